@@ -1,128 +1,539 @@
+/*
+ * A load generator for hlld. Each connection runs on its own
+ * thread, and keeps up to a pipeline depth of commands in flight.
+ *
+ * In the closed loop mode, a command is sent as soon as another
+ * completes, and its latency starts when it is sent. Given a rate,
+ * each connection sends on a fixed schedule instead, and latency
+ * starts when the command was due rather than when it was sent.
+ * Time spent queued behind a slow response is then counted, and
+ * a stall is not hidden by the generator slowing down with the
+ * server, which is coordinated omission.
+ *
+ * Sets and keys are picked with a Zipfian popularity, or uniformly
+ * with a theta of 0. Latencies go into the log-linear histograms
+ * of the server metrics, so percentiles are within 12.5%.
+ *
+ * Usage: bench [-h host] [-p port | -u path] [-c conns] [-d depth]
+ *          [-n cmds | -t secs] [-r rate] [-s sets] [-k keys]
+ *          [-z theta] [-b batch] [-m set=70,bulk=20,multi=5,size=5]
+ *          [-j] [-K]
+ */
 #include <arpa/inet.h>
-#include <fcntl.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
+#include <sys/select.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include "barrier.h"
+#include "metrics.h"
 
-static int NUM_THREADS = 1;
-static int NUM_KEYS = 1000000;
-static char* HOST = "127.0.0.1";
-static int PORT = 4553;
-static char *SET_NAME = "foobar%d";
+/**
+ * The commands that may be mixed
+ */
+typedef enum {
+    CMD_SET = 0,    // A single key in a set
+    CMD_BULK,       // A batch of keys in a set
+    CMD_MULTI,      // A batch of keys in two sets
+    CMD_SIZE,       // The size of the union of two sets
+    NUM_BENCH_CMDS
+} bench_cmd;
+
+static const char *CMD_NAMES[] = {"set", "bulk", "multi", "size"};
+
+/**
+ * Draws the ranks of a Zipfian distribution in constant time, as
+ * done by Gray et al. in "Quickly Generating Billion-Record
+ * Synthetic Databases". Ranks are uniform if theta is 0.
+ */
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    double half_pow;
+} zipf_gen;
+
+typedef struct {
+    char *host;
+    int port;
+    int conns;
+    int depth;
+    uint64_t cmds;          // Per connection, in the closed loop
+    double secs;            // How long to run, or 0 to send cmds
+    double rate;            // Commands per second in total, or 0
+    int sets;
+    uint64_t keys;
+    double theta;
+    int batch;              // Keys per bulk or multi
+    int weights[NUM_BENCH_CMDS];
+    int json;
+    int keep_sets;
+    char *unix_path;        // Connect to this unix socket, rather than TCP
+} bench_opts;
 
 typedef struct {
-    int conn_fd;
-    char set_name[32];
-    char cmd_buf[128];
-} conn_info;
+    int id;
+    int fd;
+    uint64_t rng;
+    worker_metrics *metrics;
+    uint64_t sent;
+    uint64_t errors;
+} bench_conn;
+
+static bench_opts OPTS = {
+    "127.0.0.1", 4553, 4, 16, 100000, 0, 0, 16, 1000000, 0.99, 32,
+    {70, 20, 5, 5}, 0, 0, NULL
+};
+static zipf_gen SET_GEN, KEY_GEN;
+static barrier_t START_BARRIER;
+static uint64_t START_TIME;
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i=0; i < n; i++) sum += 1 / pow(i + 1, theta);
+    return sum;
+}
+
+static void init_zipf(zipf_gen *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    if (!theta) return;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+    z->half_pow = 1 + pow(0.5, theta);
+}
+
+// Returns a uniform double in [0, 1), from xorshift64*
+static double next_uniform(uint64_t *rng) {
+    uint64_t x = *rng;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    *rng = x;
+    return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+// Returns a rank, with 0 the most popular
+static uint64_t next_zipf(zipf_gen *z, uint64_t *rng) {
+    double u = next_uniform(rng);
+    if (!z->theta) return u * z->n;
+    double uz = u * z->zetan;
+    if (uz < 1) return 0;
+    if (uz < z->half_pow) return 1;
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return (rank < z->n) ? rank : z->n - 1;
+}
+
+static int connect_unix_server(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(OPTS.unix_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Bad unix socket: %s\n", OPTS.unix_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, OPTS.unix_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        perror("Failed to connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-int connect_fd(conn_info *info) {
+static int connect_server(void) {
+    if (OPTS.unix_path) return connect_unix_server();
     struct sockaddr_in addr;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = PF_INET;
-    addr.sin_port = htons(PORT);
-    inet_pton(PF_INET, HOST, &addr.sin_addr);
-
-    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
-    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
-}
-
-int timediff(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
-}
-
-void *thread_main(void *in) {
-    printf("Thread started.");
-    conn_info info;
-    int sets = 0;
-
-    // Generate a set name
-    char *buf = (char*)&info.set_name;
-    sprintf(buf, SET_NAME, rand());
-    printf("Using set: %s\n", buf);
-
-    struct timeval start_connect, start_create, start_set, start_check, end;
-    char out_buf[16];
-    int num, sent, len;
-
-    // Connect
-    gettimeofday(&start_connect, NULL);
-    int res = connect_fd(&info);
-    if (res) {
-        printf("Failed to connect!");
-        return NULL;
-    }
-    gettimeofday(&end, NULL);
-    printf("Connect: %d msec\n", timediff(&start_connect, &end));
-
-    // Make set
-    gettimeofday(&start_create, NULL);
-
-    len = sprintf((char*)&info.cmd_buf, "create %s\n", buf);
-    send(info.conn_fd, info.cmd_buf, len, 0);
-    num = recv(info.conn_fd, (char*)&out_buf, 5, 0);
-    if (strcmp(out_buf, "Done\n") != 0) {
-        printf("Failed to create set!");
-        return NULL;
-   }
-
-    gettimeofday(&end, NULL);
-    printf("Create: %d msec\n", timediff(&start_create, &end));
-
-    // Set
-    gettimeofday(&start_set, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "set %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send!");
-            return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(OPTS.port);
+    if (inet_pton(AF_INET, OPTS.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad host: %s\n", OPTS.host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        perror("Failed to connect");
+        close(fd);
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+static int send_all(int fd, char *buf, int len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, 0);
+        if (sent <= 0) return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Sends a command and reads a single line reply, for the setup
+ * @return 0 if the reply starts with one of the wanted replies
+ */
+static int send_control(int fd, char *cmd, const char *ok, const char *ok_too) {
+    char reply[128];
+    while (1) {
+        int len = 0;
+        if (send_all(fd, cmd, strlen(cmd))) return -1;
+        while (len < (int)sizeof(reply) - 1) {
+            ssize_t n = recv(fd, reply + len, 1, 0);
+            if (n <= 0) return -1;
+            if (reply[len++] == '\n') break;
         }
+        reply[len] = '\0';
+        if (!strncmp(reply, ok, strlen(ok))) return 0;
+        if (ok_too && !strncmp(reply, ok_too, strlen(ok_too))) return 0;
+
+        // The sets of the last run may still be deleting
+        if (strncmp(reply, "Delete in progress", 18)) break;
+        sleep(1);
     }
+    fprintf(stderr, "Unexpected reply to %s%s", cmd, reply);
+    return -1;
+}
+
+// Writes the next command to a buffer, returning its length
+static int format_cmd(bench_conn *c, bench_cmd cmd, char *buf) {
+    uint64_t set = next_zipf(&SET_GEN, &c->rng);
+    uint64_t other = next_zipf(&SET_GEN, &c->rng);
+    int len = 0;
+    int keys = OPTS.batch;
+    switch (cmd) {
+        case CMD_SET:
+            len = sprintf(buf, "s bench%llu", (unsigned long long)set);
+            keys = 1;
+            break;
+        case CMD_BULK:
+            len = sprintf(buf, "b bench%llu", (unsigned long long)set);
+            break;
+        case CMD_MULTI:
+            len = sprintf(buf, "multi bench%llu,bench%llu",
+                    (unsigned long long)set, (unsigned long long)other);
+            break;
+        case CMD_SIZE:
+            len = sprintf(buf, "size_union bench%llu bench%llu",
+                    (unsigned long long)set, (unsigned long long)other);
+            keys = 0;
+            break;
+        default:
+            break;
+    }
+    for (int i=0; i < keys; i++)
+        len += sprintf(buf + len, " key%llu",
+                (unsigned long long)next_zipf(&KEY_GEN, &c->rng));
+    buf[len++] = '\n';
+    return len;
+}
+
+static bench_cmd pick_cmd(bench_conn *c) {
+    int total = 0;
+    for (int i=0; i < NUM_BENCH_CMDS; i++) total += OPTS.weights[i];
+    int pick = next_uniform(&c->rng) * total;
+    for (int i=0; i < NUM_BENCH_CMDS; i++) {
+        if (pick < OPTS.weights[i]) return i;
+        pick -= OPTS.weights[i];
+    }
+    return CMD_SET;
+}
+
+static void* conn_main(void *in) {
+    bench_conn *c = in;
+    int depth = OPTS.depth;
+    uint64_t *starts = malloc(depth * sizeof(uint64_t));
+    bench_cmd *types = malloc(depth * sizeof(bench_cmd));
+    int cmd_size = OPTS.batch * 32 + 256;
+    char *out = malloc(depth * cmd_size);
+    int in_size = 65536;
+    char *inbuf = malloc(in_size);
+    int head = 0, inflight = 0, in_len = 0, in_block = 0;
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        int remain = 5;
-        while (remain) {
-            num = recv(info.conn_fd, (char*)out_buf, remain, 0);
-            if (num == -1) {
-                printf("Failed to read! Iter: %d. Res: %d\n", i, num);
-                return NULL;
+    // Connections share the rate, each on its own schedule
+    uint64_t interval = (OPTS.rate) ? 1e9 * OPTS.conns / OPTS.rate : 0;
+    barrier_wait(&START_BARRIER);
+    uint64_t due = START_TIME + (interval * c->id) / OPTS.conns;
+    uint64_t end = (OPTS.secs) ? START_TIME + OPTS.secs * 1e9 : 0;
+
+    while (1) {
+        uint64_t now = metrics_now();
+        int more = (end) ? now < end : c->sent < OPTS.cmds;
+        if (!more && !inflight) break;
+
+        // Send what is due, up to the pipeline depth
+        int out_len = 0;
+        while (more && inflight < depth && (!interval || due <= now)) {
+            int slot = (head + inflight) % depth;
+            types[slot] = pick_cmd(c);
+            starts[slot] = (interval) ? due : now;
+            out_len += format_cmd(c, types[slot], out + out_len);
+            inflight++;
+            c->sent++;
+            due += interval;
+            if (!end && c->sent == OPTS.cmds) more = 0;
+        }
+        if (out_len && send_all(c->fd, out, out_len)) {
+            fprintf(stderr, "Failed to send on connection %d\n", c->id);
+            break;
+        }
+
+        // Wait for replies, or until the next command is due
+        struct timeval wait, *timeout = NULL;
+        if (more && interval && inflight < depth) {
+            uint64_t usec = (due > now) ? (due - now) / 1000 : 0;
+            wait.tv_sec = usec / 1000000;
+            wait.tv_usec = usec % 1000000;
+            timeout = &wait;
+        }
+        if (!inflight && !timeout) continue;
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(c->fd, &fds);
+        if (select(c->fd + 1, &fds, NULL, NULL, timeout) <= 0) continue;
+
+        ssize_t n = recv(c->fd, inbuf + in_len, in_size - in_len, 0);
+        if (n <= 0) {
+            fprintf(stderr, "Connection %d closed\n", c->id);
+            break;
+        }
+        in_len += n;
+
+        // Complete a command per line, or per START to END block
+        char *line = inbuf, *buf_end = inbuf + in_len, *term;
+        while ((term = memchr(line, '\n', buf_end - line))) {
+            int line_len = term - line;
+            int done = 1, ok = 1;
+            if (in_block) {
+                done = (line_len == 3 && !memcmp(line, "END", 3));
+            } else if (line_len == 5 && !memcmp(line, "START", 5)) {
+                in_block = 1;
+                done = 0;
+            } else {
+                ok = (line_len >= 4 && !memcmp(line, "Done", 4)) ||
+                    (line_len && line[0] >= '0' && line[0] <= '9');
+            }
+            if (done && inflight) {
+                // Failures of a multi are listed in a block
+                if (in_block) ok = 0;
+                in_block = 0;
+                metrics_record_cmd(c->metrics, types[head], metrics_now() - starts[head]);
+                if (!ok) c->errors++;
+                head = (head + 1) % depth;
+                inflight--;
             }
-            remain -= num;
+            line = term + 1;
         }
-        sets++;
+        in_len = buf_end - line;
+        memmove(inbuf, line, in_len);
     }
-    gettimeofday(&end, NULL);
-    printf("Set: %d msec. Num: %d\n", timediff(&start_set, &end), sets);
-
-    sprintf((char*)&info.cmd_buf, "drop %s\n", buf);
-    sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
 
+    free(starts);
+    free(types);
+    free(out);
+    free(inbuf);
     return NULL;
 }
 
+// Adds the buckets of a histogram to another
+static void sum_histogram(latency_histogram *into, latency_histogram *h) {
+    into->count += h->count;
+    into->sum += h->sum;
+    for (int b=0; b < LATENCY_BUCKETS; b++) into->buckets[b] += h->buckets[b];
+}
+
+static void print_text(worker_metrics *m, latency_histogram *all, uint64_t errors, double secs) {
+    printf("%s loop, %d connections, depth %d, %d sets, %llu keys, theta %.2f\n",
+            (OPTS.rate) ? "Open" : "Closed", OPTS.conns, OPTS.depth, OPTS.sets,
+            (unsigned long long)OPTS.keys, OPTS.theta);
+    printf("%llu commands, %llu errors in %.3f sec, %.0f commands/sec\n",
+            (unsigned long long)all->count, (unsigned long long)errors, secs,
+            all->count / secs);
+    printf("%-8s %10s %10s %10s %10s %10s %10s (usec)\n",
+            "command", "count", "mean", "p50", "p99", "p99.9", "max");
+    for (int i=0; i <= NUM_BENCH_CMDS; i++) {
+        latency_histogram *h = (i < NUM_BENCH_CMDS) ? m->cmds + i : all;
+        if (!h->count) continue;
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                (i < NUM_BENCH_CMDS) ? CMD_NAMES[i] : "all",
+                (unsigned long long)h->count,
+                (double)h->sum / h->count / 1000,
+                metrics_percentile(h, 0.5) / 1000.0,
+                metrics_percentile(h, 0.99) / 1000.0,
+                metrics_percentile(h, 0.999) / 1000.0,
+                metrics_percentile(h, 1) / 1000.0);
+    }
+}
+
+static void print_json_latency(const char *name, latency_histogram *h) {
+    printf("\"%s\": {\"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+            "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+            name, (unsigned long long)h->count,
+            (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)metrics_percentile(h, 0.5),
+            (unsigned long long)metrics_percentile(h, 0.9),
+            (unsigned long long)metrics_percentile(h, 0.99),
+            (unsigned long long)metrics_percentile(h, 0.999),
+            (unsigned long long)metrics_percentile(h, 1));
+}
+
+static void print_json(worker_metrics *m, latency_histogram *all, uint64_t errors, double secs) {
+    printf("{\"mode\": \"%s\", \"connections\": %d, \"depth\": %d, \"rate\": %.0f, "
+            "\"sets\": %d, \"keys\": %llu, \"theta\": %.3f, \"batch\": %d, ",
+            (OPTS.rate) ? "open" : "closed", OPTS.conns, OPTS.depth, OPTS.rate,
+            OPTS.sets, (unsigned long long)OPTS.keys, OPTS.theta, OPTS.batch);
+    printf("\"commands\": %llu, \"errors\": %llu, \"seconds\": %.6f, "
+            "\"commands_per_sec\": %.1f, \"latency\": {",
+            (unsigned long long)all->count, (unsigned long long)errors, secs,
+            all->count / secs);
+    for (int i=0; i < NUM_BENCH_CMDS; i++) {
+        if (!m->cmds[i].count) continue;
+        print_json_latency(CMD_NAMES[i], m->cmds + i);
+        printf(", ");
+    }
+    print_json_latency("all", all);
+    printf("}}\n");
+}
+
+static int parse_mix(char *mix) {
+    memset(OPTS.weights, 0, sizeof(OPTS.weights));
+    int total = 0;
+    for (char *tok = strtok(mix, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int i = 0;
+        while (i < NUM_BENCH_CMDS && strcmp(tok, CMD_NAMES[i])) i++;
+        if (i == NUM_BENCH_CMDS) return -1;
+        OPTS.weights[i] = atoi(eq + 1);
+        if (OPTS.weights[i] < 0) return -1;
+        total += OPTS.weights[i];
+    }
+    return (total > 0) ? 0 : -1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bench [-h host] [-p port | -u path] [-c conns] [-d depth]\n\
+        [-n cmds | -t secs] [-r rate] [-s sets] [-k keys] [-z theta]\n\
+        [-b batch] [-m set=70,bulk=20,multi=5,size=5] [-j] [-K]\n\
+\n\
+  -u path   Connect to the unix socket of the server, rather than TCP\n\
+  -n cmds   Commands per connection, default 100000\n\
+  -t secs   Run for a time instead\n\
+  -r rate   Send this many commands per second in total, on a fixed\n\
+            schedule, and time them from when they were due\n\
+  -z theta  Zipfian skew of the sets and keys, from 0 for uniform to\n\
+            below 1, default 0.99\n\
+  -j        Print a JSON summary\n\
+  -K        Keep the sets, rather than dropping them\n");
+}
+
 int main(int argc, char **argv) {
-    // Read random seed
-    int randfh = open("/dev/random", O_RDONLY);
-    unsigned seed = 0;
-    read(randfh, &seed, sizeof(seed));
-    close(randfh);
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:c:d:n:t:r:s:k:z:b:m:jK")) != -1) {
+        switch (opt) {
+            case 'h': OPTS.host = optarg; break;
+            case 'p': OPTS.port = atoi(optarg); break;
+            case 'u': OPTS.unix_path = optarg; break;
+            case 'c': OPTS.conns = atoi(optarg); break;
+            case 'd': OPTS.depth = atoi(optarg); break;
+            case 'n': OPTS.cmds = strtoull(optarg, NULL, 10); break;
+            case 't': OPTS.secs = atof(optarg); break;
+            case 'r': OPTS.rate = atof(optarg); break;
+            case 's': OPTS.sets = atoi(optarg); break;
+            case 'k': OPTS.keys = strtoull(optarg, NULL, 10); break;
+            case 'z': OPTS.theta = atof(optarg); break;
+            case 'b': OPTS.batch = atoi(optarg); break;
+            case 'm':
+                if (parse_mix(optarg)) {
+                    fprintf(stderr, "Bad command mix\n");
+                    return 1;
+                }
+                break;
+            case 'j': OPTS.json = 1; break;
+            case 'K': OPTS.keep_sets = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (OPTS.conns < 1 || OPTS.depth < 1 || OPTS.sets < 2 || OPTS.keys < 2 ||
+            OPTS.batch < 1 || OPTS.theta < 0 || OPTS.theta >= 1 ||
+            OPTS.rate < 0 || (!OPTS.secs && !OPTS.cmds)) {
+        usage();
+        return 1;
+    }
+    init_zipf(&SET_GEN, OPTS.sets, OPTS.theta);
+    init_zipf(&KEY_GEN, OPTS.keys, OPTS.theta);
 
-    srand(seed);
-    pthread_t t[NUM_THREADS];
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_create(&t[i], NULL, thread_main, NULL);
+    // Create the sets
+    int control = connect_server();
+    if (control == -1) return 1;
+    char cmd[64];
+    for (int i=0; i < OPTS.sets; i++) {
+        sprintf(cmd, "create bench%d\n", i);
+        if (send_control(control, cmd, "Done", "Exists")) return 1;
     }
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_join(t[i], NULL);
+
+    hlld_metrics *metrics;
+    init_metrics(OPTS.conns, &metrics);
+    bench_conn *conns = calloc(OPTS.conns, sizeof(bench_conn));
+    pthread_t *threads = calloc(OPTS.conns, sizeof(pthread_t));
+    barrier_init(&START_BARRIER, OPTS.conns + 1);
+    for (int i=0; i < OPTS.conns; i++) {
+        conns[i].id = i;
+        conns[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        conns[i].metrics = metrics_worker(metrics, i);
+        if ((conns[i].fd = connect_server()) == -1) return 1;
+        pthread_create(&threads[i], NULL, conn_main, conns + i);
     }
-    return 0;
+
+    START_TIME = metrics_now();
+    barrier_wait(&START_BARRIER);
+    uint64_t errors = 0;
+    for (int i=0; i < OPTS.conns; i++) {
+        pthread_join(threads[i], NULL);
+        close(conns[i].fd);
+        errors += conns[i].errors;
+    }
+    double secs = (metrics_now() - START_TIME) / 1e9;
+
+    worker_metrics *m = malloc(sizeof(worker_metrics));
+    latency_histogram *all = calloc(1, sizeof(latency_histogram));
+    metrics_snapshot(metrics, m);
+    for (int i=0; i < NUM_BENCH_CMDS; i++) sum_histogram(all, m->cmds + i);
+    if (OPTS.json)
+        print_json(m, all, errors, secs);
+    else
+        print_text(m, all, errors, secs);
+
+    if (!OPTS.keep_sets) {
+        for (int i=0; i < OPTS.sets; i++) {
+            sprintf(cmd, "drop bench%d\n", i);
+            send_control(control, cmd, "Done", NULL);
+        }
+    }
+    close(control);
+    int res = (all->count && !errors) ? 0 : 1;
+    free(m);
+    free(all);
+    free(conns);
+    free(threads);
+    destroy_metrics(metrics);
+    return res;
 }
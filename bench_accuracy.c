@@ -0,0 +1,376 @@
+/*
+ * Evaluates the accuracy and the speed of each HLL mode side by
+ * side, so that a faster mode cannot quietly lose accuracy. Three
+ * streams are added to every mode, at a range of precisions:
+ *
+ *  - words: the keys of tests/words.txt, all distinct
+ *  - uniform: distinct synthetic keys
+ *  - zipf: new keys, each followed by repeats of earlier keys
+ *          picked with a Zipfian skew towards the first ones
+ *
+ * Both estimators are taken at every power of ten of distinct keys,
+ * and the relative errors of the trials are summarized as their mean,
+ * root mean square and largest magnitude. Each trial salts its keys,
+ * so the trials hash differently but the runs are repeatable. The
+ * rate is of the keys hashed and added, on top of making the keys.
+ *
+ * The output of a run with the default arguments is checked in as
+ * tests/accuracy_baseline.txt. Given a baseline, which must have been
+ * made with the same trials and cardinality, a run compares its
+ * errors with it and fails if any root mean square error grew.
+ *
+ * Usage: bench_accuracy [trials] [max cardinality] [baseline]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hll.h"
+#include "hll_hash.h"
+
+static int NUM_TRIALS = 8;
+static uint64_t MAX_CARDINALITY = 1000000;
+static char *BASELINE = NULL;
+
+// Keys are hashed and added in batches
+#define BATCH_KEYS 1024
+#define MAX_KEY_LEN 64
+
+// The zipf stream has this share of new keys, and picks
+// the repeats with this skew
+#define ZIPF_NEW_PCT 25
+#define ZIPF_SKEW 1.2
+
+// Errors may grow by this much before a check fails
+#define RMS_SLACK_PCT 5
+#define RMS_SLACK 0.0005
+
+#define MAX_CHECKPOINTS 16
+#define MAX_RESULTS 4096
+
+enum {
+    STREAM_WORDS = 0,
+    STREAM_UNIFORM,
+    STREAM_ZIPF,
+    NUM_STREAMS
+};
+static const char *STREAM_NAMES[] = {"words", "uniform", "zipf"};
+
+static const int PRECISIONS[] = {12, 14, 20};
+#define NUM_PRECISIONS (int)(sizeof(PRECISIONS) / sizeof(int))
+
+/*
+ * A mode of the HLL, as a set could be created with
+ */
+typedef struct {
+    hll_format format;
+    int sparse;
+    hll_hash hash;
+} hll_mode;
+
+static const hll_mode MODES[] = {
+    {HLL_PACKED, 0, HLL_HASH_MURMUR},
+    {HLL_BYTE, 0, HLL_HASH_MURMUR},
+    {HLL_PACKED, 1, HLL_HASH_MURMUR},
+    {HLL_BYTE, 1, HLL_HASH_MURMUR},
+    {HLL_PACKED, 0, HLL_HASH_WYHASH},
+    {HLL_BYTE, 0, HLL_HASH_WYHASH},
+    {HLL_PACKED, 1, HLL_HASH_WYHASH},
+    {HLL_BYTE, 1, HLL_HASH_WYHASH},
+};
+#define NUM_MODES (int)(sizeof(MODES) / sizeof(hll_mode))
+
+static const hll_estimator ESTIMATORS[] = {HLL_ESTIMATOR_BIAS, HLL_ESTIMATOR_ERTL};
+#define NUM_ESTIMATORS 2
+
+/*
+ * The keys of a stream in a trial
+ */
+typedef struct {
+    int type;
+    int trial;
+    uint64_t distinct;  // Distinct keys so far
+    uint64_t drawn;     // Keys so far, with repeats
+    uint64_t rand;
+} stream;
+
+/*
+ * A line of results, keyed by its name
+ */
+typedef struct {
+    char name[96];
+    double mean;
+    double rms;
+    double max;
+    double rate;    // Keys per second, for the rate lines
+} result;
+
+static char **WORDS = NULL;
+static uint64_t NUM_WORDS = 0;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int load_words(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[MAX_KEY_LEN];
+    uint64_t size = 1 << 18;
+    WORDS = malloc(size * sizeof(char*));
+    while (fgets(buf, sizeof(buf), f)) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (NUM_WORDS == size) {
+            size *= 2;
+            WORDS = realloc(WORDS, size * sizeof(char*));
+        }
+        WORDS[NUM_WORDS++] = strdup(buf);
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Fills a batch with the next keys of a stream, stopping
+ * once it has the given number of distinct keys
+ * @return The number of keys
+ */
+static int next_keys(stream *s, char keys[][MAX_KEY_LEN], int *lens, uint64_t limit) {
+    int num = 0;
+    while (num < BATCH_KEYS && s->distinct < limit) {
+        char *key = keys[num];
+        switch (s->type) {
+            case STREAM_WORDS:
+                lens[num] = snprintf(key, MAX_KEY_LEN, "%d:%s", s->trial, WORDS[s->distinct++]);
+                break;
+            case STREAM_UNIFORM:
+                lens[num] = snprintf(key, MAX_KEY_LEN, "%d:u%llu", s->trial,
+                        (unsigned long long)s->distinct++);
+                break;
+            case STREAM_ZIPF: {
+                // Inverts the continuous power law over the keys so far
+                uint64_t id = s->distinct;
+                if (s->distinct && (int)(next_rand(&s->rand) % 100) >= ZIPF_NEW_PCT) {
+                    double u = (next_rand(&s->rand) >> 11) * (1.0 / 9007199254740992.0);
+                    double top = pow((double)s->distinct, 1 - ZIPF_SKEW);
+                    id = (uint64_t)pow(1 - u * (1 - top), 1 / (1 - ZIPF_SKEW)) - 1;
+                    if (id >= s->distinct) id = s->distinct - 1;
+                } else
+                    s->distinct++;
+                lens[num] = snprintf(key, MAX_KEY_LEN, "%d:z%llu", s->trial, (unsigned long long)id);
+                break;
+            }
+        }
+        num++;
+    }
+    s->drawn += num;
+    return num;
+}
+
+/**
+ * The distinct keys at which the estimates are taken
+ * @return The number of checkpoints
+ */
+static int checkpoints(int type, uint64_t *points) {
+    uint64_t max = (type == STREAM_WORDS && NUM_WORDS < MAX_CARDINALITY) ? NUM_WORDS : MAX_CARDINALITY;
+    int num = 0;
+    for (uint64_t c=10; c < max && num < MAX_CHECKPOINTS - 1; c *= 10) points[num++] = c;
+    points[num++] = max;
+    return num;
+}
+
+static void mode_name(int precision, const hll_mode *m, char *buf, int len) {
+    snprintf(buf, len, "p=%d %s %s %s", precision, hll_format_name(m->format),
+            (m->sparse) ? "sparse" : "dense", hll_hash_name(m->hash));
+}
+
+/**
+ * Adds a stream to a mode over the trials, gathering the
+ * relative errors at each checkpoint
+ * @return 0 on success
+ */
+static int run_stream(int precision, const hll_mode *m, int type,
+        result *results, int *num_results) {
+    uint64_t points[MAX_CHECKPOINTS];
+    int num_points = checkpoints(type, points);
+    double sum[MAX_CHECKPOINTS][NUM_ESTIMATORS] = {{0}};
+    double squares[MAX_CHECKPOINTS][NUM_ESTIMATORS] = {{0}};
+    double worst[MAX_CHECKPOINTS][NUM_ESTIMATORS] = {{0}};
+
+    static char keys[BATCH_KEYS][MAX_KEY_LEN];
+    int lens[BATCH_KEYS];
+    uint64_t hashes[BATCH_KEYS];
+    uint64_t nanos = 0, added = 0;
+
+    for (int t=0; t < NUM_TRIALS; t++) {
+        hll_t h;
+        int res = (m->sparse) ? hll_init_sparse(precision, m->format, &h) :
+            hll_init(precision, m->format, &h);
+        if (res) return -1;
+
+        stream s = {type, t, 0, 0, 0x9e3779b97f4a7c15ULL * (t + 1)};
+        for (int p=0; p < num_points; p++) {
+            int num;
+            while ((num = next_keys(&s, keys, lens, points[p]))) {
+                uint64_t start = now_nsec();
+                for (int i=0; i < num; i++) hashes[i] = hll_hash_key(m->hash, keys[i], lens[i]);
+                hll_add_hashes(&h, hashes, num);
+
+                // Sparse registers turn dense as sets do
+                if (hll_is_sparse(&h) && hll_sparse_should_convert(&h) && hll_convert_dense(&h, NULL)) {
+                    hll_destroy(&h);
+                    return -1;
+                }
+                nanos += now_nsec() - start;
+                added += num;
+            }
+
+            for (int e=0; e < NUM_ESTIMATORS; e++) {
+                double err = (hll_estimate(&h, ESTIMATORS[e]) - points[p]) / points[p];
+                sum[p][e] += err;
+                squares[p][e] += err * err;
+                if (fabs(err) > worst[p][e]) worst[p][e] = fabs(err);
+            }
+        }
+        hll_destroy(&h);
+    }
+
+    char mode[64];
+    mode_name(precision, m, mode, sizeof(mode));
+    for (int p=0; p < num_points; p++) {
+        for (int e=0; e < NUM_ESTIMATORS && *num_results < MAX_RESULTS; e++) {
+            result *r = results + (*num_results)++;
+            snprintf(r->name, sizeof(r->name), "%s %s %llu %s", mode, STREAM_NAMES[type],
+                    (unsigned long long)points[p], hll_estimator_name(ESTIMATORS[e]));
+            r->mean = sum[p][e] / NUM_TRIALS;
+            r->rms = sqrt(squares[p][e] / NUM_TRIALS);
+            r->max = worst[p][e];
+            r->rate = 0;
+            printf("acc %s mean=%+.5f rms=%.5f max=%.5f\n", r->name, r->mean, r->rms, r->max);
+        }
+    }
+    if (*num_results < MAX_RESULTS) {
+        result *r = results + (*num_results)++;
+        snprintf(r->name, sizeof(r->name), "%s %s", mode, STREAM_NAMES[type]);
+        r->rate = added * 1e9 / (nanos ? nanos : 1);
+        printf("rate %s keys/sec=%.0f\n", r->name, r->rate);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+static result* find_result(result *results, int num, const char *name) {
+    for (int i=0; i < num; i++) {
+        if (!strcmp(results[i].name, name)) return results + i;
+    }
+    return NULL;
+}
+
+/**
+ * Compares the results with a baseline. The errors must not
+ * grow past the slack, and the rates are only reported.
+ * @return The number of regressions, or -1 if the
+ * baseline cannot be used.
+ */
+static int check_baseline(const char *path, result *results, int num) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Failed to open the baseline %s!\n", path);
+        return -1;
+    }
+
+    char line[256];
+    int trials = 0, regressed = 0, checked = 0;
+    unsigned long long max = 0;
+    double slower = 0, faster = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char name[96];
+        double mean, rms, worst, rate;
+        if (sscanf(line, "# trials=%d max=%llu", &trials, &max) == 2) {
+            if (trials != NUM_TRIALS || max != MAX_CARDINALITY) {
+                printf("The baseline has %d trials up to %llu keys!\n", trials, max);
+                fclose(f);
+                return -1;
+            }
+            continue;
+        }
+
+        // The name is the words before the first field
+        char *fields = strstr(line, " mean=");
+        if (!strncmp(line, "acc ", 4) && fields &&
+                sscanf(fields, " mean=%lf rms=%lf max=%lf", &mean, &rms, &worst) == 3) {
+            snprintf(name, sizeof(name), "%.*s", (int)(fields - line - 4), line + 4);
+            result *r = find_result(results, num, name);
+            checked++;
+            if (!r) {
+                printf("MISSING %s\n", name);
+                regressed++;
+            } else if (r->rms > rms * (1 + RMS_SLACK_PCT / 100.0) + RMS_SLACK) {
+                printf("REGRESSED %s rms=%.5f baseline=%.5f\n", name, r->rms, rms);
+                regressed++;
+            }
+            continue;
+        }
+        fields = strstr(line, " keys/sec=");
+        if (!strncmp(line, "rate ", 5) && fields && sscanf(fields, " keys/sec=%lf", &rate) == 1) {
+            snprintf(name, sizeof(name), "%.*s", (int)(fields - line - 5), line + 5);
+            result *r = find_result(results, num, name);
+            if (!r || rate <= 0) continue;
+            double ratio = r->rate / rate;
+            printf("rate %s keys/sec=%.0f baseline=%.0f ratio=%.2f\n", name, r->rate, rate, ratio);
+            if (ratio < 1 && (!slower || ratio < slower)) slower = ratio;
+            if (ratio > faster) faster = ratio;
+        }
+    }
+    fclose(f);
+    if (!trials) {
+        printf("The baseline has no trials line!\n");
+        return -1;
+    }
+    printf("Checked %d errors against %s. Regressed: %d. Rate ratios: %.2f to %.2f\n",
+            checked, path, regressed, (slower) ? slower : 1, faster);
+    return regressed;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_TRIALS = atoi(argv[1]);
+    if (argc > 2) MAX_CARDINALITY = strtoull(argv[2], NULL, 10);
+    if (argc > 3) BASELINE = argv[3];
+    if (NUM_TRIALS < 1 || MAX_CARDINALITY < 10) {
+        printf("Need a trial and at least 10 keys!\n");
+        return 1;
+    }
+    if (load_words("tests/words.txt")) {
+        printf("Failed to read tests/words.txt!\n");
+        return 1;
+    }
+
+    printf("# bench_accuracy: relative errors of the estimates, and keys per second\n");
+    printf("# trials=%d max=%llu\n", NUM_TRIALS, (unsigned long long)MAX_CARDINALITY);
+    result *results = calloc(MAX_RESULTS, sizeof(result));
+    int num_results = 0;
+    for (int p=0; p < NUM_PRECISIONS; p++) {
+        for (int m=0; m < NUM_MODES; m++) {
+            for (int s=0; s < NUM_STREAMS; s++) {
+                if (run_stream(PRECISIONS[p], MODES + m, s, results, &num_results)) {
+                    printf("Failed to create HLL!\n");
+                    return 1;
+                }
+            }
+        }
+    }
+
+    int res = (BASELINE) ? check_baseline(BASELINE, results, num_results) : 0;
+    free(results);
+    return (res) ? 1 : 0;
+}
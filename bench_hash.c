@@ -0,0 +1,48 @@
+/*
+ * Measures the keys per second of each hash function
+ * over keys similar to the ones clients send.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "hll_hash.h"
+
+static int NUM_KEYS = 10000000;
+
+static int timediff(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_KEYS = atoi(argv[1]);
+
+    // Pre-generate the keys so only the hashing is timed
+    int num_keys = 4096;
+    char keys[4096][32];
+    int lens[4096];
+    for (int i=0; i < num_keys; i++) {
+        lens[i] = snprintf(keys[i], 32, "user:%d", i * 7919);
+    }
+
+    hll_hash hashes[] = {HLL_HASH_MURMUR, HLL_HASH_WYHASH};
+    for (int h=0; h < 2; h++) {
+        struct timeval start, end;
+        uint64_t sum = 0;
+        gettimeofday(&start, NULL);
+        for (int i=0; i < NUM_KEYS; i++) {
+            int k = i & (num_keys - 1);
+            sum += hll_hash_key(hashes[h], keys[k], lens[k]);
+        }
+        gettimeofday(&end, NULL);
+
+        int msec = timediff(&start, &end);
+        printf("Hash: %s. Time: %d msec. Keys/sec: %.0f. Checksum: %llx\n",
+                hll_hash_name(hashes[h]), msec,
+                (double)NUM_KEYS * 1000 / (msec ? msec : 1),
+                (unsigned long long)sum);
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Measures the hashes per second added to a dense HLL,
+ * one at a time and in batches, for each register format
+ * and a range of precisions. Estimates are timed as well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "hll.h"
+
+static int NUM_HASHES = 20000000;
+static int BATCH_SIZE = 64;
+
+static int timediff(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
+static double per_sec(int num, int msec) {
+    return (double)num * 1000 / (msec ? msec : 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_HASHES = atoi(argv[1]);
+
+    // Pre-generate the hashes so only the adds are timed
+    int num_hashes = 1 << 16;
+    uint64_t *hashes = malloc(num_hashes * sizeof(uint64_t));
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < num_hashes; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hashes[i] = x;
+    }
+
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    int precisions[] = {8, 12, 14, 18, 22};
+    for (int f=0; f < 2; f++) {
+        for (int p=0; p < 5; p++) {
+            hll_t h;
+            if (hll_init(precisions[p], formats[f], &h)) {
+                printf("Failed to create HLL!\n");
+                return 1;
+            }
+
+            struct timeval start, end;
+            gettimeofday(&start, NULL);
+            for (int i=0; i < NUM_HASHES; i++) {
+                hll_add_hash(&h, hashes[i & (num_hashes - 1)] + i);
+            }
+            gettimeofday(&end, NULL);
+            int single = timediff(&start, &end);
+
+            gettimeofday(&start, NULL);
+            for (int i=0; i < NUM_HASHES; i += BATCH_SIZE) {
+                hll_add_hashes(&h, hashes + (i & (num_hashes - 1)), BATCH_SIZE);
+            }
+            gettimeofday(&end, NULL);
+            int batch = timediff(&start, &end);
+
+            double sum = 0;
+            int num_sizes = (precisions[p] > HLL_MAX_BIAS_PRECISION) ? 100 : 1000000;
+            gettimeofday(&start, NULL);
+            for (int i=0; i < num_sizes; i++) sum += hll_size(&h);
+            gettimeofday(&end, NULL);
+            int sizes = timediff(&start, &end);
+
+            printf("Format: %s. Precision: %d. Adds/sec: %.0f. Batched adds/sec: %.0f. Sizes/sec: %.0f. Checksum: %.0f\n",
+                    hll_format_name(formats[f]), precisions[p],
+                    per_sec(NUM_HASHES, single), per_sec(NUM_HASHES, batch),
+                    per_sec(num_sizes, sizes), sum / num_sizes);
+            hll_destroy(&h);
+        }
+    }
+    free(hashes);
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Microbenchmarks of the kernels on the hot paths, reported
+ * in nanoseconds per operation. Each benchmark is warmed up
+ * and calibrated until a run takes RUN_MSEC, then run RUNS
+ * times, and the median and fastest runs are printed.
+ *
+ * The networking layer is included here, as the test runner
+ * includes the tests, so that the static circular buffer can
+ * be timed. It is linked with all other objects.
+ *
+ * Usage: bench_micro [name prefix]
+ */
+#include "src/networking.c"
+#include "art.h"
+#include "bitmap.h"
+#include "hll.h"
+#include "hll_hash.h"
+
+#define RUN_MSEC 100
+#define RUNS 5
+#define NUM_HASHES (1 << 16)
+#define NUM_NAMES 100000
+
+typedef void (*bench_fn)(void *data, uint64_t iters);
+
+static const char *FILTER = NULL;
+static volatile uint64_t SINK;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Times a benchmark, which runs a number of operations
+ * @arg name The name, matched against the filter
+ * @arg fn The benchmark
+ * @arg data Passed to the benchmark
+ */
+static void run_bench(const char *name, bench_fn fn, void *data) {
+    if (FILTER && strncmp(name, FILTER, strlen(FILTER))) return;
+
+    // Warm up until a run is long enough to time
+    uint64_t iters = 1, nanos = 0;
+    while (1) {
+        uint64_t start = metrics_now();
+        fn(data, iters);
+        nanos = metrics_now() - start;
+        if (nanos >= RUN_MSEC * 1000000ULL / 4) break;
+        iters *= 2;
+    }
+    iters = iters * (RUN_MSEC * 1000000ULL) / nanos + 1;
+
+    double per_op[RUNS];
+    for (int i=0; i < RUNS; i++) {
+        uint64_t start = metrics_now();
+        fn(data, iters);
+        per_op[i] = (double)(metrics_now() - start) / iters;
+    }
+    qsort(per_op, RUNS, sizeof(double), compare_doubles);
+    printf("%-36s %12.2f ns/op  (min %.2f, %llu ops)\n", name,
+            per_op[RUNS / 2], per_op[0], (unsigned long long)iters);
+}
+
+static uint64_t* random_hashes(void) {
+    uint64_t *hashes = malloc(NUM_HASHES * sizeof(uint64_t));
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < NUM_HASHES; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hashes[i] = x;
+    }
+    return hashes;
+}
+
+/*
+ * HLL adds and estimates
+ */
+typedef struct {
+    hll_t h;
+    uint64_t *hashes;
+} hll_bench;
+
+static void bench_hll_add_hash(void *data, uint64_t iters) {
+    hll_bench *b = data;
+    for (uint64_t i=0; i < iters; i++)
+        hll_add_hash(&b->h, b->hashes[i & (NUM_HASHES - 1)]);
+}
+
+static void bench_hll_size(void *data, uint64_t iters) {
+    hll_bench *b = data;
+    double sum = 0;
+    for (uint64_t i=0; i < iters; i++) sum += hll_size(&b->h);
+    SINK += sum;
+}
+
+static void run_hll_benches(void) {
+    char name[64];
+    hll_bench b;
+    b.hashes = random_hashes();
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        for (int p=HLL_MIN_PRECISION; p <= HLL_MAX_PRECISION; p++) {
+            if (hll_init(p, formats[f], &b.h)) continue;
+            snprintf(name, sizeof(name), "hll_add_hash/%s/p%d", hll_format_name(formats[f]), p);
+            run_bench(name, bench_hll_add_hash, &b);
+
+            // Estimate once the registers are well filled
+            snprintf(name, sizeof(name), "hll_size/%s/p%d", hll_format_name(formats[f]), p);
+            run_bench(name, bench_hll_size, &b);
+            hll_destroy(&b.h);
+        }
+    }
+    free(b.hashes);
+}
+
+/*
+ * ART inserts and searches of set names
+ */
+typedef struct {
+    art_tree t;
+    char **names;
+    int *lens;
+} art_bench;
+
+// Includes tearing down each tree once all the names are in
+static void bench_art_insert(void *data, uint64_t iters) {
+    art_bench *b = data;
+    art_tree t;
+    init_art_tree(&t);
+    for (uint64_t i=0; i < iters; i++) {
+        int n = i % NUM_NAMES;
+        if (!n && i) {
+            destroy_art_tree(&t);
+            init_art_tree(&t);
+        }
+        art_insert(&t, (unsigned char*)b->names[n], b->lens[n], b);
+    }
+    destroy_art_tree(&t);
+}
+
+static void bench_art_search(void *data, uint64_t iters) {
+    art_bench *b = data;
+    uint64_t found = 0;
+    for (uint64_t i=0; i < iters; i++) {
+        // Visit the names in a scattered order
+        int n = (i * 7919) % NUM_NAMES;
+        found += art_search(&b->t, (unsigned char*)b->names[n], b->lens[n]) != NULL;
+    }
+    SINK += found;
+}
+
+static void bench_art_search_miss(void *data, uint64_t iters) {
+    art_bench *b = data;
+    uint64_t found = 0;
+    for (uint64_t i=0; i < iters; i++) {
+        // The names without their last byte are not in the tree
+        int n = (i * 7919) % NUM_NAMES;
+        found += art_search(&b->t, (unsigned char*)b->names[n], b->lens[n] - 1) != NULL;
+    }
+    SINK += found;
+}
+
+static void run_art_bench_names(const char *kind, art_bench *b) {
+    char name[64];
+    snprintf(name, sizeof(name), "art_insert/%s", kind);
+    run_bench(name, bench_art_insert, b);
+    init_art_tree(&b->t);
+    for (int i=0; i < NUM_NAMES; i++)
+        art_insert(&b->t, (unsigned char*)b->names[i], b->lens[i], b);
+    snprintf(name, sizeof(name), "art_search/%s", kind);
+    run_bench(name, bench_art_search, b);
+    snprintf(name, sizeof(name), "art_search/%s_miss", kind);
+    run_bench(name, bench_art_search_miss, b);
+    destroy_art_tree(&b->t);
+    for (int i=0; i < NUM_NAMES; i++) free(b->names[i]);
+}
+
+static void run_art_benches(void) {
+    // Names like those of sets bucketed by time and dimension
+    static const char *DIMS[] = {"country", "campaign", "device", "site"};
+    art_bench b;
+    b.names = malloc(NUM_NAMES * sizeof(char*));
+    b.lens = malloc(NUM_NAMES * sizeof(int));
+    for (int i=0; i < NUM_NAMES; i++) {
+        char buf[128];
+        b.lens[i] = snprintf(buf, sizeof(buf), "events.%s.hour%d.%s%d",
+                DIMS[i % 4], 2026101400 + (i / 4) % 24, DIMS[(i / 96) % 4], i / 96) + 1;
+        b.names[i] = strdup(buf);
+    }
+    run_art_bench_names("set_names", &b);
+
+    // Campaign sets by day share a long prefix, and branch on the
+    // digits of their ids, so most searches pass through node16s
+    for (int i=0; i < NUM_NAMES; i++) {
+        char buf[128];
+        b.lens[i] = snprintf(buf, sizeof(buf), "campaign.2026-10-%02d.%d.%s",
+                1 + i % 14, 100000 + i / 14, DIMS[(i / 7) % 4]) + 1;
+        b.names[i] = strdup(buf);
+    }
+    run_art_bench_names("campaign_names", &b);
+    free(b.names);
+    free(b.lens);
+}
+
+/*
+ * Flushes of bitmaps with a share of their pages dirty
+ */
+typedef struct {
+    hlld_bitmap map;
+    int dirty_pct;
+} flush_bench;
+
+static void bench_bitmap_flush(void *data, uint64_t iters) {
+    flush_bench *b = data;
+    uint64_t pages = b->map.size / BITMAP_PAGE_SIZE;
+    for (uint64_t i=0; i < iters; i++) {
+        // Spread the dirty pages over the bitmap
+        for (uint64_t p=0; p < pages; p++) {
+            if ((p * 100) / pages >= (uint64_t)b->dirty_pct) continue;
+            uint64_t page = (p * 37) % pages;
+            b->map.mmap[page * BITMAP_PAGE_SIZE] += 1;
+            bitmap_mark_dirty(&b->map, page * BITMAP_PAGE_SIZE);
+        }
+        bitmap_flush(&b->map);
+    }
+}
+
+static void run_flush_benches(void) {
+    char name[64];
+    char path[] = "/tmp/hlld_bench_micro.mmap";
+    int pcts[] = {0, 1, 10, 50, 100};
+
+    // The size of a dense set of precision 18 in bytes
+    uint64_t size = hll_bytes_for_precision(18, HLL_BYTE);
+    bitmap_mode modes[] = {PERSISTENT, SHARED};
+    const char *mode_names[] = {"persistent", "shared"};
+    for (int m=0; m < 2; m++) {
+        for (int i=0; i < 5; i++) {
+            flush_bench b;
+            b.dirty_pct = pcts[i];
+            if (bitmap_from_filename(path, size, 1, modes[m], &b.map)) {
+                printf("Failed to create %s!\n", path);
+                return;
+            }
+            snprintf(name, sizeof(name), "bitmap_flush/%s/%d%%_dirty", mode_names[m], pcts[i]);
+            run_bench(name, bench_bitmap_flush, &b);
+            bitmap_close(&b.map);
+            unlink(path);
+        }
+    }
+}
+
+/*
+ * Register updates spread over many large sets, which are
+ * bound by TLB misses unless the sets are on huge pages
+ */
+#define NUM_TLB_SETS 1024
+
+typedef struct {
+    hlld_bitmap maps[NUM_TLB_SETS];
+    uint64_t *hashes;
+} tlb_bench;
+
+static void bench_bitmap_random_touch(void *data, uint64_t iters) {
+    tlb_bench *b = data;
+    uint64_t size = b->maps[0].size;
+    for (uint64_t i=0; i < iters; i++) {
+        uint64_t hash = b->hashes[i & (NUM_HASHES - 1)];
+        hlld_bitmap *map = b->maps + (hash >> 54) % NUM_TLB_SETS;
+        map->mmap[(hash & 0xffffffff) % size] += 1;
+    }
+}
+
+/*
+ * Reads the anonymous memory backed by huge pages, in KB
+ */
+static uint64_t anon_huge_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static void run_tlb_benches(void) {
+    char name[64];
+    tlb_bench *b = malloc(sizeof(tlb_bench));
+    b->hashes = random_hashes();
+
+    // The size of a dense set of precision 18 in bytes
+    uint64_t size = hll_bytes_for_precision(18, HLL_PACKED);
+    bitmap_mode modes[] = {ANONYMOUS, ANONYMOUS | HUGE_PAGES};
+    const char *mode_names[] = {"small_pages", "huge_pages"};
+    for (int m=0; m < 2; m++) {
+        for (int i=0; i < NUM_TLB_SETS; i++) {
+            bitmap_from_file(-1, size, modes[m], b->maps + i);
+            memset(b->maps[i].mmap, 0, size);
+        }
+        snprintf(name, sizeof(name), "bitmap_random_touch/%s/%d_sets", mode_names[m], NUM_TLB_SETS);
+        run_bench(name, bench_bitmap_random_touch, b);
+        printf("%-36s %12llu KB on huge pages\n", "", (unsigned long long)anon_huge_kb());
+        for (int i=0; i < NUM_TLB_SETS; i++) bitmap_close(b->maps + i);
+    }
+    free(b->hashes);
+    free(b);
+}
+
+/*
+ * Circular buffer writes, and command extraction from it
+ */
+static char CMD_LINE[] = "set events.country.hour2026101412 user:1234567\n";
+
+static void bench_circbuf_write(void *data, uint64_t iters) {
+    circular_buffer *buf = data;
+    uint64_t len = sizeof(CMD_LINE) - 1;
+    for (uint64_t i=0; i < iters; i++) {
+        // Drain as the writes catch up, so the buffer never grows
+        if (circbuf_avail_buf(buf) <= len)
+            circbuf_advance_read(buf, circbuf_used_buf(buf));
+        circbuf_write(buf, CMD_LINE, len);
+    }
+}
+
+// Includes refilling the buffer each time it runs dry
+static void bench_extract_to_terminator(void *data, uint64_t iters) {
+    hlld_conn_info *conn = data;
+    uint64_t len = sizeof(CMD_LINE) - 1, total = 0;
+    char *line;
+    int line_len, should_free;
+    for (uint64_t i=0; i < iters; i++) {
+        while (extract_to_terminator(conn, '\n', &line, &line_len, &should_free)) {
+            while (circbuf_avail_buf(&conn->input) > len)
+                circbuf_write(&conn->input, CMD_LINE, len);
+        }
+        total += line_len;
+        if (should_free) free(line);
+    }
+    SINK += total;
+}
+
+static void run_circbuf_benches(void) {
+    char name[64];
+    const char *kinds[] = {"plain", "mirrored"};
+    for (int mirrored=0; mirrored < 2; mirrored++) {
+        hlld_conn_info *conn = calloc(1, sizeof(hlld_conn_info));
+        circbuf_init(&conn->input, mirrored);
+        if (mirrored && !conn->input.mirrored) {
+            circbuf_free(&conn->input);
+            free(conn);
+            continue;
+        }
+        snprintf(name, sizeof(name), "circbuf_write/%s", kinds[mirrored]);
+        run_bench(name, bench_circbuf_write, &conn->input);
+
+        conn->input.read_cursor = conn->input.write_cursor = 0;
+        snprintf(name, sizeof(name), "extract_to_terminator/%s", kinds[mirrored]);
+        run_bench(name, bench_extract_to_terminator, conn);
+        circbuf_free(&conn->input);
+        free(conn);
+    }
+}
+
+/*
+ * Hashes of keys by length
+ */
+typedef struct {
+    hll_hash hash;
+    char *keys;
+    int len;
+} hash_bench;
+
+static void bench_hash(void *data, uint64_t iters) {
+    hash_bench *b = data;
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < iters; i++)
+        sum += hll_hash_key(b->hash, b->keys + (i & 1023) * 256, b->len);
+    SINK += sum;
+}
+
+static void run_hash_benches(void) {
+    char name[64];
+    hash_bench b;
+    b.keys = malloc(1024 * 256);
+    uint64_t *hashes = random_hashes();
+    memcpy(b.keys, hashes, 1024 * 256);
+    free(hashes);
+
+    hll_hash kinds[] = {HLL_HASH_MURMUR, HLL_HASH_WYHASH};
+    int lens[] = {8, 16, 32, 64, 256};
+    for (int h=0; h < 2; h++) {
+        for (int l=0; l < 5; l++) {
+            b.hash = kinds[h];
+            b.len = lens[l];
+            snprintf(name, sizeof(name), "hash/%s/%dB", hll_hash_name(kinds[h]), lens[l]);
+            run_bench(name, bench_hash, &b);
+        }
+    }
+    free(b.keys);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) FILTER = argv[1];
+    run_hll_benches();
+    run_art_benches();
+    run_flush_benches();
+    run_tlb_benches();
+    run_circbuf_benches();
+    run_hash_benches();
+    return 0;
+}
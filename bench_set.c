@@ -0,0 +1,85 @@
+/*
+ * Measures how adds to a single set scale with the
+ * number of threads, without the networking layer.
+ * Each thread adds distinct keys in batches, the same
+ * way the bulk command does.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "config.h"
+#include "set.h"
+
+static int MAX_THREADS = 8;
+static int NUM_KEYS = 1000000;
+static int BATCH_SIZE = 32;
+
+typedef struct {
+    hlld_set *set;
+    int id;
+} thread_args;
+
+static int timediff(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
+static void *thread_main(void *in) {
+    thread_args *args = in;
+    char bufs[BATCH_SIZE][32];
+    char *keys[BATCH_SIZE];
+    for (int i=0; i < BATCH_SIZE; i++) keys[i] = bufs[i];
+
+    for (int i=0; i < NUM_KEYS; i += BATCH_SIZE) {
+        for (int j=0; j < BATCH_SIZE; j++) {
+            snprintf(bufs[j], 32, "test%d:%d", args->id, i + j);
+        }
+        hset_add_batch(args->set, keys, NULL, BATCH_SIZE);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) MAX_THREADS = atoi(argv[1]);
+    if (argc > 2) NUM_KEYS = atoi(argv[2]);
+
+    hlld_config config;
+    config_from_filename(NULL, &config);
+    config.in_memory = 1;
+    config.data_dir = "/tmp";
+
+    printf("Keys per thread: %d\n", NUM_KEYS);
+    for (int threads=1; threads <= MAX_THREADS; threads *= 2) {
+        hlld_set *set;
+        if (init_set(&config, "bench_set", 1, &set)) {
+            printf("Failed to create set!\n");
+            return 1;
+        }
+
+        pthread_t t[threads];
+        thread_args args[threads];
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        for (int i=0; i < threads; i++) {
+            args[i].set = set;
+            args[i].id = i;
+            pthread_create(&t[i], NULL, thread_main, &args[i]);
+        }
+        for (int i=0; i < threads; i++) {
+            pthread_join(t[i], NULL);
+        }
+        gettimeofday(&end, NULL);
+
+        int msec = timediff(&start, &end);
+        printf("Threads: %d. Time: %d msec. Adds/sec: %.0f. Size: %llu\n",
+                threads, msec, (double)threads * NUM_KEYS * 1000 / (msec ? msec : 1),
+                (unsigned long long)hset_size(set));
+
+        hset_delete(set);
+        destroy_set(set);
+    }
+    return 0;
+}
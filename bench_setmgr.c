@@ -0,0 +1,287 @@
+/*
+ * Measures how the set manager scales with the number of client
+ * threads, without the networking layer. Each thread checkpoints
+ * before every call, as a worker does, and adds keys to or sizes
+ * sets picked with a skew towards the hot ones. The threads also
+ * create and drop sets of their own at a given rate, so that the
+ * set map keeps changing under them.
+ *
+ * The latencies of each call are reported as percentiles, and the
+ * vacuum lag is sampled while the threads run, to see how far the
+ * versions of the set map pile up behind the clients.
+ *
+ * Usage: bench_setmgr [threads] [seconds] [num sets] [hot pct]
+ *          [churn per sec] [read pct] [data dir]
+ *
+ * The hot percent of the calls go to the hottest percent of sets,
+ * and the rest to any set. The read percent are sizes, and the
+ * rest adds of a batch of keys.
+ */
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "set_manager.h"
+
+static int NUM_THREADS = 4;
+static int SECONDS = 5;
+static int NUM_SETS = 1000;
+static int HOT_PCT = 90;
+static int CHURN_PER_SEC = 100;
+static int READ_PCT = 20;
+static char *DATA_DIR = "/tmp/hlld_bench_setmgr";
+
+// Keys added by a call
+#define BATCH_KEYS 8
+
+// Latencies are kept in buckets of 1/16th of a power of two
+#define SUB_BUCKETS 16
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+enum {
+    OP_SET = 0,
+    OP_SIZE,
+    OP_CREATE,
+    OP_DROP,
+    NUM_OPS
+};
+static const char *OP_NAMES[] = {"set_keys", "set_size", "create_set", "drop_set"};
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[NUM_BUCKETS];
+} latencies;
+
+typedef struct {
+    hlld_setmgr *mgr;
+    int id;
+    volatile int *should_run;
+    uint64_t errors;
+    latencies ops[NUM_OPS];
+} thread_args;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int bucket_of(uint64_t nanos) {
+    if (nanos < SUB_BUCKETS) return nanos;
+    int msb = 63 - __builtin_clzll(nanos);
+    int sub = (nanos >> (msb - 4)) & (SUB_BUCKETS - 1);
+    return (msb - 3) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_floor(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    int msb = bucket / SUB_BUCKETS + 3;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (msb - 4);
+}
+
+static void record(latencies *l, uint64_t nanos) {
+    l->count++;
+    l->buckets[bucket_of(nanos)]++;
+    if (nanos > l->max) l->max = nanos;
+}
+
+static uint64_t percentile(latencies *l, double pct) {
+    uint64_t rank = l->count * pct / 100, seen = 0;
+    for (int i=0; i < NUM_BUCKETS; i++) {
+        seen += l->buckets[i];
+        if (seen > rank) return bucket_floor(i);
+    }
+    return l->max;
+}
+
+static int remove_cb(const char *path, const struct stat *s, int flag, struct FTW *ftw) {
+    (void)s;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/**
+ * Picks a set, the hot percent of the time among
+ * the hottest percent of the sets
+ */
+static int pick_set(uint64_t *x) {
+    int hot = NUM_SETS / 100;
+    if (hot < 1) hot = 1;
+    if ((int)(next_rand(x) % 100) < HOT_PCT) return next_rand(x) % hot;
+    return next_rand(x) % NUM_SETS;
+}
+
+static void *thread_main(void *in) {
+    thread_args *args = in;
+    hlld_setmgr *mgr = args->mgr;
+    uint64_t x = 0x9e3779b97f4a7c15ULL * (args->id + 1);
+    char name[64], bufs[BATCH_KEYS][32];
+    char *keys[BATCH_KEYS];
+    for (int i=0; i < BATCH_KEYS; i++) keys[i] = bufs[i];
+
+    // Each thread takes its share of the churn
+    uint64_t churn_nsec = (CHURN_PER_SEC) ?
+        1000000000ULL * NUM_THREADS / CHURN_PER_SEC : 0;
+    uint64_t next_churn = now_nsec() + churn_nsec;
+    int churned = 0;
+
+    while (*args->should_run) {
+        setmgr_client_checkpoint(mgr);
+        uint64_t start = now_nsec();
+
+        // Replace the set made by the last churn
+        if (churn_nsec && start >= next_churn) {
+            snprintf(name, sizeof(name), "churn%d.%d", args->id, churned);
+            if (churned && setmgr_drop_set(mgr, name)) args->errors++;
+            uint64_t dropped = now_nsec();
+            if (churned) record(args->ops + OP_DROP, dropped - start);
+
+            snprintf(name, sizeof(name), "churn%d.%d", args->id, ++churned);
+            if (setmgr_create_set(mgr, name, NULL)) args->errors++;
+            uint64_t end = now_nsec();
+            record(args->ops + OP_CREATE, end - dropped);
+            next_churn += churn_nsec;
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "bench%d", pick_set(&x));
+        int op = ((int)(next_rand(&x) % 100) < READ_PCT) ? OP_SIZE : OP_SET;
+        int res;
+        if (op == OP_SIZE) {
+            uint64_t size;
+            res = setmgr_set_size(mgr, name, &size);
+        } else {
+            for (int i=0; i < BATCH_KEYS; i++)
+                snprintf(bufs[i], 32, "%llu", (unsigned long long)next_rand(&x));
+            res = setmgr_set_keys(mgr, name, keys, BATCH_KEYS);
+        }
+        record(args->ops + op, now_nsec() - start);
+        if (res) args->errors++;
+    }
+
+    // Leave the last churned set for the cleanup
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_THREADS = atoi(argv[1]);
+    if (argc > 2) SECONDS = atoi(argv[2]);
+    if (argc > 3) NUM_SETS = atoi(argv[3]);
+    if (argc > 4) HOT_PCT = atoi(argv[4]);
+    if (argc > 5) CHURN_PER_SEC = atoi(argv[5]);
+    if (argc > 6) READ_PCT = atoi(argv[6]);
+    if (argc > 7) DATA_DIR = argv[7];
+    if (NUM_THREADS < 1 || NUM_SETS < 1) {
+        printf("Need at least a thread and a set!\n");
+        return 1;
+    }
+
+    // Sets are in memory, so that the disk is not timed
+    hlld_config config;
+    config_from_filename(NULL, &config);
+    config.data_dir = DATA_DIR;
+    config.in_memory = 1;
+
+    nftw(DATA_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    if (mkdir(DATA_DIR, 0755)) {
+        printf("Failed to create %s!\n", DATA_DIR);
+        return 1;
+    }
+
+    hlld_setmgr *mgr;
+    if (init_set_manager(&config, 1, &mgr)) {
+        printf("Failed to start the set manager!\n");
+        return 1;
+    }
+    char name[64];
+    for (int i=0; i < NUM_SETS; i++) {
+        snprintf(name, sizeof(name), "bench%d", i);
+        if (setmgr_create_set(mgr, name, NULL)) {
+            printf("Failed to create %s!\n", name);
+            return 1;
+        }
+    }
+
+    printf("Threads: %d. Sets: %d. Hot: %d%%. Churn: %d/sec. Reads: %d%%. Keys per add: %d\n",
+            NUM_THREADS, NUM_SETS, HOT_PCT, CHURN_PER_SEC, READ_PCT, BATCH_KEYS);
+
+    // Run the threads, sampling the vacuum lag meanwhile
+    volatile int should_run = 1;
+    pthread_t *t = calloc(NUM_THREADS, sizeof(pthread_t));
+    thread_args *args = calloc(NUM_THREADS, sizeof(thread_args));
+    uint64_t start = now_nsec();
+    for (int i=0; i < NUM_THREADS; i++) {
+        args[i].mgr = mgr;
+        args[i].id = i;
+        args[i].should_run = &should_run;
+        pthread_create(&t[i], NULL, thread_main, &args[i]);
+    }
+    uint64_t lag_sum = 0, lag_max = 0, samples = 0;
+    uint64_t deadline = start + SECONDS * 1000000000ULL;
+    while (now_nsec() < deadline) {
+        usleep(10000);
+        uint64_t lag = setmgr_vacuum_lag(mgr);
+        lag_sum += lag;
+        if (lag > lag_max) lag_max = lag;
+        samples++;
+    }
+    should_run = 0;
+    for (int i=0; i < NUM_THREADS; i++) pthread_join(t[i], NULL);
+    double secs = (now_nsec() - start) / 1e9;
+
+    // Merge the latencies of the threads
+    latencies *total = calloc(NUM_OPS, sizeof(latencies));
+    uint64_t calls = 0, errors = 0;
+    for (int i=0; i < NUM_THREADS; i++) {
+        errors += args[i].errors;
+        for (int op=0; op < NUM_OPS; op++) {
+            latencies *l = args[i].ops + op;
+            total[op].count += l->count;
+            if (l->max > total[op].max) total[op].max = l->max;
+            for (int b=0; b < NUM_BUCKETS; b++) total[op].buckets[b] += l->buckets[b];
+        }
+    }
+    for (int op=0; op < NUM_OPS; op++) {
+        latencies *l = total + op;
+        calls += l->count;
+        if (!l->count) continue;
+        printf("%-10s Calls: %llu. %.0f/sec. Usec p50: %.1f p99: %.1f p99.9: %.1f max: %.1f\n",
+                OP_NAMES[op], (unsigned long long)l->count, l->count / secs,
+                percentile(l, 50) / 1e3, percentile(l, 99) / 1e3,
+                percentile(l, 99.9) / 1e3, l->max / 1e3);
+    }
+    printf("Total: %llu calls. %.0f/sec. Errors: %llu. Vacuum lag mean: %.1f max: %llu\n",
+            (unsigned long long)calls, calls / secs, (unsigned long long)errors,
+            samples ? (double)lag_sum / samples : 0, (unsigned long long)lag_max);
+
+    // Drop everything, so the folders are removed
+    for (int i=0; i < NUM_SETS; i++) {
+        snprintf(name, sizeof(name), "bench%d", i);
+        setmgr_drop_set(mgr, name);
+    }
+    for (int i=0; i < NUM_THREADS; i++) {
+        snprintf(name, sizeof(name), "churn%d.%d", i, (int)args[i].ops[OP_CREATE].count);
+        setmgr_drop_set(mgr, name);
+    }
+    destroy_set_manager(mgr);
+    nftw(DATA_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    free(total);
+    free(args);
+    free(t);
+    return 0;
+}
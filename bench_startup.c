@@ -0,0 +1,161 @@
+/*
+ * Measures how long a restart takes with many sets. A synthetic
+ * data directory is built with a folder per set, each holding a
+ * config.ini and dense registers.mmap as a flush leaves them. The
+ * set manager is then started on it by scanning the folders, and
+ * again from the manifest that the first start writes, and a
+ * number of sets are faulted in after each start.
+ *
+ * The files are left in the page cache by the build, so these are
+ * warm restarts. Drop the caches between the build and the starts
+ * to time cold ones.
+ *
+ * Usage: bench_startup [num sets] [precision] [faults] [data dir]
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "config.h"
+#include "hll.h"
+#include "set_manager.h"
+
+static int NUM_SETS = 10000;
+static int PRECISION = 12;
+static int NUM_FAULTS = 10000;
+static char *DATA_DIR = "/tmp/hlld_bench_startup";
+
+static int timediff(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
+static void set_name(int i, char *buf, int len) {
+    snprintf(buf, len, "events.hour%d.site%d", 2026101400 + i % 24, i / 24);
+}
+
+static int remove_cb(const char *path, const struct stat *s, int flag, struct FTW *ftw) {
+    (void)s;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/**
+ * Writes the folder of a set, with the given registers
+ */
+static int write_set(hlld_set_config *set_config, int i, unsigned char *regs, uint64_t len) {
+    char name[128], path[512];
+    set_name(i, name, sizeof(name));
+    snprintf(path, sizeof(path), "%s/hlld.%s", DATA_DIR, name);
+    if (mkdir(path, 0755)) return -1;
+
+    snprintf(path, sizeof(path), "%s/hlld.%s/config.ini", DATA_DIR, name);
+    if (update_filename_from_set_config(path, set_config)) return -1;
+
+    snprintf(path, sizeof(path), "%s/hlld.%s/registers.mmap", DATA_DIR, name);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    int res = (write(fd, regs, len) == (ssize_t)len) ? 0 : -1;
+    close(fd);
+    return res;
+}
+
+/**
+ * Starts the set manager on the data directory, and faults
+ * in sets by adding a key to each
+ */
+static int time_start(hlld_config *config, const char *kind) {
+    struct timeval start, loaded, faulted, end;
+    hlld_setmgr *mgr;
+    gettimeofday(&start, NULL);
+    if (init_set_manager(config, 0, &mgr)) {
+        printf("Failed to start the set manager!\n");
+        return 1;
+    }
+    gettimeofday(&loaded, NULL);
+
+    char name[128];
+    char *keys[] = {"bench_startup"};
+    int faults = (NUM_FAULTS < NUM_SETS) ? NUM_FAULTS : NUM_SETS;
+    for (int i=0; i < faults; i++) {
+        set_name(i, name, sizeof(name));
+        if (setmgr_set_keys(mgr, name, keys, 1)) {
+            printf("Failed to fault in %s!\n", name);
+            return 1;
+        }
+    }
+    gettimeofday(&faulted, NULL);
+    destroy_set_manager(mgr);
+    gettimeofday(&end, NULL);
+
+    int fault_msec = timediff(&loaded, &faulted);
+    printf("Start from %s: %d msec. Faults: %d in %d msec, %.1f usec each. Shutdown: %d msec\n",
+            kind, timediff(&start, &loaded), faults, fault_msec,
+            faults ? fault_msec * 1000.0 / faults : 0, timediff(&faulted, &end));
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_SETS = atoi(argv[1]);
+    if (argc > 2) PRECISION = atoi(argv[2]);
+    if (argc > 3) NUM_FAULTS = atoi(argv[3]);
+    if (argc > 4) DATA_DIR = argv[4];
+
+    hlld_config config;
+    config_from_filename(NULL, &config);
+    config.data_dir = DATA_DIR;
+    config.default_precision = PRECISION;
+    config.default_eps = hll_error_for_precision(PRECISION);
+
+    // Fill the registers of a set, which all the sets share
+    hlld_bitmap bm;
+    hll_t h;
+    uint64_t len = hll_bytes_for_precision(PRECISION, config.default_format);
+    if (bitmap_from_file(-1, len, ANONYMOUS, &bm) ||
+            hll_init_from_bitmap(PRECISION, config.default_format, &bm, &h)) {
+        printf("Failed to create the registers!\n");
+        return 1;
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < 10000; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hll_add_hash(&h, x);
+    }
+
+    hlld_set_config set_config = {
+        config.default_eps, PRECISION, 0, config.default_format, 0,
+        config.default_estimator, config.default_hash, hll_size(&h), 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0
+    };
+
+    // Build the data directory
+    struct timeval start, end;
+    nftw(DATA_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    if (mkdir(DATA_DIR, 0755)) {
+        printf("Failed to create %s!\n", DATA_DIR);
+        return 1;
+    }
+    gettimeofday(&start, NULL);
+    for (int i=0; i < NUM_SETS; i++) {
+        if (write_set(&set_config, i, bm.mmap, len)) {
+            printf("Failed to write set %d!\n", i);
+            return 1;
+        }
+    }
+    gettimeofday(&end, NULL);
+    printf("Sets: %d. Precision: %d. Registers: %llu bytes each. Build: %d msec\n",
+            NUM_SETS, PRECISION, (unsigned long long)len, timediff(&start, &end));
+    hll_destroy(&h);
+    bitmap_close(&bm);
+
+    // The first start scans the folders, and writes the manifest
+    int res = time_start(&config, "folders");
+    if (!res) res = time_start(&config, "manifest");
+    nftw(DATA_DIR, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    return res;
+}
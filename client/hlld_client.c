@@ -0,0 +1,780 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "hlld_client.h"
+#include "hll_hash.h"
+
+/*
+ * The binary frames, as the server defines them
+ */
+#define BINARY_MAGIC 0xB1
+#define BINARY_HEADER_LEN 12
+#define BINARY_REPLY_LEN 8
+#define BIN_SET_KEYS 1
+#define BIN_SET_HASHES 2
+
+/**
+ * The sets each connection coalesces keys for at once. Sets
+ * that map to the same slot end each other's batches.
+ */
+#define OPEN_BATCHES 16
+
+// Reads are done in chunks of this size
+#define READ_CHUNK 16384
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} client_buf;
+
+typedef struct {
+    hlld_reply_cb cb;
+    void *data;
+} waiter;
+
+/*
+ * A command sent or to be sent, along with the callbacks
+ * of every call coalesced into it
+ */
+typedef struct request {
+    int binary;             // The reply is a binary header
+    int num_waiters;
+    int cap;
+    waiter *waiters;
+    struct request *next;
+} request;
+
+typedef enum {
+    BATCH_NONE = 0,
+    BATCH_KEYS,
+    BATCH_HASHES
+} batch_kind;
+
+/*
+ * The keys or hashes coalesced for a set, not yet sent
+ */
+typedef struct {
+    batch_kind kind;
+    char *set_name;
+    int name_len;
+    int num;                // Keys or hashes in the batch
+    client_buf lens;        // The u16 key lengths of a binary frame
+    client_buf body;        // The keys or hashes, encoded
+    request *req;
+} open_batch;
+
+typedef struct {
+    int fd;                 // -1 once lost
+    client_buf out;
+    size_t sent;            // Bytes of out written
+    client_buf in;
+    request *head;          // Sent, oldest first, awaiting replies
+    request *tail;
+    open_batch batches[OPEN_BATCHES];
+} client_conn;
+
+struct hlld_client {
+    hlld_client_opts opts;
+    char *host;             // To connect again, or NULL if attached
+    int port;
+    int num_conns;
+    client_conn *conns;
+    int pending;            // Callbacks not yet invoked
+};
+
+/**
+ * Fills in the default options: 4 connections, batches
+ * of up to 1024 keys, and text commands
+ * @arg opts The options to fill in
+ */
+void hlld_client_default_opts(hlld_client_opts *opts) {
+    opts->conns = 4;
+    opts->max_batch = 1024;
+    opts->binary = 0;
+}
+
+// Makes room in a buffer for more bytes
+static int buf_reserve(client_buf *b, size_t more) {
+    if (b->len + more <= b->cap) return 0;
+    size_t cap = (b->cap) ? b->cap : 256;
+    while (cap < b->len + more) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(client_buf *b, const void *data, size_t len) {
+    if (buf_reserve(b, len)) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void store_le(char *out, uint64_t val, int bytes) {
+    for (int i=0; i < bytes; i++) out[i] = (val >> (8 * i)) & 0xff;
+}
+
+// FNV-1a of a set name, to pick its connection
+static uint64_t hash_name(const char *name, int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i=0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Set names are one token of a text command
+static int valid_name(const char *name, int len) {
+    if (len <= 0 || len > 0xffff) return 0;
+    for (int i=0; i < len; i++) {
+        if (name[i] == ' ' || name[i] == '\n' || name[i] == '\r') return 0;
+    }
+    return 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Opens a connection to the server of the client
+static int open_socket(hlld_client *c) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", c->port);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(c->host, port, &hints, &res)) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *a=res; a; a=a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if (!connect(fd, a->ai_addr, a->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+
+    // Pipelined writes should not wait on acknowledgements
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (set_nonblocking(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int alloc_client(int num, hlld_client_opts *opts, hlld_client **client) {
+    hlld_client *c = calloc(1, sizeof(hlld_client));
+    if (!c) return -1;
+    if (opts)
+        c->opts = *opts;
+    else
+        hlld_client_default_opts(&c->opts);
+    if (c->opts.max_batch < 1) c->opts.max_batch = 1;
+    c->conns = calloc(num, sizeof(client_conn));
+    if (!c->conns) {
+        free(c);
+        return -1;
+    }
+    c->num_conns = num;
+    for (int i=0; i < num; i++) c->conns[i].fd = -1;
+    *client = c;
+    return 0;
+}
+
+/**
+ * Connects a pool to a server. Lost connections are made
+ * again when a command is next queued on them.
+ * @arg host The host name or address of the server
+ * @arg port The TCP port of the server
+ * @arg opts The options, or NULL for the defaults
+ * @arg client Output, the client
+ * @return 0 on success, -1 if a connection failed.
+ */
+int hlld_client_connect(const char *host, int port, hlld_client_opts *opts, hlld_client **client) {
+    int num = (opts) ? opts->conns : 4;
+    if (num < 1) return -1;
+    hlld_client *c;
+    if (alloc_client(num, opts, &c)) return -1;
+    c->host = strdup(host);
+    c->port = port;
+    for (int i=0; c->host && i < num; i++) {
+        c->conns[i].fd = open_socket(c);
+        if (c->conns[i].fd < 0) {
+            hlld_client_close(c);
+            return -1;
+        }
+    }
+    if (!c->host) {
+        hlld_client_close(c);
+        return -1;
+    }
+    *client = c;
+    return 0;
+}
+
+/**
+ * Makes a pool of sockets that are already connected, such
+ * as those of a unix socket. The opts conns is ignored, and
+ * the client takes ownership of the sockets.
+ * @arg fds The sockets
+ * @arg num The number of sockets
+ * @arg opts The options, or NULL for the defaults
+ * @arg client Output, the client
+ * @return 0 on success, -1 on error.
+ */
+int hlld_client_attach(const int *fds, int num, hlld_client_opts *opts, hlld_client **client) {
+    if (num < 1) return -1;
+    hlld_client *c;
+    if (alloc_client(num, opts, &c)) return -1;
+    c->opts.conns = num;
+    for (int i=0; i < num; i++) {
+        if (set_nonblocking(fds[i])) {
+            hlld_client_close(c);
+            return -1;
+        }
+        c->conns[i].fd = fds[i];
+    }
+    *client = c;
+    return 0;
+}
+
+static request* new_request(int binary) {
+    request *r = calloc(1, sizeof(request));
+    if (r) r->binary = binary;
+    return r;
+}
+
+static int add_waiter(hlld_client *c, request *r, hlld_reply_cb cb, void *data) {
+    if (r->num_waiters == r->cap) {
+        int cap = (r->cap) ? r->cap * 2 : 4;
+        waiter *w = realloc(r->waiters, cap * sizeof(waiter));
+        if (!w) return -1;
+        r->waiters = w;
+        r->cap = cap;
+    }
+    r->waiters[r->num_waiters++] = (waiter){cb, data};
+    c->pending++;
+    return 0;
+}
+
+// Invokes the callbacks of a request, and frees it
+static int complete_request(hlld_client *c, request *r, hlld_status status,
+        const char *reply, int reply_len) {
+    int num = r->num_waiters;
+    for (int i=0; i < num; i++) {
+        c->pending--;
+        if (r->waiters[i].cb) r->waiters[i].cb(r->waiters[i].data, status, reply, reply_len);
+    }
+    free(r->waiters);
+    free(r);
+    return num;
+}
+
+static void push_request(client_conn *conn, request *r) {
+    r->next = NULL;
+    if (conn->tail)
+        conn->tail->next = r;
+    else
+        conn->head = r;
+    conn->tail = r;
+}
+
+static void reset_batch(open_batch *b) {
+    free(b->set_name);
+    free(b->lens.data);
+    free(b->body.data);
+    memset(b, 0, sizeof(open_batch));
+}
+
+// Encodes an open batch as a command, and queues it to be sent
+static int end_batch(client_conn *conn, open_batch *b) {
+    if (b->kind == BATCH_NONE) return 0;
+    client_buf *out = &conn->out;
+    int res = 0;
+    if (b->req->binary) {
+        char header[BINARY_HEADER_LEN];
+        header[0] = (char)BINARY_MAGIC;
+        header[1] = (b->kind == BATCH_KEYS) ? BIN_SET_KEYS : BIN_SET_HASHES;
+        store_le(header + 2, b->name_len, 2);
+        store_le(header + 4, b->num, 4);
+        store_le(header + 8, b->name_len + b->lens.len + b->body.len, 4);
+        res |= buf_append(out, header, BINARY_HEADER_LEN);
+        res |= buf_append(out, b->set_name, b->name_len);
+        res |= buf_append(out, b->lens.data, b->lens.len);
+    } else {
+        const char *cmd = (b->kind == BATCH_KEYS) ? "b " : "seth ";
+        res |= buf_append(out, cmd, strlen(cmd));
+        res |= buf_append(out, b->set_name, b->name_len);
+    }
+    res |= buf_append(out, b->body.data, b->body.len);
+    if (!b->req->binary) res |= buf_append(out, "\n", 1);
+
+    // Queued even if the buffer could not grow, so the
+    // callbacks are failed along with the connection
+    push_request(conn, b->req);
+    b->req = NULL;
+    reset_batch(b);
+    return res;
+}
+
+// Fails everything on a connection, and closes it
+static int fail_conn(hlld_client *c, client_conn *conn) {
+    int done = 0;
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    for (int i=0; i < OPEN_BATCHES; i++) {
+        if (conn->batches[i].kind == BATCH_NONE) continue;
+        end_batch(conn, conn->batches + i);
+    }
+    while (conn->head) {
+        request *r = conn->head;
+        conn->head = r->next;
+        if (!conn->head) conn->tail = NULL;
+        done += complete_request(c, r, HLLD_CONN_ERR, NULL, 0);
+    }
+    conn->out.len = conn->sent = 0;
+    conn->in.len = 0;
+    return done;
+}
+
+// Writes out what a connection has queued, until it would block
+static int write_conn(hlld_client *c, client_conn *conn) {
+    while (conn->sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.data + conn->sent,
+                conn->out.len - conn->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) {
+            fail_conn(c, conn);
+            return -1;
+        }
+        conn->sent += n;
+    }
+    conn->out.len = conn->sent = 0;
+    return 0;
+}
+
+// Finds the connection of a set, making it again if lost
+static client_conn* conn_for(hlld_client *c, const char *name, int name_len) {
+    client_conn *conn = c->conns + (hash_name(name, name_len) % c->num_conns);
+    if (conn->fd < 0 && c->host) conn->fd = open_socket(c);
+    return (conn->fd < 0) ? NULL : conn;
+}
+
+/**
+ * Queues a text command, which is sent as it is with a newline
+ * @arg client The client
+ * @arg cmd The command, such as "size foo". It must not
+ * change how replies are sent, as "replies count" does.
+ * @arg cb Invoked with the reply, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_command(hlld_client *client, const char *cmd, hlld_reply_cb cb, void *data) {
+    int len = strlen(cmd);
+    if (!len || memchr(cmd, '\n', len)) return -1;
+
+    // Routed by the set, the first argument, or else the command
+    const char *name = strchr(cmd, ' ');
+    name = (name) ? name + 1 : cmd;
+    int name_len = strcspn(name, " ");
+    if (!name_len) {
+        name = cmd;
+        name_len = len;
+    }
+    client_conn *conn = conn_for(client, name, name_len);
+    if (!conn) return -1;
+
+    // Earlier keys for its sets are sent first
+    for (int i=0; i < OPEN_BATCHES; i++) {
+        if (end_batch(conn, conn->batches + i)) return -1;
+    }
+    request *r = new_request(0);
+    if (!r) return -1;
+    if (add_waiter(client, r, cb, data) ||
+            buf_reserve(&conn->out, len + 1)) {
+        client->pending -= r->num_waiters;
+        free(r->waiters);
+        free(r);
+        return -1;
+    }
+    buf_append(&conn->out, cmd, len);
+    buf_append(&conn->out, "\n", 1);
+    push_request(conn, r);
+    return 0;
+}
+
+/*
+ * Finds the open batch of a set for some more keys, ending
+ * the batch of another set in its slot, or one that is full
+ */
+static open_batch* batch_for(hlld_client *c, client_conn *conn, const char *set_name,
+        int name_len, batch_kind kind, int more) {
+    uint64_t h = hash_name(set_name, name_len);
+    open_batch *b = conn->batches + ((h / c->num_conns) % OPEN_BATCHES);
+    if (b->kind != BATCH_NONE && (b->kind != kind || b->name_len != name_len ||
+                memcmp(b->set_name, set_name, name_len) ||
+                b->num + more > c->opts.max_batch)) {
+        if (end_batch(conn, b)) return NULL;
+    }
+    if (b->kind != BATCH_NONE) return b;
+
+    b->set_name = malloc(name_len);
+    b->req = new_request(c->opts.binary);
+    if (!b->set_name || !b->req) {
+        free(b->req);
+        b->req = NULL;
+        reset_batch(b);
+        return NULL;
+    }
+    memcpy(b->set_name, set_name, name_len);
+    b->name_len = name_len;
+    b->kind = kind;
+    return b;
+}
+
+// Sends a batch that has filled up
+static int end_full_batch(hlld_client *c, client_conn *conn, open_batch *b) {
+    if (b->num < c->opts.max_batch) return 0;
+    if (end_batch(conn, b)) return -1;
+    return 0;
+}
+
+/**
+ * Queues a key to set in a set, coalesced with the other
+ * keys queued for the set
+ * @arg client The client
+ * @arg set_name The set
+ * @arg key The key, which need not be terminated. Unless
+ * binary is set, it may not hold spaces, newlines or nulls.
+ * @arg key_len The length of the key
+ * @arg cb Invoked once the batch of the key is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set(hlld_client *client, const char *set_name, const char *key,
+        int key_len, hlld_reply_cb cb, void *data) {
+    int name_len = strlen(set_name);
+    if (!valid_name(set_name, name_len) || key_len <= 0 || key_len > 0xffff) return -1;
+    if (!client->opts.binary) {
+        for (int i=0; i < key_len; i++) {
+            if (key[i] == ' ' || key[i] == '\n' || !key[i]) return -1;
+        }
+    }
+    client_conn *conn = conn_for(client, set_name, name_len);
+    if (!conn) return -1;
+    open_batch *b = batch_for(client, conn, set_name, name_len, BATCH_KEYS, 1);
+    if (!b) return -1;
+
+    // Room is made first, so a failure leaves the batch as it was
+    if (buf_reserve(&b->lens, 2) || buf_reserve(&b->body, key_len + 1) ||
+            add_waiter(client, b->req, cb, data))
+        return -1;
+    if (client->opts.binary) {
+        store_le(b->lens.data + b->lens.len, key_len, 2);
+        b->lens.len += 2;
+    } else {
+        buf_append(&b->body, " ", 1);
+    }
+    buf_append(&b->body, key, key_len);
+    b->num++;
+    return end_full_batch(client, conn, b);
+}
+
+/**
+ * Queues hashes to set in a set created with hash=external,
+ * coalesced with the other hashes queued for the set
+ * @arg client The client
+ * @arg set_name The set
+ * @arg hashes The hashes
+ * @arg num The number of hashes
+ * @arg cb Invoked once the batch of the hashes is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set_hashes(hlld_client *client, const char *set_name,
+        const uint64_t *hashes, int num, hlld_reply_cb cb, void *data) {
+    int name_len = strlen(set_name);
+    if (!valid_name(set_name, name_len) || num <= 0) return -1;
+    client_conn *conn = conn_for(client, set_name, name_len);
+    if (!conn) return -1;
+
+    // A call is never split, so a large one gets a batch of its own
+    open_batch *b = batch_for(client, conn, set_name, name_len, BATCH_HASHES, num);
+    if (!b) return -1;
+    int per_hash = (client->opts.binary) ? 8 : 17;
+    if (buf_reserve(&b->body, (size_t)num * per_hash + 1) ||
+            add_waiter(client, b->req, cb, data))
+        return -1;
+    for (int i=0; i < num; i++) {
+        if (client->opts.binary) {
+            store_le(b->body.data + b->body.len, hashes[i], 8);
+            b->body.len += 8;
+        } else {
+            b->body.len += sprintf(b->body.data + b->body.len, " %016llx",
+                    (unsigned long long)hashes[i]);
+        }
+    }
+    b->num += num;
+    return end_full_batch(client, conn, b);
+}
+
+/**
+ * Hashes keys on the client, and queues their hashes as
+ * hlld_client_set_hashes, so the server does not hash them
+ * @arg client The client
+ * @arg set_name The set, created with hash=external
+ * @arg keys The keys
+ * @arg lens The length of each key
+ * @arg num The number of keys
+ * @arg cb Invoked once the batch of the keys is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set_hashed(hlld_client *client, const char *set_name, const char **keys,
+        const int *lens, int num, hlld_reply_cb cb, void *data) {
+    if (num <= 0) return -1;
+    uint64_t *hashes = malloc(num * sizeof(uint64_t));
+    if (!hashes) return -1;
+    for (int i=0; i < num; i++) hashes[i] = hlld_client_hash(keys[i], lens[i]);
+    int res = hlld_client_set_hashes(client, set_name, hashes, num, cb, data);
+    free(hashes);
+    return res;
+}
+
+/**
+ * Hashes a key as the server does for sets with the murmur hash
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The 64 bit hash
+ */
+uint64_t hlld_client_hash(const char *key, int len) {
+    return hll_hash_key(HLL_HASH_MURMUR, key, len);
+}
+
+/**
+ * Ends the open batches, and writes out all that is queued
+ * that the sockets take without blocking
+ * @arg client The client
+ * @return 0 on success, -1 if a connection was lost.
+ */
+int hlld_client_flush(hlld_client *client) {
+    int res = 0;
+    for (int i=0; i < client->num_conns; i++) {
+        client_conn *conn = client->conns + i;
+        if (conn->fd < 0) continue;
+        for (int j=0; j < OPEN_BATCHES; j++) res |= end_batch(conn, conn->batches + j);
+        res |= write_conn(client, conn);
+    }
+    return (res) ? -1 : 0;
+}
+
+// Maps the reply to a batch of keys onto a status
+static hlld_status text_status(const char *line, int len) {
+    if (len == 4 && !memcmp(line, "Done", 4)) return HLLD_OK;
+    if (len == 18 && !memcmp(line, "Set does not exist", 18)) return HLLD_SET_NOT_EXIST;
+    if ((len >= 14 && !memcmp(line, "Client Error: ", 14)) ||
+            (len == 14 && !memcmp(line, "Internal Error", 14)))
+        return HLLD_SERVER_ERR;
+    return HLLD_OK;
+}
+
+/*
+ * Parses the replies a connection has read, and completes
+ * their requests
+ * @return The callbacks invoked, or -1 on a bad reply.
+ */
+static int parse_replies(hlld_client *c, client_conn *conn) {
+    size_t pos = 0;
+    int done = 0;
+    while (conn->head && pos < conn->in.len) {
+        char *start = conn->in.data + pos;
+        size_t avail = conn->in.len - pos;
+        request *r = conn->head;
+
+        hlld_status status;
+        const char *reply = start;
+        int reply_len;
+        char text[32];
+        if (r->binary) {
+            if (avail < BINARY_REPLY_LEN) break;
+            if ((unsigned char)start[0] != BINARY_MAGIC) return -1;
+            int code = (unsigned char)start[1];
+            status = (code == 0) ? HLLD_OK : (code == 1) ? HLLD_SET_NOT_EXIST : HLLD_SERVER_ERR;
+            if (code == 0)
+                reply_len = snprintf(text, sizeof(text), "Done");
+            else if (code == 1)
+                reply_len = snprintf(text, sizeof(text), "Set does not exist");
+            else
+                reply_len = snprintf(text, sizeof(text), "Binary status %d", code);
+            reply = text;
+            pos += BINARY_REPLY_LEN;
+        } else {
+            char *nl = memchr(start, '\n', avail);
+            if (!nl) break;
+            reply_len = nl - start;
+            pos += reply_len + 1;
+
+            // Listings are sent between START and END lines
+            if (reply_len == 5 && !memcmp(start, "START", 5)) {
+                char *body = nl + 1, *end = body, *limit = conn->in.data + conn->in.len;
+                while (end + 4 <= limit && memcmp(end, "END\n", 4)) {
+                    char *next = memchr(end, '\n', limit - end);
+                    end = (next) ? next + 1 : limit;
+                }
+                if (end + 4 > limit) {
+                    pos -= reply_len + 1;
+                    break;
+                }
+                reply = body;
+                reply_len = end - body;
+                pos = (end + 4) - conn->in.data;
+                status = HLLD_OK;
+            } else {
+                status = text_status(start, reply_len);
+            }
+        }
+
+        conn->head = r->next;
+        if (!conn->head) conn->tail = NULL;
+        done += complete_request(c, r, status, reply, reply_len);
+    }
+
+    // Keep what is left of a partial reply
+    memmove(conn->in.data, conn->in.data + pos, conn->in.len - pos);
+    conn->in.len -= pos;
+    return done;
+}
+
+// Reads the replies on a connection, until it would block
+static int read_conn(hlld_client *c, client_conn *conn) {
+    int done = 0;
+    while (conn->fd >= 0) {
+        if (buf_reserve(&conn->in, READ_CHUNK)) return -1;
+        ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, READ_CHUNK, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            done += fail_conn(c, conn);
+            break;
+        }
+        conn->in.len += n;
+        int res = parse_replies(c, conn);
+        if (res < 0) {
+            done += fail_conn(c, conn);
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+/**
+ * Flushes the client, then waits for replies and writes
+ * until the timeout, invoking the callbacks of the replies
+ * @arg client The client
+ * @arg timeout_ms The most to wait, 0 to not wait, or -1 for ever
+ * @return The number of callbacks invoked, or -1 on error.
+ */
+int hlld_client_poll(hlld_client *client, int timeout_ms) {
+    int before = client->pending;
+    hlld_client_flush(client);
+
+    struct pollfd fds[client->num_conns];
+    int idx[client->num_conns], num = 0;
+    for (int i=0; i < client->num_conns; i++) {
+        client_conn *conn = client->conns + i;
+        if (conn->fd < 0 || (!conn->head && conn->sent == conn->out.len)) continue;
+        fds[num].fd = conn->fd;
+        fds[num].events = POLLIN | ((conn->sent < conn->out.len) ? POLLOUT : 0);
+        fds[num].revents = 0;
+        idx[num++] = i;
+    }
+    if (!num) return before - client->pending;
+    int res = poll(fds, num, timeout_ms);
+    if (res < 0) return (errno == EINTR) ? before - client->pending : -1;
+
+    for (int i=0; i < num; i++) {
+        client_conn *conn = client->conns + idx[i];
+        if (fds[i].revents & POLLOUT) write_conn(client, conn);
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) read_conn(client, conn);
+    }
+    return before - client->pending;
+}
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Polls the client until every queued command is replied to
+ * @arg client The client
+ * @arg timeout_ms The most to wait, or -1 for ever
+ * @return 0 once none are pending, -1 on timeout or error.
+ */
+int hlld_client_wait(hlld_client *client, int timeout_ms) {
+    uint64_t deadline = now_msec() + timeout_ms;
+    while (client->pending) {
+        int wait = -1;
+        if (timeout_ms >= 0) {
+            uint64_t now = now_msec();
+            if (now >= deadline) return -1;
+            wait = deadline - now;
+        }
+        if (hlld_client_poll(client, wait) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the callbacks of the commands that were queued,
+ * and not yet replied to
+ * @arg client The client
+ */
+int hlld_client_pending(hlld_client *client) {
+    return client->pending;
+}
+
+/**
+ * Closes the connections and frees a client. The callbacks
+ * of commands that were not replied to are invoked with
+ * HLLD_CONN_ERR.
+ * @arg client The client
+ */
+void hlld_client_close(hlld_client *client) {
+    for (int i=0; i < client->num_conns; i++) {
+        client_conn *conn = client->conns + i;
+        fail_conn(client, conn);
+        free(conn->out.data);
+        free(conn->in.data);
+    }
+    free(client->conns);
+    free(client->host);
+    free(client);
+}
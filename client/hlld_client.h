@@ -0,0 +1,187 @@
+#ifndef HLLD_CLIENT_H
+#define HLLD_CLIENT_H
+#include <stdint.h>
+
+/*
+ * libhlld, a C client for hlld. A client holds a pool of
+ * non-blocking connections to a server, and commands are
+ * queued with a callback rather than waited on, so that many
+ * are in flight on each connection. The commands naming a set
+ * always go to the same connection, so they keep their order.
+ *
+ * Keys set in a set one call at a time are coalesced into a
+ * single bulk command, or seth for hashes, which is sent once
+ * it holds max_batch keys, or when the client is flushed or
+ * polled. With binary set, they are sent as binary frames
+ * instead, whose keys may hold any byte.
+ *
+ * A client is not thread safe, and its callbacks are invoked
+ * from hlld_client_poll. They may queue further commands, but
+ * must not poll or close the client.
+ */
+
+/**
+ * The outcome of a command, given to its callback
+ */
+typedef enum {
+    HLLD_OK = 0,            // The command was done, or replied to
+    HLLD_SET_NOT_EXIST,     // The set does not exist
+    HLLD_SERVER_ERR,        // The server replied with an error
+    HLLD_CONN_ERR           // The connection was lost before the reply
+} hlld_status;
+
+typedef struct {
+    int conns;          // Connections in the pool
+    int max_batch;      // The most keys coalesced into one command
+    int binary;         // Set keys and hashes with binary frames
+} hlld_client_opts;
+
+/**
+ * Invoked with the reply to a command. The reply is the line
+ * the server sent, without its newline, or the lines between
+ * START and END of a listing. It is only valid during the call.
+ * Binary frames have "Done", "Set does not exist", or "Binary
+ * status" and its number. Lost connections have no reply.
+ * @arg data The data given with the command
+ * @arg status The outcome of the command
+ * @arg reply The reply, which is not terminated. NULL if none.
+ * @arg reply_len The length of the reply
+ */
+typedef void (*hlld_reply_cb)(void *data, hlld_status status, const char *reply, int reply_len);
+
+typedef struct hlld_client hlld_client;
+
+/**
+ * Fills in the default options: 4 connections, batches
+ * of up to 1024 keys, and text commands
+ * @arg opts The options to fill in
+ */
+void hlld_client_default_opts(hlld_client_opts *opts);
+
+/**
+ * Connects a pool to a server. Lost connections are made
+ * again when a command is next queued on them.
+ * @arg host The host name or address of the server
+ * @arg port The TCP port of the server
+ * @arg opts The options, or NULL for the defaults
+ * @arg client Output, the client
+ * @return 0 on success, -1 if a connection failed.
+ */
+int hlld_client_connect(const char *host, int port, hlld_client_opts *opts, hlld_client **client);
+
+/**
+ * Makes a pool of sockets that are already connected, such
+ * as those of a unix socket. The opts conns is ignored, and
+ * the client takes ownership of the sockets.
+ * @arg fds The sockets
+ * @arg num The number of sockets
+ * @arg opts The options, or NULL for the defaults
+ * @arg client Output, the client
+ * @return 0 on success, -1 on error.
+ */
+int hlld_client_attach(const int *fds, int num, hlld_client_opts *opts, hlld_client **client);
+
+/**
+ * Closes the connections and frees a client. The callbacks
+ * of commands that were not replied to are invoked with
+ * HLLD_CONN_ERR.
+ * @arg client The client
+ */
+void hlld_client_close(hlld_client *client);
+
+/**
+ * Queues a text command, which is sent as it is with a newline
+ * @arg client The client
+ * @arg cmd The command, such as "size foo". It must not
+ * change how replies are sent, as "replies count" does.
+ * @arg cb Invoked with the reply, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_command(hlld_client *client, const char *cmd, hlld_reply_cb cb, void *data);
+
+/**
+ * Queues a key to set in a set, coalesced with the other
+ * keys queued for the set
+ * @arg client The client
+ * @arg set_name The set
+ * @arg key The key, which need not be terminated. Unless
+ * binary is set, it may not hold spaces, newlines or nulls.
+ * @arg key_len The length of the key
+ * @arg cb Invoked once the batch of the key is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set(hlld_client *client, const char *set_name, const char *key,
+        int key_len, hlld_reply_cb cb, void *data);
+
+/**
+ * Queues hashes to set in a set created with hash=external,
+ * coalesced with the other hashes queued for the set
+ * @arg client The client
+ * @arg set_name The set
+ * @arg hashes The hashes
+ * @arg num The number of hashes
+ * @arg cb Invoked once the batch of the hashes is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set_hashes(hlld_client *client, const char *set_name,
+        const uint64_t *hashes, int num, hlld_reply_cb cb, void *data);
+
+/**
+ * Hashes keys on the client, and queues their hashes as
+ * hlld_client_set_hashes, so the server does not hash them
+ * @arg client The client
+ * @arg set_name The set, created with hash=external
+ * @arg keys The keys
+ * @arg lens The length of each key
+ * @arg num The number of keys
+ * @arg cb Invoked once the batch of the keys is done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 on error.
+ */
+int hlld_client_set_hashed(hlld_client *client, const char *set_name, const char **keys,
+        const int *lens, int num, hlld_reply_cb cb, void *data);
+
+/**
+ * Hashes a key as the server does for sets with the murmur hash
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The 64 bit hash
+ */
+uint64_t hlld_client_hash(const char *key, int len);
+
+/**
+ * Ends the open batches, and writes out all that is queued
+ * that the sockets take without blocking
+ * @arg client The client
+ * @return 0 on success, -1 if a connection was lost.
+ */
+int hlld_client_flush(hlld_client *client);
+
+/**
+ * Flushes the client, then waits for replies and writes
+ * until the timeout, invoking the callbacks of the replies
+ * @arg client The client
+ * @arg timeout_ms The most to wait, 0 to not wait, or -1 for ever
+ * @return The number of callbacks invoked, or -1 on error.
+ */
+int hlld_client_poll(hlld_client *client, int timeout_ms);
+
+/**
+ * Polls the client until every queued command is replied to
+ * @arg client The client
+ * @arg timeout_ms The most to wait, or -1 for ever
+ * @return 0 once none are pending, -1 on timeout or error.
+ */
+int hlld_client_wait(hlld_client *client, int timeout_ms);
+
+/**
+ * Returns the callbacks of the commands that were queued,
+ * and not yet replied to
+ * @arg client The client
+ */
+int hlld_client_pending(hlld_client *client);
+
+#endif
@@ -27,6 +27,9 @@ def pytest_funcarg__servers(request):
     conf = """[hlld]
 data_dir = %(dir)s
 port = %(port)d
+
+[template:small]
+default_precision = 10
 """ % {"dir": tmpdir, "port": port}
     open(config_path, "w").write(conf)
 
@@ -223,6 +226,135 @@ class TestInteg(object):
         server.sendall("s foobar test\n")
         assert fh.readline() == "Done\n"
 
+    def test_merge(self, servers):
+        "Tests merging sets"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foo", "bar", "baz"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("bulk foo a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk bar c d\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("merge baz foo bar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("info baz\n")
+        assert fh.readline() == "START\n"
+        info = {}
+        line = fh.readline()
+        while line != "END\n":
+            key, val = line.split()
+            info[key] = val
+            line = fh.readline()
+        assert info["size"] == "4"
+
+    def test_merge_bad(self, servers):
+        "Tests merging missing sets"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foo\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("merge foo\n")
+        assert fh.readline() == "Client Error: Must provide destination and source sets\n"
+        server.sendall("merge foo bar\n")
+        assert fh.readline() == "Set does not exist\n"
+        server.sendall("create bar precision=14\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("merge foo bar\n")
+        assert fh.readline() == "Client Error: Set precisions or hashes differ\n"
+
+    def test_size_union_intersect(self, servers):
+        "Tests union and intersection sizes"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foo", "bar"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("bulk foo a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk bar c d\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size_union foo bar\n")
+        assert fh.readline() == "4\n"
+        server.sendall("size_intersect foo bar\n")
+        assert fh.readline() == "1\n"
+        server.sendall("size_intersect foo\n")
+        assert fh.readline() == "Client Error: Must provide set names\n"
+        server.sendall("size_union foo baz\n")
+        assert fh.readline() == "Set does not exist\n"
+
+    def test_jaccard(self, servers):
+        "Tests the similarity of sets keeping their smallest hashes"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foo", "bar"):
+            server.sendall("create %s kmv=16\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("create baz\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk foo a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk bar c d\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("jaccard foo bar\n")
+        assert fh.readline() == "0.250000\n"
+        server.sendall("size_intersect foo bar\n")
+        assert fh.readline() == "1\n"
+        server.sendall("jaccard foo baz\n")
+        assert fh.readline() == "Client Error: Set does not keep its smallest hashes\n"
+        server.sendall("jaccard foo\n")
+        assert fh.readline() == "Client Error: Must provide set names\n"
+        server.sendall("create bad kmv=8\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_sizes(self, servers):
+        "Tests the sizes of many sets at once"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foo", "bar"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("bulk foo a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("sizes foo baz bar\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foo 3\n"
+        assert fh.readline() == "baz Set does not exist\n"
+        assert fh.readline() == "bar 0\n"
+        assert fh.readline() == "END\n"
+        server.sendall("sizes\n")
+        assert fh.readline() == "Client Error: Must provide set names\n"
+
+    def test_bulkcreate(self, servers):
+        "Tests creating many sets from a template"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foo\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulkcreate small foo bar baz bar\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foo Exists\n"
+        assert fh.readline() == "bar Done\n"
+        assert fh.readline() == "baz Done\n"
+        assert fh.readline() == "bar Exists\n"
+        assert fh.readline() == "END\n"
+
+        server.sendall("info bar\n")
+        assert fh.readline() == "START\n"
+        info = {}
+        line = fh.readline()
+        while line != "END\n":
+            key, val = line.split()
+            info[key] = val
+            line = fh.readline()
+        assert info["precision"] == "10"
+
+        server.sendall("bulkcreate weekly qux\n")
+        assert fh.readline() == "Client Error: Unknown template\n"
+        server.sendall("bulkcreate small\n")
+        assert fh.readline() == "Client Error: Must provide template and set names\n"
+
     def test_concurrent_drop(self, servers):
         "Tests setting values and do a concurrent drop on the DB"
         server, server2 = servers
@@ -318,6 +450,114 @@ class TestInteg(object):
         t.start()
         loopset()
 
+    def test_create_estimator(self, servers):
+        "Tests creating a set with the histogram estimator"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar estimator=ertl\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk foobar a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("info foobar\n")
+        assert fh.readline() == "START\n"
+        info = {}
+        line = fh.readline()
+        while line != "END\n":
+            key, val = line.split()
+            info[key] = val
+            line = fh.readline()
+        assert info["estimator"] == "ertl"
+        assert info["size"] == "3"
+        server.sendall("create bad estimator=foo\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_create_hash(self, servers):
+        "Tests creating a set with another hash"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar hash=wyhash\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("create other\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk foobar a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size_union foobar\n")
+        assert fh.readline() == "3\n"
+        server.sendall("merge other foobar\n")
+        assert fh.readline() == "Client Error: Set precisions or hashes differ\n"
+
+    def test_seth(self, servers):
+        "Tests setting client computed hashes"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar hash=external\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("seth foobar 9e3779b97f4a7c15 2545F4914F6CDD1D 1\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size_union foobar\n")
+        assert fh.readline() == "3\n"
+        server.sendall("seth foobar xyz\n")
+        assert fh.readline() == "Client Error: Hashes must be 64bit hex values\n"
+        server.sendall("seth foobar 12345678901234567\n")
+        assert fh.readline() == "Client Error: Hashes must be 64bit hex values\n"
+        server.sendall("bulk foobar a b\n")
+        assert fh.readline() == "Client Error: Keys do not match the set hash\n"
+        server.sendall("create other\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("seth other 1\n")
+        assert fh.readline() == "Client Error: Keys do not match the set hash\n"
+        server.sendall("seth missing 1\n")
+        assert fh.readline() == "Set does not exist\n"
+
+    def test_bind(self, servers):
+        "Tests naming sets by their handles"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bind foobar\n")
+        handle = fh.readline().strip()
+        assert handle.startswith("@")
+        server.sendall("bind foobar\n")
+        assert fh.readline() == handle + "\n"
+        server.sendall("bind missing\n")
+        assert fh.readline() == "Set does not exist\n"
+        server.sendall("create @1\n")
+        assert fh.readline() == "Client Error: Bad set name\n"
+
+        server.sendall("s %s test\n" % handle)
+        assert fh.readline() == "Done\n"
+        server.sendall("b %s a b\n" % handle)
+        assert fh.readline() == "Done\n"
+        server.sendall("size foobar\n")
+        assert fh.readline() == "3\n"
+        server.sendall("drop %s\n" % handle)
+        assert fh.readline() == "Done\n"
+        server.sendall("s %s test\n" % handle)
+        assert fh.readline() == "Set does not exist\n"
+
+    def test_watch(self, servers):
+        "Tests pushing the size of a watched set"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("watch foobar delta=2\n")
+        assert fh.readline() == "0\n"
+        server.sendall("watch foobar pct=0\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+        server.sendall("watch missing delta=2\n")
+        assert fh.readline() == "Set does not exist\n"
+
+        server.sendall("b foobar a b c\n")
+        assert fh.readline() == "Done\n"
+        assert fh.readline() == "Watch foobar 3\n"
+        server.sendall("drop foobar\n")
+        assert fh.readline() == "Done\n"
+        assert fh.readline() == "Watch foobar dropped\n"
+        server.sendall("unwatch foobar\n")
+        assert fh.readline() == "Set is not watched\n"
+
     def test_create_in_memory(self, servers):
         "Tests creating a set in_memory, tries flush"
         server, _ = servers
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "affinity.h"
+
+/**
+ * The most NUMA nodes that are looked for
+ */
+#define AFFINITY_MAX_NODES 64
+
+/**
+ * The cpus of each NUMA node
+ */
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+/*
+ * The cpus the server may run on, and the node
+ * of each. Read once, by the first pinned worker.
+ */
+typedef struct {
+    int num_cpus;
+    int cpus[AFFINITY_MAX_CPUS];
+    int nodes[AFFINITY_MAX_CPUS];       // Node of each cpu
+    int num_nodes;
+    int node_ids[AFFINITY_MAX_NODES];   // Nodes with a cpu, ascending
+} cpu_topology;
+
+static cpu_topology TOPOLOGY;
+static pthread_once_t TOPOLOGY_ONCE = PTHREAD_ONCE_INIT;
+
+/**
+ * Parses a list of cpus in the form of the kernel's
+ * cpulist files, such as "0-3,8,10-11".
+ * @arg list The list
+ * @arg cpus Output, the cpus in the list
+ * @arg max The most cpus to output
+ * @return The number of cpus, or -1 if the list is invalid.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max) {
+    int num = 0;
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0) return -1;
+        long hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) return -1;
+        }
+        for (long c=lo; c <= hi; c++) {
+            if (num == max) return -1;
+            cpus[num++] = c;
+        }
+        p = end;
+        if (*p == ',') p++;
+        else if (*p && *p != '\n') return -1;
+    }
+    return num;
+}
+
+/**
+ * Reads the cpus we may run on, and their nodes. Without
+ * the node files every cpu is counted on node 0.
+ */
+static void load_topology() {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return;
+    for (int c=0; c < CPU_SETSIZE && TOPOLOGY.num_cpus < AFFINITY_MAX_CPUS; c++) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        TOPOLOGY.cpus[TOPOLOGY.num_cpus] = c;
+        TOPOLOGY.nodes[TOPOLOGY.num_cpus++] = 0;
+    }
+
+    // Nodes may be numbered sparsely, and some have no cpus
+    char path[64], buf[4096];
+    int node_cpus[AFFINITY_MAX_CPUS];
+    for (int node=0; node < AFFINITY_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), NODE_CPULIST, node);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int num = fgets(buf, sizeof(buf), f) ? parse_cpu_list(buf, node_cpus, AFFINITY_MAX_CPUS) : -1;
+        fclose(f);
+
+        int used = 0;
+        for (int i=0; i < num; i++) {
+            for (int j=0; j < TOPOLOGY.num_cpus; j++) {
+                if (TOPOLOGY.cpus[j] != node_cpus[i]) continue;
+                TOPOLOGY.nodes[j] = node;
+                used = 1;
+            }
+        }
+        if (used) TOPOLOGY.node_ids[TOPOLOGY.num_nodes++] = node;
+    }
+#endif
+    if (!TOPOLOGY.num_nodes) TOPOLOGY.num_nodes = 1;
+}
+
+/**
+ * Pins the calling worker thread. With core affinity, the
+ * workers take the cpus the server may run on in turn. With
+ * node affinity, the workers take the NUMA nodes in turn, and
+ * may run on any of the cpus of their node.
+ * @arg mode The placement of the workers
+ * @arg index The index of the worker
+ * @return The NUMA node of the worker, 0 if unpinned or
+ * the node is unknown, or -1 if it could not be pinned.
+ */
+int pin_worker_thread(hlld_worker_affinity mode, int index) {
+    if (mode == WORKER_AFFINITY_NONE) return 0;
+    pthread_once(&TOPOLOGY_ONCE, load_topology);
+#ifdef __linux__
+    if (!TOPOLOGY.num_cpus) return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int node;
+    if (mode == WORKER_AFFINITY_CORE) {
+        int i = index % TOPOLOGY.num_cpus;
+        CPU_SET(TOPOLOGY.cpus[i], &set);
+        node = TOPOLOGY.nodes[i];
+    } else {
+        node = TOPOLOGY.node_ids[index % TOPOLOGY.num_nodes];
+        for (int i=0; i < TOPOLOGY.num_cpus; i++) {
+            if (TOPOLOGY.nodes[i] == node) CPU_SET(TOPOLOGY.cpus[i], &set);
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) return -1;
+    return node;
+#else
+    (void)index;
+    return -1;
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+#include "config.h"
+
+/**
+ * The most cpus that workers are placed on
+ */
+#define AFFINITY_MAX_CPUS 1024
+
+/**
+ * Parses a list of cpus in the form of the kernel's
+ * cpulist files, such as "0-3,8,10-11".
+ * @arg list The list
+ * @arg cpus Output, the cpus in the list
+ * @arg max The most cpus to output
+ * @return The number of cpus, or -1 if the list is invalid.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max);
+
+/**
+ * Pins the calling worker thread. With core affinity, the
+ * workers take the cpus the server may run on in turn. With
+ * node affinity, the workers take the NUMA nodes in turn, and
+ * may run on any of the cpus of their node.
+ * @arg mode The placement of the workers
+ * @arg index The index of the worker
+ * @return The NUMA node of the worker, 0 if unpinned or
+ * the node is unknown, or -1 if it could not be pinned.
+ */
+int pin_worker_thread(hlld_worker_affinity mode, int index);
+
+#endif
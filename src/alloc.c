@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "alloc.h"
+#if defined(HLLD_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(HLLD_MIMALLOC)
+#include <mimalloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/**
+ * Returns the name of the allocator built in,
+ * "jemalloc", "mimalloc" or "libc"
+ */
+const char* alloc_name() {
+#if defined(HLLD_JEMALLOC)
+    return "jemalloc";
+#elif defined(HLLD_MIMALLOC)
+    return "mimalloc";
+#else
+    return "libc";
+#endif
+}
+
+#ifdef HLLD_JEMALLOC
+// The arena of each worker index, made on first use
+static pthread_mutex_t ARENAS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static unsigned *ARENAS = NULL;
+static int NUM_ARENAS = 0;
+#endif
+
+/**
+ * Has the calling thread allocate from the arena of a worker.
+ * Arenas are made on first use, and taken again by the worker
+ * of the same index, so that workers started on a reload do not
+ * pile up arenas. Allocators with arenas per thread already,
+ * such as mimalloc and glibc, are left as they are.
+ * @notes Thread safe.
+ * @arg worker The index of the worker
+ * @return 0 on success, -1 on error.
+ */
+int alloc_worker_arena(int worker) {
+#ifdef HLLD_JEMALLOC
+    if (worker < 0) return -1;
+    pthread_mutex_lock(&ARENAS_LOCK);
+    if (worker >= NUM_ARENAS) {
+        unsigned *arenas = realloc(ARENAS, (worker + 1) * sizeof(unsigned));
+        if (!arenas) {
+            pthread_mutex_unlock(&ARENAS_LOCK);
+            return -1;
+        }
+        // Arena 0 is the default one, so it marks those yet to be made
+        memset(arenas + NUM_ARENAS, 0, (worker + 1 - NUM_ARENAS) * sizeof(unsigned));
+        ARENAS = arenas;
+        NUM_ARENAS = worker + 1;
+    }
+    size_t len = sizeof(unsigned);
+    int res = 0;
+    if (!ARENAS[worker]) res = mallctl("arenas.create", ARENAS + worker, &len, NULL, 0);
+    unsigned arena = ARENAS[worker];
+    pthread_mutex_unlock(&ARENAS_LOCK);
+    if (res || mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena))) return -1;
+    return 0;
+#else
+    (void)worker;
+    return 0;
+#endif
+}
+
+// Reads the resident bytes of the process
+static uint64_t process_rss() {
+    unsigned long long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    int res = fscanf(f, "%llu %llu", &size, &resident);
+    fclose(f);
+    return (res == 2) ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+/**
+ * Reads the totals of the allocator
+ * @notes Thread safe.
+ * @arg counters Output, the totals
+ * @return 0 on success, -1 if the allocator has no stats.
+ */
+int alloc_stats(alloc_counters *counters) {
+    memset(counters, 0, sizeof(alloc_counters));
+    counters->rss = process_rss();
+
+#if defined(HLLD_JEMALLOC)
+    // The totals are only refreshed when the epoch moves
+    uint64_t epoch = 1;
+    size_t len = sizeof(epoch);
+    mallctl("epoch", &epoch, &len, &epoch, len);
+    size_t allocated, mapped;
+    len = sizeof(size_t);
+    if (mallctl("stats.allocated", &allocated, &len, NULL, 0) ||
+            mallctl("stats.mapped", &mapped, &len, NULL, 0))
+        return -1;
+    counters->allocated = allocated;
+    counters->mapped = mapped;
+    return 0;
+
+#elif defined(HLLD_MIMALLOC)
+    size_t elapsed, user, system, rss, peak_rss, commit, peak_commit, faults;
+    mi_process_info(&elapsed, &user, &system, &rss, &peak_rss, &commit, &peak_commit, &faults);
+    counters->mapped = commit;
+    return 0;
+
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    counters->allocated = info.uordblks + info.hblkhd;
+    counters->mapped = info.arena + info.hblkhd;
+    return 0;
+
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+#include <stdint.h>
+
+/*
+ * hlld allocates with malloc, which is that of the C library
+ * unless built with scons allocator=jemalloc or allocator=mimalloc,
+ * which link in the allocator in its place. The buffers of the
+ * connections are allocated by their worker, so each worker takes
+ * an arena of its own, where the allocator has them. The totals
+ * of the allocator are reported by stats.
+ */
+
+/**
+ * The totals of the allocator. Those it does not report are 0.
+ */
+typedef struct {
+    uint64_t allocated;     // Bytes allocated and not yet freed
+    uint64_t mapped;        // Bytes the allocator holds from the kernel
+    uint64_t rss;           // Bytes of the process resident in memory
+} alloc_counters;
+
+/**
+ * Returns the name of the allocator built in,
+ * "jemalloc", "mimalloc" or "libc"
+ */
+const char* alloc_name();
+
+/**
+ * Has the calling thread allocate from the arena of a worker.
+ * Arenas are made on first use, and taken again by the worker
+ * of the same index, so that workers started on a reload do not
+ * pile up arenas. Allocators with arenas per thread already,
+ * such as mimalloc and glibc, are left as they are.
+ * @notes Thread safe.
+ * @arg worker The index of the worker
+ * @return 0 on success, -1 on error.
+ */
+int alloc_worker_arena(int worker);
+
+/**
+ * Reads the totals of the allocator
+ * @notes Thread safe.
+ * @arg counters Output, the totals
+ * @return 0 on success, -1 if the allocator has no stats.
+ */
+int alloc_stats(alloc_counters *counters);
+
+#endif
@@ -0,0 +1,715 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "art.h"
+#include "type_compat.h"
+
+/*
+ * The files of the archive, numbered from 1 in the order they
+ * are created. Only the last of them takes appends.
+ */
+#define ARCHIVE_FILE_NAME "archive.%llu.data"
+static const char ARCHIVE_PREFIX[] = "archive.";
+static const char ARCHIVE_SUFFIX[] = ".data";
+
+/*
+ * Each file starts with this magic, which includes the version
+ */
+static const char ARCHIVE_MAGIC[] = "HLLDARC1";
+#define ARCHIVE_MAGIC_LEN 8
+
+/*
+ * Appends roll over to a new file once the last one is this
+ * large, so compaction never needs to copy more than it
+ */
+#define MAX_ARCHIVE_FILE (64 * 1024 * 1024)
+
+// Types of records
+#define ARCHIVE_PUT 1
+#define ARCHIVE_DROP 2
+
+/*
+ * Each record is this header, followed by the set name and its
+ * terminator, then the registers. Fields are in host byte order.
+ * The checksum covers the rest of the header and the name, so the
+ * index is rebuilt without reading the registers, which have a
+ * checksum of their own that is checked as they are read.
+ */
+typedef struct {
+    uint32_t checksum;
+    uint32_t regs_checksum;
+    uint16_t name_len;
+    uint8_t type;
+    uint8_t precision;
+    uint8_t format;
+    uint8_t sparse;
+    uint8_t estimator;
+    uint8_t hash;
+    double eps;
+    uint64_t size;
+    uint64_t regs_len;
+} archive_record;
+
+/*
+ * A file of the archive
+ */
+typedef struct {
+    unsigned long long seq;
+    int fd;
+    uint64_t len;       // Bytes of the file
+    uint64_t live;      // Bytes of the live records in it
+} archive_file;
+
+/*
+ * The live record of a set
+ */
+typedef struct {
+    archive_file *file;
+    uint64_t offset;
+    uint64_t len;       // Bytes of the whole record
+    hlld_set_config config;
+} archive_entry;
+
+struct hlld_archive {
+    char *data_dir;
+    pthread_mutex_t lock;   // Protects the index and the files
+    art_tree index;         // Maps set names -> archive_entry
+    archive_file **files;   // Oldest first
+    int num_files;
+};
+
+/*
+ * Sets copied out of the index by archive_iter
+ */
+typedef struct {
+    char **names;
+    hlld_set_config *configs;
+    int num;
+} iter_list;
+
+/* Static declarations */
+static uint32_t fnv_checksum(uint32_t hash, const unsigned char *buf, uint64_t len);
+static uint32_t record_checksum(archive_record *rec, const unsigned char *name);
+static void encode_record(archive_record *rec, int type, char *set_name,
+        hlld_set_config *config, const unsigned char *regs, uint64_t len);
+static void decode_config(archive_record *rec, hlld_set_config *config);
+static int open_file(hlld_archive *a, unsigned long long seq, int create, archive_file **file);
+static int replay_file(hlld_archive *a, archive_file *f, int last);
+static void index_record(hlld_archive *a, archive_record *rec, unsigned char *name,
+        archive_file *f, uint64_t offset);
+static int append_record(hlld_archive *a, const unsigned char *buf, uint64_t len, int sync,
+        archive_file **file, uint64_t *offset);
+static int compact_file(hlld_archive *a, archive_file *f, int has_older);
+static int write_all(int fd, const unsigned char *buf, uint64_t len, uint64_t offset);
+static int iter_collect_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int free_entry_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+
+/**
+ * Works with scandir to filter the files of the archive
+ */
+static int filter_archive_files(CONST_DIRENT_T *d) {
+    const char *name = d->d_name;
+    size_t len = strlen(name);
+    size_t prefix_len = sizeof(ARCHIVE_PREFIX) - 1;
+    size_t suffix_len = sizeof(ARCHIVE_SUFFIX) - 1;
+    if (len <= prefix_len + suffix_len) return 0;
+    return !strncmp(name, ARCHIVE_PREFIX, prefix_len) &&
+        !strcmp(name + len - suffix_len, ARCHIVE_SUFFIX);
+}
+
+/**
+ * Orders the files of the archive by their number
+ */
+static int compare_archive_files(const void *a, const void *b) {
+    unsigned long long sa = strtoull((*(struct dirent**)a)->d_name + sizeof(ARCHIVE_PREFIX) - 1, NULL, 10);
+    unsigned long long sb = strtoull((*(struct dirent**)b)->d_name + sizeof(ARCHIVE_PREFIX) - 1, NULL, 10);
+    return (sa < sb) ? -1 : (sa > sb);
+}
+
+/**
+ * Opens the archive of a data directory, and indexes
+ * its files. A record torn by a crash is truncated.
+ * The first file is only created once a set is archived.
+ * @arg data_dir The data directory
+ * @arg archive Output, the archive
+ * @return 0 on success, negative errno on failure.
+ */
+int init_archive(char *data_dir, hlld_archive **archive) {
+    struct dirent **namelist;
+    int num = scandir(data_dir, &namelist, filter_archive_files, NULL);
+    if (num < 0) return -errno;
+    if (num) qsort(namelist, num, sizeof(struct dirent*), compare_archive_files);
+
+    hlld_archive *a = calloc(1, sizeof(hlld_archive));
+    a->data_dir = strdup(data_dir);
+    pthread_mutex_init(&a->lock, NULL);
+    init_art_tree(&a->index);
+
+    int res = 0;
+    for (int i=0; i < num; i++) {
+        unsigned long long seq = strtoull(namelist[i]->d_name + sizeof(ARCHIVE_PREFIX) - 1, NULL, 10);
+        archive_file *f;
+        if (!res && !(res = open_file(a, seq, 0, &f)))
+            res = replay_file(a, f, i == num - 1);
+        free(namelist[i]);
+    }
+    free(namelist);
+    if (res) {
+        destroy_archive(a);
+        return res;
+    }
+
+    if (art_size(&a->index))
+        syslog(LOG_INFO, "Indexed %llu archived sets in %d files.",
+                (unsigned long long)art_size(&a->index), a->num_files);
+    *archive = a;
+    return 0;
+}
+
+/**
+ * Closes the archive
+ * @arg archive The archive to close
+ * @return 0 on success.
+ */
+int destroy_archive(hlld_archive *archive) {
+    art_iter(&archive->index, free_entry_cb, NULL);
+    destroy_art_tree(&archive->index);
+    for (int i=0; i < archive->num_files; i++) {
+        close(archive->files[i]->fd);
+        free(archive->files[i]);
+    }
+    free(archive->files);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive->data_dir);
+    free(archive);
+    return 0;
+}
+
+/**
+ * Appends a set to the archive, replacing any earlier record
+ * of it. The record is synced to disk before this returns, so
+ * the folder of the set may then be removed.
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @arg config The set config
+ * @arg regs The dumped registers, as produced by hset_dump
+ * @arg len The length of the registers
+ * @return 0 on success, negative errno on failure.
+ */
+int archive_put(hlld_archive *archive, char *set_name, hlld_set_config *config,
+        const unsigned char *regs, uint64_t len) {
+    size_t name_len = strlen(set_name) + 1;
+    if (name_len > UINT16_MAX) return -EINVAL;
+
+    uint64_t rec_len = sizeof(archive_record) + name_len + len;
+    unsigned char *buf = malloc(rec_len);
+    if (!buf) return -ENOMEM;
+    archive_record rec;
+    encode_record(&rec, ARCHIVE_PUT, set_name, config, regs, len);
+    memcpy(buf, &rec, sizeof(archive_record));
+    memcpy(buf + sizeof(archive_record), set_name, name_len);
+    memcpy(buf + sizeof(archive_record) + name_len, regs, len);
+
+    pthread_mutex_lock(&archive->lock);
+    archive_file *f;
+    uint64_t offset;
+    int res = append_record(archive, buf, rec_len, 1, &f, &offset);
+    if (!res) index_record(archive, &rec, (unsigned char*)set_name, f, offset);
+    pthread_mutex_unlock(&archive->lock);
+    free(buf);
+    if (res) syslog(LOG_ERR, "Failed to archive set '%s'. Err: %d", set_name, res);
+    return res;
+}
+
+/**
+ * Reads the registers of an archived set
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @arg regs Output, a malloc()'d buffer of the registers
+ * @arg len Output, the length of the registers
+ * @return 0 on success, -ENOENT if the set is not archived,
+ * or -EINVAL if its record is corrupt.
+ */
+int archive_get(hlld_archive *archive, char *set_name, unsigned char **regs, uint64_t *len) {
+    int res = 0;
+    unsigned char *buf = NULL;
+    pthread_mutex_lock(&archive->lock);
+    archive_entry *e = art_search(&archive->index, (unsigned char*)set_name, strlen(set_name)+1);
+    if (!e) {
+        res = -ENOENT;
+        goto LEAVE;
+    }
+
+    buf = malloc(e->len);
+    if (!buf) {
+        res = -ENOMEM;
+        goto LEAVE;
+    }
+    ssize_t got = pread(e->file->fd, buf, e->len, e->offset);
+    if (got != (ssize_t)e->len) {
+        res = (got < 0) ? -errno : -EINVAL;
+        goto LEAVE;
+    }
+
+    archive_record rec;
+    memcpy(&rec, buf, sizeof(archive_record));
+    unsigned char *name = buf + sizeof(archive_record);
+    unsigned char *data = name + rec.name_len;
+    if (record_checksum(&rec, name) != rec.checksum ||
+            fnv_checksum(2166136261U, data, rec.regs_len) != rec.regs_checksum) {
+        res = -EINVAL;
+        goto LEAVE;
+    }
+    *regs = malloc(rec.regs_len);
+    if (!*regs) {
+        res = -ENOMEM;
+        goto LEAVE;
+    }
+    memcpy(*regs, data, rec.regs_len);
+    *len = rec.regs_len;
+
+LEAVE:
+    pthread_mutex_unlock(&archive->lock);
+    free(buf);
+    if (res == -EINVAL) syslog(LOG_ERR, "The archived set '%s' is corrupt!", set_name);
+    return res;
+}
+
+/**
+ * Checks if a set is archived
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @return 1 if the set is archived, else 0.
+ */
+int archive_contains(hlld_archive *archive, char *set_name) {
+    pthread_mutex_lock(&archive->lock);
+    int found = art_search(&archive->index, (unsigned char*)set_name, strlen(set_name)+1) != NULL;
+    pthread_mutex_unlock(&archive->lock);
+    return found;
+}
+
+/**
+ * Appends the removal of a set to the archive
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @return 0 on success, -ENOENT if the set is not
+ * archived, or negative errno on failure.
+ */
+int archive_drop(hlld_archive *archive, char *set_name) {
+    size_t name_len = strlen(set_name) + 1;
+    if (name_len > UINT16_MAX) return -EINVAL;
+    unsigned char *buf = malloc(sizeof(archive_record) + name_len);
+    if (!buf) return -ENOMEM;
+
+    pthread_mutex_lock(&archive->lock);
+    int res = -ENOENT;
+    if (!art_search(&archive->index, (unsigned char*)set_name, name_len)) goto LEAVE;
+
+    archive_record rec;
+    encode_record(&rec, ARCHIVE_DROP, set_name, NULL, NULL, 0);
+    memcpy(buf, &rec, sizeof(archive_record));
+    memcpy(buf + sizeof(archive_record), set_name, name_len);
+    archive_file *f;
+    uint64_t offset;
+    res = append_record(archive, buf, sizeof(archive_record) + name_len, 1, &f, &offset);
+    if (!res) index_record(archive, &rec, (unsigned char*)set_name, f, offset);
+
+LEAVE:
+    pthread_mutex_unlock(&archive->lock);
+    free(buf);
+    if (res && res != -ENOENT)
+        syslog(LOG_ERR, "Failed to drop archived set '%s'. Err: %d", set_name, res);
+    return res;
+}
+
+/**
+ * Invokes a callback for each archived set. The sets are
+ * copied first, so the callback may change the archive.
+ * @arg archive The archive
+ * @arg cb The callback to invoke
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets.
+ */
+int archive_iter(hlld_archive *archive, archive_cb cb, void *data) {
+    pthread_mutex_lock(&archive->lock);
+    uint64_t num = art_size(&archive->index);
+    iter_list list = {malloc(num * sizeof(char*) + 1),
+        malloc(num * sizeof(hlld_set_config) + 1), 0};
+    art_iter(&archive->index, iter_collect_cb, &list);
+    pthread_mutex_unlock(&archive->lock);
+
+    for (int i=0; i < list.num; i++) {
+        cb(data, list.names[i], list.configs + i);
+        free(list.names[i]);
+    }
+    free(list.names);
+    free(list.configs);
+    return list.num;
+}
+
+/**
+ * Compacts the files of the archive with at least the
+ * given share of dead bytes. Their live records are copied
+ * to the newest file, and they are then deleted. The newest
+ * file is compacted into another that is started for it.
+ * @arg archive The archive
+ * @arg min_dead The share of dead bytes, between 0 and 1
+ * @arg reclaimed Output, the bytes of the deleted files, or NULL
+ * @return The number of files compacted, or negative errno.
+ */
+int archive_compact(hlld_archive *archive, double min_dead, uint64_t *reclaimed) {
+    int compacted = 0;
+    int res = 0;
+    uint64_t freed = 0;
+    pthread_mutex_lock(&archive->lock);
+
+    for (int i=0; i < archive->num_files; i++) {
+        archive_file *f = archive->files[i];
+        uint64_t dead = f->len - ARCHIVE_MAGIC_LEN - f->live;
+        if (!dead || (double)dead < min_dead * f->len) continue;
+
+        // The newest file takes the copies, so a new one is started
+        archive_file *next;
+        if (i == archive->num_files - 1 && (res = open_file(archive, f->seq + 1, 1, &next)))
+            break;
+
+        // Tombstones are only needed while older files remain
+        res = compact_file(archive, f, i > 0);
+        if (res) break;
+
+        // The copies must be durable before the file is deleted
+        archive_file *last = archive->files[archive->num_files - 1];
+        if (fdatasync(last->fd)) {
+            res = -errno;
+            break;
+        }
+        char *name;
+        if (asprintf(&name, ARCHIVE_FILE_NAME, f->seq) == -1) {
+            res = -ENOMEM;
+            break;
+        }
+        char *path = join_path(archive->data_dir, name);
+        free(name);
+        if (unlink(path)) syslog(LOG_ERR, "Failed to delete: %s. %s", path, strerror(errno));
+        free(path);
+
+        freed += f->len;
+        close(f->fd);
+        free(f);
+        memmove(archive->files + i, archive->files + i + 1,
+                (archive->num_files - i - 1) * sizeof(archive_file*));
+        archive->num_files--;
+        compacted++;
+        i--;
+    }
+    pthread_mutex_unlock(&archive->lock);
+
+    if (res) syslog(LOG_ERR, "Failed to compact the archive. Err: %d", res);
+    if (reclaimed) *reclaimed = freed;
+    return (res && !compacted) ? res : compacted;
+}
+
+/**
+ * Returns the sizes of the archive
+ * @arg archive The archive
+ * @arg sets Output, the number of archived sets
+ * @arg bytes Output, the bytes of the files
+ * @arg dead Output, the bytes of dead records among them
+ */
+void archive_usage(hlld_archive *archive, uint64_t *sets, uint64_t *bytes, uint64_t *dead) {
+    pthread_mutex_lock(&archive->lock);
+    *sets = art_size(&archive->index);
+    *bytes = 0;
+    *dead = 0;
+    for (int i=0; i < archive->num_files; i++) {
+        *bytes += archive->files[i]->len;
+        *dead += archive->files[i]->len - ARCHIVE_MAGIC_LEN - archive->files[i]->live;
+    }
+    pthread_mutex_unlock(&archive->lock);
+}
+
+/**
+ * Continues a FNV-1a checksum over a buffer
+ */
+static uint32_t fnv_checksum(uint32_t hash, const unsigned char *buf, uint64_t len) {
+    for (uint64_t i=0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Computes the checksum of the header and name of a record
+ */
+static uint32_t record_checksum(archive_record *rec, const unsigned char *name) {
+    uint32_t hash = fnv_checksum(2166136261U, (const unsigned char*)rec + sizeof(uint32_t),
+            sizeof(archive_record) - sizeof(uint32_t));
+    return fnv_checksum(hash, name, rec->name_len);
+}
+
+/**
+ * Fills in a record for a set, including its checksums
+ */
+static void encode_record(archive_record *rec, int type, char *set_name,
+        hlld_set_config *config, const unsigned char *regs, uint64_t len) {
+    memset(rec, 0, sizeof(archive_record));
+    rec->name_len = strlen(set_name) + 1;
+    rec->type = type;
+    if (config) {
+        rec->precision = config->default_precision;
+        rec->format = config->format;
+        rec->sparse = config->sparse;
+        rec->estimator = config->estimator;
+        rec->hash = config->hash;
+        rec->eps = config->default_eps;
+        rec->size = config->size;
+    }
+    rec->regs_len = len;
+    rec->regs_checksum = fnv_checksum(2166136261U, regs, len);
+    rec->checksum = record_checksum(rec, (unsigned char*)set_name);
+}
+
+/**
+ * Decodes the set config of a record. Only persistent sets
+ * without windows are archived.
+ */
+static void decode_config(archive_record *rec, hlld_set_config *config) {
+    memset(config, 0, sizeof(hlld_set_config));
+    config->default_eps = rec->eps;
+    config->default_precision = rec->precision;
+    config->format = rec->format;
+    config->sparse = rec->sparse;
+    config->estimator = rec->estimator;
+    config->hash = rec->hash;
+    config->size = rec->size;
+}
+
+/**
+ * Opens a file of the archive, and adds it as the newest.
+ * New files are created with the magic.
+ */
+static int open_file(hlld_archive *a, unsigned long long seq, int create, archive_file **file) {
+    char *name;
+    if (asprintf(&name, ARCHIVE_FILE_NAME, seq) == -1) return -ENOMEM;
+    char *path = join_path(a->data_dir, name);
+    free(name);
+    int fd = open(path, (create) ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0644);
+    free(path);
+    if (fd < 0) return -errno;
+
+    int res = 0;
+    uint64_t size = ARCHIVE_MAGIC_LEN;
+    struct stat buf;
+    if (create)
+        res = write_all(fd, (const unsigned char*)ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN, 0);
+    else if (fstat(fd, &buf))
+        res = -errno;
+    else
+        size = buf.st_size;
+    archive_file **files = realloc(a->files, (a->num_files + 1) * sizeof(archive_file*));
+    if (!res && !files) res = -ENOMEM;
+    if (res) {
+        close(fd);
+        return res;
+    }
+
+    archive_file *f = calloc(1, sizeof(archive_file));
+    f->seq = seq;
+    f->fd = fd;
+    f->len = size;
+    a->files = files;
+    a->files[a->num_files++] = f;
+    *file = f;
+    return 0;
+}
+
+/**
+ * Indexes the records of a file. Only the headers and names
+ * are read. A torn record at the end of the newest file is
+ * truncated, so appends follow the last whole record.
+ */
+static int replay_file(hlld_archive *a, archive_file *f, int last) {
+    uint64_t len = f->len;
+    if (len < ARCHIVE_MAGIC_LEN) goto TORN;
+    unsigned char *file = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (file == MAP_FAILED) return -errno;
+    if (memcmp(file, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN)) {
+        munmap(file, len);
+        syslog(LOG_ERR, "Archive file %llu is not an archive!", f->seq);
+        return -EINVAL;
+    }
+
+    archive_record rec;
+    uint64_t offset = ARCHIVE_MAGIC_LEN;
+    while (offset < len) {
+        if (len - offset < sizeof(archive_record)) break;
+        memcpy(&rec, file + offset, sizeof(archive_record));
+        unsigned char *name = file + offset + sizeof(archive_record);
+        uint64_t left = len - offset - sizeof(archive_record);
+        if (left < rec.name_len || left - rec.name_len < rec.regs_len || !rec.name_len ||
+                name[rec.name_len - 1] || record_checksum(&rec, name) != rec.checksum ||
+                (rec.type != ARCHIVE_PUT && rec.type != ARCHIVE_DROP))
+            break;
+        index_record(a, &rec, name, f, offset);
+        offset += sizeof(archive_record) + rec.name_len + rec.regs_len;
+    }
+    munmap(file, len);
+    if (offset == len) return 0;
+
+    // Older files are never appended to, so a bad record is corruption
+    if (!last) {
+        syslog(LOG_ERR, "Archive file %llu is corrupt after %llu bytes!", f->seq,
+                (unsigned long long)offset);
+        return 0;
+    }
+    len = offset;
+
+TORN:
+    syslog(LOG_WARNING, "Truncating torn record of archive file %llu.", f->seq);
+    if (len < ARCHIVE_MAGIC_LEN) {
+        len = ARCHIVE_MAGIC_LEN;
+        if (write_all(f->fd, (const unsigned char*)ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN, 0)) return -EIO;
+    }
+    if (ftruncate(f->fd, len)) return -errno;
+    f->len = len;
+    return 0;
+}
+
+/**
+ * Applies a record to the index, and the accounting of
+ * the live bytes of the files. Must hold the lock.
+ */
+static void index_record(hlld_archive *a, archive_record *rec, unsigned char *name,
+        archive_file *f, uint64_t offset) {
+    (void)a;
+    archive_entry *old;
+    if (rec->type == ARCHIVE_PUT) {
+        archive_entry *e = malloc(sizeof(archive_entry));
+        e->file = f;
+        e->offset = offset;
+        e->len = sizeof(archive_record) + rec->name_len + rec->regs_len;
+        decode_config(rec, &e->config);
+        f->live += e->len;
+        old = art_insert(&a->index, name, rec->name_len, e);
+    } else {
+        old = art_delete(&a->index, name, rec->name_len);
+    }
+    if (old) {
+        old->file->live -= old->len;
+        free(old);
+    }
+}
+
+/**
+ * Appends a whole record to the newest file, starting a new
+ * one if there is none, or it is full. Must hold the lock.
+ */
+static int append_record(hlld_archive *a, const unsigned char *buf, uint64_t len, int sync,
+        archive_file **file, uint64_t *offset) {
+    archive_file *f = (a->num_files) ? a->files[a->num_files - 1] : NULL;
+    if (!f || f->len >= MAX_ARCHIVE_FILE) {
+        int res = open_file(a, (f) ? f->seq + 1 : 1, 1, &f);
+        if (res) return res;
+    }
+
+    int res = write_all(f->fd, buf, len, f->len);
+    if (!res && sync && fdatasync(f->fd)) res = -errno;
+    if (res) {
+        // Drop any partial record, so the next append follows the last whole one
+        if (ftruncate(f->fd, f->len))
+            syslog(LOG_ERR, "Failed to truncate archive file %llu. %s", f->seq, strerror(errno));
+        return res;
+    }
+    *file = f;
+    *offset = f->len;
+    f->len += len;
+    return 0;
+}
+
+/**
+ * Copies the live records of a file to the newest one,
+ * along with the tombstones that may still hide a record
+ * of an older file. Must hold the lock.
+ */
+static int compact_file(hlld_archive *a, archive_file *f, int has_older) {
+    uint64_t len = f->len;
+    unsigned char *file = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (file == MAP_FAILED) return -errno;
+    madvise(file, len, MADV_SEQUENTIAL);
+
+    int res = 0;
+    archive_record rec;
+    uint64_t offset = ARCHIVE_MAGIC_LEN;
+    while (!res && len - offset >= sizeof(archive_record)) {
+        memcpy(&rec, file + offset, sizeof(archive_record));
+        unsigned char *name = file + offset + sizeof(archive_record);
+        uint64_t rec_len = sizeof(archive_record) + rec.name_len + rec.regs_len;
+        if (rec_len > len - offset) break;
+
+        archive_entry *e = art_search(&a->index, name, rec.name_len);
+        archive_file *to;
+        uint64_t to_offset;
+        if (rec.type == ARCHIVE_PUT && e && e->file == f && e->offset == offset) {
+            res = append_record(a, file + offset, rec_len, 0, &to, &to_offset);
+            if (!res) {
+                f->live -= e->len;
+                to->live += e->len;
+                e->file = to;
+                e->offset = to_offset;
+            }
+        } else if (rec.type == ARCHIVE_DROP && has_older && !e) {
+            res = append_record(a, file + offset, rec_len, 0, &to, &to_offset);
+        }
+        offset += rec_len;
+    }
+    munmap(file, len);
+    return res;
+}
+
+/**
+ * Writes a whole buffer at an offset, retrying short writes
+ */
+static int write_all(int fd, const unsigned char *buf, uint64_t len, uint64_t offset) {
+    uint64_t total = 0;
+    while (total < len) {
+        ssize_t written = pwrite(fd, buf + total, len - total, offset + total);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        total += written;
+    }
+    return 0;
+}
+
+/**
+ * Copies the name and set config of each archived set
+ */
+static int iter_collect_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    iter_list *list = data;
+    archive_entry *e = value;
+    list->names[list->num] = strdup((char*)key);
+    list->configs[list->num++] = e->config;
+    return 0;
+}
+
+/**
+ * Frees an entry of the index
+ */
+static int free_entry_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    free(value);
+    return 0;
+}
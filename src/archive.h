@@ -0,0 +1,119 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * The archive packs sets that have not been written for long
+ * into a few large append-only files in the data directory,
+ * instead of a folder and files of their own for each. A record
+ * holds the set config and the encoded registers of a set, and
+ * a drop appends a tombstone. An index of the live records is
+ * rebuilt from the files on start.
+ *
+ * Appends go to the newest file, until it grows past a limit.
+ * Records replaced or dropped are dead, and compaction copies
+ * the live records out of the files that are mostly dead, then
+ * deletes them.
+ */
+typedef struct hlld_archive hlld_archive;
+
+/**
+ * Callback invoked for each archived set
+ * @arg data Opaque pointer passed to archive_iter
+ * @arg set_name The name of the set
+ * @arg config The set config of the set
+ */
+typedef void(*archive_cb)(void *data, char *set_name, hlld_set_config *config);
+
+/**
+ * Opens the archive of a data directory, and indexes
+ * its files. A record torn by a crash is truncated.
+ * The first file is only created once a set is archived.
+ * @arg data_dir The data directory
+ * @arg archive Output, the archive
+ * @return 0 on success, negative errno on failure.
+ */
+int init_archive(char *data_dir, hlld_archive **archive);
+
+/**
+ * Closes the archive
+ * @arg archive The archive to close
+ * @return 0 on success.
+ */
+int destroy_archive(hlld_archive *archive);
+
+/**
+ * Appends a set to the archive, replacing any earlier record
+ * of it. The record is synced to disk before this returns, so
+ * the folder of the set may then be removed.
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @arg config The set config
+ * @arg regs The dumped registers, as produced by hset_dump
+ * @arg len The length of the registers
+ * @return 0 on success, negative errno on failure.
+ */
+int archive_put(hlld_archive *archive, char *set_name, hlld_set_config *config,
+        const unsigned char *regs, uint64_t len);
+
+/**
+ * Reads the registers of an archived set
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @arg regs Output, a malloc()'d buffer of the registers
+ * @arg len Output, the length of the registers
+ * @return 0 on success, -ENOENT if the set is not archived,
+ * or -EINVAL if its record is corrupt.
+ */
+int archive_get(hlld_archive *archive, char *set_name, unsigned char **regs, uint64_t *len);
+
+/**
+ * Checks if a set is archived
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @return 1 if the set is archived, else 0.
+ */
+int archive_contains(hlld_archive *archive, char *set_name);
+
+/**
+ * Appends the removal of a set to the archive
+ * @arg archive The archive
+ * @arg set_name The name of the set
+ * @return 0 on success, -ENOENT if the set is not
+ * archived, or negative errno on failure.
+ */
+int archive_drop(hlld_archive *archive, char *set_name);
+
+/**
+ * Invokes a callback for each archived set. The sets are
+ * copied first, so the callback may change the archive.
+ * @arg archive The archive
+ * @arg cb The callback to invoke
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets.
+ */
+int archive_iter(hlld_archive *archive, archive_cb cb, void *data);
+
+/**
+ * Compacts the files of the archive with at least the
+ * given share of dead bytes. Their live records are copied
+ * to the newest file, and they are then deleted. The newest
+ * file is compacted into another that is started for it.
+ * @arg archive The archive
+ * @arg min_dead The share of dead bytes, between 0 and 1
+ * @arg reclaimed Output, the bytes of the deleted files, or NULL
+ * @return The number of files compacted, or negative errno.
+ */
+int archive_compact(hlld_archive *archive, double min_dead, uint64_t *reclaimed);
+
+/**
+ * Returns the sizes of the archive
+ * @arg archive The archive
+ * @arg sets Output, the number of archived sets
+ * @arg bytes Output, the bytes of the files
+ * @arg dead Output, the bytes of dead records among them
+ */
+void archive_usage(hlld_archive *archive, uint64_t *sets, uint64_t *bytes, uint64_t *dead);
+
+#endif
@@ -2,8 +2,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
-#include <emmintrin.h>
 #include <assert.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "art.h"
 
 /**
@@ -14,108 +18,287 @@
 #define LEAF_RAW(x) ((void*)((uintptr_t)x & ~1))
 
 /**
- * Allocates a node of the given type,
- * initializes to zero and sets the type.
+ * Readers load the root once, pairing with the
+ * release store that publishes a copy-on-write batch
+ */
+#define LOAD_ROOT(t) ((art_node*)__atomic_load_n(&(t)->root, __ATOMIC_ACQUIRE))
+
+/**
+ * Nodes start on a cache line, so the header and keys read
+ * at each step of a search share a line. A node4 fits in one.
+ */
+#define NODE_ALIGN 64
+
+/**
+ * The bytes of each pool chunk, and the size classes
+ * of a pool. Each class is a multiple of the quantum
+ * of the pool, larger allocations are made one by one.
+ */
+#define POOL_CHUNK (64 * 1024)
+#define POOL_CLASSES 40
+
+/**
+ * The quantum of the node pools keeps nodes on a cache
+ * line, the leaf pools pack leaves by their key length.
+ */
+#define NODE_QUANTUM NODE_ALIGN
+#define LEAF_QUANTUM 16
+
+/**
+ * Header of an allocation above the size classes
+ */
+typedef struct pool_large {
+    struct pool_large *prev;
+    struct pool_large *next;
+} pool_large;
+
+/**
+ * Carves the nodes or leaves of trees out of chunks,
+ * with a free list of each size class. Freed memory is
+ * only reused by the pool, and all of it is released
+ * with the pool, without a walk of the trees.
+ */
+struct art_pool {
+    size_t quantum;             // Bytes of each step of the classes
+    void *free[POOL_CLASSES];   // Free list of each class
+    void *chunks;               // Chunks, linked by their first word
+    char *bump;                 // Next unused byte of the newest chunk
+    char *end;                  // End of the newest chunk
+    pool_large *large;          // Allocations above the classes
+    int refs;                   // Trees using the pool
+    volatile int lock;          // Held while a shared pool changes
+};
+
+static art_pool* new_pool(size_t quantum) {
+    art_pool *p = calloc(1, sizeof(art_pool));
+    if (!p) return NULL;
+    p->quantum = quantum;
+    p->refs = 1;
+    return p;
+}
+
+static void* pool_alloc(art_pool *p, size_t size) {
+    size_t cls = (size + p->quantum - 1) / p->quantum;
+    if (cls >= POOL_CLASSES) {
+        pool_large *h = malloc(sizeof(pool_large) + size);
+        if (!h) abort();
+        h->prev = NULL;
+        h->next = p->large;
+        if (p->large) p->large->prev = h;
+        p->large = h;
+        return h + 1;
+    }
+
+    // Reuse a freed allocation of the class
+    void *ptr = p->free[cls];
+    if (ptr) {
+        p->free[cls] = *(void**)ptr;
+        return ptr;
+    }
+
+    // Carve from the newest chunk, starting another when it is full.
+    // The header of a chunk takes a cache line to keep the alignment.
+    size = cls * p->quantum;
+    if (!p->bump || p->bump + size > p->end) {
+        void *chunk;
+        if (posix_memalign(&chunk, NODE_ALIGN, POOL_CHUNK)) abort();
+        *(void**)chunk = p->chunks;
+        p->chunks = chunk;
+        p->bump = (char*)chunk + NODE_ALIGN;
+        p->end = (char*)chunk + POOL_CHUNK;
+    }
+    ptr = p->bump;
+    p->bump += size;
+    return ptr;
+}
+
+static void pool_free(art_pool *p, void *ptr, size_t size) {
+    size_t cls = (size + p->quantum - 1) / p->quantum;
+    if (cls >= POOL_CLASSES) {
+        pool_large *h = (pool_large*)ptr - 1;
+        if (h->prev) h->prev->next = h->next;
+        else p->large = h->next;
+        if (h->next) h->next->prev = h->prev;
+        free(h);
+        return;
+    }
+    *(void**)ptr = p->free[cls];
+    p->free[cls] = ptr;
+}
+
+/**
+ * Drops a reference to a pool, releasing all
+ * of its memory with the last reference.
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
+static void release_pool(art_pool *p) {
+    if (!p || __sync_sub_and_fetch(&p->refs, 1)) return;
+    void *chunk = p->chunks;
+    while (chunk) {
+        void *next = *(void**)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    pool_large *h = p->large;
+    while (h) {
+        pool_large *next = h->next;
+        free(h);
+        h = next;
+    }
+    free(p);
+}
+
+static size_t node_size(uint8_t type) {
     switch (type) {
         case NODE4:
-            n = calloc(1, sizeof(art_node4));
-            break;
+            return sizeof(art_node4);
         case NODE16:
-            n = calloc(1, sizeof(art_node16));
-            break;
+            return sizeof(art_node16);
         case NODE48:
-            n = calloc(1, sizeof(art_node48));
-            break;
+            return sizeof(art_node48);
         case NODE256:
-            n = calloc(1, sizeof(art_node256));
-            break;
+            return sizeof(art_node256);
         default:
             abort();
     }
-    n->type = type;
-    return n;
 }
 
 /**
- * Initializes an ART tree
- * @return 0 on success.
+ * Allocates a node of the given type,
+ * initializes to zero and sets the type.
  */
-int init_art_tree(art_tree *t) {
-    t->root = NULL;
-    t->size = 0;
-    return 0;
+static art_node* alloc_node(art_tree *t, uint8_t type) {
+    size_t size = node_size(type);
+    void *n = pool_alloc(t->nodes, size);
+    memset(n, 0, size);
+    ((art_node*)n)->type = type;
+    return n;
 }
 
-// Recursively destroys the tree
-static void destroy_node(art_node *n) {
-    // Break if null
-    if (!n) return;
+static void free_node(art_tree *t, art_node *n) {
+    pool_free(t->nodes, n, node_size(n->type));
+}
 
-    // Special case leafs
-    if (IS_LEAF(n)) {
-        // Only release the leaf if the ref count hits zero
-        art_leaf *l = LEAF_RAW(n);
-        int ref = __sync_sub_and_fetch(&l->ref_count, 1);
-        if (!ref)
-            free(l);
-        return;
+/**
+ * Adds a node or a tagged leaf to the
+ * retired list of a copy-on-write batch
+ */
+static void retire(art_cow *cow, void *n) {
+    if (cow->num_retired == cow->max_retired) {
+        cow->max_retired = (cow->max_retired) ? cow->max_retired * 2 : 16;
+        cow->retired = realloc(cow->retired, cow->max_retired * sizeof(void*));
     }
+    cow->retired[cow->num_retired++] = n;
+}
 
-    // Handle each node type
-    int i;
-    union {
-        art_node4 *p1;
-        art_node16 *p2;
-        art_node48 *p3;
-        art_node256 *p4;
-    } p;
-    switch (n->type) {
-        case NODE4:
-            p.p1 = (art_node4*)n;
-            for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p1->children[i]);
-            }
-            break;
+/**
+ * Copies a node for a copy-on-write batch,
+ * retiring the original, which readers keep
+ */
+static art_node* copy_node(art_tree *t, art_cow *cow, art_node *n) {
+    size_t size = node_size(n->type);
+    art_node *copy = pool_alloc(t->nodes, size);
+    memcpy(copy, n, size);
+    retire(cow, n);
+    return copy;
+}
 
-        case NODE16:
-            p.p2 = (art_node16*)n;
-            for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p2->children[i]);
-            }
-            break;
+/**
+ * The leaf pool is shared by the copies of a tree,
+ * so it is locked while allocating and freeing.
+ */
+static art_leaf* alloc_leaf(art_tree *t, int key_len) {
+    art_pool *p = t->leaves;
+    while (__sync_lock_test_and_set(&p->lock, 1)) ;
+    art_leaf *l = pool_alloc(p, sizeof(art_leaf)+key_len);
+    __sync_lock_release(&p->lock);
+    return l;
+}
 
-        case NODE48:
-            p.p3 = (art_node48*)n;
-            for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p3->children[i]);
-            }
-            break;
+static void free_leaf(art_tree *t, art_leaf *l) {
+    art_pool *p = t->leaves;
+    while (__sync_lock_test_and_set(&p->lock, 1)) ;
+    pool_free(p, l, sizeof(art_leaf)+l->key_len);
+    __sync_lock_release(&p->lock);
+}
 
-        case NODE256:
-            p.p4 = (art_node256*)n;
-            for (i=0;i<256;i++) {
-                if (p.p4->children[i])
-                    destroy_node(p.p4->children[i]);
-            }
-            break;
+/**
+ * Returns a bitfield of the keys of a node16 equal to a
+ * byte, one bit per key, ignoring the unused keys.
+ */
+static inline unsigned node16_equal(art_node16 *n, unsigned char c) {
+    unsigned mask = (1 << n->n.num_children) - 1;
+#if defined(__SSE2__)
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
+            _mm_loadu_si128((__m128i*)n->keys));
+    return _mm_movemask_epi8(cmp) & mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t cmp = vandq_u8(vceqq_u8(vdupq_n_u8(c), vld1q_u8(n->keys)), vld1q_u8(bits));
+    return (vaddv_u8(vget_low_u8(cmp)) | (vaddv_u8(vget_high_u8(cmp)) << 8)) & mask;
+#else
+    unsigned bitfield = 0;
+    for (int i=0; i < 16; i++)
+        if (n->keys[i] == c) bitfield |= 1 << i;
+    return bitfield & mask;
+#endif
+}
 
-        default:
-            abort();
-    }
+/**
+ * Returns a bitfield of the keys of a node16 greater than
+ * a byte, one bit per key, ignoring the unused keys. The
+ * keys are unsigned, so that children are kept in the
+ * order of the bytes of their keys.
+ */
+static inline unsigned node16_greater(art_node16 *n, unsigned char c) {
+    unsigned mask = (1 << n->n.num_children) - 1;
+#if defined(__SSE2__)
+    // SSE2 only compares signed bytes, so flip the sign bits
+    __m128i flip = _mm_set1_epi8((char)0x80);
+    __m128i cmp = _mm_cmplt_epi8(_mm_xor_si128(_mm_set1_epi8(c), flip),
+            _mm_xor_si128(_mm_loadu_si128((__m128i*)n->keys), flip));
+    return _mm_movemask_epi8(cmp) & mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t cmp = vandq_u8(vcltq_u8(vdupq_n_u8(c), vld1q_u8(n->keys)), vld1q_u8(bits));
+    return (vaddv_u8(vget_low_u8(cmp)) | (vaddv_u8(vget_high_u8(cmp)) << 8)) & mask;
+#else
+    unsigned bitfield = 0;
+    for (int i=0; i < 16; i++)
+        if (n->keys[i] > c) bitfield |= 1 << i;
+    return bitfield & mask;
+#endif
+}
 
-    // Free ourself on the way up
-    free(n);
+/**
+ * Initializes an ART tree
+ * @return 0 on success.
+ */
+int init_art_tree(art_tree *t) {
+    t->root = NULL;
+    t->size = 0;
+    t->nodes = new_pool(NODE_QUANTUM);
+    t->leaves = new_pool(LEAF_QUANTUM);
+    if (!t->nodes || !t->leaves) {
+        release_pool(t->nodes);
+        release_pool(t->leaves);
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * Destroys an ART tree
+ * Destroys an ART tree. The nodes are released with the
+ * chunks of the pool of the tree, and the leaves with the
+ * leaf pool once every copy sharing it is destroyed.
  * @return 0 on success.
  */
 int destroy_art_tree(art_tree *t) {
-    destroy_node(t->root);
+    release_pool(t->nodes);
+    release_pool(t->leaves);
+    t->root = NULL;
+    t->size = 0;
+    t->nodes = NULL;
+    t->leaves = NULL;
     return 0;
 }
 
@@ -125,7 +308,8 @@ int destroy_art_tree(art_tree *t) {
 extern inline uint64_t art_size(art_tree *t);
 
 static art_node** find_child(art_node *n, unsigned char c) {
-    int i, mask, bitfield;
+    int i;
+    unsigned bitfield;
     union {
         art_node4 *p1;
         art_node16 *p2;
@@ -141,18 +325,11 @@ static art_node** find_child(art_node *n, unsigned char c) {
             }
             break;
 
-        {
-        __m128i cmp;
         case NODE16:
             p.p2 = (art_node16*)n;
 
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)p.p2->keys));
-
-            // Use a mask to ignore children that don't exist
-            mask = (1 << n->num_children) - 1;
-            bitfield = _mm_movemask_epi8(cmp) & mask;
+            // Compare the key to all 16 stored keys at once
+            bitfield = node16_equal(p.p2, c);
 
             /*
              * If we have a match (any bit set) then we can
@@ -162,7 +339,6 @@ static art_node** find_child(art_node *n, unsigned char c) {
             if (bitfield)
                 return &p.p2->children[__builtin_ctz(bitfield)];
             break;
-        }
 
         case NODE48:
             p.p3 = (art_node48*)n;
@@ -215,17 +391,9 @@ static int leaf_matches(art_leaf *n, unsigned char *key, int key_len, int depth)
     return memcmp(n->key, key, key_len);
 }
 
-/**
- * Searches for a value in the ART tree
- * @arg t The tree
- * @arg key The key
- * @arg key_len The length of the key
- * @return NULL if the item was not found, otherwise
- * the value pointer is returned.
- */
-void* art_search(art_tree *t, unsigned char *key, int key_len) {
+// Searches for a value under a node
+static void* search_node(art_node *n, unsigned char *key, int key_len) {
     art_node **child;
-    art_node *n = t->root;
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
@@ -254,6 +422,18 @@ void* art_search(art_tree *t, unsigned char *key, int key_len) {
     return NULL;
 }
 
+/**
+ * Searches for a value in the ART tree
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search(art_tree *t, unsigned char *key, int key_len) {
+    return search_node(LOAD_ROOT(t), key, key_len);
+}
+
 // Find the minimum leaf under a node
 static art_leaf* minimum(art_node *n) {
     // Handle base cases
@@ -310,18 +490,18 @@ static art_leaf* maximum(art_node *n) {
  * Returns the minimum valued leaf
  */
 art_leaf* art_minimum(art_tree *t) {
-    return minimum((art_node*)t->root);
+    return minimum(LOAD_ROOT(t));
 }
 
 /**
  * Returns the maximum valued leaf
  */
 art_leaf* art_maximum(art_tree *t) {
-    return maximum((art_node*)t->root);
+    return maximum(LOAD_ROOT(t));
 }
 
-static art_leaf* make_leaf(unsigned char *key, int key_len, void *value) {
-    art_leaf *l = malloc(sizeof(art_leaf)+key_len);
+static art_leaf* make_leaf(art_tree *t, unsigned char *key, int key_len, void *value) {
+    art_leaf *l = alloc_leaf(t, key_len);
     l->ref_count = 1;
     l->value = value;
     l->key_len = key_len;
@@ -345,13 +525,14 @@ static void copy_header(art_node *dest, art_node *src) {
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c, void *child) {
+    (void)t;
     (void)ref;
     n->n.num_children++;
     n->children[c] = child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
         int pos = 0;
         while (n->children[pos]) pos++;
@@ -359,7 +540,7 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         n->keys[c] = pos + 1;
         n->n.num_children++;
     } else {
-        art_node256 *new = (art_node256*)alloc_node(NODE256);
+        art_node256 *new = (art_node256*)alloc_node(t, NODE256);
         for (int i=0;i<256;i++) {
             if (n->keys[i]) {
                 new->children[i] = n->children[n->keys[i] - 1];
@@ -367,22 +548,15 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child256(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child256(t, new, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
-        __m128i cmp;
-
-        // Compare the key to all 16 stored keys
-        cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                _mm_loadu_si128((__m128i*)n->keys));
-
-        // Use a mask to ignore children that don't exist
-        unsigned mask = (1 << n->n.num_children) - 1;
-        unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
+        // Compare the key to all 16 stored keys at once
+        unsigned bitfield = node16_greater(n, c);
 
         // Check if less than any
         unsigned idx;
@@ -400,7 +574,7 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         n->n.num_children++;
 
     } else {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
 
         // Copy the child pointers and populate the key map
         memcpy(new->children, n->children,
@@ -410,12 +584,12 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child48(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child48(t, new, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
         for (idx=0; idx < n->n.num_children; idx++) {
@@ -433,7 +607,7 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
         n->n.num_children++;
 
     } else {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
 
         // Copy the child pointers and the key map
         memcpy(new->children, n->children,
@@ -442,21 +616,21 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
                 sizeof(unsigned char)*n->n.num_children);
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child16(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child16(t, new, ref, c, child);
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+static void add_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, void *child) {
     switch (n->type) {
         case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
+            return add_child4(t, (art_node4*)n, ref, c, child);
         case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
+            return add_child16(t, (art_node16*)n, ref, c, child);
         case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
+            return add_child48(t, (art_node48*)n, ref, c, child);
         case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
+            return add_child256(t, (art_node256*)n, ref, c, child);
         default:
             abort();
     }
@@ -486,10 +660,10 @@ static int prefix_mismatch(art_node *n, unsigned char *key, int key_len, int dep
     return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
+static void* recursive_insert(art_tree *t, art_cow *cow, art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
     // If we are at a NULL node, inject a leaf
     if (!n) {
-        *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+        *ref = (art_node*)SET_LEAF(make_leaf(t, key, key_len, value));
         return NULL;
     }
 
@@ -501,15 +675,19 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         if (!leaf_matches(l, key, key_len, depth)) {
             *old = 1;
             void *old_val = l->value;
-            l->value = value;
+            if (cow) {
+                *ref = (art_node*)SET_LEAF(make_leaf(t, key, key_len, value));
+                retire(cow, n);
+            } else
+                l->value = value;
             return old_val;
         }
 
         // New value, we must split the leaf into a node4
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
 
         // Create a new leaf
-        art_leaf *l2 = make_leaf(key, key_len, value);
+        art_leaf *l2 = make_leaf(t, key, key_len, value);
 
         // Determine longest prefix
         int longest_prefix = longest_common_prefix(l, l2, depth);
@@ -517,11 +695,14 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         memcpy(new->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
         // Add the leafs to the new node4
         *ref = (art_node*)new;
-        add_child4(new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-        add_child4(new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
+        add_child4(t, new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
+        add_child4(t, new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
         return NULL;
     }
 
+    // Change a copy of the node, the readers keep the original
+    if (cow) *ref = n = copy_node(t, cow, n);
+
     // Check if given node has a prefix
     if (n->partial_len) {
         // Determine if the prefixes differ, since we need to split
@@ -532,28 +713,28 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // Create a new node
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         new->n.partial_len = prefix_diff;
         memcpy(new->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
 
         // Adjust the prefix of the old node
         if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new, ref, n->partial[prefix_diff], n);
+            add_child4(t, new, ref, n->partial[prefix_diff], n);
             n->partial_len -= (prefix_diff+1);
             memmove(n->partial, n->partial+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         } else {
             n->partial_len -= (prefix_diff+1);
             art_leaf *l = minimum(n);
-            add_child4(new, ref, l->key[depth+prefix_diff], n);
+            add_child4(t, new, ref, l->key[depth+prefix_diff], n);
             memcpy(n->partial, l->key+depth+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         }
 
         // Insert the new leaf
-        art_leaf *l = make_leaf(key, key_len, value);
-        add_child4(new, ref, key[depth+prefix_diff], SET_LEAF(l));
+        art_leaf *l = make_leaf(t, key, key_len, value);
+        add_child4(t, new, ref, key[depth+prefix_diff], SET_LEAF(l));
         return NULL;
     }
 
@@ -562,12 +743,12 @@ RECURSE_SEARCH:;
     // Find a child to recurse to
     art_node **child = find_child(n, key[depth]);
     if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old);
+        return recursive_insert(t, cow, *child, child, key, key_len, value, depth+1, old);
     }
 
     // No child, node goes within us
-    art_leaf *l = make_leaf(key, key_len, value);
-    add_child(n, ref, key[depth], SET_LEAF(l));
+    art_leaf *l = make_leaf(t, key, key_len, value);
+    add_child(t, n, ref, key[depth], SET_LEAF(l));
     return NULL;
 }
 
@@ -582,19 +763,98 @@ RECURSE_SEARCH:;
  */
 void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value) {
     int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val);
+    void *old = recursive_insert(t, NULL, t->root, &t->root, key, key_len, value, 0, &old_val);
     if (!old_val) t->size++;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
+// Builds the subtree of a run of sorted keys, which share their first depth bytes
+static art_node* bulk_build(art_tree *t, unsigned char **keys, int *key_lens, void **values, int n, int depth) {
+    if (n == 1) return SET_LEAF(make_leaf(t, keys[0], key_lens[0], values[0]));
+
+    // The keys are sorted, so the first and last share the prefix of all
+    unsigned char *first = keys[0], *last = keys[n-1];
+    int max_cmp = min(key_lens[0], key_lens[n-1]);
+    int prefix = 0;
+    while (depth + prefix < max_cmp && first[depth+prefix] == last[depth+prefix]) prefix++;
+
+    // Each distinct byte after the prefix is a child
+    int pos = depth + prefix;
+    int num = 1;
+    for (int i=1; i < n; i++) {
+        if (keys[i][pos] != keys[i-1][pos]) num++;
+    }
+    uint8_t type = NODE256;
+    if (num <= 4) type = NODE4;
+    else if (num <= 16) type = NODE16;
+    else if (num <= 48) type = NODE48;
+
+    art_node *node = alloc_node(t, type);
+    node->partial_len = prefix;
+    memcpy(node->partial, first+depth, min(MAX_PREFIX_LEN, prefix));
+
+    int start = 0, child = 0;
+    for (int i=1; i <= n; i++) {
+        if (i < n && keys[i][pos] == keys[start][pos]) continue;
+        unsigned char c = keys[start][pos];
+        art_node *sub = bulk_build(t, keys+start, key_lens+start, values+start, i-start, pos+1);
+        switch (type) {
+            case NODE4:
+                ((art_node4*)node)->keys[child] = c;
+                ((art_node4*)node)->children[child] = sub;
+                break;
+            case NODE16:
+                ((art_node16*)node)->keys[child] = c;
+                ((art_node16*)node)->children[child] = sub;
+                break;
+            case NODE48:
+                ((art_node48*)node)->keys[c] = child + 1;
+                ((art_node48*)node)->children[child] = sub;
+                break;
+            case NODE256:
+                ((art_node256*)node)->children[c] = sub;
+                break;
+        }
+        child++;
+        start = i;
+    }
+
+    // A full node256 counts its children the way insertion does
+    node->num_children = (uint8_t)num;
+    return node;
+}
+
+/**
+ * Builds an empty ART tree from sorted keys in one pass,
+ * giving each node the size of its children.
+ * @arg t The tree, must be empty
+ * @arg keys The keys, in strictly ascending byte order,
+ * with no key a prefix of another
+ * @arg key_lens The length of each key
+ * @arg values Opaque value of each key
+ * @arg n The number of keys
+ * @return 0 on success, -1 if the tree is not empty
+ * or the keys are out of order.
+ */
+int art_bulk_load(art_tree *t, unsigned char **keys, int *key_lens, void **values, int n) {
+    if (t->root) return -1;
+    for (int i=1; i < n; i++) {
+        int cmp = memcmp(keys[i-1], keys[i], min(key_lens[i-1], key_lens[i]));
+        if (cmp >= 0) return -1;
+    }
+    if (n > 0) t->root = bulk_build(t, keys, key_lens, values, n, 0);
+    t->size = n;
+    return 0;
+}
+
+static void remove_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c) {
     n->children[c] = NULL;
     n->n.num_children--;
 
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
     if (n->n.num_children == 37) {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -606,18 +866,18 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
     n->children[pos-1] = NULL;
     n->n.num_children--;
 
     if (n->n.num_children == 12) {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -630,27 +890,27 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_tree *t, art_node16 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
         memcpy(new->keys, n->keys, 4);
         memcpy(new->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
+static void remove_child4(art_tree *t, art_cow *cow, art_node4 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
@@ -660,6 +920,9 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
     if (n->n.num_children == 1) {
         art_node *child = n->children[0];
         if (!IS_LEAF(child)) {
+            // A copy of the child takes the prefix, the readers keep the original
+            if (cow) child = copy_node(t, cow, child);
+
             // Concatenate the prefixes
             int prefix = n->n.partial_len;
             if (prefix < MAX_PREFIX_LEN) {
@@ -677,26 +940,26 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child(art_tree *t, art_cow *cow, art_node *n, art_node **ref, unsigned char c, art_node **l) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(t, cow, (art_node4*)n, ref, l);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(t, (art_node16*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(t, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(t, (art_node256*)n, ref, c);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
+static art_leaf* recursive_delete(art_tree *t, art_cow *cow, art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
     // Search terminated
     if (!n) return NULL;
 
@@ -719,6 +982,10 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
         depth = depth + n->partial_len;
     }
 
+    // Change a copy of the node, the readers keep the original.
+    // The key is known to be present, so the path is changed.
+    if (cow) *ref = n = copy_node(t, cow, n);
+
     // Find child node
     art_node **child = find_child(n, key[depth]);
     if (!child) return NULL;
@@ -727,14 +994,14 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
     if (IS_LEAF(*child)) {
         art_leaf *l = LEAF_RAW(*child);
         if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
+            remove_child(t, cow, n, ref, key[depth], child);
             return l;
         }
         return NULL;
 
     // Recurse
     } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
+        return recursive_delete(t, cow, *child, child, key, key_len, depth+1);
     }
 }
 
@@ -747,7 +1014,7 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, &t->root, key, key_len, 0);
+    art_leaf *l = recursive_delete(t, NULL, t->root, &t->root, key, key_len, 0);
     if (l) {
         t->size--;
         void *old = l->value;
@@ -755,13 +1022,95 @@ void* art_delete(art_tree *t, unsigned char *key, int key_len) {
         // Only release the leaf if the ref count hits zero
         int ref = __sync_sub_and_fetch(&l->ref_count, 1);
         if (!ref)
-            free(l);
+            free_leaf(t, l);
 
         return old;
     }
     return NULL;
 }
 
+/**
+ * Starts a batch of copy-on-write changes to a tree,
+ * from the version readers currently see.
+ * @arg t The tree
+ * @arg cow Output, the batch
+ */
+void art_cow_begin(art_tree *t, art_cow *cow) {
+    cow->root = t->root;
+    cow->size = t->size;
+    cow->retired = NULL;
+    cow->num_retired = 0;
+    cow->max_retired = 0;
+}
+
+/**
+ * Inserts a value in a batch, copying the path to it
+ * @arg t The tree of the batch
+ * @arg cow The batch
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_cow_insert(art_tree *t, art_cow *cow, unsigned char *key, int key_len, void *value) {
+    int old_val = 0;
+    void *old = recursive_insert(t, cow, cow->root, &cow->root, key, key_len, value, 0, &old_val);
+    if (!old_val) cow->size++;
+    return old;
+}
+
+/**
+ * Deletes a value in a batch, copying the path to it
+ * @arg t The tree of the batch
+ * @arg cow The batch
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_cow_delete(art_tree *t, art_cow *cow, unsigned char *key, int key_len) {
+    // Only copy the path of a key that is present
+    if (!search_node(cow->root, key, key_len)) return NULL;
+    art_leaf *l = recursive_delete(t, cow, cow->root, &cow->root, key, key_len, 0);
+    cow->size--;
+    retire(cow, SET_LEAF(l));
+    return l->value;
+}
+
+/**
+ * Publishes a batch, so readers that load the root after
+ * see all of its changes. The retired list stays with the
+ * batch, for the caller to reclaim.
+ * @arg t The tree
+ * @arg cow The batch
+ */
+void art_cow_publish(art_tree *t, art_cow *cow) {
+    t->size = cow->size;
+    __atomic_store_n(&t->root, cow->root, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees the nodes and leaves retired by published batches,
+ * along with the list. No reader may still hold them, and
+ * no batch may change the tree meanwhile.
+ * @arg t The tree
+ * @arg retired The retired list
+ * @arg num The length of the list
+ */
+void art_reclaim(art_tree *t, void **retired, int num) {
+    for (int i=0; i < num; i++) {
+        if (IS_LEAF(retired[i])) {
+            // Only release the leaf if the ref count hits zero
+            art_leaf *l = LEAF_RAW(retired[i]);
+            if (!__sync_sub_and_fetch(&l->ref_count, 1))
+                free_leaf(t, l);
+        } else
+            free_node(t, retired[i]);
+    }
+    free(retired);
+}
+
 // Recursively iterates over the tree
 static int recursive_iter(art_node *n, art_callback cb, void *data) {
     // Handle base cases
@@ -822,7 +1171,77 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
  * @return 0 on success, or the return of the callback.
  */
 int art_iter(art_tree *t, art_callback cb, void *data) {
-    return recursive_iter(t->root, cb, data);
+    return recursive_iter(LOAD_ROOT(t), cb, data);
+}
+
+// Compares the key of a leaf to a key, like memcmp
+static int leaf_compare(art_leaf *l, const unsigned char *key, int key_len) {
+    int res = memcmp(l->key, key, min(l->key_len, key_len));
+    return (res) ? res : (int)l->key_len - key_len;
+}
+
+// Recursively iterates over the leaves ordered after a key. Only
+// the children that straddle the key are searched, the rest are
+// either skipped or iterated entirely.
+static int recursive_iter_after(art_node *n, unsigned char *key, int key_len, art_callback cb, void *data) {
+    if (!n || leaf_compare(maximum(n), key, key_len) <= 0) return 0;
+    if (leaf_compare(minimum(n), key, key_len) > 0) return recursive_iter(n, cb, data);
+
+    int idx, res;
+    switch (n->type) {
+        case NODE4:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter_after(((art_node4*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE16:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter_after(((art_node16*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE48:
+            for (int i=0; i < 256; i++) {
+                idx = ((art_node48*)n)->keys[i];
+                if (!idx) continue;
+
+                res = recursive_iter_after(((art_node48*)n)->children[idx-1], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE256:
+            for (int i=0; i < 256; i++) {
+                if (!((art_node256*)n)->children[i]) continue;
+                res = recursive_iter_after(((art_node256*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        default:
+            abort();
+    }
+    return 0;
+}
+
+/**
+ * Iterates through the entries pairs in the map in order,
+ * starting after a key, which need not be in the map.
+ * The call back gets a key, value for each and returns an
+ * integer stop value. If the callback returns non-zero,
+ * then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
+    return recursive_iter_after(LOAD_ROOT(t), key, key_len, cb, data);
 }
 
 /**
@@ -851,7 +1270,7 @@ static int leaf_prefix_matches(art_leaf *n, unsigned char *prefix, int prefix_le
  */
 int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
     art_node **child;
-    art_node *n = t->root;
+    art_node *n = LOAD_ROOT(t);
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
@@ -899,7 +1318,7 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
 }
 
 // Recursively copies a tree
-static art_node* recursive_copy(art_node *n) {
+static art_node* recursive_copy(art_tree *t, art_node *n) {
     // Handle the NULL nodes
     if (!n) return NULL;
 
@@ -919,37 +1338,37 @@ static art_node* recursive_copy(art_node *n) {
     } p;
     switch (n->type) {
         case NODE4:
-            p.p1 = (art_node4*)alloc_node(NODE4);
+            p.p1 = (art_node4*)alloc_node(t, NODE4);
             copy_header((art_node*)p.p1, n);
             memcpy(p.p1->keys, ((art_node4*)n)->keys, 4);
             for (int i=0; i < n->num_children; i++) {
-                p.p1->children[i] = recursive_copy(((art_node4*)n)->children[i]);
+                p.p1->children[i] = recursive_copy(t, ((art_node4*)n)->children[i]);
             }
             return (art_node*)p.p1;
 
         case NODE16:
-            p.p2 = (art_node16*)alloc_node(NODE16);
+            p.p2 = (art_node16*)alloc_node(t, NODE16);
             copy_header((art_node*)p.p2, n);
             memcpy(p.p1->keys, ((art_node16*)n)->keys, 16);
             for (int i=0; i < n->num_children; i++) {
-                p.p2->children[i] = recursive_copy(((art_node16*)n)->children[i]);
+                p.p2->children[i] = recursive_copy(t, ((art_node16*)n)->children[i]);
             }
             return (art_node*)p.p2;
 
         case NODE48:
-            p.p3 = (art_node48*)alloc_node(NODE48);
+            p.p3 = (art_node48*)alloc_node(t, NODE48);
             copy_header((art_node*)p.p3, n);
             memcpy(p.p3->keys, ((art_node48*)n)->keys, 256);
             for (int i=0; i < n->num_children; i++) {
-                p.p3->children[i] = recursive_copy(((art_node48*)n)->children[i]);
+                p.p3->children[i] = recursive_copy(t, ((art_node48*)n)->children[i]);
             }
             return (art_node*)p.p3;
 
         case NODE256:
-            p.p4 = (art_node256*)alloc_node(NODE256);
+            p.p4 = (art_node256*)alloc_node(t, NODE256);
             copy_header((art_node*)p.p4, n);
             for (int i=0; i < 256; i++) {
-                p.p4->children[i] = recursive_copy(((art_node256*)n)->children[i]);
+                p.p4->children[i] = recursive_copy(t, ((art_node256*)n)->children[i]);
             }
             return (art_node*)p.p4;
 
@@ -964,14 +1383,19 @@ static art_node* recursive_copy(art_node *n) {
  * This allows leaves to be added and deleted from each tree
  * individually. It is important that concurrent updates to
  * a given key has no well defined behavior since the leaves are
- * shared.
+ * shared. The copy has its own node pool, and shares the leaf
+ * pool, which outlives the leaves dropped by either tree.
  * @arg dst The destination tree. Not initialized yet.
  * @arg src The source tree, must be initialized.
  * @return 0 on success.
  */
 int art_copy(art_tree *dst, art_tree *src) {
+    dst->nodes = new_pool(NODE_QUANTUM);
+    if (!dst->nodes) return -1;
+    dst->leaves = src->leaves;
+    __sync_fetch_and_add(&dst->leaves->refs, 1);
     dst->size = src->size;
-    dst->root = recursive_copy(src->root);
+    dst->root = recursive_copy(dst, src->root);
     return 0;
 }
 
@@ -70,13 +70,37 @@ typedef struct {
 } art_leaf;
 
 /**
- * Main struct, points to root.
+ * Size classed memory for the nodes or leaves of trees
+ */
+typedef struct art_pool art_pool;
+
+/**
+ * Main struct, points to root. Each tree allocates its
+ * nodes from its own pool, and its leaves from a pool
+ * shared with its copies.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    art_pool *nodes;
+    art_pool *leaves;
 } art_tree;
 
+/**
+ * A batch of copy-on-write changes to a tree. Each change
+ * copies the nodes on the path to its key, so readers of the
+ * tree see none of the batch until it is published, and then
+ * all of it. The nodes and leaves it replaced are retired,
+ * and must be kept until no reader can hold them.
+ */
+typedef struct {
+    art_node *root;     // The root of the new version
+    uint64_t size;      // The size of the new version
+    void **retired;     // The nodes and leaves replaced
+    int num_retired;
+    int max_retired;
+} art_cow;
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
@@ -107,6 +131,20 @@ inline uint64_t art_size(art_tree *t) {
  */
 void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value);
 
+/**
+ * Builds an empty ART tree from sorted keys in one pass,
+ * giving each node the size of its children.
+ * @arg t The tree, must be empty
+ * @arg keys The keys, in strictly ascending byte order,
+ * with no key a prefix of another
+ * @arg key_lens The length of each key
+ * @arg values Opaque value of each key
+ * @arg n The number of keys
+ * @return 0 on success, -1 if the tree is not empty
+ * or the keys are out of order.
+ */
+int art_bulk_load(art_tree *t, unsigned char **keys, int *key_lens, void **values, int n);
+
 /**
  * Deletes a value from the ART tree
  * @arg t The tree
@@ -165,6 +203,71 @@ int art_iter(art_tree *t, art_callback cb, void *data);
  */
 int art_iter_prefix(art_tree *t, unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
+/**
+ * Iterates through the entries pairs in the map in order,
+ * starting after a key, which need not be in the map.
+ * The call back gets a key, value for each and returns an
+ * integer stop value. If the callback returns non-zero,
+ * then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data);
+
+/**
+ * Starts a batch of copy-on-write changes to a tree,
+ * from the version readers currently see.
+ * @arg t The tree
+ * @arg cow Output, the batch
+ */
+void art_cow_begin(art_tree *t, art_cow *cow);
+
+/**
+ * Inserts a value in a batch, copying the path to it
+ * @arg t The tree of the batch
+ * @arg cow The batch
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_cow_insert(art_tree *t, art_cow *cow, unsigned char *key, int key_len, void *value);
+
+/**
+ * Deletes a value in a batch, copying the path to it
+ * @arg t The tree of the batch
+ * @arg cow The batch
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_cow_delete(art_tree *t, art_cow *cow, unsigned char *key, int key_len);
+
+/**
+ * Publishes a batch, so readers that load the root after
+ * see all of its changes. The retired list stays with the
+ * batch, for the caller to reclaim.
+ * @arg t The tree
+ * @arg cow The batch
+ */
+void art_cow_publish(art_tree *t, art_cow *cow);
+
+/**
+ * Frees the nodes and leaves retired by published batches,
+ * along with the list. No reader may still hold them, and
+ * no batch may change the tree meanwhile.
+ * @arg t The tree
+ * @arg retired The retired list
+ * @arg num The length of the list
+ */
+void art_reclaim(art_tree *t, void **retired, int num);
+
 /**
  * Creates a copy of an ART tree. The two trees will
  * share the internal leaves, but will NOT share internal nodes.
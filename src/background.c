@@ -1,10 +1,14 @@
 #include <unistd.h>
-#include <sys/time.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
 #include "background.h"
+#include "clock.h"
+#include "trash.h"
 
 /**
- * This defines how log we sleep between loop iterations
- * in microseconds
+ * This defines how often the memory budget is checked,
+ * and how long each flush tick lasts, in microseconds
  */
 #define PERIODIC_TIME_USEC 250000
 
@@ -15,6 +19,22 @@
  */
 #define SEC_TO_TICKS(sec) ((sec * 4))
 
+/**
+ * The longest an idle maintenance worker waits before
+ * looking at the tasks again, in microseconds
+ */
+#define MAX_IDLE_USEC 1000000
+
+/**
+ * How often the sets past their ttl are dropped
+ */
+#define EXPIRE_TIME_USEC 1000000
+
+/**
+ * How often the residency of the sets in memory is sampled
+ */
+#define RESIDENCY_TIME_USEC 10000000
+
 /**
  * After how many background operations should we force a client
  * checkpoint. This allows the vacuum thread to make progress even
@@ -22,184 +42,856 @@
  */
 #define PERIODIC_CHECKPOINT 64
 
-static int timediff_msec(struct timeval *t1, struct timeval *t2);
-static void* flush_thread_main(void *in);
-static void* unmap_thread_main(void *in);
+/**
+ * The longest we sleep at once to respect the flush
+ * rate limit, so that shutdown is not delayed.
+ */
+#define MAX_LIMIT_SLEEP_USEC 100000
+
+/*
+ * Paces the scheduled writes of all the maintenance
+ * workers to a limit of bytes written per second.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t bytes_per_sec;     // 0 if unlimited
+    uint64_t next_usec;         // When the bytes written so far are paid for
+} flush_limiter;
+
+/*
+ * A round of flushes shared by the maintenance workers
+ */
 typedef struct {
-    hlld_config *config;
     hlld_setmgr *mgr;
     int *should_run;
-} background_thread_args;
+    char **names;
+    int num_sets;
+    volatile int next;          // Index of the next set to flush
+    int workers;                // Workers flushing the round, under the lock
+    int max_workers;            // The most workers that may join
+    flush_limiter *limiter;
+    hlld_metrics *metrics;
+} flush_round;
 
-/**
- * Helper macro to pack and unpack the arguments
- * to the thread, and free the memory.
+/*
+ * The tick being scheduled by the flush task. Each set
+ * is checked on one tick of every interval, its slot.
+ * Sets with a flush period of their own have slots in
+ * every period instead.
  */
-# define PACK_ARGS() {                  \
-    args = malloc(sizeof(background_thread_args));  \
-    args->config = config;              \
-    args->mgr = mgr;                    \
-    args->should_run = should_run;      \
-}
-# define UNPACK_ARGS() {                \
-    background_thread_args *args = in;  \
-    config = args->config;              \
-    mgr = args->mgr;                    \
-    should_run = args->should_run;      \
-    free(args);                         \
-}
+typedef struct {
+    hlld_config *config;
+    unsigned int tick;          // Ticks since the maintenance started
+    unsigned int slot;          // The slot of this tick
+    unsigned int num_slots;     // Ticks in a flush interval
+    uint64_t now;               // The current time in seconds
+} flush_schedule;
+
+/*
+ * The maintenance tasks, in order of priority. When
+ * several are due, the first of them runs first.
+ */
+typedef enum {
+    TASK_BUDGET = 0,            // Unmaps sets over the memory budget
+    TASK_FLUSH,                 // Flushes the sets due on a tick
+    TASK_CHECKPOINT,            // Checkpoints the manifest and log, once per flush interval
+    TASK_SNAPSHOT,              // Writes a requested snapshot of the sets
+    TASK_COOL,                  // Reclaims the pages of the cool sets
+    TASK_COLD,                  // Unmaps the cold sets
+    TASK_FOLD,                  // Folds the sets not written for long
+    TASK_ARCHIVE,               // Archives the sets not written for longer
+    TASK_EXPIRE,                // Drops the sets past their ttl
+    TASK_TRASH,                 // Deletes the files of dropped sets
+    TASK_RESIDENCY,             // Samples the pages of the sets in memory
+    NUM_TASKS
+} maint_task_type;
+
+typedef struct {
+    void (*run)(hlld_maintenance *m);
+    uint64_t period_usec;       // 0 if the task only runs once queued by another
+    uint64_t due_usec;          // When it next runs, UINT64_MAX if not due
+    int enabled;
+    int running;
+} maint_task;
+
+/*
+ * Runs the background work of the server. The tasks are
+ * timers, run by a pool of workers that are clients of the
+ * manager. An idle worker runs the most important task that
+ * is due, or helps with the round of flushes in progress.
+ */
+struct hlld_maintenance {
+    hlld_config *config;
+    hlld_setmgr *mgr;
+    hlld_metrics *metrics;
+    int *should_run;
+
+    pthread_mutex_t lock;       // Protects the tasks and the round
+    pthread_cond_t cond;        // Signaled when there is work, or on stop
+    maint_task tasks[NUM_TASKS];
+    flush_round *round;         // The round of flushes that may be joined, if any
+    flush_limiter limiter;
+
+    unsigned int flush_ticks;
+    int flushed;                // Whether sets were flushed since the last checkpoint
+    uint64_t max_bytes;         // The memory budget, 0 if unlimited
+
+    int num_workers;
+    pthread_t *workers;
+};
+
+static uint64_t now_usec();
+static void* maintenance_worker_main(void *in);
+static maint_task* next_task(hlld_maintenance *m, uint64_t now, uint64_t *wake);
+static void wait_for_work(hlld_maintenance *m, uint64_t usec);
+static void queue_task(hlld_maintenance *m, maint_task_type type);
+static void budget_task(hlld_maintenance *m);
+static void flush_task(hlld_maintenance *m);
+static void checkpoint_task(hlld_maintenance *m);
+static void snapshot_task(hlld_maintenance *m);
+static void request_snapshot(void *data);
+static void cool_task(hlld_maintenance *m);
+static void cold_task(hlld_maintenance *m);
+static void fold_task(hlld_maintenance *m);
+static void archive_task(hlld_maintenance *m);
+static void expire_task(hlld_maintenance *m);
+static void trash_task(hlld_maintenance *m);
+static void residency_task(hlld_maintenance *m);
+static int flush_due_filter(void *in, char *set_name, hlld_set *set);
+static void flush_all_sets(hlld_maintenance *m, hlld_set_list_head *head);
+static void interleave_by_dir(hlld_setmgr *mgr, char **names, int num, int num_dirs);
+static void flush_sets(flush_round *round);
+static void limiter_wait(flush_limiter *limiter, uint64_t bytes, int *should_run);
+static void unmap_sets(hlld_setmgr *mgr, hlld_metrics *metrics,
+        hlld_set_list_head *head, const char *reason);
+static int fold_due_filter(void *in, char *set_name, hlld_set *set);
+static int archive_due_filter(void *in, char *set_name, hlld_set *set);
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the sets.
+ * Starts the maintenance of the sets. Each dirty set is
+ * flushed once per flush interval, or its own flush period,
+ * spread out over the interval, and cold sets are unmapped on every cold interval.
+ * The sets in memory are kept within the memory budget.
  * @arg config The configuration
  * @arg mgr The manager to use
+ * @arg metrics The metrics to record the durations in
  * @arg should_run Pointer to an integer that is set to 0 to
- * indicate the thread should exit.
- * @arg t The output thread
- * @return 1 if the thread was started
+ * indicate the maintenance should stop.
+ * @arg out Output, the maintenance
+ * @return 1 if the maintenance was started
  */
-int start_flush_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t) {
-    // Return if we are not scheduled
-    if(config->flush_interval <= 0) {
+int start_maintenance(hlld_config *config, hlld_setmgr *mgr, hlld_metrics *metrics,
+        int *should_run, hlld_maintenance **out) {
+    // Snapshots may always be requested, so
+    // there is at least the one worker
+    int flushing = config->flush_interval > 0;
+    int cold = config->cold_interval > 0;
+    hlld_maintenance *m = calloc(1, sizeof(hlld_maintenance));
+    if (!m) return 0;
+    m->config = config;
+    m->mgr = mgr;
+    m->metrics = metrics;
+    m->should_run = should_run;
+    m->max_bytes = (uint64_t)config->max_memory * 1024 * 1024;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&m->limiter.lock, NULL);
+    m->limiter.bytes_per_sec = (uint64_t)config->flush_rate_limit * 1024 * 1024;
+
+    // Setup the timers of the tasks
+    uint64_t now = now_usec();
+    struct { void (*run)(hlld_maintenance*); uint64_t period; int enabled; } tasks[NUM_TASKS] = {
+        {budget_task, PERIODIC_TIME_USEC, m->max_bytes > 0},
+        {flush_task, PERIODIC_TIME_USEC, flushing},
+        {checkpoint_task, 0, flushing},
+        {snapshot_task, 0, 1},
+        {cool_task, (uint64_t)config->cool_interval * 1000000, config->cool_interval > 0},
+        {cold_task, (uint64_t)config->cold_interval * 1000000, cold},
+        {fold_task, 0, cold && config->fold_after_days && !config->read_only},
+        {archive_task, 0, cold && config->archive_after_days && !config->read_only},
+        {expire_task, EXPIRE_TIME_USEC, !config->read_only},
+        {trash_task, PERIODIC_TIME_USEC, !config->read_only},
+        {residency_task, RESIDENCY_TIME_USEC, 1},
+    };
+    for (int i=0; i < NUM_TASKS; i++) {
+        maint_task *t = m->tasks + i;
+        t->run = tasks[i].run;
+        t->period_usec = tasks[i].period;
+        t->enabled = tasks[i].enabled;
+        t->due_usec = (t->enabled && t->period_usec) ? now + t->period_usec : UINT64_MAX;
+    }
+
+    // One worker for each flush thread, and one so
+    // that a round of flushes does not hold up the rest
+    m->num_workers = (flushing ? config->flush_threads : 0) + 1;
+    m->workers = calloc(m->num_workers, sizeof(pthread_t));
+    int started = 0;
+    for (; m->workers && started < m->num_workers; started++) {
+        if (pthread_create(m->workers + started, NULL, maintenance_worker_main, m)) break;
+    }
+    m->num_workers = started;
+    if (!started) {
+        syslog(LOG_ERR, "Failed to start the maintenance workers!");
+        stop_maintenance(m);
         return 0;
     }
 
-    // Start thread
-    background_thread_args *args;
-    PACK_ARGS();
-    pthread_create(t, NULL, flush_thread_main, args);
+    setmgr_snapshot_cb(mgr, request_snapshot, m);
+    syslog(LOG_INFO, "Maintenance started. Workers: %d. Flush interval: %d seconds. "
+            "Cold interval: %d seconds. Max memory: %d MB.", m->num_workers,
+            config->flush_interval, config->cold_interval, config->max_memory);
+    *out = m;
     return 1;
 }
 
 /**
- * Starts a cold unmap thread which on every
- * cold interval unamps cold sets.
- * @arg config The configuration
- * @arg mgr The manager to use
- * @arg should_run Pointer to an integer that is set to 0 to
- * indicate the thread should exit.
- * @arg t The output thread
- * @return 1 if the thread was started
+ * Stops the maintenance once should_run is set to 0, waiting
+ * for the workers to finish their tasks, and frees it.
+ * @arg m The maintenance
  */
-int start_cold_unmap_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t) {
-    // Return if we are not scheduled
-    if(config->cold_interval <= 0) {
-        return 0;
-    }
+void stop_maintenance(hlld_maintenance *m) {
+    setmgr_snapshot_cb(m->mgr, NULL, NULL);
+    pthread_mutex_lock(&m->lock);
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    for (int i=0; i < m->num_workers; i++) pthread_join(m->workers[i], NULL);
+    free(m->workers);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+    pthread_mutex_destroy(&m->limiter.lock);
+    free(m);
+}
 
-    // Start thread
-    background_thread_args *args;
-    PACK_ARGS();
-    pthread_create(t, NULL, unmap_thread_main, args);
-    return 1;
+/**
+ * Moves the maintenance onto new flush and cold intervals,
+ * as on a reload of the configuration. Either may be turned
+ * on or off. Each task changed is next due a period from now.
+ * Flushes turned on here run on the one worker, unless they
+ * were on at the start.
+ * @arg m The maintenance
+ * @arg flush_interval The new flush interval in seconds, or 0
+ * @arg cold_interval The new cold interval in seconds, or 0
+ */
+void reconfigure_maintenance(hlld_maintenance *m, int flush_interval, int cold_interval) {
+    hlld_config *config = m->config;
+    uint64_t now = now_usec();
+    pthread_mutex_lock(&m->lock);
+    if (flush_interval != config->flush_interval) {
+        config->flush_interval = flush_interval;
+        m->flush_ticks = 0;
+        m->tasks[TASK_FLUSH].enabled = flush_interval > 0;
+        m->tasks[TASK_FLUSH].due_usec = (flush_interval > 0) ?
+            now + m->tasks[TASK_FLUSH].period_usec : UINT64_MAX;
+        m->tasks[TASK_CHECKPOINT].enabled = flush_interval > 0;
+    }
+    if (cold_interval != config->cold_interval) {
+        int cold = cold_interval > 0;
+        config->cold_interval = cold_interval;
+        maint_task *t = m->tasks + TASK_COLD;
+        t->period_usec = (uint64_t)cold_interval * 1000000;
+        t->enabled = cold;
+        t->due_usec = (cold) ? now + t->period_usec : UINT64_MAX;
+        m->tasks[TASK_FOLD].enabled = cold && config->fold_after_days && !config->read_only;
+        m->tasks[TASK_ARCHIVE].enabled = cold && config->archive_after_days && !config->read_only;
+    }
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    syslog(LOG_INFO, "Maintenance reconfigured. Flush interval: %d seconds. "
+            "Cold interval: %d seconds.", flush_interval, cold_interval);
 }
 
+/**
+ * Entry point of the maintenance workers. Each joins the
+ * round of flushes in progress if it can, or runs the next
+ * task that is due, or waits for the next one to be due.
+ */
+static void* maintenance_worker_main(void *in) {
+    hlld_maintenance *m = in;
+    setmgr_client_checkpoint(m->mgr);
+    pthread_mutex_lock(&m->lock);
+    while (*m->should_run) {
+        flush_round *round = m->round;
+        if (round && round->next < round->num_sets && round->workers < round->max_workers) {
+            round->workers++;
+            pthread_mutex_unlock(&m->lock);
+            setmgr_client_checkpoint(m->mgr);
+            flush_sets(round);
+            pthread_mutex_lock(&m->lock);
+            if (!--round->workers) pthread_cond_broadcast(&m->cond);
+            continue;
+        }
 
-static void* flush_thread_main(void *in) {
-    hlld_config *config;
-    hlld_setmgr *mgr;
-    int *should_run;
-    UNPACK_ARGS();
-
-    // Perform the initial checkpoint with the manager
-    setmgr_client_checkpoint(mgr);
-
-    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
-    unsigned int ticks = 0;
-    while (*should_run) {
-        usleep(PERIODIC_TIME_USEC);
-        setmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->flush_interval)) == 0 && *should_run) {
-            // Time how long this takes
-            struct timeval start, end;
-            gettimeofday(&start, NULL);
-
-            // List all the sets
-            syslog(LOG_INFO, "Scheduled flush started.");
-            hlld_set_list_head *head;
-            int res = setmgr_list_sets(mgr, NULL, &head);
-            if (res != 0) {
-                syslog(LOG_WARNING, "Failed to list sets for flushing!");
-                continue;
-            }
-
-            // Flush all, ignore errors since
-            // sets might get deleted in the process
-            hlld_set_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                setmgr_flush_set(mgr, node->set_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
-
-            // Compute the elapsed time
-            gettimeofday(&end, NULL);
-            syslog(LOG_INFO, "Flushed %d sets in %d msecs", head->size, timediff_msec(&start, &end));
-
-            // Cleanup
-            setmgr_cleanup_list(head);
+        uint64_t now = now_usec();
+        uint64_t wake = now + MAX_IDLE_USEC;
+        maint_task *task = next_task(m, now, &wake);
+        if (!task) {
+            setmgr_client_idle(m->mgr);
+            wait_for_work(m, wake - now);
+            continue;
         }
+
+        // Periodic tasks keep their pace, unless they fell behind
+        task->running = 1;
+        if (!task->period_usec) task->due_usec = UINT64_MAX;
+        else if ((task->due_usec += task->period_usec) <= now) task->due_usec = now + task->period_usec;
+        pthread_mutex_unlock(&m->lock);
+
+        setmgr_client_checkpoint(m->mgr);
+        task->run(m);
+        pthread_mutex_lock(&m->lock);
+        task->running = 0;
     }
+    pthread_mutex_unlock(&m->lock);
+    setmgr_client_leave(m->mgr);
     return NULL;
 }
 
-static void* unmap_thread_main(void *in) {
-    hlld_config *config;
-    hlld_setmgr *mgr;
-    int *should_run;
-    UNPACK_ARGS();
-
-    // Perform the initial checkpoint with the manager
-    setmgr_client_checkpoint(mgr);
-
-    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
-    unsigned int ticks = 0;
-    while (*should_run) {
-        usleep(PERIODIC_TIME_USEC);
-        setmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
-            // Time how long this takes
-            struct timeval start, end;
-            gettimeofday(&start, NULL);
-
-            // List the cold sets
-            syslog(LOG_INFO, "Cold unmap started.");
-            hlld_set_list_head *head;
-            int res = setmgr_list_cold_sets(mgr, &head);
-            if (res != 0) {
-                continue;
-            }
-
-            // Close the sets, save memory
-            hlld_set_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                syslog(LOG_DEBUG, "Unmapping set '%s' for being cold.", node->set_name);
-                setmgr_unmap_set(mgr, node->set_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
-
-            // Compute the elapsed time
-            gettimeofday(&end, NULL);
-            syslog(LOG_INFO, "Unmapped %d sets in %d msecs", head->size, timediff_msec(&start, &end));
-
-            // Cleanup
-            setmgr_cleanup_list(head);
-        }
+/**
+ * Returns the first task that is due and not running,
+ * or NULL and lowers the wake time to the next one due.
+ * Must be invoked with the lock held.
+ */
+static maint_task* next_task(hlld_maintenance *m, uint64_t now, uint64_t *wake) {
+    for (int i=0; i < NUM_TASKS; i++) {
+        maint_task *t = m->tasks + i;
+        if (!t->enabled || t->running) continue;
+        if (t->due_usec <= now) return t;
+        if (t->due_usec < *wake) *wake = t->due_usec;
     }
     return NULL;
 }
 
 /**
- * Computes the difference in time in milliseconds
- * between two timeval structures.
+ * Waits up to some microseconds for the cond to be
+ * signaled. Must be invoked with the lock held.
+ */
+static void wait_for_work(hlld_maintenance *m, uint64_t usec) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t nsec = ts.tv_nsec + usec * 1000;
+    ts.tv_sec += nsec / 1000000000;
+    ts.tv_nsec = nsec % 1000000000;
+    pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+}
+
+/**
+ * Makes a task due right away, waking a worker to run it
+ */
+static void queue_task(hlld_maintenance *m, maint_task_type type) {
+    pthread_mutex_lock(&m->lock);
+    if (m->tasks[type].enabled) {
+        m->tasks[type].due_usec = 0;
+        pthread_cond_broadcast(&m->cond);
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * Keeps the resident sets within the memory budget
+ */
+static void budget_task(hlld_maintenance *m) {
+    hlld_set_list_head *head;
+    if (setmgr_list_lru_sets(m->mgr, m->max_bytes, &head)) return;
+    if (head->size) {
+        syslog(LOG_INFO, "Unmapping %d sets for the memory budget.", head->size);
+        unmap_sets(m->mgr, m->metrics, head, "over the memory budget");
+    }
+    setmgr_cleanup_list(head);
+}
+
+/**
+ * Flushes the sets due on this tick. The last tick of
+ * each flush interval queues the checkpoints.
+ */
+static void flush_task(hlld_maintenance *m) {
+    // The interval may be turned off by a reload meanwhile
+    hlld_config *config = m->config;
+    int interval = config->flush_interval;
+    if (interval <= 0) return;
+    unsigned int tick = m->flush_ticks++;
+    flush_schedule sched = {config, tick, tick % SEC_TO_TICKS(interval),
+        SEC_TO_TICKS(interval), hclock_wall_sec()};
+    int last = sched.slot == sched.num_slots - 1;
+
+    // A read only server has nothing to flush, and instead
+    // follows the writes of the primary once per interval
+    if (config->read_only) {
+        if (last) queue_task(m, TASK_CHECKPOINT);
+        return;
+    }
+    hlld_set_list_head *head;
+    int res = setmgr_list_filtered_sets(m->mgr, flush_due_filter, &sched, &head);
+    if (res != 0) {
+        syslog(LOG_WARNING, "Failed to list sets for flushing!");
+        return;
+    }
+
+    if (head->size) {
+        // Time how long this takes
+        uint64_t start = hclock_nsec();
+
+        // Flush all, ignore errors since
+        // sets might get deleted in the process
+        flush_all_sets(m, head);
+        m->flushed = 1;
+
+        // The slots of the round are synced together
+        if (config->slab_registers) setmgr_sync_slab(m->mgr);
+
+        // Compute the elapsed time
+        uint64_t nanos = hclock_nsec() - start;
+        syslog(LOG_DEBUG, "Flushed %d sets in %d msecs", head->size, (int)(nanos / 1000000));
+        if (m->metrics) {
+            metrics_record_background(m->metrics, FLUSH_ROUND, nanos);
+        }
+    }
+
+    // Cleanup
+    setmgr_cleanup_list(head);
+    if (last) queue_task(m, TASK_CHECKPOINT);
+}
+
+/**
+ * Runs once per flush interval, after its last tick. Records
+ * the flushed sizes in the manifest, and drops the segments of
+ * the write-ahead log that the flushes cover. A read only server
+ * refreshes the sets of the primary instead.
+ */
+static void checkpoint_task(hlld_maintenance *m) {
+    if (m->config->read_only) {
+        if (setmgr_refresh(m->mgr))
+            syslog(LOG_WARNING, "Failed to refresh the sets of the data directory!");
+        return;
+    }
+
+    // Record the flushed sizes in the manifest once per interval
+    if (__sync_lock_test_and_set(&m->flushed, 0)) {
+        setmgr_checkpoint_manifest(m->mgr);
+    }
+
+    // Drop the segments of the write-ahead log the flushes cover
+    setmgr_checkpoint_wal(m->mgr);
+
+    // Remember the sets in memory, for a restart
+    if (m->config->prewarm) setmgr_save_hot_sets(m->mgr);
+
+    uint64_t hits, misses;
+    setmgr_lookup_stats(m->mgr, &hits, &misses);
+    if (hits + misses) {
+        syslog(LOG_DEBUG, "Set lookup cache hit rate: %.2f%% (%llu hits, %llu misses)",
+                100.0 * hits / (hits + misses),
+                (unsigned long long)hits, (unsigned long long)misses);
+    }
+}
+
+/**
+ * Queues a snapshot requested of the manager
+ */
+static void request_snapshot(void *data) {
+    queue_task(data, TASK_SNAPSHOT);
+}
+
+/**
+ * Writes the snapshot of the sets. Unlike the flushes
+ * it is asked for, so is not held to the rate limit.
+ */
+static void snapshot_task(hlld_maintenance *m) {
+    uint64_t start = hclock_nsec();
+    int num_sets;
+    int res = setmgr_write_snapshot(m->mgr, &num_sets);
+    if (res)
+        syslog(LOG_ERR, "Failed to write the snapshot of the sets. Err: %d.", res);
+    else
+        syslog(LOG_INFO, "Wrote a snapshot of %d sets in %d msecs.", num_sets,
+                (int)((hclock_nsec() - start) / 1000000));
+}
+
+/**
+ * Reclaims the pages of the sets not written since the
+ * last cool scan, without unmapping them
+ */
+static void cool_task(hlld_maintenance *m) {
+    uint64_t start = hclock_nsec();
+    hlld_set_list_head *head;
+    if (setmgr_list_cool_sets(m->mgr, &head)) return;
+
+    int cooled = 0;
+    unsigned int cmds = 0;
+    for (hlld_set_list *node = head->head; node && *m->should_run; node = node->next) {
+        if (!setmgr_cool_set(m->mgr, node->set_name)) cooled++;
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(m->mgr);
+    }
+    if (cooled) syslog(LOG_INFO, "Cooled %d sets in %d msecs", cooled,
+            (int)((hclock_nsec() - start) / 1000000));
+    setmgr_cleanup_list(head);
+}
+
+/**
+ * Unmaps the cold sets, then queues the folds
+ */
+static void cold_task(hlld_maintenance *m) {
+    // Time how long this takes
+    uint64_t start = hclock_nsec();
+
+    // List the cold sets
+    syslog(LOG_INFO, "Cold unmap started.");
+    hlld_set_list_head *head;
+    int res = setmgr_list_cold_sets(m->mgr, &head);
+    if (res != 0) {
+        return;
+    }
+
+    // Close the sets, save memory
+    unmap_sets(m->mgr, m->metrics, head, "being cold");
+
+    // Compute the elapsed time
+    syslog(LOG_INFO, "Unmapped %d sets in %d msecs", head->size,
+            (int)((hclock_nsec() - start) / 1000000));
+
+    // Cleanup
+    setmgr_cleanup_list(head);
+
+    // Fold and archive the sets that have not been written for long
+    queue_task(m, TASK_FOLD);
+    queue_task(m, TASK_ARCHIVE);
+}
+
+/**
+ * Returns the slot of a set, from a FNV-1a hash of its name
+ */
+static uint64_t flush_slot(char *set_name, uint64_t num_slots) {
+    uint32_t hash = 2166136261U;
+    for (unsigned char *c = (unsigned char*)set_name; *c; c++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+    return hash % num_slots;
+}
+
+/**
+ * Filters the sets that should be flushed on a tick. A set
+ * is due on its slot if it has been dirty long enough, or
+ * on any tick once enough of its pages are dirty. Volatile
+ * sets are never due.
+ */
+static int flush_due_filter(void *in, char *set_name, hlld_set *set) {
+    flush_schedule *sched = in;
+    if (set->set_config.durability == DURABILITY_VOLATILE) return 0;
+    int64_t age = hset_dirty_age(set, sched->now);
+    if (age < 0) return 0;
+    if (sched->config->flush_dirty_pages &&
+            hset_dirty_pages(set) >= (uint64_t)sched->config->flush_dirty_pages)
+        return 1;
+
+    uint64_t slot = sched->slot, num_slots = sched->num_slots;
+    if (set->set_config.flush_period) {
+        num_slots = SEC_TO_TICKS((uint64_t)set->set_config.flush_period);
+        slot = sched->tick % num_slots;
+    }
+    return flush_slot(set_name, num_slots) == slot && age >= sched->config->flush_dirty_age;
+}
+
+/**
+ * Reads the data directory of a set
+ */
+static void set_dir_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(int*)data = hset_data_dir(set);
+}
+
+/**
+ * Orders the sets of a round so that consecutive sets are in
+ * different data directories. The workers then flush to all
+ * of the devices at once, rather than queueing on one.
+ */
+static void interleave_by_dir(hlld_setmgr *mgr, char **names, int num, int num_dirs) {
+    int *dirs = malloc(num * sizeof(int));
+    int *starts = calloc(num_dirs + 1, sizeof(int));
+    char **sorted = malloc(num * sizeof(char*));
+    if (!dirs || !starts || !sorted) goto DONE;
+
+    // Sort the sets by directory, keeping their order within each
+    for (int i=0; i < num; i++) {
+        dirs[i] = 0;
+        setmgr_set_cb(mgr, names[i], set_dir_cb, dirs + i);
+        starts[dirs[i] + 1]++;
+    }
+    for (int d=0; d < num_dirs; d++) starts[d + 1] += starts[d];
+    for (int i=0; i < num; i++) sorted[starts[dirs[i]]++] = names[i];
+
+    // Take a set from each directory in turn. The starts
+    // are now the ends of the directories.
+    int idx = 0;
+    for (int r=0; idx < num; r++) {
+        for (int d=0; d < num_dirs; d++) {
+            int begin = (d) ? starts[d - 1] : 0;
+            if (begin + r < starts[d]) names[idx++] = sorted[begin + r];
+        }
+    }
+
+DONE:
+    free(dirs);
+    free(starts);
+    free(sorted);
+}
+
+/**
+ * Flushes every set in the list. The sets are split across
+ * up to flush_threads workers, with this worker being one
+ * of them. Each worker takes the next set to flush.
+ */
+static void flush_all_sets(hlld_maintenance *m, hlld_set_list_head *head) {
+    flush_round round = {m->mgr, m->should_run, NULL, head->size, 0, 1,
+        m->config->flush_threads, &m->limiter, m->metrics};
+    round.names = malloc(head->size * sizeof(char*));
+    if (!round.names) return;
+    hlld_set_list *node = head->head;
+    for (int i=0; i < head->size && node; i++, node = node->next) {
+        round.names[i] = node->set_name;
+    }
+    if (m->config->num_data_dirs > 1)
+        interleave_by_dir(m->mgr, round.names, head->size, m->config->num_data_dirs);
+
+    // Let the idle workers take a share of the sets
+    pthread_mutex_lock(&m->lock);
+    m->round = &round;
+    if (round.max_workers > 1 && head->size > 1) pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    flush_sets(&round);
+
+    // Wait for the others. We are idle with the manager while
+    // waiting so that vacuuming is not held up, since the names
+    // are our own copies.
+    pthread_mutex_lock(&m->lock);
+    m->round = NULL;
+    if (--round.workers) {
+        setmgr_client_idle(m->mgr);
+        while (round.workers) pthread_cond_wait(&m->cond, &m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+    setmgr_client_checkpoint(m->mgr);
+    free(round.names);
+}
+
+/**
+ * Reads the counters of a set
+ */
+static void set_counters_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(set_counters*)data = *hset_counters(set);
+}
+
+/**
+ * Flushes sets of the round until none are left, pacing
+ * the flushes to the rate limit. The counters of each set
+ * are read around its flush, for the bytes it wrote.
+ */
+static void flush_sets(flush_round *round) {
+    unsigned int cmds = 0;
+    int idx;
+    while (*round->should_run &&
+            (idx = __sync_fetch_and_add(&round->next, 1)) < round->num_sets) {
+        char *name = round->names[idx];
+        set_counters before, after;
+        int counted = !setmgr_set_cb(round->mgr, name, set_counters_cb, &before);
+
+        uint64_t start = hclock_nsec();
+        setmgr_flush_set(round->mgr, name);
+        uint64_t nanos = hclock_nsec() - start;
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(round->mgr);
+
+        // Sets dropped meanwhile are not counted
+        if (!counted || setmgr_set_cb(round->mgr, name, set_counters_cb, &after)) continue;
+        uint64_t bytes = after.flush_bytes - before.flush_bytes;
+        if (round->metrics && after.flushes != before.flushes) {
+            metrics_record_set_flush(round->metrics, nanos, bytes,
+                    after.flush_clean_pages - before.flush_clean_pages);
+        }
+        if (round->limiter->bytes_per_sec && bytes)
+            limiter_wait(round->limiter, bytes, round->should_run);
+    }
+}
+
+/**
+ * Accounts for bytes that were written, and sleeps until
+ * the writes so far fit within the rate limit.
+ */
+static void limiter_wait(flush_limiter *limiter, uint64_t bytes, int *should_run) {
+    uint64_t now = now_usec();
+    pthread_mutex_lock(&limiter->lock);
+    if (limiter->next_usec < now) limiter->next_usec = now;
+    limiter->next_usec += bytes * 1000000 / limiter->bytes_per_sec;
+    uint64_t until = limiter->next_usec;
+    pthread_mutex_unlock(&limiter->lock);
+
+    while (*should_run && (now = now_usec()) < until) {
+        uint64_t wait = until - now;
+        usleep((wait > MAX_LIMIT_SLEEP_USEC) ? MAX_LIMIT_SLEEP_USEC : wait);
+    }
+}
+
+/**
+ * Accepts the persistent sets above the fold precision
+ * that have not been written for fold_after_days.
+ */
+static int fold_due_filter(void *in, char *set_name, hlld_set *set) {
+    (void)set_name;
+    hlld_config *config = in;
+    hlld_set_config *sc = &set->set_config;
+    if (sc->in_memory || sc->window || sc->sliding ||
+            sc->default_precision <= config->fold_precision)
+        return 0;
+    uint64_t last = hset_last_write(set);
+    return last && (uint64_t)time(NULL) - last >= (uint64_t)config->fold_after_days * 86400;
+}
+
+/**
+ * Folds each of the sets that are due down to the
+ * fold precision, leaving them as they were mapped.
+ * The folds share the rate limit of the flushes.
+ */
+static void fold_task(hlld_maintenance *m) {
+    hlld_config *config = m->config;
+    hlld_set_list_head *head;
+    if (setmgr_list_filtered_sets(m->mgr, fold_due_filter, config, &head)) return;
+    hlld_set_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node && *m->should_run) {
+        set_counters before, after;
+        int counted = !setmgr_set_cb(m->mgr, node->set_name, set_counters_cb, &before);
+        if (setmgr_fold_set(m->mgr, node->set_name, config->fold_precision) == -2)
+            syslog(LOG_WARNING, "Failed to fold set '%s'.", node->set_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(m->mgr);
+        if (m->limiter.bytes_per_sec && counted &&
+                !setmgr_set_cb(m->mgr, node->set_name, set_counters_cb, &after) &&
+                after.flush_bytes != before.flush_bytes)
+            limiter_wait(&m->limiter, after.flush_bytes - before.flush_bytes, m->should_run);
+        node = node->next;
+    }
+    if (head->size) syslog(LOG_INFO, "Folded %d sets to precision %d.",
+            head->size, config->fold_precision);
+    setmgr_cleanup_list(head);
+}
+
+/**
+ * Accepts the unmapped persistent sets that have not
+ * been written for archive_after_days. Archived sets
+ * have no config of their own, so are never due.
+ */
+static int archive_due_filter(void *in, char *set_name, hlld_set *set) {
+    (void)set_name;
+    hlld_config *config = in;
+    hlld_set_config *sc = &set->set_config;
+    if (!hset_is_proxied(set) || sc->in_memory || sc->window || sc->sliding || sc->kmv)
+        return 0;
+    uint64_t last = hset_last_write(set);
+    return last && (uint64_t)time(NULL) - last >= (uint64_t)config->archive_after_days * 86400;
+}
+
+/**
+ * Moves the sets that are due into the archive, then
+ * compacts the files of the archive that are mostly dead
+ */
+static void archive_task(hlld_maintenance *m) {
+    uint64_t start = hclock_nsec();
+    hlld_set_list_head *head;
+    if (setmgr_list_filtered_sets(m->mgr, archive_due_filter, m->config, &head)) return;
+
+    int archived = 0;
+    unsigned int cmds = 0;
+    for (hlld_set_list *node = head->head; node && *m->should_run; node = node->next) {
+        int res = setmgr_archive_set(m->mgr, node->set_name);
+        if (!res) archived++;
+        else if (res == -2) syslog(LOG_WARNING, "Failed to archive set '%s'.", node->set_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(m->mgr);
+    }
+    setmgr_cleanup_list(head);
+
+    uint64_t reclaimed;
+    int compacted = setmgr_compact_archive(m->mgr, &reclaimed);
+    if (archived || compacted > 0)
+        syslog(LOG_INFO, "Archived %d sets, and compacted %d archive files reclaiming %llu bytes, in %d msecs.",
+                archived, (compacted > 0) ? compacted : 0, (unsigned long long)reclaimed,
+                (int)((hclock_nsec() - start) / 1000000));
+}
+
+/**
+ * Drops the sets whose ttl ran out since the last tick
+ */
+static void expire_task(hlld_maintenance *m) {
+    uint64_t start = hclock_nsec();
+    int expired = setmgr_expire_sets(m->mgr, time(NULL));
+    if (expired)
+        syslog(LOG_INFO, "Expired %d sets, in %d msecs.", expired,
+                (int)((hclock_nsec() - start) / 1000000));
+}
+
+/**
+ * Deletes the files of dropped sets from the trash, up
+ * to the trash_unlink_rate, so that mass drops do not
+ * flood the disk
+ */
+static void trash_task(hlld_maintenance *m) {
+    int rate = m->config->trash_unlink_rate;
+    int budget = (rate) ? rate / SEC_TO_TICKS(1) : INT_MAX;
+    if (!budget) budget = 1;
+
+    // Each data directory has a trash of its own
+    int removed = 0;
+    if (m->config->num_data_dirs > 1) {
+        for (int i=0; i < m->config->num_data_dirs && removed < budget; i++)
+            removed += trash_empty(m->config->data_dir_list[i], budget - removed);
+    } else {
+        removed = trash_empty(m->config->data_dir, budget);
+    }
+    if (removed) syslog(LOG_DEBUG, "Deleted %d files of dropped sets.", removed);
+}
+
+/**
+ * Samples how much of each set paged in is resident in memory,
+ * so that info and the memory budget see the pages the kernel
+ * evicted. This walks the page tables of every set, so it is
+ * kept off the request paths.
+ */
+static void residency_task(hlld_maintenance *m) {
+    hlld_set_list_head *head;
+    if (setmgr_list_sets(m->mgr, NULL, &head)) return;
+
+    unsigned int cmds = 0;
+    for (hlld_set_list *node = head->head; node && *m->should_run; node = node->next) {
+        setmgr_sample_residency(m->mgr, node->set_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(m->mgr);
+    }
+    setmgr_cleanup_list(head);
+}
+
+/**
+ * Unmaps each of the listed sets, timing each
+ * of them and the whole round
+ */
+static void unmap_sets(hlld_setmgr *mgr, hlld_metrics *metrics,
+        hlld_set_list_head *head, const char *reason) {
+    hlld_set_list *node = head->head;
+    unsigned int cmds = 0;
+    uint64_t round_start = hclock_nsec();
+    while (node) {
+        syslog(LOG_DEBUG, "Unmapping set '%s' for %s.", node->set_name, reason);
+        uint64_t start = hclock_nsec();
+        int res = setmgr_unmap_set(mgr, node->set_name);
+        if (metrics && !res) metrics_record_background(metrics, SET_UNMAP, hclock_nsec() - start);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+    if (metrics && head->size) metrics_record_background(metrics, UNMAP_ROUND, hclock_nsec() - round_start);
+}
+
+/**
+ * Returns the current time in microseconds
  */
-static int timediff_msec(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
+static uint64_t now_usec() {
+    return hclock_nsec() / 1000;
 }
 
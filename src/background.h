@@ -3,29 +3,48 @@
 #include <pthread.h>
 #include "config.h"
 #include "set_manager.h"
+#include "metrics.h"
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the sets.
- * @arg config The configuration
- * @arg mgr The manager to use
- * @arg should_run Pointer to an integer that is set to 0 to
- * indicate the thread should exit.
- * @arg t The output thread
- * @return 1 if the thread was started
+ * The maintenance of the sets. A pool of workers runs the
+ * flushes, unmaps, folds, checkpoints and snapshots as tasks, with
+ * the most important task that is due running first.
  */
-int start_flush_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t);
+typedef struct hlld_maintenance hlld_maintenance;
 
 /**
- * Starts a cold unmap thread which on every
- * cold interval unamps cold sets.
+ * Starts the maintenance of the sets. Each dirty set is
+ * flushed once per flush interval, spread out over the
+ * interval, and cold sets are unmapped on every cold interval.
+ * The sets in memory are kept within the memory budget.
  * @arg config The configuration
  * @arg mgr The manager to use
+ * @arg metrics The metrics to record the durations in
  * @arg should_run Pointer to an integer that is set to 0 to
- * indicate the thread should exit.
- * @arg t The output thread
- * @return 1 if the thread was started
+ * indicate the maintenance should stop.
+ * @arg out Output, the maintenance
+ * @return 1 if the maintenance was started
+ */
+int start_maintenance(hlld_config *config, hlld_setmgr *mgr, hlld_metrics *metrics,
+        int *should_run, hlld_maintenance **out);
+
+/**
+ * Stops the maintenance once should_run is set to 0, waiting
+ * for the workers to finish their tasks, and frees it.
+ * @arg m The maintenance
+ */
+void stop_maintenance(hlld_maintenance *m);
+
+/**
+ * Moves the maintenance onto new flush and cold intervals,
+ * as on a reload of the configuration. Either may be turned
+ * on or off. Each task changed is next due a period from now.
+ * Flushes turned on here run on the one worker, unless they
+ * were on at the start.
+ * @arg m The maintenance
+ * @arg flush_interval The new flush interval in seconds, or 0
+ * @arg cold_interval The new cold interval in seconds, or 0
  */
-int start_cold_unmap_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *);
+void reconfigure_maintenance(hlld_maintenance *m, int flush_interval, int cold_interval);
 
 #endif
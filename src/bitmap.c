@@ -4,19 +4,61 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <pthread.h>
 #include "bitmap.h"
+#include "iobatch.h"
+#include "trace.h"
 
 /* Static declarations */
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
-static int flush_all_pages(hlld_bitmap *map);
-static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int map_bitmap(int fileno, int direct_fd, uint64_t offset, uint64_t len, bitmap_mode mode, hlld_bitmap *map);
+static int fill_buffer(int fileno, int direct_fd, unsigned char* buf, uint64_t len, uint64_t offset);
+static int flush_dirty_runs(hlld_bitmap *map);
+static int flush_runs(hlld_bitmap *map, iobatch_range *runs, int num);
+static unsigned char* huge_alloc(uint64_t len, int *huge);
+static void release_region(unsigned char *addr, uint64_t len, int huge);
 extern inline int bitmap_getbit(hlld_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(hlld_bitmap *map, uint64_t idx);
+extern inline void bitmap_mark_dirty(hlld_bitmap *map, uint64_t offset);
+
+// Pages in the bitmap, and words in the dirty bit field
+#define NUM_PAGES(size) (((size) + BITMAP_PAGE_SIZE - 1) / BITMAP_PAGE_SIZE)
+#define DIRTY_WORDS(size) ((NUM_PAGES(size) + 63) / 64)
+
+// Direct I/O moves whole sectors, so shorter or partial writes are buffered
+#define DIRECT_ALIGN 512
+
+// Rounds a length up to a multiple of a power of two
+#define ROUND_UP(len, align) (((len) + (align) - 1) & ~((uint64_t)(align) - 1))
+
+/*
+ * A huge page cannot back less than its own size, so bitmaps
+ * smaller than one are carved from shared arenas of huge pages.
+ * Slots are rounded up to whole pages, and freed slots are kept
+ * on a list per slot size for the next bitmap of that size. The
+ * arenas are never unmapped, as sets of one size are paged in
+ * and out over and over. Larger bitmaps are mapped on huge page
+ * boundaries of their own.
+ */
+#define HUGE_ARENA 1
+#define HUGE_REGION 2
+#define MAX_ARENA_CLASSES 64
+
+typedef struct {
+    uint64_t size;
+    unsigned char *free;    // Freed slots, linked through their first word
+} arena_class;
+
+static pthread_mutex_t ARENA_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static arena_class ARENA_CLASSES[MAX_ARENA_CLASSES];
+static int NUM_ARENA_CLASSES = 0;
+static unsigned char *ARENA_NEXT = NULL;    // Uncarved space of the newest arena
+static uint64_t ARENA_LEFT = 0;
 
 /**
  * Returns a hlld_bitmap pointer from a file handle
@@ -28,14 +70,45 @@ extern inline void bitmap_setbit(hlld_bitmap *map, uint64_t idx);
  * @return 0 on success. Negative on error.
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *map) {
+    return map_bitmap(fileno, -1, 0, len, mode, map);
+}
+
+/**
+ * Returns a hlld_bitmap pointer from a slot of a file shared
+ * with other bitmaps. The slot must be PERSISTENT and start on
+ * a page boundary. Flushes write the slot without syncing the
+ * file, so the owner of the file syncs it once for every bitmap.
+ * @arg fileno The fileno, opened with read/write privileges
+ * @arg offset The offset of the slot in the file
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_slot(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, hlld_bitmap *map) {
+    // The segment is shared, so a slot always uses buffered I/O
+    mode &= ~DIRECT_IO;
+    if ((mode & ~(NEW_BITMAP | HUGE_PAGES)) != PERSISTENT || offset % BITMAP_PAGE_SIZE)
+        return -EINVAL;
+    int res = map_bitmap(fileno, -1, offset, len, mode, map);
+    if (!res) map->slot = 1;
+    return res;
+}
+
+/**
+ * Maps a bitmap of a range of a file. The direct_fd, if any,
+ * is owned by the map once it is mapped.
+ */
+static int map_bitmap(int fileno, int direct_fd, uint64_t offset, uint64_t len, bitmap_mode mode, hlld_bitmap *map) {
     // Hack for old kernels and bad length checking
     if (len == 0) {
         return -EINVAL;
     }
 
-    // Check for and clear NEW_BITMAP from the mode
+    // Check for and clear NEW_BITMAP and HUGE_PAGES from the mode
     int new_bitmap = (mode & NEW_BITMAP) ? 1 : 0;
-    mode &= ~NEW_BITMAP;
+    int huge_pages = (mode & HUGE_PAGES) ? 1 : 0;
+    mode &= ~(NEW_BITMAP | HUGE_PAGES | DIRECT_IO);
 
     // Handle each mode
     int flags;
@@ -54,13 +127,24 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *ma
         flags = MAP_ANON | MAP_PRIVATE;
         newfileno = -1;
 
+    } else if (mode == READ_ONLY) {
+        flags = MAP_SHARED;
+        newfileno = dup(fileno);
+        if (newfileno < 0) return -errno;
+
     } else {
         return -1;
     }
 
-    // Perform the map in
-    unsigned char* addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
-            flags, ((mode == PERSISTENT) ? -1 : newfileno), 0);
+    // Perform the map in. Anonymous memory can use huge pages,
+    // falling back to small pages if they are not available.
+    int huge = 0;
+    unsigned char* addr = NULL;
+    if (huge_pages && (mode == PERSISTENT || mode == ANONYMOUS))
+        addr = huge_alloc(len, &huge);
+    if (!addr)
+        addr = mmap(NULL, len, (mode == READ_ONLY) ? PROT_READ : PROT_READ|PROT_WRITE,
+                flags, ((mode == PERSISTENT) ? -1 : newfileno), 0);
 
     // Check for an error, otherwise return
     if (addr == MAP_FAILED) {
@@ -73,7 +157,7 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *ma
 
     // Provide some advise on how the memory will be used
     int res;
-    if (mode == SHARED) {
+    if (mode == SHARED || mode == READ_ONLY) {
         res = madvise(addr, len, MADV_WILLNEED);
         if (res != 0) {
             perror("Failed to call madvise() [MADV_WILLNEED]");
@@ -89,36 +173,156 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *ma
     if (mode == PERSISTENT) {
         // For existing bitmaps we need to read in the data
         // since we cannot use the kernel to fault it in
-        if (!new_bitmap && (res = fill_buffer(newfileno, addr, len))) {
-            munmap(addr, len);
+        if (!new_bitmap && (res = fill_buffer(newfileno, direct_fd, addr, len, offset))) {
+            release_region(addr, len, huge);
             if (newfileno >= 0) close(newfileno);
             return res;
         }
     }
 
+    // File backed maps track dirty pages, so a flush only writes
+    // those. All pages start clean, since they match the file.
+    volatile uint64_t *dirty = NULL;
+    if (mode == SHARED || mode == PERSISTENT) {
+        dirty = calloc(DIRTY_WORDS(len), sizeof(uint64_t));
+        if (!dirty) {
+            release_region(addr, len, huge);
+            close(newfileno);
+            return -ENOMEM;
+        }
+    }
+
     // Allocate space for the map
+    map->dirty = dirty;
+    map->num_dirty = 0;
+    map->flush_syscalls = 0;
+    map->flush_bytes = 0;
+    map->flush_clean_pages = 0;
+    map->resident = NULL;
     map->mode = mode;
     map->fileno = newfileno;
     map->size = len;
     map->mmap = addr;
+    map->huge = huge;
+    map->offset = offset;
+    map->slot = 0;
+    map->direct_fd = direct_fd;
     return 0;
 }
 
+/*
+ * Maps anonymous memory starting on a huge page boundary, and
+ * asks for it to be backed by huge pages
+ */
+static unsigned char* map_huge_region(uint64_t len) {
+    uint64_t mapped = len + BITMAP_HUGE_PAGE_SIZE;
+    unsigned char *addr = mmap(NULL, mapped, PROT_READ|PROT_WRITE,
+            MAP_ANON|MAP_PRIVATE, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+
+    // Trim the mapping to the aligned region
+    unsigned char *start = (unsigned char*)ROUND_UP((uintptr_t)addr, BITMAP_HUGE_PAGE_SIZE);
+    if (start > addr) munmap(addr, start - addr);
+    if (addr + mapped > start + len) munmap(start + len, addr + mapped - (start + len));
+
+    // Without transparent huge pages, small pages are used instead
+    if (madvise(start, len, MADV_HUGEPAGE)) {
+        syslog(LOG_DEBUG, "Failed to call madvise() [MADV_HUGEPAGE]");
+    }
+    return start;
+}
+
+/*
+ * Allocates zeroed memory for a bitmap backed by huge pages
+ * @arg len The length of the bitmap
+ * @arg huge Output, how the memory is backed
+ * @return The memory, or NULL to fall back to a plain mapping
+ */
+static unsigned char* huge_alloc(uint64_t len, int *huge) {
+    if (len >= BITMAP_HUGE_PAGE_SIZE) {
+        unsigned char *addr = map_huge_region(ROUND_UP(len, BITMAP_HUGE_PAGE_SIZE));
+        if (addr) *huge = HUGE_REGION;
+        return addr;
+    }
+
+    uint64_t slot = ROUND_UP(len, BITMAP_PAGE_SIZE);
+    unsigned char *addr = NULL;
+    pthread_mutex_lock(&ARENA_LOCK);
+    arena_class *class = NULL;
+    for (int i=0; i < NUM_ARENA_CLASSES; i++) {
+        if (ARENA_CLASSES[i].size == slot) class = ARENA_CLASSES + i;
+    }
+    if (!class && NUM_ARENA_CLASSES < MAX_ARENA_CLASSES) {
+        class = ARENA_CLASSES + NUM_ARENA_CLASSES++;
+        class->size = slot;
+        class->free = NULL;
+    }
+
+    // Too many sizes of bitmaps to track their free slots
+    if (!class) goto LEAVE;
+
+    if (class->free) {
+        addr = class->free;
+        class->free = *(unsigned char**)addr;
+        memset(addr, 0, slot);
+    } else {
+        if (ARENA_LEFT < slot) {
+            unsigned char *arena = map_huge_region(BITMAP_HUGE_PAGE_SIZE);
+            if (!arena) goto LEAVE;
+            ARENA_NEXT = arena;
+            ARENA_LEFT = BITMAP_HUGE_PAGE_SIZE;
+        }
+        addr = ARENA_NEXT;
+        ARENA_NEXT += slot;
+        ARENA_LEFT -= slot;
+    }
+    *huge = HUGE_ARENA;
+
+LEAVE:
+    pthread_mutex_unlock(&ARENA_LOCK);
+    return addr;
+}
+
+/*
+ * Releases the memory of a bitmap, returning arena slots
+ * to the free list of their size
+ */
+static void release_region(unsigned char *addr, uint64_t len, int huge) {
+    if (huge == HUGE_REGION) {
+        munmap(addr, ROUND_UP(len, BITMAP_HUGE_PAGE_SIZE));
+        return;
+    } else if (huge != HUGE_ARENA) {
+        munmap(addr, len);
+        return;
+    }
+
+    uint64_t slot = ROUND_UP(len, BITMAP_PAGE_SIZE);
+    pthread_mutex_lock(&ARENA_LOCK);
+    for (int i=0; i < NUM_ARENA_CLASSES; i++) {
+        if (ARENA_CLASSES[i].size != slot) continue;
+        *(unsigned char**)addr = ARENA_CLASSES[i].free;
+        ARENA_CLASSES[i].free = addr;
+        break;
+    }
+    pthread_mutex_unlock(&ARENA_LOCK);
+}
+
 /*
  * Populates a buffer with the contents of a file
  */
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
-    uint64_t total_read = 0;
-    ssize_t more;
-    while (total_read < len) {
-        more = pread(fileno, buf+total_read, len-total_read, total_read);
-        if (more == 0)
-            break;
-        else if (more < 0 && errno != EINTR) {
-            perror("Failed to fill the bitmap buffer!");
-            return -errno;
-        } else
-            total_read += more;
+static int fill_buffer(int fileno, int direct_fd, unsigned char* buf, uint64_t len, uint64_t offset) {
+    // Read around the page cache if we can, and drop the
+    // cached pages of earlier buffered writes
+    if (direct_fd >= 0 && !(len % DIRECT_ALIGN) &&
+            iobatch_read_at(direct_fd, buf, len, offset, NULL) == (int64_t)len) {
+        posix_fadvise(fileno, offset, len, POSIX_FADV_DONTNEED);
+        return 0;
+    }
+    int64_t res = iobatch_read_at(fileno, buf, len, offset, NULL);
+    if (res < 0) {
+        errno = -res;
+        perror("Failed to fill the bitmap buffer!");
+        return res;
     }
     return 0;
 }
@@ -126,7 +330,8 @@ static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
 
 /**
  * Returns a hlld_bitmap pointer from a filename.
- * Opens the file with read/write privileges. If create
+ * Opens the file with read/write privileges, or only read
+ * privileges for READ_ONLY bitmaps. If create
  * is true, then a file will be created if it does not exist.
  * If the file cannot be opened, NULL will be returned.
  * @arg fileno The fileno
@@ -138,9 +343,11 @@ static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
  * @return 0 on success. Negative on error.
  */
 int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode mode, hlld_bitmap *map) {
-    // Get the flags
-    int flags = O_RDWR;
-    if (create) {
+    // Get the flags. Read only files are never created.
+    int flags = (mode & READ_ONLY) ? O_RDONLY : O_RDWR;
+    if (create && (mode & READ_ONLY)) {
+        return -EINVAL;
+    } else if (create) {
         flags |= O_CREAT;
     }
 
@@ -166,7 +373,20 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
         // an existing file
         if ((uint64_t)buf.st_size == 0) {
             extra_flags |= NEW_BITMAP;
-            res = ftruncate(fileno, len);
+
+            // Allocating the blocks up front keeps the file contiguous,
+            // so paging it in and flushing it stay sequential. Not every
+            // file system can, and those get a sparse file instead.
+            res = -1;
+            if (mode & PREALLOCATE) {
+                res = posix_fallocate(fileno, 0, len);
+                if (res && res != EOPNOTSUPP && res != EINVAL) {
+                    syslog(LOG_ERR, "Failed to preallocate the bitmap! %s", strerror(res));
+                    close(fileno);
+                    return -res;
+                }
+            }
+            if (res) res = ftruncate(fileno, len);
             if (res != 0) {
                 perror("ftrunctate failed on the bitmap!");
                 close(fileno);
@@ -182,11 +402,20 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
         }
     }
 
+    // Open the file again to bypass the page cache. File systems
+    // without direct I/O fall back to buffered I/O.
+    int direct_fd = -1;
+#ifdef O_DIRECT
+    if ((mode & DIRECT_IO) && (mode & PERSISTENT))
+        direct_fd = open(filename, O_RDWR | O_DIRECT);
+#endif
+
     // Use the filehandler mode
-    int res = bitmap_from_file(fileno, len, mode | extra_flags, map);
+    int res = map_bitmap(fileno, direct_fd, 0, len, (mode & ~PREALLOCATE) | extra_flags, map);
 
     // Handle is dup'ed, we can close
     close(fileno);
+    if (res && direct_fd >= 0) close(direct_fd);
 
     // Delete the file if we created it and had an error
     if (res && extra_flags & NEW_BITMAP && unlink(filename)) {
@@ -200,7 +429,9 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 /**
  * Flushes the bitmap back to disk. This is
  * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps.
+ * ANONYMOUS and READ_ONLY bitmaps. Only the dirty pages are
+ * written, and the system calls and bytes written
+ * are recorded in the bitmap.
  * @arg map The bitmap
  * @returns 0 on success, negative failure.
  */
@@ -208,62 +439,214 @@ int bitmap_flush(hlld_bitmap *map) {
     // Return if there is no map provided
     if (map == NULL) return -EINVAL;
 
-    // Do nothing for anonymous maps
+    // Do nothing for anonymous or read only maps
     int res;
-    if (map->mode == ANONYMOUS || map->mmap == NULL)
+    if (map->mode == ANONYMOUS || map->mode == READ_ONLY || map->mmap == NULL)
         return 0;
 
-    // For SHARED, we can use an msync and let the kernel deal
-    else if (map->mode == SHARED) {
-        res = msync(map->mmap, map->size, MS_SYNC);
-        if (res == -1) return -errno;
+    // Write out only the dirty pages. SHARED maps are
+    // written back by the kernel, and PERSISTENT maps by us.
+    // The batch of PERSISTENT writes includes the sync,
+    // unless the bitmap is a slot of a shared file.
+    map->flush_syscalls = 0;
+    map->flush_bytes = 0;
+    map->flush_clean_pages = 0;
+    TRACE2(bitmap_flush_begin, map->size, map->num_dirty);
+    if (!(res = flush_dirty_runs(map)) && map->mode != PERSISTENT) {
+        map->flush_syscalls++;
+        if (fsync(map->fileno) == -1) res = -errno;
+    }
+    TRACE3(bitmap_flush_end, map->flush_bytes, map->flush_syscalls, res);
+    return res;
+}
 
-    } else if (map->mode == PERSISTENT) {
-        if ((res = flush_all_pages(map)))
-            return res;
+
+/**
+ * Asks the kernel to reclaim the pages of a file backed
+ * map, which stays mapped. Pages are faulted back in from
+ * the page cache or the file on their next access.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL if the map is not
+ * SHARED or READ_ONLY, or negative errno.
+ */
+int bitmap_cool(hlld_bitmap *map) {
+    if (!map->mmap || (map->mode != SHARED && map->mode != READ_ONLY))
+        return -EINVAL;
+
+    // Reclaiming needs a 5.4 kernel, and older ones can
+    // at least move the pages to the inactive list
+#ifdef MADV_PAGEOUT
+    if (!madvise(map->mmap, map->size, MADV_PAGEOUT)) return 0;
+#endif
+#ifdef MADV_COLD
+    if (!madvise(map->mmap, map->size, MADV_COLD)) return 0;
+#endif
+    return -EINVAL;
+}
+
+/**
+ * Samples the pages of the map that are resident in memory,
+ * with mincore. Pages resident now that were not at the last
+ * sample are counted as faulted in, which misses the pages
+ * faulted in and evicted again between the samples.
+ * @arg map The bitmap
+ * @arg resident Output, the bytes of the map that are resident
+ * @arg faults Output, the pages faulted in since the last
+ * sample, or 0 on the first sample
+ * @return 0 on success, -EINVAL if the map is not mapped,
+ * or negative errno.
+ */
+int bitmap_sample_residency(hlld_bitmap *map, uint64_t *resident, uint64_t *faults) {
+    if (!map->mmap) return -EINVAL;
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t num_pages = (map->size + page_size - 1) / page_size;
+    int first = !map->resident;
+    if (first) {
+        map->resident = calloc((num_pages + 63) / 64, sizeof(uint64_t));
+        if (!map->resident) return -ENOMEM;
     }
 
-    // SHARED / PERSISTENT both have a file backing
-    res = fsync(map->fileno);
-    if (res == -1) return -errno;
+    // Check the pages a chunk at a time, so the vector stays small
+    unsigned char vec[1024];
+    uint64_t resident_pages = 0, faulted = 0;
+    for (uint64_t start = 0; start < num_pages; start += sizeof(vec)) {
+        uint64_t num = num_pages - start;
+        if (num > sizeof(vec)) num = sizeof(vec);
+        if (mincore(map->mmap + start * page_size, num * page_size, vec)) return -errno;
+        for (uint64_t i=0; i < num; i++) {
+            uint64_t page = start + i, bit = 1ULL << (page % 64);
+            uint64_t *word = map->resident + page / 64;
+            if (vec[i] & 1) {
+                resident_pages++;
+                if (!(*word & bit) && !first) faulted++;
+                *word |= bit;
+            } else {
+                *word &= ~bit;
+            }
+        }
+    }
+
+    // The last page may be partly used
+    *resident = resident_pages * page_size;
+    if (*resident > map->size) *resident = map->size;
+    *faults = faulted;
     return 0;
 }
 
-
 /**
- * Flushes all the pages of the bitmap.
+ * Marks the pages of a range as dirty, so that
+ * they are written by the next flush.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
  */
-static int flush_all_pages(hlld_bitmap *map) {
-    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
-    int res = 0;
-    for (uint64_t i=0; i < pages; i++) {
-        res = flush_page(map, i, map->size, pages - 1);
+void bitmap_mark_range(hlld_bitmap *map, uint64_t offset, uint64_t len) {
+    if (!map->dirty || !len) return;
+    uint64_t last = (offset + len - 1) / BITMAP_PAGE_SIZE;
+    for (uint64_t page = offset / BITMAP_PAGE_SIZE; page <= last; page++) {
+        bitmap_mark_dirty(map, page * BITMAP_PAGE_SIZE);
     }
-    return res;
 }
 
 
 /**
- * Flushes out a single page that is dirty
+ * Flushes the dirty pages of the bitmap. The dirty bits
+ * are cleared before their pages are written, so a page
+ * changed during the flush is written again next time.
+ * Adjacent dirty pages are written together as one run.
  */
-static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page) {
-    int res, total = 0;
-    uint64_t offset = page * 4096;
-
-    // The last page may need a write size < 4096
-    int should_write = 4096;
-    if (page == max_page && size % 4096) {
-        should_write = size % 4096;
+static int flush_dirty_runs(hlld_bitmap *map) {
+    uint64_t pages = NUM_PAGES(map->size);
+    uint64_t words = DIRTY_WORDS(map->size);
+    uint64_t taken[words], num_taken = 0;
+    for (uint64_t i=0; i < words; i++) {
+        taken[i] = (map->dirty[i]) ? __sync_fetch_and_and(map->dirty + i, 0) : 0;
+        num_taken += __builtin_popcountll(taken[i]);
+    }
+    if (num_taken) __sync_fetch_and_sub(&map->num_dirty, num_taken);
+    map->flush_clean_pages = pages - num_taken;
+
+    // Runs are separated by a clean page, bounding their number
+    iobatch_range *runs = malloc((pages / 2 + 1) * sizeof(iobatch_range));
+    if (!runs) {
+        for (uint64_t page=0; page < pages; page++) {
+            if ((taken[page / 64] >> (page % 64)) & 1)
+                bitmap_mark_dirty(map, page * BITMAP_PAGE_SIZE);
+        }
+        return -ENOMEM;
     }
 
-    while (total < should_write) {
-        res = pwrite(map->fileno, map->mmap + offset + total,
-                should_write - total, offset + total);
-        if (res == -1 && errno != EINTR)
-            return -errno;
-        else
-            total += res;
+#define TAKEN(page) ((taken[(page) / 64] >> ((page) % 64)) & 1)
+    int num = 0;
+    uint64_t page = 0, end;
+    while (page < pages) {
+        // Skip over clean pages, a word at a time if possible
+        if (!(page % 64) && !taken[page / 64]) {
+            page += 64;
+            continue;
+        } else if (!TAKEN(page)) {
+            page++;
+            continue;
+        }
+
+        // Extend the run over the adjacent dirty pages
+        end = page + 1;
+        while (end < pages && TAKEN(end)) end++;
+        runs[num].offset = page * BITMAP_PAGE_SIZE;
+        runs[num].len = end * BITMAP_PAGE_SIZE;
+
+        // The last page may be partial
+        if (runs[num].len > map->size) runs[num].len = map->size;
+        runs[num].len -= runs[num].offset;
+        runs[num].buf = map->mmap + runs[num].offset;
+        num++;
+        page = end;
+    }
+#undef TAKEN
+
+    int res = flush_runs(map, runs, num);
+    if (res) {
+        // Keep the runs dirty so they are retried
+        for (int i=0; i < num; i++)
+            bitmap_mark_range(map, runs[i].offset, runs[i].len);
     }
+    free(runs);
+    return res;
+}
+
+
+/**
+ * Flushes out the runs of dirty pages. SHARED maps schedule
+ * the write back of each run, and PERSISTENT maps write all
+ * of the runs as one batch, followed by a sync of the file.
+ * The runs of a slot are moved to its offset in the file.
+ */
+static int flush_runs(hlld_bitmap *map, iobatch_range *runs, int num) {
+    if (map->mode == PERSISTENT) {
+        // Runs start on pages, so only a partial last page is unaligned
+        int fd = map->fileno;
+        if (map->direct_fd >= 0 && num && !(runs[num - 1].len % DIRECT_ALIGN)) fd = map->direct_fd;
+
+        for (int i=0; i < num; i++) runs[i].offset += map->offset;
+        int res = iobatch_write(fd, runs, num, !map->slot, &map->flush_syscalls);
+
+        // Fall back to the page cache for good, if direct I/O is refused
+        if (res == -EINVAL && fd == map->direct_fd) {
+            syslog(LOG_WARNING, "Direct I/O refused, using buffered writes instead.");
+            close(map->direct_fd);
+            map->direct_fd = -1;
+            res = iobatch_write(map->fileno, runs, num, !map->slot, &map->flush_syscalls);
+        }
+        for (int i=0; i < num; i++) runs[i].offset -= map->offset;
+        if (res) return res;
+    } else {
+        for (int i=0; i < num; i++) {
+            map->flush_syscalls++;
+            if (msync(runs[i].buf, runs[i].len, MS_ASYNC)) return -errno;
+        }
+    }
+    for (int i=0; i < num; i++)
+        map->flush_bytes += runs[i].len;
     return 0;
 }
 
@@ -271,7 +654,8 @@ static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t m
 /**
  * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps. The caller should free()
+ * ANONYMOUS bitmaps, and a clean bitmap is only
+ * unmapped. The caller should free()
  * the structure after.
  * @arg map The bitmap
  * @returns 0 on success, negative on failure.
@@ -280,21 +664,32 @@ int bitmap_close(hlld_bitmap *map) {
     // Return if there is no map provided
     if (map == NULL) return -EINVAL;
 
-    // Flush first
-    int res = bitmap_flush(map);
+    // Flush first. A clean map was written and synced
+    // by its last flush, so it only needs to be unmapped.
+    int res = (map->num_dirty) ? bitmap_flush(map) : 0;
     if (res != 0) return res;
 
-    // Unmap the file
-    res = munmap(map->mmap, map->size);
-    if (res != 0) return -errno;
+    // Unmap the file, or return the memory to its arena
+    if (map->huge) {
+        release_region(map->mmap, map->size, map->huge);
+    } else {
+        res = munmap(map->mmap, map->size);
+        if (res != 0) return -errno;
+    }
 
     // Close the file descriptor if file backed
     if (map->mode != ANONYMOUS) {
+       if (map->direct_fd >= 0) close(map->direct_fd);
+       map->direct_fd = -1;
        res = close(map->fileno);
        if (res != 0) return -errno;
     }
 
     // Cleanup
+    if (map->dirty) free((void*)map->dirty);
+    map->dirty = NULL;
+    free(map->resident);
+    map->resident = NULL;
     map->mmap = NULL;
     map->fileno = -1;
     return 0;
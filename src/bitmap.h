@@ -8,14 +8,34 @@ typedef enum {
     SHARED      = 1, // MAP_SHARED mmap used, file backed.
     PERSISTENT  = 2, // MAP_ANONYMOUS used, file backed.
     ANONYMOUS   = 4, // MAP_ANONYMOUS mmap used. No file backing.
-    NEW_BITMAP  = 8  // File contents not read. Used with PERSISTENT
+    NEW_BITMAP  = 8, // File contents not read. Used with PERSISTENT
+    HUGE_PAGES  = 16, // Backed by huge pages. Used with PERSISTENT or ANONYMOUS
+    READ_ONLY   = 32, // MAP_SHARED mmap with PROT_READ, file backed. Never written.
+    PREALLOCATE = 64, // Blocks of a new file are allocated up front. Used on creation
+    DIRECT_IO   = 128 // Reads and flushes bypass the page cache. Used with PERSISTENT
 } bitmap_mode;
 
+// Granularity of the dirty page tracking
+#define BITMAP_PAGE_SIZE 4096
+
+// Size of the transparent huge pages used with HUGE_PAGES
+#define BITMAP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 typedef struct {
     bitmap_mode mode;
     int fileno;          // Underlying fileno
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
+    int huge;            // How the region is backed by huge pages, or 0
+    uint64_t offset;     // Offset of the bitmap in the file
+    int slot;            // Part of a shared file, synced by its owner
+    int direct_fd;       // The file opened with O_DIRECT, or -1
+    volatile uint64_t *dirty; // Bit per dirty page. NULL if ANONYMOUS
+    volatile uint64_t num_dirty; // Number of dirty pages
+    uint64_t flush_syscalls;  // System calls made by the last flush
+    uint64_t flush_bytes;     // Bytes written by the last flush
+    uint64_t flush_clean_pages; // Pages skipped as clean by the last flush
+    uint64_t *resident;  // Bit per page resident at the last sample, or NULL
 } hlld_bitmap;
 
 /**
@@ -29,9 +49,24 @@ typedef struct {
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *map);
 
+/**
+ * Returns a hlld_bitmap pointer from a slot of a file shared
+ * with other bitmaps. The slot must be PERSISTENT and start on
+ * a page boundary. Flushes write the slot without syncing the
+ * file, so the owner of the file syncs it once for every bitmap.
+ * @arg fileno The fileno, opened with read/write privileges
+ * @arg offset The offset of the slot in the file
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_slot(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, hlld_bitmap *map);
+
 /**
  * Returns a hlld_bitmap pointer from a filename.
- * Opens the file with read/write privileges. If create
+ * Opens the file with read/write privileges, or only read
+ * privileges for READ_ONLY bitmaps. If create
  * is true, then a file will be created if it does not exist.
  * If the file cannot be opened, NULL will be returned.
  * @arg fileno The fileno
@@ -46,7 +81,9 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 /**
  * Flushes the bitmap back to disk. This is
  * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps.
+ * ANONYMOUS and READ_ONLY bitmaps. Only the dirty pages are
+ * written, and the system calls and bytes written
+ * are recorded in the bitmap.
  * @arg map The bitmap
  * @returns 0 on success, negative failure.
  */
@@ -55,13 +92,63 @@ int bitmap_flush(hlld_bitmap *map);
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps. The caller should free()
+ * ANONYMOUS bitmaps, and a clean bitmap is only
+ * unmapped. The caller should free()
  * the structure after.
  * @arg map The bitmap
  * @returns 0 on success, negative on failure.
  */
 int bitmap_close(hlld_bitmap *map);
 
+/**
+ * Asks the kernel to reclaim the pages of a file backed
+ * map, which stays mapped. Pages are faulted back in from
+ * the page cache or the file on their next access.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL if the map is not
+ * SHARED or READ_ONLY, or negative errno.
+ */
+int bitmap_cool(hlld_bitmap *map);
+
+/**
+ * Samples the pages of the map that are resident in memory,
+ * with mincore. Pages resident now that were not at the last
+ * sample are counted as faulted in, which misses the pages
+ * faulted in and evicted again between the samples.
+ * @arg map The bitmap
+ * @arg resident Output, the bytes of the map that are resident
+ * @arg faults Output, the pages faulted in since the last
+ * sample, or 0 on the first sample
+ * @return 0 on success, -EINVAL if the map is not mapped,
+ * or negative errno.
+ */
+int bitmap_sample_residency(hlld_bitmap *map, uint64_t *resident, uint64_t *faults);
+
+/**
+ * Marks the pages of a range as dirty, so that
+ * they are written by the next flush.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
+ */
+void bitmap_mark_range(hlld_bitmap *map, uint64_t offset, uint64_t len);
+
+/**
+ * Marks the page holding a byte as dirty. Bytes must
+ * be marked after they are changed. This is safe to call
+ * concurrently with other writers and with a flush.
+ * @arg map The bitmap
+ * @arg offset The byte offset that changed
+ */
+inline void bitmap_mark_dirty(hlld_bitmap *map, uint64_t offset) {
+    if (!map->dirty) return;
+    uint64_t page = offset / BITMAP_PAGE_SIZE;
+    volatile uint64_t *word = map->dirty + page / 64;
+    uint64_t bit = 1ULL << (page % 64);
+    if (!(*word & bit) && !(__sync_fetch_and_or(word, bit) & bit))
+        __sync_fetch_and_add(&map->num_dirty, 1);
+}
+
 /**
  * Returns the value of the bit at index idx for the
  * hlld_bitmap map
@@ -79,6 +166,7 @@ inline void bitmap_setbit(hlld_bitmap *map, uint64_t idx) {
     unsigned char byte_off = 7 - idx % 8;
     byte |= 1 << byte_off;
     map->mmap[idx >> 3] = byte;
+    bitmap_mark_dirty(map, idx >> 3);
 }
 
 #endif
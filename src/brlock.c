@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "brlock.h"
+
+/**
+ * The rows of reader counts. Threads beyond the
+ * rows share them, which is safe but contends.
+ */
+#define BRLOCK_ROWS 128
+
+/**
+ * The counters of each row, a few cache lines
+ */
+#define BRLOCK_STRIPES 64
+
+/**
+ * Busy checks of a row by a writer before it sleeps
+ */
+#define BRLOCK_SPINS 64
+
+typedef struct {
+    volatile uint32_t readers[BRLOCK_STRIPES];
+} __attribute__((aligned(64))) brlock_row;
+
+static brlock_row ROWS[BRLOCK_ROWS];
+static volatile uint32_t NEXT_ROW = 0;
+static volatile uint32_t NEXT_STRIPE = 0;
+
+static pthread_key_t ROW_KEY;
+static pthread_once_t ROW_ONCE = PTHREAD_ONCE_INIT;
+
+/**
+ * Creates the key of the thread rows
+ */
+static void make_row_key() {
+    pthread_key_create(&ROW_KEY, NULL);
+}
+
+/**
+ * Returns the row of the calling thread,
+ * claiming the next row on first use
+ */
+static brlock_row* thread_row() {
+    pthread_once(&ROW_ONCE, make_row_key);
+    brlock_row *row = pthread_getspecific(ROW_KEY);
+    if (!row) {
+        row = ROWS + (__sync_fetch_and_add(&NEXT_ROW, 1) % BRLOCK_ROWS);
+        pthread_setspecific(ROW_KEY, row);
+    }
+    return row;
+}
+
+/**
+ * Initializes a lock
+ * @arg lock The lock
+ */
+void brlock_init(hlld_brlock *lock) {
+    lock->writer = 0;
+    lock->stripe = __sync_fetch_and_add(&NEXT_STRIPE, 1) % BRLOCK_STRIPES;
+    pthread_mutex_init(&lock->write_lock, NULL);
+}
+
+/**
+ * Destroys a lock, which must not be held
+ * @arg lock The lock
+ */
+void brlock_destroy(hlld_brlock *lock) {
+    pthread_mutex_destroy(&lock->write_lock);
+}
+
+/**
+ * Acquires the lock shared. A thread may hold
+ * many locks shared, and the same lock more than once.
+ * @arg lock The lock
+ */
+void brlock_rdlock(hlld_brlock *lock) {
+    volatile uint32_t *count = thread_row()->readers + lock->stripe;
+    for (;;) {
+        // The increment is a full barrier, so either we see the
+        // flag or the writer sees our count. A count that was already
+        // held has not been passed by a writer, which makes holding
+        // the same lock again safe.
+        if (__sync_fetch_and_add(count, 1) || !lock->writer) return;
+
+        // Back out and wait out the writer
+        __sync_fetch_and_sub(count, 1);
+        pthread_mutex_lock(&lock->write_lock);
+        pthread_mutex_unlock(&lock->write_lock);
+    }
+}
+
+/**
+ * Releases the lock from a brlock_rdlock
+ * on the same thread
+ * @arg lock The lock
+ */
+void brlock_rdunlock(hlld_brlock *lock) {
+    __sync_fetch_and_sub(thread_row()->readers + lock->stripe, 1);
+}
+
+/**
+ * Acquires the lock exclusively, waiting for
+ * the readers on every thread to leave
+ * @arg lock The lock
+ */
+void brlock_wrlock(hlld_brlock *lock) {
+    pthread_mutex_lock(&lock->write_lock);
+    lock->writer = 1;
+    __sync_synchronize();
+
+    // Once a row drains, its readers of this lock see the flag
+    uint32_t rows = NEXT_ROW;
+    if (rows > BRLOCK_ROWS) rows = BRLOCK_ROWS;
+    for (uint32_t i=0; i < rows; i++) {
+        for (int spins=0; ROWS[i].readers[lock->stripe]; spins++) {
+            if (spins >= BRLOCK_SPINS) usleep(50);
+        }
+    }
+    __sync_synchronize();
+}
+
+/**
+ * Releases the lock from a brlock_wrlock
+ * @arg lock The lock
+ */
+void brlock_wrunlock(hlld_brlock *lock) {
+    __sync_synchronize();
+    lock->writer = 0;
+    pthread_mutex_unlock(&lock->write_lock);
+}
@@ -0,0 +1,62 @@
+#ifndef BRLOCK_H
+#define BRLOCK_H
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A big reader lock, for locks that are read on every command
+ * and written rarely. Each thread counts its readers in a row
+ * of its own, a few cache lines long, so readers on many cores
+ * never write a shared line. Each lock counts its readers in
+ * one stripe of the rows. A writer raises the flag of its lock,
+ * then waits until the stripe of every row has drained. Readers
+ * that find the flag raised back out and wait on the writer.
+ *
+ * Locks sharing a stripe only delay each other's writers.
+ */
+typedef struct {
+    volatile int writer;        // Raised while a writer holds or awaits the lock
+    uint32_t stripe;            // The counter of the lock in each row
+    pthread_mutex_t write_lock; // Held by the writer
+} hlld_brlock;
+
+/**
+ * Initializes a lock
+ * @arg lock The lock
+ */
+void brlock_init(hlld_brlock *lock);
+
+/**
+ * Destroys a lock, which must not be held
+ * @arg lock The lock
+ */
+void brlock_destroy(hlld_brlock *lock);
+
+/**
+ * Acquires the lock shared. A thread may hold
+ * many locks shared, and the same lock more than once.
+ * @arg lock The lock
+ */
+void brlock_rdlock(hlld_brlock *lock);
+
+/**
+ * Releases the lock from a brlock_rdlock
+ * on the same thread
+ * @arg lock The lock
+ */
+void brlock_rdunlock(hlld_brlock *lock);
+
+/**
+ * Acquires the lock exclusively, waiting for
+ * the readers on every thread to leave
+ * @arg lock The lock
+ */
+void brlock_wrlock(hlld_brlock *lock);
+
+/**
+ * Releases the lock from a brlock_wrlock
+ * @arg lock The lock
+ */
+void brlock_wrunlock(hlld_brlock *lock);
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include "clock.h"
+#if defined(__x86_64__) && defined(__linux__)
+#include <x86intrin.h>
+#define HCLOCK_TSC 1
+#endif
+
+/**
+ * The clock source the kernel keeps time with
+ */
+#define CLOCKSOURCE "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+/**
+ * How long the TSC is calibrated for, in nanoseconds
+ */
+#define CALIBRATE_NSEC 10000000
+
+/*
+ * The TSC as calibrated at startup. The nanoseconds of a
+ * reading are base_ns plus the ticks since base_tsc, times
+ * mult shifted down by 32. A mult of 0 means the TSC is
+ * not used.
+ */
+typedef struct {
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t mult;
+} tsc_clock;
+
+static tsc_clock TSC;
+
+/*
+ * The coarse clocks cached by a thread, once it ticked
+ */
+typedef struct {
+    int ticked;
+    uint64_t msec;
+    time_t sec;
+} coarse_cache;
+
+static __thread coarse_cache COARSE;
+
+/*
+ * Reads the monotonic clock, in nanoseconds
+ */
+static uint64_t monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Reads the coarse monotonic clock, in milliseconds
+ */
+static uint64_t read_coarse_msec(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Reads the coarse wall clock, in seconds
+ */
+static time_t read_wall_sec(void) {
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+#else
+    return time(NULL);
+#endif
+}
+
+#ifdef HCLOCK_TSC
+/*
+ * Checks if the kernel keeps time with the TSC, which
+ * it only does once it found the TSC stable across cpus
+ */
+static int kernel_uses_tsc(void) {
+    char buf[32] = {0};
+    FILE *f = fopen(CLOCKSOURCE, "r");
+    if (!f) return 0;
+    int ok = fgets(buf, sizeof(buf), f) && !strncmp(buf, "tsc\n", 4);
+    fclose(f);
+    return ok;
+}
+#endif
+
+/**
+ * Calibrates the TSC, if the kernel keeps time with it.
+ * Takes about 10 milliseconds, and must be called before
+ * any other thread reads the clocks.
+ */
+void hclock_init(void) {
+#ifdef HCLOCK_TSC
+    if (!kernel_uses_tsc()) {
+        syslog(LOG_DEBUG, "Timing with the monotonic clock.");
+        return;
+    }
+    uint64_t start_ns = monotonic_nsec(), start_tsc = __rdtsc();
+    struct timespec wait = {0, CALIBRATE_NSEC};
+    while (nanosleep(&wait, &wait));
+    uint64_t end_ns = monotonic_nsec(), end_tsc = __rdtsc();
+    if (end_tsc <= start_tsc) return;
+
+    TSC.base_tsc = end_tsc;
+    TSC.base_ns = end_ns;
+    TSC.mult = ((end_ns - start_ns) << 32) / (end_tsc - start_tsc);
+    syslog(LOG_DEBUG, "Timing with the TSC, at %.3f ticks per nanosecond.",
+            (double)(end_tsc - start_tsc) / (end_ns - start_ns));
+#endif
+}
+
+/**
+ * Returns the current time for latencies
+ * @return Monotonic nanoseconds
+ */
+uint64_t hclock_nsec(void) {
+#ifdef HCLOCK_TSC
+    if (TSC.mult) {
+        // A cpu may lag the calibrating one by a few ticks
+        uint64_t tsc = __rdtsc();
+        if (tsc < TSC.base_tsc) return TSC.base_ns;
+        return TSC.base_ns + (uint64_t)(((unsigned __int128)(tsc - TSC.base_tsc) * TSC.mult) >> 32);
+    }
+#endif
+    return monotonic_nsec();
+}
+
+/**
+ * Refreshes the coarse clocks of the calling thread
+ */
+void hclock_tick(void) {
+    COARSE.msec = read_coarse_msec();
+    COARSE.sec = read_wall_sec();
+    COARSE.ticked = 1;
+}
+
+/**
+ * Returns the coarse monotonic time, as of the last
+ * tick of the calling thread
+ * @return Monotonic milliseconds
+ */
+uint64_t hclock_coarse_msec(void) {
+    return (COARSE.ticked) ? COARSE.msec : read_coarse_msec();
+}
+
+/**
+ * Returns the coarse wall clock time, as of the last
+ * tick of the calling thread
+ * @return Seconds since the epoch, like time(NULL)
+ */
+time_t hclock_wall_sec(void) {
+    return (COARSE.ticked) ? COARSE.sec : read_wall_sec();
+}
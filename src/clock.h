@@ -0,0 +1,51 @@
+#ifndef HCLOCK_H
+#define HCLOCK_H
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Clocks that are cheap enough to read for every command.
+ *
+ * hclock_nsec reads the TSC, once hclock_init has calibrated it
+ * against the monotonic clock, if the kernel also keeps time with
+ * the TSC. Otherwise, it reads the monotonic clock.
+ *
+ * The coarse clocks are cached by each thread, and refreshed by
+ * hclock_tick, which the workers call each time they wake for
+ * events. A thread that never ticks reads the coarse clocks of
+ * the kernel instead, so it never sees a stale time.
+ */
+
+/**
+ * Calibrates the TSC, if the kernel keeps time with it.
+ * Takes about 10 milliseconds, and must be called before
+ * any other thread reads the clocks.
+ */
+void hclock_init(void);
+
+/**
+ * Returns the current time for latencies
+ * @return Monotonic nanoseconds
+ */
+uint64_t hclock_nsec(void);
+
+/**
+ * Refreshes the coarse clocks of the calling thread
+ */
+void hclock_tick(void);
+
+/**
+ * Returns the coarse monotonic time, as of the last
+ * tick of the calling thread
+ * @return Monotonic milliseconds
+ */
+uint64_t hclock_coarse_msec(void);
+
+/**
+ * Returns the coarse wall clock time, as of the last
+ * tick of the calling thread
+ * @return Seconds since the epoch, like time(NULL)
+ */
+time_t hclock_wall_sec(void);
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hll_hash.h"
+#include "cluster.h"
+
+static int compare_points(const void *a, const void *b) {
+    const cluster_point *x = a, *y = b;
+    if (x->point != y->point) return (x->point > y->point) ? 1 : -1;
+    return x->node - y->node;
+}
+
+/**
+ * Builds the hash ring of the cluster nodes
+ * @arg config The configuration
+ * @arg cluster Output, the ring, or NULL if not clustered
+ * @return 0 on success.
+ */
+int init_cluster(hlld_config *config, hlld_cluster **cluster) {
+    *cluster = NULL;
+    if (!config->cluster_nodes) return 0;
+
+    // Split the node list
+    hlld_cluster *c = calloc(1, sizeof(hlld_cluster));
+    c->local = -1;
+    for (char *p = config->cluster_nodes; p; p = strchr(p, ',')) {
+        if (*p == ',') p++;
+        char *end = strchr(p, ',');
+        int len = (end) ? end - p : (int)strlen(p);
+        c->nodes = realloc(c->nodes, (c->num_nodes + 1) * sizeof(char*));
+        c->nodes[c->num_nodes] = strndup(p, len);
+        if (!strcmp(c->nodes[c->num_nodes], config->cluster_node)) c->local = c->num_nodes;
+        c->num_nodes++;
+    }
+    if (c->local == -1) {
+        destroy_cluster(c);
+        return -1;
+    }
+
+    // Each node is placed at the hashes of its numbered address
+    int vnodes = config->cluster_vnodes;
+    c->num_points = c->num_nodes * vnodes;
+    c->points = malloc(c->num_points * sizeof(cluster_point));
+    char buf[512];
+    for (int n=0; n < c->num_nodes; n++) {
+        for (int i=0; i < vnodes; i++) {
+            int len = snprintf(buf, sizeof(buf), "%s#%d", c->nodes[n], i);
+            cluster_point *point = c->points + n * vnodes + i;
+            point->point = hll_hash_key(HLL_HASH_MURMUR, buf, len);
+            point->node = n;
+        }
+    }
+    qsort(c->points, c->num_points, sizeof(cluster_point), compare_points);
+    *cluster = c;
+    return 0;
+}
+
+/**
+ * Destroys a hash ring
+ * @arg cluster The ring, may be NULL
+ */
+void destroy_cluster(hlld_cluster *cluster) {
+    if (!cluster) return;
+    for (int i=0; i < cluster->num_nodes; i++) free(cluster->nodes[i]);
+    free(cluster->nodes);
+    free(cluster->points);
+    free(cluster);
+}
+
+/**
+ * Finds the node that owns a set
+ * @arg cluster The ring
+ * @arg set_name The set name, which need not be terminated
+ * @arg len The length of the name
+ * @return The index of the node
+ */
+int cluster_node_of(hlld_cluster *cluster, const char *set_name, int len) {
+    uint64_t hash = hll_hash_key(HLL_HASH_MURMUR, set_name, len);
+
+    // Find the first point at or after the hash, wrapping around
+    int low = 0, high = cluster->num_points;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (cluster->points[mid].point < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == cluster->num_points) low = 0;
+    return cluster->points[low].node;
+}
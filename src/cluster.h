@@ -0,0 +1,61 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * In cluster mode, set names are spread over the nodes listed
+ * in cluster_nodes with a consistent hash ring. Each node has
+ * cluster_vnodes points on the ring, and a set belongs to the
+ * node of the first point at or after the hash of its name, so
+ * adding a node only moves the sets of the ring it takes over.
+ */
+
+typedef struct {
+    uint64_t point;
+    int node;
+} cluster_point;
+
+typedef struct {
+    int num_nodes;
+    char **nodes;           // host:port of each node, in config order
+    int local;              // The index of this node
+    int num_points;
+    cluster_point *points;  // Sorted by point
+} hlld_cluster;
+
+/**
+ * Builds the hash ring of the cluster nodes
+ * @arg config The configuration
+ * @arg cluster Output, the ring, or NULL if not clustered
+ * @return 0 on success.
+ */
+int init_cluster(hlld_config *config, hlld_cluster **cluster);
+
+/**
+ * Destroys a hash ring
+ * @arg cluster The ring, may be NULL
+ */
+void destroy_cluster(hlld_cluster *cluster);
+
+/**
+ * Finds the node that owns a set
+ * @arg cluster The ring
+ * @arg set_name The set name, which need not be terminated
+ * @arg len The length of the name
+ * @return The index of the node
+ */
+int cluster_node_of(hlld_cluster *cluster, const char *set_name, int len);
+
+/**
+ * Checks if a set belongs to this node
+ * @arg cluster The ring, or NULL if not clustered
+ * @arg set_name The set name, which need not be terminated
+ * @arg len The length of the name
+ * @return 1 if the set is local.
+ */
+static inline int cluster_is_local(hlld_cluster *cluster, const char *set_name, int len) {
+    return !cluster || cluster_node_of(cluster, set_name, len) == cluster->local;
+}
+
+#endif
@@ -1,14 +1,19 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 #include "hll.h"
 #include "config.h"
+#include "kmv.h"
 #include "ini.h"
 
 /**
@@ -29,7 +34,72 @@ static const hlld_config DEFAULT_CONFIG = {
     3600,               // Cold after an hour
     0,                  // Persist to disk by default
     1,                  // Only a single worker thread by default
-    0                   // Do NOT use mmap by default
+    0,                  // Do NOT use mmap by default
+    HLL_PACKED,         // Pack the registers by default
+    0,                  // Start new sets dense by default
+    HLL_ESTIMATOR_BIAS, // Bias corrected estimates by default
+    HLL_HASH_MURMUR,    // Murmur hash by default
+    0,                  // Store cold sets uncompressed by default
+    1,                  // Flush the sets on a single thread
+    0,                  // Do not limit the flush rate
+    0,                  // Flush sets as soon as they are dirty
+    0,                  // Do not flush early for dirty pages
+    0,                  // No memory budget for the sets
+    0,                  // Accept on the main thread by default
+    128,                // Connection buffers grow up to 128MB
+    0,                  // No HTTP metrics listener by default
+    0,                  // Do not log slow commands by default
+    128,                // Keep the last 128 slow commands
+    0,                  // Do not stream raises to followers by default
+    NULL,               // Not a follower by default
+    NULL,               // Not clustered by default
+    NULL,
+    128,                // Points of each node on the cluster ring
+    1000,               // Reuse fetched remote sets for a second
+    0,                  // New sets are not windowed by default
+    24,                 // Windows keep 24 buckets by default
+    0,                  // New sets are not sliding by default
+    0,                  // New sets keep no minimum hashes by default
+    0,                  // New sets never expire by default
+    DURABILITY_PERIODIC,    // New sets are flushed periodically by default
+    0,                  // on the flush interval
+    0,                  // No write-ahead log by default
+    100,                // Sync the write-ahead log every 100 msec
+    0,                  // Registers use small pages by default
+    0,                  // Each set has its own register file by default
+    0,                  // Do not fold old sets by default
+    10,                 // Fold old sets to precision 10 (1024 registers)
+    0,                  // Own the data directory by default
+    WORKER_AFFINITY_NONE,   // Workers run on any cpu by default
+    SET_AFFINITY_OFF,       // Sets are written by any worker by default
+    0,                      // Clients are served with libev by default
+    0,                      // Workers block for events by default
+    NULL,                   // No unix socket listener by default
+    1024,                   // Connections get 1024 commands per turn
+    1024,                   // or 1MB of input, whichever comes first
+    0,                      // Connections are not rate limited by default
+    0,
+    0,                      // No workers are reserved for high priority clients
+    0,                      // Workers may only be added up to worker_threads
+    0,                      // Connections stay on their worker by default
+    0,                      // Workers run their own commands by default
+    0,                      // Each write of a set is applied on its own by default
+    0,                      // Hot sets are written in place by default
+    0,                      // No shared memory ingest rings by default
+    1024,                   // Rings of 1MB
+    0,                      // Writes to missing sets fail by default
+    1000,                   // Unlink 1000 files of dropped sets a second
+    0,                      // Register files are sparse by default
+    NULL,                   // Only the data_dir by default
+    NULL,
+    0,
+    PLACE_HASH,             // Place sets by the hash of their name
+    0,                      // Flushes go through the page cache by default
+    0,                      // Sets are not cooled by default
+    0,                      // Hot sets are not paged in on start by default
+    0,                      // Sets are never archived by default
+    NULL,                   // No set templates by default
+    NULL                    // No client classes by default
 };
 
 /**
@@ -113,8 +183,90 @@ static int config_callback(void* user, const char* section, const char* name, co
         return value_to_int(value, &config->cold_interval);
     } else if (NAME_MATCH("in_memory")) {
         return value_to_int(value, &config->in_memory);
+    } else if (NAME_MATCH("sparse")) {
+        return value_to_int(value, &config->sparse);
     } else if (NAME_MATCH("use_mmap")) {
         return value_to_int(value, &config->use_mmap);
+    } else if (NAME_MATCH("compress_cold")) {
+        return value_to_int(value, &config->compress_cold);
+    } else if (NAME_MATCH("flush_threads")) {
+        return value_to_int(value, &config->flush_threads);
+    } else if (NAME_MATCH("flush_rate_limit")) {
+        return value_to_int(value, &config->flush_rate_limit);
+    } else if (NAME_MATCH("flush_dirty_age")) {
+        return value_to_int(value, &config->flush_dirty_age);
+    } else if (NAME_MATCH("flush_dirty_pages")) {
+        return value_to_int(value, &config->flush_dirty_pages);
+    } else if (NAME_MATCH("max_memory")) {
+        return value_to_int(value, &config->max_memory);
+    } else if (NAME_MATCH("reuseport")) {
+        return value_to_int(value, &config->reuseport);
+    } else if (NAME_MATCH("io_uring")) {
+        return value_to_int(value, &config->io_uring);
+    } else if (NAME_MATCH("busy_poll")) {
+        return value_to_int(value, &config->busy_poll);
+    } else if (NAME_MATCH("max_conn_buffer")) {
+        return value_to_int(value, &config->max_conn_buffer);
+    } else if (NAME_MATCH("conn_turn_cmds")) {
+        return value_to_int(value, &config->conn_turn_cmds);
+    } else if (NAME_MATCH("conn_turn_kb")) {
+        return value_to_int(value, &config->conn_turn_kb);
+    } else if (NAME_MATCH("conn_cmds_per_sec")) {
+        return value_to_int(value, &config->conn_cmds_per_sec);
+    } else if (NAME_MATCH("conn_kb_per_sec")) {
+        return value_to_int(value, &config->conn_kb_per_sec);
+    } else if (NAME_MATCH("reserved_workers")) {
+        return value_to_int(value, &config->reserved_workers);
+    } else if (NAME_MATCH("max_workers")) {
+        return value_to_int(value, &config->max_workers);
+    } else if (NAME_MATCH("migrate_busy")) {
+        return value_to_int(value, &config->migrate_busy);
+    } else if (NAME_MATCH("exec_threads")) {
+        return value_to_int(value, &config->exec_threads);
+    } else if (NAME_MATCH("coalesce_writes")) {
+        return value_to_int(value, &config->coalesce_writes);
+    } else if (NAME_MATCH("shadow_merge_msec")) {
+        return value_to_int(value, &config->shadow_merge_msec);
+    } else if (NAME_MATCH("ingest_rings")) {
+        return value_to_int(value, &config->ingest_rings);
+    } else if (NAME_MATCH("ingest_ring_kb")) {
+        return value_to_int(value, &config->ingest_ring_kb);
+    } else if (NAME_MATCH("auto_create")) {
+        return value_to_int(value, &config->auto_create);
+    } else if (NAME_MATCH("trash_unlink_rate")) {
+        return value_to_int(value, &config->trash_unlink_rate);
+    } else if (NAME_MATCH("preallocate")) {
+        return value_to_int(value, &config->preallocate);
+    } else if (NAME_MATCH("http_port")) {
+        return value_to_int(value, &config->http_port);
+    } else if (NAME_MATCH("slowlog_usec")) {
+        return value_to_int(value, &config->slowlog_usec);
+    } else if (NAME_MATCH("slowlog_len")) {
+        return value_to_int(value, &config->slowlog_len);
+    } else if (NAME_MATCH("replication_port")) {
+        return value_to_int(value, &config->replication_port);
+    } else if (NAME_MATCH("cluster_vnodes")) {
+        return value_to_int(value, &config->cluster_vnodes);
+    } else if (NAME_MATCH("remote_cache_msec")) {
+        return value_to_int(value, &config->remote_cache_msec);
+    } else if (NAME_MATCH("default_window_buckets")) {
+        return value_to_int(value, &config->default_window_buckets);
+    } else if (NAME_MATCH("default_kmv")) {
+        return value_to_int(value, &config->default_kmv);
+    } else if (NAME_MATCH("wal")) {
+        return value_to_int(value, &config->wal);
+    } else if (NAME_MATCH("wal_sync_msec")) {
+        return value_to_int(value, &config->wal_sync_msec);
+    } else if (NAME_MATCH("huge_pages")) {
+        return value_to_int(value, &config->huge_pages);
+    } else if (NAME_MATCH("slab_registers")) {
+        return value_to_int(value, &config->slab_registers);
+    } else if (NAME_MATCH("fold_after_days")) {
+        return value_to_int(value, &config->fold_after_days);
+    } else if (NAME_MATCH("fold_precision")) {
+        return value_to_int(value, &config->fold_precision);
+    } else if (NAME_MATCH("read_only")) {
+        return value_to_int(value, &config->read_only);
     } else if (NAME_MATCH("workers")) {
         return value_to_int(value, &config->worker_threads);
     } else if (NAME_MATCH("default_precision")) {
@@ -142,6 +294,91 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("replicate_from")) {
+        config->replicate_from = strdup(value);
+    } else if (NAME_MATCH("prewarm")) {
+        return value_to_int(value, &config->prewarm);
+    } else if (NAME_MATCH("archive_after_days")) {
+        return value_to_int(value, &config->archive_after_days);
+    } else if (NAME_MATCH("cool_interval")) {
+        return value_to_int(value, &config->cool_interval);
+    } else if (NAME_MATCH("direct_io")) {
+        return value_to_int(value, &config->direct_io);
+    } else if (NAME_MATCH("data_dirs")) {
+        config->data_dirs = strdup(value);
+    } else if (NAME_MATCH("placement")) {
+        if (!strcasecmp(value, "hash")) {
+            config->placement = PLACE_HASH;
+        } else if (!strcasecmp(value, "space")) {
+            config->placement = PLACE_SPACE;
+        } else {
+            syslog(LOG_ERR, "Unknown placement: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("cluster_nodes")) {
+        config->cluster_nodes = strdup(value);
+    } else if (NAME_MATCH("cluster_node")) {
+        config->cluster_node = strdup(value);
+    } else if (NAME_MATCH("unix_socket")) {
+        config->unix_socket = strdup(value);
+    } else if (NAME_MATCH("default_format")) {
+        if (hll_format_from_name(value, &config->default_format)) {
+            syslog(LOG_ERR, "Unknown register format: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("default_estimator")) {
+        if (hll_estimator_from_name(value, &config->default_estimator)) {
+            syslog(LOG_ERR, "Unknown estimator: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("default_hash")) {
+        if (hll_hash_from_name(value, &config->default_hash)) {
+            syslog(LOG_ERR, "Unknown hash: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("worker_affinity")) {
+        if (!strcasecmp(value, "none")) config->worker_affinity = WORKER_AFFINITY_NONE;
+        else if (!strcasecmp(value, "core")) config->worker_affinity = WORKER_AFFINITY_CORE;
+        else if (!strcasecmp(value, "node")) config->worker_affinity = WORKER_AFFINITY_NODE;
+        else {
+            syslog(LOG_ERR, "Unknown worker affinity: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("set_affinity")) {
+        if (!strcasecmp(value, "off")) config->set_affinity = SET_AFFINITY_OFF;
+        else if (!strcasecmp(value, "worker")) config->set_affinity = SET_AFFINITY_WORKER;
+        else if (!strcasecmp(value, "node")) config->set_affinity = SET_AFFINITY_NODE;
+        else if (!strcasecmp(value, "shard")) config->set_affinity = SET_AFFINITY_SHARD;
+        else {
+            syslog(LOG_ERR, "Unknown set affinity: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("default_window")) {
+        uint64_t secs;
+        if (duration_to_secs(value, &secs) || secs > INT32_MAX) {
+            syslog(LOG_ERR, "Invalid window duration: %s", value);
+            return 0;
+        }
+        config->default_window = secs;
+    } else if (NAME_MATCH("default_sliding")) {
+        uint64_t secs;
+        if (duration_to_secs(value, &secs) || secs > INT32_MAX) {
+            syslog(LOG_ERR, "Invalid sliding duration: %s", value);
+            return 0;
+        }
+        config->default_sliding = secs;
+    } else if (NAME_MATCH("default_ttl")) {
+        uint64_t secs;
+        if (duration_to_secs(value, &secs) || secs > INT32_MAX) {
+            syslog(LOG_ERR, "Invalid ttl duration: %s", value);
+            return 0;
+        }
+        config->default_ttl = secs;
+    } else if (NAME_MATCH("default_durability")) {
+        if (durability_from_name(value, &config->default_durability, &config->default_flush_period)) {
+            syslog(LOG_ERR, "Invalid durability: %s", value);
+            return 0;
+        }
 
         // Unknown parameter?
     } else {
@@ -153,6 +390,190 @@ static int config_callback(void* user, const char* section, const char* name, co
     return 1;
 }
 
+/**
+ * The sections of set templates start with this
+ */
+static const char TEMPLATE_SECTION[] = "template:";
+static const int TEMPLATE_SECTION_LEN = sizeof(TEMPLATE_SECTION) - 1;
+
+/**
+ * The settings a template may override
+ */
+static const char *TEMPLATE_PARAMS[] = {
+    "default_precision", "default_eps", "in_memory", "sparse", "default_format",
+    "default_estimator", "default_hash", "default_window", "default_window_buckets",
+    "default_sliding", "default_kmv", "default_ttl", "default_durability", NULL
+};
+
+/**
+ * Callback function to use with INI-H, reading
+ * the sections of set templates.
+ * @arg user Opaque user value. We use the hlld_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int template_callback(void* user, const char* section, const char* name, const char* value) {
+    // Ignore any non-template sections
+    if (strncasecmp(TEMPLATE_SECTION, section, TEMPLATE_SECTION_LEN) ||
+            !section[TEMPLATE_SECTION_LEN]) {
+        return 1;
+    }
+    const char *template_name = section + TEMPLATE_SECTION_LEN;
+
+    int known = 0;
+    for (const char **param = TEMPLATE_PARAMS; *param && !known; param++)
+        known = !strcasecmp(*param, name);
+    if (!known) {
+        syslog(LOG_ERR, "Unrecognized parameter of template %s: %s", template_name, name);
+        return 0;
+    }
+
+    // Templates start as a copy of the main config
+    hlld_config *config = (hlld_config*)user;
+    hlld_set_template *t = config->templates;
+    while (t && strcmp(t->name, template_name)) t = t->next;
+    if (!t) {
+        t = malloc(sizeof(hlld_set_template));
+        t->name = strdup(template_name);
+        memcpy(&t->config, config, sizeof(hlld_config));
+        t->config.templates = NULL;
+        t->next = config->templates;
+        config->templates = t;
+    }
+    return config_callback(&t->config, "hlld", name, value);
+}
+
+/**
+ * The sections of client classes start with this
+ */
+static const char CLASS_SECTION[] = "class:";
+static const int CLASS_SECTION_LEN = sizeof(CLASS_SECTION) - 1;
+
+/**
+ * Adds the networks of a comma separated list to a class.
+ * Each is an IPv4 address with an optional prefix length,
+ * such as 10.0.0.0/8, or "unix" for the unix socket clients.
+ * @return 1 on success, 0 on error.
+ */
+static int add_class_networks(hlld_client_class *c, const char *value) {
+    char *list = strdup(value), *save = NULL;
+    int ok = 1;
+    for (char *net = strtok_r(list, ", ", &save); net && ok; net = strtok_r(NULL, ", ", &save)) {
+        if (!strcasecmp(net, "unix")) {
+            c->match_unix = 1;
+            continue;
+        }
+
+        int prefix = 32;
+        char *slash = strchr(net, '/');
+        if (slash) {
+            *slash = '\0';
+            char *end;
+            prefix = strtol(slash + 1, &end, 10);
+            if (end == slash + 1 || *end || prefix < 0 || prefix > 32) ok = 0;
+        }
+        struct in_addr addr;
+        if (!ok || inet_pton(AF_INET, net, &addr) != 1) {
+            ok = 0;
+            break;
+        }
+
+        uint32_t *addrs = realloc(c->addrs, (c->num_networks + 1) * sizeof(uint32_t));
+        if (addrs) c->addrs = addrs;
+        uint32_t *masks = realloc(c->masks, (c->num_networks + 1) * sizeof(uint32_t));
+        if (masks) c->masks = masks;
+        if (!addrs || !masks) {
+            ok = 0;
+            break;
+        }
+        uint32_t mask = (prefix) ? 0xFFFFFFFFU << (32 - prefix) : 0;
+        c->masks[c->num_networks] = mask;
+        c->addrs[c->num_networks++] = ntohl(addr.s_addr) & mask;
+    }
+    free(list);
+    return ok;
+}
+
+/**
+ * Callback function to use with INI-H, reading
+ * the sections of client classes.
+ * @arg user Opaque user value. We use the hlld_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int class_callback(void* user, const char* section, const char* name, const char* value) {
+    // Ignore any non-class sections
+    if (strncasecmp(CLASS_SECTION, section, CLASS_SECTION_LEN) ||
+            !section[CLASS_SECTION_LEN]) {
+        return 1;
+    }
+    const char *class_name = section + CLASS_SECTION_LEN;
+
+    // Classes are kept in the order of the file, as the first match wins
+    hlld_config *config = (hlld_config*)user;
+    hlld_client_class **prev = &config->client_classes;
+    while (*prev && strcmp((*prev)->name, class_name)) prev = &(*prev)->next;
+    hlld_client_class *c = *prev;
+    if (!c) {
+        c = calloc(1, sizeof(hlld_client_class));
+        c->name = strdup(class_name);
+        *prev = c;
+    }
+
+    int res = 1;
+    if (NAME_MATCH("networks")) {
+        res = add_class_networks(c, value);
+    } else if (NAME_MATCH("cmds_per_sec")) {
+        res = value_to_int(value, &c->cmds_per_sec);
+    } else if (NAME_MATCH("kb_per_sec")) {
+        res = value_to_int(value, &c->kb_per_sec);
+    } else if (NAME_MATCH("priority")) {
+        if (!strcasecmp(value, "high")) {
+            c->high_priority = 1;
+        } else if (!strcasecmp(value, "normal")) {
+            c->high_priority = 0;
+        } else {
+            res = 0;
+        }
+    } else {
+        syslog(LOG_ERR, "Unrecognized parameter of client class %s: %s", class_name, name);
+        return 0;
+    }
+    if (!res) syslog(LOG_ERR, "Invalid %s of client class %s: %s", name, class_name, value);
+    return res;
+}
+
+hlld_client_class* config_client_class(hlld_config *config, const struct sockaddr *addr) {
+    for (hlld_client_class *c = config->client_classes; c; c = c->next) {
+        if (addr->sa_family == AF_UNIX) {
+            if (c->match_unix) return c;
+            continue;
+        }
+        if (addr->sa_family != AF_INET) continue;
+        uint32_t ip = ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr);
+        for (int i=0; i < c->num_networks; i++) {
+            if ((ip & c->masks[i]) == c->addrs[i]) return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the number of workers that may run, which is
+ * max_workers if set, otherwise worker_threads. Each has
+ * a slot of the metrics and of the shadow registers.
+ * @arg config The config
+ * @return The number of slots of the workers
+ */
+int config_worker_slots(hlld_config *config) {
+    return (config->max_workers > config->worker_threads) ?
+        config->max_workers : config->worker_threads;
+}
+
 /**
  * Initializes the configuration from a filename.
  * Reads the file as an INI configuration, and sets up the
@@ -175,6 +596,10 @@ int config_from_filename(char *filename, hlld_config *config) {
         return -ENOENT;
     }
 
+    // Templates are read once the main config is complete,
+    // so that they inherit it wherever they are in the file
+    ini_parse(filename, template_callback, config);
+    if (ini_parse(filename, class_callback, config)) return -EINVAL;
     return 0;
 }
 
@@ -242,6 +667,37 @@ int sane_data_dir(char *data_dir) {
     return 0;
 }
 
+int sane_data_dirs(char *data_dirs, char ***list, int *num) {
+    *list = NULL;
+    *num = 0;
+    if (!data_dirs) return 0;
+
+    // Each directory of the comma separated list must be usable
+    for (char *start = data_dirs; ; start = strchr(start, ',') + 1) {
+        char *end = strchr(start, ',');
+        int len = (end) ? end - start : (int)strlen(start);
+        while (len && isspace(*start)) start++, len--;
+        while (len && isspace(start[len - 1])) len--;
+        if (!len) {
+            syslog(LOG_ERR, "Illegal value for data_dirs. Must be a comma separated list of directories.");
+            goto FAIL;
+        }
+        char *dir = strndup(start, len);
+        *list = realloc(*list, (*num + 1) * sizeof(char*));
+        (*list)[(*num)++] = dir;
+        if (sane_data_dir(dir)) goto FAIL;
+        if (!end) break;
+    }
+    return 0;
+
+FAIL:
+    for (int i=0; i < *num; i++) free((*list)[i]);
+    free(*list);
+    *list = NULL;
+    *num = 0;
+    return 1;
+}
+
 int sane_log_level(char *log_level, int *syslog_level) {
 #define LOG_MATCH(lvl) (strcasecmp(lvl, log_level) == 0)
     if (LOG_MATCH("DEBUG")) {
@@ -358,6 +814,595 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_default_format(hll_format format) {
+    if (!hll_format_name(format)) {
+        syslog(LOG_ERR, "Illegal value for the register format.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_sparse(int sparse) {
+    if (sparse != 0 && sparse != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for sparse. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_compress_cold(int compress_cold) {
+    if (compress_cold != 0 && compress_cold != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for compress_cold. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_threads(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR,
+                "Cannot have fewer than one flush thread!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_rate_limit(int limit) {
+    if (limit < 0) {
+        syslog(LOG_ERR, "Flush rate limit cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_dirty_age(int age) {
+    if (age < 0) {
+        syslog(LOG_ERR, "Flush dirty age cannot be negative!");
+        return 1;
+    } else if (age >= 600) {
+        syslog(LOG_WARNING,
+                "Dirty sets wait very long to be flushed! Increased risk of data loss.");
+    }
+    return 0;
+}
+
+int sane_flush_dirty_pages(int pages) {
+    if (pages < 0) {
+        syslog(LOG_ERR, "Flush dirty pages cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_max_memory(int max_memory) {
+    if (max_memory < 0) {
+        syslog(LOG_ERR, "Max memory cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_reuseport(int reuseport) {
+    if (reuseport != 0 && reuseport != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for reuseport. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_max_conn_buffer(int max_conn_buffer) {
+    if (max_conn_buffer < 1 || max_conn_buffer > 1024) {
+        syslog(LOG_ERR,
+                "Illegal value for max_conn_buffer. Must be 1 to 1024 MB.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_slowlog_usec(int usec) {
+    if (usec < 0) {
+        syslog(LOG_ERR,
+                "Illegal value for slowlog_usec. Must be 0 or more.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_slowlog_len(int len) {
+    if (len < 1 || len > 65536) {
+        syslog(LOG_ERR,
+                "Illegal value for slowlog_len. Must be 1 to 65536.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replication_port(int port) {
+    if (port < 0 || port > 65535) {
+        syslog(LOG_ERR,
+                "Illegal value for replication_port. Must be 0 to 65535.");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Checks for a host:port address
+ * @arg addr The address, of len bytes
+ * @return 1 if valid.
+ */
+static int valid_address(const char *addr, int len) {
+    const char *colon = NULL;
+    for (int i=0; i < len; i++) {
+        if (addr[i] == ':') colon = addr + i;
+    }
+    if (!colon || colon == addr || colon == addr + len - 1 || len - (colon - addr) > 6)
+        return 0;
+    int port = 0;
+    for (const char *p=colon + 1; p < addr + len; p++) {
+        if (*p < '0' || *p > '9') return 0;
+        port = port * 10 + (*p - '0');
+    }
+    return port >= 1 && port <= 65535;
+}
+
+int sane_replicate_from(char *replicate_from) {
+    if (!replicate_from) return 0;
+    if (!valid_address(replicate_from, strlen(replicate_from))) {
+        syslog(LOG_ERR,
+                "Illegal value for replicate_from. Must be host:port.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cluster(char *nodes, char *node, int vnodes) {
+    if (vnodes < 1 || vnodes > 4096) {
+        syslog(LOG_ERR,
+                "Illegal value for cluster_vnodes. Must be 1 to 4096.");
+        return 1;
+    }
+    if (!nodes && !node) return 0;
+    if (!nodes || !node) {
+        syslog(LOG_ERR,
+                "Both cluster_nodes and cluster_node must be set.");
+        return 1;
+    }
+
+    // Each node is a host:port, and ours must be listed
+    int found = 0, node_len = strlen(node);
+    for (char *start = nodes; ; start = strchr(start, ',') + 1) {
+        char *end = strchr(start, ',');
+        int len = (end) ? end - start : (int)strlen(start);
+        if (!valid_address(start, len)) {
+            syslog(LOG_ERR,
+                    "Illegal value for cluster_nodes. Must be a comma separated list of host:port.");
+            return 1;
+        }
+        if (len == node_len && !strncmp(start, node, len)) found = 1;
+        if (!end) break;
+    }
+    if (!found) {
+        syslog(LOG_ERR,
+                "Illegal value for cluster_node. Must be one of cluster_nodes.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_remote_cache_msec(int msec) {
+    if (msec < 100 || msec > 3600000) {
+        syslog(LOG_ERR,
+                "Illegal value for remote_cache_msec. Must be 100 to 3600000.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_window(int window, int buckets) {
+    if (window < 0 || window > 31536000) {
+        syslog(LOG_ERR,
+                "Illegal value for the window. Must be 0 to 365 days.");
+        return 1;
+    }
+    if (buckets < 1 || buckets > 1024) {
+        syslog(LOG_ERR,
+                "Illegal value for the window buckets. Must be 1 to 1024.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_sliding(int sliding, int window) {
+    if (sliding < 0 || sliding > 31536000) {
+        syslog(LOG_ERR,
+                "Illegal value for the sliding window. Must be 0 to 365 days.");
+        return 1;
+    }
+    if (sliding && window) {
+        syslog(LOG_ERR, "A set cannot be both windowed and sliding.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_kmv(int kmv) {
+    if (kmv && (kmv < KMV_MIN_SIZE || kmv > KMV_MAX_SIZE)) {
+        syslog(LOG_ERR,
+                "Illegal value for the minimum hashes. Must be 0, or 16 to 65536.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_ttl(int ttl) {
+    if (ttl < 0) {
+        syslog(LOG_ERR, "Illegal value for the ttl. Must be positive, or 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_durability(hlld_durability durability, int flush_period, int wal) {
+    if (!durability_name(durability)) {
+        syslog(LOG_ERR, "Illegal value for the durability.");
+        return 1;
+    }
+    if (flush_period < 0 || (flush_period && durability == DURABILITY_VOLATILE)) {
+        syslog(LOG_ERR, "Illegal value for the flush period. Must be positive, or 0, "
+                "and volatile sets have none.");
+        return 1;
+    }
+    if (durability == DURABILITY_WAL && !wal) {
+        syslog(LOG_ERR, "The wal durability needs the write-ahead log. Must set wal = 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_wal(int wal, int sync_msec) {
+    if (wal != 0 && wal != 1) {
+        syslog(LOG_ERR, "Illegal value for wal. Must be 0 or 1.");
+        return 1;
+    }
+    if (sync_msec < 1 || sync_msec > 10000) {
+        syslog(LOG_ERR,
+                "Illegal value for wal_sync_msec. Must be 1 to 10000.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_huge_pages(int huge_pages) {
+    if (huge_pages != 0 && huge_pages != 1) {
+        syslog(LOG_ERR, "Illegal value for huge_pages. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_slab_registers(int slab_registers) {
+    if (slab_registers != 0 && slab_registers != 1) {
+        syslog(LOG_ERR, "Illegal value for slab_registers. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_fold(int days, int precision) {
+    if (days < 0 || days > 36500) {
+        syslog(LOG_ERR, "Illegal value for fold_after_days. Must be between 0 and 36500.");
+        return 1;
+    }
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) {
+        syslog(LOG_ERR, "Illegal value for fold_precision. Must be between %d and %d.",
+                HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_read_only(int read_only, int in_memory, int wal, int slab_registers, char *replicate_from) {
+    if (read_only != 0 && read_only != 1) {
+        syslog(LOG_ERR, "Illegal value for read_only. Must be 0 or 1.");
+        return 1;
+    }
+    if (read_only && (in_memory || wal || slab_registers || replicate_from)) {
+        syslog(LOG_ERR, "A read only server cannot use in_memory, wal, slab_registers or replicate_from.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_affinity(hlld_worker_affinity worker_affinity, hlld_set_affinity set_affinity) {
+    if (worker_affinity < WORKER_AFFINITY_NONE || worker_affinity > WORKER_AFFINITY_NODE) {
+        syslog(LOG_ERR, "Illegal value for worker_affinity.");
+        return 1;
+    }
+    if (set_affinity < SET_AFFINITY_OFF || set_affinity > SET_AFFINITY_SHARD) {
+        syslog(LOG_ERR, "Illegal value for set_affinity.");
+        return 1;
+    }
+    if (set_affinity == SET_AFFINITY_NODE && worker_affinity == WORKER_AFFINITY_NONE) {
+        syslog(LOG_ERR, "A set_affinity of node needs the workers pinned by worker_affinity.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_io_uring(int io_uring) {
+    if (io_uring != 0 && io_uring != 1) {
+        syslog(LOG_ERR, "Illegal value for io_uring. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_busy_poll(int busy_poll) {
+    if (busy_poll < 0 || busy_poll > 1000000) {
+        syslog(LOG_ERR,
+                "Illegal value for busy_poll. Must be 0 to 1000000 usec.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_unix_socket(char *unix_socket) {
+    if (!unix_socket) return 0;
+    struct sockaddr_un addr;
+    if (!*unix_socket || strlen(unix_socket) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Illegal value for unix_socket. Must be a path of 1 to %d bytes.",
+                (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_conn_turn(int cmds, int kb) {
+    if (cmds < 0 || cmds > 1000000) {
+        syslog(LOG_ERR,
+                "Illegal value for conn_turn_cmds. Must be 0 to 1000000.");
+        return 1;
+    }
+    if (kb < 0 || kb > 1048576) {
+        syslog(LOG_ERR,
+                "Illegal value for conn_turn_kb. Must be 0 to 1048576 KB.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_conn_rate(int cmds_per_sec, int kb_per_sec) {
+    if (cmds_per_sec < 0 || cmds_per_sec > 100000000) {
+        syslog(LOG_ERR,
+                "Illegal value for the commands per second. Must be 0 to 100000000.");
+        return 1;
+    }
+    if (kb_per_sec < 0 || kb_per_sec > 16777216) {
+        syslog(LOG_ERR,
+                "Illegal value for the KB per second. Must be 0 to 16777216 KB.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_reserved_workers(int reserved, int worker_threads) {
+    if (reserved < 0 || (reserved && reserved >= worker_threads)) {
+        syslog(LOG_ERR,
+                "Illegal value for reserved_workers. Must be 0, or less than worker_threads.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_max_workers(int max_workers, int worker_threads) {
+    if (max_workers < 0 || (max_workers && max_workers < worker_threads)) {
+        syslog(LOG_ERR,
+                "Illegal value for max_workers. Must be 0, or at least worker_threads.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_migrate_busy(int migrate_busy) {
+    if (migrate_busy < 0 || migrate_busy > 100) {
+        syslog(LOG_ERR,
+                "Illegal value for migrate_busy. Must be 0 to 100 percent.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_exec_threads(int exec_threads) {
+    if (exec_threads < 0 || exec_threads > 256) {
+        syslog(LOG_ERR,
+                "Illegal value for exec_threads. Must be 0 to 256.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_coalesce_writes(int coalesce_writes) {
+    if (coalesce_writes != 0 && coalesce_writes != 1) {
+        syslog(LOG_ERR, "Illegal value for coalesce_writes. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shadow_merge_msec(int shadow_merge_msec) {
+    if (shadow_merge_msec < 0 || shadow_merge_msec > 1000) {
+        syslog(LOG_ERR,
+                "Illegal value for shadow_merge_msec. Must be 0 to 1000.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_ingest_rings(int rings, int ring_kb) {
+    if (rings < 0 || rings > 64) {
+        syslog(LOG_ERR, "Illegal value for ingest_rings. Must be 0 to 64.");
+        return 1;
+    }
+    if (ring_kb < 64 || ring_kb > 1048576 || (ring_kb & (ring_kb - 1))) {
+        syslog(LOG_ERR,
+                "Illegal value for ingest_ring_kb. Must be a power of 2 from 64 to 1048576.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_auto_create(int auto_create) {
+    if (auto_create != 0 && auto_create != 1) {
+        syslog(LOG_ERR, "Illegal value for auto_create. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_trash_unlink_rate(int trash_unlink_rate) {
+    if (trash_unlink_rate < 0 || trash_unlink_rate > 1000000) {
+        syslog(LOG_ERR, "Illegal value for trash_unlink_rate. Must be 0 to 1000000.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cool_interval(int cool_interval, int cold_interval) {
+    if (cool_interval < 0) {
+        syslog(LOG_ERR, "Cool interval cannot be negative!");
+        return 1;
+    } else if (cool_interval && cold_interval && cool_interval >= cold_interval) {
+        syslog(LOG_ERR, "Illegal value for cool_interval. Must be less than the cold_interval.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_prewarm(int prewarm) {
+    if (prewarm != 0 && prewarm != 1) {
+        syslog(LOG_ERR, "Illegal value for prewarm. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_archive_after_days(int days) {
+    if (days < 0 || days > 36500) {
+        syslog(LOG_ERR, "Illegal value for archive_after_days. Must be between 0 and 36500.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_direct_io(int direct_io) {
+    if (direct_io != 0 && direct_io != 1) {
+        syslog(LOG_ERR, "Illegal value for direct_io. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_preallocate(int preallocate) {
+    if (preallocate < 0 || preallocate > 2) {
+        syslog(LOG_ERR, "Illegal value for preallocate. Must be 0, 1 or 2.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_default_estimator(hll_estimator estimator) {
+    if (!hll_estimator_name(estimator)) {
+        syslog(LOG_ERR, "Illegal value for the estimator.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_default_hash(hll_hash hash) {
+    if (!hll_hash_name(hash)) {
+        syslog(LOG_ERR, "Illegal value for the hash.");
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Converts a duration to seconds. Durations are a
+ * count with an optional unit of s, m, h, d or w,
+ * such as "90", "15m" or "24h".
+ * @arg value The duration
+ * @arg secs Output, the seconds
+ * @return 0 on success, -1 if the duration is invalid.
+ */
+int duration_to_secs(const char *value, uint64_t *secs) {
+    char *end;
+    if (*value < '0' || *value > '9') return -1;
+    errno = 0;
+    unsigned long long count = strtoull(value, &end, 10);
+    if (errno || count > UINT32_MAX) return -1;
+
+    uint64_t unit;
+    switch (*end) {
+        case '\0': case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 3600; break;
+        case 'd': unit = 86400; break;
+        case 'w': unit = 604800; break;
+        default: return -1;
+    }
+    if (*end && end[1]) return -1;
+    *secs = count * unit;
+    return 0;
+}
+
+/**
+ * The names of the durability classes, by value
+ */
+static const char *DURABILITY_NAMES[] = {"periodic", "volatile", "wal"};
+#define NUM_DURABILITIES (int)(sizeof(DURABILITY_NAMES) / sizeof(char*))
+
+/**
+ * Parses a durability class, which is "volatile", or "periodic"
+ * or "wal" with an optional flush period after a colon,
+ * such as "periodic:30s".
+ * @arg value The durability
+ * @arg durability Output, the class
+ * @arg flush_period Output, the flush period in seconds, or 0
+ * @return 0 on success, -1 if the durability is invalid.
+ */
+int durability_from_name(const char *value, hlld_durability *durability, int *flush_period) {
+    const char *colon = strchr(value, ':');
+    size_t len = (colon) ? (size_t)(colon - value) : strlen(value);
+    for (int i=0; i < NUM_DURABILITIES; i++) {
+        if (strlen(DURABILITY_NAMES[i]) != len || strncasecmp(DURABILITY_NAMES[i], value, len))
+            continue;
+
+        // Volatile sets are not flushed, so have no period
+        uint64_t secs = 0;
+        if (colon && (i == DURABILITY_VOLATILE || duration_to_secs(colon + 1, &secs) ||
+                    !secs || secs > INT32_MAX))
+            return -1;
+        *durability = i;
+        *flush_period = secs;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Returns the name of a durability class
+ * @arg durability The class
+ * @return The name, or NULL if the class is unknown.
+ */
+const char* durability_name(hlld_durability durability) {
+    if ((int)durability < 0 || (int)durability >= NUM_DURABILITIES) return NULL;
+    return DURABILITY_NAMES[durability];
+}
 
 /**
  * Validates the configuration
@@ -367,6 +1412,9 @@ int sane_worker_threads(int threads) {
 int validate_config(hlld_config *config) {
     int res = 0;
 
+    // The first of the data_dirs is the data_dir
+    res |= sane_data_dirs(config->data_dirs, &config->data_dir_list, &config->num_data_dirs);
+    if (config->num_data_dirs) config->data_dir = config->data_dir_list[0];
     res |= sane_data_dir(config->data_dir);
     res |= sane_log_level(config->log_level, &config->syslog_log_level);
     res |= sane_default_eps(config->default_eps);
@@ -376,10 +1424,99 @@ int validate_config(hlld_config *config) {
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_default_format(config->default_format);
+    res |= sane_sparse(config->sparse);
+    res |= sane_default_estimator(config->default_estimator);
+    res |= sane_default_hash(config->default_hash);
+    res |= sane_compress_cold(config->compress_cold);
+    res |= sane_flush_threads(config->flush_threads);
+    res |= sane_flush_rate_limit(config->flush_rate_limit);
+    res |= sane_flush_dirty_age(config->flush_dirty_age);
+    res |= sane_flush_dirty_pages(config->flush_dirty_pages);
+    res |= sane_max_memory(config->max_memory);
+    res |= sane_reuseport(config->reuseport);
+    res |= sane_max_conn_buffer(config->max_conn_buffer);
+    res |= sane_slowlog_usec(config->slowlog_usec);
+    res |= sane_slowlog_len(config->slowlog_len);
+    res |= sane_replication_port(config->replication_port);
+    res |= sane_replicate_from(config->replicate_from);
+    res |= sane_cluster(config->cluster_nodes, config->cluster_node, config->cluster_vnodes);
+    res |= sane_remote_cache_msec(config->remote_cache_msec);
+    res |= sane_window(config->default_window, config->default_window_buckets);
+    res |= sane_sliding(config->default_sliding, config->default_window);
+    res |= sane_kmv(config->default_kmv);
+    res |= sane_ttl(config->default_ttl);
+    res |= sane_durability(config->default_durability, config->default_flush_period, config->wal);
+    res |= sane_wal(config->wal, config->wal_sync_msec);
+    res |= sane_huge_pages(config->huge_pages);
+    res |= sane_slab_registers(config->slab_registers);
+    res |= sane_fold(config->fold_after_days, config->fold_precision);
+    res |= sane_read_only(config->read_only, config->in_memory, config->wal,
+            config->slab_registers, config->replicate_from);
+    res |= sane_affinity(config->worker_affinity, config->set_affinity);
+    res |= sane_io_uring(config->io_uring);
+    res |= sane_busy_poll(config->busy_poll);
+    res |= sane_unix_socket(config->unix_socket);
+    res |= sane_conn_turn(config->conn_turn_cmds, config->conn_turn_kb);
+    res |= sane_conn_rate(config->conn_cmds_per_sec, config->conn_kb_per_sec);
+    res |= sane_reserved_workers(config->reserved_workers, config->worker_threads);
+    res |= sane_max_workers(config->max_workers, config->worker_threads);
+    res |= sane_migrate_busy(config->migrate_busy);
+    res |= sane_exec_threads(config->exec_threads);
+    res |= sane_coalesce_writes(config->coalesce_writes);
+    res |= sane_shadow_merge_msec(config->shadow_merge_msec);
+    res |= sane_ingest_rings(config->ingest_rings, config->ingest_ring_kb);
+    res |= sane_auto_create(config->auto_create);
+    res |= sane_trash_unlink_rate(config->trash_unlink_rate);
+    res |= sane_preallocate(config->preallocate);
+    res |= sane_direct_io(config->direct_io);
+    res |= sane_cool_interval(config->cool_interval, config->cold_interval);
+    res |= sane_prewarm(config->prewarm);
+    res |= sane_archive_after_days(config->archive_after_days);
+
+    for (hlld_set_template *t = config->templates; t; t = t->next) {
+        if (sane_set_options(&t->config)) {
+            syslog(LOG_ERR, "Illegal settings for template %s.", t->name);
+            res |= 1;
+        }
+    }
+    for (hlld_client_class *c = config->client_classes; c; c = c->next) {
+        if (!c->num_networks && !c->match_unix) {
+            syslog(LOG_ERR, "Client class %s has no networks.", c->name);
+            res |= 1;
+        }
+        if (sane_conn_rate(c->cmds_per_sec, c->kb_per_sec)) {
+            syslog(LOG_ERR, "Illegal rate limits for client class %s.", c->name);
+            res |= 1;
+        }
+    }
+    return res;
+}
 
+int sane_set_options(hlld_config *config) {
+    int res = 0;
+    res |= sane_default_precision(config->default_precision);
+    res |= sane_default_eps(config->default_eps);
+    res |= sane_in_memory(config->in_memory);
+    res |= sane_default_format(config->default_format);
+    res |= sane_sparse(config->sparse);
+    res |= sane_default_estimator(config->default_estimator);
+    res |= sane_default_hash(config->default_hash);
+    res |= sane_window(config->default_window, config->default_window_buckets);
+    res |= sane_sliding(config->default_sliding, config->default_window);
+    res |= sane_kmv(config->default_kmv);
+    res |= sane_ttl(config->default_ttl);
+    res |= sane_durability(config->default_durability, config->default_flush_period, config->wal);
     return res;
 }
 
+hlld_config* config_template(hlld_config *config, const char *name) {
+    for (hlld_set_template *t = config->templates; t; t = t->next) {
+        if (!strcmp(t->name, name)) return &t->config;
+    }
+    return NULL;
+}
+
 /**
  * Callback function to use with INI-H.
  * @arg user Opaque user value. We use the hlld_config pointer
@@ -403,8 +1540,42 @@ static int set_config_callback(void* user, const char* section, const char* name
     // Handle the int cases
     if (NAME_MATCH("in_memory")) {
         return value_to_int(value, &config->in_memory);
+    } else if (NAME_MATCH("sparse")) {
+        return value_to_int(value, &config->sparse);
     } else if (NAME_MATCH("default_precision")) {
         return value_to_int(value, &config->default_precision);
+    } else if (NAME_MATCH("window")) {
+        return value_to_int(value, &config->window);
+    } else if (NAME_MATCH("window_buckets")) {
+        return value_to_int(value, &config->window_buckets);
+    } else if (NAME_MATCH("sliding")) {
+        return value_to_int(value, &config->sliding);
+    } else if (NAME_MATCH("kmv")) {
+        return value_to_int(value, &config->kmv);
+    } else if (NAME_MATCH("expires")) {
+        return value_to_int64(value, &config->expires);
+
+        // Handle the string cases
+    } else if (NAME_MATCH("format")) {
+        if (hll_format_from_name(value, &config->format)) {
+            syslog(LOG_ERR, "Unknown set register format: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("estimator")) {
+        if (hll_estimator_from_name(value, &config->estimator)) {
+            syslog(LOG_ERR, "Unknown set estimator: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("hash")) {
+        if (hll_hash_from_name(value, &config->hash)) {
+            syslog(LOG_ERR, "Unknown set hash: %s", value);
+            return 0;
+        }
+    } else if (NAME_MATCH("durability")) {
+        if (durability_from_name(value, &config->durability, &config->flush_period)) {
+            syslog(LOG_ERR, "Unknown set durability: %s", value);
+            return 0;
+        }
 
         // Handle big int
     } else if (NAME_MATCH("size")) {
@@ -462,11 +1633,37 @@ int update_filename_from_set_config(char *filename, hlld_set_config *config) {
 size = %llu\n\
 default_eps = %f\n\
 default_precision = %d\n\
-in_memory = %d\n", (unsigned long long)config->size,
+in_memory = %d\n\
+format = %s\n\
+sparse = %d\n\
+estimator = %s\n\
+hash = %s\n", (unsigned long long)config->size,
             config->default_eps,
             config->default_precision,
-            config->in_memory
+            config->in_memory,
+            hll_format_name(config->format),
+            config->sparse,
+            hll_estimator_name(config->estimator),
+            hll_hash_name(config->hash)
            );
+    if (config->window) {
+        fprintf(f, "window = %d\nwindow_buckets = %d\n",
+                config->window, config->window_buckets);
+    }
+    if (config->sliding) {
+        fprintf(f, "sliding = %d\n", config->sliding);
+    }
+    if (config->kmv) {
+        fprintf(f, "kmv = %d\n", config->kmv);
+    }
+    if (config->expires) {
+        fprintf(f, "expires = %llu\n", (unsigned long long)config->expires);
+    }
+    if (config->flush_period) {
+        fprintf(f, "durability = %s:%d\n", durability_name(config->durability), config->flush_period);
+    } else if (config->durability) {
+        fprintf(f, "durability = %s\n", durability_name(config->durability));
+    }
 
     // Close
     fclose(f);
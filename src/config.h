@@ -2,6 +2,48 @@
 #define CONFIG_H
 #include <stdint.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include "hll.h"
+#include "hll_hash.h"
+
+/**
+ * Placement of the worker threads
+ */
+typedef enum {
+    WORKER_AFFINITY_NONE = 0,   // Workers run on any cpu
+    WORKER_AFFINITY_CORE,       // Each worker is pinned to a cpu
+    WORKER_AFFINITY_NODE        // Each worker is pinned to the cpus of a NUMA node
+} hlld_worker_affinity;
+
+/**
+ * Which worker writes to a set
+ */
+typedef enum {
+    SET_AFFINITY_OFF = 0,       // The worker of the connection
+    SET_AFFINITY_WORKER,        // The worker owning the set
+    SET_AFFINITY_NODE,          // A worker on the NUMA node owning the set
+    SET_AFFINITY_SHARD          // The worker owning the set, for writes of many sets too
+} hlld_set_affinity;
+
+struct hlld_set_template;
+struct hlld_client_class;
+
+/**
+ * How new sets are placed across the data directories
+ */
+typedef enum {
+    PLACE_HASH = 0,     // By a hash of the set name
+    PLACE_SPACE = 1     // In the directory with the most free space
+} set_placement;
+
+/**
+ * How the writes of a set are made durable
+ */
+typedef enum {
+    DURABILITY_PERIODIC = 0,    // Flushed once per flush period, and logged if there is a WAL
+    DURABILITY_VOLATILE = 1,    // Never flushed by the maintenance, nor logged
+    DURABILITY_WAL = 2          // Logged, each write waiting for the log to sync
+} hlld_durability;
 
 /**
  * Stores our configuration
@@ -20,8 +62,103 @@ typedef struct {
     int in_memory;
     int worker_threads;
     int use_mmap;
+    hll_format default_format;
+    int sparse;
+    hll_estimator default_estimator;
+    hll_hash default_hash;
+    int compress_cold;
+    int flush_threads;
+    int flush_rate_limit;
+    int flush_dirty_age;
+    int flush_dirty_pages;
+    int max_memory;
+    int reuseport;
+    int max_conn_buffer;
+    int http_port;
+    int slowlog_usec;
+    int slowlog_len;
+    int replication_port;
+    char *replicate_from;
+    char *cluster_nodes;
+    char *cluster_node;
+    int cluster_vnodes;
+    int remote_cache_msec;
+    int default_window;
+    int default_window_buckets;
+    int default_sliding;
+    int default_kmv;
+    int default_ttl;
+    hlld_durability default_durability;
+    int default_flush_period;
+    int wal;
+    int wal_sync_msec;
+    int huge_pages;
+    int slab_registers;
+    int fold_after_days;
+    int fold_precision;
+    int read_only;
+    hlld_worker_affinity worker_affinity;
+    hlld_set_affinity set_affinity;
+    int io_uring;
+    int busy_poll;
+    char *unix_socket;
+    int conn_turn_cmds;
+    int conn_turn_kb;
+    int conn_cmds_per_sec;
+    int conn_kb_per_sec;
+    int reserved_workers;
+    int max_workers;
+    int migrate_busy;
+    int exec_threads;
+    int coalesce_writes;
+    int shadow_merge_msec;
+    int ingest_rings;
+    int ingest_ring_kb;
+    int auto_create;
+    int trash_unlink_rate;
+    int preallocate;
+    char *data_dirs;
+    char **data_dir_list;
+    int num_data_dirs;
+    set_placement placement;
+    int direct_io;
+    int cool_interval;
+    int prewarm;
+    int archive_after_days;
+    struct hlld_set_template *templates;
+    struct hlld_client_class *client_classes;
 } hlld_config;
 
+/**
+ * A named template of the settings of new sets, read
+ * from a [template:name] section of the config file.
+ * Its config is the main config, with the settings
+ * of the section applied.
+ */
+typedef struct hlld_set_template {
+    char *name;
+    hlld_config config;
+    struct hlld_set_template *next;
+} hlld_set_template;
+
+/**
+ * A named class of clients, read from a [class:name] section
+ * of the config file. The connections from its networks are
+ * held to its rate limits, and those of a high priority class
+ * are served by the reserved workers.
+ */
+typedef struct hlld_client_class {
+    char *name;
+    uint32_t *addrs;        // The IPv4 networks of the class, in host order
+    uint32_t *masks;
+    int num_networks;
+    int match_unix;         // Whether it holds the unix socket clients
+    int cmds_per_sec;       // Commands each connection may send a second, or 0
+    int kb_per_sec;         // Input each connection may send a second, or 0
+    int high_priority;
+    struct hlld_client_class *next;
+} hlld_client_class;
+
 /**
  * This structure is used to persist
  * set specific settings to an INI file.
@@ -30,7 +167,18 @@ typedef struct {
     double default_eps;
     int default_precision;
     int in_memory;
+    hll_format format;
+    int sparse;
+    hll_estimator estimator;
+    hll_hash hash;
     uint64_t size;
+    int window;             // Seconds per bucket of a windowed set, or 0
+    int window_buckets;
+    int sliding;            // Longest window of a sliding set, or 0
+    int kmv;                // Hashes kept to estimate intersections, or 0
+    uint64_t expires;       // When the set is dropped, in seconds since the epoch, or 0
+    hlld_durability durability;
+    int flush_period;       // Seconds between the flushes of the set, or 0 for the flush_interval
 } hlld_set_config;
 
 
@@ -62,6 +210,34 @@ int set_config_from_filename(char *filename, hlld_set_config *config);
  */
 int update_filename_from_set_config(char *filename, hlld_set_config *config);
 
+/**
+ * Converts a duration to seconds. Durations are a
+ * count with an optional unit of s, m, h, d or w,
+ * such as "90", "15m" or "24h".
+ * @arg value The duration
+ * @arg secs Output, the seconds
+ * @return 0 on success, -1 if the duration is invalid.
+ */
+int duration_to_secs(const char *value, uint64_t *secs);
+
+/**
+ * Parses a durability class, which is "volatile", or "periodic"
+ * or "wal" with an optional flush period after a colon,
+ * such as "periodic:30s".
+ * @arg value The durability
+ * @arg durability Output, the class
+ * @arg flush_period Output, the flush period in seconds, or 0
+ * @return 0 on success, -1 if the durability is invalid.
+ */
+int durability_from_name(const char *value, hlld_durability *durability, int *flush_period);
+
+/**
+ * Returns the name of a durability class
+ * @arg durability The class
+ * @return The name, or NULL if the class is unknown.
+ */
+const char* durability_name(hlld_durability durability);
+
 /**
  * Validates the configuration
  * @arg config The config object to validate.
@@ -69,6 +245,40 @@ int update_filename_from_set_config(char *filename, hlld_set_config *config);
  */
 int validate_config(hlld_config *config);
 
+/**
+ * Validates the settings of new sets in a config,
+ * such as those of a create or a template
+ * @arg config The config object to validate.
+ * @return 0 on success.
+ */
+int sane_set_options(hlld_config *config);
+
+/**
+ * Finds a set template by name
+ * @arg config The config the template was read with
+ * @arg name The name of the template
+ * @return The config of the template, or NULL if there is none.
+ */
+hlld_config* config_template(hlld_config *config, const char *name);
+
+/**
+ * Finds the class of a client, the first whose
+ * networks hold the address of the client
+ * @arg config The config the classes were read with
+ * @arg addr The address of the client
+ * @return The class, or NULL if the client has none.
+ */
+hlld_client_class* config_client_class(hlld_config *config, const struct sockaddr *addr);
+
+/**
+ * Returns the number of workers that may run, which is
+ * max_workers if set, otherwise worker_threads. Each has
+ * a slot of the metrics and of the shadow registers.
+ * @arg config The config
+ * @return The number of slots of the workers
+ */
+int config_worker_slots(hlld_config *config);
+
 // Configuration validation methods
 int sane_data_dir(char *data_dir);
 int sane_log_level(char *log_level, int *syslog_level);
@@ -79,6 +289,55 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_default_format(hll_format format);
+int sane_sparse(int sparse);
+int sane_default_estimator(hll_estimator estimator);
+int sane_default_hash(hll_hash hash);
+int sane_compress_cold(int compress_cold);
+int sane_flush_threads(int threads);
+int sane_flush_rate_limit(int limit);
+int sane_flush_dirty_age(int age);
+int sane_flush_dirty_pages(int pages);
+int sane_max_memory(int max_memory);
+int sane_reuseport(int reuseport);
+int sane_max_conn_buffer(int max_conn_buffer);
+int sane_slowlog_usec(int usec);
+int sane_slowlog_len(int len);
+int sane_replication_port(int port);
+int sane_replicate_from(char *replicate_from);
+int sane_cluster(char *nodes, char *node, int vnodes);
+int sane_remote_cache_msec(int msec);
+int sane_window(int window, int buckets);
+int sane_sliding(int sliding, int window);
+int sane_kmv(int kmv);
+int sane_ttl(int ttl);
+int sane_durability(hlld_durability durability, int flush_period, int wal);
+int sane_wal(int wal, int sync_msec);
+int sane_huge_pages(int huge_pages);
+int sane_slab_registers(int slab_registers);
+int sane_fold(int days, int precision);
+int sane_read_only(int read_only, int in_memory, int wal, int slab_registers, char *replicate_from);
+int sane_affinity(hlld_worker_affinity worker_affinity, hlld_set_affinity set_affinity);
+int sane_io_uring(int io_uring);
+int sane_busy_poll(int busy_poll);
+int sane_unix_socket(char *unix_socket);
+int sane_conn_turn(int cmds, int kb);
+int sane_conn_rate(int cmds_per_sec, int kb_per_sec);
+int sane_reserved_workers(int reserved, int worker_threads);
+int sane_max_workers(int max_workers, int worker_threads);
+int sane_migrate_busy(int migrate_busy);
+int sane_exec_threads(int exec_threads);
+int sane_coalesce_writes(int coalesce_writes);
+int sane_shadow_merge_msec(int shadow_merge_msec);
+int sane_ingest_rings(int rings, int ring_kb);
+int sane_auto_create(int auto_create);
+int sane_trash_unlink_rate(int trash_unlink_rate);
+int sane_preallocate(int preallocate);
+int sane_data_dirs(char *data_dirs, char ***list, int *num);
+int sane_direct_io(int direct_io);
+int sane_cool_interval(int cool_interval, int cold_interval);
+int sane_prewarm(int prewarm);
+int sane_archive_after_days(int days);
 
 /**
  * Joins two strings as part of a path,
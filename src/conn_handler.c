@@ -1,10 +1,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <regex.h>
 #include <assert.h>
 #include "hll.h"
 #include "conn_handler.h"
+#include "alloc.h"
+#include "dump.h"
+#include "spinlock.h"
 #include "handler_constants.c"
 
 /**
@@ -16,31 +20,187 @@
  */
 #define MULTI_OP_SIZE 32
 
+/**
+ * Commands on sets with longer names are not
+ * parked while the set is paged in, and binary
+ * frames may not name them.
+ */
+#define MAX_PARKED_NAME 256
+
+/**
+ * The longest remote reference, host:port/set,
+ * and the most a union waits to fetch
+ */
+#define MAX_REMOTE_REF 512
+#define MAX_PARKED_REFS 64
+
+/**
+ * Binary frames with larger bodies are refused,
+ * rather than buffered.
+ */
+#define MAX_BINARY_BODY (1 << 24)
+
+/**
+ * The most sets that a group of the multi
+ * command may set the same keys in
+ */
+#define MAX_GROUP_SETS 64
+
+/**
+ * The most writes, and roughly the most input, that
+ * are handed to an execution thread as one batch
+ */
+#define EXEC_BATCH_CMDS 256
+#define EXEC_BATCH_BYTES (256 * 1024)
+
+/**
+ * The most keys or hashes that coalesced writes
+ * apply to a set at once
+ */
+#define COALESCE_KEYS 1024
+
+/**
+ * Connection flag for clients that only want a count
+ * of the successful sets that they pipeline
+ */
+#define COUNT_REPLIES 1
+
+/**
+ * Connection flags for a create that waits for its set
+ * to be durable. The connection is parked while pending,
+ * and the page-in thread marks it done or failed.
+ */
+#define CREATE_PENDING 2
+#define CREATE_DONE 4
+#define CREATE_FAILED 8
+
+/**
+ * Watched sets are checked every WATCH_INTERVAL
+ * seconds, and a connection watches at most
+ * MAX_CONN_WATCHES sets
+ */
+#define WATCH_INTERVAL 1.
+#define MAX_CONN_WATCHES 4096
+
+/**
+ * The stats command lists this many of the sets
+ * that spent the most time flushing
+ */
+#define STATS_TOP_SETS 10
+
+/**
+ * The names of the background work in the stats,
+ * by background_op
+ */
+static const char *BACKGROUND_OP_NAMES[] = {
+    "flush_round", "set_flush", "unmap_round", "set_unmap"
+};
+
 /**
  * Invoked in any context with a hlld_conn_handler
  * to send out an INTERNAL_ERROR message to the client.
  */
-#define INTERNAL_ERROR() (handle_client_resp(handle->conn, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN))
+#define INTERNAL_ERROR() (handle_client_resp(handle, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN))
 
 /* Static method declarations */
 static void handle_set_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_set_multi_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_set_hashes_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_set_groups_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_set_all_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_create_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_bulk_create_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_drop_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_close_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_clear_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_info_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_merge_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_size_multi_cmd(hlld_conn_handler *handle, char *args, int args_len, int intersect);
+static void handle_jaccard_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_size_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_sizes_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_replies_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_stats_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_slowlog_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_snapshot_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_bind_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_watch_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_unwatch_cmd(hlld_conn_handler *handle, char *args, int args_len);
 
 
 static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res);
-static inline void handle_client_resp(hlld_conn_info *conn, char* resp_mesg, int resp_len);
-static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len);
+static void handle_set_keys_resp(hlld_conn_handler *handle, int res);
+static void flush_done_sets(hlld_conn_handler *handle);
+static inline void handle_client_resp(hlld_conn_handler *handle, char* resp_mesg, int resp_len);
+static void handle_client_err(hlld_conn_handler *handle, char* err_msg, int msg_len);
 
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
 
 static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
+static int valid_set_name(char *set_name);
+static int split_keys(char *buf, int buf_len, char **keys, int *lens, int max_keys, char **rest, int *rest_len);
+
+static int should_redirect(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int is_write_cmd(conn_cmd_type type);
+static int command_node(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int should_park(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int should_park_groups(hlld_conn_handler *handle, char *args, int args_len);
+static int should_park_all(hlld_conn_handler *handle, char *args, int args_len);
+static int should_park_union(hlld_conn_handler *handle, char *args, int args_len);
+static int member_ref(hlld_conn_handler *handle, char *name, int name_len, char *ref);
+static int size_union_members(hlld_conn_handler *handle, char **names, int num_sets, uint64_t *est);
+static int park_set(hlld_conn_handler *handle, char *name, int name_len);
+static void park_command(hlld_conn_handler *handle, char *buf, int buf_len, char *args);
+static int should_exec(hlld_conn_handler *handle, conn_cmd_type type, char *args);
+static void exec_commands(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int append_exec_cmd(char **cmds, int *len, int *size, conn_cmd_type type, char *args, int args_len);
+static void send_handler_response(hlld_conn_handler *handle, char **buffers, int *sizes, int num);
+static int parse_hash(const char *buf, uint64_t *hash);
+static int compare_batch_sets(const void *a, const void *b);
+static void coalesce_set_batches(hlld_conn_handler *handle, hlld_exec_batch **batches, int num);
+
+static int handle_binary_frame(hlld_conn_handler *handle);
+static int binary_frame_valid(int op, char *body, int name_len, uint32_t num, uint32_t body_len);
+static int handle_binary_set(hlld_conn_handler *handle, int op, char *set_name,
+        char *body, uint32_t num, uint32_t *done);
+static void handle_binary_dump(hlld_conn_handler *handle, int op, char *body, int name_len, uint32_t body_len);
+static void send_binary_snapshot(hlld_conn_handler *handle, char *prefix);
+static int handle_binary_merge_raw(hlld_conn_handler *handle, char *body, int name_len,
+        uint32_t body_len, uint32_t *node);
+static void send_binary_raw(hlld_conn_handler *handle, char *body, int name_len, uint32_t body_len);
+static void encode_binary_reply(char *reply, int status, uint32_t count);
+static void send_binary_reply(hlld_conn_info *conn, int status, uint32_t count);
+static void peek_binary_name(hlld_conn_handler *handle, char *name, int *name_len, int *keys);
+
+static inline int is_slow(hlld_conn_handler *handle, uint64_t nanos);
+static void record_cmd(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len, uint64_t nanos);
+static int owner_set_keys(hlld_conn_handler *handle, char *set_name, char **keys, int *lens, int num);
+static int owner_set_hashes(hlld_conn_handler *handle, char *set_name, uint64_t *hashes, int num);
+static void owner_set_keys_multi(hlld_conn_handler *handle, char **set_names, int num_sets,
+        char **keys, int num_keys, int *results);
+static int owner_merge_sets(hlld_conn_handler *handle, char *dst_name, char **src_names, int num_srcs);
+
+/*
+ * A set watched by a connection, and the estimate
+ * that was last reported for it
+ */
+typedef struct set_watch {
+    char *set_name;
+    uint64_t delta;     // Reported once the estimate moves by more, or 0
+    double pct;         // Reported once the estimate moves by more percent, or 0
+    uint64_t last;
+    struct set_watch *next;
+} set_watch;
+
+/*
+ * The state kept for a connection, as client_handler_state
+ */
+typedef struct {
+    set_watch *watches;
+    int num_watches;
+} client_state;
 
 // Simple struct to hold data for a callback
 typedef struct {
@@ -56,6 +216,17 @@ void init_conn_handler() {
     int res;
     res = regcomp(&VALID_SET_NAMES_RE, VALID_SET_NAMES_PATTERN, REG_EXTENDED|REG_NOSUB);
     assert(res == 0);
+
+    // Index the commands by the length of their name
+    int cmd = 0;
+    for (int len=0; len <= MAX_CLIENT_CMD_LEN + 1; len++) {
+        CLIENT_CMD_START[len] = cmd;
+        while (cmd < NUM_CLIENT_COMMANDS && CLIENT_COMMANDS[cmd].len == len) cmd++;
+    }
+    assert(cmd == NUM_CLIENT_COMMANDS);
+    assert(sizeof(CMD_TYPE_NAMES) / sizeof(char*) == NUM_CMD_TYPES);
+    assert(NUM_CMD_TYPES <= METRIC_CMDS);
+    assert(sizeof(BACKGROUND_OP_NAMES) / sizeof(char*) == NUM_BACKGROUND_OPS);
 }
 
 /**
@@ -67,18 +238,100 @@ void init_conn_handler() {
  * @return 0 on success.
  */
 int handle_client_connect(hlld_conn_handler *handle) {
+    // Reply to a create once its set is durable
+    int *flags = client_handler_flags(handle->conn);
+    if (*flags & CREATE_PENDING) {
+        if (!(*flags & CREATE_DONE)) return 0;
+        if (*flags & CREATE_FAILED)
+            INTERNAL_ERROR();
+        else
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+        *flags &= ~(CREATE_PENDING | CREATE_DONE | CREATE_FAILED);
+    }
+
     // Look for the next command line
     char *buf, *arg_buf;
     int buf_len, arg_buf_len, should_free;
     int status;
     while (1) {
+        // Leave the rest until the client reads its responses
+        if (client_output_full(handle->conn)) break;
+
+        // Leave the rest for a later pass of the event loop,
+        // once the other clients of this worker had a turn
+        if (client_turn_over(handle->conn)) break;
+
+        // Hold the client to the rate limits of its class
+        if (client_rate_limited(handle->conn)) break;
+
+        // Binary frames start with a byte no text command does
+        char first;
+        if (!peek_client_bytes(handle->conn, &first, 1) &&
+                (unsigned char)first == BINARY_MAGIC) {
+            flush_done_sets(handle);
+
+            // The frame is consumed by handling it, so the
+            // name is copied out first for the slow log
+            char name[MAX_PARKED_NAME];
+            int name_len = 0, keys = 0;
+            int sampled = metrics_sample_set(handle->worker);
+            if (SLOWLOG_TIMED || sampled) peek_binary_name(handle, name, &name_len, &keys);
+            slowlog_phases_reset();
+            uint64_t start = metrics_now();
+            if (handle_binary_frame(handle)) break;
+            uint64_t nanos = metrics_now() - start;
+            metrics_record_cmd(handle->worker, BINARY, nanos);
+            if (sampled) metrics_record_set(handle->worker, name, name_len, keys);
+            if (is_slow(handle, nanos))
+                slowlog_add_entry(handle->slowlog, BINARY, name, name_len, keys, nanos);
+            continue;
+        }
+
         status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
         if (status == -1) break; // Return if no command is available
 
         // Determine the command type
         conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
 
+        // Sets of other cluster nodes are redirected to them
+        if (should_redirect(handle, type, arg_buf, arg_buf_len)) {
+            if (should_free) free(buf);
+            continue;
+        }
+
+        // A read only server refuses writes before paging in any set
+        if (handle->config->read_only && is_write_cmd(type)) {
+            flush_done_sets(handle);
+            handle_client_err(handle, (char*)&READ_ONLY_SERVER, READ_ONLY_SERVER_LEN);
+            if (should_free) free(buf);
+            continue;
+        }
+
+        // Wait for a proxied set to be paged in, without
+        // blocking the other connections of this thread
+        if (should_park(handle, type, arg_buf, arg_buf_len)) {
+            park_command(handle, buf, buf_len, arg_buf);
+            if (should_free) free(buf);
+            break;
+        }
+
+        // Hand writes to the execution threads, so that a set
+        // that stalls does not hold up the other connections
+        if (should_exec(handle, type, arg_buf)) {
+            flush_done_sets(handle);
+            exec_commands(handle, type, arg_buf, arg_buf_len);
+            if (should_free) free(buf);
+            break;
+        }
+
+        // Counted sets are acknowledged before other replies
+        if (type != SET && type != SET_MULTI && type != SET_HASHES &&
+                type != SET_GROUPS && type != SET_ALL)
+            flush_done_sets(handle);
+
         // Handle an error or unknown response
+        slowlog_phases_reset();
+        uint64_t start = metrics_now();
         switch(type) {
             case SET:
                 handle_set_cmd(handle, arg_buf, arg_buf_len);
@@ -86,9 +339,21 @@ int handle_client_connect(hlld_conn_handler *handle) {
             case SET_MULTI:
                 handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case SET_HASHES:
+                handle_set_hashes_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_GROUPS:
+                handle_set_groups_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_ALL:
+                handle_set_all_cmd(handle, arg_buf, arg_buf_len);
+                break;
             case CREATE:
                 handle_create_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case BULK_CREATE:
+                handle_bulk_create_cmd(handle, arg_buf, arg_buf_len);
+                break;
             case DROP:
                 handle_drop_cmd(handle, arg_buf, arg_buf_len);
                 break;
@@ -107,241 +372,2014 @@ int handle_client_connect(hlld_conn_handler *handle) {
             case FLUSH:
                 handle_flush_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case MERGE:
+                handle_merge_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZE_UNION:
+                handle_size_multi_cmd(handle, arg_buf, arg_buf_len, 0);
+                break;
+            case SIZE_INTERSECT:
+                handle_size_multi_cmd(handle, arg_buf, arg_buf_len, 1);
+                break;
+            case JACCARD:
+                handle_jaccard_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZE:
+                handle_size_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZES:
+                handle_sizes_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case REPLIES:
+                handle_replies_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case STATS:
+                handle_stats_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SLOWLOG:
+                handle_slowlog_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SNAPSHOT:
+                handle_snapshot_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case BIND:
+                handle_bind_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case WATCH:
+                handle_watch_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case UNWATCH:
+                handle_unwatch_cmd(handle, arg_buf, arg_buf_len);
+                break;
             default:
-                handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+                handle_client_err(handle, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
                 break;
         }
+        uint64_t nanos = metrics_now() - start;
+        record_cmd(handle, type, arg_buf, arg_buf_len, nanos);
+        if (is_slow(handle, nanos))
+            slowlog_add(handle->slowlog, type, arg_buf, arg_buf_len, nanos);
 
         // Make sure to free the command buffer if we need to
         if (should_free) free(buf);
+
+        // Nothing more is handled until a create is durable
+        if (*flags & CREATE_PENDING) break;
     }
 
+    flush_done_sets(handle);
     return 0;
 }
 
-/**
- * Periodic update is used to update our checkpoint with
- * the set manager, so that vacuum progress can be made.
+/*
+ * A write of keys or hashes to a set, which
+ * runs on the worker owning the set
  */
-void periodic_update(hlld_conn_handler *handle) {
-    setmgr_client_checkpoint(handle->mgr);
+typedef struct {
+    hlld_setmgr *mgr;
+    char *set_name;
+    char **keys;
+    int *lens;
+    uint64_t *hashes;
+    int num;
+    int res;
+} owner_write;
+
+static void run_owner_write(void *in) {
+    owner_write *w = in;
+    if (w->hashes)
+        w->res = setmgr_set_hashes(w->mgr, w->set_name, w->hashes, w->num);
+    else
+        w->res = setmgr_set_sized_keys(w->mgr, w->set_name, w->keys, w->lens, w->num);
 }
 
-
 /**
- * Internal method to handle a command that relies
- * on a set name and a single key, responses are handled using
- * handle_multi_response.
+ * Sets keys in a set on the worker that owns it,
+ * returning like setmgr_set_sized_keys
  */
-static void handle_set_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    #define CHECK_ARG_ERR() { \
-        handle_client_err(handle->conn, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN); \
-        return; \
-    }
-    // If we have no args, complain.
-    if (!args) CHECK_ARG_ERR();
-
-    // Scan past the set name
-    char *key;
-    int key_len;
-    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (err || key_len <= 1) CHECK_ARG_ERR();
-
-    // Setup the buffers
-    char *key_buf[] = {key};
-
-    // Call into the set manager
-    int res = setmgr_set_keys(handle->mgr, args, (char**)&key_buf, 1);
+static int owner_set_keys(hlld_conn_handler *handle, char *set_name, char **keys, int *lens, int num) {
+    owner_write w = {handle->mgr, set_name, keys, lens, NULL, num, 0};
+    run_on_set_owner(handle->conn, set_name, run_owner_write, &w);
+    return w.res;
+}
 
-    // Generate the response
-    handle_set_cmd_resp(handle, res);
+/**
+ * Sets hashes in a set on the worker that owns it,
+ * returning like setmgr_set_hashes
+ */
+static int owner_set_hashes(hlld_conn_handler *handle, char *set_name, uint64_t *hashes, int num) {
+    owner_write w = {handle->mgr, set_name, NULL, NULL, hashes, num, 0};
+    run_on_set_owner(handle->conn, set_name, run_owner_write, &w);
+    return w.res;
 }
 
+/*
+ * A write of keys to the sets of one owner, or a merge
+ * into a set, which runs on the worker owning the sets
+ */
+typedef struct {
+    hlld_setmgr *mgr;
+    char **set_names;
+    int num_sets;
+    char **keys;
+    int num_keys;
+    int *results;
+    int res;
+} owner_multi;
+
+static void run_owner_multi(void *in) {
+    owner_multi *m = in;
+    if (m->results)
+        setmgr_set_keys_multi(m->mgr, m->set_names, m->num_sets, m->keys, m->num_keys, m->results);
+    else
+        m->res = setmgr_merge_sets(m->mgr, m->keys[0], m->set_names, m->num_sets);
+}
 
 /**
- * Internal method to handle a command that relies
- * on a set name and multiple keys, responses are handled using
- * handle_multi_response.
+ * Sets keys in many sets like setmgr_set_keys_multi. Sharded,
+ * the sets are split by owner and each owner writes its own.
  */
-static void handle_set_multi_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    #define CHECK_ARG_ERR() { \
-        handle_client_err(handle->conn, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN); \
-        return; \
+static void owner_set_keys_multi(hlld_conn_handler *handle, char **set_names, int num_sets,
+        char **keys, int num_keys, int *results) {
+    if (handle->config->set_affinity != SET_AFFINITY_SHARD) {
+        setmgr_set_keys_multi(handle->mgr, set_names, num_sets, keys, num_keys, results);
+        return;
     }
-    // If we have no args, complain.
-    if (!args) CHECK_ARG_ERR();
-
-    // Setup the buffers
-    char *key_buf[MULTI_OP_SIZE];
-
-    // Scan all the keys
-    char *key;
-    int key_len;
-    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (err || key_len <= 1) CHECK_ARG_ERR();
-
-    // Parse any options
-    char *curr_key = key;
-    int res = 0;
-    int index = 0;
-    while (curr_key && *curr_key != '\0') {
-        // Adds a zero terminator to the current key, scans forward
-        buffer_after_terminator(key, key_len, ' ', &key, &key_len);
-
-        // Set the key
-        key_buf[index] = curr_key;
 
-        // Advance to the next key
-        curr_key = key;
-        index++;
-
-        // If we have filled the buffer, check now
-        if (index == MULTI_OP_SIZE) {
-            // Handle the keys now
-            res = setmgr_set_keys(handle->mgr, args, (char**)&key_buf, index);
-            if (res) goto SEND_RESULT;
-
-            // Reset the index
-            index = 0;
+    // Owners already handed their sets are marked -2
+    int owners[MAX_GROUP_SETS];
+    for (int i=0; i < num_sets; i++) owners[i] = set_owner_worker(handle->conn, set_names[i]);
+
+    // Hand each owner its sets in one command
+    char *names[MAX_GROUP_SETS];
+    int res[MAX_GROUP_SETS], index[MAX_GROUP_SETS];
+    for (int i=0; i < num_sets; i++) {
+        if (owners[i] == -2) continue;
+        int owner = owners[i], num = 0;
+        for (int j=i; j < num_sets; j++) {
+            if (owners[j] != owner) continue;
+            owners[j] = -2;
+            if (results[j]) continue;
+            names[num] = set_names[j];
+            res[num] = 0;
+            index[num++] = j;
         }
+        if (!num) continue;
+        owner_multi m = {handle->mgr, names, num, keys, num_keys, res, 0};
+        run_on_worker(handle->conn, owner, run_owner_multi, &m);
+        for (int j=0; j < num; j++) results[index[j]] = res[j];
     }
+}
 
-    // Handle any remaining keys
-    if (index) {
-        res = setmgr_set_keys(handle->mgr, args, key_buf, index);
-    }
+/**
+ * Merges sets into a set like setmgr_merge_sets.
+ * Sharded, the merge runs on the owner of the destination.
+ */
+static int owner_merge_sets(hlld_conn_handler *handle, char *dst_name, char **src_names, int num_srcs) {
+    if (handle->config->set_affinity != SET_AFFINITY_SHARD)
+        return setmgr_merge_sets(handle->mgr, dst_name, src_names, num_srcs);
+    owner_multi m = {handle->mgr, src_names, num_srcs, &dst_name, 1, NULL, 0};
+    run_on_set_owner(handle->conn, dst_name, run_owner_multi, &m);
+    return m.res;
+}
 
-SEND_RESULT:
-    // Generate the response
-    handle_set_cmd_resp(handle, res);
+// Decodes the little endian integers of binary frames
+static inline uint32_t load_le16(const char *buf) {
+    const unsigned char *b = (const unsigned char*)buf;
+    return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t load_le32(const char *buf) {
+    return load_le16(buf) | (load_le16(buf + 2) << 16);
+}
+
+static inline uint64_t load_le64(const char *buf) {
+    return load_le32(buf) | ((uint64_t)load_le32(buf + 4) << 32);
 }
 
 /**
- * Internal command used to handle set creation.
+ * Handles the binary frame at the start of the input. The
+ * header gives the length of the frame, so the keys are
+ * found without scanning, and need not be terminated.
+ * @return 0 if a frame was handled, -1 if more input
+ * is needed or the frame was parked.
  */
-static void handle_create_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    // If we have no args, complain.
-    if (!args) {
-        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
-        return;
+static int handle_binary_frame(hlld_conn_handler *handle) {
+    char header[BINARY_HEADER_LEN];
+    if (peek_client_bytes(handle->conn, header, BINARY_HEADER_LEN)) return -1;
+    int op = (unsigned char)header[1];
+    int name_len = load_le16(header + 2);
+    uint32_t num = load_le32(header + 4);
+    uint32_t body_len = load_le32(header + 8);
+
+    // Refuse huge frames. Only the header is consumed, since
+    // the body may never arrive.
+    char *frame;
+    int should_free;
+    if (body_len > MAX_BINARY_BODY) {
+        if (extract_client_bytes(handle->conn, BINARY_HEADER_LEN, &frame, &should_free)) return -1;
+        if (should_free) free(frame);
+        send_binary_reply(handle->conn, BIN_BAD_FRAME, 0);
+        return 0;
     }
+    int frame_len = BINARY_HEADER_LEN + body_len;
+    if (extract_client_bytes(handle->conn, frame_len, &frame, &should_free)) return -1;
 
-    // Scan for options after the set name
-    char *options;
-    int options_len;
-    int res = buffer_after_terminator(args, args_len, ' ', &options, &options_len);
-
-    // Verify the set name is valid
-    char *set_name = args;
-    if (regexec(&VALID_SET_NAMES_RE, set_name, 0, NULL, 0) != 0) {
-        handle_client_err(handle->conn, (char*)&BAD_SET_NAME, BAD_SET_NAME_LEN);
-        return;
+    char *body = frame + BINARY_HEADER_LEN;
+    char set_name[MAX_PARKED_NAME];
+    uint32_t done = 0;
+    int status;
+    if (handle->config->read_only && (op == BIN_SET_KEYS || op == BIN_SET_HASHES ||
+                op == BIN_RESTORE || op == BIN_MERGE_RAW)) {
+        status = BIN_READ_ONLY;
+    } else if (op == BIN_MERGE_RAW) {
+        status = handle_binary_merge_raw(handle, body, name_len, body_len, &done);
+    } else if (op == BIN_GET_RAW) {
+        send_binary_raw(handle, body, name_len, body_len);
+        if (should_free) free(frame);
+        return 0;
+    } else if (op == BIN_DUMP || op == BIN_RESTORE || op == BIN_SNAPSHOT) {
+        handle_binary_dump(handle, op, body, name_len, body_len);
+        if (should_free) free(frame);
+        return 0;
+    } else if (op != BIN_SET_KEYS && op != BIN_SET_HASHES) {
+        status = BIN_NOT_SUP;
+    } else if (!binary_frame_valid(op, body, name_len, num, body_len)) {
+        status = BIN_BAD_FRAME;
+
+    // The reply of a set on another cluster node counts the node
+    } else if (setmgr_handle_id(body, name_len) == -1 &&
+            !cluster_is_local(handle->cluster, body, name_len)) {
+        status = BIN_MOVED;
+        done = cluster_node_of(handle->cluster, body, name_len);
+
+    // Wait for a proxied set to be paged in, like a text command
+    } else if (park_set(handle, body, name_len)) {
+        status = park_client_command(handle->conn, frame, frame_len);
+        if (should_free) free(frame);
+        if (!status) return -1;
+        send_binary_reply(handle->conn, BIN_INTERNAL_ERR, 0);
+        return 0;
+    } else {
+        memcpy(set_name, body, name_len);
+        set_name[name_len] = '\0';
+        status = handle_binary_set(handle, op, set_name, body + name_len, num, &done);
     }
 
-    // Parse the options
-    hlld_config *config = NULL;
-    int err = 0;
-    if (res == 0) {
-        // Make a new config store, copy the current
-        config = malloc(sizeof(hlld_config));
-        memcpy(config, handle->config, sizeof(hlld_config));
-
-        // Parse any options
-        char *param = options;
-        while (param) {
-            // Adds a zero terminator to the current param, scans forward
-            buffer_after_terminator(options, options_len, ' ', &options, &options_len);
-
-            // Check for the custom params
-            int match = 0;
-            if (sscanf(param, "precision=%u", &config->default_precision)) {
-                // Compute error given precision
-                config->default_eps = hll_error_for_precision(config->default_precision);
-                match = 1;
-            }
-            if (sscanf(param, "eps=%lf", &config->default_eps)) {
-                // Compute precision given error
-                config->default_precision = hll_precision_for_error(config->default_eps);
+    send_binary_reply(handle->conn, status, done);
+    if (should_free) free(frame);
+    return 0;
+}
 
-                // Compute error given precision. This is kinda strange but it is done
-                // since its not possible to hit all epsilons perfectly, but we try to get
-                // the eps provided to be the upper bound. This value is the actual eps.
-                config->default_eps = hll_error_for_precision(config->default_precision);
-                match = 1;
-            }
-            match |= sscanf(param, "in_memory=%d", &config->in_memory);
+/**
+ * Checks that the lengths in a binary frame add up
+ * to its body length
+ * @return 1 if the frame is valid
+ */
+static int binary_frame_valid(int op, char *body, int name_len, uint32_t num, uint32_t body_len) {
+    if (name_len <= 0 || name_len >= MAX_PARKED_NAME || (uint32_t)name_len > body_len || !num)
+        return 0;
+    uint64_t remain = body_len - name_len;
+    if (op == BIN_SET_HASHES) return remain == (uint64_t)num * sizeof(uint64_t);
+
+    // Keys are preceded by their lengths
+    if (remain / 2 < num) return 0;
+    uint64_t total = (uint64_t)num * 2;
+    char *lens = body + name_len;
+    for (uint32_t i=0; i < num; i++) total += load_le16(lens + 2 * i);
+    return total == remain;
+}
 
-            // Check if there was no match
-            if (!match) {
-                err = 1;
-                handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
-                break;
+/**
+ * Sets the keys or hashes of a valid binary frame, in
+ * batches so that the set is not held for too long.
+ * @arg set_name The set name
+ * @arg body The body after the set name
+ * @arg num The number of keys or hashes
+ * @arg done Output, the number that were set
+ * @return The binary status
+ */
+static int handle_binary_set(hlld_conn_handler *handle, int op, char *set_name,
+        char *body, uint32_t num, uint32_t *done) {
+    char *keys[MULTI_OP_SIZE];
+    int lens[MULTI_OP_SIZE];
+    uint64_t hashes[MULTI_OP_SIZE];
+    char *key = body + 2 * (uint64_t)num;
+    int res = 0;
+    while (*done < num && !res) {
+        int n = 0;
+        for (; n < MULTI_OP_SIZE && *done + n < num; n++) {
+            uint32_t i = *done + n;
+            if (op == BIN_SET_HASHES) {
+                hashes[n] = load_le64(body + i * sizeof(uint64_t));
+            } else {
+                lens[n] = load_le16(body + 2 * i);
+                keys[n] = key;
+                key += lens[n];
             }
-
-            // Advance to the next param
-            param = options;
         }
+        if (op == BIN_SET_HASHES)
+            res = owner_set_hashes(handle, set_name, hashes, n);
+        else
+            res = owner_set_keys(handle, set_name, keys, lens, n);
+        if (!res) *done += n;
+    }
 
-        // Validate the params
-        int invalid_config = 0;
-        invalid_config |= sane_default_precision(config->default_precision);
-        invalid_config |= sane_default_eps(config->default_eps);
-        invalid_config |= sane_in_memory(config->in_memory);
-
-        // Barf if the configs are bad
-        if (invalid_config) {
-            err = 1;
-            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
-        }
+    switch (res) {
+        case 0:
+            return BIN_DONE;
+        case -1:
+            return BIN_SET_NOT_EXIST;
+        case -3:
+            return BIN_HASH_MISMATCH;
+        default:
+            return BIN_INTERNAL_ERR;
     }
+}
 
-    // Clean up an leave on errors
-    if (err) {
-        if (config) free(config);
-        return;
+/**
+ * Merges the registers of a binary frame into a set,
+ * so that edge nodes can send their HLLs rather than
+ * their keys. The body is the set name, the u8 precision
+ * and the u8 layout of the registers, then the registers.
+ * @arg body The frame body
+ * @arg name_len The length of the set name
+ * @arg body_len The length of the body
+ * @arg node Output, the cluster node of a moved set
+ * @return The binary status
+ */
+static int handle_binary_merge_raw(hlld_conn_handler *handle, char *body, int name_len,
+        uint32_t body_len, uint32_t *node) {
+    if (name_len <= 0 || name_len >= MAX_PARKED_NAME || (uint32_t)name_len + 2 > body_len)
+        return BIN_BAD_FRAME;
+    if (setmgr_handle_id(body, name_len) == -1 &&
+            !cluster_is_local(handle->cluster, body, name_len)) {
+        *node = cluster_node_of(handle->cluster, body, name_len);
+        return BIN_MOVED;
     }
 
-    // Create a new set
-    res = setmgr_create_set(handle->mgr, set_name, config);
+    char set_name[MAX_PARKED_NAME];
+    memcpy(set_name, body, name_len);
+    set_name[name_len] = '\0';
+    unsigned char *regs = (unsigned char*)body + name_len;
+    int res = setmgr_merge_raw(handle->mgr, set_name, regs[0], (hset_raw_layout)regs[1],
+            regs + 2, body_len - name_len - 2);
     switch (res) {
         case 0:
-            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
-            break;
+            return BIN_DONE;
         case -1:
-            handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
-            if (config) free(config);
-            break;
-        case -3:
-            handle_client_resp(handle->conn, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
-            if (config) free(config);
-            break;
+            return BIN_SET_NOT_EXIST;
+        case -2:
+            return BIN_LOW_PRECISION;
+        case -4:
+            return BIN_BAD_FRAME;
         default:
-            INTERNAL_ERROR();
-            if (config) free(config);
-            break;
+            return BIN_INTERNAL_ERR;
     }
 }
 
+/**
+ * Sends the registers of a set after the reply, which
+ * counts their bytes and the two before them
+ */
+static void send_raw_registers(void *data, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *regs, uint64_t len) {
+    char reply[BINARY_REPLY_LEN];
+    encode_binary_reply(reply, BIN_DONE, len + 2);
+    char header[] = {precision, layout};
+    char *buffers[] = {reply, header, (char*)regs};
+    int sizes[] = {BINARY_REPLY_LEN, 2, len};
+    send_client_response(data, buffers, sizes, 3);
+}
 
 /**
- * Internal method to handle a command that relies
- * on a set name and a single key, responses are handled using
- * handle_multi_response.
+ * Sends the registers of a set, in the layouts taken by
+ * opcode 6, so that clients can merge sets themselves.
+ * Dense registers are written straight from the set.
+ * @arg body The frame body, the set name and an optional flag
+ * @arg name_len The length of the set name
+ * @arg body_len The length of the body
  */
-static void handle_setop_cmd(hlld_conn_handler *handle, char *args, int args_len,
-        int(*setmgr_func)(hlld_setmgr *, char*)) {
-    // If we have no args, complain.
-    if (!args) {
-        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+static void send_binary_raw(hlld_conn_handler *handle, char *body, int name_len, uint32_t body_len) {
+    if (name_len <= 0 || name_len >= MAX_PARKED_NAME || (uint32_t)name_len > body_len ||
+            body_len - name_len > 1) {
+        send_binary_reply(handle->conn, BIN_BAD_FRAME, 0);
+        return;
+    }
+    if (!cluster_is_local(handle->cluster, body, name_len)) {
+        send_binary_reply(handle->conn, BIN_MOVED, cluster_node_of(handle->cluster, body, name_len));
         return;
     }
 
-    // Scan past the set name
+    char set_name[MAX_PARKED_NAME];
+    memcpy(set_name, body, name_len);
+    set_name[name_len] = '\0';
+    int sparse = (uint32_t)name_len < body_len && body[name_len];
+    int res = setmgr_get_raw(handle->mgr, set_name, sparse, send_raw_registers, handle->conn);
+    if (res) send_binary_reply(handle->conn, (res == -1) ? BIN_SET_NOT_EXIST : BIN_INTERNAL_ERR, 0);
+}
+
+/**
+ * Handles the frames that dump and restore sets. Dumps are
+ * sent after the reply, which counts their bytes. Proxied
+ * sets are dumped from their register files, so need not be
+ * paged in.
+ * @arg op The opcode
+ * @arg body The frame body
+ * @arg name_len The length of the set name or prefix
+ * @arg body_len The length of the body
+ */
+static void handle_binary_dump(hlld_conn_handler *handle, int op, char *body, int name_len, uint32_t body_len) {
+    // Only restores have more than the name, and
+    // snapshots of every set have no prefix
+    char set_name[MAX_PARKED_NAME];
+    int min_len = (op == BIN_SNAPSHOT) ? 0 : 1;
+    if (name_len < min_len || name_len >= MAX_PARKED_NAME || (uint32_t)name_len > body_len ||
+            (op != BIN_RESTORE && (uint32_t)name_len != body_len)) {
+        send_binary_reply(handle->conn, BIN_BAD_FRAME, 0);
+        return;
+    }
+    memcpy(set_name, body, name_len);
+    set_name[name_len] = '\0';
+
+    if (op == BIN_SNAPSHOT) {
+        send_binary_snapshot(handle, set_name);
+        return;
+    }
+    if (!cluster_is_local(handle->cluster, set_name, name_len)) {
+        send_binary_reply(handle->conn, BIN_MOVED, cluster_node_of(handle->cluster, set_name, name_len));
+        return;
+    }
+
+    int res;
+    if (op == BIN_RESTORE) {
+        if (!valid_set_name(set_name)) {
+            send_binary_reply(handle->conn, BIN_BAD_FRAME, 0);
+            return;
+        }
+        res = setmgr_restore_set(handle->mgr, set_name,
+                (unsigned char*)body + name_len, body_len - name_len);
+        switch (res) {
+            case 0:
+                send_binary_reply(handle->conn, BIN_DONE, 0);
+                break;
+            case -1:
+                send_binary_reply(handle->conn, BIN_SET_EXISTS, 0);
+                break;
+            case -3:
+                send_binary_reply(handle->conn, BIN_DELETE_PENDING, 0);
+                break;
+            case -4:
+                send_binary_reply(handle->conn, BIN_BAD_FRAME, 0);
+                break;
+            default:
+                send_binary_reply(handle->conn, BIN_INTERNAL_ERR, 0);
+                break;
+        }
+        return;
+    }
+
+    unsigned char *dump;
+    uint64_t len;
+    res = setmgr_dump_set(handle->mgr, set_name, &dump, &len);
+    if (res) {
+        send_binary_reply(handle->conn, (res == -1) ? BIN_SET_NOT_EXIST : BIN_INTERNAL_ERR, 0);
+        return;
+    }
+    char reply[BINARY_REPLY_LEN];
+    encode_binary_reply(reply, BIN_DONE, len);
+    char *buffers[] = {reply, (char*)dump};
+    int sizes[] = {BINARY_REPLY_LEN, len};
+    send_client_response(handle->conn, buffers, sizes, 2);
+    free(dump);
+}
+
+/**
+ * Sends the dumps of every set with a prefix. The reply
+ * counts the sets, and each is followed by a u16 name length,
+ * a u32 dump length, the name and the dump. Sets dropped
+ * while the snapshot is taken are left out.
+ * @arg prefix The prefix of the sets, may be empty
+ */
+static void send_binary_snapshot(hlld_conn_handler *handle, char *prefix) {
+    hlld_set_list_head *head;
+    if (setmgr_list_sets(handle->mgr, (*prefix) ? prefix : NULL, &head)) {
+        send_binary_reply(handle->conn, BIN_INTERNAL_ERR, 0);
+        return;
+    }
+
+    // The dumps are taken first, so the reply can count them
+    int num = 0, max = head->size * 3 + 1;
+    char **buffers = calloc(max, sizeof(char*));
+    int *sizes = calloc(max, sizeof(int));
+    char reply[BINARY_REPLY_LEN];
+    buffers[0] = reply;
+    sizes[0] = BINARY_REPLY_LEN;
+    int parts = 1, status = BIN_DONE;
+    for (hlld_set_list *node = head->head; node; node = node->next) {
+        unsigned char *dump;
+        uint64_t len;
+        int res = setmgr_dump_set(handle->mgr, node->set_name, &dump, &len);
+        if (res == -1) continue;
+        if (res) {
+            status = BIN_INTERNAL_ERR;
+            break;
+        }
+        int name_len = strlen(node->set_name);
+        char *header = malloc(DUMP_STREAM_HEADER_SIZE);
+        dump_stream_header((unsigned char*)header, name_len, len);
+        buffers[parts] = header;
+        sizes[parts++] = DUMP_STREAM_HEADER_SIZE;
+        buffers[parts] = node->set_name;
+        sizes[parts++] = name_len;
+        buffers[parts] = (char*)dump;
+        sizes[parts++] = len;
+        num++;
+    }
+
+    if (status == BIN_DONE) {
+        encode_binary_reply(reply, BIN_DONE, num);
+        send_client_response(handle->conn, buffers, sizes, parts);
+    } else
+        send_binary_reply(handle->conn, status, 0);
+
+    // The names belong to the list
+    for (int i=1; i < parts; i += 3) {
+        free(buffers[i]);
+        free(buffers[i + 2]);
+    }
+    free(buffers);
+    free(sizes);
+    setmgr_cleanup_list(head);
+}
+
+/**
+ * Copies the set name and key count of the binary frame
+ * at the start of the input, without consuming it
+ * @arg name Output, the set name, of MAX_PARKED_NAME bytes
+ * @arg name_len Output, the length of the name, or 0 if unknown
+ * @arg keys Output, the key count
+ */
+static void peek_binary_name(hlld_conn_handler *handle, char *name, int *name_len, int *keys) {
+    char header[BINARY_HEADER_LEN + MAX_PARKED_NAME];
+    if (peek_client_bytes(handle->conn, header, BINARY_HEADER_LEN)) return;
+    int len = load_le16(header + 2);
+    if (len <= 0 || len >= MAX_PARKED_NAME) return;
+    if (peek_client_bytes(handle->conn, header, BINARY_HEADER_LEN + len)) return;
+    memcpy(name, header + BINARY_HEADER_LEN, len);
+    *name_len = len;
+    *keys = load_le32(header + 4);
+}
+
+/**
+ * Encodes the fixed size reply to a binary frame
+ * @arg reply Output, BINARY_REPLY_LEN bytes
+ * @arg status The binary status
+ * @arg count The number of keys that were set
+ */
+static void encode_binary_reply(char *reply, int status, uint32_t count) {
+    reply[0] = (char)BINARY_MAGIC;
+    reply[1] = status;
+    reply[2] = reply[3] = 0;
+    for (int i=0; i < 4; i++) reply[4 + i] = (count >> (8 * i)) & 0xff;
+}
+
+/**
+ * Sends the fixed size reply to a binary frame
+ * @arg status The binary status
+ * @arg count The number of keys that were set
+ */
+static void send_binary_reply(hlld_conn_info *conn, int status, uint32_t count) {
+    char reply[BINARY_REPLY_LEN];
+    encode_binary_reply(reply, status, count);
+    char *buffers[] = {reply};
+    int sizes[] = {BINARY_REPLY_LEN};
+    send_client_response(conn, buffers, sizes, 1);
+}
+
+/**
+ * Invoked by the networking layer with a datagram, which
+ * has one command per line and a null terminator after its
+ * length. Only the commands that set keys are handled, and
+ * no responses are sent. Proxied sets are paged in on this
+ * thread, since there is no connection to park.
+ * @arg handle The connection related information, without a connection
+ * @arg buf The datagram
+ * @arg buf_len The length of the datagram
+ */
+void handle_udp_message(hlld_conn_handler *handle, char *buf, int buf_len) {
+    char *arg_buf, *end = buf + buf_len;
+    int arg_buf_len;
+    while (buf < end) {
+        // Terminate the line, the last may have no newline
+        char *term = memchr(buf, '\n', end - buf);
+        if (!term) term = end;
+        *term = '\0';
+        int line_len = term - buf + 1;
+        if (line_len < 2) {
+            buf = term + 1;
+            continue;
+        }
+
+        arg_buf = NULL;
+        arg_buf_len = 0;
+        conn_cmd_type type = determine_client_command(buf, line_len, &arg_buf, &arg_buf_len);
+
+        // Datagrams cannot be redirected, so sets of other nodes are skipped
+        int node = (handle->cluster && arg_buf) ? command_node(handle, type, arg_buf, arg_buf_len) : -1;
+        if (node != -1 && node != handle->cluster->local) {
+            syslog(LOG_DEBUG, "Ignoring UDP command for another cluster node: %s", buf);
+            buf = term + 1;
+            continue;
+        }
+        if (handle->config->read_only && is_write_cmd(type)) {
+            syslog(LOG_DEBUG, "Ignoring UDP write to a read only server: %s", buf);
+            buf = term + 1;
+            continue;
+        }
+        slowlog_phases_reset();
+        uint64_t start = metrics_now();
+        switch (type) {
+            case SET:
+                handle_set_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_MULTI:
+                handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_HASHES:
+                handle_set_hashes_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_GROUPS:
+                handle_set_groups_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SET_ALL:
+                handle_set_all_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            default:
+                syslog(LOG_DEBUG, "Ignoring unsupported UDP command: %s", buf);
+                break;
+        }
+        uint64_t nanos = metrics_now() - start;
+        record_cmd(handle, type, arg_buf, arg_buf_len, nanos);
+        if (is_slow(handle, nanos))
+            slowlog_add(handle->slowlog, type, arg_buf, arg_buf_len, nanos);
+        buf = term + 1;
+    }
+}
+
+/**
+ * Invoked on the page-in thread once a set is loaded
+ */
+static void resume_parked_conn(void *data) {
+    resume_client_connection(data);
+}
+
+/**
+ * Invoked on the page-in thread once a created set is durable
+ */
+static void resume_created_conn(void *data, int res) {
+    int *flags = client_handler_flags(data);
+    *flags |= (res) ? CREATE_DONE | CREATE_FAILED : CREATE_DONE;
+    resume_client_connection(data);
+}
+
+/**
+ * Checks if a command changes sets, which a read only server refuses
+ */
+static int is_write_cmd(conn_cmd_type type) {
+    switch (type) {
+        case SET: case SET_MULTI: case SET_HASHES: case SET_GROUPS: case SET_ALL:
+        case CREATE: case BULK_CREATE: case DROP: case CLEAR: case MERGE: case SNAPSHOT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Checks if a command names sets of another cluster node,
+ * and if so replies with the address of the node, for the
+ * client to send the command there. Commands naming the
+ * sets of many nodes are refused.
+ * @return 1 if the command was answered.
+ */
+static int should_redirect(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    if (!handle->cluster || !args) return 0;
+    int node = command_node(handle, type, args, args_len);
+    if (node == -1 || node == handle->cluster->local) return 0;
+    if (node == -2) {
+        handle_client_err(handle, (char*)&CROSS_NODE, CROSS_NODE_LEN);
+        return 1;
+    }
+
+    char *addr = handle->cluster->nodes[node];
+    char *buffers[] = {(char*)&MOVED_RESP, addr, (char*)&NEW_LINE};
+    int sizes[] = {MOVED_RESP_LEN, strlen(addr), NEW_LINE_LEN};
+    flush_done_sets(handle);
+    send_client_response(handle->conn, (char**)&buffers, (int*)&sizes, 3);
+    return 1;
+}
+
+/**
+ * Finds the cluster node of the sets named by a command
+ * @return The node, -1 if the command names no sets,
+ * or -2 if the sets are on different nodes.
+ */
+static int command_node(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    switch (type) {
+        case SET: case SET_MULTI: case SET_HASHES: case SET_GROUPS: case SET_ALL:
+        case CREATE: case BULK_CREATE: case DROP: case CLOSE: case CLEAR: case INFO:
+        case FLUSH: case SIZE: case SIZES: case MERGE: case SIZE_INTERSECT: case JACCARD:
+        case BIND: case WATCH: case UNWATCH:
+            break;
+        default:
+            return -1;
+    }
+
+    char *end = args + args_len;
+    int node = -1, first = 1, group_start = 1;
+    while (args < end && *args) {
+        char *token_end = memchr(args, ' ', end - args);
+        if (!token_end) token_end = args + strnlen(args, end - args);
+
+        // Groups start with comma separated sets, setall and
+        // bulkcreate name the sets after their key or template,
+        // sizes may end with metadata=1, and the others start
+        // with one
+        int is_name;
+        if (type == SET_GROUPS)
+            is_name = group_start;
+        else if (type == SET_ALL || type == BULK_CREATE)
+            is_name = !first;
+        else if (type == SIZES)
+            is_name = (token_end - args != 10 || strncmp(args, "metadata=1", 10));
+        else if (type == MERGE || type == SIZE_INTERSECT || type == JACCARD)
+            is_name = 1;
+        else
+            is_name = first;
+
+        for (char *name = args; is_name && name < token_end; ) {
+            char *comma = (type == SET_GROUPS) ? memchr(name, ',', token_end - name) : NULL;
+            char *name_end = (comma) ? comma : token_end;
+
+            // Handles are bound on this node, since bind is redirected
+            if (setmgr_handle_id(name, name_end - name) != -1) {
+                name = name_end + 1;
+                continue;
+            }
+            int name_node = cluster_node_of(handle->cluster, name, name_end - name);
+            if (node != -1 && node != name_node) return -2;
+            node = name_node;
+            name = name_end + 1;
+        }
+        if (!is_name && !first && type != SET_GROUPS) break;
+        group_start = (token_end - args == 1 && *args == '|');
+        first = 0;
+        args = token_end + 1;
+    }
+    return node;
+}
+
+/**
+ * Checks if a command writes to a proxied set, and if so
+ * queues the set to be paged in. The connection is resumed
+ * once it is loaded.
+ * @return 1 if the command should be parked.
+ */
+static int should_park(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    if (!args) return 0;
+    if (type == SET_GROUPS) return should_park_groups(handle, args, args_len);
+    if (type == SET_ALL) return should_park_all(handle, args, args_len);
+    if (type == SIZE_UNION) return should_park_union(handle, args, args_len);
+    if (type != SET && type != SET_MULTI && type != SET_HASHES)
+        return 0;
+
+    // Copy out the set name, leaving the arguments intact
+    char *end = memchr(args, ' ', args_len);
+    int name_len = (end) ? end - args : (int)strnlen(args, args_len);
+    return park_set(handle, args, name_len);
+}
+
+/**
+ * Queues a set to be paged in, if it is proxied
+ * @arg name The set name, which need not be terminated
+ * @arg name_len The length of the name
+ * @return 1 if the set is being paged in.
+ */
+static int park_set(hlld_conn_handler *handle, char *name, int name_len) {
+    char set_name[MAX_PARKED_NAME];
+    if (name_len <= 0 || name_len >= MAX_PARKED_NAME) return 0;
+    memcpy(set_name, name, name_len);
+    set_name[name_len] = '\0';
+    return setmgr_page_in_async(handle->mgr, set_name, resume_parked_conn, handle->conn) == 1;
+}
+
+/**
+ * Checks the sets of a multi command for one that is
+ * proxied. Only one set is paged in at a time, the
+ * others are checked again once the command resumes.
+ * @return 1 if the command should be parked.
+ */
+static int should_park_groups(hlld_conn_handler *handle, char *args, int args_len) {
+    char *end = args + args_len;
+    int group_start = 1;
+    while (args < end && *args) {
+        char *token_end = memchr(args, ' ', end - args);
+        if (!token_end) token_end = args + strnlen(args, end - args);
+
+        // Each group starts with its comma separated sets
+        if (group_start) {
+            char *name = args;
+            while (name < token_end) {
+                char *comma = memchr(name, ',', token_end - name);
+                char *name_end = (comma) ? comma : token_end;
+                if (park_set(handle, name, name_end - name)) return 1;
+                name = name_end + 1;
+            }
+        }
+        group_start = (token_end - args == 1 && *args == '|');
+        args = token_end + 1;
+    }
+    return 0;
+}
+
+/**
+ * Parks a command, undoing the changes made to it while
+ * determining its type, so that it is handled as it arrived.
+ */
+static void park_command(hlld_conn_handler *handle, char *buf, int buf_len, char *args) {
+    if (args) args[-1] = ' ';
+    if (buf_len > 1 && buf[buf_len-2] == '\0') buf[buf_len-2] = '\r';
+    if (park_client_command(handle->conn, buf, buf_len)) {
+        // The command is lost without a copy
+        INTERNAL_ERROR();
+    }
+}
+
+/**
+ * Checks if a command is a write of keys or hashes
+ * to one set, which the execution threads or coalescing run
+ */
+static int should_exec(hlld_conn_handler *handle, conn_cmd_type type, char *args) {
+    if (!handle->config->exec_threads && !handle->config->coalesce_writes) return 0;
+    if (!handle->conn || !args) return 0;
+    return type == SET || type == SET_MULTI || type == SET_HASHES;
+}
+
+/**
+ * Hands a write to the execution threads, or to the coalescing
+ * of the worker, along with the writes of the same set right
+ * after it. The connection is parked until they ran, and the
+ * first other command is
+ * parked with it. The writes run here if they cannot be
+ * handed off.
+ */
+static void exec_commands(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    char set_name[MAX_PARKED_NAME];
+    char *end = memchr(args, ' ', args_len);
+    int name_len = (end) ? end - args : (int)strnlen(args, args_len);
+    int batch = (name_len > 0 && name_len < MAX_PARKED_NAME);
+    if (batch) {
+        memcpy(set_name, args, name_len);
+        set_name[name_len] = '\0';
+    }
+
+    char *cmds = NULL;
+    int len = 0, size = 0;
+    if (append_exec_cmd(&cmds, &len, &size, type, args, args_len)) {
+        free(cmds);
+        INTERNAL_ERROR();
+        return;
+    }
+
+    // Take the following writes of the set, stopping at binary frames
+    int num = 1, parked = 0;
+    while (batch && num < EXEC_BATCH_CMDS && len < EXEC_BATCH_BYTES) {
+        char first;
+        if (peek_client_bytes(handle->conn, &first, 1) || (unsigned char)first == BINARY_MAGIC)
+            break;
+
+        char *buf, *next_args = NULL;
+        int buf_len, next_len = 0, should_free;
+        if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free) == -1)
+            break;
+        conn_cmd_type next = determine_client_command(buf, buf_len, &next_args, &next_len);
+        int same = next_args && (next == SET || next == SET_MULTI || next == SET_HASHES) &&
+            next_len > name_len && !memcmp(next_args, set_name, name_len) &&
+            (next_args[name_len] == ' ' || next_args[name_len] == '\0');
+        if (same && !append_exec_cmd(&cmds, &len, &size, next, next_args, next_len)) {
+            num++;
+            if (should_free) free(buf);
+            continue;
+        }
+
+        // Anything else waits for the batch
+        park_command(handle, buf, buf_len, next_args);
+        if (should_free) free(buf);
+        parked = 1;
+        break;
+    }
+
+    if (batch && !exec_client_batch(handle->conn, set_name, cmds, len)) return;
+
+    // Without an execution thread, the writes run here
+    handle_exec_batch(handle, cmds, len);
+    free(cmds);
+    if (parked) resume_client_connection(handle->conn);
+}
+
+/**
+ * Appends a command to a batch, as its type and the
+ * length of its arguments, followed by the arguments
+ * @return 0 on success, -1 if out of memory.
+ */
+static int append_exec_cmd(char **cmds, int *len, int *size, conn_cmd_type type, char *args, int args_len) {
+    int need = *len + 2 * (int)sizeof(int) + args_len;
+    if (need > *size) {
+        int new_size = (*size) ? *size : 4096;
+        while (new_size < need) new_size *= 2;
+        char *grown = realloc(*cmds, new_size);
+        if (!grown) return -1;
+        *cmds = grown;
+        *size = new_size;
+    }
+    int header[2] = {type, args_len};
+    memcpy(*cmds + *len, header, sizeof(header));
+    memcpy(*cmds + *len + sizeof(header), args, args_len);
+    *len = need;
+    return 0;
+}
+
+/**
+ * Invoked on an execution thread with a batch of writes of
+ * a connection, as gathered by handle_client_connect. The
+ * responses are gathered in handle->exec, without a connection.
+ * @arg handle The connection related information
+ * @arg cmds The batch
+ * @arg cmds_len The length of the batch
+ */
+void handle_exec_batch(hlld_conn_handler *handle, char *cmds, int cmds_len) {
+    char *end = cmds + cmds_len;
+    while (cmds < end) {
+        int header[2];
+        memcpy(header, cmds, sizeof(header));
+        conn_cmd_type type = header[0];
+        char *args = cmds + sizeof(header);
+        int args_len = header[1];
+        cmds = args + args_len;
+
+        slowlog_phases_reset();
+        uint64_t start = metrics_now();
+        switch (type) {
+            case SET:
+                handle_set_cmd(handle, args, args_len);
+                break;
+            case SET_MULTI:
+                handle_set_multi_cmd(handle, args, args_len);
+                break;
+            case SET_HASHES:
+                handle_set_hashes_cmd(handle, args, args_len);
+                break;
+            default:
+                INTERNAL_ERROR();
+                break;
+        }
+        uint64_t nanos = metrics_now() - start;
+        record_cmd(handle, type, args, args_len, nanos);
+        if (is_slow(handle, nanos))
+            slowlog_add(handle->slowlog, type, args, args_len, nanos);
+    }
+    flush_done_sets(handle);
+}
+
+/*
+ * A batch and the set it writes, which starts
+ * its first command
+ */
+typedef struct {
+    hlld_exec_batch *batch;
+    char *name;
+    int name_len;
+} batch_set;
+
+/*
+ * A write of a batch being coalesced, once parsed
+ */
+typedef struct {
+    conn_cmd_type type;
+    char *args;
+    int args_len;
+    const char *err;    // The error to send instead, or NULL
+    int err_len;
+} coalesced_cmd;
+
+/*
+ * The writes of the batches of a set, and their keys and hashes
+ */
+typedef struct {
+    coalesced_cmd *cmds;
+    int num_cmds;
+    int max_cmds;
+    char **keys;
+    int *lens;
+    int num_keys;
+    int max_keys;
+    uint64_t *hashes;
+    int num_hashes;
+    int max_hashes;
+} coalesced_writes;
+
+/**
+ * Makes room for more keys, hashes and commands
+ * in the coalesced writes
+ * @return 0 on success, -1 if out of memory.
+ */
+static int reserve_coalesced(coalesced_writes *w, int keys, int hashes, int cmds) {
+    if (w->num_keys + keys > w->max_keys) {
+        int max = (w->max_keys) ? w->max_keys : COALESCE_KEYS;
+        while (max < w->num_keys + keys) max *= 2;
+        char **grown_keys = realloc(w->keys, max * sizeof(char*));
+        if (grown_keys) w->keys = grown_keys;
+        int *grown_lens = realloc(w->lens, max * sizeof(int));
+        if (grown_lens) w->lens = grown_lens;
+        if (!grown_keys || !grown_lens) return -1;
+        w->max_keys = max;
+    }
+    if (w->num_hashes + hashes > w->max_hashes) {
+        int max = (w->max_hashes) ? w->max_hashes : COALESCE_KEYS;
+        while (max < w->num_hashes + hashes) max *= 2;
+        uint64_t *grown = realloc(w->hashes, max * sizeof(uint64_t));
+        if (!grown) return -1;
+        w->hashes = grown;
+        w->max_hashes = max;
+    }
+    if (w->num_cmds + cmds > w->max_cmds) {
+        int max = (w->max_cmds) ? w->max_cmds : EXEC_BATCH_CMDS;
+        while (max < w->num_cmds + cmds) max *= 2;
+        coalesced_cmd *grown = realloc(w->cmds, max * sizeof(coalesced_cmd));
+        if (!grown) return -1;
+        w->cmds = grown;
+        w->max_cmds = max;
+    }
+    return 0;
+}
+
+/**
+ * Parses a write of a batch being coalesced, adding its keys or
+ * hashes to the writes of its set. A write with bad arguments
+ * gets the error its handler would send. Like handle_set_hashes_cmd,
+ * the hashes before a bad hash are kept in whole batches.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int coalesce_cmd(coalesced_writes *w, conn_cmd_type type, char *args, int args_len) {
+    if (reserve_coalesced(w, 0, 0, 1)) return -1;
+    coalesced_cmd *cmd = w->cmds + w->num_cmds++;
+    cmd->type = type;
+    cmd->args = args;
+    cmd->args_len = args_len;
+    cmd->err = NULL;
+    cmd->err_len = 0;
+
+    char *key;
+    int key_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (err || key_len <= 1) {
+        cmd->err = (type == SET_HASHES) ? SET_HASH_NEEDED : SET_KEY_NEEDED;
+        cmd->err_len = (type == SET_HASHES) ? SET_HASH_NEEDED_LEN : SET_KEY_NEEDED_LEN;
+        return 0;
+    }
+
+    // The key of a set is the rest of the line
+    if (type == SET) {
+        if (reserve_coalesced(w, 1, 0, 0)) return -1;
+        w->keys[w->num_keys] = key;
+        w->lens[w->num_keys++] = strlen(key);
+        return 0;
+    }
+
+    if (type == SET_MULTI) {
+        while (key) {
+            if (reserve_coalesced(w, MULTI_OP_SIZE, 0, 0)) return -1;
+            int num = split_keys(key, key_len, w->keys + w->num_keys, w->lens + w->num_keys,
+                    MULTI_OP_SIZE, &key, &key_len);
+            if (!num) break;
+            w->num_keys += num;
+        }
+        return 0;
+    }
+
+    int start = w->num_hashes;
+    char *curr_key = key;
+    while (curr_key && *curr_key != '\0') {
+        buffer_after_terminator(key, key_len, ' ', &key, &key_len);
+        if (reserve_coalesced(w, 0, 1, 0)) return -1;
+        if (parse_hash(curr_key, w->hashes + w->num_hashes)) {
+            int parsed = w->num_hashes - start;
+            w->num_hashes -= parsed % MULTI_OP_SIZE;
+            cmd->err = BAD_HASH;
+            cmd->err_len = BAD_HASH_LEN;
+            return 0;
+        }
+        w->num_hashes++;
+        curr_key = key;
+    }
+    return 0;
+}
+
+/**
+ * Orders batches by the set they write
+ */
+static int compare_batch_sets(const void *a, const void *b) {
+    const batch_set *x = a, *y = b;
+    if (x->name_len != y->name_len) return x->name_len - y->name_len;
+    return memcmp(x->name, y->name, x->name_len);
+}
+
+/**
+ * Invoked with batches of writes of many connections, like
+ * handle_exec_batch. The writes of the batches of each set
+ * are applied together, with one write of the set for all
+ * their keys, and then each batch gathers its responses.
+ * @arg handle The connection related information
+ * @arg batches The batches
+ * @arg num The number of batches
+ */
+void handle_exec_batches(hlld_conn_handler *handle, hlld_exec_batch **batches, int num) {
+    batch_set *sets = malloc(num * sizeof(batch_set));
+    hlld_exec_batch **group = malloc(num * sizeof(hlld_exec_batch*));
+    if (!sets || !group) {
+        free(sets);
+        free(group);
+        for (int i=0; i < num; i++) {
+            handle->exec = &batches[i]->out;
+            handle_exec_batch(handle, batches[i]->cmds, batches[i]->cmds_len);
+        }
+        return;
+    }
+
+    // Group the batches by set. Each starts with a write naming it.
+    for (int i=0; i < num; i++) {
+        int header[2];
+        memcpy(header, batches[i]->cmds, sizeof(header));
+        char *args = batches[i]->cmds + sizeof(header);
+        char *end = memchr(args, ' ', header[1]);
+        sets[i].batch = batches[i];
+        sets[i].name = args;
+        sets[i].name_len = (end) ? end - args : (int)strnlen(args, header[1]);
+    }
+    qsort(sets, num, sizeof(batch_set), compare_batch_sets);
+
+    for (int i=0; i < num; ) {
+        int size = 0;
+        do {
+            group[size++] = sets[i++].batch;
+        } while (i < num && !compare_batch_sets(sets + i - 1, sets + i));
+        coalesce_set_batches(handle, group, size);
+    }
+    free(sets);
+    free(group);
+}
+
+/**
+ * Applies the writes of batches of one set together, and
+ * gathers the responses of each batch. The keys and the
+ * hashes of the batches each take a write of the set for
+ * every COALESCE_KEYS, rather than one for every command.
+ */
+static void coalesce_set_batches(hlld_conn_handler *handle, hlld_exec_batch **batches, int num) {
+    uint64_t start = metrics_now();
+    coalesced_writes w;
+    memset(&w, 0, sizeof(w));
+    int failed = 0;
+    for (int i=0; i < num && !failed; i++) {
+        char *cmds = batches[i]->cmds, *end = cmds + batches[i]->cmds_len;
+        while (cmds < end && !failed) {
+            int header[2];
+            memcpy(header, cmds, sizeof(header));
+            char *args = cmds + sizeof(header);
+            cmds = args + header[1];
+            failed = coalesce_cmd(&w, header[0], args, header[1]);
+        }
+    }
+
+    // Without the memory to coalesce, each batch runs on its own
+    if (failed) {
+        free(w.cmds);
+        free(w.keys);
+        free(w.lens);
+        free(w.hashes);
+        for (int i=0; i < num; i++) {
+            handle->exec = &batches[i]->out;
+            handle_exec_batch(handle, batches[i]->cmds, batches[i]->cmds_len);
+        }
+        return;
+    }
+
+    // The set name was terminated while parsing its first write
+    char *set_name = w.cmds[0].args;
+    int key_res = 0, hash_res = 0;
+    for (int i=0; i < w.num_keys && !key_res; i += COALESCE_KEYS) {
+        int batch = (w.num_keys - i < COALESCE_KEYS) ? w.num_keys - i : COALESCE_KEYS;
+        key_res = owner_set_keys(handle, set_name, w.keys + i, w.lens + i, batch);
+    }
+    for (int i=0; i < w.num_hashes && !hash_res; i += COALESCE_KEYS) {
+        int batch = (w.num_hashes - i < COALESCE_KEYS) ? w.num_hashes - i : COALESCE_KEYS;
+        hash_res = owner_set_hashes(handle, set_name, w.hashes + i, batch);
+    }
+    handle->worker->batches_coalesced += num - 1;
+
+    // Each command is charged an equal share of the time
+    uint64_t nanos = (metrics_now() - start) / w.num_cmds;
+    coalesced_cmd *cmd = w.cmds;
+    for (int i=0; i < num; i++) {
+        handle->exec = &batches[i]->out;
+        handle->done_sets = 0;
+        char *cmds = batches[i]->cmds, *end = cmds + batches[i]->cmds_len;
+        for (; cmds < end; cmd++) {
+            cmds += 2 * sizeof(int) + cmd->args_len;
+            if (cmd->err)
+                handle_client_err(handle, (char*)cmd->err, cmd->err_len);
+            else
+                handle_set_keys_resp(handle, (cmd->type == SET_HASHES) ? hash_res : key_res);
+            record_cmd(handle, cmd->type, cmd->args, cmd->args_len, nanos);
+            if (is_slow(handle, nanos))
+                slowlog_add(handle->slowlog, cmd->type, cmd->args, cmd->args_len, nanos);
+        }
+        flush_done_sets(handle);
+    }
+    free(w.cmds);
+    free(w.keys);
+    free(w.lens);
+    free(w.hashes);
+}
+
+/**
+ * Periodic update is used to update our checkpoint with
+ * the set manager, so that vacuum progress can be made.
+ */
+void periodic_update(hlld_conn_handler *handle) {
+    setmgr_client_checkpoint(handle->mgr);
+}
+
+/**
+ * Checks if a command should go in the slow log
+ * @arg nanos The time spent on the command
+ * @return 1 if it was slow
+ */
+static inline int is_slow(hlld_conn_handler *handle, uint64_t nanos) {
+    if (!handle->slowlog) return 0;
+    uint64_t threshold = slowlog_threshold(handle->slowlog);
+    return threshold && nanos >= threshold;
+}
+
+/**
+ * Records a command into the metrics of this thread. A sample
+ * of the commands naming a single set weigh it, by commands
+ * and by keys added, for the hot sets.
+ */
+static void record_cmd(hlld_conn_handler *handle, conn_cmd_type type, char *args, int args_len, uint64_t nanos) {
+    metrics_record_cmd(handle->worker, type, nanos);
+    switch (type) {
+        case SET: case SET_MULTI: case SET_HASHES: case CREATE: case DROP:
+        case CLOSE: case CLEAR: case INFO: case FLUSH: case MERGE: case SIZE:
+            break;
+        default:
+            return;
+    }
+    if (!metrics_sample_set(handle->worker)) return;
+
+    int name_len, keys;
+    metrics_parse_args(args, args_len, &name_len, &keys);
+    if (type != SET && type != SET_MULTI && type != SET_HASHES) keys = 0;
+    metrics_record_set(handle->worker, args, name_len, keys);
+}
+
+/**
+ * Returns the name of a command type in the metrics
+ * @arg cmd The command type
+ * @return The name, or NULL past the last type.
+ */
+const char* handler_cmd_name(int cmd) {
+    if (cmd < 0 || cmd >= NUM_CMD_TYPES) return NULL;
+    return CMD_TYPE_NAMES[cmd];
+}
+
+
+/**
+ * Internal method to handle a command that relies
+ * on a set name and a single key, responses are handled using
+ * handle_multi_response.
+ */
+static void handle_set_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) CHECK_ARG_ERR();
+
+    // Scan past the set name
+    char *key;
+    int key_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (err || key_len <= 1) CHECK_ARG_ERR();
+
+    // Setup the buffers
+    char *key_buf[] = {key};
+
+    // Call into the set manager
+    int res = owner_set_keys(handle, args, (char**)&key_buf, NULL, 1);
+
+    // Generate the response
+    handle_set_keys_resp(handle, res);
+}
+
+
+/**
+ * Internal method to handle a command that relies
+ * on a set name and multiple keys, responses are handled using
+ * handle_multi_response.
+ */
+static void handle_set_multi_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) CHECK_ARG_ERR();
+
+    // Setup the buffers
+    char *key_buf[MULTI_OP_SIZE];
+    int key_lens[MULTI_OP_SIZE];
+
+    // Scan all the keys
+    char *key;
+    int key_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (err || key_len <= 1) CHECK_ARG_ERR();
+
+    // Split a batch of keys at a time, with their lengths
+    // so they are not scanned again when hashed
+    int res = 0;
+    while (key && !res) {
+        int num = split_keys(key, key_len, key_buf, key_lens, MULTI_OP_SIZE, &key, &key_len);
+        if (!num) break;
+        res = owner_set_keys(handle, args, key_buf, key_lens, num);
+    }
+
+    // Generate the response
+    handle_set_keys_resp(handle, res);
+}
+
+/**
+ * Parses a hash sent by a client, as up to 16 hex digits.
+ * @return 0 on success, -1 if the hash is malformed.
+ */
+static int parse_hash(const char *buf, uint64_t *hash) {
+    uint64_t val = 0;
+    int digits = 0;
+    for (; *buf; buf++, digits++) {
+        int c = *buf;
+        if (c >= '0' && c <= '9') c -= '0';
+        else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+        else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+        else return -1;
+        val = (val << 4) | c;
+    }
+    if (!digits || digits > 16) return -1;
+    *hash = val;
+    return 0;
+}
+
+/**
+ * Internal method to handle a command that relies
+ * on a set name and multiple hashes computed by the client.
+ * The hashes go straight to the registers without hashing.
+ */
+static void handle_set_hashes_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    #undef CHECK_ARG_ERR
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle, (char*)&SET_HASH_NEEDED, SET_HASH_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) CHECK_ARG_ERR();
+
+    // Scan past the set name
+    char *key;
+    int key_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (err || key_len <= 1) CHECK_ARG_ERR();
+
+    // Parse the hashes in batches
+    uint64_t hashes[MULTI_OP_SIZE];
+    char *curr_key = key;
+    int res = 0;
+    int index = 0;
+    while (curr_key && *curr_key != '\0') {
+        // Adds a zero terminator to the current hash, scans forward
+        buffer_after_terminator(key, key_len, ' ', &key, &key_len);
+        if (parse_hash(curr_key, hashes + index)) {
+            handle_client_err(handle, (char*)&BAD_HASH, BAD_HASH_LEN);
+            return;
+        }
+        curr_key = key;
+        index++;
+
+        // If we have filled the buffer, set now
+        if (index == MULTI_OP_SIZE) {
+            res = owner_set_hashes(handle, args, hashes, index);
+            if (res) goto SEND_RESULT;
+            index = 0;
+        }
+    }
+
+    // Handle any remaining hashes
+    if (index) {
+        res = owner_set_hashes(handle, args, hashes, index);
+    }
+
+SEND_RESULT:
+    handle_set_keys_resp(handle, res);
+}
+
+/**
+ * Checks the sets of a setall command for one that is
+ * proxied, like should_park_groups.
+ * @return 1 if the command should be parked.
+ */
+static int should_park_all(hlld_conn_handler *handle, char *args, int args_len) {
+    // Skip the key
+    char *end = args + args_len;
+    args = memchr(args, ' ', args_len);
+    while (args && ++args < end && *args) {
+        char *name_end = memchr(args, ' ', end - args);
+        int name_len = (name_end) ? name_end - args : (int)strnlen(args, end - args);
+        if (park_set(handle, args, name_len)) return 1;
+        args = name_end;
+    }
+    return 0;
+}
+
+/**
+ * Finds the reference of a union member on another server,
+ * which is either named as host:port/set, or is a set the
+ * cluster ring puts on another node.
+ * @arg name The member, which need not be terminated
+ * @arg name_len The length of the name
+ * @arg ref Output, the terminated reference, of MAX_REMOTE_REF bytes
+ * @return 1 if the member is remote, 0 if it is local.
+ */
+static int member_ref(hlld_conn_handler *handle, char *name, int name_len, char *ref) {
+    if (remote_is_ref(name, name_len)) {
+        if (name_len >= MAX_REMOTE_REF) return 0;
+        memcpy(ref, name, name_len);
+        ref[name_len] = '\0';
+        return 1;
+    }
+    if (cluster_is_local(handle->cluster, name, name_len)) return 0;
+    char *addr = handle->cluster->nodes[cluster_node_of(handle->cluster, name, name_len)];
+    return snprintf(ref, MAX_REMOTE_REF, "%s/%.*s", addr, name_len, name) < MAX_REMOTE_REF;
+}
+
+/**
+ * Checks the members of a union for remote sets that are
+ * not cached, or were fetched more than remote_cache_msec
+ * ago, and if so queues them to be fetched. The connection
+ * is resumed once the last of them is fetched. Unions whose
+ * members would evict each other from the cache are not
+ * parked, and fetch them when handled instead.
+ * @return 1 if the command should be parked.
+ */
+static int should_park_union(hlld_conn_handler *handle, char *args, int args_len) {
+    if (!handle->remote) return 0;
+    char *refs[MAX_PARKED_REFS];
+    int stale[MAX_PARKED_REFS];
+    int num = 0, res = 0, last = -1;
+    char ref[MAX_REMOTE_REF];
+
+    char *end = args + args_len;
+    while (args < end && *args) {
+        char *name_end = memchr(args, ' ', end - args);
+        int name_len = (name_end) ? name_end - args : (int)strnlen(args, end - args);
+        if (member_ref(handle, args, name_len, ref)) {
+            int dup = 0;
+            for (int i=0; i < num; i++) {
+                if (remote_slot(refs[i]) != remote_slot(ref)) continue;
+                if (strcmp(refs[i], ref)) goto LEAVE;
+                dup = 1;
+            }
+            if (!dup) {
+                if (num == MAX_PARKED_REFS) goto LEAVE;
+                remote_set *set = remote_get(handle->remote, ref, handle->config->remote_cache_msec);
+                if (set) remote_release(handle->remote, set);
+                stale[num] = !set;
+                if (!set) last = num;
+                refs[num++] = strdup(ref);
+            }
+        }
+        if (!name_end) break;
+        args = name_end + 1;
+    }
+
+    // Only the last fetch resumes the connection
+    for (int i=0; i <= last; i++) {
+        if (!stale[i]) continue;
+        if (i < last)
+            remote_fetch_async(handle->remote, refs[i], NULL, NULL);
+        else
+            res = !remote_fetch_async(handle->remote, refs[i], resume_parked_conn, handle->conn);
+    }
+
+LEAVE:
+    for (int i=0; i < num; i++) free(refs[i]);
+    return res;
+}
+
+/**
+ * Estimates the size of a union, whose members may be
+ * sets on other servers. Those are taken from the cache,
+ * or fetched if the cache could not hold them.
+ * @return As setmgr_size_union_remote, or -5 if a
+ * remote set could not be fetched.
+ */
+static int size_union_members(hlld_conn_handler *handle, char **names, int num_sets, uint64_t *est) {
+    char **local = malloc(num_sets * sizeof(char*));
+    remote_set **remotes = malloc(num_sets * sizeof(remote_set*));
+    hll_t **hlls = malloc(num_sets * sizeof(hll_t*));
+    hlld_set_config **configs = malloc(num_sets * sizeof(hlld_set_config*));
+    int *cached = malloc(num_sets * sizeof(int));
+    int num_local = 0, num_remote = 0, res = 0;
+    char ref[MAX_REMOTE_REF];
+
+    for (int i=0; i < num_sets; i++) {
+        if (!member_ref(handle, names[i], strlen(names[i]), ref)) {
+            local[num_local++] = names[i];
+            continue;
+        }
+        remote_set *set = (handle->remote) ? remote_get(handle->remote, ref, -1) : NULL;
+        cached[num_remote] = (set != NULL);
+        if (!set) set = remote_fetch(ref);
+        remotes[num_remote++] = set;
+        if (set->status) {
+            res = (set->status == -1) ? -1 : -5;
+            break;
+        }
+        hlls[num_remote-1] = &set->hll;
+        configs[num_remote-1] = &set->set_config;
+    }
+    if (!res)
+        res = setmgr_size_union_remote(handle->mgr, local, num_local,
+                hlls, configs, num_remote, est);
+
+    for (int i=0; i < num_remote; i++) {
+        remote_release((cached[i]) ? handle->remote : NULL, remotes[i]);
+    }
+    free(local);
+    free(remotes);
+    free(hlls);
+    free(configs);
+    free(cached);
+    return res;
+}
+
+/**
+ * Adds a response line for each set that could not be
+ * updated by a multi or setall command.
+ * @arg output_bufs The response lines, with room for all the sets
+ * @arg output_bufs_len The lengths of the lines
+ * @arg num_out The number of lines, which is updated
+ */
+static void add_set_failures(char **set_names, int *results, int num_sets,
+        char **output_bufs, int *output_bufs_len, int *num_out) {
+    for (int i=0; i < num_sets; i++) {
+        if (!results[i]) continue;
+        const char *msg = (results[i] == -1) ? SET_NOT_EXIST :
+            (results[i] == -3) ? HASH_MODE_MISMATCH_RESP : INTERNAL_ERR;
+        int len = asprintf(output_bufs + *num_out, "%s %s", set_names[i], msg);
+        assert(len != -1);
+        output_bufs_len[(*num_out)++] = len;
+    }
+}
+
+/**
+ * Sends the single response of a multi or setall command,
+ * which is "Done", or a list of the sets that failed.
+ * @arg output_bufs The response lines from add_set_failures,
+ * with room for the START and END lines
+ * @arg output_bufs_len The lengths of the lines
+ * @arg num_out The number of lines, starting from 1
+ */
+static void send_set_failures(hlld_conn_handler *handle, char **output_bufs,
+        int *output_bufs_len, int num_out) {
+    if (num_out == 1) {
+        handle_set_keys_resp(handle, 0);
+        return;
+    }
+    flush_done_sets(handle);
+    output_bufs[0] = (char*)&START_RESP;
+    output_bufs_len[0] = START_RESP_LEN;
+    output_bufs[num_out] = (char*)&END_RESP;
+    output_bufs_len[num_out] = END_RESP_LEN;
+    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out + 1);
+}
+
+/**
+ * Checks if a token is the separator between the groups
+ * of a multi command
+ */
+static inline int is_group_separator(char *token) {
+    return token[0] == '|' && (token[1] == ' ' || token[1] == '\0');
+}
+
+/**
+ * Internal method to handle a command that sets keys in
+ * groups of sets. Each group is a comma separated list of
+ * sets and the keys to set in all of them, and groups are
+ * separated by a '|'. A single response covers every group,
+ * listing the sets that could not be updated.
+ */
+static void handle_set_groups_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    #undef CHECK_ARG_ERR
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN); \
+        goto CLEANUP; \
+    }
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN);
+        return;
+    }
+
+    // Lines for the sets that failed, after a START line.
+    // There is at most one set per two bytes.
+    int num_out = 1;
+    char **output_bufs = malloc((args_len / 2 + 3) * sizeof(char*));
+    int *output_bufs_len = malloc((args_len / 2 + 3) * sizeof(int));
+
+    char *set_names[MAX_GROUP_SETS];
+    int results[MAX_GROUP_SETS];
+    char *key_buf[MULTI_OP_SIZE];
+    char *rest = args, *token;
+    int rest_len = args_len;
+    while (rest && *rest != '\0') {
+        // Split the sets of the group
+        token = rest;
+        buffer_after_terminator(rest, rest_len, ' ', &rest, &rest_len);
+        int num_sets = 0;
+        while (token && *token != '\0') {
+            if (num_sets == MAX_GROUP_SETS) {
+                handle_client_err(handle, (char*)&TOO_MANY_SETS, TOO_MANY_SETS_LEN);
+                goto CLEANUP;
+            }
+            set_names[num_sets] = token;
+            results[num_sets++] = 0;
+            token = strchr(token, ',');
+            if (token) *token++ = '\0';
+        }
+
+        // Set the keys of the group in batches
+        int index = 0, num_keys = 0;
+        while (rest && *rest != '\0' && !is_group_separator(rest)) {
+            token = rest;
+            buffer_after_terminator(rest, rest_len, ' ', &rest, &rest_len);
+            key_buf[index++] = token;
+            num_keys++;
+            if (index == MULTI_OP_SIZE) {
+                owner_set_keys_multi(handle, set_names, num_sets, key_buf, index, results);
+                index = 0;
+            }
+        }
+        if (!num_sets || !num_keys) CHECK_ARG_ERR();
+        if (index) {
+            owner_set_keys_multi(handle, set_names, num_sets, key_buf, index, results);
+        }
+
+        // Skip the separator
+        if (rest && *rest != '\0')
+            buffer_after_terminator(rest, rest_len, ' ', &rest, &rest_len);
+
+        // Report the sets that failed
+        add_set_failures(set_names, results, num_sets, output_bufs, output_bufs_len, &num_out);
+    }
+
+    // Respond once for all the groups
+    send_set_failures(handle, output_bufs, output_bufs_len, num_out);
+
+CLEANUP:
+    for (int i=1; i < num_out; i++) free(output_bufs[i]);
+    free(output_bufs);
+    free(output_bufs_len);
+}
+
+/**
+ * Internal method to handle a command that sets a single
+ * key in many sets. The key is hashed once, and a single
+ * response lists the sets that could not be updated.
+ */
+static void handle_set_all_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    char *rest;
+    int rest_len;
+    if (!args || buffer_after_terminator(args, args_len, ' ', &rest, &rest_len) ||
+            *rest == '\0') {
+        handle_client_err(handle, (char*)&SET_KEY_NEEDED, SET_KEY_NEEDED_LEN);
+        return;
+    }
+
+    // Lines for the sets that failed, after a START line.
+    // There is at most one set per two bytes.
+    int num_out = 1;
+    char **output_bufs = malloc((rest_len / 2 + 3) * sizeof(char*));
+    int *output_bufs_len = malloc((rest_len / 2 + 3) * sizeof(int));
+
+    // Set the key in batches of sets
+    char *set_names[MAX_GROUP_SETS];
+    int results[MAX_GROUP_SETS];
+    while (rest && *rest != '\0') {
+        int num_sets = 0;
+        while (rest && *rest != '\0' && num_sets < MAX_GROUP_SETS) {
+            set_names[num_sets] = rest;
+            results[num_sets++] = 0;
+            buffer_after_terminator(rest, rest_len, ' ', &rest, &rest_len);
+        }
+        owner_set_keys_multi(handle, set_names, num_sets, &args, 1, results);
+        add_set_failures(set_names, results, num_sets, output_bufs, output_bufs_len, &num_out);
+    }
+
+    send_set_failures(handle, output_bufs, output_bufs_len, num_out);
+    for (int i=1; i < num_out; i++) free(output_bufs[i]);
+    free(output_bufs);
+    free(output_bufs_len);
+}
+
+/**
+ * Internal command used to handle set creation.
+ */
+static void handle_create_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Scan for options after the set name
+    char *options;
+    int options_len;
+    int res = buffer_after_terminator(args, args_len, ' ', &options, &options_len);
+
+    // Verify the set name is valid
+    char *set_name = args;
+    if (!valid_set_name(set_name)) {
+        handle_client_err(handle, (char*)&BAD_SET_NAME, BAD_SET_NAME_LEN);
+        return;
+    }
+
+    // Parse the options
+    hlld_config *config = NULL;
+    int err = 0, async = 0;
+    if (res == 0) {
+        // Make a new config store, copy the current
+        config = malloc(sizeof(hlld_config));
+        memcpy(config, handle->config, sizeof(hlld_config));
+
+        // Parse any options
+        char *param = options;
+        while (param) {
+            // Adds a zero terminator to the current param, scans forward
+            buffer_after_terminator(options, options_len, ' ', &options, &options_len);
+
+            // Check for the custom params
+            int match = 0;
+            if (sscanf(param, "precision=%u", &config->default_precision)) {
+                // Compute error given precision
+                config->default_eps = hll_error_for_precision(config->default_precision);
+                match = 1;
+            }
+            if (sscanf(param, "eps=%lf", &config->default_eps)) {
+                // Compute precision given error
+                config->default_precision = hll_precision_for_error(config->default_eps);
+
+                // Compute error given precision. This is kinda strange but it is done
+                // since its not possible to hit all epsilons perfectly, but we try to get
+                // the eps provided to be the upper bound. This value is the actual eps.
+                config->default_eps = hll_error_for_precision(config->default_precision);
+                match = 1;
+            }
+            match |= sscanf(param, "in_memory=%d", &config->in_memory);
+            match |= sscanf(param, "sparse=%d", &config->sparse);
+            match |= sscanf(param, "buckets=%d", &config->default_window_buckets);
+            match |= sscanf(param, "kmv=%d", &config->default_kmv);
+            match |= sscanf(param, "async=%d", &async);
+
+            char format[16];
+            if (sscanf(param, "format=%15s", format)) {
+                if (hll_format_from_name(format, &config->default_format)) {
+                    config->default_format = -1;
+                }
+                match = 1;
+            }
+            if (sscanf(param, "estimator=%15s", format)) {
+                if (hll_estimator_from_name(format, &config->default_estimator)) {
+                    config->default_estimator = -1;
+                }
+                match = 1;
+            }
+            if (sscanf(param, "hash=%15s", format)) {
+                if (hll_hash_from_name(format, &config->default_hash)) {
+                    config->default_hash = -1;
+                }
+                match = 1;
+            }
+            if (sscanf(param, "window=%15s", format)) {
+                uint64_t secs;
+                config->default_window = (duration_to_secs(format, &secs) ||
+                        secs > INT32_MAX) ? -1 : (int)secs;
+                match = 1;
+            }
+            if (sscanf(param, "sliding=%15s", format)) {
+                uint64_t secs;
+                config->default_sliding = (duration_to_secs(format, &secs) ||
+                        secs > INT32_MAX) ? -1 : (int)secs;
+                match = 1;
+            }
+            if (sscanf(param, "ttl=%15s", format)) {
+                uint64_t secs;
+                config->default_ttl = (duration_to_secs(format, &secs) ||
+                        secs > INT32_MAX) ? -1 : (int)secs;
+                match = 1;
+            }
+            if (sscanf(param, "durability=%15s", format)) {
+                if (durability_from_name(format, &config->default_durability,
+                            &config->default_flush_period)) {
+                    config->default_durability = -1;
+                }
+                match = 1;
+            }
+
+            // Check if there was no match
+            if (!match) {
+                err = 1;
+                handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+                break;
+            }
+
+            // Advance to the next param
+            param = options;
+        }
+
+        // Validate the params
+        // Barf if the configs are bad
+        if (sane_set_options(config)) {
+            err = 1;
+            handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        }
+    }
+
+    // Clean up an leave on errors
+    if (err) {
+        if (config) free(config);
+        return;
+    }
+
+    // Create a new set. Its folder is made in the background, and
+    // the connection is parked until then unless the client is not
+    // waiting for it
+    int wait = handle->conn && !async;
+    if (wait) *client_handler_flags(handle->conn) |= CREATE_PENDING;
+    if (handle->conn)
+        res = setmgr_create_set_async(handle->mgr, set_name, config,
+                (wait) ? resume_created_conn : NULL, handle->conn);
+    else
+        res = setmgr_create_set(handle->mgr, set_name, config);
+    if (wait && res != 1) *client_handler_flags(handle->conn) &= ~CREATE_PENDING;
+    switch (res) {
+        case 1:
+            if (wait) {
+                park_client_command(handle->conn, NULL, 0);
+                break;
+            }
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case 0:
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
+            if (config) free(config);
+            break;
+        case -3:
+            handle_client_resp(handle, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
+            if (config) free(config);
+            break;
+        default:
+            INTERNAL_ERROR();
+            if (config) free(config);
+            break;
+    }
+}
+
+/**
+ * Internal command used to create many sets with the
+ * settings of a template, or the defaults.
+ */
+static void handle_bulk_create_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // Scan past the template name
+    char *names_buf;
+    int names_len;
+    if (!args || buffer_after_terminator(args, args_len, ' ', &names_buf, &names_len) ||
+            !*names_buf) {
+        handle_client_err(handle, (char*)&TEMPLATE_SETS_NEEDED, TEMPLATE_SETS_NEEDED_LEN);
+        return;
+    }
+
+    // The default template is the defaults, unless it is defined
+    hlld_config *config = config_template(handle->config, args);
+    if (!config && strcmp(args, "default")) {
+        handle_client_err(handle, (char*)&UNKNOWN_TEMPLATE, UNKNOWN_TEMPLATE_LEN);
+        return;
+    }
+
+    // Split the set names, there is at most one per two bytes
+    int max_sets = names_len / 2 + 1;
+    char **names = malloc(max_sets * sizeof(char*));
+    char *name = names_buf, *next;
+    int next_len, num_sets = 0;
+    while (name && *name != '\0') {
+        buffer_after_terminator(names_buf, names_len, ' ', &next, &next_len);
+        names[num_sets++] = name;
+        name = names_buf = next;
+        names_len = next_len;
+    }
+
+    // Only create the sets with valid names
+    char **valid = malloc(num_sets * sizeof(char*));
+    int *results = calloc(num_sets, sizeof(int));
+    int *valid_results = calloc(num_sets, sizeof(int));
+    int num_valid = 0;
+    for (int i=0; i < num_sets; i++) {
+        if (!valid_set_name(names[i]))
+            results[i] = -4;
+        else
+            valid[num_valid++] = names[i];
+    }
+    setmgr_create_sets(handle->mgr, valid, num_valid, config, valid_results);
+    for (int i=0, v=0; i < num_sets; i++) {
+        if (!results[i]) results[i] = valid_results[v++];
+    }
+
+    // Respond with a line per set, between START and END
+    char **output_bufs = malloc((num_sets + 2) * sizeof(char*));
+    int *output_bufs_len = malloc((num_sets + 2) * sizeof(int));
+    output_bufs[0] = (char*)&START_RESP;
+    output_bufs_len[0] = START_RESP_LEN;
+    for (int i=0; i < num_sets; i++) {
+        const char *resp;
+        switch (results[i]) {
+            case 0: resp = DONE_RESP; break;
+            case -1: resp = EXISTS_RESP; break;
+            case -3: resp = DELETE_IN_PROGRESS; break;
+            default: resp = INTERNAL_ERR; break;
+        }
+        int len = (results[i] == -4) ?
+            asprintf(output_bufs + i + 1, "%s %s%s\n", names[i], CLIENT_ERR, BAD_SET_NAME) :
+            asprintf(output_bufs + i + 1, "%s %s", names[i], resp);
+        assert(len != -1);
+        output_bufs_len[i + 1] = len;
+    }
+    output_bufs[num_sets + 1] = (char*)&END_RESP;
+    output_bufs_len[num_sets + 1] = END_RESP_LEN;
+    send_handler_response(handle, output_bufs, output_bufs_len, num_sets + 2);
+
+    for (int i=1; i <= num_sets; i++) free(output_bufs[i]);
+    free(output_bufs);
+    free(output_bufs_len);
+    free(valid_results);
+    free(results);
+    free(valid);
+    free(names);
+}
+
+
+/**
+ * Internal method to handle a command that relies
+ * on a set name and a single key, responses are handled using
+ * handle_multi_response.
+ */
+static void handle_setop_cmd(hlld_conn_handler *handle, char *args, int args_len,
+        int(*setmgr_func)(hlld_setmgr *, char*)) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the set name
     char *key;
     int key_len;
     int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (after == 0) {
-        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
         return;
     }
 
@@ -362,187 +2400,846 @@ static void handle_clear_cmd(hlld_conn_handler *handle, char *args, int args_len
     handle_setop_cmd(handle, args, args_len, setmgr_clear_set);
 }
 
+/*
+ * The bytes of each chunk of a list response
+ */
+#define LIST_CHUNK_SIZE 65536
+
+// State used to stream the lines of a list response
+typedef struct {
+    hlld_conn_info *conn;
+    char *buf;
+    int len;
+    int metadata;
+} list_chunk;
+
+// Sends the lines of a list response buffered so far
+static void send_list_chunk(list_chunk *chunk) {
+    if (!chunk->len) return;
+    char *buffers[] = {chunk->buf};
+    int sizes[] = {chunk->len};
+    send_client_response(chunk->conn, (char**)&buffers, (int*)&sizes, 1);
+    chunk->len = 0;
+}
+
+// Callback invoked by list command to create an output
+// line for each set. The set is held with its read lock,
+// so the estimate is the latest size. Proxied sets answer
+// from their metadata, so a list never faults them in.
+// With metadata=1 no set is estimated, and stale sizes
+// are marked.
+static void list_set_cb(void *data, char *set_name, hlld_set *set) {
+    list_chunk *chunk = data;
+    uint64_t estimate;
+    int stale = 0;
+    if (chunk->metadata || hset_is_proxied(set))
+        stale = hset_metadata_size(set, &estimate);
+    else
+        estimate = hset_size(set);
+    for (;;) {
+        int avail = LIST_CHUNK_SIZE - chunk->len;
+        int len = snprintf(chunk->buf + chunk->len, avail, "%s %f %u %llu %llu%s\n",
+                set_name,
+                set->set_config.default_eps,
+                set->set_config.default_precision,
+                (long long unsigned)hset_byte_size(set),
+                (long long unsigned)estimate,
+                (chunk->metadata && stale) ? " stale" : "");
+        if (len < avail) {
+            chunk->len += len;
+            return;
+        }
+        assert(chunk->len);
+        send_list_chunk(chunk);
+    }
+}
+
+static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // Split the prefix from the cursor of a page
+    char *prefix = NULL, *after = NULL, *option;
+    int limit = 0, metadata = 0;
+    while (args) {
+        option = args;
+        if (buffer_after_terminator(args, args_len, ' ', &args, &args_len)) args = NULL;
+        if (!strncmp(option, "limit=", 6)) {
+            char *end;
+            long val = strtol(option + 6, &end, 10);
+            if (*end || end == option + 6 || val <= 0 || val > INT_MAX) {
+                handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+                return;
+            }
+            limit = val;
+        } else if (!strncmp(option, "after=", 6) && option[6]) {
+            after = option + 6;
+        } else if (!strcmp(option, "metadata=1")) {
+            metadata = 1;
+        } else if (!prefix && !limit && !after && !metadata && *option) {
+            prefix = option;
+        } else {
+            handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    // Stream the sets in chunks, between the START/END lines
+    list_chunk chunk = {handle->conn, malloc(LIST_CHUNK_SIZE), START_RESP_LEN, metadata};
+    memcpy(chunk.buf, START_RESP, START_RESP_LEN);
+    setmgr_page_sets(handle->mgr, prefix, after, limit, list_set_cb, &chunk);
+    if (LIST_CHUNK_SIZE - chunk.len < END_RESP_LEN) send_list_chunk(&chunk);
+    memcpy(chunk.buf + chunk.len, END_RESP, END_RESP_LEN);
+    chunk.len += END_RESP_LEN;
+    send_list_chunk(&chunk);
+    free(chunk.buf);
+}
+
+
 // Callback invoked by list command to create an output
 // line for each set. We hold a set handle which we
 // can use to get some info about it
-static void list_set_cb(void *data, char *set_name, hlld_set *set) {
+static void info_set_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
     set_cb_data *cb_data = data;
-    int res;
 
-    // Use the last flush size, attempt to get the latest size.
-    // We do this in-case a list is at the same time as a unmap/delete.
-    uint64_t estimate = set->set_config.size;
-    setmgr_set_size(cb_data->mgr, set_name, &estimate);
-
-    res = asprintf(cb_data->output, "%s %f %u %llu %llu\n",
-            set_name,
-            set->set_config.default_eps,
-            set->set_config.default_precision,
-            (long long unsigned)hset_byte_size(set),
-            (long long unsigned)estimate);
+    // Proxied sets answer with the size of their last flush,
+    // so an info never faults them in. Otherwise attempt to get
+    // the latest size, in-case the info races an unmap/delete.
+    uint64_t size;
+    int stale = hset_metadata_size(set, &size);
+    if (!hset_is_proxied(set) && !setmgr_set_size(cb_data->mgr, set_name, &size))
+        stale = 0;
+
+    // Get some metrics
+    set_counters *counters = hset_counters(set);
+    uint64_t storage = hset_byte_size(set);
+    uint64_t resident = hset_resident_bytes(set);
+    uint64_t sets = counters->sets;
+
+    // Generate a formatted string output
+    int res;
+    res = asprintf(cb_data->output, "in_memory %d\n\
+format %s\n\
+sparse %d\n\
+estimator %s\n\
+hash %s\n\
+window %d\n\
+window_buckets %d\n\
+sliding %d\n\
+kmv %d\n\
+expires %llu\n\
+durability %s\n\
+flush_period %d\n\
+page_ins %llu\n\
+page_outs %llu\n\
+checksum_errors %llu\n\
+flush_syscalls %llu\n\
+flush_bytes %llu\n\
+flush_clean_pages %llu\n\
+flushes %llu\n\
+flush_ns %llu\n\
+flush_max_ns %llu\n\
+resident_bytes %llu\n\
+page_faults %llu\n\
+epsilon %f\n\
+precision %u\n\
+sets %llu\n\
+size %llu\n\
+stale %d\n\
+storage %llu\n",
+    ((hset_is_proxied(set)) ? 0 : 1),
+    hll_format_name(set->set_config.format),
+    set->set_config.sparse,
+    hll_estimator_name(set->set_config.estimator),
+    hll_hash_name(set->set_config.hash),
+    set->set_config.window,
+    set->set_config.window_buckets,
+    set->set_config.sliding,
+    set->set_config.kmv,
+    (unsigned long long)set->set_config.expires,
+    durability_name(set->set_config.durability),
+    set->set_config.flush_period,
+    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
+    (unsigned long long)counters->checksum_errors,
+    (unsigned long long)counters->flush_syscalls, (unsigned long long)counters->flush_bytes,
+    (unsigned long long)counters->flush_clean_pages, (unsigned long long)counters->flushes,
+    (unsigned long long)counters->flush_nanos, (unsigned long long)counters->flush_max_nanos,
+    (unsigned long long)resident, (unsigned long long)counters->page_faults,
+    set->set_config.default_eps,
+    set->set_config.default_precision,
+    (unsigned long long)sets,
+    (unsigned long long)size,
+    stale,
+    (unsigned long long)storage);
     assert(res != -1);
 }
 
-static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
+static void handle_info_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the set name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Create output buffers
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+
+    // Invoke the callback to get the set stats
+    set_cb_data cb_data = {handle->mgr, &output[1]};
+    int res = setmgr_set_cb(handle->mgr, args, info_set_cb, &cb_data);
+
+    // Check for no set
+    if (res != 0) {
+        switch (res) {
+            case -1:
+                handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+                break;
+            default:
+                INTERNAL_ERROR();
+                break;
+        }
+        return;
+    }
+
+    // Adjust the buffer size
+    lens[1] = strlen(output[1]);
+
+    // Write out the bufs
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+    free(output[1]);
+}
+
+
+static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have a specfic set, use filt_cmd
+    if (args) {
+        handle_setop_cmd(handle, args, args_len, setmgr_flush_set);
+        return;
+    }
+
+    // List all the sets
+    hlld_set_list_head *head;
+    int res = setmgr_list_sets(handle->mgr, NULL, &head);
+    if (res != 0) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    // Flush all, ignore errors since
+    // sets might get deleted in the process
+    hlld_set_list *node = head->head;
+    while (node) {
+        setmgr_flush_set(handle->mgr, node->set_name);
+        node = node->next;
+    }
+
+    // Respond
+    handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+
+    // Cleanup
+    setmgr_cleanup_list(head);
+}
+
+
+/**
+ * Internal command used to merge sets into a destination set.
+ */
+static void handle_merge_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    #undef CHECK_ARG_ERR
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle, (char*)&MERGE_SETS_NEEDED, MERGE_SETS_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) CHECK_ARG_ERR();
+
+    // Setup the buffers
+    char *src_buf[MULTI_OP_SIZE];
+
+    // Scan past the destination
+    char *src;
+    int src_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &src, &src_len);
+    if (err || src_len <= 1) CHECK_ARG_ERR();
+
+    // Merge the sources in batches. Union is associative,
+    // so this is the same as merging them all at once.
+    char *curr_src = src;
+    int res = 0;
+    int index = 0;
+    while (curr_src && *curr_src != '\0') {
+        // Adds a zero terminator to the current source, scans forward
+        buffer_after_terminator(src, src_len, ' ', &src, &src_len);
+        src_buf[index++] = curr_src;
+        curr_src = src;
+
+        if (index == MULTI_OP_SIZE) {
+            res = owner_merge_sets(handle, args, (char**)&src_buf, index);
+            if (res) goto SEND_RESULT;
+            index = 0;
+        }
+    }
+
+    // Handle any remaining sources
+    if (index) {
+        res = owner_merge_sets(handle, args, (char**)&src_buf, index);
+    }
+
+SEND_RESULT:
+    switch (res) {
+        case 0:
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            break;
+        case -2:
+            handle_client_err(handle, (char*)&PRECISION_MISMATCH, PRECISION_MISMATCH_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Internal command used to estimate the size of a set,
+ * or with last=<duration>, the keys added to a windowed
+ * or sliding set over its recent intervals.
+ */
+static void handle_size_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Look for the span after the set name
+    char *option;
+    int option_len, res;
+    uint64_t span = 0, est = 0;
+    if (buffer_after_terminator(args, args_len, ' ', &option, &option_len) == 0) {
+        if (strncmp(option, "last=", 5) || duration_to_secs(option + 5, &span) || !span) {
+            handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+        res = setmgr_set_size_window(handle->mgr, args, span, &est);
+    } else {
+        res = setmgr_set_size(handle->mgr, args, &est);
+    }
+
+    switch (res) {
+        case 0: {
+            char *output;
+            int len = asprintf(&output, "%llu\n", (unsigned long long)est);
+            assert(len != -1);
+            handle_client_resp(handle, output, len);
+            free(output);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            break;
+        case -2:
+            handle_client_err(handle, (char*)&NOT_WINDOWED, NOT_WINDOWED_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+/**
+ * Internal command used to estimate the size of many
+ * sets at once, with a line for each set. With a trailing
+ * metadata=1, the sizes are read from the metadata alone,
+ * and stale sizes are marked.
+ */
+static void handle_sizes_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        return;
+    }
+
+    // Split the set names, there is at most one per two bytes
+    int max_sets = args_len / 2 + 1;
+    char **names = malloc(max_sets * sizeof(char*));
+    char *name = args, *next;
+    int next_len, num_sets = 0;
+    while (name && *name != '\0') {
+        buffer_after_terminator(args, args_len, ' ', &next, &next_len);
+        names[num_sets++] = name;
+        name = args = next;
+        args_len = next_len;
+    }
+    int metadata = num_sets && !strcmp(names[num_sets - 1], "metadata=1");
+    if (metadata && !--num_sets) {
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        free(names);
+        return;
+    }
+
+    uint64_t *sizes = malloc(num_sets * sizeof(uint64_t));
+    int *results = calloc(num_sets, sizeof(int));
+    if (metadata)
+        setmgr_set_sizes_metadata(handle->mgr, names, num_sets, sizes, results);
+    else
+        setmgr_set_sizes(handle->mgr, names, num_sets, sizes, results);
+
+    // Respond with a line per set, between START and END
+    char **output_bufs = malloc((num_sets + 2) * sizeof(char*));
+    int *output_bufs_len = malloc((num_sets + 2) * sizeof(int));
+    output_bufs[0] = (char*)&START_RESP;
+    output_bufs_len[0] = START_RESP_LEN;
+    for (int i=0; i < num_sets; i++) {
+        int len;
+        if (results[i] < 0)
+            len = asprintf(output_bufs + i + 1, "%s %s", names[i], SET_NOT_EXIST);
+        else
+            len = asprintf(output_bufs + i + 1, "%s %llu%s\n", names[i], (unsigned long long)sizes[i],
+                    (results[i]) ? " stale" : "");
+        assert(len != -1);
+        output_bufs_len[i + 1] = len;
+    }
+    output_bufs[num_sets + 1] = (char*)&END_RESP;
+    output_bufs_len[num_sets + 1] = END_RESP_LEN;
+    flush_done_sets(handle);
+    send_handler_response(handle, output_bufs, output_bufs_len, num_sets + 2);
+
+    for (int i=1; i <= num_sets; i++) free(output_bufs[i]);
+    free(output_bufs);
+    free(output_bufs_len);
+    free(sizes);
+    free(results);
+    free(names);
+}
+
+/**
+ * Internal command used to estimate the size of the union
+ * or intersection of sets, without modifying them.
+ */
+static void handle_size_multi_cmd(hlld_conn_handler *handle, char *args, int args_len, int intersect) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        return;
+    }
+
+    // Split the set names, there is at most one per two bytes
+    char **names = malloc((args_len / 2 + 1) * sizeof(char*));
+    char *name = args, *next;
+    int next_len, num_sets = 0;
+    while (name && *name != '\0') {
+        buffer_after_terminator(args, args_len, ' ', &next, &next_len);
+        names[num_sets++] = name;
+        name = args = next;
+        args_len = next_len;
+    }
+
+    // Intersections need at least two sets
+    int res;
+    uint64_t est = 0;
+    if (num_sets < 1 + intersect) {
+        free(names);
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        return;
+    } else if (intersect) {
+        res = setmgr_size_intersect(handle->mgr, names, num_sets, &est);
+    } else {
+        res = size_union_members(handle, names, num_sets, &est);
+    }
+    free(names);
+
+    switch (res) {
+        case 0: {
+            char *output;
+            int len = asprintf(&output, "%llu\n", (unsigned long long)est);
+            assert(len != -1);
+            handle_client_resp(handle, output, len);
+            free(output);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            break;
+        case -2:
+            handle_client_err(handle, (char*)&PRECISION_MISMATCH, PRECISION_MISMATCH_LEN);
+            break;
+        case -4:
+            handle_client_err(handle, (char*)&TOO_MANY_SETS, TOO_MANY_SETS_LEN);
+            break;
+        case -5:
+            handle_client_err(handle, (char*)&REMOTE_UNAVAILABLE, REMOTE_UNAVAILABLE_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+/**
+ * Internal command used to estimate the Jaccard similarity
+ * of sets from the smallest hashes they keep.
+ */
+static void handle_jaccard_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        return;
+    }
+
+    // Split the set names, there is at most one per two bytes
+    char **names = malloc((args_len / 2 + 1) * sizeof(char*));
+    char *name = args, *next;
+    int next_len, num_sets = 0;
+    while (name && *name != '\0') {
+        buffer_after_terminator(args, args_len, ' ', &next, &next_len);
+        names[num_sets++] = name;
+        name = args = next;
+        args_len = next_len;
+    }
+    if (num_sets < 2) {
+        free(names);
+        handle_client_err(handle, (char*)&SETS_NEEDED, SETS_NEEDED_LEN);
+        return;
+    }
+
+    double jaccard = 0;
+    int res = setmgr_jaccard(handle->mgr, names, num_sets, &jaccard);
+    free(names);
+
+    switch (res) {
+        case 0: {
+            char *output;
+            int len = asprintf(&output, "%f\n", jaccard);
+            assert(len != -1);
+            handle_client_resp(handle, output, len);
+            free(output);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            break;
+        case -2:
+            handle_client_err(handle, (char*)&PRECISION_MISMATCH, PRECISION_MISMATCH_LEN);
+            break;
+        case -5:
+            handle_client_err(handle, (char*)&NO_KMV, NO_KMV_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
 
-    // List all the sets
-    hlld_set_list_head *head;
-    int res = setmgr_list_sets(handle->mgr, args, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
+/**
+ * Internal command used to choose how the sets of this
+ * connection are acknowledged. With "count", successful
+ * sets are not acknowledged one by one, but counted by
+ * a "Done <count>" response at the end of each batch of
+ * input, or before any other response.
+ */
+static void handle_replies_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    int *flags = client_handler_flags(handle->conn);
+    if (args && !strcmp(args, "count")) {
+        *flags |= COUNT_REPLIES;
+    } else if (args && !strcmp(args, "all")) {
+        *flags &= ~COUNT_REPLIES;
+    } else {
+        handle_client_err(handle, (char*)&REPLIES_MODE_NEEDED, REPLIES_MODE_NEEDED_LEN);
         return;
     }
+    handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+}
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
-
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
 
-    // Generate the responses
-    char *resp;
-    hlld_set_list *node = head->head;
-    set_cb_data cb_data = {handle->mgr, &resp};
-    for (int i=0; i < head->size; i++) {
-        res = setmgr_set_cb(handle->mgr, node->set_name, list_set_cb, &cb_data);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
-        }
-        node = node->next;
+/*
+ * The sets that spent the most time flushing, most first,
+ * and the residency of all the sets
+ */
+typedef struct {
+    int num;
+    hlld_set_stats sets[STATS_TOP_SETS];
+    uint64_t resident_bytes;
+    uint64_t page_faults;
+} top_flush_sets;
+
+// Keeps a set if it is among the most expensive to flush
+static void top_flush_cb(void *data, hlld_set_stats *stats) {
+    top_flush_sets *top = data;
+    top->resident_bytes += stats->resident_bytes;
+    top->page_faults += stats->counters.page_faults;
+    uint64_t nanos = stats->counters.flush_nanos;
+    if (!nanos) return;
+    if (top->num == STATS_TOP_SETS) {
+        if (top->sets[STATS_TOP_SETS - 1].counters.flush_nanos >= nanos) return;
+        free(top->sets[--top->num].set_name);
     }
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
-
-    // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
-    setmgr_cleanup_list(head);
+    // Shift the cheaper sets down to make room
+    int i = top->num++;
+    for (; i > 0 && top->sets[i - 1].counters.flush_nanos < nanos; i--)
+        top->sets[i] = top->sets[i - 1];
+    top->sets[i] = *stats;
+    top->sets[i].set_name = strdup(stats->set_name);
 }
 
-
-// Callback invoked by list command to create an output
-// line for each set. We hold a set handle which we
-// can use to get some info about it
-static void info_set_cb(void *data, char *set_name, hlld_set *set) {
-    (void)set_name;
-    set_cb_data *cb_data = data;
-
-    // Use the last flush size, attempt to get the latest size.
-    // We do this in-case a list is at the same time as a unmap/delete.
-    uint64_t size = set->set_config.size;
-    setmgr_set_size(cb_data->mgr, set_name, &size);
-
-    // Get some metrics
-    set_counters *counters = hset_counters(set);
-    uint64_t storage = hset_byte_size(set);
-    uint64_t sets = counters->sets;
-
-    // Generate a formatted string output
-    int res;
-    res = asprintf(cb_data->output, "in_memory %d\n\
-page_ins %llu\n\
-page_outs %llu\n\
-epsilon %f\n\
-precision %u\n\
-sets %llu\n\
-size %llu\n\
-storage %llu\n",
-    ((hset_is_proxied(set)) ? 0 : 1),
-    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
-    set->set_config.default_eps,
-    set->set_config.default_precision,
-    (unsigned long long)sets,
-    (unsigned long long)size,
-    (unsigned long long)storage);
-    assert(res != -1);
+/**
+ * Formats a line of the stats for each percentile of a histogram
+ * @return The length of the output, or -1 on error.
+ */
+static int format_latency_stats(char **output, const char *name, latency_histogram *h) {
+    return asprintf(output, "%s_count %llu\n\
+%s_p50_ns %llu\n\
+%s_p99_ns %llu\n\
+%s_p999_ns %llu\n",
+        name, (unsigned long long)h->count,
+        name, (unsigned long long)metrics_percentile(h, 0.5),
+        name, (unsigned long long)metrics_percentile(h, 0.99),
+        name, (unsigned long long)metrics_percentile(h, 0.999));
 }
 
-static void handle_info_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    // If we have no args, complain.
-    if (!args) {
-        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+/**
+ * Internal command used to return the metrics of the
+ * server, rather than of a set. The slots of the workers
+ * are merged, and each command that was used gets its
+ * count and latency percentiles, as does the work of
+ * the background threads. The sets that spent the most
+ * time flushing are taken from the last snapshot of
+ * the set stats, rather than by visiting the sets.
+ */
+static void handle_stats_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
         return;
     }
 
-    // Scan past the set name
-    char *key;
-    int key_len;
-    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (after == 0) {
-        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+    worker_metrics *m = malloc(sizeof(worker_metrics));
+    background_metrics *bg = malloc(sizeof(background_metrics));
+    top_flush_sets *top = malloc(sizeof(top_flush_sets));
+    hot_set_entry *hot = malloc(NUM_HOT_KINDS * STATS_TOP_SETS * sizeof(hot_set_entry));
+    if (!m || !bg || !top || !hot) {
+        free(m);
+        free(bg);
+        free(top);
+        free(hot);
+        INTERNAL_ERROR();
         return;
     }
+    metrics_snapshot(handle->metrics, m);
+    metrics_background_snapshot(handle->metrics, bg);
+    spinlock_counters spin;
+    spinlock_stats(&spin);
+    top->num = 0;
+    top->resident_bytes = 0;
+    top->page_faults = 0;
+    setmgr_iter_set_stats(handle->mgr, top_flush_cb, top);
+    int num_hot[NUM_HOT_KINDS];
+    for (int k=0; k < NUM_HOT_KINDS; k++) {
+        num_hot[k] = metrics_hot_sets(handle->metrics, k, hot + k * STATS_TOP_SETS, STATS_TOP_SETS);
+        if (num_hot[k] < 0) num_hot[k] = 0;
+    }
 
-    // Create output buffers
-    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
-    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    // Create output buffers, with lines per command, per
+    // background work, per expensive set and per hot set
+    char *output[NUM_CMD_TYPES + NUM_BACKGROUND_OPS + (1 + NUM_HOT_KINDS) * STATS_TOP_SETS + 5];
+    int lens[NUM_CMD_TYPES + NUM_BACKGROUND_OPS + (1 + NUM_HOT_KINDS) * STATS_TOP_SETS + 5];
+    int num = 0;
+    output[num] = (char*)&START_RESP;
+    lens[num++] = START_RESP_LEN;
+
+    int res = asprintf(&output[num], "connections %llu\n\
+connections_total %llu\n\
+bytes_in %llu\n\
+bytes_out %llu\n\
+output_buffer_bytes %llu\n\
+throttled_conns %llu\n\
+yielded_turns %llu\n\
+rate_limited %llu\n\
+migrated_conns %llu\n\
+busy_ns %llu\n\
+exec_batches %llu\n\
+coalesced_batches %llu\n\
+spin_contended %llu\n\
+spin_yields %llu\n\
+spin_parks %llu\n",
+        (unsigned long long)(m->conns_opened - m->conns_closed),
+        (unsigned long long)m->conns_opened,
+        (unsigned long long)m->bytes_in,
+        (unsigned long long)m->bytes_out,
+        (unsigned long long)output_buffer_bytes(),
+        (unsigned long long)throttled_connections(),
+        (unsigned long long)m->turns_yielded,
+        (unsigned long long)m->rate_limited,
+        (unsigned long long)m->conns_migrated,
+        (unsigned long long)m->busy_ns,
+        (unsigned long long)m->exec_batches,
+        (unsigned long long)m->batches_coalesced,
+        (unsigned long long)spin.contended,
+        (unsigned long long)spin.yields,
+        (unsigned long long)spin.parks);
+    assert(res != -1);
+    lens[num++] = res;
+
+    for (int i=0; i < NUM_CMD_TYPES; i++) {
+        latency_histogram *h = m->cmds + i;
+        if (!h->count) continue;
+        res = format_latency_stats(&output[num], CMD_TYPE_NAMES[i], h);
+        assert(res != -1);
+        lens[num++] = res;
+    }
 
-    // Invoke the callback to get the set stats
-    set_cb_data cb_data = {handle->mgr, &output[1]};
-    int res = setmgr_set_cb(handle->mgr, args, info_set_cb, &cb_data);
+    res = asprintf(&output[num], "flush_bytes %llu\nflush_clean_pages %llu\n",
+        (unsigned long long)bg->flush_bytes,
+        (unsigned long long)bg->flush_clean_pages);
+    assert(res != -1);
+    lens[num++] = res;
+    for (int i=0; i < NUM_BACKGROUND_OPS; i++) {
+        if (!bg->ops[i].count) continue;
+        res = format_latency_stats(&output[num], BACKGROUND_OP_NAMES[i], bg->ops + i);
+        assert(res != -1);
+        lens[num++] = res;
+    }
 
-    // Check for no set
-    if (res != 0) {
-        switch (res) {
-            case -1:
-                handle_client_resp(handle->conn, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
-                break;
-            default:
-                INTERNAL_ERROR();
-                break;
-        }
-        return;
+    // As of the last residency sample of each set, and the
+    // totals of the allocator as of now
+    alloc_counters alloc;
+    alloc_stats(&alloc);
+    res = asprintf(&output[num], "resident_bytes %llu\n\
+page_faults %llu\n\
+allocator %s\n\
+alloc_allocated_bytes %llu\n\
+alloc_mapped_bytes %llu\n\
+rss_bytes %llu\n",
+        (unsigned long long)top->resident_bytes,
+        (unsigned long long)top->page_faults,
+        alloc_name(),
+        (unsigned long long)alloc.allocated,
+        (unsigned long long)alloc.mapped,
+        (unsigned long long)alloc.rss);
+    assert(res != -1);
+    lens[num++] = res;
+
+    for (int i=0; i < top->num; i++) {
+        set_counters *c = &top->sets[i].counters;
+        res = asprintf(&output[num], "flush_top_%d %s\n\
+flush_top_%d_ns %llu\n\
+flush_top_%d_max_ns %llu\n\
+flush_top_%d_count %llu\n\
+flush_top_%d_bytes %llu\n\
+flush_top_%d_clean_pages %llu\n",
+            i + 1, top->sets[i].set_name,
+            i + 1, (unsigned long long)c->flush_nanos,
+            i + 1, (unsigned long long)c->flush_max_nanos,
+            i + 1, (unsigned long long)c->flushes,
+            i + 1, (unsigned long long)c->flush_bytes,
+            i + 1, (unsigned long long)c->flush_clean_pages);
+        assert(res != -1);
+        lens[num++] = res;
+        free(top->sets[i].set_name);
     }
 
-    // Adjust the buffer size
-    lens[1] = strlen(output[1]);
+    // The sets sent the most commands and keys, as sampled
+    static const char *HOT_KIND_NAMES[] = {"cmds", "keys"};
+    for (int k=0; k < NUM_HOT_KINDS; k++) {
+        for (int i=0; i < num_hot[k]; i++) {
+            hot_set_entry *e = hot + k * STATS_TOP_SETS + i;
+            res = asprintf(&output[num], "hot_%s_top_%d %s\nhot_%s_top_%d_count %llu\n",
+                HOT_KIND_NAMES[k], i + 1, e->set_name,
+                HOT_KIND_NAMES[k], i + 1, (unsigned long long)e->count);
+            assert(res != -1);
+            lens[num++] = res;
+        }
+    }
+    output[num] = (char*)&END_RESP;
+    lens[num++] = END_RESP_LEN;
 
     // Write out the bufs
-    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
-    free(output[1]);
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, num);
+    for (int i=1; i < num - 1; i++) free(output[i]);
+    free(m);
+    free(bg);
+    free(top);
+    free(hot);
 }
 
 
-static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    // If we have a specfic set, use filt_cmd
-    if (args) {
-        handle_setop_cmd(handle, args, args_len, setmgr_flush_set);
+/**
+ * Internal command used to list the slow log, newest first,
+ * or clear it with "reset". Each line is the id, the unix
+ * time, the command, the set or "-", the number of keys,
+ * and the nanoseconds spent in total, looking up sets,
+ * paging them in, and waiting on their locks.
+ */
+static void handle_slowlog_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args && !strcmp(args, "reset")) {
+        slowlog_reset(handle->slowlog);
+        handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+        return;
+    } else if (args) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
         return;
     }
 
-    // List all the sets
-    hlld_set_list_head *head;
-    int res = setmgr_list_sets(handle->mgr, NULL, &head);
-    if (res != 0) {
+    slowlog_entry *entries;
+    int num_entries = slowlog_entries(handle->slowlog, &entries);
+    if (num_entries < 0) {
         INTERNAL_ERROR();
         return;
     }
 
-    // Flush all, ignore errors since
-    // sets might get deleted in the process
-    hlld_set_list *node = head->head;
-    while (node) {
-        setmgr_flush_set(handle->mgr, node->set_name);
-        node = node->next;
+    // Create output buffers, with a line per entry
+    char **output = malloc((num_entries + 2) * sizeof(char*));
+    int *lens = malloc((num_entries + 2) * sizeof(int));
+    if (!output || !lens) {
+        free(output);
+        free(lens);
+        free(entries);
+        INTERNAL_ERROR();
+        return;
     }
+    int num = 0;
+    output[num] = (char*)&START_RESP;
+    lens[num++] = START_RESP_LEN;
+
+    for (int i=0; i < num_entries; i++) {
+        slowlog_entry *e = entries + i;
+        int res = asprintf(&output[num], "%llu %llu %s %s %d %llu %llu %llu %llu\n",
+            (unsigned long long)e->id,
+            (unsigned long long)e->time,
+            handler_cmd_name(e->cmd),
+            (e->set_name[0]) ? e->set_name : "-",
+            e->keys,
+            (unsigned long long)e->nanos,
+            (unsigned long long)e->phases[PHASE_LOOKUP],
+            (unsigned long long)e->phases[PHASE_FAULT],
+            (unsigned long long)e->phases[PHASE_LOCK]);
+        assert(res != -1);
+        lens[num++] = res;
+    }
+    output[num] = (char*)&END_RESP;
+    lens[num++] = END_RESP_LEN;
 
-    // Respond
-    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
-
-    // Cleanup
-    setmgr_cleanup_list(head);
+    // Write out the bufs
+    send_client_response(handle->conn, output, lens, num);
+    for (int i=1; i < num - 1; i++) free(output[i]);
+    free(output);
+    free(lens);
+    free(entries);
 }
 
 
@@ -553,13 +3250,16 @@ static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len
 static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res) {
     switch (res) {
         case 0:
-            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -1:
-            handle_client_resp(handle->conn, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
             break;
         case -2:
-            handle_client_resp(handle->conn, (char*)SET_NOT_PROXIED, SET_NOT_PROXIED_LEN);
+            handle_client_resp(handle, (char*)SET_NOT_PROXIED, SET_NOT_PROXIED_LEN);
+            break;
+        case -3:
+            handle_client_err(handle, (char*)&HASH_MODE_MISMATCH, HASH_MODE_MISMATCH_LEN);
             break;
         default:
             INTERNAL_ERROR();
@@ -568,14 +3268,46 @@ static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res) {
 }
 
 
+/**
+ * Responds to a command that set keys. When the client only
+ * wants counts, success is counted rather than acknowledged.
+ */
+static void handle_set_keys_resp(hlld_conn_handler *handle, int res) {
+    int flags = (handle->exec) ? handle->exec->flags :
+        (handle->conn) ? *client_handler_flags(handle->conn) : 0;
+    if (!res && (flags & COUNT_REPLIES)) {
+        handle->done_sets++;
+        return;
+    }
+    handle_set_cmd_resp(handle, res);
+}
+
+
+/**
+ * Acknowledges the counted sets with a single "Done <count>"
+ * response. This precedes any other response, so the client
+ * knows which of its commands are covered.
+ */
+static void flush_done_sets(hlld_conn_handler *handle) {
+    if (!handle->done_sets) return;
+    char resp[32];
+    int len = snprintf(resp, sizeof(resp), "Done %llu\n", (unsigned long long)handle->done_sets);
+    handle->done_sets = 0;
+    char *buffers[] = {resp};
+    int sizes[] = {len};
+    send_handler_response(handle, (char**)&buffers, (int*)&sizes, 1);
+}
+
+
 /**
  * Sends a client response message back. Simple convenience wrapper
  * around send_client_resp.
  */
-static inline void handle_client_resp(hlld_conn_info *conn, char* resp_mesg, int resp_len) {
+static inline void handle_client_resp(hlld_conn_handler *handle, char* resp_mesg, int resp_len) {
     char *buffers[] = {resp_mesg};
     int sizes[] = {resp_len};
-    send_client_response(conn, (char**)&buffers, (int*)&sizes, 1);
+    flush_done_sets(handle);
+    send_handler_response(handle, (char**)&buffers, (int*)&sizes, 1);
 }
 
 
@@ -584,10 +3316,23 @@ static inline void handle_client_resp(hlld_conn_info *conn, char* resp_mesg, int
  * output buffers so we can collapse this into a single write without
  * needing to move our buffers around.
  */
-static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len) {
+static void handle_client_err(hlld_conn_handler *handle, char* err_msg, int msg_len) {
     char *buffers[] = {(char*)&CLIENT_ERR, err_msg, (char*)&NEW_LINE};
     int sizes[] = {CLIENT_ERR_LEN, msg_len, NEW_LINE_LEN};
-    send_client_response(conn, (char**)&buffers, (int*)&sizes, 3);
+    flush_done_sets(handle);
+    send_handler_response(handle, (char**)&buffers, (int*)&sizes, 3);
+}
+
+
+/**
+ * Sends a response to the connection, or gathers it
+ * on an execution thread
+ */
+static void send_handler_response(hlld_conn_handler *handle, char **buffers, int *sizes, int num) {
+    if (handle->exec)
+        exec_output_append(handle->exec, buffers, sizes, num);
+    else
+        send_client_response(handle->conn, buffers, sizes, num);
 }
 
 
@@ -612,50 +3357,49 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
     // at the space, so we can compare the cmd_buf to the commands.
     buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len);
 
-    // Search for the command
-    conn_cmd_type type = UNKNOWN;
-    #define CMD_MATCH(name) (strcmp(name, cmd_buf) == 0)
-    switch (*cmd_buf) {
-        case 'b':
-            if (CMD_MATCH("b") || CMD_MATCH("bulk"))
-                type = SET_MULTI;
-            break;
-
-        case 'c':
-            if (CMD_MATCH("create")) {
-                type = CREATE;
-            } else if (CMD_MATCH("close")) {
-                type = CLOSE;
-            } else if (CMD_MATCH("clear")) {
-                type = CLEAR;
-            }
-            break;
-
-        case 'd':
-            if (CMD_MATCH("drop"))
-                type = DROP;
-            break;
-
-        case 'f':
-            if (CMD_MATCH("flush"))
-                type = FLUSH;
-            break;
-
-        case 'i':
-            if (CMD_MATCH("info"))
-                type = INFO;
+    // Only compare the commands of the same length
+    int len = (*arg_buf) ? *arg_buf - cmd_buf - 1 : (int)strnlen(cmd_buf, buf_len);
+    if (len <= 0 || len > MAX_CLIENT_CMD_LEN) return UNKNOWN;
+    for (int i=CLIENT_CMD_START[len]; i < CLIENT_CMD_START[len+1]; i++) {
+        const client_command *cmd = CLIENT_COMMANDS + i;
+        if (cmd->name[0] == *cmd_buf && !memcmp(cmd->name, cmd_buf, len))
+            return cmd->type;
+    }
+    return UNKNOWN;
+}
 
-        case 'l':
-            if (CMD_MATCH("list"))
-                type = LIST;
-            break;
 
-        case 's':
-            if (CMD_MATCH("s") || CMD_MATCH("set"))
-                type = SET;
+/**
+ * Splits space separated keys in a single pass, null
+ * terminating each and recording its length. The keys
+ * end at a null terminator.
+ * @arg buf The keys to split
+ * @arg buf_len The length of the keys
+ * @arg keys Output. The start of each key.
+ * @arg lens Output. The length of each key.
+ * @arg max_keys The most keys to split
+ * @arg rest Output. Set to the keys that remain, or NULL.
+ * @arg rest_len Output. Set to the length of the rest.
+ * @return The number of keys split.
+ */
+static int split_keys(char *buf, int buf_len, char **keys, int *lens, int max_keys, char **rest, int *rest_len) {
+    char *end = buf + buf_len;
+    int num = 0;
+    while (num < max_keys && buf < end && *buf) {
+        char *term_addr = memchr(buf, ' ', end - buf);
+        keys[num] = buf;
+        if (!term_addr) {
+            lens[num++] = strnlen(buf, end - buf);
+            buf = end;
             break;
+        }
+        *term_addr = '\0';
+        lens[num++] = term_addr - buf;
+        buf = term_addr + 1;
     }
-    return type;
+    *rest = (buf < end && *buf) ? buf : NULL;
+    *rest_len = end - buf;
+    return num;
 }
 
 
@@ -687,3 +3431,251 @@ static int buffer_after_terminator(char *buf, int buf_len, char terminator, char
     return 0;
 }
 
+/**
+ * Checks that a set may be created with a name. Names that
+ * are handles are refused, since they name the bound set.
+ * @return 1 if the name is valid
+ */
+static int valid_set_name(char *set_name) {
+    if (regexec(&VALID_SET_NAMES_RE, set_name, 0, NULL, 0) != 0) return 0;
+    return setmgr_handle_id(set_name, strlen(set_name)) == -1;
+}
+
+
+/**
+ * Requests a snapshot of every set. The snapshot is written
+ * in the background, to sets.snapshot in the data directory.
+ */
+static void handle_snapshot_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+    switch (setmgr_request_snapshot(handle->mgr)) {
+        case 0:
+            handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle, (char*)SNAPSHOT_IN_PROGRESS, SNAPSHOT_IN_PROGRESS_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+/**
+ * Binds a handle to a set, and replies with the handle,
+ * which commands then take in place of the set name
+ */
+static void handle_bind_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the set name
+    char *rest;
+    int rest_len;
+    if (buffer_after_terminator(args, args_len, ' ', &rest, &rest_len) == 0) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    int id;
+    switch (setmgr_bind_set(handle->mgr, args, &id)) {
+        case 0: {
+            char output[16];
+            int len = snprintf(output, sizeof(output), "%c%d\n", SET_HANDLE_PREFIX, id);
+            handle_client_resp(handle, output, len);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            break;
+        default:
+            handle_client_err(handle, (char*)&TOO_MANY_HANDLES, TOO_MANY_HANDLES_LEN);
+            break;
+    }
+}
+
+/**
+ * Finds the watch of a set by a connection
+ * @return The link to the watch, or to the end of the list
+ */
+static set_watch** find_watch(client_state *state, char *set_name) {
+    set_watch **w = &state->watches;
+    while (*w && strcmp((*w)->set_name, set_name)) w = &(*w)->next;
+    return w;
+}
+
+/**
+ * Checks if an estimate moved past the threshold
+ * of a watch, since it was last reported
+ */
+static int watch_moved(set_watch *w, uint64_t est) {
+    uint64_t diff = (est > w->last) ? est - w->last : w->last - est;
+    if (w->delta && diff > w->delta) return 1;
+    return w->pct > 0 && diff && diff * 100. > w->pct * w->last;
+}
+
+/**
+ * Watches a set, so that its estimate is pushed once it moves
+ * by more than an absolute delta, or a percentage. Replies with
+ * the estimate the changes are measured from.
+ */
+static void handle_watch_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Parse the threshold after the set name
+    char *option, *end;
+    int option_len;
+    uint64_t delta = 0;
+    double pct = 0;
+    if (buffer_after_terminator(args, args_len, ' ', &option, &option_len) ||
+            memchr(option, ' ', option_len)) {
+        handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    if (!strncmp(option, "delta=", 6) && option[6] >= '0' && option[6] <= '9') {
+        delta = strtoull(option + 6, &end, 10);
+        if (*end || !delta) option = NULL;
+    } else if (!strncmp(option, "pct=", 4) && option[4]) {
+        pct = strtod(option + 4, &end);
+        if (*end || !(pct > 0 && pct < 1e9)) option = NULL;
+    } else {
+        option = NULL;
+    }
+    if (!option) {
+        handle_client_err(handle, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    uint64_t est;
+    if (setmgr_set_size(handle->mgr, args, &est)) {
+        handle_client_resp(handle, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+        return;
+    }
+
+    // Watching a set again replaces its threshold
+    client_state **state = (client_state**)client_handler_state(handle->conn);
+    if (!*state) *state = calloc(1, sizeof(client_state));
+    set_watch **link = find_watch(*state, args);
+    set_watch *w = *link;
+    if (!w) {
+        if ((*state)->num_watches >= MAX_CONN_WATCHES) {
+            handle_client_err(handle, (char*)&TOO_MANY_WATCHES, TOO_MANY_WATCHES_LEN);
+            return;
+        }
+        w = malloc(sizeof(set_watch));
+        w->set_name = strdup(args);
+        w->next = NULL;
+        *link = w;
+        if (!(*state)->num_watches++)
+            watch_client_connection(handle->conn, WATCH_INTERVAL);
+    }
+    w->delta = delta;
+    w->pct = pct;
+    w->last = est;
+
+    char output[24];
+    int len = snprintf(output, sizeof(output), "%llu\n", (unsigned long long)est);
+    handle_client_resp(handle, output, len);
+}
+
+/**
+ * Removes a watch of a connection
+ */
+static void remove_watch(hlld_conn_handler *handle, client_state *state, set_watch **link) {
+    set_watch *w = *link;
+    *link = w->next;
+    free(w->set_name);
+    free(w);
+    if (!--state->num_watches) watch_client_connection(handle->conn, 0);
+}
+
+/**
+ * Stops watching a set
+ */
+static void handle_unwatch_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the set name
+    char *rest;
+    int rest_len;
+    if (buffer_after_terminator(args, args_len, ' ', &rest, &rest_len) == 0) {
+        handle_client_err(handle, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    client_state *state = *client_handler_state(handle->conn);
+    set_watch **link = (state) ? find_watch(state, args) : NULL;
+    if (!link || !*link) {
+        handle_client_resp(handle, (char*)NOT_WATCHED, NOT_WATCHED_LEN);
+        return;
+    }
+    remove_watch(handle, state, link);
+    handle_client_resp(handle, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+/**
+ * Pushes the estimates of the watched sets that moved past
+ * their thresholds, as "Watch <set> <estimate>". The cached
+ * estimates are read, so sets that were not written to are
+ * not estimated again. Dropped sets are pushed as
+ * "Watch <set> dropped", and are no longer watched.
+ */
+void handle_client_watch(hlld_conn_handler *handle) {
+    client_state *state = *client_handler_state(handle->conn);
+    if (!state) return;
+
+    char output[24];
+    char *buffers[] = {(char*)&WATCH_PUSH, NULL, output};
+    int sizes[] = {WATCH_PUSH_LEN, 0, 0};
+    set_watch **link = &state->watches;
+    while (*link) {
+        set_watch *w = *link;
+        uint64_t est;
+        int dropped = setmgr_set_size(handle->mgr, w->set_name, &est);
+        if (!dropped && !watch_moved(w, est)) {
+            link = &w->next;
+            continue;
+        }
+
+        buffers[1] = w->set_name;
+        sizes[1] = strlen(w->set_name);
+        if (dropped) {
+            sizes[2] = snprintf(output, sizeof(output), " dropped\n");
+        } else {
+            sizes[2] = snprintf(output, sizeof(output), " %llu\n", (unsigned long long)est);
+            w->last = est;
+        }
+        send_client_response(handle->conn, (char**)&buffers, (int*)&sizes, 3);
+        if (dropped)
+            remove_watch(handle, state, link);
+        else
+            link = &w->next;
+    }
+}
+
+void close_client_handler(void *state) {
+    client_state *s = state;
+    set_watch *w = s->watches, *next;
+    while (w) {
+        next = w->next;
+        free(w->set_name);
+        free(w);
+        w = next;
+    }
+    free(s);
+}
@@ -3,6 +3,10 @@
 #include "config.h"
 #include "networking.h"
 #include "set_manager.h"
+#include "metrics.h"
+#include "slowlog.h"
+#include "cluster.h"
+#include "remote.h"
 
 /**
  * This structure is used to communicate
@@ -13,6 +17,13 @@ typedef struct {
     hlld_config *config;     // Global configuration
     hlld_setmgr *mgr;       // Set manager
     hlld_conn_info *conn;    // Opaque handle into the networking stack
+    uint64_t done_sets;      // Sets not yet acknowledged, when counting replies
+    hlld_metrics *metrics;   // Server metrics
+    worker_metrics *worker;  // Metrics slot of this thread
+    hlld_slowlog *slowlog;   // Slow command log
+    hlld_cluster *cluster;   // Hash ring of the cluster, or NULL
+    hlld_remote *remote;     // Sets fetched from other servers
+    hlld_exec_output *exec;  // Gathers the responses on an execution thread, or NULL
 } hlld_conn_handler;
 
 /**
@@ -30,6 +41,39 @@ void init_conn_handler();
  */
 int handle_client_connect(hlld_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer with a datagram, which
+ * has one command per line and a null terminator after its
+ * length. Only the commands that set keys are handled, and
+ * no responses are sent. Proxied sets are paged in on this
+ * thread, since there is no connection to park.
+ * @arg handle The connection related information, without a connection
+ * @arg buf The datagram
+ * @arg buf_len The length of the datagram
+ */
+void handle_udp_message(hlld_conn_handler *handle, char *buf, int buf_len);
+
+/**
+ * Invoked on an execution thread with a batch of writes of
+ * a connection, as gathered by handle_client_connect. The
+ * responses are gathered in handle->exec, without a connection.
+ * @arg handle The connection related information
+ * @arg cmds The batch
+ * @arg cmds_len The length of the batch
+ */
+void handle_exec_batch(hlld_conn_handler *handle, char *cmds, int cmds_len);
+
+/**
+ * Invoked with batches of writes of many connections, like
+ * handle_exec_batch. The writes of the batches of each set
+ * are applied together, with one write of the set for all
+ * their keys, and then each batch gathers its responses.
+ * @arg handle The connection related information
+ * @arg batches The batches
+ * @arg num The number of batches
+ */
+void handle_exec_batches(hlld_conn_handler *handle, hlld_exec_batch **batches, int num);
+
 /**
  * Invoked by the networking layer periodically to
  * handle state updates. Does not provide
@@ -39,4 +83,26 @@ int handle_client_connect(hlld_conn_handler *handle);
  */
 void periodic_update(hlld_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer on the watch timer of a
+ * connection, as started by watch_client_connection. The
+ * watched sets that moved past their thresholds are pushed.
+ * @arg handle The connection related information
+ */
+void handle_client_watch(hlld_conn_handler *handle);
+
+/**
+ * Invoked by the networking layer when a connection closes,
+ * to release the state the handlers keep for it.
+ * @arg state The state, as kept with client_handler_state
+ */
+void close_client_handler(void *state);
+
+/**
+ * Returns the name of a command type in the metrics
+ * @arg cmd The command type
+ * @return The name, or NULL past the last type.
+ */
+const char* handler_cmd_name(int cmd);
+
 #endif
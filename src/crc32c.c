@@ -0,0 +1,137 @@
+/*
+ * CRC32C over the reflected Castagnoli polynomial.
+ *
+ * The hardware kernels fold in 8 bytes per instruction, which
+ * checks a register file in a few microseconds. The table is
+ * only built if the CPU lacks the instructions.
+ *
+ * The kernel is selected at runtime based on the CPU features.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+typedef uint32_t(*crc32c_func)(uint32_t crc, const unsigned char *buf, size_t len);
+
+/*
+ * The table for the software kernel, one entry per byte
+ */
+static uint32_t CRC32C_TABLE[256];
+
+static void build_table() {
+    for (uint32_t i=0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j=0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        CRC32C_TABLE[i] = crc;
+    }
+}
+
+/**
+ * The portable kernel, a byte at a time
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len--)
+        crc = CRC32C_TABLE[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/**
+ * The SSE4.2 kernel, 8 bytes per crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+/**
+ * The ARMv8 kernel, 8 bytes per crc32cx instruction
+ */
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *buf, size_t len) {
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    while (len--)
+        crc = __crc32cb(crc, *buf++);
+    return crc;
+}
+#endif
+
+/*
+ * Selects the best kernel for the running CPU
+ */
+static crc32c_func select_kernel(const char **name) {
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return crc32c_sse42;
+    }
+#elif defined(CRC32C_ARM)
+    *name = "armv8";
+    return crc32c_armv8;
+#endif
+    build_table();
+    *name = "table";
+    return crc32c_table;
+}
+
+/*
+ * The selected kernel. Selection is idempotent, so
+ * racing threads will all store the same values.
+ */
+static crc32c_func KERNEL = NULL;
+static const char *KERNEL_NAME = NULL;
+
+static inline void select_kernels() {
+    if (!KERNEL) {
+        crc32c_func kernel = select_kernel(&KERNEL_NAME);
+        __sync_synchronize();
+        KERNEL = kernel;
+    }
+}
+
+/**
+ * Extends a CRC32C over a buffer
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The buffer
+ * @arg len The length of the buffer
+ * @return The CRC of the preceding data and the buffer
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    select_kernels();
+    return ~KERNEL(~crc, buf, len);
+}
+
+/**
+ * Returns the name of the CRC32C kernel selected
+ * for this CPU, e.g. "sse4.2", "armv8" or "table".
+ */
+const char* crc32c_kernel_name() {
+    select_kernels();
+    return KERNEL_NAME;
+}
@@ -0,0 +1,27 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI and ext4. The
+ * SSE4.2 or ARMv8 CRC instructions are used when the
+ * CPU has them, and a table driven version otherwise.
+ */
+
+/**
+ * Extends a CRC32C over a buffer
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The buffer
+ * @arg len The length of the buffer
+ * @return The CRC of the preceding data and the buffer
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Returns the name of the CRC32C kernel selected
+ * for this CPU, e.g. "sse4.2", "armv8" or "table".
+ */
+const char* crc32c_kernel_name();
+
+#endif
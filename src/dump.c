@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hll.h"
+#include "hll_hash.h"
+#include "dump.h"
+
+/*
+ * The offset of the checksum in the header
+ */
+#define CHECKSUM_OFFSET 12
+
+static inline void store_le32(unsigned char *out, uint32_t val) {
+    for (int i=0; i < 4; i++) out[i] = val >> (8 * i);
+}
+
+static inline void store_le64(unsigned char *out, uint64_t val) {
+    for (int i=0; i < 8; i++) out[i] = val >> (8 * i);
+}
+
+static inline uint32_t load_le32(const unsigned char *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static inline uint64_t load_le64(const unsigned char *in) {
+    return load_le32(in) | ((uint64_t)load_le32(in + 4) << 32);
+}
+
+/**
+ * Computes the FNV-1a checksum of a dump, covering
+ * the header around the checksum and the registers
+ */
+static uint32_t dump_checksum(const unsigned char *buf, uint64_t len) {
+    uint32_t hash = 2166136261U;
+    for (uint64_t i=0; i < len; i++) {
+        if (i >= CHECKSUM_OFFSET && i < CHECKSUM_OFFSET + sizeof(uint32_t)) continue;
+        hash = (hash ^ buf[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Encodes the dump of a set
+ * @arg set_config The config of the set
+ * @arg regs The contents of the register file
+ * @arg regs_len The length of the registers
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the dump
+ * @return 0 on success
+ */
+int dump_encode(hlld_set_config *set_config, const unsigned char *regs, uint64_t regs_len,
+        unsigned char **buf, uint64_t *len) {
+    unsigned char *out = malloc(DUMP_HEADER_SIZE + regs_len);
+    if (!out) return -1;
+    store_le32(out, DUMP_MAGIC);
+    out[4] = DUMP_VERSION;
+    out[5] = set_config->default_precision;
+    out[6] = set_config->format;
+    out[7] = set_config->sparse;
+    out[8] = set_config->estimator;
+    out[9] = set_config->hash;
+    out[10] = set_config->in_memory;
+    out[11] = 0;
+    store_le64(out + 16, regs_len);
+    store_le64(out + 24, set_config->size);
+    memcpy(out + DUMP_HEADER_SIZE, regs, regs_len);
+    store_le32(out + CHECKSUM_OFFSET, dump_checksum(out, DUMP_HEADER_SIZE + regs_len));
+
+    *buf = out;
+    *len = DUMP_HEADER_SIZE + regs_len;
+    return 0;
+}
+
+/**
+ * Decodes the dump of a set. Only the header and the
+ * checksum of the registers are checked, the registers
+ * are checked as they are loaded.
+ * @arg buf The dump
+ * @arg len The length of the dump
+ * @arg set_config Output, the config of the set
+ * @arg regs Output, the registers, pointing into the dump
+ * @arg regs_len Output, the length of the registers
+ * @return 0 on success, -1 if the dump is corrupt.
+ */
+int dump_decode(const unsigned char *buf, uint64_t len, hlld_set_config *set_config,
+        const unsigned char **regs, uint64_t *regs_len) {
+    if (len < DUMP_HEADER_SIZE) return -1;
+    int precision = buf[5];
+    uint64_t body_len = load_le64(buf + 16);
+    if (load_le32(buf) != DUMP_MAGIC || buf[4] != DUMP_VERSION ||
+            precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION ||
+            !hll_format_name(buf[6]) || buf[7] > 1 || !hll_estimator_name(buf[8]) ||
+            !hll_hash_name(buf[9]) || buf[10] > 1 || !body_len ||
+            body_len != len - DUMP_HEADER_SIZE ||
+            dump_checksum(buf, len) != load_le32(buf + CHECKSUM_OFFSET))
+        return -1;
+
+    set_config->default_precision = precision;
+    set_config->default_eps = hll_error_for_precision(precision);
+    set_config->format = buf[6];
+    set_config->sparse = buf[7];
+    set_config->estimator = buf[8];
+    set_config->hash = buf[9];
+    set_config->in_memory = buf[10];
+    set_config->size = load_le64(buf + 24);
+    set_config->window = 0;
+    set_config->window_buckets = 0;
+    set_config->sliding = 0;
+    set_config->kmv = 0;
+    set_config->expires = 0;
+    set_config->durability = DURABILITY_PERIODIC;
+    set_config->flush_period = 0;
+    *regs = buf + DUMP_HEADER_SIZE;
+    *regs_len = body_len;
+    return 0;
+}
+
+/**
+ * Encodes the header of a set in a stream of dumps
+ * @arg out Output, DUMP_STREAM_HEADER_SIZE bytes
+ * @arg name_len The length of the set name
+ * @arg dump_len The length of the dump
+ */
+void dump_stream_header(unsigned char *out, uint16_t name_len, uint32_t dump_len) {
+    out[0] = name_len & 0xff;
+    out[1] = name_len >> 8;
+    store_le32(out + 2, dump_len);
+}
+
+/**
+ * Decodes the header of a set in a stream of dumps
+ * @arg in The header, DUMP_STREAM_HEADER_SIZE bytes
+ * @arg name_len Output, the length of the set name
+ * @arg dump_len Output, the length of the dump
+ */
+void dump_stream_decode(const unsigned char *in, uint16_t *name_len, uint32_t *dump_len) {
+    *name_len = in[0] | (in[1] << 8);
+    *dump_len = load_le32(in + 2);
+}
@@ -0,0 +1,79 @@
+#ifndef DUMP_H
+#define DUMP_H
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * A dump holds the registers of a set with its config, so that
+ * the set can be restored on another server. The registers are
+ * the contents of a register file: the dense registers, or the
+ * sparse or cold encodings. A set is restored by writing them
+ * out as its register file, so no conversion is needed.
+ */
+
+/**
+ * The first bytes of each dump, "HDMP"
+ */
+#define DUMP_MAGIC 0x504D4448
+
+/**
+ * The version of the dump header
+ */
+#define DUMP_VERSION 1
+
+/**
+ * The size of a dump header. It is followed
+ * by the registers.
+ */
+#define DUMP_HEADER_SIZE 32
+
+/**
+ * Encodes the dump of a set
+ * @arg set_config The config of the set
+ * @arg regs The contents of the register file
+ * @arg regs_len The length of the registers
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the dump
+ * @return 0 on success
+ */
+int dump_encode(hlld_set_config *set_config, const unsigned char *regs, uint64_t regs_len,
+        unsigned char **buf, uint64_t *len);
+
+/**
+ * Decodes the dump of a set. Only the header and the
+ * checksum of the registers are checked, the registers
+ * are checked as they are loaded.
+ * @arg buf The dump
+ * @arg len The length of the dump
+ * @arg set_config Output, the config of the set
+ * @arg regs Output, the registers, pointing into the dump
+ * @arg regs_len Output, the length of the registers
+ * @return 0 on success, -1 if the dump is corrupt.
+ */
+int dump_decode(const unsigned char *buf, uint64_t len, hlld_set_config *set_config,
+        const unsigned char **regs, uint64_t *regs_len);
+
+/**
+ * The size of the header of each set in a stream of dumps.
+ * A stream holds a dump per set, each after a header of the
+ * u16 name length and the u32 dump length, then the name.
+ */
+#define DUMP_STREAM_HEADER_SIZE 6
+
+/**
+ * Encodes the header of a set in a stream of dumps
+ * @arg out Output, DUMP_STREAM_HEADER_SIZE bytes
+ * @arg name_len The length of the set name
+ * @arg dump_len The length of the dump
+ */
+void dump_stream_header(unsigned char *out, uint16_t name_len, uint32_t dump_len);
+
+/**
+ * Decodes the header of a set in a stream of dumps
+ * @arg in The header, DUMP_STREAM_HEADER_SIZE bytes
+ * @arg name_len Output, the length of the set name
+ * @arg dump_len Output, the length of the dump
+ */
+void dump_stream_decode(const unsigned char *in, uint16_t *name_len, uint32_t *dump_len);
+
+#endif
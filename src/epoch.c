@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "epoch.h"
+
+/**
+ * The epoch of a slot that holds no references,
+ * which never holds back a writer
+ */
+#define IDLE_EPOCH ((uint64_t)-1)
+
+/**
+ * The most threads that may hold a slot at once
+ */
+#define MAX_SLOTS 1024
+
+/**
+ * Each thread claims a slot once, and maintains its thread
+ * ID as well as the last epoch it observed. Slots are a cache
+ * line each, so checkpoints do not contend with each other.
+ */
+typedef struct {
+    volatile int in_use;
+    pthread_t id;
+    volatile uint64_t epoch;
+} __attribute__((aligned(64))) epoch_slot;
+
+struct hlld_epochs {
+    uint64_t id;                // Identifies the epochs to the threads
+    volatile uint64_t epoch;    // The global epoch
+
+    epoch_slot *slots;
+    volatile int num_slots;     // Slots that have ever been claimed
+
+    // Wakes the waiters on checkpoints and notifies
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    volatile int waiting;
+};
+
+/*
+ * Each thread remembers its slot in the
+ * last epochs it used
+ */
+typedef struct {
+    uint64_t epochs_id;
+    epoch_slot *slot;
+} epoch_thread;
+
+static pthread_key_t EPOCH_THREAD_KEY;
+static pthread_once_t EPOCH_THREAD_ONCE = PTHREAD_ONCE_INIT;
+static volatile uint64_t NEXT_EPOCHS_ID = 0;
+
+static epoch_thread* get_epoch_thread(hlld_epochs *epochs);
+static epoch_slot* find_slot(hlld_epochs *epochs);
+
+/**
+ * Initializes the epochs
+ * @arg epochs Output, the epochs
+ * @return 0 on success.
+ */
+int init_epochs(hlld_epochs **epochs) {
+    hlld_epochs *e = calloc(1, sizeof(hlld_epochs));
+    if (!e) return -1;
+    if (posix_memalign((void**)&e->slots, sizeof(epoch_slot),
+                MAX_SLOTS * sizeof(epoch_slot))) {
+        syslog(LOG_ERR, "Failed to allocate epoch slots!");
+        free(e);
+        return -1;
+    }
+    memset(e->slots, 0, MAX_SLOTS * sizeof(epoch_slot));
+    for (int i=0; i < MAX_SLOTS; i++) e->slots[i].epoch = IDLE_EPOCH;
+
+    e->id = __sync_add_and_fetch(&NEXT_EPOCHS_ID, 1);
+    e->epoch = 1;
+    pthread_mutex_init(&e->wait_lock, NULL);
+    pthread_cond_init(&e->wait_cond, NULL);
+    *epochs = e;
+    return 0;
+}
+
+/**
+ * Destroys the epochs. There must be no waiters.
+ * @arg epochs The epochs to destroy
+ * @return 0 on success.
+ */
+int destroy_epochs(hlld_epochs *epochs) {
+    pthread_mutex_destroy(&epochs->wait_lock);
+    pthread_cond_destroy(&epochs->wait_cond);
+    free(epochs->slots);
+    free(epochs);
+    return 0;
+}
+
+/**
+ * Records that the calling thread has observed the current
+ * epoch, and holds no references from older epochs. The
+ * first checkpoint of a thread claims a slot for it.
+ * @arg epochs The epochs
+ */
+void epoch_checkpoint(hlld_epochs *epochs) {
+    // Use our slot if we have one
+    epoch_thread *thread = get_epoch_thread(epochs);
+    epoch_slot *slot = (thread) ? thread->slot : find_slot(epochs);
+    if (slot) {
+        uint64_t epoch = epochs->epoch;
+        if (slot->epoch != epoch) {
+            slot->epoch = epoch;
+            epoch_notify(epochs);
+        }
+        return;
+    }
+
+    // If we make it here, we have no slot yet so we need to
+    // claim a free one. Slots are idle while free, so the
+    // epoch is set before a writer could see us use it.
+    while (1) {
+        for (int i=0; i < MAX_SLOTS; i++) {
+            slot = epochs->slots + i;
+            if (slot->in_use || !__sync_bool_compare_and_swap(&slot->in_use, 0, 1))
+                continue;
+            slot->id = pthread_self();
+            slot->epoch = epochs->epoch;
+            __sync_synchronize();
+
+            // Raise the number of slots that are scanned
+            int num;
+            while ((num = epochs->num_slots) <= i &&
+                    !__sync_bool_compare_and_swap(&epochs->num_slots, num, i + 1));
+
+            if (thread) thread->slot = slot;
+            return;
+        }
+        syslog(LOG_WARNING, "All %d epoch slots are in use!", MAX_SLOTS);
+        usleep(1000);
+    }
+}
+
+/**
+ * Records that the calling thread holds no references until
+ * its next checkpoint. This should be used before blocking,
+ * and is cheaper than leaving.
+ * @arg epochs The epochs
+ */
+void epoch_idle(hlld_epochs *epochs) {
+    epoch_thread *thread = get_epoch_thread(epochs);
+    epoch_slot *slot = (thread) ? thread->slot : find_slot(epochs);
+    if (slot && slot->epoch != IDLE_EPOCH) {
+        slot->epoch = IDLE_EPOCH;
+        epoch_notify(epochs);
+    }
+}
+
+/**
+ * Releases the slot of the calling thread
+ * @arg epochs The epochs
+ */
+void epoch_leave(hlld_epochs *epochs) {
+    epoch_thread *thread = get_epoch_thread(epochs);
+    epoch_slot *slot = (thread) ? thread->slot : find_slot(epochs);
+    if (!slot) return;
+
+    // Free slots must be idle, see epoch_checkpoint
+    slot->epoch = IDLE_EPOCH;
+    __sync_synchronize();
+    slot->in_use = 0;
+    if (thread) thread->slot = NULL;
+    epoch_notify(epochs);
+}
+
+/**
+ * Advances the global epoch. Anything the caller unlinked
+ * before this is unreferenced once epoch_min reaches the
+ * returned epoch.
+ * @arg epochs The epochs
+ * @return The new epoch
+ */
+uint64_t epoch_advance(hlld_epochs *epochs) {
+    return __sync_add_and_fetch(&epochs->epoch, 1);
+}
+
+/**
+ * Returns the oldest epoch an active thread may be using,
+ * or the current epoch if no thread is active.
+ * @arg epochs The epochs
+ * @return The minimum epoch
+ */
+uint64_t epoch_min(hlld_epochs *epochs) {
+    uint64_t slot_epoch, min_epoch = epochs->epoch;
+    int num = epochs->num_slots;
+    for (int i=0; i < num; i++) {
+        epoch_slot *slot = epochs->slots + i;
+        if (!slot->in_use) continue;
+        slot_epoch = slot->epoch;
+        if (slot_epoch < min_epoch) min_epoch = slot_epoch;
+    }
+    return min_epoch;
+}
+
+/**
+ * Blocks until a predicate holds. It is rechecked whenever a
+ * thread moves to a newer epoch, goes idle or leaves, and
+ * whenever epoch_notify is invoked.
+ * @arg epochs The epochs
+ * @arg ready The predicate
+ * @arg data Opaque pointer passed to the predicate
+ */
+void epoch_wait(hlld_epochs *epochs, epoch_ready_cb ready, void *data) {
+    pthread_mutex_lock(&epochs->wait_lock);
+    epochs->waiting++;
+    __sync_synchronize();
+    while (!ready(data))
+        pthread_cond_wait(&epochs->wait_cond, &epochs->wait_lock);
+    epochs->waiting--;
+    pthread_mutex_unlock(&epochs->wait_lock);
+}
+
+/**
+ * Wakes the threads in epoch_wait to recheck their
+ * predicate. The barrier pairs with the one in the wait,
+ * so that either the waiter sees the change, or we see
+ * the waiter.
+ * @arg epochs The epochs
+ */
+void epoch_notify(hlld_epochs *epochs) {
+    __sync_synchronize();
+    if (!epochs->waiting) return;
+    pthread_mutex_lock(&epochs->wait_lock);
+    pthread_cond_broadcast(&epochs->wait_cond);
+    pthread_mutex_unlock(&epochs->wait_lock);
+}
+
+/**
+ * Creates the key of the thread slots
+ */
+static void make_epoch_thread_key() {
+    pthread_key_create(&EPOCH_THREAD_KEY, free);
+}
+
+/**
+ * Returns the state of this thread for some epochs,
+ * discarding the slot of the last ones if they differ.
+ * @return The state, or NULL if it cannot be allocated
+ */
+static epoch_thread* get_epoch_thread(hlld_epochs *epochs) {
+    pthread_once(&EPOCH_THREAD_ONCE, make_epoch_thread_key);
+    epoch_thread *thread = pthread_getspecific(EPOCH_THREAD_KEY);
+    if (!thread) {
+        thread = calloc(1, sizeof(epoch_thread));
+        if (!thread) return NULL;
+        pthread_setspecific(EPOCH_THREAD_KEY, thread);
+    }
+    if (thread->epochs_id != epochs->id) {
+        thread->epochs_id = epochs->id;
+        thread->slot = find_slot(epochs);
+    }
+    return thread;
+}
+
+/**
+ * Scans the slots for the one of this thread
+ * @return The slot, or NULL if we have none
+ */
+static epoch_slot* find_slot(hlld_epochs *epochs) {
+    pthread_t id = pthread_self();
+    int num = epochs->num_slots;
+    for (int i=0; i < num; i++) {
+        epoch_slot *slot = epochs->slots + i;
+        if (slot->in_use && pthread_equal(slot->id, id)) return slot;
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+#include <stdint.h>
+
+/*
+ * Epochs let threads share structures without locking, and
+ * let a single writer know when a structure it retired is no
+ * longer referenced. Readers periodically checkpoint, which
+ * records the global epoch they have observed. A writer that
+ * unlinks a structure advances the epoch, and may reuse or
+ * free the structure once every active reader has observed
+ * the new epoch. Readers that are idle or have left hold
+ * no references, and never hold back a writer.
+ */
+typedef struct hlld_epochs hlld_epochs;
+
+/**
+ * Predicate used to wait on epochs
+ * @arg data Opaque pointer passed to epoch_wait
+ * @return Non-zero once the wait is over
+ */
+typedef int(*epoch_ready_cb)(void *data);
+
+/**
+ * Initializes the epochs
+ * @arg epochs Output, the epochs
+ * @return 0 on success.
+ */
+int init_epochs(hlld_epochs **epochs);
+
+/**
+ * Destroys the epochs. There must be no waiters.
+ * @arg epochs The epochs to destroy
+ * @return 0 on success.
+ */
+int destroy_epochs(hlld_epochs *epochs);
+
+/**
+ * Records that the calling thread has observed the current
+ * epoch, and holds no references from older epochs. The
+ * first checkpoint of a thread claims a slot for it.
+ * @arg epochs The epochs
+ */
+void epoch_checkpoint(hlld_epochs *epochs);
+
+/**
+ * Records that the calling thread holds no references until
+ * its next checkpoint. This should be used before blocking,
+ * and is cheaper than leaving.
+ * @arg epochs The epochs
+ */
+void epoch_idle(hlld_epochs *epochs);
+
+/**
+ * Releases the slot of the calling thread
+ * @arg epochs The epochs
+ */
+void epoch_leave(hlld_epochs *epochs);
+
+/**
+ * Advances the global epoch. Anything the caller unlinked
+ * before this is unreferenced once epoch_min reaches the
+ * returned epoch.
+ * @arg epochs The epochs
+ * @return The new epoch
+ */
+uint64_t epoch_advance(hlld_epochs *epochs);
+
+/**
+ * Returns the oldest epoch an active thread may be using,
+ * or the current epoch if no thread is active.
+ * @arg epochs The epochs
+ * @return The minimum epoch
+ */
+uint64_t epoch_min(hlld_epochs *epochs);
+
+/**
+ * Blocks until a predicate holds. It is rechecked whenever a
+ * thread moves to a newer epoch, goes idle or leaves, and
+ * whenever epoch_notify is invoked.
+ * @arg epochs The epochs
+ * @arg ready The predicate
+ * @arg data Opaque pointer passed to the predicate
+ */
+void epoch_wait(hlld_epochs *epochs, epoch_ready_cb ready, void *data);
+
+/**
+ * Wakes the threads in epoch_wait to recheck their
+ * predicate. Invoked after changing what they wait on.
+ * @arg epochs The epochs
+ */
+void epoch_notify(hlld_epochs *epochs);
+
+#endif
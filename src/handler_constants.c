@@ -18,9 +18,42 @@ static const int UNEXPECTED_ARGS_LEN = sizeof(UNEXPECTED_ARGS) - 1;
 static const char SET_KEY_NEEDED[] = "Must provide set name and key";
 static const int SET_KEY_NEEDED_LEN = sizeof(SET_KEY_NEEDED) - 1;
 
+static const char SET_HASH_NEEDED[] = "Must provide set name and hashes";
+static const int SET_HASH_NEEDED_LEN = sizeof(SET_HASH_NEEDED) - 1;
+
+static const char BAD_HASH[] = "Hashes must be 64bit hex values";
+static const int BAD_HASH_LEN = sizeof(BAD_HASH) - 1;
+
+static const char HASH_MODE_MISMATCH[] = "Keys do not match the set hash";
+static const int HASH_MODE_MISMATCH_LEN = sizeof(HASH_MODE_MISMATCH) - 1;
+
 static const char SET_NEEDED[] = "Must provide set name";
 static const int SET_NEEDED_LEN = sizeof(SET_NEEDED) - 1;
 
+static const char MERGE_SETS_NEEDED[] = "Must provide destination and source sets";
+static const int MERGE_SETS_NEEDED_LEN = sizeof(MERGE_SETS_NEEDED) - 1;
+
+static const char REPLIES_MODE_NEEDED[] = "Must provide all or count";
+static const int REPLIES_MODE_NEEDED_LEN = sizeof(REPLIES_MODE_NEEDED) - 1;
+
+static const char SETS_NEEDED[] = "Must provide set names";
+static const int SETS_NEEDED_LEN = sizeof(SETS_NEEDED) - 1;
+
+static const char TEMPLATE_SETS_NEEDED[] = "Must provide template and set names";
+static const int TEMPLATE_SETS_NEEDED_LEN = sizeof(TEMPLATE_SETS_NEEDED) - 1;
+
+static const char UNKNOWN_TEMPLATE[] = "Unknown template";
+static const int UNKNOWN_TEMPLATE_LEN = sizeof(UNKNOWN_TEMPLATE) - 1;
+
+static const char TOO_MANY_SETS[] = "Too many sets";
+static const int TOO_MANY_SETS_LEN = sizeof(TOO_MANY_SETS) - 1;
+
+static const char HASH_MODE_MISMATCH_RESP[] = "Keys do not match the set hash\n";
+static const int HASH_MODE_MISMATCH_RESP_LEN = sizeof(HASH_MODE_MISMATCH_RESP) - 1;
+
+static const char PRECISION_MISMATCH[] = "Set precisions or hashes differ";
+static const int PRECISION_MISMATCH_LEN = sizeof(PRECISION_MISMATCH) - 1;
+
 static const char BAD_SET_NAME[] = "Bad set name";
 static const int BAD_SET_NAME_LEN = sizeof(BAD_SET_NAME) - 1;
 
@@ -42,6 +75,39 @@ static const int DONE_RESP_LEN = sizeof(DONE_RESP) - 1;
 static const char EXISTS_RESP[] = "Exists\n";
 static const int EXISTS_RESP_LEN = sizeof(EXISTS_RESP) - 1;
 
+static const char MOVED_RESP[] = "Moved ";
+static const int MOVED_RESP_LEN = sizeof(MOVED_RESP) - 1;
+
+static const char CROSS_NODE[] = "Sets are on different cluster nodes";
+static const int CROSS_NODE_LEN = sizeof(CROSS_NODE) - 1;
+
+static const char NOT_WINDOWED[] = "Set is not windowed";
+static const int NOT_WINDOWED_LEN = sizeof(NOT_WINDOWED) - 1;
+
+static const char NO_KMV[] = "Set does not keep its smallest hashes";
+static const int NO_KMV_LEN = sizeof(NO_KMV) - 1;
+
+static const char READ_ONLY_SERVER[] = "Server is read only";
+static const int READ_ONLY_SERVER_LEN = sizeof(READ_ONLY_SERVER) - 1;
+
+static const char SNAPSHOT_IN_PROGRESS[] = "Snapshot in progress\n";
+static const int SNAPSHOT_IN_PROGRESS_LEN = sizeof(SNAPSHOT_IN_PROGRESS) - 1;
+
+static const char TOO_MANY_HANDLES[] = "Too many handles";
+static const int TOO_MANY_HANDLES_LEN = sizeof(TOO_MANY_HANDLES) - 1;
+
+static const char TOO_MANY_WATCHES[] = "Too many watches";
+static const int TOO_MANY_WATCHES_LEN = sizeof(TOO_MANY_WATCHES) - 1;
+
+static const char NOT_WATCHED[] = "Set is not watched\n";
+static const int NOT_WATCHED_LEN = sizeof(NOT_WATCHED) - 1;
+
+static const char WATCH_PUSH[] = "Watch ";
+static const int WATCH_PUSH_LEN = sizeof(WATCH_PUSH) - 1;
+
+static const char REMOTE_UNAVAILABLE[] = "Remote set unavailable";
+static const int REMOTE_UNAVAILABLE_LEN = sizeof(REMOTE_UNAVAILABLE) - 1;
+
 static const char NEW_LINE[] = "\n";
 static const int NEW_LINE_LEN = sizeof(NEW_LINE) - 1;
 
@@ -55,6 +121,9 @@ typedef enum {
     UNKNOWN = 0,    // Unrecognized command
     SET,            // Set a single key
     SET_MULTI,      // Set multiple space-seperated keys
+    SET_HASHES,     // Set multiple space-seperated hex hashes
+    SET_GROUPS,     // Set keys in groups of sets
+    SET_ALL,        // Set a key in many sets
     LIST,           // List sets
     INFO,           // Info about a set
     CREATE,         // Creates a set
@@ -62,8 +131,118 @@ typedef enum {
     CLOSE,          // Close a set
     CLEAR,          // Clears a set from the internals
     FLUSH,          // Force flush a set
+    MERGE,          // Merge sets into a set
+    SIZE_UNION,     // Size of the union of sets
+    SIZE_INTERSECT, // Size of the intersection of sets
+    SIZE,           // Size of a set, or of its recent intervals
+    REPLIES,        // Choose how sets are acknowledged
+    STATS,          // Server wide metrics
+    SLOWLOG,        // The slowest recent commands
+    SNAPSHOT,       // Writes a snapshot of the sets in the background
+    SIZES,          // Sizes of many sets
+    BULK_CREATE,    // Creates many sets from a template
+    JACCARD,        // Jaccard similarity of sets
+    BIND,           // Binds a handle to a set name
+    WATCH,          // Pushes the size of a set as it moves
+    UNWATCH,        // Stops watching a set
+    BINARY,         // Binary frame, only for metrics
+    NUM_CMD_TYPES
 } conn_cmd_type;
 
+/**
+ * The names of the command types in the metrics
+ */
+static const char *CMD_TYPE_NAMES[] = {
+    "unknown", "set", "bulk", "seth", "multi", "setall", "list", "info",
+    "create", "drop", "close", "clear", "flush", "merge", "size_union",
+    "size_intersect", "size", "replies", "stats", "slowlog", "snapshot", "sizes", "bulkcreate", "jaccard",
+    "bind", "watch", "unwatch", "binary"
+};
+
+/*
+ * The binary protocol. Frames start with a magic byte that
+ * no text command starts with, then a fixed header of the
+ * opcode, the set name length, the key count and the body
+ * length. All integers are little endian. Replies are a
+ * fixed header of the magic, a status and a key count.
+ */
+#define BINARY_MAGIC 0xB1
+#define BINARY_HEADER_LEN 12
+#define BINARY_REPLY_LEN 8
+
+typedef enum {
+    BIN_SET_KEYS = 1,   // Body is the name, u16 key lengths, then the keys
+    BIN_SET_HASHES = 2, // Body is the name, then u64 hashes
+    BIN_DUMP = 3,       // Body is the name, the reply is followed by the dump
+    BIN_RESTORE = 4,    // Body is the name, then the dump
+    BIN_SNAPSHOT = 5,   // Body is a name prefix, the reply is followed by the dumps
+    BIN_MERGE_RAW = 6,  // Body is the name, u8 precision, u8 layout, then the registers
+    BIN_GET_RAW = 7,    // Body is the name and an optional u8 sparse flag, the
+                        // reply is followed by the precision, layout and registers
+} binary_opcode;
+
+typedef enum {
+    BIN_DONE = 0,
+    BIN_SET_NOT_EXIST,
+    BIN_BAD_FRAME,
+    BIN_HASH_MISMATCH,
+    BIN_INTERNAL_ERR,
+    BIN_NOT_SUP,
+    BIN_SET_EXISTS,
+    BIN_DELETE_PENDING,
+    BIN_MOVED,          // The count is the index of the node in cluster_nodes
+    BIN_READ_ONLY,      // The server does not take writes
+    BIN_LOW_PRECISION,  // The registers have a lower precision than the set
+} binary_status;
+
+/*
+ * The text commands, ordered by the length of their name
+ * so that a command is only compared to those of the same
+ * length. The start of each length is indexed on init.
+ */
+typedef struct {
+    const char *name;
+    int len;
+    conn_cmd_type type;
+} client_command;
+
+#define CLIENT_CMD(name, type) {name, sizeof(name) - 1, type}
+static const client_command CLIENT_COMMANDS[] = {
+    CLIENT_CMD("s", SET),
+    CLIENT_CMD("b", SET_MULTI),
+    CLIENT_CMD("set", SET),
+    CLIENT_CMD("seth", SET_HASHES),
+    CLIENT_CMD("bulk", SET_MULTI),
+    CLIENT_CMD("drop", DROP),
+    CLIENT_CMD("bind", BIND),
+    CLIENT_CMD("list", LIST),
+    CLIENT_CMD("info", INFO),
+    CLIENT_CMD("size", SIZE),
+    CLIENT_CMD("multi", SET_GROUPS),
+    CLIENT_CMD("close", CLOSE),
+    CLIENT_CMD("clear", CLEAR),
+    CLIENT_CMD("flush", FLUSH),
+    CLIENT_CMD("merge", MERGE),
+    CLIENT_CMD("stats", STATS),
+    CLIENT_CMD("watch", WATCH),
+    CLIENT_CMD("sizes", SIZES),
+    CLIENT_CMD("setall", SET_ALL),
+    CLIENT_CMD("create", CREATE),
+    CLIENT_CMD("replies", REPLIES),
+    CLIENT_CMD("jaccard", JACCARD),
+    CLIENT_CMD("unwatch", UNWATCH),
+    CLIENT_CMD("slowlog", SLOWLOG),
+    CLIENT_CMD("snapshot", SNAPSHOT),
+    CLIENT_CMD("bulkcreate", BULK_CREATE),
+    CLIENT_CMD("size_union", SIZE_UNION),
+    CLIENT_CMD("size_intersect", SIZE_INTERSECT),
+};
+#define NUM_CLIENT_COMMANDS (int)(sizeof(CLIENT_COMMANDS) / sizeof(client_command))
+#define MAX_CLIENT_CMD_LEN 14
+
+// The first command of each name length, filled on init
+static int CLIENT_CMD_START[MAX_CLIENT_CMD_LEN + 2];
+
 /* Static regexes */
 static regex_t VALID_SET_NAMES_RE;
 static const char *VALID_SET_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
@@ -7,6 +7,47 @@ State of The Art Cardinality Estimation Algorithm"
  * and a 64bit hash function. For our needs, we always use
  * a dense representation and avoid the sparse/dense conversions.
  *
+ * Registers are either packed 5 per 32bit word (HLL_PACKED),
+ * or stored one per byte (HLL_BYTE). The byte layout uses about
+ * 30% more memory, but avoids the division and masking required
+ * to access a packed register.
+ *
+ * The nibble layout (HLL_NIBBLE) uses a third less memory than
+ * packed, in the manner of HLL-TailCut. Each 64bit word holds 15
+ * registers as 4 bit offsets from a 4 bit base in its top bits.
+ * Registers of a word are close in value, since they all see the
+ * same stream, so a raise past the offsets moves the base up by
+ * their smallest offset in the same compare-and-swap. Only a
+ * register more than 15 above the lowest of its word is cut to
+ * base + 15, which is about as rare as a register of 16 while
+ * another is still zero, and barely moves the estimates.
+ *
+ * Dense registers are only ever raised, using a compare-and-swap
+ * of the word or byte holding them. This makes concurrent updates
+ * and unions of a dense HLL safe without a lock. The sparse
+ * representation is not, and must be serialized by the owner.
+ *
+ * Dense HLLs keep the harmonic sum and zero register count used
+ * by the estimator up to date as registers are raised, so the
+ * size is computed without a pass over the registers. The sum is
+ * kept in fixed point so it can be updated atomically and never
+ * drifts. The fraction is (63 - precision) bits, which fits the
+ * sum of every register being zero, and only rounds the terms of
+ * the two largest register values down to zero.
+ *
+ * The dense add paths are generated for every precision and format,
+ * so the index shift and register layout are constants in each. An
+ * HLL dispatches through the kernel table selected when it is set up.
+ *
+ * Since the hash is 64 bits, there is no large range correction
+ * like the one the original algorithm needs near 2^32. Registers
+ * only saturate near 2^64, and the histogram estimator accounts for
+ * saturated registers. The empirical bias data only covers up to
+ * precision 18, so larger precisions use the histogram estimator.
+ *
+ * Sliding HLLs keep a short list of timestamped values per register
+ * instead, and are updated under a lock. They are estimated by raising
+ * a dense HLL to the values of a window, then using its estimators.
  */
 #include <stdlib.h>
 #include <math.h>
@@ -14,18 +55,105 @@ State of The Art Cardinality Estimation Algorithm"
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "hll.h"
 #include "hll_constants.h"
+#include "hll_simd.h"
+#include "hll_hash.h"
 
 #define REG_WIDTH 6     // Bits per register
 #define INT_WIDTH 32    // Bits in an int
 #define REG_PER_WORD 5  // floor(INT_WIDTH / REG_WIDTH)
 
+/*
+ * The nibble layout. The base of a word is at most 15, so
+ * registers reach 30 before they are cut.
+ */
+#define NIBBLE_WIDTH 4
+#define NIBBLE_PER_WORD 15
+#define NIBBLE_MASK 0xfULL
+#define NIBBLE_BASE_SHIFT 60
+#define NIBBLE_MAX_BASE 15
+#define NIBBLE_ONES 0x0111111111111111ULL // A one in each offset
+
 #define NUM_REG(precision) ((1 << precision))
 #define INT_CEIL(num, denom) (((num) + (denom) - 1) / (denom))
+#define SUM_SHIFT(precision) (63 - (precision))
+
+/*
+ * Sparse entries pack the register index above the
+ * 6 bit rho value, so sorting entries sorts by index.
+ */
+#define SPARSE_ENTRY(idx, rho) (((uint32_t)(idx) << REG_WIDTH) | (rho))
+#define SPARSE_IDX(entry) ((entry) >> REG_WIDTH)
+#define SPARSE_RHO(entry) ((entry) & ((1 << REG_WIDTH) - 1))
+#define SPARSE_MIN_TMP 64       // Minimum pending entries before a merge
+#define SPARSE_TMP_RATIO 8      // Pending entries grow with encoded bytes / ratio
+#define SPARSE_MAX_VARINT 4     // Entries fit in 28 bits, encoded as 4 varint bytes
+#define SPARSE_MAGIC 0x53504c48 // "HLPS" in little endian
+
+/*
+ * The cold encoding stores each register as a 4 bit offset
+ * from a base value. Registers outside the 15 values above the
+ * base are escaped, and stored in full after the offsets.
+ */
+#define COLD_MAGIC 0x43504c48   // "HLPC" in little endian
+#define COLD_ESCAPE 15          // Offset marking an escaped register
+
+struct hll_sparse {
+    unsigned char *buf;     // Delta + varint encoded sorted entries
+    uint32_t len;           // Bytes used in buf
+    uint32_t num_entries;   // Entries encoded in buf
+    uint32_t *tmp;          // Unsorted pending entries
+    uint32_t tmp_len;
+    uint32_t tmp_cap;
+};
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+/*
+ * Header for an encoded sparse HLL
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t precision;
+    uint32_t num_entries;
+    uint32_t len;
+} sparse_header;
+
+/*
+ * Header for a cold encoded dense HLL
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t precision;
+    uint32_t base;          // Subtracted from each register
+    uint32_t num_escaped;   // Full registers after the offsets
+} cold_header;
+
+/*
+ * The pairs of a sliding register, oldest first. Values fall
+ * strictly from the oldest pair, since a pair is dropped once a
+ * newer pair is at least as large, and unused pairs are zero.
+ */
+#define SLIDING_MAGIC 0x57534c48 // "HLSW" in little endian
+
+struct hll_sliding_reg {
+    uint32_t times[HLL_SLIDING_PAIRS];
+    unsigned char rhos[HLL_SLIDING_PAIRS];
+};
+
+/*
+ * Header for an encoded sliding HLL
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t precision;
+    uint32_t max_window;
+    uint32_t pairs;         // Pairs per register
+} sliding_header;
+
+static void reset_sum(hll_t *h);
+static void rebuild_sum(hll_t *h);
+static void set_kernels(hll_t *h);
 
 
 /**
@@ -34,24 +162,26 @@ extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init(unsigned char precision, hll_t *h) {
+int hll_init(unsigned char precision, hll_format format, hll_t *h) {
     // Ensure the precision is somewhat sane
     if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
         return -1;
 
-    // Store precision
-    h->precision = precision;
-
-    // Determine how many registers are needed
-    int reg = NUM_REG(precision);
+    // Determine how many bytes are needed
+    uint64_t bytes = hll_bytes_for_precision(precision, format);
+    if (!bytes) return -1;
 
-    // Get the full words required
-    int words = INT_CEIL(reg, REG_PER_WORD);
+    // Store precision and format
+    h->precision = precision;
+    h->format = format;
+    set_kernels(h);
 
     // Allocate and zero out the registers
     h->bm = NULL;
-    h->registers = calloc(words, sizeof(uint32_t));
+    h->sparse = NULL;
+    h->registers = calloc(1, bytes);
     if (!h->registers) return -1;
+    reset_sum(h);
     return 0;
 }
 
@@ -59,25 +189,233 @@ int hll_init(unsigned char precision, hll_t *h) {
 /**
  * Initializes a new HLL from a bitmap
  * @arg precision The digits of precision to use
+ * @arg format The register layout of the bitmap
  * @arg bm The bitmap to use
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h) {
+int hll_init_from_bitmap(unsigned char precision, hll_format format, hlld_bitmap *bm, hll_t *h) {
     // Ensure the precision is somewhat sane
     if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
         return -1;
 
     // Check the bitmap size
-    if (hll_bytes_for_precision(precision) != bm->size)
+    uint64_t bytes = hll_bytes_for_precision(precision, format);
+    if (!bytes || bytes != bm->size)
         return -1;
 
-    // Store precision
+    // Store precision and format
     h->precision = precision;
+    h->format = format;
+    set_kernels(h);
 
     // Use the bitmap
     h->registers = (uint32_t*)bm->mmap;
     h->bm = bm;
+    h->sparse = NULL;
+    rebuild_sum(h);
+    return 0;
+}
+
+
+/*
+ * Allocates an empty sparse representation
+ */
+static struct hll_sparse* sparse_alloc() {
+    struct hll_sparse *sp = calloc(1, sizeof(struct hll_sparse));
+    if (!sp) return NULL;
+    sp->tmp_cap = SPARSE_MIN_TMP;
+    sp->tmp = malloc(sp->tmp_cap * sizeof(uint32_t));
+    if (!sp->tmp) {
+        free(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+static void sparse_free(struct hll_sparse *sp) {
+    free(sp->buf);
+    free(sp->tmp);
+    free(sp);
+}
+
+/*
+ * Writes a varint, returns the bytes used
+ */
+static inline int varint_encode(uint32_t val, unsigned char *out) {
+    int i = 0;
+    while (val >= 0x80) {
+        out[i++] = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    out[i++] = val;
+    return i;
+}
+
+/*
+ * Reads a varint, advancing the offset. Returns -1
+ * if the varint runs past the end of the buffer.
+ */
+static inline int varint_decode(const unsigned char *in, uint32_t len,
+        uint32_t *offset, uint32_t *val) {
+    uint32_t result = 0;
+    for (int shift=0; shift < 7 * SPARSE_MAX_VARINT; shift += 7) {
+        if (*offset >= len) return -1;
+        unsigned char b = in[(*offset)++];
+        result |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *val = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Merges the pending entries into the encoded list,
+ * keeping the largest rho for each index.
+ */
+static int sparse_compact(struct hll_sparse *sp) {
+    if (!sp->tmp_len) return 0;
+    qsort(sp->tmp, sp->tmp_len, sizeof(uint32_t), cmp_entry);
+
+    // Splitting a delta adds at most one varint per new entry
+    uint32_t cap = sp->len + (sp->tmp_len + 1) * SPARSE_MAX_VARINT;
+    unsigned char *out = malloc(cap);
+    if (!out) return -1;
+
+    uint32_t offset = 0, old_remain = sp->num_entries, old_val = 0, delta = 0;
+    uint32_t tmp_idx = 0, out_len = 0, out_entries = 0;
+    uint32_t prev = 0, pending = 0, next;
+    int have_pending = 0;
+    if (old_remain) {
+        varint_decode(sp->buf, sp->len, &offset, &delta);
+        old_val = delta;
+    }
+    while (old_remain || tmp_idx < sp->tmp_len) {
+        // Take the smallest of the two lists
+        if (old_remain && (tmp_idx == sp->tmp_len || old_val <= sp->tmp[tmp_idx])) {
+            next = old_val;
+            if (--old_remain) {
+                varint_decode(sp->buf, sp->len, &offset, &delta);
+                old_val += delta;
+            }
+        } else {
+            next = sp->tmp[tmp_idx++];
+        }
+
+        // Entries are sorted, so a repeated index has a larger rho
+        if (have_pending && SPARSE_IDX(next) == SPARSE_IDX(pending)) {
+            pending = next;
+            continue;
+        }
+        if (have_pending) {
+            out_len += varint_encode(pending - prev, out + out_len);
+            prev = pending;
+            out_entries++;
+        }
+        pending = next;
+        have_pending = 1;
+    }
+    if (have_pending) {
+        out_len += varint_encode(pending - prev, out + out_len);
+        out_entries++;
+    }
+
+    free(sp->buf);
+    sp->buf = out;
+    sp->len = out_len;
+    sp->num_entries = out_entries;
+    sp->tmp_len = 0;
+
+    // Grow the pending buffer with the list to amortize merges
+    uint32_t want = out_len / SPARSE_TMP_RATIO;
+    if (want > sp->tmp_cap) {
+        uint32_t *tmp = realloc(sp->tmp, want * sizeof(uint32_t));
+        if (tmp) {
+            sp->tmp = tmp;
+            sp->tmp_cap = want;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Initializes a new HLL using the sparse representation.
+ * The HLL stays sparse until converted with hll_convert_dense.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout to use once dense
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_sparse(unsigned char precision, hll_format format, hll_t *h) {
+    // Ensure the precision is somewhat sane
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+    if (!hll_bytes_for_precision(precision, format))
+        return -1;
+
+    // Store precision and format
+    h->precision = precision;
+    h->format = format;
+    set_kernels(h);
+    h->registers = NULL;
+    h->bm = NULL;
+    h->sparse = sparse_alloc();
+    if (!h->sparse) return -1;
+    return 0;
+}
+
+
+/**
+ * Initializes a sparse HLL from a buffer produced
+ * by hll_sparse_encode.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout to use once dense
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @arg h The HLL to initialize
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_init_sparse_from_buffer(unsigned char precision, hll_format format,
+        const unsigned char *buf, uint64_t len, hll_t *h) {
+    // Verify the header
+    sparse_header header;
+    if (len < sizeof(header)) return -1;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != SPARSE_MAGIC || header.precision != precision ||
+        header.len != len - sizeof(header))
+        return -1;
+
+    // Verify the entries are sorted and in range
+    uint32_t offset = 0, val = 0, delta = 0;
+    const unsigned char *data = buf + sizeof(header);
+    for (uint32_t i=0; i < header.num_entries; i++) {
+        if (varint_decode(data, header.len, &offset, &delta)) return -1;
+        if (i && !delta) return -1;
+        val += delta;
+        if (SPARSE_IDX(val) >= (uint32_t)NUM_REG(precision)) return -1;
+    }
+    if (offset != header.len) return -1;
+
+    if (hll_init_sparse(precision, format, h)) return -1;
+    struct hll_sparse *sp = h->sparse;
+    if (header.len) {
+        sp->buf = malloc(header.len);
+        if (!sp->buf) {
+            hll_destroy(h);
+            return -1;
+        }
+        memcpy(sp->buf, data, header.len);
+    }
+    sp->len = header.len;
+    sp->num_entries = header.num_entries;
     return 0;
 }
 
@@ -87,6 +425,12 @@ int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h) {
  * @return 0 on success
  */
 int hll_destroy(hll_t *h) {
+    // Free the sparse representation
+    if (h->sparse) {
+        sparse_free(h->sparse);
+        h->sparse = NULL;
+    }
+
     // Close the bitmap
     if (h->bm) {
         bitmap_close(h->bm);
@@ -102,74 +446,418 @@ int hll_destroy(hll_t *h) {
     return 0;
 }
 
-static int get_register(hll_t *h, int idx) {
-    uint32_t word = *(h->registers + (idx / REG_PER_WORD));
+static inline int get_register(hll_t *h, int idx) {
+    // Byte registers are a direct load
+    if (h->format == HLL_BYTE)
+        return ((volatile unsigned char*)h->registers)[idx];
+
+    // Nibbles are an offset from the base of their word
+    if (h->format == HLL_NIBBLE) {
+        uint64_t word = ((volatile uint64_t*)h->registers)[idx / NIBBLE_PER_WORD];
+        return (word >> NIBBLE_BASE_SHIFT) +
+            ((word >> NIBBLE_WIDTH * (idx % NIBBLE_PER_WORD)) & NIBBLE_MASK);
+    }
+
+    uint32_t word = *((volatile uint32_t*)h->registers + (idx / REG_PER_WORD));
     word = word >> REG_WIDTH * (idx % REG_PER_WORD);
     return word & ((1 << REG_WIDTH) - 1);
 }
 
-static void set_register(hll_t *h, int idx, int val) {
-    uint32_t *word = h->registers + (idx / REG_PER_WORD);
+/*
+ * Sets the estimator state for all zero registers
+ */
+static void reset_sum(hll_t *h) {
+    h->inv_sum = (uint64_t)NUM_REG(h->precision) << SUM_SHIFT(h->precision);
+    h->num_zero = NUM_REG(h->precision);
+}
 
-    // Shift the val into place
+/*
+ * Recomputes the estimator state from the registers.
+ * Must not race with updates to the registers.
+ */
+static void rebuild_sum(hll_t *h) {
+    int shift = SUM_SHIFT(h->precision), num_reg = NUM_REG(h->precision);
+    uint64_t inv_sum = 0;
+    int num_zero = 0, val;
+    for (int i=0; i < num_reg; i++) {
+        val = get_register(h, i);
+        inv_sum += hll_sum_term(shift, val);
+        num_zero += !val;
+    }
+    h->inv_sum = inv_sum;
+    h->num_zero = num_zero;
+}
+
+/*
+ * Applies the change in the estimator state
+ */
+static inline void apply_sum_delta(hll_t *h, hll_sum_delta *delta) {
+    if (delta->inv_sum) __sync_fetch_and_sub(&h->inv_sum, delta->inv_sum);
+    if (delta->num_zero) __sync_fetch_and_sub(&h->num_zero, delta->num_zero);
+}
+
+/*
+ * Updates the estimator state after a register is raised
+ */
+static inline void raised_register(hll_t *h, int precision, int old, int val) {
+    hll_sum_delta delta = {SUM_SHIFT(precision), 0, 0};
+    hll_sum_raise(&delta, old, val);
+    apply_sum_delta(h, &delta);
+}
+
+/*
+ * Returns the nibble word with the register at shift raised to
+ * val, which must exceed its value. A value past the offsets
+ * first moves the base up by the smallest offset of the word,
+ * and is then cut to the largest offset.
+ * @arg count The registers in the word, as the last may be short
+ */
+static inline uint64_t raise_nibble(uint64_t word, unsigned shift, int val, int count) {
+    int base = word >> NIBBLE_BASE_SHIFT;
+    if (val - base > (int)NIBBLE_MASK) {
+        int min = NIBBLE_MASK;
+        for (int i=0; i < count; i++) {
+            int off = (word >> NIBBLE_WIDTH * i) & NIBBLE_MASK;
+            if (NIBBLE_WIDTH * i != (int)shift && off < min) min = off;
+        }
+        if (base + min > NIBBLE_MAX_BASE) min = NIBBLE_MAX_BASE - base;
+        if (min) {
+            uint64_t valid = NIBBLE_ONES & ((1ULL << NIBBLE_WIDTH * count) - 1);
+            word = (word & ~(NIBBLE_MASK << shift)) - min * (valid & ~(1ULL << shift));
+            base += min;
+            word = (word & ~(NIBBLE_MASK << NIBBLE_BASE_SHIFT)) |
+                ((uint64_t)base << NIBBLE_BASE_SHIFT);
+        }
+        if (val - base > (int)NIBBLE_MASK) val = base + NIBBLE_MASK;
+    }
+    return (word & ~(NIBBLE_MASK << shift)) | ((uint64_t)(val - base) << shift);
+}
+
+/*
+ * Raises a dense register to val if it is smaller. Registers only
+ * ever increase, so a compare-and-swap loop is enough to make the
+ * update safe against concurrent writers without a lock. The
+ * writer that swaps in a value also updates the estimator state,
+ * and marks the page dirty if the registers are in a bitmap.
+ * The precision and format are passed in so the kernels can
+ * inline this with them as constants.
+ * Returns 1 if the register was raised.
+ */
+static inline __attribute__((always_inline)) int max_register_fixed(hll_t *h,
+        int idx, int val, int precision, hll_format format) {
+    // Byte registers are swapped directly
+    if (format == HLL_BYTE) {
+        volatile unsigned char *reg = (unsigned char*)h->registers + idx;
+        unsigned char old = *reg;
+        while (val > old) {
+            if (__sync_bool_compare_and_swap(reg, old, val)) {
+                raised_register(h, precision, old, val);
+                if (h->bm) bitmap_mark_dirty(h->bm, idx);
+                return 1;
+            }
+            old = *reg;
+        }
+        return 0;
+    }
+
+    // Nibbles may move the base of their word, which keeps the
+    // other registers, so only this register changes value
+    if (format == HLL_NIBBLE) {
+        int w = idx / NIBBLE_PER_WORD;
+        volatile uint64_t *word = (uint64_t*)h->registers + w;
+        unsigned shift = NIBBLE_WIDTH * (idx % NIBBLE_PER_WORD);
+        int count = NUM_REG(precision) - w * NIBBLE_PER_WORD;
+        if (count > NIBBLE_PER_WORD) count = NIBBLE_PER_WORD;
+        uint64_t old = *word;
+        while (1) {
+            int cur = (old >> NIBBLE_BASE_SHIFT) + ((old >> shift) & NIBBLE_MASK);
+            if (val <= cur) return 0;
+            uint64_t raised = raise_nibble(old, shift, val, count);
+            int now = (raised >> NIBBLE_BASE_SHIFT) + ((raised >> shift) & NIBBLE_MASK);
+            if (now <= cur) return 0;
+            if (__sync_bool_compare_and_swap(word, old, raised)) {
+                raised_register(h, precision, cur, now);
+                if (h->bm) bitmap_mark_dirty(h->bm, w * sizeof(uint64_t));
+                return 1;
+            }
+            old = *word;
+        }
+    }
+
+    volatile uint32_t *word = h->registers + (idx / REG_PER_WORD);
     unsigned shift = REG_WIDTH * (idx % REG_PER_WORD);
-    val = val << shift;
     uint32_t val_mask = ((1 << REG_WIDTH) - 1) << shift;
+    uint32_t old = *word;
+
+    // Swap in the word with the new register value shifted into place
+    while ((int)((old & val_mask) >> shift) < val) {
+        if (__sync_bool_compare_and_swap(word, old, (old & ~val_mask) | ((uint32_t)val << shift))) {
+            raised_register(h, precision, (old & val_mask) >> shift, val);
+            if (h->bm) bitmap_mark_dirty(h->bm, (idx / REG_PER_WORD) * sizeof(uint32_t));
+            return 1;
+        }
+        old = *word;
+    }
+    return 0;
+}
+
+static inline int max_register(hll_t *h, int idx, int val) {
+    return max_register_fixed(h, idx, val, h->precision, h->format);
+}
+
+/*
+ * Buffers a new sparse entry, merging once the buffer is full
+ */
+static inline void sparse_insert(struct hll_sparse *sp, uint32_t entry) {
+    sp->tmp[sp->tmp_len++] = entry;
+    if (sp->tmp_len == sp->tmp_cap && sparse_compact(sp)) {
+        // Out of memory, drop the new entry
+        sp->tmp_len--;
+    }
+}
+
+/*
+ * Raises a register of either representation
+ */
+static inline void raise_register(hll_t *h, int idx, int val) {
+    if (h->sparse)
+        sparse_insert(h->sparse, SPARSE_ENTRY(idx, val));
+    else
+        max_register(h, idx, val);
+}
+
+/*
+ * Raises the registers of a nibble word together. The base
+ * moves up to the lowest of them, so unlike raising them one
+ * at a time, none is cut unless they span more than the offsets.
+ * @arg w The index of the word
+ * @arg vals The value to raise each register of the word to, or 0
+ * @return The number of registers raised
+ */
+static int max_nibble_word(hll_t *h, int w, const int *vals) {
+    volatile uint64_t *word = (uint64_t*)h->registers + w;
+    int count = NUM_REG(h->precision) - w * NIBBLE_PER_WORD;
+    if (count > NIBBLE_PER_WORD) count = NIBBLE_PER_WORD;
+    int cur[NIBBLE_PER_WORD], now[NIBBLE_PER_WORD];
+    uint64_t old = *word;
+    while (1) {
+        int base = old >> NIBBLE_BASE_SHIFT, low = NIBBLE_MAX_BASE, changed = 0;
+        for (int i=0; i < count; i++) {
+            cur[i] = base + ((old >> NIBBLE_WIDTH * i) & NIBBLE_MASK);
+            now[i] = (vals[i] > cur[i]) ? vals[i] : cur[i];
+            changed |= now[i] > cur[i];
+            if (now[i] < low) low = now[i];
+        }
+        if (!changed) return 0;
+
+        uint64_t raised = (uint64_t)low << NIBBLE_BASE_SHIFT;
+        for (int i=0; i < count; i++) {
+            if (now[i] > low + (int)NIBBLE_MASK) now[i] = low + NIBBLE_MASK;
+            raised |= (uint64_t)(now[i] - low) << NIBBLE_WIDTH * i;
+        }
+        if (__sync_bool_compare_and_swap(word, old, raised)) {
+            hll_sum_delta delta = {SUM_SHIFT(h->precision), 0, 0};
+            int num = 0;
+            for (int i=0; i < count; i++) {
+                if (now[i] == cur[i]) continue;
+                hll_sum_raise(&delta, cur[i], now[i]);
+                num++;
+            }
+            apply_sum_delta(h, &delta);
+            if (h->bm) bitmap_mark_dirty(h->bm, w * sizeof(uint64_t));
+            return num;
+        }
+        old = *word;
+    }
+}
+
+/*
+ * Raises dense registers given mostly in order of index, as by
+ * a merge or a load. Nibble registers are gathered by word and
+ * raised together, which keeps the order of the raises from
+ * cutting them. Others are raised one at a time.
+ */
+typedef struct {
+    int word;                       // The nibble word gathered, or -1
+    int vals[NIBBLE_PER_WORD];
+} register_batch;
+
+static void batch_flush(hll_t *h, register_batch *b) {
+    if (b->word >= 0) max_nibble_word(h, b->word, b->vals);
+    b->word = -1;
+    memset(b->vals, 0, sizeof(b->vals));
+}
+
+static inline void batch_raise(hll_t *h, register_batch *b, int idx, int val) {
+    if (h->format != HLL_NIBBLE) {
+        max_register(h, idx, val);
+        return;
+    }
+    int w = idx / NIBBLE_PER_WORD;
+    if (w != b->word) {
+        batch_flush(h, b);
+        b->word = w;
+    }
+    if (val > b->vals[idx % NIBBLE_PER_WORD]) b->vals[idx % NIBBLE_PER_WORD] = val;
+}
+
+/*
+ * Splits a hash into the register index, using the first
+ * p bits, and the count of leading zeros after them.
+ */
+static inline __attribute__((always_inline)) int hash_register(uint64_t hash,
+        int precision, int *leading) {
+    int idx = hash >> (64 - precision);
+    hash = hash << precision | (1 << (precision - 1));
+    *leading = __builtin_clzll(hash) + 1;
+    return idx;
+}
+
+/*
+ * Hashes are handled in groups, prefetching a group
+ * of registers before any of them are updated.
+ */
+#define PREFETCH_GROUP 16
+
+/*
+ * The dense add kernels, inlined into a copy for each
+ * precision and format by DEFINE_KERNELS.
+ */
+static inline __attribute__((always_inline)) int add_hash_fixed(hll_t *h,
+        uint64_t hash, int precision, hll_format format) {
+    int leading;
+    int idx = hash_register(hash, precision, &leading);
+    return max_register_fixed(h, idx, leading, precision, format);
+}
+
+static inline __attribute__((always_inline)) int add_hashes_fixed(hll_t *h,
+        const uint64_t *hashes, int num, int precision, hll_format format) {
+    int changed = 0;
+    int idx[PREFETCH_GROUP];
+    int leading[PREFETCH_GROUP];
+    for (int base=0; base < num; base += PREFETCH_GROUP) {
+        int group = (num - base < PREFETCH_GROUP) ? num - base : PREFETCH_GROUP;
+
+        // Compute every register, and prefetch it for writing
+        for (int i=0; i < group; i++) {
+            idx[i] = hash_register(hashes[base + i], precision, leading + i);
+            if (format == HLL_BYTE)
+                __builtin_prefetch((unsigned char*)h->registers + idx[i], 1);
+            else if (format == HLL_NIBBLE)
+                __builtin_prefetch((uint64_t*)h->registers + (idx[i] / NIBBLE_PER_WORD), 1);
+            else
+                __builtin_prefetch(h->registers + (idx[i] / REG_PER_WORD), 1);
+        }
 
-    // Store the word
-    *word = (*word & ~val_mask) | val;
+        // Update the registers
+        for (int i=0; i < group; i++) {
+            changed += max_register_fixed(h, idx[i], leading[i], precision, format);
+        }
+    }
+    return changed;
+}
+
+/*
+ * The alpha bias corrector from the hyperloglog paper, times
+ * the squared register count, used by the raw estimate
+ */
+#define ALPHA_MM(p) (((p) == 4 ? 0.673 : (p) == 5 ? 0.697 : (p) == 6 ? 0.709 : \
+            0.7213 / (1 + 1.079 / NUM_REG(p))) * NUM_REG(p) * NUM_REG(p))
+
+struct hll_kernels {
+    int (*add_hash)(hll_t *h, uint64_t hash);
+    int (*add_hashes)(hll_t *h, const uint64_t *hashes, int num);
+    double alpha_mm;
+};
+
+#define FOR_EACH_PRECISION(X) X(4) X(5) X(6) X(7) X(8) X(9) X(10) \
+    X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22)
+
+#define DEFINE_KERNELS(p) \
+    static int add_hash_packed_##p(hll_t *h, uint64_t hash) { \
+        return add_hash_fixed(h, hash, p, HLL_PACKED); \
+    } \
+    static int add_hash_byte_##p(hll_t *h, uint64_t hash) { \
+        return add_hash_fixed(h, hash, p, HLL_BYTE); \
+    } \
+    static int add_hashes_packed_##p(hll_t *h, const uint64_t *hashes, int num) { \
+        return add_hashes_fixed(h, hashes, num, p, HLL_PACKED); \
+    } \
+    static int add_hashes_byte_##p(hll_t *h, const uint64_t *hashes, int num) { \
+        return add_hashes_fixed(h, hashes, num, p, HLL_BYTE); \
+    } \
+    static int add_hash_nibble_##p(hll_t *h, uint64_t hash) { \
+        return add_hash_fixed(h, hash, p, HLL_NIBBLE); \
+    } \
+    static int add_hashes_nibble_##p(hll_t *h, const uint64_t *hashes, int num) { \
+        return add_hashes_fixed(h, hashes, num, p, HLL_NIBBLE); \
+    }
+FOR_EACH_PRECISION(DEFINE_KERNELS)
+
+#define PACKED_KERNELS(p) {add_hash_packed_##p, add_hashes_packed_##p, ALPHA_MM(p)},
+#define BYTE_KERNELS(p) {add_hash_byte_##p, add_hashes_byte_##p, ALPHA_MM(p)},
+#define NIBBLE_KERNELS(p) {add_hash_nibble_##p, add_hashes_nibble_##p, ALPHA_MM(p)},
+
+static const struct hll_kernels KERNELS[3][HLL_MAX_PRECISION - HLL_MIN_PRECISION + 1] = {
+    {FOR_EACH_PRECISION(PACKED_KERNELS)},
+    {FOR_EACH_PRECISION(BYTE_KERNELS)},
+    {FOR_EACH_PRECISION(NIBBLE_KERNELS)}
+};
+
+/*
+ * Selects the kernels for the precision and format
+ */
+static void set_kernels(hll_t *h) {
+    h->kernels = &KERNELS[h->format][h->precision - HLL_MIN_PRECISION];
 }
 
 /**
  * Adds a new key to the HLL
  * @arg h The hll to add to
  * @arg key The key to add
+ * @return 1 if a register changed, 0 otherwise.
  */
-void hll_add(hll_t *h, char *key) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-    // Add the hashed value
-    hll_add_hash(h, out[1]);
+int hll_add(hll_t *h, char *key) {
+    // Compute the hash value of the key, and add it
+    return hll_add_hash(h, hll_hash_key(HLL_HASH_MURMUR, key, strlen(key)));
 }
 
 /**
  * Adds a new hash to the HLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return 1 if a register changed, 0 otherwise. A sparse
+ * HLL buffers new entries, so it always returns 1.
  */
-void hll_add_hash(hll_t *h, uint64_t hash) {
-    // Determine the index using the first p bits
-    int idx = hash >> (64 - h->precision);
-
-    // Shift out the index bits
-    hash = hash << h->precision | (1 << (h->precision -1));
-
-    // Determine the count of leading zeros
-    int leading = __builtin_clzll(hash) + 1;
+int hll_add_hash(hll_t *h, uint64_t hash) {
+    // Sparse entries are buffered and merged in batches
+    if (h->sparse) {
+        int leading;
+        int idx = hash_register(hash, h->precision, &leading);
+        sparse_insert(h->sparse, SPARSE_ENTRY(idx, leading));
+        return 1;
+    }
 
     // Update the register if the new value is larger
-    if (leading > get_register(h, idx)) {
-        set_register(h, idx, leading);
-    }
+    return h->kernels->add_hash(h, hash);
 }
 
-/*
- * Returns the bias correctors from the
- * hyperloglog paper
+/**
+ * Adds a batch of hashes to the HLL. The target
+ * registers are prefetched before they are updated.
+ * @arg h The hll to add to
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed. A sparse
+ * HLL buffers new entries, so it always returns num.
  */
-static double alpha(unsigned char precision) {
-    switch (precision) {
-        case 4:
-            return 0.673;
-        case 5:
-            return 0.697;
-        case 6:
-            return 0.709;
-        default:
-            return 0.7213 / (1 + 1.079 / NUM_REG(precision));
+int hll_add_hashes(hll_t *h, const uint64_t *hashes, int num) {
+    // Sparse entries are buffered, so there is nothing to prefetch
+    if (h->sparse) {
+        for (int i=0; i < num; i++) hll_add_hash(h, hashes[i]);
+        return num;
     }
+    return h->kernels->add_hashes(h, hashes, num);
 }
 
 /*
@@ -178,14 +866,26 @@ static double alpha(unsigned char precision) {
 static double raw_estimate(hll_t *h, int *num_zero) {
     unsigned char precision = h->precision;
     int num_reg = NUM_REG(precision);
-    double multi = alpha(precision) * num_reg * num_reg;
+    double multi = h->kernels->alpha_mm;
 
-    int reg_val;
-    double inv_sum = 0;
-    for (int i=0; i < num_reg; i++) {
-        reg_val = get_register(h, i);
-        inv_sum += pow(2.0, -1 * reg_val);
-        if (!reg_val) *num_zero += 1;
+    // Sparse entries are the only non-zero registers
+    double inv_sum;
+    struct hll_sparse *sp = h->sparse;
+    if (sp) {
+        sparse_compact(sp);
+        uint32_t offset = 0, val = 0, delta = 0;
+        inv_sum = num_reg - sp->num_entries;
+        *num_zero += num_reg - sp->num_entries;
+        for (uint32_t i=0; i < sp->num_entries; i++) {
+            varint_decode(sp->buf, sp->len, &offset, &delta);
+            val += delta;
+            inv_sum += inversePow2[SPARSE_RHO(val)];
+        }
+
+    // Dense registers maintain the harmonic sum as they change
+    } else {
+        inv_sum = ldexp((double)h->inv_sum, -SUM_SHIFT(precision));
+        *num_zero += h->num_zero;
     }
     return multi * (1.0 / inv_sum);
 }
@@ -255,11 +955,15 @@ static double bias_estimate(hll_t *h, double raw_est) {
 }
 
 /**
- * Estimates the cardinality of the HLL
+ * Estimates the cardinality of the HLL. Precisions past
+ * the empirical bias data use the histogram estimator.
  * @arg h The hll to query
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h) {
+    if (h->precision > HLL_MAX_BIAS_PRECISION)
+        return hll_size_ertl(h);
+
     int num_zero = 0;
     double raw_est = raw_estimate(h, &num_zero);
 
@@ -286,6 +990,619 @@ double hll_size(hll_t *h) {
 }
 
 
+/*
+ * Helpers for the improved estimator. sigma and tau are
+ * the series from the paper, computed until they converge.
+ */
+static double ertl_sigma(double x) {
+    if (x == 1) return INFINITY;
+    double y = 1, z = x, prev;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (z != prev);
+    return z;
+}
+
+static double ertl_tau(double x) {
+    if (x == 0 || x == 1) return 0;
+    double y = 1, z = 1 - x, prev;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (z != prev);
+    return z / 3;
+}
+
+/**
+ * Computes the size using the improved estimator from
+ * Ertl, "New cardinality estimation algorithms for
+ * HyperLogLog sketches". It works on a histogram of the
+ * register values, and needs no bias correction or
+ * switch to linear counting.
+ * @arg h The hll to query
+ * @return An estimate of the cardinality
+ */
+double hll_size_ertl(hll_t *h) {
+    int num_reg = NUM_REG(h->precision);
+    uint32_t hist[64];
+    memset(hist, 0, sizeof(hist));
+
+    // Build the histogram of register values
+    struct hll_sparse *sp = h->sparse;
+    if (sp) {
+        sparse_compact(sp);
+        uint32_t offset = 0, val = 0, delta = 0;
+        hist[0] = num_reg - sp->num_entries;
+        for (uint32_t i=0; i < sp->num_entries; i++) {
+            varint_decode(sp->buf, sp->len, &offset, &delta);
+            val += delta;
+            hist[SPARSE_RHO(val)]++;
+        }
+    } else if (h->format == HLL_BYTE)
+        hll_histogram_bytes((unsigned char*)h->registers, num_reg, hist);
+    else if (h->format == HLL_NIBBLE)
+        hll_histogram_nibble((uint64_t*)h->registers, num_reg, hist);
+    else
+        hll_histogram_packed(h->registers, num_reg, hist);
+
+    // Registers range from 0 to q+1, where q are the hash bits left
+    int q = 64 - h->precision;
+    double m = num_reg;
+    double z = m * ertl_tau(1 - hist[q+1] / m);
+    for (int k=q; k >= 1; k--) {
+        z = 0.5 * (z + hist[k]);
+    }
+    z += m * ertl_sigma(hist[0] / m);
+    return (m * m) / (2 * log(2) * z);
+}
+
+/**
+ * Computes the size using the given estimator
+ * @arg h The hll to query
+ * @arg estimator The estimator to use
+ * @return An estimate of the cardinality
+ */
+double hll_estimate(hll_t *h, hll_estimator estimator) {
+    if (estimator == HLL_ESTIMATOR_ERTL)
+        return hll_size_ertl(h);
+    return hll_size(h);
+}
+
+
+/*
+ * Returns the value of a register folded down by k bits of
+ * precision. The low k bits of its index become the leading
+ * bits of the rest of its hashes, so the zeros counted start
+ * with those, and only go on into the old value if they are
+ * all zero.
+ */
+static inline int fold_register(uint32_t low, int val, int k) {
+    if (!val) return 0;
+    if (low) return __builtin_clz(low) - (32 - k) + 1;
+    return val + k;
+}
+
+/*
+ * Folds a register entry down by k bits of precision
+ */
+static inline uint32_t fold_entry(uint32_t entry, int k) {
+    uint32_t idx = SPARSE_IDX(entry);
+    return SPARSE_ENTRY(idx >> k,
+            fold_register(idx & ((1 << k) - 1), SPARSE_RHO(entry), k));
+}
+
+/*
+ * Returns the largest folded value of the group of 1 << k
+ * dense registers that fold down into register idx
+ */
+static inline int fold_group(hll_t *h, int idx, int k) {
+    int max = 0, val;
+    for (uint32_t low=0; low < (1U << k); low++) {
+        val = fold_register(low, get_register(h, (idx << k) | low), k);
+        if (val > max) max = val;
+    }
+    return max;
+}
+
+/**
+ * Folds a register entry down to a lower precision
+ * @arg entry The register entry
+ * @arg from The precision of the entry
+ * @arg to The precision to fold to, at most from
+ * @return The folded entry
+ */
+uint32_t hll_fold_entry(uint32_t entry, unsigned char from, unsigned char to) {
+    return fold_entry(entry, from - to);
+}
+
+/**
+ * Merges the registers of src into dst, so that dst
+ * estimates the size of the union. A src of a higher
+ * precision is folded down as it is merged.
+ * @arg dst The hll to merge into. Updated in place.
+ * @arg src The hll to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower precision.
+ */
+int hll_union(hll_t *dst, hll_t *src) {
+    if (dst->precision > src->precision)
+        return -1;
+    int num_reg = NUM_REG(dst->precision);
+    int k = src->precision - dst->precision;
+
+    // Apply each sparse entry, both encoded and pending
+    struct hll_sparse *sp = src->sparse;
+    register_batch batch = {-1, {0}};
+    if (sp) {
+        uint32_t offset = 0, val = 0, delta = 0, entry;
+        for (uint32_t i=0; i < sp->num_entries; i++) {
+            varint_decode(sp->buf, sp->len, &offset, &delta);
+            val += delta;
+            entry = fold_entry(val, k);
+            if (dst->sparse)
+                sparse_insert(dst->sparse, entry);
+            else
+                batch_raise(dst, &batch, SPARSE_IDX(entry), SPARSE_RHO(entry));
+        }
+        batch_flush(dst, &batch);
+        for (uint32_t i=0; i < sp->tmp_len; i++) {
+            entry = fold_entry(sp->tmp[i], k);
+            raise_register(dst, SPARSE_IDX(entry), SPARSE_RHO(entry));
+        }
+
+    // Use the vectorized kernels if the layouts match. Nibble
+    // words may have other bases, so are merged by register.
+    } else if (!k && !dst->sparse && dst->format == src->format && dst->format != HLL_NIBBLE) {
+        hll_sum_delta delta = {SUM_SHIFT(dst->precision), 0, 0};
+        if (dst->format == HLL_BYTE)
+            hll_max_bytes((unsigned char*)dst->registers,
+                    (unsigned char*)src->registers, num_reg, &delta);
+        else
+            hll_max_packed(dst->registers, src->registers,
+                    INT_CEIL(num_reg, REG_PER_WORD), &delta);
+        apply_sum_delta(dst, &delta);
+
+        // The kernels do not track which pages they changed
+        if (dst->bm) bitmap_mark_range(dst->bm, 0, dst->bm->size);
+
+    // Otherwise merge register by register, folding each group
+    } else {
+        int val;
+        for (int i=0; i < num_reg; i++) {
+            val = (k) ? fold_group(src, i, k) : get_register(src, i);
+            if (!val) continue;
+            if (dst->sparse)
+                sparse_insert(dst->sparse, SPARSE_ENTRY(i, val));
+            else
+                batch_raise(dst, &batch, i, val);
+        }
+        batch_flush(dst, &batch);
+    }
+    return 0;
+}
+
+/**
+ * Folds the registers of an HLL down to a lower precision.
+ * Each group of registers sharing the leading bits of their
+ * index becomes one register, holding the largest value the
+ * hashes of the group would have set at that precision. This
+ * is lossless, so the result is exactly the HLL of the same
+ * hashes at the lower precision. A sparse HLL stays sparse.
+ * @arg h The hll to fold. Dense registers must not be in a
+ * bitmap, as they shrink.
+ * @arg precision The new precision, at most the current one
+ * @return 0 on success, -1 on error.
+ */
+int hll_fold(hll_t *h, unsigned char precision) {
+    if (precision < HLL_MIN_PRECISION || precision > h->precision || (!h->sparse && h->bm))
+        return -1;
+    if (precision == h->precision) return 0;
+
+    // Fold by merging into a new HLL of the lower precision
+    hll_t folded;
+    int res = (h->sparse) ? hll_init_sparse(precision, h->format, &folded) :
+        hll_init(precision, h->format, &folded);
+    if (res) return -1;
+    hll_union(&folded, h);
+    hll_destroy(h);
+    *h = folded;
+    return 0;
+}
+
+/**
+ * Returns the register entry that a hash raises.
+ * @arg precision The precision of the HLL
+ * @arg hash The hash
+ * @return The register entry
+ */
+uint32_t hll_hash_entry(unsigned char precision, uint64_t hash) {
+    int leading;
+    int idx = hash_register(hash, precision, &leading);
+    return SPARSE_ENTRY(idx, leading);
+}
+
+/**
+ * Raises registers to at least the value of each entry.
+ * Entries of registers out of range are ignored.
+ * @arg h The hll to update
+ * @arg entries The register entries
+ * @arg num The number of entries
+ * @return The number of entries applied
+ */
+int hll_raise_registers(hll_t *h, const uint32_t *entries, int num) {
+    uint32_t num_reg = NUM_REG(h->precision);
+    int max_val = 64 - h->precision + 1, applied = 0;
+    register_batch batch = {-1, {0}};
+    for (int i=0; i < num; i++) {
+        uint32_t idx = SPARSE_IDX(entries[i]);
+        int val = SPARSE_RHO(entries[i]);
+        if (idx >= num_reg || !val || val > max_val) continue;
+        if (h->sparse)
+            sparse_insert(h->sparse, entries[i]);
+        else
+            batch_raise(h, &batch, idx, val);
+        applied++;
+    }
+    batch_flush(h, &batch);
+    return applied;
+}
+
+/**
+ * Lists an entry for each register that is not zero,
+ * in order of register.
+ * @arg h The hll to read
+ * @arg entries Output buffer, with room for an entry per register
+ * @return The number of entries
+ */
+int hll_register_entries(hll_t *h, uint32_t *entries) {
+    int num = 0;
+    struct hll_sparse *sp = h->sparse;
+    if (sp) {
+        // Merge pending entries, so each register appears once
+        sparse_compact(sp);
+        uint32_t offset = 0, val = 0, delta = 0;
+        for (uint32_t i=0; i < sp->num_entries; i++) {
+            varint_decode(sp->buf, sp->len, &offset, &delta);
+            val += delta;
+            entries[num++] = val;
+        }
+        for (uint32_t i=0; i < sp->tmp_len && num < NUM_REG(h->precision); i++)
+            entries[num++] = sp->tmp[i];
+        return num;
+    }
+
+    int num_reg = NUM_REG(h->precision), val;
+    for (int i=0; i < num_reg; i++) {
+        val = get_register(h, i);
+        if (val) entries[num++] = SPARSE_ENTRY(i, val);
+    }
+    return num;
+}
+
+
+/*
+ * Thread-local scratch pool. Uses a pthread key so
+ * the registers are released when a thread exits.
+ */
+static pthread_key_t SCRATCH_KEY;
+static pthread_once_t SCRATCH_ONCE = PTHREAD_ONCE_INIT;
+
+static void scratch_destroy(void *pool) {
+    hll_t *hlls = pool;
+    for (int i=0; i < HLL_SCRATCH_SLOTS; i++) {
+        if (hlls[i].registers) hll_destroy(hlls + i);
+    }
+    free(hlls);
+}
+
+static void scratch_key_init() {
+    pthread_key_create(&SCRATCH_KEY, scratch_destroy);
+}
+
+/**
+ * Zeroes the registers of a dense HLL in place,
+ * so that it can be re-used without reallocating.
+ * Must not race with updates to the registers.
+ * @arg h The HLL to clear
+ * @return 0 on success, -1 if sparse.
+ */
+int hll_clear(hll_t *h) {
+    if (h->sparse) return -1;
+    uint64_t bytes = hll_bytes_for_precision(h->precision, h->format);
+    memset(h->registers, 0, bytes);
+    if (h->bm) bitmap_mark_range(h->bm, 0, bytes);
+    reset_sum(h);
+    return 0;
+}
+
+/**
+ * Copies dense registers into an HLL, as laid out
+ * in its bitmap or registers, and rebuilds the
+ * estimator state. Must not race with updates.
+ * @arg h The dense HLL to load into
+ * @arg buf The registers
+ * @arg len The length of the registers, which must
+ * be hll_bytes_for_precision
+ * @return 0 on success, -1 if the length differs or sparse.
+ */
+int hll_load_registers(hll_t *h, const unsigned char *buf, uint64_t len) {
+    if (h->sparse || len != hll_bytes_for_precision(h->precision, h->format))
+        return -1;
+    memcpy(h->registers, buf, len);
+    if (h->bm) bitmap_mark_range(h->bm, 0, len);
+    rebuild_sum(h);
+    return 0;
+}
+
+/**
+ * Checks that no dense register holds more than the
+ * largest value a hash can raise it to at the precision
+ * @arg h The dense HLL to check
+ * @return 1 if the registers are valid, 0 otherwise.
+ */
+int hll_registers_valid(hll_t *h) {
+    if (h->sparse) return 0;
+    int num_reg = NUM_REG(h->precision), max_val = 64 - h->precision + 1;
+    for (int i=0; i < num_reg; i++) {
+        if (get_register(h, i) > max_val) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns a zeroed, dense scratch HLL from a thread-local
+ * pool. The registers are re-used by later calls for the same
+ * slot on this thread, so the HLL must not be destroyed, or
+ * used once the thread exits.
+ * @arg precision The digits of precision to use
+ * @arg slot The slot to use, less than HLL_SCRATCH_SLOTS
+ * @return The scratch HLL, or NULL on error.
+ */
+hll_t* hll_scratch(unsigned char precision, int slot) {
+    if (slot < 0 || slot >= HLL_SCRATCH_SLOTS) return NULL;
+    pthread_once(&SCRATCH_ONCE, scratch_key_init);
+
+    // Get the pool for this thread
+    hll_t *hlls = pthread_getspecific(SCRATCH_KEY);
+    if (!hlls) {
+        hlls = calloc(HLL_SCRATCH_SLOTS, sizeof(hll_t));
+        if (!hlls) return NULL;
+        pthread_setspecific(SCRATCH_KEY, hlls);
+    }
+
+    // Re-use the registers if the precision matches. Scratch
+    // HLLs use bytes, since they are mostly merged and estimated.
+    hll_t *h = hlls + slot;
+    if (h->registers && h->precision == precision) {
+        hll_clear(h);
+        return h;
+    }
+    if (h->registers) hll_destroy(h);
+    if (hll_init(precision, HLL_BYTE, h)) {
+        h->registers = NULL;
+        return NULL;
+    }
+    return h;
+}
+
+
+/**
+ * Checks if a sparse HLL has grown past the point
+ * where the dense representation is more compact.
+ * @return 1 if the HLL should be converted.
+ */
+int hll_sparse_should_convert(hll_t *h) {
+    struct hll_sparse *sp = h->sparse;
+    if (!sp) return 0;
+    uint64_t dense = hll_bytes_for_precision(h->precision, h->format);
+    return sp->len + sp->tmp_len * sizeof(uint32_t) > dense / 2;
+}
+
+
+/**
+ * Returns the bytes of memory used by a sparse HLL.
+ * @return The bytes used, or 0 if dense.
+ */
+uint64_t hll_sparse_bytes(hll_t *h) {
+    struct hll_sparse *sp = h->sparse;
+    if (!sp) return 0;
+    return sizeof(struct hll_sparse) + sp->len + sp->tmp_cap * sizeof(uint32_t);
+}
+
+
+/**
+ * Encodes a sparse HLL into a buffer that can be
+ * stored and restored with hll_init_sparse_from_buffer.
+ * @arg h The HLL to encode
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 if not sparse.
+ */
+int hll_sparse_encode(hll_t *h, unsigned char **buf, uint64_t *len) {
+    struct hll_sparse *sp = h->sparse;
+    if (!sp || sparse_compact(sp)) return -1;
+
+    sparse_header header = {SPARSE_MAGIC, h->precision, sp->num_entries, sp->len};
+    *len = sizeof(header) + sp->len;
+    *buf = malloc(*len);
+    if (!*buf) return -1;
+    memcpy(*buf, &header, sizeof(header));
+    if (sp->len) memcpy(*buf + sizeof(header), sp->buf, sp->len);
+    return 0;
+}
+
+
+/**
+ * Converts a sparse HLL to the dense representation.
+ * @arg h The HLL to convert
+ * @arg bm The bitmap to store the registers in. Must be sized
+ * using hll_bytes_for_precision. If NULL, the registers are
+ * allocated. Registers already set in the bitmap are kept.
+ * @return 0 on success, -1 on error.
+ */
+int hll_convert_dense(hll_t *h, hlld_bitmap *bm) {
+    struct hll_sparse *sp = h->sparse;
+    if (!sp || sparse_compact(sp)) return -1;
+
+    // Setup the dense registers
+    uint64_t bytes = hll_bytes_for_precision(h->precision, h->format);
+    if (bm) {
+        if (bm->size != bytes) return -1;
+        h->registers = (uint32_t*)bm->mmap;
+    } else {
+        h->registers = calloc(1, bytes);
+        if (!h->registers) return -1;
+    }
+    h->bm = bm;
+    rebuild_sum(h);
+
+    // Apply each entry
+    uint32_t offset = 0, val = 0, delta = 0;
+    register_batch batch = {-1, {0}};
+    for (uint32_t i=0; i < sp->num_entries; i++) {
+        varint_decode(sp->buf, sp->len, &offset, &delta);
+        val += delta;
+        batch_raise(h, &batch, SPARSE_IDX(val), SPARSE_RHO(val));
+    }
+    batch_flush(h, &batch);
+
+    // Publish the registers before clearing sparse, since
+    // readers check the sparse pointer without a lock
+    __sync_synchronize();
+    h->sparse = NULL;
+    sparse_free(sp);
+    return 0;
+}
+
+
+/**
+ * Encodes a dense HLL into the compact cold format, which
+ * can be restored with hll_init_from_cold_buffer.
+ * @arg h The HLL to encode
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 if not dense.
+ */
+int hll_cold_encode(hll_t *h, unsigned char **buf, uint64_t *len) {
+    if (h->sparse || !h->registers) return -1;
+    int num_reg = NUM_REG(h->precision);
+    uint32_t hist[64];
+    memset(hist, 0, sizeof(hist));
+    if (h->format == HLL_BYTE)
+        hll_histogram_bytes((unsigned char*)h->registers, num_reg, hist);
+    else if (h->format == HLL_NIBBLE)
+        hll_histogram_nibble((uint64_t*)h->registers, num_reg, hist);
+    else
+        hll_histogram_packed(h->registers, num_reg, hist);
+
+    // Pick the base that covers the most registers
+    uint32_t covered = 0, best = 0;
+    int base = 0;
+    for (int i=0; i < COLD_ESCAPE; i++) covered += hist[i];
+    best = covered;
+    for (int b=1; b + COLD_ESCAPE <= 64; b++) {
+        covered += hist[b + COLD_ESCAPE - 1] - hist[b - 1];
+        if (covered > best) {
+            best = covered;
+            base = b;
+        }
+    }
+
+    cold_header header = {COLD_MAGIC, h->precision, base, num_reg - best};
+    *len = sizeof(header) + num_reg / 2 + header.num_escaped;
+    *buf = malloc(*len);
+    if (!*buf) return -1;
+    memcpy(*buf, &header, sizeof(header));
+
+    // Store the offsets two per byte, escaping as we go
+    unsigned char *offsets = *buf + sizeof(header);
+    unsigned char *escaped = offsets + num_reg / 2;
+    for (int i=0; i < num_reg; i += 2) {
+        int pair = 0;
+        for (int j=0; j < 2; j++) {
+            int val = get_register(h, i + j);
+            int off = val - base;
+            if (off < 0 || off >= COLD_ESCAPE) {
+                off = COLD_ESCAPE;
+                *escaped++ = val;
+            }
+            pair |= off << (4 * j);
+        }
+        offsets[i / 2] = pair;
+    }
+    return 0;
+}
+
+
+/**
+ * Checks if a buffer holds a cold encoded HLL
+ * @arg buf The buffer
+ * @arg len The length of the buffer
+ * @return 1 if the buffer has the cold header.
+ */
+int hll_is_cold_buffer(const unsigned char *buf, uint64_t len) {
+    cold_header header;
+    if (len < sizeof(header)) return 0;
+    memcpy(&header, buf, sizeof(header));
+    return header.magic == COLD_MAGIC;
+}
+
+
+/**
+ * Initializes a dense HLL from a buffer produced
+ * by hll_cold_encode.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout of the bitmap
+ * @arg bm The bitmap to store the registers in. Must be sized
+ * using hll_bytes_for_precision and zeroed.
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @arg h The HLL to initialize
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_init_from_cold_buffer(unsigned char precision, hll_format format,
+        hlld_bitmap *bm, const unsigned char *buf, uint64_t len, hll_t *h) {
+    // Verify the header
+    cold_header header;
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+    if (len < sizeof(header)) return -1;
+    memcpy(&header, buf, sizeof(header));
+    int num_reg = NUM_REG(precision);
+    if (header.magic != COLD_MAGIC || header.precision != precision ||
+        header.base > (uint32_t)(64 - precision + 1) ||
+        len != sizeof(header) + num_reg / 2 + header.num_escaped)
+        return -1;
+
+    // Verify the escaped registers are accounted for
+    const unsigned char *offsets = buf + sizeof(header);
+    const unsigned char *escaped = offsets + num_reg / 2;
+    uint32_t num_escaped = 0;
+    for (int i=0; i < num_reg / 2; i++) {
+        num_escaped += (offsets[i] & 0xf) == COLD_ESCAPE;
+        num_escaped += (offsets[i] >> 4) == COLD_ESCAPE;
+    }
+    if (num_escaped != header.num_escaped) return -1;
+    for (uint32_t i=0; i < num_escaped; i++) {
+        if (escaped[i] > 64 - precision + 1) return -1;
+    }
+
+    if (hll_init_from_bitmap(precision, format, bm, h)) return -1;
+    register_batch batch = {-1, {0}};
+    for (int i=0; i < num_reg; i++) {
+        int off = (offsets[i / 2] >> (4 * (i & 1))) & 0xf;
+        int val = (off == COLD_ESCAPE) ? *escaped++ : (int)header.base + off;
+        if (val) batch_raise(h, &batch, i, val);
+    }
+    batch_flush(h, &batch);
+    return 0;
+}
+
+
 /**
  * Computes the minimum number of registers
  * needed to hit a target error.
@@ -331,9 +1648,10 @@ double hll_error_for_precision(int prec) {
  * Computes the bytes required for a HLL of the
  * given precision.
  * @arg prec The precision to use
+ * @arg format The register layout to use
  * @return The bytes required or 0 on error.
  */
-uint64_t hll_bytes_for_precision(int prec) {
+uint64_t hll_bytes_for_precision(int prec, hll_format format) {
     // Check that the error bound is sane
     if (prec < HLL_MIN_PRECISION || prec > HLL_MAX_PRECISION)
         return 0;
@@ -341,10 +1659,307 @@ uint64_t hll_bytes_for_precision(int prec) {
     // Determine how many registers are needed
     int reg = NUM_REG(prec);
 
-    // Get the full words required
-    int words = INT_CEIL(reg, REG_PER_WORD);
+    switch (format) {
+        case HLL_PACKED:
+            // Get the full words required, convert to byte size
+            return INT_CEIL(reg, REG_PER_WORD) * sizeof(uint32_t);
+
+        case HLL_BYTE:
+            return reg;
+
+        case HLL_NIBBLE:
+            return INT_CEIL(reg, NIBBLE_PER_WORD) * sizeof(uint64_t);
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Converts a format name into a format.
+ * @arg name The name of the format, e.g. "packed"
+ * @arg format Output, the matching format
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_format_from_name(const char *name, hll_format *format) {
+    if (strcasecmp(name, "packed") == 0) {
+        *format = HLL_PACKED;
+    } else if (strcasecmp(name, "byte") == 0) {
+        *format = HLL_BYTE;
+    } else if (strcasecmp(name, "nibble") == 0) {
+        *format = HLL_NIBBLE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the name of a register format.
+ * @arg format The format
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_format_name(hll_format format) {
+    switch (format) {
+        case HLL_PACKED:
+            return "packed";
+        case HLL_BYTE:
+            return "byte";
+        case HLL_NIBBLE:
+            return "nibble";
+        default:
+            return NULL;
+    }
+}
+
+
+/**
+ * Parses the name of an estimator, either "bias" or "ertl".
+ * @arg name The name to parse
+ * @arg estimator Output, the matching estimator
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_estimator_from_name(const char *name, hll_estimator *estimator) {
+    if (strcasecmp(name, "bias") == 0) {
+        *estimator = HLL_ESTIMATOR_BIAS;
+    } else if (strcasecmp(name, "ertl") == 0) {
+        *estimator = HLL_ESTIMATOR_ERTL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the name of an estimator.
+ * @arg estimator The estimator
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_estimator_name(hll_estimator estimator) {
+    switch (estimator) {
+        case HLL_ESTIMATOR_BIAS:
+            return "bias";
+        case HLL_ESTIMATOR_ERTL:
+            return "ertl";
+        default:
+            return NULL;
+    }
+}
+
+
+/**
+ * Initializes a sliding HLL with no pairs
+ * @arg precision The digits of precision to use
+ * @arg max_window The longest window to keep, in seconds
+ * @arg s The sliding HLL to initialize
+ * @return 0 on success, -1 on error.
+ */
+int hll_sliding_init(unsigned char precision, uint32_t max_window, hll_sliding *s) {
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION || !max_window)
+        return -1;
+    s->precision = precision;
+    s->max_window = max_window;
+    s->dirty = 0;
+    s->regs = calloc(NUM_REG(precision), sizeof(struct hll_sliding_reg));
+    if (!s->regs) return -1;
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+/**
+ * Destroys a sliding HLL, freeing its registers
+ */
+void hll_sliding_destroy(hll_sliding *s) {
+    free(s->regs);
+    s->regs = NULL;
+    pthread_mutex_destroy(&s->lock);
+}
+
+/*
+ * Adds a value seen at a time to a register. Pairs that are
+ * no larger are dropped, since the new pair outlives them,
+ * as are pairs older than the longest window.
+ * @return 1 if the register changed.
+ */
+static int sliding_insert(hll_sliding *s, struct hll_sliding_reg *reg, uint32_t now, int rho) {
+    int len = 0;
+    while (len < HLL_SLIDING_PAIRS && reg->rhos[len]) len++;
+
+    // A clock that goes back is held at the newest pair
+    if (len && now < reg->times[len - 1]) now = reg->times[len - 1];
+    if (len && now == reg->times[len - 1] && reg->rhos[len - 1] >= rho) return 0;
+    while (len && reg->rhos[len - 1] <= rho) len--;
+
+    // Expired pairs are the oldest, and a full register drops one
+    int expired = 0;
+    while (expired < len && now - reg->times[expired] >= s->max_window) expired++;
+    if (expired == 0 && len == HLL_SLIDING_PAIRS) expired = 1;
+    if (expired) {
+        len -= expired;
+        memmove(reg->times, reg->times + expired, len * sizeof(uint32_t));
+        memmove(reg->rhos, reg->rhos + expired, len);
+    }
+    reg->times[len] = now;
+    reg->rhos[len++] = rho;
+    if (len < HLL_SLIDING_PAIRS)
+        memset(reg->rhos + len, 0, HLL_SLIDING_PAIRS - len);
+    return 1;
+}
 
-    // Convert to byte size
-    return words * sizeof(uint32_t);
+/**
+ * Adds hashes seen at a given time
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed.
+ */
+int hll_sliding_add_hashes(hll_sliding *s, uint64_t now, const uint64_t *hashes, int num) {
+    int changed = 0, leading;
+    pthread_mutex_lock(&s->lock);
+    for (int i=0; i < num; i++) {
+        int idx = hash_register(hashes[i], s->precision, &leading);
+        changed += sliding_insert(s, s->regs + idx, now, leading);
+    }
+    if (changed) s->dirty = 1;
+    pthread_mutex_unlock(&s->lock);
+    return changed;
 }
 
+/**
+ * Adds the registers of an HLL as seen at a given time
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg src The HLL to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower
+ * precision, as a higher one is folded down.
+ */
+int hll_sliding_union(hll_sliding *s, uint64_t now, hll_t *src) {
+    if (s->precision > src->precision) return -1;
+    int k = src->precision - s->precision;
+    pthread_mutex_lock(&s->lock);
+    struct hll_sparse *sp = src->sparse;
+    if (sp) {
+        uint32_t offset = 0, val = 0, delta = 0, entry;
+        for (uint32_t i=0; i < sp->num_entries; i++) {
+            varint_decode(sp->buf, sp->len, &offset, &delta);
+            val += delta;
+            entry = fold_entry(val, k);
+            sliding_insert(s, s->regs + SPARSE_IDX(entry), now, SPARSE_RHO(entry));
+        }
+        for (uint32_t i=0; i < sp->tmp_len; i++) {
+            entry = fold_entry(sp->tmp[i], k);
+            sliding_insert(s, s->regs + SPARSE_IDX(entry), now, SPARSE_RHO(entry));
+        }
+    } else {
+        int num_reg = NUM_REG(s->precision), val;
+        for (int i=0; i < num_reg; i++) {
+            val = (k) ? fold_group(src, i, k) : get_register(src, i);
+            if (val) sliding_insert(s, s->regs + i, now, val);
+        }
+    }
+    s->dirty = 1;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**
+ * Raises the registers of an HLL to the largest value
+ * of each register over the last window seconds, so that
+ * any estimator can be used on the window. The window is
+ * capped at max_window, and always covers the current second.
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg window The seconds to cover
+ * @arg h The HLL to raise
+ * @return 0 on success, -1 if the precisions differ.
+ */
+int hll_sliding_merge_into(hll_sliding *s, uint64_t now, uint64_t window, hll_t *h) {
+    if (h->precision != s->precision) return -1;
+    if (window > s->max_window) window = s->max_window;
+    if (!window) window = 1;
+
+    // The oldest pair in the window holds its largest value
+    int num_reg = NUM_REG(s->precision);
+    pthread_mutex_lock(&s->lock);
+    for (int i=0; i < num_reg; i++) {
+        struct hll_sliding_reg *reg = s->regs + i;
+        for (int j=0; j < HLL_SLIDING_PAIRS && reg->rhos[j]; j++) {
+            if (reg->times[j] > now) break;
+            if (now - reg->times[j] < window) {
+                raise_register(h, i, reg->rhos[j]);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**
+ * Returns the bytes used by the registers of a sliding HLL
+ * @arg prec The precision
+ */
+uint64_t hll_sliding_bytes(int prec) {
+    return (uint64_t)NUM_REG(prec) * sizeof(struct hll_sliding_reg);
+}
+
+/**
+ * Encodes the registers of a sliding HLL, so that it can be saved
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int hll_sliding_encode(hll_sliding *s, unsigned char **buf, uint64_t *len) {
+    uint64_t bytes = hll_sliding_bytes(s->precision);
+    *len = sizeof(sliding_header) + bytes;
+    unsigned char *out = *buf = malloc(*len);
+    if (!out) return -1;
+
+    sliding_header header = {SLIDING_MAGIC, s->precision, s->max_window, HLL_SLIDING_PAIRS};
+    memcpy(out, &header, sizeof(sliding_header));
+
+    // Cleared before copying, so that later changes are saved again
+    pthread_mutex_lock(&s->lock);
+    s->dirty = 0;
+    memcpy(out + sizeof(sliding_header), s->regs, bytes);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**
+ * Loads the registers of a sliding HLL from a buffer produced
+ * by hll_sliding_encode, which must match its precision and
+ * longest window.
+ * @arg s The sliding HLL, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_sliding_decode(hll_sliding *s, const unsigned char *buf, uint64_t len) {
+    uint64_t bytes = hll_sliding_bytes(s->precision);
+    sliding_header header;
+    if (len != sizeof(sliding_header) + bytes) return -1;
+    memcpy(&header, buf, sizeof(sliding_header));
+    if (header.magic != SLIDING_MAGIC || header.precision != s->precision ||
+            header.max_window != s->max_window || header.pairs != HLL_SLIDING_PAIRS)
+        return -1;
+
+    // Each register must hold falling values in range
+    const struct hll_sliding_reg *regs = (const void*)(buf + sizeof(sliding_header));
+    int num_reg = NUM_REG(s->precision), max_val = 64 - s->precision + 1;
+    for (int i=0; i < num_reg; i++) {
+        for (int j=0; j < HLL_SLIDING_PAIRS && regs[i].rhos[j]; j++) {
+            if (regs[i].rhos[j] > max_val || (j && (regs[i].rhos[j] >= regs[i].rhos[j - 1] ||
+                    regs[i].times[j] < regs[i].times[j - 1])))
+                return -1;
+        }
+    }
+    memcpy(s->regs, regs, bytes);
+    return 0;
+}
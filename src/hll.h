@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <pthread.h>
 #include "bitmap.h"
 
 #ifndef HLL_H
@@ -6,30 +7,93 @@
 
 // Ensure precision in a sane bound
 #define HLL_MIN_PRECISION 4      // 16 registers
-#define HLL_MAX_PRECISION 18     // 262,144 registers
+#define HLL_MAX_PRECISION 22     // 4,194,304 registers
+
+// Largest precision with empirical bias data. Larger
+// precisions always use the histogram estimator.
+#define HLL_MAX_BIAS_PRECISION 18
+
+/**
+ * The layout used to store the registers.
+ */
+typedef enum {
+    HLL_PACKED  = 0, // 6 bit registers, packed 5 per 32bit word
+    HLL_BYTE    = 1, // One register per byte. Larger, but faster.
+    HLL_NIBBLE  = 2  // 4 bit offsets from a base, 15 per 64bit word
+} hll_format;
+
+/**
+ * The estimator used to compute the size.
+ */
+typedef enum {
+    HLL_ESTIMATOR_BIAS = 0, // Raw estimate with empirical bias correction
+    HLL_ESTIMATOR_ERTL = 1  // Improved estimator over the register histogram
+} hll_estimator;
+
+/*
+ * Opaque sparse representation. Holds the sorted, varint
+ * encoded (index, rho) pairs until the HLL is converted.
+ */
+struct hll_sparse;
+
+/*
+ * Opaque table of kernels specialized for the
+ * precision and register format of an HLL.
+ */
+struct hll_kernels;
 
 typedef struct {
     unsigned char precision;
-    uint32_t *registers;
+    hll_format format;       // Dense format, or the format to convert to
+    uint32_t *registers;     // NULL while sparse
     hlld_bitmap *bm;
+    struct hll_sparse *sparse; // Non-NULL while sparse
+    const struct hll_kernels *kernels; // Specialized dense kernels
+    volatile uint64_t inv_sum; // Fixed point harmonic sum, maintained while dense
+    volatile int num_zero;     // Zero registers, maintained while dense
 } hll_t;
 
 /**
  * Initializes a new HLL
  * @arg precision The digits of precision to use
+ * @arg format The register layout to use
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init(unsigned char precision, hll_t *h);
+int hll_init(unsigned char precision, hll_format format, hll_t *h);
 
 /**
  * Initializes a new HLL from a bitmap
  * @arg precision The digits of precision to use
+ * @arg format The register layout of the bitmap
  * @arg bm The bitmap to use
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h);
+int hll_init_from_bitmap(unsigned char precision, hll_format format, hlld_bitmap *bm, hll_t *h);
+
+/**
+ * Initializes a new HLL using the sparse representation.
+ * The HLL stays sparse until converted with hll_convert_dense.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout to use once dense
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_sparse(unsigned char precision, hll_format format, hll_t *h);
+
+/**
+ * Initializes a sparse HLL from a buffer produced
+ * by hll_sparse_encode.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout to use once dense
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @arg h The HLL to initialize
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_init_sparse_from_buffer(unsigned char precision, hll_format format,
+        const unsigned char *buf, uint64_t len, hll_t *h);
 
 /**
  * Destroys an hll. Closes the bitmap, but does not free it.
@@ -41,23 +105,234 @@ int hll_destroy(hll_t *h);
  * Adds a new key to the HLL
  * @arg h The hll to add to
  * @arg key The key to add
+ * @return 1 if a register changed, 0 otherwise.
  */
-void hll_add(hll_t *h, char *key);
+int hll_add(hll_t *h, char *key);
 
 /**
  * Adds a new hash to the HLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return 1 if a register changed, 0 otherwise. A sparse
+ * HLL buffers new entries, so it always returns 1.
  */
-void hll_add_hash(hll_t *h, uint64_t hash);
+int hll_add_hash(hll_t *h, uint64_t hash);
 
 /**
- * Estimates the cardinality of the HLL
+ * Adds a batch of hashes to the HLL. The target
+ * registers are prefetched before they are updated.
+ * @arg h The hll to add to
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed. A sparse
+ * HLL buffers new entries, so it always returns num.
+ */
+int hll_add_hashes(hll_t *h, const uint64_t *hashes, int num);
+
+/**
+ * Estimates the cardinality of the HLL. Precisions past
+ * HLL_MAX_BIAS_PRECISION use the histogram estimator.
+ * A sparse HLL compacts its pending entries, so
+ * it must not be queried concurrently with updates.
  * @arg h The hll to query
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h);
 
+/**
+ * Merges the registers of src into dst, so that dst
+ * estimates the size of the union. The HLLs may use
+ * different formats. A src of a higher precision is
+ * folded down as it is merged, as with hll_fold.
+ * A sparse src must not be concurrently updated.
+ * @arg dst The hll to merge into. Updated in place.
+ * @arg src The hll to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower precision.
+ */
+int hll_union(hll_t *dst, hll_t *src);
+
+/**
+ * Folds the registers of an HLL down to a lower precision.
+ * Each group of registers sharing the leading bits of their
+ * index becomes one register, holding the largest value the
+ * hashes of the group would have set at that precision. This
+ * is lossless, so the result is exactly the HLL of the same
+ * hashes at the lower precision. A sparse HLL stays sparse.
+ * @arg h The hll to fold. Dense registers must not be in a
+ * bitmap, as they shrink.
+ * @arg precision The new precision, at most the current one
+ * @return 0 on success, -1 on error.
+ */
+int hll_fold(hll_t *h, unsigned char precision);
+
+/**
+ * Folds a register entry down to a lower precision
+ * @arg entry The register entry
+ * @arg from The precision of the entry
+ * @arg to The precision to fold to, at most from
+ * @return The folded entry
+ */
+uint32_t hll_fold_entry(uint32_t entry, unsigned char from, unsigned char to);
+
+/**
+ * Register entries pack the index of a register above the
+ * value it is raised to, as the sparse representation does.
+ */
+#define HLL_ENTRY_BITS 6
+#define HLL_ENTRY(idx, val) (((uint32_t)(idx) << HLL_ENTRY_BITS) | (val))
+#define HLL_ENTRY_IDX(entry) ((entry) >> HLL_ENTRY_BITS)
+#define HLL_ENTRY_VAL(entry) ((entry) & ((1 << HLL_ENTRY_BITS) - 1))
+
+/**
+ * Returns the register entry that a hash raises.
+ * @arg precision The precision of the HLL
+ * @arg hash The hash
+ * @return The register entry
+ */
+uint32_t hll_hash_entry(unsigned char precision, uint64_t hash);
+
+/**
+ * Raises registers to at least the value of each entry.
+ * Entries of registers out of range are ignored.
+ * A sparse HLL must not be concurrently updated.
+ * @arg h The hll to update
+ * @arg entries The register entries
+ * @arg num The number of entries
+ * @return The number of entries applied
+ */
+int hll_raise_registers(hll_t *h, const uint32_t *entries, int num);
+
+/**
+ * Lists an entry for each register that is not zero,
+ * in order of register. A sparse HLL is compacted, so it
+ * must not be concurrently updated.
+ * @arg h The hll to read
+ * @arg entries Output buffer, with room for an entry per register
+ * @return The number of entries
+ */
+int hll_register_entries(hll_t *h, uint32_t *entries);
+
+/**
+ * Zeroes the registers of a dense HLL in place,
+ * so that it can be re-used without reallocating.
+ * Must not race with updates to the registers.
+ * @arg h The HLL to clear
+ * @return 0 on success, -1 if sparse.
+ */
+int hll_clear(hll_t *h);
+
+/**
+ * Copies dense registers into an HLL, as laid out
+ * in its bitmap or registers, and rebuilds the
+ * estimator state. Must not race with updates.
+ * @arg h The dense HLL to load into
+ * @arg buf The registers
+ * @arg len The length of the registers, which must
+ * be hll_bytes_for_precision
+ * @return 0 on success, -1 if the length differs or sparse.
+ */
+int hll_load_registers(hll_t *h, const unsigned char *buf, uint64_t len);
+
+/**
+ * Checks that no dense register holds more than the
+ * largest value a hash can raise it to at the precision
+ * @arg h The dense HLL to check
+ * @return 1 if the registers are valid, 0 otherwise.
+ */
+int hll_registers_valid(hll_t *h);
+
+/**
+ * The number of scratch HLLs available per thread
+ */
+#define HLL_SCRATCH_SLOTS 9
+
+/**
+ * Returns a zeroed, dense scratch HLL from a thread-local
+ * pool. The registers are re-used by later calls for the same
+ * slot on this thread, so the HLL must not be destroyed, or
+ * used once the thread exits.
+ * @arg precision The digits of precision to use
+ * @arg slot The slot to use, less than HLL_SCRATCH_SLOTS
+ * @return The scratch HLL, or NULL on error.
+ */
+hll_t* hll_scratch(unsigned char precision, int slot);
+
+/**
+ * Checks if the HLL is using the sparse representation
+ * @return 1 if sparse, 0 if dense.
+ */
+static inline int hll_is_sparse(hll_t *h) {
+    return h->sparse != NULL;
+}
+
+/**
+ * Checks if a sparse HLL has grown past the point
+ * where the dense representation is more compact.
+ * @return 1 if the HLL should be converted.
+ */
+int hll_sparse_should_convert(hll_t *h);
+
+/**
+ * Returns the bytes of memory used by a sparse HLL.
+ * @return The bytes used, or 0 if dense.
+ */
+uint64_t hll_sparse_bytes(hll_t *h);
+
+/**
+ * Encodes a sparse HLL into a buffer that can be
+ * stored and restored with hll_init_sparse_from_buffer.
+ * @arg h The HLL to encode
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 if not sparse.
+ */
+int hll_sparse_encode(hll_t *h, unsigned char **buf, uint64_t *len);
+
+/**
+ * Encodes a dense HLL into the compact cold format, which
+ * can be restored with hll_init_from_cold_buffer. Registers
+ * are stored as 4 bit offsets from a common base, and the
+ * few that do not fit are stored in full.
+ * @arg h The HLL to encode
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 if not dense.
+ */
+int hll_cold_encode(hll_t *h, unsigned char **buf, uint64_t *len);
+
+/**
+ * Checks if a buffer holds a cold encoded HLL
+ * @arg buf The buffer
+ * @arg len The length of the buffer
+ * @return 1 if the buffer has the cold header.
+ */
+int hll_is_cold_buffer(const unsigned char *buf, uint64_t len);
+
+/**
+ * Initializes a dense HLL from a buffer produced
+ * by hll_cold_encode.
+ * @arg precision The digits of precision to use
+ * @arg format The register layout of the bitmap
+ * @arg bm The bitmap to store the registers in. Must be sized
+ * using hll_bytes_for_precision and zeroed.
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @arg h The HLL to initialize
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_init_from_cold_buffer(unsigned char precision, hll_format format,
+        hlld_bitmap *bm, const unsigned char *buf, uint64_t len, hll_t *h);
+
+/**
+ * Converts a sparse HLL to the dense representation.
+ * @arg h The HLL to convert
+ * @arg bm The bitmap to store the registers in. Must be sized
+ * using hll_bytes_for_precision. If NULL, the registers are
+ * allocated. Registers already set in the bitmap are kept.
+ * @return 0 on success, -1 on error.
+ */
+int hll_convert_dense(hll_t *h, hlld_bitmap *bm);
+
 /**
  * Computes the minimum digits of precision
  * needed to hit a target error.
@@ -80,8 +355,163 @@ double hll_error_for_precision(int prec);
  * Computes the bytes required for a HLL of the
  * given precision.
  * @arg prec The precision to use
+ * @arg format The register layout to use
  * @return The bytes required or 0 on error.
  */
-uint64_t hll_bytes_for_precision(int prec);
+uint64_t hll_bytes_for_precision(int prec, hll_format format);
+
+/**
+ * Converts a format name into a format.
+ * @arg name The name of the format, e.g. "packed"
+ * @arg format Output, the matching format
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_format_from_name(const char *name, hll_format *format);
+
+/**
+ * Returns the name of a register format.
+ * @arg format The format
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_format_name(hll_format format);
+
+/**
+ * Computes the size using the improved estimator from
+ * Ertl, "New cardinality estimation algorithms for
+ * HyperLogLog sketches". It works on a histogram of the
+ * register values, and needs no bias correction or
+ * switch to linear counting.
+ * @arg h The hll to query
+ * @return An estimate of the cardinality
+ */
+double hll_size_ertl(hll_t *h);
+
+/**
+ * Computes the size using the given estimator
+ * @arg h The hll to query
+ * @arg estimator The estimator to use
+ * @return An estimate of the cardinality
+ */
+double hll_estimate(hll_t *h, hll_estimator estimator);
+
+/**
+ * Parses the name of an estimator, either "bias" or "ertl".
+ * @arg name The name to parse
+ * @arg estimator Output, the matching estimator
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_estimator_from_name(const char *name, hll_estimator *estimator);
+
+/**
+ * Returns the name of an estimator.
+ * @arg estimator The estimator
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_estimator_name(hll_estimator estimator);
+
+/**
+ * The most (timestamp, value) pairs kept per register of
+ * a sliding HLL. The pairs of a register have falling values,
+ * and expected lists are a few pairs long, so only a register
+ * that fills up drops its oldest pair.
+ */
+#define HLL_SLIDING_PAIRS 8
+
+/*
+ * Opaque list of the timestamped values of a register
+ */
+struct hll_sliding_reg;
+
+/*
+ * A sliding HLL timestamps its registers, as described in
+ * "Sliding HyperLogLog: Estimating cardinality in a data stream"
+ * by Chabchoub and Hebrail. Each register keeps the values that
+ * may still be its largest in a later window, so the registers
+ * of any window up to max_window can be recovered and estimated.
+ */
+typedef struct {
+    unsigned char precision;
+    uint32_t max_window;            // Longest window kept, in seconds
+    struct hll_sliding_reg *regs;
+    pthread_mutex_t lock;           // Serializes updates of the pairs
+    volatile int dirty;             // Set when a pair changes
+} hll_sliding;
+
+/**
+ * Initializes a sliding HLL with no pairs
+ * @arg precision The digits of precision to use
+ * @arg max_window The longest window to keep, in seconds
+ * @arg s The sliding HLL to initialize
+ * @return 0 on success, -1 on error.
+ */
+int hll_sliding_init(unsigned char precision, uint32_t max_window, hll_sliding *s);
+
+/**
+ * Destroys a sliding HLL, freeing its registers
+ */
+void hll_sliding_destroy(hll_sliding *s);
+
+/**
+ * Adds hashes seen at a given time
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed.
+ */
+int hll_sliding_add_hashes(hll_sliding *s, uint64_t now, const uint64_t *hashes, int num);
+
+/**
+ * Adds the registers of an HLL as seen at a given time
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg src The HLL to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower
+ * precision, as a higher one is folded down.
+ */
+int hll_sliding_union(hll_sliding *s, uint64_t now, hll_t *src);
+
+/**
+ * Raises the registers of an HLL to the largest value
+ * of each register over the last window seconds, so that
+ * any estimator can be used on the window. The window is
+ * capped at max_window, and always covers the current second.
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg now The current time, in seconds since the epoch
+ * @arg window The seconds to cover
+ * @arg h The HLL to raise
+ * @return 0 on success, -1 if the precisions differ.
+ */
+int hll_sliding_merge_into(hll_sliding *s, uint64_t now, uint64_t window, hll_t *h);
+
+/**
+ * Returns the bytes used by the registers of a sliding HLL
+ * @arg prec The precision
+ */
+uint64_t hll_sliding_bytes(int prec);
+
+/**
+ * Encodes the registers of a sliding HLL, so that it can be saved
+ * @note Thread safe.
+ * @arg s The sliding HLL
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int hll_sliding_encode(hll_sliding *s, unsigned char **buf, uint64_t *len);
+
+/**
+ * Loads the registers of a sliding HLL from a buffer produced
+ * by hll_sliding_encode, which must match its precision and
+ * longest window.
+ * @arg s The sliding HLL, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int hll_sliding_decode(hll_sliding *s, const unsigned char *buf, uint64_t len);
 
 #endif
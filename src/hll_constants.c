@@ -1,5 +1,17 @@
 #include "hll_constants.h"
 
+/*
+ * 2^-k for every possible register value. This avoids
+ * needing a pow() call per register in the estimators.
+ */
+#define INV_POW2(k) (1.0 / (double)(1ULL << (k)))
+#define INV_POW2_8(k) INV_POW2(k), INV_POW2(k+1), INV_POW2(k+2), INV_POW2(k+3), \
+    INV_POW2(k+4), INV_POW2(k+5), INV_POW2(k+6), INV_POW2(k+7)
+const double inversePow2[64] = {
+    INV_POW2_8(0), INV_POW2_8(8), INV_POW2_8(16), INV_POW2_8(24),
+    INV_POW2_8(32), INV_POW2_8(40), INV_POW2_8(48), INV_POW2_8(56)
+};
+
 double switchThreshold[15] = {10, 20, 40, 80, 220, 400, 900, 1800, 3100, 6500,
     11500, 20000, 50000, 120000, 350000};
 
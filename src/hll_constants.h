@@ -4,5 +4,6 @@
 extern double switchThreshold[15];
 extern double *rawEstimateData[];
 extern double *biasData[];
+extern const double inversePow2[64];
 
 #endif
@@ -0,0 +1,162 @@
+/*
+ * Hash functions for the HLL registers.
+ *
+ * MurmurHash3 is the original hash, and produces 128 bits
+ * of which only the upper 64 are used. wyhash (final version 4,
+ * by Wang Yi, released into the public domain) produces 64 bits
+ * directly using a pair of 64x64->128 bit multiplies, and is
+ * several times faster for the short keys typical of sets.
+ * It has no vector variant, since a single short key does not
+ * fill a vector register.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "hll_hash.h"
+
+// Link the external murmur hash in
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+/*
+ * Default secret of wyhash
+ */
+static const uint64_t WY_SECRET[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wy_r8(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t wy_r4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t wy_r3(const unsigned char *p, int k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+/*
+ * Computes wyhash of a key. Reads are little endian, so
+ * the registers are the same on any host.
+ */
+static uint64_t wyhash(const void *key, int len, uint64_t seed) {
+    const unsigned char *p = key;
+    const uint64_t *secret = WY_SECRET;
+    uint64_t a, b;
+    seed ^= wy_mix(seed ^ secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_r4(p) << 32) | wy_r4(p + ((len >> 3) << 2));
+            b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wy_r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        int i = len;
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_r8(p) ^ secret[1], wy_r8(p + 8) ^ seed);
+                see1 = wy_mix(wy_r8(p + 16) ^ secret[2], wy_r8(p + 24) ^ see1);
+                see2 = wy_mix(wy_r8(p + 32) ^ secret[3], wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ secret[1], wy_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ secret[0] ^ (uint64_t)len, b ^ secret[1]);
+}
+
+/**
+ * Hashes a key with the given hash function. External
+ * hashes are computed by clients, so murmur is used.
+ * @arg hash The hash function to use
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash value
+ */
+uint64_t hll_hash_key(hll_hash hash, const char *key, int len) {
+    if (hash == HLL_HASH_WYHASH)
+        return wyhash(key, len, 0);
+
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, len, 0, &out);
+    return out[1];
+}
+
+/**
+ * Parses the name of a hash, "murmur", "wyhash" or "external".
+ * @arg name The name to parse
+ * @arg hash Output, the matching hash
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_hash_from_name(const char *name, hll_hash *hash) {
+    if (strcasecmp(name, "murmur") == 0) {
+        *hash = HLL_HASH_MURMUR;
+    } else if (strcasecmp(name, "wyhash") == 0) {
+        *hash = HLL_HASH_WYHASH;
+    } else if (strcasecmp(name, "external") == 0) {
+        *hash = HLL_HASH_EXTERNAL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the name of a hash.
+ * @arg hash The hash
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_hash_name(hll_hash hash) {
+    switch (hash) {
+        case HLL_HASH_MURMUR:
+            return "murmur";
+        case HLL_HASH_WYHASH:
+            return "wyhash";
+        case HLL_HASH_EXTERNAL:
+            return "external";
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef HLL_HASH_H
+#define HLL_HASH_H
+#include <stdint.h>
+
+/*
+ * Hash functions used to map keys onto the registers.
+ * Every key of a set must use the same hash, so the
+ * choice is made when the set is created.
+ */
+
+/**
+ * The hash functions that can be used by a set.
+ */
+typedef enum {
+    HLL_HASH_MURMUR = 0,  // MurmurHash3 x64 128, keeping the upper 64 bits
+    HLL_HASH_WYHASH = 1,  // wyhash, a faster hash with a native 64 bit output
+    HLL_HASH_EXTERNAL = 2 // Keys are hashed by the client, and sent as hashes
+} hll_hash;
+
+/**
+ * Hashes a key with the given hash function. External
+ * hashes are computed by clients, so murmur is used.
+ * @arg hash The hash function to use
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash value
+ */
+uint64_t hll_hash_key(hll_hash hash, const char *key, int len);
+
+/**
+ * Parses the name of a hash, "murmur", "wyhash" or "external".
+ * @arg name The name to parse
+ * @arg hash Output, the matching hash
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int hll_hash_from_name(const char *name, hll_hash *hash);
+
+/**
+ * Returns the name of a hash.
+ * @arg hash The hash
+ * @return A static string name, or NULL if unknown.
+ */
+const char* hll_hash_name(hll_hash hash);
+
+#endif
@@ -0,0 +1,495 @@
+/*
+ * Vectorized kernels for the HLL estimators.
+ *
+ * The harmonic sum of 2^-reg is computed without a lookup
+ * per register by building the IEEE-754 double directly:
+ * 2^-k has a zero mantissa and a biased exponent of (1023 - k).
+ * This lets us widen the registers into 64bit lanes, subtract
+ * from the bias, and shift into the exponent field.
+ *
+ * The register-wise max used for unions works on packed words
+ * without unpacking them. Alternating registers are split into
+ * lanes with a spare guard bit above each, so a single subtract
+ * compares every lane at once. Changed words and bytes are stored
+ * with a compare-and-swap, since the destination may be updated
+ * concurrently without a lock.
+ *
+ * The kernel is selected at runtime based on the CPU features.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "hll_simd.h"
+#include "hll_constants.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define HLL_SIMD_X86 1
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HLL_SIMD_NEON 1
+#endif
+
+#define REG_WIDTH 6     // Bits per register
+#define REG_PER_WORD 5  // floor(INT_WIDTH / REG_WIDTH)
+#define REG_MASK ((1 << REG_WIDTH) - 1)
+
+#define NIBBLE_WIDTH 4      // Bits per nibble register offset
+#define NIBBLE_PER_WORD 15  // Offsets below the base of a 64bit word
+#define NIBBLE_MASK 0xf
+#define NIBBLE_BASE_SHIFT 60
+
+/*
+ * Used for the IEEE-754 exponent trick
+ */
+#define DOUBLE_EXP_BIAS 1023
+#define DOUBLE_EXP_SHIFT 52
+
+/*
+ * Lane masks for the packed max. Even registers (0, 2, 4) and
+ * odd registers (1, 3) are compared separately, each in 12 bit
+ * lanes, with the guard bit at bit 6 of each lane.
+ */
+#define EVEN_LANES 0x3F03F03Fu
+#define ODD_LANES 0x0003F03Fu
+#define LANE_GUARD 0x40040040u
+
+typedef double(*sum_bytes_func)(const unsigned char *regs, int num_reg, int *num_zero);
+typedef void(*max_bytes_func)(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta);
+
+/**
+ * Computes the harmonic sum of 2^-reg over packed
+ * 6 bit registers, and counts the zero registers.
+ * @arg words The packed register words
+ * @arg num_reg The number of registers
+ * @arg num_zero Output, incremented by the zero register count
+ * @return The sum of 2^-reg over all registers
+ */
+double hll_sum_packed(const uint32_t *words, int num_reg, int *num_zero) {
+    int full_words = num_reg / REG_PER_WORD;
+    int zeros = 0;
+    double inv_sum = 0;
+
+    // Unpack each full word in place, avoiding a divide per register
+    uint32_t word;
+    int reg_val;
+    for (int i=0; i < full_words; i++) {
+        word = words[i];
+        for (int j=0; j < REG_PER_WORD; j++) {
+            reg_val = word & REG_MASK;
+            inv_sum += inversePow2[reg_val];
+            zeros += !reg_val;
+            word >>= REG_WIDTH;
+        }
+    }
+
+    // Handle the partially filled last word
+    int remain = num_reg % REG_PER_WORD;
+    word = (remain) ? words[full_words] : 0;
+    for (int j=0; j < remain; j++) {
+        reg_val = word & REG_MASK;
+        inv_sum += inversePow2[reg_val];
+        zeros += !reg_val;
+        word >>= REG_WIDTH;
+    }
+
+    *num_zero += zeros;
+    return inv_sum;
+}
+
+/*
+ * Computes the max of each 6 bit lane. Lanes must be 12 bits
+ * apart, so the guard bit absorbs the borrow of each lane.
+ */
+static inline uint32_t max_lanes(uint32_t x, uint32_t y) {
+    uint32_t ge = (((x | LANE_GUARD) - y) & LANE_GUARD) >> REG_WIDTH;
+    uint32_t mask = (ge << REG_WIDTH) - ge;
+    return (x & mask) | (y & ~mask);
+}
+
+/**
+ * Computes the register-wise max of packed 6 bit
+ * registers, storing the result in dst.
+ * @arg dst The destination register words
+ * @arg src The source register words
+ * @arg num_words The number of words
+ * @arg delta Updated with the registers that were raised
+ */
+void hll_max_packed(uint32_t *dst, const uint32_t *src, int num_words, hll_sum_delta *delta) {
+    volatile uint32_t *words = dst;
+    uint32_t d, s, m;
+    for (int i=0; i < num_words; i++) {
+        s = src[i];
+        d = words[i];
+        while (d != s) {
+            m = max_lanes(d & EVEN_LANES, s & EVEN_LANES) |
+                (max_lanes((d >> REG_WIDTH) & ODD_LANES, (s >> REG_WIDTH) & ODD_LANES) << REG_WIDTH);
+            if (m == d) break;
+            if (__sync_bool_compare_and_swap(words + i, d, m)) {
+                for (int j=0; j < REG_PER_WORD; j++) {
+                    int old = (d >> (j * REG_WIDTH)) & REG_MASK;
+                    int val = (m >> (j * REG_WIDTH)) & REG_MASK;
+                    if (val != old) hll_sum_raise(delta, old, val);
+                }
+                break;
+            }
+            d = words[i];
+        }
+    }
+}
+
+/*
+ * The histograms count into interleaved sub-histograms,
+ * so runs of equal registers do not stall on the same
+ * counter. They are summed once at the end.
+ */
+#define HIST_WAYS 4
+#define HIST_SIZE 64
+
+static inline void merge_histograms(uint32_t sub[HIST_WAYS][HIST_SIZE], uint32_t *hist) {
+    for (int i=0; i < HIST_SIZE; i++) {
+        hist[i] += sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+    }
+}
+
+/**
+ * Counts the packed 6 bit registers with each value.
+ * @arg words The packed register words
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_packed(const uint32_t *words, int num_reg, uint32_t *hist) {
+    uint32_t sub[HIST_WAYS][HIST_SIZE];
+    memset(sub, 0, sizeof(sub));
+    int full = num_reg / REG_PER_WORD;
+    for (int i=0; i < full; i++) {
+        uint32_t w = words[i];
+        sub[0][w & REG_MASK]++;
+        sub[1][(w >> REG_WIDTH) & REG_MASK]++;
+        sub[2][(w >> 2 * REG_WIDTH) & REG_MASK]++;
+        sub[3][(w >> 3 * REG_WIDTH) & REG_MASK]++;
+        sub[0][(w >> 4 * REG_WIDTH) & REG_MASK]++;
+    }
+    for (int i=full * REG_PER_WORD; i < num_reg; i++) {
+        sub[1][(words[full] >> REG_WIDTH * (i % REG_PER_WORD)) & REG_MASK]++;
+    }
+    merge_histograms(sub, hist);
+}
+
+/**
+ * Counts the byte registers with each value.
+ * @arg regs The byte registers
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_bytes(const unsigned char *regs, int num_reg, uint32_t *hist) {
+    uint32_t sub[HIST_WAYS][HIST_SIZE];
+    memset(sub, 0, sizeof(sub));
+    int i = 0;
+    for (; i + HIST_WAYS <= num_reg; i += HIST_WAYS) {
+        sub[0][regs[i] & REG_MASK]++;
+        sub[1][regs[i+1] & REG_MASK]++;
+        sub[2][regs[i+2] & REG_MASK]++;
+        sub[3][regs[i+3] & REG_MASK]++;
+    }
+    for (; i < num_reg; i++) {
+        sub[0][regs[i] & REG_MASK]++;
+    }
+    merge_histograms(sub, hist);
+}
+
+/**
+ * Counts the nibble registers with each value. The
+ * offsets of a word are counted first, then shifted
+ * by its base into the histogram.
+ * @arg words The nibble register words
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_nibble(const uint64_t *words, int num_reg, uint32_t *hist) {
+    uint32_t sub[HIST_WAYS][HIST_SIZE];
+    memset(sub, 0, sizeof(sub));
+    for (int i=0; i < num_reg; i += NIBBLE_PER_WORD) {
+        uint64_t w = words[i / NIBBLE_PER_WORD];
+        uint32_t *counts = sub[(i / NIBBLE_PER_WORD) % HIST_WAYS] + (w >> NIBBLE_BASE_SHIFT);
+        int count = (num_reg - i < NIBBLE_PER_WORD) ? num_reg - i : NIBBLE_PER_WORD;
+        for (int j=0; j < count; j++)
+            counts[(w >> (NIBBLE_WIDTH * j)) & NIBBLE_MASK]++;
+    }
+    merge_histograms(sub, hist);
+}
+
+/*
+ * Portable scalar fallback for the byte registers
+ */
+static double sum_bytes_scalar(const unsigned char *regs, int num_reg, int *num_zero) {
+    int zeros = 0;
+    double inv_sum = 0;
+    for (int i=0; i < num_reg; i++) {
+        inv_sum += inversePow2[regs[i]];
+        zeros += !regs[i];
+    }
+    *num_zero += zeros;
+    return inv_sum;
+}
+
+static void max_bytes_scalar(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta) {
+    volatile unsigned char *regs = dst;
+    unsigned char old;
+    for (int i=0; i < num_reg; i++) {
+        old = regs[i];
+        while (src[i] > old) {
+            if (__sync_bool_compare_and_swap(regs + i, old, src[i])) {
+                hll_sum_raise(delta, old, src[i]);
+                break;
+            }
+            old = regs[i];
+        }
+    }
+}
+
+#ifdef HLL_SIMD_X86
+/*
+ * The vector kernels find the blocks with a larger
+ * source register, and only swap those bytes in.
+ */
+static void max_bytes_sse2(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta) {
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(d, s), d)) != 0xFFFF)
+            max_bytes_scalar(dst + i, src + i, 16, delta);
+    }
+    max_bytes_scalar(dst + i, src + i, num_reg - i, delta);
+}
+
+__attribute__((target("avx2")))
+static void max_bytes_avx2(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta) {
+    int i = 0;
+    for (; i + 32 <= num_reg; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(d, s), d)) != -1)
+            max_bytes_scalar(dst + i, src + i, 32, delta);
+    }
+    max_bytes_scalar(dst + i, src + i, num_reg - i, delta);
+}
+
+/*
+ * Converts 2 registers in 64bit lanes into 2^-reg
+ */
+static inline __m128d inv_pow2_sse2(__m128i regs, __m128i bias) {
+    __m128i exp = _mm_slli_epi64(_mm_sub_epi64(bias, regs), DOUBLE_EXP_SHIFT);
+    return _mm_castsi128_pd(exp);
+}
+
+/*
+ * SSE2 kernel. Handles 16 registers per iteration.
+ */
+static double sum_bytes_sse2(const unsigned char *regs, int num_reg, int *num_zero) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi64x(DOUBLE_EXP_BIAS);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd(), acc3 = _mm_setzero_pd();
+    int zeros = 0;
+
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(regs + i));
+        zeros += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+
+        // Widen 8 -> 16 -> 32 bits
+        __m128i lo16 = _mm_unpacklo_epi8(v, zero);
+        __m128i hi16 = _mm_unpackhi_epi8(v, zero);
+        __m128i w0 = _mm_unpacklo_epi16(lo16, zero);
+        __m128i w1 = _mm_unpackhi_epi16(lo16, zero);
+        __m128i w2 = _mm_unpacklo_epi16(hi16, zero);
+        __m128i w3 = _mm_unpackhi_epi16(hi16, zero);
+
+        // Widen 32 -> 64 bits and accumulate
+        acc0 = _mm_add_pd(acc0, inv_pow2_sse2(_mm_unpacklo_epi32(w0, zero), bias));
+        acc1 = _mm_add_pd(acc1, inv_pow2_sse2(_mm_unpackhi_epi32(w0, zero), bias));
+        acc2 = _mm_add_pd(acc2, inv_pow2_sse2(_mm_unpacklo_epi32(w1, zero), bias));
+        acc3 = _mm_add_pd(acc3, inv_pow2_sse2(_mm_unpackhi_epi32(w1, zero), bias));
+        acc0 = _mm_add_pd(acc0, inv_pow2_sse2(_mm_unpacklo_epi32(w2, zero), bias));
+        acc1 = _mm_add_pd(acc1, inv_pow2_sse2(_mm_unpackhi_epi32(w2, zero), bias));
+        acc2 = _mm_add_pd(acc2, inv_pow2_sse2(_mm_unpacklo_epi32(w3, zero), bias));
+        acc3 = _mm_add_pd(acc3, inv_pow2_sse2(_mm_unpackhi_epi32(w3, zero), bias));
+    }
+
+    // Reduce the accumulators
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3)));
+    double inv_sum = lanes[0] + lanes[1];
+
+    // Handle any tail
+    *num_zero += zeros;
+    return inv_sum + sum_bytes_scalar(regs + i, num_reg - i, num_zero);
+}
+
+/*
+ * AVX2 kernel. Handles 16 registers per iteration
+ * using 4 lanes per vector.
+ */
+__attribute__((target("avx2")))
+static double sum_bytes_avx2(const unsigned char *regs, int num_reg, int *num_zero) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m256i bias = _mm256_set1_epi64x(DOUBLE_EXP_BIAS);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+    int zeros = 0;
+
+    #define AVX2_INV_POW2(v) _mm256_castsi256_pd(_mm256_slli_epi64( \
+                _mm256_sub_epi64(bias, _mm256_cvtepu8_epi64(v)), DOUBLE_EXP_SHIFT))
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(regs + i));
+        zeros += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+
+        // Each conversion widens the low 4 bytes of the vector
+        acc0 = _mm256_add_pd(acc0, AVX2_INV_POW2(v));
+        acc1 = _mm256_add_pd(acc1, AVX2_INV_POW2(_mm_srli_si128(v, 4)));
+        acc2 = _mm256_add_pd(acc2, AVX2_INV_POW2(_mm_srli_si128(v, 8)));
+        acc3 = _mm256_add_pd(acc3, AVX2_INV_POW2(_mm_srli_si128(v, 12)));
+    }
+    #undef AVX2_INV_POW2
+
+    // Reduce the accumulators
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3)));
+    double inv_sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    // Handle any tail
+    *num_zero += zeros;
+    return inv_sum + sum_bytes_scalar(regs + i, num_reg - i, num_zero);
+}
+#endif
+
+#ifdef HLL_SIMD_NEON
+static void max_bytes_neon(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta) {
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        uint8x16_t d = vld1q_u8(dst + i);
+        if (vmaxvq_u8(vcgtq_u8(vld1q_u8(src + i), d)))
+            max_bytes_scalar(dst + i, src + i, 16, delta);
+    }
+    max_bytes_scalar(dst + i, src + i, num_reg - i, delta);
+}
+
+/*
+ * Converts 2 registers in 64bit lanes into 2^-reg
+ */
+static inline float64x2_t inv_pow2_neon(uint64x2_t regs, uint64x2_t bias) {
+    return vreinterpretq_f64_u64(vshlq_n_u64(vsubq_u64(bias, regs), DOUBLE_EXP_SHIFT));
+}
+
+/*
+ * NEON kernel. Handles 16 registers per iteration.
+ */
+static double sum_bytes_neon(const unsigned char *regs, int num_reg, int *num_zero) {
+    const uint64x2_t bias = vdupq_n_u64(DOUBLE_EXP_BIAS);
+    float64x2_t acc0 = vdupq_n_f64(0), acc1 = vdupq_n_f64(0);
+    int zeros = 0;
+
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        uint8x16_t v = vld1q_u8(regs + i);
+        zeros += vaddvq_u8(vshrq_n_u8(vceqq_u8(v, vdupq_n_u8(0)), 7));
+
+        // Widen 8 -> 16 -> 32 bits
+        uint16x8_t lo16 = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi16 = vmovl_u8(vget_high_u8(v));
+        uint32x4_t w[4] = {
+            vmovl_u16(vget_low_u16(lo16)), vmovl_u16(vget_high_u16(lo16)),
+            vmovl_u16(vget_low_u16(hi16)), vmovl_u16(vget_high_u16(hi16))
+        };
+
+        // Widen 32 -> 64 bits and accumulate
+        for (int j=0; j < 4; j++) {
+            acc0 = vaddq_f64(acc0, inv_pow2_neon(vmovl_u32(vget_low_u32(w[j])), bias));
+            acc1 = vaddq_f64(acc1, inv_pow2_neon(vmovl_u32(vget_high_u32(w[j])), bias));
+        }
+    }
+    double inv_sum = vaddvq_f64(vaddq_f64(acc0, acc1));
+
+    // Handle any tail
+    *num_zero += zeros;
+    return inv_sum + sum_bytes_scalar(regs + i, num_reg - i, num_zero);
+}
+#endif
+
+/*
+ * Selects the best kernel for the running CPU
+ */
+static sum_bytes_func select_bytes_kernel(const char **name, max_bytes_func *max) {
+#ifdef HLL_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        *max = max_bytes_avx2;
+        return sum_bytes_avx2;
+    }
+    *name = "sse2";
+    *max = max_bytes_sse2;
+    return sum_bytes_sse2;
+#elif defined(HLL_SIMD_NEON)
+    *name = "neon";
+    *max = max_bytes_neon;
+    return sum_bytes_neon;
+#else
+    *name = "scalar";
+    *max = max_bytes_scalar;
+    return sum_bytes_scalar;
+#endif
+}
+
+/*
+ * The selected kernel. Selection is idempotent, so
+ * racing threads will all store the same values.
+ */
+static sum_bytes_func BYTES_KERNEL = NULL;
+static max_bytes_func MAX_BYTES_KERNEL = NULL;
+static const char *BYTES_KERNEL_NAME = NULL;
+
+static inline void select_kernels() {
+    if (!BYTES_KERNEL || !MAX_BYTES_KERNEL)
+        BYTES_KERNEL = select_bytes_kernel(&BYTES_KERNEL_NAME, &MAX_BYTES_KERNEL);
+}
+
+/**
+ * Computes the harmonic sum of 2^-reg over byte
+ * registers, and counts the zero registers.
+ * @arg regs The byte registers
+ * @arg num_reg The number of registers
+ * @arg num_zero Output, incremented by the zero register count
+ * @return The sum of 2^-reg over all registers
+ */
+double hll_sum_bytes(const unsigned char *regs, int num_reg, int *num_zero) {
+    select_kernels();
+    return BYTES_KERNEL(regs, num_reg, num_zero);
+}
+
+/**
+ * Computes the register-wise max of byte
+ * registers, storing the result in dst.
+ * @arg dst The destination registers
+ * @arg src The source registers
+ * @arg num_reg The number of registers
+ * @arg delta Updated with the registers that were raised
+ */
+void hll_max_bytes(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta) {
+    select_kernels();
+    MAX_BYTES_KERNEL(dst, src, num_reg, delta);
+}
+
+/**
+ * Returns the name of the byte kernel selected for
+ * this CPU, e.g. "avx2", "sse2", "neon" or "scalar".
+ */
+const char* hll_simd_kernel_name() {
+    select_kernels();
+    return BYTES_KERNEL_NAME;
+}
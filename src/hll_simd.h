@@ -0,0 +1,109 @@
+#ifndef HLL_SIMD_H
+#define HLL_SIMD_H
+#include <stdint.h>
+
+/*
+ * Vectorized kernels used by the HLL estimators.
+ * The best kernel for the running CPU is selected at
+ * runtime, and falls back to a portable scalar version.
+ * The max kernels are safe to use while other threads
+ * raise the destination registers.
+ */
+
+/**
+ * Tracks how the fixed point harmonic sum and the zero
+ * register count drop as registers are raised by a max.
+ */
+typedef struct {
+    int shift;          // Fixed point shift, see hll_sum_term
+    uint64_t inv_sum;   // Amount the harmonic sum dropped
+    int num_zero;       // Number of zero registers raised
+} hll_sum_delta;
+
+/**
+ * Returns 2^-reg in fixed point with shift fractional
+ * bits. Registers past the shift round down to zero.
+ */
+static inline uint64_t hll_sum_term(int shift, int reg) {
+    return (reg <= shift) ? 1ULL << (shift - reg) : 0;
+}
+
+/**
+ * Records that a register was raised from old to val
+ */
+static inline void hll_sum_raise(hll_sum_delta *delta, int old, int val) {
+    delta->inv_sum += hll_sum_term(delta->shift, old) - hll_sum_term(delta->shift, val);
+    delta->num_zero += !old;
+}
+
+/**
+ * Computes the harmonic sum of 2^-reg over packed
+ * 6 bit registers, and counts the zero registers.
+ * @arg words The packed register words
+ * @arg num_reg The number of registers
+ * @arg num_zero Output, incremented by the zero register count
+ * @return The sum of 2^-reg over all registers
+ */
+double hll_sum_packed(const uint32_t *words, int num_reg, int *num_zero);
+
+/**
+ * Computes the harmonic sum of 2^-reg over byte
+ * registers, and counts the zero registers.
+ * @arg regs The byte registers
+ * @arg num_reg The number of registers
+ * @arg num_zero Output, incremented by the zero register count
+ * @return The sum of 2^-reg over all registers
+ */
+double hll_sum_bytes(const unsigned char *regs, int num_reg, int *num_zero);
+
+/**
+ * Counts the packed 6 bit registers with each value.
+ * @arg words The packed register words
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_packed(const uint32_t *words, int num_reg, uint32_t *hist);
+
+/**
+ * Counts the byte registers with each value.
+ * @arg regs The byte registers
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_bytes(const unsigned char *regs, int num_reg, uint32_t *hist);
+
+/**
+ * Counts the nibble registers with each value.
+ * @arg words The nibble register words
+ * @arg num_reg The number of registers
+ * @arg hist Output, 64 counts incremented for each register value
+ */
+void hll_histogram_nibble(const uint64_t *words, int num_reg, uint32_t *hist);
+
+/**
+ * Computes the register-wise max of packed 6 bit
+ * registers, storing the result in dst.
+ * @arg dst The destination register words
+ * @arg src The source register words
+ * @arg num_words The number of words
+ * @arg delta Updated with the registers that were raised
+ */
+void hll_max_packed(uint32_t *dst, const uint32_t *src, int num_words, hll_sum_delta *delta);
+
+/**
+ * Computes the register-wise max of byte
+ * registers, storing the result in dst.
+ * @arg dst The destination registers
+ * @arg src The source registers
+ * @arg num_reg The number of registers
+ * @arg delta Updated with the registers that were raised
+ */
+void hll_max_bytes(unsigned char *dst, const unsigned char *src, int num_reg, hll_sum_delta *delta);
+
+/**
+ * Returns the name of the byte kernel selected for
+ * this CPU, e.g. "avx2", "sse2", "neon" or "scalar".
+ */
+const char* hll_simd_kernel_name();
+
+#endif
@@ -19,6 +19,9 @@
 #include "networking.h"
 #include "set_manager.h"
 #include "background.h"
+#include "ingest.h"
+#include "replication.h"
+#include "clock.h"
 
 // Simple struct that holds args for the workers
 typedef struct {
@@ -34,6 +37,12 @@ static void worker_main(worker_args *args);
  */
 static int SHOULD_RUN = 1;
 
+/**
+ * Set by our SIGHUP handler, so that the
+ * main loop reloads the configuration.
+ */
+static int SHOULD_RELOAD = 0;
+
 /**
  * Prints our usage to stderr
  */
@@ -116,6 +125,60 @@ void signal_handler(int signum) {
     syslog(LOG_WARNING, "Received signal [%s]! Exiting...", strsignal(signum));
 }
 
+/**
+ * Our registered handler of SIGHUP, which has
+ * the main loop reload the configuration.
+ */
+void reload_handler(int signum) {
+    (void)signum;
+    SHOULD_RELOAD = 1;
+}
+
+/**
+ * Reloads the configuration file, and applies the settings
+ * that may change while running: the number of workers,
+ * the flush and cold intervals, and the log level. The rest
+ * take a restart. Invalid configurations are ignored.
+ * @arg config_file The configuration file, or NULL
+ * @arg workers The workers set by the command line, or 0
+ * @arg config The running configuration, updated in place
+ * @arg netconf The networking stack
+ * @arg maint The maintenance, or NULL if it did not start
+ */
+static void reload_config(char *config_file, int workers, hlld_config *config,
+        hlld_networking *netconf, hlld_maintenance *maint) {
+    syslog(LOG_INFO, "Reloading the configuration.");
+    hlld_config *reload = calloc(1, sizeof(hlld_config));
+    if (config_from_filename(config_file, reload)) {
+        syslog(LOG_ERR, "Failed to read the configuration file! Keeping the running one.");
+        free(reload);
+        return;
+    }
+    if (workers) reload->worker_threads = workers;
+
+    // The workers can not grow past those started, nor
+    // leave the cool interval at or over the cold one
+    reload->max_workers = config->max_workers;
+    reload->cool_interval = config->cool_interval;
+    if (validate_config(reload)) {
+        syslog(LOG_ERR, "Invalid configuration! Keeping the running one.");
+        free(reload);
+        return;
+    }
+
+    setlogmask(reload->syslog_log_level);
+    config->syslog_log_level = reload->syslog_log_level;
+    if (reload->worker_threads != config->worker_threads &&
+            !scale_networking(netconf, reload->worker_threads))
+        config->worker_threads = reload->worker_threads;
+    if (maint && (reload->flush_interval != config->flush_interval ||
+                reload->cold_interval != config->cold_interval))
+        reconfigure_maintenance(maint, reload->flush_interval, reload->cold_interval);
+
+    // What else it read is left, like the templates of the running config
+    free(reload);
+}
+
 
 int main(int argc, char **argv) {
     // Initialize syslog
@@ -148,9 +211,16 @@ int main(int argc, char **argv) {
     // Set the syslog mask
     setlogmask(config->syslog_log_level);
 
+    // Fix the most workers, which are all started,
+    // with those past worker_threads standing by
+    config->max_workers = config_worker_slots(config);
+
     // Log that we are starting up
     syslog(LOG_INFO, "Starting hlld.");
 
+    // Calibrate the clocks before any thread reads them
+    hclock_init();
+
     // Initialize the sets
     hlld_setmgr *mgr;
     int mgr_res = init_set_manager(config, 1,  &mgr);
@@ -159,15 +229,39 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Initialize the metrics, with a slot for each worker
+    // and each execution thread
+    hlld_metrics *metrics;
+    if (init_metrics(config->max_workers + config->exec_threads, &metrics)) {
+        syslog(LOG_ERR, "Failed to initialize metrics!");
+        return 1;
+    }
+
     // Start the background tasks
-    int flush_on, unmap_on;
-    pthread_t flush_thread, unmap_thread;
-    flush_on = start_flush_thread(config, mgr, &SHOULD_RUN, &flush_thread);
-    unmap_on = start_cold_unmap_thread(config, mgr, &SHOULD_RUN, &unmap_thread);
+    hlld_maintenance *maint;
+    int maint_on = start_maintenance(config, mgr, metrics, &SHOULD_RUN, &maint);
+
+    // Start streaming to followers, and following a primary
+    int primary_on, follower_on;
+    pthread_t primary_thread, follower_thread;
+    primary_on = start_primary_thread(config, mgr, &SHOULD_RUN, &primary_thread);
+    if (primary_on < 0) {
+        syslog(LOG_ERR, "Failed to start replication!");
+        return 1;
+    }
+    follower_on = start_follower_thread(config, mgr, &SHOULD_RUN, &follower_thread);
+
+    // Take the writes of local producers over shared memory
+    hlld_ingest *ingest;
+    int ingest_on = start_ingest(config, mgr, &SHOULD_RUN, &ingest);
+    if (ingest_on < 0) {
+        syslog(LOG_ERR, "Failed to create the ingest rings!");
+        return 1;
+    }
 
     // Initialize the networking
     hlld_networking *netconf = NULL;
-    int net_res = init_networking(config, mgr, &netconf);
+    int net_res = init_networking(config, mgr, metrics, &netconf);
     if (net_res != 0) {
         syslog(LOG_ERR, "Failed to initialize networking!");
         return 1;
@@ -175,31 +269,41 @@ int main(int argc, char **argv) {
 
     // Start the network workers
     worker_args wargs = {mgr, netconf};
-    pthread_t *threads = calloc(config->worker_threads, sizeof(pthread_t));
-    for (int i=0; i < config->worker_threads; i++) {
+    pthread_t *threads = calloc(config->max_workers, sizeof(pthread_t));
+    for (int i=0; i < config->max_workers; i++) {
         pthread_create(&threads[i], NULL, (void*(*)(void*))worker_main, &wargs);
     }
 
     // Prepare our signal handlers to loop until we are signaled to quit
     signal(SIGPIPE, SIG_IGN);       // Ignore SIG_IGN
-    signal(SIGHUP, SIG_IGN);        // Ignore SIG_IGN
+    signal(SIGHUP, reload_handler);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
-    // Loop forever
-    enter_main_loop(netconf, &SHOULD_RUN, threads);
+    // Loop forever, reloading the configuration on SIGHUP
+    while (SHOULD_RUN) {
+        enter_main_loop(netconf, &SHOULD_RUN, &SHOULD_RELOAD, threads);
+        if (!SHOULD_RELOAD) continue;
+        SHOULD_RELOAD = 0;
+        reload_config(config_file, workers, config, netconf, (maint_on) ? maint : NULL);
+    }
 
-    // Begin the shutdown/cleanup
+    // Begin the shutdown/cleanup. Page ins resume their
+    // connections, so they finish before the workers exit.
+    setmgr_stop_page_in(mgr);
     shutdown_networking(netconf, threads);
 
     // Shutdown the background tasks
-    if (flush_on) pthread_join(flush_thread, NULL);
-    if (unmap_on) pthread_join(unmap_thread, NULL);
+    if (maint_on) stop_maintenance(maint);
+    if (ingest_on) stop_ingest(ingest);
+    if (primary_on) pthread_join(primary_thread, NULL);
+    if (follower_on) pthread_join(follower_thread, NULL);
 
     // Cleanup the sets
     destroy_set_manager(mgr);
 
     // Free our memory
+    destroy_metrics(metrics);
     free(threads);
     free(config);
 
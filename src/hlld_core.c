@@ -0,0 +1,162 @@
+/**
+ * The embedding API of hlld. This starts the set manager
+ * and its maintenance as the server does, without the
+ * networking, replication or ingest.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "hlld_core.h"
+#include "background.h"
+#include "metrics.h"
+#include "clock.h"
+
+struct hlld_core {
+    hlld_config *config;        // Our copy of the config
+    int own_templates;          // Were the templates read by us
+    hlld_setmgr *mgr;
+    hlld_metrics *metrics;      // Kept for the maintenance timings
+    hlld_maintenance *maint;
+    int maint_on;
+    int should_run;             // Cleared to stop the maintenance
+};
+
+// The clocks are calibrated once, however many engines are opened
+static pthread_once_t CLOCK_ONCE = PTHREAD_ONCE_INIT;
+
+int hlld_core_open(char *config_file, hlld_core **core) {
+    hlld_config config;
+    int res = config_from_filename(config_file, &config);
+    if (res) return res;
+    res = hlld_core_open_config(&config, core);
+    if (res) return res;
+    (*core)->own_templates = 1;
+    return 0;
+}
+
+int hlld_core_open_config(hlld_config *config, hlld_core **core) {
+    if (validate_config(config)) return -EINVAL;
+
+    hlld_core *c = calloc(1, sizeof(hlld_core));
+    if (!c) return -1;
+    c->config = malloc(sizeof(hlld_config));
+    if (!c->config) {
+        free(c);
+        return -1;
+    }
+    memcpy(c->config, config, sizeof(hlld_config));
+
+    // The clocks are calibrated before the sets read them
+    pthread_once(&CLOCK_ONCE, hclock_init);
+    if (init_set_manager(c->config, 1, &c->mgr)) {
+        syslog(LOG_ERR, "Failed to initialize the embedded set manager!");
+        free(c->config);
+        free(c);
+        return -1;
+    }
+
+    // There are no workers, so the metrics only time the maintenance
+    if (init_metrics(1, &c->metrics)) {
+        destroy_set_manager(c->mgr);
+        free(c->config);
+        free(c);
+        return -1;
+    }
+    c->should_run = 1;
+    c->maint_on = start_maintenance(c->config, c->mgr, c->metrics, &c->should_run, &c->maint);
+    *core = c;
+    return 0;
+}
+
+void hlld_core_close(hlld_core *core) {
+    core->should_run = 0;
+    setmgr_stop_page_in(core->mgr);
+    if (core->maint_on) stop_maintenance(core->maint);
+    destroy_set_manager(core->mgr);
+    destroy_metrics(core->metrics);
+
+    if (core->own_templates) {
+        hlld_set_template *t = core->config->templates, *next;
+        while (t) {
+            next = t->next;
+            free(t);
+            t = next;
+        }
+    }
+    free(core->config);
+    free(core);
+}
+
+void hlld_core_idle(hlld_core *core) {
+    setmgr_client_idle(core->mgr);
+}
+
+void hlld_core_leave(hlld_core *core) {
+    setmgr_client_leave(core->mgr);
+}
+
+hlld_setmgr* hlld_core_manager(hlld_core *core) {
+    return core->mgr;
+}
+
+int hlld_core_create(hlld_core *core, char *set_name, const char *template_name) {
+    setmgr_client_checkpoint(core->mgr);
+    if (!template_name) return setmgr_create_set(core->mgr, set_name, NULL);
+
+    // The set owns its custom config, so the template is copied
+    hlld_config *template = config_template(core->config, template_name);
+    if (!template) return -3;
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    if (!custom) return -2;
+    memcpy(custom, template, sizeof(hlld_config));
+    int res = setmgr_create_set(core->mgr, set_name, custom);
+    if (res) free(custom);
+    return res;
+}
+
+int hlld_core_drop(hlld_core *core, char *set_name) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_drop_set(core->mgr, set_name);
+}
+
+int hlld_core_add(hlld_core *core, char *set_name, char **keys, int *lens, int num_keys) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_set_sized_keys(core->mgr, set_name, keys, lens, num_keys);
+}
+
+int hlld_core_add_hashes(hlld_core *core, char *set_name, uint64_t *hashes, int num_hashes) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_set_hashes(core->mgr, set_name, hashes, num_hashes);
+}
+
+int hlld_core_size(hlld_core *core, char *set_name, uint64_t *est) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_set_size(core->mgr, set_name, est);
+}
+
+int hlld_core_size_union(hlld_core *core, char **set_names, int num_sets, uint64_t *est) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_size_union(core->mgr, set_names, num_sets, est);
+}
+
+int hlld_core_flush(hlld_core *core, char *set_name) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_flush_set(core->mgr, set_name);
+}
+
+int hlld_core_dump(hlld_core *core, char *set_name, unsigned char **dump, uint64_t *len) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_dump_set(core->mgr, set_name, dump, len);
+}
+
+int hlld_core_restore(hlld_core *core, char *set_name, const unsigned char *dump, uint64_t len) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_restore_set(core->mgr, set_name, dump, len);
+}
+
+int hlld_core_get_raw(hlld_core *core, char *set_name, int sparse, hset_raw_cb cb, void *data) {
+    setmgr_client_checkpoint(core->mgr);
+    return setmgr_get_raw(core->mgr, set_name, sparse, cb, data);
+}
@@ -0,0 +1,188 @@
+#ifndef HLLD_CORE_H
+#define HLLD_CORE_H
+#include <stdint.h>
+#include "config.h"
+#include "set_manager.h"
+
+/*
+ * libhlld_core, the engine of hlld without its networking,
+ * to be linked into a process that keeps its own sets, such
+ * as a stream processor. The sets are flushed, unmapped and
+ * archived by the same maintenance the server runs, and are
+ * kept in the same on-disk format, so a data directory written
+ * here may be served by hlld. Sets are also handed to a
+ * running server with the dump of hlld_core_dump, which is
+ * that of a snapshot and of the restore command, or with the
+ * registers of hlld_core_get_raw, which mergeraw takes.
+ *
+ * Every call may be made from any thread. A thread that stops
+ * calling for a while must call hlld_core_idle, and one that
+ * exits must call hlld_core_leave, or the memory of dropped
+ * and closed sets is never reclaimed.
+ *
+ * Calls return 0 on success, -1 if the set does not exist,
+ * and the other codes of the set manager calls they wrap.
+ */
+
+/*
+ * The version of this API. It is raised only when a
+ * call is changed in a way that breaks its callers.
+ */
+#define HLLD_CORE_API_VERSION 1
+
+typedef struct hlld_core hlld_core;
+
+/**
+ * Opens the sets of a data directory, and starts their
+ * maintenance
+ * @arg config_file The hlld config file, or NULL for the defaults
+ * @arg core Output, the engine
+ * @return 0 on success, -EINVAL for an invalid config,
+ * -ENOENT if the file can not be read, -1 on other errors.
+ */
+int hlld_core_open(char *config_file, hlld_core **core);
+
+/**
+ * Opens the sets as hlld_core_open, with a config that
+ * is filled in by the caller instead of read from a file
+ * @arg config The config, from config_from_filename. It is copied.
+ * @arg core Output, the engine
+ * @return 0 on success, -EINVAL for an invalid config, -1 on error.
+ */
+int hlld_core_open_config(hlld_config *config, hlld_core **core);
+
+/**
+ * Stops the maintenance, flushes the sets that are not
+ * in memory, and frees the engine. No other thread may
+ * be calling it.
+ * @arg core The engine
+ */
+void hlld_core_close(hlld_core *core);
+
+/**
+ * Marks the calling thread idle until its next call
+ * @arg core The engine
+ */
+void hlld_core_idle(hlld_core *core);
+
+/**
+ * Marks the calling thread as done with the engine
+ * @arg core The engine
+ */
+void hlld_core_leave(hlld_core *core);
+
+/**
+ * Returns the set manager of the engine, for the calls
+ * not wrapped here. The set manager calls are not part
+ * of the stable API.
+ * @arg core The engine
+ */
+hlld_setmgr* hlld_core_manager(hlld_core *core);
+
+/**
+ * Creates a set
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg template_name A template of the config file to take
+ * the settings of the set from, or NULL for the defaults
+ * @return 0 on success, -1 if the set exists, -2 on internal
+ * error, -3 if the template does not exist.
+ */
+int hlld_core_create(hlld_core *core, char *set_name, const char *template_name);
+
+/**
+ * Deletes a set, and its files
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int hlld_core_drop(hlld_core *core, char *set_name);
+
+/**
+ * Sets keys in a set
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg keys The keys, which may hold any byte
+ * @arg lens The length of each key
+ * @arg num_keys The number of keys
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set only takes hashes.
+ */
+int hlld_core_add(hlld_core *core, char *set_name, char **keys, int *lens, int num_keys);
+
+/**
+ * Sets hashes in a set created with hash=external
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg hashes The 64 bit hashes
+ * @arg num_hashes The number of hashes
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set hashes its keys.
+ */
+int hlld_core_add_hashes(hlld_core *core, char *set_name, uint64_t *hashes, int num_hashes);
+
+/**
+ * Estimates the size of a set
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg est Output, the estimate
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int hlld_core_size(hlld_core *core, char *set_name, uint64_t *est);
+
+/**
+ * Estimates the size of the union of sets
+ * @arg core The engine
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg est Output, the estimate
+ * @return 0 on success, -1 if a set does not exist,
+ * -2 if their hashes differ, -3 on internal error.
+ */
+int hlld_core_size_union(hlld_core *core, char **set_names, int num_sets, uint64_t *est);
+
+/**
+ * Flushes a set to disk
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int hlld_core_flush(hlld_core *core, char *set_name);
+
+/**
+ * Dumps a set, as a snapshot does, so that it can be
+ * restored here or by a server
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg dump Output, the dump, to be freed by the caller
+ * @arg len Output, the length of the dump
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 on internal error.
+ */
+int hlld_core_dump(hlld_core *core, char *set_name, unsigned char **dump, uint64_t *len);
+
+/**
+ * Creates a set from a dump, with the config and
+ * registers of the dumped set
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg dump The dump
+ * @arg len The length of the dump
+ * @return 0 on success, -1 if the set exists, -2 on internal
+ * error, -3 if it is being deleted, -4 if the dump is corrupt.
+ */
+int hlld_core_restore(hlld_core *core, char *set_name, const unsigned char *dump, uint64_t len);
+
+/**
+ * Reads the registers of a set, as merged by mergeraw
+ * @arg core The engine
+ * @arg set_name The name of the set
+ * @arg sparse Should dense registers be listed as entries
+ * @arg cb Invoked with the registers, while the set is held
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, -1 if the set does not exist.
+ * -3 on internal error.
+ */
+int hlld_core_get_raw(hlld_core *core, char *set_name, int sparse, hset_raw_cb cb, void *data);
+
+#endif
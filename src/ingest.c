@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "ingest.h"
+
+/**
+ * The first byte of a binary frame
+ */
+#define FRAME_MAGIC 0xB1
+
+/**
+ * The opcodes of the binary protocol taken from rings
+ */
+#define FRAME_SET_KEYS 1
+#define FRAME_SET_HASHES 2
+
+/**
+ * The longest set name of a frame
+ */
+#define MAX_NAME_LEN 256
+
+/**
+ * The most keys or hashes set at once, so a
+ * large frame does not hold the set for long
+ */
+#define INGEST_BATCH 1024
+
+/**
+ * The longest the thread of a ring sleeps at once
+ * while it is empty, so that shutdown is not delayed
+ */
+#define MAX_SLEEP_MSEC 100
+
+/**
+ * After how many frames the thread of a ring
+ * checkpoints with the manager
+ */
+#define PERIODIC_CHECKPOINT 64
+
+// Rounds a length up to a multiple of INGEST_ALIGN
+#define ALIGN_FRAME(len) (((len) + INGEST_ALIGN - 1) & ~((uint64_t)INGEST_ALIGN - 1))
+
+/*
+ * A ring, and the thread that drains it
+ */
+typedef struct {
+    struct hlld_ingest *ingest;
+    char name[64];
+    ingest_ring_header *ring;
+    size_t map_len;
+    uint64_t size;              // Kept apart from the header, which
+    uint64_t tail;              // the producer may write over
+    int started;
+    pthread_t thread;
+    char *frame;                // Private copy of the frame being applied
+    uint64_t frames;            // Frames applied
+    uint64_t dropped;           // Frames refused by the manager
+} ingest_ring;
+
+struct hlld_ingest {
+    hlld_config *config;
+    hlld_setmgr *mgr;
+    int *should_run;
+    int num_rings;
+    ingest_ring *rings;
+};
+
+static int create_ring(ingest_ring *r, uint64_t size);
+static void* ring_thread_main(void *in);
+static int drain_ring(ingest_ring *r);
+static int apply_frame(ingest_ring *r, char *frame, uint32_t len);
+static void wait_for_frames(ingest_ring_header *ring, uint64_t tail);
+static void wake_server(ingest_ring_header *ring);
+
+static inline uint32_t load_le16(const char *buf) {
+    const unsigned char *b = (const unsigned char*)buf;
+    return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t load_le32(const char *buf) {
+    return load_le16(buf) | (load_le16(buf + 2) << 16);
+}
+
+static inline uint64_t load_le64(const char *buf) {
+    return load_le32(buf) | ((uint64_t)load_le32(buf + 4) << 32);
+}
+
+/**
+ * Creates the ingest rings, and starts their threads
+ * @arg config The configuration
+ * @arg mgr The manager to write the sets of
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the rings should stop.
+ * @arg out Output, the rings
+ * @return 1 if the rings were started, 0 if there are none,
+ * or -1 if they could not be created.
+ */
+int start_ingest(hlld_config *config, hlld_setmgr *mgr, int *should_run, hlld_ingest **out) {
+    if (config->ingest_rings <= 0) return 0;
+    if (config->read_only) {
+        syslog(LOG_WARNING, "A read only server does not create ingest rings.");
+        return 0;
+    }
+
+    hlld_ingest *ingest = calloc(1, sizeof(hlld_ingest));
+    ingest->config = config;
+    ingest->mgr = mgr;
+    ingest->should_run = should_run;
+    ingest->rings = calloc(config->ingest_rings, sizeof(ingest_ring));
+    ingest->num_rings = config->ingest_rings;
+
+    uint64_t size = (uint64_t)config->ingest_ring_kb * 1024;
+    for (int i=0; i < ingest->num_rings; i++) {
+        ingest_ring *r = ingest->rings + i;
+        r->ingest = ingest;
+        snprintf(r->name, sizeof(r->name), INGEST_RING_NAME, config->tcp_port, i);
+        int res = create_ring(r, size);
+        if (res) {
+            syslog(LOG_ERR, "Failed to create the ingest ring '%s'. Err: %s.",
+                    r->name, strerror(-res));
+            stop_ingest(ingest);
+            return -1;
+        }
+        if (pthread_create(&r->thread, NULL, ring_thread_main, r)) {
+            syslog(LOG_ERR, "Failed to start the thread of ingest ring '%s'.", r->name);
+            stop_ingest(ingest);
+            return -1;
+        }
+        r->started = 1;
+    }
+
+    syslog(LOG_INFO, "Created %d ingest rings of %d KB.", ingest->num_rings,
+            config->ingest_ring_kb);
+    *out = ingest;
+    return 1;
+}
+
+/**
+ * Stops the ingest rings once should_run is set to 0,
+ * waiting for their threads, and removes the rings.
+ * @arg ingest The rings
+ */
+void stop_ingest(hlld_ingest *ingest) {
+    for (int i=0; i < ingest->num_rings; i++) {
+        ingest_ring *r = ingest->rings + i;
+        if (r->started) pthread_join(r->thread, NULL);
+        if (!r->ring) continue;
+        if (r->frames || r->dropped)
+            syslog(LOG_INFO, "Ingest ring '%s' applied %llu frames, and dropped %llu.",
+                    r->name, (unsigned long long)r->frames, (unsigned long long)r->dropped);
+        munmap(r->ring, r->map_len);
+        shm_unlink(r->name);
+        free(r->frame);
+    }
+    free(ingest->rings);
+    free(ingest);
+}
+
+/**
+ * Creates the shared memory of a ring, replacing a ring
+ * left behind by a server that did not stop cleanly
+ * @return 0 on success, negative errno on failure.
+ */
+static int create_ring(ingest_ring *r, uint64_t size) {
+    shm_unlink(r->name);
+    int fd = shm_open(r->name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) return -errno;
+    r->map_len = sizeof(ingest_ring_header) + size;
+    int res = 0;
+    if (ftruncate(fd, r->map_len)) res = -errno;
+    void *addr = (res) ? MAP_FAILED : mmap(NULL, r->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (!res && addr == MAP_FAILED) res = -errno;
+    close(fd);
+    if (res) {
+        shm_unlink(r->name);
+        return res;
+    }
+
+    // The magic is set last, once the ring may be used
+    r->ring = addr;
+    r->size = size;
+    r->ring->size = size;
+    r->ring->version = INGEST_VERSION;
+    __sync_synchronize();
+    r->ring->magic = INGEST_MAGIC;
+    r->frame = malloc(size);
+    return (r->frame) ? 0 : -ENOMEM;
+}
+
+/**
+ * Entry point of the thread of a ring. Frames are taken
+ * while there are any, and the thread only sleeps once
+ * the ring is empty.
+ */
+static void* ring_thread_main(void *in) {
+    ingest_ring *r = in;
+    hlld_setmgr *mgr = r->ingest->mgr;
+    setmgr_client_checkpoint(mgr);
+    while (*r->ingest->should_run) {
+        if (drain_ring(r)) continue;
+        setmgr_client_idle(mgr);
+        wait_for_frames(r->ring, r->tail);
+        setmgr_client_checkpoint(mgr);
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+/**
+ * Takes the frames of a ring until it is empty. Each frame
+ * is copied out before it is checked, so the producer cannot
+ * change it meanwhile, and its space is handed back at once.
+ * A ring with a corrupt frame is emptied, since the frames
+ * after it cannot be found.
+ * @return The number of frames taken
+ */
+static int drain_ring(ingest_ring *r) {
+    ingest_ring_header *ring = r->ring;
+    char *data = (char*)(ring + 1);
+    uint64_t size = r->size;
+    uint64_t tail = r->tail;
+    int taken = 0;
+    while (*r->ingest->should_run) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+
+        uint64_t off = tail & (size - 1);
+        uint64_t remain = size - off;
+        char *header = data + off;
+        int op = (unsigned char)header[1];
+        uint64_t len = INGEST_FRAME_HEADER + (uint64_t)load_le32(header + 8);
+        if ((unsigned char)header[0] != FRAME_MAGIC || head - tail > size ||
+                (op == INGEST_SKIP && tail + remain > head) ||
+                (op != INGEST_SKIP && (ALIGN_FRAME(len) > remain || tail + ALIGN_FRAME(len) > head))) {
+            syslog(LOG_WARNING, "Corrupt frame in ingest ring '%s', dropping %llu bytes.",
+                    r->name, (unsigned long long)(head - tail));
+            tail = head;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            break;
+        }
+
+        // A skip takes the rest of the ring
+        if (op == INGEST_SKIP) {
+            tail += remain;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        memcpy(r->frame, header, len);
+        tail += ALIGN_FRAME(len);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        if (apply_frame(r, r->frame, len)) r->dropped++;
+        else r->frames++;
+        if (!(++taken % PERIODIC_CHECKPOINT)) setmgr_client_checkpoint(r->ingest->mgr);
+    }
+    r->tail = tail;
+    return taken;
+}
+
+/**
+ * Sets the keys or hashes of a frame, in batches
+ * @return 0 on success, -1 if the frame was refused
+ */
+static int apply_frame(ingest_ring *r, char *frame, uint32_t len) {
+    int op = (unsigned char)frame[1];
+    int name_len = load_le16(frame + 2);
+    uint32_t num = load_le32(frame + 4);
+    uint32_t body_len = len - INGEST_FRAME_HEADER;
+    char *body = frame + INGEST_FRAME_HEADER;
+    if ((op != FRAME_SET_KEYS && op != FRAME_SET_HASHES) || name_len <= 0 ||
+            name_len >= MAX_NAME_LEN || (uint32_t)name_len > body_len || !num)
+        return -1;
+
+    // The lengths must add up to the body
+    uint64_t remain = body_len - name_len;
+    char *lens = body + name_len;
+    if (op == FRAME_SET_HASHES) {
+        if (remain != (uint64_t)num * sizeof(uint64_t)) return -1;
+    } else {
+        if (remain / 2 < num) return -1;
+        uint64_t total = (uint64_t)num * 2;
+        for (uint32_t i=0; i < num; i++) total += load_le16(lens + 2 * i);
+        if (total != remain) return -1;
+    }
+
+    char set_name[MAX_NAME_LEN];
+    memcpy(set_name, body, name_len);
+    set_name[name_len] = '\0';
+
+    char *keys[INGEST_BATCH];
+    int key_lens[INGEST_BATCH];
+    uint64_t hashes[INGEST_BATCH];
+    char *key = lens + 2 * (uint64_t)num;
+    for (uint32_t done = 0; done < num;) {
+        int n = 0;
+        for (; n < INGEST_BATCH && done + n < num; n++) {
+            uint32_t i = done + n;
+            if (op == FRAME_SET_HASHES) {
+                hashes[n] = load_le64(lens + i * sizeof(uint64_t));
+            } else {
+                key_lens[n] = load_le16(lens + 2 * i);
+                keys[n] = key;
+                key += key_lens[n];
+            }
+        }
+        int res = (op == FRAME_SET_HASHES) ?
+            setmgr_set_hashes(r->ingest->mgr, set_name, hashes, n) :
+            setmgr_set_sized_keys(r->ingest->mgr, set_name, keys, key_lens, n);
+        if (res) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Sleeps until the producer moves the head past the tail,
+ * or for at most MAX_SLEEP_MSEC. The sleeping flag is set
+ * before the head is checked again, so a frame written
+ * meanwhile either is seen or wakes us.
+ */
+static void wait_for_frames(ingest_ring_header *ring, uint64_t tail) {
+    ring->sleeping = 1;
+    __sync_synchronize();
+    if (ring->head == tail) {
+#ifdef __linux__
+        struct timespec ts = {0, MAX_SLEEP_MSEC * 1000000};
+        syscall(SYS_futex, &ring->sleeping, FUTEX_WAIT, 1, &ts, NULL, 0);
+#else
+        usleep(MAX_SLEEP_MSEC * 1000);
+#endif
+    }
+    ring->sleeping = 0;
+}
+
+/**
+ * Wakes the thread of a ring if it sleeps
+ */
+static void wake_server(ingest_ring_header *ring) {
+    __sync_synchronize();
+    if (!ring->sleeping) return;
+    ring->sleeping = 0;
+#ifdef __linux__
+    syscall(SYS_futex, &ring->sleeping, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Maps a ring created by the server, as its producer
+ * @arg name The name of the ring
+ * @arg ring Output, the header of the ring
+ * @return 0 on success, negative errno on failure.
+ */
+int ingest_ring_open(const char *name, ingest_ring_header **ring) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return -errno;
+    ingest_ring_header header;
+    int res = 0;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) res = -EINVAL;
+    else if (header.magic != INGEST_MAGIC || header.version != INGEST_VERSION) res = -EINVAL;
+    void *addr = MAP_FAILED;
+    if (!res) {
+        addr = mmap(NULL, sizeof(header) + header.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) res = -errno;
+    }
+    close(fd);
+    if (!res) *ring = addr;
+    return res;
+}
+
+/**
+ * Unmaps a ring mapped by ingest_ring_open
+ * @arg ring The ring
+ */
+void ingest_ring_close(ingest_ring_header *ring) {
+    munmap(ring, sizeof(ingest_ring_header) + ring->size);
+}
+
+/**
+ * Writes a binary frame to a ring, as its producer, and
+ * wakes the server if it waits
+ * @arg ring The ring
+ * @arg frame The frame, with its header
+ * @arg len The length of the frame
+ * @return 0 on success, -1 if the ring is full, or
+ * -2 if the frame does not fit in the ring.
+ */
+int ingest_ring_write(ingest_ring_header *ring, const char *frame, uint32_t len) {
+    uint64_t size = ring->size;
+    uint64_t padded = ALIGN_FRAME(len);
+    if (len < INGEST_FRAME_HEADER || padded > size / 2) return -2;
+
+    // A frame that would wrap starts the ring over, after a skip
+    uint64_t head = ring->head;
+    uint64_t off = head & (size - 1);
+    uint64_t skip = (off + padded > size) ? size - off : 0;
+    if (head + skip + padded - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > size)
+        return -1;
+
+    char *data = (char*)(ring + 1);
+    if (skip) {
+        memset(data + off, 0, INGEST_FRAME_HEADER);
+        data[off] = (char)FRAME_MAGIC;
+        data[off + 1] = INGEST_SKIP;
+        off = 0;
+    }
+    memcpy(data + off, frame, len);
+    __atomic_store_n(&ring->head, head + skip + padded, __ATOMIC_RELEASE);
+    wake_server(ring);
+    return 0;
+}
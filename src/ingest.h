@@ -0,0 +1,120 @@
+#ifndef INGEST_H
+#define INGEST_H
+#include <stdint.h>
+#include "config.h"
+#include "set_manager.h"
+
+/*
+ * Shared memory rings that local producers write to, without a
+ * system call per batch. Each ring is created by the server as
+ * the shared memory object named by INGEST_RING_NAME, and has a
+ * single producer. Records are the frames of the binary protocol
+ * that set keys or hashes, padded to INGEST_ALIGN bytes. A frame
+ * never wraps: a frame of opcode INGEST_SKIP skips the rest of
+ * the ring instead.
+ *
+ * The producer writes a frame at head, then advances the head.
+ * If sleeping is then set, it clears it and wakes the futex on
+ * it. A thread for each ring drains it, and only sleeps once it
+ * is empty.
+ */
+
+/**
+ * The name of a ring, from the TCP port and its index
+ */
+#define INGEST_RING_NAME "/hlld.%d.%d"
+
+/**
+ * The first bytes of each ring, "HRNG"
+ */
+#define INGEST_MAGIC 0x474E5248
+
+/**
+ * The version of the ring layout
+ */
+#define INGEST_VERSION 1
+
+/**
+ * Frames are padded to a multiple of this, so the end
+ * of a ring always has room for the header of a skip
+ */
+#define INGEST_ALIGN 16
+
+/**
+ * The size of a frame header, as in the binary protocol
+ */
+#define INGEST_FRAME_HEADER 12
+
+/**
+ * The opcode of a frame that skips to the end of the ring
+ */
+#define INGEST_SKIP 0
+
+/**
+ * The header of a ring, followed by its data. The
+ * offsets of the producer and the server are kept on
+ * cache lines of their own.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              // Bytes of data, a power of 2
+    char pad0[48];
+    volatile uint64_t head;     // Bytes written by the producer
+    char pad1[56];
+    volatile uint64_t tail;     // Bytes taken by the server
+    char pad2[56];
+    volatile uint32_t sleeping; // Set while the server waits for the head
+    char pad3[60];
+} ingest_ring_header;
+
+/**
+ * The rings of the server
+ */
+typedef struct hlld_ingest hlld_ingest;
+
+/**
+ * Creates the ingest rings, and starts their threads
+ * @arg config The configuration
+ * @arg mgr The manager to write the sets of
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the rings should stop.
+ * @arg out Output, the rings
+ * @return 1 if the rings were started, 0 if there are none,
+ * or -1 if they could not be created.
+ */
+int start_ingest(hlld_config *config, hlld_setmgr *mgr, int *should_run, hlld_ingest **out);
+
+/**
+ * Stops the ingest rings once should_run is set to 0,
+ * waiting for their threads, and removes the rings.
+ * @arg ingest The rings
+ */
+void stop_ingest(hlld_ingest *ingest);
+
+/**
+ * Maps a ring created by the server, as its producer
+ * @arg name The name of the ring
+ * @arg ring Output, the header of the ring
+ * @return 0 on success, negative errno on failure.
+ */
+int ingest_ring_open(const char *name, ingest_ring_header **ring);
+
+/**
+ * Unmaps a ring mapped by ingest_ring_open
+ * @arg ring The ring
+ */
+void ingest_ring_close(ingest_ring_header *ring);
+
+/**
+ * Writes a binary frame to a ring, as its producer, and
+ * wakes the server if it waits
+ * @arg ring The ring
+ * @arg frame The frame, with its header
+ * @arg len The length of the frame
+ * @return 0 on success, -1 if the ring is full, or
+ * -2 if the frame does not fit in the ring.
+ */
+int ingest_ring_write(ingest_ring_header *ring, const char *frame, uint32_t len);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * Batched file I/O, used to flush and load register files.
+ *
+ * On Linux each thread lazily sets up a small io_uring. A batch
+ * queues one request per range, and a single io_uring_enter both
+ * submits them and waits for them to complete, so the writes of
+ * every dirty run are in flight at once. A sync is queued behind
+ * the writes with IOSQE_IO_DRAIN, so it only starts once they are
+ * done. The rings are those of uring.h, which avoid depending
+ * on liburing.
+ *
+ * If io_uring is not supported by the platform or the kernel, or
+ * it is disabled, requests are issued one at a time instead.
+ */
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "iobatch.h"
+#include "uring.h"
+
+#ifdef HLLD_URING
+#define IOBATCH_URING 1
+#endif
+
+#define RING_ENTRIES 64         // Requests in flight per thread
+#define READ_CHUNK (256 * 1024) // Bytes per read request
+#define MAX_REQUEST (1 << 30)   // Largest single request
+
+#define COUNT(syscalls) if (syscalls) (*syscalls)++
+
+/*
+ * Part of a batch that is still outstanding
+ */
+typedef struct {
+    unsigned char *buf;
+    uint64_t len;       // Bytes left
+    uint64_t offset;
+} pending_op;
+
+static volatile int USE_URING = 1;
+
+/**
+ * Writes and syncs one request at a time
+ */
+static int sync_write(int fd, const iobatch_range *ranges, int num, int sync, uint64_t *syscalls) {
+    for (int i=0; i < num; i++) {
+        uint64_t total = 0;
+        ssize_t res;
+        while (total < ranges[i].len) {
+            COUNT(syscalls);
+            res = pwrite(fd, ranges[i].buf + total, ranges[i].len - total,
+                    ranges[i].offset + total);
+            if (res == -1 && errno != EINTR)
+                return -errno;
+            else if (res > 0)
+                total += res;
+        }
+    }
+    if (sync) {
+        COUNT(syscalls);
+        if (fsync(fd)) return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Reads one request at a time
+ */
+static int64_t sync_read(int fd, unsigned char *buf, uint64_t len, uint64_t offset, uint64_t *syscalls) {
+    uint64_t total = 0;
+    ssize_t more;
+    while (total < len) {
+        COUNT(syscalls);
+        more = pread(fd, buf + total, len - total, offset + total);
+        if (more == 0)
+            break;
+        else if (more < 0 && errno != EINTR)
+            return -errno;
+        else if (more > 0)
+            total += more;
+    }
+    return total;
+}
+
+#ifdef IOBATCH_URING
+
+typedef hlld_uring uring;
+
+// Marks threads where the ring could not be set up
+static uring RING_FAILED;
+
+static pthread_key_t RING_KEY;
+static pthread_once_t RING_ONCE = PTHREAD_ONCE_INIT;
+
+static void ring_destroy(void *ptr) {
+    uring *r = ptr;
+    if (r == &RING_FAILED) return;
+    uring_free(r);
+    free(r);
+}
+
+static void ring_key_init() {
+    pthread_key_create(&RING_KEY, ring_destroy);
+}
+
+/**
+ * Returns the ring of this thread, setting it up on first
+ * use. Returns NULL if io_uring cannot be used.
+ */
+static uring* thread_ring() {
+    if (!USE_URING) return NULL;
+    pthread_once(&RING_ONCE, ring_key_init);
+    uring *r = pthread_getspecific(RING_KEY);
+    if (r == &RING_FAILED) return NULL;
+    if (r) return r;
+
+    r = calloc(1, sizeof(uring));
+    if (!r || uring_setup(r, RING_ENTRIES, 0)) {
+        free(r);
+        pthread_setspecific(RING_KEY, &RING_FAILED);
+        return NULL;
+    }
+    pthread_setspecific(RING_KEY, r);
+    return r;
+}
+
+/**
+ * Drops the ring of this thread after an error, since it
+ * may still hold requests. Later batches do not use io_uring.
+ */
+static void ring_abandon(uring *r) {
+    ring_destroy(r);
+    pthread_setspecific(RING_KEY, &RING_FAILED);
+}
+
+/**
+ * Queues a request, identified by its slot in the batch
+ */
+static void ring_queue(uring *r, int op, int fd, unsigned char *buf,
+        uint32_t len, uint64_t offset, int flags, unsigned slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = slot;
+}
+
+/**
+ * Submits the queued requests, and waits for all of them.
+ * The result of each is stored by slot.
+ */
+static int ring_run(uring *r, unsigned num, int32_t *results, uint64_t *syscalls) {
+    unsigned completed = 0;
+    struct io_uring_cqe cqe;
+    while (completed < num) {
+        COUNT(syscalls);
+        int res = uring_enter(r, num - completed);
+        if (res < 0 && res != -EINTR) return res;
+
+        // Reap what has completed
+        while (uring_next_cqe(r, &cqe)) {
+            if (cqe.user_data < num) results[cqe.user_data] = cqe.res;
+            completed++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Applies the result of a request to its pending op
+ * @return 0 if it made progress or can be retried.
+ */
+static int advance_op(pending_op *op, int32_t res) {
+    if (res == -EINTR || res == -EAGAIN) return 0;
+    if (res < 0) return res;
+    op->buf += res;
+    op->offset += res;
+    op->len -= res;
+    return 0;
+}
+
+/**
+ * Writes the ranges in rounds of at most a ring of requests,
+ * until every range is written. The sync is queued with the
+ * round that writes the last of the data.
+ */
+static int ring_write(uring *r, int fd, const iobatch_range *ranges, int num,
+        int sync, uint64_t *syscalls) {
+    pending_op *ops = calloc(num ? num : 1, sizeof(pending_op));
+    if (!ops) return -ENOMEM;
+    for (int i=0; i < num; i++) {
+        ops[i].buf = ranges[i].buf;
+        ops[i].len = ranges[i].len;
+        ops[i].offset = ranges[i].offset;
+    }
+
+    int32_t results[r->entries];
+    int slots[r->entries];
+    int next = 0, res = 0, synced = !sync;
+    for (;;) {
+        while (next < num && !ops[next].len) next++;
+        if (next == num && synced) break;
+
+        // Queue the outstanding writes, leaving room for the sync
+        unsigned queued = 0;
+        int covers_all = 1;
+        for (int i=next; i < num; i++) {
+            if (!ops[i].len) continue;
+            if (queued == r->entries - 1) {
+                covers_all = 0;
+                break;
+            }
+            uint32_t len = (ops[i].len > MAX_REQUEST) ? MAX_REQUEST : ops[i].len;
+            if (len < ops[i].len) covers_all = 0;
+            ring_queue(r, IORING_OP_WRITE, fd, ops[i].buf, len, ops[i].offset, 0, queued);
+            slots[queued++] = i;
+        }
+        int sync_slot = -1;
+        if (sync && covers_all) {
+            sync_slot = queued;
+            ring_queue(r, IORING_OP_FSYNC, fd, NULL, 0, 0, IOSQE_IO_DRAIN, queued++);
+        }
+
+        if ((res = ring_run(r, queued, results, syscalls))) {
+            ring_abandon(r);
+            break;
+        }
+
+        // Retry short writes in the next round
+        int complete = 1;
+        for (unsigned k=0; k < queued; k++) {
+            if ((int)k == sync_slot) continue;
+            pending_op *op = ops + slots[k];
+            if (!res && results[k] == 0) res = -EIO;
+            if (!res) res = advance_op(op, results[k]);
+            if (op->len) complete = 0;
+        }
+        if (res) break;
+        if (sync_slot >= 0 && complete) {
+            if (results[sync_slot] < 0 && results[sync_slot] != -EINTR &&
+                    results[sync_slot] != -EAGAIN) {
+                res = results[sync_slot];
+                break;
+            }
+            synced = (results[sync_slot] >= 0);
+        }
+    }
+    free(ops);
+    return res;
+}
+
+/**
+ * Reads the file in chunks, with a ring of chunks in flight.
+ * Chunks past the end of the file complete with no data.
+ */
+static int64_t ring_read(uring *r, int fd, unsigned char *buf, uint64_t len, uint64_t offset, uint64_t *syscalls) {
+    int num = (len + READ_CHUNK - 1) / READ_CHUNK;
+    pending_op *ops = calloc(num ? num : 1, sizeof(pending_op));
+    if (!ops) return -ENOMEM;
+    for (int i=0; i < num; i++) {
+        ops[i].buf = buf + (uint64_t)i * READ_CHUNK;
+        ops[i].offset = offset + (uint64_t)i * READ_CHUNK;
+        ops[i].len = (len - (uint64_t)i * READ_CHUNK < READ_CHUNK) ? len - (uint64_t)i * READ_CHUNK : READ_CHUNK;
+    }
+
+    int32_t results[r->entries];
+    int slots[r->entries];
+    int64_t res = 0;
+    uint64_t total = 0;
+    int next = 0;
+    for (;;) {
+        while (next < num && !ops[next].len) next++;
+        if (next == num) break;
+
+        unsigned queued = 0;
+        for (int i=next; i < num && queued < r->entries; i++) {
+            if (!ops[i].len) continue;
+            ring_queue(r, IORING_OP_READ, fd, ops[i].buf, ops[i].len, ops[i].offset, 0, queued);
+            slots[queued++] = i;
+        }
+        if ((res = ring_run(r, queued, results, syscalls))) {
+            ring_abandon(r);
+            break;
+        }
+
+        for (unsigned k=0; k < queued; k++) {
+            pending_op *op = ops + slots[k];
+            if (results[k] == 0) op->len = 0;   // End of file
+            else if (results[k] > 0) total += results[k];
+            if (!res) res = advance_op(op, results[k]);
+        }
+        if (res) break;
+    }
+    free(ops);
+    return res ? res : (int64_t)total;
+}
+
+#endif
+
+/**
+ * Writes every range to a file, then optionally syncs it.
+ * Short writes are retried until the ranges are complete.
+ * @arg fd The file to write to
+ * @arg ranges The ranges to write
+ * @arg num The number of ranges
+ * @arg sync If 1, the file is synced after the writes
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return 0 on success, negative errno on failure.
+ */
+int iobatch_write(int fd, const iobatch_range *ranges, int num, int sync, uint64_t *syscalls) {
+#ifdef IOBATCH_URING
+    uring *r = thread_ring();
+    if (r) return ring_write(r, fd, ranges, num, sync, syscalls);
+#endif
+    return sync_write(fd, ranges, num, sync, syscalls);
+}
+
+/**
+ * Reads a file into a buffer, from the start of the file.
+ * Large reads are split into chunks that are read at once.
+ * @arg fd The file to read from
+ * @arg buf The buffer to read into
+ * @arg len The number of bytes to read
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return The number of bytes read, which is less than len
+ * if the file is shorter, or negative errno on failure.
+ */
+int64_t iobatch_read(int fd, unsigned char *buf, uint64_t len, uint64_t *syscalls) {
+    return iobatch_read_at(fd, buf, len, 0, syscalls);
+}
+
+/**
+ * Reads a range of a file into a buffer, like iobatch_read.
+ * @arg fd The file to read from
+ * @arg buf The buffer to read into
+ * @arg len The number of bytes to read
+ * @arg offset The offset of the range in the file
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return The number of bytes read, which is less than len
+ * if the file ends first, or negative errno on failure.
+ */
+int64_t iobatch_read_at(int fd, unsigned char *buf, uint64_t len, uint64_t offset, uint64_t *syscalls) {
+#ifdef IOBATCH_URING
+    uring *r = thread_ring();
+    if (r) return ring_read(r, fd, buf, len, offset, syscalls);
+#endif
+    return sync_read(fd, buf, len, offset, syscalls);
+}
+
+/**
+ * Enables or disables the use of io_uring. It is used by
+ * default when available. Meant for testing and benchmarks.
+ * @arg enable 1 to use io_uring when available, 0 to disable it
+ * @return 1 if io_uring will be used by this thread.
+ */
+int iobatch_use_uring(int enable) {
+    USE_URING = enable;
+#ifdef IOBATCH_URING
+    return thread_ring() != NULL;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,66 @@
+#ifndef IOBATCH_H
+#define IOBATCH_H
+#include <stdint.h>
+
+/*
+ * Batched file I/O. On Linux, the requests of a batch are
+ * submitted together through a per-thread io_uring, so the
+ * kernel can work on all of them at once with a single system
+ * call. Elsewhere, or if io_uring is unavailable, the requests
+ * are issued one at a time with pwrite, pread and fsync.
+ */
+
+/**
+ * A range of a file, and the buffer holding its contents
+ */
+typedef struct {
+    unsigned char *buf;
+    uint64_t len;
+    uint64_t offset;
+} iobatch_range;
+
+/**
+ * Writes every range to a file, then optionally syncs it.
+ * Short writes are retried until the ranges are complete.
+ * @arg fd The file to write to
+ * @arg ranges The ranges to write
+ * @arg num The number of ranges
+ * @arg sync If 1, the file is synced after the writes
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return 0 on success, negative errno on failure.
+ */
+int iobatch_write(int fd, const iobatch_range *ranges, int num, int sync, uint64_t *syscalls);
+
+/**
+ * Reads a file into a buffer, from the start of the file.
+ * Large reads are split into chunks that are read at once.
+ * @arg fd The file to read from
+ * @arg buf The buffer to read into
+ * @arg len The number of bytes to read
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return The number of bytes read, which is less than len
+ * if the file is shorter, or negative errno on failure.
+ */
+int64_t iobatch_read(int fd, unsigned char *buf, uint64_t len, uint64_t *syscalls);
+
+/**
+ * Reads a range of a file into a buffer, like iobatch_read.
+ * @arg fd The file to read from
+ * @arg buf The buffer to read into
+ * @arg len The number of bytes to read
+ * @arg offset The offset of the range in the file
+ * @arg syscalls Optional, incremented by the system calls made
+ * @return The number of bytes read, which is less than len
+ * if the file ends first, or negative errno on failure.
+ */
+int64_t iobatch_read_at(int fd, unsigned char *buf, uint64_t len, uint64_t offset, uint64_t *syscalls);
+
+/**
+ * Enables or disables the use of io_uring. It is used by
+ * default when available. Meant for testing and benchmarks.
+ * @arg enable 1 to use io_uring when available, 0 to disable it
+ * @return 1 if io_uring will be used by this thread.
+ */
+int iobatch_use_uring(int enable);
+
+#endif
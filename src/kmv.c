@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kmv.h"
+
+/*
+ * Encoded sketches start with this header, in host
+ * byte order, followed by the kept hashes ascending.
+ */
+#define KMV_MAGIC 0x48564D4B
+#define KMV_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t pad[3];
+    uint32_t k;
+    uint32_t num;
+} kmv_header;
+
+// Hashes are screened against the threshold in groups of this size
+#define KMV_BATCH_SIZE 64
+
+/*
+ * The 64 bit finalizer of MurmurHash3. The registers are
+ * picked by the top bits of a hash, so the hashes are mixed
+ * before they are ordered to keep the two independent.
+ */
+static inline uint64_t kmv_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Initializes an empty sketch
+ * @arg k The most hashes to keep
+ * @arg s The sketch to initialize
+ * @return 0 on success, -1 on error.
+ */
+int kmv_init(int k, kmv_sketch *s) {
+    if (k < KMV_MIN_SIZE || k > KMV_MAX_SIZE) return -1;
+    s->hashes = malloc(kmv_bytes(k));
+    if (!s->hashes) return -1;
+    s->k = k;
+    s->num = 0;
+    s->threshold = UINT64_MAX;
+    s->dirty = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+/**
+ * Destroys a sketch, freeing its hashes
+ * @arg s The sketch
+ */
+void kmv_destroy(kmv_sketch *s) {
+    free(s->hashes);
+    s->hashes = NULL;
+    pthread_mutex_destroy(&s->lock);
+}
+
+/*
+ * Finds the index of the first kept hash at or above a value
+ */
+static int lower_bound(const uint64_t *hashes, int num, uint64_t val) {
+    int lo = 0, hi = num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (hashes[mid] < val) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Keeps mixed values below the threshold. Must be
+ * called with the lock held.
+ * @return The number of values kept.
+ */
+static int insert_values(kmv_sketch *s, const uint64_t *vals, int num) {
+    int kept = 0;
+    for (int i=0; i < num; i++) {
+        uint64_t val = vals[i];
+        if (val >= s->threshold) continue;
+        int idx = lower_bound(s->hashes, s->num, val);
+        if (idx < s->num && s->hashes[idx] == val) continue;
+
+        // A full sketch drops its largest hash for the new one
+        if (s->num == s->k) s->num--;
+        memmove(s->hashes + idx + 1, s->hashes + idx, (s->num - idx) * sizeof(uint64_t));
+        s->hashes[idx] = val;
+        if (++s->num == s->k) s->threshold = s->hashes[s->k - 1];
+        kept++;
+    }
+    if (kept) s->dirty = 1;
+    return kept;
+}
+
+/**
+ * Adds the hashes of keys to a sketch. Once it is full,
+ * most hashes are above the threshold, and are dropped
+ * without taking the lock.
+ * @note Thread safe.
+ * @arg s The sketch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of hashes kept.
+ */
+int kmv_add_hashes(kmv_sketch *s, const uint64_t *hashes, int num) {
+    uint64_t vals[KMV_BATCH_SIZE];
+    int kept = 0;
+    while (num > 0) {
+        int batch = (num < KMV_BATCH_SIZE) ? num : KMV_BATCH_SIZE, below = 0;
+        uint64_t threshold = s->threshold;
+        for (int i=0; i < batch; i++) {
+            uint64_t val = kmv_mix(hashes[i]);
+            if (val < threshold) vals[below++] = val;
+        }
+        if (below) {
+            pthread_mutex_lock(&s->lock);
+            kept += insert_values(s, vals, below);
+            pthread_mutex_unlock(&s->lock);
+        }
+        hashes += batch;
+        num -= batch;
+    }
+    return kept;
+}
+
+/*
+ * Copies the kept hashes of a sketch under its lock
+ * @arg out Output, a malloc'd array the caller must free
+ * @return The number of hashes, or -1 on error.
+ */
+static int copy_hashes(kmv_sketch *s, uint64_t **out) {
+    *out = malloc(kmv_bytes(s->k));
+    if (!*out) return -1;
+    pthread_mutex_lock(&s->lock);
+    int num = s->num;
+    memcpy(*out, s->hashes, num * sizeof(uint64_t));
+    pthread_mutex_unlock(&s->lock);
+    return num;
+}
+
+/**
+ * Merges a sketch into another, so that it sketches the
+ * union of their sets. A larger source is cut down to the
+ * size of the destination.
+ * @note Thread safe.
+ * @arg dst The sketch to merge into
+ * @arg src The sketch to merge from. Not modified.
+ * @return 0 on success, -1 on error.
+ */
+int kmv_union(kmv_sketch *dst, kmv_sketch *src) {
+    if (dst == src) return 0;
+
+    // Copy first, so both locks are never held at once
+    uint64_t *vals;
+    int num = copy_hashes(src, &vals);
+    if (num < 0) return -1;
+    pthread_mutex_lock(&dst->lock);
+    insert_values(dst, vals, num);
+    pthread_mutex_unlock(&dst->lock);
+    free(vals);
+    return 0;
+}
+
+/*
+ * Estimates the keys of a sketch of num hashes at most k
+ * from its largest hash, as (k - 1) / (largest / 2^64).
+ */
+static double estimate_size(int num, int k, uint64_t largest) {
+    if (num < k) return num;
+    return (k - 1) / ((double)largest / 18446744073709551616.0);
+}
+
+/**
+ * Estimates the distinct keys added to a sketch
+ * @note Thread safe.
+ * @arg s The sketch
+ * @return The estimate
+ */
+double kmv_size(kmv_sketch *s) {
+    pthread_mutex_lock(&s->lock);
+    double size = (s->num) ? estimate_size(s->num, s->k, s->hashes[s->num - 1]) : 0;
+    pthread_mutex_unlock(&s->lock);
+    return size;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Estimates the Jaccard similarity of the sets of several
+ * sketches, the size of their intersection over that of
+ * their union. The sketches are compared at the size of
+ * the smallest of them.
+ * @note Thread safe.
+ * @arg sketches The sketches
+ * @arg num The number of sketches
+ * @arg jaccard Output, the similarity from 0 to 1
+ * @arg union_size Output, the estimated size of the union. May be NULL.
+ * @return 0 on success, -1 on error.
+ */
+int kmv_jaccard(kmv_sketch **sketches, int num, double *jaccard, double *union_size) {
+    if (num < 1) return -1;
+    uint64_t **copies = calloc(num, sizeof(uint64_t*));
+    int *lens = calloc(num, sizeof(int));
+    int k = KMV_MAX_SIZE, total = 0, res = 0;
+    uint64_t *all = NULL;
+    if (!copies || !lens) {
+        res = -1;
+        goto LEAVE;
+    }
+    for (int i=0; i < num; i++) {
+        lens[i] = copy_hashes(sketches[i], copies + i);
+        if (lens[i] < 0) {
+            res = -1;
+            goto LEAVE;
+        }
+        total += lens[i];
+        if (sketches[i]->k < k) k = sketches[i]->k;
+    }
+
+    // The k smallest hashes of the union sketch the union.
+    // Each is among the k smallest of every set holding it,
+    // so it is kept by the sketch of each of them.
+    all = malloc((total + 1) * sizeof(uint64_t));
+    if (!all) {
+        res = -1;
+        goto LEAVE;
+    }
+    int len = 0;
+    for (int i=0; i < num; i++) {
+        memcpy(all + len, copies[i], lens[i] * sizeof(uint64_t));
+        len += lens[i];
+    }
+    qsort(all, len, sizeof(uint64_t), compare_hashes);
+    int distinct = 0;
+    for (int i=0; i < len && distinct < k; i++) {
+        if (!distinct || all[i] != all[distinct - 1]) all[distinct++] = all[i];
+    }
+
+    // Count those in every sketch
+    int shared = 0;
+    for (int i=0; i < distinct; i++) {
+        int in_all = 1;
+        for (int j=0; j < num && in_all; j++) {
+            int idx = lower_bound(copies[j], lens[j], all[i]);
+            in_all = idx < lens[j] && copies[j][idx] == all[i];
+        }
+        shared += in_all;
+    }
+    *jaccard = (distinct) ? (double)shared / distinct : 0;
+    if (union_size)
+        *union_size = (distinct) ? estimate_size(distinct, k, all[distinct - 1]) : 0;
+
+LEAVE:
+    if (copies) {
+        for (int i=0; i < num; i++) free(copies[i]);
+    }
+    free(copies);
+    free(lens);
+    free(all);
+    return res;
+}
+
+/**
+ * Returns the bytes used by the hashes of a sketch
+ * @arg k The most hashes kept
+ */
+uint64_t kmv_bytes(int k) {
+    return (uint64_t)k * sizeof(uint64_t);
+}
+
+/**
+ * Encodes the hashes of a sketch, so that it can be saved
+ * and loaded with kmv_decode. Clears the dirty flag.
+ * @arg s The sketch
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int kmv_encode(kmv_sketch *s, unsigned char **buf, uint64_t *len) {
+    unsigned char *out = *buf = malloc(sizeof(kmv_header) + kmv_bytes(s->k));
+    if (!out) return -1;
+
+    // Cleared before copying, so that later changes are saved again
+    pthread_mutex_lock(&s->lock);
+    s->dirty = 0;
+    kmv_header header = {KMV_MAGIC, KMV_VERSION, {0, 0, 0}, s->k, s->num};
+    memcpy(out, &header, sizeof(kmv_header));
+    memcpy(out + sizeof(kmv_header), s->hashes, s->num * sizeof(uint64_t));
+    *len = sizeof(kmv_header) + s->num * sizeof(uint64_t);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**
+ * Loads the hashes of a sketch from a buffer produced by
+ * kmv_encode, which must be of the same size.
+ * @arg s The sketch, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int kmv_decode(kmv_sketch *s, const unsigned char *buf, uint64_t len) {
+    kmv_header header;
+    if (len < sizeof(kmv_header)) return -1;
+    memcpy(&header, buf, sizeof(kmv_header));
+    if (header.magic != KMV_MAGIC || header.version != KMV_VERSION ||
+            header.k != (uint32_t)s->k || header.num > header.k ||
+            len != sizeof(kmv_header) + header.num * sizeof(uint64_t))
+        return -1;
+
+    // The hashes must be strictly ascending
+    const unsigned char *hashes = buf + sizeof(kmv_header);
+    uint64_t prev = 0, val;
+    for (uint32_t i=0; i < header.num; i++) {
+        memcpy(&val, hashes + i * sizeof(uint64_t), sizeof(uint64_t));
+        if (i && val <= prev) return -1;
+        prev = val;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    memcpy(s->hashes, hashes, header.num * sizeof(uint64_t));
+    s->num = header.num;
+    s->threshold = (s->num == s->k) ? s->hashes[s->k - 1] : UINT64_MAX;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef KMV_H
+#define KMV_H
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A k-minimum-values sketch keeps the k smallest hashes
+ * a set has seen. Unlike registers, the sketches of
+ * several sets can estimate the Jaccard similarity of the
+ * sets, and so the size of their intersection, with an
+ * error relative to the intersection rather than the union.
+ * The hashes are re-mixed before they are kept, so the
+ * sketch does not follow the bits that pick the registers.
+ */
+
+/**
+ * The bounds on the hashes a sketch keeps
+ */
+#define KMV_MIN_SIZE 16
+#define KMV_MAX_SIZE 65536
+
+typedef struct {
+    int k;                          // The most hashes kept
+    int num;                        // The hashes kept
+    uint64_t *hashes;               // The kept hashes, ascending
+    volatile uint64_t threshold;    // Hashes at or above are not kept
+    pthread_mutex_t lock;           // Serializes inserts with reads
+    volatile int dirty;             // Set when a hash is kept
+} kmv_sketch;
+
+/**
+ * Initializes an empty sketch
+ * @arg k The most hashes to keep
+ * @arg s The sketch to initialize
+ * @return 0 on success, -1 on error.
+ */
+int kmv_init(int k, kmv_sketch *s);
+
+/**
+ * Destroys a sketch, freeing its hashes
+ * @arg s The sketch
+ */
+void kmv_destroy(kmv_sketch *s);
+
+/**
+ * Adds the hashes of keys to a sketch. Once it is full,
+ * most hashes are above the threshold, and are dropped
+ * without taking the lock.
+ * @note Thread safe.
+ * @arg s The sketch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of hashes kept.
+ */
+int kmv_add_hashes(kmv_sketch *s, const uint64_t *hashes, int num);
+
+/**
+ * Merges a sketch into another, so that it sketches the
+ * union of their sets. A larger source is cut down to the
+ * size of the destination.
+ * @note Thread safe.
+ * @arg dst The sketch to merge into
+ * @arg src The sketch to merge from. Not modified.
+ * @return 0 on success, -1 on error.
+ */
+int kmv_union(kmv_sketch *dst, kmv_sketch *src);
+
+/**
+ * Estimates the distinct keys added to a sketch
+ * @note Thread safe.
+ * @arg s The sketch
+ * @return The estimate
+ */
+double kmv_size(kmv_sketch *s);
+
+/**
+ * Estimates the Jaccard similarity of the sets of several
+ * sketches, the size of their intersection over that of
+ * their union. The sketches are compared at the size of
+ * the smallest of them.
+ * @note Thread safe.
+ * @arg sketches The sketches
+ * @arg num The number of sketches
+ * @arg jaccard Output, the similarity from 0 to 1
+ * @arg union_size Output, the estimated size of the union. May be NULL.
+ * @return 0 on success, -1 on error.
+ */
+int kmv_jaccard(kmv_sketch **sketches, int num, double *jaccard, double *union_size);
+
+/**
+ * Returns the bytes used by the hashes of a sketch
+ * @arg k The most hashes kept
+ */
+uint64_t kmv_bytes(int k);
+
+/**
+ * Encodes the hashes of a sketch, so that it can be saved
+ * and loaded with kmv_decode. Clears the dirty flag.
+ * @arg s The sketch
+ * @arg buf Output, a malloc'd buffer the caller must free
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int kmv_encode(kmv_sketch *s, unsigned char **buf, uint64_t *len);
+
+/**
+ * Loads the hashes of a sketch from a buffer produced by
+ * kmv_encode, which must be of the same size.
+ * @arg s The sketch, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int kmv_decode(kmv_sketch *s, const unsigned char *buf, uint64_t len);
+
+#endif
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "manifest.h"
+#include "art.h"
+
+/*
+ * The manifest file, and where checkpoints are written first
+ */
+static const char* MANIFEST_FILENAME = "sets.manifest";
+static const char* TMP_MANIFEST_FILENAME = "sets.manifest.tmp";
+
+/*
+ * The file starts with this magic, which includes the version
+ */
+static const char MANIFEST_MAGIC[] = "HLLDMNF5";
+#define MANIFEST_MAGIC_LEN 8
+
+// Types of records
+#define MANIFEST_ADD 1
+#define MANIFEST_DROP 2
+
+/*
+ * Each record is this header, followed by the set name
+ * and its terminator. Fields are in host byte order.
+ * The checksum covers the rest of the header and the name,
+ * so torn appends after a crash are detected.
+ */
+typedef struct {
+    uint32_t checksum;
+    uint16_t name_len;
+    uint8_t type;
+    uint8_t precision;
+    uint8_t in_memory;
+    uint8_t format;
+    uint8_t sparse;
+    uint8_t estimator;
+    uint8_t hash;
+    uint8_t pad[3];
+    double eps;
+    uint64_t size;
+    uint32_t window;
+    uint32_t window_buckets;
+    uint32_t sliding;
+    uint32_t kmv;
+    uint64_t expires;
+    uint32_t durability;
+    uint32_t flush_period;
+} manifest_record;
+
+struct hlld_manifest {
+    char *path;
+    char *tmp_path;
+    int fd;                 // Opened for appends on first use, or -1
+    pthread_mutex_t lock;   // Serializes appends and checkpoints
+
+    // Buffered checkpoint
+    unsigned char *buf;
+    uint64_t len;
+    uint64_t cap;
+};
+
+/*
+ * State used to invoke the callback of a load
+ */
+typedef struct {
+    manifest_cb cb;
+    void *data;
+} load_state;
+
+/* Static declarations */
+static uint32_t record_checksum(manifest_record *rec, const unsigned char *name);
+static void encode_record(manifest_record *rec, int type, char *set_name, hlld_set_config *config);
+static int append_record(hlld_manifest *m, int type, char *set_name, hlld_set_config *config);
+static int write_all(int fd, const unsigned char *buf, uint64_t len);
+static int load_record_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+
+/**
+ * Opens the manifest of a data directory. The file
+ * is only created once a set is recorded.
+ * @arg data_dir The data directory
+ * @arg manifest Output, the manifest
+ * @return 0 on success.
+ */
+int init_manifest(char *data_dir, hlld_manifest **manifest) {
+    hlld_manifest *m = *manifest = calloc(1, sizeof(hlld_manifest));
+    m->path = join_path(data_dir, (char*)MANIFEST_FILENAME);
+    m->tmp_path = join_path(data_dir, (char*)TMP_MANIFEST_FILENAME);
+    m->fd = -1;
+    pthread_mutex_init(&m->lock, NULL);
+    return 0;
+}
+
+/**
+ * Closes the manifest
+ * @arg manifest The manifest to close
+ * @return 0 on success.
+ */
+int destroy_manifest(hlld_manifest *manifest) {
+    if (manifest->fd >= 0) close(manifest->fd);
+    pthread_mutex_destroy(&manifest->lock);
+    free(manifest->path);
+    free(manifest->tmp_path);
+    free(manifest->buf);
+    free(manifest);
+    return 0;
+}
+
+/**
+ * Reads the manifest, invoking a callback for each set.
+ * The whole file is validated before any callback is made.
+ * @arg manifest The manifest
+ * @arg cb The callback to invoke
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets, -ENOENT if there is no
+ * manifest, or -EINVAL if it is corrupt.
+ */
+int manifest_load(hlld_manifest *manifest, manifest_cb cb, void *data) {
+    int fd = open(manifest->path, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    struct stat buf;
+    if (fstat(fd, &buf) || buf.st_size < MANIFEST_MAGIC_LEN) {
+        close(fd);
+        return -EINVAL;
+    }
+    uint64_t len = buf.st_size;
+    unsigned char *file = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return -errno;
+    madvise(file, len, MADV_SEQUENTIAL);
+
+    int res = 0;
+    if (memcmp(file, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN)) {
+        res = -EINVAL;
+        goto LEAVE;
+    }
+
+    // Replay the records, so only the last add of each set
+    // remains, and dropped sets are forgotten
+    art_tree sets;
+    init_art_tree(&sets);
+    manifest_record rec;
+    uint64_t offset = MANIFEST_MAGIC_LEN;
+    while (offset < len) {
+        if (len - offset < sizeof(manifest_record)) {
+            res = -EINVAL;
+            break;
+        }
+        memcpy(&rec, file + offset, sizeof(manifest_record));
+        unsigned char *name = file + offset + sizeof(manifest_record);
+        if (len - offset - sizeof(manifest_record) < rec.name_len || !rec.name_len ||
+                name[rec.name_len - 1] || record_checksum(&rec, name) != rec.checksum) {
+            res = -EINVAL;
+            break;
+        }
+
+        if (rec.type == MANIFEST_ADD)
+            art_insert(&sets, name, rec.name_len, file + offset);
+        else if (rec.type == MANIFEST_DROP)
+            art_delete(&sets, name, rec.name_len);
+        else {
+            res = -EINVAL;
+            break;
+        }
+        offset += sizeof(manifest_record) + rec.name_len;
+    }
+
+    if (!res) {
+        load_state state = {cb, data};
+        art_iter(&sets, load_record_cb, &state);
+        res = art_size(&sets);
+    }
+    destroy_art_tree(&sets);
+
+LEAVE:
+    munmap(file, len);
+    return res;
+}
+
+/**
+ * Appends a new set to the manifest
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @arg config The set config
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_add(hlld_manifest *manifest, char *set_name, hlld_set_config *config) {
+    return append_record(manifest, MANIFEST_ADD, set_name, config);
+}
+
+/**
+ * Appends the removal of a set to the manifest
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_drop(hlld_manifest *manifest, char *set_name) {
+    return append_record(manifest, MANIFEST_DROP, set_name, NULL);
+}
+
+/**
+ * Starts a checkpoint, which replaces the manifest with
+ * the sets given to manifest_checkpoint_add. Appends wait
+ * until the checkpoint ends, so they are not lost.
+ * @arg manifest The manifest
+ */
+void manifest_checkpoint_begin(hlld_manifest *manifest) {
+    pthread_mutex_lock(&manifest->lock);
+    manifest->len = 0;
+    if (manifest->cap < MANIFEST_MAGIC_LEN) {
+        manifest->cap = 4096;
+        manifest->buf = realloc(manifest->buf, manifest->cap);
+    }
+    memcpy(manifest->buf, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN);
+    manifest->len = MANIFEST_MAGIC_LEN;
+}
+
+/**
+ * Adds a set to the checkpoint in progress. This
+ * only buffers the set, and is cheap.
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @arg config The set config
+ */
+void manifest_checkpoint_add(hlld_manifest *manifest, char *set_name, hlld_set_config *config) {
+    size_t name_len = strlen(set_name) + 1;
+    if (name_len > UINT16_MAX) return;
+
+    uint64_t need = manifest->len + sizeof(manifest_record) + name_len;
+    if (need > manifest->cap) {
+        while (need > manifest->cap) manifest->cap *= 2;
+        manifest->buf = realloc(manifest->buf, manifest->cap);
+    }
+
+    manifest_record rec;
+    encode_record(&rec, MANIFEST_ADD, set_name, config);
+    memcpy(manifest->buf + manifest->len, &rec, sizeof(manifest_record));
+    memcpy(manifest->buf + manifest->len + sizeof(manifest_record), set_name, name_len);
+    manifest->len = need;
+}
+
+/**
+ * Writes out the checkpoint in progress, and
+ * atomically replaces the manifest with it.
+ * @arg manifest The manifest
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_checkpoint_end(hlld_manifest *manifest) {
+    int res = 0;
+    int fd = open(manifest->tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        res = -errno;
+        goto LEAVE;
+    }
+
+    res = write_all(fd, manifest->buf, manifest->len);
+    if (!res && fsync(fd)) res = -errno;
+    close(fd);
+    if (!res && rename(manifest->tmp_path, manifest->path)) res = -errno;
+    if (res) {
+        unlink(manifest->tmp_path);
+        goto LEAVE;
+    }
+
+    // Appends go to the new file from now on
+    if (manifest->fd >= 0) {
+        close(manifest->fd);
+        manifest->fd = -1;
+    }
+
+LEAVE:
+    if (res) syslog(LOG_ERR, "Failed to checkpoint the manifest. Err: %d", res);
+
+    // Do not hold on to a large buffer between checkpoints
+    if (manifest->cap > 1024 * 1024) {
+        free(manifest->buf);
+        manifest->buf = NULL;
+        manifest->cap = 0;
+    }
+    pthread_mutex_unlock(&manifest->lock);
+    return res;
+}
+
+/**
+ * Computes the FNV-1a checksum of a record
+ */
+static uint32_t record_checksum(manifest_record *rec, const unsigned char *name) {
+    uint32_t hash = 2166136261U;
+    const unsigned char *p = (const unsigned char*)rec + sizeof(uint32_t);
+    for (size_t i=0; i < sizeof(manifest_record) - sizeof(uint32_t); i++) {
+        hash = (hash ^ p[i]) * 16777619U;
+    }
+    for (int i=0; i < rec->name_len; i++) {
+        hash = (hash ^ name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Fills in a record for a set, including its checksum
+ */
+static void encode_record(manifest_record *rec, int type, char *set_name, hlld_set_config *config) {
+    memset(rec, 0, sizeof(manifest_record));
+    rec->name_len = strlen(set_name) + 1;
+    rec->type = type;
+    if (config) {
+        rec->precision = config->default_precision;
+        rec->in_memory = config->in_memory;
+        rec->format = config->format;
+        rec->sparse = config->sparse;
+        rec->estimator = config->estimator;
+        rec->hash = config->hash;
+        rec->eps = config->default_eps;
+        rec->size = config->size;
+        rec->window = config->window;
+        rec->window_buckets = config->window_buckets;
+        rec->sliding = config->sliding;
+        rec->kmv = config->kmv;
+        rec->expires = config->expires;
+        rec->durability = config->durability;
+        rec->flush_period = config->flush_period;
+    }
+    rec->checksum = record_checksum(rec, (unsigned char*)set_name);
+}
+
+/**
+ * Appends a record with a single write, creating the
+ * manifest if it does not exist yet
+ */
+static int append_record(hlld_manifest *m, int type, char *set_name, hlld_set_config *config) {
+    size_t name_len = strlen(set_name) + 1;
+    if (name_len > UINT16_MAX) return -EINVAL;
+
+    unsigned char *buf = malloc(MANIFEST_MAGIC_LEN + sizeof(manifest_record) + name_len);
+    if (!buf) return -ENOMEM;
+
+    int res = 0;
+    pthread_mutex_lock(&m->lock);
+    if (m->fd < 0) {
+        m->fd = open(m->path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+        if (m->fd < 0) {
+            res = -errno;
+            goto LEAVE;
+        }
+    }
+
+    // New files start with the magic
+    uint64_t len = 0;
+    struct stat st;
+    if (!fstat(m->fd, &st) && st.st_size == 0) {
+        memcpy(buf, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN);
+        len = MANIFEST_MAGIC_LEN;
+    }
+
+    manifest_record rec;
+    encode_record(&rec, type, set_name, config);
+    memcpy(buf + len, &rec, sizeof(manifest_record));
+    memcpy(buf + len + sizeof(manifest_record), set_name, name_len);
+    len += sizeof(manifest_record) + name_len;
+    res = write_all(m->fd, buf, len);
+
+LEAVE:
+    pthread_mutex_unlock(&m->lock);
+    free(buf);
+    if (res) syslog(LOG_ERR, "Failed to append set '%s' to the manifest. Err: %d", set_name, res);
+    return res;
+}
+
+/**
+ * Writes a whole buffer, retrying short writes
+ */
+static int write_all(int fd, const unsigned char *buf, uint64_t len) {
+    uint64_t total = 0;
+    while (total < len) {
+        ssize_t written = write(fd, buf + total, len - total);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        total += written;
+    }
+    return 0;
+}
+
+/**
+ * Decodes a replayed record, and invokes the load callback
+ */
+static int load_record_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    load_state *state = data;
+    manifest_record rec;
+    memcpy(&rec, value, sizeof(manifest_record));
+
+    hlld_set_config config;
+    config.default_eps = rec.eps;
+    config.default_precision = rec.precision;
+    config.in_memory = rec.in_memory;
+    config.format = rec.format;
+    config.sparse = rec.sparse;
+    config.estimator = rec.estimator;
+    config.hash = rec.hash;
+    config.size = rec.size;
+    config.window = rec.window;
+    config.window_buckets = rec.window_buckets;
+    config.sliding = rec.sliding;
+    config.kmv = rec.kmv;
+    config.expires = rec.expires;
+    config.durability = rec.durability;
+    config.flush_period = rec.flush_period;
+
+    state->cb(state->data, (char*)key, &config);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * The manifest is a single binary file in the data directory
+ * that records the name and set config of every set. It lets
+ * startup restore the sets with one read, instead of opening
+ * each set folder. Creates and drops are appended as they
+ * happen, and a checkpoint rewrites it with the current sizes.
+ */
+typedef struct hlld_manifest hlld_manifest;
+
+/**
+ * Callback invoked for each set in the manifest
+ * @arg data Opaque pointer passed to manifest_load
+ * @arg set_name The name of the set
+ * @arg config The set config of the set
+ */
+typedef void(*manifest_cb)(void *data, char *set_name, hlld_set_config *config);
+
+/**
+ * Opens the manifest of a data directory. The file
+ * is only created once a set is recorded.
+ * @arg data_dir The data directory
+ * @arg manifest Output, the manifest
+ * @return 0 on success.
+ */
+int init_manifest(char *data_dir, hlld_manifest **manifest);
+
+/**
+ * Closes the manifest
+ * @arg manifest The manifest to close
+ * @return 0 on success.
+ */
+int destroy_manifest(hlld_manifest *manifest);
+
+/**
+ * Reads the manifest, invoking a callback for each set.
+ * The whole file is validated before any callback is made.
+ * @arg manifest The manifest
+ * @arg cb The callback to invoke
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets, -ENOENT if there is no
+ * manifest, or -EINVAL if it is corrupt.
+ */
+int manifest_load(hlld_manifest *manifest, manifest_cb cb, void *data);
+
+/**
+ * Appends a new set to the manifest
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @arg config The set config
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_add(hlld_manifest *manifest, char *set_name, hlld_set_config *config);
+
+/**
+ * Appends the removal of a set to the manifest
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_drop(hlld_manifest *manifest, char *set_name);
+
+/**
+ * Starts a checkpoint, which replaces the manifest with
+ * the sets given to manifest_checkpoint_add. Appends wait
+ * until the checkpoint ends, so they are not lost.
+ * @arg manifest The manifest
+ */
+void manifest_checkpoint_begin(hlld_manifest *manifest);
+
+/**
+ * Adds a set to the checkpoint in progress. This
+ * only buffers the set, and is cheap.
+ * @arg manifest The manifest
+ * @arg set_name The name of the set
+ * @arg config The set config
+ */
+void manifest_checkpoint_add(hlld_manifest *manifest, char *set_name, hlld_set_config *config);
+
+/**
+ * Writes out the checkpoint in progress, and
+ * atomically replaces the manifest with it.
+ * @arg manifest The manifest
+ * @return 0 on success, negative errno on failure.
+ */
+int manifest_checkpoint_end(hlld_manifest *manifest);
+
+#endif
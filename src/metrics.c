@@ -0,0 +1,353 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include "metrics.h"
+#include "clock.h"
+
+struct hlld_metrics {
+    int num_workers;
+    worker_metrics *workers;
+
+    // The background threads are few and slow,
+    // so they share a slot under a lock
+    pthread_mutex_t background_lock;
+    background_metrics background;
+};
+
+static void record_latency(latency_histogram *h, uint64_t nanos);
+static void merge_latency(latency_histogram *into, latency_histogram *h);
+
+/**
+ * Initializes the metrics
+ * @arg workers The number of worker slots
+ * @arg metrics Output, the metrics
+ * @return 0 on success.
+ */
+int init_metrics(int workers, hlld_metrics **metrics) {
+    hlld_metrics *m = calloc(1, sizeof(hlld_metrics));
+    if (!m) return -1;
+    if (posix_memalign((void**)&m->workers, 64,
+                workers * sizeof(worker_metrics))) {
+        syslog(LOG_ERR, "Failed to allocate worker metrics!");
+        free(m);
+        return -1;
+    }
+    memset(m->workers, 0, workers * sizeof(worker_metrics));
+    for (int i=0; i < workers; i++) INIT_HLLD_SPIN(&m->workers[i].hot_lock);
+    m->num_workers = workers;
+    pthread_mutex_init(&m->background_lock, NULL);
+    *metrics = m;
+    return 0;
+}
+
+/**
+ * Destroys the metrics
+ * @arg metrics The metrics to destroy
+ * @return 0 on success.
+ */
+int destroy_metrics(hlld_metrics *metrics) {
+    pthread_mutex_destroy(&metrics->background_lock);
+    free(metrics->workers);
+    free(metrics);
+    return 0;
+}
+
+/**
+ * Returns the slot of a worker, which only
+ * that worker may record into.
+ * @arg metrics The metrics
+ * @arg worker The index of the worker
+ * @return The slot
+ */
+worker_metrics* metrics_worker(hlld_metrics *metrics, int worker) {
+    return metrics->workers + worker;
+}
+
+/**
+ * Returns the current time for latencies
+ * @return Monotonic nanoseconds
+ */
+uint64_t metrics_now(void) {
+    return hclock_nsec();
+}
+
+// Returns the bucket of a latency, see metrics.h
+static int latency_bucket(uint64_t nanos) {
+    if (nanos >= (1ULL << LATENCY_MAX_BITS)) nanos = (1ULL << LATENCY_MAX_BITS) - 1;
+    if (nanos < (1 << LATENCY_SUB_BITS)) return nanos;
+    int shift = 63 - __builtin_clzll(nanos) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) |
+        ((nanos >> shift) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the largest value a bucket holds
+ * @arg bucket The index of the bucket
+ * @return The value in nanoseconds
+ */
+uint64_t metrics_bucket_max(int bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS)) return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((bucket & ((1 << LATENCY_SUB_BITS) - 1)) |
+        (1 << LATENCY_SUB_BITS)) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+/**
+ * Records a command and its latency
+ * @arg w The slot of the calling worker
+ * @arg cmd The command type, below METRIC_CMDS
+ * @arg nanos The latency in nanoseconds
+ */
+void metrics_record_cmd(worker_metrics *w, int cmd, uint64_t nanos) {
+    record_latency(w->cmds + cmd, nanos);
+}
+
+/**
+ * Parses the set name and key count of the arguments of a
+ * command. The name is the first token, and the rest are
+ * keys. Tokens may be separated by spaces or nulls.
+ * @arg args The arguments, or NULL
+ * @arg args_len The length of the arguments
+ * @arg name_len Output, the length of the set name
+ * @arg keys Output, the number of keys
+ */
+void metrics_parse_args(const char *args, int args_len, int *name_len, int *keys) {
+    int len = 0, num = 0;
+    if (args) {
+        while (len < args_len && args[len] != ' ' && args[len] && args[len] != '\n')
+            len++;
+        for (int i=len; i < args_len - 1; i++) {
+            int sep = (args[i] == ' ' || !args[i]);
+            int next = (args[i+1] == ' ' || !args[i+1] || args[i+1] == '\n');
+            if (sep && !next) num++;
+        }
+    }
+    *name_len = len;
+    *keys = num;
+}
+
+// FNV-1a, which is plenty to tell set names apart
+static uint64_t hash_set_name(const char *name, int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i=0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Adds weight to a set in a space-saving sketch
+static void sketch_add(hot_set_sketch *s, uint64_t hash, const char *name,
+        int name_len, uint64_t weight) {
+    int lightest = 0;
+    for (int i=0; i < s->num; i++) {
+        if (s->entries[i].hash == hash) {
+            s->entries[i].count += weight;
+            return;
+        }
+        if (s->entries[i].count < s->entries[lightest].count) lightest = i;
+    }
+
+    // Take a free entry, or replace the lightest
+    hot_set_entry *e;
+    if (s->num < METRIC_HOT_SETS) {
+        e = s->entries + s->num++;
+        e->count = weight;
+        e->error = 0;
+    } else {
+        e = s->entries + lightest;
+        e->error = e->count;
+        e->count += weight;
+    }
+    e->hash = hash;
+    if (name_len > METRIC_HOT_NAME_LEN) name_len = METRIC_HOT_NAME_LEN;
+    memcpy(e->set_name, name, name_len);
+    e->set_name[name_len] = '\0';
+}
+
+/**
+ * Records a sampled command naming a set into the hot
+ * set sketches of a worker
+ * @arg w The slot of the calling worker
+ * @arg set_name The set name, which need not be terminated
+ * @arg name_len The length of the set name
+ * @arg keys The number of keys added, or 0 if none
+ */
+void metrics_record_set(worker_metrics *w, const char *set_name, int name_len, int keys) {
+    if (name_len <= 0) return;
+    uint64_t hash = hash_set_name(set_name, name_len);
+    LOCK_HLLD_SPIN(&w->hot_lock);
+    sketch_add(w->hot + HOT_BY_CMDS, hash, set_name, name_len, METRIC_HOT_SAMPLE);
+    if (keys > 0)
+        sketch_add(w->hot + HOT_BY_KEYS, hash, set_name, name_len,
+                (uint64_t)keys * METRIC_HOT_SAMPLE);
+    UNLOCK_HLLD_SPIN(&w->hot_lock);
+}
+
+static int compare_entry_hashes(const void *a, const void *b) {
+    uint64_t x = ((const hot_set_entry*)a)->hash, y = ((const hot_set_entry*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// Heaviest first, and by name between equals so the order is stable
+static int compare_entry_counts(const void *a, const void *b) {
+    const hot_set_entry *x = a, *y = b;
+    if (x->count != y->count) return (x->count < y->count) ? 1 : -1;
+    return strcmp(x->set_name, y->set_name);
+}
+
+/**
+ * Merges the hot set sketches of all the workers, and
+ * returns the heaviest sets, heaviest first. The counts
+ * are estimates, and include the error of the sketches.
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg kind What the sets are weighed by
+ * @arg out Output, the heaviest sets
+ * @arg max The most sets to return
+ * @return The number of sets, or -1 on error.
+ */
+int metrics_hot_sets(hlld_metrics *metrics, hot_set_kind kind, hot_set_entry *out, int max) {
+    hot_set_entry *all = malloc(metrics->num_workers * METRIC_HOT_SETS * sizeof(hot_set_entry));
+    if (!all) return -1;
+    int num = 0;
+    for (int i=0; i < metrics->num_workers; i++) {
+        worker_metrics *w = metrics->workers + i;
+        LOCK_HLLD_SPIN(&w->hot_lock);
+        hot_set_sketch *s = w->hot + kind;
+        memcpy(all + num, s->entries, s->num * sizeof(hot_set_entry));
+        num += s->num;
+        UNLOCK_HLLD_SPIN(&w->hot_lock);
+    }
+
+    // Sum the entries of each set across the workers
+    qsort(all, num, sizeof(hot_set_entry), compare_entry_hashes);
+    int merged = 0;
+    for (int i=0; i < num; i++) {
+        if (merged && all[merged - 1].hash == all[i].hash) {
+            all[merged - 1].count += all[i].count;
+            all[merged - 1].error += all[i].error;
+        } else {
+            all[merged++] = all[i];
+        }
+    }
+
+    qsort(all, merged, sizeof(hot_set_entry), compare_entry_counts);
+    if (merged > max) merged = max;
+    memcpy(out, all, merged * sizeof(hot_set_entry));
+    free(all);
+    return merged;
+}
+
+/**
+ * Records how long some background work took
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg op The work
+ * @arg nanos The duration in nanoseconds
+ */
+void metrics_record_background(hlld_metrics *metrics, background_op op, uint64_t nanos) {
+    pthread_mutex_lock(&metrics->background_lock);
+    record_latency(metrics->background.ops + op, nanos);
+    pthread_mutex_unlock(&metrics->background_lock);
+}
+
+/**
+ * Records a set flushed by a round of flushes
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg nanos The duration in nanoseconds
+ * @arg bytes The bytes written
+ * @arg clean_pages The pages skipped as clean
+ */
+void metrics_record_set_flush(hlld_metrics *metrics, uint64_t nanos,
+        uint64_t bytes, uint64_t clean_pages) {
+    pthread_mutex_lock(&metrics->background_lock);
+    record_latency(metrics->background.ops + SET_FLUSH, nanos);
+    metrics->background.flush_bytes += bytes;
+    metrics->background.flush_clean_pages += clean_pages;
+    pthread_mutex_unlock(&metrics->background_lock);
+}
+
+/**
+ * Copies the metrics of the background threads
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg out Output, the metrics
+ */
+void metrics_background_snapshot(hlld_metrics *metrics, background_metrics *out) {
+    pthread_mutex_lock(&metrics->background_lock);
+    memcpy(out, &metrics->background, sizeof(background_metrics));
+    pthread_mutex_unlock(&metrics->background_lock);
+}
+
+// Adds a latency to a histogram
+static void record_latency(latency_histogram *h, uint64_t nanos) {
+    h->count++;
+    h->sum += nanos;
+    h->buckets[latency_bucket(nanos)]++;
+}
+
+// Adds the latencies of a histogram to another. The count is
+// summed from the buckets, so that it agrees with them even
+// if the histogram is recorded into while we read.
+static void merge_latency(latency_histogram *into, latency_histogram *h) {
+    if (!h->count) return;
+    into->sum += h->sum;
+    for (int b=0; b < LATENCY_BUCKETS; b++) {
+        uint64_t n = h->buckets[b];
+        into->buckets[b] += n;
+        into->count += n;
+    }
+}
+
+/**
+ * Merges the slots of all the workers
+ * @arg metrics The metrics
+ * @arg out Output, the sum of all the slots
+ */
+void metrics_snapshot(hlld_metrics *metrics, worker_metrics *out) {
+    memset(out, 0, sizeof(worker_metrics));
+    for (int i=0; i < metrics->num_workers; i++) {
+        worker_metrics *w = metrics->workers + i;
+        out->bytes_in += w->bytes_in;
+        out->bytes_out += w->bytes_out;
+        out->conns_opened += w->conns_opened;
+        out->conns_closed += w->conns_closed;
+        out->turns_yielded += w->turns_yielded;
+        out->rate_limited += w->rate_limited;
+        out->conns_migrated += w->conns_migrated;
+        out->busy_ns += w->busy_ns;
+        out->exec_batches += w->exec_batches;
+        out->batches_coalesced += w->batches_coalesced;
+
+        for (int c=0; c < METRIC_CMDS; c++)
+            merge_latency(out->cmds + c, w->cmds + c);
+    }
+}
+
+/**
+ * Returns a percentile of a histogram
+ * @arg h The histogram
+ * @arg quantile The quantile, from 0 to 1
+ * @return The largest value in the bucket holding the quantile,
+ * or 0 if the histogram is empty.
+ */
+uint64_t metrics_percentile(latency_histogram *h, double quantile) {
+    if (!h->count) return 0;
+
+    // The rank of the value we want, counting from 1
+    uint64_t rank = quantile * h->count + 0.5;
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+
+    uint64_t seen = 0;
+    for (int b=0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) return metrics_bucket_max(b);
+    }
+    return metrics_bucket_max(LATENCY_BUCKETS - 1);
+}
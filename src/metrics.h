@@ -0,0 +1,238 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+ * Metrics are kept by each worker in its own slot, so that
+ * recording them needs no atomics or shared cache lines. Each
+ * slot has a single writer, and readers merge the slots into a
+ * snapshot, which may be slightly behind the workers.
+ *
+ * Latencies are kept in log-linear histograms, as done by
+ * HdrHistogram. Values below 2^LATENCY_SUB_BITS nanoseconds
+ * have their own bucket, and every power of two above splits
+ * into 2^LATENCY_SUB_BITS buckets, so a bucket is within
+ * 12.5% of the values it holds.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/**
+ * The most command types that are counted
+ */
+#define METRIC_CMDS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;       // Of the latencies, in nanoseconds
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+/*
+ * Each worker finds the sets it is sent the most commands
+ * and keys for with a space-saving sketch, which keeps the
+ * METRIC_HOT_SETS heaviest it has seen. A set missing from a
+ * full sketch takes the place of the lightest, inheriting its
+ * count as the error. One in METRIC_HOT_SAMPLE commands naming
+ * a set is counted, with that weight.
+ */
+#define METRIC_HOT_SETS 32
+#define METRIC_HOT_SAMPLE 8
+
+/**
+ * Longer set names are truncated in the sketches
+ */
+#define METRIC_HOT_NAME_LEN 200
+
+typedef enum {
+    HOT_BY_CMDS = 0,    // Commands naming the set
+    HOT_BY_KEYS,        // Keys added to the set
+    NUM_HOT_KINDS
+} hot_set_kind;
+
+typedef struct {
+    uint64_t hash;      // Of the full set name
+    uint64_t count;     // May overstate the weight by up to error
+    uint64_t error;
+    char set_name[METRIC_HOT_NAME_LEN + 1];
+} hot_set_entry;
+
+typedef struct {
+    int num;
+    hot_set_entry entries[METRIC_HOT_SETS];
+} hot_set_sketch;
+
+typedef struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t conns_opened;
+    uint64_t conns_closed;
+    uint64_t turns_yielded;     // Connections that left input for a later turn
+    uint64_t rate_limited;      // Connections made to wait by their rate limits
+    uint64_t conns_migrated;    // Connections moved to this worker
+    uint64_t busy_ns;           // Spent handling events, rather than waiting
+    uint64_t exec_batches;      // Batches of writes run apart from their connection
+    uint64_t batches_coalesced; // Batches applied along with another of their set
+    latency_histogram cmds[METRIC_CMDS];
+
+    // Only read by a merge of the sketches, under the lock
+    uint32_t hot_ticks;         // Commands naming a set, to pick the samples
+    hlld_spinlock hot_lock;
+    hot_set_sketch hot[NUM_HOT_KINDS];
+} __attribute__((aligned(64))) worker_metrics;
+
+/**
+ * The work of the background threads that is timed
+ */
+typedef enum {
+    FLUSH_ROUND = 0,    // A round of scheduled flushes
+    SET_FLUSH,          // A set flushed by a round
+    UNMAP_ROUND,        // A round of unmapping sets
+    SET_UNMAP,          // A set unmapped by a round
+    NUM_BACKGROUND_OPS
+} background_op;
+
+typedef struct {
+    latency_histogram ops[NUM_BACKGROUND_OPS];
+    uint64_t flush_bytes;       // Written by the scheduled flushes
+    uint64_t flush_clean_pages; // Skipped by them as clean
+} background_metrics;
+
+typedef struct hlld_metrics hlld_metrics;
+
+/**
+ * Initializes the metrics
+ * @arg workers The number of worker slots
+ * @arg metrics Output, the metrics
+ * @return 0 on success.
+ */
+int init_metrics(int workers, hlld_metrics **metrics);
+
+/**
+ * Destroys the metrics
+ * @arg metrics The metrics to destroy
+ * @return 0 on success.
+ */
+int destroy_metrics(hlld_metrics *metrics);
+
+/**
+ * Returns the slot of a worker, which only
+ * that worker may record into.
+ * @arg metrics The metrics
+ * @arg worker The index of the worker
+ * @return The slot
+ */
+worker_metrics* metrics_worker(hlld_metrics *metrics, int worker);
+
+/**
+ * Returns the current time for latencies, from hclock_nsec
+ * @return Monotonic nanoseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Records a command and its latency
+ * @arg w The slot of the calling worker
+ * @arg cmd The command type, below METRIC_CMDS
+ * @arg nanos The latency in nanoseconds
+ */
+void metrics_record_cmd(worker_metrics *w, int cmd, uint64_t nanos);
+
+/**
+ * Parses the set name and key count of the arguments of a
+ * command. The name is the first token, and the rest are
+ * keys. Tokens may be separated by spaces or nulls.
+ * @arg args The arguments, or NULL
+ * @arg args_len The length of the arguments
+ * @arg name_len Output, the length of the set name
+ * @arg keys Output, the number of keys
+ */
+void metrics_parse_args(const char *args, int args_len, int *name_len, int *keys);
+
+/**
+ * Checks if a command naming a set is sampled for the hot
+ * sets, in which case metrics_record_set should be called.
+ * @arg w The slot of the calling worker
+ * @return 1 if sampled.
+ */
+static inline int metrics_sample_set(worker_metrics *w) {
+    return !(++w->hot_ticks % METRIC_HOT_SAMPLE);
+}
+
+/**
+ * Records a sampled command naming a set into the hot
+ * set sketches of a worker
+ * @arg w The slot of the calling worker
+ * @arg set_name The set name, which need not be terminated
+ * @arg name_len The length of the set name
+ * @arg keys The number of keys added, or 0 if none
+ */
+void metrics_record_set(worker_metrics *w, const char *set_name, int name_len, int keys);
+
+/**
+ * Merges the hot set sketches of all the workers, and
+ * returns the heaviest sets, heaviest first. The counts
+ * are estimates, and include the error of the sketches.
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg kind What the sets are weighed by
+ * @arg out Output, the heaviest sets
+ * @arg max The most sets to return
+ * @return The number of sets, or -1 on error.
+ */
+int metrics_hot_sets(hlld_metrics *metrics, hot_set_kind kind, hot_set_entry *out, int max);
+
+/**
+ * Records how long some background work took
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg op The work
+ * @arg nanos The duration in nanoseconds
+ */
+void metrics_record_background(hlld_metrics *metrics, background_op op, uint64_t nanos);
+
+/**
+ * Records a set flushed by a round of flushes
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg nanos The duration in nanoseconds
+ * @arg bytes The bytes written
+ * @arg clean_pages The pages skipped as clean
+ */
+void metrics_record_set_flush(hlld_metrics *metrics, uint64_t nanos,
+        uint64_t bytes, uint64_t clean_pages);
+
+/**
+ * Copies the metrics of the background threads
+ * @notes Thread safe.
+ * @arg metrics The metrics
+ * @arg out Output, the metrics
+ */
+void metrics_background_snapshot(hlld_metrics *metrics, background_metrics *out);
+
+/**
+ * Merges the slots of all the workers
+ * @arg metrics The metrics
+ * @arg out Output, the sum of all the slots
+ */
+void metrics_snapshot(hlld_metrics *metrics, worker_metrics *out);
+
+/**
+ * Returns a percentile of a histogram
+ * @arg h The histogram
+ * @arg quantile The quantile, from 0 to 1
+ * @return The largest value in the bucket holding the quantile,
+ * or 0 if the histogram is empty.
+ */
+uint64_t metrics_percentile(latency_histogram *h, double quantile);
+
+/**
+ * Returns the largest value a bucket holds
+ * @arg bucket The index of the bucket
+ * @return The value in nanoseconds
+ */
+uint64_t metrics_bucket_max(int bucket);
+
+#endif
@@ -17,17 +17,29 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include "conn_handler.h"
+#include "affinity.h"
+#include "alloc.h"
+#include "uring.h"
 #include "spinlock.h"
 #include "barrier.h"
+#include "metrics.h"
+#include "clock.h"
+#include "slowlog.h"
+#include "prometheus.h"
+#include "trace.h"
 
 
 /**
@@ -36,6 +48,40 @@
  */
 #define BACKLOG_SIZE 64
 
+/**
+ * The most clients a worker accepts on its own
+ * listener before handling other events
+ */
+#define ACCEPT_BATCH 32
+
+/**
+ * Datagrams are read in batches of this many, and
+ * may be at most UDP_MESG_SIZE bytes. A worker reads
+ * at most UDP_MAX_BATCHES before handling other events.
+ */
+#define UDP_BATCH 32
+#define UDP_MESG_SIZE 8192
+#define UDP_MAX_BATCHES 8
+
+/**
+ * A client whose reads fill the input buffer is read
+ * again, and its commands handled, up to this many times
+ * before the worker handles other events
+ */
+#define READ_ROUNDS 16
+
+/**
+ * Buffers used by a worker to read datagrams
+ */
+typedef struct {
+    char bufs[UDP_BATCH][UDP_MESG_SIZE + 1];
+    struct iovec iovs[UDP_BATCH];
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_BATCH];
+#endif
+    int lens[UDP_BATCH];
+} udp_batch;
+
 /**
  * How big should the default connection
  * buffer size be. One page seems reasonable
@@ -53,6 +99,47 @@
  */
 #define CONN_BUF_MULTIPLIER 8
 
+/**
+ * Connection buffers that grew are shrunk back
+ * to the initial size once the connection has
+ * been idle for this many seconds.
+ */
+#define CONN_BUF_IDLE_SHRINK 30.
+
+/**
+ * Output buffers are limited by the responses we make
+ * rather than by clients, so only the size is bounded.
+ */
+#define MAX_OUTPUT_BUF_SIZE (1ULL << 31)
+
+/**
+ * Reads from a connection stop once this much output is
+ * waiting on it, and resume once it falls to the low mark,
+ * so a client that does not read cannot grow its buffer.
+ */
+#define OUTPUT_HIGH_WATERMARK (4 * 1024 * 1024)
+#define OUTPUT_LOW_WATERMARK (1024 * 1024)
+
+/**
+ * A connection that used its turn reads again once at most
+ * this much of its input is left, so a recv that keeps
+ * reading cannot grow its buffer faster than it is handled.
+ */
+#define YIELD_READ_AHEAD (256 * 1024)
+
+/*
+ * Bytes held by the output buffers of every connection,
+ * and the connections whose reads are stopped
+ */
+static volatile uint64_t OUTPUT_BUF_BYTES = 0;
+static volatile uint64_t THROTTLED_CONNS = 0;
+
+/**
+ * The most closed connections a worker keeps to reuse.
+ * Their buffers are kept too, unless they have grown.
+ */
+#define MAX_FREE_CONNS 256
+
 
 /**
  * This defines how often we invoke the
@@ -62,21 +149,154 @@
  */
 #define PERIODIC_TIME_SEC 0.25
 
+/**
+ * With migrate_busy, each worker measures its load every
+ * BALANCE_TIME_SEC, and a busy worker moves the connection
+ * that kept it busiest to the least busy worker.
+ */
+#define BALANCE_TIME_SEC 1.
 
 /**
- * Stores the worker thread specific user data.
+ * A worker that stands by moves its connections to the
+ * workers taking clients, retrying those that could not
+ * move yet every DRAIN_TIME_SEC.
+ */
+#define DRAIN_TIME_SEC 0.1
+
+/**
+ * The metrics endpoint reads requests of at most
+ * HTTP_REQUEST_SIZE bytes, and drops a scrape that is
+ * not done within HTTP_TIMEOUT_SEC. The stats of the sets
+ * are snapshotted every STATS_REFRESH_SEC, so scrapes and
+ * the stats command never visit the sets.
+ */
+#define HTTP_REQUEST_SIZE 4096
+#define HTTP_TIMEOUT_SEC 10.
+#define STATS_REFRESH_SEC 5.
+
+/**
+ * With io_uring, each worker has a ring of URING_ENTRIES
+ * requests, and provides URING_BUFS buffers of URING_BUF_SIZE
+ * bytes that the reads of all its clients share.
+ */
+#define URING_ENTRIES 1024
+#define URING_BUFS 256
+#define URING_BUF_SIZE 16384
+
+/*
+ * The request of a completion, kept in the low bits
+ * of its user data along with its connection
+ */
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_ACCEPT 3
+#define URING_CANCEL 4
+#define URING_TAG_MASK 7
+
+/**
+ * Checks of a routed command by the waiting
+ * worker before it yields the cpu
+ */
+#define ROUTE_SPINS 128
+
+/**
+ * A command routed to the worker owning its set. It lives
+ * on the stack of the waiting worker, and records the phase
+ * times of the command for its slow log.
+ */
+typedef struct route_job {
+    void (*fn)(void*);
+    void *arg;
+    uint64_t phases[NUM_SLOWLOG_PHASES];
+    volatile int done;
+    struct route_job *next;
+} route_job;
+
+/**
+ * A batch of writes of a connection, run by an execution
+ * thread or coalesced by its worker, and then handed back
+ * to the worker of the connection
  */
 typedef struct conn_info conn_info;
+typedef struct exec_job {
+    conn_info *conn;
+    hlld_exec_batch batch;
+    struct exec_job *next;
+} exec_job;
+
+/**
+ * An execution thread. Batches are pushed onto its queue,
+ * and it is woken through its pipe if the queue was empty.
+ */
+typedef struct {
+    hlld_networking *netconf;
+    pthread_t thread;
+    int pipefd[2];
+    exec_job *volatile queued;  // Batches to run, newest first
+    worker_metrics *metrics;    // Our slot of the server metrics
+} exec_thread;
+
+
+/**
+ * Stores the worker thread specific user data.
+ */
 typedef struct {
     hlld_networking *netconf;
     ev_loop *loop;
     int pipefd[2];
     ev_io pipe_client;
+    ev_io tcp_client;   // Our own listener, if using reuseport
+    ev_io udp_client;   // Our UDP socket, if any
+    udp_batch *udp;
     ev_timer periodic;
+    ev_prepare idle;    // Leaves the set manager before blocking
+    ev_check resume;    // Checkpoints before handling events
+    ev_idle turns;      // Runs the connections that yielded
+    ev_idle coalesce;   // Applies the writes of our connections, with coalesce_writes
+    ev_timer balance;   // Measures our load, with migrate_busy
+    ev_timer drain;     // Moves our connections away, while we stand by
     int should_run;
 
+    // Our open connections
+    conn_info *served;
+
     // Used to free inactive after event loop iteration
     conn_info *inactive;
+
+    // Closed connections that are reused, with their buffers
+    conn_info *free_conns;
+    int num_free_conns;
+
+    // Connections that used their turn, in the order they get the next
+    conn_info *yielded_head;
+    conn_info *yielded_tail;
+
+    // Our load, and the connection that added the most to it.
+    // Each interval of the balance timer is an epoch.
+    uint64_t wake_ns;           // When we last woke for events
+    uint64_t event_ns;          // When we last woke to events, with busy_poll
+    uint64_t handled_ns;        // Spent handling commands, with migrate_busy
+    uint64_t balance_start;     // When the epoch started
+    uint64_t balance_handled;   // Our handling time when it started
+    volatile int load;          // Permille of the last epoch spent handling
+    unsigned balance_epoch;
+    conn_info *hot;             // Busiest connection of the epoch, or NULL
+    uint64_t hot_ns;
+
+    worker_metrics *metrics;    // Our slot of the server metrics
+
+    int index;                  // Our slot of the workers
+    int reserved;               // Whether we only serve the high priority clients
+    int node;                   // NUMA node we are pinned to, or 0
+    route_job *volatile routed; // Commands routed to us, newest first
+    exec_job *volatile executed;    // Batches run for our connections, newest first
+    exec_job *coalesce_head;        // Batches to coalesce on the next pass, oldest first
+    exec_job *coalesce_tail;
+
+#ifdef HLLD_URING
+    hlld_uring *ring;   // Serves our clients, if using io_uring
+    ev_io ring_client;  // Readable once completions are waiting
+#endif
 } worker_ev_userdata;
 
 /**
@@ -87,6 +307,9 @@ typedef struct {
     int read_cursor;
     uint32_t buf_size;
     char *buffer;
+    int mirrored;   // Mapped twice in a row, so the data never wraps
+    int pinned;     // The kernel is sending from the buffer
+    char *retired;  // Replaced while pinned, freed once unpinned
 } circular_buffer;
 
 /**
@@ -107,6 +330,11 @@ typedef struct {
  * allows us to minimize copies and latency for most
  * clients, while still supporting the massive bulk
  * loads.
+ *
+ * While the handler runs, the connection is corked
+ * and responses are gathered in the output buffer,
+ * so that a pipelined client gets a single write per
+ * read event rather than one per command.
  */
 struct conn_info {
     worker_ev_userdata *thread_ev;
@@ -116,12 +344,90 @@ struct conn_info {
     circular_buffer input;
 
     int use_write_buf;
+    int corked;
+    int throttled;      // Reads stop until the output drains
     ev_io write_client;
     circular_buffer output;
 
+    int handler_flags;  // Kept for the connection handlers
+    void *handler_state;
+
+    // Invokes the handlers with the watches of the connection
+    ev_timer watch_timer;
+
+    // Shrinks grown buffers once the connection is idle
+    ev_timer idle_timer;
+    ev_tstamp last_active;
+
+    // Left input for a later turn of the worker. Reads stop
+    // until then.
+    int yielded;
+    unsigned turn_iter;     // Pass of the event loop of the turn
+    int turn_cmds;          // Commands handled in the turn
+    int64_t turn_bytes;     // Input handled in the turn, by earlier handlers
+    int64_t turn_input;     // Input buffered when this handler started
+    struct conn_info *next_yielded;
+
+    // Time spent handling the connection in the balance epoch
+    // of its worker, and the worker it is moving to, if any
+    unsigned busy_epoch;
+    uint64_t busy_ns;
+    worker_ev_userdata *migrate_to;
+
+    // Token buckets of the rate limits of the connection, refilled
+    // by the second up to a second of each. Reads stop while it
+    // is out of commands, or owes input, until the timer.
+    int cmds_per_sec;       // 0 if unlimited
+    int64_t bytes_per_sec;  // 0 if unlimited
+    double cmd_tokens;
+    double byte_tokens;     // Charged as the input is read
+    ev_tstamp rate_stamp;   // When the buckets were last refilled
+    int rate_limited;
+    ev_timer rate_timer;
+
+    // Command waiting on a set page in. Reads stop while parked.
+    int parked;
+    char *parked_cmd;
+    int parked_len;
+
+    // Requests in flight, when served with io_uring. The
+    // connection is only closed once they have completed.
+    int recv_armed;     // A multishot recv is reading
+    int reads_wanted;   // Reads are not stopped
+    int sending;        // The output is being sent
+    int closing;        // Closed, waiting on the requests
+    struct iovec send_iov[2];
+    struct msghdr send_msg;
+
     struct conn_info *next;
+
+    // Our place among the open connections of the worker
+    struct conn_info *served_prev;
+    struct conn_info *served_next;
 };
 
+// Checks if a connection is served with io_uring
+#ifdef HLLD_URING
+#define CONN_URING(conn) ((conn)->thread_ev->ring != NULL)
+#else
+#define CONN_URING(conn) 0
+#endif
+
+/**
+ * A scrape of the metrics endpoint. These are served
+ * on the main thread, and closed once answered.
+ */
+typedef struct {
+    hlld_networking *netconf;
+    ev_io watcher;
+    ev_timer timeout;
+    char request[HTTP_REQUEST_SIZE];
+    int request_len;
+    char *response;
+    size_t response_len;
+    size_t sent;
+} http_conn;
+
 
 /**
  * Defines a structure that is
@@ -135,42 +441,128 @@ struct hlld_networking {
     int ev_mode;
     ev_loop *default_loop;
     ev_io tcp_client;
-    ev_io udp_client;
+    int *listen_fds;    // Listener of each worker, if using reuseport
+    int *udp_fds;       // UDP socket of each worker, or -1 if none
+    ev_io unix_client;  // Unix socket listener, if enabled
 
     barrier_t thread_barrier;
     pthread_t *threads; // Reference to all the workers
     worker_ev_userdata **workers;
+    int num_slots;              // Workers started, up to max_workers
+    volatile int num_active;    // Workers taking clients, the rest stand by
     unsigned last_assign;    // Last thread we assigned to
+
+    hlld_metrics *metrics;  // A slot for each worker
+    hlld_slowlog *slowlog;  // Commands slower than slowlog_usec
+    hlld_cluster *cluster;  // Hash ring of the cluster, or NULL
+    hlld_remote *remote;    // Sets fetched from other servers
+    ev_io http_client;      // Metrics endpoint, if enabled
+    ev_timer stats_timer;   // Refreshes the snapshot of the set stats
+
+    // Commands routed to the owners of their sets
+    volatile int routing_stopped;   // Set at shutdown, commands run in place
+    volatile int routes_inflight;   // Commands being routed
+    int num_route_nodes;    // Nodes with workers, with a set affinity of node
+    int *route_start;       // Offset of the workers of each node
+    int *route_workers;     // The workers, grouped by node
+
+    // Threads running the writes of the workers, if any
+    exec_thread *execs;
+    int num_execs;
+    volatile int execs_stopped;     // Set at shutdown, writes run in place
+    volatile int execs_inflight;    // Batches not yet handed back
 };
 
 
 // Static typedefs
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_worker_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static int accept_client(int listen_fd, int busy_poll);
+static void schedule_client(worker_ev_userdata *data, int client_fd);
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events);
+static int read_udp_batch(int fd, udp_batch *batch);
+static void notify_worker(worker_ev_userdata *data, char cmd, void *arg);
+static hlld_client_class* peer_client_class(hlld_config *config, int client_fd);
+static worker_ev_userdata* pool_worker(hlld_networking *netconf, int high);
 static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events);
+static void run_client_handler(worker_ev_userdata *data, conn_info *conn);
+static int flush_client_output(conn_info *conn);
 static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events);
-static int read_client_data(conn_info *conn);
+static int read_client_data(conn_info *conn, int *filled);
+static void handle_conn_idle(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_conn_watch(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_conn_rate(ev_loop *lp, ev_timer *t, int ready_events);
+static void watch_grown_buffers(conn_info *conn);
 static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
+static void run_routed_jobs(worker_ev_userdata *data);
+static void run_executed_jobs(worker_ev_userdata *data);
+static void handle_worker_coalesce(ev_loop *lp, ev_idle *w, int ready_events);
+static void start_exec_threads(hlld_networking *netconf);
+static void stop_exec_threads(hlld_networking *netconf);
+static void group_route_nodes(hlld_networking *netconf);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_worker_idle(ev_loop *lp, ev_prepare *w, int ready_events);
+static void handle_worker_resume(ev_loop *lp, ev_check *w, int ready_events);
+static void handle_worker_turns(ev_loop *lp, ev_idle *w, int ready_events);
+static void handle_balance_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void migrate_client_connection(conn_info *conn, worker_ev_userdata *target);
+static void hand_off_client_connection(conn_info *conn);
+static void adopt_client_connection(worker_ev_userdata *data, conn_info *conn);
+static void link_served(conn_info *conn);
+static void unlink_served(conn_info *conn);
+static void activate_worker(worker_ev_userdata *data);
+static void stand_by_worker(worker_ev_userdata *data);
+static void handle_drain_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void start_worker_udp(worker_ev_userdata *data, int fd);
+static void handle_new_http_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_http_read(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_http_write(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_http_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_stats_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void close_http_conn(http_conn *conn);
 
 static void close_client_connection(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
+static void start_client_reads(conn_info *conn);
+static void stop_client_reads(conn_info *conn);
+static void start_worker_accept(worker_ev_userdata *data);
+
+// Serving clients with io_uring
+#ifdef HLLD_URING
+static void setup_worker_uring(worker_ev_userdata *data);
+static struct io_uring_sqe* worker_sqe(worker_ev_userdata *data);
+static void arm_worker_accept(worker_ev_userdata *data);
+static int arm_client_recv(conn_info *conn);
+static void queue_client_send(conn_info *conn);
+static int append_client_input(conn_info *conn, char *in, uint64_t len);
+static void handle_uring_completions(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_uring_accept(worker_ev_userdata *data, struct io_uring_cqe *cqe);
+static void handle_client_recv(conn_info *conn, struct io_uring_cqe *cqe);
+static void handle_client_send(conn_info *conn, struct io_uring_cqe *cqe);
+#endif
 
 // Helpers for send_client_response
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
+static int write_client_output(conn_info *conn, char *in, uint64_t bytes);
+static void count_output_bytes(int64_t delta);
+static void set_throttled(conn_info *conn, int throttled);
+static void unlink_yielded(conn_info *conn);
 
 
 // Utility methods
-static int set_client_sockopts(int client_fd);
-static conn_info* get_conn();
+static int set_client_sockopts(int client_fd, int tcp, int busy_poll);
+static conn_info* get_conn(worker_ev_userdata *data);
 
 
 // Circular buffer method
-static void circbuf_init(circular_buffer *buf);
+static void circbuf_init(circular_buffer *buf, int mirrored);
+static char* circbuf_alloc(uint32_t size, int *mirrored);
+static void circbuf_release(char *buffer, uint32_t size, int mirrored);
 static void circbuf_free(circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
-static void circbuf_grow_buf(circular_buffer *buf);
+static uint64_t circbuf_used_buf(circular_buffer *buf);
+static int circbuf_grow_buf(circular_buffer *buf, uint64_t max_size);
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes);
@@ -178,22 +570,25 @@ static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes);
 static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
 
 /**
- * Initializes the TCP listener
+ * Opens a socket listening on a TCP port
  * @arg netconf The network configuration
- * @return 0 on success.
+ * @arg port The port to listen on
+ * @arg reuseport Should SO_REUSEPORT be set, so that many
+ * sockets can listen on the port. These are non-blocking.
+ * @return The socket, or -1 on error.
  */
-static int setup_tcp_listener(hlld_networking *netconf) {
+static int open_tcp_listener(hlld_networking *netconf, int port, int reuseport) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
     bzero(&bind_addr, sizeof(bind_addr));
     addr.sin_family = PF_INET;
-    addr.sin_port = htons(netconf->config->tcp_port);
+    addr.sin_port = htons(port);
 
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
         syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
-        return 1;
+        return -1;
     }
     addr.sin_addr = bind_addr;
 
@@ -204,19 +599,63 @@ static int setup_tcp_listener(hlld_networking *netconf) {
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
+    }
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(tcp_listener_fd, SOL_SOCKET,
+                    SO_REUSEPORT, &optval, sizeof(optval)) ||
+                fcntl(tcp_listener_fd, F_SETFL, O_NONBLOCK)) {
+            syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+            close(tcp_listener_fd);
+            return -1;
+        }
+#else
+        syslog(LOG_ERR, "SO_REUSEPORT is not supported on this platform!");
+        close(tcp_listener_fd);
+        return -1;
+#endif
     }
     if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
     if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
         syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
+    }
+    return tcp_listener_fd;
+}
+
+/**
+ * Initializes the TCP listener. With reuseport, each
+ * worker gets a listener of its own, which it starts
+ * in its own event loop.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_tcp_listener(hlld_networking *netconf) {
+    if (netconf->config->reuseport) {
+        // Workers that stand by open their own once active
+        int workers = netconf->config->worker_threads;
+        netconf->listen_fds = malloc(netconf->num_slots * sizeof(int));
+        for (int i=workers; i < netconf->num_slots; i++) netconf->listen_fds[i] = -1;
+        for (int i=0; i < workers; i++) {
+            netconf->listen_fds[i] = open_tcp_listener(netconf, netconf->config->tcp_port, 1);
+            if (netconf->listen_fds[i] >= 0) continue;
+            while (i--) close(netconf->listen_fds[i]);
+            free(netconf->listen_fds);
+            netconf->listen_fds = NULL;
+            return 1;
+        }
+        return 0;
     }
 
+    int tcp_listener_fd = open_tcp_listener(netconf, netconf->config->tcp_port, 0);
+    if (tcp_listener_fd < 0) return 1;
+
     // Create the libev objects
     ev_io_init(&netconf->tcp_client, handle_new_client,
                 tcp_listener_fd, EV_READ);
@@ -225,11 +664,84 @@ static int setup_tcp_listener(hlld_networking *netconf) {
 }
 
 /**
- * Initializes the UDP Listener.
+ * Initializes the unix socket listener, if it is enabled.
+ * It is accepted from on the main thread, like TCP without
+ * reuseport. A stale socket left by an earlier server is
+ * replaced, but not one that is still being served.
  * @arg netconf The network configuration
  * @return 0 on success.
  */
-static int setup_udp_listener(hlld_networking *netconf) {
+static int setup_unix_listener(hlld_networking *netconf) {
+    netconf->unix_client.fd = -1;
+    char *path = netconf->config->unix_socket;
+    if (!path) return 0;
+
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int unix_listener_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_listener_fd < 0) {
+        syslog(LOG_ERR, "Failed to create unix socket! Err: %s", strerror(errno));
+        return 1;
+    }
+
+    // Only remove the path if it is a socket nobody accepts on
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            syslog(LOG_ERR, "Unix socket path '%s' exists and is not a socket!", path);
+            close(unix_listener_fd);
+            return 1;
+        }
+        if (!connect(unix_listener_fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            syslog(LOG_ERR, "Unix socket '%s' is in use by another server!", path);
+            close(unix_listener_fd);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    if (bind(unix_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on unix socket '%s'! Err: %s", path, strerror(errno));
+        close(unix_listener_fd);
+        return 1;
+    }
+    if (listen(unix_listener_fd, BACKLOG_SIZE) != 0) {
+        syslog(LOG_ERR, "Failed to listen on unix socket! Err: %s", strerror(errno));
+        close(unix_listener_fd);
+        unlink(path);
+        return 1;
+    }
+
+    ev_io_init(&netconf->unix_client, handle_new_client,
+                unix_listener_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->unix_client);
+    return 0;
+}
+
+/**
+ * Closes the unix socket listener, if it is enabled,
+ * and removes its path.
+ * @arg netconf The network configuration
+ */
+static void close_unix_listener(hlld_networking *netconf) {
+    if (netconf->unix_client.fd < 0) return;
+    ev_io_stop(netconf->default_loop, &netconf->unix_client);
+    close(netconf->unix_client.fd);
+    unlink(netconf->config->unix_socket);
+    netconf->unix_client.fd = -1;
+}
+
+/**
+ * Opens a non-blocking UDP socket on the UDP port
+ * @arg netconf The network configuration
+ * @arg reuseport Should SO_REUSEPORT be set, so that
+ * many sockets can share the port
+ * @return The socket, or -1 on error.
+ */
+static int open_udp_socket(hlld_networking *netconf, int reuseport) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -240,7 +752,7 @@ static int setup_udp_listener(hlld_networking *netconf) {
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
         syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
-        return 1;
+        return -1;
     }
     addr.sin_addr = bind_addr;
 
@@ -251,18 +763,70 @@ static int setup_udp_listener(hlld_networking *netconf) {
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(udp_listener_fd);
-        return 1;
+        return -1;
+    }
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(udp_listener_fd, SOL_SOCKET,
+                SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        close(udp_listener_fd);
+        return -1;
+    }
+#endif
+    if (fcntl(udp_listener_fd, F_SETFL, O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on UDP socket! Err: %s", strerror(errno));
+        close(udp_listener_fd);
+        return -1;
     }
     if (bind(udp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on UDP socket! Err: %s", strerror(errno));
         close(udp_listener_fd);
+        return -1;
+    }
+    return udp_listener_fd;
+}
+
+/**
+ * Initializes the UDP Listener. With reuseport each
+ * worker reads its own socket, otherwise the first
+ * worker reads the only one.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_udp_listener(hlld_networking *netconf) {
+    int workers = netconf->config->worker_threads;
+    int reuseport = netconf->config->reuseport;
+    netconf->udp_fds = malloc(netconf->num_slots * sizeof(int));
+    for (int i=workers; i < netconf->num_slots; i++) netconf->udp_fds[i] = -1;
+    for (int i=0; i < workers; i++) {
+        netconf->udp_fds[i] = (i == 0 || reuseport) ? open_udp_socket(netconf, reuseport) : -1;
+        if (netconf->udp_fds[i] >= 0 || (i && !reuseport)) continue;
+        while (i--) {
+            if (netconf->udp_fds[i] >= 0) close(netconf->udp_fds[i]);
+        }
+        free(netconf->udp_fds);
+        netconf->udp_fds = NULL;
         return 1;
     }
+    return 0;
+}
 
-    // Create the libev objects
-    ev_io_init(&netconf->udp_client, handle_new_udp_mesg,
-                udp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->udp_client);
+/**
+ * Initializes the metrics endpoint, if it is enabled.
+ * It is served by the main thread.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_http_listener(hlld_networking *netconf) {
+    netconf->http_client.fd = -1;
+    if (netconf->config->http_port <= 0) return 0;
+
+    int http_listener_fd = open_tcp_listener(netconf, netconf->config->http_port, 0);
+    if (http_listener_fd < 0) return 1;
+
+    ev_io_init(&netconf->http_client, handle_new_http_client,
+                http_listener_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->http_client);
     return 0;
 }
 
@@ -270,16 +834,20 @@ static int setup_udp_listener(hlld_networking *netconf) {
  * Initializes the networking interfaces
  * @arg config Takes the server configuration
  * @arg mgr The manager to pass up to the connection handlers
+ * @arg metrics The metrics, with a slot for each worker
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(hlld_config *config, void *mgr, hlld_networking **netconf_out) {
+int init_networking(hlld_config *config, void *mgr, hlld_metrics *metrics, hlld_networking **netconf_out) {
     // Make the netconf structure
     hlld_networking *netconf = calloc(1, sizeof(struct hlld_networking));
 
     // Initialize
     netconf->config = config;
     netconf->mgr = mgr;
-    netconf->workers = calloc(config->worker_threads, sizeof(worker_ev_userdata*));
+    netconf->metrics = metrics;
+    netconf->num_slots = config_worker_slots(config);
+    netconf->num_active = config->worker_threads;
+    netconf->workers = calloc(netconf->num_slots, sizeof(worker_ev_userdata*));
     if (!netconf->workers) {
         free(netconf);
         perror("Failed to calloc() for worker threads");
@@ -287,7 +855,33 @@ int init_networking(hlld_config *config, void *mgr, hlld_networking **netconf_ou
     }
 
     // Setup the barrier
-    if (barrier_init(&netconf->thread_barrier, config->worker_threads + 1)) {
+    if (barrier_init(&netconf->thread_barrier, netconf->num_slots + 1)) {
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the slow log, which is kept even if disabled
+    // so that the slowlog command has one to list
+    if (init_slowlog((uint64_t)config->slowlog_usec * 1000, config->slowlog_len,
+                &netconf->slowlog)) {
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Build the hash ring, if clustered
+    if (init_cluster(config, &netconf->cluster)) {
+        destroy_slowlog(netconf->slowlog);
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Start fetching the remote sets of unions
+    if (init_remote(config, &netconf->remote)) {
+        destroy_cluster(netconf->cluster);
+        destroy_slowlog(netconf->slowlog);
         free(netconf->workers);
         free(netconf);
         return 1;
@@ -318,18 +912,42 @@ int init_networking(hlld_config *config, void *mgr, hlld_networking **netconf_ou
         return 1;
     }
 
-    // Setup the UDP listener
+    // Setup the UDP listener, the unix socket, and the metrics endpoint
     res = setup_udp_listener(netconf);
+    if (res == 0 && (res = setup_unix_listener(netconf)) == 0 &&
+            (res = setup_http_listener(netconf))) {
+        close_unix_listener(netconf);
+    }
+    if (res != 0 && netconf->udp_fds) {
+        for (int i=0; i < config->worker_threads; i++) {
+            if (netconf->udp_fds[i] >= 0) close(netconf->udp_fds[i]);
+        }
+        free(netconf->udp_fds);
+    }
     if (res != 0) {
-        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-        close(netconf->tcp_client.fd);
+        if (netconf->listen_fds) {
+            for (int i=0; i < config->worker_threads; i++) close(netconf->listen_fds[i]);
+            free(netconf->listen_fds);
+        } else {
+            ev_io_stop(netconf->default_loop, &netconf->tcp_client);
+            close(netconf->tcp_client.fd);
+        }
         free(netconf);
         return 1;
     }
 
+    // Snapshot the set stats on the main thread,
+    // with the first snapshot taken right away
+    ev_timer_init(&netconf->stats_timer, handle_stats_timeout,
+                0., STATS_REFRESH_SEC);
+    ev_timer_start(netconf->default_loop, &netconf->stats_timer);
+
     // Prepare the conn handlers
     init_conn_handler();
 
+    // Run the writes on their own threads, if enabled
+    start_exec_threads(netconf);
+
     // Success!
     *netconf_out = netconf;
     return 0;
@@ -347,50 +965,233 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     hlld_networking *netconf = ev_userdata(lp);
 
     // Accept the client connection
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
-    int client_fd = accept(watcher->fd,
+    int client_fd = accept_client(watcher->fd, netconf->config->busy_poll);
+    if (client_fd < 0) return;
+
+    // Dispatch this client to a worker thread, of the
+    // reserved ones if it is of a high priority class
+    worker_ev_userdata *data;
+    if (netconf->config->reserved_workers) {
+        hlld_client_class *c = peer_client_class(netconf->config, client_fd);
+        data = pool_worker(netconf, c && c->high_priority);
+    } else {
+        int next_thread = netconf->last_assign++ % netconf->num_active;
+        data = netconf->workers[next_thread];
+    }
+
+    // Sent accept along with the socket. The worker sets
+    // up the connection, so it can reuse its own.
+    notify_worker(data, 'a', (void*)(intptr_t)client_fd);
+}
+
+
+/**
+ * Invoked when the listener of a worker, used with reuseport,
+ * is ready to accept new clients. The clients are accepted and
+ * scheduled on this worker, without a hand off.
+ */
+static void handle_worker_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    for (int i=0; i < ACCEPT_BATCH; i++) {
+        int client_fd = accept_client(watcher->fd, data->netconf->config->busy_poll);
+        if (client_fd < 0) break;
+        schedule_client(data, client_fd);
+    }
+}
+
+
+/**
+ * Accepts a client, and sets up its socket
+ * @arg listen_fd The listening socket
+ * @arg busy_poll The usec the socket busy polls on reads, or 0
+ * @return The client socket, or -1 if there is none.
+ */
+static int accept_client(int listen_fd, int busy_poll) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd = accept(listen_fd,
                         (struct sockaddr*)&client_addr,
                         &client_addr_len);
 
     // Check for an error
     if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
-        return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+        return -1;
     }
 
     // Setup the socket
-    if (set_client_sockopts(client_fd)) {
-        return;
+    int tcp = (client_addr.ss_family == AF_INET);
+    if (set_client_sockopts(client_fd, tcp, busy_poll)) {
+        return -1;
     }
 
     // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
-            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+    if (tcp) {
+        struct sockaddr_in *in_addr = (struct sockaddr_in*)&client_addr;
+        TRACE2(conn_accept, client_fd, ntohs(in_addr->sin_port));
+        syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+                inet_ntoa(in_addr->sin_addr), ntohs(in_addr->sin_port), client_fd);
+    } else {
+        TRACE2(conn_accept, client_fd, 0);
+        syslog(LOG_DEBUG, "Accepted unix socket connection [%d]", client_fd);
+    }
+    return client_fd;
+}
+
+
+/**
+ * Sets up the connection of a new client, and
+ * schedules it on a worker.
+ * Must be invoked on the worker thread.
+ */
+static void schedule_client(worker_ev_userdata *data, int client_fd) {
+    // Clients accepted by a worker of the other pool, or
+    // by one that has since stood by, are passed on
+    hlld_config *config = data->netconf->config;
+    hlld_client_class *c = peer_client_class(config, client_fd);
+    int high = config->reserved_workers && c && c->high_priority;
+    if ((config->reserved_workers && high != data->reserved) ||
+            data->index >= data->netconf->num_active) {
+        worker_ev_userdata *target = pool_worker(data->netconf, high);
+        if (target && target != data) {
+            notify_worker(target, 'a', (void*)(intptr_t)client_fd);
+            return;
+        }
+    }
 
     // Get the associated conn object
-    conn_info *conn = get_conn();
+    conn_info *conn = get_conn(data);
+
+    // Hold it to the limits of its class, or of all connections
+    conn->cmds_per_sec = (c) ? c->cmds_per_sec : config->conn_cmds_per_sec;
+    conn->bytes_per_sec = (int64_t)((c) ? c->kb_per_sec : config->conn_kb_per_sec) << 10;
+    conn->cmd_tokens = conn->cmds_per_sec;
+    conn->byte_tokens = conn->bytes_per_sec;
+    conn->rate_stamp = ev_now(data->loop);
 
     // Initialize the libev stuff
     ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
     ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
+    link_served(conn);
+    start_client_reads(conn);
+    data->metrics->conns_opened++;
+}
+
+
+/**
+ * Finds the class of the client of a socket, from its peer address
+ * @return The class, or NULL if it has none.
+ */
+static hlld_client_class* peer_client_class(hlld_config *config, int client_fd) {
+    if (!config->client_classes) return NULL;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(client_fd, (struct sockaddr*)&addr, &addr_len)) return NULL;
+    return config_client_class(config, (struct sockaddr*)&addr);
+}
+
+
+/**
+ * Picks the next active worker of a pool, in turn. The first
+ * reserved_workers workers serve the high priority clients.
+ * @arg high Whether to pick of the reserved workers
+ * @return The worker, or NULL if it has not started.
+ */
+static worker_ev_userdata* pool_worker(hlld_networking *netconf, int high) {
+    int reserved = netconf->config->reserved_workers;
+    int start = (high) ? 0 : reserved;
+    int num = (high) ? reserved : netconf->num_active - reserved;
+    unsigned next = __sync_fetch_and_add(&netconf->last_assign, 1);
+    return netconf->workers[start + next % num];
+}
 
-    // Dispatch this client to a worker thread
-    int next_thread = netconf->last_assign++ % netconf->config->worker_threads;
-    worker_ev_userdata *data = netconf->workers[next_thread];
 
-    // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+/**
+ * Sends a command about a connection to a worker. The
+ * command is written at once, since other threads may
+ * notify the same worker.
+ */
+static void notify_worker(worker_ev_userdata *data, char cmd, void *arg) {
+    char msg[1 + sizeof(void*)];
+    msg[0] = cmd;
+    memcpy(msg + 1, &arg, sizeof(void*));
+    if (write(data->pipefd[1], msg, sizeof(msg)) != sizeof(msg))
+        perror("Failed to write to async pipe");
 }
 
 
 /**
  * Invoked to handle new UDP messages being available.
+ * Reads the datagrams in batches, and hands each to
+ * the connection handlers. No responses are sent.
  */
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // TODO: Handle UDP clients
-    syslog(LOG_WARNING, "UDP clients not currently supported!");
+    worker_ev_userdata *data = ev_userdata(lp);
+    udp_batch *batch = data->udp;
+
+    hlld_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.conn = NULL;
+    handle.done_sets = 0;
+    handle.metrics = data->netconf->metrics;
+    handle.worker = data->metrics;
+    handle.slowlog = data->netconf->slowlog;
+    handle.cluster = data->netconf->cluster;
+    handle.remote = data->netconf->remote;
+    handle.exec = NULL;
+
+    for (int round=0; round < UDP_MAX_BATCHES; round++) {
+        int num = read_udp_batch(watcher->fd, batch);
+        for (int i=0; i < num; i++) {
+            if (batch->lens[i] < 0) continue;
+            data->metrics->bytes_in += batch->lens[i];
+            batch->bufs[i][batch->lens[i]] = '\0';
+            handle_udp_message(&handle, batch->bufs[i], batch->lens[i]);
+        }
+        if (num < UDP_BATCH) break;
+    }
+}
+
+
+/**
+ * Reads a batch of datagrams without blocking. Datagrams
+ * that were truncated have a length of -1.
+ * @arg fd The UDP socket
+ * @arg batch The buffers to read into
+ * @return The number of datagrams read.
+ */
+static int read_udp_batch(int fd, udp_batch *batch) {
+    int num = 0;
+#ifdef __linux__
+    // Read the whole batch with one call
+    num = recvmmsg(fd, batch->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            syslog(LOG_ERR, "Failed to recvmmsg() on UDP socket! %s.", strerror(errno));
+        return 0;
+    }
+    for (int i=0; i < num; i++) {
+        batch->lens[i] = batch->msgs[i].msg_len;
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) batch->lens[i] = -1;
+    }
+#else
+    for (; num < UDP_BATCH; num++) {
+        ssize_t len = recv(fd, batch->bufs[num], UDP_MESG_SIZE + 1, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                syslog(LOG_ERR, "Failed to recv() on UDP socket! %s.", strerror(errno));
+            break;
+        }
+        batch->lens[num] = (len > UDP_MESG_SIZE) ? -1 : len;
+    }
+#endif
+    for (int i=0; i < num; i++) {
+        if (batch->lens[i] < 0)
+            syslog(LOG_WARNING, "Dropped a UDP message larger than %d bytes.", UDP_MESG_SIZE);
+    }
+    return num;
 }
 
 
@@ -399,16 +1200,30 @@ static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
  * We need to take care to add the data to our buffers, and then
  * invoke the connection handlers who have the business logic
  * of what to do.
+ * @arg filled Output, set if the read filled the buffer,
+ * so the socket may have more to read
+ * @return 0 on success, 1 if the connection should be closed.
  */
-static int read_client_data(conn_info *conn) {
+static int read_client_data(conn_info *conn, int *filled) {
     /**
      * Figure out how much space we have to write.
      * If we have < 50% free, we resize the buffer using
      * a multiplier.
      */
+    uint64_t max_size = (uint64_t)conn->thread_ev->netconf->config->max_conn_buffer << 20;
     int avail_buf = circbuf_avail_buf(&conn->input);
-    if (avail_buf < conn->input.buf_size / 2) {
-        circbuf_grow_buf(&conn->input);
+    if (avail_buf < conn->input.buf_size / 2 && conn->input.buf_size < max_size) {
+        circbuf_grow_buf(&conn->input, max_size);
+        watch_grown_buffers(conn);
+        avail_buf = circbuf_avail_buf(&conn->input);
+    }
+
+    // The handler consumes every complete command, so a full
+    // buffer holds a command that can never fit
+    if (!avail_buf) {
+        syslog(LOG_WARNING, "Command exceeds max_conn_buffer of %d MB. Closing [%d].",
+                conn->thread_ev->netconf->config->max_conn_buffer, conn->client.fd);
+        return 1;
     }
 
     // Build the IO vectors to perform the read
@@ -417,6 +1232,7 @@ static int read_client_data(conn_info *conn) {
     circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
 
     // Issue the read
+    *filled = 0;
     ssize_t read_bytes = readv(conn->client.fd, (struct iovec*)&vectors, num_vectors);
 
     // Make sure we actually read something
@@ -424,30 +1240,106 @@ static int read_client_data(conn_info *conn) {
         syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
         return 1;
     } else if (read_bytes == -1) {
-        if (errno != EAGAIN && errno != EINTR) {
-            syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
-                    conn->client.fd, strerror(errno));
-        }
+        // Drained by an earlier read
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
         return 1;
     }
 
     // Update the write cursor
+    *filled = (read_bytes == avail_buf);
     circbuf_advance_write(&conn->input, read_bytes);
+    conn->thread_ev->metrics->bytes_in += read_bytes;
+    conn->byte_tokens -= read_bytes;
     return 0;
 }
 
 
 /**
- * Invoked when a client connection is ready to be written to.
+ * Starts the idle timer of a connection whose buffers grew,
+ * unless it is already running.
  */
-static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the associated connection struct
-    conn_info *conn = watcher->data;
+static void watch_grown_buffers(conn_info *conn) {
+    if (ev_is_active(&conn->idle_timer)) return;
+    ev_timer_set(&conn->idle_timer, CONN_BUF_IDLE_SHRINK, 0.);
+    ev_timer_start(conn->thread_ev->loop, &conn->idle_timer);
+}
 
-    // Bail if inactive
-    if (!conn->active) return;
 
-    // Build the IO vectors to perform the write
+/**
+ * Invoked when the watch timer of a connection fires. The
+ * handlers check the watches, and push their updates.
+ */
+static void handle_conn_watch(ev_loop *lp, ev_timer *t, int ready_events) {
+    conn_info *conn = t->data;
+    if (!conn->active) return;
+    worker_ev_userdata *data = conn->thread_ev;
+
+    hlld_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.conn = conn;
+    handle.done_sets = 0;
+    handle.metrics = data->netconf->metrics;
+    handle.worker = data->metrics;
+    handle.slowlog = data->netconf->slowlog;
+    handle.cluster = data->netconf->cluster;
+    handle.remote = data->netconf->remote;
+    handle.exec = NULL;
+
+    // The pushes are written at once
+    conn->corked = 1;
+    handle_client_watch(&handle);
+    conn->corked = 0;
+    if (flush_client_output(conn)) deactivate_client_connection(conn);
+}
+
+
+/**
+ * Invoked when the idle timer of a connection fires. The
+ * grown buffers are shrunk back once the connection has
+ * not been read from for a while, and they are empty.
+ */
+static void handle_conn_idle(ev_loop *lp, ev_timer *t, int ready_events) {
+    conn_info *conn = t->data;
+    if (!conn->active) return;
+
+    // Wait out the remainder if we were active since
+    ev_tstamp idle = ev_now(lp) - conn->last_active;
+    if (idle < CONN_BUF_IDLE_SHRINK || conn->parked ||
+            circbuf_used_buf(&conn->input) || circbuf_used_buf(&conn->output)) {
+        ev_tstamp wait = CONN_BUF_IDLE_SHRINK - idle;
+        ev_timer_set(t, (wait > 1.) ? wait : CONN_BUF_IDLE_SHRINK, 0.);
+        ev_timer_start(lp, t);
+        return;
+    }
+
+    syslog(LOG_DEBUG, "Shrinking idle connection buffers. [%d]", conn->client.fd);
+    if (conn->input.buf_size != INIT_CONN_BUF_SIZE) {
+        circbuf_free(&conn->input);
+        circbuf_init(&conn->input, 1);
+    }
+    if (conn->output.buf_size != INIT_CONN_BUF_SIZE) {
+        count_output_bytes(-(int64_t)conn->output.buf_size);
+        circbuf_free(&conn->output);
+        circbuf_init(&conn->output, 0);
+        count_output_bytes(conn->output.buf_size);
+    }
+}
+
+
+/**
+ * Invoked when a client connection is ready to be written to.
+ */
+static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the associated connection struct
+    conn_info *conn = watcher->data;
+
+    // Bail if inactive
+    if (!conn->active) return;
+
+    // Build the IO vectors to perform the write
     struct iovec vectors[2];
     int num_vectors;
     circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
@@ -458,6 +1350,7 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
     if (write_bytes > 0) {
         // Update the cursor
         circbuf_advance_read(&conn->output, write_bytes);
+        conn->thread_ev->metrics->bytes_out += write_bytes;
 
         // Check if we should reset the use_write_buf.
         // This is done when the buffer size is 0.
@@ -474,6 +1367,14 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
         deactivate_client_connection(conn);
         return;
     }
+
+    // Read again once the client has caught up, and handle
+    // the commands that were left in the input
+    if (conn->throttled && circbuf_used_buf(&conn->output) <= OUTPUT_LOW_WATERMARK) {
+        set_throttled(conn, 0);
+        if (!conn->parked) start_client_reads(conn);
+        run_client_handler(ev_userdata(lp), conn);
+    }
 }
 
 
@@ -491,24 +1392,464 @@ static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events)
     // Bail if inactive
     if (!conn->active) return;
 
-    // Read in the data, and close on issues
-    if (read_client_data(conn)) {
-        deactivate_client_connection(conn);
-        return;
+    // Read in the data, and close on issues. A read that fills
+    // the buffer is handled and followed by another, rather than
+    // waiting for the next loop iteration, until the socket is
+    // drained or the client has had its rounds.
+    conn->last_active = ev_now(lp);
+    int filled = 1;
+    for (int round=0; round < READ_ROUNDS && filled; round++) {
+        if (read_client_data(conn, &filled)) {
+            deactivate_client_connection(conn);
+            return;
+        }
+        run_client_handler(data, conn);
+        if (!conn->active || conn->parked || conn->throttled || conn->yielded ||
+                conn->rate_limited)
+            break;
     }
+}
 
+
+/**
+ * Invokes the connection handler on the buffered input
+ */
+static void run_client_handler(worker_ev_userdata *data, conn_info *conn) {
     // Prepare to invoke the handler
     hlld_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
     handle.conn = conn;
+    handle.done_sets = 0;
+    handle.metrics = data->netconf->metrics;
+    handle.worker = data->metrics;
+    handle.slowlog = data->netconf->slowlog;
+    handle.cluster = data->netconf->cluster;
+    handle.remote = data->netconf->remote;
+    handle.exec = NULL;
+
+    // Time the connection, if it may be moved to another worker
+    uint64_t start = (handle.config->migrate_busy) ? metrics_now() : 0;
+
+    // Start a turn on the first run in this pass of the loop
+    unsigned iter = ev_iteration(data->loop);
+    if (conn->turn_iter != iter) {
+        conn->turn_iter = iter;
+        conn->turn_cmds = 0;
+        conn->turn_bytes = 0;
+    }
+
+    while (1) {
+        // Gather the responses, and write them at once
+        conn->turn_input = circbuf_used_buf(&conn->input);
+        conn->corked = 1;
+        int res = handle_client_connect(&handle);
+        conn->corked = 0;
+        conn->turn_bytes += conn->turn_input - (int64_t)circbuf_used_buf(&conn->input);
+
+        // Reschedule the watcher, unless it's non-active now
+        if (res || flush_client_output(conn)) {
+            deactivate_client_connection(conn);
+            return;
+        }
+
+        // The handler stops at the high watermark. Stop reading
+        // until the writes drain the output, unless the flush has.
+        if (!conn->throttled) break;
+        if (circbuf_used_buf(&conn->output) > OUTPUT_LOW_WATERMARK) {
+            stop_client_reads(conn);
+            break;
+        }
+        set_throttled(conn, 0);
+    }
+    if (conn->output.buf_size > INIT_CONN_BUF_SIZE)
+        watch_grown_buffers(conn);
+
+    // Keep track of the busiest connection of the epoch
+    if (start) {
+        if (conn->busy_epoch != data->balance_epoch) {
+            conn->busy_epoch = data->balance_epoch;
+            conn->busy_ns = 0;
+        }
+        uint64_t nanos = metrics_now() - start;
+        conn->busy_ns += nanos;
+        data->handled_ns += nanos;
+        if (conn->busy_ns > data->hot_ns) {
+            data->hot = conn;
+            data->hot_ns = conn->busy_ns;
+        }
+    }
+}
+
+
+/**
+ * Writes the responses gathered while corked with a single
+ * writev. Anything left is written once the socket is
+ * writable, as with any buffered write.
+ * @return 0 on success, 1 on error.
+ */
+static int flush_client_output(conn_info *conn) {
+#ifdef HLLD_URING
+    // Sent with the other requests of the worker
+    if (conn->thread_ev->ring) {
+        if (conn->active) queue_client_send(conn);
+        return 0;
+    }
+#endif
+    if (!conn->active || conn->use_write_buf ||
+            conn->output.read_cursor == conn->output.write_cursor)
+        return 0;
+
+    struct iovec vectors[2];
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+    ssize_t write_bytes = writev(conn->client.fd, (struct iovec*)&vectors, num_vectors);
+    if (write_bytes < 0) {
+        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                    conn->client.fd, strerror(errno));
+            return 1;
+        }
+        write_bytes = 0;
+    }
+    circbuf_advance_read(&conn->output, write_bytes);
+    conn->thread_ev->metrics->bytes_out += write_bytes;
+
+    // Wait for the socket if our write was short
+    if (conn->output.read_cursor != conn->output.write_cursor) {
+        conn->use_write_buf = 1;
+        ev_io_start(conn->thread_ev->loop, &conn->write_client);
+    }
+    return 0;
+}
+
+
+/**
+ * Starts reading a connection, with its watcher
+ * or a recv on the ring of its worker
+ */
+static void start_client_reads(conn_info *conn) {
+#ifdef HLLD_URING
+    if (conn->thread_ev->ring) {
+        conn->reads_wanted = 1;
+        if (!conn->recv_armed && arm_client_recv(conn))
+            deactivate_client_connection(conn);
+        return;
+    }
+#endif
+    ev_io_start(conn->thread_ev->loop, &conn->client);
+}
+
+
+/**
+ * Stops reading a connection. With io_uring, data that
+ * the recv already read is still added to the input.
+ */
+static void stop_client_reads(conn_info *conn) {
+#ifdef HLLD_URING
+    if (conn->thread_ev->ring) {
+        conn->reads_wanted = 0;
+        if (!conn->recv_armed) return;
+        struct io_uring_sqe *sqe = worker_sqe(conn->thread_ev);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)conn | URING_RECV;
+        sqe->user_data = URING_CANCEL;
+        return;
+    }
+#endif
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+}
+
+
+/**
+ * Starts accepting clients on the listener of a worker
+ */
+static void start_worker_accept(worker_ev_userdata *data) {
+#ifdef HLLD_URING
+    if (data->ring) {
+        arm_worker_accept(data);
+        return;
+    }
+#endif
+    ev_io_start(data->loop, &data->tcp_client);
+}
+
+
+#ifdef HLLD_URING
+/**
+ * Sets up the ring of a worker, and the buffers its
+ * clients read into. Falls back to libev on failure.
+ */
+static void setup_worker_uring(worker_ev_userdata *data) {
+    data->ring = calloc(1, sizeof(hlld_uring));
+    int res = data->ring ? uring_setup(data->ring, URING_ENTRIES, 4 * URING_ENTRIES) : -ENOMEM;
+    if (!res) {
+        res = uring_provide_buffers(data->ring, URING_BUFS, URING_BUF_SIZE);
+        if (res) uring_free(data->ring);
+    }
+    if (res) {
+        syslog(LOG_WARNING, "Failed to set up io_uring for worker %d, using libev! %s.",
+                data->index, strerror(-res));
+        free(data->ring);
+        data->ring = NULL;
+        return;
+    }
+    ev_io_init(&data->ring_client, handle_uring_completions, data->ring->fd, EV_READ);
+    ev_io_start(data->loop, &data->ring_client);
+}
+
+
+/**
+ * Returns a request on the ring of a worker, submitting
+ * the queued ones if the ring is full.
+ * @return The request, or NULL if the ring cannot take it.
+ */
+static struct io_uring_sqe* worker_sqe(worker_ev_userdata *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(data->ring);
+    if (!sqe) {
+        uring_enter(data->ring, 0);
+        sqe = uring_get_sqe(data->ring);
+    }
+    if (!sqe) syslog(LOG_ERR, "The io_uring of worker %d is full!", data->index);
+    return sqe;
+}
+
 
-    // Reschedule the watcher, unless it's non-active now
-    if (handle_client_connect(&handle))
+/**
+ * Accepts the clients of the listener of a
+ * worker, with a single multishot accept
+ */
+static void arm_worker_accept(worker_ev_userdata *data) {
+    struct io_uring_sqe *sqe = worker_sqe(data);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = data->tcp_client.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uintptr_t)data | URING_ACCEPT;
+}
+
+
+/**
+ * Reads a connection with a multishot recv, which reads
+ * into the buffers of the worker until it is cancelled.
+ * @return 0 on success, 1 if the ring is full.
+ */
+static int arm_client_recv(conn_info *conn) {
+    struct io_uring_sqe *sqe = worker_sqe(conn->thread_ev);
+    if (!sqe) return 1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->client.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t)conn | URING_RECV;
+    conn->recv_armed = 1;
+    return 0;
+}
+
+
+/**
+ * Sends the output of a connection, unless a send is
+ * already in flight. The output buffer is pinned until
+ * the send completes, so that growing it keeps the
+ * bytes being sent.
+ */
+static void queue_client_send(conn_info *conn) {
+    if (conn->sending || conn->closing || !circbuf_used_buf(&conn->output)) return;
+    struct io_uring_sqe *sqe = worker_sqe(conn->thread_ev);
+    if (!sqe) {
         deactivate_client_connection(conn);
+        return;
+    }
+
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, conn->send_iov, &num_vectors);
+    memset(&conn->send_msg, 0, sizeof(struct msghdr));
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = num_vectors;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->client.fd;
+    sqe->addr = (uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | URING_SEND;
+    conn->sending = 1;
+    conn->output.pinned = 1;
+}
+
+
+/**
+ * Appends the bytes read by a recv to the input of a
+ * connection, growing it up to max_conn_buffer.
+ * @return 0 on success, 1 if the input is full.
+ */
+static int append_client_input(conn_info *conn, char *in, uint64_t len) {
+    uint64_t max_size = (uint64_t)conn->thread_ev->netconf->config->max_conn_buffer << 20;
+    while (circbuf_avail_buf(&conn->input) < len) {
+        if (circbuf_grow_buf(&conn->input, max_size)) {
+            syslog(LOG_WARNING, "Command exceeds max_conn_buffer of %d MB. Closing [%d].",
+                    conn->thread_ev->netconf->config->max_conn_buffer, conn->client.fd);
+            return 1;
+        }
+        watch_grown_buffers(conn);
+    }
+
+    struct iovec vectors[2];
+    int num_vectors;
+    circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
+    uint64_t first = (vectors[0].iov_len < len) ? vectors[0].iov_len : len;
+    memcpy(vectors[0].iov_base, in, first);
+    if (first < len) memcpy(vectors[1].iov_base, in + first, len - first);
+    circbuf_advance_write(&conn->input, len);
+    conn->thread_ev->metrics->bytes_in += len;
+    conn->byte_tokens -= len;
+    return 0;
 }
 
 
+/**
+ * Invoked when the ring of a worker has completions.
+ * Each is handed to its connection, or listener.
+ */
+static void handle_uring_completions(ev_loop *lp, ev_io *watcher, int ready_events) {
+    (void)watcher;
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    struct io_uring_cqe cqe;
+    while (uring_next_cqe(data->ring, &cqe)) {
+        void *ptr = (void*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_TAG_MASK);
+        switch (cqe.user_data & URING_TAG_MASK) {
+            case URING_RECV:
+                handle_client_recv(ptr, &cqe);
+                break;
+            case URING_SEND:
+                handle_client_send(ptr, &cqe);
+                break;
+            case URING_ACCEPT:
+                handle_uring_accept(data, &cqe);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+/**
+ * Invoked when the listener of a worker accepted a client
+ */
+static void handle_uring_accept(worker_ev_userdata *data, struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        if (!set_client_sockopts(cqe->res, 1, data->netconf->config->busy_poll)) {
+            TRACE2(conn_accept, cqe->res, 0);
+            syslog(LOG_DEBUG, "Accepted client connection. [%d]", cqe->res);
+            schedule_client(data, cqe->res);
+        }
+    } else if (cqe->res != -ECANCELED && data->tcp_client.fd >= 0) {
+        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(-cqe->res));
+    }
+
+    // The accept ends on errors, such as running out of files
+    if (!(cqe->flags & IORING_CQE_F_MORE) && data->should_run && data->tcp_client.fd >= 0)
+        arm_worker_accept(data);
+}
+
+
+/**
+ * Invoked when a recv of a connection completes. The bytes
+ * are added to the input, and handled unless reads are stopped.
+ */
+static void handle_client_recv(conn_info *conn, struct io_uring_cqe *cqe) {
+    worker_ev_userdata *data = conn->thread_ev;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) conn->recv_armed = 0;
+
+    // Take the bytes, and hand the buffer back
+    int failed = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && conn->active && !conn->closing)
+            failed = append_client_input(conn, uring_buffer(data->ring, bid), cqe->res);
+        uring_recycle_buffer(data->ring, bid);
+    }
+
+    if (conn->closing) {
+        if (!conn->recv_armed && !conn->sending) close_client_connection(conn);
+        return;
+    }
+    if (!conn->active) return;
+
+    if (cqe->res == 0) {
+        syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
+        failed = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED &&
+            cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        syslog(LOG_ERR, "Failed to recv() from connection [%d]! %s.",
+                conn->client.fd, strerror(-cqe->res));
+        failed = 1;
+    }
+    if (failed) {
+        deactivate_client_connection(conn);
+        return;
+    }
+
+    if (conn->migrate_to) {
+        if (!conn->recv_armed) hand_off_client_connection(conn);
+        return;
+    }
+    if (cqe->res > 0 && !conn->parked && !conn->throttled && !conn->yielded) {
+        conn->last_active = ev_now(data->loop);
+        run_client_handler(data, conn);
+    }
+
+    // Read again once the recv ends, as when out of buffers
+    if (conn->active && conn->reads_wanted && !conn->recv_armed && arm_client_recv(conn))
+        deactivate_client_connection(conn);
+}
+
+
+/**
+ * Invoked when a send of the output of a connection
+ * completes. Sends the rest of the output, and reads
+ * again once a throttled client has caught up.
+ */
+static void handle_client_send(conn_info *conn, struct io_uring_cqe *cqe) {
+    conn->sending = 0;
+    conn->output.pinned = 0;
+    free(conn->output.retired);
+    conn->output.retired = NULL;
+
+    if (conn->closing) {
+        if (!conn->recv_armed) close_client_connection(conn);
+        return;
+    }
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                conn->client.fd, strerror(-cqe->res));
+        deactivate_client_connection(conn);
+        return;
+    }
+    if (cqe->res > 0) {
+        circbuf_advance_read(&conn->output, cqe->res);
+        conn->thread_ev->metrics->bytes_out += cqe->res;
+    }
+    if (!conn->active) return;
+    if (conn->migrate_to) {
+        if (!conn->recv_armed) hand_off_client_connection(conn);
+        return;
+    }
+    queue_client_send(conn);
+
+    if (conn->throttled && circbuf_used_buf(&conn->output) <= OUTPUT_LOW_WATERMARK) {
+        set_throttled(conn, 0);
+        if (!conn->parked) start_client_reads(conn);
+        run_client_handler(conn->thread_ev, conn);
+    }
+}
+#endif
+
+
 /**
  * Invoked to handle async notifications via the thread pipes
  */
@@ -523,18 +1864,70 @@ static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_ev
 
     // Handle the command
     conn_info *conn;
+    void *client_fd;
     switch (cmd) {
         // Accept new connection
         case 'a':
-            // Read the address of conn from the pipe
-            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
+            // Read the client socket from the pipe
+            if (read(data->pipefd[0], &client_fd, sizeof(void*)) < 0) {
                 perror("Failed to read from async pipe");
                 return;
             }
 
             // Schedule this connection on this thread
-            conn->thread_ev = data;
-            ev_io_start(data->loop, &conn->client);
+            schedule_client(data, (int)(intptr_t)client_fd);
+            break;
+
+        // Resume a parked connection
+        case 'r':
+            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+
+            // Handle the parked command, then read again
+            conn->parked = 0;
+            if (!conn->active) break;
+            if (!conn->throttled) start_client_reads(conn);
+            run_client_handler(data, conn);
+            break;
+
+        // Take over a connection from a busy worker
+        case 'm':
+            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+            adopt_client_connection(data, conn);
+            break;
+
+        // Run the commands routed to us
+        case 'j':
+            if (read(data->pipefd[0], &conn, sizeof(void*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+            run_routed_jobs(data);
+            break;
+
+        // Answer the batches the execution threads ran
+        case 'x':
+            if (read(data->pipefd[0], &conn, sizeof(void*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+            run_executed_jobs(data);
+            break;
+
+        // Start taking clients, or stand by
+        case 'u':
+        case 'd':
+            if (read(data->pipefd[0], &conn, sizeof(void*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+            if (cmd == 'u') activate_worker(data);
+            else stand_by_worker(data);
             break;
 
         // Quit
@@ -548,23 +1941,848 @@ static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_ev
     }
 }
 
-
+
+/**
+ * Invoked periodically to give the connection handlers
+ * time to cleanup and handle state updates
+ */
+static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+
+    // Prepare to invoke the handler
+    hlld_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.conn = NULL;
+    handle.done_sets = 0;
+    handle.metrics = data->netconf->metrics;
+    handle.worker = data->metrics;
+    handle.slowlog = data->netconf->slowlog;
+    handle.cluster = data->netconf->cluster;
+    handle.remote = data->netconf->remote;
+    handle.exec = NULL;
+
+    // Invoke the connection handler layer
+    periodic_update(&handle);
+}
+
+
+/**
+ * Invoked before the worker blocks for events. Its
+ * connections hold no references into the set manager,
+ * so vacuuming need not wait on an idle worker.
+ */
+static void handle_worker_idle(ev_loop *lp, ev_prepare *w, int ready_events) {
+    (void)w;
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    setmgr_client_idle(data->netconf->mgr);
+    if (data->wake_ns) data->metrics->busy_ns += metrics_now() - data->wake_ns;
+
+#ifdef HLLD_URING
+    // Submit the requests of this iteration at once
+    if (data->ring && uring_queued(data->ring)) {
+        int res = uring_enter(data->ring, 0);
+        if (res < 0) syslog(LOG_ERR, "Failed to submit to io_uring! %s.", strerror(-res));
+    }
+#endif
+}
+
+/**
+ * Invoked once the worker wakes, before any other
+ * watcher, to rejoin the set manager at its current version.
+ * The coarse clocks are refreshed for the commands to come,
+ * and the wake is noted if it found events, for busy_poll.
+ */
+static void handle_worker_resume(ev_loop *lp, ev_check *w, int ready_events) {
+    (void)w;
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    hclock_tick();
+    data->wake_ns = metrics_now();
+    if (ev_pending_count(lp)) data->event_ns = data->wake_ns;
+    setmgr_client_checkpoint(data->netconf->mgr);
+}
+
+/**
+ * Gives the connections that used their turn another, on
+ * every pass of the event loop while there are any. It has
+ * the highest priority, so it runs even while other clients
+ * are ready, and they are handled in the same pass.
+ */
+static void handle_worker_turns(ev_loop *lp, ev_idle *w, int ready_events) {
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    ev_idle_stop(lp, w);
+
+    // Those yielding again wait for the next pass
+    conn_info *conn = data->yielded_head, *next;
+    data->yielded_head = data->yielded_tail = NULL;
+    for (; conn; conn = next) {
+        next = conn->next_yielded;
+        conn->next_yielded = NULL;
+        conn->yielded = 0;
+
+        // Parked and throttled connections are resumed on their own
+        if (!conn->active || conn->parked || conn->throttled) continue;
+        run_client_handler(data, conn);
+
+        // Read again, unless plenty of input is still waiting
+        if (conn->active && !conn->parked && !conn->throttled && !conn->rate_limited &&
+                (!conn->yielded || circbuf_used_buf(&conn->input) <= YIELD_READ_AHEAD))
+            start_client_reads(conn);
+    }
+}
+
+/**
+ * Invoked every BALANCE_TIME_SEC with migrate_busy. Publishes
+ * our load, the share of the epoch we spent handling commands.
+ * If it is over migrate_busy percent, our busiest connection is
+ * moved to the least busy worker, but only if that leaves both
+ * of us at most 3/4 as busy as we were. A connection that keeps
+ * a worker busy on its own stays put, rather than bouncing.
+ */
+static void handle_balance_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    (void)t;
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    hlld_networking *netconf = data->netconf;
+
+    // Close the epoch
+    uint64_t now = metrics_now();
+    uint64_t elapsed = now - data->balance_start;
+    uint64_t handled = data->handled_ns - data->balance_handled;
+    int load = (elapsed) ? handled * 1000 / elapsed : 0;
+    int hot_load = (elapsed) ? data->hot_ns * 1000 / elapsed : 0;
+    conn_info *hot = data->hot;
+    data->load = load;
+    data->balance_start = now;
+    data->balance_handled = data->handled_ns;
+    data->balance_epoch++;
+    data->hot = NULL;
+    data->hot_ns = 0;
+    if (!hot || load < netconf->config->migrate_busy * 10 || data->index >= netconf->num_active)
+        return;
+
+    // Find the least busy worker, from their last epoch
+    worker_ev_userdata *target = NULL;
+    for (int i=0; i < netconf->num_active; i++) {
+        worker_ev_userdata *w = netconf->workers[i];
+        if (!w || w == data || w->reserved != data->reserved) continue;
+        if (!target || w->load < target->load) target = w;
+    }
+    if (!target || (target->load + hot_load) * 4 > load * 3 || (load - hot_load) * 4 > load * 3)
+        return;
+
+    // Count the connection against the target until its next
+    // epoch, so other busy workers look elsewhere meanwhile
+    __sync_fetch_and_add(&target->load, hot_load);
+    syslog(LOG_DEBUG, "Moving connection [%d] from worker %d at %d%% busy to worker %d at %d%%.",
+            hot->client.fd, data->index, load / 10, target->index, target->load / 10);
+    migrate_client_connection(hot, target);
+}
+
+/**
+ * Starts moving a connection to another worker. Connections
+ * waiting on a set page in, or on their output to drain, are
+ * left alone. With io_uring, the connection is handed off once
+ * its requests in flight have completed.
+ * Must be invoked on the worker thread.
+ */
+static void migrate_client_connection(conn_info *conn, worker_ev_userdata *target) {
+    if (!conn->active || conn->parked || conn->throttled || conn->rate_limited ||
+            conn->migrate_to)
+        return;
+#ifdef HLLD_URING
+    if (conn->closing) return;
+#endif
+    if (conn->yielded) unlink_yielded(conn);
+    conn->migrate_to = target;
+    stop_client_reads(conn);
+#ifdef HLLD_URING
+    if (conn->recv_armed || conn->sending) return;
+#endif
+    hand_off_client_connection(conn);
+}
+
+/**
+ * Hands a connection to the worker it is moving to. Once
+ * notified, it is no longer ours.
+ * Must be invoked on the worker thread.
+ */
+static void hand_off_client_connection(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    ev_io_stop(data->loop, &conn->client);
+    ev_io_stop(data->loop, &conn->write_client);
+    ev_timer_stop(data->loop, &conn->idle_timer);
+    ev_timer_stop(data->loop, &conn->watch_timer);
+    ev_timer_stop(data->loop, &conn->rate_timer);
+    unlink_served(conn);
+    if (data->hot == conn) {
+        data->hot = NULL;
+        data->hot_ns = 0;
+    }
+    notify_worker(conn->migrate_to, 'm', conn);
+}
+
+/**
+ * Takes over a connection from another worker. The output
+ * it had not sent yet is sent first, then the buffered
+ * input is handled, and reads start again.
+ * Must be invoked on the worker thread.
+ */
+static void adopt_client_connection(worker_ev_userdata *data, conn_info *conn) {
+    conn->thread_ev = data;
+    conn->migrate_to = NULL;
+    conn->busy_epoch = data->balance_epoch;
+    conn->busy_ns = 0;
+    conn->last_active = ev_now(data->loop);
+    data->metrics->conns_migrated++;
+    link_served(conn);
+
+    // Pass it on again if we have since stood by
+    if (data->index >= data->netconf->num_active && !ev_is_active(&data->drain))
+        ev_timer_start(data->loop, &data->drain);
+
+    if (conn->input.buf_size > INIT_CONN_BUF_SIZE || conn->output.buf_size > INIT_CONN_BUF_SIZE)
+        watch_grown_buffers(conn);
+    if (conn->watch_timer.repeat > 0.) ev_timer_again(data->loop, &conn->watch_timer);
+    if (circbuf_used_buf(&conn->output)) {
+        if (CONN_URING(conn)) {
+#ifdef HLLD_URING
+            conn->use_write_buf = 0;
+            queue_client_send(conn);
+#endif
+        } else {
+            conn->use_write_buf = 1;
+            ev_io_start(data->loop, &conn->write_client);
+        }
+    }
+    start_client_reads(conn);
+    if (conn->active && circbuf_used_buf(&conn->input)) run_client_handler(data, conn);
+}
+
+
+/**
+ * Adds a connection to the open connections of its worker
+ */
+static void link_served(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    conn->served_prev = NULL;
+    conn->served_next = data->served;
+    if (data->served) data->served->served_prev = conn;
+    data->served = conn;
+}
+
+/**
+ * Removes a connection from the open connections of its
+ * worker, if it is among them
+ */
+static void unlink_served(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    if (conn->served_prev)
+        conn->served_prev->served_next = conn->served_next;
+    else if (data->served == conn)
+        data->served = conn->served_next;
+    else
+        return;
+    if (conn->served_next) conn->served_next->served_prev = conn->served_prev;
+    conn->served_prev = conn->served_next = NULL;
+}
+
+/**
+ * Starts reading the UDP socket of a worker
+ * @arg fd The socket
+ */
+static void start_worker_udp(worker_ev_userdata *data, int fd) {
+    if (!data->udp && !(data->udp = malloc(sizeof(udp_batch)))) {
+        close(fd);
+        return;
+    }
+    for (int j=0; j < UDP_BATCH; j++) {
+        data->udp->iovs[j].iov_base = data->udp->bufs[j];
+        data->udp->iovs[j].iov_len = UDP_MESG_SIZE + 1;
+#ifdef __linux__
+        memset(&data->udp->msgs[j], 0, sizeof(struct mmsghdr));
+        data->udp->msgs[j].msg_hdr.msg_iov = &data->udp->iovs[j];
+        data->udp->msgs[j].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+    ev_io_init(&data->udp_client, handle_new_udp_mesg, fd, EV_READ);
+    ev_io_start(data->loop, &data->udp_client);
+}
+
+/**
+ * Starts taking clients again, after standing by. With
+ * reuseport, we open listeners of our own again.
+ * Must be invoked on the worker thread.
+ */
+static void activate_worker(worker_ev_userdata *data) {
+    hlld_networking *netconf = data->netconf;
+    ev_timer_stop(data->loop, &data->drain);
+    if (netconf->listen_fds && data->tcp_client.fd < 0) {
+        int fd = open_tcp_listener(netconf, netconf->config->tcp_port, 1);
+        if (fd >= 0) {
+            ev_io_init(&data->tcp_client, handle_worker_new_client, fd, EV_READ);
+            start_worker_accept(data);
+        }
+    }
+    if (netconf->config->reuseport && data->udp_client.fd < 0) {
+        int fd = open_udp_socket(netconf, 1);
+        if (fd >= 0) start_worker_udp(data, fd);
+    }
+    syslog(LOG_INFO, "Worker %d is taking clients.", data->index);
+}
+
+/**
+ * Stands by, once the workers taking clients no longer
+ * count us. Our listeners are closed, with the clients they
+ * had queued passed on, and our connections are moved to
+ * the other workers. We keep running, idle, until we are
+ * activated again.
+ * Must be invoked on the worker thread.
+ */
+static void stand_by_worker(worker_ev_userdata *data) {
+    if (data->tcp_client.fd >= 0) {
+        int fd = data->tcp_client.fd;
+        ev_io_stop(data->loop, &data->tcp_client);
+        data->tcp_client.fd = -1;
+        int client_fd;
+        while ((client_fd = accept_client(fd, data->netconf->config->busy_poll)) >= 0)
+            schedule_client(data, client_fd);
+
+        // Ends an accept of our ring, too
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+    }
+    if (data->netconf->config->reuseport && data->udp_client.fd >= 0) {
+        ev_io_stop(data->loop, &data->udp_client);
+        close(data->udp_client.fd);
+        data->udp_client.fd = -1;
+    }
+    ev_timer_set(&data->drain, 0., DRAIN_TIME_SEC);
+    ev_timer_start(data->loop, &data->drain);
+}
+
+/**
+ * Invoked every DRAIN_TIME_SEC while we stand by, until
+ * all our connections have moved to the workers taking
+ * clients. Connections waiting on a page in or on their
+ * output are moved once they can be.
+ */
+static void handle_drain_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    (void)ready_events;
+    worker_ev_userdata *data = ev_userdata(lp);
+    hlld_networking *netconf = data->netconf;
+    if (data->index < netconf->num_active) {
+        ev_timer_stop(lp, t);
+        return;
+    }
+
+    conn_info *conn = data->served;
+    while (conn) {
+        conn_info *next = conn->served_next;
+        worker_ev_userdata *target = pool_worker(netconf, data->reserved);
+        if (target && target != data) migrate_client_connection(conn, target);
+        conn = next;
+    }
+    if (!data->served) {
+        ev_timer_stop(lp, t);
+        syslog(LOG_INFO, "Worker %d is standing by.", data->index);
+    }
+}
+
+
+/**
+ * Runs the commands routed to a worker, oldest first. The
+ * phase times of each are kept apart from the current
+ * command of this worker, and are handed back to the caller.
+ */
+static void run_routed_jobs(worker_ev_userdata *data) {
+    route_job *jobs = __sync_lock_test_and_set(&data->routed, NULL);
+    if (!jobs) return;
+
+    // Reverse the stack into arrival order
+    route_job *ordered = NULL;
+    while (jobs) {
+        route_job *next = jobs->next;
+        jobs->next = ordered;
+        ordered = jobs;
+        jobs = next;
+    }
+
+    uint64_t saved[NUM_SLOWLOG_PHASES];
+    memcpy(saved, SLOWLOG_PHASE_NANOS, sizeof(saved));
+    while (ordered) {
+        // The waiter may return once done is set
+        route_job *job = ordered;
+        ordered = job->next;
+        slowlog_phases_reset();
+        job->fn(job->arg);
+        memcpy(job->phases, SLOWLOG_PHASE_NANOS, sizeof(job->phases));
+        __sync_synchronize();
+        job->done = 1;
+    }
+    memcpy(SLOWLOG_PHASE_NANOS, saved, sizeof(saved));
+}
+
+/**
+ * Groups the workers by their node, for a set affinity
+ * of node. Runs once every worker is registered and
+ * before any of them handles a command.
+ */
+static void group_route_nodes(hlld_networking *netconf) {
+    int workers = netconf->config->worker_threads;
+    netconf->route_start = calloc(workers + 1, sizeof(int));
+    netconf->route_workers = calloc(workers, sizeof(int));
+
+    // Take the nodes in ascending order, and their workers in order
+    int placed = 0, last = -1;
+    while (placed < workers) {
+        int node = INT_MAX;
+        for (int i=0; i < workers; i++) {
+            int n = netconf->workers[i]->node;
+            if (n > last && n < node) node = n;
+        }
+        netconf->route_start[netconf->num_route_nodes++] = placed;
+        for (int i=0; i < workers; i++) {
+            if (netconf->workers[i]->node == node) netconf->route_workers[placed++] = i;
+        }
+        last = node;
+    }
+    netconf->route_start[netconf->num_route_nodes] = workers;
+}
+
+/**
+ * Hashes the name of a set, to pick its owner
+ */
+static uint64_t set_name_hash(char *set_name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char *c=(unsigned char*)set_name; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Returns the worker that owns a set, or
+ * -1 if the calling worker may write it
+ */
+static int set_owner(worker_ev_userdata *self, char *set_name) {
+    hlld_networking *netconf = self->netconf;
+    uint64_t hash = set_name_hash(set_name);
+
+    int owner;
+    if (netconf->config->set_affinity != SET_AFFINITY_NODE) {
+        owner = hash % netconf->config->worker_threads;
+    } else {
+        // Any worker of the owning node may write the set
+        int group = hash % netconf->num_route_nodes;
+        int start = netconf->route_start[group];
+        int size = netconf->route_start[group+1] - start;
+        if (netconf->workers[netconf->route_workers[start]]->node == self->node) return -1;
+        owner = netconf->route_workers[start + (hash / netconf->num_route_nodes) % size];
+    }
+    return (owner == self->index) ? -1 : owner;
+}
+
+/**
+ * Returns the worker owning a set, if set_affinity is enabled
+ * @arg conn The connection of the command, or NULL
+ * @arg set_name The set
+ * @return The index of the owning worker, or -1 if
+ * the calling worker may write the set itself.
+ */
+int set_owner_worker(hlld_conn_info *conn, char *set_name) {
+    if (!conn || conn->thread_ev->netconf->config->set_affinity == SET_AFFINITY_OFF)
+        return -1;
+    return set_owner(conn->thread_ev, set_name);
+}
+
+/**
+ * Runs a command on a worker, waiting for the command and
+ * running the commands routed to the calling worker meanwhile.
+ * @arg conn The connection of the command, or NULL to run it in place
+ * @arg worker The index of the worker, or -1 to run it in place
+ * @arg fn The command
+ * @arg arg Opaque argument to the command
+ */
+void run_on_worker(hlld_conn_info *conn, int worker, void (*fn)(void*), void *arg) {
+    if (!conn || worker < 0 || worker == conn->thread_ev->index) {
+        fn(arg);
+        return;
+    }
+    worker_ev_userdata *self = conn->thread_ev;
+    hlld_networking *netconf = self->netconf;
+    worker_ev_userdata *owner = netconf->workers[worker];
+
+    // Owners are only left running until nothing is in flight
+    __sync_fetch_and_add(&netconf->routes_inflight, 1);
+    if (netconf->routing_stopped) {
+        __sync_fetch_and_sub(&netconf->routes_inflight, 1);
+        fn(arg);
+        return;
+    }
+
+    // Push onto the routed commands, waking the owner if it had none
+    route_job job;
+    job.fn = fn;
+    job.arg = arg;
+    job.done = 0;
+    route_job *head;
+    do {
+        head = owner->routed;
+        job.next = head;
+    } while (!__sync_bool_compare_and_swap(&owner->routed, head, &job));
+    if (!head) notify_worker(owner, 'j', NULL);
+
+    // Serve our own routed commands, so owners waiting on each other progress
+    for (int spins=0; !job.done; spins++) {
+        run_routed_jobs(self);
+        if (spins >= ROUTE_SPINS) sched_yield();
+    }
+    __sync_synchronize();
+    for (int i=0; i < NUM_SLOWLOG_PHASES; i++) SLOWLOG_PHASE_NANOS[i] += job.phases[i];
+    __sync_fetch_and_sub(&netconf->routes_inflight, 1);
+}
+
+/**
+ * Runs a command that writes a set on the worker owning the
+ * set, if set_affinity is enabled, so the registers of the set
+ * stay in the caches of one core or node. The command otherwise
+ * runs on the calling worker. Waits for the command, running
+ * the commands routed to the calling worker meanwhile.
+ * @arg conn The connection of the command, or NULL to run it in place
+ * @arg set_name The set the command writes
+ * @arg fn The command
+ * @arg arg Opaque argument to the command
+ */
+void run_on_set_owner(hlld_conn_info *conn, char *set_name, void (*fn)(void*), void *arg) {
+    run_on_worker(conn, set_owner_worker(conn, set_name), fn, arg);
+}
+
+
+/**
+ * Reverses a stack of batches, so they are taken oldest first
+ */
+static exec_job* reverse_exec_jobs(exec_job *jobs) {
+    exec_job *ordered = NULL;
+    while (jobs) {
+        exec_job *next = jobs->next;
+        jobs->next = ordered;
+        ordered = jobs;
+        jobs = next;
+    }
+    return ordered;
+}
+
+/**
+ * Runs batches of writes, oldest first. With coalesce_writes,
+ * the batches of each set are applied together.
+ * @arg handle The handler of the running thread, without a connection
+ * @arg jobs The batches
+ */
+static void run_exec_jobs(hlld_conn_handler *handle, exec_job *jobs) {
+    int num = 0;
+    for (exec_job *j=jobs; j; j=j->next) num++;
+    hlld_exec_batch **batches = NULL;
+    if (handle->config->coalesce_writes)
+        batches = malloc(num * sizeof(hlld_exec_batch*));
+
+    if (batches) {
+        num = 0;
+        for (exec_job *j=jobs; j; j=j->next) batches[num++] = &j->batch;
+        handle_exec_batches(handle, batches, num);
+        free(batches);
+    } else {
+        for (exec_job *j=jobs; j; j=j->next) {
+            handle->exec = &j->batch.out;
+            handle_exec_batch(handle, j->batch.cmds, j->batch.cmds_len);
+        }
+    }
+    for (exec_job *j=jobs; j; j=j->next) {
+        free(j->batch.cmds);
+        j->batch.cmds = NULL;
+        handle->worker->exec_batches++;
+    }
+    handle->exec = NULL;
+}
+
+/**
+ * Entry point of the execution threads. Each runs the
+ * batches queued for it, oldest first, and hands them
+ * back to the workers of their connections. The thread
+ * idles in the set manager while it waits for batches.
+ */
+static void* exec_thread_main(void *in) {
+    exec_thread *t = in;
+    hlld_networking *netconf = t->netconf;
+    hlld_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.conn = NULL;
+    handle.done_sets = 0;
+    handle.metrics = netconf->metrics;
+    handle.worker = t->metrics;
+    handle.slowlog = netconf->slowlog;
+    handle.cluster = netconf->cluster;
+    handle.remote = netconf->remote;
+
+    // Hot sets are shadowed for us after the workers
+    hset_shadow_thread(netconf->num_slots + (t - netconf->execs));
+
+    char cmd;
+    while (1) {
+        ssize_t res = read(t->pipefd[0], &cmd, 1);
+        if (res == -1 && errno == EINTR) continue;
+        if (res != 1 || cmd == 'q') break;
+
+        setmgr_client_checkpoint(netconf->mgr);
+        hclock_tick();
+        exec_job *jobs;
+        while ((jobs = __sync_lock_test_and_set(&t->queued, NULL))) {
+            jobs = reverse_exec_jobs(jobs);
+            run_exec_jobs(&handle, jobs);
+            while (jobs) {
+                exec_job *job = jobs;
+                jobs = job->next;
+
+                // Hand back to the worker, waking it if it had none
+                worker_ev_userdata *owner = job->conn->thread_ev;
+                exec_job *head;
+                do {
+                    head = owner->executed;
+                    job->next = head;
+                } while (!__sync_bool_compare_and_swap(&owner->executed, head, job));
+                if (!head) notify_worker(owner, 'x', NULL);
+                __sync_fetch_and_sub(&netconf->execs_inflight, 1);
+            }
+        }
+        setmgr_client_idle(netconf->mgr);
+    }
+    setmgr_client_leave(netconf->mgr);
+    return NULL;
+}
+
+/**
+ * Starts the execution threads, if enabled. Any that
+ * do not start leave their writes to the workers.
+ */
+static void start_exec_threads(hlld_networking *netconf) {
+    int num = netconf->config->exec_threads;
+    if (!num) return;
+    netconf->execs = calloc(num, sizeof(exec_thread));
+    if (!netconf->execs) {
+        syslog(LOG_ERR, "Failed to allocate the execution threads!");
+        return;
+    }
+    for (int i=0; i < num; i++) {
+        exec_thread *t = netconf->execs + i;
+        t->netconf = netconf;
+        t->metrics = metrics_worker(netconf->metrics, netconf->num_slots + i);
+        if (pipe(t->pipefd)) {
+            syslog(LOG_ERR, "Failed to allocate execution thread pipes! %s.", strerror(errno));
+            break;
+        }
+        if (pthread_create(&t->thread, NULL, exec_thread_main, t)) {
+            syslog(LOG_ERR, "Failed to start an execution thread!");
+            close(t->pipefd[0]);
+            close(t->pipefd[1]);
+            break;
+        }
+        netconf->num_execs++;
+    }
+    if (netconf->num_execs < num)
+        syslog(LOG_WARNING, "Started %d of %d execution threads.", netconf->num_execs, num);
+}
+
+/**
+ * Stops handing batches to the execution threads, waits
+ * for those handed off to be handed back, and stops them.
+ * The workers must still be running.
+ */
+static void stop_exec_threads(hlld_networking *netconf) {
+    netconf->execs_stopped = 1;
+    __sync_synchronize();
+    while (netconf->execs_inflight) usleep(1000);
+    for (int i=0; i < netconf->num_execs; i++) {
+        exec_thread *t = netconf->execs + i;
+        if (write(t->pipefd[1], "q", 1) != 1)
+            perror("Failed to write to execution thread pipe");
+        pthread_join(t->thread, NULL);
+        close(t->pipefd[0]);
+        close(t->pipefd[1]);
+    }
+    free(netconf->execs);
+    netconf->execs = NULL;
+    netconf->num_execs = 0;
+}
+
+/**
+ * Hands a batch of writes of a connection to an execution
+ * thread, picked by the set they write, so the writes of a
+ * set are run by one thread. Without the threads, and with
+ * coalesce_writes, the worker of the connection runs the
+ * batch on its next pass instead, along with the others of
+ * that pass. The connection is parked until the batch ran,
+ * and its responses are sent then.
+ * @arg conn The client connection
+ * @arg set_name The set the batch writes
+ * @arg cmds The batch, which is freed once it ran
+ * @arg cmds_len The length of the batch
+ * @return 0 if the batch was handed off, or -1 if
+ * the caller should run it.
+ */
+int exec_client_batch(hlld_conn_info *conn, char *set_name, char *cmds, int cmds_len) {
+    worker_ev_userdata *data = conn->thread_ev;
+    hlld_networking *netconf = data->netconf;
+    if (!netconf->num_execs && !netconf->config->coalesce_writes) return -1;
+    exec_job *job = calloc(1, sizeof(exec_job));
+    if (!job) return -1;
+    job->conn = conn;
+    job->batch.cmds = cmds;
+    job->batch.cmds_len = cmds_len;
+    job->batch.out.flags = conn->handler_flags;
+
+    // Without the threads, the worker coalesces on its next pass
+    if (!netconf->num_execs) {
+        conn->parked = 1;
+        stop_client_reads(conn);
+        if (data->coalesce_tail)
+            data->coalesce_tail->next = job;
+        else
+            data->coalesce_head = job;
+        data->coalesce_tail = job;
+        if (!ev_is_active(&data->coalesce)) ev_idle_start(data->loop, &data->coalesce);
+        return 0;
+    }
+
+    // Nothing is handed off once the threads are stopping
+    __sync_fetch_and_add(&netconf->execs_inflight, 1);
+    if (netconf->execs_stopped) {
+        __sync_fetch_and_sub(&netconf->execs_inflight, 1);
+        free(job);
+        return -1;
+    }
+
+    conn->parked = 1;
+    stop_client_reads(conn);
+
+    // Push onto the queue, waking the thread if it had none
+    exec_thread *t = netconf->execs + set_name_hash(set_name) % netconf->num_execs;
+    exec_job *head;
+    do {
+        head = t->queued;
+        job->next = head;
+    } while (!__sync_bool_compare_and_swap(&t->queued, head, job));
+    if (!head && write(t->pipefd[1], "j", 1) != 1)
+        perror("Failed to write to execution thread pipe");
+    return 0;
+}
+
+/**
+ * Appends a response to those of a batch. A response that
+ * cannot be kept fails the batch, closing its connection.
+ * @arg out The responses of the batch
+ * @arg response_buffers A list of response buffers
+ * @arg buf_sizes A list of the buffer sizes
+ * @arg num_bufs The number of response buffers
+ * @return 0 on success.
+ */
+int exec_output_append(hlld_exec_output *out, char **response_buffers, int *buf_sizes, int num_bufs) {
+    if (out->failed) return -1;
+    for (int i=0; i < num_bufs; i++) {
+        if (out->len + buf_sizes[i] > out->size) {
+            int size = (out->size) ? out->size : 256;
+            while (size < out->len + buf_sizes[i]) size *= 2;
+            char *buf = realloc(out->buf, size);
+            if (!buf) {
+                out->failed = 1;
+                return -1;
+            }
+            out->buf = buf;
+            out->size = size;
+        }
+        memcpy(out->buf + out->len, response_buffers[i], buf_sizes[i]);
+        out->len += buf_sizes[i];
+    }
+    return 0;
+}
+
+/**
+ * Sends the responses of a batch that ran for one of our
+ * connections, and resumes the connection like a page in does
+ */
+static void answer_exec_job(worker_ev_userdata *data, exec_job *job) {
+    conn_info *conn = job->conn;
+    hlld_exec_output *out = &job->batch.out;
+    conn->parked = 0;
+    if (conn->active) {
+        if (out->failed) {
+            deactivate_client_connection(conn);
+        } else {
+            // The responses go out with those of the resumed handler
+            conn->corked = 1;
+            if (out->len) send_client_response(conn, &out->buf, &out->len, 1);
+            conn->corked = 0;
+            if (conn->active) {
+                if (!conn->throttled) start_client_reads(conn);
+                run_client_handler(data, conn);
+            }
+        }
+    }
+    free(out->buf);
+    free(job);
+}
+
+/**
+ * Sends the responses of the batches the execution threads
+ * ran for our connections, oldest first, and resumes the
+ * connections like a page in does.
+ */
+static void run_executed_jobs(worker_ev_userdata *data) {
+    exec_job *jobs = reverse_exec_jobs(__sync_lock_test_and_set(&data->executed, NULL));
+    while (jobs) {
+        exec_job *job = jobs;
+        jobs = job->next;
+        answer_exec_job(data, job);
+    }
+}
+
 /**
- * Invoked periodically to give the connection handlers
- * time to cleanup and handle state updates
+ * Applies the writes our connections gathered in the last
+ * pass of the event loop, with those of each set together,
+ * and answers them. It has the highest priority, like the
+ * turns, so the writes are applied early in the next pass.
  */
-static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
-    // Get the user data
+static void handle_worker_coalesce(ev_loop *lp, ev_idle *w, int ready_events) {
+    (void)ready_events;
     worker_ev_userdata *data = ev_userdata(lp);
+    ev_idle_stop(lp, w);
+
+    // Batches gathered while answering wait for the next pass
+    exec_job *jobs = data->coalesce_head;
+    data->coalesce_head = data->coalesce_tail = NULL;
 
-    // Prepare to invoke the handler
     hlld_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
     handle.conn = NULL;
-
-    // Invoke the connection handler layer
-    periodic_update(&handle);
+    handle.done_sets = 0;
+    handle.metrics = data->netconf->metrics;
+    handle.worker = data->metrics;
+    handle.slowlog = data->netconf->slowlog;
+    handle.cluster = data->netconf->cluster;
+    handle.remote = data->netconf->remote;
+    handle.exec = NULL;
+    run_exec_jobs(&handle, jobs);
+
+    while (jobs) {
+        exec_job *job = jobs;
+        jobs = job->next;
+        answer_exec_job(data, job);
+    }
 }
 
 
@@ -580,6 +2798,27 @@ void start_networking_worker(hlld_networking *netconf) {
     data.netconf = netconf;
     data.should_run = 1;
     data.inactive = NULL;
+    data.served = NULL;
+    data.free_conns = NULL;
+    data.num_free_conns = 0;
+    data.yielded_head = data.yielded_tail = NULL;
+    data.wake_ns = 0;
+    data.balance_start = metrics_now();
+    data.handled_ns = 0;
+    data.balance_handled = 0;
+    data.load = 0;
+    data.balance_epoch = 0;
+    data.hot = NULL;
+    data.hot_ns = 0;
+    data.index = -1;
+    data.reserved = 0;
+    data.node = 0;
+    data.routed = NULL;
+    data.executed = NULL;
+    data.coalesce_head = data.coalesce_tail = NULL;
+#ifdef HLLD_URING
+    data.ring = NULL;
+#endif
 
     // Allocate our pipe
     if (pipe(data.pipefd)) {
@@ -606,38 +2845,136 @@ void start_networking_worker(hlld_networking *netconf) {
                 PERIODIC_TIME_SEC, 1);
     ev_timer_start(data.loop, &data.periodic);
 
+    // Idle in the set manager while blocked, and
+    // checkpoint ahead of the other watchers on waking
+    ev_prepare_init(&data.idle, handle_worker_idle);
+    ev_prepare_start(data.loop, &data.idle);
+    ev_check_init(&data.resume, handle_worker_resume);
+    ev_set_priority(&data.resume, EV_MAXPRI);
+    ev_check_start(data.loop, &data.resume);
+    ev_idle_init(&data.turns, handle_worker_turns);
+    ev_set_priority(&data.turns, EV_MAXPRI);
+    ev_idle_init(&data.coalesce, handle_worker_coalesce);
+    ev_set_priority(&data.coalesce, EV_MAXPRI);
+
+    // Balance the connections across the workers, if enabled
+    ev_timer_init(&data.balance, handle_balance_timeout,
+                BALANCE_TIME_SEC, BALANCE_TIME_SEC);
+    if (netconf->config->migrate_busy && netconf->num_slots > 1)
+        ev_timer_start(data.loop, &data.balance);
+    ev_timer_init(&data.drain, handle_drain_timeout, 0., DRAIN_TIME_SEC);
+
     // Syncronize until netconf->threads is available
     barrier_wait(&netconf->thread_barrier);
 
     // Register this thread so we can accept connections
     assert(netconf->threads);
     pthread_t id = pthread_self();
-    for (int i=0; i < netconf->config->worker_threads; i++) {
+    data.tcp_client.fd = -1;
+    data.udp_client.fd = -1;
+    data.udp = NULL;
+    for (int i=0; i < netconf->num_slots; i++) {
         if (pthread_equal(id, netconf->threads[i])) {
             // Provide a pointer to our data
             netconf->workers[i] = &data;
+            data.metrics = metrics_worker(netconf->metrics, i);
+            data.index = i;
+            data.reserved = i < netconf->config->reserved_workers;
+            hset_shadow_thread(i);
+
+            // Allocate the memory of our connections from our own arena
+            if (alloc_worker_arena(i)) syslog(LOG_WARNING, "Failed to make an arena for worker %d!", i);
+
+            // Pin ourself, and learn our node
+            data.node = pin_worker_thread(netconf->config->worker_affinity, i);
+            if (data.node < 0) {
+                syslog(LOG_WARNING, "Failed to pin worker %d!", i);
+                data.node = 0;
+            }
+
+            // Serve our clients with io_uring, if enabled
+            if (netconf->config->io_uring) {
+#ifdef HLLD_URING
+                setup_worker_uring(&data);
+#else
+                syslog(LOG_WARNING, "io_uring is not supported, using libev.");
+#endif
+            }
+
+            // Accept on our own listener with reuseport
+            if (netconf->listen_fds && netconf->listen_fds[i] >= 0) {
+                ev_io_init(&data.tcp_client, handle_worker_new_client,
+                        netconf->listen_fds[i], EV_READ);
+                start_worker_accept(&data);
+            }
+
+            // Read our UDP socket, if we have one
+            if (netconf->udp_fds[i] >= 0) start_worker_udp(&data, netconf->udp_fds[i]);
             break;
         }
     }
 
-    // Wait for everybody to be registered
+    // Wait for everybody to be registered, then
+    // for the workers to be grouped by node
+    barrier_wait(&netconf->thread_barrier);
     barrier_wait(&netconf->thread_barrier);
 
-    // Run the event loop
+    /*
+     * Run the event loop. With busy_poll, we poll without
+     * blocking until there have been no events for that
+     * long, trading a core for the wake up latency.
+     */
+    uint64_t busy_ns = (uint64_t)netconf->config->busy_poll * 1000;
     while (data.should_run) {
-        ev_run(data.loop, EVRUN_ONCE);
+        int spin = busy_ns && data.wake_ns - data.event_ns < busy_ns;
+        ev_run(data.loop, (spin) ? EVRUN_NOWAIT : EVRUN_ONCE);
 
-        // Free inactive connections
-        conn_info *c=data.inactive;
+        // Free inactive connections. Parked ones are
+        // kept until they are resumed.
+        conn_info *c=data.inactive, *parked = NULL;
         while (c) {
             conn_info *n = c->next;
-            close_client_connection(c);
+            if (c->parked) {
+                c->next = parked;
+                parked = c;
+            } else
+                close_client_connection(c);
             c = n;
         }
-        data.inactive = NULL;
+        data.inactive = parked;
     }
 
     // Cleanup after exit
+    if (data.tcp_client.fd >= 0) {
+        ev_io_stop(data.loop, &data.tcp_client);
+        close(data.tcp_client.fd);
+    }
+    if (data.udp_client.fd >= 0) {
+        ev_io_stop(data.loop, &data.udp_client);
+        close(data.udp_client.fd);
+    }
+    free(data.udp);
+    while (data.free_conns) {
+        conn_info *c = data.free_conns;
+        data.free_conns = c->next;
+        count_output_bytes(-(int64_t)c->output.buf_size);
+        circbuf_free(&c->input);
+        circbuf_free(&c->output);
+        free(c);
+    }
+#ifdef HLLD_URING
+    if (data.ring) {
+        ev_io_stop(data.loop, &data.ring_client);
+        uring_free(data.ring);
+        free(data.ring);
+    }
+#endif
+    ev_idle_stop(data.loop, &data.turns);
+    ev_idle_stop(data.loop, &data.coalesce);
+    ev_timer_stop(data.loop, &data.balance);
+    ev_timer_stop(data.loop, &data.drain);
+    ev_check_stop(data.loop, &data.resume);
+    ev_prepare_stop(data.loop, &data.idle);
     ev_timer_stop(data.loop, &data.periodic);
     ev_io_stop(data.loop, &data.pipe_client);
     close(data.pipefd[0]);
@@ -647,12 +2984,154 @@ void start_networking_worker(hlld_networking *netconf) {
 
 
 /**
- * Entry point for the main thread to start accepting
+ * Invoked when the metrics endpoint has a new client.
+ * The client is read until its request is complete.
+ */
+static void handle_new_http_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    hlld_networking *netconf = ev_userdata(lp);
+    int client_fd = accept_client(watcher->fd, 0);
+    if (client_fd < 0) return;
+
+    http_conn *conn = calloc(1, sizeof(http_conn));
+    if (!conn) {
+        close(client_fd);
+        return;
+    }
+    conn->netconf = netconf;
+    ev_io_init(&conn->watcher, handle_http_read, client_fd, EV_READ);
+    ev_io_start(lp, &conn->watcher);
+    ev_timer_init(&conn->timeout, handle_http_timeout, HTTP_TIMEOUT_SEC, 0);
+    ev_timer_start(lp, &conn->timeout);
+    conn->watcher.data = conn;
+    conn->timeout.data = conn;
+}
+
+
+/**
+ * Invoked when a client of the metrics endpoint is readable.
+ * Once the headers are in, a GET of /metrics is answered with
+ * the metrics, and anything else with a 404.
+ */
+static void handle_http_read(ev_loop *lp, ev_io *watcher, int ready_events) {
+    http_conn *conn = watcher->data;
+    int space = HTTP_REQUEST_SIZE - 1 - conn->request_len;
+    ssize_t read_bytes = recv(watcher->fd, conn->request + conn->request_len, space, 0);
+    if (read_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (read_bytes <= 0) {
+        close_http_conn(conn);
+        return;
+    }
+    conn->request_len += read_bytes;
+    conn->request[conn->request_len] = '\0';
+
+    // Wait for the end of the headers, unless we are full
+    if (!strstr(conn->request, "\r\n\r\n") && !strstr(conn->request, "\n\n")) {
+        if (conn->request_len < HTTP_REQUEST_SIZE - 1) return;
+        close_http_conn(conn);
+        return;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    const char *status = "404 Not Found";
+    if (!strncmp(conn->request, "GET /metrics ", 13) ||
+            !strncmp(conn->request, "GET /metrics?", 13)) {
+        if (format_prometheus(conn->netconf->metrics, conn->netconf->mgr, &body, &body_len)) {
+            status = "500 Internal Server Error";
+            body = NULL;
+            body_len = 0;
+        } else
+            status = "200 OK";
+    }
+
+    int res = asprintf(&conn->response, "HTTP/1.1 %s\r\n\
+Content-Type: text/plain; version=0.0.4\r\n\
+Content-Length: %llu\r\n\
+Connection: close\r\n\r\n\
+%s", status, (unsigned long long)body_len, (body) ? body : "");
+    free(body);
+    if (res == -1) {
+        conn->response = NULL;
+        close_http_conn(conn);
+        return;
+    }
+    conn->response_len = res;
+
+    // Write out the response
+    ev_io_stop(lp, watcher);
+    ev_io_set(watcher, watcher->fd, EV_WRITE);
+    ev_set_cb(watcher, handle_http_write);
+    ev_io_start(lp, watcher);
+    handle_http_write(lp, watcher, EV_WRITE);
+}
+
+
+/**
+ * Invoked when a client of the metrics endpoint is writable.
+ * The connection is closed once the response is sent.
+ */
+static void handle_http_write(ev_loop *lp, ev_io *watcher, int ready_events) {
+    http_conn *conn = watcher->data;
+    while (conn->sent < conn->response_len) {
+        ssize_t sent = send(watcher->fd, conn->response + conn->sent,
+                conn->response_len - conn->sent, 0);
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        conn->sent += sent;
+    }
+    close_http_conn(conn);
+}
+
+
+/**
+ * Invoked when a client of the metrics endpoint
+ * is too slow, to close it.
+ */
+static void handle_http_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    close_http_conn(t->data);
+}
+
+
+// Closes a client of the metrics endpoint
+static void close_http_conn(http_conn *conn) {
+    ev_loop *lp = conn->netconf->default_loop;
+    ev_io_stop(lp, &conn->watcher);
+    ev_timer_stop(lp, &conn->timeout);
+    close(conn->watcher.fd);
+    free(conn->response);
+    free(conn);
+}
+
+
+/**
+ * Invoked periodically on the main thread to snapshot the
+ * stats of the sets for the metrics endpoint. We only hold
+ * on to the manager while walking the sets.
+ */
+static void handle_stats_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    hlld_networking *netconf = ev_userdata(lp);
+    setmgr_client_checkpoint(netconf->mgr);
+    setmgr_refresh_set_stats(netconf->mgr);
+    setmgr_client_idle(netconf->mgr);
+}
+
+
+/**
+ * Entry point for the main thread to start accepting. Returns
+ * once should_run is cleared or should_reload is set, and may
+ * be entered again to carry on.
  * @arg netconf The configuration for the networking stack.
  * @arg should_run A flag checked to see if we should run
+ * @arg should_reload A flag checked to see if we should return to reload
  * @arg threads The list of worker threads
  */
-void enter_main_loop(hlld_networking *netconf, int *should_run, pthread_t *threads) {
+void enter_main_loop(hlld_networking *netconf, int *should_run, int *should_reload,
+        pthread_t *threads) {
+    // The workers are started on the first entry only
+    if (netconf->threads) goto RUN;
+
     // Store a reference to the threads
     netconf->threads = threads;
 
@@ -662,16 +3141,64 @@ void enter_main_loop(hlld_networking *netconf, int *should_run, pthread_t *threa
     // Syncronize now that netconf->threads are ready
     barrier_wait(&netconf->thread_barrier);
 
-    // Syncronize until threads are registered
+    // Syncronize until threads are registered, and
+    // group them by node before they start
+    barrier_wait(&netconf->thread_barrier);
+    if (netconf->config->set_affinity == SET_AFFINITY_NODE) group_route_nodes(netconf);
     barrier_wait(&netconf->thread_barrier);
 
     // Run forever
-    while (*should_run) {
+RUN:
+    while (*should_run && !*should_reload) {
         ev_run(netconf->default_loop, EVRUN_ONCE);
     }
 }
 
 
+/**
+ * Changes the number of workers taking clients, up to the
+ * max_workers started. Workers are added or stood by from
+ * the last, and those that stand by move their connections
+ * to the others, but keep running, idle.
+ * Must be invoked on the main thread.
+ * @arg netconf The configuration for the networking stack.
+ * @arg workers The number of workers to take clients
+ * @return 0 on success, -1 if the workers can not change.
+ */
+int scale_networking(hlld_networking *netconf, int workers) {
+    hlld_config *config = netconf->config;
+    int active = netconf->num_active;
+    if (workers == active) return 0;
+    if (workers < 1 || workers > netconf->num_slots) {
+        syslog(LOG_ERR, "Cannot run %d workers, max_workers is %d!", workers, netconf->num_slots);
+        return -1;
+    }
+    if (config->set_affinity != SET_AFFINITY_OFF) {
+        syslog(LOG_ERR, "Cannot change the workers with a set_affinity!");
+        return -1;
+    }
+    if (config->reserved_workers && workers <= config->reserved_workers) {
+        syslog(LOG_ERR, "Cannot run %d workers, with %d reserved!", workers,
+                config->reserved_workers);
+        return -1;
+    }
+
+    // New clients go to the workers once they are active,
+    // and stop going to the others before they stand by
+    if (workers > active) {
+        for (int i=active; i < workers; i++) notify_worker(netconf->workers[i], 'u', NULL);
+        __sync_synchronize();
+        netconf->num_active = workers;
+    } else {
+        netconf->num_active = workers;
+        __sync_synchronize();
+        for (int i=workers; i < active; i++) notify_worker(netconf->workers[i], 'd', NULL);
+    }
+    syslog(LOG_INFO, "Changed the workers taking clients from %d to %d.", active, workers);
+    return 0;
+}
+
+
 /**
  * Shuts down all the connections
  * and listeners and prepares to exit.
@@ -679,20 +3206,37 @@ void enter_main_loop(hlld_networking *netconf, int *should_run, pthread_t *threa
  * @arg threads A list of worker threads
  */
 int shutdown_networking(hlld_networking *netconf, pthread_t *threads) {
-    // Stop listening for new connections
-    ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-    ev_io_stop(netconf->default_loop, &netconf->udp_client);
-    close(netconf->tcp_client.fd);
-    close(netconf->udp_client.fd);
+    // Stop listening for new connections. Workers close
+    // their own listeners with reuseport, and UDP sockets.
+    if (!netconf->listen_fds) {
+        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
+        close(netconf->tcp_client.fd);
+    }
+    close_unix_listener(netconf);
+    if (netconf->http_client.fd >= 0) {
+        ev_io_stop(netconf->default_loop, &netconf->http_client);
+        close(netconf->http_client.fd);
+    }
+    ev_timer_stop(netconf->default_loop, &netconf->stats_timer);
+    setmgr_client_leave(netconf->mgr);
+
+    // Stop routing commands, and let the routed ones finish
+    // while every worker is still running
+    netconf->routing_stopped = 1;
+    __sync_synchronize();
+    while (netconf->routes_inflight) usleep(1000);
+
+    // Likewise hand back the batches of the execution threads
+    stop_exec_threads(netconf);
 
     // Tell the threads to quit, async signal
-    for (int i=0; i < netconf->config->worker_threads; i++) {
+    for (int i=0; i < netconf->num_slots; i++) {
         write(netconf->workers[i]->pipefd[1], "q", 1);
     }
 
     // Wait for the threads to return
     pthread_t thread;
-    for (int i=0; i < netconf->config->worker_threads; i++) {
+    for (int i=0; i < netconf->num_slots; i++) {
         thread = threads[i];
         if (thread) pthread_join(thread, NULL);
     }
@@ -705,7 +3249,14 @@ int shutdown_networking(hlld_networking *netconf, pthread_t *threads) {
     ev_loop_destroy(netconf->default_loop);
 
     // Free the netconf
+    if (netconf->listen_fds) free(netconf->listen_fds);
+    free(netconf->udp_fds);
     free(netconf->workers);
+    free(netconf->route_start);
+    free(netconf->route_workers);
+    destroy_slowlog(netconf->slowlog);
+    destroy_remote(netconf->remote);
+    destroy_cluster(netconf->cluster);
     free(netconf);
     return 0;
 }
@@ -724,17 +3275,64 @@ int shutdown_networking(hlld_networking *netconf, pthread_t *threads) {
  * @arg conn The connection to close
  */
 static void close_client_connection(conn_info *conn) {
+#ifdef HLLD_URING
+    // Wait for the requests in flight, which end once
+    // the socket is shut down and the recv cancelled
+    if (conn->recv_armed || conn->sending) {
+        if (!conn->closing) {
+            conn->closing = 1;
+            shutdown(conn->client.fd, SHUT_RDWR);
+            stop_client_reads(conn);
+        }
+        return;
+    }
+    conn->closing = 0;
+#endif
+
     // Stop the libev clients
     ev_io_stop(conn->thread_ev->loop, &conn->client);
     ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    ev_timer_stop(conn->thread_ev->loop, &conn->idle_timer);
+    ev_timer_stop(conn->thread_ev->loop, &conn->watch_timer);
+    ev_timer_stop(conn->thread_ev->loop, &conn->rate_timer);
+    unlink_served(conn);
 
     // Clear everything out
-    circbuf_free(&conn->input);
-    circbuf_free(&conn->output);
+    if (conn->parked_cmd) free(conn->parked_cmd);
+    conn->parked_cmd = NULL;
+    if (conn->handler_state) close_client_handler(conn->handler_state);
+    conn->handler_state = NULL;
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
+    TRACE1(conn_close, conn->client.fd);
     close(conn->client.fd);
+    conn->thread_ev->metrics->conns_closed++;
+
+    if (conn->throttled) set_throttled(conn, 0);
+    if (conn->yielded) unlink_yielded(conn);
+    if (conn->thread_ev->hot == conn) {
+        conn->thread_ev->hot = NULL;
+        conn->thread_ev->hot_ns = 0;
+    }
+
+    // Keep the connection for reuse, along with any
+    // buffers that are still the initial size
+    worker_ev_userdata *data = conn->thread_ev;
+    if (data->num_free_conns < MAX_FREE_CONNS) {
+        if (conn->input.buf_size != INIT_CONN_BUF_SIZE) circbuf_free(&conn->input);
+        if (conn->output.buf_size != INIT_CONN_BUF_SIZE) {
+            count_output_bytes(-(int64_t)conn->output.buf_size);
+            circbuf_free(&conn->output);
+        }
+        conn->next = data->free_conns;
+        data->free_conns = conn;
+        data->num_free_conns++;
+        return;
+    }
+    count_output_bytes(-(int64_t)conn->output.buf_size);
+    circbuf_free(&conn->input);
+    circbuf_free(&conn->output);
     free(conn);
 }
 
@@ -759,15 +3357,16 @@ static void deactivate_client_connection(conn_info *conn) {
  */
 int send_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
     // Silently bail of the connection is not active
-    if (!conn->active) return 0;
+    if (!conn || !conn->active) return 0;
 
     int send_bufs, res = 0;
     for (int offset=0; offset < num_bufs && res == 0; offset += IOV_MAX) {
         // Determine how many buffers to send
         send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
 
-        // Check if we are doing buffered writes
-        if (conn->use_write_buf) {
+        // Check if we are doing buffered writes. With
+        // io_uring, every write is of the output buffer.
+        if (conn->use_write_buf || conn->corked || CONN_URING(conn)) {
             res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
         } else {
             res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
@@ -776,6 +3375,7 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
 
     // Disable the connection on error
     if (res) deactivate_client_connection(conn);
+    else if (CONN_URING(conn) && !conn->corked) flush_client_output(conn);
     return res;
 }
 
@@ -784,7 +3384,7 @@ static int send_client_response_buffered(conn_info *conn, char **response_buffer
     // Copy the buffers to the output buffer
     int res = 0;
     for (int i=0; i< num_bufs; i++) {
-        res = circbuf_write(&conn->output, response_buffers[i], buf_sizes[i]);
+        res = write_client_output(conn, response_buffers[i], buf_sizes[i]);
         if (res) break;
     }
     return res;
@@ -805,6 +3405,7 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 
     // Perform the write
     ssize_t sent = writev(conn->client.fd, vectors, num_bufs);
+    if (sent > 0) conn->thread_ev->metrics->bytes_out += sent;
     if (sent == total_bytes) return 0;
 
     // Check for a fatal error
@@ -834,7 +3435,7 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
         if (i == index && skip_bytes < sent) {
             offset = sent - skip_bytes;
         }
-        res = circbuf_write(&conn->output, response_buffers[i] + offset, buf_sizes[i] - offset);
+        res = write_client_output(conn, response_buffers[i] + offset, buf_sizes[i] - offset);
         if (res) return 1;
     }
 
@@ -847,6 +3448,36 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 }
 
 
+/**
+ * Appends to the output buffer of a connection, and
+ * counts the memory if the buffer grows.
+ * @return 0 on success.
+ */
+static int write_client_output(conn_info *conn, char *in, uint64_t bytes) {
+    uint32_t old_size = conn->output.buf_size;
+    int res = circbuf_write(&conn->output, in, bytes);
+    if (conn->output.buf_size != old_size)
+        count_output_bytes((int64_t)conn->output.buf_size - old_size);
+    return res;
+}
+
+
+// Adjusts the bytes held by the output buffers
+static void count_output_bytes(int64_t delta) {
+    __sync_add_and_fetch(&OUTPUT_BUF_BYTES, (uint64_t)delta);
+}
+
+
+// Marks a connection as throttled or not, and counts it
+static void set_throttled(conn_info *conn, int throttled) {
+    conn->throttled = throttled;
+    if (throttled)
+        __sync_add_and_fetch(&THROTTLED_CONNS, 1);
+    else
+        __sync_sub_and_fetch(&THROTTLED_CONNS, 1);
+}
+
+
 /**
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
@@ -863,9 +3494,34 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
  * @return 0 on success, -1 if the terminator is not found.
  */
 int extract_to_terminator(hlld_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
+    // A resumed command is handled before the buffered input
+    if (conn->parked_cmd) {
+        *buf = conn->parked_cmd;
+        *buf_len = conn->parked_len;
+        *should_free = 1;
+        conn->parked_cmd = NULL;
+        return 0;
+    }
+
     // First we need to find the terminator...
     char *term_addr = NULL;
-    if (conn->input.write_cursor < conn->input.read_cursor) {
+    if (conn->input.mirrored) {
+        /*
+         * The data continues past the end of a mirrored buffer,
+         * so even wrapped commands are returned in place.
+         */
+        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
+                           terminator,
+                           circbuf_used_buf(&conn->input));
+        if (term_addr) {
+            *buf = conn->input.buffer + conn->input.read_cursor;
+            *buf_len = term_addr - *buf + 1;
+            *term_addr = '\0';
+            *should_free = 0;
+            conn->input.read_cursor = (term_addr - conn->input.buffer + 1) % conn->input.buf_size;
+        }
+
+    } else if (conn->input.write_cursor < conn->input.read_cursor) {
         /*
          * We need to scan from the read cursor to the end of
          * the buffer, and then from the start of the buffer to
@@ -943,11 +3599,304 @@ int extract_to_terminator(hlld_conn_info *conn, char terminator, char **buf, int
 }
 
 
+/**
+ * Copies bytes from the start of the input, without
+ * consuming them. A parked command is seen first, as
+ * with extract_to_terminator.
+ * @arg conn The client connection
+ * @arg out The buffer to copy into
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer bytes are buffered.
+ */
+int peek_client_bytes(hlld_conn_info *conn, char *out, int len) {
+    if (conn->parked_cmd) {
+        if (conn->parked_len < len) return -1;
+        memcpy(out, conn->parked_cmd, len);
+        return 0;
+    }
+    if (circbuf_used_buf(&conn->input) < (uint64_t)len) return -1;
+
+    // Copy up to the end of the buffer, then from the start
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (end_size > len || conn->input.mirrored) end_size = len;
+    memcpy(out, conn->input.buffer + conn->input.read_cursor, end_size);
+    memcpy(out + end_size, conn->input.buffer, len - end_size);
+    return 0;
+}
+
+/**
+ * Extracts a number of bytes from the input, for commands
+ * that carry their length. Like extract_to_terminator,
+ * a parked command is returned first and whole, and the
+ * bytes are consumed.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer bytes are buffered.
+ */
+int extract_client_bytes(hlld_conn_info *conn, int len, char **buf, int *should_free) {
+    if (conn->parked_cmd) {
+        *buf = conn->parked_cmd;
+        *should_free = 1;
+        conn->parked_cmd = NULL;
+        return 0;
+    }
+    if (circbuf_used_buf(&conn->input) < (uint64_t)len) return -1;
+
+    // Use the buffer in place unless the bytes wrap around
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (end_size >= len || conn->input.mirrored) {
+        *buf = conn->input.buffer + conn->input.read_cursor;
+        *should_free = 0;
+    } else {
+        *buf = malloc(len);
+        if (!*buf) return -1;
+        memcpy(*buf, conn->input.buffer + conn->input.read_cursor, end_size);
+        memcpy(*buf + end_size, conn->input.buffer, len - end_size);
+        *should_free = 1;
+    }
+    circbuf_advance_read(&conn->input, len);
+    return 0;
+}
+
+
+/**
+ * Parks a command until the connection is resumed. Reads
+ * stop until then, and the handler should not consume more
+ * input. On resume, the command is returned again by
+ * extract_to_terminator before the buffered input.
+ * @arg conn The client connection
+ * @arg cmd The command, as returned by extract_to_terminator,
+ * or NULL to only park the connection
+ * @arg cmd_len The length of the command
+ * @return 0 on success.
+ */
+int park_client_command(hlld_conn_info *conn, char *cmd, int cmd_len) {
+    if (cmd) {
+        char *copy = malloc(cmd_len);
+        if (!copy) return -1;
+        memcpy(copy, cmd, cmd_len);
+        conn->parked_cmd = copy;
+        conn->parked_len = cmd_len;
+    }
+    conn->parked = 1;
+    stop_client_reads(conn);
+    return 0;
+}
+
+/**
+ * Returns the flags the connection handlers keep for a
+ * connection, which start zeroed.
+ * @arg conn The client connection
+ * @return The flags
+ */
+int* client_handler_flags(hlld_conn_info *conn) {
+    return &conn->handler_flags;
+}
+
+/**
+ * Returns the state the connection handlers keep for a
+ * connection, which starts NULL. It is released with
+ * close_client_handler when the connection closes.
+ * @arg conn The client connection
+ * @return The state
+ */
+void** client_handler_state(hlld_conn_info *conn) {
+    return &conn->handler_state;
+}
+
+/**
+ * Starts or stops invoking handle_client_watch for a
+ * connection. The watches move with the connection.
+ * Must be invoked on the worker thread.
+ * @arg conn The client connection
+ * @arg interval Seconds between the invocations, or 0 to stop
+ */
+void watch_client_connection(hlld_conn_info *conn, double interval) {
+    ev_loop *loop = conn->thread_ev->loop;
+    if (interval <= 0.) {
+        ev_timer_stop(loop, &conn->watch_timer);
+        conn->watch_timer.repeat = 0.;
+        return;
+    }
+    if (ev_is_active(&conn->watch_timer) && conn->watch_timer.repeat == interval) return;
+    ev_timer_stop(loop, &conn->watch_timer);
+    ev_timer_set(&conn->watch_timer, interval, interval);
+    ev_timer_start(loop, &conn->watch_timer);
+}
+
+/**
+ * Checks if the handlers should stop handling the commands
+ * of a connection, because too much output waits on it. The
+ * connection stops reading, and is handled again once the
+ * output drains.
+ * @arg conn The client connection
+ * @return 1 if the output is full, 0 otherwise.
+ */
+int client_output_full(hlld_conn_info *conn) {
+    if (conn->throttled) return 1;
+    if (circbuf_used_buf(&conn->output) <= OUTPUT_HIGH_WATERMARK) return 0;
+    set_throttled(conn, 1);
+    return 1;
+}
+
+/**
+ * Checks if a connection has had its turn of the worker, and
+ * otherwise counts a command against it. A turn is the commands
+ * and input handled in one pass of the event loop. The rest of
+ * the input is handled on the next pass, after the other clients
+ * of the worker. Reads stop until then.
+ * @arg conn The client connection
+ * @return 1 if the turn is over, 0 otherwise.
+ */
+int client_turn_over(hlld_conn_info *conn) {
+    if (conn->yielded) return 1;
+
+    // The first command of a turn is always handled
+    hlld_config *config = conn->thread_ev->netconf->config;
+    int64_t consumed = conn->turn_bytes + conn->turn_input - (int64_t)circbuf_used_buf(&conn->input);
+    if (!conn->turn_cmds ||
+            ((!config->conn_turn_cmds || conn->turn_cmds < config->conn_turn_cmds) &&
+            (!config->conn_turn_kb || consumed < (int64_t)config->conn_turn_kb << 10))) {
+        conn->turn_cmds++;
+        return 0;
+    }
+
+    // Queue for the next pass, which does not block for events
+    worker_ev_userdata *data = conn->thread_ev;
+    conn->yielded = 1;
+    conn->next_yielded = NULL;
+    if (data->yielded_tail)
+        data->yielded_tail->next_yielded = conn;
+    else
+        data->yielded_head = conn;
+    data->yielded_tail = conn;
+    if (!ev_is_active(&data->turns)) ev_idle_start(data->loop, &data->turns);
+    stop_client_reads(conn);
+    data->metrics->turns_yielded++;
+    return 1;
+}
+
+/**
+ * Checks if a connection is out of the commands or input its
+ * rate limits allow for now, and otherwise counts a command
+ * against it. Reads stop until the buckets have refilled.
+ * @arg conn The client connection
+ * @return 1 if the connection must wait, 0 otherwise.
+ */
+int client_rate_limited(hlld_conn_info *conn) {
+    if (!conn->cmds_per_sec && !conn->bytes_per_sec) return 0;
+    worker_ev_userdata *data = conn->thread_ev;
+    if (conn->rate_limited) {
+        stop_client_reads(conn);
+        return 1;
+    }
+
+    // Refill the buckets for the time since the last command
+    ev_tstamp now = ev_now(data->loop);
+    double elapsed = now - conn->rate_stamp;
+    conn->rate_stamp = now;
+    if (conn->cmds_per_sec) {
+        conn->cmd_tokens += elapsed * conn->cmds_per_sec;
+        if (conn->cmd_tokens > conn->cmds_per_sec) conn->cmd_tokens = conn->cmds_per_sec;
+    }
+    if (conn->bytes_per_sec) {
+        conn->byte_tokens += elapsed * conn->bytes_per_sec;
+        if (conn->byte_tokens > conn->bytes_per_sec) conn->byte_tokens = conn->bytes_per_sec;
+    }
+
+    // Input is charged as it is read, so it may be owed
+    int cmds_ok = !conn->cmds_per_sec || conn->cmd_tokens >= 1;
+    int bytes_ok = !conn->bytes_per_sec || conn->byte_tokens >= 0;
+    if (cmds_ok && bytes_ok) {
+        conn->cmd_tokens -= 1;
+        return 0;
+    }
+
+    // Wait until both buckets allow another command
+    double wait = 0;
+    if (!cmds_ok) wait = (1 - conn->cmd_tokens) / conn->cmds_per_sec;
+    if (!bytes_ok && -conn->byte_tokens / conn->bytes_per_sec > wait)
+        wait = -conn->byte_tokens / conn->bytes_per_sec;
+    conn->rate_limited = 1;
+    stop_client_reads(conn);
+    ev_timer_set(&conn->rate_timer, wait, 0.);
+    ev_timer_start(data->loop, &conn->rate_timer);
+    data->metrics->rate_limited++;
+    return 1;
+}
+
+/**
+ * Invoked once a rate limited connection may send again.
+ * Handles the input left, then reads again.
+ */
+static void handle_conn_rate(ev_loop *lp, ev_timer *t, int ready_events) {
+    (void)ready_events;
+    conn_info *conn = t->data;
+    conn->rate_limited = 0;
+    if (!conn->active) return;
+
+    // Parked and throttled connections are resumed on their own
+    if (conn->parked || conn->throttled) return;
+    start_client_reads(conn);
+    run_client_handler(ev_userdata(lp), conn);
+}
+
+/**
+ * Removes a closed connection from the yielded connections
+ * of its worker.
+ */
+static void unlink_yielded(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    conn_info *prev = NULL;
+    for (conn_info *c = data->yielded_head; c; prev = c, c = c->next_yielded) {
+        if (c != conn) continue;
+        if (prev) prev->next_yielded = c->next_yielded;
+        else data->yielded_head = c->next_yielded;
+        if (data->yielded_tail == c) data->yielded_tail = prev;
+        break;
+    }
+    conn->yielded = 0;
+    conn->next_yielded = NULL;
+}
+
+/**
+ * Returns the bytes held by the output buffers of
+ * all the connections.
+ * @notes Thread safe.
+ */
+uint64_t output_buffer_bytes(void) {
+    return OUTPUT_BUF_BYTES;
+}
+
+/**
+ * Returns the number of connections which are not
+ * read because their output has not drained.
+ * @notes Thread safe.
+ */
+uint64_t throttled_connections(void) {
+    return THROTTLED_CONNS;
+}
+
+/**
+ * Resumes a parked connection on its worker thread.
+ * @notes Thread safe.
+ * @arg conn The client connection
+ */
+void resume_client_connection(hlld_conn_info *conn) {
+    notify_worker(conn->thread_ev, 'r', conn);
+}
+
+
 /**
  * Sets the client socket options.
+ * @arg client_fd The client socket
+ * @arg tcp Is this a TCP socket, rather than a unix socket
+ * @arg busy_poll The usec the socket busy polls on reads, or 0
  * @return 0 on success, 1 on error.
  */
-static int set_client_sockopts(int client_fd) {
+static int set_client_sockopts(int client_fd, int tcp, int busy_poll) {
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
@@ -966,6 +3915,7 @@ static int set_client_sockopts(int client_fd) {
      * quickly, since our responses are rarely large enough to consume a packet.
      */
     int flag = 1;
+    if (!tcp) return 0;
     if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int))) {
         syslog(LOG_WARNING, "Failed to set TCP_NODELAY on connection! %s.", strerror(errno));
     }
@@ -975,28 +3925,90 @@ static int set_client_sockopts(int client_fd) {
         syslog(LOG_WARNING, "Failed to set SO_KEEPALIVE on connection! %s.", strerror(errno));
     }
 
+#ifdef SO_BUSY_POLL
+    /*
+     * Reads poll the device queue rather than waiting on its interrupt.
+     * Going above net.core.busy_read needs CAP_NET_ADMIN.
+     */
+    if (busy_poll && setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(int))) {
+        syslog(LOG_DEBUG, "Failed to set SO_BUSY_POLL on connection! %s.", strerror(errno));
+    }
+#else
+    (void)busy_poll;
+#endif
+
     return 0;
 }
 
 
 /**
- * Returns a new conn_info struct
+ * Returns a conn_info struct for a new connection on a
+ * worker, reusing one that was closed if possible
  */
-static conn_info* get_conn() {
-    // Allocate space
-    conn_info *conn = malloc(sizeof(conn_info));
+static conn_info* get_conn(worker_ev_userdata *data) {
+    conn_info *conn = data->free_conns;
+    if (conn) {
+        data->free_conns = conn->next;
+        data->num_free_conns--;
+    } else {
+        // Allocate space
+        conn = malloc(sizeof(conn_info));
+        conn->input.buffer = NULL;
+        conn->output.buffer = NULL;
+    }
+    conn->thread_ev = data;
 
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
-
-    // Prepare the buffers
-    circbuf_init(&conn->input);
-    circbuf_init(&conn->output);
+    conn->corked = 0;
+    conn->throttled = 0;
+    conn->handler_flags = 0;
+    conn->handler_state = NULL;
+    conn->yielded = 0;
+    conn->turn_iter = 0;
+    conn->turn_cmds = 0;
+    conn->turn_bytes = 0;
+    conn->turn_input = 0;
+    conn->next_yielded = NULL;
+    conn->busy_epoch = data->balance_epoch;
+    conn->busy_ns = 0;
+    conn->migrate_to = NULL;
+    conn->served_prev = conn->served_next = NULL;
+    conn->cmds_per_sec = 0;
+    conn->bytes_per_sec = 0;
+    conn->cmd_tokens = conn->byte_tokens = 0;
+    conn->rate_stamp = 0;
+    conn->rate_limited = 0;
+    conn->parked = 0;
+    conn->parked_cmd = NULL;
+    conn->parked_len = 0;
+    conn->recv_armed = 0;
+    conn->reads_wanted = 0;
+    conn->sending = 0;
+    conn->closing = 0;
+
+    // Prepare the buffers, unless they are reused
+    if (conn->input.buffer)
+        conn->input.read_cursor = conn->input.write_cursor = 0;
+    else
+        circbuf_init(&conn->input, 1);
+    if (conn->output.buffer) {
+        conn->output.read_cursor = conn->output.write_cursor = 0;
+    } else {
+        circbuf_init(&conn->output, 0);
+        count_output_bytes(conn->output.buf_size);
+    }
 
     // Store a reference to the conn object
     conn->client.data = conn;
     conn->write_client.data = conn;
+    ev_timer_init(&conn->idle_timer, handle_conn_idle, CONN_BUF_IDLE_SHRINK, 0.);
+    conn->idle_timer.data = conn;
+    ev_timer_init(&conn->watch_timer, handle_conn_watch, 0., 0.);
+    conn->watch_timer.data = conn;
+    ev_timer_init(&conn->rate_timer, handle_conn_rate, 0., 0.);
+    conn->rate_timer.data = conn;
 
     return conn;
 }
@@ -1005,20 +4017,69 @@ static conn_info* get_conn() {
  * Methods for manipulating our circular buffers
  */
 
-// Conditionally allocates if there is no buffer
-static void circbuf_init(circular_buffer *buf) {
+// Conditionally allocates if there is no buffer. Input buffers
+// are mirrored if possible, so commands can be parsed in place.
+static void circbuf_init(circular_buffer *buf, int mirrored) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
     buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
-    buf->buffer = malloc(buf->buf_size);
+    buf->mirrored = mirrored;
+    buf->pinned = 0;
+    buf->retired = NULL;
+    buf->buffer = circbuf_alloc(buf->buf_size, &buf->mirrored);
 }
 
 // Frees a buffer
 static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
+    if (buf->buffer) circbuf_release(buf->buffer, buf->buf_size, buf->mirrored);
     buf->buffer = NULL;
 }
 
+/**
+ * Allocates the memory of a buffer. A mirrored buffer maps
+ * the same pages again right after the end, so that the bytes
+ * past the end read and write those at the start. This needs
+ * memfd_create, and a size that is a multiple of the page size.
+ * @arg size The size of the buffer
+ * @arg mirrored Should the buffer be mirrored. Cleared if
+ * a plain allocation was made instead.
+ * @return The buffer
+ */
+static char* circbuf_alloc(uint32_t size, int *mirrored) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    if (*mirrored && size % sysconf(_SC_PAGESIZE) == 0) {
+        char *buffer = NULL;
+        int fd = memfd_create("hlld-conn", MFD_CLOEXEC);
+        if (fd >= 0 && !ftruncate(fd, size)) {
+            // Reserve both halves, then map the pages over each
+            buffer = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED) {
+                buffer = NULL;
+            } else if (mmap(buffer, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                    mmap(buffer + size, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                munmap(buffer, 2 * (size_t)size);
+                buffer = NULL;
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (buffer) return buffer;
+        syslog(LOG_WARNING, "Failed to map a mirrored buffer! %s.", strerror(errno));
+    }
+#endif
+    *mirrored = 0;
+    return malloc(size);
+}
+
+// Frees the memory of a buffer
+static void circbuf_release(char *buffer, uint32_t size, int mirrored) {
+    if (mirrored)
+        munmap(buffer, 2 * (size_t)size);
+    else
+        free(buffer);
+}
+
 // Calculates the available buffer size
 static uint64_t circbuf_avail_buf(circular_buffer *buf) {
     uint64_t avail_buf;
@@ -1030,10 +4091,33 @@ static uint64_t circbuf_avail_buf(circular_buffer *buf) {
     return avail_buf;
 }
 
-// Grows the circular buffer to make room for more data
-static void circbuf_grow_buf(circular_buffer *buf) {
-    int new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
-    char *new_buf = malloc(new_size);
+// Calculates the size of the buffered data
+static uint64_t circbuf_used_buf(circular_buffer *buf) {
+    if (buf->write_cursor < buf->read_cursor)
+        return buf->buf_size - buf->read_cursor + buf->write_cursor;
+    return buf->write_cursor - buf->read_cursor;
+}
+
+// Grows the circular buffer to make room for more data,
+// up to a maximum size. Data that does not wrap around is
+// grown in place when possible, as realloc can remap pages.
+// Returns 0 on success, or -1 if the buffer is at its maximum.
+static int circbuf_grow_buf(circular_buffer *buf, uint64_t max_size) {
+    uint64_t new_size = (uint64_t)buf->buf_size * CONN_BUF_MULTIPLIER;
+    if (new_size > max_size) new_size = max_size;
+    if (new_size <= buf->buf_size) return -1;
+
+    if (!buf->mirrored && !buf->pinned && buf->write_cursor >= buf->read_cursor) {
+        char *new_buf = realloc(buf->buffer, new_size);
+        if (!new_buf) return -1;
+        buf->buffer = new_buf;
+        buf->buf_size = new_size;
+        return 0;
+    }
+
+    int mirrored = buf->mirrored;
+    char *new_buf = circbuf_alloc(new_size, &mirrored);
+    if (!new_buf) return -1;
     int bytes_written = 0;
 
     // Check if the write has wrapped around
@@ -1059,12 +4143,18 @@ static void circbuf_grow_buf(circular_buffer *buf) {
                bytes_written);
     }
 
-    // Update the buffer locations and everything
-    free(buf->buffer);
+    // Update the buffer locations and everything. A pinned
+    // buffer is kept until the kernel is done sending from it.
+    if (buf->pinned && !buf->retired)
+        buf->retired = buf->buffer;
+    else
+        circbuf_release(buf->buffer, buf->buf_size, buf->mirrored);
     buf->buffer = new_buf;
     buf->buf_size = new_size;
+    buf->mirrored = mirrored;
     buf->read_cursor = 0;
     buf->write_cursor = bytes_written;
+    return 0;
 }
 
 
@@ -1127,7 +4217,10 @@ static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes) {
     // Check for available space
     uint64_t avail = circbuf_avail_buf(buf);
     while (avail < bytes) {
-        circbuf_grow_buf(buf);
+        if (circbuf_grow_buf(buf, MAX_OUTPUT_BUF_SIZE)) {
+            syslog(LOG_ERR, "Failed to grow output buffer of %u bytes!", buf->buf_size);
+            return -1;
+        }
         avail = circbuf_avail_buf(buf);
     }
 
@@ -2,6 +2,7 @@
 #define NETWORKING_H
 #include <pthread.h>
 #include "config.h"
+#include "metrics.h"
 
 // Network configuration struct
 typedef struct hlld_networking hlld_networking;
@@ -11,17 +12,22 @@ typedef struct conn_info hlld_conn_info;
  * Initializes the networking interfaces
  * @arg config Takes the server configuration
  * @arg mgr The manager to pass up to the connection handlers
+ * @arg metrics The metrics, with a slot for each worker
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(hlld_config *config, void *mgr, hlld_networking **netconf_out);
+int init_networking(hlld_config *config, void *mgr, hlld_metrics *metrics, hlld_networking **netconf_out);
 
 /**
- * Entry point for the main thread to start accepting
+ * Entry point for the main thread to start accepting. Returns
+ * once should_run is cleared or should_reload is set, and may
+ * be entered again to carry on.
  * @arg netconf The configuration for the networking stack.
  * @arg should_run A flag checked to see if we should run
+ * @arg should_reload A flag checked to see if we should return to reload
  * @arg threads The list of worker threads
  */
-void enter_main_loop(hlld_networking *netconf, int *should_run, pthread_t *threads);
+void enter_main_loop(hlld_networking *netconf, int *should_run, int *should_reload,
+        pthread_t *threads);
 
 /**
  * Entry point for threads to join the networking
@@ -31,6 +37,18 @@ void enter_main_loop(hlld_networking *netconf, int *should_run, pthread_t *threa
  */
 void start_networking_worker(hlld_networking *netconf);
 
+/**
+ * Changes the number of workers taking clients, up to the
+ * max_workers started. Workers are added or stood by from
+ * the last, and those that stand by move their connections
+ * to the others, but keep running, idle.
+ * Must be invoked on the main thread.
+ * @arg netconf The configuration for the networking stack.
+ * @arg workers The number of workers to take clients
+ * @return 0 on success, -1 if the workers can not change.
+ */
+int scale_networking(hlld_networking *netconf, int workers);
+
 /**
  * Shuts down all the connections
  * and listeners and prepares to exit.
@@ -71,4 +89,200 @@ int send_client_response(hlld_conn_info *conn, char **response_buffers, int *buf
  */
 int extract_to_terminator(hlld_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Copies bytes from the start of the input, without
+ * consuming them. A parked command is seen first, as
+ * with extract_to_terminator.
+ * @arg conn The client connection
+ * @arg out The buffer to copy into
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer bytes are buffered.
+ */
+int peek_client_bytes(hlld_conn_info *conn, char *out, int len);
+
+/**
+ * Extracts a number of bytes from the input, for commands
+ * that carry their length. Like extract_to_terminator,
+ * a parked command is returned first and whole, and the
+ * bytes are consumed.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer bytes are buffered.
+ */
+int extract_client_bytes(hlld_conn_info *conn, int len, char **buf, int *should_free);
+
+/**
+ * Parks a command until the connection is resumed. Reads
+ * stop until then, and the handler should not consume more
+ * input. On resume, the command is returned again by
+ * extract_to_terminator before the buffered input.
+ * @arg conn The client connection
+ * @arg cmd The command, as returned by extract_to_terminator,
+ * or NULL to only park the connection
+ * @arg cmd_len The length of the command
+ * @return 0 on success.
+ */
+int park_client_command(hlld_conn_info *conn, char *cmd, int cmd_len);
+
+/**
+ * Returns the flags the connection handlers keep for a
+ * connection, which start zeroed.
+ * @arg conn The client connection
+ * @return The flags
+ */
+int* client_handler_flags(hlld_conn_info *conn);
+
+/**
+ * Returns the state the connection handlers keep for a
+ * connection, which starts NULL. It is released with
+ * close_client_handler when the connection closes.
+ * @arg conn The client connection
+ * @return The state
+ */
+void** client_handler_state(hlld_conn_info *conn);
+
+/**
+ * Starts or stops invoking handle_client_watch for a
+ * connection. The watches move with the connection.
+ * Must be invoked on the worker thread.
+ * @arg conn The client connection
+ * @arg interval Seconds between the invocations, or 0 to stop
+ */
+void watch_client_connection(hlld_conn_info *conn, double interval);
+
+/**
+ * Checks if the handlers should stop handling the commands
+ * of a connection, because too much output waits on it. The
+ * connection stops reading, and is handled again once the
+ * output drains.
+ * @arg conn The client connection
+ * @return 1 if the output is full, 0 otherwise.
+ */
+int client_output_full(hlld_conn_info *conn);
+
+/**
+ * Checks if a connection has had its turn of the worker, and
+ * otherwise counts a command against it. A turn is the commands
+ * and input handled in one pass of the event loop. The rest of
+ * the input is handled on the next pass, after the other clients
+ * of the worker. Reads stop until then.
+ * @arg conn The client connection
+ * @return 1 if the turn is over, 0 otherwise.
+ */
+int client_turn_over(hlld_conn_info *conn);
+
+/**
+ * Checks if a connection is out of the commands or input its
+ * rate limits allow for now, and otherwise counts a command
+ * against it. Reads stop until the buckets have refilled.
+ * @arg conn The client connection
+ * @return 1 if the connection must wait, 0 otherwise.
+ */
+int client_rate_limited(hlld_conn_info *conn);
+
+/**
+ * Returns the bytes held by the output buffers of
+ * all the connections.
+ * @notes Thread safe.
+ */
+uint64_t output_buffer_bytes(void);
+
+/**
+ * Returns the number of connections which are not
+ * read because their output has not drained.
+ * @notes Thread safe.
+ */
+uint64_t throttled_connections(void);
+
+/**
+ * Resumes a parked connection on its worker thread.
+ * @notes Thread safe.
+ * @arg conn The client connection
+ */
+void resume_client_connection(hlld_conn_info *conn);
+
+/**
+ * The responses of a batch of writes run by an execution
+ * thread, which the worker of the connection sends
+ */
+typedef struct {
+    int flags;      // The handler flags of the connection
+    char *buf;
+    int len;
+    int size;
+    int failed;     // A response could not be kept
+} hlld_exec_output;
+
+/**
+ * A batch of writes of a connection, as gathered
+ * by the connection handlers, and their responses
+ */
+typedef struct {
+    char *cmds;
+    int cmds_len;
+    hlld_exec_output out;
+} hlld_exec_batch;
+
+/**
+ * Hands a batch of writes of a connection to an execution
+ * thread, picked by the set they write, so the writes of a
+ * set are run by one thread. Without the threads, and with
+ * coalesce_writes, the worker of the connection runs the
+ * batch on its next pass instead, along with the others of
+ * that pass. The connection is parked until the batch ran,
+ * and its responses are sent then.
+ * @arg conn The client connection
+ * @arg set_name The set the batch writes
+ * @arg cmds The batch, which is freed once it ran
+ * @arg cmds_len The length of the batch
+ * @return 0 if the batch was handed off, or -1 if
+ * the caller should run it.
+ */
+int exec_client_batch(hlld_conn_info *conn, char *set_name, char *cmds, int cmds_len);
+
+/**
+ * Appends a response to those of a batch. A response that
+ * cannot be kept fails the batch, closing its connection.
+ * @arg out The responses of the batch
+ * @arg response_buffers A list of response buffers
+ * @arg buf_sizes A list of the buffer sizes
+ * @arg num_bufs The number of response buffers
+ * @return 0 on success.
+ */
+int exec_output_append(hlld_exec_output *out, char **response_buffers, int *buf_sizes, int num_bufs);
+
+/**
+ * Returns the worker owning a set, if set_affinity is enabled
+ * @arg conn The connection of the command, or NULL
+ * @arg set_name The set
+ * @return The index of the owning worker, or -1 if
+ * the calling worker may write the set itself.
+ */
+int set_owner_worker(hlld_conn_info *conn, char *set_name);
+
+/**
+ * Runs a command on a worker, waiting for the command and
+ * running the commands routed to the calling worker meanwhile.
+ * @arg conn The connection of the command, or NULL to run it in place
+ * @arg worker The index of the worker, or -1 to run it in place
+ * @arg fn The command
+ * @arg arg Opaque argument to the command
+ */
+void run_on_worker(hlld_conn_info *conn, int worker, void (*fn)(void*), void *arg);
+
+/**
+ * Runs a command that writes a set on the worker owning the
+ * set, if set_affinity is enabled, so the registers of the set
+ * stay in the caches of one core or node. The command otherwise
+ * runs on the calling worker. Waits for the command, running
+ * the commands routed to the calling worker meanwhile.
+ * @arg conn The connection of the command, or NULL to run it in place
+ * @arg set_name The set the command writes
+ * @arg fn The command
+ * @arg arg Opaque argument to the command
+ */
+void run_on_set_owner(hlld_conn_info *conn, char *set_name, void (*fn)(void*), void *arg);
+
 #endif
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include "prometheus.h"
+#include "networking.h"
+#include "conn_handler.h"
+#include "alloc.h"
+#include "spinlock.h"
+
+/*
+ * The bounds of the histogram buckets we export, in seconds.
+ * Our own buckets are much finer, and are counted in the first
+ * bound that holds their largest value.
+ */
+static const double COMMAND_BOUNDS[] = {
+    1e-6, 2.5e-6, 1e-5, 2.5e-5, 1e-4, 2.5e-4,
+    1e-3, 2.5e-3, 1e-2, 2.5e-2, 0.1, 0.25, 1
+};
+static const double ROUND_BOUNDS[] = {
+    1e-3, 1e-2, 0.1, 0.5, 1, 5, 10, 30, 60
+};
+static const double SET_BOUNDS[] = {
+    1e-5, 1e-4, 1e-3, 1e-2, 0.1, 1, 10
+};
+
+/*
+ * The timed work of the background threads, by background_op
+ */
+static const char *BACKGROUND_METRICS[][2] = {
+    {"hlld_flush_duration_seconds", "Time spent on each round of flushes."},
+    {"hlld_set_flush_duration_seconds", "Time spent flushing each set in a round."},
+    {"hlld_unmap_duration_seconds", "Time spent on each round of unmapping sets."},
+    {"hlld_set_unmap_duration_seconds", "Time spent unmapping each set in a round."}
+};
+
+/*
+ * The metrics of each set. Samples of a metric must be
+ * written together, so the sets are visited once for each.
+ */
+static const char *SET_METRICS[][3] = {
+    {"hlld_set_resident_bytes", "gauge", "Bytes of a set resident in memory, as last sampled."},
+    {"hlld_set_page_ins_total", "counter", "Times a set was paged in."},
+    {"hlld_set_page_outs_total", "counter", "Times a set was paged out."},
+    {"hlld_set_adds_total", "counter", "Keys added to a set."},
+    {"hlld_set_flushes_total", "counter", "Times a dirty set was flushed."},
+    {"hlld_set_flush_seconds_total", "counter", "Time spent flushing a set."},
+    {"hlld_set_flushed_bytes_total", "counter", "Bytes of dense registers written by flushes."},
+    {"hlld_set_page_faults", "gauge", "Pages of a set faulted in between its last two samples."}
+};
+#define NUM_SET_METRICS (int)(sizeof(SET_METRICS) / sizeof(SET_METRICS[0]))
+
+// Sums of the per set counters, and the metric being written
+typedef struct {
+    FILE *f;
+    int metric;
+    uint64_t resident_bytes;
+    uint64_t page_ins;
+    uint64_t page_outs;
+} set_totals;
+
+static void write_header(FILE *f, const char *name, const char *type, const char *help);
+static void write_histogram(FILE *f, const char *name, const char *labels,
+        latency_histogram *h, const double *bounds, int num_bounds);
+static void write_label(FILE *f, const char *value);
+static void write_set_stats_cb(void *data, hlld_set_stats *stats);
+
+/**
+ * Formats the metrics of the server in the Prometheus
+ * text format. The sets are read from the last stats
+ * snapshot of the manager, and are not visited.
+ * @notes Thread safe.
+ * @arg metrics The server metrics
+ * @arg mgr The set manager
+ * @arg out Output, the text. Must be freed by the caller.
+ * @arg out_len Output, the length of the text
+ * @return 0 on success.
+ */
+int format_prometheus(hlld_metrics *metrics, hlld_setmgr *mgr, char **out, size_t *out_len) {
+    worker_metrics *m = malloc(sizeof(worker_metrics));
+    background_metrics *bg = malloc(sizeof(background_metrics));
+    FILE *f = open_memstream(out, out_len);
+    if (!m || !bg || !f) {
+        syslog(LOG_ERR, "Failed to allocate the metrics output!");
+        free(m);
+        free(bg);
+        if (f) {
+            fclose(f);
+            free(*out);
+        }
+        return -1;
+    }
+    metrics_snapshot(metrics, m);
+    metrics_background_snapshot(metrics, bg);
+
+    // Connections and traffic
+    write_header(f, "hlld_connections", "gauge", "Open client connections.");
+    fprintf(f, "hlld_connections %llu\n",
+            (unsigned long long)(m->conns_opened - m->conns_closed));
+    write_header(f, "hlld_connections_total", "counter", "Client connections accepted.");
+    fprintf(f, "hlld_connections_total %llu\n", (unsigned long long)m->conns_opened);
+    write_header(f, "hlld_read_bytes_total", "counter", "Bytes read from clients.");
+    fprintf(f, "hlld_read_bytes_total %llu\n", (unsigned long long)m->bytes_in);
+    write_header(f, "hlld_written_bytes_total", "counter", "Bytes written to clients.");
+    fprintf(f, "hlld_written_bytes_total %llu\n", (unsigned long long)m->bytes_out);
+    write_header(f, "hlld_output_buffer_bytes", "gauge", "Bytes held by the client output buffers.");
+    fprintf(f, "hlld_output_buffer_bytes %llu\n", (unsigned long long)output_buffer_bytes());
+    write_header(f, "hlld_throttled_connections", "gauge",
+            "Connections not read until their output drains.");
+    fprintf(f, "hlld_throttled_connections %llu\n", (unsigned long long)throttled_connections());
+    write_header(f, "hlld_yielded_turns_total", "counter",
+            "Turns that left input of a connection for a later loop pass.");
+    fprintf(f, "hlld_yielded_turns_total %llu\n", (unsigned long long)m->turns_yielded);
+    write_header(f, "hlld_rate_limited_total", "counter",
+            "Times a connection waited on its rate limits.");
+    fprintf(f, "hlld_rate_limited_total %llu\n", (unsigned long long)m->rate_limited);
+    write_header(f, "hlld_migrated_connections_total", "counter",
+            "Connections moved from a busy worker to another.");
+    fprintf(f, "hlld_migrated_connections_total %llu\n", (unsigned long long)m->conns_migrated);
+    write_header(f, "hlld_worker_busy_seconds_total", "counter",
+            "Time the workers spent handling events, rather than waiting.");
+    fprintf(f, "hlld_worker_busy_seconds_total %.9f\n", m->busy_ns / 1e9);
+    write_header(f, "hlld_exec_batches_total", "counter",
+            "Batches of writes run apart from their connection.");
+    fprintf(f, "hlld_exec_batches_total %llu\n", (unsigned long long)m->exec_batches);
+    write_header(f, "hlld_coalesced_batches_total", "counter",
+            "Batches of writes applied along with another batch of their set.");
+    fprintf(f, "hlld_coalesced_batches_total %llu\n", (unsigned long long)m->batches_coalesced);
+
+    // The allocator
+    alloc_counters alloc;
+    alloc_stats(&alloc);
+    write_header(f, "hlld_alloc_allocated_bytes", "gauge", "Bytes allocated and not yet freed.");
+    fprintf(f, "hlld_alloc_allocated_bytes{allocator=\"%s\"} %llu\n", alloc_name(),
+            (unsigned long long)alloc.allocated);
+    write_header(f, "hlld_alloc_mapped_bytes", "gauge", "Bytes the allocator holds from the kernel.");
+    fprintf(f, "hlld_alloc_mapped_bytes{allocator=\"%s\"} %llu\n", alloc_name(),
+            (unsigned long long)alloc.mapped);
+    write_header(f, "hlld_resident_memory_bytes", "gauge", "Bytes of the process resident in memory.");
+    fprintf(f, "hlld_resident_memory_bytes %llu\n", (unsigned long long)alloc.rss);
+
+    // Waits on the locks of the sets and the manager
+    spinlock_counters spin;
+    spinlock_stats(&spin);
+    write_header(f, "hlld_spin_contended_total", "counter", "Lock acquires that found the lock held.");
+    fprintf(f, "hlld_spin_contended_total %llu\n", (unsigned long long)spin.contended);
+    write_header(f, "hlld_spin_yields_total", "counter", "Timeslices yielded waiting on a lock.");
+    fprintf(f, "hlld_spin_yields_total %llu\n", (unsigned long long)spin.yields);
+    write_header(f, "hlld_spin_parks_total", "counter", "Waits on a lock parked in the kernel.");
+    fprintf(f, "hlld_spin_parks_total %llu\n", (unsigned long long)spin.parks);
+
+    // Latencies of the commands that were used
+    write_header(f, "hlld_command_duration_seconds", "histogram", "Time spent handling commands.");
+    const char *name;
+    for (int i=0; i < METRIC_CMDS && (name = handler_cmd_name(i)); i++) {
+        if (!m->cmds[i].count) continue;
+        char labels[64];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", name);
+        write_histogram(f, "hlld_command_duration_seconds", labels, m->cmds + i,
+                COMMAND_BOUNDS, sizeof(COMMAND_BOUNDS) / sizeof(double));
+    }
+
+    // The background threads, whose rounds are much slower than their sets
+    for (int i=0; i < NUM_BACKGROUND_OPS; i++) {
+        int round = (i == FLUSH_ROUND || i == UNMAP_ROUND);
+        write_header(f, BACKGROUND_METRICS[i][0], "histogram", BACKGROUND_METRICS[i][1]);
+        write_histogram(f, BACKGROUND_METRICS[i][0], NULL, bg->ops + i,
+                (round) ? ROUND_BOUNDS : SET_BOUNDS, (round) ?
+                sizeof(ROUND_BOUNDS) / sizeof(double) : sizeof(SET_BOUNDS) / sizeof(double));
+    }
+    write_header(f, "hlld_flush_bytes_total", "counter", "Bytes written by the scheduled flushes.");
+    fprintf(f, "hlld_flush_bytes_total %llu\n", (unsigned long long)bg->flush_bytes);
+    write_header(f, "hlld_flush_clean_pages_total", "counter",
+            "Pages skipped as clean by the scheduled flushes.");
+    fprintf(f, "hlld_flush_clean_pages_total %llu\n", (unsigned long long)bg->flush_clean_pages);
+
+    // The set manager
+    uint64_t hits, misses;
+    setmgr_lookup_stats(mgr, &hits, &misses);
+    write_header(f, "hlld_vacuum_lag_versions", "gauge",
+            "Versions not yet merged into both set maps.");
+    fprintf(f, "hlld_vacuum_lag_versions %llu\n", (unsigned long long)setmgr_vacuum_lag(mgr));
+    write_header(f, "hlld_set_lookups_total", "counter", "Set lookups, by the cache result.");
+    fprintf(f, "hlld_set_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)hits);
+    fprintf(f, "hlld_set_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)misses);
+
+    // Each set, and their totals
+    set_totals totals = {f, 0, 0, 0, 0};
+    int num_sets = 0;
+    for (; totals.metric < NUM_SET_METRICS; totals.metric++) {
+        const char **metric = SET_METRICS[totals.metric];
+        write_header(f, metric[0], metric[1], metric[2]);
+        num_sets = setmgr_iter_set_stats(mgr, write_set_stats_cb, &totals);
+    }
+    write_header(f, "hlld_sets", "gauge", "Sets in the last snapshot.");
+    fprintf(f, "hlld_sets %d\n", num_sets);
+    write_header(f, "hlld_resident_bytes", "gauge", "Bytes of all sets resident in memory, as last sampled.");
+    fprintf(f, "hlld_resident_bytes %llu\n", (unsigned long long)totals.resident_bytes);
+    write_header(f, "hlld_page_ins_total", "counter", "Times any set was paged in.");
+    fprintf(f, "hlld_page_ins_total %llu\n", (unsigned long long)totals.page_ins);
+    write_header(f, "hlld_page_outs_total", "counter", "Times any set was paged out.");
+    fprintf(f, "hlld_page_outs_total %llu\n", (unsigned long long)totals.page_outs);
+
+    free(m);
+    free(bg);
+    return (fclose(f) == 0) ? 0 : -1;
+}
+
+// Writes the help and type lines of a metric
+static void write_header(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes a histogram, with cumulative buckets at the given
+ * bounds. Latencies are converted to seconds.
+ */
+static void write_histogram(FILE *f, const char *name, const char *labels,
+        latency_histogram *h, const double *bounds, int num_bounds) {
+    const char *sep = (labels) ? "," : "";
+    if (!labels) labels = "";
+
+    uint64_t seen = 0;
+    int b = 0;
+    for (int i=0; i < num_bounds; i++) {
+        uint64_t bound = bounds[i] * 1e9;
+        for (; b < LATENCY_BUCKETS && metrics_bucket_max(b) <= bound; b++)
+            seen += h->buckets[b];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bounds[i],
+                (unsigned long long)seen);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)h->count);
+    fprintf(f, "%s_sum%s%s%s %.9f\n", name, (*labels) ? "{" : "", labels,
+            (*labels) ? "}" : "", h->sum / 1e9);
+    fprintf(f, "%s_count%s%s%s %llu\n", name, (*labels) ? "{" : "", labels,
+            (*labels) ? "}" : "", (unsigned long long)h->count);
+}
+
+// Writes a label value, escaping the quotes and backslashes
+static void write_label(FILE *f, const char *value) {
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\') fputc('\\', f);
+        fputc(*value, f);
+    }
+}
+
+// Writes a metric of a set, and adds the set to the totals
+static void write_set_stats_cb(void *data, hlld_set_stats *stats) {
+    set_totals *totals = data;
+    uint64_t value = 0;
+    switch (totals->metric) {
+        case 0:
+            value = stats->resident_bytes;
+            totals->resident_bytes += value;
+            break;
+        case 1:
+            value = stats->counters.page_ins;
+            totals->page_ins += value;
+            break;
+        case 2:
+            value = stats->counters.page_outs;
+            totals->page_outs += value;
+            break;
+        case 3:
+            value = stats->counters.sets;
+            break;
+        case 4:
+            value = stats->counters.flushes;
+            break;
+        case 5:
+            // Written as seconds, below
+            break;
+        case 6:
+            value = stats->counters.flush_bytes;
+            break;
+        case 7:
+            value = stats->counters.page_faults;
+            break;
+    }
+    fprintf(totals->f, "%s{set=\"", SET_METRICS[totals->metric][0]);
+    write_label(totals->f, stats->set_name);
+    if (totals->metric == 5)
+        fprintf(totals->f, "\"} %.9f\n", stats->counters.flush_nanos / 1e9);
+    else
+        fprintf(totals->f, "\"} %llu\n", (unsigned long long)value);
+}
@@ -0,0 +1,20 @@
+#ifndef PROMETHEUS_H
+#define PROMETHEUS_H
+#include <stddef.h>
+#include "metrics.h"
+#include "set_manager.h"
+
+/**
+ * Formats the metrics of the server in the Prometheus
+ * text format. The sets are read from the last stats
+ * snapshot of the manager, and are not visited.
+ * @notes Thread safe.
+ * @arg metrics The server metrics
+ * @arg mgr The set manager
+ * @arg out Output, the text. Must be freed by the caller.
+ * @arg out_len Output, the length of the text
+ * @return 0 on success.
+ */
+int format_prometheus(hlld_metrics *metrics, hlld_setmgr *mgr, char **out, size_t *out_len);
+
+#endif
@@ -0,0 +1,360 @@
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "dump.h"
+#include "hll_hash.h"
+#include "metrics.h"
+#include "remote.h"
+
+/*
+ * The binary dump request, as in handler_constants.c
+ */
+#define BINARY_MAGIC 0xB1
+#define BINARY_HEADER_LEN 12
+#define BINARY_REPLY_LEN 8
+#define BIN_DUMP 3
+#define BIN_DONE 0
+#define BIN_SET_NOT_EXIST 1
+
+/**
+ * Larger dumps are refused
+ */
+#define MAX_DUMP_LEN (1 << 26)
+
+static void* remote_thread_main(void *in);
+
+static inline uint64_t now_msec(void) {
+    return metrics_now() / 1000000;
+}
+
+
+/**
+ * Creates the remote cache, and starts its fetch thread
+ * @arg config The configuration
+ * @arg remote Output, the cache
+ * @return 0 on success.
+ */
+int init_remote(hlld_config *config, hlld_remote **remote) {
+    hlld_remote *r = *remote = calloc(1, sizeof(hlld_remote));
+    r->config = config;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->run = 1;
+    if (pthread_create(&r->thread, NULL, remote_thread_main, r)) {
+        syslog(LOG_ERR, "Failed to start the remote fetch thread!");
+        free(r);
+        *remote = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops the fetch thread, and destroys the cache
+ * @arg remote The cache, may be NULL
+ */
+void destroy_remote(hlld_remote *remote) {
+    if (!remote) return;
+    pthread_mutex_lock(&remote->lock);
+    remote->run = 0;
+    pthread_cond_signal(&remote->cond);
+    pthread_mutex_unlock(&remote->lock);
+    pthread_join(remote->thread, NULL);
+
+    for (int i=0; i < REMOTE_CACHE_SLOTS; i++) {
+        if (remote->slots[i]) remote_release(remote, remote->slots[i]);
+    }
+    free(remote);
+}
+
+/**
+ * Checks if a set name is a reference to a remote set
+ * @arg name The name, which need not be terminated
+ * @arg len The length of the name
+ * @return 1 if the name is host:port/set
+ */
+int remote_is_ref(const char *name, int len) {
+    const char *slash = memchr(name, '/', len);
+    if (!slash || slash == name + len - 1) return 0;
+    const char *colon = NULL;
+    for (const char *p=name; p < slash; p++) {
+        if (*p == ':') colon = p;
+    }
+    if (!colon || colon == name || colon + 1 == slash) return 0;
+    for (const char *p=colon + 1; p < slash; p++) {
+        if (*p < '0' || *p > '9') return 0;
+    }
+    return 1;
+}
+
+/**
+ * Finds the cache slot of a reference. References
+ * sharing a slot cannot be cached together.
+ * @arg ref The reference, host:port/set
+ * @return The slot
+ */
+int remote_slot(const char *ref) {
+    return hll_hash_key(HLL_HASH_MURMUR, ref, strlen(ref)) % REMOTE_CACHE_SLOTS;
+}
+
+/**
+ * Looks up a remote set in the cache
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg ref The reference, host:port/set
+ * @arg max_age_msec The oldest fetch to return, or -1 for any
+ * @return The set, to release with remote_release, or NULL if
+ * it is not cached.
+ */
+remote_set* remote_get(hlld_remote *remote, const char *ref, int64_t max_age_msec) {
+    int slot = remote_slot(ref);
+    uint64_t now = now_msec();
+    pthread_mutex_lock(&remote->lock);
+    remote_set *set = remote->slots[slot];
+    if (set && (strcmp(set->ref, ref) ||
+            (max_age_msec >= 0 && now - set->fetched_msec > (uint64_t)max_age_msec)))
+        set = NULL;
+    if (set) set->refs++;
+    pthread_mutex_unlock(&remote->lock);
+    return set;
+}
+
+/*
+ * Frees a remote set once unreferenced
+ */
+static void free_remote_set(remote_set *set) {
+    if (!set->status) hll_destroy(&set->hll);
+    free(set->ref);
+    free(set);
+}
+
+/**
+ * Releases a remote set returned by remote_get
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg set The set
+ */
+void remote_release(hlld_remote *remote, remote_set *set) {
+    if (!remote) {
+        free_remote_set(set);
+        return;
+    }
+    pthread_mutex_lock(&remote->lock);
+    int refs = --set->refs;
+    pthread_mutex_unlock(&remote->lock);
+    if (!refs) free_remote_set(set);
+}
+
+/**
+ * Queues a remote set to be fetched into the cache. Fetches
+ * are done in order, so the callback of the last fetch queued
+ * is invoked once all of them are done.
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg ref The reference, host:port/set
+ * @arg cb Invoked on the fetch thread once done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 if not running.
+ */
+int remote_fetch_async(hlld_remote *remote, const char *ref, remote_fetch_cb cb, void *data) {
+    remote_job *job = malloc(sizeof(remote_job));
+    job->ref = strdup(ref);
+    job->cb = cb;
+    job->data = data;
+    job->next = NULL;
+
+    pthread_mutex_lock(&remote->lock);
+    if (!remote->run) {
+        pthread_mutex_unlock(&remote->lock);
+        free(job->ref);
+        free(job);
+        return -1;
+    }
+    if (remote->tail)
+        remote->tail->next = job;
+    else
+        remote->head = job;
+    remote->tail = job;
+    pthread_cond_signal(&remote->cond);
+    pthread_mutex_unlock(&remote->lock);
+    return 0;
+}
+
+/*
+ * Connects to host:port, with the fetch timeouts
+ * @return The socket, or -1 on error.
+ */
+static int connect_remote(const char *addr, int addr_len) {
+    char *host = strndup(addr, addr_len);
+    char *port = strrchr(host, ':');
+    *port++ = '\0';
+
+    struct addrinfo hints, *res = NULL;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct timeval timeout = {REMOTE_TIMEOUT_SEC, 0};
+    int fd = -1;
+    if (!getaddrinfo(host, port, &hints, &res)) {
+        for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+    }
+    free(host);
+    return fd;
+}
+
+static int read_all(int fd, unsigned char *buf, uint64_t len) {
+    uint64_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, buf + total, len - total);
+        if (n <= 0) return -1;
+        total += n;
+    }
+    return 0;
+}
+
+/*
+ * Requests the dump of a set
+ * @return 0 on success, -1 if the set does not exist, -2 on error.
+ */
+static int fetch_dump(const char *ref, unsigned char **dump, uint64_t *len) {
+    const char *slash = strchr(ref, '/');
+    const char *name = slash + 1;
+    int name_len = strlen(name);
+    int fd = connect_remote(ref, slash - ref);
+    if (fd < 0) return -2;
+
+    unsigned char frame[BINARY_HEADER_LEN] = {BINARY_MAGIC, BIN_DUMP,
+        name_len & 0xff, name_len >> 8, 0, 0, 0, 0,
+        name_len & 0xff, name_len >> 8, 0, 0};
+    unsigned char reply[BINARY_REPLY_LEN];
+    int res = -2;
+    if (write(fd, frame, sizeof(frame)) != sizeof(frame) ||
+            write(fd, name, name_len) != name_len ||
+            read_all(fd, reply, sizeof(reply)) || reply[0] != BINARY_MAGIC)
+        goto LEAVE;
+
+    uint32_t count = reply[4] | (reply[5] << 8) | (reply[6] << 16) | ((uint32_t)reply[7] << 24);
+    if (reply[1] == BIN_SET_NOT_EXIST) {
+        res = -1;
+    } else if (reply[1] == BIN_DONE && count <= MAX_DUMP_LEN) {
+        *dump = malloc(count);
+        if (read_all(fd, *dump, count)) {
+            free(*dump);
+        } else {
+            *len = count;
+            res = 0;
+        }
+    }
+
+LEAVE:
+    close(fd);
+    return res;
+}
+
+/*
+ * Loads the dumped registers into a dense HLL
+ * @return 0 on success.
+ */
+static int load_dump(remote_set *set, const unsigned char *dump, uint64_t len) {
+    const unsigned char *regs;
+    uint64_t regs_len;
+    if (dump_decode(dump, len, &set->set_config, &regs, &regs_len)) return -1;
+    unsigned char precision = set->set_config.default_precision;
+    hll_format format = set->set_config.format;
+    uint64_t size = hll_bytes_for_precision(precision, format);
+    if (bitmap_from_file(-1, size, ANONYMOUS, &set->bm)) return -1;
+
+    int res;
+    if (regs_len == size) {
+        memcpy(set->bm.mmap, regs, size);
+        res = hll_init_from_bitmap(precision, format, &set->bm, &set->hll);
+    } else if (hll_is_cold_buffer(regs, regs_len)) {
+        res = hll_init_from_cold_buffer(precision, format, &set->bm, regs, regs_len, &set->hll);
+    } else {
+        // Sparse registers are made dense, for the union kernel
+        res = hll_init_sparse_from_buffer(precision, format, regs, regs_len, &set->hll);
+        if (!res && hll_convert_dense(&set->hll, &set->bm)) {
+            hll_destroy(&set->hll);
+            res = -1;
+        }
+    }
+    if (res) bitmap_close(&set->bm);
+    return res;
+}
+
+/**
+ * Fetches a remote set, without caching it
+ * @arg ref The reference, host:port/set
+ * @return The set, with a single reference to release with
+ * remote_release, or NULL if the reference is invalid.
+ */
+remote_set* remote_fetch(const char *ref) {
+    if (!remote_is_ref(ref, strlen(ref))) return NULL;
+    remote_set *set = calloc(1, sizeof(remote_set));
+    set->ref = strdup(ref);
+    set->refs = 1;
+
+    unsigned char *dump;
+    uint64_t len;
+    set->status = fetch_dump(ref, &dump, &len);
+    if (!set->status) {
+        if (load_dump(set, dump, len)) set->status = -2;
+        free(dump);
+    }
+    if (set->status == -2)
+        syslog(LOG_WARNING, "Failed to fetch the remote set '%s'.", ref);
+    set->fetched_msec = now_msec();
+    return set;
+}
+
+/*
+ * Fetches the queued remote sets into the cache
+ */
+static void* remote_thread_main(void *in) {
+    hlld_remote *remote = in;
+    pthread_mutex_lock(&remote->lock);
+    while (1) {
+        remote_job *job = remote->head;
+        if (!job) {
+            if (!remote->run) break;
+            pthread_cond_wait(&remote->cond, &remote->lock);
+            continue;
+        }
+        remote->head = job->next;
+        if (!remote->head) remote->tail = NULL;
+        pthread_mutex_unlock(&remote->lock);
+
+        // Replace the cached set, which readers may still hold
+        remote_set *set = remote_fetch(job->ref);
+        if (set) {
+            int slot = remote_slot(job->ref);
+            pthread_mutex_lock(&remote->lock);
+            remote_set *old = remote->slots[slot];
+            remote->slots[slot] = set;
+            pthread_mutex_unlock(&remote->lock);
+            if (old) remote_release(remote, old);
+        }
+
+        if (job->cb) job->cb(job->data);
+        free(job->ref);
+        free(job);
+        pthread_mutex_lock(&remote->lock);
+    }
+    pthread_mutex_unlock(&remote->lock);
+    return NULL;
+}
@@ -0,0 +1,130 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "bitmap.h"
+#include "hll.h"
+
+/*
+ * The remote cache holds the registers of sets on other servers,
+ * so that a union may span the partial sets of a set whose keys
+ * are spread over many nodes. A remote set is named by reference,
+ * "host:port/set", and is fetched with a binary dump on a thread
+ * of its own, so that the connection asking for it is parked
+ * rather than blocking its worker. Fetched registers are kept
+ * dense for the union, and reused until remote_cache_msec passes.
+ */
+
+/**
+ * The number of remote sets cached. References that
+ * hash to the same slot replace each other.
+ */
+#define REMOTE_CACHE_SLOTS 1024
+
+/**
+ * How long a fetch may wait on the remote server
+ */
+#define REMOTE_TIMEOUT_SEC 2
+
+typedef struct {
+    char *ref;                  // host:port/set
+    int status;                 // 0 if fetched, -1 if the set does not exist, -2 on error
+    hll_t hll;                  // The dense registers, if fetched
+    hlld_bitmap bm;
+    hlld_set_config set_config;
+    uint64_t fetched_msec;
+    int refs;                   // Held by the cache and each reader
+} remote_set;
+
+typedef void(*remote_fetch_cb)(void *data);
+
+typedef struct remote_job {
+    char *ref;
+    remote_fetch_cb cb;         // Invoked once fetched, may be NULL
+    void *data;
+    struct remote_job *next;
+} remote_job;
+
+typedef struct {
+    hlld_config *config;
+    pthread_mutex_t lock;
+    remote_set *slots[REMOTE_CACHE_SLOTS];
+    pthread_cond_t cond;
+    remote_job *head;
+    remote_job *tail;
+    int run;                    // Cleared to stop the fetch thread
+    pthread_t thread;
+} hlld_remote;
+
+/**
+ * Creates the remote cache, and starts its fetch thread
+ * @arg config The configuration
+ * @arg remote Output, the cache
+ * @return 0 on success.
+ */
+int init_remote(hlld_config *config, hlld_remote **remote);
+
+/**
+ * Stops the fetch thread, and destroys the cache
+ * @arg remote The cache, may be NULL
+ */
+void destroy_remote(hlld_remote *remote);
+
+/**
+ * Checks if a set name is a reference to a remote set
+ * @arg name The name, which need not be terminated
+ * @arg len The length of the name
+ * @return 1 if the name is host:port/set
+ */
+int remote_is_ref(const char *name, int len);
+
+/**
+ * Finds the cache slot of a reference. References
+ * sharing a slot cannot be cached together.
+ * @arg ref The reference, host:port/set
+ * @return The slot
+ */
+int remote_slot(const char *ref);
+
+/**
+ * Looks up a remote set in the cache
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg ref The reference, host:port/set
+ * @arg max_age_msec The oldest fetch to return, or -1 for any
+ * @return The set, to release with remote_release, or NULL if
+ * it is not cached.
+ */
+remote_set* remote_get(hlld_remote *remote, const char *ref, int64_t max_age_msec);
+
+/**
+ * Releases a remote set returned by remote_get
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg set The set
+ */
+void remote_release(hlld_remote *remote, remote_set *set);
+
+/**
+ * Queues a remote set to be fetched into the cache. Fetches
+ * are done in order, so the callback of the last fetch queued
+ * is invoked once all of them are done.
+ * @notes Thread safe.
+ * @arg remote The cache
+ * @arg ref The reference, host:port/set
+ * @arg cb Invoked on the fetch thread once done, may be NULL
+ * @arg data Passed to the callback
+ * @return 0 if queued, -1 if not running.
+ */
+int remote_fetch_async(hlld_remote *remote, const char *ref, remote_fetch_cb cb, void *data);
+
+/**
+ * Fetches a remote set, without caching it
+ * @arg ref The reference, host:port/set
+ * @return The set, with a single reference to release with
+ * remote_release, or NULL if the reference is invalid.
+ */
+remote_set* remote_fetch(const char *ref);
+
+#endif
@@ -0,0 +1,499 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crc32c.h"
+#include "hll.h"
+#include "hll_hash.h"
+#include "repl_log.h"
+
+/**
+ * The smallest buffer allocated for the raises of a set
+ */
+#define MIN_ENTRIES 64
+
+/**
+ * Entries fit in 28 bits, so are at most 4 varint bytes
+ */
+#define MAX_VARINT 4
+
+/*
+ * The names of the sets with raises to stream
+ */
+static pthread_mutex_t PENDING_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static char **PENDING = NULL;
+static int PENDING_NUM = 0;
+static int PENDING_CAP = 0;
+
+/*
+ * Adds a set to the pending list
+ */
+static void add_pending(char *set_name) {
+    pthread_mutex_lock(&PENDING_LOCK);
+    if (PENDING_NUM == PENDING_CAP) {
+        int cap = (PENDING_CAP) ? PENDING_CAP * 2 : 64;
+        char **names = realloc(PENDING, cap * sizeof(char*));
+        if (!names) {
+            pthread_mutex_unlock(&PENDING_LOCK);
+            return;
+        }
+        PENDING = names;
+        PENDING_CAP = cap;
+    }
+    PENDING[PENDING_NUM++] = strdup(set_name);
+    pthread_mutex_unlock(&PENDING_LOCK);
+}
+
+/**
+ * Creates the replication log of a set
+ * @arg set_name The name of the set
+ * @return The new log
+ */
+repl_log* repl_log_create(char *set_name) {
+    repl_log *log = calloc(1, sizeof(repl_log));
+    log->set_name = strdup(set_name);
+    INIT_HLLD_SPIN(&log->lock);
+    return log;
+}
+
+/**
+ * Destroys the replication log of a set
+ * @arg log The log
+ */
+void repl_log_destroy(repl_log *log) {
+    free(log->set_name);
+    free(log->entries);
+    free(log);
+}
+
+/*
+ * Drops the raises of a log, and queues it for a full
+ * send. Must be called with the lock held.
+ * @return 1 if the log must be added to the pending list
+ */
+static int mark_resync(repl_log *log) {
+    free(log->entries);
+    log->entries = NULL;
+    log->num = log->cap = 0;
+    log->resync = 1;
+    if (log->queued) return 0;
+    log->queued = 1;
+    return 1;
+}
+
+/**
+ * Records raises of the registers of a set.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ * @arg entries The register entries that were raised
+ * @arg num The number of entries
+ */
+void repl_log_add(repl_log *log, const uint32_t *entries, int num) {
+    if (!num) return;
+    int queue = 0;
+    LOCK_HLLD_SPIN(&log->lock);
+
+    // The registers are sent in full anyways
+    if (log->resync) goto LEAVE;
+
+    // Grow up to the limit, then fold repeated raises of a register
+    if (log->num + num > log->cap && log->cap < REPL_MAX_ENTRIES) {
+        int cap = (log->cap) ? log->cap : MIN_ENTRIES;
+        while (cap < log->num + num && cap < REPL_MAX_ENTRIES) cap *= 2;
+        uint32_t *grown = realloc(log->entries, cap * sizeof(uint32_t));
+        if (grown) {
+            log->entries = grown;
+            log->cap = cap;
+        }
+    }
+    if (log->num + num > log->cap)
+        log->num = repl_fold(log->entries, log->num);
+    if (log->num + num > log->cap) {
+        queue = mark_resync(log);
+        goto LEAVE;
+    }
+
+    memcpy(log->entries + log->num, entries, num * sizeof(uint32_t));
+    log->num += num;
+    if (!log->queued) {
+        log->queued = 1;
+        queue = 1;
+    }
+
+LEAVE:
+    UNLOCK_HLLD_SPIN(&log->lock);
+    if (queue) add_pending(log->set_name);
+}
+
+/**
+ * Marks that the registers of a set must be sent in
+ * full, as they changed in ways that were not logged.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ */
+void repl_log_resync(repl_log *log) {
+    LOCK_HLLD_SPIN(&log->lock);
+    int queue = mark_resync(log);
+    UNLOCK_HLLD_SPIN(&log->lock);
+    if (queue) add_pending(log->set_name);
+}
+
+/**
+ * Takes the raises of a set, leaving the log empty.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ * @arg entries Output, the raises. malloc()'d, may be NULL.
+ * @arg resync Output, set to 1 if the registers must be sent in full
+ * @return The number of raises
+ */
+int repl_log_take(repl_log *log, uint32_t **entries, int *resync) {
+    LOCK_HLLD_SPIN(&log->lock);
+    int num = log->num;
+    *entries = log->entries;
+    *resync = log->resync;
+    log->entries = NULL;
+    log->num = log->cap = 0;
+    log->resync = 0;
+    log->queued = 0;
+    UNLOCK_HLLD_SPIN(&log->lock);
+    return num;
+}
+
+/**
+ * Takes the names of the sets that logged raises
+ * since the last call.
+ * @notes Thread safe.
+ * @arg names Output, a malloc()'d array of malloc()'d names
+ * @return The number of names
+ */
+int repl_log_pending(char ***names) {
+    pthread_mutex_lock(&PENDING_LOCK);
+    int num = PENDING_NUM;
+    *names = PENDING;
+    PENDING = NULL;
+    PENDING_NUM = PENDING_CAP = 0;
+    pthread_mutex_unlock(&PENDING_LOCK);
+    return num;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sorts register entries, keeping the largest
+ * value of each register.
+ * @arg entries The entries, folded in place
+ * @arg num The number of entries
+ * @return The number of entries left
+ */
+int repl_fold(uint32_t *entries, int num) {
+    if (num < 2) return num;
+    qsort(entries, num, sizeof(uint32_t), cmp_entry);
+
+    // Sorted entries of a register end with the largest value
+    int out = 0;
+    for (int i=0; i < num; i++) {
+        if (out && HLL_ENTRY_IDX(entries[out - 1]) == HLL_ENTRY_IDX(entries[i]))
+            out--;
+        entries[out++] = entries[i];
+    }
+    return out;
+}
+
+static inline void store_le16(unsigned char *out, uint16_t val) {
+    out[0] = val;
+    out[1] = val >> 8;
+}
+
+static inline void store_le32(unsigned char *out, uint32_t val) {
+    for (int i=0; i < 4; i++) out[i] = val >> (8 * i);
+}
+
+static inline uint16_t load_le16(const unsigned char *in) {
+    return in[0] | (in[1] << 8);
+}
+
+static inline uint32_t load_le32(const unsigned char *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+/**
+ * Encodes a replication frame
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set
+ * @arg entries Folded register entries
+ * @arg num The number of entries
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the frame
+ * @return 0 on success
+ */
+int repl_encode_frame(char *set_name, hlld_set_config *set_config,
+        const uint32_t *entries, int num, unsigned char **buf, uint32_t *len) {
+    size_t name_len = strlen(set_name);
+    if (!name_len || name_len > UINT16_MAX) return -1;
+    unsigned char *out = malloc(REPL_HEADER_SIZE + name_len + (size_t)num * MAX_VARINT);
+    if (!out) return -1;
+
+    // Entries are stored as the deltas from the last
+    unsigned char *body = out + REPL_HEADER_SIZE + name_len;
+    uint32_t body_len = 0, prev = 0;
+    for (int i=0; i < num; i++) {
+        uint32_t delta = entries[i] - prev;
+        prev = entries[i];
+        while (delta >= 0x80) {
+            body[body_len++] = (delta & 0x7f) | 0x80;
+            delta >>= 7;
+        }
+        body[body_len++] = delta;
+    }
+
+    out[0] = REPL_FRAME_MAGIC;
+    out[1] = set_config->default_precision;
+    store_le16(out + 2, name_len);
+    store_le32(out + 4, num);
+    store_le32(out + 8, body_len);
+    out[12] = set_config->format;
+    out[13] = set_config->hash;
+    out[14] = set_config->estimator;
+    out[15] = set_config->sparse;
+    memcpy(out + REPL_HEADER_SIZE, set_name, name_len);
+
+    *buf = out;
+    *len = REPL_HEADER_SIZE + name_len + body_len;
+    return 0;
+}
+
+/**
+ * Decodes a replication frame from the front of a buffer
+ * @arg buf The buffer
+ * @arg len The bytes in the buffer
+ * @arg frame Output, the frame. Freed with repl_frame_free.
+ * @return The length of the frame, 0 if the buffer does
+ * not hold a whole frame, or -1 if the frame is corrupt.
+ */
+int repl_decode_frame(const unsigned char *buf, uint32_t len, repl_frame *frame) {
+    if (len < REPL_HEADER_SIZE) return 0;
+    int precision = buf[1];
+    uint32_t name_len = load_le16(buf + 2);
+    uint32_t num = load_le32(buf + 4);
+    uint32_t body_len = load_le32(buf + 8);
+    if (buf[0] != REPL_FRAME_MAGIC || !name_len ||
+            precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION ||
+            num > (1U << precision) || body_len < num || body_len > num * MAX_VARINT ||
+            !hll_format_name(buf[12]) || !hll_hash_name(buf[13]) ||
+            !hll_estimator_name(buf[14]) || buf[15] > 1)
+        return -1;
+    uint64_t frame_len = (uint64_t)REPL_HEADER_SIZE + name_len + body_len;
+    if (frame_len > len) return 0;
+
+    // Decode the entries, which must be in order of register
+    const unsigned char *body = buf + REPL_HEADER_SIZE + name_len;
+    uint32_t *entries = malloc((num ? num : 1) * sizeof(uint32_t));
+    if (!entries) return -1;
+    uint32_t offset = 0, val = 0;
+    for (uint32_t i=0; i < num; i++) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (offset < body_len && shift < 7 * MAX_VARINT) {
+            unsigned char byte = body[offset++];
+            delta |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) break;
+        }
+        if ((i && !delta) || HLL_ENTRY_IDX(val + delta) >= (1U << precision)) {
+            free(entries);
+            return -1;
+        }
+        val += delta;
+        entries[i] = val;
+    }
+    if (offset != body_len) {
+        free(entries);
+        return -1;
+    }
+
+    frame->set_name = malloc(name_len + 1);
+    memcpy(frame->set_name, buf + REPL_HEADER_SIZE, name_len);
+    frame->set_name[name_len] = '\0';
+    frame->set_config.default_precision = precision;
+    frame->set_config.default_eps = hll_error_for_precision(precision);
+    frame->set_config.in_memory = 0;
+    frame->set_config.format = buf[12];
+    frame->set_config.hash = buf[13];
+    frame->set_config.estimator = buf[14];
+    frame->set_config.sparse = buf[15];
+    frame->set_config.size = 0;
+    frame->set_config.window = 0;
+    frame->set_config.window_buckets = 0;
+    frame->set_config.sliding = 0;
+    frame->set_config.kmv = 0;
+    frame->set_config.expires = 0;
+    frame->set_config.durability = DURABILITY_PERIODIC;
+    frame->set_config.flush_period = 0;
+    frame->entries = entries;
+    frame->num = num;
+    return frame_len;
+}
+
+/**
+ * Frees the buffers of a decoded frame
+ * @arg frame The frame
+ */
+void repl_frame_free(repl_frame *frame) {
+    free(frame->set_name);
+    free(frame->entries);
+}
+
+/**
+ * Returns the number of register pages of a precision
+ * @arg precision The precision of the set
+ * @return The number of pages
+ */
+uint32_t repl_num_pages(int precision) {
+    return ((1U << precision) + REPL_PAGE_REGISTERS - 1) / REPL_PAGE_REGISTERS;
+}
+
+/**
+ * Computes the digest of each page of registers, as the
+ * CRC32C of the entries of the registers in the page.
+ * Pages without any entries have a digest of 0.
+ * @arg entries Register entries, in order of register
+ * @arg num The number of entries
+ * @arg precision The precision of the set
+ * @arg digests Output, with room for repl_num_pages(precision)
+ */
+void repl_page_digests(const uint32_t *entries, int num, int precision, uint32_t *digests) {
+    uint32_t num_pages = repl_num_pages(precision);
+    memset(digests, 0, num_pages * sizeof(uint32_t));
+
+    // Entries are hashed as little endian, in batches
+    unsigned char buf[1024];
+    int i = 0;
+    while (i < num) {
+        uint32_t page = HLL_ENTRY_IDX(entries[i]) / REPL_PAGE_REGISTERS;
+        if (page >= num_pages) return;
+        uint32_t crc = 0, buf_len = 0;
+        for (; i < num && HLL_ENTRY_IDX(entries[i]) / REPL_PAGE_REGISTERS == page; i++) {
+            store_le32(buf + buf_len, entries[i]);
+            buf_len += 4;
+            if (buf_len == sizeof(buf)) {
+                crc = crc32c(crc, buf, buf_len);
+                buf_len = 0;
+            }
+        }
+        digests[page] = crc32c(crc, buf, buf_len);
+    }
+}
+
+/**
+ * Keeps only the entries in the pages whose digests
+ * differ from those of a follower.
+ * @arg entries Register entries in order of register, filtered in place
+ * @arg num The number of entries
+ * @arg precision The precision of the set
+ * @arg digests The digests of the pages of the follower
+ * @arg pages Output, the number of pages that differ
+ * @return The number of entries left
+ */
+int repl_diff_pages(uint32_t *entries, int num, int precision,
+        const uint32_t *digests, uint32_t *pages) {
+    uint32_t num_pages = repl_num_pages(precision);
+    uint32_t *ours = malloc(num_pages * sizeof(uint32_t));
+    if (!ours) {
+        *pages = num_pages;
+        return num;
+    }
+    repl_page_digests(entries, num, precision, ours);
+
+    int out = 0;
+    *pages = 0;
+    for (uint32_t page=0; page < num_pages; page++)
+        ours[page] = (ours[page] != digests[page]);
+    for (int i=0; i < num; i++) {
+        if (ours[HLL_ENTRY_IDX(entries[i]) / REPL_PAGE_REGISTERS])
+            entries[out++] = entries[i];
+    }
+    for (uint32_t page=0; page < num_pages; page++) *pages += ours[page];
+    free(ours);
+    return out;
+}
+
+/**
+ * Encodes a digest frame
+ * @arg set_name The name of the set, or NULL for the
+ * frame that ends the digests
+ * @arg precision The precision of the set
+ * @arg digests The digest of each page
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the frame
+ * @return 0 on success
+ */
+int repl_encode_digests(char *set_name, int precision, const uint32_t *digests,
+        unsigned char **buf, uint32_t *len) {
+    size_t name_len = (set_name) ? strlen(set_name) : 0;
+    uint32_t num_pages = (set_name) ? repl_num_pages(precision) : 0;
+    if ((set_name && !name_len) || name_len > UINT16_MAX) return -1;
+    unsigned char *out = malloc(REPL_DIGEST_HEADER_SIZE + name_len + num_pages * 4);
+    if (!out) return -1;
+
+    out[0] = REPL_DIGEST_MAGIC;
+    out[1] = (set_name) ? precision : 0;
+    store_le16(out + 2, name_len);
+    store_le32(out + 4, num_pages);
+    if (name_len) memcpy(out + REPL_DIGEST_HEADER_SIZE, set_name, name_len);
+    unsigned char *body = out + REPL_DIGEST_HEADER_SIZE + name_len;
+    for (uint32_t i=0; i < num_pages; i++) store_le32(body + i * 4, digests[i]);
+
+    *buf = out;
+    *len = REPL_DIGEST_HEADER_SIZE + name_len + num_pages * 4;
+    return 0;
+}
+
+/**
+ * Decodes a digest frame from the front of a buffer
+ * @arg buf The buffer
+ * @arg len The bytes in the buffer
+ * @arg digests Output, the digests. Freed with repl_digests_free.
+ * @return The length of the frame, 0 if the buffer does
+ * not hold a whole frame, or -1 if the frame is corrupt.
+ */
+int repl_decode_digests(const unsigned char *buf, uint32_t len, repl_digests *digests) {
+    if (len < REPL_DIGEST_HEADER_SIZE) return 0;
+    int precision = buf[1];
+    uint32_t name_len = load_le16(buf + 2);
+    uint32_t num_pages = load_le32(buf + 4);
+    if (buf[0] != REPL_DIGEST_MAGIC) return -1;
+
+    // The end of the digests has no name or pages
+    memset(digests, 0, sizeof(repl_digests));
+    if (!name_len) return (precision || num_pages) ? -1 : REPL_DIGEST_HEADER_SIZE;
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION ||
+            num_pages != repl_num_pages(precision))
+        return -1;
+    uint32_t frame_len = REPL_DIGEST_HEADER_SIZE + name_len + num_pages * 4;
+    if (frame_len > len) return 0;
+
+    digests->set_name = malloc(name_len + 1);
+    digests->digests = malloc(num_pages * sizeof(uint32_t));
+    if (!digests->set_name || !digests->digests) {
+        repl_digests_free(digests);
+        return -1;
+    }
+    memcpy(digests->set_name, buf + REPL_DIGEST_HEADER_SIZE, name_len);
+    digests->set_name[name_len] = '\0';
+    const unsigned char *body = buf + REPL_DIGEST_HEADER_SIZE + name_len;
+    for (uint32_t i=0; i < num_pages; i++) digests->digests[i] = load_le32(body + i * 4);
+    digests->precision = precision;
+    digests->num_pages = num_pages;
+    return frame_len;
+}
+
+/**
+ * Frees the buffers of decoded digests
+ * @arg digests The digests
+ */
+void repl_digests_free(repl_digests *digests) {
+    free(digests->set_name);
+    free(digests->digests);
+}
@@ -0,0 +1,232 @@
+#ifndef REPL_LOG_H
+#define REPL_LOG_H
+#include <stdint.h>
+#include "config.h"
+#include "spinlock.h"
+
+/*
+ * The replication log keeps the register raises of a set
+ * that are yet to be streamed to followers. Raises are
+ * register entries, as packed by HLL_ENTRY, and since
+ * registers only grow, they may be folded to the largest
+ * value of each register and applied in any order.
+ *
+ * Sets with raises are kept on a pending list, so the
+ * primary only visits the sets that changed.
+ */
+
+/**
+ * The most raises buffered for a set. Past this, the
+ * raises are dropped and the registers are sent in full.
+ */
+#define REPL_MAX_ENTRIES 65536
+
+/**
+ * The first byte of each replication frame
+ */
+#define REPL_FRAME_MAGIC 0xB2
+
+/**
+ * The size of a frame header. It is followed by the name
+ * of the set, and the entries encoded as varint deltas.
+ */
+#define REPL_HEADER_SIZE 16
+
+/**
+ * Registers are compared with a follower in pages of this
+ * many, which is a 4KB page of byte registers.
+ */
+#define REPL_PAGE_REGISTERS 4096
+
+/**
+ * The first byte of each digest frame. On connecting, a
+ * follower sends a digest frame for each of its sets, so
+ * the primary only sends the pages that differ.
+ */
+#define REPL_DIGEST_MAGIC 0xB3
+
+/**
+ * The size of a digest frame header. It is followed by the
+ * name of the set, and the CRC32C of each page of registers.
+ * A frame with an empty name ends the digests.
+ */
+#define REPL_DIGEST_HEADER_SIZE 8
+
+typedef struct {
+    hlld_spinlock lock;
+    char *set_name;
+    uint32_t *entries;      // Raises not yet streamed
+    int num;
+    int cap;
+    int resync;             // Raises were lost, send the registers in full
+    int queued;             // Set while on the pending list
+} repl_log;
+
+/**
+ * A decoded replication frame
+ */
+typedef struct {
+    char *set_name;         // Null terminated, malloc()'d
+    hlld_set_config set_config;
+    uint32_t *entries;      // Sorted, malloc()'d
+    int num;
+} repl_frame;
+
+/**
+ * A decoded digest frame
+ */
+typedef struct {
+    char *set_name;         // Null terminated, malloc()'d. NULL at the end.
+    int precision;
+    uint32_t *digests;      // A CRC32C per page, malloc()'d
+    uint32_t num_pages;
+} repl_digests;
+
+/**
+ * Creates the replication log of a set
+ * @arg set_name The name of the set
+ * @return The new log
+ */
+repl_log* repl_log_create(char *set_name);
+
+/**
+ * Destroys the replication log of a set
+ * @arg log The log
+ */
+void repl_log_destroy(repl_log *log);
+
+/**
+ * Records raises of the registers of a set.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ * @arg entries The register entries that were raised
+ * @arg num The number of entries
+ */
+void repl_log_add(repl_log *log, const uint32_t *entries, int num);
+
+/**
+ * Marks that the registers of a set must be sent in
+ * full, as they changed in ways that were not logged.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ */
+void repl_log_resync(repl_log *log);
+
+/**
+ * Takes the raises of a set, leaving the log empty.
+ * @notes Thread safe.
+ * @arg log The log of the set
+ * @arg entries Output, the raises. malloc()'d, may be NULL.
+ * @arg resync Output, set to 1 if the registers must be sent in full
+ * @return The number of raises
+ */
+int repl_log_take(repl_log *log, uint32_t **entries, int *resync);
+
+/**
+ * Takes the names of the sets that logged raises
+ * since the last call.
+ * @notes Thread safe.
+ * @arg names Output, a malloc()'d array of malloc()'d names
+ * @return The number of names
+ */
+int repl_log_pending(char ***names);
+
+/**
+ * Sorts register entries, keeping the largest
+ * value of each register.
+ * @arg entries The entries, folded in place
+ * @arg num The number of entries
+ * @return The number of entries left
+ */
+int repl_fold(uint32_t *entries, int num);
+
+/**
+ * Encodes a replication frame
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set
+ * @arg entries Folded register entries
+ * @arg num The number of entries
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the frame
+ * @return 0 on success
+ */
+int repl_encode_frame(char *set_name, hlld_set_config *set_config,
+        const uint32_t *entries, int num, unsigned char **buf, uint32_t *len);
+
+/**
+ * Decodes a replication frame from the front of a buffer
+ * @arg buf The buffer
+ * @arg len The bytes in the buffer
+ * @arg frame Output, the frame. Freed with repl_frame_free.
+ * @return The length of the frame, 0 if the buffer does
+ * not hold a whole frame, or -1 if the frame is corrupt.
+ */
+int repl_decode_frame(const unsigned char *buf, uint32_t len, repl_frame *frame);
+
+/**
+ * Frees the buffers of a decoded frame
+ * @arg frame The frame
+ */
+void repl_frame_free(repl_frame *frame);
+
+/**
+ * Returns the number of register pages of a precision
+ * @arg precision The precision of the set
+ * @return The number of pages
+ */
+uint32_t repl_num_pages(int precision);
+
+/**
+ * Computes the digest of each page of registers, as the
+ * CRC32C of the entries of the registers in the page.
+ * Pages without any entries have a digest of 0.
+ * @arg entries Register entries, in order of register
+ * @arg num The number of entries
+ * @arg precision The precision of the set
+ * @arg digests Output, with room for repl_num_pages(precision)
+ */
+void repl_page_digests(const uint32_t *entries, int num, int precision, uint32_t *digests);
+
+/**
+ * Keeps only the entries in the pages whose digests
+ * differ from those of a follower.
+ * @arg entries Register entries in order of register, filtered in place
+ * @arg num The number of entries
+ * @arg precision The precision of the set
+ * @arg digests The digests of the pages of the follower
+ * @arg pages Output, the number of pages that differ
+ * @return The number of entries left
+ */
+int repl_diff_pages(uint32_t *entries, int num, int precision,
+        const uint32_t *digests, uint32_t *pages);
+
+/**
+ * Encodes a digest frame
+ * @arg set_name The name of the set, or NULL for the
+ * frame that ends the digests
+ * @arg precision The precision of the set
+ * @arg digests The digest of each page
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the frame
+ * @return 0 on success
+ */
+int repl_encode_digests(char *set_name, int precision, const uint32_t *digests,
+        unsigned char **buf, uint32_t *len);
+
+/**
+ * Decodes a digest frame from the front of a buffer
+ * @arg buf The buffer
+ * @arg len The bytes in the buffer
+ * @arg digests Output, the digests. Freed with repl_digests_free.
+ * @return The length of the frame, 0 if the buffer does
+ * not hold a whole frame, or -1 if the frame is corrupt.
+ */
+int repl_decode_digests(const unsigned char *buf, uint32_t len, repl_digests *digests);
+
+/**
+ * Frees the buffers of decoded digests
+ * @arg digests The digests
+ */
+void repl_digests_free(repl_digests *digests);
+
+#endif
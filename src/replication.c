@@ -0,0 +1,531 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "repl_log.h"
+#include "replication.h"
+
+/**
+ * How often the logged raises are streamed, in milliseconds
+ */
+#define REPL_INTERVAL_MSEC 100
+
+/**
+ * The most followers of a primary
+ */
+#define REPL_MAX_FOLLOWERS 16
+
+/**
+ * A follower that cannot take a frame for this long is
+ * dropped, so that it does not hold back the others.
+ * It is sent the pages that differ once it reconnects.
+ * A new follower has as long to send each part of its
+ * page digests.
+ */
+#define SEND_TIMEOUT_SEC 5
+
+/**
+ * How long a follower waits between reconnects, doubling
+ * from the first up to the last, in milliseconds
+ */
+#define RECONNECT_MIN_MSEC 100
+#define RECONNECT_MAX_MSEC 5000
+
+/**
+ * The largest frame a follower accepts. A set of the highest
+ * precision with a long name is well under this.
+ */
+#define MAX_FRAME_SIZE (32 * 1024 * 1024)
+
+/**
+ * After how many sets should a snapshot checkpoint
+ * with the manager, so the vacuum can make progress
+ */
+#define PERIODIC_CHECKPOINT 64
+
+typedef struct {
+    hlld_config *config;
+    hlld_setmgr *mgr;
+    int *should_run;
+    int listen_fd;
+} repl_thread_args;
+
+static void* primary_thread_main(void *in);
+static void* follower_thread_main(void *in);
+
+/**
+ * Opens the replication listener
+ * @return The socket, or -1 on error.
+ */
+static int open_listener(hlld_config *config) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(config->replication_port);
+    if (inet_pton(AF_INET, config->bind_address, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", config->bind_address);
+        return -1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+        syslog(LOG_ERR, "Failed to listen on replication port %d! Err: %s",
+                config->replication_port, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Starts the primary thread, which accepts followers on the
+ * replication port. Each follower sends the page digests of its
+ * sets, and is first sent the registers of the pages that differ,
+ * and then the raises logged by the sets, folded and streamed
+ * every REPL_INTERVAL_MSEC.
+ * @arg config The configuration
+ * @arg mgr The manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started, 0 if there is no
+ * replication port, or -1 on error.
+ */
+int start_primary_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t) {
+    if (!config->replication_port) return 0;
+    int fd = open_listener(config);
+    if (fd < 0) return -1;
+
+    repl_thread_args *args = malloc(sizeof(repl_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->should_run = should_run;
+    args->listen_fd = fd;
+    pthread_create(t, NULL, primary_thread_main, args);
+    return 1;
+}
+
+/**
+ * Starts the follower thread, which connects to the primary
+ * in replicate_from and applies the raises it streams to our
+ * sets. It reconnects after errors, backing off.
+ * @arg config The configuration
+ * @arg mgr The manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started, 0 if there is no primary.
+ */
+int start_follower_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t) {
+    if (!config->replicate_from) return 0;
+    repl_thread_args *args = malloc(sizeof(repl_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->should_run = should_run;
+    args->listen_fd = -1;
+    pthread_create(t, NULL, follower_thread_main, args);
+    return 1;
+}
+
+/*
+ * Writes a whole buffer, failing after the send timeout
+ */
+static int send_all(int fd, const unsigned char *buf, uint32_t len) {
+    while (len) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/*
+ * Encodes and sends the entries of a set to each follower,
+ * dropping the followers that fail.
+ */
+static void send_entries(char *set_name, hlld_set_config *set_config,
+        const uint32_t *entries, int num, int *followers, int *num_followers) {
+    unsigned char *frame;
+    uint32_t len;
+    if (repl_encode_frame(set_name, set_config, entries, num, &frame, &len)) return;
+    for (int i=0; i < *num_followers; i++) {
+        if (!send_all(followers[i], frame, len)) continue;
+        syslog(LOG_WARNING, "Dropping a follower that fell behind. Err: %s", strerror(errno));
+        close(followers[i]);
+        followers[i--] = followers[--*num_followers];
+    }
+    free(frame);
+}
+
+static int compare_digests(const void *a, const void *b) {
+    return strcmp(((const repl_digests*)a)->set_name, ((const repl_digests*)b)->set_name);
+}
+
+static void free_digests(repl_digests *digests, int num) {
+    for (int i=0; i < num; i++) repl_digests_free(digests + i);
+    free(digests);
+}
+
+/*
+ * Receives the page digests of the sets of a new follower,
+ * up to the frame that ends them.
+ * @arg digests Output, a malloc()'d array sorted by name
+ * @return The number of sets, or -1 on error.
+ */
+static int recv_digests(int fd, repl_digests **digests) {
+    uint32_t cap = 64 * 1024, len = 0;
+    unsigned char *buf = malloc(cap);
+    repl_digests *out = NULL;
+    int num = 0, size = 0, done = 0, frame_len = 0;
+    while (!done && frame_len >= 0) {
+        // Grow to fit a large frame
+        if (len == cap) {
+            if (cap >= MAX_FRAME_SIZE) break;
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t got = recv(fd, buf + len, cap - len, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        len += got;
+
+        uint32_t offset = 0;
+        repl_digests frame;
+        while (!done && (frame_len = repl_decode_digests(buf + offset, len - offset, &frame)) > 0) {
+            offset += frame_len;
+            if (!frame.set_name) {
+                done = 1;
+                break;
+            }
+            if (num == size) {
+                size = (size) ? size * 2 : 64;
+                out = realloc(out, size * sizeof(repl_digests));
+            }
+            out[num++] = frame;
+        }
+        memmove(buf, buf + offset, len - offset);
+        len -= offset;
+    }
+    free(buf);
+    if (!done) {
+        free_digests(out, num);
+        return -1;
+    }
+    if (num) qsort(out, num, sizeof(repl_digests), compare_digests);
+    *digests = out;
+    return num;
+}
+
+/*
+ * Sends the registers of every set to a new follower. Sets the
+ * follower has are only sent the pages whose digests differ,
+ * and skipped if none do. Empty sets the follower does not have
+ * are sent too, so that they are created.
+ * @return 0 on success, otherwise the follower is closed
+ */
+static int send_snapshot(hlld_setmgr *mgr, int fd, repl_digests *digests,
+        int num_digests, int *should_run) {
+    hlld_set_list_head *head;
+    if (setmgr_list_sets(mgr, NULL, &head)) {
+        close(fd);
+        return -1;
+    }
+
+    int sent = 0, in_sync = 0, num_followers = 1;
+    uint64_t pages = 0, differed = 0;
+    hlld_set_list *node = head->head;
+    for (; node && num_followers && *should_run; node = node->next) {
+        hlld_set_config set_config;
+        uint32_t *entries = NULL;
+        int num = setmgr_replication_entries(mgr, node->set_name, 1, &set_config, &entries);
+
+        // Filter down to the pages the follower differs on
+        repl_digests key = {node->set_name, 0, NULL, 0};
+        repl_digests *theirs = (num >= 0 && num_digests) ? bsearch(&key, digests,
+                num_digests, sizeof(repl_digests), compare_digests) : NULL;
+        if (theirs && theirs->precision == set_config.default_precision) {
+            uint32_t diff;
+            num = repl_diff_pages(entries, num, theirs->precision, theirs->digests, &diff);
+            pages += theirs->num_pages;
+            differed += diff;
+            if (!diff) {
+                in_sync++;
+                num = -1;
+            }
+        }
+
+        if (num >= 0) send_entries(node->set_name, &set_config, entries, num, &fd, &num_followers);
+        free(entries);
+        if (++sent % PERIODIC_CHECKPOINT == 0) setmgr_client_checkpoint(mgr);
+    }
+    setmgr_cleanup_list(head);
+    if (!num_followers) return -1;
+    syslog(LOG_INFO, "Synced %d sets with a new follower, %d were in sync. %llu of %llu pages differed.",
+            sent, in_sync, (unsigned long long)differed, (unsigned long long)pages);
+    return 0;
+}
+
+/*
+ * Streams the raises logged since the last call
+ */
+static void stream_pending(hlld_setmgr *mgr, int *followers, int *num_followers) {
+    char **names;
+    int num_names = repl_log_pending(&names);
+    for (int i=0; i < num_names; i++) {
+        // Without followers the raises are dropped, as
+        // followers are sent every register on connecting
+        hlld_set_config set_config;
+        uint32_t *entries = NULL;
+        int num = setmgr_replication_entries(mgr, names[i], 0, &set_config,
+                (*num_followers) ? &entries : NULL);
+        if (num > 0) {
+            num = repl_fold(entries, num);
+            send_entries(names[i], &set_config, entries, num, followers, num_followers);
+        }
+        free(entries);
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void* primary_thread_main(void *in) {
+    repl_thread_args *args = in;
+    hlld_config *config = args->config;
+    hlld_setmgr *mgr = args->mgr;
+    int *should_run = args->should_run;
+    int listen_fd = args->listen_fd;
+    free(args);
+
+    // Perform the initial checkpoint with the manager
+    setmgr_client_checkpoint(mgr);
+    syslog(LOG_INFO, "Replication listening on port %d.", config->replication_port);
+
+    int followers[REPL_MAX_FOLLOWERS];
+    int num_followers = 0;
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (*should_run) {
+        setmgr_client_idle(mgr);
+        int ready = poll(&pfd, 1, REPL_INTERVAL_MSEC);
+        setmgr_client_checkpoint(mgr);
+        if (!*should_run) break;
+
+        // A new follower is sent the registers it lacks before it gets
+        // raises. Raises logged during the snapshot are streamed after it.
+        if (ready > 0) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && num_followers == REPL_MAX_FOLLOWERS) {
+                syslog(LOG_WARNING, "Rejecting a follower, the limit is %d.", REPL_MAX_FOLLOWERS);
+                close(fd);
+            } else if (fd >= 0) {
+                struct timeval timeout = {SEND_TIMEOUT_SEC, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+                // The follower first sends the digests of its pages
+                repl_digests *digests = NULL;
+                setmgr_client_idle(mgr);
+                int num_digests = recv_digests(fd, &digests);
+                setmgr_client_checkpoint(mgr);
+                if (num_digests < 0) {
+                    syslog(LOG_WARNING, "Failed to get the digests of a new follower.");
+                    close(fd);
+                } else {
+                    if (!send_snapshot(mgr, fd, digests, num_digests, should_run))
+                        followers[num_followers++] = fd;
+                    free_digests(digests, num_digests);
+                }
+            }
+        }
+        stream_pending(mgr, followers, &num_followers);
+    }
+
+    for (int i=0; i < num_followers; i++) close(followers[i]);
+    close(listen_fd);
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+/*
+ * Connects to the primary, given as host:port
+ * @return The socket, or -1 on error.
+ */
+static int connect_primary(char *replicate_from) {
+    char *host = strdup(replicate_from);
+    char *port = strrchr(host, ':');
+    *port++ = '\0';
+
+    struct addrinfo hints, *res = NULL;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int fd = -1;
+    if (!getaddrinfo(host, port, &hints, &res)) {
+        for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+    }
+    free(host);
+    return fd;
+}
+
+/*
+ * Sends the page digests of each of our sets to a primary
+ * we connected to, so it only sends the pages that differ.
+ * @return 0 on success.
+ */
+static int send_digests(hlld_setmgr *mgr, int fd, int *should_run) {
+    struct timeval timeout = {SEND_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    hlld_set_list_head *head;
+    if (setmgr_list_sets(mgr, NULL, &head)) return -1;
+
+    unsigned char *frame;
+    uint32_t len;
+    int res = 0, sent = 0;
+    hlld_set_list *node = head->head;
+    for (; node && !res && *should_run; node = node->next) {
+        hlld_set_config set_config;
+        uint32_t *entries = NULL;
+        int num = setmgr_replication_entries(mgr, node->set_name, 1, &set_config, &entries);
+        if (num >= 0) {
+            int precision = set_config.default_precision;
+            uint32_t *digests = malloc(repl_num_pages(precision) * sizeof(uint32_t));
+            repl_page_digests(entries, num, precision, digests);
+            if (!repl_encode_digests(node->set_name, precision, digests, &frame, &len)) {
+                res = send_all(fd, frame, len);
+                free(frame);
+            }
+            free(digests);
+        }
+        free(entries);
+        if (++sent % PERIODIC_CHECKPOINT == 0) setmgr_client_checkpoint(mgr);
+    }
+    setmgr_cleanup_list(head);
+
+    // Mark the end of the digests
+    if (!res && !repl_encode_digests(NULL, 0, NULL, &frame, &len)) {
+        res = send_all(fd, frame, len);
+        free(frame);
+    }
+    return res;
+}
+
+/*
+ * Applies each whole frame at the front of a buffer
+ * @return The bytes applied, or -1 if a frame is corrupt.
+ */
+static int apply_frames(hlld_setmgr *mgr, unsigned char *buf, uint32_t len) {
+    uint32_t offset = 0;
+    while (offset < len) {
+        repl_frame frame;
+        int frame_len = repl_decode_frame(buf + offset, len - offset, &frame);
+        if (frame_len <= 0) return (frame_len) ? -1 : (int)offset;
+        int res = setmgr_raise_registers(mgr, frame.set_name, &frame.set_config,
+                frame.entries, frame.num);
+        if (res == -3) {
+            syslog(LOG_WARNING, "Set '%s' does not match the primary, skipping.", frame.set_name);
+        } else if (res) {
+            syslog(LOG_WARNING, "Failed to apply raises to set '%s'.", frame.set_name);
+        }
+        repl_frame_free(&frame);
+        offset += frame_len;
+    }
+    return offset;
+}
+
+/*
+ * Applies the streams of a connected primary,
+ * until it disconnects or we are shut down.
+ */
+static void follow_primary(hlld_setmgr *mgr, int fd, int *should_run) {
+    struct timeval timeout = {0, REPL_INTERVAL_MSEC * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t cap = 64 * 1024, len = 0;
+    unsigned char *buf = malloc(cap);
+    while (*should_run) {
+        // Grow to fit a large frame
+        if (len == cap) {
+            if (cap >= MAX_FRAME_SIZE) {
+                syslog(LOG_ERR, "Replication frame is too large!");
+                break;
+            }
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+
+        setmgr_client_idle(mgr);
+        ssize_t got = recv(fd, buf + len, cap - len, 0);
+        setmgr_client_checkpoint(mgr);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+        if (got <= 0) {
+            syslog(LOG_WARNING, "Lost the replication primary. Err: %s",
+                    (got) ? strerror(errno) : "Closed");
+            break;
+        }
+        len += got;
+
+        int applied = apply_frames(mgr, buf, len);
+        if (applied < 0) {
+            syslog(LOG_ERR, "Corrupt frame from the replication primary!");
+            break;
+        }
+        memmove(buf, buf + applied, len - applied);
+        len -= applied;
+    }
+    free(buf);
+}
+
+static void* follower_thread_main(void *in) {
+    repl_thread_args *args = in;
+    hlld_config *config = args->config;
+    hlld_setmgr *mgr = args->mgr;
+    int *should_run = args->should_run;
+    free(args);
+
+    // Perform the initial checkpoint with the manager
+    setmgr_client_checkpoint(mgr);
+
+    int backoff = RECONNECT_MIN_MSEC;
+    while (*should_run) {
+        int fd = connect_primary(config->replicate_from);
+        if (fd >= 0) {
+            syslog(LOG_INFO, "Following the replication primary at %s.", config->replicate_from);
+            backoff = RECONNECT_MIN_MSEC;
+            if (!send_digests(mgr, fd, should_run)) {
+                follow_primary(mgr, fd, should_run);
+            } else {
+                syslog(LOG_WARNING, "Failed to send digests to the replication primary. Err: %s",
+                        strerror(errno));
+            }
+            close(fd);
+        }
+
+        // Wait to reconnect, checking if we should exit
+        setmgr_client_idle(mgr);
+        for (int waited=0; waited < backoff && *should_run; waited += RECONNECT_MIN_MSEC)
+            usleep(RECONNECT_MIN_MSEC * 1000);
+        setmgr_client_checkpoint(mgr);
+        backoff = (backoff * 2 < RECONNECT_MAX_MSEC) ? backoff * 2 : RECONNECT_MAX_MSEC;
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
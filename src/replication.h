@@ -0,0 +1,35 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+#include <pthread.h>
+#include "config.h"
+#include "set_manager.h"
+
+/**
+ * Starts the primary thread, which accepts followers on the
+ * replication port. Each follower is first sent the registers
+ * of every set, and then the raises logged by the sets, folded
+ * and streamed every REPL_INTERVAL_MSEC.
+ * @arg config The configuration
+ * @arg mgr The manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started, 0 if there is no
+ * replication port, or -1 on error.
+ */
+int start_primary_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts the follower thread, which connects to the primary
+ * in replicate_from and applies the raises it streams to our
+ * sets. It reconnects after errors, backing off.
+ * @arg config The configuration
+ * @arg mgr The manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started, 0 if there is no primary.
+ */
+int start_follower_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t);
+
+#endif
@@ -1,16 +1,24 @@
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include "set.h"
+#include "clock.h"
 #include "type_compat.h"
+#include "iobatch.h"
+#include "trace.h"
+#include "slowlog.h"
+#include "trash.h"
+#include "crc32c.h"
 
 /*
  * Generates the folder name, given a set name.
@@ -22,38 +30,284 @@ static const char* SET_FOLDER_NAME = "hlld.%s";
  */
 static const char* DATA_FILE_NAME = "registers.mmap";
 
+/**
+ * Sparse registers and conversions are written here
+ * first, then renamed over the data file.
+ */
+static const char* TMP_DATA_FILE_NAME = "registers.mmap.tmp";
+
+/**
+ * The buckets of windowed sets are saved here,
+ * by way of the temporary file.
+ */
+static const char* WINDOW_FILE_NAME = "window.data";
+static const char* TMP_WINDOW_FILE_NAME = "window.data.tmp";
+
+/**
+ * The timestamped registers of sliding sets are saved
+ * here, by way of the temporary file.
+ */
+static const char* SLIDING_FILE_NAME = "sliding.data";
+static const char* TMP_SLIDING_FILE_NAME = "sliding.data.tmp";
+
+/**
+ * The smallest hashes of sets that keep them are
+ * saved here, by way of the temporary file.
+ */
+static const char* KMV_FILE_NAME = "kmv.data";
+static const char* TMP_KMV_FILE_NAME = "kmv.data.tmp";
+
+/*
+ * Flushes append this trailer to dense register files. It
+ * follows the registers, which keep starting the file so they
+ * stay page aligned for mapping and direct IO. The CRC is
+ * checked on page in. Files of just the dense size predate it.
+ */
+#define REGISTER_TRAILER_MAGIC 0x544c4c48 // "HLLT"
+#define REGISTER_TRAILER_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t layout;         // The hll_format of the registers
+    uint8_t precision;
+    uint8_t hash;           // The hll_hash of the set
+    uint8_t unused[3];
+    uint32_t crc;           // CRC32C of the registers
+    uint64_t size;          // The cached size estimate
+    uint64_t reg_bytes;     // Length of the registers
+    uint32_t trailer_crc;   // CRC32C of the fields above
+    uint32_t unused2;
+} register_trailer;
+
 /*
  * Generates the config file name
  */
 static const char* CONFIG_FILENAME = "config.ini";
 
+/*
+ * The most keys hashed on the stack before
+ * updating the registers in a batch add.
+ */
+#define HSET_BATCH_SIZE 64
+
+/*
+ * A set turns hot once its adds cross multiples of
+ * 1 << HSET_HOT_SHIFT twice within HSET_HOT_MSEC.
+ */
+#define HSET_HOT_SHIFT 18
+#define HSET_HOT_MSEC 1000
+
+/*
+ * The most shadow registers a thread raises before merging
+ */
+#define HSET_SHADOW_RAISES 1024
+
+/*
+ * A shadow register raised since it was last merged by its
+ * thread. The value is kept in the low bits after a merge, so
+ * the thread skips the adds that would not raise it again.
+ */
+#define SHADOW_PENDING 0x80
+#define SHADOW_VAL(reg) ((reg) & 0x3f)
+
+/*
+ * The registers of a thread writing a hot set. Only the thread
+ * writes them, and readers merge the raised registers it lists.
+ */
+struct hset_shadow {
+    unsigned char *regs;                    // A register per byte
+    uint32_t raised[HSET_SHADOW_RAISES];    // Registers pending a merge
+    volatile int num_raised;
+    volatile uint64_t adds;                 // Adds not yet counted in the set
+    uint64_t merged_at;                     // When the thread last merged, in msec
+};
+
+/*
+ * The adds of a thread writing a hot set in place, as sets
+ * that log their raises are. Each is on its own cache line,
+ * and readers move them into the counters of the set.
+ */
+struct hset_slot_adds {
+    volatile uint64_t adds;
+} __attribute__((aligned(HSET_CACHE_LINE)));
+
+/*
+ * The shadow slot of each thread, plus one
+ */
+static pthread_key_t SHADOW_SLOT_KEY;
+static pthread_once_t SHADOW_SLOT_ONCE = PTHREAD_ONCE_INIT;
+
+/*
+ * Returns the slot of the calling thread among those
+ * of a hot set, or -1 if it has none
+ */
+static inline int thread_slot(hlld_set *s) {
+    int slot = (int)(intptr_t)pthread_getspecific(SHADOW_SLOT_KEY) - 1;
+    return (slot < s->num_shadows) ? slot : -1;
+}
+
 /*
  * Static delarations
  */
 static int thread_safe_fault(hlld_set *f);
-static int timediff_msec(struct timeval *t1, struct timeval *t2);
+static int read_register_file(hlld_set *s, char *path, uint64_t len, bitmap_mode mode);
+static int load_cold_registers(hlld_set *s, unsigned char *buf, uint64_t len, bitmap_mode mode);
+static int write_register_file(hlld_set *s, unsigned char *buf, uint64_t len);
+static int write_register_trailer(hlld_set *s);
+static int check_register_trailer(hlld_set *s);
+static int read_trailer_size(hlld_set *s, uint64_t *size);
+static int write_set_config(hlld_set *s);
+static int write_set_file(hlld_set *s, const char *name, const char *tmp_name,
+        unsigned char *buf, uint64_t len);
+static int open_window(hlld_set *s);
+static int write_window_file(hlld_set *s);
+static int open_sliding(hlld_set *s);
+static int write_sliding_file(hlld_set *s);
+static int open_kmv(hlld_set *s);
+static int write_kmv_file(hlld_set *s);
+static int write_sparse_file(hlld_set *s);
+static int load_dumped_registers(hlld_set *s, const unsigned char *regs, uint64_t len);
+static int dump_register_file(hlld_set *s, unsigned char **regs, uint64_t *len);
+static int convert_sparse_set(hlld_set *s);
+static int rehydrate_set(hlld_set *s);
+static void remove_folder(hlld_set *s);
+static void keep_last_write(hlld_set *set, struct timespec *mtime);
+static int open_slot_registers(hlld_set *s, uint64_t size, bitmap_mode mode, int create);
+static int place_slot_registers(hlld_set *s, char *replaced);
+static void check_heat(hlld_set *s);
+static void raise_entries(hlld_set *s, const uint32_t *entries, int num);
+static void merge_shadows(hlld_set *s);
+static void drop_shadows(hlld_set *s);
+static int union_registers(hlld_set *dst, hll_t *from);
+static int read_cached_size(hlld_set *s, uint64_t *gen, uint64_t *size);
+
+/**
+ * Marker for a cached size that is not valid
+ */
+#define INVALID_GEN ((uint64_t)-1)
+
+/**
+ * Invalidates the cached size after registers change
+ */
+static inline void registers_changed(hlld_set *s) {
+    __sync_fetch_and_add(&s->reg_gen, 1);
+}
+
+/**
+ * Marks the set dirty, noting when it became dirty
+ */
+static inline void mark_dirty(hlld_set *s) {
+    if (!s->is_dirty) {
+        s->dirty_since = hclock_wall_sec();
+        s->is_dirty = 1;
+    }
+}
+
+/**
+ * Counts adds to the set, noticing once it turns hot.
+ * Threads count the adds of hot sets on their own lines.
+ */
+static inline void count_sets(hlld_set *s, uint64_t num) {
+    struct hset_slot_adds *adds = s->slot_adds;
+    int slot = (adds) ? thread_slot(s) : -1;
+    if (slot >= 0) {
+        __sync_fetch_and_add(&adds[slot].adds, num);
+        return;
+    }
+    uint64_t old = __sync_fetch_and_add(&s->counters.sets, num);
+    if ((old ^ (old + num)) >> HSET_HOT_SHIFT) check_heat(s);
+}
+
+/**
+ * Logs raised registers for followers and to the write-ahead log
+ */
+static inline void log_raises(hlld_set *s, const uint32_t *entries, int num) {
+    if (s->repl) repl_log_add(s->repl, entries, num);
+    if (s->wal) wal_append(s->wal, &s->wal_seq, s->set_name, &s->set_config, entries, num);
+}
+
+/**
+ * Returns the bitmap mode of the dense registers of a set
+ */
+static bitmap_mode registers_mode(hlld_set *s) {
+    if (s->config->read_only) return READ_ONLY;
+    bitmap_mode mode = (s->set_config.in_memory) ? ANONYMOUS :
+        (s->config->use_mmap) ? SHARED : PERSISTENT;
+    if (mode == PERSISTENT && s->config->direct_io) mode |= DIRECT_IO;
+    if (mode != SHARED && s->config->huge_pages) mode |= HUGE_PAGES;
+    return mode;
+}
+
+/**
+ * Returns the bitmap mode to create a register file with
+ */
+static inline bitmap_mode create_mode(hlld_set *s, bitmap_mode mode) {
+    return (s->config->preallocate) ? (mode | PREALLOCATE) : mode;
+}
 
 static int filter_out_special(CONST_DIRENT_T *d);
+static hlld_set* alloc_set(hlld_config *config, char *set_name);
+static void new_set_config(hlld_set *s, hlld_config *config);
+static int make_folder(hlld_set *s);
+
+/**
+ * Returns the data directory of the folder of a set. The
+ * folder of an existing set may be in any of them, and a new
+ * one is placed by the hash of its name, or in the directory
+ * with the most free space.
+ * @return The index of the directory among the data_dirs
+ */
+static int place_set(hlld_config *config, char *folder_name) {
+    int num = config->num_data_dirs;
+    if (num <= 1) return 0;
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+    struct stat buf;
+    for (int i=0; i < num; i++) {
+        char *path = join_path(config->data_dir_list[i], folder_name);
+        int found = !stat(path, &buf);
+        free(path);
+        if (found) return i;
+    }
+
+    if (config->placement == PLACE_SPACE) {
+        int best = -1;
+        uint64_t best_free = 0;
+        struct statvfs fs;
+        for (int i=0; i < num; i++) {
+            if (statvfs(config->data_dir_list[i], &fs)) continue;
+            uint64_t avail = (uint64_t)fs.f_bavail * fs.f_frsize;
+            if (best < 0 || avail > best_free) {
+                best = i;
+                best_free = avail;
+            }
+        }
+        if (best >= 0) return best;
+    }
+
+    // FNV-1a, so the placement is stable across restarts
+    uint32_t hash = 2166136261U;
+    for (unsigned char *c = (unsigned char*)folder_name; *c; c++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+    return hash % num;
+}
 
 /**
- * Initializes a set wrapper.
- * @arg config The configuration to use
- * @arg set_name The name of the set
- * @arg discover Should existing data files be discovered. Otherwise
- * they will be faulted in on-demand.
- * @arg set Output parameter, the new set
- * @return 0 on success
+ * Allocates a proxied set, without touching its folder
  */
-int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set) {
-    // Allocate the buffers
-    hlld_set *s = *set = calloc(1, sizeof(hlld_set));
+static hlld_set* alloc_set(hlld_config *config, char *set_name) {
+    // Allocate the buffers, aligned so the groups of fields
+    // keep to their own cache lines
+    hlld_set *s;
+    if (posix_memalign((void**)&s, HSET_CACHE_LINE, sizeof(hlld_set))) abort();
+    memset(s, 0, sizeof(hlld_set));
 
     // Initialize
     s->is_dirty = 1;
+    s->dirty_since = time(NULL);
     s->is_proxied = 1;
+    s->cached_gen = INVALID_GEN;
+    s->config_size = UINT64_MAX;
 
     // Store the things
     s->config = config;
@@ -64,6 +318,13 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set)
     s->set_config.default_precision = config->default_precision;
     s->set_config.in_memory = config->in_memory;
 
+    // Sets that pre-date these options are always packed, bias corrected
+    // and use murmur, so only new sets make use of the configured ones.
+    s->set_config.format = HLL_PACKED;
+    s->set_config.sparse = 0;
+    s->set_config.estimator = HLL_ESTIMATOR_BIAS;
+    s->set_config.hash = HLL_HASH_MURMUR;
+
     // Get the folder name
     char *folder_name = NULL;
     int res;
@@ -71,15 +332,38 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set)
     assert(res != -1);
 
     // Compute the full path
-    s->full_path = join_path(config->data_dir, folder_name);
+    s->data_dir_index = place_set(config, folder_name);
+    s->data_dir = (config->num_data_dirs) ?
+        config->data_dir_list[s->data_dir_index] : config->data_dir;
+    s->full_path = join_path(s->data_dir, folder_name);
     free(folder_name);
 
     // Initialize the locks
     INIT_HLLD_SPIN(&s->hll_update);
     pthread_mutex_init(&s->hll_lock, NULL);
+    pthread_mutex_init(&s->sparse_lock, NULL);
 
-    // Try to create the folder path
-    res = mkdir(s->full_path, 0755);
+    // Log the raises of the registers for followers
+    if (config->replication_port)
+        s->repl = repl_log_create(s->set_name);
+    return s;
+}
+
+/**
+ * Initializes a set wrapper.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg discover Should existing data files be discovered. Otherwise
+ * they will be faulted in on-demand.
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set) {
+    hlld_set *s = *set = alloc_set(config, set_name);
+    int res;
+
+    // Try to create the folder path, unless another server owns it
+    res = (config->read_only) ? 0 : mkdir(s->full_path, 0755);
     if (res && errno != EEXIST) {
         syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
         return res;
@@ -89,7 +373,13 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set)
     char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
     res = set_config_from_filename(config_name, &s->set_config);
     free(config_name);
-    if (res && res != -ENOENT) {
+    if (!res) {
+        // Dense registers have the size of their last flush
+        s->config_size = s->set_config.size;
+        read_trailer_size(s, &s->set_config.size);
+    } else if (res == -ENOENT) {
+        new_set_config(s, config);
+    } else if (res) {
         syslog(LOG_ERR, "Failed to read set '%s' configuration. Err: %d [%d]", s->set_name, res, errno);
         return res;
     }
@@ -112,6 +402,130 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set)
     return res;
 }
 
+/**
+ * Initializes a proxied set from a known set config, without
+ * reading the config file or touching the set folder. The
+ * folder must already exist. Used to restore many sets quickly.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config The set config, as last flushed
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_set_from_config(hlld_config *config, char *set_name, hlld_set_config *set_config, hlld_set **set) {
+    hlld_set *s = *set = alloc_set(config, set_name);
+    s->set_config = *set_config;
+    return 0;
+}
+
+/**
+ * Initializes a new proxied set, without touching the disk.
+ * Its folder is made once it is first paged in, so that a
+ * create need not wait on the disk.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_new_set(hlld_config *config, char *set_name, hlld_set **set) {
+    hlld_set *s = *set = alloc_set(config, set_name);
+    new_set_config(s, config);
+    s->is_unborn = !config->read_only;
+    return 0;
+}
+
+/**
+ * Takes the settings of a set that has no config file yet
+ * from the configuration, to be written on the first flush.
+ */
+static void new_set_config(hlld_set *s, hlld_config *config) {
+    s->config_stale = 1;
+    // Sets past the bias data precision can be several megabytes,
+    // so they always start sparse to bound the memory of small sets
+    s->set_config.format = config->default_format;
+    s->set_config.sparse = config->sparse ||
+        s->set_config.default_precision > HLL_MAX_BIAS_PRECISION;
+    s->set_config.estimator = config->default_estimator;
+    s->set_config.hash = config->default_hash;
+    s->set_config.window = config->default_window;
+    s->set_config.window_buckets = (config->default_window) ? config->default_window_buckets : 0;
+    s->set_config.sliding = config->default_sliding;
+    s->set_config.kmv = config->default_kmv;
+    s->set_config.expires = (config->default_ttl) ? (uint64_t)time(NULL) + config->default_ttl : 0;
+    s->set_config.durability = config->default_durability;
+    s->set_config.flush_period = config->default_flush_period;
+}
+
+/**
+ * Makes the folder of a new set. A folder that is
+ * already there keeps its settings, like init_set.
+ * Must be called with the hll lock held.
+ */
+static int make_folder(hlld_set *s) {
+    int res = mkdir(s->full_path, 0755);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
+        return res;
+    }
+    if (res) {
+        hlld_set_config set_config = s->set_config;
+        char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
+        res = set_config_from_filename(config_name, &set_config);
+        free(config_name);
+        if (!res) {
+            s->set_config = set_config;
+            s->config_stale = 0;
+            s->config_size = s->set_config.size;
+            read_trailer_size(s, &s->set_config.size);
+        } else if (res != -ENOENT) {
+            syslog(LOG_ERR, "Failed to read set '%s' configuration. Err: %d [%d]", s->set_name, res, errno);
+            return res;
+        }
+    }
+    s->is_unborn = 0;
+    return 0;
+}
+
+/**
+ * Initializes a set from dumped registers, as produced by
+ * hset_dump. Persistent sets write the registers out as their
+ * register file or slot, which is then loaded like any other,
+ * and in-memory sets load them directly.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config The set config of the dump
+ * @arg regs The dumped registers
+ * @arg len The length of the registers
+ * @arg slab The slab to place the registers in, or NULL
+ * @arg set Output parameter, the new set
+ * @return 0 on success, -1 if the registers are corrupt.
+ */
+int init_set_from_dump(hlld_config *config, char *set_name, hlld_set_config *set_config,
+        const unsigned char *regs, uint64_t len, hlld_slab *slab, hlld_set **set) {
+    hlld_set *s = *set = alloc_set(config, set_name);
+    s->set_config = *set_config;
+    if (slab) hset_attach_slab(s, slab);
+
+    // Try to create the folder path
+    int res = mkdir(s->full_path, 0755);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
+        return res;
+    }
+
+    res = load_dumped_registers(s, regs, len);
+    if (res) {
+        syslog(LOG_ERR, "Failed to restore the registers of set '%s'.", s->set_name);
+        return res;
+    }
+    registers_changed(s);
+    s->is_proxied = 0;
+
+    // Write out the config, the registers are already in place
+    s->config_stale = 1;
+    return hset_flush(s);
+}
+
 /**
  * Destroys a set
  * @arg set The set to destroy
@@ -122,6 +536,7 @@ int destroy_set(hlld_set *set) {
     hset_close(set);
 
     // Cleanup
+    if (set->repl) repl_log_destroy(set->repl);
     free(set->set_name);
     free(set->full_path);
     free(set);
@@ -135,9 +550,23 @@ int destroy_set(hlld_set *set) {
  * @return A reference to the counters of a set
  */
 set_counters* hset_counters(hlld_set *set) {
+    struct hset_slot_adds *adds = set->slot_adds;
+    for (int i=0; adds && i < set->num_shadows; i++) {
+        uint64_t num = __sync_lock_test_and_set(&adds[i].adds, 0);
+        if (num) __sync_fetch_and_add(&set->counters.sets, num);
+    }
     return &set->counters;
 }
 
+/**
+ * Returns the index of the data directory of a set
+ * among the data_dirs, or 0 for the data_dir
+ * @notes Thread safe.
+ */
+int hset_data_dir(hlld_set *set) {
+    return set->data_dir_index;
+}
+
 /**
  * Checks if a set is currectly mapped into
  * memory or if it is proxied.
@@ -148,6 +577,60 @@ int hset_is_proxied(hlld_set *set) {
     return set->is_proxied;
 }
 
+/**
+ * Returns how long the set has been dirty.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg set The set
+ * @arg now The current time, in seconds since the epoch
+ * @return Seconds since the set became dirty, or -1 if clean.
+ */
+int64_t hset_dirty_age(hlld_set *set, uint64_t now) {
+    if (set->is_proxied || !set->is_dirty) return -1;
+    uint64_t since = set->dirty_since;
+    return (now > since) ? (int64_t)(now - since) : 0;
+}
+
+/**
+ * Returns the number of dense register pages changed
+ * since the last flush. Sparse sets have no pages.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg set The set
+ * @return The number of dirty pages
+ */
+uint64_t hset_dirty_pages(hlld_set *set) {
+    return set->bm.num_dirty;
+}
+
+/**
+ * Asks the kernel to read the files of a proxied set
+ * ahead, so that paging it in soon after is quicker.
+ * @notes Thread safe.
+ * @arg set The set
+ */
+void hset_readahead(hlld_set *set) {
+    if (!set->is_proxied || set->set_config.in_memory || set->slab) return;
+    const char *name = (set->set_config.window) ? WINDOW_FILE_NAME :
+        (set->set_config.sliding) ? SLIDING_FILE_NAME : DATA_FILE_NAME;
+    char *path = join_path(set->full_path, (char*)name);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/**
+ * Loads the registers of a proxied set into memory.
+ * Idempotent if the set is not proxied.
+ * @notes Thread safe.
+ * @arg set The set
+ * @return 0 on success.
+ */
+int hset_page_in(hlld_set *set) {
+    if (!set->is_proxied) return 0;
+    return thread_safe_fault(set);
+}
+
 /**
  * Flushes the set. Idempotent if the
  * set is proxied or not dirty.
@@ -155,13 +638,12 @@ int hset_is_proxied(hlld_set *set) {
  * @return 0 on success.
  */
 int hset_flush(hlld_set *set) {
-    // Only do things if we are non-proxied
-    if (set->is_proxied)
+    // Only do things if we are non-proxied, and own the files
+    if (set->is_proxied || set->config->read_only)
         return 0;
 
     // Time how long this takes
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+    uint64_t start = hclock_nsec();
 
     // If we are not dirty, nothing to do
     if (!set->is_dirty)
@@ -170,28 +652,103 @@ int hset_flush(hlld_set *set) {
     // Store our properties for a future unmap
     set->set_config.size = hset_size(set);
 
-    // Write out set_config
-    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
-    int res = update_filename_from_set_config(config_name, &set->set_config);
-    free(config_name);
-    if (res) {
-        syslog(LOG_ERR, "Failed to write set '%s' configuration. Err: %d.",
-                set->set_name, res);
-    }
-
     // Turn dirty off
     set->is_dirty = 0;
 
-    // Flush the set
-    res = 0;
+    // Raises logged from here on may miss this flush, so
+    // they need the segments of the WAL from now on
+    uint64_t wal_seq = set->wal_seq;
+    set->wal_flushing = wal_seq;
+    __sync_synchronize();
+    set->wal_seq = 0;
+
+    // Flush the set. Sparse sets are re-written, and the lock
+    // prevents a concurrent conversion from being replaced.
+    int res = 0, trailer = 0;
     if (!set->set_config.in_memory) {
-        res = bitmap_flush(&set->bm);
+        pthread_mutex_lock(&set->sparse_lock);
+        if (hll_is_sparse(&set->hll))
+            res = write_sparse_file(set);
+        else {
+            res = bitmap_flush(&set->bm);
+            if (!res) trailer = !write_register_trailer(set);
+            set->counters.flush_syscalls += set->bm.flush_syscalls;
+            set->counters.flush_bytes += set->bm.flush_bytes;
+            set->counters.flush_clean_pages += set->bm.flush_clean_pages;
+        }
+        pthread_mutex_unlock(&set->sparse_lock);
+        if (!res && set->window && set->window->dirty)
+            res = write_window_file(set);
+        if (!res && set->sliding && set->sliding->dirty)
+            res = write_sliding_file(set);
+        if (!res && set->kmv && set->kmv->dirty)
+            res = write_kmv_file(set);
+    }
+
+    // The config is only rewritten once its settings change. The
+    // trailer of dense registers carries the size, and the config
+    // only keeps it for the other registers.
+    if (set->config_stale || (!trailer && set->set_config.size != set->config_size)) {
+        int config_res = write_set_config(set);
+        if (config_res) {
+            syslog(LOG_ERR, "Failed to write set '%s' configuration. Err: %d.",
+                    set->set_name, config_res);
+        }
     }
 
+    // A failed flush still needs the raises in the WAL
+    if (res && wal_seq) set->wal_seq = wal_seq;
+    set->wal_flushing = 0;
+
     // Compute the elapsed time
-    gettimeofday(&end, NULL);
+    uint64_t nanos = hclock_nsec() - start;
+    set->counters.flushes++;
+    set->counters.flush_nanos += nanos;
+    if (nanos > set->counters.flush_max_nanos) set->counters.flush_max_nanos = nanos;
     syslog(LOG_DEBUG, "Flushed set '%s'. Total time: %d msec.",
-            set->set_name, timediff_msec(&start, &end));
+            set->set_name, (int)(nanos / 1000000));
+    return res;
+}
+
+/**
+ * Cools a set that is mapped from its data file. It stays
+ * mapped, but the kernel reclaims the pages of its registers,
+ * so the next access only reads them back in.
+ * @arg set The set to cool
+ * @return 0 on success, or -1 if the set is not mapped
+ * from a file, and cannot be cooled.
+ */
+int hset_cool(hlld_set *set) {
+    pthread_mutex_lock(&set->hll_lock);
+    int res = -1;
+    if (!set->is_proxied && !set->set_config.in_memory && !hll_is_sparse(&set->hll))
+        res = (bitmap_cool(&set->bm)) ? -1 : 0;
+    pthread_mutex_unlock(&set->hll_lock);
+    return res;
+}
+
+/**
+ * Samples the bytes of a set that are resident in memory, and
+ * the pages of its registers faulted in since the last sample,
+ * into its counters. Walks the page tables of the registers, so
+ * it is left to the maintenance rather than the request paths.
+ * @arg set The set to sample
+ * @return 0 on success, or -1 if the set is proxied.
+ */
+int hset_sample_residency(hlld_set *set) {
+    pthread_mutex_lock(&set->hll_lock);
+    int res = -1;
+    if (!set->is_proxied) {
+        // Only the mapped dense registers may be paged out
+        uint64_t bytes = hset_byte_size(set), resident, faults = 0;
+        if (set->bm.mmap && !hll_is_sparse(&set->hll) &&
+                !bitmap_sample_residency(&set->bm, &resident, &faults))
+            bytes = bytes - set->bm.size + resident;
+        set->counters.resident_bytes = bytes;
+        set->counters.page_faults = faults;
+        res = 0;
+    }
+    pthread_mutex_unlock(&set->hll_lock);
     return res;
 }
 
@@ -203,11 +760,58 @@ int hset_flush(hlld_set *set) {
 int hset_close(hlld_set *set) {
     // Acquire lock
     pthread_mutex_lock(&set->hll_lock);
+    drop_shadows(set);
 
     // Only act if we are non-proxied
     if (!set->is_proxied) {
         hset_flush(set);
+
+        // Encode the dense registers before they are unmapped,
+        // and only keep the encoding if it is actually smaller
+        unsigned char *cold = NULL;
+        uint64_t cold_len = 0;
+        if (set->config->compress_cold && !set->set_config.in_memory &&
+                !set->config->read_only &&
+                !hll_is_sparse(&set->hll) &&
+                !hll_cold_encode(&set->hll, &cold, &cold_len) &&
+                cold_len >= set->bm.size) {
+            free(cold);
+            cold = NULL;
+        }
+
         hll_destroy(&set->hll);
+        if (set->window) {
+            window_destroy(set->window);
+            free(set->window);
+            set->window = NULL;
+        }
+        if (set->sliding) {
+            hll_sliding_destroy(set->sliding);
+            free(set->sliding);
+            set->sliding = NULL;
+        }
+        if (set->kmv) {
+            kmv_destroy(set->kmv);
+            free(set->kmv);
+            set->kmv = NULL;
+        }
+        if (cold) {
+            // The cold file replaces the slot of the registers. The
+            // config takes over the size from the trailer, and the
+            // time of the last write from the dense registers.
+            char *bitmap_path = join_path(set->full_path, (char*)DATA_FILE_NAME);
+            struct stat st;
+            int written = !stat(bitmap_path, &st);
+            free(bitmap_path);
+            if (!write_register_file(set, cold, cold_len)) {
+                if (set->slab) slab_free(set->slab, set->set_name);
+                if (set->set_config.size != set->config_size) write_set_config(set);
+                if (written) keep_last_write(set, &st.st_mtim);
+                syslog(LOG_DEBUG, "Compressed set '%s' to %llu bytes.",
+                        set->set_name, (unsigned long long)cold_len);
+            }
+            free(cold);
+        }
         set->is_proxied = 1;
         set->counters.page_outs += 1;
     }
@@ -217,6 +821,22 @@ int hset_close(hlld_set *set) {
     return 0;
 }
 
+/**
+ * Moves the modification time of the config forward to
+ * that of registers it replaces, so hset_last_write does
+ * not go back in time once they are gone.
+ */
+static void keep_last_write(hlld_set *set, struct timespec *mtime) {
+    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
+    struct stat st;
+    if (!stat(config_name, &st) && (st.st_mtim.tv_sec < mtime->tv_sec ||
+            (st.st_mtim.tv_sec == mtime->tv_sec && st.st_mtim.tv_nsec < mtime->tv_nsec))) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, *mtime};
+        utimensat(AT_FDCWD, config_name, times, 0);
+    }
+    free(config_name);
+}
+
 /**
  * Deletes the set with extreme prejudice.
  * @arg set The set to delete
@@ -225,18 +845,33 @@ int hset_close(hlld_set *set) {
 int hset_delete(hlld_set *set) {
     // Close first
     hset_close(set);
+    if (set->slab) slab_free(set->slab, set->set_name);
+    if (set->is_archived) archive_drop(set->archive, set->set_name);
+    remove_folder(set);
+    return 0;
+}
+
+/**
+ * Moves the folder of a set to the trash, so the files
+ * are deleted in the background, or deletes them here
+ * if it cannot be moved.
+ */
+static void remove_folder(hlld_set *s) {
+    int res = trash_move(s->data_dir, s->full_path);
+    if (!res || res == -ENOENT) return;
+    syslog(LOG_WARNING, "Failed to move set %s to the trash. %s", s->set_name, strerror(-res));
 
     // Delete the files
     struct dirent **namelist = NULL;
     int num;
 
     // Filter only data dirs, in sorted order
-    num = scandir(set->full_path, &namelist, filter_out_special, NULL);
-    syslog(LOG_INFO, "Deleting %d files for set %s.", num, set->set_name);
+    num = scandir(s->full_path, &namelist, filter_out_special, NULL);
+    syslog(LOG_INFO, "Deleting %d files for set %s.", num, s->set_name);
 
     // Free the memory associated with scandir
     for (int i=0; i < num; i++) {
-        char *file_path = join_path(set->full_path, namelist[i]->d_name);
+        char *file_path = join_path(s->full_path, namelist[i]->d_name);
         if (unlink(file_path)) {
             syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
         }
@@ -251,43 +886,1019 @@ int hset_delete(hlld_set *set) {
         free(namelist);
 
     // Delete the directory
-    if (rmdir(set->full_path)) {
-        syslog(LOG_ERR, "Failed to delete: %s. %s", set->full_path, strerror(errno));
+    if (rmdir(s->full_path)) {
+        syslog(LOG_ERR, "Failed to delete: %s. %s", s->full_path, strerror(errno));
     }
+}
 
-    return 0;
+/*
+ * Creates the key of the shadow slots
+ */
+static void shadow_slot_key_init(void) {
+    pthread_key_create(&SHADOW_SLOT_KEY, NULL);
 }
 
 /**
- * Adds a key to the given set
- * @arg set The set to add to
- * @arg key The key to add
- * @return 0 on success.
+ * Names the slot of the calling thread for the shadow registers
+ * of hot sets. Once a set takes adds quickly, the writes of each
+ * thread with a slot go to registers of its own, with no locks or
+ * shared cache lines. These are merged into the set every
+ * shadow_merge_msec by their thread, and by any read of the set.
+ * Workers take their index, and execution threads follow them.
+ * @arg slot The slot, or -1 to write the sets in place
  */
-int hset_add(hlld_set *set, char *key) {
-    if (set->is_proxied) {
-        if (thread_safe_fault(set) != 0) return -1;
+void hset_shadow_thread(int slot) {
+    pthread_once(&SHADOW_SLOT_ONCE, shadow_slot_key_init);
+    pthread_setspecific(SHADOW_SLOT_KEY, (void*)(intptr_t)(slot + 1));
+}
+
+/*
+ * Gives the set shadow registers if it took its last adds
+ * quickly. Sets that log their raises are written in place,
+ * so that each raise is logged as it happens, and only
+ * count their adds per thread.
+ */
+static void check_heat(hlld_set *s) {
+    if (!s->config->shadow_merge_msec || s->shadows || s->slot_adds) return;
+    uint64_t now = hclock_coarse_msec(), last = s->heat_stamp;
+    s->heat_stamp = now;
+    if (!last || now - last >= HSET_HOT_MSEC) return;
+
+    int slots = config_worker_slots(s->config) + s->config->exec_threads;
+    if (s->repl || s->wal) {
+        struct hset_slot_adds *adds;
+        if (posix_memalign((void**)&adds, HSET_CACHE_LINE, slots * sizeof(struct hset_slot_adds)))
+            return;
+        memset(adds, 0, slots * sizeof(struct hset_slot_adds));
+        pthread_once(&SHADOW_SLOT_ONCE, shadow_slot_key_init);
+        s->num_shadows = slots;
+        __sync_synchronize();
+        if (!__sync_bool_compare_and_swap(&s->slot_adds, NULL, adds))
+            free(adds);
+        else
+            syslog(LOG_INFO, "Set '%s' is hot, counting its adds per thread.", s->set_name);
+        return;
     }
+    struct hset_shadow **shadows = calloc(slots, sizeof(struct hset_shadow*));
+    if (!shadows) return;
+    pthread_once(&SHADOW_SLOT_ONCE, shadow_slot_key_init);
+    s->num_shadows = slots;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&s->shadows, NULL, shadows))
+        free(shadows);
+    else
+        syslog(LOG_INFO, "Set '%s' is hot, writing it through shadow registers.", s->set_name);
+}
 
-    // Compute the hash value of the key. We do this
+/*
+ * Returns the shadow registers of the calling thread
+ * for a hot set, or NULL to write the set in place
+ */
+static struct hset_shadow* thread_shadow(hlld_set *s) {
+    struct hset_shadow *volatile *shadows = s->shadows;
+    if (!shadows) return NULL;
+    int slot = thread_slot(s);
+    if (slot < 0) return NULL;
+    struct hset_shadow *sh = shadows[slot];
+    if (sh) return sh;
+
+    // Only this thread fills in its slot
+    sh = calloc(1, sizeof(struct hset_shadow));
+    if (sh) sh->regs = calloc((size_t)1 << s->hll.precision, 1);
+    if (!sh || !sh->regs) {
+        free(sh);
+        return NULL;
+    }
+    sh->merged_at = hclock_coarse_msec();
+    __sync_synchronize();
+    shadows[slot] = sh;
+    return sh;
+}
+
+/*
+ * Merges the raised shadow registers of the calling thread
+ * into the set, and counts its adds
+ */
+static void merge_own_shadow(hlld_set *s, struct hset_shadow *sh) {
+    uint32_t entries[HSET_SHADOW_RAISES];
+    int num = sh->num_raised;
+    for (int i=0; i < num; i++) {
+        uint32_t idx = sh->raised[i];
+        unsigned char val = SHADOW_VAL(sh->regs[idx]);
+        entries[i] = HLL_ENTRY(idx, val);
+        __atomic_store_n(sh->regs + idx, val, __ATOMIC_RELAXED);
+    }
+    if (num) {
+        raise_entries(s, entries, num);
+        mark_dirty(s);
+    }
+    __atomic_store_n(&sh->num_raised, 0, __ATOMIC_RELEASE);
+
+    uint64_t adds = __sync_lock_test_and_set(&sh->adds, 0);
+    if (adds) __sync_fetch_and_add(&s->counters.sets, adds);
+    sh->merged_at = hclock_coarse_msec();
+}
+
+/*
+ * Adds hashes to the shadow registers of the calling thread.
+ * A register is listed once it is raised, and the list is
+ * merged when full or every shadow_merge_msec.
+ */
+static void shadow_add_hashes(hlld_set *s, struct hset_shadow *sh, const uint64_t *hashes, int num) {
+    unsigned char precision = s->hll.precision;
+    for (int i=0; i < num; i++) {
+        uint32_t entry = hll_hash_entry(precision, hashes[i]);
+        uint32_t idx = HLL_ENTRY_IDX(entry);
+        unsigned char val = HLL_ENTRY_VAL(entry), reg = sh->regs[idx];
+        if (val <= SHADOW_VAL(reg)) continue;
+        if (reg & SHADOW_PENDING) {
+            __atomic_store_n(sh->regs + idx, val | SHADOW_PENDING, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // List the register before readers can see it
+        if (sh->num_raised == HSET_SHADOW_RAISES) merge_own_shadow(s, sh);
+        sh->raised[sh->num_raised] = idx;
+        __atomic_store_n(sh->regs + idx, val | SHADOW_PENDING, __ATOMIC_RELAXED);
+        __atomic_store_n(&sh->num_raised, sh->num_raised + 1, __ATOMIC_RELEASE);
+    }
+    __sync_fetch_and_add(&sh->adds, num);
+    if (hclock_coarse_msec() - sh->merged_at >= (uint64_t)s->config->shadow_merge_msec)
+        merge_own_shadow(s, sh);
+}
+
+/*
+ * Merges the raised shadow registers of every thread into
+ * the set before a read. The threads may still be writing,
+ * and keep their registers listed until they merge them.
+ */
+static void merge_shadows(hlld_set *s) {
+    struct hset_shadow *volatile *shadows = s->shadows;
+    if (!shadows) return;
+    uint32_t entries[HSET_SHADOW_RAISES];
+    for (int i=0; i < s->num_shadows; i++) {
+        struct hset_shadow *sh = shadows[i];
+        if (!sh) continue;
+        int num = __atomic_load_n(&sh->num_raised, __ATOMIC_ACQUIRE);
+        for (int j=0; j < num; j++) {
+            uint32_t idx = sh->raised[j];
+            entries[j] = HLL_ENTRY(idx, SHADOW_VAL(__atomic_load_n(sh->regs + idx, __ATOMIC_RELAXED)));
+        }
+        if (num) raise_entries(s, entries, num);
+
+        uint64_t adds = __sync_lock_test_and_set(&sh->adds, 0);
+        if (adds) __sync_fetch_and_add(&s->counters.sets, adds);
+    }
+}
+
+/*
+ * Merges and frees the shadow registers of a set. The set
+ * must not be written meanwhile, as when it is closed.
+ */
+static void drop_shadows(hlld_set *s) {
+    struct hset_slot_adds *adds = s->slot_adds;
+    if (adds) {
+        hset_counters(s);
+        s->slot_adds = NULL;
+        free(adds);
+        s->heat_stamp = 0;
+    }
+
+    struct hset_shadow *volatile *shadows = s->shadows;
+    if (!shadows) return;
+    merge_shadows(s);
+    for (int i=0; i < s->num_shadows; i++) {
+        if (!shadows[i]) continue;
+        free(shadows[i]->regs);
+        free(shadows[i]);
+    }
+    free((void*)shadows);
+    s->shadows = NULL;
+    s->heat_stamp = 0;
+}
+
+/**
+ * Adds a key to the given set
+ * @arg set The set to add to
+ * @arg key The key to add
+ * @return 0 on success, -2 if the set only accepts hashes.
+ */
+int hset_add(hlld_set *set, char *key) {
+    TRACE1(set_add_entry, set->set_name);
+    if (set->set_config.hash == HLL_HASH_EXTERNAL) {
+        TRACE2(set_add_return, set->set_name, -2);
+        return -2;
+    }
+    if (set->is_proxied) {
+        if (thread_safe_fault(set) != 0) {
+            TRACE2(set_add_return, set->set_name, -1);
+            return -1;
+        }
+    }
+
+    // Compute the hash value of the key. We do this
     // so that we can use the hll_add_hash instead of
     // hll_add. This way, the expensive CPU bit can
     // be done without holding a lock
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+    uint64_t hash = hll_hash_key(set->set_config.hash, key, strlen(key));
+    if (set->window) window_add_hashes(set->window, hclock_wall_sec(), &hash, 1);
+    if (set->sliding) hll_sliding_add_hashes(set->sliding, hclock_wall_sec(), &hash, 1);
+    if (set->kmv) kmv_add_hashes(set->kmv, &hash, 1);
+
+    // Hot sets take the add in the registers of this thread
+    struct hset_shadow *sh = thread_shadow(set);
+    if (sh) {
+        shadow_add_hashes(set, sh, &hash, 1);
+        mark_dirty(set);
+        TRACE2(set_add_return, set->set_name, 0);
+        return 0;
+    }
+
+    // Dense registers are updated without a lock. Sparse
+    // updates are serialized, and the check is repeated under
+    // the lock in case the set is converted in the mean time.
+    int convert = 0, changed;
+    if (!hll_is_sparse(&set->hll)) {
+        changed = hll_add_hash(&set->hll, hash);
+    } else {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        changed = hll_add_hash(&set->hll, hash);
+        convert = hll_sparse_should_convert(&set->hll);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    }
+    if (changed) registers_changed(set);
+    if (changed && (set->repl || set->wal)) {
+        uint32_t entry = hll_hash_entry(set->hll.precision, hash);
+        log_raises(set, &entry, 1);
+    }
+    count_sets(set, 1);
+
+    // Mark as dirty, avoiding the store if we can
+    mark_dirty(set);
+
+    // Switch to dense registers once they are more compact
+    if (convert) convert_sparse_set(set);
+    TRACE2(set_add_return, set->set_name, changed);
+    return 0;
+}
+
+/*
+ * Adds a group of hashes to the set one at a time, so that
+ * the raised registers are logged for followers and the WAL.
+ */
+static void add_logged_hash_group(hlld_set *set, const uint64_t *hashes, int num) {
+    uint32_t raised[HSET_BATCH_SIZE];
+    int convert = 0, changed = 0;
+    int sparse = hll_is_sparse(&set->hll);
+    if (sparse) LOCK_HLLD_SPIN(&set->hll_update);
+    for (int i=0; i < num; i++) {
+        if (hll_add_hash(&set->hll, hashes[i]))
+            raised[changed++] = hll_hash_entry(set->hll.precision, hashes[i]);
+    }
+    if (sparse) {
+        convert = hll_sparse_should_convert(&set->hll);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    }
+    if (changed) {
+        registers_changed(set);
+        log_raises(set, raised, changed);
+    }
+    count_sets(set, num);
+
+    // Switch to dense registers once they are more compact
+    if (convert) convert_sparse_set(set);
+}
+
+/*
+ * Adds a group of hashes to the set, locking only if sparse.
+ * Hot sets take them in the shadow registers of the thread.
+ */
+static void add_hash_group(hlld_set *set, const uint64_t *hashes, int num) {
+    if (set->window) window_add_hashes(set->window, hclock_wall_sec(), hashes, num);
+    if (set->sliding) hll_sliding_add_hashes(set->sliding, hclock_wall_sec(), hashes, num);
+    if (set->kmv) kmv_add_hashes(set->kmv, hashes, num);
+    if (set->repl || set->wal) {
+        add_logged_hash_group(set, hashes, num);
+        return;
+    }
+    struct hset_shadow *sh = thread_shadow(set);
+    if (sh) {
+        shadow_add_hashes(set, sh, hashes, num);
+        return;
+    }
+
+    int convert = 0, changed;
+    if (!hll_is_sparse(&set->hll)) {
+        changed = hll_add_hashes(&set->hll, hashes, num);
+    } else {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        changed = hll_add_hashes(&set->hll, hashes, num);
+        convert = hll_sparse_should_convert(&set->hll);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    }
+    if (changed) registers_changed(set);
+    count_sets(set, num);
+
+    // Switch to dense registers once they are more compact
+    if (convert) convert_sparse_set(set);
+}
+
+/**
+ * Adds a batch of keys to the given set. All the
+ * keys are hashed before the update lock is taken once.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg lens The length of each key, or NULL to use strlen
+ * @arg num The number of keys
+ * @return 0 on success, -2 if the set only accepts hashes.
+ */
+int hset_add_batch(hlld_set *set, char **keys, const int *lens, int num) {
+    if (set->set_config.hash == HLL_HASH_EXTERNAL) return -2;
+    if (set->is_proxied) {
+        if (thread_safe_fault(set) != 0) return -1;
+    }
+
+    // Hash in groups without holding the lock
+    uint64_t hashes[HSET_BATCH_SIZE];
+    for (int base=0; base < num; base += HSET_BATCH_SIZE) {
+        int group = (num - base < HSET_BATCH_SIZE) ? num - base : HSET_BATCH_SIZE;
+        for (int i=0; i < group; i++) {
+            char *key = keys[base + i];
+            hashes[i] = hll_hash_key(set->set_config.hash, key,
+                    (lens) ? lens[base + i] : (int)strlen(key));
+        }
+        add_hash_group(set, hashes, group);
+    }
+
+    // Mark as dirty, avoiding the store if we can
+    mark_dirty(set);
+    return 0;
+}
+
+/**
+ * Adds a batch of hashes computed by the client
+ * to a set that uses external hashes.
+ * @arg set The set to add to
+ * @arg hashes The 64 bit hashes to add
+ * @arg num The number of hashes
+ * @return 0 on success, -2 if the set does not accept hashes.
+ */
+int hset_add_hashes(hlld_set *set, const uint64_t *hashes, int num) {
+    return hset_add_hashed(set, HLL_HASH_EXTERNAL, hashes, num);
+}
+
+/**
+ * Adds a batch of keys that were already hashed, so that
+ * keys added to many sets are only hashed once.
+ * @arg set The set to add to
+ * @arg hash The hash function the keys were hashed with
+ * @arg hashes The 64 bit hashes to add
+ * @arg num The number of hashes
+ * @return 0 on success, -1 on error, -2 if the set uses another hash.
+ */
+int hset_add_hashed(hlld_set *set, hll_hash hash, const uint64_t *hashes, int num) {
+    if (set->set_config.hash != hash) return -2;
+    if (set->is_proxied) {
+        if (thread_safe_fault(set) != 0) return -1;
+    }
 
-    // Add the hashed value and update the
-    // counters
+    // Bound how long the sparse lock is held
+    for (int base=0; base < num; base += HSET_BATCH_SIZE) {
+        int group = (num - base < HSET_BATCH_SIZE) ? num - base : HSET_BATCH_SIZE;
+        add_hash_group(set, hashes + base, group);
+    }
+
+    // Mark as dirty, avoiding the store if we can
+    mark_dirty(set);
+    return 0;
+}
+
+/**
+ * Checks if the registers of two sets can be combined,
+ * which requires the same hash function. The registers of
+ * a higher precision are folded down to the lower one.
+ * @return 1 if compatible, 0 otherwise.
+ */
+int hset_compatible(hlld_set *a, hlld_set *b) {
+    return a->set_config.hash == b->set_config.hash;
+}
+
+/**
+ * Merges the registers of another set into a set,
+ * so that it estimates the size of their union. A source
+ * of a higher precision is folded down as it is merged.
+ * Both sets are faulted in if needed.
+ * @note Thread safe.
+ * @arg dst The set to merge into
+ * @arg src The set to merge from. Not modified.
+ * @return 0 on success, -1 on error, -2 if the sets are not
+ * compatible, or the source has a lower precision.
+ */
+int hset_union(hlld_set *dst, hlld_set *src) {
+    if (dst == src) return 0;
+    if (!hset_compatible(dst, src) ||
+            src->set_config.default_precision < dst->set_config.default_precision)
+        return -2;
+
+    // Fault in both sets
+    if (dst->is_proxied && thread_safe_fault(dst) != 0) return -1;
+    if (src->is_proxied && thread_safe_fault(src) != 0) return -1;
+    merge_shadows(src);
+
+    // Snapshot a sparse source, since its entries move as it is
+    // updated. Dense registers can be read while being updated,
+    // and we avoid holding the locks of both sets at once.
+    hll_t copy;
+    hll_t *from = &src->hll;
+    int res;
+    if (hll_is_sparse(&src->hll)) {
+        if (hll_init_sparse(src->hll.precision, src->hll.format, &copy)) return -1;
+        from = &copy;
+        res = hset_merge_into(src, &copy);
+        if (res) {
+            hll_destroy(&copy);
+            return res;
+        }
+    }
+
+    res = union_registers(dst, from);
+    if (from == &copy) hll_destroy(&copy);
+
+    // The smallest hashes only merge from another set keeping them
+    if (!res && dst->kmv && src->kmv) res = kmv_union(dst->kmv, src->kmv);
+    return res;
+}
+
+/**
+ * Merges registers sent by a client into a set, as laid
+ * out by an HLL of that layout, or as a list of entries.
+ * Registers of a higher precision are folded down as they
+ * are merged. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to merge into
+ * @arg precision The precision of the registers
+ * @arg layout The layout of the registers
+ * @arg payload The registers. Sparse entries are little
+ * endian u32s, as packed by HLL_ENTRY.
+ * @arg len The length of the payload
+ * @return 0 on success, -1 on error, -2 if the precision is
+ * lower than that of the set, -3 if the payload is invalid.
+ */
+int hset_merge_raw(hlld_set *set, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *payload, uint64_t len) {
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) return -3;
+    if (precision < set->set_config.default_precision) return -2;
+
+    // Load the payload into an HLL of its own layout, so dense
+    // registers of the same precision use the vectorized kernels
+    hll_t from;
+    int res = 0;
+    if (layout == HSET_RAW_SPARSE) {
+        if (len % sizeof(uint32_t)) return -3;
+        if (hll_init_sparse(precision, set->hll.format, &from)) return -1;
+        uint32_t max_idx = (uint32_t)1 << precision, max_val = 64 - precision + 1;
+        uint32_t entries[HSET_BATCH_SIZE];
+        int num = 0;
+        for (uint64_t i=0; i < len && !res; i += sizeof(uint32_t)) {
+            uint32_t entry = payload[i] | (uint32_t)payload[i + 1] << 8 |
+                (uint32_t)payload[i + 2] << 16 | (uint32_t)payload[i + 3] << 24;
+            if (HLL_ENTRY_IDX(entry) >= max_idx || !HLL_ENTRY_VAL(entry) ||
+                    HLL_ENTRY_VAL(entry) > max_val) {
+                res = -3;
+                break;
+            }
+            entries[num++] = entry;
+            if (num == HSET_BATCH_SIZE || i + sizeof(uint32_t) == len) {
+                hll_raise_registers(&from, entries, num);
+                num = 0;
+            }
+        }
+    } else if (layout == HSET_RAW_PACKED || layout == HSET_RAW_BYTE || layout == HSET_RAW_NIBBLE) {
+        hll_format format = (layout == HSET_RAW_NIBBLE) ? HLL_NIBBLE : (hll_format)layout;
+        if (hll_init(precision, format, &from)) return -1;
+        if (hll_load_registers(&from, payload, len) || !hll_registers_valid(&from))
+            res = -3;
+    } else
+        return -3;
+
+    if (!res && set->is_proxied && thread_safe_fault(set) != 0) res = -1;
+    if (!res) res = union_registers(set, &from);
+    hll_destroy(&from);
+    return (res == -2) ? -1 : res;
+}
+
+/**
+ * Reads the registers of a set, in the layouts taken by
+ * hset_merge_raw. Dense registers are passed from where the
+ * set keeps them, without a copy, so they may be raised while
+ * the callback runs. Sparse sets are always listed as entries.
+ * The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg sparse Should dense registers be listed as entries
+ * @arg cb Invoked with the registers
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, -1 on error.
+ */
+int hset_raw_registers(hlld_set *set, int sparse, hset_raw_cb cb, void *data) {
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+    merge_shadows(set);
+
+    // Dense registers stay dense, and are passed
+    // straight from the register file mapping
+    hll_t *h = &set->hll;
+    if (!sparse && !hll_is_sparse(h)) {
+        hset_raw_layout layout = (h->format == HLL_NIBBLE) ? HSET_RAW_NIBBLE :
+            (hset_raw_layout)h->format;
+        cb(data, h->precision, layout, (unsigned char*)h->registers,
+                hll_bytes_for_precision(h->precision, h->format));
+        return 0;
+    }
+
+    // Sparse entries must be read under the update lock
+    uint32_t *entries = malloc(((uint64_t)1 << h->precision) * sizeof(uint32_t));
+    if (!entries) return -1;
     LOCK_HLLD_SPIN(&set->hll_update);
-    hll_add_hash(&set->hll, out[1]);
-    set->counters.sets += 1;
+    int num = hll_register_entries(h, entries);
     UNLOCK_HLLD_SPIN(&set->hll_update);
 
-    // Mark as dirty
-    set->is_dirty = 1;
+    // Entries are sent little endian
+    unsigned char *out = (unsigned char*)entries;
+    for (int i=0; i < num; i++) {
+        uint32_t entry = entries[i];
+        for (int b=0; b < 4; b++) out[4 * i + b] = (entry >> (8 * b)) & 0xff;
+    }
+    cb(data, h->precision, HSET_RAW_SPARSE, out, (uint64_t)num * sizeof(uint32_t));
+    free(entries);
+    return 0;
+}
+
+/**
+ * Merges the registers of an HLL into a set that is in memory
+ * @arg dst The set to merge into
+ * @arg from The HLL to merge, of at least the precision of the set
+ * @return 0 on success, -2 on error.
+ */
+static int union_registers(hlld_set *dst, hll_t *from) {
+    // Merge the registers, dense registers do not need the lock
+    int res, convert = 0;
+    if (!hll_is_sparse(&dst->hll)) {
+        res = hll_union(&dst->hll, from);
+    } else {
+        LOCK_HLLD_SPIN(&dst->hll_update);
+        res = hll_union(&dst->hll, from);
+        convert = hll_sparse_should_convert(&dst->hll);
+        UNLOCK_HLLD_SPIN(&dst->hll_update);
+    }
+
+    // Merged keys count as seen in the current interval
+    if (!res && dst->window) res = window_union(dst->window, time(NULL), from);
+    if (!res && dst->sliding) res = hll_sliding_union(dst->sliding, time(NULL), from);
+
+    // The WAL has no resync, so it is sent every merged register
+    if (!res && dst->wal) {
+        uint32_t *entries = malloc(((uint64_t)1 << from->precision) * sizeof(uint32_t));
+        if (entries) {
+            int num = hll_register_entries(from, entries);
+            for (int i=0; i < num && from->precision != dst->hll.precision; i++)
+                entries[i] = hll_fold_entry(entries[i], from->precision, dst->hll.precision);
+            wal_append(dst->wal, &dst->wal_seq, dst->set_name, &dst->set_config, entries, num);
+            free(entries);
+        }
+    }
+    if (res) return -2;
+
+    // Mark as dirty. The raises are not logged, so
+    // followers are sent all the registers instead.
+    registers_changed(dst);
+    mark_dirty(dst);
+    if (dst->repl) repl_log_resync(dst->repl);
+
+    // Switch to dense registers once they are more compact
+    if (convert) convert_sparse_set(dst);
+    return 0;
+}
+
+/**
+ * Merges the registers of a set into an HLL owned
+ * by the caller. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to merge from. Not modified.
+ * @arg h The HLL to merge into, of at most the precision of the set
+ * @return 0 on success, -1 on error, -2 if the HLL has a
+ * higher precision.
+ */
+int hset_merge_into(hlld_set *set, hll_t *h) {
+    if (h->precision > set->set_config.default_precision)
+        return -2;
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+    merge_shadows(set);
+
+    // Sparse entries must be read under the update lock
+    if (hll_is_sparse(&set->hll)) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        hll_union(h, &set->hll);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    } else {
+        hll_union(h, &set->hll);
+    }
+    return 0;
+}
+
+/*
+ * Raises the registers of a resident set to at least
+ * the value of each entry, without logging the raises
+ */
+static void raise_entries(hlld_set *s, const uint32_t *entries, int num) {
+    // Bound how long the sparse lock is held
+    for (int base=0; base < num; base += HSET_BATCH_SIZE) {
+        int group = (num - base < HSET_BATCH_SIZE) ? num - base : HSET_BATCH_SIZE;
+        int convert = 0;
+        if (!hll_is_sparse(&s->hll)) {
+            hll_raise_registers(&s->hll, entries + base, group);
+        } else {
+            LOCK_HLLD_SPIN(&s->hll_update);
+            hll_raise_registers(&s->hll, entries + base, group);
+            convert = hll_sparse_should_convert(&s->hll);
+            UNLOCK_HLLD_SPIN(&s->hll_update);
+        }
+        if (convert) convert_sparse_set(s);
+    }
+    registers_changed(s);
+}
+
+/**
+ * Raises the registers of a set to at least the value
+ * of each entry, as streamed from a primary. The set is
+ * faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to update
+ * @arg entries The register entries, as packed by HLL_ENTRY
+ * @arg num The number of entries
+ * @return 0 on success, -1 on error.
+ */
+int hset_raise_registers(hlld_set *set, const uint32_t *entries, int num) {
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+    raise_entries(set, entries, num);
+    mark_dirty(set);
+
+    // Pass the raises on to our own followers and the WAL
+    log_raises(set, entries, num);
     return 0;
 }
 
+/**
+ * Takes the register raises to stream to followers. If
+ * raises were lost, or full is set, an entry of every
+ * register that is not zero is returned instead, and the
+ * set is faulted in if needed. A full read leaves the
+ * logged raises in place.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg full Should every register be returned
+ * @arg entries Output, a malloc()'d list of register entries,
+ * or NULL to drop the raises
+ * @return The number of entries, or -1 on error.
+ */
+int hset_replication_entries(hlld_set *set, int full, uint32_t **entries) {
+    uint32_t *raises = NULL;
+    int resync = 0, num = 0;
+    if (set->repl && !full) {
+        num = repl_log_take(set->repl, &raises, &resync);
+        if (!entries) {
+            free(raises);
+            return 0;
+        }
+        *entries = raises;
+        if (!resync) return num;
+        free(raises);
+        *entries = NULL;
+    }
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+
+    *entries = malloc(((uint64_t)1 << set->set_config.default_precision) * sizeof(uint32_t));
+    if (!*entries) return -1;
+    if (hll_is_sparse(&set->hll)) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        num = hll_register_entries(&set->hll, *entries);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    } else {
+        num = hll_register_entries(&set->hll, *entries);
+    }
+    return num;
+}
+
+/**
+ * Logs the raises of a persistent set to a write-ahead
+ * log from now on, unless it is volatile. Must be called
+ * before the set is used.
+ * @arg set The set
+ * @arg wal The write-ahead log
+ */
+void hset_attach_wal(hlld_set *set, hlld_wal *wal) {
+    if (!set->set_config.in_memory && set->set_config.durability != DURABILITY_VOLATILE)
+        set->wal = wal;
+}
+
+/**
+ * Keeps the dense registers of a persistent set in a slot of
+ * the slab from now on, rather than a file of their own. Sets
+ * with a register file keep using it. Must be called before
+ * the set is used.
+ * @arg set The set
+ * @arg slab The slab
+ */
+void hset_attach_slab(hlld_set *set, hlld_slab *slab) {
+    // Slots are read into memory, and never mapped
+    if (!set->set_config.in_memory && !set->config->use_mmap) set->slab = slab;
+}
+
+/**
+ * Lets a persistent set be moved into an archive, and notices
+ * if it is already there. A set is archived if the archive has
+ * it, and its folder has no config, as a set is only removed
+ * from the archive once its folder is complete again. Must be
+ * called before the set is used.
+ * @arg set The set
+ * @arg archive The archive
+ */
+void hset_attach_archive(hlld_set *set, hlld_archive *archive) {
+    hlld_set_config *sc = &set->set_config;
+    if (sc->in_memory || sc->window || sc->sliding || sc->kmv) return;
+    set->archive = archive;
+    if (!archive_contains(archive, set->set_name)) return;
+
+    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
+    struct stat buf;
+    set->is_archived = stat(config_name, &buf) != 0;
+    free(config_name);
+}
+
+/**
+ * Checks if a set is in the archive, rather than its folder
+ * @note Thread safe.
+ * @return 1 if archived, else 0.
+ */
+int hset_is_archived(hlld_set *set) {
+    return set->is_archived;
+}
+
+/**
+ * Moves a proxied set into its archive, then removes its
+ * folder. The registers are archived in their encoded form,
+ * so a dense register file is faulted in to encode it. The
+ * next page in restores the folder from the archive.
+ * @arg set The set
+ * @return 0 on success, -1 if the set is not proxied, or is
+ * in-memory, windowed, sliding or keeps its smallest hashes,
+ * or could not be archived.
+ */
+int hset_archive(hlld_set *set) {
+    hlld_set_config *sc = &set->set_config;
+    if (!set->archive || !set->is_proxied || sc->in_memory || sc->window || sc->sliding ||
+            sc->kmv)
+        return -1;
+    if (set->is_archived) return 0;
+
+    // The dump of a proxied set copies its register file as it is
+    unsigned char *regs;
+    uint64_t len;
+    if (hset_dump(set, &regs, &len)) return -1;
+    if (len == hll_bytes_for_precision(sc->default_precision, sc->format)) {
+        free(regs);
+        if (thread_safe_fault(set) || hset_dump(set, &regs, &len)) {
+            hset_close(set);
+            return -1;
+        }
+    }
+
+    // A set faulted in by the dump is closed again
+    hset_close(set);
+
+    // The folder is only removed once the archive has the set
+    int res = -1;
+    pthread_mutex_lock(&set->hll_lock);
+    if (set->is_proxied && !archive_put(set->archive, set->set_name, sc, regs, len)) {
+        if (set->slab) slab_free(set->slab, set->set_name);
+        remove_folder(set);
+        set->is_archived = 1;
+        res = 0;
+        syslog(LOG_DEBUG, "Archived set '%s' in %llu bytes.", set->set_name,
+                (unsigned long long)len);
+    }
+    pthread_mutex_unlock(&set->hll_lock);
+    free(regs);
+    return res;
+}
+
+/**
+ * Returns the oldest segment of the write-ahead log
+ * the set needs, as it holds raises not yet flushed.
+ * @note Thread safe.
+ * @arg set The set
+ * @return The segment, or 0 if none is needed.
+ */
+uint64_t hset_wal_seq(hlld_set *set) {
+    // Read in the opposite order of hset_flush, so a
+    // flush starting in between is seen in wal_flushing
+    uint64_t seq = set->wal_seq;
+    __sync_synchronize();
+    uint64_t flushing = set->wal_flushing;
+    if (!seq || (flushing && flushing < seq)) return flushing;
+    return seq;
+}
+
+/**
+ * Returns when a set was last written. Only the flush of a
+ * write touches the trailer of dense registers, or rewrites
+ * the config of other sets, so for a clean set this is when
+ * the newer of them was last written.
+ * @arg set The set
+ * @return Seconds since the epoch, or 0 if unknown.
+ */
+uint64_t hset_last_write(hlld_set *set) {
+    if (!set->is_proxied && set->is_dirty) return set->dirty_since;
+    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
+    struct stat buf;
+    int res = stat(config_name, &buf);
+    free(config_name);
+    if (res) return 0;
+    uint64_t last = buf.st_mtime;
+
+    uint64_t size = hll_bytes_for_precision(set->set_config.default_precision,
+            set->set_config.format);
+    char *bitmap_path = join_path(set->full_path, (char*)DATA_FILE_NAME);
+    if (!stat(bitmap_path, &buf) && (uint64_t)buf.st_size == size + sizeof(register_trailer) &&
+            (uint64_t)buf.st_mtime > last)
+        last = buf.st_mtime;
+    free(bitmap_path);
+    return last;
+}
+
+/**
+ * Mixes the inode, size and modification time of each
+ * file of a set, so a change to any of them is noticed.
+ */
+static uint64_t disk_stamp(hlld_set *s) {
+    const char *names[] = {CONFIG_FILENAME, DATA_FILE_NAME,
+        WINDOW_FILE_NAME, SLIDING_FILE_NAME, KMV_FILE_NAME};
+    uint64_t stamp = 14695981039346656037ULL;
+    struct stat buf;
+    for (int i=0; i < 5; i++) {
+        char *path = join_path(s->full_path, (char*)names[i]);
+        int res = stat(path, &buf);
+        free(path);
+        if (res) memset(&buf, 0, sizeof(buf));
+        uint64_t parts[] = {buf.st_ino, buf.st_size, buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec};
+        for (int j=0; j < 4; j++) stamp = (stamp ^ parts[j]) * 1099511628211ULL;
+    }
+    return stamp;
+}
+
+/**
+ * Notices the files of a set written by the server that owns
+ * the data directory. The set is closed if any of them changed,
+ * and adopts its new config, so the next read faults in the
+ * new registers. Must be called with the set held exclusively.
+ * @arg set The set
+ * @return 0 if nothing changed, 1 if the set was closed, or
+ * -1 if the config could not be read, or changed as it was read.
+ */
+int hset_refresh(hlld_set *set) {
+    uint64_t stamp = disk_stamp(set);
+    if (stamp == set->disk_stamp) return 0;
+
+    hlld_set_config set_config = set->set_config;
+    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
+    int res = set_config_from_filename(config_name, &set_config);
+    free(config_name);
+    if (res || disk_stamp(set) != stamp) return -1;
+
+    hset_close(set);
+    set->set_config = set_config;
+    read_trailer_size(set, &set->set_config.size);
+    set->disk_stamp = stamp;
+    registers_changed(set);
+    return 1;
+}
+
+/**
+ * Folds the registers of a persistent set down to a lower
+ * precision, with hll_fold, and writes them out in place of
+ * its registers along with its new config. The set is left
+ * proxied if it was. Windowed and sliding sets are not folded.
+ * @arg set The set
+ * @arg precision The new precision
+ * @return 0 on success, or if the set is already at or below
+ * the precision, -1 on error.
+ */
+int hset_fold(hlld_set *set, unsigned char precision) {
+    hlld_set_config *sc = &set->set_config;
+    if (sc->in_memory || sc->window || sc->sliding || precision < HLL_MIN_PRECISION)
+        return -1;
+    if (precision >= sc->default_precision) return 0;
+    int proxied = set->is_proxied;
+    if (proxied && thread_safe_fault(set)) return -1;
+    drop_shadows(set);
+
+    // Fold a copy, as the registers may be in a bitmap
+    hll_t folded;
+    int res = (hll_is_sparse(&set->hll)) ?
+        hll_init_sparse(sc->default_precision, sc->format, &folded) :
+        hll_init(sc->default_precision, sc->format, &folded);
+    if (res) return -1;
+    if (hll_union(&folded, &set->hll) || hll_fold(&folded, precision)) {
+        hll_destroy(&folded);
+        return -1;
+    }
+
+    // Sparse registers are dumped encoded, dense ones as they are
+    unsigned char *regs = (unsigned char*)folded.registers;
+    uint64_t len = hll_bytes_for_precision(precision, sc->format);
+    int sparse = hll_is_sparse(&folded);
+    if (sparse && hll_sparse_encode(&folded, &regs, &len)) {
+        hll_destroy(&folded);
+        return -1;
+    }
+
+    // Swap in the folded registers, as if they were restored.
+    // The old precision is kept if they cannot be written.
+    pthread_mutex_lock(&set->hll_lock);
+    hll_destroy(&set->hll);
+    unsigned char old_precision = sc->default_precision;
+    sc->default_precision = precision;
+    sc->default_eps = hll_error_for_precision(precision);
+    res = load_dumped_registers(set, regs, len);
+    if (res) {
+        sc->default_precision = old_precision;
+        sc->default_eps = hll_error_for_precision(old_precision);
+        set->is_proxied = 1;
+    }
+    registers_changed(set);
+    mark_dirty(set);
+    if (!res) set->config_stale = 1;
+    pthread_mutex_unlock(&set->hll_lock);
+    if (sparse) free(regs);
+    hll_destroy(&folded);
+    if (res) {
+        syslog(LOG_ERR, "Failed to fold set '%s' to precision %d.", set->set_name, precision);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Folded set '%s' from precision %d to %d.", set->set_name,
+            old_precision, precision);
+    res = hset_flush(set);
+    if (proxied) hset_close(set);
+    return res;
+}
+
+/**
+ * Dumps the registers of a set as the contents of a register
+ * file. Sparse sets are encoded, and dense sets use the cold
+ * encoding where that is smaller. Proxied sets are copied from
+ * their register file, rather than faulted in.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg regs Output, a malloc()'d buffer of the registers
+ * @arg len Output, the length of the registers
+ * @return 0 on success, -1 on error.
+ */
+int hset_dump(hlld_set *set, unsigned char **regs, uint64_t *len) {
+    if (set->is_archived && !archive_get(set->archive, set->set_name, regs, len))
+        return 0;
+    if (set->is_proxied && !set->set_config.in_memory && !dump_register_file(set, regs, len))
+        return 0;
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+    merge_shadows(set);
+
+    // The lock keeps a conversion from swapping the registers
+    int res = 0;
+    pthread_mutex_lock(&set->sparse_lock);
+    if (hll_is_sparse(&set->hll)) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        res = hll_sparse_encode(&set->hll, regs, len);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+        goto LEAVE;
+    }
+
+    // Most dense registers are small, and compress well
+    if (!hll_cold_encode(&set->hll, regs, len)) {
+        if (*len < set->bm.size) goto LEAVE;
+        free(*regs);
+    }
+    *regs = malloc(set->bm.size);
+    if (!*regs) {
+        res = -1;
+        goto LEAVE;
+    }
+    memcpy(*regs, set->bm.mmap, set->bm.size);
+    *len = set->bm.size;
+
+LEAVE:
+    pthread_mutex_unlock(&set->sparse_lock);
+    return res;
+}
+
 /**
  * Gets the size of the set
  * @note Thread safe.
@@ -295,80 +1906,298 @@ int hset_add(hlld_set *set, char *key) {
  * @return The estimated size of the set
  */
 uint64_t hset_size(hlld_set *set) {
-    if (!set->is_proxied) {
-        return hll_size(&set->hll);
-    } else {
+    if (set->is_proxied)
         return set->set_config.size;
+    merge_shadows(set);
+
+    // Use the cached estimate if no register moved since
+    uint64_t gen, size;
+    if (read_cached_size(set, &gen, &size)) return size;
+
+    // Sparse estimates compact the pending entries, so
+    // they must be serialized with the updates. Estimates are
+    // rounded, as the histogram estimator can land just below
+    // small exact counts.
+    double est;
+    if (hll_is_sparse(&set->hll)) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        est = hll_estimate(&set->hll, set->set_config.estimator);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    } else {
+        est = hll_estimate(&set->hll, set->set_config.estimator);
     }
+    size = est + 0.5;
+
+    // Refresh the cache, unless another reader is doing so
+    if (__sync_bool_compare_and_swap(&set->cache_lock, 0, 1)) {
+        set->cached_gen = INVALID_GEN;
+        __sync_synchronize();
+        set->cached_size = size;
+        __sync_synchronize();
+        set->cached_gen = gen;
+        __sync_lock_release(&set->cache_lock);
+    }
+    return size;
+}
+
+/**
+ * Reads the cached size of a set, without locks and without
+ * storing to memory, so readers never take the cache lines
+ * of the set from its writers. The cache is a seqlock over
+ * the estimate, keyed by the register generation: a refresh
+ * invalidates the generation, stores the estimate, then
+ * publishes the generation it estimated.
+ * @note Thread safe, and safe without the set lock.
+ * @arg set The set
+ * @arg size Output, the cached size
+ * @return 1 if the size was read, 0 if it must be estimated.
+ */
+int hset_read_size(hlld_set *set, uint64_t *size) {
+    if (set->is_proxied) {
+        *size = set->set_config.size;
+        return 1;
+    }
+
+    // Shadow registers hold raises the cache has not seen
+    if (set->shadows) return 0;
+    uint64_t gen;
+    return read_cached_size(set, &gen, size);
+}
+
+/**
+ * Reads the size of a set without touching its registers,
+ * so that catalog scans never fault a set in. Proxied sets,
+ * and sets whose estimate is not cached, answer with the
+ * size of their last flush, from their config or the
+ * manifest, which is marked as stale.
+ * @note Thread safe, and safe without the set lock.
+ * @arg set The set
+ * @arg size Output, the size
+ * @return 0 if the size is current, 1 if it is stale.
+ */
+int hset_metadata_size(hlld_set *set, uint64_t *size) {
+    if (!set->is_proxied && hset_read_size(set, size)) return 0;
+    *size = set->set_config.size;
+    return 1;
+}
+
+/*
+ * Reads the cached estimate if it is of the current register
+ * generation. The generation is re-read after the estimate,
+ * to detect a concurrent refresh.
+ */
+static int read_cached_size(hlld_set *s, uint64_t *gen, uint64_t *size) {
+    *gen = __atomic_load_n(&s->reg_gen, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->cached_gen, __ATOMIC_ACQUIRE) != *gen) return 0;
+    uint64_t cached = __atomic_load_n(&s->cached_size, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->cached_gen, __ATOMIC_RELAXED) != *gen) return 0;
+    *size = cached;
+    return 1;
+}
+
+/**
+ * Checks if the size of a set is cached, so that
+ * hset_size will not need to estimate it. Writes
+ * may race with the check, so it is only a hint.
+ * @arg set The set to check
+ * @return 1 if the size is cached, 0 otherwise.
+ */
+int hset_size_cached(hlld_set *set) {
+    return set->is_proxied || set->cached_gen == set->reg_gen;
+}
+
+/**
+ * Gets the byte size of the set
+ * @note Thread safe.
+ * @arg set The set
+ * @return The total byte size of the set
+ */
+uint64_t hset_byte_size(hlld_set *set) {
+    uint64_t bytes = 0;
+    if (!set->is_proxied && hll_is_sparse(&set->hll)) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        bytes = hll_sparse_bytes(&set->hll);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+    }
+    if (!bytes)
+        bytes = (set->bm.size) ? set->bm.size :
+            hll_bytes_for_precision(set->set_config.default_precision, set->set_config.format);
+    if (set->window)
+        bytes += window_bytes(set->window);
+    if (set->sliding)
+        bytes += hll_sliding_bytes(set->sliding->precision);
+    if (set->kmv)
+        bytes += kmv_bytes(set->kmv->k);
+    return bytes;
+}
+
+/**
+ * Gets the bytes of a set resident in memory as of the last
+ * residency sample. Sets whose registers are not mapped, or
+ * have yet to be sampled, are taken to be wholly resident.
+ * @note Thread safe.
+ * @arg set The set
+ * @return The resident bytes, or 0 if the set is proxied
+ */
+uint64_t hset_resident_bytes(hlld_set *set) {
+    if (set->is_proxied) return 0;
+    if (set->bm.resident) return set->counters.resident_bytes;
+    return hset_byte_size(set);
+}
+
+/**
+ * Estimates the keys added to a windowed or sliding set
+ * over its recent intervals. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg span The seconds to cover. Windowed sets round it
+ * up to whole intervals.
+ * @arg est Output, the estimate
+ * @return 0 on success, -1 on error, -2 if the set is not windowed.
+ */
+int hset_size_window(hlld_set *set, uint64_t span, uint64_t *est) {
+    if (!set->set_config.window && !set->set_config.sliding) return -2;
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+
+    // Merge the buckets through the union kernel, or recover
+    // the registers of the window from the timestamped values
+    hll_t *scratch = hll_scratch(set->set_config.default_precision, 0);
+    if (!scratch) return -1;
+    if (set->window)
+        window_merge_into(set->window, time(NULL), span, scratch);
+    else
+        hll_sliding_merge_into(set->sliding, time(NULL), span, scratch);
+    *est = hll_estimate(scratch, set->set_config.estimator) + 0.5;
+    return 0;
 }
 
 /**
- * Gets the byte size of the set
+ * Copies the smallest hashes kept by a set, so that they can
+ * be compared with those of other sets without holding it.
+ * The set is faulted in if needed.
  * @note Thread safe.
  * @arg set The set
- * @return The total byte size of the set
+ * @arg out Output, the copy. Must be destroyed with kmv_destroy.
+ * @return 0 on success, -1 on error, -2 if the set keeps no hashes.
  */
-uint64_t hset_byte_size(hlld_set *set) {
-    if (set->bm.size)
-        return set->bm.size;
-    return hll_bytes_for_precision(set->set_config.default_precision);
+int hset_copy_kmv(hlld_set *set, kmv_sketch *out) {
+    if (!set->set_config.kmv) return -2;
+    if (set->is_proxied && thread_safe_fault(set) != 0) return -1;
+    if (kmv_init(set->kmv->k, out)) return -1;
+    if (kmv_union(out, set->kmv)) {
+        kmv_destroy(out);
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Provides a thread safe faulting of the set.
  */
 static int thread_safe_fault(hlld_set *s) {
-    // Acquire lock
+    // Acquire lock. The trace includes waiting for
+    // it, so that faults of the same set are seen.
     int res = 0;
     char *bitmap_path = NULL;
+    TRACE1(set_fault_begin, s->set_name);
+    uint64_t start = slowlog_phase_start();
     pthread_mutex_lock(&s->hll_lock);
 
     // Bail if we already faulted in
     if (!s->is_proxied)
         goto LEAVE;
 
+    // New sets make their folder first
+    if (s->is_unborn && (res = make_folder(s)))
+        goto LEAVE;
+
     // Determine the expected size
-    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision);
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
 
     // Get the mode for our bitmap
-    bitmap_mode mode;
-    if (s->set_config.in_memory) {
-        mode = ANONYMOUS;
+    bitmap_mode mode = registers_mode(s);
+    if (s->set_config.in_memory && s->set_config.sparse) {
+        res = hll_init_sparse(s->set_config.default_precision,
+                s->set_config.format, &s->hll);
+        goto DONE;
+
+    } else if (s->set_config.in_memory) {
         res = bitmap_from_file(-1, size, mode, &s->bm);
 
         // Skip the fault in
         goto CREATE_HLL;
 
-    } else if (s->config->use_mmap) {
-        mode = SHARED;
-
-    } else {
-        mode = PERSISTENT;
+    // Archived sets restore their folder first
+    } else if (s->is_archived) {
+        res = rehydrate_set(s);
+        if (!res) s->counters.page_ins += 1;
+        goto DONE;
     }
 
     // Get the full path to the bitmap
     bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
 
-    // Check if the register file exists
+    // Check if the register file exists. A register
+    // file replaces any slot left by a crash.
     struct stat buf;
     res = stat(bitmap_path, &buf);
+    int missing = (res == -1 && errno == ENOENT);
+    if (res == 0 && s->slab) slab_free(s->slab, s->set_name);
+
+    // A read only server never creates the registers, so
+    // a set without any yet is empty until they are flushed
+    if (missing && s->config->read_only) {
+        res = hll_init_sparse(s->set_config.default_precision,
+                s->set_config.format, &s->hll);
+        goto DONE;
+    }
+
+    // Anything other than the dense size, with or without
+    // a trailer, is a sparse or cold register file
+    int trailer = (res == 0 && (uint64_t)buf.st_size == size + sizeof(register_trailer));
+    if (res == 0 && (uint64_t)buf.st_size != size && !trailer) {
+        syslog(LOG_INFO, "Discovered encoded HLL set: %s.", bitmap_path);
+        res = read_register_file(s, bitmap_path, buf.st_size, mode);
+        if (!res) s->counters.page_ins += 1;
+        goto DONE;
 
     // Handle if the file exists
-    if (res == 0) {
+    } else if (res == 0) {
         syslog(LOG_INFO, "Discovered HLL set: %s.", bitmap_path);
-        res = bitmap_from_filename(bitmap_path, buf.st_size, 0, mode, &s->bm);
+        res = bitmap_from_filename(bitmap_path, size, 0, mode, &s->bm);
         if (res) {
             syslog(LOG_ERR, "Failed to load bitmap: %s. %s", bitmap_path, strerror(errno));
             goto LEAVE;
         }
+        if (trailer && (res = check_register_trailer(s))) {
+            bitmap_close(&s->bm);
+            goto LEAVE;
+        }
 
         // Increase our page ins
         s->counters.page_ins += 1;
 
+    // Handle if the registers are in the slab
+    } else if (missing && s->slab && (res = open_slot_registers(s, size, mode, 0)) != -ENOENT) {
+        if (res) goto LEAVE;
+        syslog(LOG_INFO, "Discovered HLL set in the slab: %s.", s->set_name);
+        s->counters.page_ins += 1;
+
     // Handle if it doesn't exist
-    } else if (res == -1 && errno == ENOENT) {
+    } else if (missing && s->set_config.sparse) {
+        syslog(LOG_INFO, "Creating sparse HLL set: %s.", bitmap_path);
+        res = hll_init_sparse(s->set_config.default_precision,
+                s->set_config.format, &s->hll);
+        goto DONE;
+
+    } else if (missing && !(res = open_slot_registers(s, size, mode, 1))) {
+        syslog(LOG_INFO, "Creating HLL set in the slab: %s.", s->set_name);
+
+    } else if (missing) {
         syslog(LOG_INFO, "Creating HLL set: %s.", bitmap_path);
-        res = bitmap_from_filename(bitmap_path, size, 1, mode, &s->bm);
+        res = bitmap_from_filename(bitmap_path, size, 1, create_mode(s, mode), &s->bm);
         if (res) {
             syslog(LOG_ERR, "Failed to create bitmap: %s. %s", bitmap_path, strerror(errno));
             goto LEAVE;
@@ -383,12 +2212,28 @@ static int thread_safe_fault(hlld_set *s) {
 CREATE_HLL:
     // Create the HLL
     res = hll_init_from_bitmap(s->set_config.default_precision,
-                &s->bm, &s->hll);
+                s->set_config.format, &s->bm, &s->hll);
+
+DONE:
+    // Windowed sets load their buckets alongside the registers
+    if (!res && s->set_config.window) {
+        res = open_window(s);
+        if (res) hll_destroy(&s->hll);
+    }
+    if (!res && s->set_config.sliding) {
+        res = open_sliding(s);
+        if (res) hll_destroy(&s->hll);
+    }
+    if (!res && s->set_config.kmv) {
+        res = open_kmv(s);
+        if (res) hll_destroy(&s->hll);
+    }
 
     // Disable proxied
-    if (!res)
+    if (!res) {
+        registers_changed(s);
         s->is_proxied = 0;
-    else
+    } else
         syslog(LOG_ERR, "Failed to create HLL! Res: %d", res);
 
 LEAVE:
@@ -397,6 +2242,670 @@ LEAVE:
 
     // Free the bitmap path if any
     if (bitmap_path) free(bitmap_path);
+    slowlog_phase_end(PHASE_FAULT, start);
+    TRACE2(set_fault_end, s->set_name, res);
+    return res;
+}
+
+/**
+ * Restores the folder of an archived set, and loads its
+ * registers. The config is written last, and the set is
+ * only then dropped from the archive, so a crash leaves
+ * either a complete folder or the archived set.
+ */
+static int rehydrate_set(hlld_set *s) {
+    unsigned char *regs;
+    uint64_t len;
+    int res = archive_get(s->archive, s->set_name, &regs, &len);
+    if (res) return res;
+
+    res = mkdir(s->full_path, 0755);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
+        free(regs);
+        return res;
+    }
+    res = load_dumped_registers(s, regs, len);
+    free(regs);
+    if (res) return res;
+
+    res = write_set_config(s);
+    if (res) {
+        hll_destroy(&s->hll);
+        return res;
+    }
+    archive_drop(s->archive, s->set_name);
+    s->is_archived = 0;
+    syslog(LOG_INFO, "Restored archived set '%s'.", s->set_name);
+    return 0;
+}
+
+/**
+ * Loads a sparse or cold register file into the HLL.
+ */
+static int read_register_file(hlld_set *s, char *path, uint64_t len, bitmap_mode mode) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open encoded registers: %s. %s", path, strerror(errno));
+        return -errno;
+    }
+
+    unsigned char *buf = malloc(len);
+    int64_t total = iobatch_read(fd, buf, len, NULL);
+    close(fd);
+
+    int res = -1;
+    if (total == (int64_t)len && hll_is_cold_buffer(buf, len)) {
+        res = load_cold_registers(s, buf, len, mode);
+    } else if (total == (int64_t)len) {
+        res = hll_init_sparse_from_buffer(s->set_config.default_precision,
+                s->set_config.format, buf, len, &s->hll);
+    }
+    if (res) syslog(LOG_ERR, "Corrupt encoded registers: %s.", path);
+    free(buf);
+    return res;
+}
+
+/**
+ * Expands cold registers into a new dense register file.
+ * Like a conversion, the file is created under a temporary
+ * name and moved over the cold file once flushed. With a
+ * slab, they are expanded into a slot instead. A read only
+ * server expands them into memory, leaving the file alone.
+ */
+static int load_cold_registers(hlld_set *s, unsigned char *buf, uint64_t len, bitmap_mode mode) {
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    if (s->config->read_only) {
+        int res = bitmap_from_file(-1, size, ANONYMOUS, &s->bm);
+        if (!res) res = hll_init_from_cold_buffer(s->set_config.default_precision,
+                s->set_config.format, &s->bm, buf, len, &s->hll);
+        if (res) bitmap_close(&s->bm);
+        return res;
+    }
+    char *tmp_path = join_path(s->full_path, (char*)TMP_DATA_FILE_NAME);
+    char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+    int slot = !open_slot_registers(s, size, mode, 1);
+    int res = 0;
+    if (!slot) {
+        unlink(tmp_path);
+        res = bitmap_from_filename(tmp_path, size, 1, create_mode(s, mode), &s->bm);
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to create bitmap: %s. %s", tmp_path, strerror(errno));
+        goto LEAVE;
+    }
+
+    res = hll_init_from_cold_buffer(s->set_config.default_precision,
+            s->set_config.format, &s->bm, buf, len, &s->hll);
+    if (!res) res = bitmap_flush(&s->bm);
+    if (!res && slot) {
+        res = place_slot_registers(s, bitmap_path);
+    } else if (!res && rename(tmp_path, bitmap_path)) {
+        syslog(LOG_ERR, "Failed to rename registers: %s. %s", tmp_path, strerror(errno));
+        res = -errno;
+    }
+    if (res) {
+        bitmap_close(&s->bm);
+        if (slot) slab_free(s->slab, s->set_name);
+        else unlink(tmp_path);
+    }
+
+LEAVE:
+    free(tmp_path);
+    free(bitmap_path);
+    return res;
+}
+
+/**
+ * Copies the registers of a proxied set from its slot
+ * @return 0 on success, -1 if the set has no slot.
+ */
+static int dump_slot_registers(hlld_set *s, unsigned char **regs, uint64_t *len) {
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    int fd;
+    uint64_t offset;
+    if (slab_find(s->slab, s->set_name, size, &fd, &offset)) return -1;
+    *regs = malloc(size);
+    if (*regs && iobatch_read_at(fd, *regs, size, offset, NULL) == (int64_t)size) {
+        *len = size;
+        return 0;
+    }
+    free(*regs);
+    return -1;
+}
+
+/**
+ * Copies the register file of a proxied set, so that
+ * it can be dumped without being faulted in.
+ * @return 0 on success, -1 if the set must be faulted in.
+ */
+static int dump_register_file(hlld_set *s, unsigned char **regs, uint64_t *len) {
+    int res = -1;
+    char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+    pthread_mutex_lock(&s->hll_lock);
+    if (!s->is_proxied) goto LEAVE;
+
+    int fd = open(bitmap_path, O_RDONLY);
+    if (fd == -1 && errno == ENOENT && s->slab) {
+        res = dump_slot_registers(s, regs, len);
+        goto LEAVE;
+    }
+    if (fd == -1) goto LEAVE;
+    // The trailer of dense registers is left behind
+    struct stat buf;
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    if (!fstat(fd, &buf) && buf.st_size > 0) {
+        if ((uint64_t)buf.st_size == size + sizeof(register_trailer))
+            buf.st_size = size;
+        *regs = malloc(buf.st_size);
+        if (*regs && iobatch_read(fd, *regs, buf.st_size, NULL) == buf.st_size) {
+            *len = buf.st_size;
+            res = 0;
+        } else
+            free(*regs);
+    }
+    close(fd);
+
+LEAVE:
+    pthread_mutex_unlock(&s->hll_lock);
+    free(bitmap_path);
+    return res;
+}
+
+/**
+ * Loads dumped registers into a new set. Encoded registers are
+ * checked by decoding them before anything is written. Dense
+ * registers are written once, as the register file or into
+ * anonymous memory, and cold registers are expanded into it.
+ */
+static int load_dumped_registers(hlld_set *s, const unsigned char *regs, uint64_t len) {
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    int in_memory = s->set_config.in_memory;
+    bitmap_mode mode = registers_mode(s);
+    int res;
+
+    // Sparse registers are kept in memory either way
+    if (len != size && !hll_is_cold_buffer(regs, len)) {
+        res = hll_init_sparse_from_buffer(s->set_config.default_precision,
+                s->set_config.format, regs, len, &s->hll);
+        if (!res && !in_memory) {
+            res = write_register_file(s, (unsigned char*)regs, len);
+            if (res) hll_destroy(&s->hll);
+        }
+        return res;
+    }
+
+    if (len != size && !in_memory)
+        return load_cold_registers(s, (unsigned char*)regs, len, mode);
+
+    if (in_memory) {
+        res = bitmap_from_file(-1, size, mode, &s->bm);
+        if (!res && len == size) memcpy(s->bm.mmap, regs, size);
+    } else if (!open_slot_registers(s, size, mode, 1)) {
+        char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+        memcpy(s->bm.mmap, regs, size);
+        bitmap_mark_range(&s->bm, 0, size);
+        res = bitmap_flush(&s->bm);
+        if (!res) res = place_slot_registers(s, bitmap_path);
+        free(bitmap_path);
+        if (res) {
+            bitmap_close(&s->bm);
+            slab_free(s->slab, s->set_name);
+        }
+    } else {
+        res = write_register_file(s, (unsigned char*)regs, len);
+        if (!res) {
+            char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+            res = bitmap_from_filename(bitmap_path, size, 0, mode, &s->bm);
+            free(bitmap_path);
+        }
+    }
+    if (res) return res;
+
+    if (len == size)
+        res = hll_init_from_bitmap(s->set_config.default_precision,
+                s->set_config.format, &s->bm, &s->hll);
+    else
+        res = hll_init_from_cold_buffer(s->set_config.default_precision,
+                s->set_config.format, &s->bm, regs, len, &s->hll);
+    if (res) bitmap_close(&s->bm);
+    return res;
+}
+
+/**
+ * Writes the sparse registers to a temporary file,
+ * then moves it over the register file. Must be
+ * called with the sparse lock held.
+ */
+static int write_sparse_file(hlld_set *s) {
+    // Encode under the update lock
+    unsigned char *buf;
+    uint64_t len;
+    LOCK_HLLD_SPIN(&s->hll_update);
+    int res = hll_sparse_encode(&s->hll, &buf, &len);
+    UNLOCK_HLLD_SPIN(&s->hll_update);
+    if (res) return -1;
+    res = write_register_file(s, buf, len);
+    free(buf);
+    return res;
+}
+
+/**
+ * Writes an encoded register file to a temporary
+ * file, then moves it over the register file.
+ */
+static int write_register_file(hlld_set *s, unsigned char *buf, uint64_t len) {
+    return write_set_file(s, DATA_FILE_NAME, TMP_DATA_FILE_NAME, buf, len);
+}
+
+/**
+ * Writes the config file of the set
+ * @return 0 on success.
+ */
+static int write_set_config(hlld_set *s) {
+    char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
+    int res = update_filename_from_set_config(config_name, &s->set_config);
+    free(config_name);
+    if (!res) {
+        s->config_stale = 0;
+        s->config_size = s->set_config.size;
+    }
+    return res;
+}
+
+/**
+ * Writes the trailer after the flushed dense registers.
+ * It is not synced itself, since a torn or stale trailer
+ * only fails the check, and the next flush syncs it.
+ * @return 0 on success, -1 if the registers have no trailer.
+ */
+static int write_register_trailer(hlld_set *s) {
+    if (s->bm.slot || s->bm.fileno < 0) return -1;
+    register_trailer t;
+    memset(&t, 0, sizeof(t));
+    t.magic = REGISTER_TRAILER_MAGIC;
+    t.version = REGISTER_TRAILER_VERSION;
+    t.layout = s->set_config.format;
+    t.precision = s->set_config.default_precision;
+    t.hash = s->set_config.hash;
+    t.crc = crc32c(0, s->bm.mmap, s->bm.size);
+    t.size = s->set_config.size;
+    t.reg_bytes = s->bm.size;
+    t.trailer_crc = crc32c(0, &t, offsetof(register_trailer, trailer_crc));
+    if (pwrite(s->bm.fileno, &t, sizeof(t), s->bm.size) != sizeof(t)) {
+        syslog(LOG_WARNING, "Failed to write the register trailer of set '%s'. %s",
+                s->set_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the cached size from the trailer of the register
+ * file of a proxied set, without mapping the registers.
+ * @arg size Output, the size. Untouched on failure.
+ * @return 0 on success, -1 if there is no valid trailer.
+ */
+static int read_trailer_size(hlld_set *s, uint64_t *size) {
+    uint64_t reg_bytes = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+    int fd = open(bitmap_path, O_RDONLY);
+    free(bitmap_path);
+    if (fd < 0) return -1;
+
+    register_trailer t;
+    int res = (pread(fd, &t, sizeof(t), reg_bytes) == sizeof(t) &&
+            t.magic == REGISTER_TRAILER_MAGIC && t.reg_bytes == reg_bytes &&
+            t.trailer_crc == crc32c(0, &t, offsetof(register_trailer, trailer_crc))) ? 0 : -1;
+    close(fd);
+    if (!res) *size = t.size;
+    return res;
+}
+
+/**
+ * Checks the trailer of dense registers that were just
+ * mapped. Registers that do not match their CRC are only
+ * counted and logged, since a crash between a flush and
+ * its trailer leaves them that way as well.
+ * @return 0 if the registers may be used, -1 if
+ * they have another layout than the set.
+ */
+static int check_register_trailer(hlld_set *s) {
+    register_trailer t;
+    if (pread(s->bm.fileno, &t, sizeof(t), s->bm.size) != sizeof(t) ||
+            t.magic != REGISTER_TRAILER_MAGIC ||
+            t.trailer_crc != crc32c(0, &t, offsetof(register_trailer, trailer_crc))) {
+        syslog(LOG_WARNING, "Ignoring the torn register trailer of set '%s'.", s->set_name);
+        s->counters.checksum_errors++;
+        return 0;
+    }
+
+    // Newer trailers may carry more, but keep the registers first
+    if (t.version > REGISTER_TRAILER_VERSION) return 0;
+    if (t.layout != s->set_config.format || t.precision != s->set_config.default_precision ||
+            t.reg_bytes != s->bm.size) {
+        syslog(LOG_ERR, "The registers of set '%s' have precision %d and format %s, not %d and %s.",
+                s->set_name, t.precision, hll_format_name(t.layout),
+                s->set_config.default_precision, hll_format_name(s->set_config.format));
+        return -1;
+    }
+    if (t.hash != s->set_config.hash)
+        syslog(LOG_WARNING, "The registers of set '%s' were hashed with %s, not %s.",
+                s->set_name, hll_hash_name(t.hash), hll_hash_name(s->set_config.hash));
+
+    // Files owned by another server may be in the middle of a flush
+    if (!s->config->read_only && t.crc != crc32c(0, s->bm.mmap, s->bm.size)) {
+        syslog(LOG_WARNING, "The registers of set '%s' do not match their checksum.", s->set_name);
+        s->counters.checksum_errors++;
+    }
+    return 0;
+}
+
+/**
+ * Writes a file of the set to a temporary file,
+ * then moves it over the file.
+ */
+static int write_set_file(hlld_set *s, const char *name, const char *tmp_name,
+        unsigned char *buf, uint64_t len) {
+    int res = 0;
+    char *tmp_path = join_path(s->full_path, (char*)tmp_name);
+    char *bitmap_path = join_path(s->full_path, (char*)name);
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open set file: %s. %s", tmp_path, strerror(errno));
+        res = -errno;
+        goto LEAVE;
+    }
+
+    // Write everything out, then swap it into place
+    uint64_t total = 0;
+    ssize_t n = 1;
+    while (total < len && n > 0) {
+        n = write(fd, buf + total, len - total);
+        if (n > 0) total += n;
+    }
+    if (total != len || fsync(fd)) {
+        syslog(LOG_ERR, "Failed to write set file: %s. %s", tmp_path, strerror(errno));
+        res = -1;
+    }
+    close(fd);
+    if (!res && rename(tmp_path, bitmap_path)) {
+        syslog(LOG_ERR, "Failed to rename set file: %s. %s", tmp_path, strerror(errno));
+        res = -errno;
+    }
+
+LEAVE:
+    free(tmp_path);
+    free(bitmap_path);
+    return res;
+}
+
+/**
+ * Creates the buckets of a windowed set, and loads
+ * them from the window file of a persistent set.
+ */
+static int open_window(hlld_set *s) {
+    s->window = malloc(sizeof(hll_window));
+    if (!s->window || window_init(s->set_config.default_precision, s->set_config.format,
+                s->set_config.window, s->set_config.window_buckets, s->window)) {
+        syslog(LOG_ERR, "Failed to create the window of set '%s'.", s->set_name);
+        free(s->window);
+        s->window = NULL;
+        return -1;
+    }
+    if (s->set_config.in_memory) return 0;
+
+    // A missing file is a new window
+    char *path = join_path(s->full_path, (char*)WINDOW_FILE_NAME);
+    int res = 0, fd = open(path, O_RDONLY);
+    struct stat buf;
+    if (fd != -1 && !fstat(fd, &buf)) {
+        unsigned char *data = malloc(buf.st_size);
+        if (iobatch_read(fd, data, buf.st_size, NULL) != buf.st_size ||
+                window_decode(s->window, data, buf.st_size)) {
+            syslog(LOG_ERR, "Corrupt window buckets: %s.", path);
+            res = -1;
+        }
+        free(data);
+    } else if (errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to open window buckets: %s. %s", path, strerror(errno));
+        res = -errno;
+    }
+    if (fd != -1) close(fd);
+    free(path);
+    if (res) {
+        window_destroy(s->window);
+        free(s->window);
+        s->window = NULL;
+    }
+    return res;
+}
+
+/**
+ * Writes the buckets of a windowed set to its window file
+ */
+static int write_window_file(hlld_set *s) {
+    unsigned char *buf;
+    uint64_t len;
+    if (window_encode(s->window, &buf, &len)) return -1;
+    int res = write_set_file(s, WINDOW_FILE_NAME, TMP_WINDOW_FILE_NAME, buf, len);
+    free(buf);
+    return res;
+}
+
+/**
+ * Creates the timestamped registers of a sliding set, and
+ * loads them from the sliding file of a persistent set.
+ */
+static int open_sliding(hlld_set *s) {
+    s->sliding = malloc(sizeof(hll_sliding));
+    if (!s->sliding || hll_sliding_init(s->set_config.default_precision,
+                s->set_config.sliding, s->sliding)) {
+        syslog(LOG_ERR, "Failed to create the sliding registers of set '%s'.", s->set_name);
+        free(s->sliding);
+        s->sliding = NULL;
+        return -1;
+    }
+    if (s->set_config.in_memory) return 0;
+
+    // A missing file has no pairs yet
+    char *path = join_path(s->full_path, (char*)SLIDING_FILE_NAME);
+    int res = 0, fd = open(path, O_RDONLY);
+    struct stat buf;
+    if (fd != -1 && !fstat(fd, &buf)) {
+        unsigned char *data = malloc(buf.st_size);
+        if (iobatch_read(fd, data, buf.st_size, NULL) != buf.st_size ||
+                hll_sliding_decode(s->sliding, data, buf.st_size)) {
+            syslog(LOG_ERR, "Corrupt sliding registers: %s.", path);
+            res = -1;
+        }
+        free(data);
+    } else if (errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to open sliding registers: %s. %s", path, strerror(errno));
+        res = -errno;
+    }
+    if (fd != -1) close(fd);
+    free(path);
+    if (res) {
+        hll_sliding_destroy(s->sliding);
+        free(s->sliding);
+        s->sliding = NULL;
+    }
+    return res;
+}
+
+/**
+ * Writes the timestamped registers of a sliding set to its sliding file
+ */
+static int write_sliding_file(hlld_set *s) {
+    unsigned char *buf;
+    uint64_t len;
+    if (hll_sliding_encode(s->sliding, &buf, &len)) return -1;
+    int res = write_set_file(s, SLIDING_FILE_NAME, TMP_SLIDING_FILE_NAME, buf, len);
+    free(buf);
+    return res;
+}
+
+/**
+ * Creates the smallest hashes of a set that keeps them, and
+ * loads them from the kmv file of a persistent set.
+ */
+static int open_kmv(hlld_set *s) {
+    s->kmv = malloc(sizeof(kmv_sketch));
+    if (!s->kmv || kmv_init(s->set_config.kmv, s->kmv)) {
+        syslog(LOG_ERR, "Failed to create the smallest hashes of set '%s'.", s->set_name);
+        free(s->kmv);
+        s->kmv = NULL;
+        return -1;
+    }
+    if (s->set_config.in_memory) return 0;
+
+    // A missing file has no hashes yet
+    char *path = join_path(s->full_path, (char*)KMV_FILE_NAME);
+    int res = 0, fd = open(path, O_RDONLY);
+    struct stat buf;
+    if (fd != -1 && !fstat(fd, &buf)) {
+        unsigned char *data = malloc(buf.st_size);
+        if (iobatch_read(fd, data, buf.st_size, NULL) != buf.st_size ||
+                kmv_decode(s->kmv, data, buf.st_size)) {
+            syslog(LOG_ERR, "Corrupt smallest hashes: %s.", path);
+            res = -1;
+        }
+        free(data);
+    } else if (errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to open smallest hashes: %s. %s", path, strerror(errno));
+        res = -errno;
+    }
+    if (fd != -1) close(fd);
+    free(path);
+    if (res) {
+        kmv_destroy(s->kmv);
+        free(s->kmv);
+        s->kmv = NULL;
+    }
+    return res;
+}
+
+/**
+ * Writes the smallest hashes of a set to its kmv file
+ */
+static int write_kmv_file(hlld_set *s) {
+    unsigned char *buf;
+    uint64_t len;
+    if (kmv_encode(s->kmv, &buf, &len)) return -1;
+    int res = write_set_file(s, KMV_FILE_NAME, TMP_KMV_FILE_NAME, buf, len);
+    free(buf);
+    return res;
+}
+
+/**
+ * Converts a sparse set to dense registers. The dense
+ * register file is created under a temporary name and
+ * moved into place once it is flushed, so a crash leaves
+ * either the sparse or dense registers behind. With a slab,
+ * the sparse file is removed once the slot is synced.
+ */
+static int convert_sparse_set(hlld_set *s) {
+    int res = 0;
+    char *tmp_path = NULL, *bitmap_path = NULL;
+    pthread_mutex_lock(&s->sparse_lock);
+
+    // Bail if another thread converted the set
+    if (!hll_is_sparse(&s->hll))
+        goto LEAVE;
+
+    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision,
+            s->set_config.format);
+    bitmap_mode mode = registers_mode(s);
+    int slot = 0;
+    if (s->set_config.in_memory) {
+        res = bitmap_from_file(-1, size, mode, &s->bm);
+    } else if (!open_slot_registers(s, size, mode, 1)) {
+        bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+        slot = 1;
+    } else {
+        tmp_path = join_path(s->full_path, (char*)TMP_DATA_FILE_NAME);
+        bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+        unlink(tmp_path);
+        res = bitmap_from_filename(tmp_path, size, 1, create_mode(s, mode), &s->bm);
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to create bitmap for set '%s'. %s", s->set_name, strerror(errno));
+        goto LEAVE;
+    }
+
+    // Move the registers over
+    LOCK_HLLD_SPIN(&s->hll_update);
+    res = hll_convert_dense(&s->hll, &s->bm);
+    UNLOCK_HLLD_SPIN(&s->hll_update);
+    registers_changed(s);
+    if (res) {
+        syslog(LOG_ERR, "Failed to convert set '%s' to dense registers.", s->set_name);
+        bitmap_close(&s->bm);
+        if (tmp_path) unlink(tmp_path);
+        if (slot) slab_free(s->slab, s->set_name);
+        goto LEAVE;
+    }
+
+    // Persist the dense registers before replacing the sparse file
+    if (tmp_path) {
+        res = bitmap_flush(&s->bm);
+        if (!res && rename(tmp_path, bitmap_path)) {
+            syslog(LOG_ERR, "Failed to rename registers: %s. %s", tmp_path, strerror(errno));
+            res = -errno;
+        }
+    } else if (slot) {
+        res = bitmap_flush(&s->bm);
+        if (!res) res = place_slot_registers(s, bitmap_path);
+    }
+    mark_dirty(s);
+    syslog(LOG_INFO, "Converted set '%s' to dense registers.", s->set_name);
+
+LEAVE:
+    pthread_mutex_unlock(&s->sparse_lock);
+    if (tmp_path) free(tmp_path);
+    if (bitmap_path) free(bitmap_path);
+    return res;
+}
+
+/**
+ * Maps the dense registers of a set from its slot of the
+ * slab. Creating the registers allocates a zeroed slot,
+ * replacing any the set has.
+ * @return 0 on success, -ENOENT if the set has no slab or
+ * slot, or negative on error.
+ */
+static int open_slot_registers(hlld_set *s, uint64_t size, bitmap_mode mode, int create) {
+    if (!s->slab) return -ENOENT;
+    int fd;
+    uint64_t offset;
+    int res = (create) ? slab_alloc(s->slab, s->set_name, size, &fd, &offset) :
+        slab_find(s->slab, s->set_name, size, &fd, &offset);
+    if (res) return res;
+
+    res = bitmap_from_slot(fd, offset, size, mode | ((create) ? NEW_BITMAP : 0), &s->bm);
+    if (res) {
+        syslog(LOG_ERR, "Failed to map the slab slot of set '%s'. Err: %d", s->set_name, res);
+        if (create) slab_free(s->slab, s->set_name);
+    }
+    return res;
+}
+
+/**
+ * Syncs the flushed registers of a new slot, then removes
+ * the register file they replace, if any
+ */
+static int place_slot_registers(hlld_set *s, char *replaced) {
+    int res = slab_sync(s->slab);
+    if (!res && unlink(replaced) && errno != ENOENT) {
+        syslog(LOG_ERR, "Failed to remove registers: %s. %s", replaced, strerror(errno));
+        res = -errno;
+    }
     return res;
 }
 
@@ -414,13 +2923,3 @@ static int filter_out_special(CONST_DIRENT_T *d) {
     return 1;
 }
 
-/**
- * Computes the difference in time in milliseconds
- * between two timeval structures.
- */
-static int timediff_msec(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
-}
-
@@ -4,6 +4,12 @@
 #include "config.h"
 #include "spinlock.h"
 #include "hll.h"
+#include "repl_log.h"
+#include "wal.h"
+#include "slab.h"
+#include "archive.h"
+#include "window.h"
+#include "kmv.h"
 
 /*
  * Functions are NOT thread safe unless explicitly documented
@@ -16,27 +22,89 @@ typedef struct {
     uint64_t sets;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t checksum_errors;   // Dense registers paged in that failed their CRC
+    uint64_t flush_syscalls;    // System calls made flushing dense registers
+    uint64_t flush_bytes;       // Bytes written flushing dense registers
+    uint64_t flush_clean_pages; // Pages of dense registers skipped as clean
+    uint64_t flushes;           // Flushes of a dirty set
+    uint64_t flush_nanos;       // Time spent in those flushes
+    uint64_t flush_max_nanos;   // The longest of them
+    uint64_t resident_bytes;    // Bytes in memory at the last residency sample
+    uint64_t page_faults;       // Pages of registers faulted in between the last two samples
 } set_counters;
 
+/*
+ * Opaque registers of a thread writing a hot set
+ */
+struct hset_shadow;
+
+/*
+ * Adds counted by a thread writing a hot set
+ */
+struct hset_slot_adds;
+
+/**
+ * The size of a cache line. The fields of a set are grouped by
+ * how often they are written, so that the lines every add reads
+ * are not invalidated by the ones that adds write.
+ */
+#define HSET_CACHE_LINE 64
+
 /**
  * Representation of a hyperloglog set
  */
 typedef struct hlld_set {
+    // Read mostly, only written as the set is created, faulted in or closed
     hlld_config *config;           // hlld configuration
     hlld_set_config set_config;    // Set-specific config
 
     char *set_name;                 // The name of the set
     char *full_path;                // Path to our data
+    char *data_dir;                 // The data directory of the folder
+    int data_dir_index;             // Its index among the data_dirs
 
     char is_proxied;                // Is the bitmap available
-    pthread_mutex_t hll_lock;       // Protects faulting in the HLL
+    repl_log *repl;                 // Raises to stream to followers, or NULL
+    hll_window *window;             // Buckets of recent intervals, if windowed
+    hll_sliding *sliding;           // Timestamped registers, if sliding
+    kmv_sketch *kmv;                // Smallest hashes seen, if kept
+    hlld_wal *wal;                  // Write-ahead log of raises, or NULL
+    hlld_slab *slab;                // Packs the dense registers with others, or NULL
+    hlld_archive *archive;          // Holds the set once it is long cold, or NULL
+    char is_archived;               // Is the set in the archive, rather than its folder
+    char is_unborn;                 // Is the folder yet to be made, for a new set
+    uint64_t disk_stamp;            // Stamp of the files last seen, if read only
+    char config_stale;              // Are the settings in the config file out of date
+    uint64_t config_size;           // The size in the config file, or UINT64_MAX if unknown
+
+    // Registers of each thread writing the set once it is hot, or NULL
+    struct hset_shadow *volatile *volatile shadows;
+    struct hset_slot_adds *volatile slot_adds; // Adds of each thread, if hot but
+                                                // written in place, or NULL
+    int num_shadows;                // The slots of either
 
-    char is_dirty;                  // Has a write happened
+    // The registers, written as adds raise them
+    hll_t hll __attribute__((aligned(HSET_CACHE_LINE))); // Underlying HLL
     hlld_bitmap bm;                 // Bitmap for the HLL
-    hll_t hll;                      // Underlying HLL
-    hlld_spinlock hll_update;       // Protect the updates
+    volatile uint64_t reg_gen;      // Bumped whenever a register changes
+    hlld_spinlock hll_update;       // Protects sparse updates
+
+    // Written once by the first add after each flush, and by flushes
+    char is_dirty __attribute__((aligned(HSET_CACHE_LINE))); // Has a write happened
+    uint64_t dirty_since;           // When is_dirty was set, in seconds
+    volatile uint64_t wal_seq;      // Oldest segment with unflushed raises, or 0
+    volatile uint64_t wal_flushing; // The wal_seq of a flush in progress, or 0
+    uint64_t heat_stamp;            // When the adds last crossed a multiple, in msec
+    pthread_mutex_t hll_lock;       // Protects faulting in the HLL
+    pthread_mutex_t sparse_lock;    // Serializes sparse writes and conversion
+
+    // Cached estimate, valid while cached_gen matches reg_gen
+    uint64_t cached_size __attribute__((aligned(HSET_CACHE_LINE)));
+    volatile uint64_t cached_gen;
+    volatile int cache_lock;        // Held while refreshing the cache
 
-    set_counters counters;         // Counters
+    // Counters, on their own cache line since every writer updates them
+    set_counters counters __attribute__((aligned(HSET_CACHE_LINE)));
 } hlld_set;
 
 /**
@@ -50,6 +118,46 @@ typedef struct hlld_set {
  */
 int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set);
 
+/**
+ * Initializes a proxied set from a known set config, without
+ * reading the config file or touching the set folder. The
+ * folder must already exist. Used to restore many sets quickly.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config The set config, as last flushed
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_set_from_config(hlld_config *config, char *set_name, hlld_set_config *set_config, hlld_set **set);
+
+/**
+ * Initializes a new proxied set, without touching the disk.
+ * Its folder is made once it is first paged in, so that a
+ * create need not wait on the disk.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_new_set(hlld_config *config, char *set_name, hlld_set **set);
+
+/**
+ * Initializes a set from dumped registers, as produced by
+ * hset_dump. Persistent sets write the registers out as their
+ * register file or slot, which is then loaded like any other,
+ * and in-memory sets load them directly.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config The set config of the dump
+ * @arg regs The dumped registers
+ * @arg len The length of the registers
+ * @arg slab The slab to place the registers in, or NULL
+ * @arg set Output parameter, the new set
+ * @return 0 on success, -1 if the registers are corrupt.
+ */
+int init_set_from_dump(hlld_config *config, char *set_name, hlld_set_config *set_config,
+        const unsigned char *regs, uint64_t len, hlld_slab *slab, hlld_set **set);
+
 /**
  * Destroys a set
  * @arg set The set to destroy
@@ -57,6 +165,17 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set);
  */
 int destroy_set(hlld_set *set);
 
+/**
+ * Names the slot of the calling thread for the shadow registers
+ * of hot sets. Once a set takes adds quickly, the writes of each
+ * thread with a slot go to registers of its own, with no locks or
+ * shared cache lines. These are merged into the set every
+ * shadow_merge_msec by their thread, and by any read of the set.
+ * Workers take their index, and execution threads follow them.
+ * @arg slot The slot, or -1 to write the sets in place
+ */
+void hset_shadow_thread(int slot);
+
 /**
  * Gets the counters that belong to a set
  * @notes Thread safe, but may be inconsistent.
@@ -65,6 +184,21 @@ int destroy_set(hlld_set *set);
  */
 set_counters* hset_counters(hlld_set *set);
 
+/**
+ * Returns the index of the data directory of a set
+ * among the data_dirs, or 0 for the data_dir
+ * @notes Thread safe.
+ */
+int hset_data_dir(hlld_set *set);
+
+/**
+ * Asks the kernel to read the files of a proxied set
+ * ahead, so that paging it in soon after is quicker.
+ * @notes Thread safe.
+ * @arg set The set
+ */
+void hset_readahead(hlld_set *set);
+
 /**
  * Checks if a set is currectly mapped into
  * memory or if it is proxied.
@@ -73,6 +207,33 @@ set_counters* hset_counters(hlld_set *set);
  */
 int hset_is_proxied(hlld_set *set);
 
+/**
+ * Returns how long the set has been dirty.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg set The set
+ * @arg now The current time, in seconds since the epoch
+ * @return Seconds since the set became dirty, or -1 if clean.
+ */
+int64_t hset_dirty_age(hlld_set *set, uint64_t now);
+
+/**
+ * Returns the number of dense register pages changed
+ * since the last flush. Sparse sets have no pages.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg set The set
+ * @return The number of dirty pages
+ */
+uint64_t hset_dirty_pages(hlld_set *set);
+
+/**
+ * Loads the registers of a proxied set into memory.
+ * Idempotent if the set is not proxied.
+ * @notes Thread safe.
+ * @arg set The set
+ * @return 0 on success.
+ */
+int hset_page_in(hlld_set *set);
+
 /**
  * Flushes the set. Idempotent if the
  * set is proxied or not dirty.
@@ -81,6 +242,26 @@ int hset_is_proxied(hlld_set *set);
  */
 int hset_flush(hlld_set *set);
 
+/**
+ * Cools a set that is mapped from its data file. It stays
+ * mapped, but the kernel reclaims the pages of its registers,
+ * so the next access only reads them back in.
+ * @arg set The set to cool
+ * @return 0 on success, or -1 if the set is not mapped
+ * from a file, and cannot be cooled.
+ */
+int hset_cool(hlld_set *set);
+
+/**
+ * Samples the bytes of a set that are resident in memory, and
+ * the pages of its registers faulted in since the last sample,
+ * into its counters. Walks the page tables of the registers, so
+ * it is left to the maintenance rather than the request paths.
+ * @arg set The set to sample
+ * @return 0 on success, or -1 if the set is proxied.
+ */
+int hset_sample_residency(hlld_set *set);
+
 /**
  * Gracefully closes a set.
  * @arg set The set to close
@@ -99,18 +280,299 @@ int hset_delete(hlld_set *set);
  * Adds a key to the given set
  * @arg set The set to add to
  * @arg key The key to add
- * @return 0 on success.
+ * @return 0 on success, -2 if the set only accepts hashes.
  */
 int hset_add(hlld_set *set, char *key);
 
 /**
- * Gets the size of the set
+ * Adds a batch of keys to the given set. All the
+ * keys are hashed before the update lock is taken once.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg lens The length of each key, or NULL to use strlen
+ * @arg num The number of keys
+ * @return 0 on success, -2 if the set only accepts hashes.
+ */
+int hset_add_batch(hlld_set *set, char **keys, const int *lens, int num);
+
+/**
+ * Adds a batch of hashes computed by the client
+ * to a set that uses external hashes.
+ * @arg set The set to add to
+ * @arg hashes The 64 bit hashes to add
+ * @arg num The number of hashes
+ * @return 0 on success, -2 if the set does not accept hashes.
+ */
+int hset_add_hashes(hlld_set *set, const uint64_t *hashes, int num);
+
+/**
+ * Adds a batch of keys that were already hashed, so that
+ * keys added to many sets are only hashed once.
+ * @arg set The set to add to
+ * @arg hash The hash function the keys were hashed with
+ * @arg hashes The 64 bit hashes to add
+ * @arg num The number of hashes
+ * @return 0 on success, -2 if the set uses another hash.
+ */
+int hset_add_hashed(hlld_set *set, hll_hash hash, const uint64_t *hashes, int num);
+
+/**
+ * Checks if the registers of two sets can be combined,
+ * which requires the same hash function. The registers of
+ * a higher precision are folded down to the lower one.
+ * @return 1 if compatible, 0 otherwise.
+ */
+int hset_compatible(hlld_set *a, hlld_set *b);
+
+/**
+ * Merges the registers of another set into a set,
+ * so that it estimates the size of their union. A source
+ * of a higher precision is folded down as it is merged.
+ * Both sets are faulted in if needed.
+ * @note Thread safe.
+ * @arg dst The set to merge into
+ * @arg src The set to merge from. Not modified.
+ * @return 0 on success, -1 on error, -2 if the sets are not
+ * compatible, or the source has a lower precision.
+ */
+int hset_union(hlld_set *dst, hlld_set *src);
+
+/**
+ * The layouts of registers merged with hset_merge_raw
+ */
+typedef enum {
+    HSET_RAW_PACKED = HLL_PACKED, // Dense, 6 bit registers packed 5 per u32
+    HSET_RAW_BYTE = HLL_BYTE,     // Dense, one register per byte
+    HSET_RAW_SPARSE = 2,          // The entries of registers that are set
+    HSET_RAW_NIBBLE = 3           // Dense, 4 bit offsets from a base, 15 per u64
+} hset_raw_layout;
+
+/**
+ * Merges registers sent by a client into a set, as laid
+ * out by an HLL of that layout, or as a list of entries.
+ * Registers of a higher precision are folded down as they
+ * are merged. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to merge into
+ * @arg precision The precision of the registers
+ * @arg layout The layout of the registers
+ * @arg payload The registers. Sparse entries are little
+ * endian u32s, as packed by HLL_ENTRY.
+ * @arg len The length of the payload
+ * @return 0 on success, -1 on error, -2 if the precision is
+ * lower than that of the set, -3 if the payload is invalid.
+ */
+int hset_merge_raw(hlld_set *set, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *payload, uint64_t len);
+
+/**
+ * Callback for the registers of a set
+ * @arg data The opaque data of the caller
+ * @arg precision The precision of the registers
+ * @arg layout The layout of the registers
+ * @arg regs The registers
+ * @arg len The length of the registers
+ */
+typedef void(*hset_raw_cb)(void *data, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *regs, uint64_t len);
+
+/**
+ * Reads the registers of a set, in the layouts taken by
+ * hset_merge_raw. Dense registers are passed from where the
+ * set keeps them, without a copy, so they may be raised while
+ * the callback runs. Sparse sets are always listed as entries.
+ * The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg sparse Should dense registers be listed as entries
+ * @arg cb Invoked with the registers
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, -1 on error.
+ */
+int hset_raw_registers(hlld_set *set, int sparse, hset_raw_cb cb, void *data);
+
+/**
+ * Merges the registers of a set into an HLL owned
+ * by the caller. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to merge from. Not modified.
+ * @arg h The HLL to merge into, of at most the precision of the set
+ * @return 0 on success, -1 on error, -2 if the HLL has a
+ * higher precision.
+ */
+int hset_merge_into(hlld_set *set, hll_t *h);
+
+/**
+ * Raises the registers of a set to at least the value
+ * of each entry, as streamed from a primary. The set is
+ * faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set to update
+ * @arg entries The register entries, as packed by HLL_ENTRY
+ * @arg num The number of entries
+ * @return 0 on success, -1 on error.
+ */
+int hset_raise_registers(hlld_set *set, const uint32_t *entries, int num);
+
+/**
+ * Takes the register raises to stream to followers. If
+ * raises were lost, or full is set, an entry of every
+ * register that is not zero is returned instead, and the
+ * set is faulted in if needed. A full read leaves the
+ * logged raises in place.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg full Should every register be returned
+ * @arg entries Output, a malloc()'d list of register entries,
+ * or NULL to drop the raises
+ * @return The number of entries, or -1 on error.
+ */
+int hset_replication_entries(hlld_set *set, int full, uint32_t **entries);
+
+/**
+ * Logs the raises of a persistent set to a write-ahead
+ * log from now on, unless it is volatile. Must be called
+ * before the set is used.
+ * @arg set The set
+ * @arg wal The write-ahead log
+ */
+void hset_attach_wal(hlld_set *set, hlld_wal *wal);
+
+/**
+ * Keeps the dense registers of a persistent set in a slot of
+ * the slab from now on, rather than a file of their own. Sets
+ * with a register file keep using it. Must be called before
+ * the set is used.
+ * @arg set The set
+ * @arg slab The slab
+ */
+void hset_attach_slab(hlld_set *set, hlld_slab *slab);
+
+/**
+ * Lets a persistent set be moved into an archive, and notices
+ * if it is already there. A set is archived if the archive has
+ * it, and its folder has no config, as a set is only removed
+ * from the archive once its folder is complete again. Must be
+ * called before the set is used.
+ * @arg set The set
+ * @arg archive The archive
+ */
+void hset_attach_archive(hlld_set *set, hlld_archive *archive);
+
+/**
+ * Checks if a set is in the archive, rather than its folder
+ * @note Thread safe.
+ * @return 1 if archived, else 0.
+ */
+int hset_is_archived(hlld_set *set);
+
+/**
+ * Moves a proxied set into its archive, then removes its
+ * folder. The registers are archived in their encoded form,
+ * so a dense register file is faulted in to encode it. The
+ * next page in restores the folder from the archive.
+ * @arg set The set
+ * @return 0 on success, -1 if the set is not proxied, or is
+ * in-memory, windowed or sliding, or could not be archived.
+ */
+int hset_archive(hlld_set *set);
+
+/**
+ * Returns the oldest segment of the write-ahead log
+ * the set needs, as it holds raises not yet flushed.
+ * @note Thread safe.
+ * @arg set The set
+ * @return The segment, or 0 if none is needed.
+ */
+uint64_t hset_wal_seq(hlld_set *set);
+
+/**
+ * Returns when a set was last written. The config of a set
+ * is only rewritten by the flush of a write, so for a clean
+ * set this is when its config was last written.
+ * @arg set The set
+ * @return Seconds since the epoch, or 0 if unknown.
+ */
+uint64_t hset_last_write(hlld_set *set);
+
+/**
+ * Notices the files of a set written by the server that owns
+ * the data directory. The set is closed if any of them changed,
+ * and adopts its new config, so the next read faults in the
+ * new registers. Must be called with the set held exclusively.
+ * @arg set The set
+ * @return 0 if nothing changed, 1 if the set was closed, or
+ * -1 if the config could not be read, or changed as it was read.
+ */
+int hset_refresh(hlld_set *set);
+
+/**
+ * Folds the registers of a persistent set down to a lower
+ * precision, with hll_fold, and writes them out in place of
+ * its registers along with its new config. The set is left
+ * proxied if it was. Windowed and sliding sets are not folded.
+ * @arg set The set
+ * @arg precision The new precision
+ * @return 0 on success, or if the set is already at or below
+ * the precision, -1 on error.
+ */
+int hset_fold(hlld_set *set, unsigned char precision);
+
+/**
+ * Dumps the registers of a set as the contents of a register
+ * file. Sparse sets are encoded, and dense sets use the cold
+ * encoding where that is smaller. Proxied sets are copied from
+ * their register file, rather than faulted in.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg regs Output, a malloc()'d buffer of the registers
+ * @arg len Output, the length of the registers
+ * @return 0 on success, -1 on error.
+ */
+int hset_dump(hlld_set *set, unsigned char **regs, uint64_t *len);
+
+/**
+ * Gets the size of the set. The estimate is cached,
+ * and only recomputed once a register has changed.
  * @note Thread safe.
  * @arg set The set to check
  * @return The estimated size of the set
  */
 uint64_t hset_size(hlld_set *set);
 
+/**
+ * Reads the cached size of a set, without locks and without
+ * storing to memory, so readers never take the cache lines
+ * of the set from its writers.
+ * @note Thread safe, and safe without the set lock.
+ * @arg set The set
+ * @arg size Output, the cached size
+ * @return 1 if the size was read, 0 if it must be estimated.
+ */
+int hset_read_size(hlld_set *set, uint64_t *size);
+
+/**
+ * Reads the size of a set without touching its registers,
+ * so that catalog scans never fault a set in. Proxied sets,
+ * and sets whose estimate is not cached, answer with the
+ * size of their last flush, from their config or the
+ * manifest, which is marked as stale.
+ * @note Thread safe, and safe without the set lock.
+ * @arg set The set
+ * @arg size Output, the size
+ * @return 0 if the size is current, 1 if it is stale.
+ */
+int hset_metadata_size(hlld_set *set, uint64_t *size);
+
+/**
+ * Checks if the size of a set is cached, so that
+ * hset_size will not need to estimate it. Writes
+ * may race with the check, so it is only a hint.
+ * @arg set The set to check
+ * @return 1 if the size is cached, 0 otherwise.
+ */
+int hset_size_cached(hlld_set *set);
+
 /**
  * Gets the byte size of the set
  * @note Thread safe.
@@ -119,4 +581,37 @@ uint64_t hset_size(hlld_set *set);
  */
 uint64_t hset_byte_size(hlld_set *set);
 
+/**
+ * Gets the bytes of a set resident in memory as of the last
+ * residency sample. Sets whose registers are not mapped, or
+ * have yet to be sampled, are taken to be wholly resident.
+ * @note Thread safe.
+ * @arg set The set
+ * @return The resident bytes, or 0 if the set is proxied
+ */
+uint64_t hset_resident_bytes(hlld_set *set);
+
+/**
+ * Estimates the keys added to a windowed or sliding set
+ * over its recent intervals. The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg span The seconds to cover. Windowed sets round it
+ * up to whole intervals.
+ * @arg est Output, the estimate
+ * @return 0 on success, -1 on error, -2 if the set is not windowed.
+ */
+int hset_size_window(hlld_set *set, uint64_t span, uint64_t *est);
+
+/**
+ * Copies the smallest hashes kept by a set, so that they can
+ * be compared with those of other sets without holding it.
+ * The set is faulted in if needed.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg out Output, the copy. Must be destroyed with kmv_destroy.
+ * @return 0 on success, -1 on error, -2 if the set keeps no hashes.
+ */
+int hset_copy_kmv(hlld_set *set, kmv_sketch *out);
+
 #endif
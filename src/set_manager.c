@@ -4,17 +4,29 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include "spinlock.h"
 #include "set_manager.h"
+#include "trace.h"
 #include "art.h"
 #include "set.h"
+#include "manifest.h"
+#include "archive.h"
+#include "wal.h"
+#include "dump.h"
+#include "epoch.h"
+#include "brlock.h"
+#include "slowlog.h"
+#include "clock.h"
 #include "type_compat.h"
 
 /**
- * This defines how log we sleep between vacuum poll
- * iterations in microseconds
+ * The version of a lookup cache that was
+ * never filled, which matches no version
  */
-#define VACUUM_POLL_USEC 500000
+#define IDLE_VSN ((unsigned long long)-1)
 
 /**
  * Wraps a hlld_set to ensure only a single
@@ -22,58 +34,63 @@
  * references, to allow a sane close to take place.
  */
 typedef struct {
+    hlld_set *set;    // The actual set object
+    hlld_brlock lock;   // Protects the set
+    hlld_config *custom;   // Custom config to cleanup
     volatile int is_active;         // Set to 0 when we are trying to delete it
-    volatile int is_hot;            // Used to mark a set as hot
     volatile int should_delete;     // Used to control deletion
 
-    hlld_set *set;    // The actual set object
-    pthread_rwlock_t rwlock; // Protects the set
-    hlld_config *custom;   // Custom config to cleanup
+    // Stamped by writers, so kept off the line every access reads
+    volatile uint64_t last_access __attribute__((aligned(HSET_CACHE_LINE)));  // Manager clock of the last write
+    volatile int is_cool;           // Pages reclaimed, and not written since
 } hlld_set_wrapper;
 
-/**
- * We use a linked list of setmgr_client
- * structs to track any clients of the set manager.
- * Each client maintains a thread ID as well as the
- * last known version they used. The vacuum thread
- * uses this information to safely garbage collect
- * old versions.
+/*
+ * A set in the expiry wheel. Entries are not removed when
+ * their set is dropped, so an entry only expires a set of
+ * the name that still expires at the same time.
  */
-typedef struct setmgr_client {
-    pthread_t id;
-    unsigned long long vsn;
-    struct setmgr_client *next;
-} setmgr_client;
+typedef struct expiry_entry {
+    char *set_name;
+    uint64_t expires;
+    struct expiry_entry *next;
+} expiry_entry;
 
-// Enum of possible delta updates
+// Enum of possible updates to the set map
 typedef enum {
     CREATE,
-    DELETE,
-    BARRIER
-} delta_type;
+    DELETE
+} update_type;
 
-// Simple linked list of set wrappers
-typedef struct set_list {
-    unsigned long long vsn;
-    delta_type type;
-    hlld_set_wrapper *set;
-    struct set_list *next;
-} set_list;
+/*
+ * What a version of the set map gave up, its replaced
+ * nodes and the sets it dropped. It is freed once every
+ * client has moved past the epoch it was published in.
+ */
+typedef struct set_garbage {
+    uint64_t epoch;
+    void **nodes;               // Retired nodes of the set map
+    int num_nodes;
+    hlld_set_wrapper **sets;    // Sets dropped by the version
+    int num_sets;
+    struct set_garbage *next;
+} set_garbage;
 
 /**
  * We use a a simple form of Multi-Version Concurrency Controll (MVCC)
  * to prevent locking on access to the map of set name -> hlld_set_wrapper.
  *
- * The way it works is we have 2 ART trees, the "primary" and an alternate.
- * All the clients of the set manager have reads go through the primary
- * without any locking. We also maintain a delta list of new and deleted sets,
- * which is a simple linked list.
+ * The map is a single persistent ART tree. All the clients of the set
+ * manager read it without any locking. Creates and drops copy the nodes
+ * on the path to their set under the write lock, and publish a new root
+ * atomically, so they are visible at once. Readers that loaded the old
+ * root keep the nodes they hold.
  *
- * We use a separate vacuum thread to merge changes from the delta lists
- * into the alternate tree, and then do a pointer swap to rotate the
- * primary tree for the alternate.
+ * The replaced nodes, and the dropped sets, are queued with the epoch
+ * they were published in. A separate vacuum thread frees them once an
+ * epoch grace period shows that no client is still reading them.
  *
- * This mechanism ensures we have at most 2 ART trees, reads are lock-free,
+ * This mechanism ensures we have one ART tree, reads are lock-free,
  * and performance does not degrade with the number of sets.
  *
  */
@@ -85,13 +102,13 @@ struct hlld_setmgr {
 
     /*
      * To support vacuuming of old versions, we require that
-     * workers 'periodically' checkpoint. This just updates an
-     * index to match the current version. The vacuum thread
-     * can scan for the minimum seen version and clean all older
-     * versions.
+     * workers 'periodically' checkpoint. This records the epoch
+     * they have observed. Each version of the set map advances
+     * the epoch, and once every client has moved past it the
+     * nodes and sets that version replaced are unreferenced.
      */
-    setmgr_client *clients;
-    hlld_spinlock clients_lock;
+    hlld_epochs *epochs;
+    uint64_t reclaim_epoch;     // Epoch the vacuum thread waits for
 
     // This is the current version. Should be used
     // under the write lock.
@@ -99,45 +116,380 @@ struct hlld_setmgr {
     pthread_mutex_t write_lock; // Serializes destructive operations
 
     // Maps key names -> hlld_set_wrapper
-    unsigned long long primary_vsn; // This is the version that set_map represents
-    art_tree *set_map;
-    art_tree *alt_set_map;
+    art_tree set_map;
 
     /**
      * List of pending deletes. This is necessary
      * because the set_map may reflect that a delete has
      * taken place, while the vacuum thread has not yet performed the
      * delete. This allows create to return a "Delete in progress".
+     * These are the sets the vacuum thread is deleting, the
+     * garbage holds the sets it has yet to take.
      */
     hlld_set_list *pending_deletes;
     hlld_spinlock pending_lock;
 
-    // Delta lists for non-merged operations
-    set_list *delta;
+    // Names of the sets being built by setmgr_create_sets,
+    // which other creates treat as existing. Under the write lock.
+    art_tree creating;
+
+    // Garbage of the versions not yet reclaimed, newest
+    // first. Under the write lock.
+    set_garbage *garbage;
+    uint64_t num_garbage;
+
+    /*
+     * Writes stamp the set with the clock, which is advanced by
+     * every eviction and cold scan. Sets stamped before the
+     * cold mark have not been written since the last cold scan,
+     * and likewise for the cool mark and cool scans.
+     */
+    volatile uint64_t clock;
+    uint64_t cold_mark;
+    uint64_t cool_mark;
+
+    // Queues of sets to page in, with a thread for each data
+    // directory, so page ins keep every device busy
+    pthread_mutex_t page_in_lock;
+    pthread_cond_t page_in_cond;
+    struct page_in_job **page_in_head;
+    struct page_in_job **page_in_tail;
+    int page_in_run;    // Cleared to stop the page-in threads
+    int page_in_queues;
+    int page_in_started;
+    int page_in_claimed; // Each thread claims the next queue
+    pthread_t *page_in_threads;
+
+    // Pages in the sets that were hot before a restart
+    volatile int prewarm_run;   // Cleared to stop the prewarm thread
+    pthread_t prewarm_thread;
+
+    // Records the sets, so a restart need not scan their folders
+    hlld_manifest *manifest;
+
+    // Logs the raises of sets between flushes, or NULL
+    hlld_wal *wal;
+
+    // Packs the dense registers of the sets, or NULL
+    hlld_slab *slab;
+
+    // Holds the sets not written for long, or NULL if read only
+    hlld_archive *archive;
+
+    // Names of the bound handles, indexed by handle, and their
+    // handles. Handles are only added, under the handle lock.
+    char **handle_names;
+    volatile int num_handles;
+    art_tree handle_ids;
+    pthread_mutex_t handle_lock;
+
+    // Timer wheel of the sets that expire, with a slot for
+    // each second modulo EXPIRY_SLOTS. Under the expiry lock.
+    expiry_entry **expiry_wheel;
+    uint64_t expiry_tick;       // The last second that was expired
+    pthread_mutex_t expiry_lock;
+
+    // Identifies the manager to the lookup caches
+    uint64_t id;
+    volatile uint64_t lookup_hits;
+    volatile uint64_t lookup_misses;
+
+    // Last snapshot of the stats of each set
+    pthread_mutex_t stats_lock;
+    hlld_set_stats *stats;
+    int num_stats;
+
+    // Writes the snapshots of the sets in the background
+    snapshot_cb snapshot_cb;
+    void *snapshot_data;
+    volatile int snapshot_busy;     // A snapshot is requested or being written
 };
 
+/*
+ * Stats of the sets collected for a snapshot
+ */
+typedef struct {
+    hlld_set_stats *stats;
+    int num;
+    int cap;
+} set_stats_list;
+
+/**
+ * Each thread caches the sets it found recently, direct mapped
+ * by a hash of their name. Must be a power of two.
+ */
+#define LOOKUP_CACHE_SIZE 256
+
+/**
+ * Lookups are counted per thread, and added to
+ * the manager in batches of this many
+ */
+#define LOOKUP_STATS_BATCH 1024
+
+typedef struct {
+    uint64_t hash;
+    hlld_set_wrapper *set;
+} lookup_entry;
+
+/*
+ * The set a thread found for a handle, which is valid
+ * for the version it was found in
+ */
+typedef struct {
+    unsigned long long vsn;
+    hlld_set_wrapper *set;
+} handle_entry;
+
+/*
+ * The state each thread keeps for the last manager it used,
+ * which is the lookup cache. The cache entries are only valid for the version
+ * they were found in. Sets are not freed until the client has moved past
+ * the epoch of the version that dropped them, and the cache is flushed
+ * by then.
+ */
+typedef struct {
+    uint64_t mgr_id;
+    unsigned long long vsn;
+    uint32_t hits;
+    uint32_t misses;
+    lookup_entry entries[LOOKUP_CACHE_SIZE];
+    handle_entry *handles;  // Grown to the handles used, or NULL
+    int handles_cap;
+} thread_state;
+
+static pthread_key_t THREAD_STATE_KEY;
+static pthread_once_t THREAD_STATE_ONCE = PTHREAD_ONCE_INIT;
+static volatile uint64_t NEXT_MGR_ID = 0;
+
+/*
+ * A set waiting to be paged in, and who to notify
+ */
+typedef struct page_in_job {
+    char *set_name;
+    page_in_cb cb;
+    create_cb created;  // Used instead of cb if is_create
+    int is_create;      // Makes the folder of a new set
+    void *data;
+    struct page_in_job *next;
+} page_in_job;
+
+/*
+ * State used to list the sets not written since the last scan
+ */
+typedef struct {
+    hlld_set_list_head *head;
+    uint64_t mark;
+    int skip_cool;      // Skip the sets cooled by an earlier scan
+} cold_list;
+
+/*
+ * A resident set that may be evicted
+ */
+typedef struct {
+    char *name;
+    uint64_t last_access;
+    uint64_t bytes;
+} lru_entry;
+
+/*
+ * State used to find the least recently written sets
+ */
+typedef struct {
+    lru_entry *entries;
+    int num;
+    int cap;
+    uint64_t resident;  // Bytes of all resident sets
+} lru_list;
+
+/**
+ * Marks a set as written at the current clock,
+ * avoiding the store if we can
+ */
+static inline void touch_set(hlld_setmgr *mgr, hlld_set_wrapper *set) {
+    uint64_t now = mgr->clock;
+    if (set->last_access != now) set->last_access = now;
+    if (set->is_cool) set->is_cool = 0;
+}
+
+/**
+ * Files of the archive are compacted once
+ * this share of their bytes is dead
+ */
+#define ARCHIVE_COMPACT_DEAD 0.5
+
 /**
  * We warn if there are this many outstanding versions
- * that cannot be vacuumed
+ * that cannot be reclaimed
  */
 #define WARN_THRESHOLD 32
 
+/**
+ * Keys set in many sets are hashed in batches of this
+ * many, so the hashes can be kept on the stack
+ */
+#define MULTI_HASH_BATCH 64
+
+/**
+ * The uncached estimates of a setmgr_set_sizes are split
+ * across up to this many threads, each given at least this
+ * many sets
+ */
+#define MAX_SIZE_THREADS 4
+#define MIN_SETS_PER_SIZE_THREAD 32
+
+/**
+ * The expiry wheel has a slot for each second of this
+ * many. Longer ttls go around it, and are skipped until
+ * the round that they expire in.
+ */
+#define EXPIRY_SLOTS 4096
+
+/**
+ * The estimates of a setmgr_set_sizes. Each
+ * thread takes the next set that is not cached.
+ */
+typedef struct {
+    hlld_set_wrapper **sets;
+    uint64_t *sizes;
+    int *cold;                  // Indexes of the sets to estimate
+    int num;
+    volatile int next;          // Index of the next set to estimate
+} size_round;
+
+/**
+ * Existing sets are loaded on up to this many threads,
+ * each given at least this many sets
+ */
+#define MAX_LOAD_THREADS 32
+#define MIN_SETS_PER_LOAD_THREAD 64
+
+/*
+ * State shared by the threads loading existing sets.
+ * Each thread takes the next folder to load.
+ */
+typedef struct {
+    hlld_setmgr *mgr;
+    struct dirent **namelist;
+    int num;
+    volatile int next;          // Index of the next folder to load
+    hlld_set_wrapper **sets;    // Loaded sets, NULL on failure
+} load_round;
+
+/**
+ * On shutdown, the sets are flushed and closed on up to
+ * this many threads, each given at least this many sets
+ */
+#define MAX_CLOSE_THREADS 32
+#define MIN_SETS_PER_CLOSE_THREAD 64
+
+/*
+ * State shared by the threads flushing or closing the sets
+ * on shutdown. Each thread takes the next set.
+ */
+typedef struct {
+    hlld_set_wrapper **sets;
+    int num;
+    void (*run)(hlld_set_wrapper *set);
+    const char *done_verb;      // Logged with the progress, such as "Flushed"
+    volatile int next;          // Index of the next set
+    volatile int done;
+} close_round;
+
+/*
+ * Sets restored from the manifest, in the order of their names
+ */
+typedef struct {
+    hlld_setmgr *mgr;
+    hlld_set_wrapper **sets;
+    int num;
+    int cap;
+} load_list;
+
+/*
+ * State used to match the archived sets to the loaded sets
+ */
+typedef struct {
+    hlld_setmgr *mgr;
+    int from_manifest;  // The manifest lists every set
+    int added;
+} archive_load;
+
 /*
  * Static declarations
  */
 static const char FOLDER_PREFIX[] = "hlld.";
 static const int FOLDER_PREFIX_LEN = sizeof(FOLDER_PREFIX) - 1;
+static const char SNAPSHOT_FILENAME[] = "sets.snapshot";
+static const char TMP_SNAPSHOT_FILENAME[] = "sets.snapshot.tmp";
+
+/**
+ * The sets in memory, hottest first, one name a line,
+ * which are paged in again on the next start
+ */
+static const char HOT_SETS_FILENAME[] = "sets.hot";
+static const char TMP_HOT_SETS_FILENAME[] = "sets.hot.tmp";
+
+/**
+ * The sets read ahead of the one being prewarmed
+ */
+#define PREWARM_READAHEAD 16
+
+/**
+ * After how many sets a snapshot checkpoints
+ * with the manager, so vacuuming is not held up
+ */
+#define SNAPSHOT_CHECKPOINT 64
 
 static hlld_set_wrapper* find_set(hlld_setmgr *mgr, char *set_name);
+static hlld_set_wrapper* find_handle_set(hlld_setmgr *mgr, int id);
+static hlld_set_wrapper* search_set(hlld_setmgr *mgr, char *set_name);
+static thread_state* get_thread_state(hlld_setmgr *mgr);
 static hlld_set_wrapper* take_set(hlld_setmgr *mgr, char *set_name);
+static hlld_set_wrapper* take_write_set(hlld_setmgr *mgr, char *set_name);
+static void lock_set(hlld_set_wrapper *set, int exclusive);
 static void delete_set(hlld_set_wrapper *set);
-static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int delta);
+static int take_sets(hlld_setmgr *mgr, char **set_names, int num_sets, hlld_set_wrapper **sets);
+static unsigned char min_precision(hlld_set_wrapper **sets, int num_sets);
+static hlld_set_wrapper* alloc_set_wrapper(hlld_setmgr *mgr, hlld_config *config, int is_hot);
+static hlld_set_wrapper* new_set_wrapper(hlld_setmgr *mgr, char *set_name, hlld_config *config, hlld_set_config *set_config, int is_hot);
+static hlld_config* config_for_set(hlld_setmgr *mgr, hlld_set_config *set_config);
+static int check_new_set(hlld_setmgr *mgr, char *set_name);
+static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int publish);
 static int set_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int set_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
-static int set_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_list_filtered_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int compare_set_names(const void *a, const void *b);
+static int set_map_list_lru_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_stats_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void free_set_stats(hlld_set_stats *stats, int num);
+static int compare_lru(const void *a, const void *b);
 static int load_existing_sets(hlld_setmgr *mgr);
-static unsigned long long create_delta_update(hlld_setmgr *mgr, delta_type type, hlld_set_wrapper *set);
+static void* size_worker_main(void *in);
+static void snapshot_manifest(hlld_setmgr *mgr);
+static void replay_wal_cb(void *data, repl_frame *frame);
+static void load_manifest_cb(void *data, char *set_name, hlld_set_config *config);
+static void load_archived_sets(hlld_setmgr *mgr, int from_manifest);
+static void refresh_manifest_cb(void *data, char *set_name, hlld_set_config *config);
+static int refresh_add_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int refresh_free_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_manifest_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_collect_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void flush_closing_set(hlld_set_wrapper *set);
+static void run_close_round(hlld_setmgr *mgr, close_round *round);
+static int set_map_refresh_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void mark_pending_deletes(hlld_setmgr *mgr, set_garbage *garbage);
+static void clear_pending_deletes(hlld_setmgr *mgr);
+static unsigned long long publish_set_map(hlld_setmgr *mgr, art_cow *cow,
+        hlld_set_wrapper **dropped, int num_dropped);
+static unsigned long long update_set_map(hlld_setmgr *mgr, update_type type, hlld_set_wrapper *set);
+static void add_expiry(hlld_setmgr *mgr, hlld_set *set);
 static void* setmgr_thread_main(void *in);
+static void* page_in_thread_main(void *in);
+static int queue_page_in(hlld_setmgr *mgr, page_in_job *job, int data_dir);
+static int persist_new_set(hlld_setmgr *mgr, char *set_name);
+static void* prewarm_thread_main(void *in);
+static int compare_hot(const void *a, const void *b);
 
 /**
  * Initializer
@@ -153,36 +505,80 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
 
     // Copy the config
     m->config = config;
+    m->clock = 1;
+    m->cold_mark = 1;
+    m->cool_mark = 1;
+    m->id = __sync_add_and_fetch(&NEXT_MGR_ID, 1);
 
     // Initialize the locks
     pthread_mutex_init(&m->write_lock, NULL);
-    INIT_HLLD_SPIN(&m->clients_lock);
+    if (init_epochs(&m->epochs)) {
+        syslog(LOG_ERR, "Failed to allocate client epochs!");
+        free(m);
+        return -1;
+    }
     INIT_HLLD_SPIN(&m->pending_lock);
-
-    // Allocate storage for the art trees
-    art_tree *trees = calloc(2, sizeof(art_tree));
-    m->set_map = trees;
-    m->alt_set_map = trees+1;
-
-    // Allocate the initial art tree
-    int res = init_art_tree(m->set_map);
+    pthread_mutex_init(&m->page_in_lock, NULL);
+    pthread_cond_init(&m->page_in_cond, NULL);
+    pthread_mutex_init(&m->stats_lock, NULL);
+    pthread_mutex_init(&m->handle_lock, NULL);
+    init_art_tree(&m->handle_ids);
+    pthread_mutex_init(&m->expiry_lock, NULL);
+    m->expiry_tick = time(NULL);
+
+    // Allocate the art tree
+    int res = init_art_tree(&m->set_map);
     if (res) {
         syslog(LOG_ERR, "Failed to allocate set map!");
         free(m);
         return -1;
     }
 
+    // Open the write-ahead log first, so the loaded sets log to it
+    if (config->wal && init_wal(config, &m->wal)) {
+        syslog(LOG_ERR, "Failed to open the write-ahead log!");
+        destroy_epochs(m->epochs);
+        destroy_art_tree(&m->set_map);
+        free(m);
+        return -1;
+    }
+
+    // The slab is opened before the sets, which are placed in it
+    if (config->slab_registers && !config->use_mmap && init_slab(config->data_dir, config->preallocate == 2, &m->slab)) {
+        syslog(LOG_ERR, "Failed to open the register slab!");
+        destroy_wal(m->wal);
+        destroy_epochs(m->epochs);
+        destroy_art_tree(&m->set_map);
+        free(m);
+        return -1;
+    }
+
+    // The archive is opened before the sets, which may be in it
+    if (!config->read_only && (res = init_archive(config->data_dir, &m->archive))) {
+        syslog(LOG_ERR, "Failed to open the archive! Err: %d", res);
+        destroy_slab(m->slab);
+        destroy_wal(m->wal);
+        destroy_epochs(m->epochs);
+        destroy_art_tree(&m->set_map);
+        free(m);
+        return -1;
+    }
+
     // Discover existing sets
+    init_manifest(config->data_dir, &m->manifest);
     load_existing_sets(m);
 
-    // Initialize the alternate map
-    res = art_copy(m->alt_set_map, m->set_map);
-    if (res) {
-        syslog(LOG_ERR, "Failed to copy set map to alternate!");
-        destroy_set_manager(m);
-        return -1;
+    // Replay the raises lost since the last flushes. They are
+    // logged again as they are applied, so the replayed
+    // segments are removed by the checkpoint.
+    if (m->wal) {
+        int num = wal_replay(m->wal, replay_wal_cb, m);
+        if (num) syslog(LOG_INFO, "Replayed %d records of the write-ahead log", num);
+        setmgr_checkpoint_wal(m);
     }
 
+    init_art_tree(&m->creating);
+
     // Start the vacuum thread
     m->should_run = vacuum;
     if (vacuum && pthread_create(&m->vacuum_thread, NULL, setmgr_thread_main, m)) {
@@ -191,6 +587,28 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
         return 1;
     }
 
+    // Start the page-in threads
+    m->page_in_queues = (config->num_data_dirs > 1) ? config->num_data_dirs : 1;
+    m->page_in_head = calloc(m->page_in_queues, sizeof(page_in_job*));
+    m->page_in_tail = calloc(m->page_in_queues, sizeof(page_in_job*));
+    m->page_in_threads = calloc(m->page_in_queues, sizeof(pthread_t));
+    m->page_in_run = 1;
+    for (int i=0; i < m->page_in_queues; i++) {
+        if (pthread_create(&m->page_in_threads[i], NULL, page_in_thread_main, m)) {
+            perror("Failed to start page-in thread!");
+            destroy_set_manager(m);
+            return 1;
+        }
+        m->page_in_started++;
+    }
+
+    // Page the sets that were hot back in, while clients connect
+    m->prewarm_run = config->prewarm;
+    if (config->prewarm && pthread_create(&m->prewarm_thread, NULL, prewarm_thread_main, m)) {
+        perror("Failed to start prewarm thread!");
+        m->prewarm_run = 0;
+    }
+
     // Done
     return 0;
 }
@@ -201,39 +619,88 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
  * @return 0 on success.
  */
 int destroy_set_manager(hlld_setmgr *mgr) {
-    // Stop the vacuum thread
+    // Stop the prewarm, page-in and vacuum threads
+    if (mgr->prewarm_run) {
+        mgr->prewarm_run = 0;
+        pthread_join(mgr->prewarm_thread, NULL);
+    }
+    setmgr_stop_page_in(mgr);
     mgr->should_run = 0;
+    epoch_notify(mgr->epochs);
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
+    // Remember the sets in memory, then flush the
+    // sets, and record their final sizes
+    if (mgr->config->prewarm && !mgr->config->read_only) setmgr_save_hot_sets(mgr);
+    load_list all = {mgr, NULL, 0, 0};
+    art_iter(&mgr->set_map, set_map_collect_cb, &all);
+    close_round flushes = {all.sets, all.num, flush_closing_set, "Flushed", 0, 0};
+    run_close_round(mgr, &flushes);
+    if (!mgr->config->read_only) {
+        snapshot_manifest(mgr);
+        manifest_checkpoint_end(mgr->manifest);
+    }
+    if (mgr->slab) setmgr_sync_slab(mgr);
+
+    // The flushed sets no longer need the write-ahead log
+    if (mgr->wal) setmgr_checkpoint_wal(mgr);
+
     // Nuke all the keys in the current version.
-    art_iter(mgr->set_map, set_map_delete_cb, mgr);
+    close_round closes = {all.sets, all.num, delete_set, "Closed", 0, 0};
+    run_close_round(mgr, &closes);
+    free(all.sets);
 
-    // Handle any delta operations
-    set_list *next, *current = mgr->delta;
+    // Delete the dropped sets not yet reclaimed, their
+    // nodes are released with the tree
+    set_garbage *next, *current = mgr->garbage;
     while (current) {
-        // Only delete pending creates, pending
-        // deletes are still in the primary tree
-        if (current->type == CREATE)
-            delete_set(current->set);
+        for (int i=0; i < current->num_sets; i++) delete_set(current->sets[i]);
         next = current->next;
+        free(current->nodes);
+        free(current->sets);
         free(current);
         current = next;
     }
+    clear_pending_deletes(mgr);
+    destroy_art_tree(&mgr->creating);
+
+    // Free the handles
+    for (int i=0; i < mgr->num_handles; i++) free(mgr->handle_names[i]);
+    free(mgr->handle_names);
+    destroy_art_tree(&mgr->handle_ids);
+    pthread_mutex_destroy(&mgr->handle_lock);
+
+    // Free the expiry wheel
+    for (int i=0; mgr->expiry_wheel && i < EXPIRY_SLOTS; i++) {
+        expiry_entry *e = mgr->expiry_wheel[i], *next;
+        while (e) {
+            next = e->next;
+            free(e->set_name);
+            free(e);
+            e = next;
+        }
+    }
+    free(mgr->expiry_wheel);
+    pthread_mutex_destroy(&mgr->expiry_lock);
 
     // Free the clients
-    setmgr_client *cl_next, *cl = mgr->clients;
-    while (cl) {
-        cl_next = cl->next;
-        free(cl);
-        cl = cl_next;
-    }
+    destroy_epochs(mgr->epochs);
 
-    // Destroy the ART trees
-    destroy_art_tree(mgr->set_map);
-    destroy_art_tree(mgr->alt_set_map);
-    free((mgr->set_map < mgr->alt_set_map) ? mgr->set_map : mgr->alt_set_map);
+    // Free the page-in queues, their threads are stopped
+    free(mgr->page_in_head);
+    free(mgr->page_in_tail);
+    free(mgr->page_in_threads);
+
+    // Destroy the ART tree
+    destroy_art_tree(&mgr->set_map);
 
     // Free the manager
+    destroy_wal(mgr->wal);
+    destroy_slab(mgr->slab);
+    if (mgr->archive) destroy_archive(mgr->archive);
+    destroy_manifest(mgr->manifest);
+    free_set_stats(mgr->stats, mgr->num_stats);
+    pthread_mutex_destroy(&mgr->stats_lock);
     free(mgr);
     return 0;
 }
@@ -247,33 +714,18 @@ int destroy_set_manager(hlld_setmgr *mgr) {
  * @arg mgr The manager
  */
 void setmgr_client_checkpoint(hlld_setmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    setmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            cl->vsn = mgr->vsn;
-            return;
-        }
-        cl = cl->next;
-    }
-
-    // If we make it here, we are not a client yet
-    // so we need to safely add ourself
-    cl = malloc(sizeof(setmgr_client));
-    cl->id = id;
-    cl->vsn = mgr->vsn;
-
-    // Critical section for the flip
-    LOCK_HLLD_SPIN(&mgr->clients_lock);
-
-    cl->next = mgr->clients;
-    mgr->clients = cl;
+    epoch_checkpoint(mgr->epochs);
+}
 
-    UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+/**
+ * Should be invoked by clients before they block, such as
+ * when waiting for events. The client holds no references
+ * until its next checkpoint, so vacuuming is not held back
+ * while it waits. This is cheaper than leaving.
+ * @arg mgr The manager
+ */
+void setmgr_client_idle(hlld_setmgr *mgr) {
+    epoch_idle(mgr->epochs);
 }
 
 /**
@@ -283,29 +735,75 @@ void setmgr_client_checkpoint(hlld_setmgr *mgr) {
  * @arg mgr The manager
  */
 void setmgr_client_leave(hlld_setmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Critical section
-    LOCK_HLLD_SPIN(&mgr->clients_lock);
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    setmgr_client **last_next = &mgr->clients;
-    setmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            // Set the last prev pointer to skip the current entry
-            *last_next = cl->next;
-
-            // Cleanup the memory associated
-            free(cl);
-            break;
-        }
-        last_next = &cl->next;
-        cl = cl->next;
+    epoch_leave(mgr->epochs);
+}
+
+/**
+ * Queues a proxied set to be paged in on the page-in
+ * thread, so that the caller does not block on the disk.
+ * @arg set_name The name of the set
+ * @arg cb Invoked on the page-in thread once the set is loaded
+ * @arg data Opaque pointer passed to the callback
+ * @return 1 if the page in was queued, and cb will be invoked.
+ * 0 if the set is not proxied or paging in is stopped, and
+ * -1 if the set does not exist.
+ */
+int setmgr_page_in_async(hlld_setmgr *mgr, char *set_name, page_in_cb cb, void *data) {
+    // Get the set
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+    if (!hset_is_proxied(set->set)) return 0;
+
+    page_in_job *job = calloc(1, sizeof(page_in_job));
+    job->set_name = strdup(set_name);
+    job->cb = cb;
+    job->data = data;
+    if (queue_page_in(mgr, job, hset_data_dir(set->set))) {
+        free(job->set_name);
+        free(job);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Queues a job on the page-in thread of a data directory
+ * @return 0 if queued, or -1 if paging in is stopped.
+ */
+static int queue_page_in(hlld_setmgr *mgr, page_in_job *job, int data_dir) {
+    pthread_mutex_lock(&mgr->page_in_lock);
+    if (!mgr->page_in_run) {
+        pthread_mutex_unlock(&mgr->page_in_lock);
+        return -1;
     }
-    UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+    int queue = data_dir % mgr->page_in_queues;
+    if (mgr->page_in_tail[queue])
+        mgr->page_in_tail[queue]->next = job;
+    else
+        mgr->page_in_head[queue] = job;
+    mgr->page_in_tail[queue] = job;
+    if (mgr->page_in_queues > 1)
+        pthread_cond_broadcast(&mgr->page_in_cond);
+    else
+        pthread_cond_signal(&mgr->page_in_cond);
+    pthread_mutex_unlock(&mgr->page_in_lock);
+    return 0;
+}
+
+/**
+ * Stops paging in sets asynchronously. Queued page ins
+ * are finished first. Later requests are refused, so their
+ * callers load the sets inline.
+ * @arg mgr The manager
+ */
+void setmgr_stop_page_in(hlld_setmgr *mgr) {
+    pthread_mutex_lock(&mgr->page_in_lock);
+    mgr->page_in_run = 0;
+    int started = mgr->page_in_started;
+    mgr->page_in_started = 0;
+    pthread_cond_broadcast(&mgr->page_in_cond);
+    pthread_mutex_unlock(&mgr->page_in_lock);
+    for (int i=0; i < started; i++) pthread_join(mgr->page_in_threads[i], NULL);
 }
 
 /**
@@ -321,13 +819,14 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name) {
     // Acquire the READ lock. We use the read lock
     // since clients might inspect the hll, which
     // should not be cleared in the mean time
-    pthread_rwlock_rdlock(&set->rwlock);
+    lock_set(set, 0);
 
     // Flush
     hset_flush(set->set);
 
     // Release the lock
-    pthread_rwlock_unlock(&set->rwlock);
+    brlock_rdunlock(&set->lock);
+    if (mgr->slab) setmgr_sync_slab(mgr);
     return 0;
 }
 
@@ -337,109 +836,1058 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name) {
  * @arg keys A list of points to character arrays to add
  * @arg num_keys The number of keys to add
  * * @return 0 on success, -1 if the set does not exist.
- * -2 on internal error.
+ * -2 on internal error, -3 if the set only accepts hashes.
  */
 int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys) {
+    return setmgr_set_sized_keys(mgr, set_name, keys, NULL, num_keys);
+}
+
+/**
+ * Sets keys of known lengths in a given set. The
+ * keys need not be null terminated.
+ * @arg set_name The name of the set
+ * @arg keys A list of points to character arrays to add
+ * @arg lens The length of each key
+ * @arg num_keys The number of keys to add
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set only accepts hashes.
+ */
+int setmgr_set_sized_keys(hlld_setmgr *mgr, char *set_name, char **keys, int *lens, int num_keys) {
     // Get the set
-    hlld_set_wrapper *set = take_set(mgr, set_name);
+    hlld_set_wrapper *set = take_write_set(mgr, set_name);
     if (!set) return -1;
 
     // Acquire the READ lock. We use the read lock
     // since we can handle concurrent writes.
-    pthread_rwlock_rdlock(&set->rwlock);
+    lock_set(set, 0);
 
-    // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = hset_add(set->set, keys[i]);
-        if (res) break;
-    }
+    // Set the keys in a single batch
+    int res = hset_add_batch(set->set, keys, lens, num_keys);
 
     // Mark as hot
-    set->is_hot = 1;
+    touch_set(mgr, set);
 
     // Release the lock
-    pthread_rwlock_unlock(&set->rwlock);
-    return (res == -1) ? -2 : 0;
+    brlock_rdunlock(&set->lock);
+    return (res == -1) ? -2 : (res == -2) ? -3 : 0;
 }
 
 /**
- * Estimates the size of a set
+ * Sets client computed hashes in a given set. The
+ * set must have been created with the external hash.
  * @arg set_name The name of the set
- * @arg est Output pointer, the estimate on success.
+ * @arg hashes A list of 64 bit hashes to add
+ * @arg num_hashes The number of hashes to add
  * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set does not accept hashes.
  */
-int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est) {
+int setmgr_set_hashes(hlld_setmgr *mgr, char *set_name, uint64_t *hashes, int num_hashes) {
     // Get the set
-    hlld_set_wrapper *set = take_set(mgr, set_name);
+    hlld_set_wrapper *set = take_write_set(mgr, set_name);
     if (!set) return -1;
 
-    // Acquire the READ lock. We use the read lock
-    // since we can handle concurrent read/writes.
-    pthread_rwlock_rdlock(&set->rwlock);
-
-    // Get the size
-    *est = hset_size(set->set);
-
-    // Release the lock
-    pthread_rwlock_unlock(&set->rwlock);
-    return 0;
+    // Acquire the READ lock, since we can handle concurrent writes
+    lock_set(set, 0);
+    int res = hset_add_hashes(set->set, hashes, num_hashes);
+    touch_set(mgr, set);
+    brlock_rdunlock(&set->lock);
+    return (res == -1) ? -2 : (res == -2) ? -3 : 0;
 }
 
 /**
- * Creates a new set of the given name and parameters.
- * @arg set_name The name of the set
- * @arg custom_config Optional, can be null. Configs that override the defaults.
- * @return 0 on success, -1 if the set already exists.
- * -2 for internal error. -3 if there is a pending delete.
+ * Sets the same keys in many sets. Each key is hashed once
+ * for each hash function used by the sets, rather than once
+ * for every set.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg results The result of each set, as returned by setmgr_set_keys.
+ * Sets with a non-zero result are skipped, so that the results
+ * can be reused across batches of keys. Must start zeroed.
+ * @return 0 if every set was updated, otherwise the number
+ * of sets that were not.
  */
-int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_config) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+int setmgr_set_keys_multi(hlld_setmgr *mgr, char **set_names, int num_sets,
+        char **keys, int num_keys, int *results) {
+    uint64_t hashes[HLL_HASH_EXTERNAL][MULTI_HASH_BATCH];
+    for (int base=0; base < num_keys; base += MULTI_HASH_BATCH) {
+        int group = (num_keys - base < MULTI_HASH_BATCH) ? num_keys - base : MULTI_HASH_BATCH;
+        int hashed[HLL_HASH_EXTERNAL] = {0};
+
+        for (int i=0; i < num_sets; i++) {
+            if (results[i]) continue;
+            hlld_set_wrapper *set = take_write_set(mgr, set_names[i]);
+            if (!set) {
+                results[i] = -1;
+                continue;
+            }
 
-    /*
-     * Bail if the set already exists.
-     * -1 if the set is active
-     * -3 if delete is pending
-     */
-    hlld_set_wrapper *set = find_set(mgr, set_name);
-    if (set) {
-        res = (set->is_active) ? -1 : -3;
-        goto LEAVE;
-    }
+            // Sets of client computed hashes have no keys
+            hll_hash hash = set->set->set_config.hash;
+            if (hash == HLL_HASH_EXTERNAL) {
+                results[i] = -3;
+                continue;
+            }
 
-    // Scan the pending delete queue
-    LOCK_HLLD_SPIN(&mgr->pending_lock);
-    if (mgr->pending_deletes) {
-        hlld_set_list *node = mgr->pending_deletes;
-        while (node) {
-            if (!strcmp(node->set_name, set_name)) {
-                res = -3; // Pending delete
-                UNLOCK_HLLD_SPIN(&mgr->pending_lock);
-                goto LEAVE;
+            // Hash the keys for the first set using this hash
+            if (!hashed[hash]) {
+                for (int j=0; j < group; j++) {
+                    char *key = keys[base + j];
+                    hashes[hash][j] = hll_hash_key(hash, key, strlen(key));
+                }
+                hashed[hash] = 1;
             }
-            node = node->next;
+
+            // Acquire the READ lock, since we can handle concurrent writes
+            lock_set(set, 0);
+            int res = hset_add_hashed(set->set, hash, hashes[hash], group);
+            touch_set(mgr, set);
+            brlock_rdunlock(&set->lock);
+            if (res) results[i] = (res == -1) ? -2 : -3;
         }
     }
-    UNLOCK_HLLD_SPIN(&mgr->pending_lock);
 
-    // Use a custom config if provided, else the default
-    hlld_config *config = (custom_config) ? custom_config : mgr->config;
+    int failed = 0;
+    for (int i=0; i < num_sets; i++) {
+        if (results[i]) failed++;
+    }
+    return failed;
+}
 
-    // Add the set
-    if (add_set(mgr, set_name, config, 1, 1)) {
-        res = -2; // Internal error
+/**
+ * Sets a key in many sets, hashing it once for
+ * each hash function used by the sets.
+ * @arg key The key to add
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg results The result of each set, as with setmgr_set_keys_multi.
+ * Must start zeroed.
+ * @return 0 if every set was updated, otherwise the number
+ * of sets that were not.
+ */
+int setmgr_set_key_many(hlld_setmgr *mgr, char *key, char **set_names, int num_sets, int *results) {
+    return setmgr_set_keys_multi(mgr, set_names, num_sets, &key, 1, results);
+}
+
+/**
+ * Merges a list of sets into a destination set, so that
+ * the destination estimates the size of their union.
+ * The source sets are not modified, and those of a higher
+ * precision are folded down to that of the destination.
+ * @arg dst_name The name of the set to merge into
+ * @arg src_names A list of set names to merge from
+ * @arg num_srcs The number of source sets
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ or a source has a lower precision
+ * than the destination, -3 on internal error.
+ */
+int setmgr_merge_sets(hlld_setmgr *mgr, char *dst_name, char **src_names, int num_srcs) {
+    // Get the sets, verify all of them before changing anything
+    hlld_set_wrapper *dst = take_set(mgr, dst_name);
+    if (!dst) return -1;
+
+    hlld_set_wrapper **srcs = calloc(num_srcs, sizeof(hlld_set_wrapper*));
+    int res = take_sets(mgr, src_names, num_srcs, srcs);
+    if (!res && !hset_compatible(srcs[0]->set, dst->set))
+        res = -2;
+    for (int i=0; i < num_srcs && !res; i++) {
+        if (srcs[i]->set->set_config.default_precision <
+                dst->set->set_config.default_precision)
+            res = -2;
+    }
+    if (res) goto LEAVE;
+
+    // Acquire the READ lock on the destination, since
+    // the merge can handle concurrent writes
+    lock_set(dst, 0);
+
+    // Merge each source under its own READ lock
+    for (int i=0; i < num_srcs; i++) {
+        if (srcs[i] == dst) continue;
+        lock_set(srcs[i], 0);
+        res = hset_union(dst->set, srcs[i]->set);
+        brlock_rdunlock(&srcs[i]->lock);
+        if (res) break;
     }
 
+    // Mark as hot
+    touch_set(mgr, dst);
+
+    // Release the lock
+    brlock_rdunlock(&dst->lock);
+    if (res == -1) res = -3;
+
 LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
+    free(srcs);
     return res;
 }
 
 /**
- * Deletes the set entirely. This removes it from the set
- * manager and deletes it from disk. This is a permanent operation.
- * @arg set_name The name of the set to delete
+ * Merges registers built elsewhere into a set, such as the
+ * HLL of an edge node, so that the set estimates the size of
+ * their union. The registers must use the hash of the set,
+ * and those of a higher precision are folded down.
+ * @arg set_name The name of the set to merge into
+ * @arg precision The precision of the registers
+ * @arg layout The layout of the registers
+ * @arg payload The registers, as with hset_merge_raw
+ * @arg len The length of the payload
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 if the precision is lower than that of the set,
+ * -3 on internal error, -4 if the payload is invalid.
+ */
+int setmgr_merge_raw(hlld_setmgr *mgr, char *set_name, unsigned char precision,
+        hset_raw_layout layout, const unsigned char *payload, uint64_t len) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // A READ lock is enough, as with merges of sets
+    lock_set(set, 0);
+    int res = hset_merge_raw(set->set, precision, layout, payload, len);
+    touch_set(mgr, set);
+    brlock_rdunlock(&set->lock);
+    switch (res) {
+        case -1:
+            return -3;
+        case -3:
+            return -4;
+        default:
+            return res;
+    }
+}
+
+/**
+ * Reads the registers of a set, so that they can be merged
+ * elsewhere or sent back with setmgr_merge_raw
+ * @arg set_name The name of the set
+ * @arg sparse Should dense registers be listed as entries
+ * @arg cb Invoked with the registers, while the set is held
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, -1 if the set does not exist.
+ * -3 on internal error.
+ */
+int setmgr_get_raw(hlld_setmgr *mgr, char *set_name, int sparse, hset_raw_cb cb, void *data) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // The READ lock keeps the registers mapped
+    lock_set(set, 0);
+    int res = hset_raw_registers(set->set, sparse, cb, data);
+    touch_set(mgr, set);
+    brlock_rdunlock(&set->lock);
+    return (res) ? -3 : 0;
+}
+
+/**
+ * Estimates the size of the union of a list of sets,
+ * without modifying any of them. The union is at the
+ * lowest precision of the sets.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error.
+ */
+int setmgr_size_union(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est) {
+    return setmgr_size_union_remote(mgr, set_names, num_sets, NULL, NULL, 0, est);
+}
+
+/**
+ * Estimates the size of the union of a list of sets and
+ * the registers of sets fetched from other servers,
+ * without modifying any of them. The union is at the
+ * lowest precision of the sets.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets, may be 0
+ * @arg remotes The registers of the remote sets
+ * @arg remote_configs The config of each remote set
+ * @arg num_remote The number of remote sets
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error.
+ */
+int setmgr_size_union_remote(hlld_setmgr *mgr, char **set_names, int num_sets,
+        hll_t **remotes, hlld_set_config **remote_configs, int num_remote, uint64_t *est) {
+    hlld_set_wrapper **sets = calloc(num_sets + 1, sizeof(hlld_set_wrapper*));
+    int res = take_sets(mgr, set_names, num_sets, sets);
+    if (res) goto LEAVE;
+
+    // The remote sets must use the hash of the first set, and
+    // the union is folded down to the lowest precision
+    hlld_set_config *first = (num_sets) ? &sets[0]->set->set_config : remote_configs[0];
+    unsigned char precision = min_precision(sets, num_sets);
+    for (int i=0; i < num_remote; i++) {
+        if (remote_configs[i]->hash != first->hash) {
+            res = -2;
+            goto LEAVE;
+        }
+        if (remotes[i]->precision < precision) precision = remotes[i]->precision;
+    }
+
+    // Merge into a scratch HLL, so no set is changed
+    hll_t *scratch = hll_scratch(precision, 0);
+    if (!scratch) {
+        res = -3;
+        goto LEAVE;
+    }
+
+    // Merge each set under its own READ lock
+    for (int i=0; i < num_sets && !res; i++) {
+        lock_set(sets[i], 0);
+        res = hset_merge_into(sets[i]->set, scratch);
+        brlock_rdunlock(&sets[i]->lock);
+    }
+    for (int i=0; i < num_remote && !res; i++) {
+        res = hll_union(scratch, remotes[i]);
+    }
+    if (res == -1) res = -3;
+    if (!res) *est = hll_size(scratch);
+
+LEAVE:
+    free(sets);
+    return res;
+}
+
+/*
+ * Estimates the Jaccard similarity of sets from the smallest
+ * hashes they keep, copying each under its own READ lock.
+ * @return 0 on success, -3 on internal error, -5 if a set
+ * does not keep its smallest hashes.
+ */
+static int jaccard_sets(hlld_set_wrapper **sets, int num_sets, double *jaccard, double *union_size) {
+    for (int i=0; i < num_sets; i++) {
+        if (!sets[i]->set->set_config.kmv) return -5;
+    }
+    kmv_sketch *copies = calloc(num_sets, sizeof(kmv_sketch));
+    kmv_sketch **sketches = calloc(num_sets, sizeof(kmv_sketch*));
+    int res = (copies && sketches) ? 0 : -3, copied = 0;
+    for (; copied < num_sets && !res; copied++) {
+        lock_set(sets[copied], 0);
+        res = hset_copy_kmv(sets[copied]->set, copies + copied);
+        brlock_rdunlock(&sets[copied]->lock);
+        if (res) break;
+        sketches[copied] = copies + copied;
+    }
+    if (!res && kmv_jaccard(sketches, num_sets, jaccard, union_size)) res = -3;
+    for (int i=0; i < copied; i++) kmv_destroy(copies + i);
+    free(copies);
+    free(sketches);
+    return (res == -1) ? -3 : res;
+}
+
+/**
+ * Estimates the size of the intersection of a list of sets,
+ * without modifying any of them. Sets that all keep their
+ * smallest hashes scale the size of their union by their
+ * Jaccard similarity, which keeps the error relative to the
+ * intersection. Otherwise the inclusion-exclusion principle
+ * is used, whose error grows quickly with the number of sets,
+ * and is large when the intersection is small. The sets are
+ * combined at their lowest precision.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets, at most SETMGR_MAX_INTERSECT
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error,
+ * -4 if there are too many sets.
+ */
+int setmgr_size_intersect(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est) {
+    if (num_sets > SETMGR_MAX_INTERSECT) return -4;
+    hlld_set_wrapper *sets[SETMGR_MAX_INTERSECT];
+    int res = take_sets(mgr, set_names, num_sets, sets);
+    if (res) return res;
+
+    // Snapshot each set into the scratch slots after the first,
+    // folded down to the lowest precision
+    unsigned char precision = min_precision(sets, num_sets);
+    hll_t *snaps[SETMGR_MAX_INTERSECT];
+    for (int i=0; i < num_sets && !res; i++) {
+        snaps[i] = hll_scratch(precision, i + 1);
+        if (!snaps[i]) return -3;
+        lock_set(sets[i], 0);
+        res = hset_merge_into(sets[i]->set, snaps[i]);
+        brlock_rdunlock(&sets[i]->lock);
+    }
+    if (res) return (res == -1) ? -3 : res;
+
+    // Sum the union of every subset, adding odd sized subsets
+    // and subtracting even sized ones. Sets that keep their
+    // smallest hashes only need the union of them all.
+    double jaccard, total = 0, min_size = -1, size;
+    int sampled = !jaccard_sets(sets, num_sets, &jaccard, NULL);
+    int all = (1 << num_sets) - 1;
+    for (int mask=1; mask <= all; mask++) {
+        int bits = __builtin_popcount(mask);
+        if (sampled && bits > 1 && mask != all) continue;
+        hll_t *work = hll_scratch(precision, 0);
+        if (!work) return -3;
+        for (int i=0; i < num_sets; i++) {
+            if (mask & (1 << i)) hll_union(work, snaps[i]);
+        }
+        size = hll_size(work);
+        if (!sampled)
+            total += (bits % 2) ? size : -size;
+        else if (mask == all)
+            total = jaccard * size;
+        if (bits == 1 && (min_size < 0 || size < min_size))
+            min_size = size;
+    }
+
+    // Clamp to the sane range
+    if (total < 0) total = 0;
+    if (total > min_size) total = min_size;
+    *est = total + 0.5;
+    return 0;
+}
+
+/**
+ * Estimates the Jaccard similarity of a list of sets, the
+ * size of their intersection over that of their union, from
+ * the smallest hashes each keeps. The sets are compared at
+ * the fewest hashes any of them keeps.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets
+ * @arg jaccard Output pointer, the similarity from 0 to 1.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error,
+ * -5 if a set does not keep its smallest hashes.
+ */
+int setmgr_jaccard(hlld_setmgr *mgr, char **set_names, int num_sets, double *jaccard) {
+    hlld_set_wrapper **sets = calloc(num_sets + 1, sizeof(hlld_set_wrapper*));
+    int res = take_sets(mgr, set_names, num_sets, sets);
+    if (!res) res = jaccard_sets(sets, num_sets, jaccard, NULL);
+    free(sets);
+    return res;
+}
+
+/**
+ * Estimates the size of a set
+ * @arg set_name The name of the set
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est) {
+    // Get the set
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // Cached sizes are read without the lock, so
+    // dashboards do not slow down the writers
+    if (hset_read_size(set->set, est)) return 0;
+
+    // Acquire the READ lock. We use the read lock
+    // since we can handle concurrent read/writes.
+    lock_set(set, 0);
+
+    // Get the size
+    *est = hset_size(set->set);
+
+    // Release the lock
+    brlock_rdunlock(&set->lock);
+    return 0;
+}
+
+/**
+ * Estimates the size of many sets at once. The sets whose
+ * estimates are not cached are split across a few threads.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg sizes Output, the estimate of each set
+ * @arg results The result of each set, 0 or -1 if the set
+ * does not exist. Must start zeroed.
+ * @return 0 if every set exists, otherwise the number
+ * of sets that do not.
+ */
+int setmgr_set_sizes(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *sizes, int *results) {
+    hlld_set_wrapper **sets = malloc(num_sets * sizeof(hlld_set_wrapper*));
+    int *cold = malloc(num_sets * sizeof(int));
+    int missing = 0, num_cold = 0;
+
+    // Hold every set while the sizes are estimated, so the
+    // helper threads need not take the locks of their own
+    for (int i=0; i < num_sets; i++) {
+        sets[i] = take_set(mgr, set_names[i]);
+        if (!sets[i]) {
+            results[i] = -1;
+            missing++;
+            continue;
+        }
+        lock_set(sets[i], 0);
+        if (hset_size_cached(sets[i]->set))
+            sizes[i] = hset_size(sets[i]->set);
+        else
+            cold[num_cold++] = i;
+    }
+
+    // Do not bother with threads for few estimates
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = num_cold / MIN_SETS_PER_SIZE_THREAD;
+    if (cores > 0 && num_threads > cores) num_threads = cores;
+    if (num_threads > MAX_SIZE_THREADS) num_threads = MAX_SIZE_THREADS;
+
+    size_round round = {sets, sizes, cold, num_cold, 0};
+    pthread_t threads[MAX_SIZE_THREADS];
+    int started = 0;
+    for (; started < num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, size_worker_main, &round)) break;
+    }
+    size_worker_main(&round);
+    for (int i=0; i < started; i++) pthread_join(threads[i], NULL);
+
+    for (int i=num_sets - 1; i >= 0; i--) {
+        if (sets[i]) brlock_rdunlock(&sets[i]->lock);
+    }
+    free(sets);
+    free(cold);
+    return missing;
+}
+
+/**
+ * Reads the sizes of many sets from their metadata alone,
+ * without the set locks and without estimates, so that a
+ * scan of the catalog never faults a set in or waits on
+ * its writers. Proxied sets, and those whose estimate is
+ * not cached, answer with the size of their last flush.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg sizes Output, the size of each set
+ * @arg results The result of each set, 0 if the size is
+ * current, 1 if it is stale, or -1 if the set does not exist.
+ * @return 0 if every set exists, otherwise the number
+ * of sets that do not.
+ */
+int setmgr_set_sizes_metadata(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *sizes, int *results) {
+    int missing = 0;
+    for (int i=0; i < num_sets; i++) {
+        hlld_set_wrapper *set = take_set(mgr, set_names[i]);
+        if (!set) {
+            results[i] = -1;
+            missing++;
+            continue;
+        }
+        results[i] = hset_metadata_size(set->set, sizes + i);
+    }
+    return missing;
+}
+
+/**
+ * Estimates the sets of a size round. Each thread
+ * takes the next set that is not cached.
+ */
+static void* size_worker_main(void *in) {
+    size_round *round = in;
+    int idx;
+    while ((idx = __sync_fetch_and_add(&round->next, 1)) < round->num) {
+        int set = round->cold[idx];
+        round->sizes[set] = hset_size(round->sets[set]->set);
+    }
+    return NULL;
+}
+
+/**
+ * Estimates the keys added to a windowed or sliding set
+ * over its recent intervals, merging the registers that
+ * cover them.
+ * @arg set_name The name of the set
+ * @arg span The seconds to cover. Windowed sets round it
+ * up to whole intervals.
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if the set is not windowed, -3 on internal error.
+ */
+int setmgr_set_size_window(hlld_setmgr *mgr, char *set_name, uint64_t span, uint64_t *est) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // Acquire the READ lock, the window handles concurrent adds
+    lock_set(set, 0);
+    int res = hset_size_window(set->set, span, est);
+    touch_set(mgr, set);
+    brlock_rdunlock(&set->lock);
+    return (res == -1) ? -3 : res;
+}
+
+/**
+ * Raises the registers of a set, as streamed from a primary.
+ * A missing set is created with the config of the primary.
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set on the primary
+ * @arg entries The register entries, as packed by HLL_ENTRY
+ * @arg num The number of entries
+ * @return 0 on success, -1 if the set could not be created,
+ * -2 on internal error, -3 if the set is not compatible.
+ */
+int setmgr_raise_registers(hlld_setmgr *mgr, char *set_name, hlld_set_config *set_config,
+        const uint32_t *entries, int num) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) {
+        // Create the set as the primary has it
+        hlld_config *config = config_for_set(mgr, set_config);
+        int res = setmgr_create_set(mgr, set_name, config);
+        if (res) free(config);
+        if (res == -3) return -1;
+        set = take_set(mgr, set_name);
+        if (!set) return -1;
+    }
+
+    lock_set(set, 0);
+    int res = -3;
+    if (set->set->set_config.default_precision == set_config->default_precision &&
+            set->set->set_config.hash == set_config->hash) {
+        res = (hset_raise_registers(set->set, entries, num)) ? -2 : 0;
+    }
+    brlock_rdunlock(&set->lock);
+    return res;
+}
+
+/**
+ * Gets the register entries of a set to stream to followers.
+ * @arg set_name The name of the set
+ * @arg full Should every register be returned, rather than the raises
+ * @arg set_config Output, the config of the set
+ * @arg entries Output, a malloc()'d list of register entries,
+ * or NULL to drop the raises
+ * @return The number of entries, -1 if the set does not
+ * exist, or -2 on internal error.
+ */
+int setmgr_replication_entries(hlld_setmgr *mgr, char *set_name, int full,
+        hlld_set_config *set_config, uint32_t **entries) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // The read lock keeps the set from being unmapped
+    lock_set(set, 0);
+    int res = hset_replication_entries(set->set, full, entries);
+    memcpy(set_config, &set->set->set_config, sizeof(hlld_set_config));
+    brlock_rdunlock(&set->lock);
+    return (res < 0) ? -2 : res;
+}
+
+/**
+ * Dumps a set, with its config, so that it can be restored
+ * on another server with setmgr_restore_set.
+ * @arg set_name The name of the set
+ * @arg dump Output, a malloc()'d buffer of the dump
+ * @arg len Output, the length of the dump
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 on internal error.
+ */
+int setmgr_dump_set(hlld_setmgr *mgr, char *set_name, unsigned char **dump, uint64_t *len) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // The read lock keeps the set from being unmapped
+    lock_set(set, 0);
+    unsigned char *regs;
+    uint64_t regs_len;
+    int res = hset_dump(set->set, &regs, &regs_len);
+    if (!res) {
+        hlld_set_config set_config = set->set->set_config;
+        set_config.size = hset_size(set->set);
+        res = dump_encode(&set_config, regs, regs_len, dump, len);
+        free(regs);
+    }
+    brlock_rdunlock(&set->lock);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Registers the callback that has requested snapshots written
+ * in the background, with setmgr_write_snapshot.
+ * @arg mgr The manager
+ * @arg cb Invoked when a snapshot is requested
+ * @arg data Opaque pointer passed to the callback
+ */
+void setmgr_snapshot_cb(hlld_setmgr *mgr, snapshot_cb cb, void *data) {
+    mgr->snapshot_data = data;
+    mgr->snapshot_cb = cb;
+}
+
+/**
+ * Requests a snapshot of every set, written in the background
+ * @arg mgr The manager
+ * @return 0 if requested, -1 if a snapshot is already in
+ * progress, or -2 if snapshots are not written.
+ */
+int setmgr_request_snapshot(hlld_setmgr *mgr) {
+    if (!mgr->snapshot_cb) return -2;
+    if (__sync_lock_test_and_set(&mgr->snapshot_busy, 1)) return -1;
+    mgr->snapshot_cb(mgr->snapshot_data);
+    return 0;
+}
+
+/**
+ * Records the sets in memory, hottest first, so they
+ * are paged in again once the server restarts with
+ * prewarm. Invoked on each checkpoint, and on shutdown.
+ * @arg mgr The manager
+ * @return 0 on success, negative errno on failure.
+ */
+int setmgr_save_hot_sets(hlld_setmgr *mgr) {
+    lru_list list = {NULL, 0, 0, 0};
+    art_iter(&mgr->set_map, set_map_list_lru_cb, &list);
+    if (list.num) qsort(list.entries, list.num, sizeof(lru_entry), compare_hot);
+
+    char *path = join_path(mgr->config->data_dir, (char*)HOT_SETS_FILENAME);
+    char *tmp_path = join_path(mgr->config->data_dir, (char*)TMP_HOT_SETS_FILENAME);
+    int res = 0;
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        res = -errno;
+        goto LEAVE;
+    }
+    for (int i=0; i < list.num && !res; i++) {
+        if (fprintf(f, "%s\n", list.entries[i].name) < 0) res = (errno) ? -errno : -EIO;
+    }
+    if (!res && fflush(f)) res = -errno;
+    fclose(f);
+    if (!res && rename(tmp_path, path)) res = -errno;
+    if (res) unlink(tmp_path);
+
+LEAVE:
+    if (res) syslog(LOG_WARNING, "Failed to record the hot sets. %s", strerror(-res));
+    free(list.entries);
+    free(path);
+    free(tmp_path);
+    return res;
+}
+
+/**
+ * Writes a snapshot of every set to the data directory, as a
+ * stream of their dumps. Each set is dumped as of a point in
+ * the snapshot, under a read lock that writes share, and the
+ * file is replaced once all the sets are written. Completes
+ * the requested snapshot, if any.
+ * @arg mgr The manager
+ * @arg num_sets Output, the number of sets written
+ * @return 0 on success, negative errno on failure.
+ */
+int setmgr_write_snapshot(hlld_setmgr *mgr, int *num_sets) {
+    *num_sets = 0;
+    char *path = join_path(mgr->config->data_dir, (char*)SNAPSHOT_FILENAME);
+    char *tmp_path = join_path(mgr->config->data_dir, (char*)TMP_SNAPSHOT_FILENAME);
+    hlld_set_list_head *head = NULL;
+    int res = 0;
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        res = -errno;
+        goto LEAVE;
+    }
+    if (setmgr_list_sets(mgr, NULL, &head)) {
+        res = -ENOMEM;
+        goto CLOSE;
+    }
+
+    // Sets dropped since they were listed are left out
+    for (hlld_set_list *node = head->head; node && !res; node = node->next) {
+        unsigned char *dump;
+        uint64_t len;
+        int dumped = setmgr_dump_set(mgr, node->set_name, &dump, &len);
+        if (dumped == -1) continue;
+        if (dumped || len > UINT32_MAX) {
+            if (!dumped) free(dump);
+            res = -EIO;
+            break;
+        }
+
+        unsigned char header[DUMP_STREAM_HEADER_SIZE];
+        int name_len = strlen(node->set_name);
+        dump_stream_header(header, name_len, len);
+        if (fwrite(header, sizeof(header), 1, f) != 1 ||
+                fwrite(node->set_name, name_len, 1, f) != 1 ||
+                fwrite(dump, len, 1, f) != 1)
+            res = (errno) ? -errno : -EIO;
+        free(dump);
+        if (!(++*num_sets % SNAPSHOT_CHECKPOINT)) setmgr_client_checkpoint(mgr);
+    }
+    setmgr_cleanup_list(head);
+
+CLOSE:
+    if (!res && (fflush(f) || fsync(fileno(f)))) res = -errno;
+    fclose(f);
+    if (!res && rename(tmp_path, path)) res = -errno;
+    if (res) unlink(tmp_path);
+
+LEAVE:
+    free(path);
+    free(tmp_path);
+    __sync_lock_release(&mgr->snapshot_busy);
+    return res;
+}
+
+/**
+ * Creates a set from a dump made by setmgr_dump_set, with
+ * the config and registers of the dumped set.
+ * @arg set_name The name of the set
+ * @arg dump The dump
+ * @arg len The length of the dump
+ * @return 0 on success, -1 if the set already exists,
+ * -2 for internal error, -3 if there is a pending delete,
+ * or -4 if the dump is corrupt.
+ */
+int setmgr_restore_set(hlld_setmgr *mgr, char *set_name, const unsigned char *dump, uint64_t len) {
+    hlld_set_config set_config;
+    const unsigned char *regs;
+    uint64_t regs_len;
+    if (dump_decode(dump, len, &set_config, &regs, &regs_len)) return -4;
+
+    pthread_mutex_lock(&mgr->write_lock);
+    int res = check_new_set(mgr, set_name);
+    if (res) goto LEAVE;
+
+    // Restored sets keep the config they were dumped with
+    hlld_config *config = config_for_set(mgr, &set_config);
+    hlld_set_wrapper *set = alloc_set_wrapper(mgr, config, 1);
+    if (init_set_from_dump(config, set_name, &set_config, regs, regs_len, mgr->slab, &set->set)) {
+        hset_delete(set->set);
+        destroy_set(set->set);
+        free(set);
+        free(config);
+        res = -4;
+        goto LEAVE;
+    }
+    if (mgr->wal) hset_attach_wal(set->set, mgr->wal);
+    update_set_map(mgr, CREATE, set);
+    manifest_add(mgr->manifest, set_name, &set->set->set_config);
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Creates a new set of the given name and parameters.
+ * @arg set_name The name of the set
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * @return 0 on success, -1 if the set already exists.
+ * -2 for internal error. -3 if there is a pending delete.
+ */
+int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_config) {
+    pthread_mutex_lock(&mgr->write_lock);
+    int res = check_new_set(mgr, set_name);
+    if (res) goto LEAVE;
+
+    // Use a custom config if provided, else the default
+    hlld_config *config = (custom_config) ? custom_config : mgr->config;
+
+    // Add the set
+    if (add_set(mgr, set_name, config, 1, 1)) {
+        res = -2; // Internal error
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Creates a new set without blocking on the disk. The set
+ * is added right away, and its folder is made on the page-in
+ * thread of its data directory. Commands that page the set in
+ * meanwhile queue behind it there.
+ * @arg set_name The name of the set
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * @arg cb Optional, invoked once the set is durable, with 0, or -2
+ * if its folder could not be made and it was dropped. It is invoked
+ * on the page-in thread, or by the caller once those are stopped.
+ * @arg data Opaque pointer passed to the callback
+ * @return 1 if the set was added, and owns the custom config. -1 if
+ * the set already exists, or -3 if there is a pending delete.
+ */
+int setmgr_create_set_async(hlld_setmgr *mgr, char *set_name, hlld_config *custom_config,
+        create_cb cb, void *data) {
+    pthread_mutex_lock(&mgr->write_lock);
+    int res = check_new_set(mgr, set_name);
+    if (res) {
+        pthread_mutex_unlock(&mgr->write_lock);
+        return res;
+    }
+
+    // Add the set before it has a folder, like new_set_wrapper
+    hlld_config *config = (custom_config) ? custom_config : mgr->config;
+    hlld_set_wrapper *set = alloc_set_wrapper(mgr, config, 1);
+    init_new_set(config, set_name, &set->set);
+    if (mgr->wal) hset_attach_wal(set->set, mgr->wal);
+    if (mgr->slab) hset_attach_slab(set->set, mgr->slab);
+    if (mgr->archive) hset_attach_archive(set->set, mgr->archive);
+    if (set->set->set_config.expires && !mgr->config->read_only) add_expiry(mgr, set->set);
+    update_set_map(mgr, CREATE, set);
+
+    // Make the folder on the thread of its data directory,
+    // so that the page ins of the set queue behind it
+    page_in_job *job = calloc(1, sizeof(page_in_job));
+    job->set_name = strdup(set_name);
+    job->created = cb;
+    job->is_create = 1;
+    job->data = data;
+    int queued = !queue_page_in(mgr, job, hset_data_dir(set->set));
+    pthread_mutex_unlock(&mgr->write_lock);
+    if (queued) return 1;
+
+    // The page-in threads are stopped, so make it here
+    res = persist_new_set(mgr, set_name);
+    if (cb) cb(data, res);
+    free(job->set_name);
+    free(job);
+    return 1;
+}
+
+/**
+ * Makes the folder of a set added by setmgr_create_set_async,
+ * and writes its config. The manifest only lists the set once
+ * it is durable. A set that cannot be made is dropped.
+ * @return 0 on success, or -2 if the set was dropped.
+ */
+static int persist_new_set(hlld_setmgr *mgr, char *set_name) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    int res = 0;
+    if (set) {
+        brlock_rdlock(&set->lock);
+        res = hset_page_in(set->set);
+        if (!res) res = hset_flush(set->set);
+        brlock_rdunlock(&set->lock);
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to create the folder of set '%s'. Err: %d", set_name, res);
+        setmgr_drop_set(mgr, set_name);
+        res = -2;
+    } else if (set) {
+        pthread_mutex_lock(&mgr->write_lock);
+        if (take_set(mgr, set_name) == set)
+            manifest_add(mgr->manifest, set_name, &set->set->set_config);
+        pthread_mutex_unlock(&mgr->write_lock);
+    }
+    return res;
+}
+
+/**
+ * Creates many sets with the same parameters. The sets are
+ * built without the write lock, and then published at once.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg shared_config Optional, can be null. Configs that override
+ * the defaults, which must outlive the sets.
+ * @arg results The result of each set, as returned by setmgr_create_set
+ * @return The number of sets that were not created.
+ */
+int setmgr_create_sets(hlld_setmgr *mgr, char **set_names, int num_sets,
+        hlld_config *shared_config, int *results) {
+    hlld_config *config = (shared_config) ? shared_config : mgr->config;
+    hlld_set_wrapper **sets = calloc(num_sets, sizeof(hlld_set_wrapper*));
+
+    // Reserve the names, so that other creates of them, and
+    // repeats in the list, fail while the sets are built
+    pthread_mutex_lock(&mgr->write_lock);
+    for (int i=0; i < num_sets; i++) {
+        results[i] = check_new_set(mgr, set_names[i]);
+        if (!results[i])
+            art_insert(&mgr->creating, (unsigned char*)set_names[i], strlen(set_names[i])+1, mgr);
+    }
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    // Create the folders and files of the sets without the lock
+    int failed = 0;
+    for (int i=0; i < num_sets; i++) {
+        if (results[i]) {
+            failed++;
+            continue;
+        }
+        sets[i] = new_set_wrapper(mgr, set_names[i], config, NULL, 1);
+        if (sets[i]) sets[i]->custom = NULL;
+    }
+
+    // Publish the sets as one version of the set
+    // map, so readers see all of them or none
+    pthread_mutex_lock(&mgr->write_lock);
+    art_cow cow;
+    art_cow_begin(&mgr->set_map, &cow);
+    for (int i=0; i < num_sets; i++) {
+        if (results[i]) continue;
+        art_delete(&mgr->creating, (unsigned char*)set_names[i], strlen(set_names[i])+1);
+        if (!sets[i]) {
+            results[i] = -2; // Internal error
+            failed++;
+            continue;
+        }
+        art_cow_insert(&mgr->set_map, &cow, (unsigned char*)set_names[i], strlen(set_names[i])+1, sets[i]);
+        manifest_add(mgr->manifest, set_names[i], &sets[i]->set->set_config);
+    }
+    publish_set_map(mgr, &cow, NULL, 0);
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    free(sets);
+    return failed;
+}
+
+/**
+ * Checks that a set may be created. Must be called
+ * with the write lock held.
+ * @return 0 if the set may be created, -1 if the set
+ * already exists, or -3 if there is a pending delete.
+ */
+static int check_new_set(hlld_setmgr *mgr, char *set_name) {
+    /*
+     * Bail if the set already exists.
+     * -1 if the set is active
+     * -3 if delete is pending
+     * Handles name another set, so they are taken.
+     */
+    if (setmgr_handle_id(set_name, strlen(set_name)) != -1) return -1;
+    hlld_set_wrapper *set = find_set(mgr, set_name);
+    if (set) return (set->is_active) ? -1 : -3;
+    if (art_search(&mgr->creating, (unsigned char*)set_name, strlen(set_name)+1)) return -1;
+
+    // Scan the drops the vacuum thread has yet to take
+    for (set_garbage *g = mgr->garbage; g; g = g->next) {
+        for (int i=0; i < g->num_sets; i++) {
+            if (!strcmp(g->sets[i]->set->set_name, set_name)) return -3;
+        }
+    }
+
+    // Scan the pending delete queue
+    int res = 0;
+    LOCK_HLLD_SPIN(&mgr->pending_lock);
+    for (hlld_set_list *node = mgr->pending_deletes; node; node = node->next) {
+        if (!strcmp(node->set_name, set_name)) {
+            res = -3; // Pending delete
+            break;
+        }
+    }
+    UNLOCK_HLLD_SPIN(&mgr->pending_lock);
+    return res;
+}
+
+/**
+ * Builds a custom config that creates sets like the
+ * given one, such as a set on another server.
+ * @arg set_config The config of the set
+ * @return A malloc()'d config
+ */
+static hlld_config* config_for_set(hlld_setmgr *mgr, hlld_set_config *set_config) {
+    hlld_config *config = malloc(sizeof(hlld_config));
+    memcpy(config, mgr->config, sizeof(hlld_config));
+    config->default_precision = set_config->default_precision;
+    config->default_eps = set_config->default_eps;
+    config->default_format = set_config->format;
+    config->sparse = set_config->sparse;
+    config->default_estimator = set_config->estimator;
+    config->default_hash = set_config->hash;
+    config->default_window = set_config->window;
+    if (set_config->window) config->default_window_buckets = set_config->window_buckets;
+    config->default_sliding = set_config->sliding;
+    config->default_kmv = set_config->kmv;
+    uint64_t now = time(NULL);
+    config->default_ttl = (set_config->expires > now) ? set_config->expires - now : 0;
+    config->default_durability = set_config->durability;
+    config->default_flush_period = set_config->flush_period;
+    return config;
+}
+
+/**
+ * Deletes the set entirely. This removes it from the set
+ * manager and deletes it from disk. This is a permanent operation.
+ * @arg set_name The name of the set to delete
  * @return 0 on success, -1 if the set does not exist.
  */
 int setmgr_drop_set(hlld_setmgr *mgr, char *set_name) {
@@ -457,7 +1905,9 @@ int setmgr_drop_set(hlld_setmgr *mgr, char *set_name) {
     // Set the set to be non-active and mark for deletion
     set->is_active = 0;
     set->should_delete = 1;
-    create_delta_update(mgr, DELETE, set);
+    update_set_map(mgr, DELETE, set);
+    manifest_drop(mgr->manifest, set->set->set_name);
+    if (mgr->wal) wal_drop(mgr->wal, set->set->set_name);
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -465,6 +1915,138 @@ LEAVE:
 }
 
 
+/**
+ * Drops the sets that expired by a time. The slots of the
+ * expiry wheel since the last call are taken, and their due
+ * sets are dropped at once, as one version of the set map. Their
+ * files are deleted in the background, like any drop.
+ * @arg now The time, in seconds since the epoch
+ * @return The number of sets dropped
+ */
+int setmgr_expire_sets(hlld_setmgr *mgr, uint64_t now) {
+    // Take the due entries of the slots passed since the last tick
+    expiry_entry *due = NULL;
+    pthread_mutex_lock(&mgr->expiry_lock);
+    if (!mgr->expiry_wheel || now <= mgr->expiry_tick) {
+        if (now > mgr->expiry_tick) mgr->expiry_tick = now;
+        pthread_mutex_unlock(&mgr->expiry_lock);
+        return 0;
+    }
+    uint64_t ticks = now - mgr->expiry_tick;
+    if (ticks > EXPIRY_SLOTS) ticks = EXPIRY_SLOTS;
+    for (uint64_t t = now - ticks + 1; t <= now; t++) {
+        expiry_entry **link = mgr->expiry_wheel + t % EXPIRY_SLOTS;
+        while (*link) {
+            expiry_entry *e = *link;
+            if (e->expires > now) {
+                link = &e->next;
+                continue;
+            }
+            *link = e->next;
+            e->next = due;
+            due = e;
+        }
+    }
+    mgr->expiry_tick = now;
+    pthread_mutex_unlock(&mgr->expiry_lock);
+    if (!due) return 0;
+
+    // Publish the drops as one version of the set
+    // map, so readers see all of them or none
+    int dropped = 0, cap = 0;
+    hlld_set_wrapper **sets = NULL;
+    pthread_mutex_lock(&mgr->write_lock);
+    art_cow cow;
+    art_cow_begin(&mgr->set_map, &cow);
+    for (expiry_entry *e = due; e; e = e->next) {
+        hlld_set_wrapper *set = take_set(mgr, e->set_name);
+        if (!set || set->set->set_config.expires != e->expires) continue;
+        set->is_active = 0;
+        set->should_delete = 1;
+        if (dropped == cap) {
+            cap = (cap) ? cap * 2 : 16;
+            sets = realloc(sets, cap * sizeof(hlld_set_wrapper*));
+        }
+        sets[dropped++] = set;
+        art_cow_delete(&mgr->set_map, &cow, (unsigned char*)e->set_name, strlen(e->set_name)+1);
+        manifest_drop(mgr->manifest, set->set->set_name);
+        if (mgr->wal) wal_drop(mgr->wal, set->set->set_name);
+    }
+    if (dropped)
+        publish_set_map(mgr, &cow, sets, dropped);
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    while (due) {
+        expiry_entry *next = due->next;
+        free(due->set_name);
+        free(due);
+        due = next;
+    }
+    return dropped;
+}
+
+/**
+ * Returns the handle named by a set name
+ * @arg set_name The name, which need not be terminated
+ * @arg len The length of the name
+ * @return The handle, or -1 if the name is not a handle.
+ */
+int setmgr_handle_id(const char *set_name, int len) {
+    if (len < 2 || len > 6 || set_name[0] != SET_HANDLE_PREFIX) return -1;
+    int id = 0;
+    for (int i=1; i < len; i++) {
+        if (set_name[i] < '0' || set_name[i] > '9') return -1;
+        id = id * 10 + set_name[i] - '0';
+    }
+    return (id < MAX_SET_HANDLES) ? id : -1;
+}
+
+/**
+ * Binds a handle to a set name, which other calls then
+ * take in place of the name. A name keeps its handle while
+ * the server runs, even once its set is dropped, so a set
+ * created again with the name is found by it.
+ * @arg set_name The name of the set, which must exist
+ * @arg id Output, the handle
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if every handle is bound.
+ */
+int setmgr_bind_set(hlld_setmgr *mgr, char *set_name, int *id) {
+    if (setmgr_handle_id(set_name, strlen(set_name)) != -1) return -1;
+    if (!take_set(mgr, set_name)) return -1;
+
+    int res = 0;
+    pthread_mutex_lock(&mgr->handle_lock);
+    uint32_t key_len = strlen(set_name) + 1;
+    void *bound = art_search(&mgr->handle_ids, (unsigned char*)set_name, key_len);
+    if (bound) {
+        *id = (uintptr_t)bound - 1;
+        goto LEAVE;
+    }
+    if (mgr->num_handles == MAX_SET_HANDLES) {
+        res = -2;
+        goto LEAVE;
+    }
+    if (!mgr->handle_names) {
+        mgr->handle_names = calloc(MAX_SET_HANDLES, sizeof(char*));
+        if (!mgr->handle_names) {
+            res = -2;
+            goto LEAVE;
+        }
+    }
+
+    // The name is published before the count that covers it
+    *id = mgr->num_handles;
+    mgr->handle_names[*id] = strdup(set_name);
+    art_insert(&mgr->handle_ids, (unsigned char*)set_name, key_len, (void*)(uintptr_t)(*id + 1));
+    __sync_synchronize();
+    mgr->num_handles = *id + 1;
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->handle_lock);
+    return res;
+}
+
 /**
  * Clears the set from the internal data stores. This can only
  * be performed if the set is proxied.
@@ -489,11 +2071,22 @@ int setmgr_clear_set(hlld_setmgr *mgr, char *set_name) {
         goto LEAVE;
     }
 
+    // The folder of an archived set is restored, so a
+    // later create finds it as with any other
+    if (hset_is_archived(set->set)) {
+        if (hset_page_in(set->set)) {
+            res = -2;
+            goto LEAVE;
+        }
+        hset_close(set->set);
+    }
+
     // This is critical, as it prevents it from
     // being deleted. Instead, it is merely closed.
     set->is_active = 0;
     set->should_delete = 0;
-    create_delta_update(mgr, DELETE, set);
+    update_set_map(mgr, DELETE, set);
+    manifest_drop(mgr->manifest, set->set->set_name);
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -502,36 +2095,145 @@ LEAVE:
 
 
 /**
- * Unmaps the set from memory, but leaves it
- * registered in the set manager. This is rarely invoked
- * by a client, as it can be handled automatically by hlld,
- * but particular clients with specific needs may use it as an
- * optimization.
- * @arg set_name The name of the set to delete
- * @return 0 on success, -1 if the set does not exist.
+ * Unmaps the set from memory, but leaves it
+ * registered in the set manager. This is rarely invoked
+ * by a client, as it can be handled automatically by hlld,
+ * but particular clients with specific needs may use it as an
+ * optimization.
+ * @arg set_name The name of the set to delete
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name) {
+    // Get the set
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+
+    // Bail if we are in memory only, or already unmapped
+    if (set->set->set_config.in_memory || hset_is_proxied(set->set))
+        goto LEAVE;
+
+    // Flush under the read lock, so that only the pages
+    // dirtied since are written while writers are held
+    lock_set(set, 0);
+    hset_flush(set->set);
+    brlock_rdunlock(&set->lock);
+
+    // Acquire the write lock
+    lock_set(set, 1);
+
+    // Close the set
+    hset_close(set->set);
+    set->is_cool = 0;
+
+    // Release the lock
+    brlock_wrunlock(&set->lock);
+
+LEAVE:
+    return 0;
+}
+
+/**
+ * Cools a set mapped from its data file. Its dirty pages are
+ * flushed, then the kernel is asked to reclaim its pages,
+ * while it stays mapped. The set is cold unmapped later on,
+ * if it is not written meanwhile.
+ * @arg set_name The name of the set to cool
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 if it is not mapped from a file.
+ */
+int setmgr_cool_set(hlld_setmgr *mgr, char *set_name) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+    if (set->set->set_config.in_memory || hset_is_proxied(set->set)) return -2;
+
+    // Under the read lock, writers may continue
+    lock_set(set, 0);
+    hset_flush(set->set);
+    int res = hset_cool(set->set);
+    if (!res) set->is_cool = 1;
+    brlock_rdunlock(&set->lock);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Samples the residency of a set in memory, taking the
+ * bytes of its registers that are paged in and the pages
+ * faulted in since the last sample, as reported by info.
+ * @arg set_name The name of the set to sample
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 if it is not paged in.
+ */
+int setmgr_sample_residency(hlld_setmgr *mgr, char *set_name) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+    if (hset_is_proxied(set->set)) return -2;
+
+    // The read lock keeps the set from being unmapped
+    lock_set(set, 0);
+    int res = hset_sample_residency(set->set);
+    brlock_rdunlock(&set->lock);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Folds a set down to a lower precision, and records its
+ * new config in the manifest, as a restart would otherwise
+ * restore it at its old precision.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @arg precision The new precision
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if it could not be folded.
  */
-int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name) {
-    // Get the set
+int setmgr_fold_set(hlld_setmgr *mgr, char *set_name, unsigned char precision) {
     hlld_set_wrapper *set = take_set(mgr, set_name);
     if (!set) return -1;
 
-    // Bail if we are in memory only
-    if (set->set->set_config.in_memory)
-        goto LEAVE;
+    lock_set(set, 1);
+    unsigned char old_precision = set->set->set_config.default_precision;
+    int res = hset_fold(set->set, precision);
+    if (set->set->set_config.default_precision != old_precision)
+        manifest_add(mgr->manifest, set->set->set_name, &set->set->set_config);
+    brlock_wrunlock(&set->lock);
+    return (res) ? -2 : 0;
+}
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&set->rwlock);
+/**
+ * Moves a set into the archive, unmapping it first. It stays
+ * registered, and is restored from the archive by the next
+ * page in.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if it could not be archived.
+ */
+int setmgr_archive_set(hlld_setmgr *mgr, char *set_name) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) return -1;
+    if (!mgr->archive) return -2;
 
-    // Close the set
+    lock_set(set, 1);
     hset_close(set->set);
-
-    // Release the lock
-    pthread_rwlock_unlock(&set->rwlock);
-
-LEAVE:
-    return 0;
+    set->is_cool = 0;
+    int res = hset_archive(set->set);
+    brlock_wrunlock(&set->lock);
+    return (res) ? -2 : 0;
 }
 
+/**
+ * Compacts the files of the archive that are mostly
+ * dead records, of sets restored or dropped since
+ * they were archived.
+ * @arg mgr The manager
+ * @arg reclaimed Output, the bytes reclaimed
+ * @return The number of files compacted, or negative
+ * errno on failure.
+ */
+int setmgr_compact_archive(hlld_setmgr *mgr, uint64_t *reclaimed) {
+    *reclaimed = 0;
+    if (!mgr->archive) return 0;
+    return archive_compact(mgr->archive, ARCHIVE_COMPACT_DEAD, reclaimed);
+}
 
 /**
  * Allocates space for and returns a linked
@@ -546,41 +2248,18 @@ int setmgr_list_sets(hlld_setmgr *mgr, char *prefix, hlld_set_list_head **head)
     hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
 
     // Check if we should use the prefix
-    int prefix_len = 0;
-    if (prefix) {
-        prefix_len = strlen(prefix);
-        art_iter_prefix(mgr->set_map, (unsigned char*)prefix, prefix_len, set_map_list_cb, h);
-    } else
-        art_iter(mgr->set_map, set_map_list_cb, h);
-
-    // Joy... we have to potentially handle the delta updates
-    if (mgr->primary_vsn == mgr->vsn) return 0;
-
-    set_list *current = mgr->delta;
-    hlld_set_wrapper *s;
-    while (current) {
-        // Check if this is a match (potential prefix)
-        if (current->type == CREATE) {
-            s = current->set;
-            if (!prefix_len || !strncmp(s->set->set_name, prefix, prefix_len)) {
-                s = current->set;
-                set_map_list_cb(h, (unsigned char*)s->set->set_name, 0, s);
-            }
-        }
-
-        // Don't seek past what the primary set map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
-
+    if (prefix)
+        art_iter_prefix(&mgr->set_map, (unsigned char*)prefix, strlen(prefix), set_map_list_cb, h);
+    else
+        art_iter(&mgr->set_map, set_map_list_cb, h);
     return 0;
 }
 
 
 /**
  * Allocates space for and returns a linked
- * list of all the cold sets. This has the side effect
+ * list of all the cold sets, which were not written
+ * since the last call. This has the side effect
  * of clearing the list of cold sets!
  * @arg mgr The manager to list from
  * @arg head Output, sets to the address of the list header
@@ -590,12 +2269,295 @@ int setmgr_list_cold_sets(hlld_setmgr *mgr, hlld_set_list_head **head) {
     // Allocate the head of a new hashmap
     hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
 
-    // Scan for the cold sets. Ignore deltas, since they are either
-    // new (e.g. hot), or being deleted anyways.
-    art_iter(mgr->set_map, set_map_list_cold_cb, h);
+    // Scan for the cold sets
+    cold_list list = {h, mgr->cold_mark, 0};
+    art_iter(&mgr->set_map, set_map_list_cold_cb, &list);
+
+    // Sets written from now on are hot for the next scan
+    mgr->cold_mark = __sync_add_and_fetch(&mgr->clock, 1);
+    return 0;
+}
+
+/**
+ * Allocates space for and returns a linked list of the
+ * sets to cool, which were not written since the last call,
+ * and were not cooled already. Like setmgr_list_cold_sets,
+ * but with a mark of its own.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int setmgr_list_cool_sets(hlld_setmgr *mgr, hlld_set_list_head **head) {
+    hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
+    cold_list list = {h, mgr->cool_mark, 1};
+    art_iter(&mgr->set_map, set_map_list_cold_cb, &list);
+    mgr->cool_mark = __sync_add_and_fetch(&mgr->clock, 1);
+    return 0;
+}
+
+/**
+ * Allocates space for and returns a linked list of the
+ * sets to unmap so that the resident sets fit in a memory
+ * budget. The least recently written sets are listed first.
+ * In-memory sets count against the budget, but are never
+ * listed. Each call advances the clock used to order writes.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg max_bytes The budget for the resident sets, in bytes
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int setmgr_list_lru_sets(hlld_setmgr *mgr, uint64_t max_bytes, hlld_set_list_head **head) {
+    hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
+    lru_list list = {NULL, 0, 0, 0};
+    art_iter(&mgr->set_map, set_map_list_lru_cb, &list);
+    __sync_fetch_and_add(&mgr->clock, 1);
+
+    // Evict the oldest sets until we fit
+    if (list.resident > max_bytes) {
+        qsort(list.entries, list.num, sizeof(lru_entry), compare_lru);
+        for (int i=0; i < list.num && list.resident > max_bytes; i++) {
+            hlld_set_list *node = malloc(sizeof(hlld_set_list));
+            node->set_name = strdup(list.entries[i].name);
+            node->next = NULL;
+            if (!h->head)
+                h->head = node;
+            else
+                h->tail->next = node;
+            h->tail = node;
+            h->size++;
+            list.resident -= list.entries[i].bytes;
+        }
+    }
+    free(list.entries);
+    return 0;
+}
+
+
+/*
+ * State used to list the sets accepted by a filter
+ */
+typedef struct {
+    set_filter filter;
+    void *data;
+    hlld_set_list_head *head;
+} filtered_list;
+
+/**
+ * Allocates space for and returns a linked list of
+ * the sets accepted by a filter. Like setmgr_set_cb, the
+ * set is not locked, so the filter should only read metrics.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg filter Returns 1 to include a set
+ * @arg data Opaque pointer passed to the filter
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int setmgr_list_filtered_sets(hlld_setmgr *mgr, set_filter filter, void *data, hlld_set_list_head **head) {
+    filtered_list list = {filter, data, NULL};
+    list.head = *head = calloc(1, sizeof(hlld_set_list_head));
+    art_iter(&mgr->set_map, set_map_list_filtered_cb, &list);
+    return 0;
+}
+
+
+/**
+ * Rewrites the manifest with the sets and their sizes as of
+ * their last flush, so a restart restores them without reading
+ * each set folder. Creates and drops are recorded as they happen,
+ * so this only needs to be invoked periodically.
+ * @arg mgr The manager
+ * @return 0 on success.
+ */
+int setmgr_checkpoint_manifest(hlld_setmgr *mgr) {
+    if (mgr->config->read_only) return 0;
+    pthread_mutex_lock(&mgr->write_lock);
+    snapshot_manifest(mgr);
+    pthread_mutex_unlock(&mgr->write_lock);
+    return manifest_checkpoint_end(mgr->manifest);
+}
+
+/**
+ * Follows the sets of a data directory owned by another
+ * server. The manifest it keeps decides which sets exist,
+ * so sets are added and closed to match it, and the sets
+ * whose files changed are closed to fault in the new ones.
+ * Only used by a read only server.
+ * @arg mgr The manager
+ * @return 0 on success, or a negative errno if the
+ * manifest could not be read.
+ */
+int setmgr_refresh(hlld_setmgr *mgr) {
+    art_tree known;
+    if (init_art_tree(&known)) return -ENOMEM;
+    int res = manifest_load(mgr->manifest, refresh_manifest_cb, &known);
+    if (res < 0) goto LEAVE;
+    res = 0;
+
+    // Add the new sets
+    hlld_set_list_head *head;
+    setmgr_list_sets(mgr, NULL, &head);
+    pthread_mutex_lock(&mgr->write_lock);
+    art_iter(&known, refresh_add_cb, mgr);
+
+    // Close the dropped sets, leaving their files alone
+    for (hlld_set_list *node = head->head; node; node = node->next) {
+        if (art_search(&known, (unsigned char*)node->set_name, strlen(node->set_name)+1))
+            continue;
+        hlld_set_wrapper *set = take_set(mgr, node->set_name);
+        if (!set) continue;
+        set->is_active = 0;
+        set->should_delete = 0;
+        update_set_map(mgr, DELETE, set);
+    }
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    // Close the sets whose files changed
+    for (hlld_set_list *node = head->head; node; node = node->next) {
+        hlld_set_wrapper *set = take_set(mgr, node->set_name);
+        if (!set) continue;
+        lock_set(set, 1);
+        if (hset_refresh(set->set) < 0)
+            syslog(LOG_DEBUG, "Set '%s' is being written, skipping refresh.", node->set_name);
+        brlock_wrunlock(&set->lock);
+    }
+    setmgr_cleanup_list(head);
+
+LEAVE:
+    art_iter(&known, refresh_free_cb, NULL);
+    destroy_art_tree(&known);
+    return res;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to find the oldest WAL segment a set needs.
+ */
+static int set_map_wal_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    uint64_t *oldest = data;
+    hlld_set_wrapper *set = value;
+    uint64_t seq = hset_wal_seq(set->set);
+    if (seq && seq < *oldest) *oldest = seq;
+    return 0;
+}
+
+/**
+ * Starts a new segment of the write-ahead log, and removes
+ * the segments that only hold raises the sets have flushed
+ * since. Invoked once per flush interval.
+ * @arg mgr The manager
+ * @return 0 on success, -1 if there is no write-ahead log.
+ */
+int setmgr_checkpoint_wal(hlld_setmgr *mgr) {
+    if (!mgr->wal) return -1;
+    uint64_t oldest = wal_rotate(mgr->wal);
+
+    // Creates are not missed under the write lock
+    pthread_mutex_lock(&mgr->write_lock);
+    art_iter(&mgr->set_map, set_map_wal_cb, &oldest);
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    // Registers flushed to the slab are only durable once synced
+    if (mgr->slab && setmgr_sync_slab(mgr)) return 0;
+    wal_trim(mgr->wal, oldest);
+    return 0;
+}
+
+/**
+ * Syncs the segments of the slab, making the registers
+ * the sets flushed to their slots durable. Invoked after
+ * every round of flushes.
+ * @arg mgr The manager
+ * @return 0 on success, -1 if there is no slab or it
+ * failed to sync.
+ */
+int setmgr_sync_slab(hlld_setmgr *mgr) {
+    if (!mgr->slab) return -1;
+    return (slab_sync(mgr->slab)) ? -1 : 0;
+}
+
+/**
+ * Applies the raises replayed from the write-ahead log
+ * to a loaded set. Raises of unknown sets are skipped.
+ */
+static void replay_wal_cb(void *data, repl_frame *frame) {
+    hlld_setmgr *mgr = data;
+    hlld_set_wrapper *set = art_search(&mgr->set_map, (unsigned char*)frame->set_name,
+            strlen(frame->set_name)+1);
+    if (!set || set->set->set_config.default_precision != frame->set_config.default_precision)
+        return;
+    hset_raise_registers(set->set, frame->entries, frame->num);
+}
+
+
+/**
+ * Reads how often set lookups were served by the
+ * per-thread caches. Counts are added in batches, so
+ * recent lookups may not be counted yet.
+ * @arg mgr The manager
+ * @arg hits Output, the lookups found in a cache
+ * @arg misses Output, the lookups that searched the set map
+ */
+void setmgr_lookup_stats(hlld_setmgr *mgr, uint64_t *hits, uint64_t *misses) {
+    *hits = mgr->lookup_hits;
+    *misses = mgr->lookup_misses;
+}
+
+/**
+ * Takes a snapshot of the stats of the sets in the set
+ * map, so they can be read without visiting the sets, as
+ * with setmgr_iter_set_stats. Sets created after are left
+ * for the next snapshot.
+ * @arg mgr The manager
+ * @return 0 on success.
+ */
+int setmgr_refresh_set_stats(hlld_setmgr *mgr) {
+    set_stats_list list = {NULL, 0, 0};
+    art_iter(&mgr->set_map, set_map_stats_cb, &list);
+
+    // Swap in the new snapshot, and free the old one
+    pthread_mutex_lock(&mgr->stats_lock);
+    hlld_set_stats *old = mgr->stats;
+    int old_num = mgr->num_stats;
+    mgr->stats = list.stats;
+    mgr->num_stats = list.num;
+    pthread_mutex_unlock(&mgr->stats_lock);
+    free_set_stats(old, old_num);
     return 0;
 }
 
+/**
+ * Invokes a callback with the stats of each set in the
+ * last snapshot. Blocks the next snapshot until done.
+ * @notes Thread safe, the caller need not be a client.
+ * @arg mgr The manager
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets in the snapshot.
+ */
+int setmgr_iter_set_stats(hlld_setmgr *mgr, set_stats_cb cb, void *data) {
+    pthread_mutex_lock(&mgr->stats_lock);
+    int num = mgr->num_stats;
+    for (int i=0; i < num; i++) cb(data, mgr->stats + i);
+    pthread_mutex_unlock(&mgr->stats_lock);
+    return num;
+}
+
+/**
+ * Returns how many versions of the set map the vacuum thread
+ * has yet to reclaim. This grows while a client holds
+ * back the grace period.
+ * @notes Thread safe.
+ * @arg mgr The manager
+ * @return The number of versions
+ */
+uint64_t setmgr_vacuum_lag(hlld_setmgr *mgr) {
+    return *(volatile uint64_t*)&mgr->num_garbage;
+}
+
 
 /**
  * This method allows a callback function to be invoked with hlld set.
@@ -611,10 +2573,79 @@ int setmgr_set_cb(hlld_setmgr *mgr, char *set_name, set_cb cb, void* data) {
     if (!set) return -1;
 
     // Callback
-    cb(data, set_name, set->set);
+    cb(data, set->set->set_name, set->set);
+    return 0;
+}
+
+/*
+ * State used to invoke a callback with a page of sets
+ */
+typedef struct {
+    set_cb cb;
+    void *data;
+    char *prefix;
+    int prefix_len;
+    int limit;
+    int num;
+} set_page;
+
+/**
+ * Invokes the callback of a page with an active set,
+ * under its read lock
+ */
+static void visit_page_set(set_page *page, hlld_set_wrapper *set) {
+    if (!set->is_active) return;
+    lock_set(set, 0);
+    page->cb(page->data, set->set->set_name, set->set);
+    brlock_rdunlock(&set->lock);
+    page->num++;
+}
+
+/**
+ * Invokes a callback with each set whose name starts with
+ * a prefix, in a single pass over the set map, without
+ * copying the names. Each set is held with its read lock
+ * during the callback, so it may estimate the size of the
+ * set, but must not write to it.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on or NULL
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return 0 on success.
+ */
+int setmgr_iter_sets(hlld_setmgr *mgr, char *prefix, set_cb cb, void *data) {
+    setmgr_page_sets(mgr, prefix, NULL, 0, cb, data);
     return 0;
 }
 
+/**
+ * Invokes a callback with a page of the sets whose name
+ * starts with a prefix, in the order of their names, starting
+ * after a cursor. Only the part of the set map after the cursor
+ * is visited. Like setmgr_iter_sets, each set is held with its
+ * read lock during the callback.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on or NULL
+ * @arg after The name to start after, usually the last of
+ * the previous page, or NULL to start from the first
+ * @arg limit The most sets to visit, or 0 for all
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets visited.
+ */
+int setmgr_page_sets(hlld_setmgr *mgr, char *prefix, char *after, int limit, set_cb cb, void *data) {
+    set_page page = {cb, data, prefix, (prefix) ? strlen(prefix) : 0, limit, 0};
+
+    // Seek past the cursor, or to the prefix
+    if (after && (!prefix || strcmp(after, prefix) >= 0))
+        art_iter_after(&mgr->set_map, (unsigned char*)after, strlen(after)+1, set_map_page_cb, &page);
+    else if (prefix)
+        art_iter_prefix(&mgr->set_map, (unsigned char*)prefix, page.prefix_len, set_map_page_cb, &page);
+    else
+        art_iter(&mgr->set_map, set_map_page_cb, &page);
+    return page.num;
+}
+
 
 /**
  * Convenience method to cleanup a set list.
@@ -632,46 +2663,208 @@ void setmgr_cleanup_list(hlld_set_list_head *head) {
 
 
 /**
- * Searches the primary tree and the delta list for a set
+ * Finds a set, through the lookup cache of this thread
+ * if the set map has not changed since it was filled
  */
 static hlld_set_wrapper* find_set(hlld_setmgr *mgr, char *set_name) {
-    // Search the tree first
-    hlld_set_wrapper *set = art_search(mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1);
+    // Handles index the sets of this thread directly
+    int id = setmgr_handle_id(set_name, strlen(set_name));
+    if (id >= 0) return find_handle_set(mgr, id);
+
+    // Look in the cache of this thread first
+    unsigned long long vsn = *(volatile unsigned long long*)&mgr->vsn;
+    thread_state *state = get_thread_state(mgr);
+    if (!state) return search_set(mgr, set_name);
+    if (state->vsn != vsn) {
+        memset(state->entries, 0, sizeof(state->entries));
+        state->vsn = vsn;
+    }
 
-    // If we found the set, check if it is active
-    if (set) return set;
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char *c = (unsigned char*)set_name; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    lookup_entry *entry = state->entries + (hash & (LOOKUP_CACHE_SIZE - 1));
+    hlld_set_wrapper *set = entry->set;
+    if (set && entry->hash == hash && !strcmp(set->set->set_name, set_name)) {
+        if (++state->hits == LOOKUP_STATS_BATCH) {
+            __sync_fetch_and_add(&mgr->lookup_hits, state->hits);
+            state->hits = 0;
+        }
+        return set;
+    }
+    if (++state->misses == LOOKUP_STATS_BATCH) {
+        __sync_fetch_and_add(&mgr->lookup_misses, state->misses);
+        state->misses = 0;
+    }
 
-    // Check if the primary has all delta changes
-    if (mgr->primary_vsn == mgr->vsn) return NULL;
+    // Only cache what was found in an unchanged version
+    set = search_set(mgr, set_name);
+    if (set && vsn == *(volatile unsigned long long*)&mgr->vsn) {
+        entry->hash = hash;
+        entry->set = set;
+    }
+    return set;
+}
 
-    // Search the delta list
-    set_list *current = mgr->delta;
-    while (current) {
-        // Check if this is a match
-        if (current->type != BARRIER &&
-            strcmp(current->set->set->set_name, set_name) == 0) {
-            return current->set;
+/**
+ * Finds the set of a handle, through the sets this thread
+ * found for the handles, which are valid while the
+ * version is unchanged. Sets dropped since are not active,
+ * and are looked up again by name, in case they were created
+ * again since.
+ */
+static hlld_set_wrapper* find_handle_set(hlld_setmgr *mgr, int id) {
+    if (id >= mgr->num_handles) return NULL;
+    __sync_synchronize();
+    unsigned long long vsn = *(volatile unsigned long long*)&mgr->vsn;
+    thread_state *state = get_thread_state(mgr);
+    handle_entry *entry = NULL;
+    if (state && id >= state->handles_cap) {
+        int cap = (state->handles_cap) ? state->handles_cap : 64;
+        while (cap <= id) cap *= 2;
+        handle_entry *grown = realloc(state->handles, cap * sizeof(handle_entry));
+        if (grown) {
+            memset(grown + state->handles_cap, 0, (cap - state->handles_cap) * sizeof(handle_entry));
+            state->handles = grown;
+            state->handles_cap = cap;
         }
+    }
+    if (state && id < state->handles_cap) {
+        entry = state->handles + id;
+        if (entry->set && entry->vsn == vsn && entry->set->is_active) return entry->set;
+    }
 
-        // Don't seek past what the primary set map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
+    hlld_set_wrapper *set = search_set(mgr, mgr->handle_names[id]);
+    if (entry && set && vsn == *(volatile unsigned long long*)&mgr->vsn) {
+        entry->vsn = vsn;
+        entry->set = set;
     }
+    return set;
+}
 
-    // Not found
-    return NULL;
+/**
+ * Frees the state of a thread, as it exits
+ */
+static void free_thread_state(void *in) {
+    thread_state *state = in;
+    free(state->handles);
+    free(state);
+}
+
+/**
+ * Creates the key of the thread states
+ */
+static void make_thread_state_key() {
+    pthread_key_create(&THREAD_STATE_KEY, free_thread_state);
+}
+
+/**
+ * Returns the state of this thread for a manager, discarding
+ * the state of the last manager if it was another one.
+ * @return The state, or NULL if it cannot be allocated
+ */
+static thread_state* get_thread_state(hlld_setmgr *mgr) {
+    pthread_once(&THREAD_STATE_ONCE, make_thread_state_key);
+    thread_state *state = pthread_getspecific(THREAD_STATE_KEY);
+    if (!state) {
+        state = calloc(1, sizeof(thread_state));
+        if (!state) return NULL;
+        pthread_setspecific(THREAD_STATE_KEY, state);
+    }
+    if (state->mgr_id != mgr->id) {
+        free(state->handles);
+        memset(state, 0, sizeof(thread_state));
+        state->mgr_id = mgr->id;
+        state->vsn = IDLE_VSN;
+    }
+    return state;
+}
+
+/**
+ * Searches for a set in the set map, without
+ * using the lookup cache.
+ */
+static hlld_set_wrapper* search_set(hlld_setmgr *mgr, char *set_name) {
+    return art_search(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1);
 }
 
 
+/**
+ * Acquires the lock of a set, timing the wait
+ * for the slow log.
+ */
+static void lock_set(hlld_set_wrapper *set, int exclusive) {
+    uint64_t start = slowlog_phase_start();
+    if (exclusive)
+        brlock_wrlock(&set->lock);
+    else
+        brlock_rdlock(&set->lock);
+    slowlog_phase_end(PHASE_LOCK, start);
+}
+
 /**
  * Gets the hlld set in a thread safe way.
  */
 static hlld_set_wrapper* take_set(hlld_setmgr *mgr, char *set_name) {
+    uint64_t start = slowlog_phase_start();
     hlld_set_wrapper *set = find_set(mgr, set_name);
+    slowlog_phase_end(PHASE_LOOKUP, start);
     return (set && set->is_active) ? set : NULL;
 }
 
+/**
+ * Gets a set to write to. With auto_create, a missing set
+ * is created with the default config. Writers that race to
+ * create it are resolved by the write lock of the create,
+ * and the losers take the set of the winner.
+ * @return The set, or NULL if it does not exist and cannot
+ * be created, such as while a delete of it is pending.
+ */
+static hlld_set_wrapper* take_write_set(hlld_setmgr *mgr, char *set_name) {
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (set || !mgr->config->auto_create) return set;
+
+    // Only names that create would accept, which are not handles
+    int len = strlen(set_name);
+    if (len < 1 || len > 200 || strpbrk(set_name, " \t\n\r")) return NULL;
+    if (setmgr_handle_id(set_name, len) != -1) return NULL;
+    int res = setmgr_create_set(mgr, set_name, NULL);
+    if (res && res != -1) return NULL;
+    return take_set(mgr, set_name);
+}
+
+/**
+ * Returns the lowest precision of a list of sets, or
+ * HLL_MAX_PRECISION if there are none
+ */
+static unsigned char min_precision(hlld_set_wrapper **sets, int num_sets) {
+    unsigned char precision = HLL_MAX_PRECISION;
+    for (int i=0; i < num_sets; i++) {
+        if (sets[i]->set->set_config.default_precision < precision)
+            precision = sets[i]->set->set_config.default_precision;
+    }
+    return precision;
+}
+
+/**
+ * Gets a list of sets, and checks they share a hash.
+ * @arg sets Output, the set wrappers
+ * @return 0 on success, -1 if any set does not exist,
+ * -2 if the sets are not compatible.
+ */
+static int take_sets(hlld_setmgr *mgr, char **set_names, int num_sets, hlld_set_wrapper **sets) {
+    for (int i=0; i < num_sets; i++) {
+        sets[i] = take_set(mgr, set_names[i]);
+        if (!sets[i]) return -1;
+    }
+    for (int i=1; i < num_sets; i++) {
+        if (!hset_compatible(sets[i]->set, sets[0]->set))
+            return -2;
+    }
+    return 0;
+}
+
 /**
  * Invoked to cleanup a set once we
  * have hit 0 remaining references.
@@ -692,6 +2885,7 @@ static void delete_set(hlld_set_wrapper *set) {
     }
 
     // Release the struct
+    brlock_destroy(&set->lock);
     free(set);
     return;
 }
@@ -702,38 +2896,104 @@ static void delete_set(hlld_set_wrapper *set) {
  * @arg set_name The name of the set
  * @arg config The configuration for the set
  * @arg is_hot Is the set hot. False for existing.
- * @arg delta Should a delta entry be added, or the primary tree updated.
- * This is usually 0, except during initialization when it is safe to update
- * the primary tree.
+ * @arg publish Should the set be published as a new version, or the tree
+ * updated in place. This is usually 1, except during initialization when
+ * no client reads the tree.
  * @return 0 on success, -1 on error
  */
-static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int delta) {
-    // Create the set
-    hlld_set_wrapper *set = calloc(1, sizeof(hlld_set_wrapper));
+static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int publish) {
+    hlld_set_wrapper *set = new_set_wrapper(mgr, set_name, config, NULL, is_hot);
+    if (!set) return -1;
+
+    // Check if we are publishing a version or directly updating ART tree
+    if (publish) {
+        update_set_map(mgr, CREATE, set);
+        manifest_add(mgr->manifest, set_name, &set->set->set_config);
+    } else
+        art_insert(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
+
+    return 0;
+}
+
+/**
+ * Allocates a set wrapper, without its underlying set
+ * @arg mgr The manager
+ * @arg config The configuration for the set
+ * @arg is_hot Is the set hot. False for existing.
+ * @return The new wrapper
+ */
+static hlld_set_wrapper* alloc_set_wrapper(hlld_setmgr *mgr, hlld_config *config, int is_hot) {
+    hlld_set_wrapper *set;
+    if (posix_memalign((void**)&set, HSET_CACHE_LINE, sizeof(hlld_set_wrapper))) abort();
+    memset(set, 0, sizeof(hlld_set_wrapper));
     set->is_active = 1;
-    set->is_hot = is_hot;
+    set->last_access = (is_hot) ? mgr->clock : 0;
     set->should_delete = 0;
-    pthread_rwlock_init(&set->rwlock, NULL);
+    brlock_init(&set->lock);
 
     // Set the custom set if its not the same
     if (mgr->config != config) {
         set->custom = config;
     }
+    return set;
+}
 
-    // Try to create the underlying set. Only discover if it is hot.
-    int res = init_set(config, set_name, is_hot, &set->set);
+/**
+ * Creates a set wrapper and its underlying set, without
+ * adding it to the manager. Safe to call from many threads.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @arg config The configuration for the set
+ * @arg set_config The known set config of an existing set, or NULL
+ * to read it from the set folder
+ * @arg is_hot Is the set hot. False for existing.
+ * @return The new wrapper, or NULL on error
+ */
+static hlld_set_wrapper* new_set_wrapper(hlld_setmgr *mgr, char *set_name, hlld_config *config, hlld_set_config *set_config, int is_hot) {
+    hlld_set_wrapper *set = alloc_set_wrapper(mgr, config, is_hot);
+
+    // Try to create the underlying set. Hot sets are only
+    // discovered once attached, so that their registers are
+    // placed in the slab and their raises logged.
+    int res;
+    if (set_config)
+        res = init_set_from_config(config, set_name, set_config, &set->set);
+    else
+        res = init_set(config, set_name, 0, &set->set);
     if (res != 0) {
         free(set);
-        return -1;
+        return NULL;
     }
+    if (mgr->wal) hset_attach_wal(set->set, mgr->wal);
+    if (mgr->slab) hset_attach_slab(set->set, mgr->slab);
+    if (mgr->archive) hset_attach_archive(set->set, mgr->archive);
+    if (is_hot && (!(res = hset_page_in(set->set)))) res = hset_flush(set->set);
+    if (res) {
+        syslog(LOG_ERR, "Failed to fault in the set '%s'. Err: %d", set_name, res);
+        destroy_set(set->set);
+        free(set);
+        return NULL;
+    }
+    if (set->set->set_config.expires && !mgr->config->read_only) add_expiry(mgr, set->set);
+    return set;
+}
 
-    // Check if we are adding a delta value or directly updating ART tree
-    if (delta)
-        create_delta_update(mgr, CREATE, set);
-    else
-        art_insert(mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
-
-    return 0;
+/**
+ * Adds a set that expires to the expiry wheel. Sets that
+ * are past due are expired on the next tick.
+ */
+static void add_expiry(hlld_setmgr *mgr, hlld_set *set) {
+    expiry_entry *e = malloc(sizeof(expiry_entry));
+    e->set_name = strdup(set->set_name);
+    e->expires = set->set_config.expires;
+
+    pthread_mutex_lock(&mgr->expiry_lock);
+    if (!mgr->expiry_wheel) mgr->expiry_wheel = calloc(EXPIRY_SLOTS, sizeof(expiry_entry*));
+    uint64_t tick = (e->expires > mgr->expiry_tick) ? e->expires : mgr->expiry_tick + 1;
+    expiry_entry **slot = mgr->expiry_wheel + tick % EXPIRY_SLOTS;
+    e->next = *slot;
+    *slot = e;
+    pthread_mutex_unlock(&mgr->expiry_lock);
 }
 
 /**
@@ -779,12 +3039,12 @@ static int set_map_list_cb(void *data, const unsigned char *key, uint32_t key_le
 static int set_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key_len;
     // Cast the inputs
-    hlld_set_list_head *head = data;
+    cold_list *list = data;
+    hlld_set_list_head *head = list->head;
     hlld_set_wrapper *set = value;
 
-    // Check if hot, turn off and skip
-    if (set->is_hot) {
-        set->is_hot = 0;
+    // Skip if written since the last scan
+    if (set->last_access >= list->mark || (list->skip_cool && set->is_cool)) {
         return 0;
     }
 
@@ -807,18 +3067,116 @@ static int set_map_list_cold_cb(void *data, const unsigned char *key, uint32_t k
 }
 
 /**
- * Called as part of the hashmap callback
- * to cleanup the sets.
+ * Called as part of the hashmap callback to total
+ * the resident sets, and collect those that may be evicted.
  */
-static int set_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)data;
+static int set_map_list_lru_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    lru_list *list = data;
+    hlld_set_wrapper *set = value;
+    if (!set->is_active || hset_is_proxied(set->set)) return 0;
+
+    uint64_t bytes = hset_resident_bytes(set->set);
+    list->resident += bytes;
+    if (set->set->set_config.in_memory) return 0;
+
+    // Grow the entries as needed
+    if (list->num == list->cap) {
+        int cap = (list->cap) ? list->cap * 2 : 64;
+        lru_entry *entries = realloc(list->entries, cap * sizeof(lru_entry));
+        if (!entries) return 0;
+        list->entries = entries;
+        list->cap = cap;
+    }
+    lru_entry *e = list->entries + list->num++;
+    e->name = (char*)key;
+    e->last_access = set->last_access;
+    e->bytes = bytes;
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback to
+ * collect the stats of each set for a snapshot.
+ */
+static int set_map_stats_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key;
     (void)key_len;
+    set_stats_list *list = data;
+    hlld_set_wrapper *set = value;
+    if (!set->is_active) return 0;
+
+    // Grow the stats as needed
+    if (list->num == list->cap) {
+        int cap = (list->cap) ? list->cap * 2 : 64;
+        hlld_set_stats *stats = realloc(list->stats, cap * sizeof(hlld_set_stats));
+        if (!stats) return 0;
+        list->stats = stats;
+        list->cap = cap;
+    }
+    hlld_set_stats *s = list->stats + list->num++;
+    s->set_name = strdup(set->set->set_name);
+    s->resident = !hset_is_proxied(set->set);
+    s->resident_bytes = hset_resident_bytes(set->set);
+    s->counters = *hset_counters(set->set);
+    return 0;
+}
+
+// Frees a snapshot of set stats
+static void free_set_stats(hlld_set_stats *stats, int num) {
+    for (int i=0; i < num; i++) free(stats[i].set_name);
+    free(stats);
+}
+
+/**
+ * Orders the LRU entries, least recently written first
+ */
+static int compare_lru(const void *a, const void *b) {
+    const lru_entry *e1 = a, *e2 = b;
+    if (e1->last_access < e2->last_access) return -1;
+    return (e1->last_access > e2->last_access);
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to list the sets accepted by a filter.
+ */
+static int set_map_list_filtered_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    filtered_list *list = data;
     hlld_set_wrapper *set = value;
-    delete_set(set);
+    if (!set->is_active || !list->filter(list->data, (char*)key, set->set)) return 0;
+
+    // Allocate a new entry, and inject at head
+    hlld_set_list *node = malloc(sizeof(hlld_set_list));
+    node->set_name = strdup((char*)key);
+    node->next = list->head->head;
+    list->head->head = node;
+    list->head->size++;
     return 0;
 }
 
+/**
+ * Called as part of the hashmap callback to visit the sets
+ * of a page in order. Stops once past the prefix or the limit.
+ */
+static int set_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    set_page *page = data;
+    if (page->prefix_len && strncmp((char*)key, page->prefix, page->prefix_len)) return 1;
+    visit_page_set(page, value);
+    return (page->limit && page->num == page->limit);
+}
+
+/**
+ * Orders set wrappers by the names of their sets
+ */
+static int compare_set_names(const void *a, const void *b) {
+    hlld_set_wrapper *sa = *(hlld_set_wrapper**)a;
+    hlld_set_wrapper *sb = *(hlld_set_wrapper**)b;
+    return strcmp(sa->set->set_name, sb->set->set_name);
+}
+
 /**
  * Works with scandir to set out non-hlld folders.
  */
@@ -841,101 +3199,463 @@ static int set_hlld_folders(CONST_DIRENT_T *d) {
     return 0;
 }
 
+/**
+ * Orders folders by name
+ */
+static int compare_folders(const void *a, const void *b) {
+    return strcmp((*(struct dirent**)a)->d_name, (*(struct dirent**)b)->d_name);
+}
+
+/**
+ * Lists the set folders of all the data directories. A
+ * folder found in more than one is only listed once, as
+ * the set opens the first of them.
+ * @arg config The configuration
+ * @arg namelist Output, the folders, as with scandir
+ * @return The number of folders, or -1 on error.
+ */
+static int scan_set_folders(hlld_config *config, struct dirent ***namelist) {
+    if (config->num_data_dirs <= 1)
+        return scandir(config->data_dir, namelist, set_hlld_folders, NULL);
+
+    struct dirent **all = NULL;
+    int num = 0;
+    for (int i=0; i < config->num_data_dirs; i++) {
+        struct dirent **found;
+        int n = scandir(config->data_dir_list[i], &found, set_hlld_folders, NULL);
+        if (n == -1) {
+            syslog(LOG_ERR, "Failed to scan data directory '%s'!", config->data_dir_list[i]);
+            for (int j=0; j < num; j++) free(all[j]);
+            free(all);
+            return -1;
+        }
+        if (n) all = realloc(all, (num + n) * sizeof(struct dirent*));
+        memcpy(all + num, found, n * sizeof(struct dirent*));
+        num += n;
+        free(found);
+    }
+
+    int kept = 0;
+    if (num) qsort(all, num, sizeof(struct dirent*), compare_folders);
+    for (int i=0; i < num; i++) {
+        if (kept && !strcmp(all[kept - 1]->d_name, all[i]->d_name)) {
+            syslog(LOG_WARNING, "Set folder '%s' is in more than one data directory!", all[i]->d_name);
+            free(all[i]);
+        } else {
+            all[kept++] = all[i];
+        }
+    }
+    *namelist = all;
+    return kept;
+}
+
+/**
+ * Thread that loads existing sets until none are left
+ */
+static void* load_worker_main(void *in) {
+    load_round *round = in;
+    int idx;
+    while ((idx = __sync_fetch_and_add(&round->next, 1)) < round->num) {
+        char *set_name = round->namelist[idx]->d_name + FOLDER_PREFIX_LEN;
+        round->sets[idx] = new_set_wrapper(round->mgr, set_name, round->mgr->config, NULL, 0);
+        if (!round->sets[idx]) {
+            syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Builds the set map from the loaded sets in one pass. The
+ * NULL entries are sets that failed to load, and are skipped.
+ */
+static void insert_loaded_sets(hlld_setmgr *mgr, hlld_set_wrapper **sets, int num) {
+    int n = 0;
+    for (int i=0; i < num; i++) {
+        if (sets[i]) sets[n++] = sets[i];
+    }
+    if (!n) return;
+    qsort(sets, n, sizeof(hlld_set_wrapper*), compare_set_names);
+
+    unsigned char **keys = malloc(n * sizeof(unsigned char*));
+    int *key_lens = malloc(n * sizeof(int));
+    for (int i=0; i < n; i++) {
+        keys[i] = (unsigned char*)sets[i]->set->set_name;
+        key_lens[i] = strlen(sets[i]->set->set_name) + 1;
+    }
+    if (art_bulk_load(&mgr->set_map, keys, key_lens, (void**)sets, n)) {
+        for (int i=0; i < n; i++)
+            art_insert(&mgr->set_map, keys[i], key_lens[i], sets[i]);
+    }
+    free(keys);
+    free(key_lens);
+}
+
 /**
  * Loads the existing sets. This is not thread
  * safe and assumes that we are being initialized.
+ * Reading the set configs dominates, so the sets are
+ * built on a pool of threads, then inserted at once.
  */
 static int load_existing_sets(hlld_setmgr *mgr) {
-    struct dirent **namelist;
-    int num;
+    // Restore from the manifest if we can, else scan the folders
+    load_list list = {mgr, NULL, 0, 0};
+    int num = manifest_load(mgr->manifest, load_manifest_cb, &list);
+    insert_loaded_sets(mgr, list.sets, list.num);
+    free(list.sets);
+    if (num >= 0) {
+        syslog(LOG_INFO, "Loaded %d existing sets from the manifest", num);
+        load_archived_sets(mgr, 1);
+
+        // The sizes of the manifest may predate the last flushes
+        if (mgr->config->read_only) art_iter(&mgr->set_map, set_map_refresh_cb, NULL);
+        return 0;
+    } else if (num != -ENOENT) {
+        syslog(LOG_WARNING, "Ignoring the invalid manifest. Err: %d", num);
+    }
 
-    num = scandir(mgr->config->data_dir, &namelist, set_hlld_folders, NULL);
+    struct dirent **namelist;
+    num = scan_set_folders(mgr->config, &namelist);
     if (num == -1) {
         syslog(LOG_ERR, "Failed to scan files for existing sets!");
         return -1;
     }
     syslog(LOG_INFO, "Found %d existing sets", num);
 
-    // Add all the sets
-    for (int i=0; i< num; i++) {
-        char *folder_name = namelist[i]->d_name;
-        char *set_name = folder_name + FOLDER_PREFIX_LEN;
-        if (add_set(mgr, set_name, mgr->config, 0, 0)) {
-            syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
-        }
+    // Use a thread per core, but do not bother for few sets
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (num + MIN_SETS_PER_LOAD_THREAD - 1) / MIN_SETS_PER_LOAD_THREAD;
+    if (cores > 0 && num_threads > cores) num_threads = cores;
+    if (num_threads > MAX_LOAD_THREADS) num_threads = MAX_LOAD_THREADS;
+
+    // Build all the sets, helping out on this thread
+    load_round round = {mgr, namelist, num, 0, calloc(num + 1, sizeof(hlld_set_wrapper*))};
+    pthread_t threads[MAX_LOAD_THREADS];
+    int started = 0;
+    for (; started < num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, load_worker_main, &round)) break;
     }
+    load_worker_main(&round);
+    for (int i=0; i < started; i++) pthread_join(threads[i], NULL);
 
+    // Add all the sets, and those that are only archived
+    insert_loaded_sets(mgr, round.sets, num);
+    free(round.sets);
     for (int i=0; i < num; i++) free(namelist[i]);
     free(namelist);
+    load_archived_sets(mgr, 0);
+
+    // Record the sets, so the next start can skip the scan
+    if (!mgr->config->read_only) {
+        snapshot_manifest(mgr);
+        manifest_checkpoint_end(mgr->manifest);
+    }
+    return 0;
+}
+
+/**
+ * Builds a set restored from the manifest
+ */
+static void load_manifest_cb(void *data, char *set_name, hlld_set_config *config) {
+    load_list *list = data;
+    hlld_set_wrapper *set = new_set_wrapper(list->mgr, set_name, list->mgr->config, config, 0);
+    if (!set) {
+        syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
+        return;
+    }
+    if (list->num == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->sets = realloc(list->sets, list->cap * sizeof(hlld_set_wrapper*));
+    }
+    list->sets[list->num++] = set;
+}
+
+/**
+ * Matches an archived set to the loaded sets. A set that
+ * was restored just before a crash still has its record,
+ * and a set the manifest does not have was dropped.
+ */
+static void load_archived_cb(void *data, char *set_name, hlld_set_config *config) {
+    archive_load *load = data;
+    hlld_setmgr *mgr = load->mgr;
+    hlld_set_wrapper *set = art_search(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1);
+    if (set) {
+        if (!hset_is_archived(set->set)) archive_drop(mgr->archive, set_name);
+        return;
+    } else if (load->from_manifest) {
+        archive_drop(mgr->archive, set_name);
+        return;
+    }
+
+    // Archived sets have no folder, so they are not found by a scan
+    set = new_set_wrapper(mgr, set_name, mgr->config, config, 0);
+    if (!set) {
+        syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
+        return;
+    }
+    art_insert(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
+    load->added++;
+}
+
+/**
+ * Adds the archived sets to the loaded sets, and
+ * drops the records that are no longer needed
+ */
+static void load_archived_sets(hlld_setmgr *mgr, int from_manifest) {
+    if (!mgr->archive) return;
+    archive_load load = {mgr, from_manifest, 0};
+    int num = archive_iter(mgr->archive, load_archived_cb, &load);
+    if (num) syslog(LOG_INFO, "Found %d archived sets", num);
+}
+
+/**
+ * Collects a copy of each set config of the manifest
+ */
+static void refresh_manifest_cb(void *data, char *set_name, hlld_set_config *config) {
+    hlld_set_config *copy = malloc(sizeof(hlld_set_config));
+    *copy = *config;
+    free(art_insert(data, (unsigned char*)set_name, strlen(set_name)+1, copy));
+}
+
+/**
+ * Called as part of the hashmap callback to add the sets
+ * of the manifest that are new. Runs with the write lock.
+ */
+static int refresh_add_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    hlld_setmgr *mgr = data;
+    char *set_name = (char*)key;
+    if (check_new_set(mgr, set_name)) return 0;
+    hlld_set_wrapper *set = new_set_wrapper(mgr, set_name, mgr->config, value, 0);
+    if (!set) {
+        syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
+        return 0;
+    }
+    update_set_map(mgr, CREATE, set);
+    syslog(LOG_INFO, "Following new set '%s'.", set_name);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to free the set configs of a refresh.
+ */
+static int refresh_free_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    free(value);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to add the active sets to a manifest checkpoint.
+ */
+static int set_map_manifest_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    hlld_set_wrapper *set = value;
+    if (set->is_active)
+        manifest_checkpoint_add(data, (char*)key, &set->set->set_config);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to collect every set into a list.
+ */
+static int set_map_collect_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    load_list *list = data;
+    if (list->num == list->cap) {
+        int cap = (list->cap) ? list->cap * 2 : 64;
+        hlld_set_wrapper **sets = realloc(list->sets, cap * sizeof(hlld_set_wrapper*));
+        if (!sets) return 1;
+        list->sets = sets;
+        list->cap = cap;
+    }
+    list->sets[list->num++] = value;
+    return 0;
+}
+
+/**
+ * Flushes an active set on shutdown, if it is dirty
+ */
+static void flush_closing_set(hlld_set_wrapper *set) {
+    if (set->is_active && set->set->is_dirty) hset_flush(set->set);
+}
+
+/**
+ * Thread that flushes or closes sets until none are left
+ */
+static void* close_worker_main(void *in) {
+    close_round *round = in;
+    int idx;
+    while ((idx = __sync_fetch_and_add(&round->next, 1)) < round->num) {
+        round->run(round->sets[idx]);
+        __sync_fetch_and_add(&round->done, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Flushes or closes all the sets of a round in parallel, so
+ * that a shutdown waits on the disks rather than on each set
+ * in turn. Uses a thread per core, or per flush thread if
+ * there are more, helping out on this thread.
+ */
+static void run_close_round(hlld_setmgr *mgr, close_round *round) {
+    if (!round->num) return;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < mgr->config->flush_threads) cores = mgr->config->flush_threads;
+    int num_threads = (round->num + MIN_SETS_PER_CLOSE_THREAD - 1) / MIN_SETS_PER_CLOSE_THREAD;
+    if (cores > 0 && num_threads > cores) num_threads = cores;
+    if (num_threads > MAX_CLOSE_THREADS) num_threads = MAX_CLOSE_THREADS;
+
+    uint64_t start = hclock_nsec();
+    pthread_t threads[MAX_CLOSE_THREADS];
+    int started = 0;
+    for (; started < num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, close_worker_main, round)) break;
+    }
+
+    // Take sets on this thread too, reporting every second
+    uint64_t reported = start;
+    int idx;
+    while ((idx = __sync_fetch_and_add(&round->next, 1)) < round->num) {
+        round->run(round->sets[idx]);
+        __sync_fetch_and_add(&round->done, 1);
+        uint64_t now = hclock_nsec();
+        if (now - reported >= 1000000000ULL) {
+            syslog(LOG_INFO, "%s %d of %d sets.", round->done_verb, round->done, round->num);
+            reported = now;
+        }
+    }
+    for (int i=0; i < started; i++) pthread_join(threads[i], NULL);
+    syslog(LOG_INFO, "%s %d sets on %d threads in %d msecs.", round->done_verb, round->num,
+            started + 1, (int)((hclock_nsec() - start) / 1000000));
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to read the files of the sets as last flushed.
+ */
+static int set_map_refresh_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    hlld_set_wrapper *set = value;
+    hset_refresh(set->set);
     return 0;
 }
 
+/**
+ * Starts a manifest checkpoint of every active set.
+ * This must be invoked with the write lock, or during
+ * initialization, so creates and drops are not missed.
+ */
+static void snapshot_manifest(hlld_setmgr *mgr) {
+    manifest_checkpoint_begin(mgr->manifest);
+    art_iter(&mgr->set_map, set_map_manifest_cb, mgr->manifest);
+}
+
 
 /**
- * Creates a new delta update and adds to the head of the list.
+ * Publishes a batch of changes to the set map as a new version,
+ * and queues what it gave up for the vacuum thread.
  * This must be invoked with the write lock as it is unsafe.
  * @arg mgr The manager
- * @arg type The type of delta
- * @arg set The set that is affected
+ * @arg cow The batch, whose retired nodes are taken
+ * @arg dropped The sets removed by the batch, a malloc()'d
+ * array which is taken, or NULL
+ * @arg num_dropped The number of sets removed
  * @return The new version we created
  */
-static unsigned long long create_delta_update(hlld_setmgr *mgr, delta_type type, hlld_set_wrapper *set) {
-    set_list *delta = malloc(sizeof(set_list));
-    delta->vsn = ++mgr->vsn;
-    delta->type = type;
-    delta->set = set;
-    delta->next = mgr->delta;
-    mgr->delta = delta;
-    return delta->vsn;
+static unsigned long long publish_set_map(hlld_setmgr *mgr, art_cow *cow,
+        hlld_set_wrapper **dropped, int num_dropped) {
+    art_cow_publish(&mgr->set_map, cow);
+
+    // The lookup caches rely on the version changing after the tree
+    __sync_synchronize();
+    unsigned long long vsn = ++mgr->vsn;
+    if (!cow->num_retired && !num_dropped) {
+        free(cow->retired);
+        free(dropped);
+        return vsn;
+    }
+
+    // Clients that loaded the old root are done once past the new epoch
+    set_garbage *garbage = malloc(sizeof(set_garbage));
+    garbage->nodes = cow->retired;
+    garbage->num_nodes = cow->num_retired;
+    garbage->sets = dropped;
+    garbage->num_sets = num_dropped;
+    garbage->epoch = epoch_advance(mgr->epochs);
+    garbage->next = mgr->garbage;
+    mgr->garbage = garbage;
+    mgr->num_garbage++;
+    epoch_notify(mgr->epochs);
+    return vsn;
 }
 
 /**
- * Merges changes into the alternate tree from the delta lists
- * Safety: Safe ONLY if no other thread is using alt_set_map
+ * Creates or drops a single set in the set map, as a new version.
+ * This must be invoked with the write lock as it is unsafe.
+ * @arg mgr The manager
+ * @arg type The type of update
+ * @arg set The set that is affected
+ * @return The new version we created
  */
-static void merge_old_versions(hlld_setmgr *mgr, set_list *delta, unsigned long long min_vsn) {
-    // Handle older delta first (bottom up)
-    if (delta->next) merge_old_versions(mgr, delta->next, min_vsn);
-
-    // Check if we should skip this update
-    if (delta->vsn > min_vsn) return;
-
-    // Handle current update
-    hlld_set_wrapper *s = delta->set;
-    switch (delta->type) {
+static unsigned long long update_set_map(hlld_setmgr *mgr, update_type type, hlld_set_wrapper *set) {
+    art_cow cow;
+    art_cow_begin(&mgr->set_map, &cow);
+    hlld_set_wrapper **dropped = NULL;
+    unsigned char *key = (unsigned char*)set->set->set_name;
+    int key_len = strlen(set->set->set_name) + 1;
+    switch (type) {
         case CREATE:
-            art_insert(mgr->alt_set_map, (unsigned char*)s->set->set_name, strlen(s->set->set_name)+1, s);
+            art_cow_insert(&mgr->set_map, &cow, key, key_len, set);
             break;
         case DELETE:
-            art_delete(mgr->alt_set_map, (unsigned char*)s->set->set_name, strlen(s->set->set_name)+1);
-            break;
-        case BARRIER:
-            // Ignore the barrier...
+            art_cow_delete(&mgr->set_map, &cow, key, key_len);
+            dropped = malloc(sizeof(hlld_set_wrapper*));
+            dropped[0] = set;
             break;
     }
+    return publish_set_map(mgr, &cow, dropped, (dropped) ? 1 : 0);
 }
 
 /**
- * Updates the pending deletes list with a list of pending deletes
+ * Replaces the pending deletes list with
+ * the sets dropped by the taken garbage
  */
-static void mark_pending_deletes(hlld_setmgr *mgr, unsigned long long min_vsn) {
+static void mark_pending_deletes(hlld_setmgr *mgr, set_garbage *garbage) {
     hlld_set_list *tmp, *pending = NULL;
 
     // Add each delete
-    set_list *delta = mgr->delta;
-    while (delta) {
-        if (delta->vsn <= min_vsn && delta->type == DELETE) {
+    for (; garbage; garbage = garbage->next) {
+        for (int i=0; i < garbage->num_sets; i++) {
             tmp = malloc(sizeof(hlld_set_list));
-            tmp->set_name = strdup(delta->set->set->set_name);
+            tmp->set_name = strdup(garbage->sets[i]->set->set_name);
             tmp->next = pending;
             pending = tmp;
         }
-        delta = delta->next;
     }
 
     LOCK_HLLD_SPIN(&mgr->pending_lock);
+    tmp = mgr->pending_deletes;
     mgr->pending_deletes = pending;
     UNLOCK_HLLD_SPIN(&mgr->pending_lock);
+
+    // Free the old nodes
+    hlld_set_list *next;
+    while (tmp) {
+        free(tmp->set_name);
+        next = tmp->next;
+        free(tmp);
+        tmp = next;
+    }
 }
 
 /**
@@ -962,89 +3682,65 @@ static void clear_pending_deletes(hlld_setmgr *mgr) {
 }
 
 /**
- * Swap the alternate / primary maps, sets the primary_vsn
- * This is always safe, since its just a pointer swap.
- */
-static void swap_set_maps(hlld_setmgr *mgr, unsigned long long primary_vsn) {
-    art_tree *tmp = mgr->set_map;
-    mgr->set_map = mgr->alt_set_map;
-    mgr->alt_set_map = tmp;
-    mgr->primary_vsn = primary_vsn;
-}
-
-/*
- * Scans a set_list* until it finds an entry with a version
- * less than min_vsn. It NULLs the pointer to that version
- * and returns a pointer to that node.
+ * Reclaims the garbage of the versions published up to an
+ * epoch. The nodes are freed under the write lock, since the
+ * writers allocate from the same pool, and then delete_set is
+ * called on the dropped sets.
  *
- * Safety: This is ONLY safe if the minimum client version
- * and the primary_vsn is strictly greater than the min_vsn argument.
- * This ensures access to older delta entries will not happen.
+ * Safety: This is ONLY safe if every client has moved past
+ * max_epoch. This ensures the garbage is not referenced.
+ * @return The number of versions reclaimed
  */
-static set_list* remove_delta_versions(set_list *init, set_list **ref, unsigned long long min_vsn) {
-    set_list *current = init;
-    set_list **prev = ref;
-    while (current && current->vsn > min_vsn) {
-        prev = &current->next;
-        current = current->next;
-    }
+static int delete_old_versions(hlld_setmgr *mgr, uint64_t max_epoch) {
+    // Take the garbage old enough, the newest is first
+    pthread_mutex_lock(&mgr->write_lock);
+    set_garbage **prev = &mgr->garbage;
+    while (*prev && (*prev)->epoch > max_epoch) prev = &(*prev)->next;
+    set_garbage *old = *prev;
+    *prev = NULL;
 
-    // NULL out the reference pointer to current node if any
-    if (current) *prev = NULL;
-    return current;
-}
+    int num = 0;
+    for (set_garbage *g = old; g; g = g->next, num++)
+        art_reclaim(&mgr->set_map, g->nodes, g->num_nodes);
+    mgr->num_garbage -= num;
 
-/**
- * Deletes old versions from the delta lists, and calls
- * delete_set on the sets in the destroyed list.
- *
- * Safety: Same as remove_delta_versions
- */
-static void delete_old_versions(hlld_setmgr *mgr, unsigned long long min_vsn) {
-    // Get the merged in pending ops, lock to avoid a race
-    pthread_mutex_lock(&mgr->write_lock);
-    set_list *old = remove_delta_versions(mgr->delta, &mgr->delta, min_vsn);
+    /*
+     * Mark the pending deletes so that create does not allow
+     * a set to be created before we manage to delete its files.
+     * They are marked before the lock is released, so a
+     * create/drop/create cycle always finds the first set.
+     */
+    mark_pending_deletes(mgr, old);
     pthread_mutex_unlock(&mgr->write_lock);
 
-    // Delete the sets now that we have merged into both trees
-    set_list *next, *current = old;
-    while (current) {
-        if (current->type == DELETE) delete_set(current->set);
-        next = current->next;
-        free(current);
-        current = next;
+    // Delete the sets now that no client can reach them
+    set_garbage *next;
+    while (old) {
+        for (int i=0; i < old->num_sets; i++) delete_set(old->sets[i]);
+        next = old->next;
+        free(old->sets);
+        free(old);
+        old = next;
     }
+    clear_pending_deletes(mgr);
+    return num;
 }
 
 /**
- * Determines the minimum visible version from the client list
- * Safety: Always safe
+ * Checks if the vacuum thread has garbage to reclaim
  */
-static unsigned long long client_min_vsn(hlld_setmgr *mgr) {
-    // Determine the minimum version
-    unsigned long long thread_vsn, min_vsn = mgr->vsn;
-    for (setmgr_client *cl=mgr->clients; cl != NULL; cl=cl->next) {
-        thread_vsn = cl->vsn;
-        if (thread_vsn < min_vsn) min_vsn = thread_vsn;
-    }
-    return min_vsn;
+static int vacuum_has_work(void *data) {
+    hlld_setmgr *mgr = data;
+    return !mgr->should_run || mgr->garbage;
 }
 
 /**
- * Creates a barrier that is implicit by adding a
- * new version, and waiting for all clients to reach
- * that version. This can be used as a non-locking
- * syncronization mechanism.
+ * Checks if every client has moved past the epoch
+ * of the newest garbage, so it is unused
  */
-static void version_barrier(hlld_setmgr *mgr) {
-    // Create a new delta
-    pthread_mutex_lock(&mgr->write_lock);
-    unsigned long long vsn = create_delta_update(mgr, BARRIER, NULL);
-    pthread_mutex_unlock(&mgr->write_lock);
-
-    // Wait until we converge on the version
-    while (mgr->should_run && client_min_vsn(mgr) < vsn)
-        usleep(VACUUM_POLL_USEC);
+static int vacuum_grace_over(void *data) {
+    hlld_setmgr *mgr = data;
+    return !mgr->should_run || epoch_min(mgr->epochs) >= mgr->reclaim_epoch;
 }
 
 /**
@@ -1052,105 +3748,180 @@ static void version_barrier(hlld_setmgr *mgr) {
  * the state of the set manager. It's current use is to
  * cleanup the garbage created by our MVCC model. We do this
  * by making use of periodic 'checkpoints'. Our worker threads
- * report the version they are currently using, and we are always
- * able to delete versions that are strictly less than the minimum.
+ * report the epoch they have observed, and once they are all
+ * past the epoch of a version, we are able to free the nodes
+ * and sets it replaced.
  */
 static void* setmgr_thread_main(void *in) {
     // Extract our arguments
     hlld_setmgr *mgr = in;
-    unsigned long long min_vsn, mgr_vsn;
     while (mgr->should_run) {
-        // Do nothing if there is no changes
-        if (mgr->vsn == mgr->primary_vsn) {
-            usleep(VACUUM_POLL_USEC);
-            continue;
-        }
-
-        /*
-         * Because we use a version barrier, we always
-         * end up creating a new version when we try to
-         * apply delta updates. We need to handle the special case
-         * where we are 1 version behind and the only delta is
-         * a barrier. Do this by just updating primary_vsn.
-         */
-        mgr_vsn = mgr->vsn;
-        if ((mgr_vsn - mgr->primary_vsn) == 1) {
-            pthread_mutex_lock(&mgr->write_lock);
-
-            // Ensure no version created in the mean time
-            int should_continue = 0;
-            if (mgr_vsn == mgr->vsn && mgr->delta->type == BARRIER) {
-                mgr->primary_vsn = mgr_vsn;
-                should_continue = 1;
-            }
-
-            // Release the lock and see if we should loop back
-            pthread_mutex_unlock(&mgr->write_lock);
-            if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
-                continue;
-            }
-        }
-
-        // Determine the minimum version
-        min_vsn = client_min_vsn(mgr);
-
-        // Warn if there are a lot of outstanding deltas
-        if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
-            syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
+        // Sleep until there is garbage
+        epoch_wait(mgr->epochs, vacuum_has_work, mgr);
+        if (!mgr->should_run) break;
+
+        // Warn if there are a lot of outstanding versions
+        pthread_mutex_lock(&mgr->write_lock);
+        mgr->reclaim_epoch = mgr->garbage->epoch;
+        uint64_t num = mgr->num_garbage;
+        pthread_mutex_unlock(&mgr->write_lock);
+        if (num > WARN_THRESHOLD) {
+            syslog(LOG_WARNING, "Many versions awaiting reclaim! num: %llu (epoch: %llu)",
+                    (unsigned long long)num, (unsigned long long)mgr->reclaim_epoch);
         } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
+            syslog(LOG_DEBUG, "Reclaiming versions up to epoch: %llu",
+                    (unsigned long long)mgr->reclaim_epoch);
         }
 
-        // Merge the old versions into the alternate three
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        /*
-         * Mark any pending deletes so that create does not allow
-         * a set to be created before we manage to call delete_old_versions.
-         * There is an unfortunate race that can happen if a client
-         * does a create/drop/create cycle, where the create/drop are
-         * reflected in the set_map, and thus the second create is allowed
-         * BEFORE we have had a chance to actually handle the delete.
-         */
-        mark_pending_deletes(mgr, min_vsn);
-
-        // Swap the maps
-        swap_set_maps(mgr, min_vsn);
+        // Wait until nobody is using the newest garbage
+        TRACE1(vacuum_grace_begin, mgr->reclaim_epoch);
+        epoch_wait(mgr->epochs, vacuum_grace_over, mgr);
+        TRACE1(vacuum_grace_end, mgr->reclaim_epoch);
+        if (!mgr->should_run) break;
 
-        // Wait on a barrier until nobody is using the old tree
-        version_barrier(mgr);
-
-        // Merge the changes into the other tree now that its safe
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        // Both trees have the changes incorporated, safe to delete
-        delete_old_versions(mgr, min_vsn);
-
-        // Clear the pending delete list, since delete_old_versions() will
-        // block untill all deletes are completed.
-        clear_pending_deletes(mgr);
+        // Every client is past these versions, safe to delete
+        TRACE1(vacuum_delete_begin, mgr->reclaim_epoch);
+        int reclaimed = delete_old_versions(mgr, mgr->reclaim_epoch);
+        TRACE1(vacuum_delete_end, mgr->reclaim_epoch);
 
         // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
-                min_vsn, mgr->vsn);
+        syslog(LOG_INFO, "Reclaimed %d versions up to epoch: %llu",
+                reclaimed, (unsigned long long)mgr->reclaim_epoch);
     }
     return NULL;
 }
 
 
 /**
- * This method is used to force a vacuum up to the current
- * version. It is generally unsafe to use in hlld,
+ * This method is used to force a vacuum of every version.
+ * It is generally unsafe to use in hlld,
  * but can be used in an embeded or test environment.
  */
 void setmgr_vacuum(hlld_setmgr *mgr) {
-    unsigned long long vsn = mgr->vsn;
-    merge_old_versions(mgr, mgr->delta, vsn);
-    swap_set_maps(mgr, vsn);
-    merge_old_versions(mgr, mgr->delta, vsn);
-    delete_old_versions(mgr, vsn);
+    delete_old_versions(mgr, (uint64_t)-1);
+}
+
+/**
+ * Orders the sets hottest first
+ */
+static int compare_hot(const void *a, const void *b) {
+    return compare_lru(b, a);
+}
+
+/**
+ * Reads the names of the hot sets recorded before a restart
+ * @arg names Output, the names, hottest first
+ * @return The number of names, 0 if there are none.
+ */
+static int read_hot_sets(hlld_setmgr *mgr, char ***names) {
+    *names = NULL;
+    char *path = join_path(mgr->config->data_dir, (char*)HOT_SETS_FILENAME);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) return 0;
+
+    int num = 0, cap = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        int len = strcspn(line, "\n");
+        if (!len) continue;
+        line[len] = '\0';
+        if (num == cap) {
+            cap = (cap) ? cap * 2 : 64;
+            *names = realloc(*names, cap * sizeof(char*));
+        }
+        (*names)[num++] = strdup(line);
+    }
+    fclose(f);
+    return num;
+}
+
+/**
+ * Entry point of the prewarm thread. Pages in the sets that
+ * were hot before the restart, hottest first, reading the
+ * files of the next few ahead so the disk is kept busy.
+ * Like the page-in thread, it is only a client of the
+ * manager while loading.
+ */
+static void* prewarm_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    char **names;
+    int num = read_hot_sets(mgr, &names);
+    uint64_t start = hclock_nsec();
+
+    int ahead = 0, warmed = 0, i = 0;
+    for (; i < num && mgr->prewarm_run; i++) {
+        setmgr_client_checkpoint(mgr);
+        for (; ahead < num && ahead <= i + PREWARM_READAHEAD; ahead++) {
+            hlld_set_wrapper *set = take_set(mgr, names[ahead]);
+            if (set) hset_readahead(set->set);
+        }
+
+        // Fault in under the READ lock, like a write would
+        hlld_set_wrapper *set = take_set(mgr, names[i]);
+        if (set && hset_is_proxied(set->set)) {
+            brlock_rdlock(&set->lock);
+            if (!hset_page_in(set->set)) warmed++;
+            brlock_rdunlock(&set->lock);
+        }
+        setmgr_client_leave(mgr);
+    }
+    if (warmed) syslog(LOG_INFO, "Paged in %d hot sets in %d msecs", warmed,
+            (int)((hclock_nsec() - start) / 1000000));
+    for (int j=0; j < num; j++) free(names[j]);
+    free(names);
+    return NULL;
 }
 
+/**
+ * Entry point for a page-in thread. Loads the queued sets
+ * of its data directory in order, and notifies the requester
+ * of each. The thread is only a client of the manager while
+ * loading, so an idle thread does not hold back vacuuming.
+ */
+static void* page_in_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    pthread_mutex_lock(&mgr->page_in_lock);
+    int queue = mgr->page_in_claimed++;
+    while (1) {
+        page_in_job *job = mgr->page_in_head[queue];
+        if (!job) {
+            if (!mgr->page_in_run) break;
+            pthread_cond_wait(&mgr->page_in_cond, &mgr->page_in_lock);
+            continue;
+        }
+        mgr->page_in_head[queue] = job->next;
+        if (!mgr->page_in_head[queue]) mgr->page_in_tail[queue] = NULL;
+        pthread_mutex_unlock(&mgr->page_in_lock);
+
+        // New sets make their folder, and are then durable
+        if (job->is_create) {
+            setmgr_client_checkpoint(mgr);
+            int res = persist_new_set(mgr, job->set_name);
+            setmgr_client_leave(mgr);
+            if (job->created) job->created(job->data, res);
+            free(job->set_name);
+            free(job);
+            pthread_mutex_lock(&mgr->page_in_lock);
+            continue;
+        }
+
+        // Fault in under the READ lock, like a write would
+        setmgr_client_checkpoint(mgr);
+        hlld_set_wrapper *set = take_set(mgr, job->set_name);
+        if (set) {
+            brlock_rdlock(&set->lock);
+            if (hset_page_in(set->set))
+                syslog(LOG_ERR, "Failed to page in set '%s'.", job->set_name);
+            brlock_rdunlock(&set->lock);
+        }
+        setmgr_client_leave(mgr);
+
+        job->cb(job->data);
+        free(job->set_name);
+        free(job);
+        pthread_mutex_lock(&mgr->page_in_lock);
+    }
+    pthread_mutex_unlock(&mgr->page_in_lock);
+    return NULL;
+}
@@ -4,6 +4,19 @@
 #include "config.h"
 #include "set.h"
 
+/**
+ * The most sets an intersection can estimate. Inclusion-exclusion
+ * needs the size of the union of every subset of the sets.
+ */
+#define SETMGR_MAX_INTERSECT 8
+
+/**
+ * Bound sets are named by their handle after this prefix,
+ * such as @12, by any call taking a set name
+ */
+#define SET_HANDLE_PREFIX '@'
+#define MAX_SET_HANDLES 65536
+
 /**
  * Opaque handle to the set manager
  */
@@ -23,6 +36,23 @@ typedef struct {
    hlld_set_list *tail;
 } hlld_set_list_head;
 
+/**
+ * Metrics of a set, as of the last stats snapshot
+ */
+typedef struct {
+    char *set_name;
+    int resident;               // Is the set paged in
+    uint64_t resident_bytes;    // Bytes of registers paged in
+    set_counters counters;
+} hlld_set_stats;
+
+/**
+ * Callback invoked with the stats of each set
+ * @arg data Opaque pointer passed to setmgr_iter_set_stats
+ * @arg stats The stats of a set
+ */
+typedef void(*set_stats_cb)(void *data, hlld_set_stats *stats);
+
 /**
  * Initializer
  * @arg config The configuration
@@ -40,6 +70,14 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr);
  */
 int destroy_set_manager(hlld_setmgr *mgr);
 
+/**
+ * Stops paging in sets asynchronously. Queued page ins
+ * are finished first. Later requests are refused, so their
+ * callers load the sets inline.
+ * @arg mgr The manager
+ */
+void setmgr_stop_page_in(hlld_setmgr *mgr);
+
 /**
  * Should be invoked periodically by client threads to allow
  * the vacuum thread to cleanup garbage state. It should also
@@ -58,6 +96,28 @@ void setmgr_client_checkpoint(hlld_setmgr *mgr);
  */
 void setmgr_client_leave(hlld_setmgr *mgr);
 
+/**
+ * Should be invoked by clients before they block, such as
+ * when waiting for events. The client holds no references
+ * until its next checkpoint, so vacuuming is not held back
+ * while it waits. This is cheaper than leaving.
+ * @arg mgr The manager
+ */
+void setmgr_client_idle(hlld_setmgr *mgr);
+
+/**
+ * Queues a proxied set to be paged in on the page-in
+ * thread, so that the caller does not block on the disk.
+ * @arg set_name The name of the set
+ * @arg cb Invoked on the page-in thread once the set is loaded
+ * @arg data Opaque pointer passed to the callback
+ * @return 1 if the page in was queued, and cb will be invoked.
+ * 0 if the set is not proxied or paging in is stopped, and
+ * -1 if the set does not exist.
+ */
+typedef void(*page_in_cb)(void *data);
+int setmgr_page_in_async(hlld_setmgr *mgr, char *set_name, page_in_cb cb, void *data);
+
 /**
  * Flushes the set with the given name
  * @arg set_name The name of the set to flush
@@ -71,10 +131,167 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name);
  * @arg keys A list of points to character arrays to add
  * @arg num_keys The number of keys to add
  * @return 0 on success, -1 if the set does not exist.
- * -2 on internal error.
+ * -2 on internal error, -3 if the set only accepts hashes.
  */
 int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys);
 
+/**
+ * Sets keys of known lengths in a given set. The
+ * keys need not be null terminated.
+ * @arg set_name The name of the set
+ * @arg keys A list of points to character arrays to add
+ * @arg lens The length of each key
+ * @arg num_keys The number of keys to add
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set only accepts hashes.
+ */
+int setmgr_set_sized_keys(hlld_setmgr *mgr, char *set_name, char **keys, int *lens, int num_keys);
+
+/**
+ * Sets client computed hashes in a given set. The
+ * set must have been created with the external hash.
+ * @arg set_name The name of the set
+ * @arg hashes A list of 64 bit hashes to add
+ * @arg num_hashes The number of hashes to add
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if the set does not accept hashes.
+ */
+int setmgr_set_hashes(hlld_setmgr *mgr, char *set_name, uint64_t *hashes, int num_hashes);
+
+/**
+ * Sets the same keys in many sets. Each key is hashed once
+ * for each hash function used by the sets, rather than once
+ * for every set.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg results The result of each set, as returned by setmgr_set_keys.
+ * Sets with a non-zero result are skipped, so that the results
+ * can be reused across batches of keys. Must start zeroed.
+ * @return 0 if every set was updated, otherwise the number
+ * of sets that were not.
+ */
+int setmgr_set_keys_multi(hlld_setmgr *mgr, char **set_names, int num_sets,
+        char **keys, int num_keys, int *results);
+
+/**
+ * Sets a key in many sets, hashing it once for
+ * each hash function used by the sets.
+ * @arg key The key to add
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg results The result of each set, as with setmgr_set_keys_multi.
+ * Must start zeroed.
+ * @return 0 if every set was updated, otherwise the number
+ * of sets that were not.
+ */
+int setmgr_set_key_many(hlld_setmgr *mgr, char *key, char **set_names, int num_sets, int *results);
+
+/**
+ * Merges a list of sets into a destination set, so that
+ * the destination estimates the size of their union.
+ * The source sets are not modified, and those of a higher
+ * precision are folded down to that of the destination.
+ * @arg dst_name The name of the set to merge into
+ * @arg src_names A list of set names to merge from
+ * @arg num_srcs The number of source sets
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ or a source has a lower precision
+ * than the destination, -3 on internal error.
+ */
+int setmgr_merge_sets(hlld_setmgr *mgr, char *dst_name, char **src_names, int num_srcs);
+
+/**
+ * Merges registers built elsewhere into a set, such as the
+ * HLL of an edge node, so that the set estimates the size of
+ * their union. The registers must use the hash of the set,
+ * and those of a higher precision are folded down.
+ * @arg set_name The name of the set to merge into
+ * @arg precision The precision of the registers
+ * @arg layout The layout of the registers
+ * @arg payload The registers, as with hset_merge_raw
+ * @arg len The length of the payload
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 if the precision is lower than that of the set,
+ * -3 on internal error, -4 if the payload is invalid.
+ */
+int setmgr_merge_raw(hlld_setmgr *mgr, char *set_name, unsigned char precision,
+        hset_raw_layout layout, const unsigned char *payload, uint64_t len);
+
+/**
+ * Reads the registers of a set, so that they can be merged
+ * elsewhere or sent back with setmgr_merge_raw
+ * @arg set_name The name of the set
+ * @arg sparse Should dense registers be listed as entries
+ * @arg cb Invoked with the registers, while the set is held
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, -1 if the set does not exist.
+ * -3 on internal error.
+ */
+int setmgr_get_raw(hlld_setmgr *mgr, char *set_name, int sparse, hset_raw_cb cb, void *data);
+
+/**
+ * Estimates the size of the union of a list of sets,
+ * without modifying any of them. The union is at the
+ * lowest precision of the sets.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error.
+ */
+int setmgr_size_union(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est);
+
+/**
+ * Estimates the size of the union of a list of sets and
+ * the registers of sets fetched from other servers,
+ * without modifying any of them. The union is at the
+ * lowest precision of the sets.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets, may be 0
+ * @arg remotes The registers of the remote sets
+ * @arg remote_configs The config of each remote set
+ * @arg num_remote The number of remote sets
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error.
+ */
+int setmgr_size_union_remote(hlld_setmgr *mgr, char **set_names, int num_sets,
+        hll_t **remotes, hlld_set_config **remote_configs, int num_remote, uint64_t *est);
+
+/**
+ * Estimates the size of the intersection of a list of sets,
+ * without modifying any of them. Sets that all keep their
+ * smallest hashes scale the size of their union by their
+ * Jaccard similarity, which keeps the error relative to the
+ * intersection. Otherwise the inclusion-exclusion principle
+ * is used, whose error grows quickly with the number of sets,
+ * and is large when the intersection is small. The sets are
+ * combined at their lowest precision.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets, at most SETMGR_MAX_INTERSECT
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error,
+ * -4 if there are too many sets.
+ */
+int setmgr_size_intersect(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est);
+
+/**
+ * Estimates the Jaccard similarity of a list of sets, the
+ * size of their intersection over that of their union, from
+ * the smallest hashes each keeps. The sets are compared at
+ * the fewest hashes any of them keeps.
+ * @arg set_names A list of set names
+ * @arg num_sets The number of sets
+ * @arg jaccard Output pointer, the similarity from 0 to 1.
+ * @return 0 on success, -1 if any set does not exist.
+ * -2 if the hashes differ, -3 on internal error,
+ * -5 if a set does not keep its smallest hashes.
+ */
+int setmgr_jaccard(hlld_setmgr *mgr, char **set_names, int num_sets, double *jaccard);
+
 /**
  * Estimates the size of a set
  * @arg set_name The name of the set
@@ -83,6 +300,134 @@ int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys)
  */
 int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est);
 
+/**
+ * Estimates the size of many sets at once. The sets whose
+ * estimates are not cached are split across a few threads.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg sizes Output, the estimate of each set
+ * @arg results The result of each set, 0 or -1 if the set
+ * does not exist. Must start zeroed.
+ * @return 0 if every set exists, otherwise the number
+ * of sets that do not.
+ */
+int setmgr_set_sizes(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *sizes, int *results);
+
+/**
+ * Reads the sizes of many sets from their metadata alone,
+ * without the set locks and without estimates, so that a
+ * scan of the catalog never faults a set in or waits on
+ * its writers. Proxied sets, and those whose estimate is
+ * not cached, answer with the size of their last flush.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg sizes Output, the size of each set
+ * @arg results The result of each set, 0 if the size is
+ * current, 1 if it is stale, or -1 if the set does not exist.
+ * @return 0 if every set exists, otherwise the number
+ * of sets that do not.
+ */
+int setmgr_set_sizes_metadata(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *sizes, int *results);
+
+/**
+ * Estimates the keys added to a windowed set over its
+ * recent intervals, merging the buckets that cover them.
+ * @arg set_name The name of the set
+ * @arg span The seconds to cover, rounded up to whole intervals
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if the set is not windowed, -3 on internal error.
+ */
+int setmgr_set_size_window(hlld_setmgr *mgr, char *set_name, uint64_t span, uint64_t *est);
+
+/**
+ * Raises the registers of a set, as streamed from a primary.
+ * A missing set is created with the config of the primary.
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set on the primary
+ * @arg entries The register entries, as packed by HLL_ENTRY
+ * @arg num The number of entries
+ * @return 0 on success, -1 if the set could not be created,
+ * -2 on internal error, -3 if the set is not compatible.
+ */
+int setmgr_raise_registers(hlld_setmgr *mgr, char *set_name, hlld_set_config *set_config,
+        const uint32_t *entries, int num);
+
+/**
+ * Gets the register entries of a set to stream to followers.
+ * @arg set_name The name of the set
+ * @arg full Should every register be returned, rather than the raises
+ * @arg set_config Output, the config of the set
+ * @arg entries Output, a malloc()'d list of register entries,
+ * or NULL to drop the raises
+ * @return The number of entries, -1 if the set does not
+ * exist, or -2 on internal error.
+ */
+int setmgr_replication_entries(hlld_setmgr *mgr, char *set_name, int full,
+        hlld_set_config *set_config, uint32_t **entries);
+
+/**
+ * Dumps a set, with its config, so that it can be restored
+ * on another server with setmgr_restore_set.
+ * @arg set_name The name of the set
+ * @arg dump Output, a malloc()'d buffer of the dump
+ * @arg len Output, the length of the dump
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 on internal error.
+ */
+int setmgr_dump_set(hlld_setmgr *mgr, char *set_name, unsigned char **dump, uint64_t *len);
+
+/**
+ * Registers the callback that has requested snapshots written
+ * in the background, with setmgr_write_snapshot.
+ * @arg mgr The manager
+ * @arg cb Invoked when a snapshot is requested
+ * @arg data Opaque pointer passed to the callback
+ */
+typedef void(*snapshot_cb)(void *data);
+void setmgr_snapshot_cb(hlld_setmgr *mgr, snapshot_cb cb, void *data);
+
+/**
+ * Requests a snapshot of every set, written in the background
+ * @arg mgr The manager
+ * @return 0 if requested, -1 if a snapshot is already in
+ * progress, or -2 if snapshots are not written.
+ */
+int setmgr_request_snapshot(hlld_setmgr *mgr);
+
+/**
+ * Records the sets in memory, hottest first, so they
+ * are paged in again once the server restarts with
+ * prewarm. Invoked on each checkpoint, and on shutdown.
+ * @arg mgr The manager
+ * @return 0 on success, negative errno on failure.
+ */
+int setmgr_save_hot_sets(hlld_setmgr *mgr);
+
+/**
+ * Writes a snapshot of every set to the data directory, as a
+ * stream of their dumps. Each set is dumped as of a point in
+ * the snapshot, under a read lock that writes share, and the
+ * file is replaced once all the sets are written. Completes
+ * the requested snapshot, if any.
+ * @arg mgr The manager
+ * @arg num_sets Output, the number of sets written
+ * @return 0 on success, negative errno on failure.
+ */
+int setmgr_write_snapshot(hlld_setmgr *mgr, int *num_sets);
+
+/**
+ * Creates a set from a dump made by setmgr_dump_set, with
+ * the config and registers of the dumped set.
+ * @arg set_name The name of the set
+ * @arg dump The dump
+ * @arg len The length of the dump
+ * @return 0 on success, -1 if the set already exists,
+ * -2 for internal error, -3 if there is a pending delete,
+ * or -4 if the dump is corrupt.
+ */
+int setmgr_restore_set(hlld_setmgr *mgr, char *set_name, const unsigned char *dump, uint64_t len);
+
 /**
  * Creates a new set of the given name and parameters.
  * @arg set_name The name of the set
@@ -92,6 +437,59 @@ int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est);
  */
 int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_config);
 
+/**
+ * Creates a new set without blocking on the disk. The set
+ * is added right away, and its folder is made on the page-in
+ * thread of its data directory. Commands that page the set in
+ * meanwhile queue behind it there.
+ * @arg set_name The name of the set
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * @arg cb Optional, invoked once the set is durable, with 0, or -2
+ * if its folder could not be made and it was dropped. It is invoked
+ * on the page-in thread, or by the caller once those are stopped.
+ * @arg data Opaque pointer passed to the callback
+ * @return 1 if the set was added, and owns the custom config. -1 if
+ * the set already exists, or -3 if there is a pending delete.
+ */
+typedef void(*create_cb)(void *data, int res);
+int setmgr_create_set_async(hlld_setmgr *mgr, char *set_name, hlld_config *custom_config,
+        create_cb cb, void *data);
+
+/**
+ * Creates many sets with the same parameters. The sets are
+ * built without the write lock, and then published at once.
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg shared_config Optional, can be null. Configs that override
+ * the defaults, such as a template. Unlike the config of
+ * setmgr_create_set, it is not owned by the sets, so it
+ * must outlive them.
+ * @arg results The result of each set, as returned by setmgr_create_set
+ * @return The number of sets that were not created.
+ */
+int setmgr_create_sets(hlld_setmgr *mgr, char **set_names, int num_sets,
+        hlld_config *shared_config, int *results);
+
+/**
+ * Binds a handle to a set name, which other calls then
+ * take in place of the name. A name keeps its handle while
+ * the server runs, even once its set is dropped, so a set
+ * created again with the name is found by it.
+ * @arg set_name The name of the set, which must exist
+ * @arg id Output, the handle
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if every handle is bound.
+ */
+int setmgr_bind_set(hlld_setmgr *mgr, char *set_name, int *id);
+
+/**
+ * Returns the handle named by a set name
+ * @arg set_name The name, which need not be terminated
+ * @arg len The length of the name
+ * @return The handle, or -1 if the name is not a handle.
+ */
+int setmgr_handle_id(const char *set_name, int len);
+
 /**
  * Deletes the set entirely. This removes it from the set
  * manager and deletes it from disk. This is a permanent operation.
@@ -100,6 +498,16 @@ int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_conf
  */
 int setmgr_drop_set(hlld_setmgr *mgr, char *set_name);
 
+/**
+ * Drops the sets that expired by a time. The slots of the
+ * expiry wheel since the last call are taken, and their due
+ * sets are dropped at once, as one version of the set map. Their
+ * files are deleted in the background, like any drop.
+ * @arg now The time, in seconds since the epoch
+ * @return The number of sets dropped
+ */
+int setmgr_expire_sets(hlld_setmgr *mgr, uint64_t now);
+
 /**
  * Unmaps the set from memory, but leaves it
  * registered in the set manager. This is rarely invoked
@@ -111,6 +519,39 @@ int setmgr_drop_set(hlld_setmgr *mgr, char *set_name);
  */
 int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name);
 
+/**
+ * Cools a set mapped from its data file. Its dirty pages are
+ * flushed, then the kernel is asked to reclaim its pages,
+ * while it stays mapped. The set is cold unmapped later on,
+ * if it is not written meanwhile.
+ * @arg set_name The name of the set to cool
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 if it is not mapped from a file.
+ */
+int setmgr_cool_set(hlld_setmgr *mgr, char *set_name);
+
+/**
+ * Samples the residency of a set in memory, taking the
+ * bytes of its registers that are paged in and the pages
+ * faulted in since the last sample, as reported by info.
+ * @arg set_name The name of the set to sample
+ * @return 0 on success, -1 if the set does not exist,
+ * or -2 if it is not paged in.
+ */
+int setmgr_sample_residency(hlld_setmgr *mgr, char *set_name);
+
+/**
+ * Folds a set down to a lower precision, and records its
+ * new config in the manifest, as a restart would otherwise
+ * restore it at its old precision.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @arg precision The new precision
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if it could not be folded.
+ */
+int setmgr_fold_set(hlld_setmgr *mgr, char *set_name, unsigned char precision);
+
 /**
  * Clears the set from the internal data stores. This can only
  * be performed if the set is proxied.
@@ -120,6 +561,28 @@ int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name);
  */
 int setmgr_clear_set(hlld_setmgr *mgr, char *set_name);
 
+/**
+ * Moves a set into the archive, unmapping it first. It stays
+ * registered, and is restored from the archive by the next
+ * page in.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if it could not be archived.
+ */
+int setmgr_archive_set(hlld_setmgr *mgr, char *set_name);
+
+/**
+ * Compacts the files of the archive that are mostly
+ * dead records, of sets restored or dropped since
+ * they were archived.
+ * @arg mgr The manager
+ * @arg reclaimed Output, the bytes reclaimed
+ * @return The number of files compacted, or negative
+ * errno on failure.
+ */
+int setmgr_compact_archive(hlld_setmgr *mgr, uint64_t *reclaimed);
+
 /**
  * Allocates space for and returns a linked
  * list of all the sets. The memory should be free'd by
@@ -133,7 +596,8 @@ int setmgr_list_sets(hlld_setmgr *mgr, char *prefix, hlld_set_list_head **head);
 
 /**
  * Allocates space for and returns a linked
- * list of all the cold sets. This has the side effect
+ * list of all the cold sets, which were not written
+ * since the last call. This has the side effect
  * of clearing the list of cold sets! The memory should
  * be free'd by the caller.
  * @arg mgr The manager to list from
@@ -142,11 +606,132 @@ int setmgr_list_sets(hlld_setmgr *mgr, char *prefix, hlld_set_list_head **head);
  */
 int setmgr_list_cold_sets(hlld_setmgr *mgr, hlld_set_list_head **head);
 
+/**
+ * Allocates space for and returns a linked list of the
+ * sets to cool, which were not written since the last call,
+ * and were not cooled already. Like setmgr_list_cold_sets,
+ * but with a mark of its own.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int setmgr_list_cool_sets(hlld_setmgr *mgr, hlld_set_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of the
+ * sets to unmap so that the resident sets fit in a memory
+ * budget. The least recently written sets are listed first.
+ * In-memory sets count against the budget, but are never
+ * listed. Each call advances the clock used to order writes.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg max_bytes The budget for the resident sets, in bytes
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int setmgr_list_lru_sets(hlld_setmgr *mgr, uint64_t max_bytes, hlld_set_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of
+ * the sets accepted by a filter. Like setmgr_set_cb, the
+ * set is not locked, so the filter should only read metrics.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg filter Returns 1 to include a set
+ * @arg data Opaque pointer passed to the filter
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+typedef int(*set_filter)(void *in, char *set_name, hlld_set *set);
+int setmgr_list_filtered_sets(hlld_setmgr *mgr, set_filter filter, void *data, hlld_set_list_head **head);
+
 /**
  * Convenience method to cleanup a set list.
  */
 void setmgr_cleanup_list(hlld_set_list_head *head);
 
+/**
+ * Rewrites the manifest with the sets and their sizes as of
+ * their last flush, so a restart restores them without reading
+ * each set folder. Creates and drops are recorded as they happen,
+ * so this only needs to be invoked periodically.
+ * @arg mgr The manager
+ * @return 0 on success.
+ */
+int setmgr_checkpoint_manifest(hlld_setmgr *mgr);
+
+/**
+ * Follows the sets of a data directory owned by another
+ * server. The manifest it keeps decides which sets exist,
+ * so sets are added and closed to match it, and the sets
+ * whose files changed are closed to fault in the new ones.
+ * Only used by a read only server.
+ * @arg mgr The manager
+ * @return 0 on success, or a negative errno if the
+ * manifest could not be read.
+ */
+int setmgr_refresh(hlld_setmgr *mgr);
+
+/**
+ * Starts a new segment of the write-ahead log, and removes
+ * the segments that only hold raises the sets have flushed
+ * since. Invoked once per flush interval.
+ * @arg mgr The manager
+ * @return 0 on success, -1 if there is no write-ahead log.
+ */
+int setmgr_checkpoint_wal(hlld_setmgr *mgr);
+
+/**
+ * Syncs the segments of the slab, making the registers
+ * the sets flushed to their slots durable. Invoked after
+ * every round of flushes.
+ * @arg mgr The manager
+ * @return 0 on success, -1 if there is no slab or it
+ * failed to sync.
+ */
+int setmgr_sync_slab(hlld_setmgr *mgr);
+
+/**
+ * Reads how often set lookups were served by the
+ * per-thread caches. Counts are added in batches, so
+ * recent lookups may not be counted yet.
+ * @arg mgr The manager
+ * @arg hits Output, the lookups found in a cache
+ * @arg misses Output, the lookups that searched the set map
+ */
+void setmgr_lookup_stats(hlld_setmgr *mgr, uint64_t *hits, uint64_t *misses);
+
+/**
+ * Takes a snapshot of the stats of the sets in the set
+ * map, so they can be read without visiting the sets, as
+ * with setmgr_iter_set_stats. Sets created after are left
+ * for the next snapshot.
+ * @arg mgr The manager
+ * @return 0 on success.
+ */
+int setmgr_refresh_set_stats(hlld_setmgr *mgr);
+
+/**
+ * Invokes a callback with the stats of each set in the
+ * last snapshot. Blocks the next snapshot until done.
+ * @notes Thread safe, the caller need not be a client.
+ * @arg mgr The manager
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets in the snapshot.
+ */
+int setmgr_iter_set_stats(hlld_setmgr *mgr, set_stats_cb cb, void *data);
+
+/**
+ * Returns how many versions of the set map the vacuum thread
+ * has yet to reclaim. This grows while a client holds
+ * back the grace period.
+ * @notes Thread safe.
+ * @arg mgr The manager
+ * @return The number of versions
+ */
+uint64_t setmgr_vacuum_lag(hlld_setmgr *mgr);
+
 /**
  * This method allows a callback function to be invoked with hlld set.
  * The purpose of this is to ensure that a hlld set is not deleted or
@@ -159,8 +744,39 @@ typedef void(*set_cb)(void* in, char *set_name, hlld_set *set);
 int setmgr_set_cb(hlld_setmgr *mgr, char *set_name, set_cb cb, void* data);
 
 /**
- * This method is used to force a vacuum up to the current
- * version. It is generally unsafe to use in hlld,
+ * Invokes a callback with each set whose name starts with
+ * a prefix, in a single pass over the set map, without
+ * copying the names. Each set is held with its read lock
+ * during the callback, so it may estimate the size of the
+ * set, but must not write to it.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on or NULL
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return 0 on success.
+ */
+int setmgr_iter_sets(hlld_setmgr *mgr, char *prefix, set_cb cb, void *data);
+
+/**
+ * Invokes a callback with a page of the sets whose name
+ * starts with a prefix, in the order of their names, starting
+ * after a cursor. Only the part of the set map after the cursor
+ * is visited. Like setmgr_iter_sets, each set is held with its
+ * read lock during the callback.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on or NULL
+ * @arg after The name to start after, usually the last of
+ * the previous page, or NULL to start from the first
+ * @arg limit The most sets to visit, or 0 for all
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of sets visited.
+ */
+int setmgr_page_sets(hlld_setmgr *mgr, char *prefix, char *after, int limit, set_cb cb, void *data);
+
+/**
+ * This method is used to force a vacuum of every version.
+ * It is generally unsafe to use in hlld,
  * but can be used in an embeded or test environment.
  */
 void setmgr_vacuum(hlld_setmgr *mgr);
@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "art.h"
+#include "bitmap.h"
+#include "config.h"
+#include "iobatch.h"
+#include "slab.h"
+
+/*
+ * Each table entry holds a magic, the FNV-1a checksum of the
+ * rest of the entry, the length of the name, the first page of
+ * the slot, the length of the registers, then the name. Free
+ * entries are zeroed.
+ */
+#define SLAB_MAGIC 0x31424c53
+#define ENTRY_SIZE 256
+#define ENTRY_HEADER 24
+#define TABLE_SIZE ((uint64_t)SLAB_SLOTS * ENTRY_SIZE)
+#define SLAB_PAGES ((SLAB_SEGMENT_SIZE - TABLE_SIZE) / BITMAP_PAGE_SIZE)
+#define PAGE_OFFSET(page) (TABLE_SIZE + (uint64_t)(page) * BITMAP_PAGE_SIZE)
+#define PAGES_FOR(len) (((len) + BITMAP_PAGE_SIZE - 1) / BITMAP_PAGE_SIZE)
+
+#define BIT_SET(words, i) ((words)[(i) / 64] & (1ULL << ((i) % 64)))
+#define SET_BIT(words, i) ((words)[(i) / 64] |= (1ULL << ((i) % 64)))
+#define CLEAR_BIT(words, i) ((words)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+typedef struct {
+    int fd;
+    int used;                                       // Slots in use
+    uint64_t used_entries[SLAB_SLOTS / 64];         // Bit per table entry
+    uint64_t used_pages[(SLAB_PAGES + 63) / 64];    // Bit per page of slots
+} slab_segment;
+
+typedef struct {
+    int segment;
+    int entry;
+    uint32_t page;
+    uint64_t len;
+} slab_slot;
+
+struct hlld_slab {
+    char *data_dir;
+    pthread_mutex_t lock;
+    art_tree slots;             // Set name to its slab_slot
+    slab_segment **segments;
+    int num_segments;
+    int preallocate;            // Allocate the blocks of new segments
+};
+
+static inline void store_le32(unsigned char *out, uint32_t val) {
+    for (int i=0; i < 4; i++) out[i] = val >> (8 * i);
+}
+
+static inline void store_le64(unsigned char *out, uint64_t val) {
+    for (int i=0; i < 8; i++) out[i] = val >> (8 * i);
+}
+
+static inline uint32_t load_le32(const unsigned char *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static inline uint64_t load_le64(const unsigned char *in) {
+    return load_le32(in) | ((uint64_t)load_le32(in + 4) << 32);
+}
+
+static uint32_t entry_checksum(const unsigned char *entry) {
+    uint32_t hash = 2166136261U;
+    for (int i=8; i < ENTRY_SIZE; i++) {
+        hash = (hash ^ entry[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Returns the path of a segment, which must be freed
+ */
+static char* segment_path(hlld_slab *slab, int num) {
+    char name[32];
+    snprintf(name, sizeof(name), "slab.%d.data", num);
+    return join_path(slab->data_dir, name);
+}
+
+/**
+ * Marks the pages of a slot as used or free
+ */
+static void mark_pages(slab_segment *seg, uint32_t page, uint64_t len, int used) {
+    for (uint64_t i=page; i < page + PAGES_FOR(len); i++) {
+        if (used) SET_BIT(seg->used_pages, i);
+        else CLEAR_BIT(seg->used_pages, i);
+    }
+}
+
+/**
+ * Checks that the pages of a slot are all free
+ */
+static int pages_free(slab_segment *seg, uint32_t page, uint64_t len) {
+    for (uint64_t i=page; i < page + PAGES_FOR(len); i++) {
+        if (BIT_SET(seg->used_pages, i)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Writes a table entry, along with any zeroed registers,
+ * then syncs the segment
+ */
+static int write_entry(slab_segment *seg, int entry, const unsigned char *buf,
+        unsigned char *zeros, uint32_t page, uint64_t len) {
+    iobatch_range ranges[2] = {
+        {(unsigned char*)buf, ENTRY_SIZE, (uint64_t)entry * ENTRY_SIZE},
+        {zeros, len, PAGE_OFFSET(page)}
+    };
+    return iobatch_write(seg->fd, ranges, (zeros) ? 2 : 1, 1, NULL);
+}
+
+/**
+ * Clears the table entry of a slot, and frees its pages
+ */
+static int free_slot(hlld_slab *slab, slab_slot *slot) {
+    slab_segment *seg = slab->segments[slot->segment];
+    unsigned char entry[ENTRY_SIZE];
+    memset(entry, 0, ENTRY_SIZE);
+    int res = write_entry(seg, slot->entry, entry, NULL, 0, 0);
+    if (res) {
+        syslog(LOG_ERR, "Failed to free a slab slot. Err: %d", res);
+        return res;
+    }
+    CLEAR_BIT(seg->used_entries, slot->entry);
+    mark_pages(seg, slot->page, slot->len, 0);
+    seg->used--;
+    return 0;
+}
+
+/**
+ * Reads the table of a segment into the slab. Invalid entries
+ * and entries of names seen before are ignored.
+ */
+static int load_segment(hlld_slab *slab, int num, int fd) {
+    slab_segment *seg = calloc(1, sizeof(slab_segment));
+    unsigned char *table = malloc(TABLE_SIZE);
+    if (!seg || !table) {
+        free(seg);
+        free(table);
+        return -ENOMEM;
+    }
+    seg->fd = fd;
+
+    int64_t read = iobatch_read_at(fd, table, TABLE_SIZE, 0, NULL);
+    if (read < 0) {
+        free(seg);
+        free(table);
+        return read;
+    }
+    for (int i=0; i < SLAB_SLOTS && (uint64_t)(i + 1) * ENTRY_SIZE <= (uint64_t)read; i++) {
+        unsigned char *entry = table + (uint64_t)i * ENTRY_SIZE;
+        uint32_t name_len = load_le32(entry + 8);
+        uint32_t page = load_le32(entry + 12);
+        uint64_t len = load_le64(entry + 16);
+        if (load_le32(entry) != SLAB_MAGIC || load_le32(entry + 4) != entry_checksum(entry) ||
+                !name_len || name_len > SLAB_MAX_NAME || entry[ENTRY_HEADER + name_len] ||
+                !len || page + PAGES_FOR(len) > SLAB_PAGES || !pages_free(seg, page, len))
+            continue;
+
+        char *name = (char*)entry + ENTRY_HEADER;
+        if (art_search(&slab->slots, (unsigned char*)name, name_len + 1)) {
+            syslog(LOG_WARNING, "Ignoring a second slab slot of set '%s'.", name);
+            continue;
+        }
+        slab_slot *slot = malloc(sizeof(slab_slot));
+        if (!slot) break;
+        slot->segment = num;
+        slot->entry = i;
+        slot->page = page;
+        slot->len = len;
+        art_insert(&slab->slots, (unsigned char*)name, name_len + 1, slot);
+        SET_BIT(seg->used_entries, i);
+        mark_pages(seg, page, len, 1);
+        seg->used++;
+    }
+    free(table);
+    slab->segments[num] = seg;
+    slab->num_segments = num + 1;
+    return 0;
+}
+
+/**
+ * Opens a segment, creating it if needed. New segments
+ * are sparse, so unused slots take no space, unless the
+ * slab preallocates them.
+ */
+static int open_segment(hlld_slab *slab, int num, int create) {
+    char *path = segment_path(slab, num);
+    int fd = open(path, O_RDWR | ((create) ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        int res = -errno;
+        if (res != -ENOENT || create)
+            syslog(LOG_ERR, "Failed to open slab segment '%s'. %s", path, strerror(errno));
+        free(path);
+        return res;
+    }
+    free(path);
+
+    // A preallocated segment keeps its slots contiguous, on the
+    // file systems that support it, the others get a sparse one
+    int res = 0;
+    if (create && slab->preallocate) {
+        res = posix_fallocate(fd, 0, SLAB_SEGMENT_SIZE);
+        if (res == EOPNOTSUPP || res == EINVAL) res = ftruncate(fd, SLAB_SEGMENT_SIZE) ? errno : 0;
+    } else if (create) {
+        res = ftruncate(fd, SLAB_SEGMENT_SIZE) ? errno : 0;
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to size a slab segment. %s", strerror(res));
+        close(fd);
+        return -res;
+    }
+
+    slab_segment **segments = realloc(slab->segments, (num + 1) * sizeof(slab_segment*));
+    if (!segments) {
+        close(fd);
+        return -ENOMEM;
+    }
+    slab->segments = segments;
+    res = load_segment(slab, num, fd);
+    if (res) {
+        syslog(LOG_ERR, "Failed to read slab segment %d. Err: %d", num, res);
+        close(fd);
+    }
+    return res;
+}
+
+/**
+ * Opens the segments of a data directory, and
+ * reads their tables. No segment is created until
+ * a slot is allocated.
+ * @arg data_dir The data directory
+ * @arg preallocate If 1, the blocks of new segments are allocated up front
+ * @arg slab Output, the slab
+ * @return 0 on success, negative errno on failure.
+ */
+int init_slab(char *data_dir, int preallocate, hlld_slab **slab) {
+    hlld_slab *s = calloc(1, sizeof(hlld_slab));
+    if (!s) return -ENOMEM;
+    s->data_dir = strdup(data_dir);
+    s->preallocate = preallocate;
+    pthread_mutex_init(&s->lock, NULL);
+    init_art_tree(&s->slots);
+
+    // Segments are numbered from zero, without gaps
+    int res;
+    for (int num=0; !(res = open_segment(s, num, 0)); num++);
+    if (res != -ENOENT) {
+        destroy_slab(s);
+        return res;
+    }
+    *slab = s;
+    return 0;
+}
+
+static int free_slot_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    free(value);
+    return 0;
+}
+
+/**
+ * Closes the segments. The bitmaps of the slots
+ * keep their own file descriptors.
+ * @arg slab The slab, may be NULL
+ */
+void destroy_slab(hlld_slab *slab) {
+    if (!slab) return;
+    art_iter(&slab->slots, free_slot_cb, NULL);
+    destroy_art_tree(&slab->slots);
+    for (int i=0; i < slab->num_segments; i++) {
+        close(slab->segments[i]->fd);
+        free(slab->segments[i]);
+    }
+    free(slab->segments);
+    pthread_mutex_destroy(&slab->lock);
+    free(slab->data_dir);
+    free(slab);
+}
+
+/**
+ * Finds the slot of a set. A slot of another length is
+ * left from registers of another precision, and is freed.
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @arg len The length of the registers
+ * @arg fd Output, the segment file, owned by the slab
+ * @arg offset Output, the offset of the slot in the segment
+ * @return 0 on success, -ENOENT if the set has no slot.
+ */
+int slab_find(hlld_slab *slab, char *set_name, uint64_t len, int *fd, uint64_t *offset) {
+    int res = -ENOENT;
+    int key_len = strlen(set_name) + 1;
+    pthread_mutex_lock(&slab->lock);
+    slab_slot *slot = art_search(&slab->slots, (unsigned char*)set_name, key_len);
+    if (slot && slot->len != len) {
+        syslog(LOG_WARNING, "Freeing the slab slot of set '%s' of %llu bytes.",
+                set_name, (unsigned long long)slot->len);
+        if (!free_slot(slab, slot)) {
+            art_delete(&slab->slots, (unsigned char*)set_name, key_len);
+            free(slot);
+        }
+    } else if (slot) {
+        *fd = slab->segments[slot->segment]->fd;
+        *offset = PAGE_OFFSET(slot->page);
+        res = 0;
+    }
+    pthread_mutex_unlock(&slab->lock);
+    return res;
+}
+
+/**
+ * Finds the first segment with a free entry and a free run of
+ * pages for a slot, and the run within it
+ * @return 0 on success, -1 if every segment is full.
+ */
+static int find_space(hlld_slab *slab, uint64_t len, int *segment, int *entry, uint32_t *page) {
+    uint64_t pages = PAGES_FOR(len);
+    for (int s=0; s < slab->num_segments; s++) {
+        slab_segment *seg = slab->segments[s];
+        if (seg->used == SLAB_SLOTS) continue;
+
+        uint64_t run = 0;
+        for (uint64_t p=0; p < SLAB_PAGES; p++) {
+            // Skip over full words of used pages
+            if (!(p % 64) && seg->used_pages[p / 64] == ~0ULL) {
+                run = 0;
+                p += 63;
+                continue;
+            }
+            run = BIT_SET(seg->used_pages, p) ? 0 : run + 1;
+            if (run < pages) continue;
+
+            int e = 0;
+            while (BIT_SET(seg->used_entries, e)) e++;
+            *segment = s;
+            *entry = e;
+            *page = p + 1 - pages;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocates a zeroed slot for a set, replacing any slot it
+ * has. The slot is durable once this returns.
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @arg len The length of the registers
+ * @arg fd Output, the segment file, owned by the slab
+ * @arg offset Output, the offset of the slot in the segment
+ * @return 0 on success, -ENAMETOOLONG or -EFBIG if the set
+ * needs a file of its own, or negative errno on failure.
+ */
+int slab_alloc(hlld_slab *slab, char *set_name, uint64_t len, int *fd, uint64_t *offset) {
+    uint32_t name_len = strlen(set_name);
+    if (name_len > SLAB_MAX_NAME) return -ENAMETOOLONG;
+    if (!len || PAGES_FOR(len) > SLAB_PAGES) return -EFBIG;
+    unsigned char *zeros = calloc(1, len);
+    if (!zeros) return -ENOMEM;
+
+    int res = 0;
+    pthread_mutex_lock(&slab->lock);
+    slab_slot *slot = art_search(&slab->slots, (unsigned char*)set_name, name_len + 1);
+    if (slot && slot->len == len) {
+        // Reuse the slot, clearing the registers left in it
+        slab_segment *seg = slab->segments[slot->segment];
+        iobatch_range range = {zeros, len, PAGE_OFFSET(slot->page)};
+        res = iobatch_write(seg->fd, &range, 1, 1, NULL);
+        goto FOUND;
+    } else if (slot) {
+        if ((res = free_slot(slab, slot))) goto LEAVE;
+        art_delete(&slab->slots, (unsigned char*)set_name, name_len + 1);
+        free(slot);
+    }
+
+    int segment, entry;
+    uint32_t page;
+    if (find_space(slab, len, &segment, &entry, &page)) {
+        segment = slab->num_segments;
+        if ((res = open_segment(slab, segment, 1))) goto LEAVE;
+        entry = 0;
+        page = 0;
+    }
+
+    unsigned char buf[ENTRY_SIZE];
+    memset(buf, 0, ENTRY_SIZE);
+    store_le32(buf, SLAB_MAGIC);
+    store_le32(buf + 8, name_len);
+    store_le32(buf + 12, page);
+    store_le64(buf + 16, len);
+    memcpy(buf + ENTRY_HEADER, set_name, name_len);
+    store_le32(buf + 4, entry_checksum(buf));
+
+    slab_segment *seg = slab->segments[segment];
+    if ((res = write_entry(seg, entry, buf, zeros, page, len))) {
+        syslog(LOG_ERR, "Failed to allocate a slab slot for set '%s'. Err: %d", set_name, res);
+        goto LEAVE;
+    }
+    slot = malloc(sizeof(slab_slot));
+    slot->segment = segment;
+    slot->entry = entry;
+    slot->page = page;
+    slot->len = len;
+    art_insert(&slab->slots, (unsigned char*)set_name, name_len + 1, slot);
+    SET_BIT(seg->used_entries, entry);
+    mark_pages(seg, page, len, 1);
+    seg->used++;
+
+FOUND:
+    if (!res) {
+        *fd = slab->segments[slot->segment]->fd;
+        *offset = PAGE_OFFSET(slot->page);
+    }
+LEAVE:
+    pthread_mutex_unlock(&slab->lock);
+    free(zeros);
+    return res;
+}
+
+/**
+ * Frees the slot of a set, if it has one
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @return 0 on success, -ENOENT if the set has no slot.
+ */
+int slab_free(hlld_slab *slab, char *set_name) {
+    int key_len = strlen(set_name) + 1;
+    pthread_mutex_lock(&slab->lock);
+    slab_slot *slot = art_search(&slab->slots, (unsigned char*)set_name, key_len);
+    int res = (slot) ? free_slot(slab, slot) : -ENOENT;
+    if (!res) {
+        art_delete(&slab->slots, (unsigned char*)set_name, key_len);
+        free(slot);
+    }
+    pthread_mutex_unlock(&slab->lock);
+    return res;
+}
+
+/**
+ * Syncs every segment, making the registers
+ * flushed to their slots durable
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @return 0 on success, negative errno on failure.
+ */
+int slab_sync(hlld_slab *slab) {
+    int res = 0;
+    pthread_mutex_lock(&slab->lock);
+    int num = slab->num_segments;
+    int fds[num ? num : 1];
+    for (int i=0; i < num; i++) fds[i] = slab->segments[i]->fd;
+    pthread_mutex_unlock(&slab->lock);
+
+    // Segments are never closed while the slab is open, so
+    // they are synced without the lock, letting slots be
+    // found and allocated meanwhile
+    for (int i=0; i < num; i++) {
+        if (fsync(fds[i]) == -1) {
+            syslog(LOG_ERR, "Failed to sync slab segment %d. %s", i, strerror(errno));
+            res = -errno;
+        }
+    }
+    return res;
+}
+
+/**
+ * Returns the number of slots in use
+ * @notes Thread safe.
+ * @arg slab The slab
+ */
+uint64_t slab_slots(hlld_slab *slab) {
+    pthread_mutex_lock(&slab->lock);
+    uint64_t slots = art_size(&slab->slots);
+    pthread_mutex_unlock(&slab->lock);
+    return slots;
+}
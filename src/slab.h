@@ -0,0 +1,104 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stdint.h>
+
+/*
+ * The slab packs the dense register files of many sets into
+ * a few large segment files, "slab.<n>.data" in the data
+ * directory, instead of a file per set. Each segment starts
+ * with a table of its slots, naming the set, the offset and
+ * the length of each, followed by the slots in whole pages.
+ * Slots are allocated first fit from a map of the free pages
+ * of each segment, which is rebuilt from the tables on start.
+ *
+ * The registers are written to their slots without a sync, so
+ * a round of flushes only syncs each segment once.
+ */
+typedef struct hlld_slab hlld_slab;
+
+/**
+ * The bytes of each segment
+ */
+#define SLAB_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/**
+ * The slots of each segment
+ */
+#define SLAB_SLOTS 4096
+
+/**
+ * The longest set name that has a slot
+ */
+#define SLAB_MAX_NAME 232
+
+/**
+ * Opens the segments of a data directory, and
+ * reads their tables. No segment is created until
+ * a slot is allocated.
+ * @arg data_dir The data directory
+ * @arg preallocate If 1, the blocks of new segments are allocated up front
+ * @arg slab Output, the slab
+ * @return 0 on success, negative errno on failure.
+ */
+int init_slab(char *data_dir, int preallocate, hlld_slab **slab);
+
+/**
+ * Closes the segments. The bitmaps of the slots
+ * keep their own file descriptors.
+ * @arg slab The slab, may be NULL
+ */
+void destroy_slab(hlld_slab *slab);
+
+/**
+ * Finds the slot of a set. A slot of another length is
+ * left from registers of another precision, and is freed.
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @arg len The length of the registers
+ * @arg fd Output, the segment file, owned by the slab
+ * @arg offset Output, the offset of the slot in the segment
+ * @return 0 on success, -ENOENT if the set has no slot.
+ */
+int slab_find(hlld_slab *slab, char *set_name, uint64_t len, int *fd, uint64_t *offset);
+
+/**
+ * Allocates a zeroed slot for a set, replacing any slot it
+ * has. The slot is durable once this returns.
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @arg len The length of the registers
+ * @arg fd Output, the segment file, owned by the slab
+ * @arg offset Output, the offset of the slot in the segment
+ * @return 0 on success, -ENAMETOOLONG or -EFBIG if the set
+ * needs a file of its own, or negative errno on failure.
+ */
+int slab_alloc(hlld_slab *slab, char *set_name, uint64_t len, int *fd, uint64_t *offset);
+
+/**
+ * Frees the slot of a set, if it has one
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @arg set_name The name of the set
+ * @return 0 on success, -ENOENT if the set has no slot.
+ */
+int slab_free(hlld_slab *slab, char *set_name);
+
+/**
+ * Syncs every segment, making the registers
+ * flushed to their slots durable
+ * @notes Thread safe.
+ * @arg slab The slab
+ * @return 0 on success, negative errno on failure.
+ */
+int slab_sync(hlld_slab *slab);
+
+/**
+ * Returns the number of slots in use
+ * @notes Thread safe.
+ * @arg slab The slab
+ */
+uint64_t slab_slots(hlld_slab *slab);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "slowlog.h"
+#include "spinlock.h"
+
+struct hlld_slowlog {
+    uint64_t threshold;     // In nanoseconds, 0 if disabled
+    int max_len;
+    hlld_spinlock lock;     // Guards the ring
+    uint64_t next_id;       // Of the next entry
+    int start;              // Index of the oldest entry
+    int len;                // Number of entries
+    slowlog_entry *ring;
+};
+
+int SLOWLOG_TIMED = 0;
+__thread uint64_t SLOWLOG_PHASE_NANOS[NUM_SLOWLOG_PHASES];
+
+/**
+ * Initializes a slow log
+ * @arg threshold_nanos Commands at least this slow are kept,
+ * or 0 to keep none.
+ * @arg max_len The most entries kept
+ * @arg log Output, the slow log
+ * @return 0 on success.
+ */
+int init_slowlog(uint64_t threshold_nanos, int max_len, hlld_slowlog **log) {
+    hlld_slowlog *l = calloc(1, sizeof(hlld_slowlog));
+    if (!l) return -1;
+    l->ring = calloc(max_len, sizeof(slowlog_entry));
+    if (!l->ring) {
+        syslog(LOG_ERR, "Failed to allocate the slow log!");
+        free(l);
+        return -1;
+    }
+    l->threshold = threshold_nanos;
+    l->max_len = max_len;
+    INIT_HLLD_SPIN(&l->lock);
+    if (threshold_nanos) SLOWLOG_TIMED = 1;
+    *log = l;
+    return 0;
+}
+
+/**
+ * Destroys a slow log
+ * @arg log The slow log
+ * @return 0 on success.
+ */
+int destroy_slowlog(hlld_slowlog *log) {
+    free(log->ring);
+    free(log);
+    return 0;
+}
+
+/**
+ * Returns the threshold of a slow log
+ * @arg log The slow log
+ * @return The threshold in nanoseconds, or 0 if disabled.
+ */
+uint64_t slowlog_threshold(hlld_slowlog *log) {
+    return log->threshold;
+}
+
+/**
+ * Adds a slow command to the log, replacing the oldest
+ * entry if full. The set name and key count are parsed
+ * from the arguments, whose tokens may be separated by
+ * spaces or nulls.
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg cmd The command type
+ * @arg args The arguments, or NULL
+ * @arg args_len The length of the arguments
+ * @arg nanos The time spent on the command
+ */
+void slowlog_add(hlld_slowlog *log, int cmd, char *args, int args_len, uint64_t nanos) {
+    int name_len, keys;
+    metrics_parse_args(args, args_len, &name_len, &keys);
+    slowlog_add_entry(log, cmd, args, name_len, keys, nanos);
+}
+
+/**
+ * Adds a slow command with a known set name and key
+ * count to the log, as slowlog_add.
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg cmd The command type
+ * @arg set_name The set name, which need not be terminated
+ * @arg name_len The length of the set name
+ * @arg keys The number of keys
+ * @arg nanos The time spent on the command
+ */
+void slowlog_add_entry(hlld_slowlog *log, int cmd, const char *set_name,
+        int name_len, int keys, uint64_t nanos) {
+    if (name_len > SLOWLOG_NAME_LEN) name_len = SLOWLOG_NAME_LEN;
+
+    LOCK_HLLD_SPIN(&log->lock);
+    int idx = (log->start + log->len) % log->max_len;
+    if (log->len == log->max_len)
+        log->start = (log->start + 1) % log->max_len;
+    else
+        log->len++;
+
+    slowlog_entry *e = log->ring + idx;
+    e->id = log->next_id++;
+    e->time = time(NULL);
+    e->nanos = nanos;
+    e->cmd = cmd;
+    e->keys = keys;
+    memcpy(e->phases, SLOWLOG_PHASE_NANOS, sizeof(e->phases));
+    if (name_len) memcpy(e->set_name, set_name, name_len);
+    e->set_name[name_len] = '\0';
+    UNLOCK_HLLD_SPIN(&log->lock);
+}
+
+/**
+ * Copies the entries of the log, newest first
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg out Output, the entries. Must be freed by the caller.
+ * @return The number of entries, or -1 on error.
+ */
+int slowlog_entries(hlld_slowlog *log, slowlog_entry **out) {
+    slowlog_entry *entries = malloc(log->max_len * sizeof(slowlog_entry));
+    if (!entries) return -1;
+
+    LOCK_HLLD_SPIN(&log->lock);
+    int len = log->len;
+    for (int i=0; i < len; i++) {
+        int idx = (log->start + len - 1 - i) % log->max_len;
+        entries[i] = log->ring[idx];
+    }
+    UNLOCK_HLLD_SPIN(&log->lock);
+    *out = entries;
+    return len;
+}
+
+/**
+ * Removes all the entries of the log
+ * @notes Thread safe.
+ * @arg log The slow log
+ */
+void slowlog_reset(hlld_slowlog *log) {
+    LOCK_HLLD_SPIN(&log->lock);
+    log->start = 0;
+    log->len = 0;
+    UNLOCK_HLLD_SPIN(&log->lock);
+}
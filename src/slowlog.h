@@ -0,0 +1,142 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+#include <stdint.h>
+#include <time.h>
+#include "metrics.h"
+
+/*
+ * The slow log keeps the last commands that took longer than
+ * a threshold, in a ring. For each, the time spent in a few
+ * phases is kept, so that page ins and lock waits can be
+ * told apart from the command itself.
+ *
+ * Phases are timed into thread local counters, which the
+ * handlers reset before each command. Timing is skipped
+ * unless a slow log is enabled, so the hot paths only pay
+ * for a check of a global.
+ */
+typedef enum {
+    PHASE_LOOKUP = 0,   // Finding the sets by name
+    PHASE_FAULT,        // Paging in the sets
+    PHASE_LOCK,         // Waiting on the locks of the sets
+    NUM_SLOWLOG_PHASES
+} slowlog_phase;
+
+/**
+ * Longer set names are truncated in the log
+ */
+#define SLOWLOG_NAME_LEN 200
+
+typedef struct {
+    uint64_t id;        // Increases with each slow command
+    time_t time;        // When the command finished
+    uint64_t nanos;     // Time spent on the command
+    int cmd;            // The command type
+    int keys;           // Number of keys, or 0 if none
+    uint64_t phases[NUM_SLOWLOG_PHASES];
+    char set_name[SLOWLOG_NAME_LEN + 1];
+} slowlog_entry;
+
+typedef struct hlld_slowlog hlld_slowlog;
+
+// Set while any slow log is enabled
+extern int SLOWLOG_TIMED;
+
+// The phase times of the current command of each thread
+extern __thread uint64_t SLOWLOG_PHASE_NANOS[NUM_SLOWLOG_PHASES];
+
+/**
+ * Initializes a slow log
+ * @arg threshold_nanos Commands at least this slow are kept,
+ * or 0 to keep none.
+ * @arg max_len The most entries kept
+ * @arg log Output, the slow log
+ * @return 0 on success.
+ */
+int init_slowlog(uint64_t threshold_nanos, int max_len, hlld_slowlog **log);
+
+/**
+ * Destroys a slow log
+ * @arg log The slow log
+ * @return 0 on success.
+ */
+int destroy_slowlog(hlld_slowlog *log);
+
+/**
+ * Returns the threshold of a slow log
+ * @arg log The slow log
+ * @return The threshold in nanoseconds, or 0 if disabled.
+ */
+uint64_t slowlog_threshold(hlld_slowlog *log);
+
+/**
+ * Adds a slow command to the log, replacing the oldest
+ * entry if full. The set name and key count are parsed
+ * from the arguments, whose tokens may be separated by
+ * spaces or nulls.
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg cmd The command type
+ * @arg args The arguments, or NULL
+ * @arg args_len The length of the arguments
+ * @arg nanos The time spent on the command
+ */
+void slowlog_add(hlld_slowlog *log, int cmd, char *args, int args_len, uint64_t nanos);
+
+/**
+ * Adds a slow command with a known set name and key
+ * count to the log, as slowlog_add.
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg cmd The command type
+ * @arg set_name The set name, which need not be terminated
+ * @arg name_len The length of the set name
+ * @arg keys The number of keys
+ * @arg nanos The time spent on the command
+ */
+void slowlog_add_entry(hlld_slowlog *log, int cmd, const char *set_name,
+        int name_len, int keys, uint64_t nanos);
+
+/**
+ * Copies the entries of the log, newest first
+ * @notes Thread safe.
+ * @arg log The slow log
+ * @arg out Output, the entries. Must be freed by the caller.
+ * @return The number of entries, or -1 on error.
+ */
+int slowlog_entries(hlld_slowlog *log, slowlog_entry **out);
+
+/**
+ * Removes all the entries of the log
+ * @notes Thread safe.
+ * @arg log The slow log
+ */
+void slowlog_reset(hlld_slowlog *log);
+
+/**
+ * Starts timing a phase
+ * @return The start time, or 0 if phases are not timed
+ */
+static inline uint64_t slowlog_phase_start(void) {
+    return (SLOWLOG_TIMED) ? metrics_now() : 0;
+}
+
+/**
+ * Adds the time since a start to a phase of the
+ * current command of this thread
+ * @arg phase The phase
+ * @arg start The start time, from slowlog_phase_start
+ */
+static inline void slowlog_phase_end(slowlog_phase phase, uint64_t start) {
+    if (start) SLOWLOG_PHASE_NANOS[phase] += metrics_now() - start;
+}
+
+/**
+ * Resets the phase times, for a new command on this thread
+ */
+static inline void slowlog_phases_reset(void) {
+    if (!SLOWLOG_TIMED) return;
+    for (int i=0; i < NUM_SLOWLOG_PHASES; i++) SLOWLOG_PHASE_NANOS[i] = 0;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include <sched.h>
+#include "spinlock.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/**
+ * Rounds of spinning before a waiter parks. Each round
+ * pauses twice as long as the last, up to SPIN_MAX_PAUSES.
+ */
+#define SPIN_ROUNDS 16
+#define SPIN_MAX_PAUSES 128
+
+/**
+ * The round from which a waiter yields its timeslice
+ * rather than pausing, for a holder that was descheduled
+ */
+#define SPIN_YIELD_ROUND 12
+
+static volatile uint64_t CONTENDED = 0;
+static volatile uint64_t YIELDS = 0;
+static volatile uint64_t PARKS = 0;
+
+/**
+ * Reads the contention counters of the locks. They are
+ * only counted by the adaptive lock, and 0 otherwise.
+ * @notes Thread safe.
+ * @arg counters Output, the counters
+ */
+void spinlock_stats(spinlock_counters *counters) {
+    counters->contended = CONTENDED;
+    counters->yields = YIELDS;
+    counters->parks = PARKS;
+}
+
+#if defined(__linux__) && !defined(__MACH__)
+
+// Tells the core we are spinning, easing off the lock's line
+static inline void cpu_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    __sync_synchronize();
+#endif
+}
+
+/**
+ * Acquires a lock that was found held
+ * @arg spin The lock
+ */
+void hlld_spin_lock_slow(hlld_spinlock *spin) {
+    __sync_fetch_and_add(&CONTENDED, 1);
+    int pauses = 1;
+    for (int round=0; round < SPIN_ROUNDS; round++) {
+        if (round >= SPIN_YIELD_ROUND) {
+            __sync_fetch_and_add(&YIELDS, 1);
+            sched_yield();
+        } else {
+            for (int i=0; i < pauses; i++) cpu_pause();
+            if (pauses < SPIN_MAX_PAUSES) pauses *= 2;
+        }
+        if (!spin->state && __sync_bool_compare_and_swap(&spin->state, 0, 1)) return;
+    }
+
+    // Take the lock as having waiters, since others may be
+    // parked, and park until the holder wakes us
+    while (__sync_lock_test_and_set(&spin->state, 2) != 0) {
+        __sync_fetch_and_add(&PARKS, 1);
+        syscall(SYS_futex, &spin->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Releases a lock that had waiters, waking one of them
+ * @arg spin The lock
+ */
+void hlld_spin_unlock_slow(hlld_spinlock *spin) {
+    __sync_lock_release(&spin->state);
+    syscall(SYS_futex, &spin->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#endif
@@ -1,9 +1,27 @@
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
 
 #ifndef SPINLOCK_H
 #define SPINLOCK_H
 
+/**
+ * Counts how the locks were waited on, over all the locks
+ */
+typedef struct {
+    uint64_t contended;     // Acquires that found the lock held
+    uint64_t yields;        // Timeslices yielded while spinning
+    uint64_t parks;         // Waits parked on the futex
+} spinlock_counters;
+
+/**
+ * Reads the contention counters of the locks. They are
+ * only counted by the adaptive lock, and 0 otherwise.
+ * @notes Thread safe.
+ * @arg counters Output, the counters
+ */
+void spinlock_stats(spinlock_counters *counters);
+
 #ifdef __MACH__
 // On OSX use OSAtomic
 #include <libkern/OSAtomic.h>
@@ -12,6 +30,38 @@ typedef OSSpinLock hlld_spinlock;
 #define LOCK_HLLD_SPIN(spin) { OSSpinLockLock(spin); }
 #define UNLOCK_HLLD_SPIN(spin) { OSSpinLockUnlock(spin); }
 
+#elif defined(__linux__)
+/*
+ * On Linux, use an adaptive lock. Holders are quick, so a waiter
+ * first spins, pausing longer each round, and yields its timeslice
+ * for the last rounds so that a holder that was descheduled gets
+ * to run. It then parks on a futex until the holder wakes it.
+ * The state is 0 when free, 1 when held, and 2 when held and
+ * there may be parked waiters. Only contended locks leave the
+ * inlined compare and swap.
+ */
+typedef struct {
+    volatile int state;
+} hlld_spinlock;
+
+/**
+ * Acquires a lock that was found held
+ * @arg spin The lock
+ */
+void hlld_spin_lock_slow(hlld_spinlock *spin);
+
+/**
+ * Releases a lock that had waiters, waking one of them
+ * @arg spin The lock
+ */
+void hlld_spin_unlock_slow(hlld_spinlock *spin);
+
+#define INIT_HLLD_SPIN(spin) { (spin)->state = 0; }
+#define LOCK_HLLD_SPIN(spin) { \
+    if (!__sync_bool_compare_and_swap(&(spin)->state, 0, 1)) hlld_spin_lock_slow(spin); }
+#define UNLOCK_HLLD_SPIN(spin) { \
+    if (__sync_fetch_and_sub(&(spin)->state, 1) != 1) hlld_spin_unlock_slow(spin); }
+
 #else
 #ifdef _POSIX_SPIN_LOCKS
 // On most POSIX systems, use pthreads spin locks
@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Static tracepoints for tools such as bpftrace and perf. They
+ * are compiled out unless built with HLLD_TRACE, which `scons
+ * trace=1` sets, and then cost a nop each until a tracer attaches.
+ * The provider is hlld, so a probe is found as, for example:
+ *
+ *   bpftrace -e 'usdt:./hlld:hlld:set_fault_begin { ... }'
+ *
+ * Arguments should be cheap to compute, since they are
+ * evaluated whether or not a tracer is attached.
+ */
+#ifdef HLLD_TRACE
+#include <sys/sdt.h>
+#define TRACE0(name) DTRACE_PROBE(hlld, name)
+#define TRACE1(name, a) DTRACE_PROBE1(hlld, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(hlld, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(hlld, name, a, b, c)
+#else
+#define TRACE0(name) do {} while (0)
+#define TRACE1(name, a) do {} while (0)
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
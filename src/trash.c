@@ -0,0 +1,105 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "trash.h"
+
+static volatile unsigned long long TRASH_SEQ = 0;
+
+static int is_special(const char *name);
+
+/**
+ * Moves a folder into the trash of a data directory
+ * @arg data_dir The data directory
+ * @arg path The folder to move, in the data directory
+ * @return 0 on success, negative errno on failure.
+ */
+int trash_move(char *data_dir, char *path) {
+    char *trash = join_path(data_dir, (char*)TRASH_FOLDER);
+    if (mkdir(trash, 0755) && errno != EEXIST) {
+        int err = errno;
+        free(trash);
+        return -err;
+    }
+
+    // The names in the trash only need to be unique
+    char *name;
+    int res = asprintf(&name, "%lld.%lld.%llu", (long long)time(NULL), (long long)getpid(),
+            __sync_add_and_fetch(&TRASH_SEQ, 1));
+    if (res == -1) {
+        free(trash);
+        return -ENOMEM;
+    }
+    char *dest = join_path(trash, name);
+    res = rename(path, dest) ? -errno : 0;
+    free(name);
+    free(dest);
+    free(trash);
+    return res;
+}
+
+/**
+ * Unlinks the files of the trash, removing each
+ * folder once it is empty
+ * @arg data_dir The data directory
+ * @arg max_unlinks The most files and folders to remove
+ * @return The number removed, which is max_unlinks if
+ * there may be more left.
+ */
+int trash_empty(char *data_dir, int max_unlinks) {
+    char *trash = join_path(data_dir, (char*)TRASH_FOLDER);
+    DIR *dir = opendir(trash);
+    if (!dir) {
+        free(trash);
+        return 0;
+    }
+
+    int removed = 0;
+    struct dirent *folder;
+    while (removed < max_unlinks && (folder = readdir(dir))) {
+        if (is_special(folder->d_name)) continue;
+        char *folder_path = join_path(trash, folder->d_name);
+        DIR *files = opendir(folder_path);
+        if (!files) {
+            if (unlink(folder_path))
+                syslog(LOG_ERR, "Failed to delete: %s. %s", folder_path, strerror(errno));
+            removed++;
+            free(folder_path);
+            continue;
+        }
+        struct dirent *file;
+        while (removed < max_unlinks && (file = readdir(files))) {
+            if (is_special(file->d_name)) continue;
+            char *file_path = join_path(folder_path, file->d_name);
+            if (unlink(file_path))
+                syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
+            removed++;
+            free(file_path);
+        }
+        closedir(files);
+
+        // Remove the folder once it is empty
+        if (removed < max_unlinks) {
+            if (rmdir(folder_path))
+                syslog(LOG_ERR, "Failed to delete: %s. %s", folder_path, strerror(errno));
+            removed++;
+        }
+        free(folder_path);
+    }
+    closedir(dir);
+    free(trash);
+    return removed;
+}
+
+/**
+ * Checks for the . and .. entries of a folder
+ */
+static int is_special(const char *name) {
+    return !strcmp(name, ".") || !strcmp(name, "..");
+}
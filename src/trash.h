@@ -0,0 +1,35 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+/*
+ * The folders of dropped sets are renamed into the trash folder
+ * of the data directory, which is a single atomic step, and are
+ * unlinked later in the background. The trash is not scanned
+ * for sets, and what a crash leaves in it is removed once the
+ * server is started again.
+ */
+
+/**
+ * The folder of the data directory that holds the trash
+ */
+#define TRASH_FOLDER "hlld-trash"
+
+/**
+ * Moves a folder into the trash of a data directory
+ * @arg data_dir The data directory
+ * @arg path The folder to move, in the data directory
+ * @return 0 on success, negative errno on failure.
+ */
+int trash_move(char *data_dir, char *path);
+
+/**
+ * Unlinks the files of the trash, removing each
+ * folder once it is empty
+ * @arg data_dir The data directory
+ * @arg max_unlinks The most files and folders to remove
+ * @return The number removed, which is max_unlinks if
+ * there may be more left.
+ */
+int trash_empty(char *data_dir, int max_unlinks);
+
+#endif
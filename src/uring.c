@@ -0,0 +1,218 @@
+#include "uring.h"
+#ifdef HLLD_URING
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Sets up a ring
+ * @arg r The ring
+ * @arg entries The size of the submission queue
+ * @arg cq_entries The size of the completion queue,
+ * or 0 for the default of twice the entries
+ * @return 0 on success, negative errno on failure.
+ */
+int uring_setup(hlld_uring *r, unsigned entries, unsigned cq_entries) {
+    memset(r, 0, sizeof(hlld_uring));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (cq_entries) {
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -errno;
+    r->entries = p.sq_entries;
+
+    // Newer kernels map both rings at once
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto FAIL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto FAIL;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto FAIL;
+    }
+
+    unsigned char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_queued = *r->sq_tail;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+FAIL:
+    uring_free(r);
+    return -ENOMEM;
+}
+
+/**
+ * Tears down a ring, along with its buffers. Requests
+ * still in flight are cancelled by the kernel.
+ * @arg r The ring
+ */
+void uring_free(hlld_uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+
+    // The kernel is done with the buffers once the ring is closed
+    if (r->buf_ring) munmap(r->buf_ring, r->num_bufs * sizeof(struct io_uring_buf));
+    free(r->buf_mem);
+    memset(r, 0, sizeof(hlld_uring));
+    r->fd = -1;
+}
+
+/**
+ * Provides a pool of buffers to the kernel, as buffer group 0.
+ * Requests that select a buffer complete with one of these,
+ * which is handed back with uring_recycle_buffer.
+ * @arg r The ring
+ * @arg num The number of buffers, a power of 2
+ * @arg size The size of each buffer
+ * @return 0 on success, negative errno on failure.
+ */
+int uring_provide_buffers(hlld_uring *r, unsigned num, unsigned size) {
+    if (!num || (num & (num - 1)) || num > 32768) return -EINVAL;
+
+    // The ring of buffers must be page aligned
+    size_t ring_len = num * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, ring_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return -ENOMEM;
+    char *mem = malloc((size_t)num * size);
+    if (!mem) {
+        munmap(ring, ring_len);
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = num;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        int err = errno;
+        munmap(ring, ring_len);
+        free(mem);
+        return -err;
+    }
+
+    r->buf_ring = ring;
+    r->buf_mem = mem;
+    r->num_bufs = num;
+    r->buf_size = size;
+    r->buf_tail = 0;
+    for (unsigned i=0; i < num; i++) uring_recycle_buffer(r, i);
+    return 0;
+}
+
+/**
+ * Returns a provided buffer
+ * @arg r The ring
+ * @arg bid The buffer ID of a completion
+ * @return The buffer
+ */
+char* uring_buffer(hlld_uring *r, unsigned bid) {
+    return r->buf_mem + (size_t)bid * r->buf_size;
+}
+
+/**
+ * Hands a provided buffer back to the kernel
+ * @arg r The ring
+ * @arg bid The buffer ID of a completion
+ */
+void uring_recycle_buffer(hlld_uring *r, unsigned bid) {
+    struct io_uring_buf *buf = r->buf_ring->bufs + (r->buf_tail & (r->num_bufs - 1));
+    buf->addr = (uintptr_t)uring_buffer(r, bid);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+
+    // Publish the buffer before the tail
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues a request. The entry is zeroed, and is submitted
+ * by the next uring_enter.
+ * @arg r The ring
+ * @return The entry to fill in, or NULL if the queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(hlld_uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_queued - head >= r->entries) return NULL;
+    unsigned idx = r->sq_queued++ & r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/**
+ * Returns the number of requests queued since the last uring_enter
+ * @arg r The ring
+ */
+unsigned uring_queued(hlld_uring *r) {
+    return r->sq_queued - *r->sq_tail;
+}
+
+/**
+ * Submits the queued requests, and optionally waits for completions
+ * @arg r The ring
+ * @arg wait_nr The number of completions to wait for, or 0
+ * @return The number of requests submitted, or negative errno.
+ */
+int uring_enter(hlld_uring *r, unsigned wait_nr) {
+    // Publish the entries before the tail
+    __atomic_store_n(r->sq_tail, r->sq_queued, __ATOMIC_RELEASE);
+    unsigned pending = r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (!pending && !wait_nr) return 0;
+    int res = syscall(__NR_io_uring_enter, r->fd, pending, wait_nr,
+            wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return (res < 0) ? -errno : res;
+}
+
+/**
+ * Takes the oldest completion, if any
+ * @arg r The ring
+ * @arg cqe Output, a copy of the completion
+ * @return 1 if a completion was taken, 0 if there are none.
+ */
+int uring_next_cqe(hlld_uring *r, struct io_uring_cqe *cqe) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = r->cqes[head & r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef URING_H
+#define URING_H
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls so that
+ * hlld does not depend on liburing. Requests are queued with
+ * uring_get_sqe, and submitted together by uring_enter. A ring
+ * may also provide buffers to the kernel, so that reads of many
+ * sockets share a pool rather than holding a buffer each.
+ *
+ * A ring is owned by a single thread.
+ */
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define HLLD_URING 1
+#endif
+#endif
+
+#ifdef HLLD_URING
+
+/**
+ * An io_uring, and its mapped queues
+ */
+typedef struct {
+    int fd;
+    unsigned entries;
+    volatile unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask;
+    unsigned sq_queued;         // Tail of the queued entries, not yet published
+    volatile unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+
+    // Buffers provided to the kernel, if any
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_mem;
+    unsigned num_bufs;
+    unsigned buf_size;
+    unsigned short buf_tail;
+} hlld_uring;
+
+/**
+ * Sets up a ring
+ * @arg r The ring
+ * @arg entries The size of the submission queue
+ * @arg cq_entries The size of the completion queue,
+ * or 0 for the default of twice the entries
+ * @return 0 on success, negative errno on failure.
+ */
+int uring_setup(hlld_uring *r, unsigned entries, unsigned cq_entries);
+
+/**
+ * Tears down a ring, along with its buffers. Requests
+ * still in flight are cancelled by the kernel.
+ * @arg r The ring
+ */
+void uring_free(hlld_uring *r);
+
+/**
+ * Provides a pool of buffers to the kernel, as buffer group 0.
+ * Requests that select a buffer complete with one of these,
+ * which is handed back with uring_recycle_buffer.
+ * @arg r The ring
+ * @arg num The number of buffers, a power of 2
+ * @arg size The size of each buffer
+ * @return 0 on success, negative errno on failure.
+ */
+int uring_provide_buffers(hlld_uring *r, unsigned num, unsigned size);
+
+/**
+ * Returns a provided buffer
+ * @arg r The ring
+ * @arg bid The buffer ID of a completion
+ * @return The buffer
+ */
+char* uring_buffer(hlld_uring *r, unsigned bid);
+
+/**
+ * Hands a provided buffer back to the kernel
+ * @arg r The ring
+ * @arg bid The buffer ID of a completion
+ */
+void uring_recycle_buffer(hlld_uring *r, unsigned bid);
+
+/**
+ * Queues a request. The entry is zeroed, and is submitted
+ * by the next uring_enter.
+ * @arg r The ring
+ * @return The entry to fill in, or NULL if the queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(hlld_uring *r);
+
+/**
+ * Returns the number of requests queued since the last uring_enter
+ * @arg r The ring
+ */
+unsigned uring_queued(hlld_uring *r);
+
+/**
+ * Submits the queued requests, and optionally waits for completions
+ * @arg r The ring
+ * @arg wait_nr The number of completions to wait for, or 0
+ * @return The number of requests submitted, or negative errno.
+ */
+int uring_enter(hlld_uring *r, unsigned wait_nr);
+
+/**
+ * Takes the oldest completion, if any
+ * @arg r The ring
+ * @arg cqe Output, a copy of the completion
+ * @return 1 if a completion was taken, 0 if there are none.
+ */
+int uring_next_cqe(hlld_uring *r, struct io_uring_cqe *cqe);
+
+#endif
+#endif
@@ -0,0 +1,452 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "art.h"
+#include "iobatch.h"
+#include "wal.h"
+
+/*
+ * Each record starts with the length of its body, the
+ * FNV-1a checksum of the rest of the record, and its type.
+ */
+#define WAL_RAISE 1
+#define WAL_DROP 2
+
+/**
+ * The buffered bytes past which a batch is
+ * written without waiting for more appends
+ */
+#define WAL_EAGER_BUFFER (1024 * 1024)
+
+/*
+ * Replay positions pack the segment above the offset
+ */
+#define POSITION(seq, offset) (((seq) << 40) | (offset))
+
+static inline void store_le32(unsigned char *out, uint32_t val) {
+    for (int i=0; i < 4; i++) out[i] = val >> (8 * i);
+}
+
+static inline uint32_t load_le32(const unsigned char *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static uint32_t record_checksum(const unsigned char *buf, uint64_t len) {
+    uint32_t hash = 2166136261U;
+    for (uint64_t i=8; i < len; i++) {
+        hash = (hash ^ buf[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Returns the path of a segment, which must be freed
+ */
+static char* segment_path(hlld_wal *wal, uint64_t seq) {
+    char name[48];
+    snprintf(name, sizeof(name), "wal.%llu.log", (unsigned long long)seq);
+    return join_path(wal->config->data_dir, name);
+}
+
+/**
+ * Parses the number of a segment from its file name
+ * @return 1 if the name is that of a segment
+ */
+static int segment_seq(const char *name, uint64_t *seq) {
+    unsigned long long val;
+    int end = 0;
+    if (sscanf(name, "wal.%llu.log%n", &val, &end) != 1 || !end || name[end] || !val)
+        return 0;
+    *seq = val;
+    return 1;
+}
+
+static int open_segment(hlld_wal *wal, uint64_t seq) {
+    char *path = segment_path(wal, seq);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open WAL segment '%s'. %s", path, strerror(errno));
+    }
+    free(path);
+    return fd;
+}
+
+/**
+ * Writes and syncs the batches of appends, and starts
+ * new segments when asked to.
+ */
+static void* wal_thread_main(void *in) {
+    hlld_wal *wal = in;
+    uint64_t offset = 0;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->run || wal->len) {
+        if (!wal->len && !wal->rotate) {
+            pthread_cond_wait(&wal->cond, &wal->lock);
+            continue;
+        }
+
+        // Let a group of appends build up, to share the sync,
+        // unless an append is waiting for it
+        if (wal->run && !wal->rotate && !wal->sync_waiters && wal->len < WAL_EAGER_BUFFER) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t nsec = ts.tv_nsec + wal->config->wal_sync_msec * 1000000ULL;
+            ts.tv_sec += nsec / 1000000000ULL;
+            ts.tv_nsec = nsec % 1000000000ULL;
+            pthread_cond_timedwait(&wal->cond, &wal->lock, &ts);
+        }
+
+        // Swap the buffers, so appends go on during the write
+        unsigned char *batch = wal->buf;
+        uint64_t len = wal->len, cap = wal->cap, end = wal->appended;
+        wal->buf = wal->spare;
+        wal->cap = wal->spare_cap;
+        wal->len = 0;
+        wal->spare = NULL;
+        wal->spare_cap = 0;
+        int rotate = wal->rotate;
+        uint64_t seq = wal->seq;
+        int fd = wal->fd;
+        pthread_cond_broadcast(&wal->done);
+        pthread_mutex_unlock(&wal->lock);
+
+        int res = 0;
+        if (len) {
+            iobatch_range range = {batch, len, offset};
+            res = iobatch_write(fd, &range, 1, 1, NULL);
+            if (res) {
+                // A torn record ends the replay of a segment, start another
+                syslog(LOG_ERR, "Failed to write the WAL. Err: %d", res);
+                rotate = 1;
+            }
+            offset += len;
+        }
+        int new_fd = -1;
+        if (rotate && (new_fd = open_segment(wal, seq + 1)) >= 0) {
+            close(fd);
+            offset = 0;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        wal->spare = batch;
+        wal->spare_cap = cap;
+        if (new_fd >= 0) {
+            wal->fd = new_fd;
+            wal->seq = seq + 1;
+        }
+        if (rotate) wal->rotate = 0;
+        wal->synced = end;
+        wal->sync_res = res;
+        pthread_cond_broadcast(&wal->done);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+/**
+ * Opens the log, starting a segment after those
+ * on disk, and starts the log thread
+ * @arg config The configuration
+ * @arg wal Output, the log
+ * @return 0 on success, -1 on error.
+ */
+int init_wal(hlld_config *config, hlld_wal **wal) {
+    DIR *dir = opendir(config->data_dir);
+    if (!dir) {
+        syslog(LOG_ERR, "Failed to scan the data directory for the WAL. %s", strerror(errno));
+        return -1;
+    }
+    uint64_t oldest = 0, newest = 0, seq;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!segment_seq(ent->d_name, &seq)) continue;
+        if (!oldest || seq < oldest) oldest = seq;
+        if (seq > newest) newest = seq;
+    }
+    closedir(dir);
+
+    hlld_wal *w = calloc(1, sizeof(hlld_wal));
+    if (!w) return -1;
+    w->config = config;
+    w->seq = newest + 1;
+    w->oldest = oldest ? oldest : w->seq;
+    w->fd = open_segment(w, w->seq);
+    if (w->fd < 0) {
+        free(w);
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->run = 1;
+    if (pthread_create(&w->thread, NULL, wal_thread_main, w)) {
+        close(w->fd);
+        free(w);
+        return -1;
+    }
+    *wal = w;
+    return 0;
+}
+
+/**
+ * Writes out the buffered records, stops the
+ * log thread, and closes the log
+ * @arg wal The log, may be NULL
+ */
+void destroy_wal(hlld_wal *wal) {
+    if (!wal) return;
+    pthread_mutex_lock(&wal->lock);
+    wal->run = 0;
+    pthread_cond_signal(&wal->cond);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->thread, NULL);
+
+    close(wal->fd);
+    free(wal->buf);
+    free(wal->spare);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->cond);
+    pthread_cond_destroy(&wal->done);
+    free(wal);
+}
+
+/**
+ * Adds a record to the buffer, waiting while it is full,
+ * and optionally until it is written and synced
+ */
+static int append_record(hlld_wal *wal, volatile uint64_t *wal_seq, int type,
+        const unsigned char *body, uint32_t body_len, int sync) {
+    uint32_t len = WAL_HEADER_SIZE + body_len;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->len && wal->len + len > WAL_MAX_BUFFER && wal->run) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    if (wal->len + len > wal->cap) {
+        uint64_t cap = wal->cap ? wal->cap : 4096;
+        while (cap < wal->len + len) cap *= 2;
+        unsigned char *buf = realloc(wal->buf, cap);
+        if (!buf) {
+            pthread_mutex_unlock(&wal->lock);
+            return -1;
+        }
+        wal->buf = buf;
+        wal->cap = cap;
+    }
+
+    unsigned char *out = wal->buf + wal->len;
+    store_le32(out, body_len);
+    out[8] = type;
+    out[9] = out[10] = out[11] = 0;
+    memcpy(out + WAL_HEADER_SIZE, body, body_len);
+    store_le32(out + 4, record_checksum(out, len));
+
+    if (!wal->len || sync) pthread_cond_signal(&wal->cond);
+    wal->len += len;
+    wal->appended += len;
+    if (wal_seq && !*wal_seq) *wal_seq = wal->seq;
+
+    // The log thread writes every buffered record before it stops
+    int res = 0;
+    if (sync) {
+        uint64_t end = wal->appended;
+        wal->sync_waiters++;
+        while (wal->synced < end) pthread_cond_wait(&wal->done, &wal->lock);
+        wal->sync_waiters--;
+        res = (wal->sync_res) ? -1 : 0;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return res;
+}
+
+/**
+ * Appends the raises of a set. The raises of a set with the
+ * wal durability are written and synced before returning,
+ * unless they are being replayed.
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg wal_seq The oldest segment with unflushed raises of the
+ * set, set to the current segment if 0
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set
+ * @arg entries The register entries that were raised
+ * @arg num The number of entries
+ * @return 0 on success, -1 on error.
+ */
+int wal_append(hlld_wal *wal, volatile uint64_t *wal_seq, char *set_name,
+        hlld_set_config *set_config, const uint32_t *entries, int num) {
+    if (!num) return 0;
+    uint32_t *folded = malloc(num * sizeof(uint32_t));
+    if (!folded) return -1;
+    memcpy(folded, entries, num * sizeof(uint32_t));
+    num = repl_fold(folded, num);
+
+    unsigned char *frame;
+    uint32_t frame_len;
+    int res = repl_encode_frame(set_name, set_config, folded, num, &frame, &frame_len);
+    free(folded);
+    if (res) return -1;
+    int sync = set_config->durability == DURABILITY_WAL && !wal->replaying;
+    res = append_record(wal, wal_seq, WAL_RAISE, frame, frame_len, sync);
+    free(frame);
+    return res;
+}
+
+/**
+ * Appends a drop of a set, so that its earlier
+ * raises are not replayed into a later set of
+ * the same name
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 on error.
+ */
+int wal_drop(hlld_wal *wal, char *set_name) {
+    return append_record(wal, NULL, WAL_DROP, (unsigned char*)set_name, strlen(set_name), 0);
+}
+
+/**
+ * Reads a whole segment
+ * @return The length read, or 0 if it is empty or cannot be read
+ */
+static uint64_t read_segment(hlld_wal *wal, uint64_t seq, unsigned char **buf) {
+    char *path = segment_path(wal, seq);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    int64_t len = 0;
+    if (!fstat(fd, &st) && st.st_size > 0 && (*buf = malloc(st.st_size))) {
+        len = iobatch_read(fd, *buf, st.st_size, NULL);
+        if (len <= 0) {
+            free(*buf);
+            len = 0;
+        }
+    }
+    close(fd);
+    return len;
+}
+
+/**
+ * Walks the records of a segment, up to the first torn one.
+ * The first pass notes the last drop of each set, and the
+ * second replays the raises after it.
+ */
+static int scan_segment(hlld_wal *wal, uint64_t seq, int pass, art_tree *drops,
+        wal_replay_cb cb, void *data) {
+    unsigned char *buf;
+    uint64_t len = read_segment(wal, seq, &buf);
+    if (!len) return 0;
+
+    int replayed = 0;
+    uint64_t offset = 0;
+    while (offset + WAL_HEADER_SIZE <= len) {
+        unsigned char *rec = buf + offset;
+        uint32_t body_len = load_le32(rec);
+        if (body_len > len - offset - WAL_HEADER_SIZE ||
+                record_checksum(rec, WAL_HEADER_SIZE + body_len) != load_le32(rec + 4)) {
+            syslog(LOG_WARNING, "Torn record in WAL segment %llu at %llu, skipping the rest.",
+                    (unsigned long long)seq, (unsigned long long)offset);
+            break;
+        }
+        unsigned char *body = rec + WAL_HEADER_SIZE;
+        uint64_t pos = POSITION(seq, offset);
+        offset += WAL_HEADER_SIZE + body_len;
+
+        if (rec[8] == WAL_DROP && pass == 1 && body_len) {
+            char *name = strndup((char*)body, body_len);
+            if (!name) continue;
+            art_insert(drops, (unsigned char*)name, body_len + 1, (void*)(uintptr_t)pos);
+            free(name);
+
+        } else if (rec[8] == WAL_RAISE && pass == 2) {
+            repl_frame frame;
+            if (repl_decode_frame(body, body_len, &frame) != (int)body_len) continue;
+            uintptr_t last = (uintptr_t)art_search(drops, (unsigned char*)frame.set_name,
+                    strlen(frame.set_name) + 1);
+            if (pos > last) {
+                cb(data, &frame);
+                replayed++;
+            }
+            repl_frame_free(&frame);
+        }
+    }
+    free(buf);
+    return replayed;
+}
+
+/**
+ * Replays the raises of the segments on disk, in order,
+ * skipping the raises of a set before its last drop.
+ * Replayed raises should be appended again, as the
+ * segments are removed by the next wal_trim.
+ * @arg wal The log
+ * @arg cb Invoked with the raises of each record
+ * @arg data Passed to the callback
+ * @return The number of records replayed
+ */
+int wal_replay(hlld_wal *wal, wal_replay_cb cb, void *data) {
+    art_tree drops;
+    init_art_tree(&drops);
+    int replayed = 0;
+
+    // Replayed raises are appended again, without waiting for
+    // each sync, as the log is rotated once they are done
+    wal->replaying = 1;
+    for (int pass=1; pass <= 2; pass++) {
+        for (uint64_t seq=wal->oldest; seq < wal->seq; seq++) {
+            replayed += scan_segment(wal, seq, pass, &drops, cb, data);
+        }
+    }
+    wal->replaying = 0;
+    destroy_art_tree(&drops);
+    return replayed;
+}
+
+/**
+ * Writes and syncs the buffered records, then starts a new
+ * segment. Waits for the log thread to do so.
+ * @notes Thread safe.
+ * @arg wal The log
+ * @return The new segment
+ */
+uint64_t wal_rotate(hlld_wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    wal->rotate = 1;
+    pthread_cond_signal(&wal->cond);
+    while (wal->rotate) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    uint64_t seq = wal->seq;
+    pthread_mutex_unlock(&wal->lock);
+    return seq;
+}
+
+/**
+ * Removes the segments older than a segment
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg seq The oldest segment to keep, at most the current
+ */
+void wal_trim(hlld_wal *wal, uint64_t seq) {
+    pthread_mutex_lock(&wal->lock);
+    if (seq > wal->seq) seq = wal->seq;
+    uint64_t oldest = wal->oldest;
+    if (seq > oldest) wal->oldest = seq;
+    pthread_mutex_unlock(&wal->lock);
+
+    for (; oldest < seq; oldest++) {
+        char *path = segment_path(wal, oldest);
+        if (unlink(path) && errno != ENOENT) {
+            syslog(LOG_ERR, "Failed to remove WAL segment '%s'. %s", path, strerror(errno));
+        }
+        free(path);
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef WAL_H
+#define WAL_H
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "repl_log.h"
+
+/*
+ * The write-ahead log keeps the register raises of persistent
+ * sets between their flushes, so that a crash only loses the
+ * raises of the last wal_sync_msec. Raises are appended to a
+ * buffer, which a thread of its own writes and syncs in batches,
+ * so many clients share each sync. The raises of sets with the
+ * wal durability wait for their batch to sync, which is written
+ * at once rather than after wal_sync_msec.
+ *
+ * The log is split into segments, "wal.<seq>.log" in the data
+ * directory. A new segment is started once per flush interval,
+ * and each set remembers the oldest segment holding raises it
+ * has not flushed, so the segments older than every set are
+ * removed. Each record is a replication frame of the raises of
+ * a set, or the name of a dropped set, behind a header with its
+ * length and checksum, so a torn append is detected.
+ */
+
+/**
+ * The buffered bytes past which appends wait
+ * for the log thread to catch up
+ */
+#define WAL_MAX_BUFFER (64 * 1024 * 1024)
+
+/**
+ * The bytes of each record header
+ */
+#define WAL_HEADER_SIZE 12
+
+typedef struct {
+    hlld_config *config;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signals the log thread
+    pthread_cond_t done;        // Signals a finished batch
+    unsigned char *buf;         // Records not yet written
+    uint64_t len;
+    uint64_t cap;
+    unsigned char *spare;       // Buffer of the batch being written
+    uint64_t spare_cap;
+    uint64_t seq;               // The segment being appended to
+    uint64_t oldest;            // The oldest segment on disk
+    int fd;
+    int rotate;                 // Set to start a new segment
+    uint64_t appended;          // Bytes appended since the log was opened
+    uint64_t synced;            // Bytes of those written and synced
+    int sync_res;               // The result of the last batch written
+    int sync_waiters;           // Appends waiting for their sync
+    int replaying;              // Set while the segments are replayed
+    int run;                    // Cleared to stop the log thread
+    pthread_t thread;
+} hlld_wal;
+
+/**
+ * Invoked with the raises of each record replayed
+ * @arg data Opaque pointer passed to wal_replay
+ * @arg frame The raises of a set
+ */
+typedef void(*wal_replay_cb)(void *data, repl_frame *frame);
+
+/**
+ * Opens the log, starting a segment after those
+ * on disk, and starts the log thread
+ * @arg config The configuration
+ * @arg wal Output, the log
+ * @return 0 on success, -1 on error.
+ */
+int init_wal(hlld_config *config, hlld_wal **wal);
+
+/**
+ * Writes out the buffered records, stops the
+ * log thread, and closes the log
+ * @arg wal The log, may be NULL
+ */
+void destroy_wal(hlld_wal *wal);
+
+/**
+ * Appends the raises of a set. The raises of a set with the
+ * wal durability are written and synced before returning,
+ * unless they are being replayed.
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg wal_seq The oldest segment with unflushed raises of the
+ * set, set to the current segment if 0
+ * @arg set_name The name of the set
+ * @arg set_config The config of the set
+ * @arg entries The register entries that were raised
+ * @arg num The number of entries
+ * @return 0 on success, -1 on error.
+ */
+int wal_append(hlld_wal *wal, volatile uint64_t *wal_seq, char *set_name,
+        hlld_set_config *set_config, const uint32_t *entries, int num);
+
+/**
+ * Appends a drop of a set, so that its earlier
+ * raises are not replayed into a later set of
+ * the same name
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 on error.
+ */
+int wal_drop(hlld_wal *wal, char *set_name);
+
+/**
+ * Replays the raises of the segments on disk, in order,
+ * skipping the raises of a set before its last drop.
+ * Replayed raises should be appended again, as the
+ * segments are removed by the next wal_trim.
+ * @arg wal The log
+ * @arg cb Invoked with the raises of each record
+ * @arg data Passed to the callback
+ * @return The number of records replayed
+ */
+int wal_replay(hlld_wal *wal, wal_replay_cb cb, void *data);
+
+/**
+ * Writes and syncs the buffered records, then starts a new
+ * segment. Waits for the log thread to do so.
+ * @notes Thread safe.
+ * @arg wal The log
+ * @return The new segment
+ */
+uint64_t wal_rotate(hlld_wal *wal);
+
+/**
+ * Removes the segments older than a segment
+ * @notes Thread safe.
+ * @arg wal The log
+ * @arg seq The oldest segment to keep, at most the current
+ */
+void wal_trim(hlld_wal *wal, uint64_t seq);
+
+#endif
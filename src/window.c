@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include "window.h"
+
+/*
+ * Encoded windows start with this header, in host
+ * byte order, followed by the interval number of each
+ * bucket and then the registers of each bucket.
+ */
+#define WINDOW_MAGIC 0x444E5748
+#define WINDOW_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t precision;
+    uint8_t format;
+    uint8_t pad;
+    uint32_t interval;
+    uint32_t num_buckets;
+} window_header;
+
+/**
+ * Initializes a window of empty buckets
+ * @arg precision The digits of precision of each bucket
+ * @arg format The register layout of each bucket
+ * @arg interval The seconds covered by each bucket
+ * @arg num_buckets The number of buckets
+ * @arg w The window to initialize
+ * @return 0 on success, -1 on error.
+ */
+int window_init(unsigned char precision, hll_format format, uint32_t interval,
+        int num_buckets, hll_window *w) {
+    if (!interval || num_buckets < 1 || num_buckets > WINDOW_MAX_BUCKETS)
+        return -1;
+    w->interval = interval;
+    w->num_buckets = num_buckets;
+    w->dirty = 0;
+    w->epochs = calloc(num_buckets, sizeof(uint64_t));
+    w->buckets = calloc(num_buckets, sizeof(hll_t));
+    if (!w->epochs || !w->buckets) goto ERROR;
+    for (int i=0; i < num_buckets; i++) {
+        if (hll_init(precision, format, w->buckets + i)) {
+            while (i--) hll_destroy(w->buckets + i);
+            goto ERROR;
+        }
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    return 0;
+
+ERROR:
+    free((void*)w->epochs);
+    free(w->buckets);
+    return -1;
+}
+
+/**
+ * Destroys a window, freeing its buckets
+ * @arg w The window
+ */
+void window_destroy(hll_window *w) {
+    for (int i=0; i < w->num_buckets; i++) {
+        hll_destroy(w->buckets + i);
+    }
+    free((void*)w->epochs);
+    free(w->buckets);
+    pthread_mutex_destroy(&w->lock);
+}
+
+/*
+ * Finds the bucket of the current interval, clearing it in
+ * place if it last held an expired interval.
+ * @return The bucket, or NULL if the clock went back past it.
+ */
+static hll_t* current_bucket(hll_window *w, uint64_t now) {
+    uint64_t epoch = now / w->interval;
+    int idx = epoch % w->num_buckets;
+    if (w->epochs[idx] == epoch) return w->buckets + idx;
+
+    pthread_mutex_lock(&w->lock);
+    hll_t *bucket = w->buckets + idx;
+    if (w->epochs[idx] > epoch) {
+        bucket = NULL;
+    } else if (w->epochs[idx] != epoch) {
+        hll_clear(bucket);
+        __sync_synchronize();
+        w->epochs[idx] = epoch;
+        w->dirty = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return bucket;
+}
+
+/**
+ * Adds hashes to the bucket of the current interval,
+ * recycling it first if it holds an expired interval.
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed.
+ */
+int window_add_hashes(hll_window *w, uint64_t now, const uint64_t *hashes, int num) {
+    hll_t *bucket = current_bucket(w, now);
+    if (!bucket) return 0;
+    int changed = hll_add_hashes(bucket, hashes, num);
+    if (changed && !w->dirty) w->dirty = 1;
+    return changed;
+}
+
+/**
+ * Merges an HLL into the bucket of the current interval
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg src The HLL to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower precision.
+ */
+int window_union(hll_window *w, uint64_t now, hll_t *src) {
+    hll_t *bucket = current_bucket(w, now);
+    if (!bucket) return 0;
+    if (hll_union(bucket, src)) return -1;
+    w->dirty = 1;
+    return 0;
+}
+
+/**
+ * Merges the buckets covering the last span seconds into
+ * an HLL. The current interval is always included, and the
+ * span is rounded up to whole intervals.
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg span The seconds to cover
+ * @arg h The HLL to merge into, folded down to if of a lower precision
+ * @return 0 on success, -1 if h has a higher precision.
+ */
+int window_merge_into(hll_window *w, uint64_t now, uint64_t span, hll_t *h) {
+    if (h->precision > w->buckets[0].precision) return -1;
+    uint64_t epoch = now / w->interval;
+    uint64_t intervals = (span + w->interval - 1) / w->interval;
+    if (intervals < 1) intervals = 1;
+
+    // The lock keeps a bucket from being recycled while merged
+    pthread_mutex_lock(&w->lock);
+    for (int i=0; i < w->num_buckets; i++) {
+        uint64_t bucket_epoch = w->epochs[i];
+        if (bucket_epoch && bucket_epoch <= epoch && epoch - bucket_epoch < intervals)
+            hll_union(h, w->buckets + i);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/**
+ * Returns the bytes used by the registers of a window
+ */
+uint64_t window_bytes(hll_window *w) {
+    return w->num_buckets * hll_bytes_for_precision(w->buckets[0].precision,
+            w->buckets[0].format);
+}
+
+/**
+ * Encodes the buckets of a window, so that it can be saved
+ * @note Thread safe.
+ * @arg w The window
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int window_encode(hll_window *w, unsigned char **buf, uint64_t *len) {
+    uint64_t bytes = hll_bytes_for_precision(w->buckets[0].precision, w->buckets[0].format);
+    uint64_t epochs_len = w->num_buckets * sizeof(uint64_t);
+    *len = sizeof(window_header) + epochs_len + w->num_buckets * bytes;
+    unsigned char *out = *buf = malloc(*len);
+    if (!out) return -1;
+
+    window_header header = {WINDOW_MAGIC, WINDOW_VERSION, w->buckets[0].precision,
+        w->buckets[0].format, 0, w->interval, w->num_buckets};
+    memcpy(out, &header, sizeof(window_header));
+
+    // Cleared before copying, so that later changes are saved again
+    pthread_mutex_lock(&w->lock);
+    w->dirty = 0;
+    __sync_synchronize();
+    memcpy(out + sizeof(window_header), (void*)w->epochs, epochs_len);
+    out += sizeof(window_header) + epochs_len;
+    for (int i=0; i < w->num_buckets; i++) {
+        memcpy(out + i * bytes, w->buckets[i].registers, bytes);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/**
+ * Loads the buckets of a window from a buffer produced by
+ * window_encode, which must match its layout.
+ * @arg w The window, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int window_decode(hll_window *w, const unsigned char *buf, uint64_t len) {
+    uint64_t bytes = hll_bytes_for_precision(w->buckets[0].precision, w->buckets[0].format);
+    uint64_t epochs_len = w->num_buckets * sizeof(uint64_t);
+    window_header header;
+    if (len != sizeof(window_header) + epochs_len + w->num_buckets * bytes)
+        return -1;
+    memcpy(&header, buf, sizeof(window_header));
+    if (header.magic != WINDOW_MAGIC || header.version != WINDOW_VERSION ||
+            header.precision != w->buckets[0].precision ||
+            header.format != w->buckets[0].format ||
+            header.interval != w->interval ||
+            header.num_buckets != (uint32_t)w->num_buckets)
+        return -1;
+
+    memcpy((void*)w->epochs, buf + sizeof(window_header), epochs_len);
+    buf += sizeof(window_header) + epochs_len;
+    for (int i=0; i < w->num_buckets; i++) {
+        if (hll_load_registers(w->buckets + i, buf + i * bytes, bytes)) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+#include <stdint.h>
+#include <pthread.h>
+#include "hll.h"
+
+/*
+ * A window is a ring of dense HLLs, one per interval, so that
+ * a set can estimate the keys seen over its recent intervals.
+ * The bucket of an interval is found by its number modulo the
+ * number of buckets, and once the ring wraps around, the expired
+ * bucket it lands on is cleared in place and re-used. Expired
+ * buckets are only recycled by adds, and are skipped by merges.
+ */
+
+/**
+ * The most buckets in a window
+ */
+#define WINDOW_MAX_BUCKETS 1024
+
+typedef struct {
+    uint32_t interval;          // Seconds covered by each bucket
+    int num_buckets;
+    volatile uint64_t *epochs;  // Interval number of each bucket, 0 if unused
+    hll_t *buckets;             // Dense registers of each bucket
+    pthread_mutex_t lock;       // Serializes recycling buckets with merges
+    volatile int dirty;         // Set when a bucket changes
+} hll_window;
+
+/**
+ * Initializes a window of empty buckets
+ * @arg precision The digits of precision of each bucket
+ * @arg format The register layout of each bucket
+ * @arg interval The seconds covered by each bucket
+ * @arg num_buckets The number of buckets
+ * @arg w The window to initialize
+ * @return 0 on success, -1 on error.
+ */
+int window_init(unsigned char precision, hll_format format, uint32_t interval,
+        int num_buckets, hll_window *w);
+
+/**
+ * Destroys a window, freeing its buckets
+ * @arg w The window
+ */
+void window_destroy(hll_window *w);
+
+/**
+ * Adds hashes to the bucket of the current interval,
+ * recycling it first if it holds an expired interval.
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg hashes The hashes to add
+ * @arg num The number of hashes
+ * @return The number of registers changed.
+ */
+int window_add_hashes(hll_window *w, uint64_t now, const uint64_t *hashes, int num);
+
+/**
+ * Merges an HLL into the bucket of the current interval
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg src The HLL to merge from. Not modified.
+ * @return 0 on success, -1 if src has a lower precision.
+ */
+int window_union(hll_window *w, uint64_t now, hll_t *src);
+
+/**
+ * Merges the buckets covering the last span seconds into
+ * an HLL. The current interval is always included, and the
+ * span is rounded up to whole intervals.
+ * @note Thread safe.
+ * @arg w The window
+ * @arg now The current time, in seconds since the epoch
+ * @arg span The seconds to cover
+ * @arg h The HLL to merge into, folded down to if of a lower precision
+ * @return 0 on success, -1 if h has a higher precision.
+ */
+int window_merge_into(hll_window *w, uint64_t now, uint64_t span, hll_t *h);
+
+/**
+ * Returns the bytes used by the registers of a window
+ */
+uint64_t window_bytes(hll_window *w);
+
+/**
+ * Encodes the buckets of a window, so that it can be saved
+ * @note Thread safe.
+ * @arg w The window
+ * @arg buf Output, a malloc()'d buffer
+ * @arg len Output, the length of the buffer
+ * @return 0 on success, -1 on error.
+ */
+int window_encode(hll_window *w, unsigned char **buf, uint64_t *len);
+
+/**
+ * Loads the buckets of a window from a buffer produced by
+ * window_encode, which must match its layout.
+ * @arg w The window, as initialized
+ * @arg buf The encoded buffer
+ * @arg len The length of the buffer
+ * @return 0 on success, -1 if the buffer is invalid.
+ */
+int window_decode(hll_window *w, const unsigned char *buf, uint64_t len);
+
+#endif
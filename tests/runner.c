@@ -7,6 +7,29 @@
 #include "test_set.c"
 #include "test_setmgr.c"
 #include "test_art.c"
+#include "test_manifest.c"
+#include "test_epoch.c"
+#include "test_metrics.c"
+#include "test_slowlog.c"
+#include "test_repl_log.c"
+#include "test_cluster.c"
+#include "test_remote.c"
+#include "test_window.c"
+#include "test_wal.c"
+#include "test_slab.c"
+#include "test_brlock.c"
+#include "test_spinlock.c"
+#include "test_alloc.c"
+#include "test_affinity.c"
+#include "test_uring.c"
+#include "test_clock.c"
+#include "test_ingest.c"
+#include "test_trash.c"
+#include "test_archive.c"
+#include "test_crc32c.c"
+#include "test_kmv.c"
+#include "test_client.c"
+#include "test_core.c"
 
 int main(void)
 {
@@ -19,6 +42,29 @@ int main(void)
     TCase *tc5 = tcase_create("set");
     TCase *tc6 = tcase_create("manager");
     TCase *tc7 = tcase_create("art");
+    TCase *tc8 = tcase_create("manifest");
+    TCase *tc9 = tcase_create("epoch");
+    TCase *tc10 = tcase_create("metrics");
+    TCase *tc11 = tcase_create("slowlog");
+    TCase *tc12 = tcase_create("replication");
+    TCase *tc13 = tcase_create("cluster");
+    TCase *tc14 = tcase_create("remote");
+    TCase *tc15 = tcase_create("window");
+    TCase *tc16 = tcase_create("wal");
+    TCase *tc17 = tcase_create("slab");
+    TCase *tc18 = tcase_create("brlock");
+    TCase *tc19 = tcase_create("affinity");
+    TCase *tc20 = tcase_create("uring");
+    TCase *tc21 = tcase_create("clock");
+    TCase *tc22 = tcase_create("ingest");
+    TCase *tc23 = tcase_create("trash");
+    TCase *tc24 = tcase_create("archive");
+    TCase *tc25 = tcase_create("crc32c");
+    TCase *tc26 = tcase_create("kmv");
+    TCase *tc27 = tcase_create("client");
+    TCase *tc28 = tcase_create("core");
+    TCase *tc29 = tcase_create("spinlock");
+    TCase *tc30 = tcase_create("alloc");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -29,6 +75,7 @@ int main(void)
     tcase_add_test(tc1, test_config_empty_file);
     tcase_add_test(tc1, test_config_basic_config);
     tcase_add_test(tc1, test_config_basic_config_precision);
+    tcase_add_test(tc1, test_config_templates);
     tcase_add_test(tc1, test_validate_default_config);
     tcase_add_test(tc1, test_validate_bad_config);
     tcase_add_test(tc1, test_join_path_no_slash);
@@ -41,6 +88,54 @@ int main(void)
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_default_format);
+    tcase_add_test(tc1, test_sane_sparse);
+    tcase_add_test(tc1, test_sane_compress_cold);
+    tcase_add_test(tc1, test_sane_flush_threads);
+    tcase_add_test(tc1, test_sane_flush_rate_limit);
+    tcase_add_test(tc1, test_sane_flush_dirty_age);
+    tcase_add_test(tc1, test_sane_flush_dirty_pages);
+    tcase_add_test(tc1, test_sane_max_memory);
+    tcase_add_test(tc1, test_sane_reuseport);
+    tcase_add_test(tc1, test_sane_max_conn_buffer);
+    tcase_add_test(tc1, test_sane_slowlog);
+    tcase_add_test(tc1, test_sane_replication);
+    tcase_add_test(tc1, test_sane_cluster);
+    tcase_add_test(tc1, test_sane_remote_cache_msec);
+    tcase_add_test(tc1, test_sane_window);
+    tcase_add_test(tc1, test_sane_sliding);
+    tcase_add_test(tc1, test_sane_kmv);
+    tcase_add_test(tc1, test_sane_wal);
+    tcase_add_test(tc1, test_sane_huge_pages);
+    tcase_add_test(tc1, test_sane_slab_registers);
+    tcase_add_test(tc1, test_sane_fold);
+    tcase_add_test(tc1, test_sane_affinity);
+    tcase_add_test(tc1, test_sane_io_uring);
+    tcase_add_test(tc1, test_sane_busy_poll);
+    tcase_add_test(tc1, test_sane_conn_rate);
+    tcase_add_test(tc1, test_sane_reserved_workers);
+    tcase_add_test(tc1, test_sane_max_workers);
+    tcase_add_test(tc1, test_sane_unix_socket);
+    tcase_add_test(tc1, test_sane_conn_turn);
+    tcase_add_test(tc1, test_sane_migrate_busy);
+    tcase_add_test(tc1, test_sane_exec_threads);
+    tcase_add_test(tc1, test_sane_coalesce_writes);
+    tcase_add_test(tc1, test_sane_shadow_merge_msec);
+    tcase_add_test(tc1, test_sane_ingest_rings);
+    tcase_add_test(tc1, test_sane_auto_create);
+    tcase_add_test(tc1, test_sane_trash_unlink_rate);
+    tcase_add_test(tc1, test_sane_preallocate);
+    tcase_add_test(tc1, test_sane_data_dirs);
+    tcase_add_test(tc1, test_sane_direct_io);
+    tcase_add_test(tc1, test_sane_cool_interval);
+    tcase_add_test(tc1, test_sane_prewarm);
+    tcase_add_test(tc1, test_sane_archive_after_days);
+    tcase_add_test(tc1, test_sane_read_only);
+    tcase_add_test(tc1, test_duration_to_secs);
+    tcase_add_test(tc1, test_durability_from_name);
+    tcase_add_test(tc1, test_sane_durability);
+    tcase_add_test(tc1, test_sane_default_estimator);
+    tcase_add_test(tc1, test_sane_default_hash);
     tcase_add_test(tc1, test_set_config_bad_file);
     tcase_add_test(tc1, test_set_config_empty_file);
     tcase_add_test(tc1, test_set_config_basic_config);
@@ -57,6 +152,17 @@ int main(void)
     tcase_add_test(tc3, make_bitmap_nofile_persistent);
     tcase_add_test(tc3, make_bitmap_nofile_create);
     tcase_add_test(tc3, make_bitmap_nofile_create_persistent);
+    tcase_add_test(tc3, make_bitmap_nofile_create_preallocate);
+    tcase_add_test(tc3, flush_does_write_persist_direct);
+    tcase_add_test(tc3, cool_bitmap);
+    tcase_add_test(tc3, sample_bitmap_residency);
+    tcase_add_test(tc3, flush_skips_clean_pages_persist);
+    tcase_add_test(tc3, flush_merges_runs);
+    tcase_add_test(tc3, huge_pages_anonymous);
+    tcase_add_test(tc3, huge_pages_persistent);
+    tcase_add_test(tc3, read_only_sees_writes);
+    tcase_add_test(tc3, iobatch_write_read);
+    tcase_add_test(tc3, iobatch_bad_fd);
 
     // Add the hll tests
     suite_add_tcase(s1, tc4);
@@ -66,11 +172,44 @@ int main(void)
     tcase_add_test(tc4, test_hll_add_hash);
     tcase_add_test(tc4, test_hll_add_size);
     tcase_add_test(tc4, test_hll_add_size_bitmap);
+    tcase_add_test(tc4, test_hll_marks_dirty);
     tcase_add_test(tc4, test_hll_size);
     tcase_add_test(tc4, test_hll_error_bound);
     tcase_add_test(tc4, test_hll_precision_for_error);
     tcase_add_test(tc4, test_hll_error_for_precision);
     tcase_add_test(tc4, test_hll_bytes_for_precision);
+    tcase_add_test(tc4, test_hll_bytes_for_precision_byte);
+    tcase_add_test(tc4, test_hll_bytes_for_precision_nibble);
+    tcase_add_test(tc4, test_hll_format_name);
+    tcase_add_test(tc4, test_hll_ertl);
+    tcase_add_test(tc4, test_hll_estimator_name);
+    tcase_add_test(tc4, test_hll_hash);
+    tcase_add_test(tc4, test_hll_high_precision);
+    tcase_add_test(tc4, test_hll_byte_init_bitmap_bad_size);
+    tcase_add_test(tc4, test_hll_byte_error_bound);
+    tcase_add_test(tc4, test_hll_byte_matches_packed);
+    tcase_add_test(tc4, test_hll_byte_size_large_registers);
+    tcase_add_test(tc4, test_hll_nibble_matches_packed);
+    tcase_add_test(tc4, test_hll_nibble_rebase);
+    tcase_add_test(tc4, test_hll_sparse_matches_dense);
+    tcase_add_test(tc4, test_hll_sparse_convert);
+    tcase_add_test(tc4, test_hll_sparse_encode);
+    tcase_add_test(tc4, test_hll_cold_encode);
+    tcase_add_test(tc4, test_hll_union);
+    tcase_add_test(tc4, test_hll_union_sparse);
+    tcase_add_test(tc4, test_hll_register_entries);
+    tcase_add_test(tc4, test_hll_union_bad_precision);
+    tcase_add_test(tc4, test_hll_union_fold);
+    tcase_add_test(tc4, test_hll_scratch);
+    tcase_add_test(tc4, test_hll_add_hashes);
+    tcase_add_test(tc4, test_hll_kernels);
+    tcase_add_test(tc4, test_hll_add_changed);
+    tcase_add_test(tc4, test_hll_sum_state);
+    tcase_add_test(tc4, test_hll_concurrent_add);
+    tcase_add_test(tc4, test_hll_sliding);
+    tcase_add_test(tc4, test_hll_sliding_bounded);
+    tcase_add_test(tc4, test_hll_sliding_encode_union);
+    tcase_add_test(tc4, test_hll_fold);
 
     // Add the set tests
     suite_add_tcase(s1, tc5);
@@ -81,7 +220,24 @@ int main(void)
     tcase_add_test(tc5, test_set_init_proxied);
     tcase_add_test(tc5, test_set_add);
     tcase_add_test(tc5, test_set_restore);
+    tcase_add_test(tc5, test_set_restore_huge_pages);
+    tcase_add_test(tc5, test_set_slab);
+    tcase_add_test(tc5, test_set_fold);
+    tcase_add_test(tc5, test_set_cold_compress);
+    tcase_add_test(tc5, test_set_restore_byte_format);
+    tcase_add_test(tc5, test_set_sparse_restore);
+    tcase_add_test(tc5, test_set_sparse_convert);
+    tcase_add_test(tc5, test_set_high_precision_sparse);
+    tcase_add_test(tc5, test_set_add_batch);
+    tcase_add_test(tc5, test_set_add_hashes);
+    tcase_add_test(tc5, test_set_replication);
+    tcase_add_test(tc5, test_set_dump);
+    tcase_add_test(tc5, test_set_size_cached);
+    tcase_add_test(tc5, test_set_shadow_registers);
+    tcase_add_test(tc5, test_set_hot_logged_counts);
     tcase_add_test(tc5, test_set_flush);
+    tcase_add_test(tc5, test_set_register_trailer);
+    tcase_add_test(tc5, test_set_config_written_once);
     tcase_add_test(tc5, test_set_add_in_mem);
     tcase_add_test(tc5, test_set_page_out);
 
@@ -93,8 +249,13 @@ int main(void)
     tcase_add_test(tc6, test_mgr_create_double_drop);
     tcase_add_test(tc6, test_mgr_list);
     tcase_add_test(tc6, test_mgr_list_prefix);
+    tcase_add_test(tc6, test_mgr_iter_sets);
+    tcase_add_test(tc6, test_mgr_page_sets);
     tcase_add_test(tc6, test_mgr_list_no_sets);
     tcase_add_test(tc6, test_mgr_add_keys);
+    tcase_add_test(tc6, test_mgr_add_sized_keys);
+    tcase_add_test(tc6, test_mgr_add_keys_multi);
+    tcase_add_test(tc6, test_mgr_add_key_many);
     tcase_add_test(tc6, test_mgr_add_no_set);
     tcase_add_test(tc6, test_mgr_flush_no_set);
     tcase_add_test(tc6, test_mgr_flush);
@@ -107,10 +268,47 @@ int main(void)
     tcase_add_test(tc6, test_mgr_clear_reload);
     tcase_add_test(tc6, test_mgr_list_cold_no_sets);
     tcase_add_test(tc6, test_mgr_list_cold);
+    tcase_add_test(tc6, test_mgr_cool);
+    tcase_add_test(tc6, test_mgr_residency);
+    tcase_add_test(tc6, test_mgr_sizes_metadata);
+    tcase_add_test(tc6, test_mgr_prewarm);
+    tcase_add_test(tc6, test_mgr_archive);
+    tcase_add_test(tc6, test_mgr_list_lru);
     tcase_add_test(tc6, test_mgr_unmap_in_mem);
     tcase_add_test(tc6, test_mgr_create_custom_config);
     tcase_add_test(tc6, test_mgr_restore);
+    tcase_add_test(tc6, test_mgr_restore_many);
+    tcase_add_test(tc6, test_mgr_restore_manifest);
     tcase_add_test(tc6, test_mgr_callback);
+    tcase_add_test(tc6, test_mgr_merge);
+    tcase_add_test(tc6, test_mgr_merge_raw);
+    tcase_add_test(tc6, test_mgr_get_raw);
+    tcase_add_test(tc6, test_mgr_set_sizes);
+    tcase_add_test(tc6, test_mgr_auto_create);
+    tcase_add_test(tc6, test_mgr_create_sets);
+    tcase_add_test(tc6, test_mgr_data_dirs);
+    tcase_add_test(tc6, test_mgr_size_union_intersect);
+    tcase_add_test(tc6, test_mgr_jaccard);
+    tcase_add_test(tc6, test_mgr_size_union_remote);
+    tcase_add_test(tc6, test_mgr_page_in_async);
+    tcase_add_test(tc6, test_mgr_lookup_cache);
+    tcase_add_test(tc6, test_mgr_vacuum_wakeup);
+    tcase_add_test(tc6, test_mgr_client_slots);
+    tcase_add_test(tc6, test_mgr_set_stats);
+    tcase_add_test(tc6, test_mgr_dump_restore);
+    tcase_add_test(tc6, test_mgr_snapshot);
+    tcase_add_test(tc6, test_mgr_size_window);
+    tcase_add_test(tc6, test_mgr_size_sliding);
+    tcase_add_test(tc6, test_mgr_wal_replay);
+    tcase_add_test(tc6, test_mgr_slab);
+    tcase_add_test(tc6, test_mgr_fold);
+    tcase_add_test(tc6, test_mgr_read_only);
+    tcase_add_test(tc6, test_mgr_bind_handles);
+    tcase_add_test(tc6, test_mgr_expire_sets);
+    tcase_add_test(tc6, test_mgr_single_tree);
+    tcase_add_test(tc6, test_mgr_durability);
+    tcase_add_test(tc6, test_mgr_parallel_close);
+    tcase_add_test(tc6, test_mgr_create_async);
 
     // Add the art tests
     suite_add_tcase(s1, tc7);
@@ -121,7 +319,151 @@ int main(void)
     tcase_add_test(tc7, test_art_insert_delete);
     tcase_add_test(tc7, test_art_insert_iter);
     tcase_add_test(tc7, test_art_iter_prefix);
+    tcase_add_test(tc7, test_art_iter_after);
+    tcase_add_test(tc7, test_art_iter_high_bytes);
     tcase_add_test(tc7, test_art_insert_copy_delete);
+    tcase_add_test(tc7, test_art_pool_churn);
+    tcase_add_test(tc7, test_art_bulk_load);
+    tcase_add_test(tc7, test_art_cow);
+
+    // Add the manifest tests
+    suite_add_tcase(s1, tc8);
+    tcase_add_test(tc8, test_manifest_missing);
+    tcase_add_test(tc8, test_manifest_add_drop);
+    tcase_add_test(tc8, test_manifest_checkpoint);
+    tcase_add_test(tc8, test_manifest_corrupt);
+
+    // Add the epoch tests
+    suite_add_tcase(s1, tc9);
+    tcase_set_timeout(tc9, 3);
+    tcase_add_test(tc9, test_epoch_init_destroy);
+    tcase_add_test(tc9, test_epoch_checkpoint_idle_leave);
+    tcase_add_test(tc9, test_epoch_wait);
+
+    // Add the metrics tests
+    suite_add_tcase(s1, tc10);
+    tcase_add_test(tc10, test_metrics_init_destroy);
+    tcase_add_test(tc10, test_metrics_buckets);
+    tcase_add_test(tc10, test_metrics_percentile);
+    tcase_add_test(tc10, test_metrics_snapshot);
+    tcase_add_test(tc10, test_metrics_hot_sets);
+
+    // Add the slow log tests
+    suite_add_tcase(s1, tc11);
+    tcase_add_test(tc11, test_slowlog_init_destroy);
+    tcase_add_test(tc11, test_slowlog_parse_args);
+    tcase_add_test(tc11, test_slowlog_overflow_reset);
+    tcase_add_test(tc11, test_slowlog_phases);
+
+    // Add the replication log tests
+    suite_add_tcase(s1, tc12);
+    tcase_add_test(tc12, test_repl_fold);
+    tcase_add_test(tc12, test_repl_log_add_take);
+    tcase_add_test(tc12, test_repl_log_overflow);
+    tcase_add_test(tc12, test_repl_frame_encode_decode);
+    tcase_add_test(tc12, test_repl_page_digests);
+    tcase_add_test(tc12, test_repl_digests_encode_decode);
+
+    // Add the cluster tests
+    suite_add_tcase(s1, tc13);
+    tcase_add_test(tc13, test_cluster_disabled);
+    tcase_add_test(tc13, test_cluster_ring);
+    tcase_add_test(tc13, test_cluster_add_node);
+
+    // Add the remote tests
+    suite_add_tcase(s1, tc14);
+    tcase_add_test(tc14, test_remote_is_ref);
+    tcase_add_test(tc14, test_remote_cache);
+
+    // Add the window tests
+    suite_add_tcase(s1, tc15);
+    tcase_add_test(tc15, test_window_init_destroy);
+    tcase_add_test(tc15, test_window_rotate);
+    tcase_add_test(tc15, test_window_union);
+    tcase_add_test(tc15, test_window_encode_decode);
+
+    // Add the write-ahead log tests
+    suite_add_tcase(s1, tc16);
+    tcase_add_test(tc16, test_wal_append_replay);
+    tcase_add_test(tc16, test_wal_torn_record);
+    tcase_add_test(tc16, test_wal_rotate_trim);
+    tcase_add_test(tc16, test_wal_durability_sync);
+
+    // Add the slab tests
+    suite_add_tcase(s1, tc17);
+    tcase_add_test(tc17, test_slab_alloc_find);
+    tcase_add_test(tc17, test_slab_reuse_space);
+    tcase_add_test(tc17, test_slab_bitmap);
+    tcase_add_test(tc17, test_slab_preallocate);
+
+    // Add the big reader lock tests
+    suite_add_tcase(s1, tc18);
+    tcase_add_test(tc18, test_brlock_readers_writer);
+    tcase_add_test(tc18, test_brlock_reader_blocks_writer);
+
+    // Add the adaptive lock tests
+    suite_add_tcase(s1, tc29);
+    tcase_add_test(tc29, test_spinlock_exclusion);
+    tcase_add_test(tc29, test_spinlock_counters);
+
+    // Add the allocator tests
+    suite_add_tcase(s1, tc30);
+    tcase_add_test(tc30, test_alloc_stats);
+
+    // Add the worker placement tests
+    suite_add_tcase(s1, tc19);
+    tcase_add_test(tc19, test_parse_cpu_list);
+    tcase_add_test(tc19, test_pin_worker_thread);
+
+    // Add the io_uring tests
+    suite_add_tcase(s1, tc20);
+    tcase_add_test(tc20, test_uring_recv_send);
+    tcase_add_test(tc20, test_uring_full_queue);
+
+    // Add the clock tests
+    suite_add_tcase(s1, tc21);
+    tcase_add_test(tc21, test_clock_nsec);
+    tcase_add_test(tc21, test_clock_coarse);
+
+    // Add the ingest ring tests
+    suite_add_tcase(s1, tc22);
+    tcase_add_test(tc22, test_ingest_ring);
+
+    // Add the trash tests
+    suite_add_tcase(s1, tc23);
+    tcase_add_test(tc23, test_trash_move_empty);
+    tcase_add_test(tc23, test_trash_set_delete);
+
+    // Add the archive tests
+    suite_add_tcase(s1, tc24);
+    tcase_add_test(tc24, test_archive_put_get);
+    tcase_add_test(tc24, test_archive_torn_record);
+    tcase_add_test(tc24, test_archive_compact);
+
+    // Add the crc32c tests
+    suite_add_tcase(s1, tc25);
+    tcase_add_test(tc25, test_crc32c_vectors);
+    tcase_add_test(tc25, test_crc32c_kernels);
+
+    // Add the kmv tests
+    suite_add_tcase(s1, tc26);
+    tcase_add_test(tc26, test_kmv_init_destroy);
+    tcase_add_test(tc26, test_kmv_add_size);
+    tcase_add_test(tc26, test_kmv_union);
+    tcase_add_test(tc26, test_kmv_jaccard);
+    tcase_add_test(tc26, test_kmv_encode_decode);
+
+    // Add the client tests
+    suite_add_tcase(s1, tc27);
+    tcase_add_test(tc27, test_client_coalesce);
+    tcase_add_test(tc27, test_client_listing);
+    tcase_add_test(tc27, test_client_binary);
+    tcase_add_test(tc27, test_client_hashed);
+
+    // Add the embedding tests
+    suite_add_tcase(s1, tc28);
+    tcase_add_test(tc28, test_core_sets);
+    tcase_add_test(tc28, test_core_persist);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
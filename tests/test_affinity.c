@@ -0,0 +1,49 @@
+#include <check.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "affinity.h"
+
+START_TEST(test_parse_cpu_list)
+{
+    int cpus[16];
+    fail_unless(parse_cpu_list("0-3,8,10-11\n", cpus, 16) == 7);
+    fail_unless(cpus[0] == 0 && cpus[3] == 3 && cpus[4] == 8 && cpus[6] == 11);
+    fail_unless(parse_cpu_list("5", cpus, 16) == 1 && cpus[0] == 5);
+
+    // Nodes without cpus have an empty list
+    fail_unless(parse_cpu_list("\n", cpus, 16) == 0);
+
+    fail_unless(parse_cpu_list("3-1", cpus, 16) == -1);
+    fail_unless(parse_cpu_list("a", cpus, 16) == -1);
+    fail_unless(parse_cpu_list("1;2", cpus, 16) == -1);
+    fail_unless(parse_cpu_list("0-31", cpus, 16) == -1);
+}
+END_TEST
+
+static void* pin_core_main(void *in) {
+    int *cpus = in;
+    if (pin_worker_thread(WORKER_AFFINITY_CORE, 0) < 0) return NULL;
+#ifdef __linux__
+    cpu_set_t set;
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) *cpus = CPU_COUNT(&set);
+#endif
+    return NULL;
+}
+
+START_TEST(test_pin_worker_thread)
+{
+    // Unpinned workers are left alone
+    fail_unless(pin_worker_thread(WORKER_AFFINITY_NONE, 3) == 0);
+
+#ifdef __linux__
+    // A core pinned worker runs on one cpu
+    int cpus = 0;
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, pin_core_main, &cpus) == 0);
+    pthread_join(t, NULL);
+    fail_unless(cpus == 1);
+#endif
+}
+END_TEST
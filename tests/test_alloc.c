@@ -0,0 +1,30 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+
+START_TEST(test_alloc_stats)
+{
+    const char *name = alloc_name();
+    fail_unless(!strcmp(name, "libc") || !strcmp(name, "jemalloc") || !strcmp(name, "mimalloc"));
+
+    // A worker takes the same arena again
+    fail_unless(alloc_worker_arena(0) == 0);
+    fail_unless(alloc_worker_arena(3) == 0);
+    fail_unless(alloc_worker_arena(0) == 0);
+
+    // A large allocation shows in the totals
+    alloc_counters before, after;
+    if (alloc_stats(&before)) return;
+    fail_unless(before.rss > 0);
+    // Volatile, so that the allocation is not optimized out
+    char * volatile buf = malloc(16 * 1024 * 1024);
+    memset(buf, 1, 16 * 1024 * 1024);
+    fail_unless(alloc_stats(&after) == 0);
+    fail_unless(after.rss > before.rss);
+    fail_unless(after.mapped >= after.allocated || !after.allocated);
+    if (before.allocated)
+        fail_unless(after.allocated >= before.allocated + 16 * 1024 * 1024);
+    free(buf);
+}
+END_TEST
@@ -0,0 +1,177 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+#define ARCHIVE_TEST_DIR "/tmp/hlld_archive"
+
+static hlld_archive* open_test_archive() {
+    mkdir(ARCHIVE_TEST_DIR, 0755);
+    hlld_archive *archive;
+    fail_unless(init_archive(ARCHIVE_TEST_DIR, &archive) == 0);
+    return archive;
+}
+
+static void remove_test_archive(hlld_archive *archive) {
+    destroy_archive(archive);
+    char path[128];
+    for (int i=1; i < 8; i++) {
+        snprintf(path, sizeof(path), ARCHIVE_TEST_DIR "/archive.%d.data", i);
+        unlink(path);
+    }
+    rmdir(ARCHIVE_TEST_DIR);
+}
+
+static hlld_set_config archive_test_config(uint64_t size) {
+    hlld_set_config config;
+    memset(&config, 0, sizeof(config));
+    config.default_eps = 0.01625;
+    config.default_precision = 12;
+    config.format = HLL_PACKED;
+    config.sparse = 1;
+    config.size = size;
+    return config;
+}
+
+static void archived_cb(void *data, char *set_name, hlld_set_config *config) {
+    int *found = data;
+    if (!strcmp(set_name, "foo") && config->size == 200 && config->default_precision == 12)
+        found[0]++;
+    else
+        found[1]++;
+}
+
+START_TEST(test_archive_put_get)
+{
+    hlld_archive *archive = open_test_archive();
+    hlld_set_config config = archive_test_config(100);
+    unsigned char regs[300];
+    for (int i=0; i < 300; i++) regs[i] = i;
+
+    unsigned char *out;
+    uint64_t len;
+    fail_unless(archive_get(archive, "foo", &out, &len) == -ENOENT);
+    fail_unless(access(ARCHIVE_TEST_DIR "/archive.1.data", F_OK) != 0);
+    fail_unless(archive_put(archive, "foo", &config, regs, 100) == 0);
+    fail_unless(archive_put(archive, "bar", &config, regs, 300) == 0);
+    fail_unless(archive_contains(archive, "foo"));
+    fail_unless(archive_get(archive, "bar", &out, &len) == 0);
+    fail_unless(len == 300 && !memcmp(out, regs, 300));
+    free(out);
+
+    // A later record replaces the earlier one
+    config.size = 200;
+    fail_unless(archive_put(archive, "foo", &config, regs + 10, 50) == 0);
+    fail_unless(archive_drop(archive, "bar") == 0);
+    fail_unless(archive_drop(archive, "bar") == -ENOENT);
+    fail_unless(!archive_contains(archive, "bar"));
+
+    uint64_t sets, bytes, dead;
+    archive_usage(archive, &sets, &bytes, &dead);
+    fail_unless(sets == 1);
+    fail_unless(dead > 0 && dead < bytes);
+    destroy_archive(archive);
+
+    // The index is rebuilt from the file
+    archive = open_test_archive();
+    int found[2] = {0, 0};
+    fail_unless(archive_iter(archive, archived_cb, found) == 1);
+    fail_unless(found[0] == 1 && found[1] == 0);
+    fail_unless(archive_get(archive, "foo", &out, &len) == 0);
+    fail_unless(len == 50 && !memcmp(out, regs + 10, 50));
+    free(out);
+    fail_unless(archive_get(archive, "bar", &out, &len) == -ENOENT);
+    remove_test_archive(archive);
+}
+END_TEST
+
+START_TEST(test_archive_torn_record)
+{
+    hlld_archive *archive = open_test_archive();
+    hlld_set_config config = archive_test_config(200);
+    unsigned char regs[64];
+    memset(regs, 7, sizeof(regs));
+    fail_unless(archive_put(archive, "foo", &config, regs, sizeof(regs)) == 0);
+    destroy_archive(archive);
+
+    // Add half of a record, as a crash would
+    struct stat buf;
+    fail_unless(stat(ARCHIVE_TEST_DIR "/archive.1.data", &buf) == 0);
+    off_t whole = buf.st_size;
+    int fd = open(ARCHIVE_TEST_DIR "/archive.1.data", O_WRONLY|O_APPEND);
+    fail_unless(fd >= 0);
+    fail_unless(write(fd, regs, 20) == 20);
+    close(fd);
+
+    // The torn record is truncated, and appends follow the last whole one
+    archive = open_test_archive();
+    fail_unless(stat(ARCHIVE_TEST_DIR "/archive.1.data", &buf) == 0);
+    fail_unless(buf.st_size == whole);
+    fail_unless(archive_put(archive, "bar", &config, regs, 10) == 0);
+    destroy_archive(archive);
+
+    archive = open_test_archive();
+    fail_unless(archive_contains(archive, "foo"));
+    fail_unless(archive_contains(archive, "bar"));
+
+    // A corrupt register record is not returned
+    destroy_archive(archive);
+    fd = open(ARCHIVE_TEST_DIR "/archive.1.data", O_WRONLY);
+    fail_unless(pwrite(fd, "x", 1, whole - 1) == 1);
+    close(fd);
+    archive = open_test_archive();
+    unsigned char *out;
+    uint64_t len;
+    fail_unless(archive_get(archive, "foo", &out, &len) == -EINVAL);
+    fail_unless(archive_get(archive, "bar", &out, &len) == 0);
+    free(out);
+    remove_test_archive(archive);
+}
+END_TEST
+
+START_TEST(test_archive_compact)
+{
+    hlld_archive *archive = open_test_archive();
+    hlld_set_config config = archive_test_config(200);
+    unsigned char regs[1000];
+    memset(regs, 3, sizeof(regs));
+    fail_unless(archive_put(archive, "foo", &config, regs, 1000) == 0);
+    fail_unless(archive_put(archive, "bar", &config, regs, 1000) == 0);
+
+    // Files without enough dead records are left alone
+    uint64_t reclaimed;
+    fail_unless(archive_compact(archive, 0.5, &reclaimed) == 0);
+    fail_unless(reclaimed == 0);
+
+    fail_unless(archive_put(archive, "foo", &config, regs, 10) == 0);
+    fail_unless(archive_drop(archive, "bar") == 0);
+    fail_unless(archive_compact(archive, 0.5, &reclaimed) == 1);
+    fail_unless(reclaimed > 2000);
+    fail_unless(access(ARCHIVE_TEST_DIR "/archive.1.data", F_OK) != 0);
+
+    // Only the live record is left
+    uint64_t sets, bytes, dead;
+    archive_usage(archive, &sets, &bytes, &dead);
+    fail_unless(sets == 1);
+    fail_unless(dead == 0);
+    fail_unless(bytes < 100);
+    fail_unless(archive_compact(archive, 0, &reclaimed) == 0);
+    destroy_archive(archive);
+
+    archive = open_test_archive();
+    int found[2] = {0, 0};
+    fail_unless(archive_iter(archive, archived_cb, found) == 1);
+    fail_unless(found[0] == 1);
+    unsigned char *out;
+    uint64_t len;
+    fail_unless(archive_get(archive, "foo", &out, &len) == 0);
+    fail_unless(len == 10);
+    free(out);
+    remove_test_archive(archive);
+}
+END_TEST
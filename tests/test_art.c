@@ -325,6 +325,103 @@ START_TEST(test_art_iter_prefix)
 }
 END_TEST
 
+typedef struct {
+    int next;
+    int stop;
+} after_data;
+
+static int test_after_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    after_data *a = data;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "set.%04d", a->next);
+    fail_unless(k_len == strlen(buf)+1 && !memcmp(k, buf, k_len));
+    fail_unless((uintptr_t)val == (uintptr_t)a->next + 1);
+    a->next++;
+    return a->next == a->stop;
+}
+
+START_TEST(test_art_iter_after)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Enough keys to grow every node type
+    char buf[32];
+    for (uintptr_t i=0; i < 2000; i++) {
+        snprintf(buf, sizeof(buf), "set.%04d", (int)i);
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, strlen(buf)+1, (void*)(i+1)));
+    }
+
+    // Start after a key in the tree
+    after_data a = {500, 0};
+    fail_unless(!art_iter_after(&t, (unsigned char*)"set.0499", 9, test_after_cb, &a));
+    fail_unless(a.next == 2000);
+
+    // Start after a key that is not in the tree
+    after_data a2 = {1500, 0};
+    fail_unless(!art_iter_after(&t, (unsigned char*)"set.1499x", 10, test_after_cb, &a2));
+    fail_unless(a2.next == 2000);
+
+    // A prefix without the terminator starts at its first key
+    after_data a3 = {1200, 0};
+    fail_unless(!art_iter_after(&t, (unsigned char*)"set.12", 6, test_after_cb, &a3));
+    fail_unless(a3.next == 2000);
+
+    // The callback stops the iteration
+    after_data a4 = {0, 10};
+    fail_unless(art_iter_after(&t, (unsigned char*)"", 0, test_after_cb, &a4) == 1);
+    fail_unless(a4.next == 10);
+
+    // Nothing is after the last key
+    after_data a5 = {0, 0};
+    fail_unless(!art_iter_after(&t, (unsigned char*)"set.1999", 9, test_after_cb, &a5));
+    fail_unless(!art_iter_after(&t, (unsigned char*)"z", 1, test_after_cb, &a5));
+    fail_unless(a5.next == 0);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int test_order_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)val;
+    int *last = data;
+    fail_unless(k_len == 3);
+    fail_unless((int)k[1] > *last);
+    *last = k[1];
+    return 0;
+}
+
+START_TEST(test_art_iter_high_bytes)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Bytes past 0x7f order after the others, in a node16 and after
+    unsigned char bytes[] = {0x80, 0x10, 0xff, 0x41, 0x7f, 0xc3, 0x01, 0x9a,
+        0x30, 0xe2, 0x5f, 0x81, 0x20, 0xfe, 0x7e, 0xb0, 0x02, 0xd0, 0x60};
+    for (int n=12; n <= 19; n += 7) {
+        for (int i=0; i < n; i++) {
+            unsigned char key[] = {'a', bytes[i], 0};
+            art_insert(&t, key, 3, &t);
+        }
+        int last = -1;
+        fail_unless(!art_iter(&t, test_order_cb, &last));
+        for (int i=0; i < n; i++) {
+            unsigned char key[] = {'a', bytes[i], 0};
+            fail_unless(art_search(&t, key, 3) == &t);
+            unsigned char miss[] = {'b', bytes[i], 0};
+            fail_unless(art_search(&t, miss, 3) == NULL);
+        }
+    }
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_art_insert_copy_delete)
 {
     art_tree t;
@@ -384,3 +481,192 @@ START_TEST(test_art_insert_copy_delete)
 }
 END_TEST
 
+
+START_TEST(test_art_pool_churn)
+{
+    art_tree t;
+    fail_unless(init_art_tree(&t) == 0);
+
+    // Keys grow nodes to a node256, some leaves above the size classes
+    char buf[1024];
+    for (int round=0; round < 3; round++) {
+        for (uintptr_t i=0; i < 2000; i++) {
+            int len = snprintf(buf, sizeof(buf), "%03d.%d", (int)(i % 300), (int)i);
+            if (i % 100 == 0) {
+                memset(buf + len, 'x', 700);
+                len += 700;
+                buf[len] = '\0';
+            }
+            fail_unless(art_insert(&t, (unsigned char*)buf, len+1, (void*)(i+1)) == NULL);
+        }
+        fail_unless(art_size(&t) == 2000);
+
+        // A copy shares the leaves, and keeps them when the original drops them
+        art_tree t2;
+        fail_unless(art_copy(&t2, &t) == 0);
+        for (uintptr_t i=0; i < 2000; i++) {
+            int len = snprintf(buf, sizeof(buf), "%03d.%d", (int)(i % 300), (int)i);
+            if (i % 100 == 0) {
+                memset(buf + len, 'x', 700);
+                len += 700;
+                buf[len] = '\0';
+            }
+            fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len+1) == i+1);
+            fail_unless((uintptr_t)art_search(&t2, (unsigned char*)buf, len+1) == i+1);
+        }
+        fail_unless(art_size(&t) == 0);
+        fail_unless(art_size(&t2) == 2000);
+        fail_unless(destroy_art_tree(&t2) == 0);
+    }
+    fail_unless(destroy_art_tree(&t) == 0);
+}
+END_TEST
+
+// Formats the key of a copy-on-write test, some with long shared prefixes
+static int test_cow_key(char *buf, uintptr_t i) {
+    if (i % 7 == 0)
+        return snprintf(buf, 64, "shared-prefix-longer-than-a-node-%d", (int)i) + 1;
+    return snprintf(buf, 64, "%03d.%d", (int)(i % 300), (int)i) + 1;
+}
+
+START_TEST(test_art_cow)
+{
+    art_tree t;
+    fail_unless(init_art_tree(&t) == 0);
+    char buf[64];
+    for (uintptr_t i=0; i < 2000; i++) {
+        int len = test_cow_key(buf, i);
+        fail_unless(art_insert(&t, (unsigned char*)buf, len, (void*)(i+1)) == NULL);
+    }
+
+    // Drop the odd keys, update every third, and add new ones
+    art_cow cow;
+    art_cow_begin(&t, &cow);
+    for (uintptr_t i=0; i < 3000; i++) {
+        int len = test_cow_key(buf, i);
+        if (i >= 2000)
+            fail_unless(art_cow_insert(&t, &cow, (unsigned char*)buf, len, (void*)(i+1)) == NULL);
+        else if (i % 2)
+            fail_unless((uintptr_t)art_cow_delete(&t, &cow, (unsigned char*)buf, len) == i+1);
+        else if (i % 3 == 0)
+            fail_unless((uintptr_t)art_cow_insert(&t, &cow, (unsigned char*)buf, len, (void*)(i+10000)) == i+1);
+    }
+    fail_unless(art_cow_delete(&t, &cow, (unsigned char*)"missing", 8) == NULL);
+
+    // Readers see none of the batch until it is published
+    uint64_t out[] = {0, 0};
+    fail_unless(art_size(&t) == 2000);
+    fail_unless(art_iter(&t, iter_cb, &out) == 0);
+    fail_unless(out[0] == 2000);
+    for (uintptr_t i=0; i < 3000; i++) {
+        int len = test_cow_key(buf, i);
+        void *val = art_search(&t, (unsigned char*)buf, len);
+        fail_unless((uintptr_t)val == ((i < 2000) ? i+1 : 0));
+    }
+
+    // A reader holding the old root keeps the old version
+    art_tree old = t;
+    art_cow_publish(&t, &cow);
+    fail_unless(art_size(&t) == 2000);
+    for (uintptr_t i=0; i < 3000; i++) {
+        int len = test_cow_key(buf, i);
+        uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+        if (i >= 2000) fail_unless(val == i+1);
+        else if (i % 2) fail_unless(val == 0);
+        else if (i % 3 == 0) fail_unless(val == i+10000);
+        else fail_unless(val == i+1);
+        val = (uintptr_t)art_search(&old, (unsigned char*)buf, len);
+        fail_unless(val == ((i < 2000) ? i+1 : 0));
+    }
+    art_reclaim(&t, cow.retired, cow.num_retired);
+
+    // Empty the tree in a second batch
+    art_cow_begin(&t, &cow);
+    for (uintptr_t i=0; i < 3000; i++) {
+        int len = test_cow_key(buf, i);
+        art_cow_delete(&t, &cow, (unsigned char*)buf, len);
+    }
+    art_cow_publish(&t, &cow);
+    art_reclaim(&t, cow.retired, cow.num_retired);
+    fail_unless(art_size(&t) == 0);
+    fail_unless(art_minimum(&t) == NULL);
+    fail_unless(destroy_art_tree(&t) == 0);
+}
+END_TEST
+
+static int test_bulk_cmp(const void *a, const void *b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+static int test_bulk_iter_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    char ***next = data;
+    fail_unless(k_len == strlen(**next) + 1);
+    fail_unless(!strcmp((char*)k, **next));
+    fail_unless(val == **next);
+    (*next)++;
+    return 0;
+}
+
+START_TEST(test_art_bulk_load)
+{
+    // Narrow and wide fan outs, and prefixes longer than a node holds
+    char *names[2600];
+    int n = 0;
+    char buf[64];
+    for (int i=0; i < 2000; i++) {
+        snprintf(buf, sizeof(buf), "set.%04d", i);
+        names[n++] = strdup(buf);
+    }
+    for (int c=1; c < 256; c++) {
+        snprintf(buf, sizeof(buf), "wide.%c", c);
+        names[n++] = strdup(buf);
+    }
+    for (int i=0; i < 30; i++) {
+        snprintf(buf, sizeof(buf), "campaign.2026-10-%02d.clicks", i);
+        names[n++] = strdup(buf);
+    }
+    qsort(names, n, sizeof(char*), test_bulk_cmp);
+
+    unsigned char *keys[2600];
+    int key_lens[2600];
+    for (int i=0; i < n; i++) {
+        keys[i] = (unsigned char*)names[i];
+        key_lens[i] = strlen(names[i]) + 1;
+    }
+
+    art_tree t;
+    fail_unless(init_art_tree(&t) == 0);
+
+    // Keys out of order, or repeated, are refused
+    unsigned char *swapped[] = {keys[1], keys[0]};
+    int swapped_lens[] = {key_lens[1], key_lens[0]};
+    fail_unless(art_bulk_load(&t, swapped, swapped_lens, (void**)names, 2) == -1);
+    unsigned char *repeated[] = {keys[0], keys[0]};
+    fail_unless(art_bulk_load(&t, repeated, key_lens, (void**)names, 2) == -1);
+
+    fail_unless(art_bulk_load(&t, keys, key_lens, (void**)names, n) == 0);
+    fail_unless(art_size(&t) == (uint64_t)n);
+    fail_unless(art_bulk_load(&t, keys, key_lens, (void**)names, n) == -1);
+
+    // The tree iterates in order and finds every key
+    char **next = names;
+    fail_unless(art_iter(&t, test_bulk_iter_cb, &next) == 0);
+    fail_unless(next == names + n);
+    for (int i=0; i < n; i++) {
+        fail_unless(art_search(&t, keys[i], key_lens[i]) == names[i]);
+    }
+    fail_unless(art_search(&t, (unsigned char*)"set.00", 7) == NULL);
+    fail_unless(art_search(&t, (unsigned char*)"campaign.2026-10-01.views", 26) == NULL);
+
+    // The nodes grow and shrink like inserted ones
+    fail_unless(art_insert(&t, (unsigned char*)"set.00", 7, names[0]) == NULL);
+    for (int i=0; i < n; i++) {
+        fail_unless(art_delete(&t, keys[i], key_lens[i]) == names[i]);
+    }
+    fail_unless(art_size(&t) == 1);
+    fail_unless(art_search(&t, (unsigned char*)"set.00", 7) == names[0]);
+
+    fail_unless(destroy_art_tree(&t) == 0);
+    for (int i=0; i < n; i++) free(names[i]);
+}
+END_TEST
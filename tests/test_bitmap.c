@@ -2,11 +2,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include "bitmap.h"
+#include "iobatch.h"
 
 /*
 hlld_bitmap *bitmap_from_file(int fileno, size_t len) {
@@ -84,6 +86,26 @@ START_TEST(make_bitmap_nofile_create_persistent)
 }
 END_TEST
 
+START_TEST(make_bitmap_nofile_create_preallocate)
+{
+    hlld_bitmap map;
+    unlink("/tmp/mmap_nofile_create_prealloc");
+    int res = bitmap_from_filename("/tmp/mmap_nofile_create_prealloc", 65536, 1,
+            PERSISTENT | PREALLOCATE, &map);
+    fail_unless(res == 0);
+    fail_unless(map.mode == PERSISTENT);
+
+    // The blocks of the file are allocated, and it is still zero
+    struct stat buf;
+    fail_unless(stat("/tmp/mmap_nofile_create_prealloc", &buf) == 0);
+    fail_unless(buf.st_size == 65536);
+    fail_unless(buf.st_blocks * 512 >= 65536);
+    for (int i=0; i < 65536 * 8; i += 997) fail_unless(bitmap_getbit(&map, i) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_nofile_create_prealloc");
+}
+END_TEST
+
 
 /*
  * int bitmap_flush(hlld_bitmap *map) {
@@ -407,6 +429,171 @@ START_TEST(flush_does_write_persist) {
 }
 END_TEST
 
+START_TEST(cool_bitmap) {
+    hlld_bitmap map;
+    unlink("/tmp/mmap_cool_bitmap");
+    int res = bitmap_from_filename("/tmp/mmap_cool_bitmap", 3 * 4096, 1, SHARED, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 3 * 4096 * 8; idx += 5) bitmap_setbit((&map), idx);
+    fail_unless(bitmap_flush(&map) == 0);
+
+    // The registers are read back in after their pages are reclaimed
+    fail_unless(bitmap_cool(&map) == 0);
+    for (int idx = 0; idx < 3 * 4096 * 8; idx++)
+        fail_unless(bitmap_getbit(&map, idx) == !(idx % 5));
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_cool_bitmap");
+
+    // Anonymous memory has no file to read back from
+    res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_cool(&map) == -EINVAL);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(sample_bitmap_residency) {
+    hlld_bitmap map;
+    uint64_t resident, faults;
+    int res = bitmap_from_file(-1, 16 * 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+
+    // The first sample has nothing to compare to
+    fail_unless(bitmap_sample_residency(&map, &resident, &faults) == 0);
+    fail_unless(resident <= 16 * 4096);
+    fail_unless(faults == 0);
+
+    // Writing each page faults in those that were not resident
+    uint64_t before = resident;
+    for (int idx = 0; idx < 16 * 4096 * 8; idx += 4096 * 8) bitmap_setbit((&map), idx);
+    fail_unless(bitmap_sample_residency(&map, &resident, &faults) == 0);
+    fail_unless(resident == 16 * 4096);
+    fail_unless(faults == (16 * 4096 - before) / 4096);
+    fail_unless(bitmap_sample_residency(&map, &resident, &faults) == 0);
+    fail_unless(faults == 0);
+
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(map.resident == NULL);
+    fail_unless(bitmap_sample_residency(&map, &resident, &faults) == -EINVAL);
+}
+END_TEST
+
+START_TEST(flush_does_write_persist_direct) {
+    // A partial last page is not aligned, so it goes through the cache
+    uint64_t lens[] = {3 * 4096, 4096 + 100};
+    for (int i=0; i < 2; i++) {
+        unlink("/tmp/persist_flush_direct");
+        hlld_bitmap map;
+        int res = bitmap_from_filename("/tmp/persist_flush_direct", lens[i], 1,
+                PERSISTENT | DIRECT_IO, &map);
+        fail_unless(res == 0);
+        fail_unless(map.mode == PERSISTENT);
+        for (uint64_t idx = 0; idx < lens[i] * 8; idx += 3) bitmap_setbit((&map), idx);
+        fail_unless(bitmap_flush(&map) == 0);
+        fail_unless(bitmap_close(&map) == 0);
+        fail_unless(map.direct_fd == -1);
+
+        // Read back around the page cache
+        hlld_bitmap map2;
+        res = bitmap_from_filename("/tmp/persist_flush_direct", lens[i], 0,
+                PERSISTENT | DIRECT_IO, &map2);
+        fail_unless(res == 0);
+        for (uint64_t idx = 0; idx < lens[i] * 8; idx++)
+            fail_unless(bitmap_getbit(&map2, idx) == !(idx % 3));
+        fail_unless(bitmap_close(&map2) == 0);
+    }
+    unlink("/tmp/persist_flush_direct");
+}
+END_TEST
+
+START_TEST(flush_skips_clean_pages_persist) {
+    hlld_bitmap map;
+    unlink("/tmp/persist_flush_clean");
+    int res = bitmap_from_filename("/tmp/persist_flush_clean", 3 * 4096, 1,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(map.dirty[0] == 0);
+
+    // Change the file behind the bitmap
+    int fh = open("/tmp/persist_flush_clean", O_RDWR);
+    unsigned char page[4096];
+    memset(page, 0xaa, sizeof(page));
+    fail_unless(pwrite(fh, page, 4096, 4096) == 4096);
+    fail_unless(pwrite(fh, page, 4096, 2 * 4096) == 4096);
+
+    // Only the pages that were set are written
+    bitmap_setbit((&map), 0);
+    map.mmap[2 * 4096 + 5] = 1;
+    bitmap_mark_dirty(&map, 2 * 4096 + 5);
+    fail_unless(map.dirty[0] == 5);
+    fail_unless(map.num_dirty == 2);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(map.dirty[0] == 0);
+    fail_unless(map.num_dirty == 0);
+    // A ring submits both writes and the sync at once
+    fail_unless(map.flush_syscalls == (iobatch_use_uring(1) ? 1 : 3));
+    fail_unless(map.flush_bytes == 2 * 4096);
+    fail_unless(map.flush_clean_pages == 1);
+
+    fail_unless(pread(fh, page, 4096, 0) == 4096);
+    fail_unless(page[0] == 128);
+    fail_unless(pread(fh, page, 4096, 4096) == 4096);
+    fail_unless(page[0] == 0xaa);
+    fail_unless(pread(fh, page, 4096, 2 * 4096) == 4096);
+    fail_unless(page[0] == 0 && page[5] == 1);
+
+    // Ranges mark every page they touch
+    bitmap_mark_range(&map, 4095, 2);
+    bitmap_mark_range(&map, 0, 1);
+    fail_unless(map.dirty[0] == 3);
+    fail_unless(map.num_dirty == 2);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(pread(fh, page, 4096, 4096) == 4096);
+    fail_unless(page[0] == 0);
+    close(fh);
+    unlink("/tmp/persist_flush_clean");
+}
+END_TEST
+
+START_TEST(flush_merges_runs) {
+    bitmap_mode modes[] = {PERSISTENT, SHARED};
+    for (int m=0; m < 2; m++) {
+        hlld_bitmap map;
+        unlink("/tmp/flush_merges_runs");
+        int res = bitmap_from_filename("/tmp/flush_merges_runs", 4 * 4096 + 100, 1,
+                modes[m], &map);
+        fail_unless(res == 0);
+
+        // Nothing to write but the sync
+        fail_unless(bitmap_flush(&map) == 0);
+        fail_unless(map.flush_syscalls == 1);
+        fail_unless(map.flush_bytes == 0);
+        fail_unless(map.flush_clean_pages == 5);
+
+        // Adjacent pages are written together, up to the partial last page
+        bitmap_setbit((&map), 0);
+        bitmap_setbit((&map), 8 * 4096);
+        bitmap_setbit((&map), 8 * (3 * 4096));
+        bitmap_setbit((&map), 8 * (4 * 4096 + 99));
+        fail_unless(bitmap_flush(&map) == 0);
+        int batched = (modes[m] == PERSISTENT && iobatch_use_uring(1));
+        fail_unless(map.flush_syscalls == (batched ? 1 : 3));
+        fail_unless(map.flush_bytes == 2 * 4096 + 4096 + 100);
+        fail_unless(bitmap_close(&map) == 0);
+
+        res = bitmap_from_filename("/tmp/flush_merges_runs", 4 * 4096 + 100, 0,
+                PERSISTENT, &map);
+        fail_unless(res == 0);
+        fail_unless(bitmap_getbit((&map), 0) == 1);
+        fail_unless(bitmap_getbit((&map), 8 * 4096) == 1);
+        fail_unless(bitmap_getbit((&map), 8 * (3 * 4096)) == 1);
+        fail_unless(bitmap_getbit((&map), 8 * (4 * 4096 + 99)) == 1);
+        fail_unless(bitmap_close(&map) == 0);
+        unlink("/tmp/flush_merges_runs");
+    }
+}
+END_TEST
+
 START_TEST(close_does_flush_persist) {
     hlld_bitmap map;
     int res = bitmap_from_filename("/tmp/persist_close_flush", 4096, 1,
@@ -428,3 +615,138 @@ START_TEST(close_does_flush_persist) {
 }
 END_TEST
 
+START_TEST(huge_pages_anonymous) {
+    // Small bitmaps of a size are packed into one arena
+    hlld_bitmap a, b, c;
+    fail_unless(bitmap_from_file(-1, 6000, ANONYMOUS | HUGE_PAGES, &a) == 0);
+    fail_unless(bitmap_from_file(-1, 6000, ANONYMOUS | HUGE_PAGES, &b) == 0);
+    fail_unless(a.huge && b.huge);
+    fail_unless(b.mmap == a.mmap + 8192 || a.mmap == b.mmap + 8192);
+    memset(a.mmap, 0xff, a.size);
+
+    // Freed slots are reused, and are cleared first
+    unsigned char *slot = a.mmap;
+    fail_unless(bitmap_close(&a) == 0);
+    fail_unless(bitmap_from_file(-1, 6000, ANONYMOUS | HUGE_PAGES, &c) == 0);
+    fail_unless(c.mmap == slot);
+    for (int i=0; i < 6000; i++) fail_unless(c.mmap[i] == 0);
+    fail_unless(bitmap_close(&b) == 0);
+    fail_unless(bitmap_close(&c) == 0);
+
+    // Bitmaps of a huge page or more start on a huge page
+    fail_unless(bitmap_from_file(-1, BITMAP_HUGE_PAGE_SIZE + 1, ANONYMOUS | HUGE_PAGES, &a) == 0);
+    fail_unless(a.huge);
+    fail_unless(((uintptr_t)a.mmap % BITMAP_HUGE_PAGE_SIZE) == 0);
+    a.mmap[BITMAP_HUGE_PAGE_SIZE] = 1;
+    fail_unless(bitmap_close(&a) == 0);
+
+    // Shared maps are backed by the file
+    int fd = open("/tmp/huge_shared", O_RDWR | O_CREAT, 0644);
+    fail_unless(ftruncate(fd, 4096) == 0);
+    fail_unless(bitmap_from_file(fd, 4096, SHARED | HUGE_PAGES, &a) == 0);
+    fail_unless(!a.huge);
+    fail_unless(bitmap_close(&a) == 0);
+    close(fd);
+    unlink("/tmp/huge_shared");
+}
+END_TEST
+
+START_TEST(huge_pages_persistent) {
+    hlld_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_huge", 12288, 1,
+            PERSISTENT | HUGE_PAGES, &map);
+    fail_unless(res == 0);
+    fail_unless(map.huge);
+    for (int idx = 0; idx < 12288*8 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+
+    // The registers are read back into a slot
+    res = bitmap_from_filename("/tmp/persist_huge", 12288, 0,
+            PERSISTENT | HUGE_PAGES, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 12288; idx++) {
+        fail_unless(map.mmap[idx] == 255);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/persist_huge");
+}
+END_TEST
+
+START_TEST(read_only_sees_writes) {
+    hlld_bitmap map, ro;
+    fail_unless(bitmap_from_filename("/tmp/mmap_read_only", 8192, 0, READ_ONLY, &ro) < 0);
+    fail_unless(bitmap_from_filename("/tmp/mmap_read_only", 8192, 1, READ_ONLY, &ro) == -EINVAL);
+    int res = bitmap_from_filename("/tmp/mmap_read_only", 8192, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+    res = bitmap_from_filename("/tmp/mmap_read_only", 8192, 0, READ_ONLY, &ro);
+    fail_unless(res == 0);
+    fail_unless(ro.dirty == NULL);
+
+    // Flushed pages of the writer are seen without a copy
+    map.mmap[5000] = 0x5a;
+    bitmap_mark_dirty(&map, 5000);
+    fail_unless(ro.mmap[5000] == 0);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(ro.mmap[5000] == 0x5a);
+
+    fail_unless(bitmap_flush(&ro) == 0);
+    fail_unless(bitmap_close(&ro) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_read_only");
+}
+END_TEST
+
+
+START_TEST(iobatch_write_read) {
+    int len = 600000;
+    unsigned char *buf = malloc(len), *out = malloc(len + 1000);
+    for (int i=0; i < len; i++) buf[i] = i % 251;
+
+    for (int ring=1; ring >= 0; ring--) {
+        int batched = iobatch_use_uring(ring);
+        unlink("/tmp/iobatch_write_read");
+        int fh = open("/tmp/iobatch_write_read", O_RDWR|O_CREAT, 0644);
+        fail_unless(fh >= 0);
+
+        // Write out of order, with ranges bigger than a read chunk
+        iobatch_range ranges[] = {
+            {buf + 300000, 300000, 300000},
+            {buf, 100, 0},
+            {buf + 100, 299900, 100},
+        };
+        uint64_t syscalls = 0;
+        fail_unless(iobatch_write(fh, ranges, 3, 1, &syscalls) == 0);
+        fail_unless(syscalls == (uint64_t)(batched ? 1 : 4));
+
+        // Reads stop at the end of the file
+        memset(out, 0, len + 1000);
+        fail_unless(iobatch_read(fh, out, len + 1000, NULL) == len);
+        fail_unless(memcmp(buf, out, len) == 0);
+        fail_unless(iobatch_read(fh, out, 10, NULL) == 10);
+
+        // Nothing to write but the sync
+        syscalls = 0;
+        fail_unless(iobatch_write(fh, NULL, 0, 1, &syscalls) == 0);
+        fail_unless(syscalls == 1);
+        close(fh);
+    }
+    iobatch_use_uring(1);
+    free(buf);
+    free(out);
+    unlink("/tmp/iobatch_write_read");
+}
+END_TEST
+
+START_TEST(iobatch_bad_fd) {
+    unsigned char buf[100];
+    iobatch_range range = {buf, 100, 0};
+    for (int ring=1; ring >= 0; ring--) {
+        iobatch_use_uring(ring);
+        fail_unless(iobatch_write(-1, &range, 1, 1, NULL) == -EBADF);
+        fail_unless(iobatch_read(-1, buf, 100, NULL) == -EBADF);
+    }
+    iobatch_use_uring(1);
+}
+END_TEST
@@ -0,0 +1,93 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "brlock.h"
+
+/*
+ * Shared by readers checking that a writer is
+ * never seen part way through an update
+ */
+typedef struct {
+    hlld_brlock lock;
+    volatile int a;
+    volatile int b;
+    volatile int done;
+    volatile int torn;
+} brlock_state;
+
+static void* brlock_reader_main(void *in) {
+    brlock_state *s = in;
+    while (!s->done) {
+        brlock_rdlock(&s->lock);
+        if (s->a != s->b) s->torn = 1;
+        brlock_rdunlock(&s->lock);
+    }
+    return NULL;
+}
+
+static void* brlock_writer_main(void *in) {
+    brlock_state *s = in;
+    brlock_wrlock(&s->lock);
+    s->a++;
+    s->b++;
+    brlock_wrunlock(&s->lock);
+    return NULL;
+}
+
+START_TEST(test_brlock_readers_writer)
+{
+    brlock_state s;
+    brlock_init(&s.lock);
+    s.a = s.b = s.done = s.torn = 0;
+
+    pthread_t readers[4];
+    for (int i=0; i < 4; i++)
+        fail_unless(pthread_create(&readers[i], NULL, brlock_reader_main, &s) == 0);
+
+    // Writers exclude the readers
+    for (int i=0; i < 200; i++) {
+        brlock_wrlock(&s.lock);
+        s.a++;
+        usleep(10);
+        s.b++;
+        brlock_wrunlock(&s.lock);
+    }
+    s.done = 1;
+    for (int i=0; i < 4; i++) pthread_join(readers[i], NULL);
+    fail_unless(!s.torn);
+    fail_unless(s.a == 200 && s.b == 200);
+    brlock_destroy(&s.lock);
+}
+END_TEST
+
+START_TEST(test_brlock_reader_blocks_writer)
+{
+    brlock_state s;
+    brlock_init(&s.lock);
+    s.a = s.b = s.done = s.torn = 0;
+
+    // A reader may take the lock again while it holds it
+    brlock_rdlock(&s.lock);
+    brlock_rdlock(&s.lock);
+
+    pthread_t writer;
+    fail_unless(pthread_create(&writer, NULL, brlock_writer_main, &s) == 0);
+    usleep(20000);
+    fail_unless(s.a == 0);
+    brlock_rdunlock(&s.lock);
+    usleep(20000);
+    fail_unless(s.a == 0);
+
+    // The writer proceeds once the last read is released
+    brlock_rdunlock(&s.lock);
+    pthread_join(writer, NULL);
+    fail_unless(s.a == 1);
+
+    // And readers proceed once it is done
+    brlock_rdlock(&s.lock);
+    fail_unless(s.b == 1);
+    brlock_rdunlock(&s.lock);
+    brlock_destroy(&s.lock);
+}
+END_TEST
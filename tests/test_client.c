@@ -0,0 +1,206 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../client/hlld_client.h"
+#include "hll_hash.h"
+
+/*
+ * The replies seen by the callbacks, in order
+ */
+typedef struct {
+    int num;
+    hlld_status status[16];
+    char reply[16][64];
+} client_replies;
+
+static void record_reply(void *data, hlld_status status, const char *reply, int reply_len) {
+    client_replies *r = data;
+    r->status[r->num] = status;
+    if (reply_len > 63) reply_len = 63;
+    if (reply) memcpy(r->reply[r->num], reply, reply_len);
+    r->reply[r->num][(reply) ? reply_len : 0] = '\0';
+    r->num++;
+}
+
+/*
+ * Connects a client to our end of a socket pair, which
+ * plays the server
+ */
+static hlld_client* pair_client(int binary, int max_batch, int *server) {
+    int fds[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    hlld_client_opts opts;
+    hlld_client_default_opts(&opts);
+    opts.binary = binary;
+    opts.max_batch = max_batch;
+    hlld_client *c;
+    fail_unless(hlld_client_attach(fds, 1, &opts, &c) == 0);
+    *server = fds[1];
+    return c;
+}
+
+// Reads exactly len bytes from the server end
+static void read_server(int fd, char *buf, int len) {
+    int got = 0;
+    while (got < len) {
+        int n = read(fd, buf + got, len - got);
+        fail_unless(n > 0);
+        got += n;
+    }
+    buf[got] = '\0';
+}
+
+static void write_server(int fd, const char *buf, int len) {
+    fail_unless(write(fd, buf, len) == len);
+}
+
+START_TEST(test_client_coalesce)
+{
+    int server;
+    hlld_client *c = pair_client(0, 3, &server);
+    client_replies r;
+    memset(&r, 0, sizeof(r));
+
+    // Keys of a set are sent as one bulk command once it is full,
+    // or the client is flushed, ahead of others for the connection
+    fail_unless(hlld_client_set(c, "foo", "k1", 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_set(c, "foo", "k2", 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_set(c, "bar", "k3", 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_set(c, "foo", "k4", 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_set(c, "foo", "k5", 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_command(c, "size foo", record_reply, &r) == 0);
+    fail_unless(hlld_client_pending(c) == 6);
+    fail_unless(hlld_client_set(c, "foo", "bad key", 7, record_reply, &r) == -1);
+    fail_unless(hlld_client_set(c, "bad set", "k", 1, record_reply, &r) == -1);
+    fail_unless(hlld_client_flush(c) == 0);
+
+    char buf[128];
+    const char *sent = "b foo k1 k2 k4\nb foo k5\nb bar k3\nsize foo\n";
+    read_server(server, buf, strlen(sent));
+    fail_unless(!strcmp(buf, sent));
+
+    // Replies may arrive in pieces
+    const char *replies = "Done\nDone\nSet does not exist\n42\n";
+    write_server(server, replies, 8);
+    fail_unless(hlld_client_poll(c, 1000) == 3);
+    write_server(server, replies + 8, strlen(replies) - 8);
+    fail_unless(hlld_client_wait(c, 1000) == 0);
+    fail_unless(r.num == 6);
+    for (int i=0; i < 4; i++) fail_unless(r.status[i] == HLLD_OK);
+    fail_unless(r.status[4] == HLLD_SET_NOT_EXIST);
+    fail_unless(r.status[5] == HLLD_OK);
+    fail_unless(!strcmp(r.reply[5], "42"));
+
+    hlld_client_close(c);
+    close(server);
+}
+END_TEST
+
+START_TEST(test_client_listing)
+{
+    int server;
+    hlld_client *c = pair_client(0, 16, &server);
+    client_replies r;
+    memset(&r, 0, sizeof(r));
+
+    fail_unless(hlld_client_command(c, "list", record_reply, &r) == 0);
+    fail_unless(hlld_client_command(c, "list", record_reply, &r) == 0);
+    fail_unless(hlld_client_command(c, "drop foo", record_reply, &r) == 0);
+    fail_unless(hlld_client_flush(c) == 0);
+    char buf[64];
+    read_server(server, buf, 19);
+    fail_unless(!strcmp(buf, "list\nlist\ndrop foo\n"));
+
+    // The lines of a listing are given together, once all read
+    const char *replies = "START\nfoo 0.01 14 1024 3\nEND\nSTART\nEND\nClient Error: Bad set name\n";
+    write_server(server, replies, 20);
+    fail_unless(hlld_client_poll(c, 1000) == 0);
+    write_server(server, replies + 20, strlen(replies) - 20);
+    fail_unless(hlld_client_wait(c, 1000) == 0);
+    fail_unless(r.num == 3);
+    fail_unless(r.status[0] == HLLD_OK);
+    fail_unless(!strcmp(r.reply[0], "foo 0.01 14 1024 3\n"));
+    fail_unless(r.reply[1][0] == '\0');
+    fail_unless(r.status[2] == HLLD_SERVER_ERR);
+
+    hlld_client_close(c);
+    close(server);
+}
+END_TEST
+
+START_TEST(test_client_binary)
+{
+    int server;
+    hlld_client *c = pair_client(1, 16, &server);
+    client_replies r;
+    memset(&r, 0, sizeof(r));
+
+    // Binary keys may hold any byte
+    fail_unless(hlld_client_set(c, "foo", "a b", 3, record_reply, &r) == 0);
+    fail_unless(hlld_client_set(c, "foo", "\n", 1, record_reply, &r) == 0);
+    uint64_t hashes[] = {1, 0xffffffffffffffffULL};
+    fail_unless(hlld_client_set_hashes(c, "ext", hashes, 2, record_reply, &r) == 0);
+    fail_unless(hlld_client_flush(c) == 0);
+
+    // The batches are ended in the order of their slots
+    char buf[128];
+    read_server(server, buf, 12 + 3 + 16);
+    fail_unless((unsigned char)buf[0] == 0xB1);
+    fail_unless(buf[1] == 2);
+    fail_unless(buf[4] == 2);
+    fail_unless(buf[15] == 1 && (unsigned char)buf[30] == 0xff);
+    read_server(server, buf, 12 + 3 + 4 + 4);
+    fail_unless((unsigned char)buf[0] == 0xB1);
+    fail_unless(buf[1] == 1);
+    fail_unless(buf[2] == 3 && buf[3] == 0);
+    fail_unless(buf[4] == 2 && buf[5] == 0);
+    fail_unless(buf[8] == 11 && buf[9] == 0);
+    fail_unless(!memcmp(buf + 12, "foo\x03\x00\x01\x00" "a b\n", 11));
+
+    char replies[] = {(char)0xB1, 1, 0, 0, 0, 0, 0, 0, (char)0xB1, 0, 0, 0, 2, 0, 0, 0};
+    write_server(server, replies, sizeof(replies));
+    fail_unless(hlld_client_wait(c, 1000) == 0);
+    fail_unless(r.num == 3);
+    fail_unless(r.status[0] == HLLD_SET_NOT_EXIST);
+    fail_unless(r.status[1] == HLLD_OK && r.status[2] == HLLD_OK);
+    fail_unless(!strcmp(r.reply[1], "Done"));
+
+    hlld_client_close(c);
+    close(server);
+}
+END_TEST
+
+START_TEST(test_client_hashed)
+{
+    int server;
+    hlld_client *c = pair_client(0, 16, &server);
+    client_replies r;
+    memset(&r, 0, sizeof(r));
+
+    // Keys are hashed as the server does, and sent with seth
+    fail_unless(hlld_client_hash("key", 3) == hll_hash_key(HLL_HASH_MURMUR, "key", 3));
+    const char *keys[] = {"key"};
+    int lens[] = {3};
+    fail_unless(hlld_client_set_hashed(c, "ext", keys, lens, 1, record_reply, &r) == 0);
+    uint64_t hash = 0xabc;
+    fail_unless(hlld_client_set_hashes(c, "ext", &hash, 1, record_reply, &r) == 0);
+    fail_unless(hlld_client_flush(c) == 0);
+
+    char expected[64], buf[64];
+    snprintf(expected, sizeof(expected), "seth ext %016llx 0000000000000abc\n",
+        (unsigned long long)hlld_client_hash("key", 3));
+    read_server(server, buf, strlen(expected));
+    fail_unless(!strcmp(buf, expected));
+
+    // A lost connection fails what is in flight
+    close(server);
+    fail_unless(hlld_client_wait(c, 1000) == 0);
+    fail_unless(r.num == 2);
+    fail_unless(r.status[0] == HLLD_CONN_ERR && r.status[1] == HLLD_CONN_ERR);
+    fail_unless(hlld_client_set(c, "ext", "k", 1, record_reply, &r) == -1);
+    hlld_client_close(c);
+}
+END_TEST
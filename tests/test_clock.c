@@ -0,0 +1,45 @@
+#include <check.h>
+#include <time.h>
+#include <unistd.h>
+#include "clock.h"
+
+START_TEST(test_clock_nsec)
+{
+    // Readings before and after calibrating run forward
+    uint64_t before = hclock_nsec();
+    hclock_init();
+    uint64_t start = hclock_nsec();
+    fail_unless(start >= before);
+
+    // And keep pace with the monotonic clock
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t mono_start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    usleep(50000);
+    uint64_t elapsed = hclock_nsec() - start;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t mono_elapsed = ts.tv_sec * 1000000000ULL + ts.tv_nsec - mono_start;
+    fail_unless(elapsed >= 49000000);
+    fail_unless(elapsed < mono_elapsed + 1000000);
+}
+END_TEST
+
+START_TEST(test_clock_coarse)
+{
+    // Without a tick, the kernel's coarse clocks are read
+    time_t now = time(NULL);
+    fail_unless(hclock_wall_sec() >= now - 1 && hclock_wall_sec() <= now + 1);
+    uint64_t msec = hclock_coarse_msec();
+    usleep(20000);
+    fail_unless(hclock_coarse_msec() >= msec + 10);
+
+    // Once ticked, the cached times hold until the next tick
+    hclock_tick();
+    msec = hclock_coarse_msec();
+    usleep(20000);
+    fail_unless(hclock_coarse_msec() == msec);
+    hclock_tick();
+    fail_unless(hclock_coarse_msec() >= msec + 10);
+    fail_unless(hclock_wall_sec() >= now - 1 && hclock_wall_sec() <= now + 1);
+}
+END_TEST
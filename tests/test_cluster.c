@@ -0,0 +1,81 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "cluster.h"
+
+START_TEST(test_cluster_disabled)
+{
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    hlld_cluster *cluster;
+    fail_unless(init_cluster(&config, &cluster) == 0);
+    fail_unless(cluster == NULL);
+    fail_unless(cluster_is_local(cluster, "foo", 3));
+    destroy_cluster(cluster);
+}
+END_TEST
+
+START_TEST(test_cluster_ring)
+{
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.cluster_nodes = "a:4553,b:4553,c:4553";
+    config.cluster_node = "b:4553";
+    hlld_cluster *cluster;
+    fail_unless(init_cluster(&config, &cluster) == 0);
+    fail_unless(cluster->num_nodes == 3);
+    fail_unless(cluster->local == 1);
+    fail_unless(strcmp(cluster->nodes[2], "c:4553") == 0);
+    fail_unless(cluster->num_points == 3 * 128);
+
+    // Names map to the same node every time, spread over the nodes
+    int counts[3] = {0, 0, 0}, local = 0;
+    char name[32];
+    for (int i=0; i < 3000; i++) {
+        int len = snprintf(name, sizeof(name), "set%d", i);
+        int node = cluster_node_of(cluster, name, len);
+        fail_unless(node >= 0 && node < 3);
+        fail_unless(cluster_node_of(cluster, name, len) == node);
+        counts[node]++;
+        local += cluster_is_local(cluster, name, len);
+    }
+    fail_unless(local == counts[1]);
+    for (int i=0; i < 3; i++) fail_unless(counts[i] > 700, "node %d has %d sets", i, counts[i]);
+    destroy_cluster(cluster);
+
+    // Our node must be listed
+    config.cluster_node = "d:4553";
+    fail_unless(init_cluster(&config, &cluster) == -1);
+}
+END_TEST
+
+START_TEST(test_cluster_add_node)
+{
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.cluster_nodes = "a:4553,b:4553,c:4553";
+    config.cluster_node = "a:4553";
+    hlld_cluster *before, *after;
+    fail_unless(init_cluster(&config, &before) == 0);
+    config.cluster_nodes = "a:4553,b:4553,c:4553,d:4553";
+    fail_unless(init_cluster(&config, &after) == 0);
+
+    // Only the sets the new node takes over move
+    int moved = 0;
+    char name[32];
+    for (int i=0; i < 4000; i++) {
+        int len = snprintf(name, sizeof(name), "set%d", i);
+        int old_node = cluster_node_of(before, name, len);
+        int new_node = cluster_node_of(after, name, len);
+        if (old_node != new_node) {
+            fail_unless(new_node == 3);
+            moved++;
+        }
+    }
+    fail_unless(moved > 600 && moved < 1400, "moved %d sets", moved);
+    destroy_cluster(before);
+    destroy_cluster(after);
+}
+END_TEST
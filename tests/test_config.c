@@ -6,6 +6,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "config.h"
 
 START_TEST(test_config_get_default)
@@ -25,6 +29,69 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.default_estimator == HLL_ESTIMATOR_BIAS);
+    fail_unless(config.default_hash == HLL_HASH_MURMUR);
+    fail_unless(config.compress_cold == 0);
+    fail_unless(config.flush_threads == 1);
+    fail_unless(config.flush_rate_limit == 0);
+    fail_unless(config.flush_dirty_age == 0);
+    fail_unless(config.flush_dirty_pages == 0);
+    fail_unless(config.max_memory == 0);
+    fail_unless(config.reuseport == 0);
+    fail_unless(config.max_conn_buffer == 128);
+    fail_unless(config.http_port == 0);
+    fail_unless(config.slowlog_usec == 0);
+    fail_unless(config.slowlog_len == 128);
+    fail_unless(config.replication_port == 0);
+    fail_unless(config.replicate_from == NULL);
+    fail_unless(config.cluster_nodes == NULL);
+    fail_unless(config.cluster_node == NULL);
+    fail_unless(config.cluster_vnodes == 128);
+    fail_unless(config.remote_cache_msec == 1000);
+    fail_unless(config.default_window == 0);
+    fail_unless(config.default_window_buckets == 24);
+    fail_unless(config.default_sliding == 0);
+    fail_unless(config.default_kmv == 0);
+    fail_unless(config.default_durability == DURABILITY_PERIODIC);
+    fail_unless(config.default_flush_period == 0);
+    fail_unless(config.wal == 0);
+    fail_unless(config.wal_sync_msec == 100);
+    fail_unless(config.huge_pages == 0);
+    fail_unless(config.slab_registers == 0);
+    fail_unless(config.fold_after_days == 0);
+    fail_unless(config.fold_precision == 10);
+    fail_unless(config.read_only == 0);
+    fail_unless(config.worker_affinity == WORKER_AFFINITY_NONE);
+    fail_unless(config.set_affinity == SET_AFFINITY_OFF);
+    fail_unless(config.io_uring == 0);
+    fail_unless(config.busy_poll == 0);
+    fail_unless(config.unix_socket == NULL);
+    fail_unless(config.conn_turn_cmds == 1024);
+    fail_unless(config.conn_turn_kb == 1024);
+    fail_unless(config.conn_cmds_per_sec == 0);
+    fail_unless(config.conn_kb_per_sec == 0);
+    fail_unless(config.reserved_workers == 0);
+    fail_unless(config.max_workers == 0);
+    fail_unless(config_worker_slots(&config) == 1);
+    fail_unless(config.migrate_busy == 0);
+    fail_unless(config.exec_threads == 0);
+    fail_unless(config.coalesce_writes == 0);
+    fail_unless(config.shadow_merge_msec == 0);
+    fail_unless(config.ingest_rings == 0);
+    fail_unless(config.ingest_ring_kb == 1024);
+    fail_unless(config.auto_create == 0);
+    fail_unless(config.trash_unlink_rate == 1000);
+    fail_unless(config.preallocate == 0);
+    fail_unless(config.data_dirs == NULL);
+    fail_unless(config.num_data_dirs == 0);
+    fail_unless(config.placement == PLACE_HASH);
+    fail_unless(config.direct_io == 0);
+    fail_unless(config.cool_interval == 0);
+    fail_unless(config.prewarm == 0);
+    fail_unless(config.archive_after_days == 0);
+    fail_unless(config.templates == NULL);
+    fail_unless(config_template(&config, "daily") == NULL);
+    fail_unless(config.client_classes == NULL);
 }
 END_TEST
 
@@ -91,7 +158,69 @@ default_eps = 0.05\n\
 data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
-log_level = INFO\n";
+compress_cold = 1\n\
+flush_threads = 4\n\
+flush_rate_limit = 200\n\
+flush_dirty_age = 30\n\
+flush_dirty_pages = 64\n\
+max_memory = 512\n\
+reuseport = 1\n\
+max_conn_buffer = 16\n\
+http_port = 10002\n\
+slowlog_usec = 5000\n\
+slowlog_len = 32\n\
+replication_port = 10003\n\
+replicate_from = primary:10003\n\
+cluster_nodes = a:4553,b:4553\n\
+cluster_node = b:4553\n\
+cluster_vnodes = 16\n\
+remote_cache_msec = 5000\n\
+default_window = 2h\n\
+default_window_buckets = 12\n\
+default_sliding = 30m\n\
+default_kmv = 1024\n\
+default_durability = wal:10s\n\
+wal = 1\n\
+wal_sync_msec = 50\n\
+huge_pages = 1\n\
+slab_registers = 1\n\
+fold_after_days = 30\n\
+fold_precision = 8\n\
+read_only = 1\n\
+worker_affinity = node\n\
+set_affinity = worker\n\
+io_uring = 1\n\
+busy_poll = 50\n\
+unix_socket = /tmp/hlld.sock\n\
+conn_turn_cmds = 64\n\
+conn_turn_kb = 0\n\
+conn_cmds_per_sec = 1000\n\
+conn_kb_per_sec = 512\n\
+reserved_workers = 1\n\
+max_workers = 8\n\
+migrate_busy = 80\n\
+exec_threads = 2\n\
+coalesce_writes = 1\n\
+shadow_merge_msec = 5\n\
+ingest_rings = 2\n\
+ingest_ring_kb = 256\n\
+auto_create = 1\n\
+trash_unlink_rate = 50\n\
+preallocate = 2\n\
+data_dirs = /mnt/a,/mnt/b\n\
+placement = space\n\
+direct_io = 1\n\
+cool_interval = 600\n\
+prewarm = 1\n\
+archive_after_days = 90\n\
+log_level = INFO\n\
+[class:ops]\n\
+networks = 10.1.0.0/16, unix\n\
+priority = high\n\
+[class:batch]\n\
+networks = 10.0.0.0/8\n\
+cmds_per_sec = 100\n\
+kb_per_sec = 64\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
     close(fh);
@@ -112,6 +241,82 @@ log_level = INFO\n";
     fail_unless(config.in_memory == 1);
     fail_unless(config.worker_threads == 2);
     fail_unless(config.use_mmap == 1);
+    fail_unless(config.compress_cold == 1);
+    fail_unless(config.flush_threads == 4);
+    fail_unless(config.flush_rate_limit == 200);
+    fail_unless(config.flush_dirty_age == 30);
+    fail_unless(config.flush_dirty_pages == 64);
+    fail_unless(config.max_memory == 512);
+    fail_unless(config.reuseport == 1);
+    fail_unless(config.max_conn_buffer == 16);
+    fail_unless(config.http_port == 10002);
+    fail_unless(config.slowlog_usec == 5000);
+    fail_unless(config.slowlog_len == 32);
+    fail_unless(config.replication_port == 10003);
+    fail_unless(strcmp(config.replicate_from, "primary:10003") == 0);
+    fail_unless(strcmp(config.cluster_nodes, "a:4553,b:4553") == 0);
+    fail_unless(strcmp(config.cluster_node, "b:4553") == 0);
+    fail_unless(config.cluster_vnodes == 16);
+    fail_unless(config.remote_cache_msec == 5000);
+    fail_unless(config.default_window == 7200);
+    fail_unless(config.default_window_buckets == 12);
+    fail_unless(config.default_sliding == 1800);
+    fail_unless(config.default_kmv == 1024);
+    fail_unless(config.default_durability == DURABILITY_WAL);
+    fail_unless(config.default_flush_period == 10);
+    fail_unless(config.wal == 1);
+    fail_unless(config.wal_sync_msec == 50);
+    fail_unless(config.huge_pages == 1);
+    fail_unless(config.slab_registers == 1);
+    fail_unless(config.fold_after_days == 30);
+    fail_unless(config.fold_precision == 8);
+    fail_unless(config.read_only == 1);
+    fail_unless(config.worker_affinity == WORKER_AFFINITY_NODE);
+    fail_unless(config.set_affinity == SET_AFFINITY_WORKER);
+    fail_unless(config.io_uring == 1);
+    fail_unless(config.busy_poll == 50);
+    fail_unless(strcmp(config.unix_socket, "/tmp/hlld.sock") == 0);
+    fail_unless(config.conn_turn_cmds == 64);
+    fail_unless(config.conn_turn_kb == 0);
+    fail_unless(config.conn_cmds_per_sec == 1000);
+    fail_unless(config.conn_kb_per_sec == 512);
+    fail_unless(config.reserved_workers == 1);
+    fail_unless(config.max_workers == 8);
+    fail_unless(config_worker_slots(&config) == 8);
+    fail_unless(config.migrate_busy == 80);
+    fail_unless(config.exec_threads == 2);
+    fail_unless(config.coalesce_writes == 1);
+    fail_unless(config.shadow_merge_msec == 5);
+    fail_unless(config.ingest_rings == 2);
+    fail_unless(config.ingest_ring_kb == 256);
+    fail_unless(config.auto_create == 1);
+    fail_unless(config.trash_unlink_rate == 50);
+    fail_unless(config.preallocate == 2);
+    fail_unless(strcmp(config.data_dirs, "/mnt/a,/mnt/b") == 0);
+    fail_unless(config.placement == PLACE_SPACE);
+    fail_unless(config.direct_io == 1);
+    fail_unless(config.cool_interval == 600);
+    fail_unless(config.prewarm == 1);
+    fail_unless(config.archive_after_days == 90);
+
+    // Clients are of the first class of their network
+    struct sockaddr_in in = {.sin_family = AF_INET};
+    inet_pton(AF_INET, "10.1.2.3", &in.sin_addr);
+    hlld_client_class *c = config_client_class(&config, (struct sockaddr*)&in);
+    fail_unless(c && strcmp(c->name, "ops") == 0);
+    fail_unless(c->high_priority == 1);
+    fail_unless(c->cmds_per_sec == 0);
+    inet_pton(AF_INET, "10.2.0.1", &in.sin_addr);
+    c = config_client_class(&config, (struct sockaddr*)&in);
+    fail_unless(c && strcmp(c->name, "batch") == 0);
+    fail_unless(c->high_priority == 0);
+    fail_unless(c->cmds_per_sec == 100);
+    fail_unless(c->kb_per_sec == 64);
+    inet_pton(AF_INET, "192.168.0.1", &in.sin_addr);
+    fail_unless(config_client_class(&config, (struct sockaddr*)&in) == NULL);
+    struct sockaddr_un un = {.sun_family = AF_UNIX};
+    c = config_client_class(&config, (struct sockaddr*)&un);
+    fail_unless(c && strcmp(c->name, "ops") == 0);
 
     unlink("/tmp/basic_config");
 }
@@ -156,6 +361,50 @@ log_level = INFO\n";
 }
 END_TEST
 
+START_TEST(test_config_templates)
+{
+    int fh = open("/tmp/template_config", O_CREAT|O_RDWR|O_TRUNC, 0777);
+    char *buf = "[template:daily]\n\
+default_precision = 10\n\
+default_window = 1h\n\
+[template:memory]\n\
+in_memory = 1\n\
+flush_interval = 5\n\
+[hlld]\n\
+in_memory = 0\n\
+default_precision = 14\n\
+flush_interval = 120\n";
+    write(fh, buf, strlen(buf));
+    close(fh);
+
+    hlld_config config;
+    int res = config_from_filename("/tmp/template_config", &config);
+    fail_unless(res == 0);
+    fail_unless(validate_config(&config) == 0);
+
+    // Templates inherit the main config, wherever it is
+    hlld_config *daily = config_template(&config, "daily");
+    fail_unless(daily != NULL);
+    fail_unless(daily->default_precision == 10);
+    fail_unless(daily->default_window == 3600);
+    fail_unless(daily->in_memory == 0);
+    fail_unless(daily->flush_interval == 120);
+
+    // Only the settings of sets are taken from templates
+    hlld_config *memory = config_template(&config, "memory");
+    fail_unless(memory != NULL);
+    fail_unless(memory->in_memory == 1);
+    fail_unless(memory->default_precision == 14);
+    fail_unless(memory->flush_interval == 120);
+    fail_unless(config_template(&config, "weekly") == NULL);
+
+    // Bad templates are refused
+    memory->sparse = 2;
+    fail_unless(validate_config(&config) == 1);
+    unlink("/tmp/template_config");
+}
+END_TEST
+
 
 
 START_TEST(test_validate_default_config)
@@ -227,14 +476,16 @@ START_TEST(test_sane_default_eps)
     fail_unless(sane_default_eps(0.25) == 0);
     fail_unless(sane_default_eps(0.005) == 0);
     fail_unless(sane_default_eps(0.3) == 1);
-    fail_unless(sane_default_eps(0.002) == 1);
+    fail_unless(sane_default_eps(0.002) == 0);
+    fail_unless(sane_default_eps(0.0002) == 1);
 }
 END_TEST
 
 START_TEST(test_sane_default_precision)
 {
     fail_unless(sane_default_precision(0) == 1);
-    fail_unless(sane_default_precision(20) == 1);
+    fail_unless(sane_default_precision(23) == 1);
+    fail_unless(sane_default_precision(22) == 0);
     fail_unless(sane_default_precision(4) == 0);
     fail_unless(sane_default_precision(18) == 0);
     fail_unless(sane_default_precision(12) == 0);
@@ -290,6 +541,534 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_default_format)
+{
+    fail_unless(sane_default_format(-1) == 1);
+    fail_unless(sane_default_format(HLL_PACKED) == 0);
+    fail_unless(sane_default_format(HLL_BYTE) == 0);
+    fail_unless(sane_default_format(100) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_compress_cold)
+{
+    fail_unless(sane_compress_cold(-1) == 1);
+    fail_unless(sane_compress_cold(0) == 0);
+    fail_unless(sane_compress_cold(1) == 0);
+    fail_unless(sane_compress_cold(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_threads)
+{
+    fail_unless(sane_flush_threads(-1) == 1);
+    fail_unless(sane_flush_threads(0) == 1);
+    fail_unless(sane_flush_threads(1) == 0);
+    fail_unless(sane_flush_threads(8) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_rate_limit)
+{
+    fail_unless(sane_flush_rate_limit(-1) == 1);
+    fail_unless(sane_flush_rate_limit(0) == 0);
+    fail_unless(sane_flush_rate_limit(100) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_dirty_age)
+{
+    fail_unless(sane_flush_dirty_age(-1) == 1);
+    fail_unless(sane_flush_dirty_age(0) == 0);
+    fail_unless(sane_flush_dirty_age(30) == 0);
+    fail_unless(sane_flush_dirty_age(3600) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_dirty_pages)
+{
+    fail_unless(sane_flush_dirty_pages(-1) == 1);
+    fail_unless(sane_flush_dirty_pages(0) == 0);
+    fail_unless(sane_flush_dirty_pages(256) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_max_memory)
+{
+    fail_unless(sane_max_memory(-1) == 1);
+    fail_unless(sane_max_memory(0) == 0);
+    fail_unless(sane_max_memory(1024) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_reuseport)
+{
+    fail_unless(sane_reuseport(-1) == 1);
+    fail_unless(sane_reuseport(0) == 0);
+    fail_unless(sane_reuseport(1) == 0);
+    fail_unless(sane_reuseport(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_sparse)
+{
+    fail_unless(sane_sparse(-1) == 1);
+    fail_unless(sane_sparse(0) == 0);
+    fail_unless(sane_sparse(1) == 0);
+    fail_unless(sane_sparse(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_max_conn_buffer)
+{
+    fail_unless(sane_max_conn_buffer(0) == 1);
+    fail_unless(sane_max_conn_buffer(1) == 0);
+    fail_unless(sane_max_conn_buffer(128) == 0);
+    fail_unless(sane_max_conn_buffer(1024) == 0);
+    fail_unless(sane_max_conn_buffer(1025) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_slowlog)
+{
+    fail_unless(sane_slowlog_usec(-1) == 1);
+    fail_unless(sane_slowlog_usec(0) == 0);
+    fail_unless(sane_slowlog_usec(10000) == 0);
+    fail_unless(sane_slowlog_len(0) == 1);
+    fail_unless(sane_slowlog_len(1) == 0);
+    fail_unless(sane_slowlog_len(65536) == 0);
+    fail_unless(sane_slowlog_len(65537) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_replication)
+{
+    fail_unless(sane_replication_port(-1) == 1);
+    fail_unless(sane_replication_port(0) == 0);
+    fail_unless(sane_replication_port(4555) == 0);
+    fail_unless(sane_replication_port(65536) == 1);
+    fail_unless(sane_replicate_from(NULL) == 0);
+    fail_unless(sane_replicate_from("primary:4555") == 0);
+    fail_unless(sane_replicate_from("10.0.0.1:4555") == 0);
+    fail_unless(sane_replicate_from("primary") == 1);
+    fail_unless(sane_replicate_from(":4555") == 1);
+    fail_unless(sane_replicate_from("primary:0") == 1);
+    fail_unless(sane_replicate_from("primary:70000") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_cluster)
+{
+    fail_unless(sane_cluster(NULL, NULL, 128) == 0);
+    fail_unless(sane_cluster(NULL, NULL, 0) == 1);
+    fail_unless(sane_cluster("a:4553,b:4553", "b:4553", 128) == 0);
+    fail_unless(sane_cluster("a:4553,b:4553", "b:4553", 4097) == 1);
+    fail_unless(sane_cluster("a:4553,b:4553", NULL, 128) == 1);
+    fail_unless(sane_cluster(NULL, "a:4553", 128) == 1);
+    fail_unless(sane_cluster("a:4553,b:4553", "c:4553", 128) == 1);
+    fail_unless(sane_cluster("a:4553,b:4553", "b:455", 128) == 1);
+    fail_unless(sane_cluster("a:4553,b", "a:4553", 128) == 1);
+    fail_unless(sane_cluster("a:4553,", "a:4553", 128) == 1);
+    fail_unless(sane_cluster("a:4553,b:0", "a:4553", 128) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_remote_cache_msec)
+{
+    fail_unless(sane_remote_cache_msec(99) == 1);
+    fail_unless(sane_remote_cache_msec(100) == 0);
+    fail_unless(sane_remote_cache_msec(1000) == 0);
+    fail_unless(sane_remote_cache_msec(3600000) == 0);
+    fail_unless(sane_remote_cache_msec(3600001) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_window)
+{
+    fail_unless(sane_window(-1, 24) == 1);
+    fail_unless(sane_window(0, 24) == 0);
+    fail_unless(sane_window(3600, 1) == 0);
+    fail_unless(sane_window(31536000, 1024) == 0);
+    fail_unless(sane_window(31536001, 24) == 1);
+    fail_unless(sane_window(3600, 0) == 1);
+    fail_unless(sane_window(3600, 1025) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_sliding)
+{
+    fail_unless(sane_sliding(-1, 0) == 1);
+    fail_unless(sane_sliding(0, 0) == 0);
+    fail_unless(sane_sliding(3600, 0) == 0);
+    fail_unless(sane_sliding(31536000, 0) == 0);
+    fail_unless(sane_sliding(31536001, 0) == 1);
+    fail_unless(sane_sliding(0, 3600) == 0);
+    fail_unless(sane_sliding(3600, 3600) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_kmv)
+{
+    fail_unless(sane_kmv(0) == 0);
+    fail_unless(sane_kmv(-1) == 1);
+    fail_unless(sane_kmv(15) == 1);
+    fail_unless(sane_kmv(16) == 0);
+    fail_unless(sane_kmv(4096) == 0);
+    fail_unless(sane_kmv(65536) == 0);
+    fail_unless(sane_kmv(65537) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_huge_pages)
+{
+    fail_unless(sane_huge_pages(0) == 0);
+    fail_unless(sane_huge_pages(1) == 0);
+    fail_unless(sane_huge_pages(2) == 1);
+    fail_unless(sane_huge_pages(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_read_only)
+{
+    fail_unless(sane_read_only(0, 1, 1, 1, "10.0.0.1:4555") == 0);
+    fail_unless(sane_read_only(1, 0, 0, 0, NULL) == 0);
+    fail_unless(sane_read_only(2, 0, 0, 0, NULL) == 1);
+    fail_unless(sane_read_only(1, 1, 0, 0, NULL) == 1);
+    fail_unless(sane_read_only(1, 0, 1, 0, NULL) == 1);
+    fail_unless(sane_read_only(1, 0, 0, 1, NULL) == 1);
+    fail_unless(sane_read_only(1, 0, 0, 0, "10.0.0.1:4555") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_affinity)
+{
+    fail_unless(sane_affinity(WORKER_AFFINITY_NONE, SET_AFFINITY_OFF) == 0);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NONE, SET_AFFINITY_WORKER) == 0);
+    fail_unless(sane_affinity(WORKER_AFFINITY_CORE, SET_AFFINITY_NODE) == 0);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NODE, SET_AFFINITY_NODE) == 0);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NONE, SET_AFFINITY_NODE) == 1);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NONE, SET_AFFINITY_SHARD) == 0);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NODE + 1, SET_AFFINITY_OFF) == 1);
+    fail_unless(sane_affinity(WORKER_AFFINITY_NONE, SET_AFFINITY_SHARD + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_io_uring)
+{
+    fail_unless(sane_io_uring(-1) == 1);
+    fail_unless(sane_io_uring(0) == 0);
+    fail_unless(sane_io_uring(1) == 0);
+    fail_unless(sane_io_uring(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_busy_poll)
+{
+    fail_unless(sane_busy_poll(-1) == 1);
+    fail_unless(sane_busy_poll(0) == 0);
+    fail_unless(sane_busy_poll(50) == 0);
+    fail_unless(sane_busy_poll(1000001) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_conn_rate)
+{
+    fail_unless(sane_conn_rate(0, 0) == 0);
+    fail_unless(sane_conn_rate(1000, 512) == 0);
+    fail_unless(sane_conn_rate(-1, 0) == 1);
+    fail_unless(sane_conn_rate(0, -1) == 1);
+    fail_unless(sane_conn_rate(100000001, 0) == 1);
+    fail_unless(sane_conn_rate(0, 16777217) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_reserved_workers)
+{
+    fail_unless(sane_reserved_workers(0, 1) == 0);
+    fail_unless(sane_reserved_workers(1, 4) == 0);
+    fail_unless(sane_reserved_workers(3, 4) == 0);
+    fail_unless(sane_reserved_workers(4, 4) == 1);
+    fail_unless(sane_reserved_workers(-1, 4) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_max_workers)
+{
+    fail_unless(sane_max_workers(0, 4) == 0);
+    fail_unless(sane_max_workers(4, 4) == 0);
+    fail_unless(sane_max_workers(16, 4) == 0);
+    fail_unless(sane_max_workers(3, 4) == 1);
+    fail_unless(sane_max_workers(-1, 4) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_unix_socket)
+{
+    char path[200];
+    memset(path, 'a', sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    fail_unless(sane_unix_socket(NULL) == 0);
+    fail_unless(sane_unix_socket("/tmp/hlld.sock") == 0);
+    fail_unless(sane_unix_socket("") == 1);
+    fail_unless(sane_unix_socket(path) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_conn_turn)
+{
+    fail_unless(sane_conn_turn(0, 0) == 0);
+    fail_unless(sane_conn_turn(1024, 1024) == 0);
+    fail_unless(sane_conn_turn(1000000, 1048576) == 0);
+    fail_unless(sane_conn_turn(-1, 1024) == 1);
+    fail_unless(sane_conn_turn(1000001, 1024) == 1);
+    fail_unless(sane_conn_turn(1024, -1) == 1);
+    fail_unless(sane_conn_turn(1024, 1048577) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_migrate_busy)
+{
+    fail_unless(sane_migrate_busy(-1) == 1);
+    fail_unless(sane_migrate_busy(0) == 0);
+    fail_unless(sane_migrate_busy(80) == 0);
+    fail_unless(sane_migrate_busy(100) == 0);
+    fail_unless(sane_migrate_busy(101) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_exec_threads)
+{
+    fail_unless(sane_exec_threads(-1) == 1);
+    fail_unless(sane_exec_threads(0) == 0);
+    fail_unless(sane_exec_threads(4) == 0);
+    fail_unless(sane_exec_threads(256) == 0);
+    fail_unless(sane_exec_threads(257) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_coalesce_writes)
+{
+    fail_unless(sane_coalesce_writes(-1) == 1);
+    fail_unless(sane_coalesce_writes(0) == 0);
+    fail_unless(sane_coalesce_writes(1) == 0);
+    fail_unless(sane_coalesce_writes(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_shadow_merge_msec)
+{
+    fail_unless(sane_shadow_merge_msec(-1) == 1);
+    fail_unless(sane_shadow_merge_msec(0) == 0);
+    fail_unless(sane_shadow_merge_msec(5) == 0);
+    fail_unless(sane_shadow_merge_msec(1000) == 0);
+    fail_unless(sane_shadow_merge_msec(1001) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_ingest_rings)
+{
+    fail_unless(sane_ingest_rings(-1, 1024) == 1);
+    fail_unless(sane_ingest_rings(0, 1024) == 0);
+    fail_unless(sane_ingest_rings(64, 64) == 0);
+    fail_unless(sane_ingest_rings(65, 1024) == 1);
+    fail_unless(sane_ingest_rings(1, 32) == 1);
+    fail_unless(sane_ingest_rings(1, 1000) == 1);
+    fail_unless(sane_ingest_rings(1, 1048576) == 0);
+    fail_unless(sane_ingest_rings(1, 2097152) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_auto_create)
+{
+    fail_unless(sane_auto_create(0) == 0);
+    fail_unless(sane_auto_create(1) == 0);
+    fail_unless(sane_auto_create(2) == 1);
+    fail_unless(sane_auto_create(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_trash_unlink_rate)
+{
+    fail_unless(sane_trash_unlink_rate(0) == 0);
+    fail_unless(sane_trash_unlink_rate(1000000) == 0);
+    fail_unless(sane_trash_unlink_rate(1000001) == 1);
+    fail_unless(sane_trash_unlink_rate(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_data_dirs)
+{
+    char **list;
+    int num;
+    fail_unless(sane_data_dirs(NULL, &list, &num) == 0);
+    fail_unless(num == 0 && list == NULL);
+    fail_unless(sane_data_dirs("/tmp/hlld_dirs_a, /tmp/hlld_dirs_b", &list, &num) == 0);
+    fail_unless(num == 2);
+    fail_unless(strcmp(list[0], "/tmp/hlld_dirs_a") == 0);
+    fail_unless(strcmp(list[1], "/tmp/hlld_dirs_b") == 0);
+    for (int i=0; i < num; i++) {
+        rmdir(list[i]);
+        free(list[i]);
+    }
+    free(list);
+
+    fail_unless(sane_data_dirs("/tmp/hlld_dirs_a,,/tmp/hlld_dirs_b", &list, &num) == 1);
+    fail_unless(num == 0 && list == NULL);
+    fail_unless(sane_data_dirs("/tmp/hlld_dirs_a,/dev/null", &list, &num) == 1);
+    rmdir("/tmp/hlld_dirs_a");
+}
+END_TEST
+
+START_TEST(test_sane_prewarm)
+{
+    fail_unless(sane_prewarm(0) == 0);
+    fail_unless(sane_prewarm(1) == 0);
+    fail_unless(sane_prewarm(2) == 1);
+    fail_unless(sane_prewarm(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_archive_after_days)
+{
+    fail_unless(sane_archive_after_days(0) == 0);
+    fail_unless(sane_archive_after_days(90) == 0);
+    fail_unless(sane_archive_after_days(36500) == 0);
+    fail_unless(sane_archive_after_days(36501) == 1);
+    fail_unless(sane_archive_after_days(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_cool_interval)
+{
+    fail_unless(sane_cool_interval(0, 3600) == 0);
+    fail_unless(sane_cool_interval(600, 3600) == 0);
+    fail_unless(sane_cool_interval(600, 0) == 0);
+    fail_unless(sane_cool_interval(3600, 3600) == 1);
+    fail_unless(sane_cool_interval(-1, 3600) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_direct_io)
+{
+    fail_unless(sane_direct_io(0) == 0);
+    fail_unless(sane_direct_io(1) == 0);
+    fail_unless(sane_direct_io(2) == 1);
+    fail_unless(sane_direct_io(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_preallocate)
+{
+    fail_unless(sane_preallocate(0) == 0);
+    fail_unless(sane_preallocate(1) == 0);
+    fail_unless(sane_preallocate(2) == 0);
+    fail_unless(sane_preallocate(3) == 1);
+    fail_unless(sane_preallocate(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_fold)
+{
+    fail_unless(sane_fold(0, 10) == 0);
+    fail_unless(sane_fold(30, 4) == 0);
+    fail_unless(sane_fold(36500, 22) == 0);
+    fail_unless(sane_fold(-1, 10) == 1);
+    fail_unless(sane_fold(36501, 10) == 1);
+    fail_unless(sane_fold(30, 3) == 1);
+    fail_unless(sane_fold(30, 23) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_slab_registers)
+{
+    fail_unless(sane_slab_registers(0) == 0);
+    fail_unless(sane_slab_registers(1) == 0);
+    fail_unless(sane_slab_registers(2) == 1);
+    fail_unless(sane_slab_registers(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_wal)
+{
+    fail_unless(sane_wal(0, 100) == 0);
+    fail_unless(sane_wal(1, 1) == 0);
+    fail_unless(sane_wal(1, 10000) == 0);
+    fail_unless(sane_wal(2, 100) == 1);
+    fail_unless(sane_wal(-1, 100) == 1);
+    fail_unless(sane_wal(1, 0) == 1);
+    fail_unless(sane_wal(1, 10001) == 1);
+}
+END_TEST
+
+START_TEST(test_duration_to_secs)
+{
+    uint64_t secs;
+    fail_unless(duration_to_secs("90", &secs) == 0 && secs == 90);
+    fail_unless(duration_to_secs("30s", &secs) == 0 && secs == 30);
+    fail_unless(duration_to_secs("5m", &secs) == 0 && secs == 300);
+    fail_unless(duration_to_secs("24h", &secs) == 0 && secs == 86400);
+    fail_unless(duration_to_secs("2d", &secs) == 0 && secs == 172800);
+    fail_unless(duration_to_secs("1w", &secs) == 0 && secs == 604800);
+    fail_unless(duration_to_secs("", &secs) == -1);
+    fail_unless(duration_to_secs("h", &secs) == -1);
+    fail_unless(duration_to_secs("-1h", &secs) == -1);
+    fail_unless(duration_to_secs("3y", &secs) == -1);
+    fail_unless(duration_to_secs("3hh", &secs) == -1);
+}
+END_TEST
+
+START_TEST(test_durability_from_name)
+{
+    hlld_durability durability;
+    int period;
+    fail_unless(durability_from_name("volatile", &durability, &period) == 0);
+    fail_unless(durability == DURABILITY_VOLATILE && period == 0);
+    fail_unless(durability_from_name("periodic:5m", &durability, &period) == 0);
+    fail_unless(durability == DURABILITY_PERIODIC && period == 300);
+    fail_unless(durability_from_name("wal", &durability, &period) == 0);
+    fail_unless(durability == DURABILITY_WAL && period == 0);
+    fail_unless(strcmp(durability_name(DURABILITY_WAL), "wal") == 0);
+    fail_unless(durability_name(3) == NULL);
+    fail_unless(durability_from_name("volatile:10", &durability, &period) == -1);
+    fail_unless(durability_from_name("periodic:0", &durability, &period) == -1);
+    fail_unless(durability_from_name("periodic:", &durability, &period) == -1);
+    fail_unless(durability_from_name("wall", &durability, &period) == -1);
+    fail_unless(durability_from_name("", &durability, &period) == -1);
+}
+END_TEST
+
+START_TEST(test_sane_durability)
+{
+    fail_unless(sane_durability(DURABILITY_PERIODIC, 0, 0) == 0);
+    fail_unless(sane_durability(DURABILITY_PERIODIC, 30, 0) == 0);
+    fail_unless(sane_durability(DURABILITY_VOLATILE, 0, 1) == 0);
+    fail_unless(sane_durability(DURABILITY_VOLATILE, 30, 1) == 1);
+    fail_unless(sane_durability(DURABILITY_WAL, 30, 1) == 0);
+    fail_unless(sane_durability(DURABILITY_WAL, 0, 0) == 1);
+    fail_unless(sane_durability(DURABILITY_PERIODIC, -1, 0) == 1);
+    fail_unless(sane_durability(-1, 0, 0) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_default_estimator)
+{
+    fail_unless(sane_default_estimator(-1) == 1);
+    fail_unless(sane_default_estimator(HLL_ESTIMATOR_BIAS) == 0);
+    fail_unless(sane_default_estimator(HLL_ESTIMATOR_ERTL) == 0);
+    fail_unless(sane_default_estimator(100) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_default_hash)
+{
+    fail_unless(sane_default_hash(-1) == 1);
+    fail_unless(sane_default_hash(HLL_HASH_MURMUR) == 0);
+    fail_unless(sane_default_hash(HLL_HASH_WYHASH) == 0);
+    fail_unless(sane_default_hash(HLL_HASH_EXTERNAL) == 0);
+    fail_unless(sane_default_hash(100) == 1);
+}
+END_TEST
+
 START_TEST(test_set_config_bad_file)
 {
     hlld_set_config config;
@@ -331,7 +1110,10 @@ START_TEST(test_set_config_basic_config)
 size = 1024\n\
 in_memory = 1\n\
 default_eps = 0.01625\n\
-default_precision = 12\n";
+default_precision = 12\n\
+window = 3600\n\
+window_buckets = 48\n\
+sliding = 600\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
     close(fh);
@@ -346,6 +1128,9 @@ default_precision = 12\n";
     fail_unless(config.default_eps == 0.01625);
     fail_unless(config.default_precision == 12);
     fail_unless(config.in_memory == 1);
+    fail_unless(config.window == 3600);
+    fail_unless(config.window_buckets == 48);
+    fail_unless(config.sliding == 600);
 
     unlink("/tmp/set_basic_config");
 }
@@ -357,7 +1142,15 @@ START_TEST(test_update_filename_from_set_config)
     config.default_eps = 0.01625;
     config.default_precision = 12;
     config.in_memory = 1;
+    config.format = HLL_BYTE;
+    config.sparse = 1;
+    config.estimator = HLL_ESTIMATOR_ERTL;
+    config.hash = HLL_HASH_WYHASH;
     config.size = 4096;
+    config.kmv = 512;
+    config.expires = 1700000000;
+    config.durability = DURABILITY_PERIODIC;
+    config.flush_period = 15;
 
     int res = update_filename_from_set_config("/tmp/update_filter", &config);
     chmod("/tmp/update_filter", 777);
@@ -372,7 +1165,15 @@ START_TEST(test_update_filename_from_set_config)
     fail_unless(config2.default_eps == 0.01625);
     fail_unless(config2.default_precision == 12);
     fail_unless(config2.in_memory == 1);
+    fail_unless(config2.format == HLL_BYTE);
+    fail_unless(config2.sparse == 1);
+    fail_unless(config2.estimator == HLL_ESTIMATOR_ERTL);
+    fail_unless(config2.hash == HLL_HASH_WYHASH);
     fail_unless(config2.size == 4096);
+    fail_unless(config2.kmv == 512);
+    fail_unless(config2.expires == 1700000000);
+    fail_unless(config2.durability == DURABILITY_PERIODIC);
+    fail_unless(config2.flush_period == 15);
 
     unlink("/tmp/update_filter");
 }
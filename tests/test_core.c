@@ -0,0 +1,113 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hlld_core.h"
+
+// Records the precision of the registers read
+static void core_raw_cb(void *data, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *regs, uint64_t len) {
+    (void)layout;
+    (void)regs;
+    (void)len;
+    *(int*)data = precision;
+}
+
+/*
+ * Adds keys prefix{start} .. prefix{end - 1} to an embedded set
+ */
+static int add_core_keys(hlld_core *core, char *set_name, const char *prefix, int start, int end) {
+    char buf[32];
+    char *keys[] = {buf};
+    int lens[1];
+    for (int i=start; i < end; i++) {
+        lens[0] = snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        int res = hlld_core_add(core, set_name, keys, lens, 1);
+        if (res) return res;
+    }
+    return 0;
+}
+
+START_TEST(test_core_sets)
+{
+    int fh = open("/tmp/core_config", O_CREAT|O_RDWR|O_TRUNC, 0777);
+    char *buf = "[hlld]\n\
+in_memory = 1\n\
+[template:small]\n\
+default_precision = 10\n";
+    write(fh, buf, strlen(buf));
+    close(fh);
+
+    hlld_core *core;
+    fail_unless(hlld_core_open("/tmp/does_not_exist", &core) == -ENOENT);
+    fail_unless(hlld_core_open("/tmp/core_config", &core) == 0);
+    fail_unless(hlld_core_manager(core) != NULL);
+
+    // Sets take their settings from the defaults, or a template
+    fail_unless(hlld_core_create(core, "core_foo", NULL) == 0);
+    fail_unless(hlld_core_create(core, "core_foo", NULL) == -1);
+    fail_unless(hlld_core_create(core, "core_small", "small") == 0);
+    fail_unless(hlld_core_create(core, "core_none", "none") == -3);
+    int precision = 0;
+    fail_unless(hlld_core_get_raw(core, "core_small", 0, core_raw_cb, &precision) == 0);
+    fail_unless(precision == 10);
+    fail_unless(hlld_core_get_raw(core, "core_none", 0, core_raw_cb, &precision) == -1);
+
+    fail_unless(add_core_keys(core, "core_foo", "key", 0, 1000) == 0);
+    fail_unless(add_core_keys(core, "core_small", "key", 500, 1500) == 0);
+    uint64_t hash = 1;
+    fail_unless(hlld_core_add_hashes(core, "core_foo", &hash, 1) == -3);
+    uint64_t est;
+    fail_unless(hlld_core_size(core, "core_foo", &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+    char *both[] = {"core_foo", "core_small"};
+    fail_unless(hlld_core_size_union(core, both, 2, &est) == 0);
+    fail_unless(est > 1350 && est < 1650);
+    fail_unless(hlld_core_flush(core, "core_foo") == 0);
+
+    // A set is handed over as a dump
+    unsigned char *dump;
+    uint64_t len, restored;
+    fail_unless(hlld_core_dump(core, "core_foo", &dump, &len) == 0);
+    fail_unless(hlld_core_restore(core, "core_copy", dump, len) == 0);
+    free(dump);
+    fail_unless(hlld_core_size(core, "core_foo", &est) == 0);
+    fail_unless(hlld_core_size(core, "core_copy", &restored) == 0);
+    fail_unless(est == restored);
+
+    fail_unless(hlld_core_drop(core, "core_foo") == 0);
+    fail_unless(hlld_core_size(core, "core_foo", &est) == -1);
+    hlld_core_leave(core);
+    hlld_core_close(core);
+    unlink("/tmp/core_config");
+}
+END_TEST
+
+START_TEST(test_core_persist)
+{
+    // Sets are kept in the data directory, as the server keeps them
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    hlld_core *core;
+    fail_unless(hlld_core_open_config(&config, &core) == 0);
+    fail_unless(hlld_core_create(core, "core_persist", NULL) == 0);
+    fail_unless(add_core_keys(core, "core_persist", "key", 0, 100) == 0);
+    uint64_t est, reopened;
+    fail_unless(hlld_core_size(core, "core_persist", &est) == 0);
+    hlld_core_leave(core);
+    hlld_core_close(core);
+
+    fail_unless(hlld_core_open_config(&config, &core) == 0);
+    fail_unless(hlld_core_size(core, "core_persist", &reopened) == 0);
+    fail_unless(est == reopened);
+    fail_unless(hlld_core_drop(core, "core_persist") == 0);
+    hlld_core_leave(core);
+    hlld_core_close(core);
+
+    // Invalid configs are refused
+    config.default_precision = 1;
+    fail_unless(hlld_core_open_config(&config, &core) == -EINVAL);
+}
+END_TEST
@@ -0,0 +1,52 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crc32c.h"
+
+/*
+ * Bitwise reference CRC32C
+ */
+static uint32_t crc32c_reference(const unsigned char *buf, size_t len) {
+    uint32_t crc = ~0u;
+    for (size_t i=0; i < len; i++) {
+        crc ^= buf[i];
+        for (int j=0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+START_TEST(test_crc32c_vectors)
+{
+    fail_unless(crc32c(0, "", 0) == 0);
+    fail_unless(crc32c(0, "123456789", 9) == 0xE3069283);
+
+    // RFC 3720, 32 bytes of zeros and of ones
+    unsigned char buf[32];
+    memset(buf, 0, sizeof(buf));
+    fail_unless(crc32c(0, buf, sizeof(buf)) == 0x8A9136AA);
+    memset(buf, 0xFF, sizeof(buf));
+    fail_unless(crc32c(0, buf, sizeof(buf)) == 0x62A8AB43);
+}
+END_TEST
+
+START_TEST(test_crc32c_kernels)
+{
+    const char *name = crc32c_kernel_name();
+    fail_unless(!strcmp(name, "sse4.2") || !strcmp(name, "armv8") || !strcmp(name, "table"));
+
+    // Every length and alignment matches the reference,
+    // and extending a CRC matches computing it at once
+    unsigned char buf[300];
+    for (int i=0; i < 300; i++) buf[i] = i * 31 + 7;
+    for (int off=0; off < 8; off++) {
+        for (int len=0; len + off <= 300; len += 13) {
+            uint32_t crc = crc32c(0, buf + off, len);
+            fail_unless(crc == crc32c_reference(buf + off, len));
+            int split = len / 3;
+            fail_unless(crc32c(crc32c(0, buf + off, split), buf + off + split, len - split) == crc);
+        }
+    }
+}
+END_TEST
@@ -0,0 +1,98 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/*
+ * A thread that observes an epoch, and holds
+ * it until told to move on
+ */
+typedef struct {
+    hlld_epochs *epochs;
+    volatile int stage;
+} epoch_reader;
+
+static void* epoch_reader_main(void *in) {
+    epoch_reader *r = in;
+    epoch_checkpoint(r->epochs);
+    r->stage = 1;
+    while (r->stage == 1) usleep(1000);
+    epoch_checkpoint(r->epochs);
+    r->stage = 3;
+    while (r->stage == 3) usleep(1000);
+    epoch_leave(r->epochs);
+    return NULL;
+}
+
+static int epoch_past(void *data) {
+    void **args = data;
+    return epoch_min(args[0]) >= *(uint64_t*)args[1];
+}
+
+START_TEST(test_epoch_init_destroy)
+{
+    hlld_epochs *e;
+    fail_unless(init_epochs(&e) == 0);
+
+    // No thread is active, so the minimum is current
+    uint64_t epoch = epoch_advance(e);
+    fail_unless(epoch_min(e) == epoch);
+    fail_unless(destroy_epochs(e) == 0);
+}
+END_TEST
+
+START_TEST(test_epoch_checkpoint_idle_leave)
+{
+    hlld_epochs *e;
+    fail_unless(init_epochs(&e) == 0);
+
+    // A checkpointed thread holds back the minimum
+    epoch_checkpoint(e);
+    uint64_t old = epoch_min(e);
+    uint64_t epoch = epoch_advance(e);
+    fail_unless(epoch_min(e) == old);
+    epoch_checkpoint(e);
+    fail_unless(epoch_min(e) == epoch);
+
+    // Idle and departed threads do not
+    epoch = epoch_advance(e);
+    epoch_idle(e);
+    fail_unless(epoch_min(e) == epoch);
+    epoch_checkpoint(e);
+    epoch = epoch_advance(e);
+    epoch_leave(e);
+    fail_unless(epoch_min(e) == epoch);
+    fail_unless(destroy_epochs(e) == 0);
+}
+END_TEST
+
+START_TEST(test_epoch_wait)
+{
+    hlld_epochs *e;
+    fail_unless(init_epochs(&e) == 0);
+
+    epoch_reader r = {e, 0};
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, epoch_reader_main, &r) == 0);
+    while (r.stage != 1) usleep(1000);
+
+    // The reader holds back the new epoch until it checkpoints
+    uint64_t epoch = epoch_advance(e);
+    fail_unless(epoch_min(e) < epoch);
+    r.stage = 2;
+    void *args[] = {e, &epoch};
+    epoch_wait(e, epoch_past, args);
+    fail_unless(epoch_min(e) >= epoch);
+
+    // Leaving wakes a waiter as well
+    while (r.stage != 3) usleep(1000);
+    epoch = epoch_advance(e);
+    r.stage = 4;
+    epoch_wait(e, epoch_past, args);
+    pthread_join(t, NULL);
+    fail_unless(epoch_min(e) == epoch);
+    fail_unless(destroy_epochs(e) == 0);
+}
+END_TEST
@@ -6,18 +6,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
 #include "hll.h"
+#include "hll_simd.h"
+#include "hll_hash.h"
+
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
 
 START_TEST(test_hll_init_bad)
 {
     hll_t h;
-    fail_unless(hll_init(HLL_MIN_PRECISION-1, &h) == -1);
-    fail_unless(hll_init(HLL_MAX_PRECISION+1, &h) == -1);
+    fail_unless(hll_init(HLL_MIN_PRECISION-1, HLL_PACKED, &h) == -1);
+    fail_unless(hll_init(HLL_MAX_PRECISION+1, HLL_PACKED, &h) == -1);
 
-    fail_unless(hll_init(HLL_MIN_PRECISION, &h) == 0);
+    fail_unless(hll_init(HLL_MIN_PRECISION, HLL_PACKED, &h) == 0);
     fail_unless(hll_destroy(&h) == 0);
 
-    fail_unless(hll_init(HLL_MAX_PRECISION, &h) == 0);
+    fail_unless(hll_init(HLL_MAX_PRECISION, HLL_PACKED, &h) == 0);
     fail_unless(hll_destroy(&h) == 0);
 }
 END_TEST
@@ -26,7 +33,7 @@ END_TEST
 START_TEST(test_hll_init_and_destroy)
 {
     hll_t h;
-    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(10, HLL_PACKED, &h) == 0);
     fail_unless(hll_destroy(&h) == 0);
 }
 END_TEST
@@ -34,7 +41,7 @@ END_TEST
 START_TEST(test_hll_add)
 {
     hll_t h;
-    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(10, HLL_PACKED, &h) == 0);
 
     char buf[100];
     for (int i=0; i < 100; i++) {
@@ -49,7 +56,7 @@ END_TEST
 START_TEST(test_hll_add_hash)
 {
     hll_t h;
-    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(10, HLL_PACKED, &h) == 0);
 
     for (uint64_t i=0; i < 100; i++) {
         hll_add_hash(&h, i ^ rand());
@@ -62,7 +69,7 @@ END_TEST
 START_TEST(test_hll_add_size)
 {
     hll_t h;
-    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(10, HLL_PACKED, &h) == 0);
 
     char buf[100];
     for (int i=0; i < 100; i++) {
@@ -80,11 +87,11 @@ END_TEST
 START_TEST(test_hll_add_size_bitmap)
 {
     hlld_bitmap bm;
-    uint64_t bytes = hll_bytes_for_precision(10);
+    uint64_t bytes = hll_bytes_for_precision(10, HLL_PACKED);
     fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &bm) == 0);
 
     hll_t h;
-    fail_unless(hll_init_from_bitmap(10, &bm, &h) == 0);
+    fail_unless(hll_init_from_bitmap(10, HLL_PACKED, &bm, &h) == 0);
 
     char buf[100];
     for (int i=0; i < 100; i++) {
@@ -99,10 +106,48 @@ START_TEST(test_hll_add_size_bitmap)
 }
 END_TEST
 
+START_TEST(test_hll_marks_dirty)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hlld_bitmap bm;
+        uint64_t bytes = hll_bytes_for_precision(16, formats[f]);
+        unlink("/tmp/hll_marks_dirty");
+        fail_unless(bitmap_from_filename("/tmp/hll_marks_dirty", bytes, 1, PERSISTENT, &bm) == 0);
+
+        hll_t h, other;
+        fail_unless(hll_init_from_bitmap(16, formats[f], &bm, &h) == 0);
+        fail_unless(bm.dirty[0] == 0);
+
+        // Raising the first register only dirties the first page
+        fail_unless(hll_add_hash(&h, 1) == 1);
+        fail_unless(bm.dirty[0] == 1);
+        fail_unless(bitmap_flush(&bm) == 0);
+        fail_unless(hll_add_hash(&h, 1) == 0);
+        fail_unless(bm.dirty[0] == 0);
+
+        // Raising the last register dirties the last page
+        fail_unless(hll_add_hash(&h, ~0ULL) == 1);
+        uint64_t last = (bytes - 1) / BITMAP_PAGE_SIZE;
+        fail_unless(bm.dirty[last / 64] == 1ULL << (last % 64));
+        fail_unless(bitmap_flush(&bm) == 0);
+
+        // Unions dirty every page
+        fail_unless(hll_init(16, formats[f], &other) == 0);
+        fail_unless(hll_union(&h, &other) == 0);
+        fail_unless(bm.dirty[0] == ~0ULL >> (63 - last));
+
+        fail_unless(hll_destroy(&other) == 0);
+        fail_unless(hll_destroy(&h) == 0);
+        unlink("/tmp/hll_marks_dirty");
+    }
+}
+END_TEST
+
 START_TEST(test_hll_size)
 {
     hll_t h;
-    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(10, HLL_PACKED, &h) == 0);
 
     double s = hll_size(&h);
     fail_unless(s == 0);
@@ -115,7 +160,7 @@ START_TEST(test_hll_error_bound)
 {
     // Precision 14 -> variance of 1%
     hll_t h;
-    fail_unless(hll_init(14, &h) == 0);
+    fail_unless(hll_init(14, HLL_PACKED, &h) == 0);
 
     char buf[100];
     for (int i=0; i < 10000; i++) {
@@ -131,6 +176,134 @@ START_TEST(test_hll_error_bound)
 }
 END_TEST
 
+START_TEST(test_hll_ertl)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hll_t h, sp;
+        fail_unless(hll_init(14, formats[f], &h) == 0);
+        fail_unless(hll_init_sparse(14, formats[f], &sp) == 0);
+        fail_unless(hll_size_ertl(&h) == 0);
+
+        // Stays within 2% through the linear counting range
+        char buf[100];
+        int checks[] = {100, 1000, 10000, 50000, 100000};
+        int i = 0;
+        for (int c=0; c < 5; c++) {
+            for (; i < checks[c]; i++) {
+                fail_unless(sprintf((char*)&buf, "test%d", i));
+                hll_add(&h, (char*)&buf);
+                hll_add(&sp, (char*)&buf);
+            }
+            double s = hll_estimate(&h, HLL_ESTIMATOR_ERTL);
+            fail_unless(fabs(s - checks[c]) < 0.02 * checks[c]);
+            fail_unless(fabs(hll_size_ertl(&sp) - s) < 1e-9 * s);
+        }
+        fail_unless(hll_estimate(&h, HLL_ESTIMATOR_BIAS) == hll_size(&h));
+
+        fail_unless(hll_destroy(&h) == 0);
+        fail_unless(hll_destroy(&sp) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_hll_high_precision)
+{
+    hll_t h, sp;
+    fail_unless(hll_init(22, HLL_PACKED, &h) == 0);
+    fail_unless(hll_init_sparse(22, HLL_PACKED, &sp) == 0);
+    fail_unless(hll_size(&h) == 0);
+
+    // The last register index needs the widest sparse entry
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    hll_add_hash(&h, ~0ULL);
+    hll_add_hash(&sp, ~0ULL);
+    for (int i=1; i < 1000000; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hll_add_hash(&h, x);
+        if (i < 50000) hll_add_hash(&sp, x);
+    }
+
+    // Error at p=22 is about 0.05%
+    double s = hll_size(&h);
+    fail_unless(fabs(s - 1000000) < 0.003 * 1000000);
+    s = hll_size(&sp);
+    fail_unless(fabs(s - 50000) < 0.003 * 50000);
+
+    // The sparse encoding round trips the largest entries
+    unsigned char *buf;
+    uint64_t len;
+    hll_t copy;
+    fail_unless(hll_sparse_encode(&sp, &buf, &len) == 0);
+    fail_unless(hll_init_sparse_from_buffer(22, HLL_PACKED, buf, len, &copy) == 0);
+    fail_unless(hll_size(&copy) == hll_size(&sp));
+    free(buf);
+
+    fail_unless(hll_convert_dense(&copy, NULL) == 0);
+    fail_unless(fabs(hll_size(&copy) - s) < 1e-9 * s);
+
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&sp) == 0);
+    fail_unless(hll_destroy(&copy) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_hash)
+{
+    hll_hash hash;
+    fail_unless(hll_hash_from_name("murmur", &hash) == 0);
+    fail_unless(hash == HLL_HASH_MURMUR);
+    fail_unless(hll_hash_from_name("WYHASH", &hash) == 0);
+    fail_unless(hash == HLL_HASH_WYHASH);
+    fail_unless(hll_hash_from_name("foo", &hash) == -1);
+    fail_unless(strcmp(hll_hash_name(HLL_HASH_MURMUR), "murmur") == 0);
+    fail_unless(strcmp(hll_hash_name(HLL_HASH_WYHASH), "wyhash") == 0);
+    fail_unless(hll_hash_name(-1) == NULL);
+
+    // Murmur keeps the upper half of the 128 bit hash
+    uint64_t out[2];
+    MurmurHash3_x64_128("test", 4, 0, &out);
+    fail_unless(hll_hash_key(HLL_HASH_MURMUR, "test", 4) == out[1]);
+
+    // Each length class of wyhash is used, and the
+    // estimate is as accurate as with murmur
+    char buf[100];
+    memset(buf, 'a', sizeof(buf));
+    uint64_t prev = hll_hash_key(HLL_HASH_WYHASH, buf, 0);
+    for (int len=1; len < 100; len++) {
+        uint64_t h = hll_hash_key(HLL_HASH_WYHASH, buf, len);
+        fail_unless(h != prev);
+        fail_unless(h == hll_hash_key(HLL_HASH_WYHASH, buf, len));
+        prev = h;
+    }
+
+    hll_t h;
+    fail_unless(hll_init(14, HLL_PACKED, &h) == 0);
+    for (int i=0; i < 10000; i++) {
+        int len = sprintf((char*)&buf, "test%d", i);
+        hll_add_hash(&h, hll_hash_key(HLL_HASH_WYHASH, buf, len));
+    }
+    double s = hll_size(&h);
+    fail_unless(s > 9800 && s < 10200);
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_estimator_name)
+{
+    hll_estimator est;
+    fail_unless(hll_estimator_from_name("bias", &est) == 0);
+    fail_unless(est == HLL_ESTIMATOR_BIAS);
+    fail_unless(hll_estimator_from_name("ERTL", &est) == 0);
+    fail_unless(est == HLL_ESTIMATOR_ERTL);
+    fail_unless(hll_estimator_from_name("foo", &est) == -1);
+
+    fail_unless(strcmp(hll_estimator_name(HLL_ESTIMATOR_BIAS), "bias") == 0);
+    fail_unless(strcmp(hll_estimator_name(HLL_ESTIMATOR_ERTL), "ertl") == 0);
+    fail_unless(hll_estimator_name(-1) == NULL);
+}
+END_TEST
+
 START_TEST(test_hll_precision_for_error)
 {
     fail_unless(hll_precision_for_error(1.0) == -1);
@@ -145,7 +318,7 @@ END_TEST
 START_TEST(test_hll_error_for_precision)
 {
     fail_unless(hll_error_for_precision(3) == 0);
-    fail_unless(hll_error_for_precision(20) == 0);
+    fail_unless(hll_error_for_precision(23) == 0);
     fail_unless(hll_error_for_precision(12) == .01625);
     fail_unless(hll_error_for_precision(10) == .0325);
     fail_unless(hll_error_for_precision(16) == .0040625);
@@ -154,11 +327,992 @@ END_TEST
 
 START_TEST(test_hll_bytes_for_precision)
 {
-    fail_unless(hll_bytes_for_precision(3) == 0);
-    fail_unless(hll_bytes_for_precision(20) == 0);
-    fail_unless(hll_bytes_for_precision(12) == 3280);
-    fail_unless(hll_bytes_for_precision(10) == 820);
-    fail_unless(hll_bytes_for_precision(16) == 52432);
+    fail_unless(hll_bytes_for_precision(3, HLL_PACKED) == 0);
+    fail_unless(hll_bytes_for_precision(23, HLL_PACKED) == 0);
+    fail_unless(hll_bytes_for_precision(22, HLL_PACKED) == 3355444);
+    fail_unless(hll_bytes_for_precision(12, HLL_PACKED) == 3280);
+    fail_unless(hll_bytes_for_precision(10, HLL_PACKED) == 820);
+    fail_unless(hll_bytes_for_precision(16, HLL_PACKED) == 52432);
+}
+END_TEST
+
+
+START_TEST(test_hll_bytes_for_precision_byte)
+{
+    fail_unless(hll_bytes_for_precision(3, HLL_BYTE) == 0);
+    fail_unless(hll_bytes_for_precision(23, HLL_BYTE) == 0);
+    fail_unless(hll_bytes_for_precision(22, HLL_BYTE) == 4194304);
+    fail_unless(hll_bytes_for_precision(12, HLL_BYTE) == 4096);
+    fail_unless(hll_bytes_for_precision(10, HLL_BYTE) == 1024);
+    fail_unless(hll_bytes_for_precision(16, HLL_BYTE) == 65536);
+}
+END_TEST
+
+START_TEST(test_hll_bytes_for_precision_nibble)
+{
+    fail_unless(hll_bytes_for_precision(3, HLL_NIBBLE) == 0);
+    fail_unless(hll_bytes_for_precision(4, HLL_NIBBLE) == 16);
+    fail_unless(hll_bytes_for_precision(12, HLL_NIBBLE) == 2192);
+    fail_unless(hll_bytes_for_precision(14, HLL_NIBBLE) == 8744);
+    fail_unless(hll_bytes_for_precision(22, HLL_NIBBLE) == 2236968);
+}
+END_TEST
+
+START_TEST(test_hll_format_name)
+{
+    hll_format format;
+    fail_unless(hll_format_from_name("packed", &format) == 0);
+    fail_unless(format == HLL_PACKED);
+    fail_unless(hll_format_from_name("BYTE", &format) == 0);
+    fail_unless(format == HLL_BYTE);
+    fail_unless(hll_format_from_name("foo", &format) == -1);
+
+    fail_unless(strcmp(hll_format_name(HLL_PACKED), "packed") == 0);
+    fail_unless(strcmp(hll_format_name(HLL_BYTE), "byte") == 0);
+    fail_unless(hll_format_from_name("nibble", &format) == 0);
+    fail_unless(format == HLL_NIBBLE);
+    fail_unless(strcmp(hll_format_name(HLL_NIBBLE), "nibble") == 0);
+    fail_unless(hll_format_name(-1) == NULL);
+}
+END_TEST
+
+START_TEST(test_hll_byte_init_bitmap_bad_size)
+{
+    hlld_bitmap bm;
+    uint64_t bytes = hll_bytes_for_precision(10, HLL_PACKED);
+    fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &bm) == 0);
+
+    // Packed sized bitmap cannot be used for byte registers
+    hll_t h;
+    fail_unless(hll_init_from_bitmap(10, HLL_BYTE, &bm, &h) == -1);
+    fail_unless(bitmap_close(&bm) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_byte_error_bound)
+{
+    // Precision 14 -> variance of 1%
+    hll_t h;
+    fail_unless(hll_init(14, HLL_BYTE, &h) == 0);
+
+    char buf[100];
+    for (int i=0; i < 10000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+    }
+
+    // Should be within 1%
+    double s = hll_size(&h);
+    fail_unless(s > 9900 && s < 10100);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_byte_matches_packed)
+{
+    hll_t p, b;
+    fail_unless(hll_init(12, HLL_PACKED, &p) == 0);
+    fail_unless(hll_init(12, HLL_BYTE, &b) == 0);
+
+    char buf[100];
+    for (int i=0; i < 5000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&p, (char*)&buf);
+        hll_add(&b, (char*)&buf);
+    }
+
+    // Same registers, so the estimates must match up to
+    // the summation order of the vectorized kernels
+    double ps = hll_size(&p), bs = hll_size(&b);
+    fail_unless(fabs(ps - bs) < 1e-9 * ps);
+
+    fail_unless(hll_destroy(&p) == 0);
+    fail_unless(hll_destroy(&b) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_byte_size_large_registers)
+{
+    hll_t p, b;
+    fail_unless(hll_init(10, HLL_PACKED, &p) == 0);
+    fail_unless(hll_init(10, HLL_BYTE, &b) == 0);
+
+    // Use hashes with many leading zeros after the index
+    // bits, to exercise large register values
+    for (uint64_t i=0; i < 1024; i++) {
+        uint64_t hash = (i << 54) | (1ULL << (i % 50));
+        hll_add_hash(&p, hash);
+        hll_add_hash(&b, hash);
+    }
+
+    double ps = hll_size(&p), bs = hll_size(&b);
+    fail_unless(ps > 0);
+    fail_unless(fabs(ps - bs) < 1e-9 * ps);
+
+    fail_unless(hll_destroy(&p) == 0);
+    fail_unless(hll_destroy(&b) == 0);
+}
+END_TEST
+
+/*
+ * Counts the registers of a nibble HLL that differ from those
+ * of another, failing if any is larger or not cut to the top
+ * offset of its word
+ */
+static int nibble_cut_registers(const uint32_t *full, const uint32_t *nibble, int num) {
+    int cut = 0;
+    for (int i=0; i < num; i++) {
+        if (full[i] == nibble[i]) continue;
+        fail_unless(HLL_ENTRY_IDX(full[i]) == HLL_ENTRY_IDX(nibble[i]));
+        fail_unless(HLL_ENTRY_VAL(nibble[i]) < HLL_ENTRY_VAL(full[i]));
+        int w = i / 15, low = 64;
+        for (int j=w * 15; j < w * 15 + 15 && j < num; j++)
+            if (j != i && (int)HLL_ENTRY_VAL(nibble[j]) < low) low = HLL_ENTRY_VAL(nibble[j]);
+        fail_unless((int)HLL_ENTRY_VAL(nibble[i]) >= low + 15);
+        cut++;
+    }
+    return cut;
+}
+
+START_TEST(test_hll_nibble_matches_packed)
+{
+    hll_t p, n;
+    fail_unless(hll_init(12, HLL_PACKED, &p) == 0);
+    fail_unless(hll_init(12, HLL_NIBBLE, &n) == 0);
+
+    char buf[100];
+    uint64_t hashes[100];
+    for (int i=0; i < 200000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hashes[i % 100] = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+        if (i % 100 == 99) {
+            hll_add_hashes(&p, hashes, 100);
+            hll_add_hashes(&n, hashes, 100);
+        }
+    }
+
+    // Only the rare register far above the rest of its word is cut
+    uint32_t *pe = malloc(4096 * sizeof(uint32_t)), *ne = malloc(4096 * sizeof(uint32_t));
+    int num = hll_register_entries(&p, pe);
+    fail_unless(num == 4096);
+    fail_unless(hll_register_entries(&n, ne) == num);
+    fail_unless(nibble_cut_registers(pe, ne, num) <= 2);
+    fail_unless(fabs(hll_size(&p) - hll_size(&n)) < 1e-4 * hll_size(&p));
+    fail_unless(fabs(hll_size_ertl(&p) - hll_size_ertl(&n)) < 1e-4 * hll_size(&p));
+
+    // Unions across the layouts keep the registers
+    hll_t u;
+    fail_unless(hll_init(12, HLL_NIBBLE, &u) == 0);
+    fail_unless(hll_union(&u, &p) == 0);
+    fail_unless(hll_union(&u, &n) == 0);
+    fail_unless(hll_register_entries(&u, ne) == num);
+    fail_unless(nibble_cut_registers(pe, ne, num) <= 2);
+
+    // As does the cold encoding
+    unsigned char *cold;
+    uint64_t cold_len;
+    hlld_bitmap bm;
+    hll_t c;
+    fail_unless(hll_cold_encode(&n, &cold, &cold_len) == 0);
+    fail_unless(bitmap_from_file(-1, hll_bytes_for_precision(12, HLL_NIBBLE), ANONYMOUS, &bm) == 0);
+    fail_unless(hll_init_from_cold_buffer(12, HLL_NIBBLE, &bm, cold, cold_len, &c) == 0);
+    fail_unless(hll_size(&c) == hll_size(&n));
+    free(cold);
+
+    free(pe);
+    free(ne);
+    fail_unless(hll_destroy(&c) == 0);
+    fail_unless(hll_destroy(&u) == 0);
+    fail_unless(hll_destroy(&p) == 0);
+    fail_unless(hll_destroy(&n) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_nibble_rebase)
+{
+    hll_t h;
+    fail_unless(hll_init(4, HLL_NIBBLE, &h) == 0);
+
+    // Raising the first word past its offsets moves the base
+    uint32_t entries[16];
+    for (int i=0; i < 15; i++) entries[i] = HLL_ENTRY(i, 10);
+    hll_raise_registers(&h, entries, 15);
+    entries[0] = HLL_ENTRY(0, 25);
+    fail_unless(hll_raise_registers(&h, entries, 1) == 1);
+    fail_unless(hll_register_entries(&h, entries) == 15);
+    fail_unless(entries[0] == HLL_ENTRY(0, 25));
+    fail_unless(entries[1] == HLL_ENTRY(1, 10));
+    fail_unless(entries[14] == HLL_ENTRY(14, 10));
+
+    // Past the lowest register by more than the offsets is cut
+    entries[0] = HLL_ENTRY(1, 40);
+    hll_raise_registers(&h, entries, 1);
+    fail_unless(hll_register_entries(&h, entries) == 15);
+    fail_unless(entries[1] == HLL_ENTRY(1, 25));
+    fail_unless(entries[2] == HLL_ENTRY(2, 10));
+
+    // The lone register of the last word reaches 30
+    entries[0] = HLL_ENTRY(15, 30);
+    hll_raise_registers(&h, entries, 1);
+    entries[0] = HLL_ENTRY(15, 40);
+    hll_raise_registers(&h, entries, 1);
+    fail_unless(hll_register_entries(&h, entries) == 16);
+    fail_unless(entries[15] == HLL_ENTRY(15, 30));
+    fail_unless(hll_registers_valid(&h));
+
+    // The estimator state follows the values kept
+    double s = hll_size(&h);
+    hll_t copy;
+    fail_unless(hll_init(4, HLL_BYTE, &copy) == 0);
+    hll_raise_registers(&copy, entries, 16);
+    fail_unless(hll_size(&copy) == s);
+
+    // A word raised in one merge is not cut by the order of
+    // its entries, though raising the first alone would be
+    hll_t merged;
+    fail_unless(hll_init(4, HLL_NIBBLE, &merged) == 0);
+    entries[0] = HLL_ENTRY(0, 30);
+    for (int i=1; i < 15; i++) entries[i] = HLL_ENTRY(i, 20);
+    fail_unless(hll_raise_registers(&merged, entries, 15) == 15);
+    fail_unless(hll_register_entries(&merged, entries) == 15);
+    fail_unless(entries[0] == HLL_ENTRY(0, 30));
+    fail_unless(entries[14] == HLL_ENTRY(14, 20));
+
+    fail_unless(hll_destroy(&merged) == 0);
+    fail_unless(hll_destroy(&copy) == 0);
+    fail_unless(hll_destroy(&h) == 0);
 }
 END_TEST
 
+START_TEST(test_hll_sparse_matches_dense)
+{
+    hll_t d, sp;
+    fail_unless(hll_init(14, HLL_PACKED, &d) == 0);
+    fail_unless(hll_init_sparse(14, HLL_PACKED, &sp) == 0);
+    fail_unless(hll_is_sparse(&sp));
+    fail_unless(!hll_is_sparse(&d));
+
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&d, (char*)&buf);
+        hll_add(&sp, (char*)&buf);
+
+        // Repeats are merged with the existing entries
+        hll_add(&sp, (char*)&buf);
+    }
+
+    double ds = hll_size(&d), ss = hll_size(&sp);
+    fail_unless(fabs(ds - ss) < 1e-9 * ds);
+    fail_unless(!hll_sparse_should_convert(&sp));
+    fail_unless(hll_sparse_bytes(&sp) < hll_bytes_for_precision(14, HLL_PACKED));
+
+    fail_unless(hll_destroy(&d) == 0);
+    fail_unless(hll_destroy(&sp) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_sparse_convert)
+{
+    hll_t d, sp;
+    fail_unless(hll_init(10, HLL_BYTE, &d) == 0);
+    fail_unless(hll_init_sparse(10, HLL_BYTE, &sp) == 0);
+
+    char buf[100];
+    int i;
+    for (i=0; !hll_sparse_should_convert(&sp); i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&d, (char*)&buf);
+        hll_add(&sp, (char*)&buf);
+    }
+    fail_unless(i < 1024);
+
+    fail_unless(hll_convert_dense(&sp, NULL) == 0);
+    fail_unless(!hll_is_sparse(&sp));
+    fail_unless(hll_convert_dense(&sp, NULL) == -1);
+    fail_unless(memcmp(d.registers, sp.registers, hll_bytes_for_precision(10, HLL_BYTE)) == 0);
+
+    // Keeps working as a dense HLL
+    for (; i < 5000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&d, (char*)&buf);
+        hll_add(&sp, (char*)&buf);
+    }
+    fail_unless(hll_size(&d) == hll_size(&sp));
+
+    fail_unless(hll_destroy(&d) == 0);
+    fail_unless(hll_destroy(&sp) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_sparse_encode)
+{
+    hll_t sp, restore, d;
+    fail_unless(hll_init(12, HLL_PACKED, &d) == 0);
+    fail_unless(hll_sparse_encode(&d, NULL, NULL) == -1);
+    fail_unless(hll_init_sparse(12, HLL_PACKED, &sp) == 0);
+
+    char buf[100];
+    for (int i=0; i < 300; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&sp, (char*)&buf);
+    }
+
+    unsigned char *enc;
+    uint64_t len;
+    fail_unless(hll_sparse_encode(&sp, &enc, &len) == 0);
+    fail_unless(len < hll_bytes_for_precision(12, HLL_PACKED));
+
+    // Wrong precision and truncation are rejected
+    fail_unless(hll_init_sparse_from_buffer(13, HLL_PACKED, enc, len, &restore) == -1);
+    fail_unless(hll_init_sparse_from_buffer(12, HLL_PACKED, enc, len - 1, &restore) == -1);
+    fail_unless(hll_init_sparse_from_buffer(12, HLL_PACKED, enc, 4, &restore) == -1);
+
+    fail_unless(hll_init_sparse_from_buffer(12, HLL_PACKED, enc, len, &restore) == 0);
+    fail_unless(hll_is_sparse(&restore));
+    fail_unless(hll_size(&restore) == hll_size(&sp));
+    free(enc);
+
+    fail_unless(hll_destroy(&sp) == 0);
+    fail_unless(hll_destroy(&restore) == 0);
+    fail_unless(hll_destroy(&d) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_union)
+{
+    hll_t a, b, both, ab;
+    fail_unless(hll_init(12, HLL_PACKED, &a) == 0);
+    fail_unless(hll_init(12, HLL_PACKED, &b) == 0);
+    fail_unless(hll_init(12, HLL_PACKED, &both) == 0);
+    fail_unless(hll_init(12, HLL_BYTE, &ab) == 0);
+
+    char buf[100];
+    for (int i=0; i < 20000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add((i % 3) ? &a : &b, (char*)&buf);
+        hll_add(&both, (char*)&buf);
+    }
+
+    // Packed into packed uses the word kernel, and byte
+    // into packed merges register by register
+    fail_unless(hll_union(&ab, &b) == 0);
+    fail_unless(hll_union(&a, &ab) == 0);
+    fail_unless(memcmp(a.registers, both.registers, hll_bytes_for_precision(12, HLL_PACKED)) == 0);
+
+    // Packed into byte, then byte into byte
+    hll_t c;
+    fail_unless(hll_init(12, HLL_BYTE, &c) == 0);
+    fail_unless(hll_union(&c, &both) == 0);
+    fail_unless(hll_union(&ab, &c) == 0);
+    fail_unless(fabs(hll_size(&ab) - hll_size(&both)) < 1e-9 * hll_size(&both));
+
+    fail_unless(hll_destroy(&a) == 0);
+    fail_unless(hll_destroy(&b) == 0);
+    fail_unless(hll_destroy(&c) == 0);
+    fail_unless(hll_destroy(&both) == 0);
+    fail_unless(hll_destroy(&ab) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_union_sparse)
+{
+    hll_t sa, sb, d, both;
+    fail_unless(hll_init_sparse(14, HLL_PACKED, &sa) == 0);
+    fail_unless(hll_init_sparse(14, HLL_PACKED, &sb) == 0);
+    fail_unless(hll_init(14, HLL_BYTE, &d) == 0);
+    fail_unless(hll_init(14, HLL_PACKED, &both) == 0);
+
+    char buf[100];
+    for (int i=0; i < 600; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add((i % 2) ? &sa : &sb, (char*)&buf);
+        hll_add(&both, (char*)&buf);
+    }
+
+    // Sparse into sparse, then sparse into dense
+    fail_unless(hll_union(&sa, &sb) == 0);
+    fail_unless(hll_is_sparse(&sa));
+    fail_unless(hll_union(&d, &sa) == 0);
+
+    double size = hll_size(&both);
+    fail_unless(fabs(hll_size(&sa) - size) < 1e-9 * size);
+    fail_unless(fabs(hll_size(&d) - size) < 1e-9 * size);
+
+    // Dense into sparse
+    hll_t sc;
+    fail_unless(hll_init_sparse(14, HLL_PACKED, &sc) == 0);
+    fail_unless(hll_union(&sc, &d) == 0);
+    fail_unless(hll_is_sparse(&sc));
+    fail_unless(fabs(hll_size(&sc) - size) < 1e-9 * size);
+
+    fail_unless(hll_destroy(&sa) == 0);
+    fail_unless(hll_destroy(&sb) == 0);
+    fail_unless(hll_destroy(&sc) == 0);
+    fail_unless(hll_destroy(&d) == 0);
+    fail_unless(hll_destroy(&both) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_register_entries)
+{
+    hll_t src, sparse, dense;
+    fail_unless(hll_init(12, HLL_PACKED, &src) == 0);
+    fail_unless(hll_init_sparse(12, HLL_PACKED, &sparse) == 0);
+    fail_unless(hll_init(12, HLL_BYTE, &dense) == 0);
+
+    // Each raise is the entry of its hash
+    char buf[100];
+    uint32_t raises[300];
+    for (int i=0; i < 300; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        uint64_t hash = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+        hll_add_hash(&src, hash);
+        raises[i] = hll_hash_entry(12, hash);
+    }
+    fail_unless(hll_raise_registers(&sparse, raises, 300) == 300);
+    fail_unless(hll_is_sparse(&sparse));
+    double size = hll_size(&src);
+    fail_unless(fabs(hll_size(&sparse) - size) < 1e-9 * size);
+
+    // The registers of the source rebuild it, in any format
+    uint32_t *entries = malloc(4096 * sizeof(uint32_t));
+    int num = hll_register_entries(&src, entries);
+    fail_unless(num > 250 && num <= 300);
+    for (int i=1; i < num; i++)
+        fail_unless(HLL_ENTRY_IDX(entries[i - 1]) < HLL_ENTRY_IDX(entries[i]));
+    fail_unless(hll_raise_registers(&dense, entries, num) == num);
+    fail_unless(fabs(hll_size(&dense) - size) < 1e-9 * size);
+
+    // Sparse registers list the same entries
+    uint32_t *sparse_entries = malloc(4096 * sizeof(uint32_t));
+    fail_unless(hll_register_entries(&sparse, sparse_entries) == num);
+    fail_unless(memcmp(entries, sparse_entries, num * sizeof(uint32_t)) == 0);
+
+    // Lower values and bad entries leave the registers alone
+    uint32_t bad[] = {HLL_ENTRY(HLL_ENTRY_IDX(entries[0]), 1),
+        HLL_ENTRY(4096, 3), HLL_ENTRY(7, 0), HLL_ENTRY(7, 60)};
+    fail_unless(hll_raise_registers(&dense, bad, 4) == 1);
+    fail_unless(fabs(hll_size(&dense) - size) < 1e-9 * size);
+
+    free(entries);
+    free(sparse_entries);
+    fail_unless(hll_destroy(&src) == 0);
+    fail_unless(hll_destroy(&sparse) == 0);
+    fail_unless(hll_destroy(&dense) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_union_bad_precision)
+{
+    // Only higher precisions can be folded down
+    hll_t a, b;
+    fail_unless(hll_init(12, HLL_PACKED, &a) == 0);
+    fail_unless(hll_init(13, HLL_PACKED, &b) == 0);
+    fail_unless(hll_union(&b, &a) == -1);
+    fail_unless(hll_union(&a, &b) == 0);
+    fail_unless(hll_destroy(&a) == 0);
+    fail_unless(hll_destroy(&b) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_union_fold)
+{
+    // Merging p14 sets into p11 matches a p11 set of all the keys
+    hll_t dense, sparse, dst, direct;
+    fail_unless(hll_init(14, HLL_BYTE, &dense) == 0);
+    fail_unless(hll_init_sparse(14, HLL_PACKED, &sparse) == 0);
+    fail_unless(hll_init(11, HLL_PACKED, &dst) == 0);
+    fail_unless(hll_init(11, HLL_PACKED, &direct) == 0);
+    char buf[64];
+    for (int i=0; i < 20000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        hll_add(&dense, buf);
+        hll_add(&direct, buf);
+    }
+    for (int i=0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "sparse%d", i);
+        hll_add(&sparse, buf);
+        hll_add(&direct, buf);
+    }
+    fail_unless(hll_union(&dst, &dense) == 0);
+    fail_unless(hll_union(&dst, &sparse) == 0);
+    fail_unless(memcmp(dst.registers, direct.registers,
+                hll_bytes_for_precision(11, HLL_PACKED)) == 0);
+
+    // Folded entries match the registers they fold into
+    uint32_t entry = hll_hash_entry(14, 0x123456789abcdefULL);
+    fail_unless(hll_fold_entry(entry, 14, 11) == hll_hash_entry(11, 0x123456789abcdefULL));
+    fail_unless(hll_fold_entry(entry, 14, 14) == entry);
+
+    hll_destroy(&dense);
+    hll_destroy(&sparse);
+    hll_destroy(&dst);
+    hll_destroy(&direct);
+}
+END_TEST
+
+START_TEST(test_hll_scratch)
+{
+    hll_t *h = hll_scratch(12, 0);
+    fail_unless(h != NULL);
+    fail_unless(h->format == HLL_BYTE);
+    hll_add(h, "test");
+    fail_unless(hll_size(h) > 0);
+
+    // Re-used and zeroed for the same slot
+    hll_t *again = hll_scratch(12, 0);
+    fail_unless(again == h);
+    fail_unless(hll_size(again) == 0);
+
+    // Other precisions are re-allocated
+    h = hll_scratch(14, 0);
+    fail_unless(h != NULL && h->precision == 14);
+
+    fail_unless(hll_scratch(12, HLL_SCRATCH_SLOTS) == NULL);
+    fail_unless(hll_scratch(30, 1) == NULL);
+}
+END_TEST
+
+START_TEST(test_hll_add_hashes)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hll_t one, batch, sparse;
+        fail_unless(hll_init(10, formats[f], &one) == 0);
+        fail_unless(hll_init(10, formats[f], &batch) == 0);
+        fail_unless(hll_init_sparse(10, formats[f], &sparse) == 0);
+
+        // Odd sized batch to cover a partial group
+        uint64_t hashes[1001];
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (int i=0; i < 1001; i++) {
+            h ^= h << 13; h ^= h >> 7; h ^= h << 17;
+            hashes[i] = h;
+            hll_add_hash(&one, h);
+        }
+        hll_add_hashes(&batch, hashes, 1001);
+        hll_add_hashes(&sparse, hashes, 1001);
+
+        fail_unless(memcmp(one.registers, batch.registers,
+                    hll_bytes_for_precision(10, formats[f])) == 0);
+        fail_unless(fabs(hll_size(&sparse) - hll_size(&one)) < 1e-9 * hll_size(&one));
+
+        fail_unless(hll_destroy(&one) == 0);
+        fail_unless(hll_destroy(&batch) == 0);
+        fail_unless(hll_destroy(&sparse) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_hll_kernels)
+{
+    // Every specialized kernel agrees with the generic register updates
+    uint64_t hashes[1000];
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < 1000; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hashes[i] = x;
+    }
+
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        for (int p=HLL_MIN_PRECISION; p <= HLL_MAX_PRECISION; p++) {
+            hll_t single, batch, sp;
+            fail_unless(hll_init(p, formats[f], &single) == 0);
+            fail_unless(hll_init(p, formats[f], &batch) == 0);
+            fail_unless(hll_init_sparse(p, formats[f], &sp) == 0);
+            for (int i=0; i < 1000; i++) hll_add_hash(&single, hashes[i]);
+            hll_add_hashes(&batch, hashes, 1000);
+            hll_add_hashes(&sp, hashes, 1000);
+            fail_unless(hll_convert_dense(&sp, NULL) == 0);
+
+            uint64_t bytes = hll_bytes_for_precision(p, formats[f]);
+            fail_unless(memcmp(single.registers, batch.registers, bytes) == 0);
+            fail_unless(memcmp(single.registers, sp.registers, bytes) == 0);
+            fail_unless(hll_size(&single) == hll_size(&sp));
+
+            fail_unless(hll_destroy(&single) == 0);
+            fail_unless(hll_destroy(&batch) == 0);
+            fail_unless(hll_destroy(&sp) == 0);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_hll_add_changed)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hll_t h;
+        fail_unless(hll_init(10, formats[f], &h) == 0);
+
+        // Only the first add of a hash raises a register
+        fail_unless(hll_add_hash(&h, 0x9e3779b97f4a7c15ULL) == 1);
+        fail_unless(hll_add_hash(&h, 0x9e3779b97f4a7c15ULL) == 0);
+        fail_unless(hll_add(&h, "test") == 1);
+        fail_unless(hll_add(&h, "test") == 0);
+
+        uint64_t hashes[100];
+        uint64_t x = 0x2545f4914f6cdd1dULL;
+        for (int i=0; i < 100; i++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            hashes[i] = x;
+        }
+        fail_unless(hll_add_hashes(&h, hashes, 100) > 0);
+        fail_unless(hll_add_hashes(&h, hashes, 100) == 0);
+        fail_unless(hll_destroy(&h) == 0);
+    }
+}
+END_TEST
+
+/*
+ * Checks the maintained estimator state against a full pass
+ */
+static void check_sum_state(hll_t *h) {
+    int num_zero = 0;
+    double inv_sum;
+    if (h->format == HLL_BYTE)
+        inv_sum = hll_sum_bytes((unsigned char*)h->registers, 1 << h->precision, &num_zero);
+    else
+        inv_sum = hll_sum_packed(h->registers, 1 << h->precision, &num_zero);
+    fail_unless(h->num_zero == num_zero);
+    fail_unless(fabs(ldexp((double)h->inv_sum, -(63 - h->precision)) - inv_sum) < 1e-9 * inv_sum);
+}
+
+START_TEST(test_hll_sum_state)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hll_t a, b, sp;
+        fail_unless(hll_init(12, formats[f], &a) == 0);
+        fail_unless(hll_init(12, formats[f], &b) == 0);
+        fail_unless(hll_init_sparse(12, formats[f], &sp) == 0);
+        check_sum_state(&a);
+
+        char buf[100];
+        for (int i=0; i < 20000; i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            hll_add((i % 2) ? &a : &b, (char*)&buf);
+            if (i % 3 == 0) hll_add(&sp, (char*)&buf);
+        }
+        check_sum_state(&a);
+        check_sum_state(&b);
+
+        // Unions through the kernels and the sparse path
+        fail_unless(hll_union(&a, &b) == 0);
+        check_sum_state(&a);
+        fail_unless(hll_union(&b, &sp) == 0);
+        check_sum_state(&b);
+
+        // Conversion rebuilds the state
+        fail_unless(hll_convert_dense(&sp, NULL) == 0);
+        check_sum_state(&sp);
+
+        fail_unless(hll_destroy(&a) == 0);
+        fail_unless(hll_destroy(&b) == 0);
+        fail_unless(hll_destroy(&sp) == 0);
+    }
+}
+END_TEST
+
+typedef struct {
+    hll_t *h;
+    int offset;
+} concurrent_args;
+
+static void* concurrent_add(void *in) {
+    concurrent_args *args = in;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < 200000; i++) {
+        h ^= h << 13; h ^= h >> 7; h ^= h << 17;
+        if (i % 4 == args->offset) hll_add_hash(args->h, h);
+    }
+    return NULL;
+}
+
+START_TEST(test_hll_cold_encode)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    int counts[] = {0, 1000, 20000, 200000};
+    for (int f=0; f < 2; f++) {
+        for (int c=0; c < 4; c++) {
+            hll_t h, restore;
+            fail_unless(hll_init(12, formats[f], &h) == 0);
+            char buf[100];
+            for (int i=0; i < counts[c]; i++) {
+                fail_unless(sprintf((char*)&buf, "test%d", i));
+                hll_add(&h, (char*)&buf);
+            }
+
+            // Force a register far from the rest to be escaped
+            if (counts[c]) hll_add_hash(&h, 0);
+
+            unsigned char *enc;
+            uint64_t len;
+            uint64_t bytes = hll_bytes_for_precision(12, formats[f]);
+            fail_unless(hll_cold_encode(&h, &enc, &len) == 0);
+            fail_unless(len < bytes);
+            fail_unless(hll_is_cold_buffer(enc, len));
+
+            // Registers and the estimator state are restored
+            hlld_bitmap bm;
+            fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &bm) == 0);
+            fail_unless(hll_init_from_cold_buffer(12, formats[f], &bm, enc, len, &restore) == 0);
+            fail_unless(memcmp(restore.registers, h.registers, bytes) == 0);
+            fail_unless(hll_size(&restore) == hll_size(&h));
+            check_sum_state(&restore);
+
+            // Wrong precision and truncation are rejected
+            fail_unless(hll_init_from_cold_buffer(13, formats[f], &bm, enc, len, &restore) == -1);
+            fail_unless(hll_init_from_cold_buffer(12, formats[f], &bm, enc, len - 1, &restore) == -1);
+            fail_unless(hll_init_from_cold_buffer(12, formats[f], &bm, enc, 4, &restore) == -1);
+            fail_unless(!hll_is_cold_buffer(enc, 4));
+            free(enc);
+
+            fail_unless(hll_destroy(&h) == 0);
+            fail_unless(hll_destroy(&restore) == 0);
+        }
+    }
+
+    // Sparse HLLs use their own encoding
+    hll_t sp;
+    unsigned char *enc;
+    uint64_t len;
+    fail_unless(hll_init_sparse(12, HLL_PACKED, &sp) == 0);
+    fail_unless(hll_cold_encode(&sp, &enc, &len) == -1);
+    fail_unless(hll_sparse_encode(&sp, &enc, &len) == 0);
+    fail_unless(!hll_is_cold_buffer(enc, len));
+    free(enc);
+    fail_unless(hll_destroy(&sp) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_concurrent_add)
+{
+    hll_format formats[] = {HLL_PACKED, HLL_BYTE};
+    for (int f=0; f < 2; f++) {
+        hll_t shared, serial;
+        fail_unless(hll_init(8, formats[f], &shared) == 0);
+        fail_unless(hll_init(8, formats[f], &serial) == 0);
+
+        // Threads update neighbouring registers in the same words
+        pthread_t threads[4];
+        concurrent_args args[4];
+        for (int i=0; i < 4; i++) {
+            args[i].h = &shared;
+            args[i].offset = i;
+            fail_unless(pthread_create(threads + i, NULL, concurrent_add, args + i) == 0);
+        }
+        for (int i=0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+            args[i].h = &serial;
+            concurrent_add(args + i);
+        }
+
+        // No update may be lost
+        fail_unless(memcmp(shared.registers, serial.registers,
+                    hll_bytes_for_precision(8, formats[f])) == 0);
+        fail_unless(shared.inv_sum == serial.inv_sum);
+        fail_unless(shared.num_zero == serial.num_zero);
+        fail_unless(hll_destroy(&shared) == 0);
+        fail_unless(hll_destroy(&serial) == 0);
+    }
+}
+END_TEST
+
+/*
+ * Adds keys prefix0 .. prefixN to a sliding HLL at a given time
+ */
+static void add_sliding_keys(hll_sliding *s, uint64_t now, const char *prefix, int num) {
+    char buf[64];
+    for (int i=0; i < num; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        uint64_t hash = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+        hll_sliding_add_hashes(s, now, &hash, 1);
+    }
+}
+
+static uint64_t sliding_estimate(hll_sliding *s, uint64_t now, uint64_t window) {
+    hll_t h;
+    fail_unless(hll_init(s->precision, HLL_BYTE, &h) == 0);
+    fail_unless(hll_sliding_merge_into(s, now, window, &h) == 0);
+    uint64_t est = hll_estimate(&h, HLL_ESTIMATOR_BIAS) + 0.5;
+    hll_destroy(&h);
+    return est;
+}
+
+START_TEST(test_hll_sliding)
+{
+    hll_sliding s;
+    fail_unless(hll_sliding_init(12, 0, &s) == -1);
+    fail_unless(hll_sliding_init(HLL_MAX_PRECISION + 1, 3600, &s) == -1);
+    fail_unless(hll_sliding_init(12, 3600, &s) == 0);
+    fail_unless(hll_sliding_bytes(12) == 4096 * (HLL_SLIDING_PAIRS * 5));
+    fail_unless(sliding_estimate(&s, 100000, 3600) == 0);
+
+    // A distinct thousand keys a minute apart
+    uint64_t start = 100000;
+    add_sliding_keys(&s, start, "a", 1000);
+    add_sliding_keys(&s, start + 60, "b", 1000);
+    add_sliding_keys(&s, start + 120, "c", 1000);
+    fail_unless(s.dirty == 1);
+
+    // Any window can be answered, not just whole intervals
+    uint64_t now = start + 120;
+    uint64_t est = sliding_estimate(&s, now, 1);
+    fail_unless(est > 950 && est < 1050);
+    est = sliding_estimate(&s, now, 61);
+    fail_unless(est > 1900 && est < 2100);
+    est = sliding_estimate(&s, now, 121);
+    fail_unless(est > 2850 && est < 3150);
+    est = sliding_estimate(&s, now + 30, 91);
+    fail_unless(est > 1900 && est < 2100);
+
+    // Windows are capped at the longest window kept
+    est = sliding_estimate(&s, start + 3600 + 59, 86400);
+    fail_unless(est > 1900 && est < 2100);
+
+    // Re-adding keys only refreshes their times
+    add_sliding_keys(&s, start + 180, "a", 1000);
+    est = sliding_estimate(&s, start + 180, 1);
+    fail_unless(est > 950 && est < 1050);
+    est = sliding_estimate(&s, start + 180, 181);
+    fail_unless(est > 2850 && est < 3150);
+
+    hll_t other;
+    fail_unless(hll_init(13, HLL_BYTE, &other) == 0);
+    fail_unless(hll_sliding_merge_into(&s, now, 60, &other) == -1);
+    fail_unless(hll_sliding_union(&s, now, &other) == 0);
+    hll_destroy(&other);
+    hll_sliding_destroy(&s);
+}
+END_TEST
+
+START_TEST(test_hll_sliding_bounded)
+{
+    hll_sliding s;
+    fail_unless(hll_sliding_init(4, 1000000, &s) == 0);
+
+    // Falling values each add a pair, until the register is full
+    for (int i=0; i < HLL_SLIDING_PAIRS + 4; i++) {
+        int rho = 40 - i;
+        uint64_t hash = (1ULL << (64 - 4 - rho));
+        fail_unless(hll_sliding_add_hashes(&s, 1000 + i, &hash, 1) == 1);
+    }
+
+    // A smaller value at the same time changes nothing
+    uint64_t hash = 1ULL << 40;
+    fail_unless(hll_sliding_add_hashes(&s, 1000 + HLL_SLIDING_PAIRS + 3, &hash, 1) == 0);
+
+    // The oldest pairs were dropped, so longer windows see less
+    hll_t h;
+    fail_unless(hll_init(4, HLL_BYTE, &h) == 0);
+    fail_unless(hll_sliding_merge_into(&s, 2000, 1000000, &h) == 0);
+    uint32_t entries[16];
+    fail_unless(hll_register_entries(&h, entries) == 1);
+    fail_unless(entries[0] == 40 - 4);
+
+    // A larger value replaces every pair
+    hash = 1ULL << (64 - 4 - 50);
+    fail_unless(hll_sliding_add_hashes(&s, 3000, &hash, 1) == 1);
+    fail_unless(hll_clear(&h) == 0);
+    fail_unless(hll_sliding_merge_into(&s, 3000, 1, &h) == 0);
+    fail_unless(hll_register_entries(&h, entries) == 1);
+    fail_unless(entries[0] == 50);
+    hll_destroy(&h);
+    hll_sliding_destroy(&s);
+}
+END_TEST
+
+START_TEST(test_hll_sliding_encode_union)
+{
+    hll_sliding s, copy, other;
+    hll_t src;
+    fail_unless(hll_sliding_init(12, 600, &s) == 0);
+    fail_unless(hll_init(12, HLL_PACKED, &src) == 0);
+    char buf[64];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        hll_add(&src, buf);
+    }
+    fail_unless(hll_sliding_union(&s, 5000, &src) == 0);
+    add_sliding_keys(&s, 5100, "other", 1000);
+
+    unsigned char *enc;
+    uint64_t len;
+    fail_unless(hll_sliding_encode(&s, &enc, &len) == 0);
+    fail_unless(s.dirty == 0);
+    fail_unless(hll_sliding_init(12, 600, &copy) == 0);
+    fail_unless(hll_sliding_decode(&copy, enc, len) == 0);
+    uint64_t est = sliding_estimate(&copy, 5100, 600);
+    fail_unless(est > 1900 && est < 2100);
+    est = sliding_estimate(&copy, 5100, 100);
+    fail_unless(est > 950 && est < 1050);
+
+    // The layout must match
+    fail_unless(hll_sliding_decode(&copy, enc, len - 1) == -1);
+    fail_unless(hll_sliding_init(12, 60, &other) == 0);
+    fail_unless(hll_sliding_decode(&other, enc, len) == -1);
+    hll_sliding_destroy(&other);
+    enc[0] ^= 0xff;
+    fail_unless(hll_sliding_decode(&copy, enc, len) == -1);
+
+    free(enc);
+    hll_destroy(&src);
+    hll_sliding_destroy(&copy);
+    hll_sliding_destroy(&s);
+}
+END_TEST
+
+/**
+ * Checks that folding an HLL of hashes at precision 14 gives
+ * exactly the registers of the same hashes at precision 10
+ */
+static void check_fold(int sparse, int num) {
+    hll_t h, direct;
+    if (sparse) {
+        fail_unless(hll_init_sparse(14, HLL_PACKED, &h) == 0);
+        fail_unless(hll_init_sparse(10, HLL_PACKED, &direct) == 0);
+    } else {
+        fail_unless(hll_init(14, HLL_PACKED, &h) == 0);
+        fail_unless(hll_init(10, HLL_PACKED, &direct) == 0);
+    }
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    for (int i=0; i < num; i++) {
+        hash ^= hash << 13;
+        hash ^= hash >> 7;
+        hash ^= hash << 17;
+        hll_add_hash(&h, hash);
+        hll_add_hash(&direct, hash);
+    }
+    // Hashes with no bits below the precision take the largest value
+    hll_add_hash(&h, 1ULL << 63);
+    hll_add_hash(&direct, 1ULL << 63);
+
+    fail_unless(hll_fold(&h, 15) == -1);
+    fail_unless(hll_fold(&h, 3) == -1);
+    fail_unless(hll_fold(&h, 10) == 0);
+    fail_unless(h.precision == 10);
+    fail_unless(hll_is_sparse(&h) == sparse);
+
+    uint32_t *folded = malloc((1 << 10) * sizeof(uint32_t));
+    uint32_t *expect = malloc((1 << 10) * sizeof(uint32_t));
+    int num_folded = hll_register_entries(&h, folded);
+    fail_unless(num_folded == hll_register_entries(&direct, expect));
+    fail_unless(memcmp(folded, expect, num_folded * sizeof(uint32_t)) == 0);
+    fail_unless(hll_size(&h) == hll_size(&direct));
+
+    free(folded);
+    free(expect);
+    hll_destroy(&h);
+    hll_destroy(&direct);
+}
+
+START_TEST(test_hll_fold)
+{
+    check_fold(0, 20000);
+    check_fold(1, 200);
+}
+END_TEST
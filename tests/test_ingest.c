@@ -0,0 +1,111 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "set_manager.h"
+#include "ingest.h"
+
+/**
+ * Encodes a binary frame setting keys, returning its length
+ */
+static int ingest_keys_frame(char *frame, const char *set_name, char **keys, int num) {
+    int name_len = strlen(set_name);
+    char *p = frame + INGEST_FRAME_HEADER;
+    memcpy(p, set_name, name_len);
+    p += name_len;
+    for (int i=0; i < num; i++) {
+        int len = strlen(keys[i]);
+        *p++ = len & 0xff;
+        *p++ = len >> 8;
+    }
+    for (int i=0; i < num; i++) {
+        memcpy(p, keys[i], strlen(keys[i]));
+        p += strlen(keys[i]);
+    }
+    uint32_t body_len = p - frame - INGEST_FRAME_HEADER;
+    frame[0] = (char)0xB1;
+    frame[1] = 1;
+    frame[2] = name_len & 0xff;
+    frame[3] = name_len >> 8;
+    for (int i=0; i < 4; i++) {
+        frame[4 + i] = (num >> (8 * i)) & 0xff;
+        frame[8 + i] = (body_len >> (8 * i)) & 0xff;
+    }
+    return p - frame;
+}
+
+/**
+ * Waits for the server to take every frame of a ring, and
+ * to apply the last of them, for up to 5 seconds
+ */
+static void ingest_wait_drained(ingest_ring_header *ring) {
+    for (int i=0; i < 500 && ring->tail != ring->head; i++) usleep(10000);
+    fail_unless(ring->tail == ring->head);
+    usleep(50000);
+}
+
+START_TEST(test_ingest_ring)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.tcp_port = 14553;
+    config.ingest_rings = 1;
+    config.ingest_ring_kb = 64;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "ingest1", NULL) == 0);
+
+    int should_run = 1;
+    hlld_ingest *ingest;
+    fail_unless(start_ingest(&config, mgr, &should_run, &ingest) == 1);
+    ingest_ring_header *ring;
+    fail_unless(ingest_ring_open("/hlld.14553.0", &ring) == 0);
+    fail_unless(ring->size == 64 * 1024);
+
+    // Frames that do not fit are refused
+    static char frame[64 * 1024];
+    fail_unless(ingest_ring_write(ring, frame, 40 * 1024) == -2);
+
+    // Enough frames to wrap the ring several times,
+    // waiting while it is full
+    char key_buf[4][16];
+    char *keys[4];
+    for (int i=0; i < 2000; i++) {
+        for (int j=0; j < 4; j++) {
+            snprintf(key_buf[j], sizeof(key_buf[j]), "key%d", i * 4 + j);
+            keys[j] = key_buf[j];
+        }
+        int len = ingest_keys_frame(frame, "ingest1", keys, 4);
+        while ((res = ingest_ring_write(ring, frame, len)) == -1) usleep(100);
+        fail_unless(res == 0);
+    }
+    ingest_wait_drained(ring);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "ingest1", &size) == 0);
+    fail_unless(size > 7600 && size < 8400);
+
+    // Frames for sets that do not exist are dropped,
+    // and the ring carries on
+    keys[0] = "last";
+    int len = ingest_keys_frame(frame, "noop", keys, 1);
+    fail_unless(ingest_ring_write(ring, frame, len) == 0);
+    len = ingest_keys_frame(frame, "ingest1", keys, 1);
+    fail_unless(ingest_ring_write(ring, frame, len) == 0);
+    ingest_wait_drained(ring);
+    fail_unless(setmgr_set_size(mgr, "ingest1", &size) == 0);
+    fail_unless(size > 7600 && size < 8400);
+
+    ingest_ring_close(ring);
+    should_run = 0;
+    stop_ingest(ingest);
+    fail_unless(ingest_ring_open("/hlld.14553.0", &ring) < 0);
+
+    fail_unless(setmgr_drop_set(mgr, "ingest1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
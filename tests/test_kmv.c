@@ -0,0 +1,159 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hll_hash.h"
+#include "kmv.h"
+
+/*
+ * Adds keys prefix{start} .. prefix{end - 1} to a sketch
+ */
+static void add_kmv_keys(kmv_sketch *s, const char *prefix, int start, int end) {
+    char buf[64];
+    for (int i=start; i < end; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        uint64_t hash = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+        kmv_add_hashes(s, &hash, 1);
+    }
+}
+
+START_TEST(test_kmv_init_destroy)
+{
+    kmv_sketch s;
+    fail_unless(kmv_init(KMV_MIN_SIZE - 1, &s) == -1);
+    fail_unless(kmv_init(KMV_MAX_SIZE + 1, &s) == -1);
+    fail_unless(kmv_init(1024, &s) == 0);
+    fail_unless(kmv_bytes(1024) == 8192);
+    fail_unless(s.num == 0);
+    fail_unless(s.dirty == 0);
+    fail_unless(kmv_size(&s) == 0);
+    kmv_destroy(&s);
+}
+END_TEST
+
+START_TEST(test_kmv_add_size)
+{
+    kmv_sketch s;
+    fail_unless(kmv_init(1024, &s) == 0);
+
+    // Until full, the keys are counted exactly
+    add_kmv_keys(&s, "key", 0, 500);
+    add_kmv_keys(&s, "key", 0, 500);
+    fail_unless(s.num == 500);
+    fail_unless(s.dirty == 1);
+    fail_unless(kmv_size(&s) == 500);
+
+    // Then estimated from the largest kept
+    add_kmv_keys(&s, "key", 500, 100000);
+    fail_unless(s.num == 1024);
+    for (int i=1; i < s.num; i++) fail_unless(s.hashes[i - 1] < s.hashes[i]);
+    fail_unless(s.threshold == s.hashes[1023]);
+    double size = kmv_size(&s);
+    fail_unless(fabs(size - 100000) < 0.1 * 100000);
+
+    // Repeats are not kept
+    uint64_t hashes[100];
+    for (int i=0; i < 100; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key%d", i);
+        hashes[i] = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+    }
+    fail_unless(kmv_add_hashes(&s, hashes, 100) == 0);
+    fail_unless(kmv_size(&s) == size);
+    kmv_destroy(&s);
+}
+END_TEST
+
+START_TEST(test_kmv_union)
+{
+    kmv_sketch a, b, big, both;
+    fail_unless(kmv_init(256, &a) == 0);
+    fail_unless(kmv_init(256, &b) == 0);
+    fail_unless(kmv_init(1024, &big) == 0);
+    fail_unless(kmv_init(256, &both) == 0);
+    add_kmv_keys(&a, "key", 0, 20000);
+    add_kmv_keys(&b, "key", 10000, 30000);
+    add_kmv_keys(&big, "key", 10000, 30000);
+    add_kmv_keys(&both, "key", 0, 30000);
+
+    // Merging matches adding the keys of both, and
+    // a larger source is cut down to the destination
+    fail_unless(kmv_union(&a, &b) == 0);
+    fail_unless(a.num == 256);
+    fail_unless(!memcmp(a.hashes, both.hashes, 256 * sizeof(uint64_t)));
+    fail_unless(kmv_union(&b, &big) == 0);
+    fail_unless(b.num == 256);
+    fail_unless(kmv_union(&a, &a) == 0);
+
+    kmv_destroy(&a);
+    kmv_destroy(&b);
+    kmv_destroy(&big);
+    kmv_destroy(&both);
+}
+END_TEST
+
+START_TEST(test_kmv_jaccard)
+{
+    kmv_sketch a, b, c;
+    fail_unless(kmv_init(4096, &a) == 0);
+    fail_unless(kmv_init(4096, &b) == 0);
+    fail_unless(kmv_init(2048, &c) == 0);
+
+    // A small overlap of 5000 keys in a union of 195000
+    add_kmv_keys(&a, "key", 0, 100000);
+    add_kmv_keys(&b, "key", 95000, 195000);
+    kmv_sketch *pair[] = {&a, &b};
+    double jaccard, union_size;
+    fail_unless(kmv_jaccard(pair, 2, &jaccard, &union_size) == 0);
+    double expected = 5000.0 / 195000;
+    fail_unless(fabs(jaccard - expected) < 0.3 * expected);
+    fail_unless(fabs(union_size - 195000) < 0.05 * 195000);
+
+    // A set is identical to itself, and shares nothing with a
+    // disjoint one. Sketches are compared at the smallest size.
+    kmv_sketch *same[] = {&a, &a};
+    fail_unless(kmv_jaccard(same, 2, &jaccard, NULL) == 0);
+    fail_unless(jaccard == 1);
+    add_kmv_keys(&c, "other", 0, 100000);
+    kmv_sketch *three[] = {&a, &b, &c};
+    fail_unless(kmv_jaccard(three, 3, &jaccard, NULL) == 0);
+    fail_unless(jaccard == 0);
+    fail_unless(kmv_jaccard(three, 0, &jaccard, NULL) == -1);
+
+    kmv_destroy(&a);
+    kmv_destroy(&b);
+    kmv_destroy(&c);
+}
+END_TEST
+
+START_TEST(test_kmv_encode_decode)
+{
+    kmv_sketch s, loaded, other;
+    fail_unless(kmv_init(512, &s) == 0);
+    fail_unless(kmv_init(512, &loaded) == 0);
+    fail_unless(kmv_init(256, &other) == 0);
+    add_kmv_keys(&s, "key", 0, 10000);
+
+    unsigned char *buf;
+    uint64_t len;
+    fail_unless(kmv_encode(&s, &buf, &len) == 0);
+    fail_unless(s.dirty == 0);
+    fail_unless(kmv_decode(&loaded, buf, len) == 0);
+    fail_unless(loaded.num == 512);
+    fail_unless(loaded.threshold == s.threshold);
+    fail_unless(!memcmp(loaded.hashes, s.hashes, kmv_bytes(512)));
+
+    // Sketches of another size, truncated buffers
+    // and hashes out of order are refused
+    fail_unless(kmv_decode(&other, buf, len) == -1);
+    fail_unless(kmv_decode(&loaded, buf, len - 1) == -1);
+    memcpy(buf + len - 8, buf + len - 16, 8);
+    fail_unless(kmv_decode(&loaded, buf, len) == -1);
+    free(buf);
+
+    kmv_destroy(&s);
+    kmv_destroy(&loaded);
+    kmv_destroy(&other);
+}
+END_TEST
@@ -0,0 +1,123 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "manifest.h"
+
+#define MANIFEST_TEST_DIR "/tmp/hlld_manifest_test"
+
+/*
+ * Collects the loaded sets
+ */
+typedef struct {
+    int num;
+    char names[8][32];
+    hlld_set_config configs[8];
+} manifest_sets;
+
+static void collect_manifest_cb(void *data, char *set_name, hlld_set_config *config) {
+    manifest_sets *sets = data;
+    strcpy(sets->names[sets->num], set_name);
+    sets->configs[sets->num++] = *config;
+}
+
+static hlld_manifest* fresh_manifest() {
+    mkdir(MANIFEST_TEST_DIR, 0755);
+    unlink(MANIFEST_TEST_DIR "/sets.manifest");
+    hlld_manifest *m;
+    fail_unless(init_manifest(MANIFEST_TEST_DIR, &m) == 0);
+    return m;
+}
+
+START_TEST(test_manifest_missing)
+{
+    hlld_manifest *m = fresh_manifest();
+    manifest_sets sets = {0};
+    fail_unless(manifest_load(m, collect_manifest_cb, &sets) == -ENOENT);
+    fail_unless(sets.num == 0);
+    fail_unless(destroy_manifest(m) == 0);
+}
+END_TEST
+
+START_TEST(test_manifest_add_drop)
+{
+    hlld_manifest *m = fresh_manifest();
+    hlld_set_config config = {0.01, 14, 0, HLL_PACKED, 1, HLL_ESTIMATOR_BIAS, HLL_HASH_MURMUR, 100, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+    fail_unless(manifest_add(m, "foo", &config) == 0);
+    fail_unless(manifest_add(m, "bar", &config) == 0);
+    fail_unless(manifest_drop(m, "foo") == 0);
+
+    // Later records replace earlier ones
+    config.size = 200;
+    config.window = 3600;
+    config.window_buckets = 48;
+    config.sliding = 600;
+    fail_unless(manifest_add(m, "bar", &config) == 0);
+
+    manifest_sets sets = {0};
+    fail_unless(manifest_load(m, collect_manifest_cb, &sets) == 1);
+    fail_unless(sets.num == 1);
+    fail_unless(strcmp(sets.names[0], "bar") == 0);
+    fail_unless(sets.configs[0].size == 200);
+    fail_unless(sets.configs[0].default_precision == 14);
+    fail_unless(sets.configs[0].default_eps == 0.01);
+    fail_unless(sets.configs[0].sparse == 1);
+    fail_unless(sets.configs[0].window == 3600);
+    fail_unless(sets.configs[0].window_buckets == 48);
+    fail_unless(sets.configs[0].sliding == 600);
+    fail_unless(destroy_manifest(m) == 0);
+}
+END_TEST
+
+START_TEST(test_manifest_checkpoint)
+{
+    hlld_manifest *m = fresh_manifest();
+    hlld_set_config config = {0.01, 12, 1, HLL_BYTE, 0, HLL_ESTIMATOR_ERTL, HLL_HASH_WYHASH, 5, 0, 0, 0, 256, 1700000000, DURABILITY_WAL, 30};
+    fail_unless(manifest_add(m, "old", &config) == 0);
+
+    // The checkpoint replaces what was appended before it
+    manifest_checkpoint_begin(m);
+    manifest_checkpoint_add(m, "one", &config);
+    manifest_checkpoint_add(m, "two", &config);
+    fail_unless(manifest_checkpoint_end(m) == 0);
+    fail_unless(manifest_add(m, "three", &config) == 0);
+
+    manifest_sets sets = {0};
+    fail_unless(manifest_load(m, collect_manifest_cb, &sets) == 3);
+    for (int i=0; i < sets.num; i++) {
+        fail_unless(strcmp(sets.names[i], "old") != 0);
+        fail_unless(sets.configs[i].in_memory == 1);
+        fail_unless(sets.configs[i].format == HLL_BYTE);
+        fail_unless(sets.configs[i].estimator == HLL_ESTIMATOR_ERTL);
+        fail_unless(sets.configs[i].hash == HLL_HASH_WYHASH);
+        fail_unless(sets.configs[i].kmv == 256);
+        fail_unless(sets.configs[i].expires == 1700000000);
+        fail_unless(sets.configs[i].durability == DURABILITY_WAL);
+        fail_unless(sets.configs[i].flush_period == 30);
+    }
+    fail_unless(destroy_manifest(m) == 0);
+}
+END_TEST
+
+START_TEST(test_manifest_corrupt)
+{
+    hlld_manifest *m = fresh_manifest();
+    hlld_set_config config = {0.01, 12, 0, HLL_PACKED, 0, HLL_ESTIMATOR_BIAS, HLL_HASH_MURMUR, 0, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+    fail_unless(manifest_add(m, "first", &config) == 0);
+    fail_unless(manifest_add(m, "second", &config) == 0);
+
+    // A torn append invalidates the manifest
+    struct stat buf;
+    fail_unless(stat(MANIFEST_TEST_DIR "/sets.manifest", &buf) == 0);
+    fail_unless(truncate(MANIFEST_TEST_DIR "/sets.manifest", buf.st_size - 1) == 0);
+
+    manifest_sets sets = {0};
+    fail_unless(manifest_load(m, collect_manifest_cb, &sets) == -EINVAL);
+    fail_unless(sets.num == 0);
+    fail_unless(destroy_manifest(m) == 0);
+}
+END_TEST
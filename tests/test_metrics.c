@@ -0,0 +1,144 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+
+START_TEST(test_metrics_init_destroy)
+{
+    hlld_metrics *m;
+    fail_unless(init_metrics(4, &m) == 0);
+    fail_unless(((uintptr_t)metrics_worker(m, 1) % 64) == 0);
+    fail_unless(metrics_worker(m, 3)->bytes_in == 0);
+    fail_unless(destroy_metrics(m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_buckets)
+{
+    // Each bucket starts after the last, and is within 12.5%
+    uint64_t last = 0;
+    for (int b=1; b < LATENCY_BUCKETS; b++) {
+        uint64_t max = metrics_bucket_max(b);
+        fail_unless(max > last);
+        fail_unless((max - last) * 8 <= last + 8);
+        last = max;
+    }
+    fail_unless(last == (1ULL << LATENCY_MAX_BITS) - 1);
+}
+END_TEST
+
+START_TEST(test_metrics_percentile)
+{
+    hlld_metrics *m;
+    fail_unless(init_metrics(1, &m) == 0);
+    worker_metrics *w = metrics_worker(m, 0);
+    fail_unless(metrics_percentile(w->cmds + 1, 0.5) == 0);
+
+    // 1000 values of 1us to 1ms
+    for (int i=1; i <= 1000; i++)
+        metrics_record_cmd(w, 1, i * 1000);
+    fail_unless(w->cmds[1].count == 1000);
+
+    uint64_t p50 = metrics_percentile(w->cmds + 1, 0.5);
+    uint64_t p99 = metrics_percentile(w->cmds + 1, 0.99);
+    fail_unless(p50 >= 500000 && p50 <= 500000 * 1.125);
+    fail_unless(p99 >= 990000 && p99 <= 990000 * 1.125);
+    fail_unless(metrics_percentile(w->cmds + 1, 1) >= 1000000);
+
+    // Very large values are kept in the last bucket
+    metrics_record_cmd(w, 2, ~0ULL);
+    fail_unless(metrics_percentile(w->cmds + 2, 1) == (1ULL << LATENCY_MAX_BITS) - 1);
+    fail_unless(destroy_metrics(m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_snapshot)
+{
+    hlld_metrics *m;
+    fail_unless(init_metrics(2, &m) == 0);
+    worker_metrics *w1 = metrics_worker(m, 0);
+    worker_metrics *w2 = metrics_worker(m, 1);
+    w1->bytes_in = 10;
+    w2->bytes_in = 5;
+    w2->conns_opened = 3;
+    metrics_record_cmd(w1, 3, 100);
+    metrics_record_cmd(w2, 3, 100);
+    metrics_record_cmd(w2, 3, 1000000);
+
+    worker_metrics *out = malloc(sizeof(worker_metrics));
+    metrics_snapshot(m, out);
+    fail_unless(out->bytes_in == 15);
+    fail_unless(out->conns_opened == 3);
+    fail_unless(out->cmds[3].count == 3);
+    fail_unless(out->cmds[3].sum == 1000200);
+    fail_unless(out->cmds[1].count == 0);
+    fail_unless(metrics_percentile(out->cmds + 3, 0.5) < 128);
+    fail_unless(metrics_percentile(out->cmds + 3, 1) >= 1000000);
+    free(out);
+
+    // The background work is kept apart from the workers
+    background_metrics *bg = malloc(sizeof(background_metrics));
+    metrics_record_background(m, FLUSH_ROUND, 5000);
+    metrics_record_set_flush(m, 2000, 4096, 3);
+    metrics_record_set_flush(m, 1000, 8192, 1);
+    metrics_background_snapshot(m, bg);
+    fail_unless(bg->ops[FLUSH_ROUND].count == 1);
+    fail_unless(bg->ops[FLUSH_ROUND].sum == 5000);
+    fail_unless(bg->ops[SET_FLUSH].count == 2);
+    fail_unless(bg->ops[UNMAP_ROUND].count == 0);
+    fail_unless(bg->flush_bytes == 12288);
+    fail_unless(bg->flush_clean_pages == 4);
+    free(bg);
+    fail_unless(destroy_metrics(m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_hot_sets)
+{
+    hlld_metrics *m;
+    fail_unless(init_metrics(2, &m) == 0);
+    worker_metrics *w1 = metrics_worker(m, 0);
+    worker_metrics *w2 = metrics_worker(m, 1);
+
+    // Only one in METRIC_HOT_SAMPLE commands is sampled
+    int sampled = 0;
+    for (int i=0; i < METRIC_HOT_SAMPLE * 4; i++) sampled += metrics_sample_set(w1);
+    fail_unless(sampled == 4);
+
+    // A set split across the workers is merged, and beats
+    // a stream of distinct sets that overflows the sketches
+    char name[32];
+    for (int i=0; i < 100; i++) {
+        metrics_record_set(w1, "hot", 3, 1);
+        metrics_record_set(w2, "hot", 3, 1);
+        metrics_record_set(w2, "wide", 4, 50);
+        int len = snprintf(name, sizeof(name), "cold%d", i);
+        metrics_record_set(w1, name, len, 0);
+        metrics_record_set(w1, "nothing", 0, 5);
+    }
+
+    hot_set_entry top[4];
+    int num = metrics_hot_sets(m, HOT_BY_CMDS, top, 4);
+    fail_unless(num == 4);
+    fail_unless(!strcmp(top[0].set_name, "hot"));
+    fail_unless(top[0].count == 200 * METRIC_HOT_SAMPLE);
+    fail_unless(top[0].error == 0);
+    fail_unless(!strcmp(top[1].set_name, "wide"));
+    fail_unless(top[1].count == 100 * METRIC_HOT_SAMPLE);
+
+    num = metrics_hot_sets(m, HOT_BY_KEYS, top, 4);
+    fail_unless(num == 2);
+    fail_unless(!strcmp(top[0].set_name, "wide"));
+    fail_unless(top[0].count == 5000 * METRIC_HOT_SAMPLE);
+    fail_unless(!strcmp(top[1].set_name, "hot"));
+
+    // The arguments of text commands are parsed for the name
+    int name_len, keys;
+    metrics_parse_args("foo bar baz\n", 12, &name_len, &keys);
+    fail_unless(name_len == 3 && keys == 2);
+    metrics_parse_args(NULL, 0, &name_len, &keys);
+    fail_unless(name_len == 0 && keys == 0);
+    fail_unless(destroy_metrics(m) == 0);
+}
+END_TEST
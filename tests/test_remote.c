@@ -0,0 +1,60 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "remote.h"
+
+START_TEST(test_remote_is_ref)
+{
+    fail_unless(remote_is_ref("a:4553/foo", 10));
+    fail_unless(remote_is_ref("127.0.0.1:4553/foo.bar", 22));
+    fail_unless(!remote_is_ref("foo", 3));
+    fail_unless(!remote_is_ref("a:4553/", 7));
+    fail_unless(!remote_is_ref("a/foo", 5));
+    fail_unless(!remote_is_ref(":4553/foo", 9));
+    fail_unless(!remote_is_ref("a:/foo", 6));
+    fail_unless(!remote_is_ref("a:45x3/foo", 10));
+
+    // Only the given length is checked
+    fail_unless(!remote_is_ref("a:4553/foo", 6));
+    fail_unless(remote_fetch("foo") == NULL);
+}
+END_TEST
+
+static void fetch_done(void *data) {
+    *(volatile int*)data = 1;
+}
+
+START_TEST(test_remote_cache)
+{
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    hlld_remote *remote;
+    fail_unless(init_remote(&config, &remote) == 0);
+    fail_unless(remote_get(remote, "127.0.0.1:1/foo", -1) == NULL);
+    fail_unless(remote_slot("127.0.0.1:1/foo") < REMOTE_CACHE_SLOTS);
+
+    // Nothing listens on the port, so the fetch fails
+    volatile int done = 0;
+    fail_unless(remote_fetch_async(remote, "127.0.0.1:1/foo", fetch_done, (void*)&done) == 0);
+    for (int i=0; i < 500 && !done; i++) usleep(10000);
+    fail_unless(done);
+
+    remote_set *set = remote_get(remote, "127.0.0.1:1/foo", -1);
+    fail_unless(set != NULL);
+    fail_unless(set->status == -2);
+    fail_unless(strcmp(set->ref, "127.0.0.1:1/foo") == 0);
+
+    // The failure is cached, until it is too old
+    usleep(5000);
+    fail_unless(remote_get(remote, "127.0.0.1:1/foo", 0) == NULL);
+    fail_unless(remote_get(remote, "127.0.0.1:1/bar", -1) == NULL);
+
+    // The cache only frees the set once released
+    destroy_remote(remote);
+    fail_unless(set->refs == 1);
+    remote_release(NULL, set);
+}
+END_TEST
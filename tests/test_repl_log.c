@@ -0,0 +1,219 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hll.h"
+#include "repl_log.h"
+
+START_TEST(test_repl_fold)
+{
+    uint32_t entries[] = {HLL_ENTRY(9, 2), HLL_ENTRY(3, 1), HLL_ENTRY(9, 5),
+        HLL_ENTRY(3, 4), HLL_ENTRY(0, 7), HLL_ENTRY(9, 3)};
+    fail_unless(repl_fold(entries, 6) == 3);
+    fail_unless(entries[0] == HLL_ENTRY(0, 7));
+    fail_unless(entries[1] == HLL_ENTRY(3, 4));
+    fail_unless(entries[2] == HLL_ENTRY(9, 5));
+    fail_unless(repl_fold(entries, 1) == 1);
+    fail_unless(repl_fold(entries, 0) == 0);
+}
+END_TEST
+
+START_TEST(test_repl_log_add_take)
+{
+    // Drop any sets queued by other tests
+    char **names;
+    int num_names = repl_log_pending(&names);
+    for (int i=0; i < num_names; i++) free(names[i]);
+    free(names);
+
+    repl_log *log = repl_log_create("test_repl");
+    uint32_t raises[] = {HLL_ENTRY(1, 1), HLL_ENTRY(2, 2)};
+    repl_log_add(log, raises, 2);
+    repl_log_add(log, raises, 1);
+
+    // The set is queued once
+    fail_unless(repl_log_pending(&names) == 1);
+    fail_unless(strcmp(names[0], "test_repl") == 0);
+    free(names[0]);
+    free(names);
+
+    uint32_t *entries;
+    int resync;
+    fail_unless(repl_log_take(log, &entries, &resync) == 3);
+    fail_unless(!resync);
+    fail_unless(entries[2] == HLL_ENTRY(1, 1));
+    free(entries);
+    fail_unless(repl_log_take(log, &entries, &resync) == 0);
+    fail_unless(entries == NULL);
+
+    // It is queued again by the next raise
+    repl_log_add(log, raises, 2);
+    fail_unless(repl_log_pending(&names) == 1);
+    free(names[0]);
+    free(names);
+    fail_unless(repl_log_take(log, &entries, &resync) == 2);
+    free(entries);
+    repl_log_destroy(log);
+}
+END_TEST
+
+START_TEST(test_repl_log_overflow)
+{
+    repl_log *log = repl_log_create("test_repl_overflow");
+
+    // Repeated raises of a register are folded away
+    uint32_t raise = HLL_ENTRY(5, 1);
+    for (int i=0; i < REPL_MAX_ENTRIES * 2; i++) repl_log_add(log, &raise, 1);
+    uint32_t *entries;
+    int resync;
+    int num = repl_log_take(log, &entries, &resync);
+    fail_unless(!resync);
+    fail_unless(num > 0 && num <= REPL_MAX_ENTRIES);
+    fail_unless(repl_fold(entries, num) == 1);
+    free(entries);
+
+    // Too many registers for the log falls back to a full send
+    for (int i=0; i <= REPL_MAX_ENTRIES; i++) {
+        raise = HLL_ENTRY(i, 1);
+        repl_log_add(log, &raise, 1);
+    }
+    fail_unless(repl_log_take(log, &entries, &resync) == 0);
+    fail_unless(resync);
+    fail_unless(entries == NULL);
+
+    repl_log_resync(log);
+    repl_log_take(log, &entries, &resync);
+    fail_unless(resync);
+    repl_log_destroy(log);
+
+    char **names;
+    int num_names = repl_log_pending(&names);
+    for (int i=0; i < num_names; i++) free(names[i]);
+    free(names);
+}
+END_TEST
+
+START_TEST(test_repl_frame_encode_decode)
+{
+    hlld_set_config set_config = {hll_error_for_precision(14), 14, 0,
+        HLL_BYTE, 1, HLL_ESTIMATOR_ERTL, HLL_HASH_WYHASH, 0, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+    uint32_t entries[1000];
+    for (int i=0; i < 1000; i++) entries[i] = HLL_ENTRY(i * 16 + 3, 1 + i % 40);
+
+    unsigned char *buf;
+    uint32_t len;
+    fail_unless(repl_encode_frame("test_frame", &set_config, entries, 1000, &buf, &len) == 0);
+    fail_unless(len > REPL_HEADER_SIZE + 10 + 1000);
+
+    // Partial frames need more bytes
+    repl_frame frame;
+    fail_unless(repl_decode_frame(buf, 0, &frame) == 0);
+    fail_unless(repl_decode_frame(buf, REPL_HEADER_SIZE, &frame) == 0);
+    fail_unless(repl_decode_frame(buf, len - 1, &frame) == 0);
+
+    fail_unless(repl_decode_frame(buf, len, &frame) == (int)len);
+    fail_unless(strcmp(frame.set_name, "test_frame") == 0);
+    fail_unless(frame.set_config.default_precision == 14);
+    fail_unless(frame.set_config.format == HLL_BYTE);
+    fail_unless(frame.set_config.sparse == 1);
+    fail_unless(frame.set_config.estimator == HLL_ESTIMATOR_ERTL);
+    fail_unless(frame.set_config.hash == HLL_HASH_WYHASH);
+    fail_unless(frame.num == 1000);
+    fail_unless(memcmp(frame.entries, entries, sizeof(entries)) == 0);
+    repl_frame_free(&frame);
+
+    // Corrupt headers are rejected
+    buf[0] = 0;
+    fail_unless(repl_decode_frame(buf, len, &frame) == -1);
+    buf[0] = REPL_FRAME_MAGIC;
+    buf[1] = 30;
+    fail_unless(repl_decode_frame(buf, len, &frame) == -1);
+    free(buf);
+
+    // So are entries past the registers of the precision
+    entries[999] = HLL_ENTRY(1 << 14, 1);
+    fail_unless(repl_encode_frame("test_frame", &set_config, entries, 1000, &buf, &len) == 0);
+    fail_unless(repl_decode_frame(buf, len, &frame) == -1);
+    free(buf);
+
+    // Empty sets are sent with no entries
+    fail_unless(repl_encode_frame("test_empty", &set_config, entries, 0, &buf, &len) == 0);
+    fail_unless(repl_decode_frame(buf, len, &frame) == (int)len);
+    fail_unless(frame.num == 0);
+    repl_frame_free(&frame);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_repl_page_digests)
+{
+    // Precision 14 has 4 pages, low precisions have one
+    fail_unless(repl_num_pages(14) == 4);
+    fail_unless(repl_num_pages(4) == 1);
+
+    uint32_t entries[1000];
+    for (int i=0; i < 1000; i++) entries[i] = HLL_ENTRY(i * 16 + 3, 1 + i % 40);
+    uint32_t digests[4], theirs[4];
+    repl_page_digests(entries, 1000, 14, digests);
+    for (int i=0; i < 4; i++) fail_unless(digests[i] != 0);
+
+    // Raising a register changes only its page
+    entries[300] += 1;
+    repl_page_digests(entries, 1000, 14, theirs);
+    fail_unless(digests[0] == theirs[0]);
+    fail_unless(digests[1] != theirs[1]);
+    fail_unless(digests[2] == theirs[2]);
+    fail_unless(digests[3] == theirs[3]);
+
+    // Only the entries of that page are kept
+    uint32_t pages;
+    int num = repl_diff_pages(entries, 1000, 14, digests, &pages);
+    fail_unless(pages == 1);
+    fail_unless(num == 256);
+    for (int i=0; i < num; i++)
+        fail_unless(HLL_ENTRY_IDX(entries[i]) / REPL_PAGE_REGISTERS == 1);
+
+    // Nothing is kept when the digests match
+    repl_page_digests(entries, num, 14, digests);
+    fail_unless(repl_diff_pages(entries, num, 14, digests, &pages) == 0);
+    fail_unless(pages == 0);
+
+    // Empty pages have a digest of 0
+    repl_page_digests(entries, 0, 14, digests);
+    for (int i=0; i < 4; i++) fail_unless(digests[i] == 0);
+}
+END_TEST
+
+START_TEST(test_repl_digests_encode_decode)
+{
+    uint32_t digests[4] = {1, 0xdeadbeef, 0, 42};
+    unsigned char *buf;
+    uint32_t len;
+    fail_unless(repl_encode_digests("test_digests", 14, digests, &buf, &len) == 0);
+    fail_unless(len == REPL_DIGEST_HEADER_SIZE + 12 + 16);
+
+    repl_digests out;
+    fail_unless(repl_decode_digests(buf, 0, &out) == 0);
+    fail_unless(repl_decode_digests(buf, len - 1, &out) == 0);
+    fail_unless(repl_decode_digests(buf, len, &out) == (int)len);
+    fail_unless(strcmp(out.set_name, "test_digests") == 0);
+    fail_unless(out.precision == 14);
+    fail_unless(out.num_pages == 4);
+    fail_unless(memcmp(out.digests, digests, sizeof(digests)) == 0);
+    repl_digests_free(&out);
+
+    // Corrupt headers are rejected
+    buf[4] = 5;
+    fail_unless(repl_decode_digests(buf, len, &out) == -1);
+    buf[0] = REPL_FRAME_MAGIC;
+    fail_unless(repl_decode_digests(buf, len, &out) == -1);
+    free(buf);
+
+    // The end of the digests has no name
+    fail_unless(repl_encode_digests(NULL, 0, NULL, &buf, &len) == 0);
+    fail_unless(len == REPL_DIGEST_HEADER_SIZE);
+    fail_unless(repl_decode_digests(buf, len, &out) == (int)len);
+    fail_unless(out.set_name == NULL);
+    free(buf);
+}
+END_TEST
@@ -1,4 +1,5 @@
 #include <check.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -7,8 +8,10 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
 #include "config.h"
 #include "set.h"
+#include "iobatch.h"
 
 static int set_out_special(const struct dirent *d) {
     const char *name = d->d_name;
@@ -195,6 +198,658 @@ START_TEST(test_set_restore)
 }
 END_TEST
 
+START_TEST(test_set_restore_huge_pages)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.huge_pages = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_huge", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(set->bm.huge);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // The registers are flushed from and read back into the arena
+    res = init_set(&config, "test_set_huge", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_huge") == 2);
+}
+END_TEST
+
+START_TEST(test_set_slab)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.slab_registers = 1;
+    mkdir("/tmp/hlld_slab", 0755);
+    hlld_slab *slab;
+    fail_unless(init_slab("/tmp/hlld_slab", 0, &slab) == 0);
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_slab", 0, &set);
+    fail_unless(res == 0);
+    hset_attach_slab(set, slab);
+    fail_unless(hset_page_in(set) == 0);
+    fail_unless(set->bm.slot);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(slab_sync(slab) == 0);
+
+    // Proxied sets are dumped from their slot
+    fail_unless(hset_close(set) == 0);
+    unsigned char *regs;
+    uint64_t len;
+    fail_unless(hset_dump(set, &regs, &len) == 0);
+    fail_unless(len == set->bm.size);
+    fail_unless(hset_is_proxied(set));
+    free(regs);
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // The registers are read back from the slot
+    fail_unless(access("/tmp/hlld/hlld.test_set_slab/registers.mmap", F_OK) != 0);
+    res = init_set(&config, "test_set_slab", 0, &set);
+    fail_unless(res == 0);
+    hset_attach_slab(set, slab);
+    fail_unless(hset_size(set) == size);
+
+    // Deleting the set frees its slot
+    fail_unless(slab_slots(slab) == 1);
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(slab_slots(slab) == 0);
+    destroy_set(set);
+    destroy_slab(slab);
+    unlink("/tmp/hlld_slab/slab.0.data");
+    rmdir("/tmp/hlld_slab");
+}
+END_TEST
+
+START_TEST(test_set_fold)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.default_precision = 14;
+    config.default_eps = hll_error_for_precision(14);
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_fold", 1, &set);
+    fail_unless(res == 0);
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(hset_close(set) == 0);
+
+    // Only lower precisions are folded to
+    fail_unless(hset_fold(set, 14) == 0);
+    fail_unless(set->set_config.default_precision == 14);
+    fail_unless(hset_fold(set, 10) == 0);
+    fail_unless(set->set_config.default_precision == 10);
+    fail_unless(hset_is_proxied(set));
+    uint64_t size = hset_size(set);
+    fail_unless(size > 9000 && size < 11000);
+
+    struct stat st;
+    fail_unless(stat("/tmp/hlld/hlld.test_set_fold/registers.mmap", &st) == 0);
+    fail_unless((uint64_t)st.st_size == hll_bytes_for_precision(10, HLL_PACKED) + 40);
+    fail_unless(hset_last_write(set) > 0);
+    fail_unless(destroy_set(set) == 0);
+
+    // The folded config is read back
+    res = init_set(&config, "test_set_fold", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(set->set_config.default_precision == 10);
+    fail_unless(hset_size(set) == size);
+    fail_unless(hset_delete(set) == 0);
+    destroy_set(set);
+}
+END_TEST
+
+START_TEST(test_set_cold_compress)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.compress_cold = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_cold", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    // Closing the set compresses the registers
+    struct stat st;
+    fail_unless(hset_close(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set_cold/registers.mmap", &st) == 0);
+    fail_unless((uint64_t)st.st_size < 3280);
+
+    // Faulting in restores the dense registers
+    snprintf((char*)&buf, 100, "foobar%d", 0);
+    fail_unless(hset_add(set, (char*)&buf) == 0);
+    fail_unless(!hset_is_proxied(set));
+    fail_unless(hset_size(set) == size);
+    fail_unless(hset_byte_size(set) == 3280);
+    fail_unless(stat("/tmp/hlld/hlld.test_set_cold/registers.mmap", &st) == 0);
+    fail_unless(st.st_size == 3280);
+
+    // Survives a restart while cold
+    fail_unless(destroy_set(set) == 0);
+    res = init_set(&config, "test_set_cold", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+    fail_unless(hset_add(set, (char*)&buf) == 0);
+    fail_unless(hset_size(set) == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_cold") == 2);
+}
+END_TEST
+
+START_TEST(test_set_restore_byte_format)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.default_format = HLL_BYTE;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_byte", 0, &set);
+    fail_unless(res == 0);
+    fail_unless(set->set_config.format == HLL_BYTE);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // Remake the set with a packed default, format should persist
+    config.default_format = HLL_PACKED;
+    res = init_set(&config, "test_set_byte", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(set->set_config.format == HLL_BYTE);
+
+    fail_unless(hset_size(set) == size);
+    fail_unless(hset_byte_size(set) == 4096);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_byte") == 2);
+}
+END_TEST
+
+START_TEST(test_set_sparse_restore)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.sparse = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_sparse", 0, &set);
+    fail_unless(res == 0);
+    fail_unless(set->set_config.sparse == 1);
+
+    char buf[100];
+    for (int i=0;i<100;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    fail_unless(hll_is_sparse(&set->hll));
+    uint64_t size = hset_size(set);
+    fail_unless(hset_byte_size(set) < 3280);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // The register file holds the sparse entries
+    struct stat st;
+    fail_unless(stat("/tmp/hlld/hlld.test_set_sparse/registers.mmap", &st) == 0);
+    fail_unless(st.st_size < 3280);
+
+    // Remake with a dense default, should restore sparse
+    config.sparse = 0;
+    res = init_set(&config, "test_set_sparse", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(set->set_config.sparse == 1);
+    fail_unless(hll_is_sparse(&set->hll));
+    fail_unless(hset_size(set) == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_sparse") == 2);
+}
+END_TEST
+
+START_TEST(test_set_sparse_convert)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.sparse = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_sparse_conv", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    fail_unless(!hll_is_sparse(&set->hll));
+    fail_unless(hset_byte_size(set) == 3280);
+    uint64_t size = hset_size(set);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // Should restore as a dense register file
+    res = init_set(&config, "test_set_sparse_conv", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(!hll_is_sparse(&set->hll));
+    fail_unless(hset_size(set) == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_sparse_conv") == 2);
+}
+END_TEST
+
+START_TEST(test_set_high_precision_sparse)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.default_precision = 20;
+
+    // Large sets start sparse, even if not configured
+    hlld_set *set = NULL;
+    fail_unless(init_set(&config, "test_set_high_prec", 1, &set) == 0);
+    fail_unless(set->set_config.sparse == 1);
+    fail_unless(hll_is_sparse(&set->hll));
+    fail_unless(hset_add(set, "foo") == 0);
+    fail_unless(hset_size(set) == 1);
+    fail_unless(hset_byte_size(set) < 4096);
+
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(destroy_set(set) == 0);
+}
+END_TEST
+
+START_TEST(test_set_add_batch)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_set *one = NULL, *batch = NULL;
+    fail_unless(init_set(&config, "test_set_add_one", 0, &one) == 0);
+    fail_unless(init_set(&config, "test_set_add_batch", 0, &batch) == 0);
+
+    char bufs[100][20];
+    char *keys[100];
+    int lens[100];
+    for (int i=0; i < 100; i++) {
+        lens[i] = snprintf(bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+        fail_unless(hset_add(one, keys[i]) == 0);
+    }
+
+    // Explicit lengths, and lengths from strlen
+    fail_unless(hset_add_batch(batch, keys, lens, 70) == 0);
+    fail_unless(hset_add_batch(batch, keys + 70, NULL, 30) == 0);
+    fail_unless(hset_size(batch) == hset_size(one));
+    fail_unless(batch->counters.sets == 100);
+
+    fail_unless(hset_delete(one) == 0);
+    fail_unless(hset_delete(batch) == 0);
+    fail_unless(destroy_set(one) == 0);
+    fail_unless(destroy_set(batch) == 0);
+}
+END_TEST
+
+START_TEST(test_set_add_hashes)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_set *keyed = NULL, *external = NULL;
+    fail_unless(init_set(&config, "test_set_keyed", 1, &keyed) == 0);
+    config.default_hash = HLL_HASH_EXTERNAL;
+    fail_unless(init_set(&config, "test_set_external", 1, &external) == 0);
+
+    // Client hashes give the same registers as hashing in hlld
+    char bufs[100][20];
+    char *keys[100];
+    uint64_t hashes[100];
+    for (int i=0; i < 100; i++) {
+        int len = snprintf(bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+        hashes[i] = hll_hash_key(HLL_HASH_MURMUR, keys[i], len);
+    }
+    fail_unless(hset_add_batch(keyed, keys, NULL, 100) == 0);
+    fail_unless(hset_add_hashes(external, hashes, 100) == 0);
+    fail_unless(hset_size(external) == hset_size(keyed));
+    fail_unless(external->counters.sets == 100);
+
+    // Each set only accepts its own kind of keys
+    fail_unless(hset_add_hashes(keyed, hashes, 100) == -2);
+    fail_unless(hset_add_batch(external, keys, NULL, 100) == -2);
+    fail_unless(hset_add(external, "foo") == -2);
+    fail_unless(!hset_compatible(keyed, external));
+
+    fail_unless(hset_delete(keyed) == 0);
+    fail_unless(hset_delete(external) == 0);
+    fail_unless(destroy_set(keyed) == 0);
+    fail_unless(destroy_set(external) == 0);
+}
+END_TEST
+
+START_TEST(test_set_replication)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.replication_port = 4555;
+
+    hlld_set *primary = NULL, *follower = NULL;
+    fail_unless(init_set(&config, "test_set_primary", 1, &primary) == 0);
+    config.replication_port = 0;
+    fail_unless(init_set(&config, "test_set_follower", 1, &follower) == 0);
+    fail_unless(primary->repl != NULL);
+    fail_unless(follower->repl == NULL);
+
+    // The logged raises rebuild the registers
+    char bufs[500][20];
+    char *keys[500];
+    for (int i=0; i < 500; i++) {
+        snprintf(bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    fail_unless(hset_add_batch(primary, keys, NULL, 400) == 0);
+    fail_unless(hset_add(primary, "foobar499") == 0);
+    uint32_t *entries;
+    int num = hset_replication_entries(primary, 0, &entries);
+    fail_unless(num > 0 && num <= 401);
+    fail_unless(hset_raise_registers(follower, entries, num) == 0);
+    fail_unless(hset_size(follower) == hset_size(primary));
+    free(entries);
+
+    // Nothing is left once the raises are taken
+    fail_unless(hset_replication_entries(primary, 0, &entries) == 0);
+    free(entries);
+
+    // A union is not logged, so every register is sent
+    hlld_set *other = NULL;
+    fail_unless(init_set(&config, "test_set_other", 1, &other) == 0);
+    fail_unless(hset_add_batch(other, keys + 400, NULL, 100) == 0);
+    fail_unless(hset_union(primary, other) == 0);
+    num = hset_replication_entries(primary, 0, &entries);
+    uint32_t *full;
+    fail_unless(hset_replication_entries(primary, 1, &full) == num);
+    fail_unless(memcmp(entries, full, num * sizeof(uint32_t)) == 0);
+    fail_unless(hset_raise_registers(follower, entries, num) == 0);
+    fail_unless(hset_size(follower) == hset_size(primary));
+    free(entries);
+    free(full);
+
+    fail_unless(hset_delete(primary) == 0);
+    fail_unless(hset_delete(follower) == 0);
+    fail_unless(hset_delete(other) == 0);
+    fail_unless(destroy_set(primary) == 0);
+    fail_unless(destroy_set(follower) == 0);
+    fail_unless(destroy_set(other) == 0);
+}
+END_TEST
+
+START_TEST(test_set_dump)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_set *set = NULL, *dense = NULL, *sparse = NULL;
+    fail_unless(init_set(&config, "test_set_dump", 1, &set) == 0);
+    char bufs[1000][20];
+    char *keys[1000];
+    for (int i=0; i < 1000; i++) {
+        snprintf(bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    fail_unless(hset_add_batch(set, keys, NULL, 1000) == 0);
+    uint64_t size = hset_size(set);
+
+    // Dense registers are restored with the same size
+    unsigned char *regs;
+    uint64_t len;
+    fail_unless(hset_dump(set, &regs, &len) == 0);
+    fail_unless(len > 0 && len <= hset_byte_size(set));
+    fail_unless(init_set_from_dump(&config, "test_set_dump_dense", &set->set_config, regs, len, NULL, &dense) == 0);
+    fail_unless(hset_size(dense) == size);
+    free(regs);
+
+    // Proxied sets are dumped from their register file
+    fail_unless(hset_close(set) == 0);
+    fail_unless(hset_is_proxied(set));
+    fail_unless(hset_dump(set, &regs, &len) == 0);
+    fail_unless(hset_is_proxied(set));
+    free(regs);
+
+    // Sparse registers are restored in memory
+    hlld_set_config set_config = set->set_config;
+    set_config.in_memory = 1;
+    set_config.sparse = 1;
+    config.sparse = 1;
+    hlld_set *small = NULL;
+    fail_unless(init_set(&config, "test_set_dump_small", 1, &small) == 0);
+    fail_unless(hset_add_batch(small, keys, NULL, 10) == 0);
+    fail_unless(hset_dump(small, &regs, &len) == 0);
+    fail_unless(len < hset_byte_size(dense));
+    fail_unless(init_set_from_dump(&config, "test_set_dump_sparse", &set_config, regs, len, NULL, &sparse) == 0);
+    fail_unless(hset_size(sparse) == hset_size(small));
+    free(regs);
+
+    // Registers that are not a register file are refused
+    hlld_set *bad = NULL;
+    unsigned char junk[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    fail_unless(init_set_from_dump(&config, "test_set_dump_bad", &set_config, junk, 10, NULL, &bad) != 0);
+    fail_unless(hset_delete(bad) == 0);
+    fail_unless(destroy_set(bad) == 0);
+
+    hlld_set *sets[] = {set, dense, sparse, small};
+    for (int i=0; i < 4; i++) {
+        fail_unless(hset_delete(sets[i]) == 0);
+        fail_unless(destroy_set(sets[i]) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_set_size_cached)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_set *set = NULL;
+    fail_unless(init_set(&config, "test_set_size_cached", 1, &set) == 0);
+
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    uint64_t size, read;
+    fail_unless(hset_read_size(set, &read) == 0);
+    size = hset_size(set);
+    fail_unless(set->cached_gen == set->reg_gen);
+    fail_unless(set->cached_size == size);
+    fail_unless(hset_read_size(set, &read) == 1);
+    fail_unless(read == size);
+
+    // Re-adding keys leaves the registers and the cache alone
+    uint64_t gen = set->reg_gen;
+    fail_unless(hset_add(set, "foobar1") == 0);
+    fail_unless(set->reg_gen == gen);
+    fail_unless(hset_size(set) == size);
+
+    // New keys invalidate the cache
+    for (int i=1000; i < 2000; i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    fail_unless(set->cached_gen != set->reg_gen);
+    fail_unless(hset_read_size(set, &read) == 0);
+    fail_unless(hset_size(set) > size);
+    fail_unless(set->cached_gen == set->reg_gen);
+    fail_unless(hset_read_size(set, &read) == 1);
+    fail_unless(read > size);
+
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(destroy_set(set) == 0);
+}
+END_TEST
+
+START_TEST(test_set_shadow_registers)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.default_precision = 14;
+    hlld_config shadowed = config;
+    shadowed.shadow_merge_msec = 1000;
+
+    // One set is written through shadow registers once hot
+    hlld_set *hot = NULL, *plain = NULL;
+    fail_unless(init_set(&shadowed, "test_set_shadow_hot", 1, &hot) == 0);
+    fail_unless(init_set(&config, "test_set_shadow_plain", 1, &plain) == 0);
+
+    char bufs[1000][32];
+    char *keys[1000];
+    for (int i=0; i < 1000; i++) keys[i] = bufs[i];
+    hset_shadow_thread(0);
+    for (int round=0; round < 600; round++) {
+        for (int i=0; i < 1000; i++)
+            snprintf(bufs[i], 32, "shadow%d", round * 1000 + i);
+        fail_unless(hset_add_batch(hot, keys, NULL, 1000) == 0);
+        fail_unless(hset_add_batch(plain, keys, NULL, 1000) == 0);
+    }
+    fail_unless(hot->shadows != NULL);
+    fail_unless(plain->shadows == NULL);
+
+    // Reads merge the shadows first, so the registers match
+    fail_unless(hset_size(hot) == hset_size(plain));
+    fail_unless(hset_counters(hot)->sets == 600000);
+    fail_unless(hset_add(hot, "shadow-last") == 0);
+    fail_unless(hset_add(plain, "shadow-last") == 0);
+    fail_unless(hset_size(hot) == hset_size(plain));
+    hset_shadow_thread(-1);
+
+    // Closing keeps the merged registers
+    uint64_t size = hset_size(hot);
+    fail_unless(hset_close(hot) == 0);
+    fail_unless(hot->shadows == NULL);
+    fail_unless(hset_size(hot) == size);
+
+    fail_unless(hset_delete(hot) == 0);
+    fail_unless(destroy_set(hot) == 0);
+    fail_unless(hset_delete(plain) == 0);
+    fail_unless(destroy_set(plain) == 0);
+}
+END_TEST
+
+START_TEST(test_set_hot_logged_counts)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.default_precision = 14;
+    config.shadow_merge_msec = 1000;
+    config.replication_port = 4555;
+
+    // Logged sets stay written in place once hot,
+    // but count their adds on each thread's own line
+    hlld_set *set = NULL;
+    fail_unless(init_set(&config, "test_set_hot_logged", 1, &set) == 0);
+    fail_unless(set->repl != NULL);
+    fail_unless((uintptr_t)set % HSET_CACHE_LINE == 0);
+    fail_unless(offsetof(hlld_set, hll) / HSET_CACHE_LINE !=
+                offsetof(hlld_set, is_dirty) / HSET_CACHE_LINE);
+    fail_unless(offsetof(hlld_set, reg_gen) / HSET_CACHE_LINE <
+                offsetof(hlld_set, counters) / HSET_CACHE_LINE);
+
+    char bufs[1000][32];
+    char *keys[1000];
+    for (int i=0; i < 1000; i++) keys[i] = bufs[i];
+    hset_shadow_thread(0);
+    for (int round=0; round < 600; round++) {
+        for (int i=0; i < 1000; i++)
+            snprintf(bufs[i], 32, "logged%d", round * 1000 + i);
+        fail_unless(hset_add_batch(set, keys, NULL, 1000) == 0);
+    }
+    fail_unless(set->shadows == NULL);
+    fail_unless(set->slot_adds != NULL);
+    fail_unless(hset_add(set, "logged-last") == 0);
+    fail_unless(hset_counters(set)->sets == 600001);
+    hset_shadow_thread(-1);
+
+    // Closing keeps the counts
+    fail_unless(hset_close(set) == 0);
+    fail_unless(set->slot_adds == NULL);
+    fail_unless(hset_counters(set)->sets == 600001);
+
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(destroy_set(set) == 0);
+}
+END_TEST
+
 START_TEST(test_set_flush)
 {
     hlld_config config;
@@ -213,8 +868,25 @@ START_TEST(test_set_flush)
         fail_unless(res == 0);
     }
 
-    // Flush
+    // The set tracks how long and how much it has been dirty
+    uint64_t now = time(NULL);
+    fail_unless(hset_dirty_age(set, now + 5) >= 5);
+    fail_unless(hset_dirty_pages(set) == 1);
+
+    // Flush, writing the whole register file once
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(hset_dirty_age(set, now) == -1);
+    fail_unless(hset_dirty_pages(set) == 0);
+    set_counters *counters = hset_counters(set);
+    fail_unless(counters->flush_bytes == 3280);
+    fail_unless(counters->flush_syscalls == (iobatch_use_uring(1) ? 1 : 2));
+    fail_unless(counters->flush_clean_pages == 0);
+    fail_unless(counters->flushes == 1);
+    fail_unless(counters->flush_max_nanos <= counters->flush_nanos);
+
+    // A clean set is not flushed again
     fail_unless(hset_flush(set) == 0);
+    fail_unless(counters->flushes == 1);
 
     // Remake the set
     hlld_set *set2 = NULL;
@@ -235,6 +907,117 @@ START_TEST(test_set_flush)
 }
 END_TEST
 
+START_TEST(test_set_register_trailer)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_trailer", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    // The flush appends the trailer after the registers
+    struct stat st;
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set_trailer/registers.mmap", &st) == 0);
+    fail_unless(st.st_size == 3280 + 40);
+
+    // Dumps leave it behind, and a page in verifies it
+    unsigned char *regs;
+    uint64_t len;
+    fail_unless(hset_close(set) == 0);
+    fail_unless(hset_dump(set, &regs, &len) == 0);
+    fail_unless(len == 3280);
+    free(regs);
+    fail_unless(hset_page_in(set) == 0);
+    fail_unless(hset_counters(set)->checksum_errors == 0);
+    fail_unless(hset_size(set) == size);
+    fail_unless(destroy_set(set) == 0);
+
+    // A corrupt register is only counted
+    int fd = open("/tmp/hlld/hlld.test_set_trailer/registers.mmap", O_WRONLY);
+    fail_unless(fd >= 0);
+    fail_unless(pwrite(fd, "x", 1, 100) == 1);
+    close(fd);
+    res = init_set(&config, "test_set_trailer", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_page_in(set) == 0);
+    fail_unless(hset_counters(set)->checksum_errors == 1);
+    fail_unless(destroy_set(set) == 0);
+
+    // A file without the trailer predates it
+    fail_unless(truncate("/tmp/hlld/hlld.test_set_trailer/registers.mmap", 3280) == 0);
+    res = init_set(&config, "test_set_trailer", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_page_in(set) == 0);
+    fail_unless(hset_counters(set)->checksum_errors == 0);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_trailer") == 2);
+}
+END_TEST
+
+START_TEST(test_set_config_written_once)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.compress_cold = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set_config", 0, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_add(set, "first") == 0);
+    fail_unless(hset_flush(set) == 0);
+    struct stat first, st;
+    fail_unless(stat("/tmp/hlld/hlld.test_set_config/config.ini", &first) == 0);
+
+    // Later flushes of the dense registers leave the config alone
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    uint64_t size = hset_size(set);
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set_config/config.ini", &st) == 0);
+    fail_unless(st.st_ino == first.st_ino);
+    fail_unless(st.st_mtim.tv_sec == first.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == first.st_mtim.tv_nsec);
+    fail_unless(hset_last_write(set) > 0);
+
+    // The size is read back from the trailer
+    hlld_set *set2 = NULL;
+    res = init_set(&config, "test_set_config", 0, &set2);
+    fail_unless(res == 0);
+    fail_unless(hset_is_proxied(set2));
+    fail_unless(hset_size(set2) == size);
+    fail_unless(destroy_set(set2) == 0);
+
+    // Compressed registers have no trailer, so the config takes the size
+    fail_unless(destroy_set(set) == 0);
+    res = init_set(&config, "test_set_config", 0, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+    hlld_set_config set_config;
+    fail_unless(set_config_from_filename("/tmp/hlld/hlld.test_set_config/config.ini", &set_config) == 0);
+    fail_unless(set_config.size == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set_config") == 2);
+}
+END_TEST
+
 START_TEST(test_set_add_in_mem)
 {
     hlld_config config;
@@ -7,9 +7,11 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "config.h"
 #include "set.h"
 #include "set_manager.h"
+#include "dump.h"
 
 START_TEST(test_mgr_init_destroy)
 {
@@ -168,6 +170,104 @@ START_TEST(test_mgr_list_prefix)
 END_TEST
 
 
+static void count_iter_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    uint64_t *counts = data;
+    counts[0]++;
+    counts[1] += hset_size(set);
+}
+
+START_TEST(test_mgr_iter_sets)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // One set is vacuumed into the map, the other is a pending create
+    fail_unless(setmgr_create_set(mgr, "iter1", NULL) == 0);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_create_set(mgr, "iter2", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "junk2", NULL) == 0);
+    char *keys[] = {"a", "b", "c"};
+    fail_unless(setmgr_set_keys(mgr, "iter1", keys, 3) == 0);
+    fail_unless(setmgr_set_keys(mgr, "iter2", keys, 2) == 0);
+
+    uint64_t counts[2] = {0, 0};
+    fail_unless(setmgr_iter_sets(mgr, "iter", count_iter_cb, counts) == 0);
+    fail_unless(counts[0] == 2);
+    fail_unless(counts[1] == 5);
+
+    // Dropped sets are skipped
+    fail_unless(setmgr_drop_set(mgr, "iter1") == 0);
+    counts[0] = counts[1] = 0;
+    fail_unless(setmgr_iter_sets(mgr, NULL, count_iter_cb, counts) == 0);
+    fail_unless(counts[0] == 2);
+    fail_unless(counts[1] == 2);
+
+    fail_unless(setmgr_drop_set(mgr, "iter2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "junk2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void name_page_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set;
+    char *names = data;
+    strcat(names, set_name);
+    strcat(names, " ");
+}
+
+START_TEST(test_mgr_page_sets)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Pending creates are ordered among the vacuumed sets
+    fail_unless(setmgr_create_set(mgr, "page.b", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "page.d", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "other", NULL) == 0);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_create_set(mgr, "page.c", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "page.a", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "page.e", NULL) == 0);
+
+    char names[256] = "";
+    fail_unless(setmgr_page_sets(mgr, "page.", NULL, 2, name_page_cb, names) == 2);
+    fail_unless(!strcmp(names, "page.a page.b "), "%s", names);
+    names[0] = 0;
+    fail_unless(setmgr_page_sets(mgr, "page.", "page.b", 2, name_page_cb, names) == 2);
+    fail_unless(!strcmp(names, "page.c page.d "), "%s", names);
+    names[0] = 0;
+    fail_unless(setmgr_page_sets(mgr, "page.", "page.d", 2, name_page_cb, names) == 1);
+    fail_unless(!strcmp(names, "page.e "), "%s", names);
+    names[0] = 0;
+    fail_unless(setmgr_page_sets(mgr, "page.", "page.e", 2, name_page_cb, names) == 0);
+
+    // Without a prefix or limit, every set after the cursor
+    names[0] = 0;
+    fail_unless(setmgr_page_sets(mgr, NULL, "other", 0, name_page_cb, names) == 5);
+    fail_unless(!strcmp(names, "page.a page.b page.c page.d page.e "), "%s", names);
+    names[0] = 0;
+    fail_unless(setmgr_page_sets(mgr, "page.", "a", 1, name_page_cb, names) == 1);
+    fail_unless(!strcmp(names, "page.a "), "%s", names);
+
+    char *drop[] = {"page.a", "page.b", "page.c", "page.d", "page.e", "other"};
+    for (int i=0; i < 6; i++) fail_unless(setmgr_drop_set(mgr, drop[i]) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_mgr_list_no_sets)
 {
     hlld_config config;
@@ -215,6 +315,132 @@ START_TEST(test_mgr_add_keys)
 }
 END_TEST
 
+START_TEST(test_mgr_add_sized_keys)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "zab11", NULL);
+    fail_unless(res == 0);
+
+    // The keys are not terminated, so the lengths are used,
+    // and the repeated key is only counted once
+    char buf[] = "heytherethere";
+    char *keys[] = {buf, buf + 3, buf + 8};
+    int lens[] = {3, 5, 5};
+    res = setmgr_set_sized_keys(mgr, "zab11", (char**)&keys, (int*)&lens, 3);
+    fail_unless(res == 0);
+
+    uint64_t est;
+    res = setmgr_set_size(mgr, "zab11", &est);
+    fail_unless(res == 0);
+    fail_unless(est == 2);
+
+    res = setmgr_set_sized_keys(mgr, "noop11", (char**)&keys, (int*)&lens, 3);
+    fail_unless(res == -1);
+
+    res = setmgr_drop_set(mgr, "zab11");
+    fail_unless(res == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_add_keys_multi)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_create_set(mgr, "multi1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "multi2", NULL) == 0);
+    hlld_config *wy = malloc(sizeof(hlld_config));
+    memcpy(wy, &config, sizeof(hlld_config));
+    wy->default_hash = HLL_HASH_WYHASH;
+    fail_unless(setmgr_create_set(mgr, "multi_wy", wy) == 0);
+    hlld_config *ext = malloc(sizeof(hlld_config));
+    memcpy(ext, &config, sizeof(hlld_config));
+    ext->default_hash = HLL_HASH_EXTERNAL;
+    fail_unless(setmgr_create_set(mgr, "multi_ext", ext) == 0);
+
+    // Each set gets every key, whatever its hash
+    char *names[] = {"multi1", "multi_none", "multi2", "multi_wy", "multi_ext"};
+    int results[5] = {0};
+    char buf[100 * 16];
+    char *keys[100];
+    for (int i=0; i < 100; i++) {
+        keys[i] = buf + i * 16;
+        snprintf(keys[i], 16, "key%d", i);
+    }
+    fail_unless(setmgr_set_keys_multi(mgr, (char**)&names, 5, keys, 100, results) == 2);
+    fail_unless(results[0] == 0 && results[2] == 0 && results[3] == 0);
+    fail_unless(results[1] == -1);
+    fail_unless(results[4] == -3);
+
+    // The sets match adding the keys one set at a time
+    fail_unless(setmgr_create_set(mgr, "multi_one", NULL) == 0);
+    fail_unless(setmgr_set_keys(mgr, "multi_one", keys, 100) == 0);
+    uint64_t size, one_size;
+    fail_unless(setmgr_set_size(mgr, "multi_one", &one_size) == 0);
+    for (int i=0; i < 4; i++) {
+        if (i == 1) continue;
+        fail_unless(setmgr_set_size(mgr, names[i], &size) == 0);
+        fail_unless(size > 90 && size < 110);
+        if (i != 3) fail_unless(size == one_size);
+    }
+
+    fail_unless(setmgr_drop_set(mgr, "multi1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "multi2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "multi_wy") == 0);
+    fail_unless(setmgr_drop_set(mgr, "multi_ext") == 0);
+    fail_unless(setmgr_drop_set(mgr, "multi_one") == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_add_key_many)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_create_set(mgr, "many1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "many2", NULL) == 0);
+
+    char *names[] = {"many1", "many_none", "many2"};
+    int results[3] = {0};
+    fail_unless(setmgr_set_key_many(mgr, "user42", (char**)&names, 3, results) == 1);
+    fail_unless(results[0] == 0 && results[1] == -1 && results[2] == 0);
+
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "many1", &size) == 0);
+    fail_unless(size == 1);
+    fail_unless(setmgr_set_size(mgr, "many2", &size) == 0);
+    fail_unless(size == 1);
+
+    fail_unless(setmgr_drop_set(mgr, "many1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "many2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_mgr_add_no_set)
 {
     hlld_config config;
@@ -552,6 +778,331 @@ START_TEST(test_mgr_list_cold)
 }
 END_TEST
 
+START_TEST(test_mgr_cool)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_mmap = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "cool1", NULL) == 0);
+    hlld_config *mem = malloc(sizeof(hlld_config));
+    memcpy(mem, &config, sizeof(hlld_config));
+    mem->in_memory = 1;
+    fail_unless(setmgr_create_set(mgr, "cool2", mem) == 0);
+    setmgr_vacuum(mgr);
+
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_set_keys(mgr, "cool1", keys, 3) == 0);
+    hlld_set_list_head *head;
+    fail_unless(setmgr_list_cool_sets(mgr, &head) == 0);
+    fail_unless(head->size == 0);
+    setmgr_cleanup_list(head);
+
+    // Both are listed once they are not written for a scan,
+    // but only the mapped set is cooled
+    fail_unless(setmgr_list_cool_sets(mgr, &head) == 0);
+    fail_unless(head->size == 2);
+    setmgr_cleanup_list(head);
+    fail_unless(setmgr_cool_set(mgr, "cool1") == 0);
+    fail_unless(setmgr_cool_set(mgr, "cool2") == -2);
+    fail_unless(setmgr_cool_set(mgr, "cool3") == -1);
+
+    // A cooled set is not listed again until it is written
+    fail_unless(setmgr_list_cool_sets(mgr, &head) == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->set_name, "cool2") == 0);
+    setmgr_cleanup_list(head);
+
+    // It stays mapped, and reads its registers back in
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "cool1", &size) == 0);
+    fail_unless(size == 3);
+    char *more[] = {"more", "keys"};
+    fail_unless(setmgr_set_keys(mgr, "cool1", more, 2) == 0);
+    fail_unless(setmgr_set_size(mgr, "cool1", &size) == 0);
+    fail_unless(size == 5);
+    fail_unless(setmgr_list_cool_sets(mgr, &head) == 0);
+    setmgr_cleanup_list(head);
+    fail_unless(setmgr_list_cool_sets(mgr, &head) == 0);
+    fail_unless(head->size == 2);
+    setmgr_cleanup_list(head);
+
+    fail_unless(setmgr_drop_set(mgr, "cool1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "cool2") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+static void resident_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(uint64_t*)data = hset_resident_bytes(set);
+}
+
+START_TEST(test_mgr_residency)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_mmap = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "resident1", NULL) == 0);
+    setmgr_vacuum(mgr);
+
+    // Until sampled, the set is taken to be resident
+    uint64_t resident = 0;
+    setmgr_set_cb(mgr, "resident1", resident_cb, &resident);
+    fail_unless(resident > 0);
+
+    // Writes fault in the pages they touch
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_set_keys(mgr, "resident1", keys, 3) == 0);
+    fail_unless(setmgr_sample_residency(mgr, "resident1") == 0);
+    setmgr_set_cb(mgr, "resident1", resident_cb, &resident);
+    fail_unless(resident > 0);
+    fail_unless(setmgr_sample_residency(mgr, "resident2") == -1);
+
+    // Unmapped sets are not resident, and are not sampled
+    fail_unless(setmgr_unmap_set(mgr, "resident1") == 0);
+    fail_unless(setmgr_sample_residency(mgr, "resident1") == -2);
+
+    fail_unless(setmgr_drop_set(mgr, "resident1") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+static void proxied_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(int*)data = hset_is_proxied(set);
+}
+
+START_TEST(test_mgr_sizes_metadata)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "meta1", NULL) == 0);
+    char *keys[] = {"hey","there","person","other"};
+    fail_unless(setmgr_set_keys(mgr, "meta1", keys, 3) == 0);
+
+    // Cached estimates are current
+    char *names[] = {"meta1", "meta2"};
+    uint64_t sizes[2], size;
+    int results[2];
+    fail_unless(setmgr_set_size(mgr, "meta1", &size) == 0 && size == 3);
+    fail_unless(setmgr_set_sizes_metadata(mgr, names, 2, sizes, results) == 1);
+    fail_unless(results[0] == 0 && sizes[0] == 3);
+    fail_unless(results[1] == -1);
+
+    // Writes since the estimate leave it stale
+    fail_unless(setmgr_set_keys(mgr, "meta1", keys + 3, 1) == 0);
+    fail_unless(setmgr_set_sizes_metadata(mgr, names, 1, sizes, results) == 0);
+    fail_unless(results[0] == 1);
+
+    // Proxied sets answer from their config, and stay proxied
+    fail_unless(setmgr_unmap_set(mgr, "meta1") == 0);
+    fail_unless(setmgr_set_sizes_metadata(mgr, names, 1, sizes, results) == 0);
+    fail_unless(results[0] == 1 && sizes[0] == 4);
+    int proxied = 0;
+    setmgr_set_cb(mgr, "meta1", proxied_cb, &proxied);
+    fail_unless(proxied == 1);
+
+    fail_unless(setmgr_drop_set(mgr, "meta1") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_prewarm)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.prewarm = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_create_set(mgr, "warm1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "warm2", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "warm3", NULL) == 0);
+
+    // Advance the clock, so the write makes warm1 the hottest
+    hlld_set_list_head *head;
+    fail_unless(setmgr_list_lru_sets(mgr, UINT64_MAX, &head) == 0);
+    setmgr_cleanup_list(head);
+    fail_unless(setmgr_set_keys(mgr, "warm1", keys, 3) == 0);
+    fail_unless(setmgr_unmap_set(mgr, "warm3") == 0);
+    setmgr_vacuum(mgr);
+    fail_unless(destroy_set_manager(mgr) == 0);
+
+    // Only the sets in memory are recorded, hottest first
+    char line[64];
+    char *path = join_path(config.data_dir, "sets.hot");
+    FILE *f = fopen(path, "r");
+    fail_unless(f != NULL);
+    fail_unless(fgets(line, sizeof(line), f) && !strcmp(line, "warm1\n"));
+    fail_unless(fgets(line, sizeof(line), f) && !strcmp(line, "warm2\n"));
+    fail_unless(!fgets(line, sizeof(line), f));
+    fclose(f);
+    free(path);
+
+    // They are paged in again after a restart
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    int proxied[3] = {1, 1, 1};
+    for (int i=0; i < 200 && (proxied[0] || proxied[1]); i++) {
+        usleep(10000);
+        setmgr_set_cb(mgr, "warm1", proxied_cb, proxied);
+        setmgr_set_cb(mgr, "warm2", proxied_cb, proxied + 1);
+    }
+    setmgr_set_cb(mgr, "warm3", proxied_cb, proxied + 2);
+    fail_unless(!proxied[0] && !proxied[1] && proxied[2]);
+
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "warm1", &size) == 0);
+    fail_unless(size == 3);
+    fail_unless(setmgr_drop_set(mgr, "warm1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "warm2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "warm3") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_archive)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "arch1", NULL) == 0);
+    hlld_config *mem = malloc(sizeof(hlld_config));
+    memcpy(mem, &config, sizeof(hlld_config));
+    mem->in_memory = 1;
+    fail_unless(setmgr_create_set(mgr, "arch2", mem) == 0);
+    setmgr_vacuum(mgr);
+
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_set_keys(mgr, "arch1", keys, 3) == 0);
+    fail_unless(setmgr_archive_set(mgr, "arch1") == 0);
+    fail_unless(setmgr_archive_set(mgr, "arch2") == -2);
+    fail_unless(setmgr_archive_set(mgr, "arch3") == -1);
+    fail_unless(access("/tmp/hlld/hlld.arch1", F_OK) != 0);
+
+    // The size is kept without restoring the set
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "arch1", &size) == 0);
+    fail_unless(size == 3);
+    fail_unless(access("/tmp/hlld/hlld.arch1", F_OK) != 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+
+    // It is still archived after a restart, and a write restores it
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size(mgr, "arch1", &size) == 0);
+    fail_unless(size == 3);
+    char *more[] = {"more", "keys"};
+    fail_unless(setmgr_set_keys(mgr, "arch1", more, 2) == 0);
+    fail_unless(access("/tmp/hlld/hlld.arch1/config.ini", F_OK) == 0);
+    fail_unless(setmgr_set_size(mgr, "arch1", &size) == 0);
+    fail_unless(size == 5);
+
+    // Archived sets are found without the manifest
+    fail_unless(setmgr_archive_set(mgr, "arch1") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+    unlink("/tmp/hlld/sets.manifest");
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size(mgr, "arch1", &size) == 0);
+    fail_unless(size == 5);
+
+    // Dropping the set leaves nothing for compaction to keep
+    fail_unless(setmgr_drop_set(mgr, "arch1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "arch2") == 0);
+    setmgr_vacuum(mgr);
+    uint64_t reclaimed;
+    fail_unless(setmgr_compact_archive(mgr, &reclaimed) == 1);
+    fail_unless(reclaimed > 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_list_lru)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *names[] = {"lru1", "lru2", "lru3"};
+    for (int i=0; i < 3; i++) {
+        res = setmgr_create_set(mgr, names[i], NULL);
+        fail_unless(res == 0);
+    }
+    setmgr_vacuum(mgr);
+
+    // Write each set on its own clock tick, newest last
+    hlld_set_list_head *head;
+    char *keys[] = {"hey","there","person"};
+    int order[] = {1, 0, 2};
+    for (int i=0; i < 3; i++) {
+        res = setmgr_list_lru_sets(mgr, UINT64_MAX, &head);
+        fail_unless(res == 0);
+        fail_unless(head->size == 0);
+        setmgr_cleanup_list(head);
+        res = setmgr_set_keys(mgr, names[order[i]], (char**)&keys, 3);
+        fail_unless(res == 0);
+    }
+
+    // Fit two sets, evicting the oldest
+    uint64_t bytes = hll_bytes_for_precision(12, HLL_PACKED);
+    res = setmgr_list_lru_sets(mgr, 2 * bytes, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->set_name, "lru2") == 0);
+    setmgr_cleanup_list(head);
+
+    // Fit one set, evicting the two oldest in order
+    res = setmgr_list_lru_sets(mgr, bytes + 1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 2);
+    fail_unless(strcmp(head->head->set_name, "lru2") == 0);
+    fail_unless(strcmp(head->head->next->set_name, "lru1") == 0);
+    setmgr_cleanup_list(head);
+
+    // Unmapped sets are not resident
+    res = setmgr_unmap_set(mgr, "lru2");
+    fail_unless(res == 0);
+    res = setmgr_list_lru_sets(mgr, 2 * bytes, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    setmgr_cleanup_list(head);
+
+    for (int i=0; i < 3; i++) {
+        res = setmgr_drop_set(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 /* Unmap in memory */
 START_TEST(test_mgr_unmap_in_mem)
 {
@@ -657,31 +1208,126 @@ START_TEST(test_mgr_restore)
 }
 END_TEST
 
-void test_mgr_cb(void *data, char *set_name, hlld_set* set) {
-    (void)set_name;
-    (void)set;
-    int *out = data;
-    *out = 1;
-}
-
-START_TEST(test_mgr_callback)
+START_TEST(test_mgr_restore_many)
 {
     hlld_config config;
     int res = config_from_filename(NULL, &config);
     fail_unless(res == 0);
-    config.in_memory = 1;
 
     hlld_setmgr *mgr;
     res = init_set_manager(&config, 0, &mgr);
     fail_unless(res == 0);
 
-    res = setmgr_create_set(mgr, "cb1", NULL);
+    // Enough sets to be loaded on several threads
+    char name[64];
+    char *keys[] = {name};
+    for (int i=0; i < 150; i++) {
+        snprintf(name, sizeof(name), "many%d", i);
+        fail_unless(setmgr_create_set(mgr, name, NULL) == 0);
+        fail_unless(setmgr_set_keys(mgr, name, (char**)&keys, 1) == 0);
+    }
+    res = destroy_set_manager(mgr);
     fail_unless(res == 0);
 
-    int val = 0;
-    res = setmgr_set_cb(mgr, "cb1", test_mgr_cb, &val);
-    fail_unless(val == 1);
-
+    // Restore
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_set_list_head *head;
+    res = setmgr_list_sets(mgr, "many", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 150);
+    setmgr_cleanup_list(head);
+
+    uint64_t size;
+    for (int i=0; i < 150; i++) {
+        snprintf(name, sizeof(name), "many%d", i);
+        fail_unless(setmgr_set_size(mgr, name, &size) == 0);
+        fail_unless(size == 1);
+        fail_unless(setmgr_drop_set(mgr, name) == 0);
+    }
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void precision_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(int*)data = set->set_config.default_precision;
+}
+
+START_TEST(test_mgr_restore_manifest)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_precision = 14;
+    res = setmgr_create_set(mgr, "zabman", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    res = setmgr_set_keys(mgr, "zabman", (char**)&keys, 3);
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Restore without the set config, which the manifest replaces
+    char *config_path = join_path(config.data_dir, "hlld.zabman/config.ini");
+    fail_unless(unlink(config_path) == 0);
+    free(config_path);
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    int precision = 0;
+    res = setmgr_set_cb(mgr, "zabman", precision_cb, &precision);
+    fail_unless(res == 0);
+    fail_unless(precision == 14);
+
+    uint64_t size;
+    res = setmgr_set_size(mgr, "zabman", &size);
+    fail_unless(res == 0);
+    fail_unless(size == 3);
+
+    res = setmgr_drop_set(mgr, "zabman");
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+void test_mgr_cb(void *data, char *set_name, hlld_set* set) {
+    (void)set_name;
+    (void)set;
+    int *out = data;
+    *out = 1;
+}
+
+START_TEST(test_mgr_callback)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "cb1", NULL);
+    fail_unless(res == 0);
+
+    int val = 0;
+    res = setmgr_set_cb(mgr, "cb1", test_mgr_cb, &val);
+    fail_unless(val == 1);
+
     res = setmgr_drop_set(mgr, "cb1");
     fail_unless(res == 0);
 
@@ -690,3 +1336,1595 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+START_TEST(test_mgr_merge)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "merge1", NULL);
+    fail_unless(res == 0);
+    res = setmgr_create_set(mgr, "merge2", NULL);
+    fail_unless(res == 0);
+    res = setmgr_create_set(mgr, "merge_dst", NULL);
+    fail_unless(res == 0);
+
+    // Different precision
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_precision = 14;
+    res = setmgr_create_set(mgr, "merge_p14", custom);
+    fail_unless(res == 0);
+
+    char *keys1[] = {"hey","there","person"};
+    char *keys2[] = {"hey","other","people"};
+    fail_unless(setmgr_set_keys(mgr, "merge1", (char**)&keys1, 3) == 0);
+    fail_unless(setmgr_set_keys(mgr, "merge2", (char**)&keys2, 3) == 0);
+
+    char *srcs[] = {"merge1", "merge2"};
+    res = setmgr_merge_sets(mgr, "merge_dst", (char**)&srcs, 2);
+    fail_unless(res == 0);
+
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "merge_dst", &size) == 0);
+    fail_unless(size == 5);
+
+    // Sources are untouched
+    fail_unless(setmgr_set_size(mgr, "merge1", &size) == 0);
+    fail_unless(size == 3);
+
+    // Missing sets, and sources of a lower precision
+    char *missing[] = {"merge1", "merge_none"};
+    fail_unless(setmgr_merge_sets(mgr, "merge_none", (char**)&srcs, 2) == -1);
+    fail_unless(setmgr_merge_sets(mgr, "merge_dst", (char**)&missing, 2) == -1);
+    fail_unless(setmgr_merge_sets(mgr, "merge_p14", (char**)&srcs, 2) == -2);
+
+    // Higher precisions are folded down
+    char *p14_keys[] = {"hey","folded"};
+    fail_unless(setmgr_set_keys(mgr, "merge_p14", (char**)&p14_keys, 2) == 0);
+    char *p14[] = {"merge_p14"};
+    fail_unless(setmgr_merge_sets(mgr, "merge_dst", (char**)&p14, 1) == 0);
+    fail_unless(setmgr_set_size(mgr, "merge_dst", &size) == 0);
+    fail_unless(size == 6);
+    char *all[] = {"merge_p14", "merge1", "merge2"};
+    fail_unless(setmgr_size_union(mgr, (char**)&all, 3, &size) == 0);
+    fail_unless(size == 6);
+
+    // Mismatched hashes
+    hlld_config *wy = malloc(sizeof(hlld_config));
+    memcpy(wy, &config, sizeof(hlld_config));
+    wy->default_hash = HLL_HASH_WYHASH;
+    fail_unless(setmgr_create_set(mgr, "merge_wy", wy) == 0);
+    char *wys[] = {"merge_wy"};
+    fail_unless(setmgr_merge_sets(mgr, "merge_dst", (char**)&wys, 1) == -2);
+    fail_unless(setmgr_size_union(mgr, (char**)&wys, 1, &size) == 0);
+    char *mixed[] = {"merge1", "merge_wy"};
+    fail_unless(setmgr_size_union(mgr, (char**)&mixed, 2, &size) == -2);
+
+    // Client computed hashes
+    wy = malloc(sizeof(hlld_config));
+    memcpy(wy, &config, sizeof(hlld_config));
+    wy->default_hash = HLL_HASH_EXTERNAL;
+    fail_unless(setmgr_create_set(mgr, "merge_ext", wy) == 0);
+    uint64_t hashes[] = {0x9e3779b97f4a7c15ULL, 0x2545f4914f6cdd1dULL};
+    fail_unless(setmgr_set_hashes(mgr, "merge_ext", hashes, 2) == 0);
+    fail_unless(setmgr_set_size(mgr, "merge_ext", &size) == 0);
+    fail_unless(size == 2);
+    fail_unless(setmgr_set_hashes(mgr, "merge1", hashes, 2) == -3);
+    fail_unless(setmgr_set_keys(mgr, "merge_ext", (char**)&keys1, 3) == -3);
+    fail_unless(setmgr_set_hashes(mgr, "merge_none", hashes, 2) == -1);
+    fail_unless(setmgr_drop_set(mgr, "merge_ext") == 0);
+
+    fail_unless(setmgr_drop_set(mgr, "merge1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "merge2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "merge_dst") == 0);
+    fail_unless(setmgr_drop_set(mgr, "merge_p14") == 0);
+    fail_unless(setmgr_drop_set(mgr, "merge_wy") == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_merge_raw)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "raw_dense", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "raw_sparse", NULL) == 0);
+
+    // Dense registers, as an edge node keeps them
+    hll_t edge;
+    fail_unless(hll_init(config.default_precision, HLL_PACKED, &edge) == 0);
+    char key[32];
+    for (int i=0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "edge%d", i);
+        hll_add(&edge, key);
+    }
+    uint64_t len = hll_bytes_for_precision(edge.precision, HLL_PACKED);
+    res = setmgr_merge_raw(mgr, "raw_dense", edge.precision, HSET_RAW_PACKED,
+            (unsigned char*)edge.registers, len);
+    fail_unless(res == 0);
+    uint64_t size, expected = hll_size(&edge);
+    fail_unless(setmgr_set_size(mgr, "raw_dense", &size) == 0);
+    fail_unless(size >= expected - 5 && size <= expected + 5);
+
+    // Merging the same registers again changes nothing
+    fail_unless(setmgr_merge_raw(mgr, "raw_dense", edge.precision, HSET_RAW_PACKED,
+            (unsigned char*)edge.registers, len) == 0);
+    fail_unless(setmgr_set_size(mgr, "raw_dense", &size) == 0);
+    fail_unless(size >= expected - 5 && size <= expected + 5);
+
+    // Sparse entries of a higher precision are folded down
+    hll_t fine;
+    fail_unless(hll_init(config.default_precision + 2, HLL_BYTE, &fine) == 0);
+    hll_add(&fine, "hey");
+    hll_add(&fine, "there");
+    hll_add(&fine, "person");
+    uint32_t entries[3];
+    fail_unless(hll_register_entries(&fine, entries) == 3);
+    res = setmgr_merge_raw(mgr, "raw_sparse", fine.precision, HSET_RAW_SPARSE,
+            (unsigned char*)entries, sizeof(entries));
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size(mgr, "raw_sparse", &size) == 0);
+    fail_unless(size == 3);
+
+    // Missing sets, lower precisions and bad payloads
+    fail_unless(setmgr_merge_raw(mgr, "raw_none", fine.precision, HSET_RAW_SPARSE,
+            (unsigned char*)entries, sizeof(entries)) == -1);
+    fail_unless(setmgr_merge_raw(mgr, "raw_sparse", config.default_precision - 1,
+            HSET_RAW_SPARSE, (unsigned char*)entries, sizeof(entries)) == -2);
+    fail_unless(setmgr_merge_raw(mgr, "raw_sparse", fine.precision, HSET_RAW_SPARSE,
+            (unsigned char*)entries, sizeof(entries) - 1) == -4);
+    fail_unless(setmgr_merge_raw(mgr, "raw_dense", edge.precision, HSET_RAW_PACKED,
+            (unsigned char*)edge.registers, len - 4) == -4);
+    fail_unless(setmgr_merge_raw(mgr, "raw_dense", edge.precision, 7,
+            (unsigned char*)edge.registers, len) == -4);
+    uint32_t too_high = HLL_ENTRY(1, 64 - config.default_precision + 2);
+    fail_unless(setmgr_merge_raw(mgr, "raw_sparse", config.default_precision,
+            HSET_RAW_SPARSE, (unsigned char*)&too_high, sizeof(too_high)) == -4);
+    uint64_t byte_len = hll_bytes_for_precision(config.default_precision, HLL_BYTE);
+    unsigned char *bytes = calloc(1, byte_len);
+    bytes[10] = 200;
+    fail_unless(setmgr_merge_raw(mgr, "raw_sparse", config.default_precision,
+            HSET_RAW_BYTE, bytes, byte_len) == -4);
+    free(bytes);
+    fail_unless(setmgr_set_size(mgr, "raw_sparse", &size) == 0);
+    fail_unless(size == 3);
+
+    hll_destroy(&edge);
+    hll_destroy(&fine);
+    fail_unless(setmgr_drop_set(mgr, "raw_dense") == 0);
+    fail_unless(setmgr_drop_set(mgr, "raw_sparse") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+typedef struct {
+    unsigned char precision;
+    hset_raw_layout layout;
+    unsigned char *regs;
+    uint64_t len;
+} raw_capture;
+
+static void capture_raw_cb(void *data, unsigned char precision, hset_raw_layout layout,
+        const unsigned char *regs, uint64_t len) {
+    raw_capture *c = data;
+    c->precision = precision;
+    c->layout = layout;
+    c->regs = malloc(len);
+    memcpy(c->regs, regs, len);
+    c->len = len;
+}
+
+START_TEST(test_mgr_get_raw)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    hlld_config *sparse = malloc(sizeof(hlld_config));
+    memcpy(sparse, &config, sizeof(hlld_config));
+    sparse->sparse = 1;
+    fail_unless(setmgr_create_set(mgr, "getraw_src", sparse) == 0);
+    fail_unless(setmgr_create_set(mgr, "getraw_dst", NULL) == 0);
+
+    // A sparse set is always listed as entries
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_set_keys(mgr, "getraw_src", (char**)&keys, 3) == 0);
+    raw_capture c;
+    fail_unless(setmgr_get_raw(mgr, "getraw_src", 0, capture_raw_cb, &c) == 0);
+    fail_unless(c.precision == config.default_precision);
+    fail_unless(c.layout == HSET_RAW_SPARSE);
+    fail_unless(c.len == 3 * sizeof(uint32_t));
+    free(c.regs);
+
+    // Dense registers round trip through a merge
+    char key[32], *key_ptr = key;
+    for (int i=0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "getraw%d", i);
+        fail_unless(setmgr_set_keys(mgr, "getraw_src", &key_ptr, 1) == 0);
+    }
+    fail_unless(setmgr_get_raw(mgr, "getraw_src", 0, capture_raw_cb, &c) == 0);
+    fail_unless(c.layout == (hset_raw_layout)config.default_format);
+    fail_unless(c.len == hll_bytes_for_precision(c.precision, config.default_format));
+    fail_unless(setmgr_merge_raw(mgr, "getraw_dst", c.precision, c.layout, c.regs, c.len) == 0);
+    free(c.regs);
+
+    uint64_t src_size, dst_size;
+    fail_unless(setmgr_set_size(mgr, "getraw_src", &src_size) == 0);
+    fail_unless(setmgr_set_size(mgr, "getraw_dst", &dst_size) == 0);
+    fail_unless(src_size == dst_size);
+
+    // Or as the entries of the registers that are set
+    fail_unless(setmgr_get_raw(mgr, "getraw_src", 1, capture_raw_cb, &c) == 0);
+    fail_unless(c.layout == HSET_RAW_SPARSE);
+    fail_unless(setmgr_drop_set(mgr, "getraw_dst") == 0);
+    fail_unless(setmgr_create_set(mgr, "getraw_dst2", NULL) == 0);
+    fail_unless(setmgr_merge_raw(mgr, "getraw_dst2", c.precision, c.layout, c.regs, c.len) == 0);
+    free(c.regs);
+    fail_unless(setmgr_set_size(mgr, "getraw_dst2", &dst_size) == 0);
+    fail_unless(src_size == dst_size);
+
+    fail_unless(setmgr_get_raw(mgr, "getraw_none", 0, capture_raw_cb, &c) == -1);
+    fail_unless(setmgr_drop_set(mgr, "getraw_src") == 0);
+    fail_unless(setmgr_drop_set(mgr, "getraw_dst2") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_set_sizes)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.default_estimator = HLL_ESTIMATOR_ERTL;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Enough uncached sets to be split across threads
+    char *names[202];
+    char key[32], *key_ptr = key;
+    for (int i=0; i < 200; i++) {
+        fail_unless(asprintf(&names[i], "sizes%d", i) != -1);
+        fail_unless(setmgr_create_set(mgr, names[i], NULL) == 0);
+        for (int k=0; k < i % 10; k++) {
+            snprintf(key, sizeof(key), "key%d", k);
+            fail_unless(setmgr_set_keys(mgr, names[i], &key_ptr, 1) == 0);
+        }
+    }
+    names[200] = "sizes_none";
+    names[201] = names[3];
+
+    uint64_t sizes[202];
+    int results[202] = {0};
+    fail_unless(setmgr_set_sizes(mgr, names, 202, sizes, results) == 1);
+    for (int i=0; i < 200; i++) {
+        fail_unless(results[i] == 0);
+        fail_unless(sizes[i] == (uint64_t)(i % 10));
+    }
+    fail_unless(results[200] == -1);
+    fail_unless(results[201] == 0 && sizes[201] == 3);
+
+    // Cached sizes give the same answers
+    memset(results, 0, sizeof(results));
+    fail_unless(setmgr_set_sizes(mgr, names, 200, sizes, results) == 0);
+    for (int i=0; i < 200; i++) fail_unless(sizes[i] == (uint64_t)(i % 10));
+
+    for (int i=0; i < 200; i++) {
+        fail_unless(setmgr_drop_set(mgr, names[i]) == 0);
+        free(names[i]);
+    }
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+static void* auto_create_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    char key[32], *key_ptr = key;
+    for (int i=0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(setmgr_set_keys(mgr, "auto_race", &key_ptr, 1) == 0);
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+START_TEST(test_mgr_data_dirs)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dirs = "/tmp/hlld_dirs0, /tmp/hlld_dirs1";
+    fail_unless(sane_data_dirs(config.data_dirs, &config.data_dir_list, &config.num_data_dirs) == 0);
+    fail_unless(config.num_data_dirs == 2);
+    config.data_dir = config.data_dir_list[0];
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // The sets are placed across both directories
+    char *keys[] = {"hey", "there", "person"};
+    char name[32], path[64];
+    struct stat buf;
+    int placed[2] = {0};
+    for (int i=0; i < 16; i++) {
+        snprintf(name, sizeof(name), "dirs%d", i);
+        fail_unless(setmgr_create_set(mgr, name, NULL) == 0);
+        fail_unless(setmgr_set_keys(mgr, name, keys, 1 + i % 3) == 0);
+        fail_unless(setmgr_flush_set(mgr, name) == 0);
+        int found = 0;
+        for (int d=0; d < 2; d++) {
+            snprintf(path, sizeof(path), "/tmp/hlld_dirs%d/hlld.%s", d, name);
+            if (!stat(path, &buf)) {
+                found++;
+                placed[d]++;
+            }
+        }
+        fail_unless(found == 1);
+    }
+    fail_unless(placed[0] > 0 && placed[1] > 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+
+    // The sets are found in both, with the manifest or by a scan
+    for (int pass=0; pass < 2; pass++) {
+        if (pass) unlink("/tmp/hlld_dirs0/sets.manifest");
+        res = init_set_manager(&config, 0, &mgr);
+        fail_unless(res == 0);
+        for (int i=0; i < 16; i++) {
+            snprintf(name, sizeof(name), "dirs%d", i);
+            uint64_t size;
+            fail_unless(setmgr_set_size(mgr, name, &size) == 0);
+            fail_unless(size == (uint64_t)(1 + i % 3));
+        }
+        fail_unless(destroy_set_manager(mgr) == 0);
+    }
+
+    // Placing by the free space also uses a single directory
+    config.placement = PLACE_SPACE;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "dirs_space", NULL) == 0);
+    fail_unless(setmgr_flush_set(mgr, "dirs_space") == 0);
+    int found = !stat("/tmp/hlld_dirs0/hlld.dirs_space", &buf) +
+        !stat("/tmp/hlld_dirs1/hlld.dirs_space", &buf);
+    fail_unless(found == 1);
+
+    fail_unless(setmgr_drop_set(mgr, "dirs_space") == 0);
+    for (int i=0; i < 16; i++) {
+        snprintf(name, sizeof(name), "dirs%d", i);
+        fail_unless(setmgr_drop_set(mgr, name) == 0);
+    }
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_auto_create)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Writes to missing sets fail by default
+    char *keys[] = {"hey", "there", "person"};
+    fail_unless(setmgr_set_keys(mgr, "auto1", keys, 3) == -1);
+    config.auto_create = 1;
+
+    // Until they are created on the first write
+    fail_unless(setmgr_set_keys(mgr, "auto1", keys, 3) == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "auto1", &size) == 0);
+    fail_unless(size == 3);
+    fail_unless(setmgr_create_set(mgr, "auto1", NULL) == -1);
+
+    char *names[] = {"auto1", "auto2", "bad name"};
+    int results[3] = {0};
+    fail_unless(setmgr_set_keys_multi(mgr, names, 3, keys, 2, results) == 1);
+    fail_unless(results[0] == 0 && results[1] == 0 && results[2] == -1);
+    fail_unless(setmgr_set_size(mgr, "auto2", &size) == 0);
+    fail_unless(size == 2);
+
+    // Racing writers all write to one set
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++)
+        fail_unless(pthread_create(threads + i, NULL, auto_create_thread_main, mgr) == 0);
+    for (int i=0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    fail_unless(setmgr_set_size(mgr, "auto_race", &size) == 0);
+    fail_unless(size == 100);
+
+    // A set is not created again while its delete is pending
+    fail_unless(setmgr_drop_set(mgr, "auto1") == 0);
+    fail_unless(setmgr_set_keys(mgr, "auto1", keys, 3) == -1);
+
+    fail_unless(setmgr_drop_set(mgr, "auto2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "auto_race") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_create_sets)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    hlld_config shared;
+    memcpy(&shared, &config, sizeof(hlld_config));
+    shared.default_precision = 10;
+    shared.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_create_set(mgr, "bulkc2", NULL) == 0);
+    char *names[] = {"bulkc1", "bulkc2", "bulkc3", "bulkc1"};
+    int results[4];
+    fail_unless(setmgr_create_sets(mgr, names, 4, &shared, results) == 2);
+    fail_unless(results[0] == 0 && results[1] == -1);
+    fail_unless(results[2] == 0 && results[3] == -1);
+
+    // The sets are found before and after the vacuum
+    char *keys[] = {"hey", "there"};
+    fail_unless(setmgr_set_keys(mgr, "bulkc1", keys, 2) == 0);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_set_keys(mgr, "bulkc3", keys, 2) == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "bulkc1", &size) == 0 && size == 2);
+
+    hlld_set_list_head *head;
+    fail_unless(setmgr_list_sets(mgr, "bulkc", &head) == 0);
+    fail_unless(head->size == 3);
+    setmgr_cleanup_list(head);
+
+    // Sets of a dropped name are refused until it is vacuumed
+    fail_unless(setmgr_drop_set(mgr, "bulkc3") == 0);
+    fail_unless(setmgr_create_sets(mgr, names + 2, 1, &shared, results) == 1);
+    fail_unless(results[0] == -3);
+
+    fail_unless(setmgr_drop_set(mgr, "bulkc1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "bulkc2") == 0);
+    fail_unless(destroy_set_manager(mgr) == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_size_union_intersect)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_create_set(mgr, "sizeu1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "sizeu2", NULL) == 0);
+
+    // 2000 keys each, 1000 in common
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; i < 3000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        if (i < 2000) fail_unless(setmgr_set_keys(mgr, "sizeu1", (char**)&keys, 1) == 0);
+        if (i >= 1000) fail_unless(setmgr_set_keys(mgr, "sizeu2", (char**)&keys, 1) == 0);
+    }
+
+    char *names[] = {"sizeu1", "sizeu2"};
+    uint64_t est;
+    fail_unless(setmgr_size_union(mgr, (char**)&names, 2, &est) == 0);
+    fail_unless(est > 2850 && est < 3150);
+    fail_unless(setmgr_size_intersect(mgr, (char**)&names, 2, &est) == 0);
+    fail_unless(est > 850 && est < 1150);
+
+    // Sets are not modified
+    fail_unless(setmgr_set_size(mgr, "sizeu1", &est) == 0);
+    fail_unless(est > 1900 && est < 2100);
+
+    // Errors
+    char *missing[] = {"sizeu1", "sizeu_none"};
+    fail_unless(setmgr_size_union(mgr, (char**)&missing, 2, &est) == -1);
+    fail_unless(setmgr_size_intersect(mgr, (char**)&missing, 2, &est) == -1);
+    fail_unless(setmgr_size_intersect(mgr, (char**)&names, SETMGR_MAX_INTERSECT + 1, &est) == -4);
+
+    fail_unless(setmgr_drop_set(mgr, "sizeu1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "sizeu2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_jaccard)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.default_kmv = 4096;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_kmv = 0;
+    fail_unless(setmgr_create_set(mgr, "jacc1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "jacc2", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "jacc_none", custom) == 0);
+
+    // 40000 keys each, 2000 in common
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; i < 78000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        if (i < 40000) fail_unless(setmgr_set_keys(mgr, "jacc1", (char**)&keys, 1) == 0);
+        if (i >= 38000) fail_unless(setmgr_set_keys(mgr, "jacc2", (char**)&keys, 1) == 0);
+        if (i < 40000) fail_unless(setmgr_set_keys(mgr, "jacc_none", (char**)&keys, 1) == 0);
+    }
+
+    // The smallest hashes survive the sets being closed
+    fail_unless(setmgr_unmap_set(mgr, "jacc1") == 0);
+    fail_unless(setmgr_unmap_set(mgr, "jacc2") == 0);
+
+    char *names[] = {"jacc1", "jacc2"};
+    double jaccard;
+    uint64_t est;
+    fail_unless(setmgr_jaccard(mgr, (char**)&names, 2, &jaccard) == 0);
+    fail_unless(jaccard > 0.7 * 2000 / 78000 && jaccard < 1.3 * 2000 / 78000);
+    fail_unless(setmgr_size_intersect(mgr, (char**)&names, 2, &est) == 0);
+    fail_unless(est > 1400 && est < 2600);
+
+    // Sets without them fall back to inclusion-exclusion
+    char *mixed[] = {"jacc1", "jacc_none"};
+    fail_unless(setmgr_jaccard(mgr, (char**)&mixed, 2, &jaccard) == -5);
+    fail_unless(setmgr_size_intersect(mgr, (char**)&mixed, 2, &est) == 0);
+    fail_unless(est > 36000 && est < 44000);
+
+    char *missing[] = {"jacc1", "jacc_missing"};
+    fail_unless(setmgr_jaccard(mgr, (char**)&missing, 2, &jaccard) == -1);
+
+    fail_unless(setmgr_drop_set(mgr, "jacc1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "jacc2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "jacc_none") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_size_union_remote)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "sizer1", NULL) == 0);
+
+    // The remote registers overlap the set by 1000 keys
+    hll_t remote, other;
+    fail_unless(hll_init(config.default_precision, config.default_format, &remote) == 0);
+    fail_unless(hll_init(config.default_precision + 1, config.default_format, &other) == 0);
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; i < 3000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        if (i < 2000) fail_unless(setmgr_set_keys(mgr, "sizer1", (char**)&keys, 1) == 0);
+        if (i >= 1000) hll_add(&remote, buf);
+    }
+
+    hlld_set_config set_config = {0};
+    set_config.default_precision = config.default_precision;
+    set_config.hash = config.default_hash;
+    hll_t *remotes[] = {&remote};
+    hlld_set_config *configs[] = {&set_config};
+    char *names[] = {"sizer1"};
+    uint64_t est;
+    fail_unless(setmgr_size_union_remote(mgr, (char**)&names, 1, remotes, configs, 1, &est) == 0);
+    fail_unless(est > 2850 && est < 3150);
+
+    // Only remote sets
+    fail_unless(setmgr_size_union_remote(mgr, NULL, 0, remotes, configs, 1, &est) == 0);
+    fail_unless(est > 1900 && est < 2100);
+
+    // Higher precisions are folded down
+    hlld_set_config other_config = set_config;
+    other_config.default_precision++;
+    hll_t *others[] = {&other};
+    hlld_set_config *other_configs[] = {&other_config};
+    fail_unless(setmgr_size_union_remote(mgr, (char**)&names, 1, others, other_configs, 1, &est) == 0);
+    fail_unless(est > 1900 && est < 2100);
+
+    // The hashes must match
+    other_config.hash = HLL_HASH_WYHASH;
+    fail_unless(setmgr_size_union_remote(mgr, (char**)&names, 1, others, other_configs, 1, &est) == -2);
+
+    hll_destroy(&remote);
+    hll_destroy(&other);
+    fail_unless(setmgr_drop_set(mgr, "sizer1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_size_window)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_window = 3600;
+    custom->default_window_buckets = 24;
+    fail_unless(setmgr_create_set(mgr, "window1", custom) == 0);
+    fail_unless(setmgr_create_set(mgr, "window2", NULL) == 0);
+
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        fail_unless(setmgr_set_keys(mgr, "window1", (char**)&keys, 1) == 0);
+    }
+
+    uint64_t est;
+    fail_unless(setmgr_set_size_window(mgr, "window1", 86400, &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+    fail_unless(setmgr_set_size_window(mgr, "window1", 0, &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+    fail_unless(setmgr_set_size_window(mgr, "window2", 86400, &est) == -2);
+    fail_unless(setmgr_set_size_window(mgr, "noop", 86400, &est) == -1);
+
+    // The window is kept over a restart
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size_window(mgr, "window1", 86400, &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+
+    fail_unless(setmgr_drop_set(mgr, "window1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "window2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_size_sliding)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_sliding = 3600;
+    fail_unless(setmgr_create_set(mgr, "sliding1", custom) == 0);
+
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        fail_unless(setmgr_set_keys(mgr, "sliding1", (char**)&keys, 1) == 0);
+    }
+
+    uint64_t est;
+    fail_unless(setmgr_set_size_window(mgr, "sliding1", 600, &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+
+    // The timestamped registers are kept over a restart
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size_window(mgr, "sliding1", 86400, &est) == 0);
+    fail_unless(est > 950 && est < 1050);
+
+    fail_unless(setmgr_drop_set(mgr, "sliding1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_wal_replay)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.wal = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "walset1", NULL) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Log raises the set never flushed, as if the server crashed
+    hll_t h;
+    fail_unless(hll_init(config.default_precision, HLL_PACKED, &h) == 0);
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        hll_add(&h, buf);
+    }
+    uint32_t *entries = malloc((1 << config.default_precision) * sizeof(uint32_t));
+    int num = hll_register_entries(&h, entries);
+    hlld_set_config set_config = {0};
+    set_config.default_precision = config.default_precision;
+    set_config.hash = config.default_hash;
+
+    hlld_wal *wal;
+    fail_unless(init_wal(&config, &wal) == 0);
+    fail_unless(wal_append(wal, NULL, "walset1", &set_config, entries, num) == 0);
+    fail_unless(wal_append(wal, NULL, "unknown", &set_config, entries, num) == 0);
+    destroy_wal(wal);
+    free(entries);
+    hll_destroy(&h);
+
+    // The raises are replayed as the set is loaded
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "walset1", &size) == 0);
+    fail_unless(size > 950 && size < 1050);
+
+    // Once flushed, the replayed segments are removed
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+    DIR *dir = opendir(config.data_dir);
+    struct dirent *ent;
+    int segments = 0;
+    while ((ent = readdir(dir))) {
+        if (!strncmp(ent->d_name, "wal.", 4)) segments++;
+    }
+    closedir(dir);
+    fail_unless(segments == 1);
+
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size(mgr, "walset1", &size) == 0);
+    fail_unless(size > 950 && size < 1050);
+    fail_unless(setmgr_drop_set(mgr, "walset1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    dir = opendir(config.data_dir);
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "wal.", 4)) continue;
+        char *path = join_path(config.data_dir, ent->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(dir);
+}
+END_TEST
+
+START_TEST(test_mgr_slab)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.slab_registers = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "slabset1", NULL) == 0);
+    char *keys[1000];
+    char buf[1000][16];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf[i], sizeof(buf[i]), "key%d", i);
+        keys[i] = buf[i];
+    }
+    fail_unless(setmgr_set_keys(mgr, "slabset1", keys, 1000) == 0);
+    fail_unless(setmgr_flush_set(mgr, "slabset1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // The registers are in the slab, not a file of the set
+    fail_unless(access("/tmp/hlld/slab.0.data", F_OK) == 0);
+    fail_unless(access("/tmp/hlld/hlld.slabset1/registers.mmap", F_OK) != 0);
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "slabset1", &size) == 0);
+    fail_unless(size > 950 && size < 1050);
+    fail_unless(setmgr_drop_set(mgr, "slabset1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Dropping the set freed its slot
+    hlld_slab *slab;
+    fail_unless(init_slab("/tmp/hlld", 0, &slab) == 0);
+    fail_unless(slab_slots(slab) == 0);
+    destroy_slab(slab);
+    unlink("/tmp/hlld/slab.0.data");
+}
+END_TEST
+
+START_TEST(test_mgr_fold)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.slab_registers = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_precision = 14;
+    fail_unless(setmgr_create_set(mgr, "foldset", custom) == 0);
+    char *keys[1000];
+    char buf[1000][16];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf[i], sizeof(buf[i]), "key%d", i);
+        keys[i] = buf[i];
+    }
+    fail_unless(setmgr_set_keys(mgr, "foldset", keys, 1000) == 0);
+    fail_unless(setmgr_fold_set(mgr, "noset", 10) == -1);
+    fail_unless(setmgr_fold_set(mgr, "foldset", 10) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // The manifest has the folded config
+    char *config_path = join_path(config.data_dir, "hlld.foldset/config.ini");
+    fail_unless(unlink(config_path) == 0);
+    free(config_path);
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    int precision = 0;
+    fail_unless(setmgr_set_cb(mgr, "foldset", precision_cb, &precision) == 0);
+    fail_unless(precision == 10);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "foldset", &size) == 0);
+    fail_unless(size > 900 && size < 1100);
+    fail_unless(setmgr_drop_set(mgr, "foldset") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+    unlink("/tmp/hlld/slab.0.data");
+}
+END_TEST
+
+START_TEST(test_mgr_read_only)
+{
+    hlld_config config, ro_config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    memcpy(&ro_config, &config, sizeof(hlld_config));
+    ro_config.read_only = 1;
+
+    hlld_setmgr *mgr, *replica;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "ro1", NULL) == 0);
+    char *keys[100];
+    char buf[100][16];
+    for (int i=0; i < 100; i++) {
+        snprintf(buf[i], sizeof(buf[i]), "key%d", i);
+        keys[i] = buf[i];
+    }
+    fail_unless(setmgr_set_keys(mgr, "ro1", keys, 100) == 0);
+    fail_unless(setmgr_flush_set(mgr, "ro1") == 0);
+
+    // The replica follows the primary's data directory
+    res = init_set_manager(&ro_config, 0, &replica);
+    fail_unless(res == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(replica, "ro1", &size) == 0);
+    fail_unless(size > 95 && size < 105);
+
+    // Creates, drops and writes are seen once refreshed
+    fail_unless(setmgr_create_set(mgr, "ro2", NULL) == 0);
+    fail_unless(setmgr_drop_set(mgr, "ro1") == 0);
+    fail_unless(setmgr_set_size(replica, "ro2", &size) == -1);
+    fail_unless(setmgr_refresh(replica) == 0);
+    fail_unless(setmgr_set_size(replica, "ro1", &size) == -1);
+    fail_unless(setmgr_set_size(replica, "ro2", &size) == 0);
+    fail_unless(size == 0);
+
+    fail_unless(setmgr_set_keys(mgr, "ro2", keys, 50) == 0);
+    fail_unless(setmgr_flush_set(mgr, "ro2") == 0);
+    fail_unless(setmgr_refresh(replica) == 0);
+    fail_unless(setmgr_set_size(replica, "ro2", &size) == 0);
+    fail_unless(size > 45 && size < 55);
+
+    res = destroy_set_manager(replica);
+    fail_unless(res == 0);
+    fail_unless(setmgr_drop_set(mgr, "ro2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void page_in_done(void *data) {
+    *(volatile int*)data = 1;
+}
+
+START_TEST(test_mgr_page_in_async)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_page_in_async(mgr, "pagein_none", page_in_done, NULL) == -1);
+
+    res = setmgr_create_set(mgr, "pagein1", NULL);
+    fail_unless(res == 0);
+
+    // Resident sets need no page in
+    volatile int done = 0;
+    fail_unless(setmgr_page_in_async(mgr, "pagein1", page_in_done, (void*)&done) == 0);
+
+    char *keys[] = {"hey","there","person"};
+    res = setmgr_set_keys(mgr, "pagein1", (char**)&keys, 3);
+    fail_unless(res == 0);
+    res = setmgr_unmap_set(mgr, "pagein1");
+    fail_unless(res == 0);
+
+    // Proxied sets are paged in, then the callback runs
+    fail_unless(setmgr_page_in_async(mgr, "pagein1", page_in_done, (void*)&done) == 1);
+    for (int i=0; i < 1000 && !done; i++) usleep(1000);
+    fail_unless(done == 1);
+    fail_unless(setmgr_page_in_async(mgr, "pagein1", page_in_done, (void*)&done) == 0);
+
+    uint64_t size;
+    res = setmgr_set_size(mgr, "pagein1", &size);
+    fail_unless(res == 0);
+    fail_unless(size == 3);
+
+    res = setmgr_drop_set(mgr, "pagein1");
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_lookup_cache)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_create_set(mgr, "cache1", NULL) == 0);
+    char *keys[] = {"hey"};
+    for (int i=0; i < 3000; i++) {
+        fail_unless(setmgr_set_keys(mgr, "cache1", (char**)&keys, 1) == 0);
+    }
+
+    // Repeated lookups are served by the cache
+    uint64_t hits, misses;
+    setmgr_lookup_stats(mgr, &hits, &misses);
+    fail_unless(hits >= 2048);
+    fail_unless(misses < 1024);
+
+    // A cached set is still seen as dropped, and is
+    // gone once the vacuum reclaims it
+    fail_unless(setmgr_drop_set(mgr, "cache1") == 0);
+    fail_unless(setmgr_set_keys(mgr, "cache1", (char**)&keys, 1) == -1);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_set_keys(mgr, "cache1", (char**)&keys, 1) == -1);
+
+    // A new set of the same name is found
+    fail_unless(setmgr_create_set(mgr, "cache1", NULL) == 0);
+    fail_unless(setmgr_set_keys(mgr, "cache1", (char**)&keys, 1) == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "cache1", &size) == 0);
+    fail_unless(size == 1);
+
+    fail_unless(setmgr_drop_set(mgr, "cache1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+/**
+ * Creates a set, retrying while a drop of it is pending.
+ * Marks the client idle between attempts if asked.
+ */
+static int create_after_drop(hlld_setmgr *mgr, char *set_name, int idle) {
+    int res;
+    for (int tries=0; tries < 1000; tries++) {
+        setmgr_client_checkpoint(mgr);
+        res = setmgr_create_set(mgr, set_name, NULL);
+        if (res != -3) return res;
+        if (idle) setmgr_client_idle(mgr);
+        usleep(1000);
+    }
+    return res;
+}
+
+START_TEST(test_mgr_vacuum_wakeup)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    setmgr_client_checkpoint(mgr);
+
+    // The vacuum thread is woken by each drop and by our
+    // checkpoints, or by us going idle, instead of polling
+    for (int i=0; i < 20; i++) {
+        fail_unless(create_after_drop(mgr, "wake1", i % 2) == 0);
+        fail_unless(setmgr_drop_set(mgr, "wake1") == 0);
+    }
+    fail_unless(create_after_drop(mgr, "wake1", 0) == 0);
+    fail_unless(setmgr_drop_set(mgr, "wake1") == 0);
+
+    setmgr_client_leave(mgr);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* client_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    setmgr_client_checkpoint(mgr);
+    setmgr_client_checkpoint(mgr);
+    setmgr_client_idle(mgr);
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+START_TEST(test_mgr_client_slots)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+
+    // More threads than slots come and go, reusing the slots
+    for (int i=0; i < 2048; i += 8) {
+        pthread_t threads[8];
+        for (int j=0; j < 8; j++)
+            fail_unless(pthread_create(threads + j, NULL, client_thread_main, mgr) == 0);
+        for (int j=0; j < 8; j++)
+            pthread_join(threads[j], NULL);
+    }
+
+    // Departed clients do not hold back the vacuum
+    setmgr_client_checkpoint(mgr);
+    fail_unless(setmgr_create_set(mgr, "slots1", NULL) == 0);
+    fail_unless(setmgr_drop_set(mgr, "slots1") == 0);
+    fail_unless(create_after_drop(mgr, "slots1", 0) == 0);
+    fail_unless(setmgr_drop_set(mgr, "slots1") == 0);
+
+    setmgr_client_leave(mgr);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void set_stats_cb_sum(void *data, hlld_set_stats *stats) {
+    uint64_t *sums = data;
+    fail_unless(!strncmp(stats->set_name, "stats", 5));
+    sums[0]++;
+    sums[1] += stats->resident;
+    sums[2] += stats->counters.sets;
+    if (stats->resident) fail_unless(stats->resident_bytes > 0);
+}
+
+START_TEST(test_mgr_set_stats)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // No snapshot is taken until asked
+    uint64_t sums[3] = {0, 0, 0};
+    fail_unless(setmgr_iter_set_stats(mgr, set_stats_cb_sum, sums) == 0);
+
+    // New sets are seen at once
+    fail_unless(setmgr_create_set(mgr, "stats1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "stats2", NULL) == 0);
+
+    char *keys[] = {"hey", "there", "person"};
+    fail_unless(setmgr_set_keys(mgr, "stats1", (char**)&keys, 3) == 0);
+    fail_unless(setmgr_set_keys(mgr, "stats2", (char**)&keys, 1) == 0);
+
+    // The snapshot holds until the next refresh
+    fail_unless(setmgr_refresh_set_stats(mgr) == 0);
+    fail_unless(setmgr_iter_set_stats(mgr, set_stats_cb_sum, sums) == 2);
+    fail_unless(sums[0] == 2);
+    fail_unless(sums[1] == 2);
+    fail_unless(sums[2] == 4);
+
+    // The dropped set is deleted once the vacuum reclaims it
+    fail_unless(setmgr_drop_set(mgr, "stats1") == 0);
+    fail_unless(setmgr_vacuum_lag(mgr) > 0);
+    fail_unless(setmgr_iter_set_stats(mgr, set_stats_cb_sum, sums) == 2);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_vacuum_lag(mgr) == 0);
+    fail_unless(setmgr_refresh_set_stats(mgr) == 0);
+    fail_unless(setmgr_iter_set_stats(mgr, set_stats_cb_sum, sums) == 1);
+
+    fail_unless(setmgr_drop_set(mgr, "stats2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_dump_restore)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_precision = 14;
+    custom->default_eps = 0.008125;
+    fail_unless(setmgr_create_set(mgr, "dump1", custom) == 0);
+    char *keys[] = {"hey", "there", "person"};
+    fail_unless(setmgr_set_keys(mgr, "dump1", (char**)&keys, 3) == 0);
+
+    unsigned char *dump;
+    uint64_t len;
+    fail_unless(setmgr_dump_set(mgr, "noop", &dump, &len) == -1);
+    fail_unless(setmgr_dump_set(mgr, "dump1", &dump, &len) == 0);
+
+    // Sets are restored with their config, but not over another
+    fail_unless(setmgr_restore_set(mgr, "dump1", dump, len) == -1);
+    fail_unless(setmgr_restore_set(mgr, "dump2", dump, len) == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "dump2", &size) == 0);
+    fail_unless(size == 3);
+    int precision = 0;
+    fail_unless(setmgr_set_cb(mgr, "dump2", precision_cb, &precision) == 0);
+    fail_unless(precision == 14);
+
+    // Corrupt dumps are refused
+    dump[len - 1] ^= 1;
+    fail_unless(setmgr_restore_set(mgr, "dump3", dump, len) == -4);
+    fail_unless(setmgr_restore_set(mgr, "dump3", dump, 10) == -4);
+    fail_unless(setmgr_dump_set(mgr, "dump3", &dump, &len) == -1);
+    free(dump);
+
+    fail_unless(setmgr_drop_set(mgr, "dump1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "dump2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void count_snapshot_cb(void *data) {
+    (*(int*)data)++;
+}
+
+START_TEST(test_mgr_snapshot)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "snap1", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "snap2", NULL) == 0);
+    char *keys[] = {"hey", "there", "person"};
+    fail_unless(setmgr_set_keys(mgr, "snap1", (char**)&keys, 3) == 0);
+    fail_unless(setmgr_set_keys(mgr, "snap2", (char**)&keys, 1) == 0);
+
+    // Requests are refused without a writer, and
+    // only one is in progress at a time
+    int requested = 0;
+    fail_unless(setmgr_request_snapshot(mgr) == -2);
+    setmgr_snapshot_cb(mgr, count_snapshot_cb, &requested);
+    fail_unless(setmgr_request_snapshot(mgr) == 0);
+    fail_unless(setmgr_request_snapshot(mgr) == -1);
+    fail_unless(requested == 1);
+
+    int num_sets;
+    fail_unless(setmgr_write_snapshot(mgr, &num_sets) == 0);
+    fail_unless(num_sets == 2);
+    fail_unless(setmgr_request_snapshot(mgr) == 0);
+    fail_unless(requested == 2);
+
+    // The snapshot is a stream of the dumps
+    FILE *f = fopen("/tmp/hlld/sets.snapshot", "r");
+    fail_unless(f != NULL);
+    uint64_t sizes[2];
+    for (int i=0; i < 2; i++) {
+        unsigned char header[DUMP_STREAM_HEADER_SIZE];
+        fail_unless(fread(header, sizeof(header), 1, f) == 1);
+        uint16_t name_len;
+        uint32_t dump_len;
+        dump_stream_decode(header, &name_len, &dump_len);
+        fail_unless(name_len == 5);
+        char name[6] = {0};
+        fail_unless(fread(name, name_len, 1, f) == 1);
+        fail_unless(strncmp(name, "snap", 4) == 0);
+
+        unsigned char *dump = malloc(dump_len);
+        fail_unless(fread(dump, dump_len, 1, f) == 1);
+        hlld_set_config set_config;
+        const unsigned char *regs;
+        uint64_t regs_len;
+        fail_unless(dump_decode(dump, dump_len, &set_config, &regs, &regs_len) == 0);
+        sizes[name[4] - '1'] = set_config.size;
+        free(dump);
+    }
+    fail_unless(fgetc(f) == EOF);
+    fclose(f);
+    fail_unless(sizes[0] == 3 && sizes[1] == 1);
+
+    unlink("/tmp/hlld/sets.snapshot");
+    fail_unless(setmgr_drop_set(mgr, "snap1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "snap2") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_bind_handles)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "bind_a", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "bind_b", NULL) == 0);
+
+    // A name keeps its handle, and only sets are bound
+    int id_a, id_b, id;
+    fail_unless(setmgr_bind_set(mgr, "bind_a", &id_a) == 0);
+    fail_unless(setmgr_bind_set(mgr, "bind_b", &id_b) == 0);
+    fail_unless(setmgr_bind_set(mgr, "bind_a", &id) == 0);
+    fail_unless(id == id_a && id_a != id_b);
+    fail_unless(setmgr_bind_set(mgr, "bind_none", &id) == -1);
+    fail_unless(setmgr_bind_set(mgr, "@0", &id) == -1);
+    fail_unless(setmgr_handle_id("@12", 3) == 12);
+    fail_unless(setmgr_handle_id("@1x", 3) == -1);
+    fail_unless(setmgr_handle_id("@", 1) == -1);
+    fail_unless(setmgr_handle_id("@65536", 6) == -1);
+    fail_unless(setmgr_create_set(mgr, "@5", NULL) == -1);
+
+    // Handles name their set in the calls
+    char handle_a[8], handle_b[8];
+    snprintf(handle_a, sizeof(handle_a), "@%d", id_a);
+    snprintf(handle_b, sizeof(handle_b), "@%d", id_b);
+    char *keys[] = {"hey","there","person"};
+    uint64_t size;
+    fail_unless(setmgr_set_keys(mgr, handle_a, (char**)&keys, 3) == 0);
+    fail_unless(setmgr_set_keys(mgr, handle_a, (char**)&keys, 3) == 0);
+    fail_unless(setmgr_set_size(mgr, "bind_a", &size) == 0);
+    fail_unless(size == 3);
+    fail_unless(setmgr_set_size(mgr, handle_b, &size) == 0);
+    fail_unless(size == 0);
+    fail_unless(setmgr_set_size(mgr, "@99", &size) == -1);
+
+    // A dropped set is gone from its handle, which finds
+    // the set created again with its name
+    fail_unless(setmgr_drop_set(mgr, handle_a) == 0);
+    fail_unless(setmgr_set_keys(mgr, handle_a, (char**)&keys, 1) == -1);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_set_keys(mgr, handle_a, (char**)&keys, 1) == -1);
+    fail_unless(setmgr_create_set(mgr, "bind_a", NULL) == 0);
+    fail_unless(setmgr_set_keys(mgr, handle_a, (char**)&keys, 1) == 0);
+    fail_unless(setmgr_set_size(mgr, "bind_a", &size) == 0);
+    fail_unless(size == 1);
+
+    fail_unless(setmgr_drop_set(mgr, handle_a) == 0);
+    fail_unless(setmgr_drop_set(mgr, handle_b) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_expire_sets)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Sets created with a ttl are dropped once it runs out
+    uint64_t now = time(NULL);
+    for (int i=0; i < 3; i++) {
+        hlld_config *custom = malloc(sizeof(hlld_config));
+        memcpy(custom, &config, sizeof(hlld_config));
+        custom->default_ttl = (i == 2) ? 10000 : 100;
+        char name[32];
+        snprintf(name, sizeof(name), "expire_%d", i);
+        fail_unless(setmgr_create_set(mgr, name, custom) == 0);
+    }
+    fail_unless(setmgr_create_set(mgr, "expire_never", NULL) == 0);
+    fail_unless(setmgr_expire_sets(mgr, now + 50) == 0);
+    fail_unless(setmgr_expire_sets(mgr, now + 200) == 2);
+
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "expire_0", &size) == -1);
+    fail_unless(setmgr_set_size(mgr, "expire_1", &size) == -1);
+    fail_unless(setmgr_set_size(mgr, "expire_2", &size) == 0);
+    fail_unless(setmgr_set_size(mgr, "expire_never", &size) == 0);
+
+    // A set created again with the name does not expire
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_create_set(mgr, "expire_0", NULL) == 0);
+
+    // Longer ttls go around the wheel
+    fail_unless(setmgr_expire_sets(mgr, now + 9000) == 0);
+    fail_unless(setmgr_expire_sets(mgr, now + 10001) == 1);
+    fail_unless(setmgr_set_size(mgr, "expire_2", &size) == -1);
+    fail_unless(setmgr_set_size(mgr, "expire_0", &size) == 0);
+
+    fail_unless(setmgr_drop_set(mgr, "expire_0") == 0);
+    fail_unless(setmgr_drop_set(mgr, "expire_never") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void durability_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    hlld_set_config *out = data;
+    *out = set->set_config;
+    out->size = set->wal != NULL;
+}
+
+START_TEST(test_mgr_durability)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.wal = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    const char *classes[] = {"volatile", "wal:30s"};
+    char *names[] = {"dur_volatile", "dur_wal", "dur_periodic"};
+    for (int i=0; i < 2; i++) {
+        hlld_config *custom = malloc(sizeof(hlld_config));
+        memcpy(custom, &config, sizeof(hlld_config));
+        fail_unless(durability_from_name(classes[i], &custom->default_durability,
+                    &custom->default_flush_period) == 0);
+        fail_unless(setmgr_create_set(mgr, names[i], custom) == 0);
+    }
+    fail_unless(setmgr_create_set(mgr, "dur_periodic", NULL) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // The classes are kept over a restart, and only volatile
+    // sets are left out of the write-ahead log
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    hlld_set_config sc;
+    fail_unless(setmgr_set_cb(mgr, "dur_volatile", durability_cb, &sc) == 0);
+    fail_unless(sc.durability == DURABILITY_VOLATILE && sc.flush_period == 0 && !sc.size);
+    fail_unless(setmgr_set_cb(mgr, "dur_wal", durability_cb, &sc) == 0);
+    fail_unless(sc.durability == DURABILITY_WAL && sc.flush_period == 30 && sc.size);
+    fail_unless(setmgr_set_cb(mgr, "dur_periodic", durability_cb, &sc) == 0);
+    fail_unless(sc.durability == DURABILITY_PERIODIC && sc.flush_period == 0 && sc.size);
+
+    // Writes to a set with the wal durability are synced as they return
+    char *keys[] = {"a", "b", "c"};
+    fail_unless(setmgr_set_keys(mgr, "dur_wal", keys, 3) == 0);
+    for (int i=0; i < 3; i++) fail_unless(setmgr_drop_set(mgr, names[i]) == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    DIR *dir = opendir(config.data_dir);
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "wal.", 4)) continue;
+        char *path = join_path(config.data_dir, ent->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(dir);
+}
+END_TEST
+
+static void* reader_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    uint64_t size;
+    for (int i=0; i < 20000; i++) {
+        setmgr_client_checkpoint(mgr);
+        fail_unless(setmgr_set_size(mgr, "tree_stay", &size) == 0);
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+START_TEST(test_mgr_single_tree)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Creates and drops are seen at once, without a vacuum
+    fail_unless(setmgr_create_set(mgr, "tree1", NULL) == 0);
+    hlld_set_list_head *head;
+    fail_unless(setmgr_list_sets(mgr, "tree", &head) == 0);
+    fail_unless(head->size == 1);
+    setmgr_cleanup_list(head);
+    fail_unless(setmgr_drop_set(mgr, "tree1") == 0);
+    fail_unless(setmgr_list_sets(mgr, "tree", &head) == 0);
+    fail_unless(head->size == 0);
+    setmgr_cleanup_list(head);
+
+    // The name is taken until the dropped set is deleted
+    fail_unless(setmgr_create_set(mgr, "tree1", NULL) == -3);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_create_set(mgr, "tree1", NULL) == 0);
+    fail_unless(setmgr_drop_set(mgr, "tree1") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Readers keep finding a set while others come and go
+    res = init_set_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_create_set(mgr, "tree_stay", NULL) == 0);
+    pthread_t thread;
+    fail_unless(pthread_create(&thread, NULL, reader_thread_main, mgr) == 0);
+    char name[32];
+    for (int i=0; i < 200; i++) {
+        snprintf(name, sizeof(name), "tree_churn%d", i);
+        fail_unless(setmgr_create_set(mgr, name, NULL) == 0);
+        fail_unless(setmgr_drop_set(mgr, name) == 0);
+    }
+    pthread_join(thread, NULL);
+    fail_unless(setmgr_drop_set(mgr, "tree_stay") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_parallel_close)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.flush_threads = 4;
+
+    // Enough sets to be flushed and closed on many threads
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    char name[32];
+    char *keys[] = {"a", "b", "c"};
+    for (int i=0; i < 300; i++) {
+        snprintf(name, sizeof(name), "close%d", i);
+        fail_unless(setmgr_create_set(mgr, name, NULL) == 0);
+        if (i % 2) fail_unless(setmgr_set_keys(mgr, name, keys, 3) == 0);
+    }
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Every dirty set was flushed before it was closed
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    uint64_t size;
+    for (int i=0; i < 300; i++) {
+        snprintf(name, sizeof(name), "close%d", i);
+        fail_unless(setmgr_set_size(mgr, name, &size) == 0);
+        fail_unless(size == ((i % 2) ? 3 : 0));
+        fail_unless(setmgr_drop_set(mgr, name) == 0);
+    }
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void create_done(void *data, int res) {
+    *(volatile int*)data = (res) ? -1 : 1;
+}
+
+START_TEST(test_mgr_create_async)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // The set is added at once, and its folder made in the background
+    volatile int done = 0;
+    res = setmgr_create_set_async(mgr, "async1", NULL, create_done, (void*)&done);
+    fail_unless(res == 1);
+    fail_unless(setmgr_create_set_async(mgr, "async1", NULL, NULL, NULL) == -1);
+    fail_unless(setmgr_create_set(mgr, "async1", NULL) == -1);
+    for (int i=0; i < 1000 && !done; i++) usleep(1000);
+    fail_unless(done == 1);
+
+    struct stat buf;
+    fail_unless(stat("/tmp/hlld/hlld.async1/config.ini", &buf) == 0);
+
+    // Writes before the folder is made page the set in behind it
+    fail_unless(setmgr_create_set_async(mgr, "async2", NULL, NULL, NULL) == 1);
+    char *keys[] = {"hey","there","person"};
+    fail_unless(setmgr_set_keys(mgr, "async2", (char**)&keys, 3) == 0);
+    uint64_t size;
+    fail_unless(setmgr_set_size(mgr, "async2", &size) == 0);
+    fail_unless(size == 3);
+
+    // Once paging in is stopped, the folder is made by the caller
+    setmgr_stop_page_in(mgr);
+    done = 0;
+    fail_unless(setmgr_create_set_async(mgr, "async3", NULL, create_done, (void*)&done) == 1);
+    fail_unless(done == 1);
+    fail_unless(stat("/tmp/hlld/hlld.async3/config.ini", &buf) == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // The sets are durable
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(setmgr_set_size(mgr, "async2", &size) == 0);
+    fail_unless(size == 3);
+    fail_unless(setmgr_drop_set(mgr, "async1") == 0);
+    fail_unless(setmgr_drop_set(mgr, "async2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "async3") == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,147 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "bitmap.h"
+#include "slab.h"
+
+#define SLAB_TEST_DIR "/tmp/hlld_slab"
+
+static hlld_slab* open_slab_with(int preallocate) {
+    mkdir(SLAB_TEST_DIR, 0755);
+    hlld_slab *slab;
+    fail_unless(init_slab(SLAB_TEST_DIR, preallocate, &slab) == 0);
+    return slab;
+}
+
+static hlld_slab* open_test_slab() {
+    hlld_slab *slab = open_slab_with(0);
+    return slab;
+}
+
+static void remove_test_slab(hlld_slab *slab) {
+    destroy_slab(slab);
+    char path[128];
+    for (int i=0; i < 4; i++) {
+        snprintf(path, sizeof(path), SLAB_TEST_DIR "/slab.%d.data", i);
+        unlink(path);
+    }
+    rmdir(SLAB_TEST_DIR);
+}
+
+START_TEST(test_slab_alloc_find)
+{
+    hlld_slab *slab = open_test_slab();
+    int fd;
+    uint64_t a_offset, b_offset, offset;
+    fail_unless(slab_find(slab, "a", 3072, &fd, &offset) == -ENOENT);
+    fail_unless(access(SLAB_TEST_DIR "/slab.0.data", F_OK) != 0);
+
+    fail_unless(slab_alloc(slab, "a", 3072, &fd, &a_offset) == 0);
+    fail_unless(slab_alloc(slab, "b", 20000, &fd, &b_offset) == 0);
+    fail_unless(a_offset % BITMAP_PAGE_SIZE == 0);
+    fail_unless(b_offset == a_offset + BITMAP_PAGE_SIZE);
+    fail_unless(slab_slots(slab) == 2);
+    destroy_slab(slab);
+
+    // The slots are found again from the table
+    slab = open_test_slab();
+    fail_unless(slab_slots(slab) == 2);
+    fail_unless(slab_find(slab, "a", 3072, &fd, &offset) == 0);
+    fail_unless(offset == a_offset);
+    fail_unless(slab_find(slab, "b", 20000, &fd, &offset) == 0);
+    fail_unless(offset == b_offset);
+
+    // A slot of another length is freed
+    fail_unless(slab_find(slab, "b", 3072, &fd, &offset) == -ENOENT);
+    fail_unless(slab_slots(slab) == 1);
+    fail_unless(slab_free(slab, "a") == 0);
+    fail_unless(slab_free(slab, "a") == -ENOENT);
+    fail_unless(slab_slots(slab) == 0);
+    remove_test_slab(slab);
+}
+END_TEST
+
+START_TEST(test_slab_reuse_space)
+{
+    hlld_slab *slab = open_test_slab();
+    int fd;
+    uint64_t a_offset, b_offset, c_offset;
+    fail_unless(slab_alloc(slab, "a", 3 * BITMAP_PAGE_SIZE, &fd, &a_offset) == 0);
+    fail_unless(slab_alloc(slab, "b", BITMAP_PAGE_SIZE, &fd, &b_offset) == 0);
+
+    // Freed pages are reused first fit, if the slot fits
+    fail_unless(slab_free(slab, "a") == 0);
+    fail_unless(slab_alloc(slab, "c", 4 * BITMAP_PAGE_SIZE, &fd, &c_offset) == 0);
+    fail_unless(c_offset == b_offset + BITMAP_PAGE_SIZE);
+    fail_unless(slab_alloc(slab, "d", 2 * BITMAP_PAGE_SIZE, &fd, &c_offset) == 0);
+    fail_unless(c_offset == a_offset);
+
+    // Long names and huge registers get files of their own
+    char name[SLAB_MAX_NAME + 2];
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    fail_unless(slab_alloc(slab, name, 3072, &fd, &c_offset) == -ENAMETOOLONG);
+    fail_unless(slab_alloc(slab, "e", SLAB_SEGMENT_SIZE, &fd, &c_offset) == -EFBIG);
+    remove_test_slab(slab);
+}
+END_TEST
+
+START_TEST(test_slab_bitmap)
+{
+    hlld_slab *slab = open_test_slab();
+    int fd;
+    uint64_t offset;
+    fail_unless(slab_alloc(slab, "a", 3072, &fd, &offset) == 0);
+
+    hlld_bitmap map;
+    fail_unless(bitmap_from_slot(fd, offset, 3072, SHARED, &map) == -EINVAL);
+    fail_unless(bitmap_from_slot(fd, offset + 1, 3072, PERSISTENT, &map) == -EINVAL);
+    fail_unless(bitmap_from_slot(fd, offset, 3072, PERSISTENT | NEW_BITMAP, &map) == 0);
+    for (int i=0; i < 3072 * 8; i += 3) bitmap_setbit(&map, i);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(slab_sync(slab) == 0);
+    destroy_slab(slab);
+
+    // The flushed registers are read back from the slot
+    slab = open_test_slab();
+    fail_unless(slab_find(slab, "a", 3072, &fd, &offset) == 0);
+    fail_unless(bitmap_from_slot(fd, offset, 3072, PERSISTENT, &map) == 0);
+    for (int i=0; i < 3072 * 8; i++) fail_unless(bitmap_getbit(&map, i) == !(i % 3));
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Allocating the slot again clears it
+    fail_unless(slab_alloc(slab, "a", 3072, &fd, &offset) == 0);
+    fail_unless(bitmap_from_slot(fd, offset, 3072, PERSISTENT, &map) == 0);
+    for (int i=0; i < 3072 * 8; i++) fail_unless(bitmap_getbit(&map, i) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    remove_test_slab(slab);
+}
+END_TEST
+
+START_TEST(test_slab_preallocate)
+{
+    hlld_slab *slab = open_test_slab();
+    int fd;
+    uint64_t offset;
+    struct stat buf;
+
+    // Segments are sparse by default
+    fail_unless(slab_alloc(slab, "a", 3072, &fd, &offset) == 0);
+    fail_unless(stat(SLAB_TEST_DIR "/slab.0.data", &buf) == 0);
+    fail_unless(buf.st_size == SLAB_SEGMENT_SIZE);
+    fail_unless(buf.st_blocks * 512 < SLAB_SEGMENT_SIZE);
+    remove_test_slab(slab);
+
+    // Or have all their blocks allocated up front
+    slab = open_slab_with(1);
+    fail_unless(slab_alloc(slab, "a", 3072, &fd, &offset) == 0);
+    fail_unless(stat(SLAB_TEST_DIR "/slab.0.data", &buf) == 0);
+    fail_unless(buf.st_size == SLAB_SEGMENT_SIZE);
+    fail_unless(buf.st_blocks * 512 >= SLAB_SEGMENT_SIZE);
+    remove_test_slab(slab);
+}
+END_TEST
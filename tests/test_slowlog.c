@@ -0,0 +1,96 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slowlog.h"
+
+START_TEST(test_slowlog_init_destroy)
+{
+    hlld_slowlog *l;
+    fail_unless(init_slowlog(1000, 4, &l) == 0);
+    fail_unless(slowlog_threshold(l) == 1000);
+
+    slowlog_entry *e;
+    fail_unless(slowlog_entries(l, &e) == 0);
+    free(e);
+    fail_unless(destroy_slowlog(l) == 0);
+}
+END_TEST
+
+START_TEST(test_slowlog_parse_args)
+{
+    hlld_slowlog *l;
+    fail_unless(init_slowlog(1000, 4, &l) == 0);
+
+    char text[] = "foobar k1 k2 k3\n";
+    slowlog_add(l, 3, text, strlen(text), 5000);
+    char split[] = "baz\0k1\0k2";
+    slowlog_add(l, 4, split, sizeof(split) - 1, 6000);
+    slowlog_add(l, 5, NULL, 0, 7000);
+
+    slowlog_entry *e;
+    fail_unless(slowlog_entries(l, &e) == 3);
+    fail_unless(e[0].cmd == 5);
+    fail_unless(e[0].set_name[0] == '\0');
+    fail_unless(e[0].keys == 0);
+    fail_unless(strcmp(e[1].set_name, "baz") == 0);
+    fail_unless(e[1].keys == 2);
+    fail_unless(strcmp(e[2].set_name, "foobar") == 0);
+    fail_unless(e[2].keys == 3);
+    fail_unless(e[2].nanos == 5000);
+    free(e);
+    fail_unless(destroy_slowlog(l) == 0);
+}
+END_TEST
+
+START_TEST(test_slowlog_overflow_reset)
+{
+    hlld_slowlog *l;
+    fail_unless(init_slowlog(1000, 4, &l) == 0);
+
+    // Only the newest entries are kept, newest first
+    for (int i=0; i < 10; i++)
+        slowlog_add_entry(l, 1, "set", 3, i, 1000 + i);
+
+    slowlog_entry *e;
+    fail_unless(slowlog_entries(l, &e) == 4);
+    for (int i=0; i < 4; i++) {
+        fail_unless(e[i].id == (uint64_t)(9 - i));
+        fail_unless(e[i].keys == 9 - i);
+    }
+    free(e);
+
+    // Ids keep increasing after a reset
+    slowlog_reset(l);
+    fail_unless(slowlog_entries(l, &e) == 0);
+    free(e);
+    slowlog_add_entry(l, 1, "set", 3, 1, 1000);
+    fail_unless(slowlog_entries(l, &e) == 1);
+    fail_unless(e[0].id == 10);
+    free(e);
+    fail_unless(destroy_slowlog(l) == 0);
+}
+END_TEST
+
+START_TEST(test_slowlog_phases)
+{
+    hlld_slowlog *l;
+    fail_unless(init_slowlog(1000, 4, &l) == 0);
+
+    slowlog_phases_reset();
+    uint64_t start = slowlog_phase_start();
+    fail_unless(start != 0);
+    usleep(1000);
+    slowlog_phase_end(PHASE_FAULT, start);
+    slowlog_add_entry(l, 1, "set", 3, 1, 2000000);
+
+    slowlog_entry *e;
+    fail_unless(slowlog_entries(l, &e) == 1);
+    fail_unless(e[0].phases[PHASE_FAULT] >= 1000000);
+    fail_unless(e[0].phases[PHASE_LOOKUP] == 0);
+    fail_unless(e[0].phases[PHASE_LOCK] == 0);
+    free(e);
+    fail_unless(destroy_slowlog(l) == 0);
+}
+END_TEST
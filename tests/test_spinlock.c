@@ -0,0 +1,82 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "spinlock.h"
+
+/*
+ * Shared by threads checking that holders
+ * of the lock exclude each other
+ */
+typedef struct {
+    hlld_spinlock lock;
+    volatile int a;
+    volatile int b;
+    volatile int torn;
+    int iters;
+} spinlock_state;
+
+static void* spinlock_thread_main(void *in) {
+    spinlock_state *s = in;
+    for (int i=0; i < s->iters; i++) {
+        LOCK_HLLD_SPIN(&s->lock);
+        if (s->a != s->b) s->torn = 1;
+        s->a++;
+        // Now and then hold the lock long enough for waiters to park
+        if (!(i % 1000)) usleep(100);
+        s->b++;
+        UNLOCK_HLLD_SPIN(&s->lock);
+    }
+    return NULL;
+}
+
+START_TEST(test_spinlock_exclusion)
+{
+    spinlock_state s;
+    INIT_HLLD_SPIN(&s.lock);
+    s.a = s.b = s.torn = 0;
+    s.iters = 20000;
+
+    pthread_t threads[8];
+    for (int i=0; i < 8; i++)
+        fail_unless(pthread_create(&threads[i], NULL, spinlock_thread_main, &s) == 0);
+    for (int i=0; i < 8; i++) pthread_join(threads[i], NULL);
+    fail_unless(!s.torn);
+    fail_unless(s.a == 8 * 20000 && s.b == 8 * 20000);
+}
+END_TEST
+
+static void* spinlock_waiter_main(void *in) {
+    spinlock_state *s = in;
+    LOCK_HLLD_SPIN(&s->lock);
+    s->a++;
+    UNLOCK_HLLD_SPIN(&s->lock);
+    return NULL;
+}
+
+START_TEST(test_spinlock_counters)
+{
+    spinlock_state s;
+    INIT_HLLD_SPIN(&s.lock);
+    s.a = 0;
+    spinlock_counters before, after;
+    spinlock_stats(&before);
+
+    // A waiter on a lock held for long is counted, and parks
+    LOCK_HLLD_SPIN(&s.lock);
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, spinlock_waiter_main, &s) == 0);
+    usleep(50000);
+    fail_unless(s.a == 0);
+    UNLOCK_HLLD_SPIN(&s.lock);
+    pthread_join(t, NULL);
+    fail_unless(s.a == 1);
+
+    spinlock_stats(&after);
+#ifdef __linux__
+    fail_unless(after.contended > before.contended);
+    fail_unless(after.yields > before.yields);
+    fail_unless(after.parks > before.parks);
+#endif
+}
+END_TEST
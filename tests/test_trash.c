@@ -0,0 +1,59 @@
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "config.h"
+#include "set.h"
+#include "trash.h"
+
+START_TEST(test_trash_move_empty)
+{
+    // Other tests leave their dropped sets in the trash
+    mkdir("/tmp/hlld", 0755);
+    while (trash_empty("/tmp/hlld", 1000));
+
+    // A folder of three files
+    mkdir("/tmp/hlld/trash_src", 0755);
+    char path[64];
+    for (int i=0; i < 3; i++) {
+        snprintf(path, sizeof(path), "/tmp/hlld/trash_src/file%d", i);
+        int fd = open(path, O_CREAT|O_RDWR, 0644);
+        fail_unless(fd >= 0);
+        close(fd);
+    }
+
+    struct stat st;
+    fail_unless(trash_move("/tmp/hlld", "/tmp/hlld/trash_src") == 0);
+    fail_unless(stat("/tmp/hlld/trash_src", &st) == -1 && errno == ENOENT);
+    fail_unless(trash_move("/tmp/hlld", "/tmp/hlld/trash_src") == -ENOENT);
+
+    // The files are removed within the budget, then the folder
+    fail_unless(trash_empty("/tmp/hlld", 2) == 2);
+    fail_unless(trash_empty("/tmp/hlld", 100) == 2);
+    fail_unless(trash_empty("/tmp/hlld", 100) == 0);
+    fail_unless(rmdir("/tmp/hlld/" TRASH_FOLDER) == 0);
+    fail_unless(trash_empty("/tmp/hlld", 100) == 0);
+}
+END_TEST
+
+START_TEST(test_trash_set_delete)
+{
+    hlld_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    while (trash_empty("/tmp/hlld", 1000));
+    hlld_set *set;
+    fail_unless(init_set(&config, "test_trash_set", 0, &set) == 0);
+    fail_unless(hset_flush(set) == 0);
+
+    // The folder of a deleted set waits in the trash
+    struct stat st;
+    fail_unless(stat("/tmp/hlld/hlld.test_trash_set", &st) == 0);
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_trash_set", &st) == -1 && errno == ENOENT);
+    fail_unless(trash_empty("/tmp/hlld", 1000) > 0);
+    fail_unless(trash_empty("/tmp/hlld", 1000) == 0);
+}
+END_TEST
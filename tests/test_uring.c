@@ -0,0 +1,109 @@
+#include <check.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+START_TEST(test_uring_recv_send)
+{
+#ifdef HLLD_URING
+    hlld_uring r;
+    // Kernels without io_uring, or buffer rings, are skipped
+    if (uring_setup(&r, 8, 0)) return;
+    if (uring_provide_buffers(&r, 4, 64)) {
+        uring_free(&r);
+        return;
+    }
+    fail_unless(uring_provide_buffers(&r, 3, 64) == -EINVAL);
+
+    int fds[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    // A multishot recv into the provided buffers
+    struct io_uring_sqe *sqe = uring_get_sqe(&r);
+    fail_unless(sqe != NULL);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->user_data = 1;
+
+    // A send, queued in the same submission
+    struct iovec iov = {"hello", 5};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    sqe = uring_get_sqe(&r);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fds[1];
+    sqe->addr = (uintptr_t)&msg;
+    sqe->len = 1;
+    sqe->user_data = 2;
+    fail_unless(uring_queued(&r) == 2);
+    fail_unless(uring_enter(&r, 2) == 2);
+    fail_unless(uring_queued(&r) == 0);
+
+    int sent = 0, received = 0;
+    struct io_uring_cqe cqe;
+    while (sent + received < 2) {
+        if (!uring_next_cqe(&r, &cqe)) {
+            fail_unless(uring_enter(&r, 1) >= 0);
+            continue;
+        }
+        if (cqe.user_data == 2) {
+            fail_unless(cqe.res == 5);
+            sent = 1;
+        } else {
+            fail_unless(cqe.user_data == 1);
+            fail_unless(cqe.res == 5);
+            fail_unless(cqe.flags & IORING_CQE_F_BUFFER);
+            fail_unless(cqe.flags & IORING_CQE_F_MORE);
+            unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            fail_unless(memcmp(uring_buffer(&r, bid), "hello", 5) == 0);
+            uring_recycle_buffer(&r, bid);
+            received = 1;
+        }
+    }
+
+    // Closing the peer ends the recv
+    close(fds[1]);
+    fail_unless(uring_enter(&r, 1) >= 0);
+    fail_unless(uring_next_cqe(&r, &cqe) == 1);
+    fail_unless(cqe.user_data == 1 && cqe.res == 0);
+    fail_unless(!(cqe.flags & IORING_CQE_F_MORE));
+    fail_unless(uring_next_cqe(&r, &cqe) == 0);
+
+    close(fds[0]);
+    uring_free(&r);
+#endif
+}
+END_TEST
+
+START_TEST(test_uring_full_queue)
+{
+#ifdef HLLD_URING
+    hlld_uring r;
+    if (uring_setup(&r, 4, 0)) return;
+    for (unsigned i=0; i < r.entries; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&r);
+        fail_unless(sqe != NULL);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = i;
+    }
+    fail_unless(uring_get_sqe(&r) == NULL);
+    fail_unless(uring_enter(&r, r.entries) == (int)r.entries);
+
+    // The completions are taken in order
+    struct io_uring_cqe cqe;
+    for (unsigned i=0; i < r.entries; i++) {
+        fail_unless(uring_next_cqe(&r, &cqe) == 1);
+        fail_unless(cqe.user_data == i);
+    }
+    fail_unless(uring_get_sqe(&r) != NULL);
+    uring_free(&r);
+#endif
+}
+END_TEST
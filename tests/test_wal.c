@@ -0,0 +1,183 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "hll.h"
+#include "wal.h"
+#include "clock.h"
+
+#define WAL_TEST_DIR "/tmp/hlld_wal"
+
+/*
+ * Replayed records, by set
+ */
+typedef struct {
+    int records;
+    int a_entries;
+    int b_entries;
+    uint32_t last_a;
+} replay_counts;
+
+static void count_replay_cb(void *data, repl_frame *frame) {
+    replay_counts *counts = data;
+    counts->records++;
+    if (!strcmp(frame->set_name, "a")) {
+        counts->a_entries += frame->num;
+        counts->last_a = frame->entries[0];
+    } else if (!strcmp(frame->set_name, "b")) {
+        counts->b_entries += frame->num;
+    }
+}
+
+static void wal_test_config(hlld_config *config) {
+    fail_unless(config_from_filename(NULL, config) == 0);
+    config->data_dir = WAL_TEST_DIR;
+    config->wal = 1;
+    config->wal_sync_msec = 5;
+    mkdir(WAL_TEST_DIR, 0755);
+}
+
+static int segment_exists(uint64_t seq) {
+    char path[128];
+    snprintf(path, sizeof(path), WAL_TEST_DIR "/wal.%llu.log", (unsigned long long)seq);
+    return !access(path, F_OK);
+}
+
+static void remove_segments(hlld_wal *wal) {
+    wal_trim(wal, wal->seq);
+    destroy_wal(wal);
+    char path[128];
+    for (int i=1; i < 16; i++) {
+        snprintf(path, sizeof(path), WAL_TEST_DIR "/wal.%d.log", i);
+        unlink(path);
+    }
+    rmdir(WAL_TEST_DIR);
+}
+
+START_TEST(test_wal_append_replay)
+{
+    hlld_config config;
+    wal_test_config(&config);
+    hlld_set_config set_config = {0.01625, 12, 0, HLL_PACKED, 0,
+        HLL_ESTIMATOR_BIAS, HLL_HASH_MURMUR, 0, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+
+    hlld_wal *wal;
+    fail_unless(init_wal(&config, &wal) == 0);
+    fail_unless(wal->seq == 1);
+
+    // The seq of a set is only set by its first append
+    volatile uint64_t a_seq = 0, b_seq = 0;
+    uint32_t entries[] = {HLL_ENTRY(7, 3), HLL_ENTRY(1, 2), HLL_ENTRY(7, 5)};
+    fail_unless(wal_append(wal, &a_seq, "a", &set_config, entries, 3) == 0);
+    fail_unless(wal_append(wal, &b_seq, "b", &set_config, entries, 3) == 0);
+    fail_unless(a_seq == 1 && b_seq == 1);
+    fail_unless(wal_rotate(wal) == 2);
+    fail_unless(wal_append(wal, &b_seq, "b", &set_config, entries, 1) == 0);
+    fail_unless(b_seq == 1);
+
+    // A drop hides the earlier raises of a set
+    fail_unless(wal_drop(wal, "a") == 0);
+    uint32_t after[] = {HLL_ENTRY(9, 4)};
+    fail_unless(wal_append(wal, &a_seq, "a", &set_config, after, 1) == 0);
+    destroy_wal(wal);
+
+    fail_unless(init_wal(&config, &wal) == 0);
+    fail_unless(wal->seq == 3);
+    fail_unless(wal->oldest == 1);
+    replay_counts counts = {0, 0, 0, 0};
+    fail_unless(wal_replay(wal, count_replay_cb, &counts) == 3);
+    fail_unless(counts.records == 3);
+    fail_unless(counts.a_entries == 1);
+    fail_unless(counts.last_a == HLL_ENTRY(9, 4));
+    fail_unless(counts.b_entries == 3);
+    remove_segments(wal);
+}
+END_TEST
+
+START_TEST(test_wal_torn_record)
+{
+    hlld_config config;
+    wal_test_config(&config);
+    hlld_set_config set_config = {0.01625, 12, 0, HLL_PACKED, 0,
+        HLL_ESTIMATOR_BIAS, HLL_HASH_MURMUR, 0, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+
+    hlld_wal *wal;
+    fail_unless(init_wal(&config, &wal) == 0);
+    uint32_t entries[] = {HLL_ENTRY(1, 1)};
+    for (int i=0; i < 4; i++) {
+        fail_unless(wal_append(wal, NULL, "a", &set_config, entries, 1) == 0);
+    }
+    destroy_wal(wal);
+
+    // A crash mid append leaves a partial last record
+    struct stat st;
+    fail_unless(stat(WAL_TEST_DIR "/wal.1.log", &st) == 0);
+    fail_unless(truncate(WAL_TEST_DIR "/wal.1.log", st.st_size - 3) == 0);
+
+    fail_unless(init_wal(&config, &wal) == 0);
+    replay_counts counts = {0, 0, 0, 0};
+    fail_unless(wal_replay(wal, count_replay_cb, &counts) == 3);
+    remove_segments(wal);
+}
+END_TEST
+
+START_TEST(test_wal_rotate_trim)
+{
+    hlld_config config;
+    wal_test_config(&config);
+
+    hlld_wal *wal;
+    fail_unless(init_wal(&config, &wal) == 0);
+    fail_unless(segment_exists(1));
+    fail_unless(wal_rotate(wal) == 2);
+    fail_unless(wal_rotate(wal) == 3);
+    fail_unless(segment_exists(1) && segment_exists(2) && segment_exists(3));
+
+    // Only the segments before the bound are removed
+    wal_trim(wal, 2);
+    fail_unless(!segment_exists(1) && segment_exists(2));
+    fail_unless(wal->oldest == 2);
+
+    // The current segment is always kept
+    wal_trim(wal, 10);
+    fail_unless(!segment_exists(2) && segment_exists(3));
+    fail_unless(wal->oldest == 3);
+    remove_segments(wal);
+}
+END_TEST
+
+START_TEST(test_wal_durability_sync)
+{
+    hlld_config config;
+    wal_test_config(&config);
+    config.wal_sync_msec = 10000;
+    hlld_set_config set_config = {0.01625, 12, 0, HLL_PACKED, 0,
+        HLL_ESTIMATOR_BIAS, HLL_HASH_MURMUR, 0, 0, 0, 0, 0, 0, DURABILITY_PERIODIC, 0};
+
+    hlld_wal *wal;
+    fail_unless(init_wal(&config, &wal) == 0);
+    volatile uint64_t seq = 0;
+    uint32_t entries[] = {HLL_ENTRY(7, 3)};
+
+    // Periodic sets share the sync of a later batch
+    fail_unless(wal_append(wal, &seq, "a", &set_config, entries, 1) == 0);
+    fail_unless(wal->synced < wal->appended);
+
+    // A set with the wal durability waits for its batch, without
+    // the wait for more appends
+    set_config.durability = DURABILITY_WAL;
+    uint64_t start = hclock_nsec();
+    fail_unless(wal_append(wal, &seq, "b", &set_config, entries, 1) == 0);
+    fail_unless(wal->synced == wal->appended);
+    fail_unless(hclock_nsec() - start < 5000000000ULL);
+    destroy_wal(wal);
+
+    fail_unless(init_wal(&config, &wal) == 0);
+    replay_counts counts = {0, 0, 0, 0};
+    fail_unless(wal_replay(wal, count_replay_cb, &counts) == 2);
+    remove_segments(wal);
+}
+END_TEST
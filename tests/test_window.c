@@ -0,0 +1,151 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hll.h"
+#include "hll_hash.h"
+#include "window.h"
+
+/*
+ * Adds keys prefix0 .. prefixN to the window at a given time
+ */
+static void add_window_keys(hll_window *w, uint64_t now, const char *prefix, int num) {
+    char buf[64];
+    for (int i=0; i < num; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        uint64_t hash = hll_hash_key(HLL_HASH_MURMUR, buf, strlen(buf));
+        window_add_hashes(w, now, &hash, 1);
+    }
+}
+
+static uint64_t window_estimate(hll_window *w, uint64_t now, uint64_t span) {
+    hll_t h;
+    fail_unless(hll_init(12, HLL_BYTE, &h) == 0);
+    fail_unless(window_merge_into(w, now, span, &h) == 0);
+    uint64_t est = hll_estimate(&h, HLL_ESTIMATOR_BIAS) + 0.5;
+    hll_destroy(&h);
+    return est;
+}
+
+START_TEST(test_window_init_destroy)
+{
+    hll_window w;
+    fail_unless(window_init(12, HLL_PACKED, 0, 24, &w) == -1);
+    fail_unless(window_init(12, HLL_PACKED, 3600, 0, &w) == -1);
+    fail_unless(window_init(12, HLL_PACKED, 3600, WINDOW_MAX_BUCKETS + 1, &w) == -1);
+    fail_unless(window_init(12, HLL_PACKED, 3600, 24, &w) == 0);
+    fail_unless(window_bytes(&w) == 24 * hll_bytes_for_precision(12, HLL_PACKED));
+    fail_unless(w.dirty == 0);
+    fail_unless(window_estimate(&w, 100000, 86400) == 0);
+    window_destroy(&w);
+}
+END_TEST
+
+START_TEST(test_window_rotate)
+{
+    hll_window w;
+    uint64_t start = 1000 * 60;
+    fail_unless(window_init(12, HLL_PACKED, 60, 4, &w) == 0);
+
+    // A distinct thousand keys in each of three intervals
+    add_window_keys(&w, start, "a", 1000);
+    add_window_keys(&w, start + 60, "b", 1000);
+    add_window_keys(&w, start + 125, "c", 1000);
+    fail_unless(w.dirty == 1);
+
+    // The current interval is always covered
+    uint64_t now = start + 130;
+    uint64_t est = window_estimate(&w, now, 0);
+    fail_unless(est > 950 && est < 1050);
+    est = window_estimate(&w, now, 60);
+    fail_unless(est > 950 && est < 1050);
+    est = window_estimate(&w, now, 61);
+    fail_unless(est > 1900 && est < 2100);
+    est = window_estimate(&w, now, 3600);
+    fail_unless(est > 2850 && est < 3150);
+
+    // Intervals in the future of a merge are skipped
+    est = window_estimate(&w, start + 60, 3600);
+    fail_unless(est > 1900 && est < 2100);
+
+    // Wrapping around recycles the bucket of the first interval
+    hll_t *first = w.buckets + (start / 60) % 4;
+    add_window_keys(&w, start + 4 * 60, "d", 1000);
+    fail_unless(w.epochs[(start / 60) % 4] == start / 60 + 4);
+    fail_unless(first == w.buckets + (start / 60 + 4) % 4);
+    est = window_estimate(&w, start + 4 * 60, 4 * 60);
+    fail_unless(est > 2850 && est < 3150);
+
+    // An idle interval leaves its stale bucket out of merges
+    est = window_estimate(&w, start + 6 * 60, 3 * 60);
+    fail_unless(est > 950 && est < 1050);
+
+    // Adds from the past of a recycled bucket are dropped
+    fail_unless(window_add_hashes(&w, start, (uint64_t[]){1}, 1) == 0);
+    window_destroy(&w);
+}
+END_TEST
+
+START_TEST(test_window_union)
+{
+    hll_window w;
+    hll_t src, other;
+    fail_unless(window_init(12, HLL_BYTE, 3600, 24, &w) == 0);
+    fail_unless(hll_init(12, HLL_PACKED, &src) == 0);
+    fail_unless(hll_init(13, HLL_PACKED, &other) == 0);
+    char buf[64];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        hll_add(&src, buf);
+    }
+
+    fail_unless(window_union(&w, 7200, &src) == 0);
+    fail_unless(window_union(&w, 7200, &other) == 0);
+    uint64_t est = window_estimate(&w, 7200, 3600);
+    fail_unless(est > 950 && est < 1050);
+
+    hll_t h;
+    fail_unless(hll_init(13, HLL_BYTE, &h) == 0);
+    fail_unless(window_merge_into(&w, 7200, 3600, &h) == -1);
+    hll_destroy(&h);
+    hll_destroy(&src);
+    hll_destroy(&other);
+    window_destroy(&w);
+}
+END_TEST
+
+START_TEST(test_window_encode_decode)
+{
+    hll_window w, copy, other;
+    fail_unless(window_init(12, HLL_PACKED, 60, 8, &w) == 0);
+    add_window_keys(&w, 6000, "a", 1000);
+    add_window_keys(&w, 6060, "b", 1000);
+
+    unsigned char *buf;
+    uint64_t len;
+    fail_unless(window_encode(&w, &buf, &len) == 0);
+    fail_unless(w.dirty == 0);
+
+    fail_unless(window_init(12, HLL_PACKED, 60, 8, &copy) == 0);
+    fail_unless(window_decode(&copy, buf, len) == 0);
+    for (int i=0; i < 8; i++) {
+        fail_unless(copy.epochs[i] == w.epochs[i]);
+    }
+    uint64_t est = window_estimate(&copy, 6060, 120);
+    fail_unless(est > 1900 && est < 2100);
+    est = window_estimate(&copy, 6060, 60);
+    fail_unless(est > 950 && est < 1050);
+
+    // The layout must match
+    fail_unless(window_decode(&copy, buf, len - 1) == -1);
+    fail_unless(window_init(12, HLL_PACKED, 120, 8, &other) == 0);
+    fail_unless(window_decode(&other, buf, len) == -1);
+    window_destroy(&other);
+    buf[0] ^= 0xff;
+    fail_unless(window_decode(&copy, buf, len) == -1);
+
+    free(buf);
+    window_destroy(&copy);
+    window_destroy(&w);
+}
+END_TEST